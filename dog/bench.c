@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator of a live cluster
+ *
+ * 'dog bench run' drives a workload against the vdis through libsheepdog, see
+ * bench_io.c, and reports the IOPS, the bandwidth and the latency percentiles
+ * of the reads and the writes, in total and for each node.  The node of an
+ * I/O is the one of the first copy of its object.  The latencies are kept in
+ * histograms of 8 buckets for each power of two, which is within 1/8 of the
+ * latency and merged by a sum.
+ *
+ * To load the cluster from many clients, run them with the same -S, each on
+ * its own vdis as a vdi is locked by its client, and -o to save the results,
+ * then 'dog bench merge' adds up the saved results.
+ */
+
+#include <time.h>
+
+#include "dog.h"
+#include "bench.h"
+
+#define BENCH_FILE_MAGIC "sheepdog-bench"
+#define BENCH_FILE_VERSION 1
+
+/* the results of all the I/Os or of the ones of a node */
+struct bench_scope {
+	char name[64];
+	struct bench_hist op[BENCH_NR_OPS];
+};
+
+static const char * const op_names[BENCH_NR_OPS] = {
+	[BENCH_READ] = "read",
+	[BENCH_WRITE] = "write",
+};
+
+static struct bench_cmd_data {
+	struct bench_job job;
+	const char *workload;
+	int mix;
+	time_t start_at;
+	const char *output;
+} bench_cmd_data = {
+	.job = {
+		.block_size = 4096,
+		.queue_depth = 32,
+		.runtime = 60,
+	},
+	.workload = "randread",
+	.mix = 70,
+};
+
+/* scopes[0] is the total, then the nodes in the order of sd_nroot */
+static struct bench_scope *scopes;
+static int nr_scopes;
+static const struct sd_node **bench_nodes;
+
+static int lat_to_bucket(uint64_t lat)
+{
+	int e, idx;
+
+	if (lat < (1 << BENCH_SUB_BITS))
+		return lat;
+	e = 63 - __builtin_clzll(lat);
+	idx = ((e - BENCH_SUB_BITS + 1) << BENCH_SUB_BITS) +
+		((lat >> (e - BENCH_SUB_BITS)) & ((1 << BENCH_SUB_BITS) - 1));
+	return min(idx, BENCH_NR_BUCKETS - 1);
+}
+
+/* the middle of the bucket */
+static uint64_t bucket_to_lat(int idx)
+{
+	int g = idx >> BENCH_SUB_BITS, sub = idx & ((1 << BENCH_SUB_BITS) - 1);
+	uint64_t low;
+
+	if (!g)
+		return idx;
+	low = (uint64_t)((1 << BENCH_SUB_BITS) + sub) << (g - 1);
+	return low + ((1ULL << (g - 1)) >> 1);
+}
+
+static void hist_add(struct bench_hist *h, uint32_t len, uint64_t lat,
+		     bool failed)
+{
+	if (failed) {
+		h->errors++;
+		return;
+	}
+	h->nr++;
+	h->bytes += len;
+	h->lat_sum += lat;
+	h->buckets[lat_to_bucket(lat)]++;
+}
+
+static void hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	dst->nr += src->nr;
+	dst->bytes += src->bytes;
+	dst->errors += src->errors;
+	dst->lat_sum += src->lat_sum;
+	for (int i = 0; i < BENCH_NR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static uint64_t hist_percentile(const struct bench_hist *h, double pct)
+{
+	uint64_t target = (uint64_t)(h->nr * pct / 100.0 + 0.5), sum = 0;
+
+	if (!target)
+		target = 1;
+	for (int i = 0; i < BENCH_NR_BUCKETS; i++) {
+		sum += h->buckets[i];
+		if (sum >= target)
+			return bucket_to_lat(i);
+	}
+	return 0;
+}
+
+static int node_ptr_cmp(const struct sd_node **a, const struct sd_node **b)
+{
+	return node_cmp(*a, *b);
+}
+
+void bench_record(enum bench_op op, uint64_t oid, uint32_t len, uint64_t lat,
+		  bool failed)
+{
+	const struct sd_node *n = oid_to_node(oid, &sd_vroot, 0), **p;
+
+	hist_add(scopes[0].op + op, len, lat, failed);
+	p = xbsearch(&n, bench_nodes, nr_scopes - 1, node_ptr_cmp);
+	if (p)
+		hist_add(scopes[p - bench_nodes + 1].op + op, len, lat, failed);
+}
+
+static struct bench_scope *find_scope(const char *name)
+{
+	for (int i = 0; i < nr_scopes; i++)
+		if (!strcmp(scopes[i].name, name))
+			return scopes + i;
+
+	scopes = xrealloc(scopes, sizeof(*scopes) * (nr_scopes + 1));
+	memset(scopes + nr_scopes, 0, sizeof(*scopes));
+	pstrcpy(scopes[nr_scopes].name, sizeof(scopes[nr_scopes].name), name);
+	return scopes + nr_scopes++;
+}
+
+static void print_results(uint64_t elapsed)
+{
+	double secs = elapsed / 1000000000.0;
+
+	if (!raw_output)
+		printf("%-24s %-5s %10s %9s %8s %8s %8s %8s %8s %6s\n",
+		       "Scope", "Op", "IOPS", "MB/s", "Avg(us)", "p50",
+		       "p90", "p99", "p99.9", "Errors");
+	for (int i = 0; i < nr_scopes; i++)
+		for (int op = 0; op < BENCH_NR_OPS; op++) {
+			const struct bench_hist *h = scopes[i].op + op;
+
+			if (!h->nr && !h->errors)
+				continue;
+			printf(raw_output ? "%s %s %.1f %.1f %"PRIu64" %"PRIu64
+			       " %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64"\n" :
+			       "%-24s %-5s %10.1f %9.1f %8"PRIu64" %8"PRIu64
+			       " %8"PRIu64" %8"PRIu64" %8"PRIu64" %6"PRIu64"\n",
+			       scopes[i].name, op_names[op], h->nr / secs,
+			       h->bytes / secs / 1048576,
+			       h->nr ? h->lat_sum / h->nr : 0,
+			       hist_percentile(h, 50), hist_percentile(h, 90),
+			       hist_percentile(h, 99), hist_percentile(h, 99.9),
+			       h->errors);
+		}
+}
+
+static int save_results(const char *path, uint64_t elapsed)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
+	fprintf(f, "%s %d\nelapsed %"PRIu64"\n", BENCH_FILE_MAGIC,
+		BENCH_FILE_VERSION, elapsed);
+	for (int i = 0; i < nr_scopes; i++)
+		for (int op = 0; op < BENCH_NR_OPS; op++) {
+			const struct bench_hist *h = scopes[i].op + op;
+
+			fprintf(f, "%s %s %"PRIu64" %"PRIu64" %"PRIu64
+				" %"PRIu64, scopes[i].name, op_names[op], h->nr, h->bytes,
+				h->errors, h->lat_sum);
+			for (int j = 0; j < BENCH_NR_BUCKETS; j++)
+				if (h->buckets[j])
+					fprintf(f, " %d:%"PRIu64, j,
+						h->buckets[j]);
+			fprintf(f, "\n");
+		}
+	if (fclose(f)) {
+		sd_err("failed to write %s, %m", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Add the results saved in the file to the scopes */
+static int load_results(const char *path, uint64_t *elapsed)
+{
+	char line[16384], name[64], op[8];
+	uint64_t e;
+	int version, ret = -1;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+	if (!fgets(line, sizeof(line), f) ||
+	    sscanf(line, BENCH_FILE_MAGIC" %d", &version) != 1 ||
+	    version != BENCH_FILE_VERSION || !fgets(line, sizeof(line), f) ||
+	    sscanf(line, "elapsed %"SCNu64, &e) != 1)
+		goto out;
+	*elapsed = max(*elapsed, e);
+
+	while (fgets(line, sizeof(line), f)) {
+		struct bench_hist h = {};
+		int n, idx, o;
+		char *p = line;
+		uint64_t count;
+
+		if (sscanf(p, "%63s %7s %"SCNu64" %"SCNu64" %"SCNu64" %"SCNu64
+			   "%n", name, op, &h.nr, &h.bytes, &h.errors,
+			   &h.lat_sum, &n) != 6)
+			goto out;
+		for (o = 0; o < BENCH_NR_OPS; o++)
+			if (!strcmp(op, op_names[o]))
+				break;
+		if (o == BENCH_NR_OPS)
+			goto out;
+		for (p += n;
+		     sscanf(p, " %d:%"SCNu64"%n", &idx, &count, &n) == 2;
+		     p += n) {
+			if (idx < 0 || idx >= BENCH_NR_BUCKETS)
+				goto out;
+			h.buckets[idx] = count;
+		}
+		hist_merge(find_scope(name)->op + o, &h);
+	}
+	ret = 0;
+out:
+	if (ret)
+		sd_err("invalid results in %s", path);
+	fclose(f);
+	return ret;
+}
+
+static int bench_setup_workload(struct bench_job *job, const char *workload)
+{
+	const char *w = workload;
+
+	job->random = !strncmp(w, "rand", 4);
+	if (job->random)
+		w += 4;
+	if (!strcmp(w, "read"))
+		job->read_pct = 100;
+	else if (!strcmp(w, "write"))
+		job->read_pct = 0;
+	else if (!strcmp(w, "rw"))
+		job->read_pct = bench_cmd_data.mix;
+	else {
+		sd_err("Invalid workload %s", workload);
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_wait_start(time_t start_at)
+{
+	struct timespec ts;
+	uint64_t now = clock_get_time(), at = start_at * 1000000000ULL;
+
+	if (at <= now)
+		return;
+	ts.tv_sec = (at - now) / 1000000000ULL;
+	ts.tv_nsec = (at - now) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int bench_run(int argc, char **argv)
+{
+	struct bench_job *job = &bench_cmd_data.job;
+	struct sd_node *n;
+	int ret, i = 0;
+
+	if (bench_setup_workload(job, bench_cmd_data.workload) < 0)
+		return EXIT_USAGE;
+	pstrcpy(job->host, sizeof(job->host),
+		addr_to_str(sd_nid.addr, sd_nid.port));
+	job->vdis = argv + optind;
+	job->nr_vdis = argc - optind;
+
+	find_scope("total");
+	bench_nodes = xcalloc(sd_nodes_nr, sizeof(*bench_nodes));
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		bench_nodes[i++] = n;
+		find_scope(addr_to_str(n->nid.addr, n->nid.port));
+	}
+
+	bench_wait_start(bench_cmd_data.start_at);
+	ret = bench_io_run(job);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to run the bench, %s", sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	print_results(job->elapsed);
+	if (bench_cmd_data.output &&
+	    save_results(bench_cmd_data.output, job->elapsed) < 0)
+		return EXIT_SYSFAIL;
+	return EXIT_SUCCESS;
+}
+
+static int bench_merge(int argc, char **argv)
+{
+	uint64_t elapsed = 0;
+
+	/* the clients are run together, so the rates add up */
+	for (int i = optind; i < argc; i++)
+		if (load_results(argv[i], &elapsed) < 0)
+			return EXIT_FAILURE;
+	if (!elapsed) {
+		sd_err("No results to merge");
+		return EXIT_FAILURE;
+	}
+
+	print_results(elapsed);
+	if (bench_cmd_data.output &&
+	    save_results(bench_cmd_data.output, elapsed) < 0)
+		return EXIT_SYSFAIL;
+	return EXIT_SUCCESS;
+}
+
+static int bench_parser(int ch, const char *opt)
+{
+	struct bench_job *job = &bench_cmd_data.job;
+	uint64_t size;
+	char *p;
+
+	switch (ch) {
+	case 'b':
+		if (option_parse_size(opt, &size) < 0 || size < 512 ||
+		    size > (1ULL << 31) || (size & (size - 1))) {
+			sd_err("Invalid block size %s, it must be a power of "
+			       "two from 512 to the object size", opt);
+			exit(EXIT_USAGE);
+		}
+		job->block_size = size;
+		break;
+	case 'q':
+		job->queue_depth = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || job->queue_depth < 1) {
+			sd_err("Invalid queue depth %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'w':
+		bench_cmd_data.workload = opt;
+		break;
+	case 'm':
+		bench_cmd_data.mix = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || bench_cmd_data.mix < 0 ||
+		    bench_cmd_data.mix > 100) {
+			sd_err("Invalid read percentage %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 's':
+		if (option_parse_size(opt, &job->working_set) < 0) {
+			sd_err("Invalid working set size %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 't':
+		job->runtime = strtoull(opt, &p, 10);
+		if (opt == p || *p != '\0' || !job->runtime) {
+			sd_err("Invalid runtime %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'd':
+		job->direct = true;
+		break;
+	case 'S':
+		bench_cmd_data.start_at = strtoll(opt, &p, 10);
+		if (opt == p || *p != '\0') {
+			sd_err("Invalid start time %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'o':
+		bench_cmd_data.output = opt;
+		break;
+	}
+
+	return 0;
+}
+
+static struct sd_option bench_options[] = {
+	{'b', "block-size", true, "specify the size of an I/O (default: 4K)"},
+	{'q', "queue-depth", true,
+	 "specify the I/Os in flight (default: 32)"},
+	{'w', "workload", true, "specify the workload: read, write, rw,\n"
+	 "                          randread (default), randwrite or randrw"},
+	{'m', "mix", true,
+	 "specify the percentage of the reads of rw (default: 70)"},
+	{'s', "working-set", true,
+	 "specify the bytes used of each vdi (default: all)"},
+	{'t', "runtime", true, "specify the seconds to run (default: 60)"},
+	{'d', "direct", false, "connect to each node and read from the copies"},
+	{'S', "start", true, "start at the given unix time, to run together"},
+	{'o', "output", true, "save the results to the file for a merge"},
+	{ 0, NULL, false, NULL },
+};
+
+static struct subcommand bench_cmd[] = {
+	{"run", "<vdiname> [vdiname...]", "aprhTbqwmstdSo",
+	 "run a workload against the vdis", NULL,
+	 CMD_NEED_NODELIST | CMD_NEED_ARG, bench_run, bench_options},
+	{"merge", "<file> [file...]", "aprhTo",
+	 "add up the results saved by the clients", NULL,
+	 CMD_NEED_ARG, bench_merge, bench_options},
+	{NULL},
+};
+
+struct command bench_command = {
+	"bench",
+	bench_cmd,
+	bench_parser
+};
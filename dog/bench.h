@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __DOG_BENCH_H__
+#define __DOG_BENCH_H__
+
+/*
+ * The interface between 'dog bench' and its I/O engine.  The engine runs on
+ * libsheepdog, whose sheepdog.h can't be included with dog.h, so this header
+ * includes neither of them.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the latencies in us, 8 linear buckets for each power of two */
+#define BENCH_SUB_BITS 3
+#define BENCH_NR_BUCKETS (40 << BENCH_SUB_BITS)
+
+enum bench_op {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_NR_OPS,
+};
+
+struct bench_hist {
+	uint64_t nr;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t lat_sum;
+	uint64_t buckets[BENCH_NR_BUCKETS];
+};
+
+struct bench_job {
+	char host[64]; /* IP:PORT */
+	bool direct; /* a connection to each node, see sd_connect_direct() */
+	char **vdis;
+	int nr_vdis;
+	uint32_t block_size;
+	int queue_depth;
+	bool random;
+	int read_pct;
+	uint64_t working_set; /* from the start of each vdi, 0 for all */
+	uint64_t runtime; /* in seconds */
+	uint64_t elapsed; /* in ns, set by bench_io_run() */
+};
+
+/* Run the job, calling bench_record() for each I/O done */
+int bench_io_run(struct bench_job *job);
+void bench_record(enum bench_op op, uint64_t oid, uint32_t len, uint64_t lat,
+		  bool failed);
+
+#endif
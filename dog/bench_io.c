@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The I/O engine of 'dog bench'
+ *
+ * It keeps queue_depth I/Os of block_size bytes in flight through the
+ * asynchronous API of libsheepdog, sd_vdi_submit() and sd_vdi_poll(), and
+ * submits a new one for each I/O done until the runtime is over.  The vdi of
+ * an I/O is picked at random, the block at random or after the last one of
+ * the vdi, and the operation by the percentage of the reads.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "sheepdog.h"
+#include "bench.h"
+
+struct bench_target {
+	struct sd_vdi *vdi;
+	uint64_t nr_blocks; /* in the working set */
+	uint64_t next; /* of a sequential job */
+};
+
+struct bench_slot {
+	struct iovec iov;
+	uint64_t oid;
+	uint64_t start;
+};
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, seeded apart for the clients run together */
+static uint64_t bench_random(void)
+{
+	static uint64_t x;
+
+	if (!x)
+		x = bench_now() ^ ((uint64_t)getpid() << 32) ^
+			0x2545f4914f6cdd1dULL;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void bench_prepare(struct bench_job *job, struct bench_target *targets,
+			  struct sd_io *io)
+{
+	struct bench_target *t = targets + bench_random() % job->nr_vdis;
+	struct bench_slot *s = io->opaque;
+	uint64_t block;
+
+	if (job->random)
+		block = bench_random() % t->nr_blocks;
+	else {
+		block = t->next;
+		t->next = (t->next + 1) % t->nr_blocks;
+	}
+
+	io->vdi = t->vdi;
+	io->write = bench_random() % 100 >= job->read_pct;
+	io->offset = block * job->block_size;
+	s->oid = vid_to_data_oid(t->vdi->vid,
+				 io->offset >> t->vdi->inode->block_size_shift);
+	s->start = bench_now();
+}
+
+static int bench_open(struct sd_cluster *c, struct bench_job *job,
+		      struct bench_target *t, char *name)
+{
+	uint64_t size;
+
+	t->vdi = sd_vdi_open(c, name, NULL);
+	if (!t->vdi) {
+		fprintf(stderr, "failed to open %s\n", name);
+		return errno;
+	}
+
+	size = sd_vdi_getsize(t->vdi);
+	if (job->working_set && job->working_set < size)
+		size = job->working_set;
+	t->nr_blocks = size / job->block_size;
+	/* a block within an object */
+	if (!t->nr_blocks ||
+	    job->block_size > (1U << t->vdi->inode->block_size_shift)) {
+		fprintf(stderr, "invalid block size %"PRIu32" for %s\n",
+			job->block_size, name);
+		return SD_RES_INVALID_PARMS;
+	}
+	if (job->read_pct < 100 && vdi_is_snapshot(t->vdi->inode)) {
+		fprintf(stderr, "%s is a snapshot\n", name);
+		return SD_RES_INVALID_PARMS;
+	}
+	return SD_RES_SUCCESS;
+}
+
+int bench_io_run(struct bench_job *job)
+{
+	struct bench_target *targets;
+	struct bench_slot *slots;
+	struct sd_io *ios, **done;
+	struct sd_cluster *c;
+	uint64_t start, end;
+	int inflight = 0, ret = SD_RES_SUCCESS;
+	char *buf;
+
+	c = job->direct ? sd_connect_direct(job->host) : sd_connect(job->host);
+	if (!c) {
+		fprintf(stderr, "failed to connect to %s\n", job->host);
+		return errno;
+	}
+
+	targets = xcalloc(job->nr_vdis, sizeof(*targets));
+	slots = xcalloc(job->queue_depth, sizeof(*slots));
+	ios = xcalloc(job->queue_depth, sizeof(*ios));
+	done = xcalloc(job->queue_depth, sizeof(*done));
+	/* random data, not compressed or deduplicated by the store */
+	buf = xvalloc((size_t)job->queue_depth * job->block_size);
+	for (size_t i = 0; i < (size_t)job->queue_depth * job->block_size;
+	     i += sizeof(uint64_t)) {
+		uint64_t r = bench_random();
+
+		memcpy(buf + i, &r, sizeof(r));
+	}
+
+	for (int i = 0; i < job->nr_vdis; i++) {
+		ret = bench_open(c, job, targets + i, job->vdis[i]);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	start = bench_now();
+	end = start + job->runtime * 1000000000ULL;
+	for (int i = 0; i < job->queue_depth; i++) {
+		slots[i].iov.iov_base = buf + (size_t)i * job->block_size;
+		slots[i].iov.iov_len = job->block_size;
+		ios[i].iov = &slots[i].iov;
+		ios[i].iovcnt = 1;
+		ios[i].opaque = slots + i;
+		bench_prepare(job, targets, ios + i);
+	}
+	ret = sd_vdi_submit(ios, job->queue_depth);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	inflight = job->queue_depth;
+
+	while (inflight) {
+		int n = sd_vdi_poll(c, done, job->queue_depth, true);
+		uint64_t now = bench_now();
+
+		for (int i = 0; i < n; i++) {
+			struct sd_io *io = done[i];
+			struct bench_slot *s = io->opaque;
+
+			bench_record(io->write ? BENCH_WRITE : BENCH_READ,
+				     s->oid, job->block_size,
+				     (now - s->start) / 1000,
+				     io->ret != SD_RES_SUCCESS);
+			if (now >= end) {
+				inflight--;
+				continue;
+			}
+			bench_prepare(job, targets, io);
+			if (sd_vdi_submit(io, 1) != SD_RES_SUCCESS)
+				inflight--;
+		}
+	}
+	job->elapsed = bench_now() - start;
+out:
+	for (int i = 0; i < job->nr_vdis; i++)
+		if (targets[i].vdi)
+			sd_vdi_close(targets[i].vdi);
+	sd_disconnect(c);
+	free(buf);
+	free(done);
+	free(ios);
+	free(slots);
+	free(targets);
+	return ret;
+}
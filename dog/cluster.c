@@ -19,29 +19,50 @@
 
 static struct sd_option cluster_options[] = {
 	{'b', "store", true, "specify backend store"},
+	{'B', "budget", true,
+	 "reconfig in steps moving about the size of data each"},
 	{'c', "copies", true, "specify the default data redundancy (number of copies)"},
 	{'f', "force", false, "do not prompt for confirmation"},
 	{'m', "multithread", false,
 	 "use multi-thread for 'cluster snapshot save'"},
+	{'N', "nodes", false,
+	 "let the nodes save the objects to the path they share"},
 	{'t', "strict", false,
 	 "do not serve write request if number of nodes is not sufficient"},
 	{'s', "manual", false, "enable manual membership control"},
+	{'H', "hash", true,
+	 "placement hash of the objects, fnv (default) or mix"},
 	{'d', "diff", false,
 	 "just output the changes between the two adjacent epoches"
 		"for cluster info"},
+	{'j', "jobs", true, "specify the number of objects checked in parallel"},
+	{'R', "rate", true,
+	 "specify the bytes of the copies checked per second (default: no limit)"},
+	{'C', "checkpoint", true,
+	 "skip the vdis listed in the file and list the checked ones in it"},
 	{ 0, NULL, false, NULL },
 };
 
+#define CLUSTER_CHECK_DEFAULT_JOBS 64
+
 static struct cluster_cmd_data {
 	uint8_t copies;
 	uint8_t copy_policy;
 	uint8_t multithread;
+	bool on_nodes;
 	bool force;
 	bool strict;
 	bool manual;
+	bool mixhash;
 	bool diff;
+	uint64_t budget;
 	char name[STORE_LEN];
-} cluster_cmd_data;
+	int nr_jobs;
+	uint64_t rate;
+	const char *checkpoint;
+} cluster_cmd_data = {
+	.nr_jobs = CLUSTER_CHECK_DEFAULT_JOBS,
+};
 
 #define DEFAULT_STORE	"plain"
 
@@ -131,6 +152,8 @@ static int cluster_format(int argc, char **argv)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_STRICT;
 	if (cluster_cmd_data.manual)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_MANUAL;
+	if (cluster_cmd_data.mixhash)
+		hdr.cluster.flags |= SD_CLUSTER_FLAG_MIXHASH;
 
 #ifdef HAVE_DISKVNODES
 	hdr.cluster.flags |= SD_CLUSTER_FLAG_DISKMODE;
@@ -321,6 +344,15 @@ retry:
 		else
 			printf("node");
 
+		if (!raw_output)
+			printf("\nCluster placement hash: ");
+		else
+			printf("\n");
+		if (logs->flags & SD_CLUSTER_FLAG_MIXHASH)
+			printf("mix");
+		else
+			printf("fnv");
+
 		printf("\nCluster block event: %d\n", logs->block_event_number);
 	}
 
@@ -427,7 +459,7 @@ static void fill_cb(struct sd_index *idx, void *arg, int ignore)
 	if (idx->vdi_id) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
 		object_tree_insert(oid, inode->nr_copies,
-				   inode->copy_policy);
+				   inode->copy_policy, inode->block_size_shift);
 	}
 }
 
@@ -461,7 +493,8 @@ static void fill_object_tree(uint32_t vid, const char *name, const char *tag,
 		opt->nr_snapshot++;
 
 	/* fill vdi object id */
-	object_tree_insert(vdi_oid, i->nr_copies, i->copy_policy);
+	object_tree_insert(vdi_oid, i->nr_copies, i->copy_policy,
+			   i->block_size_shift);
 
 	/* fill data object id */
 	if (i->store_policy == 0) {
@@ -471,16 +504,18 @@ static void fill_object_tree(uint32_t vid, const char *name, const char *tag,
 			if (!vdi_id)
 				continue;
 			uint64_t oid = vid_to_data_oid(vdi_id, idx);
-			object_tree_insert(oid, i->nr_copies, i->copy_policy);
+			object_tree_insert(oid, i->nr_copies, i->copy_policy,
+					   i->block_size_shift);
 		}
 	} else
-		sd_inode_index_walk(i, fill_cb, &i);
+		sd_inode_index_walk(i, fill_cb, (void *)i);
 
 	/* fill vmstate object id */
 	nr_vmstate_object = DIV_ROUND_UP(i->vm_state_size, SD_DATA_OBJ_SIZE);
 	for (uint32_t idx = 0; idx < nr_vmstate_object; idx++) {
 		vmstate_oid = vid_to_vmstate_oid(vid, idx);
-		object_tree_insert(vmstate_oid, i->nr_copies, i->copy_policy);
+		object_tree_insert(vmstate_oid, i->nr_copies, i->copy_policy,
+				   i->block_size_shift);
 	}
 }
 
@@ -532,8 +567,8 @@ static int save_snapshot(int argc, char **argv)
 		goto out;
 	}
 
-	if (farm_save_snapshot(tag, cluster_cmd_data.multithread)
-	    != SD_RES_SUCCESS)
+	if (farm_save_snapshot(tag, cluster_cmd_data.multithread,
+			       cluster_cmd_data.on_nodes) != SD_RES_SUCCESS)
 		goto out;
 
 	ret = EXIT_SUCCESS;
@@ -622,6 +657,17 @@ out:
 	return ret;
 }
 
+static int repack_snapshot(int argc, char **argv)
+{
+	const char *path = argv[optind++];
+
+	if (farm_init(path) != SD_RES_SUCCESS || farm_repack() < 0) {
+		sd_err("Fail to repack snapshot.");
+		return EXIT_SYSFAIL;
+	}
+	return EXIT_SUCCESS;
+}
+
 #define RECOVER_PRINT \
 	"Caution! Please try starting all the cluster nodes normally before\n" \
 	"running this command.\n\n" \
@@ -670,7 +716,7 @@ static int cluster_recover(int argc, char **argv)
 
 /* Subcommand list of snapshot */
 static struct subcommand cluster_snapshot_cmd[] = {
-	{"save", NULL, "h", "save snapshot to localpath",
+	{"save", NULL, "hN", "save snapshot to localpath",
 	 NULL, CMD_NEED_ARG|CMD_NEED_NODELIST,
 	 save_snapshot, NULL},
 	{"list", NULL, "h", "list snapshot of localpath",
@@ -679,6 +725,8 @@ static struct subcommand cluster_snapshot_cmd[] = {
 	 NULL, CMD_NEED_ARG | CMD_NEED_NODELIST, load_snapshot, NULL},
 	{"show", NULL, "h", "show vdi list from snapshot",
 	 NULL, CMD_NEED_ARG | CMD_NEED_NODELIST, show_snapshot, NULL},
+	{"repack", NULL, "h", "pack the loose objects of localpath",
+	 NULL, CMD_NEED_ARG, repack_snapshot, NULL},
 	{NULL},
 };
 
@@ -693,31 +741,18 @@ static int cluster_reconfig(int argc, char **argv)
 	struct sd_req hdr;
 
 	sd_init_req(&hdr, SD_OP_REWEIGHT);
+	hdr.reweight.budget = cluster_cmd_data.budget;
 	ret = send_light_req(&sd_nid, &hdr);
 	if (ret)
 		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 }
 
-static void cluster_check_cb(uint32_t vid, const char *name, const char *tag,
-			     uint32_t snapid, uint32_t flags,
-			     const struct sd_inode *inode, void *data)
-{
-	if (vdi_is_snapshot(inode))
-		printf("Checking snapshot %s (id: %d, tag: \"%s\")\n", name,
-		       snapid, tag);
-	else
-		printf("Checking vdi %s\n", name);
-
-	do_vdi_check(inode);
-}
-
 static int cluster_check(int argc, char **argv)
 {
-	if (parse_vdi(cluster_check_cb, SD_INODE_SIZE, NULL, true) < 0)
-		return EXIT_SYSFAIL;
-
-	return EXIT_SUCCESS;
+	return do_cluster_check(cluster_cmd_data.nr_jobs,
+				cluster_cmd_data.rate,
+				cluster_cmd_data.checkpoint);
 }
 
 #define ALTER_CLUSTER_COPY_PRINT				\
@@ -804,7 +839,7 @@ failure:
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprhvTd", "show cluster information",
 	 NULL, CMD_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bctaphTfs", "create a Sheepdog store",
+	{"format", NULL, "bctaphTfsH", "create a Sheepdog store",
 	 NULL, CMD_NEED_NODELIST, cluster_format, cluster_options},
 	{"shutdown", NULL, "aphT", "stop Sheepdog",
 	 NULL, 0, cluster_shutdown, cluster_options},
@@ -816,9 +851,9 @@ static struct subcommand cluster_cmd[] = {
 	 "See 'dog cluster recover' for more information",
 	 cluster_recover_cmd, CMD_NEED_ARG,
 	 cluster_recover, cluster_options},
-	{"reconfig", NULL, "aphT", "reconfig the cluster", NULL, 0,
+	{"reconfig", NULL, "aphTB", "reconfig the cluster", NULL, 0,
 	 cluster_reconfig, cluster_options},
-	{"check", NULL, "aphT", "check and repair cluster", NULL,
+	{"check", NULL, "aphTjRC", "check and repair cluster", NULL,
 	 CMD_NEED_NODELIST, cluster_check, cluster_options},
 	{"alter-copy", NULL, "aphTc", "set the cluster's redundancy level",
 	 NULL, CMD_NEED_NODELIST, cluster_alter_copy, cluster_options},
@@ -827,11 +862,19 @@ static struct subcommand cluster_cmd[] = {
 
 static int cluster_parser(int ch, const char *opt)
 {
+	char *p;
+
 	switch (ch) {
 	case 'b':
 		pstrcpy(cluster_cmd_data.name, sizeof(cluster_cmd_data.name),
 			opt);
 		break;
+	case 'B':
+		if (option_parse_size(opt, &cluster_cmd_data.budget) < 0) {
+			sd_err("Invalid budget %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	case 'c':
 		cluster_cmd_data.copies =
 			parse_copy(opt, &cluster_cmd_data.copy_policy);
@@ -849,16 +892,44 @@ static int cluster_parser(int ch, const char *opt)
 	case 'f':
 		cluster_cmd_data.force = true;
 		break;
+	case 'N':
+		cluster_cmd_data.on_nodes = true;
+		break;
 	case 'm':
 		cluster_cmd_data.multithread = true;
 	case 't':
 		cluster_cmd_data.strict = true;
 		break;
+	case 'H':
+		if (!strcmp(opt, "mix"))
+			cluster_cmd_data.mixhash = true;
+		else if (strcmp(opt, "fnv")) {
+			sd_err("Invalid placement hash %s, fnv or mix", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	case 'd':
 		cluster_cmd_data.diff = true;
 		break;
 	case 's':
 		cluster_cmd_data.manual = true;
+		break;
+	case 'j':
+		cluster_cmd_data.nr_jobs = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || cluster_cmd_data.nr_jobs < 1) {
+			sd_err("The number of jobs must be a positive integer");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'R':
+		if (option_parse_size(opt, &cluster_cmd_data.rate) < 0) {
+			sd_err("Invalid rate %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'C':
+		cluster_cmd_data.checkpoint = opt;
+		break;
 	}
 
 	return 0;
@@ -80,20 +80,69 @@ char *strnumber(uint64_t size)
 	return strnumber_raw(size, raw_output);
 }
 
+/*
+ * Read the object through the gateway nid, a background read is kept out of
+ * the page cache of the sheep
+ */
+int dog_read_object_from(const struct node_id *nid, uint64_t oid, void *data,
+			 unsigned int datalen, uint64_t offset, bool direct,
+			 bool background)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.data_length = datalen;
+
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	if (direct)
+		hdr.flags |= SD_FLAG_CMD_DIRECT;
+	if (background)
+		hdr.flags |= SD_FLAG_CMD_BACKGROUND;
+
+	ret = dog_exec_req(nid, &hdr, data);
+	if (ret < 0) {
+		sd_err("Failed to read object %" PRIx64, oid);
+		return SD_RES_EIO;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to read object %" PRIx64 " %s", oid,
+		       sd_strerror(rsp->result));
+		return rsp->result;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
 int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		    uint64_t offset, bool direct)
+{
+	return dog_read_object_from(&sd_nid, oid, data, datalen, offset,
+				    direct, false);
+}
+
+/* Same as dog_read_object(), but the holes aren't sent over the network */
+int dog_read_sparse_object(uint64_t oid, void *data, unsigned int datalen,
+			   uint64_t offset, bool direct, bool background)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	void *sparse;
 	int ret;
 
 	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.flags = SD_FLAG_CMD_SPARSE;
 	hdr.data_length = datalen;
 
 	hdr.obj.oid = oid;
 	hdr.obj.offset = offset;
 	if (direct)
 		hdr.flags |= SD_FLAG_CMD_DIRECT;
+	if (background)
+		hdr.flags |= SD_FLAG_CMD_BACKGROUND;
 
 	ret = dog_exec_req(&sd_nid, &hdr, data);
 	if (ret < 0) {
@@ -107,13 +156,26 @@ int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		return rsp->result;
 	}
 
+	if (!(rsp->flags & SD_FLAG_CMD_SPARSE))
+		return SD_RES_SUCCESS;
+
+	sparse = xmalloc(rsp->data_length);
+	memcpy(sparse, data, rsp->data_length);
+	ret = sparse_decode(sparse, rsp->data_length, data, datalen);
+	free(sparse);
+	if (ret < 0) {
+		sd_err("Failed to decode object %" PRIx64, oid);
+		return SD_RES_EIO;
+	}
+
 	return SD_RES_SUCCESS;
 }
 
-int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
-		     unsigned int datalen, uint64_t offset, uint32_t flags,
-		     uint8_t copies, uint8_t copy_policy, bool create,
-		     bool direct)
+/* Write the object through the gateway nid */
+int dog_write_object_to(const struct node_id *nid, uint64_t oid,
+			uint64_t cow_oid, void *data, unsigned int datalen,
+			uint64_t offset, uint32_t flags, uint8_t copies,
+			uint8_t copy_policy, bool create, bool direct)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -137,7 +199,7 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 	hdr.obj.cow_oid = cow_oid;
 	hdr.obj.offset = offset;
 
-	ret = dog_exec_req(&sd_nid, &hdr, data);
+	ret = dog_exec_req(nid, &hdr, data);
 	if (ret < 0) {
 		sd_err("Failed to write object %" PRIx64, oid);
 		return SD_RES_EIO;
@@ -151,6 +213,27 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Return the node of the first copy of the object, whose gateway writes a
+ * copy locally, or sd_nid if the node list is not known
+ */
+const struct node_id *oid_to_gateway(uint64_t oid)
+{
+	if (RB_EMPTY_ROOT(&sd_vroot))
+		return &sd_nid;
+	return &oid_to_vnode(oid, &sd_vroot, 0)->node->nid;
+}
+
+int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
+		     unsigned int datalen, uint64_t offset, uint32_t flags,
+		     uint8_t copies, uint8_t copy_policy, bool create,
+		     bool direct)
+{
+	return dog_write_object_to(&sd_nid, oid, cow_oid, data, datalen,
+				   offset, flags, copies, copy_policy, create,
+				   direct);
+}
+
 #define FOR_EACH_VDI(nr, vdis) FOR_EACH_BIT(nr, vdis, SD_NR_VDIS)
 
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data,
@@ -214,6 +297,102 @@ out:
 	return ret;
 }
 
+/* The records of SD_OP_LIST_VDI_HEADERS in a page */
+#define VDI_HEADERS_PAGE 256
+
+/*
+ * The record of SD_OP_LIST_VDI_HEADERS for the inode i, with the objects
+ * counted if stat, for which i has to be read with the index
+ */
+void vdi_header_from_inode(const struct sd_inode *i, bool stat,
+			   struct sd_vdi_header *h)
+{
+	memset(h, 0, sizeof(*h));
+	pstrcpy(h->name, sizeof(h->name), i->name);
+	pstrcpy(h->tag, sizeof(h->tag), i->tag);
+	h->create_time = i->create_time;
+	h->snap_ctime = i->snap_ctime;
+	h->vdi_size = i->vdi_size;
+	h->vdi_id = i->vdi_id;
+	h->parent_vdi_id = i->parent_vdi_id;
+	h->snap_id = i->snap_id;
+	h->nr_copies = i->nr_copies;
+	h->copy_policy = i->copy_policy;
+	h->store_policy = i->store_policy;
+	h->block_size_shift = i->block_size_shift;
+	if (stat)
+		sd_inode_stat(i, &h->my_objs, &h->cow_objs);
+}
+
+struct header_parser {
+	vdi_header_parser_func_t func;
+	bool stat;
+	void *data;
+};
+
+static void parse_inode_header(uint32_t vid, const char *name,
+			       const char *tag, uint32_t snapid,
+			       uint32_t flags, const struct sd_inode *i,
+			       void *data)
+{
+	struct header_parser *p = data;
+	struct sd_vdi_header h;
+
+	vdi_header_from_inode(i, p->stat, &h);
+	p->func(&h, p->data);
+}
+
+/*
+ * Call func on the headers of the vdis in use but the deleted ones, a page of
+ * them in a request instead of two reads for each vdi.  The objects are
+ * counted if stat.  The inodes are read one by one from a sheep which doesn't
+ * know SD_OP_LIST_VDI_HEADERS.
+ */
+int parse_vdi_headers(vdi_header_parser_func_t func, bool stat, void *data)
+{
+	struct sd_vdi_header *h = xmalloc(VDI_HEADERS_PAGE * sizeof(*h));
+	struct header_parser p = { func, stat, data };
+	struct sd_req req;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req;
+	uint64_t vid = 0;
+	int ret;
+
+	for (;;) {
+		uint32_t nr;
+
+		sd_init_req(&req, SD_OP_LIST_VDI_HEADERS);
+		req.data_length = VDI_HEADERS_PAGE * sizeof(*h);
+		req.obj.oid = vid;
+
+		ret = dog_exec_req(&sd_nid, &req, h);
+		if (ret < 0 && vid)
+			goto out;
+		/* an older sheep closes the connection on the unknown op */
+		if (!vid && (ret < 0 || rsp->result == SD_RES_NO_SUPPORT ||
+			     rsp->result == SD_RES_INVALID_PARMS)) {
+			ret = parse_vdi(parse_inode_header,
+					stat ? SD_INODE_SIZE :
+					SD_INODE_HEADER_SIZE, &p, true);
+			goto out;
+		}
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("%s", sd_strerror(rsp->result));
+			ret = -1;
+			goto out;
+		}
+
+		nr = rsp->data_length / sizeof(*h);
+		if (!nr)
+			break;
+		for (uint32_t n = 0; n < nr; n++)
+			func(h + n, data);
+		vid = h[nr - 1].vdi_id + 1;
+	}
+out:
+	free(h);
+	return ret;
+}
+
 int dog_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 {
 	struct sockfd *sfd;
@@ -229,10 +408,14 @@ int dog_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 	 * 2. Some operations might take unexpected long time
 	 */
 	ret = exec_req(sfd->fd, hdr, buf, NULL, 0, UINT32_MAX);
+	if (ret) {
+		/* e.g. closed by an older sheep on an unknown opcode */
+		sockfd_cache_drop(nid, sfd);
+		return -1;
+	}
 
 	sockfd_cache_put(nid, sfd);
-
-	return ret ? -1 : 0;
+	return 0;
 }
 
 /* Light request only contains header, without body content. */
@@ -22,6 +22,8 @@
 #include "sockfd_cache.h"
 
 #define EPOLL_SIZE 4096
+/* 4 MB each */
+#define DOG_BNODE_CACHE 64
 
 static const char program_name[] = "dog";
 struct node_id sd_nid = {
@@ -127,6 +129,7 @@ int update_node_list(int max_nodes)
 	if (ret < 0)
 		goto out;
 
+	sd_mix_placement = !!(logs->flags & SD_CLUSTER_FLAG_MIXHASH);
 	if (logs->flags & SD_CLUSTER_FLAG_DISKMODE)
 		disks_to_vnodes(&sd_nroot, &sd_vroot);
 	else
@@ -176,6 +179,7 @@ static void init_commands(const struct command **commands)
 		vdi_command,
 		node_command,
 		cluster_command,
+		bench_command,
 #ifdef HAVE_TRACE
 		trace_command,
 #endif
@@ -545,6 +549,8 @@ int main(int argc, char **argv)
 
 	if (sd_inode_actor_init(dog_bnode_writer, dog_bnode_reader) < 0)
 		exit(EXIT_SYSFAIL);
+	/* a command is short lived, keep the B-tree nodes it walks */
+	sd_inode_cache_init(DOG_BNODE_CACHE);
 
 	if (!is_stdout_console() || raw_output)
 		highlight = false;
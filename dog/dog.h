@@ -76,11 +76,26 @@ typedef void (*vdi_parser_func_t)(uint32_t vid, const char *name,
 				  const struct sd_inode *i, void *data);
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data,
 			bool no_deleted);
+typedef void (*vdi_header_parser_func_t)(const struct sd_vdi_header *h,
+					 void *data);
+void vdi_header_from_inode(const struct sd_inode *i, bool stat,
+			   struct sd_vdi_header *h);
+int parse_vdi_headers(vdi_header_parser_func_t func, bool stat, void *data);
 int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		    uint64_t offset, bool direct);
+int dog_read_object_from(const struct node_id *nid, uint64_t oid, void *data,
+			 unsigned int datalen, uint64_t offset, bool direct,
+			 bool background);
+int dog_read_sparse_object(uint64_t oid, void *data, unsigned int datalen,
+			   uint64_t offset, bool direct, bool background);
 int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		     unsigned int datalen, uint64_t offset, uint32_t flags,
 		     uint8_t copies, uint8_t, bool create, bool direct);
+int dog_write_object_to(const struct node_id *nid, uint64_t oid,
+			uint64_t cow_oid, void *data, unsigned int datalen,
+			uint64_t offset, uint32_t flags, uint8_t copies,
+			uint8_t copy_policy, bool create, bool direct);
+const struct node_id *oid_to_gateway(uint64_t oid);
 int dog_exec_req(const struct node_id *, struct sd_req *hdr, void *data);
 int send_light_req(const struct node_id *, struct sd_req *hdr);
 int do_generic_subcommand(struct subcommand *sub, int argc, char **argv);
@@ -91,6 +106,7 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
 		  uint8_t copy_policy, uint8_t store_policy);
 int do_vdi_check(const struct sd_inode *inode);
+int do_cluster_check(int nr_jobs, uint64_t rate, const char *checkpoint);
 void show_progress(uint64_t done, uint64_t total, bool raw);
 size_t get_store_objsize(uint8_t copy_policy, uint64_t oid);
 bool is_erasure_oid(uint64_t oid, uint8_t policy);
@@ -115,6 +131,7 @@ extern struct command vdi_command;
 extern struct command node_command;
 extern struct command cluster_command;
 extern struct command alter_command;
+extern struct command bench_command;
 
 #ifdef HAVE_TRACE
 extern struct command trace_command;
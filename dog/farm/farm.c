@@ -17,6 +17,7 @@
 
 #include "farm.h"
 #include "rbtree.h"
+#include "slice.h"
 
 static char farm_object_dir[PATH_MAX];
 static char farm_dir[PATH_MAX];
@@ -56,8 +57,39 @@ static uint64_t obj_to_load;
 struct snapshot_work {
 	struct trunk_entry entry;
 	struct strbuf *trunk_buf;
+	uint8_t block_size_shift; /* of the vdi, for a save */
 	struct work work;
+	/* of a load */
+	uint64_t idx; /* of the entry in the trunk */
+	struct load_node *node;
+	bool loaded; /* by an interrupted load */
 };
+
+/*
+ * The objects of a load are sorted out by the node of their first copy, see
+ * oid_to_gateway(), and written through the gateway of the node, up to
+ * LOAD_NODE_JOBS at a time on each node, so the writes spread over all the
+ * nodes instead of following the order of the trunk, and mostly save a
+ * forward.  The loaded entries are marked in the load-<trunk sha1> bitmap of
+ * the farm, so a load of the snapshot after an interruption skips them, and
+ * the bitmap is removed once the load is done.
+ */
+#define LOAD_NODE_JOBS 8
+
+struct load_node {
+	const struct node_id *nid;
+	uint64_t *entries; /* indexes of the entries of the node */
+	uint64_t nr, next;
+};
+
+static struct trunk_entry *load_entries;
+static uint64_t *load_idx; /* of the entries in the trunk */
+static uint64_t nr_load_entries, nr_trunk_entries;
+static struct load_node *load_nodes;
+static int nr_load_nodes;
+static uint8_t *load_bitmap;
+static int load_fd = -1;
+static char load_path[PATH_MAX + 64];
 static struct work_queue *wq;
 static uatomic_bool work_error;
 
@@ -237,6 +269,9 @@ int farm_init(const char *path)
 		goto out;
 	if (snap_init(farm_dir) < 0)
 		goto out;
+	if (pack_init() < 0)
+		goto out;
+	slice_cut_init();
 	return 0;
 out:
 	if (ret)
@@ -261,7 +296,10 @@ static void do_save_object(struct work *work)
 
 	sw = container_of(work, struct snapshot_work, work);
 
-	size = get_objsize(sw->entry.oid);
+	if (is_data_obj(sw->entry.oid))
+		size = UINT64_C(1) << sw->block_size_shift;
+	else
+		size = get_objsize(sw->entry.oid);
 	buf = xmalloc(size);
 
 	if (dog_read_object(sw->entry.oid, buf, size, 0, true) < 0)
@@ -300,7 +338,7 @@ out:
 
 static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 				    uint8_t copy_policy,
-				    void *data)
+				    uint8_t block_size_shift, void *data)
 {
 	struct snapshot_work *sw = xzalloc(sizeof(struct snapshot_work));
 	struct strbuf *trunk_buf = data;
@@ -308,6 +346,7 @@ static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 	sw->entry.oid = oid;
 	sw->entry.nr_copies = nr_copies;
 	sw->entry.copy_policy = copy_policy;
+	sw->block_size_shift = block_size_shift;
 	sw->trunk_buf = trunk_buf;
 	sw->work.fn = do_save_object;
 	sw->work.done = save_object_done;
@@ -316,7 +355,176 @@ static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 	return 0;
 }
 
-int farm_save_snapshot(const char *tag, bool multithread)
+/*
+ * With the nodes saving the objects, see sheep/farm.c, the objects are sorted
+ * out by the nodes of their first copies as for a load, and each node gets
+ * SAVE_NODE_JOBS batches of SAVE_BATCH objects at a time.  Dog only merges the
+ * sha1 of the slice files the nodes return into the trunk, so the farm must be
+ * at the same path on the nodes.
+ */
+#define SAVE_NODE_JOBS 4
+#define SAVE_BATCH 256
+
+struct save_node {
+	const struct node_id *nid;
+	struct sd_farm_entry *entries;
+	uint64_t nr, next;
+};
+
+struct save_batch_work {
+	struct save_node *node;
+	uint64_t start;
+	uint32_t nr;
+	struct work work;
+};
+
+static struct save_node *save_nodes;
+static int nr_save_nodes;
+static char save_dir[PATH_MAX];
+
+static struct save_node *save_node_of(const struct node_id *nid)
+{
+	for (int i = 0; i < nr_save_nodes; i++)
+		if (save_nodes[i].nid == nid)
+			return save_nodes + i;
+
+	save_nodes = xrealloc(save_nodes,
+			      sizeof(*save_nodes) * (nr_save_nodes + 1));
+	memset(save_nodes + nr_save_nodes, 0, sizeof(*save_nodes));
+	save_nodes[nr_save_nodes].nid = nid;
+	return save_nodes + nr_save_nodes++;
+}
+
+static int add_save_entry(uint64_t oid, uint32_t nr_copies,
+			  uint8_t copy_policy, uint8_t block_size_shift,
+			  void *data)
+{
+	struct save_node *node = save_node_of(oid_to_gateway(oid));
+	struct sd_farm_entry *e;
+
+	if (!(node->nr & (node->nr + 1)))
+		node->entries = xrealloc(node->entries,
+					 sizeof(*node->entries) *
+					 (node->nr + 1) * 2);
+	e = node->entries + node->nr++;
+	memset(e, 0, sizeof(*e));
+	e->oid = oid;
+	e->nr_copies = nr_copies;
+	e->copy_policy = copy_policy;
+	e->block_size_shift = block_size_shift;
+	return 0;
+}
+
+static void do_save_batch(struct work *work)
+{
+	struct save_batch_work *bw = container_of(work, struct save_batch_work,
+						  work);
+	struct sd_farm_entry *entries = bw->node->entries + bw->start;
+	size_t path_len = strlen(save_dir) + 1, off = round_up(path_len, 8);
+	size_t len = off + sizeof(*entries) * bw->nr;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char *buf;
+
+	if (uatomic_is_true(&work_error))
+		return;
+
+	buf = xzalloc(len);
+	memcpy(buf, save_dir, path_len);
+	memcpy(buf + off, entries, sizeof(*entries) * bw->nr);
+
+	sd_init_req(&hdr, SD_OP_FARM_SAVE);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+	hdr.data_length = len;
+	hdr.farm.path_len = path_len;
+	hdr.farm.nr = bw->nr;
+	if (dog_exec_req(bw->node->nid, &hdr, buf) < 0 ||
+	    rsp->result != SD_RES_SUCCESS) {
+		sd_err("Fail to save objects on %s: %s",
+		       addr_to_str(bw->node->nid->addr, bw->node->nid->port),
+		       sd_strerror(rsp->result));
+		uatomic_set_true(&work_error);
+	} else
+		memcpy(entries, buf + off, sizeof(*entries) * bw->nr);
+	free(buf);
+}
+
+static void queue_save_node_work(struct save_node *node);
+
+static void save_batch_done(struct work *work)
+{
+	struct save_batch_work *bw = container_of(work, struct save_batch_work,
+						  work);
+	static unsigned long saved;
+
+	saved += bw->nr;
+	if (!uatomic_is_true(&work_error))
+		farm_show_progress(saved, object_tree_size());
+	queue_save_node_work(bw->node);
+	free(bw);
+}
+
+/* Queue the next batch of the node */
+static void queue_save_node_work(struct save_node *node)
+{
+	struct save_batch_work *bw;
+
+	if (uatomic_is_true(&work_error) || node->next == node->nr)
+		return;
+
+	bw = xzalloc(sizeof(*bw));
+	bw->node = node;
+	bw->start = node->next;
+	bw->nr = min(node->nr - node->next, (uint64_t)SAVE_BATCH);
+	node->next += bw->nr;
+	bw->work.fn = do_save_batch;
+	bw->work.done = save_batch_done;
+	queue_work(wq, &bw->work);
+}
+
+/* Let the nodes save the objects, and add the entries to the trunk */
+static int save_on_nodes(struct strbuf *trunk_buf)
+{
+	int ret = -1;
+
+	if (!realpath(farm_dir, save_dir)) {
+		sd_err("Fail to resolve %s: %m", farm_dir);
+		return -1;
+	}
+
+	for_each_object_in_tree(add_save_entry, NULL);
+	wq = create_work_queue("save snapshot", WQ_DYNAMIC);
+	for (int i = 0; i < nr_save_nodes; i++)
+		for (int j = 0; j < SAVE_NODE_JOBS; j++)
+			queue_save_node_work(save_nodes + i);
+
+	work_queue_wait(wq);
+	if (uatomic_is_true(&work_error))
+		goto out;
+
+	for (int i = 0; i < nr_save_nodes; i++)
+		for (uint64_t j = 0; j < save_nodes[i].nr; j++) {
+			struct sd_farm_entry *e = save_nodes[i].entries + j;
+			struct trunk_entry entry = {
+				.oid = e->oid,
+				.nr_copies = e->nr_copies,
+				.copy_policy = e->copy_policy,
+			};
+
+			memcpy(entry.sha1, e->sha1, SHA1_DIGEST_SIZE);
+			strbuf_add(trunk_buf, &entry, sizeof(entry));
+		}
+	ret = 0;
+out:
+	for (int i = 0; i < nr_save_nodes; i++)
+		free(save_nodes[i].entries);
+	free(save_nodes);
+	save_nodes = NULL;
+	nr_save_nodes = 0;
+	return ret;
+}
+
+int farm_save_snapshot(const char *tag, bool multithread, bool on_nodes)
 {
 	unsigned char trunk_sha1[SHA1_DIGEST_SIZE];
 	struct strbuf trunk_buf;
@@ -358,18 +566,24 @@ int farm_save_snapshot(const char *tag, bool multithread)
 
 	strbuf_init(&trunk_buf, sizeof(struct trunk_entry) * nr_objects);
 
-	wq = create_work_queue("save snapshot",
-			       multithread ? WQ_DYNAMIC : WQ_ORDERED);
-	if (for_each_object_in_tree(queue_save_snapshot_work,
-				    &trunk_buf) < 0) {
-		ret = -1;
-		goto out;
-	}
+	if (on_nodes) {
+		ret = save_on_nodes(&trunk_buf);
+		if (ret < 0)
+			goto out;
+	} else {
+		wq = create_work_queue("save snapshot",
+				       multithread ? WQ_DYNAMIC : WQ_ORDERED);
+		if (for_each_object_in_tree(queue_save_snapshot_work,
+					    &trunk_buf) < 0) {
+			ret = -1;
+			goto out;
+		}
 
-	work_queue_wait(wq);
-	if (uatomic_is_true(&work_error)) {
-		ret = -1;
-		goto out;
+		work_queue_wait(wq);
+		if (uatomic_is_true(&work_error)) {
+			ret = -1;
+			goto out;
+		}
 	}
 
 	if (trunk_file_write(nr_objects, (struct trunk_entry *)trunk_buf.buf,
@@ -403,10 +617,12 @@ static void do_load_object(struct work *work)
 
 	sw = container_of(work, struct snapshot_work, work);
 
-	buffer = slice_read(sw->entry.sha1, &size);
-
-	if (!buffer)
-		goto error;
+	/* the inodes loaded before are still needed for the active vdis */
+	if (!sw->loaded || is_vdi_obj(sw->entry.oid)) {
+		buffer = slice_read(sw->entry.sha1, &size);
+		if (!buffer)
+			goto error;
+	}
 
 	vid = oid_to_vid(sw->entry.oid);
 	if (register_vdi(vid)) {
@@ -415,9 +631,10 @@ static void do_load_object(struct work *work)
 			goto error;
 	}
 
-	if (dog_write_object(sw->entry.oid, 0, buffer, size, 0, 0,
-			     sw->entry.nr_copies, sw->entry.copy_policy,
-			     true, true) != 0)
+	if (!sw->loaded &&
+	    dog_write_object_to(sw->node->nid, sw->entry.oid, 0, buffer, size,
+				0, 0, sw->entry.nr_copies,
+				sw->entry.copy_policy, true, true) != 0)
 		goto error;
 
 	if (is_vdi_obj(sw->entry.oid))
@@ -433,24 +650,122 @@ error:
 	uatomic_set_true(&work_error);
 }
 
+static void queue_load_node_work(struct load_node *node);
+
 static void load_object_done(struct work *work)
 {
 	struct snapshot_work *sw = container_of(work, struct snapshot_work,
 						work);
+	off_t off = sw->idx / BITS_PER_BYTE;
 
+	if (!uatomic_is_true(&work_error) && !sw->loaded) {
+		load_bitmap[off] |= 1U << (sw->idx % BITS_PER_BYTE);
+		if (xpwrite(load_fd, load_bitmap + off, 1, off) != 1)
+			sd_err("failed to update %s, %m", load_path);
+	}
+	queue_load_node_work(sw->node);
 	free(sw);
 }
 
+/* Queue the next object of the node */
+static void queue_load_node_work(struct load_node *node)
+{
+	struct snapshot_work *sw;
+	uint64_t idx;
+
+	if (uatomic_is_true(&work_error) || node->next == node->nr)
+		return;
+
+	idx = node->entries[node->next++];
+	sw = xzalloc(sizeof(struct snapshot_work));
+	memcpy(&sw->entry, load_entries + idx, sizeof(struct trunk_entry));
+	idx = sw->idx = load_idx[idx];
+	sw->node = node;
+	sw->loaded = load_bitmap[idx / BITS_PER_BYTE] &
+		(1U << (idx % BITS_PER_BYTE));
+	sw->work.fn = do_load_object;
+	sw->work.done = load_object_done;
+	queue_work(wq, &sw->work);
+}
+
+static struct load_node *load_node_of(const struct node_id *nid)
+{
+	for (int i = 0; i < nr_load_nodes; i++)
+		if (load_nodes[i].nid == nid)
+			return load_nodes + i;
+
+	load_nodes = xrealloc(load_nodes,
+			      sizeof(*load_nodes) * (nr_load_nodes + 1));
+	memset(load_nodes + nr_load_nodes, 0, sizeof(*load_nodes));
+	load_nodes[nr_load_nodes].nid = nid;
+	return load_nodes + nr_load_nodes++;
+}
+
+/* Sort out the entries of the load by the nodes of their first copies */
+static void group_load_entries(void)
+{
+	for (uint64_t i = 0; i < nr_load_entries; i++) {
+		struct load_node *node;
+
+		node = load_node_of(oid_to_gateway(load_entries[i].oid));
+		if (!(node->nr & (node->nr + 1)))
+			node->entries = xrealloc(node->entries,
+						 sizeof(uint64_t) *
+						 (node->nr + 1) * 2);
+		node->entries[node->nr++] = i;
+	}
+}
+
+/* Open the bitmap of the entries of the trunk loaded before */
+static int open_load_bitmap(const unsigned char *trunk_sha1)
+{
+	uint64_t size = DIV_ROUND_UP(trunk_get_count(), BITS_PER_BYTE);
+	struct stat st;
+
+	snprintf(load_path, sizeof(load_path), "%s/load-%s", farm_dir,
+		 sha1_to_hex(trunk_sha1));
+	load_fd = open(load_path, O_RDWR | O_CREAT, 0644);
+	if (load_fd < 0) {
+		sd_err("failed to open %s, %m", load_path);
+		return -1;
+	}
+
+	load_bitmap = xzalloc(size ?: 1);
+	if (fstat(load_fd, &st) == 0 && st.st_size == size && size) {
+		if (xread(load_fd, load_bitmap, size) != size) {
+			sd_err("failed to read %s, %m", load_path);
+			return -1;
+		}
+		sd_info("resuming the load of the snapshot");
+	} else if (ftruncate(load_fd, 0) < 0 || ftruncate(load_fd, size) < 0) {
+		sd_err("failed to truncate %s, %m", load_path);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_load(void)
+{
+	for (int i = 0; i < nr_load_nodes; i++)
+		free(load_nodes[i].entries);
+	free(load_nodes);
+	free(load_entries);
+	free(load_idx);
+	free(load_bitmap);
+	if (load_fd >= 0)
+		close(load_fd);
+}
+
 static int registered_obj_cmp(struct registered_obj_entry *a,
 			      struct registered_obj_entry *b)
 {
 	return intcmp(a->oid, b->oid);
 }
 
-static int queue_load_snapshot_work(struct trunk_entry *entry, void *data)
+static int add_load_entry(struct trunk_entry *entry, void *data)
 {
-	struct snapshot_work *sw;
 	struct registered_obj_entry key;
+	uint64_t idx = nr_trunk_entries++;
 
 	if (obj_to_load > 0) {
 		key.oid = entry->oid;
@@ -459,12 +774,12 @@ static int queue_load_snapshot_work(struct trunk_entry *entry, void *data)
 			return 0;
 	}
 
-	sw = xzalloc(sizeof(struct snapshot_work));
-
-	memcpy(&sw->entry, entry, sizeof(struct trunk_entry));
-	sw->work.fn = do_load_object;
-	sw->work.done = load_object_done;
-	queue_work(wq, &sw->work);
+	if (!load_entries) {
+		load_entries = xmalloc(sizeof(*entry) * trunk_get_count());
+		load_idx = xmalloc(sizeof(uint64_t) * trunk_get_count());
+	}
+	memcpy(load_entries + nr_load_entries, entry, sizeof(*entry));
+	load_idx[nr_load_entries++] = idx;
 
 	return 0;
 }
@@ -556,10 +871,15 @@ int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name)
 		goto out;
 	}
 
-	wq = create_work_queue("load snapshot", WQ_DYNAMIC);
-	if (for_each_entry_in_trunk(trunk_sha1, queue_load_snapshot_work,
-				    NULL) < 0)
+	if (for_each_entry_in_trunk(trunk_sha1, add_load_entry, NULL) < 0 ||
+	    open_load_bitmap(trunk_sha1) < 0)
 		goto out;
+	group_load_entries();
+
+	wq = create_work_queue("load snapshot", WQ_DYNAMIC);
+	for (int i = 0; i < nr_load_nodes; i++)
+		for (int j = 0; j < LOAD_NODE_JOBS; j++)
+			queue_load_node_work(load_nodes + i);
 
 	work_queue_wait(wq);
 	if (uatomic_is_true(&work_error))
@@ -568,8 +888,10 @@ int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name)
 	if (create_active_vdis() < 0)
 		goto out;
 
+	unlink(load_path);
 	ret = 0;
 out:
+	free_load();
 	rb_destroy(&active_vdi_tree, struct active_vdi_entry, rb);
 	rb_destroy(&registered_vdi_tree, struct registered_vdi_entry, rb);
 	rb_destroy(&registered_obj_tree, struct registered_obj_entry, rb);
@@ -61,7 +61,7 @@ struct vdi_option {
 /* farm.c */
 int farm_init(const char *path);
 bool farm_contain_snapshot(uint32_t idx, const char *tag);
-int farm_save_snapshot(const char *tag, bool);
+int farm_save_snapshot(const char *tag, bool, bool);
 int farm_load_snapshot(uint32_t idx, const char *tag, int count, char **name);
 int farm_show_snapshot(uint32_t idx, const char *tag, int count, char **name);
 char *get_object_directory(void);
@@ -86,14 +86,21 @@ int snap_log_write_hdr(struct snap_log_hdr *);
 int sha1_file_write(void *buf, size_t len, unsigned char *sha1);
 void *sha1_file_read(const unsigned char *sha1, size_t *size);
 
+/* pack.c */
+int pack_init(void);
+bool pack_contain(const unsigned char *sha1);
+void *pack_read(const unsigned char *sha1, size_t *size);
+int farm_repack(void);
+
 /* object_tree.c */
 int object_tree_size(void);
 void object_tree_insert(uint64_t oid, uint32_t nr_copies,
-			uint8_t);
+			uint8_t, uint8_t);
 void object_tree_free(void);
 void object_tree_print(void);
 int for_each_object_in_tree(int (*func)(uint64_t oid, uint32_t nr_copies,
-					uint8_t, void *data), void *data);
+					uint8_t, uint8_t, void *data),
+			    void *data);
 /* slice.c */
 int slice_write(void *buf, size_t len, unsigned char *outsha1);
 void *slice_read(const unsigned char *sha1, size_t *outsize);
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pack files of the farm objects
+ *
+ * A snapshot save writes each slice and trunk as a loose file under the fan
+ * out directories of the sha1, which leaves millions of small files after a
+ * few snapshots of a big cluster.  'dog cluster snapshot repack' moves the
+ * loose files into a pack, as git does: objects/pack/pack-<sha1>.pack holds
+ * the files one after the other, and pack-<sha1>.idx the entries sorted by
+ * sha1 with a fan out table of the first byte.  The packs are mapped at
+ * farm_init(), and a lookup is a binary search in the entries of the first
+ * byte, without a file open.  The index is renamed last, so a pack without
+ * its index is not used.
+ */
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "farm.h"
+#include "util.h"
+
+#define PACK_MAGIC 0x5344504b /* SDPK */
+#define PACK_IDX_MAGIC 0x53445049 /* SDPI */
+#define PACK_VERSION 1
+
+struct pack_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nr;
+};
+
+struct pack_idx_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t nr;
+	uint32_t fanout[256]; /* entries whose first byte is up to i */
+};
+
+struct pack_idx_entry {
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	uint32_t length;
+	uint64_t offset; /* in the pack */
+};
+
+struct pack {
+	const struct pack_idx_hdr *idx;
+	const struct pack_idx_entry *entries;
+	const char *data;
+	size_t idx_size, data_size;
+};
+
+static struct pack *packs;
+static int nr_packs;
+
+static void *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		sd_err("failed to map %s, %m", path);
+		return NULL;
+	}
+	*size = st.st_size;
+	return p;
+}
+
+static int pack_open(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	struct pack p;
+	const struct pack_hdr *hdr;
+	int len = strlen(name) - strlen(".idx");
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	p.idx = map_file(path, &p.idx_size);
+	if (!p.idx)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%.*s.pack", dir, len, name);
+	p.data = map_file(path, &p.data_size);
+	if (!p.data) {
+		munmap((void *)p.idx, p.idx_size);
+		return -1;
+	}
+
+	hdr = (const struct pack_hdr *)p.data;
+	if (p.idx_size < sizeof(*p.idx) || p.idx->magic != PACK_IDX_MAGIC ||
+	    p.idx->version != PACK_VERSION ||
+	    p.idx_size != sizeof(*p.idx) + p.idx->nr * sizeof(*p.entries) ||
+	    p.data_size < sizeof(*hdr) || hdr->magic != PACK_MAGIC ||
+	    hdr->nr != p.idx->nr) {
+		sd_err("invalid pack %s", path);
+		munmap((void *)p.idx, p.idx_size);
+		munmap((void *)p.data, p.data_size);
+		return -1;
+	}
+
+	p.entries = (const struct pack_idx_entry *)(p.idx + 1);
+	packs = xrealloc(packs, sizeof(*packs) * (nr_packs + 1));
+	packs[nr_packs++] = p;
+	return 0;
+}
+
+static const char *pack_directory(void)
+{
+	/* room for the pack names after it */
+	static char dir[PATH_MAX - 64];
+
+	snprintf(dir, sizeof(dir), "%s/pack", get_object_directory());
+	return dir;
+}
+
+int pack_init(void)
+{
+	const char *dir = pack_directory();
+	struct dirent *d;
+	DIR *dp;
+
+	if (xmkdir(dir, 0755) < 0) {
+		sd_err("failed to create %s, %m", dir);
+		return -1;
+	}
+
+	dp = opendir(dir);
+	if (!dp) {
+		sd_err("failed to open %s, %m", dir);
+		return -1;
+	}
+	while ((d = readdir(dp))) {
+		const char *dot = strrchr(d->d_name, '.');
+
+		if (strncmp(d->d_name, "pack-", 5) || !dot ||
+		    strcmp(dot, ".idx"))
+			continue;
+		pack_open(dir, d->d_name);
+	}
+	closedir(dp);
+	return 0;
+}
+
+static const struct pack_idx_entry *pack_find(const struct pack *p,
+					      const unsigned char *sha1)
+{
+	uint32_t start = sha1[0] ? p->idx->fanout[sha1[0] - 1] : 0;
+	uint32_t end = p->idx->fanout[sha1[0]];
+
+	while (start < end) {
+		uint32_t mid = start + (end - start) / 2;
+		int cmp = memcmp(p->entries[mid].sha1, sha1, SHA1_DIGEST_SIZE);
+
+		if (!cmp)
+			return p->entries + mid;
+		if (cmp < 0)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	return NULL;
+}
+
+bool pack_contain(const unsigned char *sha1)
+{
+	for (int i = 0; i < nr_packs; i++)
+		if (pack_find(packs + i, sha1))
+			return true;
+	return false;
+}
+
+/* Return a copy of the object in the packs, or NULL if none has it */
+void *pack_read(const unsigned char *sha1, size_t *size)
+{
+	for (int i = 0; i < nr_packs; i++) {
+		const struct pack_idx_entry *e = pack_find(packs + i, sha1);
+		void *buf;
+
+		if (!e)
+			continue;
+		if (e->offset + e->length > packs[i].data_size) {
+			sd_err("invalid entry of %s in a pack",
+			       sha1_to_hex(sha1));
+			return NULL;
+		}
+		buf = xmalloc(e->length);
+		memcpy(buf, packs[i].data + e->offset, e->length);
+		*size = e->length;
+		return buf;
+	}
+	return NULL;
+}
+
+static int entry_cmp(const struct pack_idx_entry *a,
+		     const struct pack_idx_entry *b)
+{
+	return memcmp(a->sha1, b->sha1, SHA1_DIGEST_SIZE);
+}
+
+/* Append the loose files of the fan out directory to the pack */
+static int repack_dir(int nr, int fd, uint64_t *offset,
+		      struct strbuf *entries, struct strbuf *loose)
+{
+	char dir[PATH_MAX - 64], path[PATH_MAX];
+	struct dirent *d;
+	DIR *dp;
+	int ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s/%02x", get_object_directory(), nr);
+	dp = opendir(dir);
+	if (!dp) {
+		sd_err("failed to open %s, %m", dir);
+		return -1;
+	}
+	while ((d = readdir(dp))) {
+		struct pack_idx_entry e = { .offset = *offset };
+		size_t size;
+		void *buf;
+
+		if (strlen(d->d_name) != SHA1_DIGEST_SIZE * 2 - 2)
+			continue;
+		e.sha1[0] = nr;
+		for (int i = 1; i < SHA1_DIGEST_SIZE; i++)
+			if (sscanf(d->d_name + i * 2 - 2, "%2hhx",
+				   e.sha1 + i) != 1)
+				goto next;
+
+		snprintf(path, sizeof(path), "%s/%.40s", dir, d->d_name);
+		strbuf_addstr(loose, path);
+		strbuf_addch(loose, '\0');
+		/* e.g. left by a repack which failed to remove them */
+		if (pack_contain(e.sha1))
+			goto next;
+
+		buf = sha1_file_read(e.sha1, &size);
+		if (!buf) {
+			ret = -1;
+			break;
+		}
+		e.length = size;
+		if (xwrite(fd, buf, size) != size) {
+			sd_err("failed to write the pack, %m");
+			free(buf);
+			ret = -1;
+			break;
+		}
+		*offset += size;
+		strbuf_add(entries, &e, sizeof(e));
+		free(buf);
+next:
+		;
+	}
+	closedir(dp);
+	return ret;
+}
+
+static int write_idx(const char *path, const struct pack_idx_hdr *hdr,
+		     const struct strbuf *entries)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
+	if (xwrite(fd, hdr, sizeof(*hdr)) != sizeof(*hdr) ||
+	    xwrite(fd, entries->buf, entries->len) != entries->len ||
+	    fsync(fd) < 0) {
+		sd_err("failed to write %s, %m", path);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* Move the loose objects of the farm into a new pack */
+int farm_repack(void)
+{
+	struct strbuf entries = STRBUF_INIT, loose = STRBUF_INIT;
+	struct pack_hdr hdr = { PACK_MAGIC, PACK_VERSION, 0 };
+	struct pack_idx_hdr ihdr = { PACK_IDX_MAGIC, PACK_VERSION, 0 };
+	const char *dir = pack_directory();
+	char path[PATH_MAX], tmp[PATH_MAX];
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	uint64_t offset = sizeof(hdr);
+	struct pack_idx_entry *e;
+	int fd, ret = -1;
+
+	snprintf(tmp, sizeof(tmp), "%s/tmp.pack", dir);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", tmp);
+		return -1;
+	}
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	for (int i = 0; i < 256; i++)
+		if (repack_dir(i, fd, &offset, &entries, &loose) < 0)
+			goto out;
+
+	e = (struct pack_idx_entry *)entries.buf;
+	hdr.nr = ihdr.nr = entries.len / sizeof(*e);
+	if (hdr.nr) {
+		if (xpwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    fsync(fd) < 0) {
+			sd_err("failed to write %s, %m", tmp);
+			goto out;
+		}
+		xqsort(e, hdr.nr, entry_cmp);
+		for (uint64_t i = 0; i < hdr.nr; i++)
+			ihdr.fanout[e[i].sha1[0]]++;
+		for (int i = 1; i < 256; i++)
+			ihdr.fanout[i] += ihdr.fanout[i - 1];
+
+		/* named after the sorted entries, as git does */
+		get_buffer_sha1((unsigned char *)entries.buf, entries.len,
+				sha1);
+		snprintf(path, sizeof(path), "%s/pack-%s.pack", dir,
+			 sha1_to_hex(sha1));
+		if (rename(tmp, path) < 0)
+			goto out;
+		snprintf(tmp, sizeof(tmp), "%s/tmp.idx", dir);
+		snprintf(path, sizeof(path), "%s/pack-%s.idx", dir,
+			 sha1_to_hex(sha1));
+		if (write_idx(tmp, &ihdr, &entries) < 0 ||
+		    rename(tmp, path) < 0)
+			goto out;
+	} else
+		unlink(tmp);
+
+	for (char *p = loose.buf; p < loose.buf + loose.len;
+	     p += strlen(p) + 1)
+		if (unlink(p) < 0)
+			sd_err("failed to remove %s, %m", p);
+
+	printf("packed %"PRIu64" objects\n", hdr.nr);
+	ret = 0;
+out:
+	if (ret)
+		sd_err("failed to repack %s", dir);
+	close(fd);
+	strbuf_release(&entries);
+	strbuf_release(&loose);
+	return ret;
+}
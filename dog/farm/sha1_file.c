@@ -84,12 +84,80 @@ err_open:
 	return ret;
 }
 
+/*
+ * The sha1 of the files written or found by this dog, so that the slices
+ * shared by the objects, e.g. the zeroed ones, are written once without a
+ * lookup of the file each.  The table is open addressed by the head of the
+ * sha1 and doubled at 3/4 full.
+ */
+static struct {
+	struct sd_mutex lock;
+	unsigned char (*sha1)[SHA1_DIGEST_SIZE];
+	size_t nr, size;
+} known = { .lock = SD_MUTEX_INITIALIZER };
+
+static const unsigned char null_sha1[SHA1_DIGEST_SIZE];
+
+static size_t known_slot(const unsigned char *sha1)
+{
+	uint64_t head;
+	size_t i;
+
+	memcpy(&head, sha1, sizeof(head));
+	for (i = head & (known.size - 1);
+	     memcmp(known.sha1[i], null_sha1, SHA1_DIGEST_SIZE) &&
+	     memcmp(known.sha1[i], sha1, SHA1_DIGEST_SIZE);
+	     i = (i + 1) & (known.size - 1))
+		;
+	return i;
+}
+
+static void known_grow(void)
+{
+	unsigned char (*old)[SHA1_DIGEST_SIZE] = known.sha1;
+	size_t old_size = known.size;
+
+	known.size = old_size ? old_size * 2 : 4096;
+	known.sha1 = xcalloc(known.size, SHA1_DIGEST_SIZE);
+	for (size_t i = 0; i < old_size; i++)
+		if (memcmp(old[i], null_sha1, SHA1_DIGEST_SIZE))
+			memcpy(known.sha1[known_slot(old[i])], old[i],
+			       SHA1_DIGEST_SIZE);
+	free(old);
+}
+
+/* Return true if the sha1 is known, or add it */
+static bool known_test_and_add(const unsigned char *sha1)
+{
+	bool found = false;
+	size_t i;
+
+	/* the all zero sha1 marks the free slots */
+	if (!memcmp(sha1, null_sha1, SHA1_DIGEST_SIZE))
+		return false;
+
+	sd_mutex_lock(&known.lock);
+	if ((known.nr + 1) * 4 > known.size * 3)
+		known_grow();
+	i = known_slot(sha1);
+	if (memcmp(known.sha1[i], null_sha1, SHA1_DIGEST_SIZE))
+		found = true;
+	else {
+		memcpy(known.sha1[i], sha1, SHA1_DIGEST_SIZE);
+		known.nr++;
+	}
+	sd_mutex_unlock(&known.lock);
+	return found;
+}
+
 int sha1_file_write(void *buf, size_t len, unsigned char *outsha1)
 {
 	unsigned char sha1[SHA1_DIGEST_SIZE];
 
 	get_buffer_sha1(buf, len, sha1);
-	if (sha1_buffer_write(sha1, buf, len) < 0)
+	/* a failed write fails the whole snapshot */
+	if (!known_test_and_add(sha1) && !pack_contain(sha1) &&
+	    sha1_buffer_write(sha1, buf, len) < 0)
 		return -1;
 	if (outsha1)
 		memcpy(outsha1, sha1, SHA1_DIGEST_SIZE);
@@ -112,10 +180,20 @@ static int verify_sha1_file(const unsigned char *sha1,
 void *sha1_file_read(const unsigned char *sha1, size_t *size)
 {
 	char *filename = sha1_to_path(sha1);
-	int fd = open(filename, O_RDONLY);
 	struct stat st;
-	void *buf = NULL;
+	void *buf;
+	int fd;
+
+	buf = pack_read(sha1, size);
+	if (buf) {
+		if (verify_sha1_file(sha1, buf, *size) < 0) {
+			free(buf);
+			return NULL;
+		}
+		return buf;
+	}
 
+	fd = open(filename, O_RDONLY);
 	if (fd < 0) {
 		perror(filename);
 		return NULL;
@@ -12,8 +12,12 @@
  */
 
 /*
- * Slice is a fixed chunk of one object to be stored in farm. We slice
- * the object into smaller chunks to get better deduplication.
+ * Slice is a chunk of one object to be stored in farm. We slice the object
+ * into smaller chunks to get better deduplication.
+ *
+ * The slices are cut by slice_cut(), see lib/slice.c.  The slice file only
+ * lists the sha1 of the slices, so the fixed slices of the older snapshots
+ * read back the same way.
  */
 
 #include <pthread.h>
@@ -21,6 +25,7 @@
 #include <unistd.h>
 
 #include "farm.h"
+#include "slice.h"
 #include "strbuf.h"
 #include "util.h"
 #include "sheepdog_proto.h"
@@ -34,24 +39,23 @@ struct slice_file {
 	struct slice *slices;
 };
 
-/* 128k, best empirical value from some tests, but no rationale */
-#define SLICE_SIZE (1024*128)
-
 int slice_write(void *buf, size_t len, unsigned char *outsha1)
 {
-	int count = DIV_ROUND_UP(len, SLICE_SIZE);
-	size_t slen = count * SHA1_DIGEST_SIZE;
-	char *sbuf = xmalloc(slen);
+	int count = DIV_ROUND_UP(len, SLICE_MIN_SIZE);
+	size_t slen = 0;
+	char *sbuf = xmalloc(count * SHA1_DIGEST_SIZE);
 	char *p = buf;
 
-	for (int i = 0; i < count; i++, p += SLICE_SIZE) {
+	while (len > 0) {
 		unsigned char sha1[SHA1_DIGEST_SIZE];
-		size_t wlen = (ssize_t)len - SLICE_SIZE > 0 ? SLICE_SIZE : len;
-		len -= SLICE_SIZE;
+		size_t wlen = slice_cut((uint8_t *)p, len);
 
 		if (sha1_file_write(p, wlen, sha1) < 0)
 			goto err;
-		memcpy(sbuf + i * SHA1_DIGEST_SIZE, sha1, SHA1_DIGEST_SIZE);
+		memcpy(sbuf + slen, sha1, SHA1_DIGEST_SIZE);
+		slen += SHA1_DIGEST_SIZE;
+		p += wlen;
+		len -= wlen;
 	}
 
 	if (sha1_file_write(sbuf, slen, outsha1) < 0)
@@ -18,6 +18,10 @@ static struct node_cmd_data {
 	bool local;
 	bool force;
 	bool io_addr;
+	bool latency;
+	bool locks;
+	bool throttle;
+	struct recovery_throttle recovery_throttle;
 } node_cmd_data;
 
 static void cal_total_vdi_size(uint32_t vid, const char *name, const char *tag,
@@ -228,11 +232,47 @@ static int node_recovery_progress(void)
 	return result < 0 ? EXIT_SYSFAIL : EXIT_SUCCESS;
 }
 
+/* Set the recovery throttle of all the nodes */
+static int node_recovery_throttle(void)
+{
+	const struct recovery_throttle *t = &node_cmd_data.recovery_throttle;
+	struct sd_node *n;
+	int ret;
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct sd_req req;
+		struct sd_rsp *rsp = (struct sd_rsp *)&req;
+
+		if (n->nid.status == NODE_STATUS_OFFLINE || node_dead(n))
+			continue;
+
+		sd_init_req(&req, SD_OP_RECOVERY_THROTTLE);
+		req.flags = SD_FLAG_CMD_WRITE;
+		req.data_length = sizeof(*t);
+
+		ret = dog_exec_req(&n->nid, &req, (void *)t);
+		if (ret < 0)
+			return EXIT_SYSFAIL;
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("%s: %s", addr_to_str(n->nid.addr, n->nid.port),
+			       sd_strerror(rsp->result));
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("Recovery throttle: %s/s, %"PRIu32" objects/s"
+	       " (0 for no limit)\n", strnumber(t->max_bw), t->max_objs);
+	return EXIT_SUCCESS;
+}
+
 static int node_recovery(int argc, char **argv)
 {
 	struct sd_node *n;
 	int ret, i = 0;
 
+	if (node_cmd_data.throttle)
+		return node_recovery_throttle();
+
 	if (node_cmd_data.recovery_progress)
 		return node_recovery_progress();
 
@@ -399,14 +439,217 @@ static int node_kill(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static const char *lat_op_name(uint8_t opcode)
+{
+	switch (opcode) {
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		return "Create";
+	case SD_OP_READ_OBJ:
+		return "Read";
+	case SD_OP_WRITE_OBJ:
+		return "Write";
+	case SD_OP_REMOVE_OBJ:
+		return "Remove";
+	case SD_OP_DISCARD_OBJ:
+		return "Discard";
+	case SD_OP_FLUSH_VDI:
+		return "Flush";
+	case SD_OP_CREATE_AND_WRITE_PEER:
+		return "CreatePeer";
+	case SD_OP_READ_PEER:
+		return "ReadPeer";
+	case SD_OP_WRITE_PEER:
+		return "WritePeer";
+	case SD_OP_REMOVE_PEER:
+		return "RemovePeer";
+	default:
+		return "Others";
+	}
+}
+
+static const char * const lat_stage_names[SD_LAT_NR_STAGES] = {
+	[SD_LAT_RX] = "rx",
+	[SD_LAT_QUEUE] = "queue",
+	[SD_LAT_WORK] = "work",
+	[SD_LAT_PEER] = "peer",
+	[SD_LAT_STORE] = "store",
+	[SD_LAT_TX] = "tx",
+	[SD_LAT_TOTAL] = "total",
+};
+
+/* Return the upper bound of the bucket where the percentile falls, in us */
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t count,
+			       double percent)
+{
+	uint64_t rank = (uint64_t)(count * percent / 100), sum = 0;
+	int i;
+
+	for (i = 0; i < SD_LAT_NR_BUCKETS - 1; i++) {
+		sum += hist[i];
+		if (sum > rank)
+			break;
+	}
+	return sd_lat_bucket_min(i + 1);
+}
+
+static void print_latency(const struct sd_latency_stat *lat,
+			  const struct sd_latency_stat *last)
+{
+	uint64_t hist[SD_LAT_NR_BUCKETS], count;
+
+	if (!raw_output)
+		printf("Op\tStage\tCount\tp50(us)\tp99(us)\tp999(us)\n");
+
+	for (int i = 0; i < SD_LAT_NR_OPS; i++) {
+		for (int j = 0; j < SD_LAT_NR_STAGES; j++) {
+			count = 0;
+			for (int k = 0; k < SD_LAT_NR_BUCKETS; k++) {
+				hist[k] = lat->hist[i][j][k];
+				if (last)
+					hist[k] -= last->hist[i][j][k];
+				count += hist[k];
+			}
+			if (!count)
+				continue;
+
+			printf("%s\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t"
+			       "%"PRIu64"\n", lat_op_name(lat->opcodes[i]),
+			       lat_stage_names[j], count,
+			       lat_percentile(hist, count, 50),
+			       lat_percentile(hist, count, 99),
+			       lat_percentile(hist, count, 99.9));
+		}
+	}
+}
+
+static int node_latency_stat(void)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t len = sizeof(struct sd_stat) + sizeof(struct sd_latency_stat);
+	struct sd_latency_stat *lat, *last = NULL;
+	char *buf = xmalloc(len);
+	int ret = EXIT_SUCCESS;
+
+	lat = (struct sd_latency_stat *)(buf + sizeof(struct sd_stat));
+again:
+	sd_init_req(&hdr, SD_OP_STAT);
+	hdr.data_length = len;
+	hdr.stat.version = SD_STAT_VERSION_LATENCY;
+	if (dog_exec_req(&sd_nid, &hdr, buf) < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get stat information: %s",
+		       sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (rsp->data_length < len) {
+		sd_err("the node doesn't support latency stat");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (node_cmd_data.watch) {
+		/* show the latencies of the last second */
+		if (last)
+			print_latency(lat, last);
+		else
+			last = xmalloc(sizeof(*last));
+		memcpy(last, lat, sizeof(*last));
+		sleep(1);
+		goto again;
+	}
+	print_latency(lat, NULL);
+out:
+	free(last);
+	free(buf);
+	return ret;
+}
+
+#define LOCK_STAT_MAX 4096
+
+static int lock_stat_cmp(const struct sd_lock_stat *a,
+			 const struct sd_lock_stat *b)
+{
+	return intcmp(b->wait_ns, a->wait_ns);
+}
+
+/* Return the upper bound of the bucket where the percentile falls, in us */
+static uint64_t lock_percentile(const struct sd_lock_stat *ls, double percent)
+{
+	uint64_t rank = (uint64_t)(ls->nr_contended * percent / 100), sum = 0;
+	int i;
+
+	for (i = 0; i < SD_LOCK_NR_BUCKETS - 1; i++) {
+		sum += ls->wait_hist[i];
+		if (sum > rank)
+			break;
+	}
+	return UINT64_C(1) << i;
+}
+
+static int node_lock_stat(void)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t len = sizeof(struct sd_lock_stat) * LOCK_STAT_MAX;
+	struct sd_lock_stat *ls = xmalloc(len);
+	int ret = EXIT_SUCCESS, nr;
+
+	sd_init_req(&hdr, SD_OP_GET_LOCK_STAT);
+	hdr.data_length = len;
+	if (dog_exec_req(&sd_nid, &hdr, ls) < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		if (rsp->result == SD_RES_NO_SUPPORT)
+			sd_err("the node isn't built with --enable-lockstat");
+		else
+			sd_err("failed to get lock stat: %s",
+			       sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*ls);
+	xqsort(ls, nr, lock_stat_cmp);
+	if (!raw_output)
+		printf("Lock\tSite\tAcquired\tContended\tWait(us)\t"
+		       "p99(us)\tMax(us)\tHold(us)\tBlocking\n");
+	for (int i = 0; i < nr; i++)
+		printf("%s\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t"
+		       "%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n", ls[i].name,
+		       ls[i].site, ls[i].nr_acquired, ls[i].nr_contended,
+		       ls[i].wait_ns / 1000,
+		       ls[i].nr_contended ? lock_percentile(ls + i, 99) : 0,
+		       ls[i].max_wait_ns / 1000, ls[i].hold_ns / 1000,
+		       ls[i].nr_blocking);
+out:
+	free(ls);
+	return ret;
+}
+
 static int node_stat(int argc, char **argv)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	struct sd_stat stat, last = { { 0 } };
+	/* older sheep doesn't fill the trailing counters */
+	struct sd_stat stat = { { 0 } }, last = { { 0 } };
+	uint64_t lookups;
 	int ret;
 	bool watch = node_cmd_data.watch ? true : false, first = true;
 
+	if (node_cmd_data.latency)
+		return node_latency_stat();
+	if (node_cmd_data.locks)
+		return node_lock_stat();
 again:
 	sd_init_req(&hdr, SD_OP_STAT);
 	hdr.data_length = sizeof(stat);
@@ -473,6 +716,69 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+		printf("%s%"PRIu64"\n",
+		       raw_output ? "" : "Expired\t", stat.r.expired_nr);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nFD cache\tCached\tHit\tMiss\tEvict\n\t\t",
+		       stat.fd.nr, stat.fd.hit, stat.fd.miss, stat.fd.evict);
+		lookups = stat.pc.hit + stat.pc.miss;
+		printf("%s%"PRIu64"\t%"PRIu64"\t%.1f%%\n",
+		       raw_output ? "" :
+		       "\nPlacement cache\tHit\tMiss\tHit rate\n\t\t",
+		       stat.pc.hit, stat.pc.miss,
+		       lookups ? 100.0 * stat.pc.hit / lookups : 0.0);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%s\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nBuffer pool\tAlloc\tHit\tMiss\tCached\tTrimmed\n\t\t",
+		       stat.bp.alloc, stat.bp.hit, stat.bp.miss,
+		       strnumber(stat.bp.cached), stat.bp.trimmed);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nDedup\t\tShared\tDiffered\tRecovered\n\t\t",
+		       stat.dd.shared, stat.dd.differed, stat.dd.recovered);
+		printf("%s%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nPool\t\tClaimed\tMissed\n\t\t",
+		       stat.pool.claimed, stat.pool.missed);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nKV cache\tHit\tMiss\tStale\n\t\t",
+		       stat.kv_cache.hit, stat.kv_cache.miss,
+		       stat.kv_cache.stale);
+		printf("%s%"PRIu64"\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+		       raw_output ? "" :
+		       "\nScrub\t\tScanned\tBytes\tMismatch\tRepaired\tFailed"
+		       "\n\t\t",
+		       stat.scrub.scanned, strnumber(stat.scrub.bytes),
+		       stat.scrub.mismatched, stat.scrub.repaired,
+		       stat.scrub.failed);
+		printf("%s%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%s\n",
+		       raw_output ? "" :
+		       "\nRead cache\tHit\tMiss\tEvict\tCached\n\t\t",
+		       stat.rc.hit, stat.rc.miss, stat.rc.evict,
+		       strnumber(stat.rc.cached));
+		printf("%s%s\t%s\t%s\t%.3f\n",
+		       raw_output ? "" :
+		       "\nWire\t\tRaw\tDeflated\tInflated\tTime(s)\n\t\t",
+		       strnumber(stat.wire.raw), strnumber(stat.wire.deflated),
+		       strnumber(stat.wire.inflated),
+		       (double)stat.wire.ns / 1000000000);
+		printf("%s", raw_output ? "" : "\nLoop lag\t<1ms\t<4ms\t<16ms\t"
+		       "<64ms\t<256ms\t<1s\tMore\tMax(ms)\tStalls\n\t\t");
+		for (int i = 0; i < SD_LOOP_NR_BUCKETS; i++)
+			printf("%"PRIu64"\t", stat.loop.lag[i]);
+		printf("%"PRIu64"\t%"PRIu64"\n", stat.loop.max_lag / 1000000,
+		       stat.loop.stalls);
+		printf("%s", raw_output ? "" : "\nMemory\t\tUsed\tCap\n");
+		for (int i = 0; i < SD_MEM_NR_TAGS; i++)
+			printf("%s\t%s%s\t%s\n", sd_mem_tag_name(i),
+			       raw_output ? "" : "\t",
+			       strnumber(stat.mem.used[i]),
+			       stat.mem.cap[i] ? strnumber(stat.mem.cap[i]) :
+			       "-");
+		printf("%s%"PRIu64"\n", raw_output ? "" : "Throttled\t",
+		       stat.mem.throttled);
 	}
 
 	return EXIT_SUCCESS;
@@ -483,7 +789,8 @@ static int node_md_info(struct node_id *nid)
 	struct sd_md_info info = {};
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, i;
+	int ret, i, nr_fast = 0;
+	bool tiered;
 
 	sd_init_req(&hdr, SD_OP_MD_INFO);
 	hdr.data_length = sizeof(info);
@@ -498,24 +805,42 @@ static int node_md_info(struct node_id *nid)
 		return EXIT_FAILURE;
 	}
 
+	/* Show the tiers only if the node has both */
+	for (i = 0; i < info.nr; i++)
+		nr_fast += info.disk[i].fast;
+	tiered = nr_fast && nr_fast < info.nr;
+
 	for (i = 0; i < info.nr; i++) {
 		uint64_t size = info.disk[i].free + info.disk[i].used;
 		int ratio = (int)(((double)info.disk[i].used / size) * 100);
+		const char *tier = !tiered ? "" :
+			info.disk[i].fast ? " (fast)" : " (slow)";
+		const char *degraded = info.disk[i].slow ? " (degraded)" : "";
 
 		if (raw_output)
-			fprintf(stdout, "%s %d %s %s %s %d%% %s\n",
+			fprintf(stdout, "%s %d %s %s %s %d%% %s %"PRIu32" %"PRIu32
+				" %s%s%s\n",
 				addr_to_str(nid->addr, nid->port),
 				info.disk[i].idx, strnumber(size),
 				strnumber(info.disk[i].used),
 				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
+				ratio, strnumber(info.disk[i].stale),
+				info.disk[i].lat_us, info.disk[i].p99_us,
+				info.disk[i].path, tier, degraded);
 		else
-			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\n",
+			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\t%.1fms\t"
+				"%.1fms\t%s%s%s\n",
 				info.disk[i].idx, strnumber(size),
 				strnumber(info.disk[i].used),
 				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
+				ratio, strnumber(info.disk[i].stale),
+				info.disk[i].lat_us / 1000.0,
+				info.disk[i].p99_us / 1000.0,
+				info.disk[i].path, tier, degraded);
 	}
+	if (tiered && !raw_output)
+		fprintf(stdout, "\t%"PRIu32" hot objects on the fast tier\n",
+			info.nr_hot);
 	return EXIT_SUCCESS;
 }
 
@@ -525,7 +850,8 @@ static int md_info(int argc, char **argv)
 	int ret, i = 0;
 
 	if (!raw_output)
-		fprintf(stdout, "Id\tSize\tUsed\tAvail\tUse%%\tPath\n");
+		fprintf(stdout, "Id\tSize\tUsed\tAvail\tUse%%\tStale\tLat\t"
+			"P99\tPath\n");
 
 	if (!node_cmd_data.all_nodes)
 		return node_md_info(&sd_nid);
@@ -611,6 +937,152 @@ static int node_md(int argc, char **argv)
 	return do_generic_subcommand(node_md_cmd, argc, argv);
 }
 
+/* <bandwidth>[:<objects per second>], e.g. 100M:50 */
+static int parse_recovery_throttle(const char *opt,
+				   struct recovery_throttle *t)
+{
+	char *bw = xstrdup(opt), *objs = strchr(bw, ':'), *p;
+	int ret = -1;
+
+	memset(t, 0, sizeof(*t));
+	if (objs)
+		*objs++ = '\0';
+	if (option_parse_size(bw, &t->max_bw) < 0)
+		goto out;
+	if (objs) {
+		unsigned long n = strtoul(objs, &p, 10);
+
+		if (objs == p || *p != '\0' || n > UINT32_MAX)
+			goto out;
+		t->max_objs = n;
+	}
+	ret = 0;
+out:
+	free(bw);
+	return ret;
+}
+
+#define SLOW_DEFAULT_NR 10
+
+struct node_span {
+	struct sd_span span;
+	const struct sd_node *node;
+};
+
+static int node_span_cmp(const struct node_span *a, const struct node_span *b)
+{
+	/* the slowest first */
+	return -intcmp(a->span.us[SD_LAT_TOTAL], b->span.us[SD_LAT_TOTAL]);
+}
+
+/* Get the spans of the peers of the ids, or the slowest ones if nr is 0 */
+static int get_spans(const struct sd_node *n, const uint64_t *ids, uint32_t nr,
+		     struct sd_span *spans, uint32_t len)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+
+	sd_init_req(&hdr, SD_OP_GET_SPANS);
+	hdr.data_length = len;
+	hdr.span.nr = nr;
+	if (nr) {
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		memcpy(spans, ids, nr * sizeof(*ids));
+	}
+	if (dog_exec_req(&n->nid, &hdr, spans) < 0)
+		return -1;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the spans of %s: %s",
+		       addr_to_str(n->nid.addr, n->nid.port),
+		       sd_strerror(rsp->result));
+		return -1;
+	}
+	return rsp->data_length / sizeof(*spans);
+}
+
+static void print_span(const struct sd_node *n, const struct sd_span *span,
+		       bool peer)
+{
+	char time_str[128];
+	struct tm tm;
+	time_t ti = span->time;
+
+	localtime_r(&ti, &tm);
+	strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s%s\t%s\t%016"PRIx64"\t%s", peer ? "  " : "",
+	       addr_to_str(n->nid.addr, n->nid.port),
+	       lat_op_name(span->opcode), span->oid, time_str);
+	for (int i = 0; i < SD_LAT_NR_STAGES; i++)
+		printf("\t%"PRIu32, span->us[i]);
+	printf("\n");
+}
+
+/* Show the slowest requests of the cluster with the stages on the peers */
+static int node_slow(int argc, char **argv)
+{
+	uint32_t nr = SLOW_DEFAULT_NR, nr_slow = 0, nr_peers = 0, len;
+	struct node_span *slow = xcalloc(sd_nodes_nr * SD_SPAN_SLOWEST,
+					 sizeof(*slow)), *peers;
+	struct sd_span *spans;
+	uint64_t *ids;
+	struct sd_node *n;
+	int ret;
+
+	if (optind < argc) {
+		nr = strtoul(argv[optind], NULL, 10);
+		if (!nr) {
+			sd_err("Invalid number of requests '%s'", argv[optind]);
+			exit(EXIT_USAGE);
+		}
+	}
+
+	/* the peer spans of an id are at most its copies on a node */
+	len = max(nr, (uint32_t)SD_SPAN_SLOWEST) * SD_MAX_COPIES *
+		sizeof(*spans);
+	spans = xmalloc(len);
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		ret = get_spans(n, NULL, 0, spans, len);
+		for (int i = 0; i < ret; i++) {
+			slow[nr_slow].span = spans[i];
+			slow[nr_slow++].node = n;
+		}
+	}
+	xqsort(slow, nr_slow, node_span_cmp);
+	nr = min(nr, nr_slow);
+
+	ids = xmalloc(nr * sizeof(*ids));
+	for (int i = 0; i < nr; i++)
+		ids[i] = slow[i].span.id;
+	peers = xcalloc(sd_nodes_nr * len / sizeof(*spans), sizeof(*peers));
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		ret = get_spans(n, ids, nr, spans, len);
+		for (int i = 0; i < ret; i++) {
+			peers[nr_peers].span = spans[i];
+			peers[nr_peers++].node = n;
+		}
+	}
+
+	if (!raw_output) {
+		printf("Node\tOp\tOid\tTime");
+		for (int i = 0; i < SD_LAT_NR_STAGES; i++)
+			printf("\t%s(us)", lat_stage_names[i]);
+		printf("\n");
+	}
+	for (int i = 0; i < nr; i++) {
+		print_span(slow[i].node, &slow[i].span, false);
+		for (int j = 0; j < nr_peers; j++)
+			if (peers[j].span.id == ids[i] &&
+			    peers[j].span.oid == slow[i].span.oid)
+				print_span(peers[j].node, &peers[j].span, true);
+	}
+
+	free(peers);
+	free(ids);
+	free(spans);
+	free(slow);
+	return EXIT_SUCCESS;
+}
+
 static int node_parser(int ch, const char *opt)
 {
 	switch (ch) {
@@ -632,6 +1104,21 @@ static int node_parser(int ch, const char *opt)
 	case 'i':
 		node_cmd_data.io_addr = true;
 		break;
+	case 'L':
+		node_cmd_data.latency = true;
+		break;
+	case 'k':
+		node_cmd_data.locks = true;
+		break;
+	case 't':
+		if (parse_recovery_throttle(opt,
+				&node_cmd_data.recovery_throttle) < 0) {
+			sd_err("Invalid throttle '%s', it should be "
+			       "<bandwidth>[:<objects per second>]", opt);
+			exit(EXIT_USAGE);
+		}
+		node_cmd_data.throttle = true;
+		break;
 	}
 
 	return 0;
@@ -644,6 +1131,12 @@ static struct sd_option node_options[] = {
 	{'l', "local", false, "issue request to local node"},
 	{'f', "force", false, "ignore the confirmation"},
 	{'i', "io", false, "show data io address"},
+	{'L', "latency", false, "show latency percentiles of the requests"},
+	{'k', "locks", false, "show the contention of the locks by the call"
+	 " sites, of a sheep built with --enable-lockstat"},
+	{'t', "throttle", true, "limit the recovery of all the nodes to\n"
+	 "                          <bandwidth>[:<objects per second>], which\n"
+	 "                          is lowered by the client I/O, 0 for no limit"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -741,16 +1234,19 @@ static struct subcommand node_cmd[] = {
 	 CMD_NEED_NODELIST, node_list, node_options},
 	{"info", NULL, "aprhT", "show information about each node", NULL,
 	 CMD_NEED_NODELIST, node_info},
-	{"recovery", NULL, "aphPrT", "show recovery information of nodes", NULL,
+	{"recovery", NULL, "aphPrtT", "show recovery information of nodes", NULL,
 	 CMD_NEED_NODELIST, node_recovery, node_options},
 	{"md", "[disks]", "aprAfhT", "See 'dog node md' for more information",
 	 node_md_cmd, CMD_NEED_ARG, node_md, node_options},
-	{"stat", NULL, "aprwhT", "show stat information about the node", NULL,
+	{"stat", NULL, "aprwLkhT", "show stat information about the node", NULL,
 	 0, node_stat, node_options},
 	{"log", NULL, "aphT", "show or set log level of the node", node_log_cmd,
 	 CMD_NEED_ARG, node_log},
 	{"ping", "<node id>", "aprhlT", "ping node", NULL,
 	 CMD_NEED_NODELIST, node_ping, node_options},
+	{"slow", "[nr]", "aprhT", "show the slowest requests of the cluster"
+	 " with the stages on the peers", NULL,
+	 CMD_NEED_NODELIST, node_slow},
 	{NULL,},
 };
 
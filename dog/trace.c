@@ -24,6 +24,7 @@
 #include "rbtree.h"
 #include "list.h"
 #include "internal_proto.h"
+#include "strbuf.h"
 
 static inline void print_thread_name(struct trace_graph_item *item)
 {
@@ -75,7 +76,12 @@ static void cat_trace_file(void *buf, size_t size)
 
 static const char *tracefile = "/tmp/tracefile";
 
-static int trace_read_buffer(void)
+static struct trace_cmd_data {
+	bool watch;
+} trace_cmd_data;
+
+/* Read the trace buffers of the node into the trace file, after it if append */
+static int trace_read_buffer(bool append)
 {
 	int ret, tfd;
 	int rval = EXIT_SUCCESS;
@@ -84,7 +90,8 @@ static int trace_read_buffer(void)
 #define TRACE_BUF_LEN      (1024 * 1024 * 20)
 	char *buf = xmalloc(TRACE_BUF_LEN);
 
-	tfd = open(tracefile, O_CREAT | O_RDWR | O_APPEND | O_TRUNC, 0644);
+	tfd = open(tracefile, O_CREAT | O_RDWR | O_APPEND |
+		   (append ? 0 : O_TRUNC), 0644);
 	if (tfd < 0) {
 		sd_err("can't create tracefile");
 		rval = EXIT_SYSFAIL;
@@ -115,6 +122,8 @@ read_buffer:
 		goto read_buffer;
 
 out:
+	if (tfd >= 0)
+		close(tfd);
 	free(buf);
 	return rval;
 }
@@ -180,7 +189,23 @@ static int trace_disable(int argc, char **argv)
 		return EXIT_SYSFAIL;
 	}
 
-	return trace_read_buffer();
+	return trace_read_buffer(false);
+}
+
+/*
+ * Read the buffers of a tracer left enabled, as the sample one.  With -w, the
+ * buffers are read every second and appended to the trace file, which keeps
+ * the bounded buffers of the node from dropping the items.
+ */
+static int trace_dump(int argc, char **argv)
+{
+	int ret = trace_read_buffer(false);
+
+	while (ret == EXIT_SUCCESS && trace_cmd_data.watch) {
+		sleep(1);
+		ret = trace_read_buffer(true);
+	}
+	return ret;
 }
 
 static int trace_status(int argc, char **argv)
@@ -251,12 +276,100 @@ static int graph_cat(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * The call trees of the threads are rebuilt from the returns, which carry the
+ * entry and return time of the calls: the caller of a call is the last call of
+ * the thread at a lower depth which is still running when it returns.  The
+ * items of a thread may be in the buffers of different cpus, so they are
+ * sorted by the thread and the entry time first.
+ */
+struct graph_call {
+	const struct trace_graph_item *item;
+	int parent; /* the index of the caller, or -1 */
+	uint64_t children; /* the time spent in the callees, in ns */
+};
+
+static struct graph_call *calls;
+static size_t nr_calls;
+
+static inline uint64_t call_total(const struct graph_call *call)
+{
+	return call->item->return_time - call->item->entry_time;
+}
+
+static inline uint64_t call_self(const struct graph_call *call)
+{
+	uint64_t total = call_total(call);
+
+	return total > call->children ? total - call->children : 0;
+}
+
+static int graph_call_cmp(const void *a, const void *b)
+{
+	const struct trace_graph_item *ia = ((const struct graph_call *)a)->item;
+	const struct trace_graph_item *ib = ((const struct graph_call *)b)->item;
+	int ret = strcmp(ia->tname, ib->tname);
+
+	if (ret)
+		return ret;
+	if (ia->entry_time != ib->entry_time)
+		return intcmp(ia->entry_time, ib->entry_time);
+	return intcmp(ia->depth, ib->depth);
+}
+
+static void build_calls(void *buf, size_t size)
+{
+	struct trace_graph_item *item = (struct trace_graph_item *)buf;
+	size_t sz = size / sizeof(struct trace_graph_item), top = 0;
+	int *stack;
+
+	calls = xcalloc(sz, sizeof(*calls));
+	for (size_t i = 0; i < sz; i++, item++)
+		if (item->type == TRACE_GRAPH_RETURN)
+			calls[nr_calls++].item = item;
+	qsort(calls, nr_calls, sizeof(*calls), graph_call_cmp);
+
+	stack = xcalloc(nr_calls + 1, sizeof(*stack));
+	for (size_t i = 0; i < nr_calls; i++) {
+		const struct trace_graph_item *it = calls[i].item;
+
+		if (i && strcmp(it->tname, calls[i - 1].item->tname))
+			top = 0;
+		while (top) {
+			const struct trace_graph_item *p =
+				calls[stack[top - 1]].item;
+
+			if (p->depth < it->depth &&
+			    p->return_time >= it->return_time)
+				break;
+			top--;
+		}
+
+		calls[i].parent = top ? stack[top - 1] : -1;
+		if (top)
+			calls[stack[top - 1]].children += call_total(calls + i);
+		stack[top++] = i;
+	}
+	free(stack);
+}
+
+/* Append the frames of the call, from the outermost one, to buf */
+static void add_call_stack(struct strbuf *buf, int idx, const char *sep)
+{
+	if (calls[idx].parent >= 0) {
+		add_call_stack(buf, calls[idx].parent, sep);
+		strbuf_addstr(buf, sep);
+	}
+	strbuf_addstr(buf, calls[idx].item->fname);
+}
+
 struct graph_stat_entry {
 	struct rb_node rb;
 	struct list_node list;
 	char fname[TRACE_FNAME_LEN];
 	uint64_t duration;
-	uint16_t nr_calls;
+	uint64_t self;
+	uint64_t nr_calls;
 };
 
 static struct rb_root stat_tree_root;
@@ -277,20 +390,20 @@ stat_tree_insert(struct graph_stat_entry *new)
 	entry = rb_insert(&stat_tree_root, new, rb, graph_stat_cmp);
 	if (entry) {
 		entry->duration += new->duration;
+		entry->self += new->self;
 		entry->nr_calls++;
 	}
 	return entry;
 }
 
-static void prepare_stat_tree(struct trace_graph_item *item)
+static void prepare_stat_tree(const struct graph_call *call)
 {
 	struct graph_stat_entry *new;
 
-	if (item->type != TRACE_GRAPH_RETURN)
-		return;
 	new = xmalloc(sizeof(*new));
-	pstrcpy(new->fname, sizeof(new->fname), item->fname);
-	new->duration = item->return_time - item->entry_time;
+	pstrcpy(new->fname, sizeof(new->fname), call->item->fname);
+	new->duration = call_total(call);
+	new->self = call_self(call);
 	new->nr_calls = 1;
 	if (stat_tree_insert(new)) {
 		free(new);
@@ -305,10 +418,12 @@ static void stat_list_print(void)
 
 	list_for_each_entry(entry, &stat_list, list) {
 		float total = (float)entry->duration / 1000000000;
+		float self = (float)entry->self / 1000000000;
 		float per = (float)entry->duration / entry->nr_calls / 1000000;
 
-		printf("%10.3f   %10.3f        %5"PRIu16"   %-*s\n", total, per,
-		       entry->nr_calls, TRACE_FNAME_LEN, entry->fname);
+		printf("%10.3f  %10.3f   %10.3f   %10"PRIu64"   %-*s\n", total,
+		       self, per, entry->nr_calls, TRACE_FNAME_LEN,
+		       entry->fname);
 	}
 }
 
@@ -319,17 +434,16 @@ static int stat_list_cmp(void *priv, struct list_node *a, struct list_node *b)
 	struct graph_stat_entry *gb = container_of(b, struct graph_stat_entry,
 						   list);
 	/* '-' is for reverse sort, largest first */
-	return -intcmp(ga->duration, gb->duration);
+	return -intcmp(ga->self, gb->self);
 }
 
 static void stat_trace_file(void *buf, size_t size)
 {
-	struct trace_graph_item *item = (struct trace_graph_item *)buf;
-	size_t sz = size / sizeof(struct trace_graph_item), i;
+	build_calls(buf, size);
 
-	printf("   Total (s)   Per Call (ms)   Calls   Name\n");
-	for (i = 0; i < sz; i++)
-		prepare_stat_tree(item++);
+	printf("   Total (s)    Self (s)   Per Call (ms)      Calls   Name\n");
+	for (size_t i = 0; i < nr_calls; i++)
+		prepare_stat_tree(calls + i);
 	list_sort(NULL, &stat_list, stat_list_cmp);
 	stat_list_print();
 }
@@ -347,16 +461,125 @@ static int graph_stat(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+struct folded_stack {
+	struct rb_node rb;
+	char *stack;
+	uint64_t self; /* ns */
+};
+
+static struct rb_root folded_root;
+
+static int folded_stack_cmp(const struct folded_stack *a,
+			    const struct folded_stack *b)
+{
+	return strcmp(a->stack, b->stack);
+}
+
+/*
+ * Print the self time of the stacks in the folded format of the flame graph
+ * tools, "thread;caller;callee <ns>", one line for each distinct stack.
+ */
+static void fold_trace_file(void *buf, size_t size)
+{
+	struct folded_stack *new, *entry;
+
+	build_calls(buf, size);
+	for (size_t i = 0; i < nr_calls; i++) {
+		struct strbuf stack = STRBUF_INIT;
+
+		strbuf_addstr(&stack, calls[i].item->tname);
+		strbuf_addstr(&stack, ";");
+		add_call_stack(&stack, i, ";");
+
+		new = xmalloc(sizeof(*new));
+		new->stack = strbuf_detach(&stack);
+		new->self = call_self(calls + i);
+		entry = rb_insert(&folded_root, new, rb, folded_stack_cmp);
+		if (entry) {
+			entry->self += new->self;
+			free(new->stack);
+			free(new);
+		}
+	}
+
+	rb_for_each_entry(entry, &folded_root, rb)
+		printf("%s %"PRIu64"\n", entry->stack, entry->self);
+}
+
+static int graph_flame(int argc, char **argv)
+{
+	struct stat st;
+	void *map = map_trace_file(&st);
+
+	if (!map)
+		return EXIT_FAILURE;
+
+	fold_trace_file(map, st.st_size);
+	munmap(map, st.st_size);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Print a sample of the self time for each call in the format of perf script,
+ * for the tools which read it.  The thread names of the workers end with their
+ * tid, which is taken as the pid.
+ */
+static void perf_trace_file(void *buf, size_t size)
+{
+	build_calls(buf, size);
+	for (size_t i = 0; i < nr_calls; i++) {
+		const struct trace_graph_item *item = calls[i].item;
+		uint64_t t = item->return_time;
+
+		printf("%s%s %"PRIu64".%06"PRIu64": %"PRIu64" cpu-clock:\n",
+		       item->tname, strchr(item->tname, ' ') ? "" : " 0",
+		       t / 1000000000, t % 1000000000 / 1000,
+		       call_self(calls + i));
+		for (int j = i; j >= 0; j = calls[j].parent)
+			printf("\t0 %s (sheep)\n", calls[j].item->fname);
+		printf("\n");
+	}
+}
+
+static int graph_perf(int argc, char **argv)
+{
+	struct stat st;
+	void *map = map_trace_file(&st);
+
+	if (!map)
+		return EXIT_FAILURE;
+
+	perf_trace_file(map, st.st_size);
+	munmap(map, st.st_size);
+	return EXIT_SUCCESS;
+}
+
 static int trace_parser(int ch, const char *opt)
 {
+	switch (ch) {
+	case 'w':
+		trace_cmd_data.watch = true;
+		break;
+	}
+
 	return 0;
 }
 
+static struct sd_option trace_options[] = {
+	{'w', "watch", false, "read the buffers every second and append them\n"
+	 "                          to the trace file, until interrupted"},
+	{ 0, NULL, false, NULL },
+};
+
 static struct subcommand graph_cmd[] = {
 	{"cat", NULL, NULL, "cat the output of graph tracer",
 	 NULL, 0, graph_cat},
-	{"stat", NULL, NULL, "get the stat of the graph calls",
+	{"stat", NULL, NULL, "get the total and self time of the functions",
 	 NULL, 0, graph_stat},
+	{"flame", NULL, NULL, "print the folded stacks for a flame graph",
+	 NULL, 0, graph_flame},
+	{"perf", NULL, NULL, "print the calls in the format of perf script",
+	 NULL, 0, graph_perf},
 	{NULL,},
 };
 
@@ -373,6 +596,8 @@ static struct subcommand trace_cmd[] = {
 	 CMD_NEED_ARG, trace_disable},
 	{"status", NULL, "aph", "show tracer statuses", NULL,
 	 0, trace_status},
+	{"dump", NULL, "aphw", "read the trace buffers into the trace file",
+	 NULL, 0, trace_dump, trace_options},
 	{"graph", NULL, "aph", "run dog trace graph for more information",
 	 graph_cmd, CMD_NEED_ARG, trace_graph},
 	{NULL},
@@ -21,6 +21,10 @@
 #include "sha1.h"
 #include "fec.h"
 
+#ifdef HAVE_COMPRESS
+#include <zlib.h>
+#endif
+
 struct rb_root oid_tree = RB_ROOT;
 
 static struct sd_option vdi_options[] = {
@@ -39,9 +43,19 @@ static struct sd_option vdi_options[] = {
 	 "                          neither comparing nor repairing"},
 	{'A', "async", false, "delete vdi asynchronously"},
 	{'S', "single", false, "only list the single fully matched vdi"},
+	{'z', "compress", false, "compress the data objects"},
+	{'H', "hybrid", false, "keep the hot data objects replicated and\n"
+	 "                          erasure code the cold ones"},
+	{'j', "jobs", true, "specify the number of object requests in flight"},
+	{'b', "block-size", true, "specify the size of the data objects, a power\n"
+	 "                          of 2 from 512K to 64M (default 4M)"},
+	{'k', "stripe-size", true, "specify the size of the erasure stripes, a\n"
+	 "                          power of 2 from 512 to 1M (default 512)"},
 	{ 0, NULL, false, NULL },
 };
 
+#define VDI_RW_DEFAULT_JOBS 16
+
 static struct vdi_cmd_data {
 	uint64_t index;
 	int snapshot_id;
@@ -59,7 +73,12 @@ static struct vdi_cmd_data {
 	bool exist;
 	bool async;
 	bool single;
-} vdi_cmd_data = { ~0, };
+	bool compress;
+	bool hybrid;
+	int nr_jobs;
+	uint8_t block_size_shift;
+	uint8_t stripe_shift;
+} vdi_cmd_data = { ~0, .nr_jobs = VDI_RW_DEFAULT_JOBS, };
 
 struct get_vdi_info {
 	const char *name;
@@ -109,12 +128,11 @@ static char *redundancy_scheme(uint8_t copy_nr, uint8_t policy)
 	return str;
 }
 
-static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
-			   uint32_t snapid, uint32_t flags,
-			   const struct sd_inode *i, void *data)
+static void print_vdi_list(const struct sd_vdi_header *h, void *data)
 {
-	bool is_clone = false;
-	uint64_t my_objs = 0, cow_objs = 0;
+	bool is_clone = false, is_snapshot = h->snap_ctime != 0;
+	uint32_t snapid = is_snapshot ? h->snap_id : 0;
+	const char *name = h->name;
 	time_t ti;
 	struct tm tm;
 	char dbuf[128];
@@ -123,7 +141,7 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 	if (info && strcmp(name, info->name) != 0)
 		return;
 
-	ti = i->create_time >> 32;
+	ti = h->create_time >> 32;
 	if (raw_output) {
 		snprintf(dbuf, sizeof(dbuf), "%" PRIu64, (uint64_t) ti);
 	} else {
@@ -132,48 +150,44 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 			 "%Y-%m-%d %H:%M", &tm);
 	}
 
-	sd_inode_stat(i, &my_objs, &cow_objs);
-
-	if (i->snap_id == 1 && i->parent_vdi_id != 0)
+	if (h->snap_id == 1 && h->parent_vdi_id != 0)
 		is_clone = true;
 
 	if (raw_output) {
-		printf("%c ", vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : '='));
+		printf("%c ", is_snapshot ? 's' : (is_clone ? 'c' : '='));
 		while (*name) {
 			if (isspace(*name) || *name == '\\')
 				putchar('\\');
 			putchar(*name++);
 		}
 		printf(" %d %s %s %s %s %" PRIx32 " %s %s\n", snapid,
-		       strnumber(i->vdi_size),
-		       strnumber(my_objs * SD_DATA_OBJ_SIZE),
-		       strnumber(cow_objs * SD_DATA_OBJ_SIZE),
-		       dbuf, vid,
-		       redundancy_scheme(i->nr_copies, i->copy_policy),
-		       i->tag);
+		       strnumber(h->vdi_size),
+		       strnumber(h->my_objs << h->block_size_shift),
+		       strnumber(h->cow_objs << h->block_size_shift),
+		       dbuf, h->vdi_id,
+		       redundancy_scheme(h->nr_copies, h->copy_policy),
+		       h->tag);
 	} else {
 		printf("%c %-8s %5d %7s %7s %7s %s  %7" PRIx32 " %6s %13s\n",
-		       vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : ' '),
+		       is_snapshot ? 's' : (is_clone ? 'c' : ' '),
 		       name, snapid,
-		       strnumber(i->vdi_size),
-		       strnumber(my_objs * SD_DATA_OBJ_SIZE),
-		       strnumber(cow_objs * SD_DATA_OBJ_SIZE),
-		       dbuf, vid,
-		       redundancy_scheme(i->nr_copies, i->copy_policy),
-		       i->tag);
+		       strnumber(h->vdi_size),
+		       strnumber(h->my_objs << h->block_size_shift),
+		       strnumber(h->cow_objs << h->block_size_shift),
+		       dbuf, h->vdi_id,
+		       redundancy_scheme(h->nr_copies, h->copy_policy),
+		       h->tag);
 	}
 }
 
-static void print_vdi_tree(uint32_t vid, const char *name, const char *tag,
-			   uint32_t snapid, uint32_t flags,
-			   const struct sd_inode *i, void *data)
+static void print_vdi_tree(const struct sd_vdi_header *h, void *data)
 {
 	time_t ti;
 	struct tm tm;
 	char buf[128];
 
-	if (vdi_is_snapshot(i)) {
-		ti = i->create_time >> 32;
+	if (h->snap_ctime) {
+		ti = h->create_time >> 32;
 		localtime_r(&ti, &tm);
 
 		strftime(buf, sizeof(buf),
@@ -181,37 +195,36 @@ static void print_vdi_tree(uint32_t vid, const char *name, const char *tag,
 	} else
 		pstrcpy(buf, sizeof(buf), "(you are here)");
 
-	add_vdi_tree(name, buf, vid, i->parent_vdi_id,
-		     highlight && !vdi_is_snapshot(i));
+	add_vdi_tree(h->name, buf, h->vdi_id, h->parent_vdi_id,
+		     highlight && !h->snap_ctime);
 }
 
-static void print_vdi_graph(uint32_t vid, const char *name, const char *tag,
-			    uint32_t snapid, uint32_t flags,
-			    const struct sd_inode *i, void *data)
+static void print_vdi_graph(const struct sd_vdi_header *h, void *data)
 {
 	time_t ti;
 	struct tm tm;
 	char dbuf[128], tbuf[128];
 
-	ti = i->create_time >> 32;
+	ti = h->create_time >> 32;
 	localtime_r(&ti, &tm);
 
 	strftime(dbuf, sizeof(dbuf), "%Y-%m-%d", &tm);
 	strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
 
-	printf("  \"%x\" -> \"%x\";\n", i->parent_vdi_id, vid);
+	printf("  \"%x\" -> \"%x\";\n", h->parent_vdi_id, h->vdi_id);
 	printf("  \"%x\" [\n"
 	       "    group = \"%s\",\n"
 	       "    label = \"",
-	       vid, name);
+	       h->vdi_id, h->name);
 	printf("Name: %10s\\n"
 	       "Tag:  %10x\\n"
 	       "Size: %10s\\n"
 	       "Date: %10s\\n"
 	       "Time: %10s",
-	       name, snapid, strnumber(i->vdi_size), dbuf, tbuf);
+	       h->name, h->snap_ctime ? h->snap_id : 0,
+	       strnumber(h->vdi_size), dbuf, tbuf);
 
-	if (vdi_is_snapshot(i))
+	if (h->snap_ctime)
 		printf("\"\n  ];\n\n");
 	else
 		printf("\",\n    color=\"red\"\n  ];\n\n");
@@ -269,6 +282,7 @@ static void print_obj_ref(uint32_t vid, const char *name, const char *tag,
 	uint64_t oid = *(uint64_t *)data;
 	uint64_t idx = data_oid_to_idx(oid);
 	struct get_vdi_info info;
+	struct sd_vdi_header h;
 
 	if (idx >= SD_INODE_DATA_INDEX) {
 		sd_err("Failed to list: wrong oid %016"PRIx64"\n", oid);
@@ -279,7 +293,8 @@ static void print_obj_ref(uint32_t vid, const char *name, const char *tag,
 			i->data_vdi_id[idx] == oid_to_vid(oid)) {
 		memset(&info, 0, sizeof(info));
 		info.name = name;
-		print_vdi_list(vid, name, tag, snapid, flags, i, &info);
+		vdi_header_from_inode(i, true, &h);
+		print_vdi_list(&h, &info);
 	}
 }
 
@@ -294,7 +309,7 @@ static int vdi_list(int argc, char **argv)
 		struct sd_inode *inode = NULL;
 		int ret;
 		struct get_vdi_info info;
-		uint32_t snapid;
+		struct sd_vdi_header h;
 
 		memset(&info, 0, sizeof(info));
 		info.name = vdiname;
@@ -307,9 +322,9 @@ static int vdi_list(int argc, char **argv)
 			return ret;
 		}
 
-		snapid = vdi_is_snapshot(inode) ? inode->snap_id : 0;
-		print_vdi_list(inode->vdi_id, vdiname,
-			vdi_cmd_data.snapshot_tag, snapid, 0, inode, &info);
+		vdi_header_from_inode(inode, true, &h);
+		free(inode);
+		print_vdi_list(&h, &info);
 
 		return EXIT_SUCCESS;
 	}
@@ -318,7 +333,7 @@ static int vdi_list(int argc, char **argv)
 		struct get_vdi_info info;
 		memset(&info, 0, sizeof(info));
 		info.name = vdiname;
-		if (parse_vdi(print_vdi_list, SD_INODE_SIZE, &info, true) < 0)
+		if (parse_vdi_headers(print_vdi_list, true, &info) < 0)
 			return EXIT_SYSFAIL;
 		return EXIT_SUCCESS;
 	}
@@ -332,7 +347,7 @@ static int vdi_list(int argc, char **argv)
 		return EXIT_SUCCESS;
 	}
 
-	if (parse_vdi(print_vdi_list, SD_INODE_SIZE, NULL, true) < 0)
+	if (parse_vdi_headers(print_vdi_list, true, NULL) < 0)
 		return EXIT_SYSFAIL;
 	return EXIT_SUCCESS;
 }
@@ -340,7 +355,7 @@ static int vdi_list(int argc, char **argv)
 static int vdi_tree(int argc, char **argv)
 {
 	init_tree();
-	if (parse_vdi(print_vdi_tree, SD_INODE_HEADER_SIZE, NULL, true) < 0)
+	if (parse_vdi_headers(print_vdi_tree, false, NULL) < 0)
 		return EXIT_SYSFAIL;
 	dump_tree();
 
@@ -354,7 +369,7 @@ static int vdi_graph(int argc, char **argv)
 	printf("  node [shape = \"box\", fontname = \"Courier\"];\n\n");
 	printf("  \"0\" [shape = \"ellipse\", label = \"root\"];\n\n");
 
-	if (parse_vdi(print_vdi_graph, SD_INODE_HEADER_SIZE, NULL, true) < 0)
+	if (parse_vdi_headers(print_vdi_graph, false, NULL) < 0)
 		return EXIT_SYSFAIL;
 
 	/* print a footer */
@@ -405,7 +420,7 @@ int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
 		return EXIT_FAILURE;
 	}
 
-	ret = dog_read_object(vid_to_vdi_oid(vid), inode, size, 0, true);
+	ret = sd_inode_read(vid_to_vdi_oid(vid), inode, size);
 	if (ret != SD_RES_SUCCESS) {
 		if (snapid) {
 			sd_err("Failed to read a snapshot %s:%d", vdiname,
@@ -445,6 +460,13 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.vdi_size = vdi_size;
 	hdr.vdi.copy_policy = copy_policy;
 	hdr.vdi.store_policy = store_policy;
+	/* snapshots and clones inherit it from the base */
+	if (vdi_cmd_data.compress)
+		hdr.vdi.compress = SD_COMPRESS_ZLIB;
+	if (vdi_cmd_data.hybrid)
+		hdr.vdi.hybrid = 1;
+	hdr.vdi.block_size_shift = vdi_cmd_data.block_size_shift;
+	hdr.vdi.stripe_shift = vdi_cmd_data.stripe_shift;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
@@ -465,7 +487,7 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 static int vdi_create(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	uint64_t size;
+	uint64_t size, obj_size = SD_DATA_OBJ_SIZE;
 	uint32_t vid;
 	uint64_t oid;
 	uint64_t idx;
@@ -481,15 +503,19 @@ static int vdi_create(int argc, char **argv)
 	if (ret < 0)
 		return EXIT_USAGE;
 
-	if (size > SD_OLD_MAX_VDI_SIZE && 0 == vdi_cmd_data.store_policy) {
+	/* the index has as many objects whatever their size */
+	if (vdi_cmd_data.block_size_shift)
+		obj_size = UINT64_C(1) << vdi_cmd_data.block_size_shift;
+	if (size > obj_size * OLD_MAX_DATA_OBJS &&
+	    0 == vdi_cmd_data.store_policy) {
 		sd_err("VDI size is larger than %s bytes, please use '-y' to "
 		       "create a hyper volume with size up to %s bytes",
-		       strnumber(SD_OLD_MAX_VDI_SIZE),
-		       strnumber(SD_MAX_VDI_SIZE));
+		       strnumber(obj_size * OLD_MAX_DATA_OBJS),
+		       strnumber(obj_size * MAX_DATA_OBJS));
 		return EXIT_USAGE;
 	}
 
-	if (size > SD_MAX_VDI_SIZE) {
+	if (size > obj_size * MAX_DATA_OBJS) {
 		sd_err("VDI size is too large");
 		return EXIT_USAGE;
 	}
@@ -508,10 +534,10 @@ static int vdi_create(int argc, char **argv)
 		ret = EXIT_FAILURE;
 		goto out;
 	}
-	max_idx = DIV_ROUND_UP(size, SD_DATA_OBJ_SIZE);
+	max_idx = count_data_objs(inode);
 
 	for (idx = 0; idx < max_idx; idx++) {
-		vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+		vdi_show_progress(idx * obj_size, inode->vdi_size);
 		oid = vid_to_data_oid(vid, idx);
 
 		ret = dog_write_object(oid, 0, NULL, 0, 0, 0, inode->nr_copies,
@@ -528,7 +554,7 @@ static int vdi_create(int argc, char **argv)
 			goto out;
 		}
 	}
-	vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+	vdi_show_progress(idx * obj_size, inode->vdi_size);
 	ret = EXIT_SUCCESS;
 
 out:
@@ -609,70 +635,77 @@ out:
 	return ret;
 }
 
-static int vdi_clone(int argc, char **argv)
+/*
+ * Create the vdis of nv by SD_OP_NEW_VDIS, SD_MAX_NEW_VDIS in a cluster
+ * operation, which fills the vid and the result of each
+ */
+static int do_vdi_create_many(struct sd_new_vdi *nv, int nr,
+			      uint8_t copy_policy, uint8_t store_policy)
 {
-	const char *src_vdi = argv[optind++], *dst_vdi;
-	uint32_t base_vid, new_vid, vdi_id;
-	uint64_t oid;
-	uint64_t idx;
-	uint32_t max_idx, ret;
-	struct sd_inode *inode = NULL, *new_inode = NULL;
-	char *buf = NULL;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
 
-	dst_vdi = argv[optind];
-	if (!dst_vdi) {
-		sd_err("Destination VDI name must be specified");
-		ret = EXIT_USAGE;
-		goto out;
-	}
+	for (int i = 0; i < nr; i += SD_MAX_NEW_VDIS) {
+		int n = min(nr - i, SD_MAX_NEW_VDIS);
 
-	if (!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) {
-		sd_err("Only snapshot VDIs can be cloned");
-		sd_err("Please specify the '-s' option");
-		ret = EXIT_USAGE;
-		goto out;
+		sd_init_req(&hdr, SD_OP_NEW_VDIS);
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		hdr.data_length = n * sizeof(*nv);
+		hdr.vdi.copy_policy = copy_policy;
+		hdr.vdi.store_policy = store_policy;
+		if (vdi_cmd_data.compress)
+			hdr.vdi.compress = SD_COMPRESS_ZLIB;
+		if (vdi_cmd_data.hybrid)
+			hdr.vdi.hybrid = 1;
+		hdr.vdi.block_size_shift = vdi_cmd_data.block_size_shift;
+		hdr.vdi.stripe_shift = vdi_cmd_data.stripe_shift;
+
+		ret = dog_exec_req(&sd_nid, &hdr, nv + i);
+		if (ret < 0)
+			return EXIT_SYSFAIL;
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("Failed to create VDIs: %s",
+			       sd_strerror(rsp->result));
+			return EXIT_FAILURE;
+		}
 	}
+	return EXIT_SUCCESS;
+}
 
-	inode = xmalloc(sizeof(*inode));
-
-	ret = read_vdi_obj(src_vdi, vdi_cmd_data.snapshot_id,
-			   vdi_cmd_data.snapshot_tag, &base_vid, inode,
-			   SD_INODE_SIZE);
-	if (ret != EXIT_SUCCESS)
-		goto out;
-
-	if (vdi_cmd_data.no_share == true)
-		base_vid = 0;
-
-	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
-			    inode->copy_policy, inode->store_policy);
-	if (ret != EXIT_SUCCESS ||
-			(!vdi_cmd_data.prealloc && !vdi_cmd_data.no_share))
-		goto out;
+/* Copy the data of the snapshot to the clone new_vid for -n or -P */
+static int vdi_clone_copy(const struct sd_inode *inode, const char *dst_vdi,
+			  uint32_t new_vid)
+{
+	struct sd_inode *new_inode = xmalloc(sizeof(*inode));
+	uint32_t max_idx, vdi_id;
+	char *buf = NULL;
+	uint64_t oid, idx;
+	int ret;
 
-	new_inode = xmalloc(sizeof(*inode));
 	ret = read_vdi_obj(dst_vdi, 0, "", NULL, new_inode,
 			SD_INODE_HEADER_SIZE);
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
-	buf = xzalloc(SD_DATA_OBJ_SIZE);
+	buf = xzalloc(vdi_object_size(inode));
 	max_idx = count_data_objs(inode);
 
 	for (idx = 0; idx < max_idx; idx++) {
 		size_t size;
 
-		vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+		vdi_show_progress(idx * vdi_object_size(inode),
+				  inode->vdi_size);
 		vdi_id = sd_inode_get_vid(inode, idx);
 		if (vdi_id) {
 			oid = vid_to_data_oid(vdi_id, idx);
-			ret = dog_read_object(oid, buf, SD_DATA_OBJ_SIZE, 0,
-					      true);
+			ret = dog_read_object(oid, buf, vdi_object_size(inode),
+					      0, true);
 			if (ret) {
 				ret = EXIT_FAILURE;
 				goto out;
 			}
-			size = SD_DATA_OBJ_SIZE;
+			size = vdi_object_size(inode);
 		} else {
 			if (vdi_cmd_data.no_share && !vdi_cmd_data.prealloc)
 				continue;
@@ -696,21 +729,116 @@ static int vdi_clone(int argc, char **argv)
 			goto out;
 		}
 	}
-	vdi_show_progress(idx * SD_DATA_OBJ_SIZE, inode->vdi_size);
+	vdi_show_progress(idx * vdi_object_size(inode), inode->vdi_size);
 	ret = EXIT_SUCCESS;
+out:
+	free(new_inode);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Clone the snapshot to each of the destinations.  Many of them are created in
+ * a cluster operation for each SD_MAX_NEW_VDIS instead of one each, for the
+ * provisioning of many vdis from a template.
+ */
+static int vdi_clone_many(const struct sd_inode *inode, uint32_t base_vid,
+			  char **dst_vdis, int nr)
+{
+	struct sd_new_vdi *nv = xzalloc(sizeof(*nv) * nr);
+	int ret;
+
+	for (int i = 0; i < nr; i++) {
+		pstrcpy(nv[i].name, sizeof(nv[i].name), dst_vdis[i]);
+		nv[i].vdi_size = inode->vdi_size;
+		nv[i].base_vid = base_vid;
+	}
 
+	ret = do_vdi_create_many(nv, nr, inode->copy_policy,
+				 inode->store_policy);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	for (int i = 0; i < nr; i++) {
+		if (nv[i].result != SD_RES_SUCCESS) {
+			sd_err("Failed to create VDI %s: %s", nv[i].name,
+			       sd_strerror(nv[i].result));
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if ((vdi_cmd_data.prealloc || vdi_cmd_data.no_share) &&
+		    vdi_clone_copy(inode, nv[i].name, nv[i].vid) !=
+		    EXIT_SUCCESS) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		if (!verbose)
+			continue;
+		if (raw_output)
+			printf("%s %x\n", nv[i].name, nv[i].vid);
+		else
+			printf("VDI ID of newly created clone %s: %x\n",
+			       nv[i].name, nv[i].vid);
+	}
 out:
+	free(nv);
+	return ret;
+}
+
+static int vdi_clone(int argc, char **argv)
+{
+	const char *src_vdi = argv[optind++], *dst_vdi;
+	uint32_t base_vid, new_vid;
+	uint32_t ret;
+	struct sd_inode *inode = NULL;
+
+	dst_vdi = argv[optind];
+	if (!dst_vdi) {
+		sd_err("Destination VDI name must be specified");
+		ret = EXIT_USAGE;
+		goto out;
+	}
+
+	if (!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) {
+		sd_err("Only snapshot VDIs can be cloned");
+		sd_err("Please specify the '-s' option");
+		ret = EXIT_USAGE;
+		goto out;
+	}
+
+	inode = xmalloc(sizeof(*inode));
+
+	ret = read_vdi_obj(src_vdi, vdi_cmd_data.snapshot_id,
+			   vdi_cmd_data.snapshot_tag, &base_vid, inode,
+			   SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	if (vdi_cmd_data.no_share == true)
+		base_vid = 0;
+
+	if (argc - optind > 1) {
+		ret = vdi_clone_many(inode, base_vid, argv + optind,
+				     argc - optind);
+		goto out;
+	}
+
+	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
+			    inode->copy_policy, inode->store_policy);
+	if (ret != EXIT_SUCCESS ||
+			(!vdi_cmd_data.prealloc && !vdi_cmd_data.no_share))
+		goto print;
+
+	ret = vdi_clone_copy(inode, dst_vdi, new_vid);
+print:
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
 			printf("%x\n", new_vid);
 		else
 			printf("VDI ID of newly created clone: %x\n", new_vid);
 	}
-
+out:
 	free(inode);
-	if (new_inode)
-		free(new_inode);
-	free(buf);
 	return ret;
 }
 
@@ -1389,176 +1517,638 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
-static int vdi_read(int argc, char **argv)
+static struct vdi_qos vdi_qos_data;
+
+static int qos_parse_u32(const char *s, uint32_t *ret)
 {
-	const char *vdiname = argv[optind++];
-	int ret;
-	struct sd_inode *inode = NULL;
-	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
-	uint32_t vdi_id, idx;
-	unsigned int len;
-	char *buf = NULL;
+	char *p;
+	unsigned long n = strtoul(s, &p, 10);
 
-	if (argv[optind]) {
-		ret = option_parse_size(argv[optind++], &offset);
-		if (ret < 0)
-			return EXIT_USAGE;
-		if (argv[optind]) {
-			ret = option_parse_size(argv[optind++], &total);
-			if (ret < 0)
-				return EXIT_USAGE;
-		}
+	if (s == p || *p != '\0' || n > UINT32_MAX) {
+		sd_err("Invalid number '%s'", s);
+		return -1;
 	}
+	*ret = n;
+	return 0;
+}
 
-	inode = malloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
-
-	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
-			   vdi_cmd_data.snapshot_tag, NULL, inode,
-			   SD_INODE_SIZE);
-	if (ret != EXIT_SUCCESS)
-		goto out;
-
-	if (inode->vdi_size < offset) {
-		sd_err("Read offset is beyond the end of the VDI");
-		ret = EXIT_FAILURE;
-		goto out;
-	}
+static int qos_weight_parser(const char *s)
+{
+	return qos_parse_u32(s, &vdi_qos_data.weight);
+}
 
-	total = min(total, inode->vdi_size - offset);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
-	while (done < total) {
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
-		vdi_id = sd_inode_get_vid(inode, idx);
-		if (vdi_id) {
-			oid = vid_to_data_oid(vdi_id, idx);
-			ret = dog_read_object(oid, buf, len, offset, false);
-			if (ret != SD_RES_SUCCESS) {
-				sd_err("Failed to read VDI");
-				ret = EXIT_FAILURE;
-				goto out;
-			}
-		} else
-			memset(buf, 0, len);
+static int qos_reservation_parser(const char *s)
+{
+	return qos_parse_u32(s, &vdi_qos_data.reservation);
+}
 
-		ret = xwrite(STDOUT_FILENO, buf, len);
-		if (ret < 0) {
-			sd_err("Failed to write to stdout: %m");
-			ret = EXIT_SYSFAIL;
-			goto out;
-		}
+static int qos_iops_parser(const char *s)
+{
+	return qos_parse_u32(s, &vdi_qos_data.iops);
+}
 
-		offset = 0;
-		idx++;
-		done += len;
-	}
-	fsync(STDOUT_FILENO);
-	ret = EXIT_SUCCESS;
-out:
-	free(inode);
-	free(buf);
+static int qos_bps_parser(const char *s)
+{
+	return option_parse_size(s, &vdi_qos_data.bps);
+}
 
-	return ret;
+static int qos_window_parser(const char *s)
+{
+	return qos_parse_u32(s, &vdi_qos_data.write_window);
 }
 
-static int vdi_write(int argc, char **argv)
+static struct option_parser qos_parsers[] = {
+	{ "weight=", qos_weight_parser },
+	{ "reservation=", qos_reservation_parser },
+	{ "iops=", qos_iops_parser },
+	{ "bps=", qos_bps_parser },
+	{ "window=", qos_window_parser },
+	{ NULL, NULL },
+};
+
+/* Show or set the QoS of a vdi, the fields not given are kept */
+static int vdi_qos(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	uint32_t vid, flags, vdi_id, idx;
+	struct vdi_qos *qos = &vdi_qos_data;
+	struct sheepdog_vdi_attr *vattr;
+	uint32_t vid = 0, nr_copies = 0;
+	uint64_t attr_oid = 0;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	int ret;
-	struct sd_inode *inode = NULL;
-	uint64_t offset = 0, oid, old_oid, done = 0, total = (uint64_t) -1;
-	unsigned int len;
-	char *buf = NULL;
-	bool create;
 
-	if (argv[optind]) {
-		ret = option_parse_size(argv[optind++], &offset);
-		if (ret < 0)
-			return EXIT_USAGE;
-		if (argv[optind]) {
-			ret = option_parse_size(argv[optind++], &total);
-			if (ret < 0)
-				return EXIT_USAGE;
-		}
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_QOS_ATTR_KEY,
+				NULL, 0, &vid, &attr_oid, &nr_copies, false,
+				false, false);
+	if (ret == SD_RES_SUCCESS) {
+		vattr = xmalloc(SD_ATTR_OBJ_SIZE);
+		ret = dog_read_object(attr_oid, vattr, SD_ATTR_OBJ_SIZE, 0,
+				      true);
+		if (ret == SD_RES_SUCCESS && vattr->value_len == sizeof(*qos))
+			memcpy(qos, vattr->value, sizeof(*qos));
+		free(vattr);
+	} else if (ret == SD_RES_NO_VDI) {
+		sd_err("VDI not found");
+		return EXIT_MISSING;
+	} else if (ret != SD_RES_NO_OBJ) {
+		sd_err("Failed to find the QoS: %s", sd_strerror(ret));
+		return EXIT_FAILURE;
 	}
 
-	inode = xmalloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
+	if (!argv[optind]) {
+		printf("weight: %"PRIu32"\n",
+		       qos->weight ?: SD_QOS_DEFAULT_WEIGHT);
+		printf("reservation: %"PRIu32" IOPS\n", qos->reservation);
+		printf("limit: %"PRIu32" IOPS, %s/s (0 for no limit)\n",
+		       qos->iops, strnumber(qos->bps));
+		printf("write window: %"PRIu32" us\n", qos->write_window);
+		return EXIT_SUCCESS;
+	}
 
-	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
-	if (ret != EXIT_SUCCESS)
-		goto out;
+	if (option_parse(argv[optind], ",", qos_parsers) < 0)
+		return EXIT_USAGE;
+	if (qos->iops && qos->reservation > qos->iops) {
+		sd_err("The reservation is above the IOPS limit");
+		return EXIT_USAGE;
+	}
+	if (qos->write_window > SD_QOS_MAX_WRITE_WINDOW) {
+		sd_err("The write window is above %d us",
+		       SD_QOS_MAX_WRITE_WINDOW);
+		return EXIT_USAGE;
+	}
 
-	if (inode->vdi_size < offset) {
-		sd_err("Write offset is beyond the end of the VDI");
-		ret = EXIT_FAILURE;
-		goto out;
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_QOS_ATTR_KEY,
+				qos, sizeof(*qos), &vid, &attr_oid, &nr_copies,
+				true, false, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to set the QoS: %s", sd_strerror(ret));
+		return EXIT_FAILURE;
 	}
 
-	total = min(total, inode->vdi_size - offset);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
-	while (done < total) {
-		create = false;
-		old_oid = 0;
-		flags = 0;
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+	/* the gateways reload it from the attribute when they restart */
+	sd_init_req(&hdr, SD_OP_SET_VDI_QOS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(*qos);
+	hdr.vdi.base_vdi_id = vid;
+	ret = dog_exec_req(&sd_nid, &hdr, qos);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to notify the QoS: %s",
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
 
-		vdi_id = sd_inode_get_vid(inode, idx);
-		if (!vdi_id)
-			create = true;
-		else if (!is_data_obj_writeable(inode, idx)) {
-			create = true;
-			old_oid = vid_to_data_oid(vdi_id, idx);
-		}
+static struct vdi_replica vdi_replica_data;
 
-		if (vdi_cmd_data.writeback)
-			flags |= SD_FLAG_CMD_CACHE;
+static int replica_interval_parser(const char *s)
+{
+	return qos_parse_u32(s, &vdi_replica_data.interval);
+}
 
-		ret = xread(STDIN_FILENO, buf, len);
-		if (ret < 0) {
-			sd_err("Failed to read from stdin: %m");
-			ret = EXIT_SYSFAIL;
-			goto out;
-		} else if (ret < len) {
-			/* exit after this buffer is sent */
-			memset(buf + ret, 0, len - ret);
-			total = done + len;
-		}
+static struct option_parser replica_parsers[] = {
+	{ "interval=", replica_interval_parser },
+	{ NULL, NULL },
+};
 
-		sd_inode_set_vid(inode, idx, inode->vdi_id);
-		oid = vid_to_data_oid(inode->vdi_id, idx);
-		ret = dog_write_object(oid, old_oid, buf, len, offset, flags,
-				      inode->nr_copies, inode->copy_policy,
-				      create, false);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("Failed to write VDI");
-			ret = EXIT_FAILURE;
-			goto out;
-		}
+/* Parse "<addr>:<port>[,interval=]" or "off" */
+static int replica_parse(char *s, struct vdi_replica *replica)
+{
+	char *opts = strchr(s, ','), *port;
+	uint8_t addr[16];
+	unsigned long n;
 
-		if (create) {
-			ret = sd_inode_write_vid(inode, idx, vid, vid, flags,
-						 false, false);
-			if (ret) {
-				ret = EXIT_FAILURE;
+	if (!strcmp(s, "off")) {
+		replica->interval = 0;
+		return 0;
+	}
+
+	if (opts)
+		*opts++ = '\0';
+	port = strrchr(s, ':');
+	if (!port) {
+		sd_err("Invalid remote '%s', expected <addr>:<port>", s);
+		return -1;
+	}
+	*port++ = '\0';
+	n = strtoul(port, &port, 10);
+	if (*port != '\0' || !n || n > UINT16_MAX) {
+		sd_err("Invalid port of the remote");
+		return -1;
+	}
+	if (!str_to_addr(s, addr)) {
+		sd_err("Invalid address of the remote '%s'", s);
+		return -1;
+	}
+
+	/* a new remote starts over from a full copy */
+	if (memcmp(replica->addr, addr, sizeof(addr)) || replica->port != n) {
+		replica->seq = 0;
+		replica->snap_vid = 0;
+	}
+	memcpy(replica->addr, addr, sizeof(addr));
+	replica->port = n;
+	replica->interval = SD_REPLICA_DEFAULT_INTERVAL;
+	if (opts && option_parse(opts, ",", replica_parsers) < 0)
+		return -1;
+	if (!replica->interval) {
+		sd_err("The interval must be above 0, use 'off' to stop");
+		return -1;
+	}
+	return 0;
+}
+
+/* Show or set the asynchronous replication of a vdi to a remote cluster */
+static int vdi_replicate(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	struct vdi_replica *replica = &vdi_replica_data;
+	struct sheepdog_vdi_attr *vattr;
+	uint32_t vid = 0, nr_copies = 0;
+	uint64_t attr_oid = 0;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char buf[sizeof(*replica) + SD_MAX_VDI_LEN] = {};
+	int ret;
+
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_REPLICA_ATTR_KEY,
+				NULL, 0, &vid, &attr_oid, &nr_copies, false,
+				false, false);
+	if (ret == SD_RES_SUCCESS) {
+		vattr = xmalloc(SD_ATTR_OBJ_SIZE);
+		ret = dog_read_object(attr_oid, vattr, SD_ATTR_OBJ_SIZE, 0,
+				      true);
+		if (ret == SD_RES_SUCCESS &&
+		    vattr->value_len == sizeof(*replica))
+			memcpy(replica, vattr->value, sizeof(*replica));
+		free(vattr);
+	} else if (ret == SD_RES_NO_VDI) {
+		sd_err("VDI not found");
+		return EXIT_MISSING;
+	} else if (ret != SD_RES_NO_OBJ) {
+		sd_err("Failed to find the replication: %s", sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	if (!argv[optind]) {
+		if (!replica->interval) {
+			printf("not replicated\n");
+			return EXIT_SUCCESS;
+		}
+		printf("remote: %s\n",
+		       addr_to_str(replica->addr, replica->port));
+		printf("interval: %"PRIu32" seconds\n", replica->interval);
+		if (replica->seq)
+			printf("last snapshot: replica-%"PRIu32"\n",
+			       replica->seq);
+		else
+			printf("last snapshot: none\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (replica_parse(argv[optind], replica) < 0)
+		return EXIT_USAGE;
+
+	ret = find_vdi_attr_oid(vdiname, vdi_cmd_data.snapshot_tag,
+				vdi_cmd_data.snapshot_id, SD_REPLICA_ATTR_KEY,
+				replica, sizeof(*replica), &vid, &attr_oid,
+				&nr_copies, true, false, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to set the replication: %s", sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	/* the nodes read it from the attribute when they restart */
+	memcpy(buf, replica, sizeof(*replica));
+	pstrcpy(buf + sizeof(*replica), SD_MAX_VDI_LEN, vdiname);
+	sd_init_req(&hdr, SD_OP_SET_VDI_REPLICA);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(buf);
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to notify the replication: %s",
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int alter_vdi_copy(struct vdi_copy *vc)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_ALTER_VDI_COPY);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(*vc);
+	ret = dog_exec_req(&sd_nid, &hdr, vc);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to change the copies: %s",
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+static int vdi_alter_copy(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	char buf[SD_INODE_HEADER_SIZE];
+	struct sd_inode *inode = (struct sd_inode *)buf;
+	struct vdi_copy vc = {};
+	uint8_t nr_copies, copy_policy;
+	uint64_t rate = 0, total;
+	uint32_t vid;
+	int shift, ret;
+
+	if (!argv[optind]) {
+		sd_err("Please specify the number of copies");
+		return EXIT_USAGE;
+	}
+	nr_copies = parse_copy(argv[optind++], &copy_policy);
+	if (!nr_copies || copy_policy) {
+		sd_err("Invalid number of copies, only replicas can be changed"
+		       " online");
+		return EXIT_USAGE;
+	}
+	if (argv[optind] && option_parse_size(argv[optind], &rate) < 0)
+		return EXIT_USAGE;
+
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_HEADER_SIZE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	if (inode->copy_policy || inode->store_policy) {
+		sd_err("Erasure coded or hypervolume images can't be changed"
+		       " online");
+		return EXIT_FAILURE;
+	}
+
+	vc.vid = vid;
+	vc.nr_copies = nr_copies;
+	vc.rate = rate;
+	ret = alter_vdi_copy(&vc);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	/* the node converts it in the background, follow the progress */
+	shift = inode->block_size_shift;
+	total = vc.nr_objs << shift;
+	while (vc.old_nr_copies) {
+		if (total)
+			vdi_show_progress(vc.nr_done << shift, total);
+		sleep(1);
+		memset(&vc, 0, sizeof(vc));
+		vc.vid = vid;
+		ret = alter_vdi_copy(&vc);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		if (vc.old_nr_copies && !vc.nr_objs) {
+			sd_err("The conversion stopped, %"PRIu64" objects"
+			       " failed, please run it again", vc.nr_failed);
+			return EXIT_FAILURE;
+		}
+	}
+	if (total)
+		vdi_show_progress(total, total);
+	printf("%s has %d copies\n", vdiname, nr_copies);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * An object request of vdi read and write
+ *
+ * The requests of an object each go to the gateway on a node holding the
+ * first copy of the object, so they spread over the nodes and mostly save a
+ * forward.  Up to vdi_cmd_data.nr_jobs requests are in flight in the slots of
+ * a ring, which the main thread fills from stdin and drains to stdout in the
+ * order of the objects, overlapping the I/O of the requests.
+ */
+struct vdi_rw_work {
+	struct work work;
+	const struct node_id *nid;
+	uint32_t idx;
+	uint64_t oid, cow_oid;
+	uint32_t offset, len, flags;
+	uint8_t copies, copy_policy;
+	bool write, create;
+	bool busy; /* queued, but not done yet */
+	int ret;
+	char *buf;
+};
+
+static void vdi_rw_object_work(struct work *work)
+{
+	struct vdi_rw_work *w = container_of(work, struct vdi_rw_work, work);
+
+	if (w->write)
+		w->ret = dog_write_object_to(w->nid, w->oid, w->cow_oid, w->buf,
+					     w->len, w->offset, w->flags,
+					     w->copies, w->copy_policy,
+					     w->create, false);
+	else
+		w->ret = dog_read_object_from(w->nid, w->oid, w->buf, w->len,
+					      w->offset, false, false);
+}
+
+static void vdi_rw_object_done(struct work *work)
+{
+	struct vdi_rw_work *w = container_of(work, struct vdi_rw_work, work);
+
+	w->busy = false;
+}
+
+static struct vdi_rw_work *vdi_rw_alloc(int nr, size_t obj_size)
+{
+	struct vdi_rw_work *works = xcalloc(nr, sizeof(*works));
+
+	for (int i = 0; i < nr; i++) {
+		works[i].work.fn = vdi_rw_object_work;
+		works[i].work.done = vdi_rw_object_done;
+		works[i].buf = xmalloc(obj_size);
+	}
+	return works;
+}
+
+static void vdi_rw_queue(struct work_queue *wq, struct vdi_rw_work *w)
+{
+	w->nid = oid_to_gateway(w->oid);
+	w->busy = true;
+	queue_work(wq, &w->work);
+}
+
+/* Wait for the request of the slot to be done */
+static void vdi_rw_wait(struct vdi_rw_work *w)
+{
+	while (w->busy)
+		event_loop(-1);
+}
+
+static void vdi_rw_free(struct work_queue *wq, struct vdi_rw_work *works,
+			int nr)
+{
+	work_queue_wait(wq);
+	/* not allocated if the inode couldn't be read */
+	for (int i = 0; works && i < nr; i++)
+		free(works[i].buf);
+	free(works);
+}
+
+static int vdi_read(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	int ret, nr_jobs = vdi_cmd_data.nr_jobs, head = 0, nr = 0;
+	struct sd_inode *inode = NULL;
+	uint64_t offset = 0, queued = 0, total = (uint64_t) -1, obj_size;
+	uint32_t vdi_id, idx;
+	struct vdi_rw_work *works = NULL;
+	struct work_queue *wq;
+
+	if (argv[optind]) {
+		ret = option_parse_size(argv[optind++], &offset);
+		if (ret < 0)
+			return EXIT_USAGE;
+		if (argv[optind]) {
+			ret = option_parse_size(argv[optind++], &total);
+			if (ret < 0)
+				return EXIT_USAGE;
+		}
+	}
+
+	inode = malloc(sizeof(*inode));
+	wq = create_work_queue("vdi read", WQ_UNLIMITED);
+
+	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
+			   vdi_cmd_data.snapshot_tag, NULL, inode,
+			   SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+	obj_size = vdi_object_size(inode);
+	works = vdi_rw_alloc(nr_jobs, obj_size);
+
+	if (inode->vdi_size < offset) {
+		sd_err("Read offset is beyond the end of the VDI");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	total = min(total, inode->vdi_size - offset);
+	idx = offset / obj_size;
+	offset %= obj_size;
+	while (queued < total || nr) {
+		struct vdi_rw_work *w;
+
+		for (; nr < nr_jobs && queued < total; nr++) {
+			w = works + (head + nr) % nr_jobs;
+			w->len = min(total - queued, obj_size - offset);
+			w->offset = offset;
+			w->ret = SD_RES_SUCCESS;
+			/* the unallocated objects are read as zero locally */
+			vdi_id = sd_inode_get_vid(inode, idx);
+			if (vdi_id) {
+				w->oid = vid_to_data_oid(vdi_id, idx);
+				vdi_rw_queue(wq, w);
+			} else
+				memset(w->buf, 0, w->len);
+
+			queued += w->len;
+			offset = 0;
+			idx++;
+		}
+
+		w = works + head;
+		vdi_rw_wait(w);
+		if (w->ret != SD_RES_SUCCESS) {
+			sd_err("Failed to read VDI");
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		ret = xwrite(STDOUT_FILENO, w->buf, w->len);
+		if (ret < 0) {
+			sd_err("Failed to write to stdout: %m");
+			ret = EXIT_SYSFAIL;
+			goto out;
+		}
+
+		head = (head + 1) % nr_jobs;
+		nr--;
+	}
+	fsync(STDOUT_FILENO);
+	ret = EXIT_SUCCESS;
+out:
+	vdi_rw_free(wq, works, nr_jobs);
+	free(inode);
+
+	return ret;
+}
+
+static int vdi_write(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	uint32_t vid, flags = 0, vdi_id, idx;
+	int ret, nr_jobs = vdi_cmd_data.nr_jobs, head = 0, nr = 0;
+	struct sd_inode *inode = NULL;
+	uint64_t offset = 0, queued = 0, total = (uint64_t) -1, obj_size;
+	struct vdi_rw_work *works = NULL;
+	struct work_queue *wq;
+
+	if (argv[optind]) {
+		ret = option_parse_size(argv[optind++], &offset);
+		if (ret < 0)
+			return EXIT_USAGE;
+		if (argv[optind]) {
+			ret = option_parse_size(argv[optind++], &total);
+			if (ret < 0)
+				return EXIT_USAGE;
+		}
+	}
+
+	inode = xmalloc(sizeof(*inode));
+	wq = create_work_queue("vdi write", WQ_UNLIMITED);
+
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+	obj_size = vdi_object_size(inode);
+	works = vdi_rw_alloc(nr_jobs, obj_size);
+
+	if (inode->vdi_size < offset) {
+		sd_err("Write offset is beyond the end of the VDI");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (vdi_cmd_data.writeback)
+		flags |= SD_FLAG_CMD_CACHE;
+
+	total = min(total, inode->vdi_size - offset);
+	idx = offset / obj_size;
+	offset %= obj_size;
+	while (queued < total || nr) {
+		struct vdi_rw_work *w;
+
+		for (; nr < nr_jobs && queued < total; nr++) {
+			w = works + (head + nr) % nr_jobs;
+			w->len = min(total - queued, obj_size - offset);
+			w->offset = offset;
+			w->idx = idx;
+			w->write = true;
+			w->create = false;
+			w->cow_oid = 0;
+			w->flags = flags;
+			w->copies = inode->nr_copies;
+			w->copy_policy = inode->copy_policy;
+			w->ret = SD_RES_SUCCESS;
+
+			ret = xread(STDIN_FILENO, w->buf, w->len);
+			if (ret < 0) {
+				sd_err("Failed to read from stdin: %m");
+				ret = EXIT_SYSFAIL;
 				goto out;
+			} else if (ret < w->len) {
+				/* exit after this buffer is sent */
+				memset(w->buf + ret, 0, w->len - ret);
+				total = queued + w->len;
 			}
-		}
 
-		offset += len;
-		if (offset == SD_DATA_OBJ_SIZE) {
+			vdi_id = sd_inode_get_vid(inode, idx);
+			if (!vdi_id)
+				w->create = true;
+			else if (!is_data_obj_writeable(inode, idx)) {
+				w->create = true;
+				w->cow_oid = vid_to_data_oid(vdi_id, idx);
+			}
+
+			queued += w->len;
 			offset = 0;
 			idx++;
+
+			/* an unallocated object is all zero already */
+			if (!vdi_id && is_zero_block(w->buf, w->len)) {
+				w->create = false;
+				continue;
+			}
+			w->oid = vid_to_data_oid(inode->vdi_id, w->idx);
+			vdi_rw_queue(wq, w);
+		}
+
+		w = works + head;
+		vdi_rw_wait(w);
+		if (w->ret != SD_RES_SUCCESS) {
+			sd_err("Failed to write VDI");
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		/* the inode is updated in the order of the objects */
+		if (w->create) {
+			sd_inode_set_vid(inode, w->idx, inode->vdi_id);
+			ret = sd_inode_write_vid(inode, w->idx, vid, vid, flags,
+						 false, false);
+			if (ret) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
 		}
-		done += len;
+
+		head = (head + 1) % nr_jobs;
+		nr--;
 	}
 	ret = EXIT_SUCCESS;
 out:
+	vdi_rw_free(wq, works, nr_jobs);
 	free(inode);
-	free(buf);
 
 	return ret;
 }
@@ -1595,12 +2185,43 @@ struct vdi_check_work {
 	struct vdi_check_info *info;
 	const struct sd_vnode *vnode;
 	uint8_t hash[SHA1_DIGEST_SIZE];
+	/* the digests of the blocks, NULL if the sheep gave only the hash */
+	uint8_t (*blocks)[SHA1_DIGEST_SIZE];
 	uint8_t ec_index;
 	uint8_t *buf;
 	bool object_found;
 	struct work work;
 };
 
+/* A vdi being checked by 'dog vdi check' or 'dog cluster check' */
+struct check_vdi {
+	uint32_t vid;
+	char name[SD_MAX_VDI_LEN];
+	uint8_t nr_copies;
+	uint8_t copy_policy;
+	uint64_t vdi_size;
+	uint64_t obj_size;
+	int nr_pending; /* the objects being checked */
+
+	/* of 'dog cluster check', see check_vdi_done() */
+	int nr_waiting; /* the objects waiting in the check_node lists */
+	bool queued; /* all the objects are waiting or being checked */
+};
+
+/* The objects of 'dog cluster check' by the node of their first copy */
+struct check_node {
+	const struct sd_node *node;
+	struct list_head waiting;
+	int nr_inflight;
+	struct rb_node rb;
+};
+
+struct check_obj {
+	uint64_t oid;
+	struct check_vdi *cv;
+	struct list_node list;
+};
+
 enum vdi_check_result {
 	VDI_CHECK_NO_OBJ_FOUND,
 	VDI_CHECK_NO_MAJORITY_FOUND,
@@ -1612,21 +2233,40 @@ struct vdi_check_info {
 	uint8_t nr_copies;
 	uint8_t copy_policy;
 	uint64_t total;
+	uint64_t obj_size;
 	uint64_t *done;
 	int refcnt;
 	struct work_queue *wq;
+	struct check_vdi *cv;
+	struct check_node *cn;
 	enum vdi_check_result result;
 	struct vdi_check_work *majority;
 	struct vdi_check_work vcw[0];
 };
 
+/* the number of objects being checked */
+static int nr_vdi_checks;
+
+static void check_vdi_done(struct check_vdi *cv);
+
 static void free_vdi_check_info(struct vdi_check_info *info)
 {
+	struct check_vdi *cv = info->cv;
+
 	if (info->done) {
-		*info->done += SD_DATA_OBJ_SIZE;
+		*info->done += info->obj_size;
 		vdi_show_progress(*info->done, info->total);
 	}
+	if (info->cn)
+		info->cn->nr_inflight--;
+	for (int i = 0; i < info->nr_copies; i++)
+		free(info->vcw[i].blocks);
 	free(info);
+	nr_vdi_checks--;
+
+	cv->nr_pending--;
+	if (cv->queued && !cv->nr_waiting && !cv->nr_pending)
+		check_vdi_done(cv);
 }
 
 static void vdi_repair_work(struct work *work)
@@ -1688,20 +2328,47 @@ static void vdi_check_object_work(struct work *work)
 						    info->oid);
 		hdr.obj.ec_index = vcw->ec_index;
 		hdr.epoch = sd_epoch;
+		hdr.flags = SD_FLAG_CMD_BACKGROUND;
 		vcw->buf = xmalloc(hdr.data_length);
-	} else
-		sd_init_req(&hdr, SD_OP_GET_HASH);
+	} else {
+		sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+		hdr.data_length = SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE;
+		hdr.epoch = sd_epoch;
+		vcw->blocks = xmalloc(hdr.data_length);
+		vcw->buf = (uint8_t *)vcw->blocks;
+	}
 	hdr.obj.oid = info->oid;
 	hdr.obj.tgt_epoch = sd_epoch;
 
 	ret = dog_exec_req(&vcw->vnode->node->nid, &hdr, vcw->buf);
-	if (ret < 0)
+	if (ret < 0 && !vcw->blocks)
 		exit(EXIT_SYSFAIL);
 
+	/*
+	 * The sheep has no digests of the blocks, or is an older one which
+	 * closes the connection on SD_OP_GET_BLOCK_HASH, ask for the whole hash
+	 */
+	if (vcw->blocks && (ret < 0 || rsp->result == SD_RES_NO_SUPPORT ||
+			    rsp->result == SD_RES_INVALID_PARMS)) {
+		free(vcw->blocks);
+		vcw->blocks = NULL;
+		vcw->buf = NULL;
+		sd_init_req(&hdr, SD_OP_GET_HASH);
+		hdr.obj.oid = info->oid;
+		hdr.obj.tgt_epoch = sd_epoch;
+		ret = dog_exec_req(&vcw->vnode->node->nid, &hdr, NULL);
+		if (ret < 0)
+			exit(EXIT_SYSFAIL);
+	}
+
 	switch (rsp->result) {
 	case SD_RES_SUCCESS:
 		vcw->object_found = true;
-		if (!is_erasure_oid(info->oid, info->copy_policy))
+		/* the hash of an object is the sha1 of its block digests */
+		if (vcw->blocks)
+			get_buffer_sha1(vcw->buf, SD_BLOCK_HASH_NR *
+					SHA1_DIGEST_SIZE, vcw->hash);
+		else if (!is_erasure_oid(info->oid, info->copy_policy))
 			memcpy(vcw->hash, rsp->hash.digest, sizeof(vcw->hash));
 		break;
 	case SD_RES_NO_OBJ:
@@ -1816,6 +2483,47 @@ out:
 	ec_destroy(ctx);
 }
 
+/*
+ * Without a majority of the copies, a copy which has the majority of each of
+ * its blocks is the good one, e.g. of three copies with a different block
+ * broken each
+ */
+static struct vdi_check_work *vote_majority_blocks(struct vdi_check_info *info)
+{
+	int nr_live_copies = 0;
+
+	for (int i = 0; i < info->nr_copies; i++) {
+		if (!info->vcw[i].object_found)
+			continue;
+		if (!info->vcw[i].blocks)
+			return NULL;
+		nr_live_copies++;
+	}
+
+	for (int i = 0; i < info->nr_copies; i++) {
+		struct vdi_check_work *vcw = &info->vcw[i];
+		int b;
+
+		if (!vcw->object_found)
+			continue;
+		for (b = 0; b < SD_BLOCK_HASH_NR; b++) {
+			int count = 0;
+
+			for (int j = 0; j < info->nr_copies; j++)
+				if (info->vcw[j].object_found &&
+				    !memcmp(vcw->blocks[b],
+					    info->vcw[j].blocks[b],
+					    SHA1_DIGEST_SIZE))
+					count++;
+			if (count <= nr_live_copies / 2)
+				break;
+		}
+		if (b == SD_BLOCK_HASH_NR)
+			return vcw;
+	}
+	return NULL;
+}
+
 static void vote_majority_object(struct vdi_check_info *info)
 {
 	/*
@@ -1864,9 +2572,11 @@ static void vote_majority_object(struct vdi_check_info *info)
 	else if (count > nr_live_copies / 2)
 		info->result = VDI_CHECK_SUCCESS;
 	else {
-		/* no majority found */
-		majority = NULL;
-		info->result = VDI_CHECK_NO_MAJORITY_FOUND;
+		majority = vote_majority_blocks(info);
+		if (majority)
+			info->result = VDI_CHECK_SUCCESS;
+		else
+			info->result = VDI_CHECK_NO_MAJORITY_FOUND;
 	}
 
 	info->majority = majority;
@@ -1893,99 +2603,382 @@ static void vdi_check_object_main(struct work *work)
 		free_vdi_check_info(info);
 }
 
-static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
+static void queue_vdi_check_work(struct check_vdi *cv, uint64_t oid,
 				 uint64_t *done, struct work_queue *wq,
-				 int nr_copies)
+				 struct check_node *cn)
 {
 	struct vdi_check_info *info;
 	const struct sd_vnode *tgt_vnodes[SD_MAX_COPIES];
+	int nr_copies = cv->nr_copies;
+
+	/* bound the memory of the digests and the strips in flight */
+	while (nr_vdi_checks >= vdi_cmd_data.nr_jobs)
+		event_loop(-1);
+	nr_vdi_checks++;
+	cv->nr_pending++;
+	if (cn)
+		cn->nr_inflight++;
 
 	info = xzalloc(sizeof(*info) + sizeof(info->vcw[0]) * nr_copies);
 	info->oid = oid;
 	info->nr_copies = nr_copies;
-	info->total = inode->vdi_size;
+	info->total = cv->vdi_size;
+	info->obj_size = cv->obj_size;
 	info->done = done;
 	info->wq = wq;
-	info->copy_policy = inode->copy_policy;
+	info->cv = cv;
+	info->cn = cn;
+	info->copy_policy = cv->copy_policy;
+
+	oid_to_vnodes(oid, &sd_vroot, nr_copies, tgt_vnodes);
+	for (int i = 0; i < nr_copies; i++) {
+		info->vcw[i].info = info;
+		info->vcw[i].ec_index = i;
+		info->vcw[i].vnode = tgt_vnodes[i];
+		info->vcw[i].work.fn = vdi_check_object_work;
+		info->vcw[i].work.done = vdi_check_object_main;
+		info->refcnt++;
+		queue_work(info->wq, &info->vcw[i].work);
+	}
+}
+
+struct check_arg {
+	struct check_vdi *cv;
+	uint64_t *done;
+	struct work_queue *wq;
+};
+
+static void check_cb(struct sd_index *idx, void *arg, int ignore)
+{
+	struct check_arg *carg = arg;
+	uint64_t oid;
+
+	if (idx->vdi_id) {
+		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
+		*(carg->done) = idx->idx * carg->cv->obj_size;
+		vdi_show_progress(*(carg->done), carg->cv->vdi_size);
+		queue_vdi_check_work(carg->cv, oid, NULL, carg->wq, NULL);
+	}
+}
+
+/*
+ * A data object of a hybrid vdi is either replicated under oid | HOT_BIT or
+ * erasure coded under oid, and may move between the two while it's checked,
+ * which the check doesn't tell apart.
+ */
+static bool check_hybrid_vdi(const struct sd_inode *inode)
+{
+	if (!inode->hybrid)
+		return true;
+
+	sd_err("ABORT: %s is a hybrid vdi, its hot and cold objects can't be"
+	       " checked", inode->name);
+	return false;
+}
+
+/* Fill in cv for the check of the vdi, false if it can't be checked now */
+static bool init_check_vdi(const struct sd_inode *inode, struct check_vdi *cv)
+{
+	if (!check_hybrid_vdi(inode))
+		return false;
+
+	if (0 < inode->copy_policy && sd_zones_nr < (int)inode->nr_copies) {
+		sd_err("ABORT: Not enough active zones for consistency-checking"
+		       " erasure coded VDI");
+		return false;
+	}
+
+	cv->vid = inode->vdi_id;
+	pstrcpy(cv->name, sizeof(cv->name), inode->name);
+	cv->nr_copies = min((int)inode->nr_copies, sd_zones_nr);
+	cv->copy_policy = inode->copy_policy;
+	cv->vdi_size = inode->vdi_size;
+	cv->obj_size = vdi_object_size(inode);
+	return true;
+}
+
+int do_vdi_check(const struct sd_inode *inode)
+{
+	uint32_t max_idx;
+	uint64_t done = 0, oid;
+	uint32_t vid;
+	struct work_queue *wq;
+	struct check_vdi cv = {};
+
+	if (!init_check_vdi(inode, &cv))
+		return EXIT_FAILURE;
+
+	wq = create_work_queue("vdi check", WQ_DYNAMIC);
+
+	init_fec();
+
+	queue_vdi_check_work(&cv, vid_to_vdi_oid(inode->vdi_id), NULL, wq,
+			     NULL);
+
+	if (inode->store_policy == 0) {
+		max_idx = count_data_objs(inode);
+		vdi_show_progress(done, inode->vdi_size);
+		for (uint32_t idx = 0; idx < max_idx; idx++) {
+			vid = sd_inode_get_vid(inode, idx);
+			if (vid) {
+				oid = vid_to_data_oid(vid, idx);
+				queue_vdi_check_work(&cv, oid, &done, wq,
+						     NULL);
+			} else {
+				done += vdi_object_size(inode);
+				vdi_show_progress(done, inode->vdi_size);
+			}
+		}
+	} else {
+		struct check_arg arg = {&cv, &done, wq};
+		sd_inode_index_walk(inode, check_cb, &arg);
+		vdi_show_progress(inode->vdi_size, inode->vdi_size);
+	}
+
+	work_queue_wait(wq);
+
+	fprintf(stdout, "finish check&repair %s\n", inode->name);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * dog cluster check
+ *
+ * The objects of all the vdis are checked together, up to nr_jobs at a time,
+ * so that the small vdis don't leave the cluster idle.  They wait in a list
+ * per node of their first copy, which are taken in turn with up to twice
+ * their share of nr_jobs each, so the reads are spread over the nodes.  The
+ * vdis are read as the lists drain, keeping up to CHECK_MAX_WAITING objects
+ * in them.  With a bandwidth budget, the objects are started no faster than
+ * rate bytes of all their copies per second.
+ *
+ * A vdi whose objects are all checked is appended to the checkpoint file,
+ * and the vdis in the file are skipped, so an interrupted check resumes.
+ */
+#define CHECK_MAX_WAITING 65536
+
+static struct cluster_check {
+	struct work_queue *wq;
+	struct rb_root nodes;
+	int nr_nodes;
+	struct check_node *next; /* whose turn it is */
+	int nr_waiting;
+	int node_jobs;
+
+	uint64_t rate;
+	uint64_t start;
+	uint64_t bytes;
+
+	FILE *checkpoint;
+	unsigned long *checked; /* the vids in the checkpoint */
+} cc = {
+	.nodes = RB_ROOT,
+};
+
+static int check_node_cmp(const struct check_node *a,
+			  const struct check_node *b)
+{
+	return node_cmp(a->node, b->node);
+}
+
+static struct check_node *next_check_node(struct check_node *cn)
+{
+	struct rb_node *n = rb_next(&cn->rb);
+
+	if (!n)
+		n = rb_first(&cc.nodes);
+	return rb_entry(n, struct check_node, rb);
+}
+
+/* Wait until the bytes more start within the bandwidth budget */
+static void check_throttle(uint64_t bytes)
+{
+	uint64_t due = cc.start + (uint64_t)((double)cc.bytes * 1000000000 /
+					     cc.rate);
+	uint64_t now = clock_get_time();
+	struct timespec ts;
+
+	cc.bytes += bytes;
+	if (due <= now)
+		return;
+	ts.tv_sec = (due - now) / 1000000000;
+	ts.tv_nsec = (due - now) % 1000000000;
+	nanosleep(&ts, NULL);
+}
 
-	oid_to_vnodes(oid, &sd_vroot, nr_copies, tgt_vnodes);
-	for (int i = 0; i < nr_copies; i++) {
-		info->vcw[i].info = info;
-		info->vcw[i].ec_index = i;
-		info->vcw[i].vnode = tgt_vnodes[i];
-		info->vcw[i].work.fn = vdi_check_object_work;
-		info->vcw[i].work.done = vdi_check_object_main;
-		info->refcnt++;
-		queue_work(info->wq, &info->vcw[i].work);
+/* Start the waiting objects the budgets allow, the nodes in turn */
+static void check_dispatch(void)
+{
+	struct check_node *cn = cc.next;
+	struct check_obj *obj;
+	int idle = 0;
+
+	while (cc.nr_waiting && nr_vdi_checks < vdi_cmd_data.nr_jobs &&
+	       idle < cc.nr_nodes) {
+		if (list_empty(&cn->waiting) ||
+		    cn->nr_inflight >= cc.node_jobs) {
+			idle++;
+			cn = next_check_node(cn);
+			continue;
+		}
+		idle = 0;
+
+		obj = list_first_entry(&cn->waiting, struct check_obj, list);
+		list_del(&obj->list);
+		cc.nr_waiting--;
+		obj->cv->nr_waiting--;
+		if (cc.rate)
+			check_throttle(obj->cv->obj_size * obj->cv->nr_copies);
+		queue_vdi_check_work(obj->cv, obj->oid, NULL, cc.wq, cn);
+		free(obj);
+		cn = next_check_node(cn);
 	}
+	cc.next = cn;
 }
 
-struct check_arg {
-	const struct sd_inode *inode;
-	uint64_t *done;
-	struct work_queue *wq;
-	int nr_copies;
-};
+/* Let the waiting objects go down to max */
+static void check_drain(int max)
+{
+	while (cc.nr_waiting > max) {
+		check_dispatch();
+		if (cc.nr_waiting > max)
+			event_loop(-1);
+	}
+}
 
-static void check_cb(struct sd_index *idx, void *arg, int ignore)
+static void check_add(struct check_vdi *cv, uint64_t oid)
 {
-	struct check_arg *carg = arg;
-	uint64_t oid;
+	struct check_obj *obj = xzalloc(sizeof(*obj));
+	struct check_node key, *cn;
+
+	key.node = oid_to_vnode(oid, &sd_vroot, 0)->node;
+	cn = rb_search(&cc.nodes, &key, rb, check_node_cmp);
+
+	obj->oid = oid;
+	obj->cv = cv;
+	list_add_tail(&obj->list, &cn->waiting);
+	cv->nr_waiting++;
+	if (++cc.nr_waiting >= CHECK_MAX_WAITING)
+		check_drain(CHECK_MAX_WAITING / 2);
+}
 
-	if (idx->vdi_id) {
-		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
-		*(carg->done) = (uint64_t)idx->idx * SD_DATA_OBJ_SIZE;
-		vdi_show_progress(*(carg->done), carg->inode->vdi_size);
-		queue_vdi_check_work(carg->inode, oid, NULL, carg->wq,
-				     carg->nr_copies);
+static void check_vdi_done(struct check_vdi *cv)
+{
+	fprintf(stdout, "finish check&repair %s\n", cv->name);
+	if (cc.checkpoint) {
+		fprintf(cc.checkpoint, "%"PRIx32"\n", cv->vid);
+		fflush(cc.checkpoint);
 	}
+	free(cv);
 }
 
-int do_vdi_check(const struct sd_inode *inode)
+static void cluster_check_index_cb(struct sd_index *idx, void *arg, int ignore)
 {
-	uint32_t max_idx;
-	uint64_t done = 0, oid;
-	uint32_t vid;
-	struct work_queue *wq;
-	int nr_copies = min((int)inode->nr_copies, sd_zones_nr);
+	if (idx->vdi_id)
+		check_add(arg, vid_to_data_oid(idx->vdi_id, idx->idx));
+}
 
-	if (0 < inode->copy_policy && sd_zones_nr < (int)inode->nr_copies) {
-		sd_err("ABORT: Not enough active zones for consistency-checking"
-		       " erasure coded VDI");
-		return EXIT_FAILURE;
-	}
+static void cluster_check_cb(uint32_t vid, const char *name, const char *tag,
+			     uint32_t snapid, uint32_t flags,
+			     const struct sd_inode *inode, void *data)
+{
+	struct check_vdi *cv;
+	uint32_t max_idx;
 
-	wq = create_work_queue("vdi check", WQ_DYNAMIC);
+	if (test_bit(vid, cc.checked))
+		return;
 
-	init_fec();
+	if (vdi_is_snapshot(inode))
+		printf("Checking snapshot %s (id: %d, tag: \"%s\")\n", name,
+		       snapid, tag);
+	else
+		printf("Checking vdi %s\n", name);
 
-	queue_vdi_check_work(inode, vid_to_vdi_oid(inode->vdi_id), NULL, wq,
-			     nr_copies);
+	cv = xzalloc(sizeof(*cv));
+	if (!init_check_vdi(inode, cv)) {
+		free(cv);
+		return;
+	}
 
+	check_add(cv, vid_to_vdi_oid(vid));
 	if (inode->store_policy == 0) {
 		max_idx = count_data_objs(inode);
-		vdi_show_progress(done, inode->vdi_size);
 		for (uint32_t idx = 0; idx < max_idx; idx++) {
-			vid = sd_inode_get_vid(inode, idx);
-			if (vid) {
-				oid = vid_to_data_oid(vid, idx);
-				queue_vdi_check_work(inode, oid, &done, wq,
-						     nr_copies);
-			} else {
-				done += SD_DATA_OBJ_SIZE;
-				vdi_show_progress(done, inode->vdi_size);
-			}
+			uint32_t data_vid = sd_inode_get_vid(inode, idx);
+
+			if (data_vid)
+				check_add(cv, vid_to_data_oid(data_vid, idx));
 		}
-	} else {
-		struct check_arg arg = {inode, &done, wq, nr_copies};
-		sd_inode_index_walk(inode, check_cb, &arg);
-		vdi_show_progress(inode->vdi_size, inode->vdi_size);
+	} else
+		sd_inode_index_walk(inode, cluster_check_index_cb, cv);
+
+	cv->queued = true;
+	if (!cv->nr_waiting && !cv->nr_pending)
+		check_vdi_done(cv);
+}
+
+static int load_checkpoint(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	uint32_t vid;
+
+	if (!fp) {
+		if (errno == ENOENT)
+			goto out;
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+	while (fscanf(fp, "%"SCNx32, &vid) == 1)
+		if (vid < SD_NR_VDIS)
+			set_bit(vid, cc.checked);
+	fclose(fp);
+out:
+	cc.checkpoint = fopen(path, "a");
+	if (!cc.checkpoint) {
+		sd_err("failed to open %s, %m", path);
+		return -1;
 	}
+	return 0;
+}
 
-	work_queue_wait(wq);
+/*
+ * Check and repair all the vdis, up to nr_jobs objects at a time and within
+ * rate bytes per second if it isn't 0, skipping the vdis in the checkpoint
+ * file and appending the checked ones to it if it isn't NULL
+ */
+int do_cluster_check(int nr_jobs, uint64_t rate, const char *checkpoint)
+{
+	struct sd_node *n;
+	struct check_node *cn;
 
-	fprintf(stdout, "finish check&repair %s\n", inode->name);
+	cc.checked = alloc_bitmap(NULL, 0, SD_NR_VDIS);
+	if (checkpoint && load_checkpoint(checkpoint) < 0)
+		return EXIT_SYSFAIL;
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		cn = xzalloc(sizeof(*cn));
+		cn->node = n;
+		INIT_LIST_HEAD(&cn->waiting);
+		rb_insert(&cc.nodes, cn, rb, check_node_cmp);
+		cc.nr_nodes++;
+	}
+	cc.next = rb_entry(rb_first(&cc.nodes), struct check_node, rb);
+	vdi_cmd_data.nr_jobs = nr_jobs;
+	cc.node_jobs = DIV_ROUND_UP(2 * nr_jobs, cc.nr_nodes);
+	cc.rate = rate;
+	cc.start = clock_get_time();
 
+	cc.wq = create_work_queue("vdi check", WQ_DYNAMIC);
+	init_fec();
+
+	if (parse_vdi(cluster_check_cb, SD_INODE_SIZE, NULL, true) < 0)
+		return EXIT_SYSFAIL;
+	check_drain(0);
+	work_queue_wait(cc.wq);
+
+	if (cc.checkpoint)
+		fclose(cc.checkpoint);
 	return EXIT_SUCCESS;
 }
 
@@ -2003,6 +2996,11 @@ static int vdi_check(int argc, char **argv)
 		goto out;
 	}
 
+	if (!check_hybrid_vdi(inode)) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
 	if (vdi_cmd_data.exist)
 		ret = do_vdi_check_exist(inode);
 	else
@@ -2012,9 +3010,19 @@ out:
 	return ret;
 }
 
-/* vdi backup format */
+/*
+ * vdi backup format
+ *
+ * The backup header is followed by the records of the changed ranges of the
+ * objects, in the order of the objects, then by a record of the index
+ * UINT32_MAX.  The data of a record follows it, compressed with zlib if
+ * zlength isn't 0.  An object may have several records, one per changed range,
+ * which are always next to each other, so the records of an object are
+ * restored together and the objects in parallel.  Version 1 has a single
+ * uncompressed record per object.
+ */
 
-#define VDI_BACKUP_FORMAT_VERSION 1
+#define VDI_BACKUP_FORMAT_VERSION 2
 #define VDI_BACKUP_MAGIC 0x11921192
 
 struct backup_hdr {
@@ -2026,10 +3034,12 @@ struct obj_backup {
 	uint32_t idx;
 	uint32_t offset;
 	uint32_t length;
-	uint32_t reserved;
+	uint32_t zlength; /* of the compressed data, or 0 (reserved in v1) */
 	uint8_t data[SD_DATA_OBJ_SIZE];
 };
 
+#define OBJ_BACKUP_HDR_SIZE offsetof(struct obj_backup, data)
+
 /* discards redundant area from backup data */
 static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data)
 {
@@ -2064,22 +3074,26 @@ static int get_obj_backup(uint32_t idx, uint32_t from_vid, uint32_t to_vid,
 	backup->length = SD_DATA_OBJ_SIZE;
 
 	if (to_vid) {
-		ret = dog_read_object(vid_to_data_oid(to_vid, idx),
-				      backup->data, SD_DATA_OBJ_SIZE, 0, true);
+		ret = dog_read_sparse_object(vid_to_data_oid(to_vid, idx),
+					     backup->data, SD_DATA_OBJ_SIZE, 0,
+					     true, true);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to read object %" PRIx32 ", %d", to_vid,
 			       idx);
+			free(from_data);
 			return EXIT_FAILURE;
 		}
 	} else
 		memset(backup->data, 0, SD_DATA_OBJ_SIZE);
 
 	if (from_vid) {
-		ret = dog_read_object(vid_to_data_oid(from_vid, idx), from_data,
-				      SD_DATA_OBJ_SIZE, 0, true);
+		ret = dog_read_sparse_object(vid_to_data_oid(from_vid, idx),
+					     from_data, SD_DATA_OBJ_SIZE, 0,
+					     true, true);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to read object %" PRIx32 ", %d",
 			       from_vid, idx);
+			free(from_data);
 			return EXIT_FAILURE;
 		}
 	}
@@ -2091,18 +3105,198 @@ static int get_obj_backup(uint32_t idx, uint32_t from_vid, uint32_t to_vid,
 	return EXIT_SUCCESS;
 }
 
+/* A changed range of an object, with its data compressed if zdata is set */
+struct backup_extent {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t zlength;
+	void *zdata;
+};
+
+/*
+ * The backup of an object, in the data of backup at the offsets of the object
+ *
+ * The objects are backed up by up to vdi_cmd_data.nr_jobs works at a time,
+ * and written out in their order.  The digests of the blocks of both the
+ * replicated objects are asked to the nodes holding them, so only the blocks
+ * which differ are read.
+ */
+struct backup_work {
+	struct work work;
+	uint32_t idx, from_vid, to_vid;
+	bool replicated;
+	bool busy;
+	int ret;
+	int nr_extents;
+	struct backup_extent extents[SD_BLOCK_HASH_NR];
+	struct obj_backup *backup;
+};
+
+static int backup_get_block_hash(uint64_t oid,
+				 uint8_t digests[][SHA1_DIGEST_SIZE])
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.epoch = sd_epoch;
+	hdr.data_length = SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = sd_epoch;
+
+	if (dog_exec_req(oid_to_gateway(oid), &hdr, digests) < 0 ||
+	    rsp->result != SD_RES_SUCCESS)
+		return -1;
+	return 0;
+}
+
+/* Return SD_RES_NO_SUPPORT if the digests of the blocks aren't available */
+static int backup_changed_blocks(struct backup_work *w)
+{
+	uint8_t from[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint8_t to[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint32_t bsize = SD_DATA_OBJ_SIZE / SD_BLOCK_HASH_NR;
+	uint64_t to_oid = vid_to_data_oid(w->to_vid, w->idx);
+	int ret;
+
+	if (backup_get_block_hash(vid_to_data_oid(w->from_vid, w->idx),
+				  from) < 0 ||
+	    backup_get_block_hash(to_oid, to) < 0)
+		return SD_RES_NO_SUPPORT;
+
+	for (int i = 0, j; i < SD_BLOCK_HASH_NR; i = j) {
+		struct backup_extent *e;
+
+		if (!memcmp(from[i], to[i], SHA1_DIGEST_SIZE)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < SD_BLOCK_HASH_NR; j++)
+			if (!memcmp(from[j], to[j], SHA1_DIGEST_SIZE))
+				break;
+
+		e = w->extents + w->nr_extents++;
+		e->offset = i * bsize;
+		e->length = (j - i) * bsize;
+		ret = dog_read_object_from(oid_to_gateway(to_oid), to_oid,
+					   w->backup->data + e->offset,
+					   e->length, e->offset, true, true);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	return SD_RES_SUCCESS;
+}
+
+#ifdef HAVE_COMPRESS
+static void backup_compress(struct backup_work *w)
+{
+	for (int i = 0; i < w->nr_extents; i++) {
+		struct backup_extent *e = w->extents + i;
+		uLongf zlen = compressBound(e->length);
+		void *z = xmalloc(zlen);
+
+		if (compress2(z, &zlen, w->backup->data + e->offset, e->length,
+			      Z_BEST_SPEED) != Z_OK || zlen >= e->length) {
+			free(z);
+			continue;
+		}
+		e->zdata = z;
+		e->zlength = zlen;
+	}
+}
+#else
+static void backup_compress(struct backup_work *w) {}
+#endif
+
+static void backup_object_work(struct work *work)
+{
+	struct backup_work *w = container_of(work, struct backup_work, work);
+	struct obj_backup *backup = w->backup;
+	int ret = SD_RES_NO_SUPPORT;
+
+	w->nr_extents = 0;
+	if (w->from_vid && w->to_vid && w->replicated)
+		ret = backup_changed_blocks(w);
+	if (ret == SD_RES_NO_SUPPORT) {
+		w->nr_extents = 0;
+		w->ret = get_obj_backup(w->idx, w->from_vid, w->to_vid, backup);
+		if (w->ret != EXIT_SUCCESS || !backup->length)
+			return;
+		w->extents[0].offset = backup->offset;
+		w->extents[0].length = backup->length;
+		w->nr_extents = 1;
+	} else if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to read object %" PRIx32 ", %d", w->to_vid,
+		       w->idx);
+		w->ret = EXIT_FAILURE;
+		return;
+	}
+
+	if (vdi_cmd_data.compress)
+		backup_compress(w);
+	w->ret = EXIT_SUCCESS;
+}
+
+static void backup_object_done(struct work *work)
+{
+	struct backup_work *w = container_of(work, struct backup_work, work);
+
+	w->busy = false;
+}
+
+static void backup_free_extents(struct backup_work *w)
+{
+	for (int i = 0; i < w->nr_extents; i++) {
+		free(w->extents[i].zdata);
+		w->extents[i].zdata = NULL;
+		w->extents[i].zlength = 0;
+	}
+	w->nr_extents = 0;
+}
+
+static int backup_write_object(struct backup_work *w)
+{
+	struct obj_backup *backup = w->backup;
+
+	for (int i = 0; i < w->nr_extents; i++) {
+		struct backup_extent *e = w->extents + i;
+
+		backup->idx = w->idx;
+		backup->offset = e->offset;
+		backup->length = e->length;
+		backup->zlength = e->zlength;
+		if (xwrite(STDOUT_FILENO, backup, OBJ_BACKUP_HDR_SIZE) < 0 ||
+		    xwrite(STDOUT_FILENO,
+			   e->zdata ? e->zdata : backup->data + e->offset,
+			   e->zdata ? e->zlength : e->length) < 0) {
+			sd_err("failed to write backup data, %m");
+			return EXIT_SYSFAIL;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
 static int vdi_backup(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	int ret = EXIT_SUCCESS;
-	uint32_t idx, nr_objs;
+	int ret = EXIT_SUCCESS, nr_jobs = vdi_cmd_data.nr_jobs;
+	int head = 0, nr = 0;
+	uint32_t idx = 0, nr_objs;
 	struct sd_inode *from_inode = xzalloc(sizeof(*from_inode));
 	struct sd_inode *to_inode = xzalloc(sizeof(*to_inode));
 	struct backup_hdr hdr = {
 		.version = VDI_BACKUP_FORMAT_VERSION,
 		.magic = VDI_BACKUP_MAGIC,
 	};
-	struct obj_backup *backup = xzalloc(sizeof(*backup));
+	struct obj_backup *end = xzalloc(sizeof(*end));
+	struct backup_work *works = xcalloc(nr_jobs, sizeof(*works));
+	struct work_queue *wq = create_work_queue("vdi backup", WQ_UNLIMITED);
+
+	for (int i = 0; i < nr_jobs; i++) {
+		works[i].work.fn = backup_object_work;
+		works[i].work.done = backup_object_done;
+		works[i].backup = xmalloc(sizeof(*works[i].backup));
+	}
 
 	if ((!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) ||
 	    (!vdi_cmd_data.from_snapshot_id &&
@@ -2112,6 +3306,14 @@ static int vdi_backup(int argc, char **argv)
 		goto out;
 	}
 
+#ifndef HAVE_COMPRESS
+	if (vdi_cmd_data.compress) {
+		sd_err("compress is not supported");
+		ret = EXIT_USAGE;
+		goto out;
+	}
+#endif
+
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.from_snapshot_id,
 			   vdi_cmd_data.from_snapshot_tag, NULL,
 			   from_inode, SD_INODE_SIZE);
@@ -2124,6 +3326,14 @@ static int vdi_backup(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	/* the backup format holds the objects of the default size */
+	if (vdi_object_size(to_inode) != SD_DATA_OBJ_SIZE) {
+		sd_err("The backup of the VDIs of %s objects isn't supported",
+		       strnumber(vdi_object_size(to_inode)));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
 	nr_objs = count_data_objs(to_inode);
 
 	ret = xwrite(STDOUT_FILENO, &hdr, sizeof(hdr));
@@ -2133,41 +3343,46 @@ static int vdi_backup(int argc, char **argv)
 		goto out;
 	}
 
-	for (idx = 0; idx < nr_objs; idx++) {
-		uint32_t from_vid = sd_inode_get_vid(from_inode, idx);
-		uint32_t to_vid = sd_inode_get_vid(to_inode, idx);
-
-		if (to_vid == 0 && from_vid == 0)
-			continue;
+	while (idx < nr_objs || nr) {
+		struct backup_work *w;
 
-		ret = get_obj_backup(idx, from_vid, to_vid, backup);
-		if (ret != EXIT_SUCCESS)
-			goto out;
+		for (; nr < nr_jobs && idx < nr_objs; idx++) {
+			uint32_t from_vid = sd_inode_get_vid(from_inode, idx);
+			uint32_t to_vid = sd_inode_get_vid(to_inode, idx);
 
-		if (backup->length == 0)
-			continue;
+			/* the snapshots share the object if it is unchanged */
+			if (to_vid == from_vid)
+				continue;
 
-		ret = xwrite(STDOUT_FILENO, backup,
-			     sizeof(*backup) - sizeof(backup->data));
-		if (ret < 0) {
-			sd_err("failed to write backup data, %m");
-			ret = EXIT_SYSFAIL;
-			goto out;
+			w = works + (head + nr++) % nr_jobs;
+			w->idx = idx;
+			w->from_vid = from_vid;
+			w->to_vid = to_vid;
+			w->replicated = !to_inode->copy_policy &&
+					!from_inode->copy_policy;
+			w->busy = true;
+			queue_work(wq, &w->work);
 		}
-		ret = xwrite(STDOUT_FILENO, backup->data + backup->offset,
-			     backup->length);
-		if (ret < 0) {
-			sd_err("failed to write backup data, %m");
-			ret = EXIT_SYSFAIL;
+		if (!nr)
+			break;
+
+		w = works + head;
+		while (w->busy)
+			event_loop(-1);
+		ret = w->ret;
+		if (ret == EXIT_SUCCESS)
+			ret = backup_write_object(w);
+		backup_free_extents(w);
+		if (ret != EXIT_SUCCESS)
 			goto out;
-		}
+
+		head = (head + 1) % nr_jobs;
+		nr--;
 	}
 
 	/* write end marker */
-	memset(backup, 0, sizeof(*backup) - sizeof(backup->data));
-	backup->idx = UINT32_MAX;
-	ret = xwrite(STDOUT_FILENO, backup,
-		     sizeof(*backup) - sizeof(backup->data));
+	end->idx = UINT32_MAX;
+	ret = xwrite(STDOUT_FILENO, end, OBJ_BACKUP_HDR_SIZE);
 	if (ret < 0) {
 		sd_err("failed to write end marker, %m");
 		ret = EXIT_SYSFAIL;
@@ -2177,50 +3392,139 @@ static int vdi_backup(int argc, char **argv)
 	fsync(STDOUT_FILENO);
 	ret = EXIT_SUCCESS;
 out:
+	work_queue_wait(wq);
+	for (int i = 0; i < nr_jobs; i++) {
+		backup_free_extents(works + i);
+		free(works[i].backup);
+	}
+	free(works);
+	free(end);
 	free(from_inode);
 	free(to_inode);
-	free(backup);
 	return ret;
 }
 
+/*
+ * The restore of the records of an object, by up to vdi_cmd_data.nr_jobs
+ * works at a time, with the data of the extents as read from the backup
+ */
+struct restore_work {
+	struct work work;
+	uint32_t idx, vid;
+	const struct sd_inode *parent_inode;
+	bool busy;
+	int ret;
+	int nr_extents;
+	struct backup_extent extents[SD_BLOCK_HASH_NR];
+	uint8_t *buf;
+};
+
+/* Return the data of the extent, uncompressed into buf if need be */
+static void *restore_extent_data(struct backup_extent *e, uint8_t *buf)
+{
+#ifdef HAVE_COMPRESS
+	uLongf len = e->length;
+
+	if (e->zlength)
+		return uncompress(buf, &len, e->zdata, e->zlength) == Z_OK &&
+			len == e->length ? buf : NULL;
+#else
+	if (e->zlength)
+		return NULL;
+#endif
+	return e->zdata;
+}
+
 /* restore backup data to vdi */
-static int restore_obj(struct obj_backup *backup, uint32_t vid,
-		       struct sd_inode *parent_inode)
+static void restore_object_work(struct work *work)
 {
+	struct restore_work *w = container_of(work, struct restore_work, work);
+	const struct sd_inode *parent_inode = w->parent_inode;
+	uint32_t parent_vid = sd_inode_get_vid(parent_inode, w->idx);
+	uint64_t oid = vid_to_data_oid(w->vid, w->idx), parent_oid = 0;
+	uint64_t vdi_oid = vid_to_vdi_oid(w->vid);
 	int ret;
-	uint32_t parent_vid = sd_inode_get_vid(parent_inode, backup->idx);
-	uint64_t parent_oid = 0;
 
 	if (parent_vid)
-		parent_oid = vid_to_data_oid(parent_vid, backup->idx);
+		parent_oid = vid_to_data_oid(parent_vid, w->idx);
 
-	/* send a copy-on-write request */
-	ret = dog_write_object(vid_to_data_oid(vid, backup->idx), parent_oid,
-			       backup->data, backup->length, backup->offset,
-			       0, parent_inode->nr_copies,
-			       parent_inode->copy_policy, true, true);
-	if (ret != SD_RES_SUCCESS)
-		return ret;
+	for (int i = 0; i < w->nr_extents; i++) {
+		struct backup_extent *e = w->extents + i;
+		void *data = restore_extent_data(e, w->buf);
+
+		if (!data) {
+			sd_err("failed to uncompress the backup of %" PRIx64,
+			       oid);
+			w->ret = SD_RES_EIO;
+			return;
+		}
+		/* the first write sends a copy-on-write request */
+		ret = dog_write_object_to(oid_to_gateway(oid), oid,
+					  i ? 0 : parent_oid, data, e->length,
+					  e->offset, 0,
+					  parent_inode->nr_copies,
+					  parent_inode->copy_policy, !i, true);
+		if (ret != SD_RES_SUCCESS) {
+			w->ret = ret;
+			return;
+		}
+	}
+
+	w->ret = dog_write_object_to(oid_to_gateway(vdi_oid), vdi_oid, 0,
+				     &w->vid, sizeof(w->vid),
+				     SD_INODE_HEADER_SIZE +
+				     sizeof(w->vid) * w->idx, 0,
+				     parent_inode->nr_copies,
+				     parent_inode->copy_policy, false, true);
+}
+
+static void restore_object_done(struct work *work)
+{
+	struct restore_work *w = container_of(work, struct restore_work, work);
 
-	return dog_write_object(vid_to_vdi_oid(vid), 0, &vid, sizeof(vid),
-			SD_INODE_HEADER_SIZE + sizeof(vid) * backup->idx,
-				0, parent_inode->nr_copies,
-				parent_inode->copy_policy, false, true);
+	w->busy = false;
+}
+
+static void restore_free_extents(struct restore_work *w)
+{
+	for (int i = 0; i < w->nr_extents; i++)
+		free(w->extents[i].zdata);
+	w->nr_extents = 0;
+}
+
+/* Wait for the work of the slot, and return its result */
+static int restore_wait(struct restore_work *w)
+{
+	while (w->busy)
+		event_loop(-1);
+	restore_free_extents(w);
+	return w->ret;
 }
 
 static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 {
-	int ret;
+	int ret, nr_jobs = vdi_cmd_data.nr_jobs, cur = 0;
 	uint32_t vid;
 	struct backup_hdr hdr;
 	struct obj_backup *backup = xzalloc(sizeof(*backup));
 	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	struct restore_work *works = xcalloc(nr_jobs, sizeof(*works)), *w;
+	struct work_queue *wq = create_work_queue("vdi restore",
+						  WQ_UNLIMITED);
+
+	for (int i = 0; i < nr_jobs; i++) {
+		works[i].work.fn = restore_object_work;
+		works[i].work.done = restore_object_done;
+		works[i].parent_inode = inode;
+		works[i].ret = SD_RES_SUCCESS;
+		works[i].buf = xmalloc(SD_DATA_OBJ_SIZE);
+	}
 
 	ret = xread(STDIN_FILENO, &hdr, sizeof(hdr));
 	if (ret != sizeof(hdr))
 		sd_err("failed to read backup header, %m");
 
-	if (hdr.version != VDI_BACKUP_FORMAT_VERSION ||
+	if ((hdr.version != 1 && hdr.version != VDI_BACKUP_FORMAT_VERSION) ||
 	    hdr.magic != VDI_BACKUP_MAGIC) {
 		sd_err("The backup file is corrupted");
 		ret = EXIT_SYSFAIL;
@@ -2239,36 +3543,74 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 		goto out;
 	}
 
+	w = works;
 	while (true) {
-		ret = xread(STDIN_FILENO, backup,
-			    sizeof(*backup) - sizeof(backup->data));
-		if (ret != sizeof(*backup) - sizeof(backup->data)) {
+		struct backup_extent *e;
+
+		ret = xread(STDIN_FILENO, backup, OBJ_BACKUP_HDR_SIZE);
+		if (ret != OBJ_BACKUP_HDR_SIZE) {
 			sd_err("failed to read backup data");
 			ret = EXIT_SYSFAIL;
 			break;
 		}
 
+		/* the records of the last object are complete */
+		if (w->nr_extents && backup->idx != w->idx) {
+			w->busy = true;
+			queue_work(wq, &w->work);
+			cur = (cur + 1) % nr_jobs;
+			w = works + cur;
+			if (restore_wait(w) != SD_RES_SUCCESS) {
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+
 		if (backup->idx == UINT32_MAX) {
 			ret = EXIT_SUCCESS;
 			break;
 		}
 
-		ret = xread(STDIN_FILENO, backup->data, backup->length);
-		if (ret != backup->length) {
-			sd_err("failed to read backup data");
+		if (backup->offset > SD_DATA_OBJ_SIZE ||
+		    backup->length > SD_DATA_OBJ_SIZE - backup->offset ||
+		    (backup->zlength && backup->zlength >= backup->length) ||
+		    w->nr_extents == SD_BLOCK_HASH_NR) {
+			sd_err("The backup file is corrupted");
 			ret = EXIT_SYSFAIL;
 			break;
 		}
 
-		ret = restore_obj(backup, vid, inode);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to restore backup");
-			do_vdi_delete(vdiname, 0, NULL, false);
-			ret = EXIT_FAILURE;
+		w->idx = backup->idx;
+		w->vid = vid;
+		e = w->extents + w->nr_extents++;
+		e->offset = backup->offset;
+		e->length = backup->length;
+		e->zlength = backup->zlength;
+		e->zdata = xmalloc(e->zlength ? e->zlength : e->length);
+		ret = xread(STDIN_FILENO, e->zdata,
+			    e->zlength ? e->zlength : e->length);
+		if (ret != (e->zlength ? e->zlength : e->length)) {
+			sd_err("failed to read backup data");
+			ret = EXIT_SYSFAIL;
 			break;
 		}
 	}
+
+	for (int i = 0; i < nr_jobs; i++)
+		if (restore_wait(works + i) != SD_RES_SUCCESS &&
+		    ret == EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+	if (ret == EXIT_FAILURE) {
+		sd_err("failed to restore backup");
+		do_vdi_delete(vdiname, 0, NULL, false);
+	}
 out:
+	work_queue_wait(wq);
+	for (int i = 0; i < nr_jobs; i++) {
+		restore_free_extents(works + i);
+		free(works[i].buf);
+	}
+	free(works);
 	free(backup);
 	free(inode);
 
@@ -2302,6 +3644,13 @@ static int vdi_restore(int argc, char **argv)
 		goto out;
 	}
 
+	if (vdi_object_size(inode_for_check) != SD_DATA_OBJ_SIZE) {
+		sd_err("The backup of the VDIs of %s objects isn't supported",
+		       strnumber(vdi_object_size(inode_for_check)));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
 	/*
 	 * delete the current vdi temporarily first to avoid making
 	 * the current state become snapshot
@@ -2481,6 +3830,14 @@ static int vdi_cache_info(int argc, char **argv)
 	fprintf(stdout, "\nCache size %s, used %s, %s\n",
 		strnumber(info.size), strnumber(info.used),
 		info.directio ? "directio" : "non-directio");
+	if (info.hits + info.misses)
+		fprintf(stdout, "Hits %"PRIu64", misses %"PRIu64
+			" (%"PRIu64" recently reclaimed), hit rate %.1f%%\n",
+			info.hits, info.misses, info.ghost_hits,
+			100.0 * info.hits / (info.hits + info.misses));
+	if (info.dirty + info.pushing)
+		fprintf(stdout, "Dirty objects %"PRIu32", being pushed %"PRIu32
+			"\n", info.dirty, info.pushing);
 
 	return EXIT_SUCCESS;
 }
@@ -2549,8 +3906,11 @@ static int vdi_object_dump_inode(int argc, char **argv)
 	printf("vm_state_size: %"PRIu64"\n", inode->vm_state_size);
 	printf("copy_policy: %d\n", inode->copy_policy);
 	printf("store_policy: %d\n", inode->store_policy);
+	printf("compress: %d\n", inode->compress);
+	printf("hybrid: %d\n", inode->hybrid);
 	printf("nr_copies: %d\n", inode->nr_copies);
 	printf("block_size_shift: %d\n", inode->block_size_shift);
+	printf("stripe_shift: %d\n", inode->stripe_shift);
 	printf("snap_id: %"PRIu32"\n", inode->snap_id);
 	printf("vdi_id: %"PRIx32"\n", inode->vdi_id);
 	printf("parent_vdi_id: %"PRIx32"\n", inode->parent_vdi_id);
@@ -2618,16 +3978,18 @@ static int vdi_cache(int argc, char **argv)
 }
 
 static struct subcommand vdi_cmd[] = {
-	{"check", "<vdiname>", "seaphT", "check and repair image's consistency",
+	{"check", "<vdiname>", "sejaphT",
+	 "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "PyaphrvT", "create an image",
+	{"create", "<vdiname> <size>", "PyzHbkaphrvT", "create an image",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saphrvT", "create a snapshot",
 	 NULL, CMD_NEED_ARG,
 	 vdi_snapshot, vdi_options},
-	{"clone", "<src vdi> <dst vdi>", "sPnaphrvT", "clone an image",
+	{"clone", "<src vdi> <dst vdi>...", "sPnaphrvT",
+	 "clone an image to one or more images",
 	 NULL, CMD_NEED_ARG,
 	 vdi_clone, vdi_options},
 	{"delete", "<vdiname>", "saphTA", "delete an image",
@@ -2656,22 +4018,36 @@ static struct subcommand vdi_cmd[] = {
 	{"getattr", "<vdiname> <key>", "aphT", "get a VDI attribute",
 	 NULL, CMD_NEED_ARG,
 	 vdi_getattr, vdi_options},
+	{"qos", "<vdiname> [weight=,reservation=,iops=,bps=,window=]",
+	 "aphT",
+	 "show or set the QoS of an image",
+	 NULL, CMD_NEED_ARG,
+	 vdi_qos, vdi_options},
+	{"replicate", "<vdiname> [<addr>:<port>[,interval=]|off]", "aph",
+	 "show or set the asynchronous replication of an image to a remote "
+	 "cluster",
+	 NULL, CMD_NEED_ARG,
+	 vdi_replicate, vdi_options},
+	{"alter-copy", "<vdiname> <copies> [rate]", "aphT",
+	 "change the number of copies of an image in the background",
+	 NULL, CMD_NEED_ARG,
+	 vdi_alter_copy, vdi_options},
 	{"resize", "<vdiname> <new size>", "aphT", "resize an image",
 	 NULL, CMD_NEED_ARG,
 	 vdi_resize, vdi_options},
-	{"read", "<vdiname> [<offset> [<len>]]", "saphT",
+	{"read", "<vdiname> [<offset> [<len>]]", "sjaphT",
 	 "read data from an image",
-	 NULL, CMD_NEED_ARG,
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_read, vdi_options},
-	{"write", "<vdiname> [<offset> [<len>]]", "apwhT",
+	{"write", "<vdiname> [<offset> [<len>]]", "apwjhT",
 	 "write data to an image",
-	 NULL, CMD_NEED_ARG,
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_write, vdi_options},
-	{"backup", "<vdiname> <backup>", "sFaphT",
+	{"backup", "<vdiname> <backup>", "sFzjaphT",
 	 "create an incremental backup between two snapshots",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_backup, vdi_options},
-	{"restore", "<vdiname> <backup>", "saphT",
+	{"restore", "<vdiname> <backup>", "sjaphT",
 	 "restore snapshot images from a backup",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_restore, vdi_options},
@@ -2685,6 +4061,7 @@ static struct subcommand vdi_cmd[] = {
 static int vdi_parser(int ch, const char *opt)
 {
 	char *p;
+	uint64_t size;
 
 	switch (ch) {
 	case 'P':
@@ -2739,6 +4116,12 @@ static int vdi_parser(int ch, const char *opt)
 	case 'y':
 		vdi_cmd_data.store_policy = 1;
 		break;
+	case 'z':
+		vdi_cmd_data.compress = true;
+		break;
+	case 'H':
+		vdi_cmd_data.hybrid = true;
+		break;
 	case 'o':
 		vdi_cmd_data.oid = strtoull(opt, &p, 16);
 		if (opt == p) {
@@ -2754,6 +4137,37 @@ static int vdi_parser(int ch, const char *opt)
 	case 'S':
 		vdi_cmd_data.single = true;
 		break;
+	case 'j':
+		vdi_cmd_data.nr_jobs = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || vdi_cmd_data.nr_jobs < 1) {
+			sd_err("The number of jobs must be a positive integer");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'b':
+		if (option_parse_size(opt, &size) < 0)
+			exit(EXIT_FAILURE);
+		if (size & (size - 1) ||
+		    size < (UINT64_C(1) << SD_MIN_BLOCK_SIZE_SHIFT) ||
+		    size > (UINT64_C(1) << SD_MAX_BLOCK_SIZE_SHIFT)) {
+			sd_err("The block size must be a power of 2 from 512K"
+			       " to 64M");
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.block_size_shift = ffsll(size) - 1;
+		break;
+	case 'k':
+		if (option_parse_size(opt, &size) < 0)
+			exit(EXIT_FAILURE);
+		if (size & (size - 1) ||
+		    size < (UINT64_C(1) << SD_EC_MIN_STRIPE_SHIFT) ||
+		    size > (UINT64_C(1) << SD_EC_MAX_STRIPE_SHIFT)) {
+			sd_err("The stripe size must be a power of 2 from 512"
+			       " to 1M");
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.stripe_shift = ffsll(size) - 1;
+		break;
 	}
 
 	return 0;
@@ -117,8 +117,11 @@ static inline int fallocate(int fd, int mode, __off_t offset, __off_t len)
 #ifdef __x86_64__
 
 #define X86_FEATURE_SSSE3	(4 * 32 + 9) /* Supplemental SSE-3 */
+#define X86_FEATURE_SSE4_1	(4 * 32 + 19) /* "sse4_1" SSE-4.1 */
 #define X86_FEATURE_OSXSAVE	(4 * 32 + 27) /* "" XSAVE enabled in the OS */
 #define X86_FEATURE_AVX	(4 * 32 + 28) /* Advanced Vector Extensions */
+#define X86_FEATURE_AVX2	(9 * 32 + 5) /* AVX2 instructions */
+#define X86_FEATURE_SHA_NI	(9 * 32 + 29) /* SHA1/SHA256 Extensions */
 
 #define XSTATE_FP	0x1
 #define XSTATE_SSE	0x2
@@ -154,6 +157,9 @@ static inline uint64_t xgetbv(uint32_t idx)
 #define cpu_has_ssse3           cpu_has(X86_FEATURE_SSSE3)
 #define cpu_has_avx		cpu_has(X86_FEATURE_AVX)
 #define cpu_has_osxsave		cpu_has(X86_FEATURE_OSXSAVE)
+#define cpu_has_sse4_1		cpu_has(X86_FEATURE_SSE4_1)
+#define cpu_has_avx2		cpu_has(X86_FEATURE_AVX2)
+#define cpu_has_sha_ni		cpu_has(X86_FEATURE_SHA_NI)
 
 #endif /* __x86_64__ */
 
@@ -3,6 +3,8 @@
 
 #include "list.h"
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 struct event_info;
 
@@ -15,13 +17,27 @@ int modify_event(int fd, unsigned int events);
 void event_loop(int timeout);
 void event_loop_prio(int timeout);
 void event_force_refresh(void);
+bool is_reactor_thread(void);
+void event_watch_main(void);
+uint64_t event_main_busy(void **fn);
 
 struct timer {
 	void (*callback)(void *);
 	void *data;
+
+	/* private, for the timer wheel of the event loop */
+	struct list_node list;
+	uint64_t expire; /* in ms */
+	uint16_t slot;
 };
 
 void add_timer(struct timer *t, unsigned int mseconds);
+void del_timer(struct timer *t);
+
+static inline bool timer_pending(const struct timer *t)
+{
+	return list_linked(&t->list);
+}
 
 #define EVENT_PRIO_MAX     INT_MAX
 #define EVENT_PRIO_DEFAULT 0
@@ -67,14 +67,33 @@
 #include "sheepdog_proto.h"
 #include "../lib/isa-l/include/erasure_code.h"
 
+struct fec;
+
+/* Compute all the parity strips of the data strips src */
+typedef void (*fec_encode_fn)(const struct fec *code,
+			      const uint8_t *const *src,
+			      uint8_t *const *fecs, size_t sz);
+/* Compute the strip dst as the sum of coef[j] times the strip src[j] */
+typedef void (*fec_dot_fn)(const uint8_t *coef, uint8_t *const *src,
+			   uint8_t *dst, size_t sz);
+
 struct fec {
 	unsigned long magic;
 	unsigned short d, dp;                     /* parameters of the code */
 	uint8_t *enc_matrix;
 	unsigned char *ec_tbl;                    /* for isa-l */
+	/* kernels for the code picked by fec_new(), or NULL for generic */
+	fec_encode_fn encode;
+	fec_dot_fn dot;
 };
 
 void init_fec(void);
+
+typedef void (*ec_encode_data_fn)(int len, int k, int rows,
+				  unsigned char *gftbls, unsigned char **data,
+				  unsigned char **coding);
+/* The fastest isa-l encoder for this CPU picked by init_fec(), or NULL */
+extern ec_encode_data_fn isa_encode_data;
 /*
  * param d the number of blocks required to reconstruct
  * param dp the total number of blocks created
@@ -99,11 +118,21 @@ void fec_encode(const struct fec *code,
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		       char *buf, int idx);
 
+void ec_update_buffer(const struct fec *ctx, int idx, int nr,
+		      const uint8_t *delta[], uint8_t *ps[], size_t len);
+
 /* for isa-l */
 
 void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		       char *buf, int idx);
 
+/*
+ * Add the share of input, the strip in_idx[j], in the lost strip idx to buf,
+ * so the lost strip is the sum of the shares of the strips in_idx
+ */
+void ec_decode_partial(struct fec *ctx, const int in_idx[], int idx, int j,
+		       const uint8_t *input, uint8_t *buf, size_t len);
+
 /*
  * @param inpkts an array of packets (size k); If a primary block, i, is present
  * then it must be at index i. Secondary blocks can appear anywhere.
@@ -118,9 +147,14 @@ void fec_decode(const struct fec *code,
 		uint8_t *const *const outpkts,
 		const int *const index, size_t sz);
 
-/* Set data stripe as sector size to make VM happy */
+/*
+ * Set data stripe as sector size to make VM happy.  A vdi may have a larger
+ * one, up to 1M, for fewer and bigger strips, see stripe_shift of its inode.
+ */
 #define SD_EC_DATA_STRIPE_SIZE (512) /* 512 Byte */
 #define SD_EC_NR_STRIPE_PER_OBJECT (SD_DATA_OBJ_SIZE / SD_EC_DATA_STRIPE_SIZE)
+#define SD_EC_MIN_STRIPE_SHIFT 9
+#define SD_EC_MAX_STRIPE_SHIFT 20
 #define SD_EC_MAX_STRIP (16)
 
 static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
@@ -164,13 +198,12 @@ static inline struct fec *ec_init(int d, int dp)
 }
 
 /*
- * This function decodes the data strips and return the parity strips
- *
- * @ds: data strips to generate parity strips
- * @ps: parity strips to return
+ * Like ec_encode(), but the strips are len bytes long.  The code works byte
+ * by byte, so the strips of consecutive stripes can be encoded at once if
+ * each of them is laid out contiguously.
  */
-static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
-			     uint8_t *ps[])
+static inline void ec_encode_buffer(struct fec *ctx, const uint8_t *ds[],
+				    uint8_t *ps[], size_t len)
 {
 	int p = ctx->dp - ctx->d;
 	int pidx[p];
@@ -178,12 +211,23 @@ static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
 	for (int i = 0; i < p; i++)
 		pidx[i] = ctx->d + i;
 
-	if (cpu_has_ssse3)
-		ec_encode_data_sse(SD_EC_DATA_STRIPE_SIZE / ctx->d, ctx->d, p,
-				   ctx->ec_tbl, (unsigned char **)ds, ps);
+	if (isa_encode_data)
+		isa_encode_data(len, ctx->d, p, ctx->ec_tbl,
+				(unsigned char **)ds, ps);
 	else
-		fec_encode(ctx, ds, ps, pidx, p, SD_EC_DATA_STRIPE_SIZE /
-			   ctx->d);
+		fec_encode(ctx, ds, ps, pidx, p, len);
+}
+
+/*
+ * This function decodes the data strips and return the parity strips
+ *
+ * @ds: data strips to generate parity strips
+ * @ps: parity strips to return
+ */
+static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
+			     uint8_t *ps[])
+{
+	ec_encode_buffer(ctx, ds, ps, SD_EC_DATA_STRIPE_SIZE / ctx->d);
 }
 
 /*
@@ -208,7 +252,7 @@ static inline void ec_destroy(struct fec *ctx)
 static inline void ec_decode_buffer(struct fec *ctx, uint8_t *input[],
 				    const int in_idx[], char *buf, int idx)
 {
-	if (cpu_has_ssse3)
+	if (isa_encode_data)
 		isa_decode_buffer(ctx, input, in_idx, buf, idx);
 	else
 		fec_decode_buffer(ctx, input, in_idx, buf, idx);
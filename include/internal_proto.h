@@ -32,6 +32,9 @@
  */
 #define SD_MAX_COPIES (SD_EC_MAX_STRIP * 2 - 1)
 
+/* Objects are hashed in this many blocks, see SD_OP_GET_BLOCK_HASH */
+#define SD_BLOCK_HASH_NR 64
+
 /*
  * The max number of nodes sheep daemon can support is constrained by
  * the number of nodes in the struct cluster_info, but the actual max
@@ -77,6 +80,7 @@
 #define SD_OP_WRITE_PEER     0xA5
 #define SD_OP_REMOVE_PEER    0xA6
 /* #define SD_OP_SET_CACHE_SIZE 0xA7 deleted */
+#define SD_OP_OBJ_UNCHANGED_PEER 0xA7
 /* #define SD_OP_ENABLE_RECOVER 0xA8 deleted */
 /* #define SD_OP_DISABLE_RECOVER 0xA9 deleted */
 /* #define SD_OP_GET_VDI_COPIES 0xAB deleted */
@@ -102,7 +106,7 @@
 #define SD_OP_ALTER_CLUSTER_COPY	0xBF
 /* #define SD_OP_ALTER_VDI_COPY	0xC0 */
 #define SD_OP_UNREF_OBJ     0xC1
-/* #define SD_OP_UNREF_PEER    0xC2 */
+#define SD_OP_UNREF_PEER    0xC2
 /* #define SD_OP_PREVENT_INODE_UPDATE    0xC3 */
 /* #define SD_OP_ALLOW_INODE_UPDATE      0xC4 */
 #define SD_OP_REPAIR_REPLICA	0xC5
@@ -113,20 +117,60 @@
 #define SD_OP_LIVEPATCH_PATCH    0xD0
 #define SD_OP_LIVEPATCH_UNPATCH  0xD1
 #define SD_OP_LIVEPATCH_STATUS   0xD2
+#define SD_OP_RECOVERY_THROTTLE  0xD3
+#define SD_OP_GET_OBJ_LIST_PAGE  0xD4
+#define SD_OP_GET_BLOCK_HASH     0xD5
+#define SD_OP_DISCARD_RANGE      0xD6
+#define SD_OP_DISCARD_PEER       0xD7
+#define SD_OP_CLUSTER_LOCK       0xD8
+#define SD_OP_CLUSTER_UNLOCK     0xD9
+#define SD_OP_GET_EPOCHS         0xDA
+#define SD_OP_GET_VDI_STATE      0xDB
+#define SD_OP_GET_SPANS          0xDC
+#define SD_OP_SET_VDI_QOS        0xDD
+#define SD_OP_READ_PARTIAL       0xDE
+#define SD_OP_COPY_PEER          0xDF
+#define SD_OP_READ_PEERS         0xE0
+#define SD_OP_GET_LOCK_STAT      0xE1
+#define SD_OP_LIST_VDI_HEADERS   0xE2
+#define SD_OP_ALTER_VDI_COPY     0xE3
+#define SD_OP_SET_VDI_COPY       0xE4
+#define SD_OP_UNREF_OBJS         0xE5
+#define SD_OP_READ_CLUSTER_MSG   0xE6
+#define SD_OP_SET_VDI_REPLICA    0xE7
+#define SD_OP_REPLICA_WRITE      0xE8
+#define SD_OP_FARM_SAVE          0xE9
+#define SD_OP_LOOKUP_VDI_ATTR    0xEA
+#define SD_OP_NEW_VDIS           0xEB
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
 
+/* flags for SD_OP_CLUSTER_LOCK */
+#define SD_LOCK_RECLAIM 0x01 /* a lock held in the last epoch */
+
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
 #define SD_FLAG_CMD_EXCL     0x0200
 #define SD_FLAG_CMD_DEL      0x0400
 
+/* the data of a read may be returned as a sparse buffer, see sparse_encode() */
+#define SD_FLAG_CMD_SPARSE   0x0800
+/* create the object compressed, or read the compressed file for recovery */
+#define SD_FLAG_CMD_COMPRESS 0x1000
+/* the object of a hybrid vdi in its erasure coded form, not the hot one */
+#define SD_FLAG_CMD_COLD     0x4000
+/* the payload of a peer write or the reply of a peer read is deflated */
+#define SD_FLAG_CMD_DEFLATE  0x8000
+
 #define SD_FLAG_CMD_ALL (SD_FLAG_CMD_WRITE | SD_FLAG_CMD_COW | \
 			 SD_FLAG_CMD_CACHE | SD_FLAG_CMD_DIRECT | \
 			 SD_FLAG_CMD_PIGGYBACK | SD_FLAG_CMD_RECOVERY | \
 			 SD_FLAG_CMD_CREAT | SD_FLAG_CMD_EXCL | \
-			 SD_FLAG_CMD_DEL | SD_FLAG_CMD_TGT)
+			 SD_FLAG_CMD_DEL | SD_FLAG_CMD_TGT | \
+			 SD_FLAG_CMD_SPARSE | SD_FLAG_CMD_COMPRESS | \
+			 SD_FLAG_CMD_COLD | \
+			 SD_FLAG_CMD_DEFLATE | SD_FLAG_CMD_BACKGROUND)
 
 /* internal error return values, must be above 0x80 */
 #define SD_RES_OLD_NODE_VER  0x81 /* Request has an old epoch */
@@ -153,11 +197,13 @@
 #define SD_RES_COLLECTING_CINFO 0x95
 #define SD_RES_GATEWAY_MODE  0x97 /* Target node is gateway mode */
 #define SD_RES_INVALID_VNODES_STRATEGY 0x98 /* Invalid vnodes strategy */
+#define SD_RES_EXPIRED       0x99 /* Deadline of the request has passed */
 
 
 #define SD_CLUSTER_FLAG_STRICT		0x0001 /* Strict mode for write */
 #define SD_CLUSTER_FLAG_DISKMODE	0x0002 /* Disk mode for cluster */
 #define SD_CLUSTER_FLAG_MANUAL		0x0004 /* Manual recovery mode */
+#define SD_CLUSTER_FLAG_MIXHASH		0x0008 /* Placement by sd_mix_64() */
 
 
 enum sd_status {
@@ -272,6 +318,31 @@ struct epoch_log {
 	struct sd_node nodes[0];
 };
 
+/*
+ * An epoch of the reply of SD_OP_GET_EPOCHS, which holds the epochs from
+ * hdr.obj.tgt_epoch down.  The nodes added to the epoch before it in the reply,
+ * i.e. the next newer one, follow it and then the ids of the nodes removed.
+ */
+struct epoch_delta {
+	uint32_t epoch;
+	uint16_t nr_added;
+	uint16_t nr_removed;
+	uint64_t time;		/* treated as time_t */
+};
+
+static inline size_t epoch_delta_size(const struct epoch_delta *d)
+{
+	return sizeof(*d) + d->nr_added * sizeof(struct sd_node) +
+		d->nr_removed * sizeof(struct node_id);
+}
+
+/* A vdi in use, in the reply of SD_OP_GET_VDI_STATE */
+struct vdi_state {
+	uint32_t vid;
+	uint8_t snapshot;
+	uint8_t __pad[3];
+};
+
 struct vdi_op_message {
 	struct sd_req req;
 	struct sd_rsp rsp;
@@ -280,8 +351,14 @@ struct vdi_op_message {
 
 struct md_info {
 	int idx;
+	uint8_t fast; /* non-rotational, the fast tier */
+	uint8_t slow; /* an outlier by its latency, see md_slow_timer_fn() */
+	uint8_t reserved[2];
 	uint64_t free;
 	uint64_t used;
+	uint64_t stale; /* bytes of the stale objects to purge */
+	uint32_t lat_us; /* smoothed mean latency of the I/O */
+	uint32_t p99_us; /* of the I/O of the last MD_SLOW_INTERVAL */
 	char path[PATH_MAX];
 };
 
@@ -289,6 +366,7 @@ struct md_info {
 struct sd_md_info {
 	struct md_info disk[MD_MAX_DISK];
 	int nr;
+	uint32_t nr_hot; /* objects promoted to the fast tier */
 };
 
 static inline __attribute__((used)) void __sd_epoch_format_build_bug_ons(void)
@@ -310,6 +388,102 @@ struct recovery_state {
 	uint64_t nr_total;
 };
 
+/*
+ * SD_OP_READ_PEERS reads the objects of the oids in its data into a reply of
+ * up to hdr.obj.length bytes, SD_READ_PEERS_MAX at most.  The reply is an
+ * entry for each oid, in the order of the oids, and then the data of the
+ * objects read, each at the next offset aligned to SD_READ_PEERS_ALIGN.  The
+ * objects which don't fit are SD_RES_BUFFER_SMALL.
+ */
+#define SD_READ_PEERS_MAX (UINT32_C(32) << 20)
+#define SD_READ_PEERS_ALIGN 4096
+
+struct sd_read_peers_entry {
+	uint64_t oid;
+	uint32_t result;
+	uint32_t length; /* of the data, 0 on an error */
+};
+
+/* The rate limits of the object recovery of a node, 0 for no limit */
+struct recovery_throttle {
+	uint64_t max_bw; /* bytes per second */
+	uint32_t max_objs; /* objects per second */
+	uint32_t __pad;
+};
+
+/*
+ * The QoS of the I/O of a vdi on each gateway, the value of its attribute
+ * SD_QOS_ATTR_KEY.  The zero fields are the defaults: SD_QOS_DEFAULT_WEIGHT,
+ * no reservation, no limit and no write window.
+ */
+#define SD_QOS_ATTR_KEY "sheepdog.qos"
+#define SD_QOS_DEFAULT_WEIGHT 100
+#define SD_QOS_MAX_WRITE_WINDOW 10000 /* us */
+
+/*
+ * The data objects which a vdi accessed in the first seconds after its object
+ * cache was created, the value of its attribute SD_BOOT_TRACE_ATTR_KEY.  It's
+ * an array of the uint32_t indexes of the objects in the order of the first
+ * access.
+ */
+#define SD_BOOT_TRACE_ATTR_KEY "sheepdog.boot_trace"
+
+struct vdi_qos {
+	uint32_t weight; /* the share of the gateway when it is busy */
+	uint32_t reservation; /* I/Os per second dispatched in any case */
+	uint32_t iops; /* the most I/Os per second */
+	uint32_t write_window; /* us a write waits for the adjacent ones */
+	uint64_t bps; /* the most bytes per second */
+};
+
+/*
+ * The asynchronous replication of a vdi to the vdi of the same name in a
+ * remote cluster, the value of its attribute SD_REPLICA_ATTR_KEY.  Each
+ * round leaves a snapshot tagged "replica-<seq>" on both sides.  See
+ * sheep/replicate.c.
+ */
+#define SD_REPLICA_ATTR_KEY "sheepdog.replica"
+#define SD_REPLICA_DEFAULT_INTERVAL 300 /* seconds */
+
+struct vdi_replica {
+	uint8_t addr[16]; /* of a sheep of the remote cluster */
+	uint16_t port;
+	uint16_t __pad;
+	uint32_t interval; /* seconds between the rounds, 0 to stop */
+	uint32_t seq; /* of the last round, 0 before the first */
+	uint32_t snap_vid; /* the local snapshot of the last round */
+};
+
+/*
+ * A decrement message of the generation reference of a data object, an entry
+ * of the data of SD_OP_UNREF_OBJS and SD_OP_UNREF_PEER.  See
+ * doc/object-reclaim.txt.
+ */
+struct sd_unref {
+	uint64_t oid; /* of the data object */
+	uint32_t generation;
+	uint32_t count;
+};
+
+/*
+ * The copy number of a vdi changed in the background, the data of both
+ * SD_OP_ALTER_VDI_COPY, which starts the conversion on a node or reports it if
+ * nr_copies is 0, and SD_OP_SET_VDI_COPY, which tells all the nodes the copy
+ * number.  old_nr_copies is not 0 while the objects are converted.
+ */
+struct vdi_copy {
+	uint32_t vid;
+	uint8_t nr_copies;
+	uint8_t old_nr_copies;
+	uint8_t __pad[2];
+	uint64_t rate; /* bytes a second copied, 0 for no limit */
+	uint64_t nr_objs; /* the entries of the index */
+	uint64_t nr_done; /* the entries converted */
+	uint64_t nr_copied; /* the new copies made */
+	uint64_t nr_removed; /* the old copies removed */
+	uint64_t nr_failed;
+};
+
 #define CACHE_MAX	1024
 struct cache_info {
 	uint32_t vid;
@@ -323,8 +497,17 @@ struct object_cache_info {
 	struct cache_info caches[CACHE_MAX];
 	int count;
 	uint8_t directio;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t ghost_hits; /* misses of the recently reclaimed objects */
+	uint32_t dirty; /* dirty objects of all the VDIs */
+	uint32_t pushing; /* objects being pushed back */
 };
 
+#define SD_LOOP_NR_BUCKETS 7
+#define SD_MEM_STAT_NR 8
+#define SD_HTTP_NR_METHODS 5
+
 struct sd_stat {
 	struct s_request {
 		uint64_t gway_active_nr; /* nr of running request */
@@ -342,9 +525,240 @@ struct sd_stat {
 		uint64_t peer_total_remove_nr;
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
+		uint64_t expired_nr; /* dropped past their deadline */
 	} r;
+	struct s_fd_cache {
+		uint64_t nr; /* nr of cached fds */
+		uint64_t hit;
+		uint64_t miss;
+		uint64_t evict;
+	} fd;
+	struct s_placement_cache {
+		uint64_t hit;
+		uint64_t miss;
+	} pc;
+	struct s_buffer_pool {
+		uint64_t alloc;
+		uint64_t hit;	/* served from the pool */
+		uint64_t miss;
+		uint64_t cached; /* bytes of the free buffers */
+		uint64_t trimmed; /* buffers returned to the system */
+	} bp;
+	struct s_dedup {
+		uint64_t shared; /* blocks shared with another object */
+		uint64_t differed; /* index hits whose blocks differed */
+		uint64_t recovered; /* blocks recovered from the local disks */
+	} dd;
+	struct s_pool {
+		uint64_t claimed; /* objects created from a preallocated file */
+		uint64_t missed; /* sequential fills finding the pool empty */
+	} pool;
+	struct s_kv_cache {
+		uint64_t hit; /* lookups of the http gateway in the cache */
+		uint64_t miss;
+		uint64_t stale; /* hits whose slots changed since */
+	} kv_cache;
+	struct s_scrub {
+		uint64_t scanned; /* local objects verified by the scrubber */
+		uint64_t bytes;
+		uint64_t mismatched; /* objects with a differing copy */
+		uint64_t repaired; /* copies repaired */
+		uint64_t failed; /* with no majority or failed to repair */
+	} scrub;
+	struct s_read_cache {
+		uint64_t hit; /* local reads served from the memory */
+		uint64_t miss;
+		uint64_t evict;
+		uint64_t cached; /* bytes of the blocks cached */
+	} rc;
+	struct s_wire {
+		uint64_t raw; /* bytes of the payloads deflated */
+		uint64_t deflated; /* bytes they took on the wire */
+		uint64_t inflated; /* bytes of the payloads inflated */
+		uint64_t ns; /* spent deflating and inflating */
+	} wire;
+	struct s_loop {
+		/*
+		 * How long the main loop had run a callback at each sample of
+		 * the watchdog, [i] below 4^i ms, the last one the rest
+		 */
+		uint64_t lag[SD_LOOP_NR_BUCKETS];
+		uint64_t max_lag; /* ns */
+		uint64_t stalls;
+	} loop;
+	struct s_mem {
+		/* by enum sd_mem_tag of util.h, in bytes */
+		uint64_t used[SD_MEM_STAT_NR];
+		uint64_t cap[SD_MEM_STAT_NR];
+		uint64_t throttled; /* times a subsystem backed off its cap */
+	} mem;
+	struct s_http {
+		/*
+		 * The requests of the http gateway by the method, GET, PUT,
+		 * POST, DELETE and HEAD, and the nanoseconds they spent in
+		 * the stages
+		 */
+		uint64_t nr[SD_HTTP_NR_METHODS];
+		uint64_t queue[SD_HTTP_NR_METHODS]; /* waiting for a worker */
+		uint64_t io[SD_HTTP_NR_METHODS]; /* the bodies to and from */
+		uint64_t alloc[SD_HTTP_NR_METHODS]; /* of the data objects */
+		uint64_t handle[SD_HTTP_NR_METHODS]; /* all of the driver */
+	} http;
 };
 
+/*
+ * Versions of SD_OP_STAT.  Version 0 returns struct sd_stat only, version 1
+ * appends struct sd_latency_stat to it.
+ */
+#define SD_STAT_VERSION_LATENCY 1
+
+/* Stages of a request whose latency is recorded */
+enum sd_latency_stage {
+	SD_LAT_RX,	/* receiving the request from the client */
+	SD_LAT_QUEUE,	/* waiting for a worker thread */
+	SD_LAT_WORK,	/* executing the work */
+	SD_LAT_PEER,	/* forwarding to the peers */
+	SD_LAT_STORE,	/* I/O of the backend store */
+	SD_LAT_TX,	/* sending the response to the client */
+	SD_LAT_TOTAL,	/* from receiving to sending */
+	SD_LAT_NR_STAGES,
+};
+
+#define SD_LAT_NR_OPS		11 /* the last one is for the other opcodes */
+#define SD_LAT_SUB_BITS		2
+#define SD_LAT_NR_BUCKETS	128
+
+/*
+ * Latency histograms in microseconds.  They are log-linear: values below
+ * 2^SD_LAT_SUB_BITS have their own bucket and each power of two above it is
+ * split into 2^SD_LAT_SUB_BITS buckets, so a bucket is at most 25% wide.
+ */
+struct sd_latency_stat {
+	uint8_t opcodes[SD_LAT_NR_OPS];
+	uint8_t reserved[5];
+	uint64_t hist[SD_LAT_NR_OPS][SD_LAT_NR_STAGES][SD_LAT_NR_BUCKETS];
+};
+
+static inline int sd_lat_bucket(uint64_t us)
+{
+	int msb, idx;
+
+	if (us < (1 << SD_LAT_SUB_BITS))
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	idx = ((msb - SD_LAT_SUB_BITS + 1) << SD_LAT_SUB_BITS) +
+		((us >> (msb - SD_LAT_SUB_BITS)) &
+		 ((1 << SD_LAT_SUB_BITS) - 1));
+
+	return idx < SD_LAT_NR_BUCKETS ? idx : SD_LAT_NR_BUCKETS - 1;
+}
+
+/* The smallest value of the bucket */
+static inline uint64_t sd_lat_bucket_min(int idx)
+{
+	int group = idx >> SD_LAT_SUB_BITS,
+	    sub = idx & ((1 << SD_LAT_SUB_BITS) - 1);
+
+	if (group == 0)
+		return idx;
+
+	return (uint64_t)((1 << SD_LAT_SUB_BITS) + sub) << (group - 1);
+}
+
+/*
+ * The stages of a request in microseconds, as SD_OP_GET_SPANS returns them.
+ * A gateway keeps the spans of its SD_SPAN_SLOWEST slowest requests, and a
+ * node the spans of the last peer requests, whose id is the one of the span
+ * of the gateway which forwarded them.
+ */
+#define SD_SPAN_SLOWEST 64
+
+struct sd_span {
+	uint64_t id;
+	uint64_t oid;
+	uint64_t time; /* seconds since the epoch when it was done */
+	uint32_t us[SD_LAT_NR_STAGES];
+	uint8_t opcode;
+	uint8_t reserved[3];
+};
+
+/*
+ * An object of SD_OP_FARM_SAVE, which the sheep saves to the farm shared by
+ * the nodes and returns with the sha1 of its slice file.  It has the layout
+ * of an entry of the trunk of the farm.
+ */
+struct sd_farm_entry {
+	uint64_t oid;
+	uint8_t nr_copies;
+	uint8_t copy_policy;
+	uint8_t block_size_shift;
+	uint8_t reserved;
+	uint8_t sha1[20];
+};
+
+/*
+ * The contention of a call site taking a lock, as SD_OP_GET_LOCK_STAT returns
+ * it from a sheep built with --enable-lockstat.  The times are in nanoseconds.
+ */
+#define SD_LOCK_NAME_LEN	64
+#define SD_LOCK_NR_BUCKETS	16 /* [i] counts the waits below 2^i us */
+
+struct sd_lock_stat {
+	char name[SD_LOCK_NAME_LEN]; /* the lock expression */
+	char site[SD_LOCK_NAME_LEN]; /* file:line */
+	uint64_t nr_acquired;
+	uint64_t nr_contended; /* the first try failed */
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t hold_ns; /* held exclusively */
+	uint64_t nr_blocking; /* the waits of the others while held here */
+	uint64_t wait_hist[SD_LOCK_NR_BUCKETS];
+};
+
+/*
+ * The header of a vdi in use as SD_OP_LIST_VDI_HEADERS returns it, the
+ * deleted ones left out.  my_objs counts the data objects of the vdi and
+ * cow_objs the ones shared with the others, as sd_inode_stat() does.
+ */
+struct sd_vdi_header {
+	char name[SD_MAX_VDI_LEN];
+	char tag[SD_MAX_VDI_TAG_LEN];
+	uint64_t create_time;
+	uint64_t snap_ctime;
+	uint64_t vdi_size;
+	uint64_t my_objs;
+	uint64_t cow_objs;
+	uint32_t vdi_id;
+	uint32_t parent_vdi_id;
+	uint32_t snap_id;
+	uint8_t nr_copies;
+	uint8_t copy_policy;
+	uint8_t store_policy;
+	uint8_t block_size_shift;
+};
+
+/*
+ * A vdi of SD_OP_NEW_VDIS, which creates up to SD_MAX_NEW_VDIS vdis in a single
+ * cluster operation with the redundancy and the policies of its header.  A vdi
+ * is created afresh if base_vid is 0, cloned from the snapshot base_vid or, if
+ * snapshot is set, snapshotted from base_vid, the working vdi of the name.
+ * The sheep fills vid, copies and result of each in place.
+ */
+struct sd_new_vdi {
+	char name[SD_MAX_VDI_LEN];
+	uint64_t vdi_size;
+	uint32_t base_vid;
+	uint8_t snapshot;
+	uint8_t copies;
+	uint16_t __pad;
+	uint32_t vid;
+	uint32_t result;
+};
+
+/* within the cluster messages of any driver, see SD_MAX_EVENT_BUF_SIZE */
+#define SD_MAX_NEW_VDIS 256
+
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *);
 
 #ifdef HAVE_TRACE
@@ -401,6 +815,7 @@ static inline const char *sd_strerror(int err)
 		[SD_RES_AGAIN] = "Ask to try again",
 		[SD_RES_STALE_OBJ] = "Object may be stale",
 		[SD_RES_CLUSTER_ERROR] = "Cluster driver error",
+		[SD_RES_EXPIRED] = "Deadline of the request has passed",
 	};
 
 	if (!(0 <= err && err < sizeof(descs) / sizeof(descs[0])) \
@@ -52,6 +52,7 @@ void get_thread_name(char *name);
 })
 int __sd_dump_variable(const char *var);
 void sd_backtrace(void);
+void sd_print_addrs(void *const *addrs, int n);
 
 /* sheep log priorities, compliant with syslog spec */
 #define	SDOG_EMERG	LOG_EMERG
@@ -46,8 +46,19 @@ int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t), uint32_t,
+		      uint32_t);
+int send_reqs(int sockfd, struct iovec *iov, int nr_iov,
+	      bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+bool reap_zerocopy(int fd);
+int do_read_rsp(int sockfd, struct sd_rsp *rsp, void *buf, uint32_t len,
+		bool (*need_retry)(uint32_t), uint32_t, uint32_t);
 int exec_req(int sockfd, struct sd_req *hdr, void *,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int exec_req_rw(int sockfd, struct sd_req *hdr, void *wdata, unsigned int wlen,
+		void *rdata, unsigned int rlen,
+		bool (*need_retry)(uint32_t), uint32_t, uint32_t);
 int create_listen_ports(const char *bindaddr, int port,
 			int (*callback)(int fd, void *), void *data);
 int create_unix_domain_socket(const char *unix_path,
@@ -57,7 +68,10 @@ const char *addr_to_str(const uint8_t *addr, uint16_t port);
 uint8_t *str_to_addr(const char *ipstr, uint8_t *addr);
 char *sockaddr_in_to_str(struct sockaddr_in *sockaddr);
 int set_nodelay(int fd);
+int set_nonblocking(int fd);
+int set_zerocopy(int fd);
 int set_keepalive(int fd);
+int set_dscp(int fd, int dscp);
 int set_snd_timeout(int fd);
 int set_rcv_timeout(int fd);
 int get_local_addr(uint8_t *bytes);
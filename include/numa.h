@@ -0,0 +1,15 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stdint.h>
+
+#define MAX_NUMA_NODES 64
+
+int init_numa_topology(void);
+int nr_numa_nodes(void);
+int cpu_to_numa_node(int cpu);
+int path_to_numa_node(const char *path);
+int addr_to_numa_node(const uint8_t *addr);
+int bind_to_numa_node(int node);
+
+#endif
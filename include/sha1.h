@@ -16,6 +16,8 @@
 
 #define SHA1_DIGEST_SIZE        20
 #define SHA1_BLOCK_SIZE         64
+/* the buffers get_buffers_sha1() hashes at a time at most */
+#define SHA1_BATCH_NR		8
 
 struct sha1_ctx {
 	uint64_t count;
@@ -33,5 +35,7 @@ sha1_final_func_t sha1_final;
 
 const char *sha1_to_hex(const unsigned char *sha1);
 void get_buffer_sha1(unsigned char *buf, unsigned len, unsigned char *sha1);
+void get_buffers_sha1(unsigned char **bufs, unsigned len, unsigned char **sha1s,
+		      int nr);
 
 #endif
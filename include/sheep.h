@@ -27,12 +27,36 @@ struct sd_vnode {
 	uint64_t hash;
 };
 
+/*
+ * Flat sorted copy of the vnode ring for the lookups in the I/O path.  It is
+ * built together with the vnode_info and never modified, so the threads can
+ * search it without locking.  An entry is 16 bytes, 4 entries per cache line.
+ */
+struct vnode_entry {
+	uint64_t hash;
+	uint32_t zone;
+};
+
+struct vnode_array {
+	uint32_t nr;
+	struct vnode_entry *entries;
+	const struct sd_vnode **vnodes; /* vnodes[i] is the one of entries[i] */
+};
+
+struct placement_slot;
+
 struct vnode_info {
 	struct rb_root vroot;
 	struct rb_root nroot;
+	struct sd_vnode *vnodes; /* of vroot, sorted by hash */
+	bool diskmode; /* vnodes of the disks */
+	bool mixhash; /* placed by sd_mix_64() */
+	struct vnode_array varray;
+	struct placement_slot *pcache; /* oid -> vnodes, see group.c */
 	int nr_nodes;
 	int nr_zones;
 	refcnt_t refcnt;
+	struct list_node retired; /* replaced, see retire_vnode_info() */
 };
 
 static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
@@ -54,12 +78,45 @@ static inline int vnode_cmp(const struct sd_vnode *node1,
 	return intcmp(node1->hash, node2->hash);
 }
 
+/*
+ * The placement hash of the objects and the chains of the vnodes.  A cluster
+ * formatted with SD_CLUSTER_FLAG_MIXHASH mixes the 64 bits of a value with two
+ * multiplies instead of the eight rounds of FNV-1a over its bytes, the others
+ * keep sd_hash_oid() and sd_hash_next().  Set before the vnodes are built.
+ */
+extern bool sd_mix_placement;
+
+static inline uint64_t sd_place_oid(uint64_t oid)
+{
+	return sd_mix_placement ? sd_mix_64(oid) : sd_hash_oid(oid);
+}
+
+static inline uint64_t sd_place_next(uint64_t hval)
+{
+	return sd_mix_placement ? sd_mix_64(hval) : sd_hash_next(hval);
+}
+
+/*
+ * sd_place_oid() of an array of oids.  The loops have no branch and no
+ * dependency between the oids, so the compiler vectorizes them.
+ */
+static inline void sd_place_oids(const uint64_t *oids, uint64_t *hvals,
+				 size_t nr)
+{
+	if (sd_mix_placement)
+		for (size_t i = 0; i < nr; i++)
+			hvals[i] = sd_mix_64(oids[i]);
+	else
+		for (size_t i = 0; i < nr; i++)
+			hvals[i] = sd_hash_oid(oids[i]);
+}
+
 /* If v1_hash < oid_hash <= v2_hash, then oid is resident on v2 */
 static inline struct sd_vnode *
 oid_to_first_vnode(uint64_t oid, struct rb_root *root)
 {
 	struct sd_vnode dummy = {
-		.hash = sd_hash_oid(oid),
+		.hash = sd_place_oid(oid),
 	};
 	return rb_nsearch(root, &dummy, rb, vnode_cmp);
 }
@@ -117,6 +174,108 @@ static inline void oid_to_nodes(uint64_t oid, struct rb_root *root,
 		nodes[i] = vnodes[i]->node;
 }
 
+static inline void vnode_array_build(struct vnode_array *va,
+				     struct rb_root *vroot)
+{
+	const struct sd_vnode *v;
+	uint32_t nr = 0;
+
+	rb_for_each_entry(v, vroot, rb)
+		nr++;
+
+	va->nr = nr;
+	/* page aligned, hence cache line aligned */
+	va->entries = xvalloc(sizeof(*va->entries) * (nr + 1));
+	va->vnodes = xmalloc(sizeof(*va->vnodes) * (nr + 1));
+
+	nr = 0;
+	rb_for_each_entry(v, vroot, rb) {
+		va->entries[nr].hash = v->hash;
+		va->entries[nr].zone = v->node->zone;
+		va->vnodes[nr] = v;
+		nr++;
+	}
+}
+
+static inline void vnode_array_free(struct vnode_array *va)
+{
+	free(va->entries);
+	free(va->vnodes);
+	va->nr = 0;
+}
+
+/* Return the index of the first vnode whose hash is not less than 'hash' */
+static inline uint32_t vnode_array_search(const struct vnode_array *va,
+					  uint64_t hash)
+{
+	const struct vnode_entry *base = va->entries;
+	uint32_t n = va->nr, idx;
+
+	while (n > 1) {
+		uint32_t half = n / 2;
+
+		/* no branch here, this is compiled to a conditional move */
+		base = base[half].hash < hash ? base + half : base;
+		n -= half;
+	}
+	idx = base - va->entries + (base->hash < hash);
+
+	return idx == va->nr ? 0 : idx; /* Wrap around */
+}
+
+/* Same as vnode_array_to_idx() with the placement hash of the oid */
+static inline void vnode_array_hash_to_idx(const struct vnode_array *va,
+					   uint64_t hval, int nr_copies,
+					   uint32_t *idxs)
+{
+	uint32_t zones[SD_MAX_COPIES];
+	uint32_t first, idx;
+
+	first = idx = vnode_array_search(va, hval);
+	idxs[0] = idx;
+	zones[0] = va->entries[idx].zone;
+	for (int i = 1; i < nr_copies; i++) {
+next:
+		if (++idx == va->nr)
+			idx = 0;
+		if (unlikely(idx == first))
+			panic("can't find a valid vnode");
+		for (int j = 0; j < i; j++)
+			if (zones[j] == va->entries[idx].zone)
+				goto next;
+		idxs[i] = idx;
+		zones[i] = va->entries[idx].zone;
+	}
+}
+
+/*
+ * Same as oid_to_vnodes() but against the flat array, returns the indexes of
+ * the vnodes in the array.  The array must not be empty.
+ */
+static inline void vnode_array_to_idx(const struct vnode_array *va,
+				      uint64_t oid, int nr_copies,
+				      uint32_t *idxs)
+{
+	vnode_array_hash_to_idx(va, sd_place_oid(oid), nr_copies, idxs);
+}
+
+static inline void vnode_array_to_vnodes(const struct vnode_array *va,
+					 uint64_t oid, int nr_copies,
+					 const struct sd_vnode **vnodes)
+{
+	uint32_t idxs[SD_MAX_COPIES];
+
+	if (unlikely(!va->nr)) {
+		for (int i = 0; i < nr_copies; i++)
+			vnodes[i] = NULL;
+		return;
+	}
+
+	vnode_array_to_idx(va, oid, nr_copies, idxs);
+	for (int i = 0; i < nr_copies; i++)
+		vnodes[i] = va->vnodes[idxs[i]];
+}
+
 static inline int oid_cmp(const uint64_t *oid1, const uint64_t *oid2)
 {
 	return intcmp(*oid1, *oid2);
@@ -164,7 +323,7 @@ node_disk_to_vnodes(const struct sd_node *n, struct rb_root *vroot)
 		disk_vnodes = DIV_ROUND_UP(n->disks[j].disk_space, WEIGHT_MIN);
 		total += disk_vnodes;
 		for (int k = 0; k < disk_vnodes; k++) {
-			hval = sd_hash_next(hval);
+			hval = sd_place_next(hval);
 			struct sd_vnode *v = xmalloc(sizeof(*v));
 			v->hash = hval;
 			v->node = n;
@@ -193,7 +352,7 @@ node_to_vnodes(const struct sd_node *n, struct rb_root *vroot)
 	for (int i = 0; i < n->nr_vnodes; i++) {
 		struct sd_vnode *v = xmalloc(sizeof(*v));
 
-		hval = sd_hash_next(hval);
+		hval = sd_place_next(hval);
 		v->hash = hval;
 		v->node = n;
 		if (unlikely(rb_insert(vroot, v, rb, vnode_cmp)))
@@ -266,10 +425,15 @@ static inline bool is_cluster_diskmode(const struct cluster_info *cinfo)
 	return (cinfo->flags & SD_CLUSTER_FLAG_DISKMODE) > 0;
 }
 
+/* The size of the data objects of the vdi, fixed when it is created */
+static inline uint64_t vdi_object_size(const struct sd_inode *inode)
+{
+	return UINT64_C(1) << inode->block_size_shift;
+}
+
 static inline size_t count_data_objs(const struct sd_inode *inode)
 {
-	return DIV_ROUND_UP(inode->vdi_size,
-			    (1UL << inode->block_size_shift));
+	return DIV_ROUND_UP(inode->vdi_size, vdi_object_size(inode));
 }
 
 static inline __attribute__((used)) void __sd_proto_build_bug_ons(void)
@@ -49,6 +49,7 @@
 #define SD_OP_FLUSH_VDI      0x16
 #define SD_OP_DEL_VDI        0x17
 #define SD_OP_GET_CLUSTER_DEFAULT   0x18
+#define SD_OP_SHM_ATTACH     0x19
 
 /* macros in the SD_FLAG_CMD_XXX group are mutually exclusive */
 #define SD_FLAG_CMD_WRITE    0x01
@@ -58,6 +59,8 @@
 /* return something back while sending something to sheep */
 #define SD_FLAG_CMD_PIGGYBACK   0x10
 #define SD_FLAG_CMD_TGT   0x20
+/* a bulk read, like a backup, to keep out of the page cache of the sheep */
+#define SD_FLAG_CMD_BACKGROUND  0x40
 /* flags above 0x80 are sheepdog-internal */
 
 #define SD_RES_SUCCESS       0x00 /* Success */
@@ -108,6 +111,8 @@
 #define VDI_ATTR_BIT (UINT64_C(1) << 61)
 #define VDI_BTREE_BIT (UINT64_C(1) << 60)
 #define LEDGER_BIT (UINT64_C(1) << 59)
+/* the replicated form of a data object of a hybrid vdi */
+#define HOT_BIT (UINT64_C(1) << 58)
 #define OLD_MAX_DATA_OBJS (1ULL << 20)
 #define MAX_DATA_OBJS (1ULL << 32)
 #define SD_MAX_VDI_LEN 256U
@@ -120,6 +125,8 @@
 #define SD_OLD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * OLD_MAX_DATA_OBJS)
 #define SD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * MAX_DATA_OBJS)
 #define SD_DEFAULT_BLOCK_SIZE_SHIFT 22 /* 4M */
+#define SD_MIN_BLOCK_SIZE_SHIFT 19 /* 512K */
+#define SD_MAX_BLOCK_SIZE_SHIFT 26 /* 64M */
 
 #define SD_INODE_SIZE (sizeof(struct sd_inode))
 #define SD_INODE_INDEX_SIZE (sizeof(uint32_t) * MAX_DATA_OBJS)
@@ -134,6 +141,13 @@
 #define SD_REQ_SIZE 48
 #define SD_RSP_SIZE 48
 
+/*
+ * Unit of obj.deadline in milliseconds.  A client which gives up on a request
+ * after a timeout can set it, so that the sheep drop the request instead of
+ * running it when it's still queued past the timeout.
+ */
+#define SD_DEADLINE_UNIT 100
+
 struct sd_req {
 	uint8_t		proto_ver;
 	uint8_t		opcode;
@@ -144,14 +158,25 @@ struct sd_req {
 	union {
 		struct {
 			uint64_t	oid;
-			uint64_t	cow_oid;
+			union {
+				uint64_t	cow_oid;
+				/* of a forwarded peer request, or 0 */
+				uint64_t	span_id;
+				/* of SD_OP_READ_PARTIAL, bitmaps of strips */
+				struct {
+					uint32_t	strips; /* summed */
+					uint32_t	chain; /* left to sum */
+				};
+			};
 			uint8_t		copies;
 			uint8_t		copy_policy;
 			uint8_t		ec_index;
-			uint8_t		reserved;
+			/* in SD_DEADLINE_UNIT from the receipt, 0 for none */
+			uint8_t		deadline;
 			uint32_t	tgt_epoch;
 			uint32_t	offset;
-			uint32_t	__pad;
+			/* bytes to discard from offset, 0 for the object */
+			uint32_t	length;
 		} obj;
 		struct {
 			uint64_t	vdi_size;
@@ -162,7 +187,10 @@ struct sd_req {
 			uint8_t		block_size_shift;
 			uint32_t	snapid;
 			uint8_t		async_delete;
-			uint8_t		reserved[3];
+			uint8_t		compress;
+			uint8_t		hybrid;
+			/* log2 of the erasure stripe size, 0 for the default */
+			uint8_t		stripe_shift;
 		} vdi;
 
 		/* sheepdog-internal */
@@ -196,6 +224,27 @@ struct sd_req {
 			uint8_t		addr[16];
 			uint16_t	port;
 		} forw;
+		struct {
+			uint32_t	version;
+		} stat;
+		struct {
+			uint64_t	id;
+			uint32_t	epoch;
+			uint32_t	flags;
+		} lock;
+		struct {
+			/* span ids in the data, 0 for the slowest spans */
+			uint32_t	nr;
+		} span;
+		struct {
+			/* the data to move in a step, 0 for all at once */
+			uint64_t	budget;
+		} reweight;
+		struct {
+			/* the farm path, padded to 8 bytes, then the objects */
+			uint32_t	path_len;
+			uint32_t	nr;
+		} farm;
 
 		uint32_t		__pad[8];
 	};
@@ -213,7 +262,9 @@ struct sd_rsp {
 		struct {
 			uint32_t	__pad;
 			uint8_t		copies;
-			uint8_t		reserved[3];
+			/* of a peer read, the copy is on a slow disk */
+			uint8_t		slow;
+			uint8_t		reserved[2];
 			uint64_t	offset;
 		} obj;
 		struct {
@@ -246,11 +297,89 @@ struct sd_rsp {
 			uint8_t		block_size_shift;
 			uint8_t		__pad2;
 		} cluster_default;
+		struct {
+			uint32_t	__pad;
+			uint8_t		synced;
+			uint8_t		__reserved[3];
+		} vdi_state;
 
 		uint32_t		__pad[8];
 	};
 };
 
+/*
+ * The shared memory ring of a local client
+ *
+ * A client on the unix socket creates a file in /dev/shm of SD_SHM_SIZE()
+ * bytes, fills in the header and sends its name as the data of
+ * SD_OP_SHM_ATTACH.  After a successful response the socket carries only
+ * the doorbells.  The client puts a request in a free slot, its data in the
+ * data of the slot, the slot in sq[sq_tail % nr_slots] and bumps sq_tail,
+ * then writes a byte to the socket for the batch.  The sheep reads and
+ * writes the data of the slot in place, fills in its response, puts it in
+ * cq[cq_tail % nr_slots] and bumps cq_tail, and writes a byte to the socket
+ * for each batch of responses.  A slot may be reused once its response is
+ * taken from cq.
+ */
+#define SD_SHM_MAGIC		0x5344534d /* SDSM */
+#define SD_SHM_MAX_SLOTS	1024
+#define SD_SHM_ALIGN		4096
+
+struct sd_shm_ring {
+	uint32_t magic;
+	uint32_t nr_slots; /* a power of two */
+	uint32_t slot_size; /* the data bytes of a slot, SD_SHM_ALIGN aligned */
+	uint32_t __pad[13];
+	uint32_t sq_tail; /* written by the client */
+	uint32_t __pad1[15];
+	uint32_t sq_head; /* written by the sheep */
+	uint32_t __pad2[15];
+	uint32_t cq_tail; /* written by the sheep */
+	uint32_t __pad3[15];
+	uint32_t cq_head; /* written by the client */
+	uint32_t __pad4[15];
+	/* then sq[nr_slots], cq[nr_slots], the slots and the data */
+};
+
+struct sd_shm_slot {
+	struct sd_req req;
+	struct sd_rsp rsp;
+};
+
+static inline uint32_t *sd_shm_sq(struct sd_shm_ring *ring)
+{
+	return (uint32_t *)(ring + 1);
+}
+
+static inline uint32_t *sd_shm_cq(struct sd_shm_ring *ring)
+{
+	return sd_shm_sq(ring) + ring->nr_slots;
+}
+
+static inline struct sd_shm_slot *sd_shm_slot(struct sd_shm_ring *ring,
+					      uint32_t idx)
+{
+	return (struct sd_shm_slot *)(sd_shm_cq(ring) + ring->nr_slots) + idx;
+}
+
+static inline uint64_t sd_shm_data_offset(uint32_t nr_slots)
+{
+	uint64_t len = sizeof(struct sd_shm_ring) +
+		2 * nr_slots * sizeof(uint32_t) +
+		nr_slots * sizeof(struct sd_shm_slot);
+
+	return (len + SD_SHM_ALIGN - 1) / SD_SHM_ALIGN * SD_SHM_ALIGN;
+}
+
+static inline void *sd_shm_data(struct sd_shm_ring *ring, uint32_t idx)
+{
+	return (char *)ring + sd_shm_data_offset(ring->nr_slots) +
+		(uint64_t)idx * ring->slot_size;
+}
+
+#define SD_SHM_SIZE(nr_slots, slot_size) \
+	(sd_shm_data_offset(nr_slots) + (uint64_t)(nr_slots) * (slot_size))
+
 /*
  * Historical notes: previous version of sheepdog (< v0.9.0) has a limit of
  * maximum number of children which can be created from single VDI. So the inode
@@ -261,9 +390,14 @@ struct sd_rsp {
  *
  * users of the released area:
  * - uint32_t btree_counter
+ * - uint8_t compress, uint8_t __reserved[3]
  */
 #define OLD_MAX_CHILDREN 1024U
 
+/* compression of the data objects of a vdi */
+#define SD_COMPRESS_NONE 0
+#define SD_COMPRESS_ZLIB 1
+
 struct generation_reference {
 	int32_t generation;
 	int32_t count;
@@ -286,7 +420,11 @@ struct sd_inode {
 	uint32_t parent_vdi_id;
 
 	uint32_t btree_counter;
-	uint32_t __unused[OLD_MAX_CHILDREN - 1];
+	uint8_t  compress; /* SD_COMPRESS_* of the data objects */
+	uint8_t  hybrid; /* replicate the hot data objects */
+	uint8_t  stripe_shift; /* of the erasure stripe, 0 for the default */
+	uint8_t  __reserved[1];
+	uint32_t __unused[OLD_MAX_CHILDREN - 2];
 
 	uint32_t data_vdi_id[SD_INODE_DATA_INDEX];
 	struct generation_reference gref[SD_INODE_DATA_INDEX];
@@ -332,11 +470,13 @@ struct sheepdog_vdi_attr {
 
 extern void sd_inode_init(void *data, int depth);
 extern int sd_inode_actor_init(write_node_fn writer, read_node_fn reader);
+extern void sd_inode_cache_init(size_t nr_nodes);
 extern uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx);
 extern int sd_inode_set_vid(struct sd_inode *inode, uint32_t idx, uint32_t);
 extern int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
 				  uint32_t idx_end, uint32_t vdi_id);
 extern int sd_inode_write(struct sd_inode *inode, int flags, bool create, bool);
+extern int sd_inode_read(uint64_t oid, struct sd_inode *inode, size_t size);
 extern int sd_inode_write_vid(struct sd_inode *inode,
 			      uint32_t idx, uint32_t vid, uint32_t value,
 			      int flags, bool create, bool direct);
@@ -349,6 +489,19 @@ extern void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 typedef void (*index_cb_fn)(struct sd_index *, void *arg, int type);
 void sd_inode_index_walk(const struct sd_inode *inode, index_cb_fn, void *);
 
+/* A compact in-memory inode, see lib/sd_inode.c */
+struct sd_cinode;
+
+extern int sd_cinode_read(uint32_t vid, struct sd_cinode **cinode);
+extern void sd_cinode_free(struct sd_cinode *ci);
+extern const struct sd_inode *sd_cinode_header(const struct sd_cinode *ci);
+extern uint32_t sd_cinode_get_vid(struct sd_cinode *ci, uint32_t idx);
+extern int sd_cinode_set_vid(struct sd_cinode *ci, uint32_t idx,
+			     uint32_t vdi_id);
+extern int sd_cinode_write_vid(struct sd_cinode *ci, uint32_t idx,
+			       uint32_t vid, uint32_t value, int flags,
+			       bool create, bool direct);
+
 /* 64 bit FNV-1a non-zero initial basis */
 #define FNV1A_64_INIT ((uint64_t) 0xcbf29ce484222325ULL)
 #define FNV_64_PRIME ((uint64_t) 0x100000001b3ULL)
@@ -421,6 +574,15 @@ static inline uint64_t sd_hash_oid(uint64_t oid)
 	return sd_hash_64(oid);
 }
 
+/* The finalizer of splitmix64, a bijection of the 64 bits */
+static inline uint64_t sd_mix_64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
 /*
  * Create a hash value from a vdi name.  We cannot use sd_hash_buf for this
  * purpose because of backward compatibility.
@@ -464,6 +626,11 @@ static inline bool is_ledger_object(uint64_t oid)
 	return !!(oid & LEDGER_BIT);
 }
 
+static inline bool is_hot_obj(uint64_t oid)
+{
+	return !!(oid & HOT_BIT);
+}
+
 static inline bool is_data_obj(uint64_t oid)
 {
 	return !is_vdi_obj(oid) && !is_vmstate_obj(oid) &&
@@ -23,6 +23,9 @@ enum sph_srv_msg_type {
 	SPH_SRV_MSG_LEAVE_FORWARD,
 
 	SPH_SRV_MSG_REMOVE,
+
+	/* the messages above in the body, each with its struct sph_msg */
+	SPH_SRV_MSG_BATCH,
 };
 
 struct sph_msg {
@@ -114,6 +117,7 @@ static inline const char *sph_srv_msg_to_str(enum sph_srv_msg_type msg)
 		{ SPH_SRV_MSG_NOTIFY_FORWARD, "SPH_SRV_MSG_NOTIFY_FORWARD" },
 		{ SPH_SRV_MSG_BLOCK_FORWARD, "SPH_SRV_MSG_BLOCK_FORWARD" },
 		{ SPH_SRV_MSG_REMOVE, "SPH_SRV_MSG_REMOVE" },
+		{ SPH_SRV_MSG_BATCH, "SPH_SRV_MSG_BATCH" },
 	};
 
 	for (i = 0; i < ARRAY_SIZE(msgs); i++) {
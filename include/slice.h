@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SLICE_H__
+#define __SLICE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The slices of the objects of a farm, cut where the gear hash of the last
+ * bytes matches.  Dog and the sheep saving a snapshot must cut the same way
+ * for the slices to be shared.
+ */
+
+/* 128k, best empirical value from some tests, but no rationale */
+#define SLICE_SIZE (1024*128)
+#define SLICE_MIN_SIZE (SLICE_SIZE / 4)
+#define SLICE_MAX_SIZE (SLICE_SIZE * 4)
+
+void slice_cut_init(void);
+size_t slice_cut(const uint8_t *p, size_t len);
+
+#endif
@@ -4,14 +4,102 @@
 #include "internal_proto.h"
 #include "work.h"
 
+/*
+ * The traffic classes, which have connections of their own, so a bulk
+ * transfer doesn't delay the requests of the clients queued behind it
+ */
+enum sockfd_class {
+	SOCKFD_FG, /* the I/O of the clients */
+	SOCKFD_BG, /* recovery and the other bulk reads */
+	SOCKFD_NR_CLASSES,
+};
+
+static inline enum sockfd_class sockfd_req_class(const struct sd_req *hdr)
+{
+	if (hdr->flags & (SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_BACKGROUND))
+		return SOCKFD_BG;
+	return SOCKFD_FG;
+}
+
 struct sockfd *sockfd_cache_get(const struct node_id *nid);
+struct sockfd *sockfd_cache_get_class(const struct node_id *nid,
+				      enum sockfd_class cls);
 void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_del_node(const struct node_id *nid);
 void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_add(const struct node_id *nid);
 void sockfd_cache_add_group(const struct rb_root *nroot);
+void sockfd_cache_drop(const struct node_id *nid, struct sockfd *sfd);
+
+struct sockfd_load {
+	int nr_inflight;
+	uint64_t latency;	/* in microseconds */
+	uint64_t latency_var;
+	bool down;		/* we failed to connect to it lately */
+};
+
+void sockfd_cache_update_latency(const struct node_id *nid, uint64_t latency);
+void sockfd_cache_get_load(const struct node_id *nid, struct sockfd_load *load);
+
+struct sockfd_stat {
+	int nr_nodes;
+	int nr_fds_per_node; /* the slots for the fds of a node */
+	int nr_fds; /* connected */
+	int nr_in_use;
+	int nr_mux; /* multiplexed connections */
+	int nr_mux_inflight;
+};
+
+void sockfd_cache_get_stat(struct sockfd_stat *stat);
 
 int sockfd_init(void);
+void sockfd_set_dscp(enum sockfd_class cls, int dscp);
+void sockfd_mark(int fd, enum sockfd_class cls);
+int sockfd_probe_init(const struct node_id *self);
+
+/*
+ * A request on a multiplexed connection
+ *
+ * The caller sets buf and buf_len for the response data before
+ * sockfd_mux_send(), waits on sockfd_mux_efd() until sockfd_mux_done() is true
+ * and then releases it with sockfd_mux_finish().
+ */
+struct sockfd_mux_req {
+	struct sd_rsp rsp;
+	void *buf;
+	uint32_t buf_len;
+
+	/* private */
+	struct sockfd_mux *mux;
+	void *transport; /* set if another transport sent it, e.g. RDMA */
+	struct list_node list;
+	uint32_t id;
+	int efd;
+	uatomic_bool claimed; /* the dispatcher is receiving the response */
+	uatomic_bool done;
+
+	/* queued on the connection until a sender writes it */
+	struct list_node send_list;
+	struct sd_req *hdr;
+	void *data;
+	unsigned int wlen;
+	bool zerocopy;
+	bool sent;
+	int send_ret;
+};
+
+int sockfd_mux_send(const struct node_id *nid, struct sd_req *hdr, void *data,
+		    unsigned int wlen, bool zerocopy,
+		    bool (*need_retry)(uint32_t), uint32_t epoch,
+		    struct sockfd_mux_req *mreq);
+void sockfd_mux_finish(struct sockfd_mux_req *mreq);
+void sockfd_mux_rebind(struct sockfd_mux_req *mreq, int efd);
+int sockfd_mux_efd(void);
+
+static inline bool sockfd_mux_done(struct sockfd_mux_req *mreq)
+{
+	return uatomic_is_true(&mreq->done);
+}
 
 /* sockfd_cache */
 struct sockfd {
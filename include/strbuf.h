@@ -88,6 +88,8 @@ static inline void strbuf_addbuf(struct strbuf *sb, struct strbuf *sb2)
 	strbuf_add(sb, sb2->buf, sb2->len);
 }
 
+void strbuf_vaddf(struct strbuf *sb, const char *fmt, va_list ap)
+	__printf(2, 0);
 void strbuf_addf(struct strbuf *sb, const char *fmt, ...) __printf(2, 3);
 
 size_t strbuf_fread(struct strbuf *, size_t, FILE *);
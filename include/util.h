@@ -130,6 +130,35 @@ void *xzalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xvalloc(size_t size);
+
+/*
+ * Subsystems whose memory is accounted, by the usable size of the allocations
+ * from the tagged variants below, which have to be freed by free_tag() or
+ * reallocated by xrealloc_tag() with the same tag.
+ */
+enum sd_mem_tag {
+	SD_MEM_RECOVERY,	/* the oid lists of the recovery */
+	SD_MEM_OBJLIST,		/* the object list cache */
+	SD_MEM_REQUEST,		/* the request buffers from the system */
+	SD_MEM_VNODE,		/* the vnodes of vnode_info */
+	SD_MEM_INODE,		/* the inode buffers of the vdi operations */
+	SD_MEM_KV,		/* the data buffers of the http kv store */
+	SD_MEM_NR_TAGS,
+};
+
+void *xmalloc_tag(size_t size, enum sd_mem_tag tag);
+void *xzalloc_tag(size_t size, enum sd_mem_tag tag);
+void *xrealloc_tag(void *ptr, size_t size, enum sd_mem_tag tag);
+void *xvalloc_tag(size_t size, enum sd_mem_tag tag);
+void free_tag(void *ptr, enum sd_mem_tag tag);
+void sd_mem_charge(enum sd_mem_tag tag, int64_t size);
+uint64_t sd_mem_used(enum sd_mem_tag tag);
+uint64_t sd_mem_cap(enum sd_mem_tag tag);
+void sd_mem_set_cap(enum sd_mem_tag tag, uint64_t cap);
+bool sd_mem_over_cap(enum sd_mem_tag tag);
+const char *sd_mem_tag_name(enum sd_mem_tag tag);
+int sd_mem_tag_by_name(const char *name);
+
 int prealloc(int fd, uint64_t size);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
@@ -305,8 +334,14 @@ static inline int refcount_dec(refcnt_t *rc)
 
 #define SD_MUTEX_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
 
+struct lock_site;
+
 struct sd_mutex {
 	pthread_mutex_t mutex;
+#ifdef HAVE_LOCKSTAT
+	struct lock_site *holder; /* see the lock contention profiler */
+	uint64_t since;
+#endif
 };
 
 static inline void sd_init_mutex(struct sd_mutex *mutex)
@@ -428,6 +463,14 @@ static inline int sd_cond_wait_timeout(struct sd_cond *cond,
 	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, &wait_time);
 }
 
+/* Wait until the CLOCK_REALTIME deadline, ETIMEDOUT once it has passed */
+static inline int sd_cond_wait_until(struct sd_cond *cond,
+				     struct sd_mutex *mutex,
+				     const struct timespec *deadline)
+{
+	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, deadline);
+}
+
 static inline int sd_cond_broadcast(struct sd_cond *cond)
 {
 	return pthread_cond_broadcast(&cond->cond);
@@ -439,6 +482,10 @@ static inline int sd_cond_broadcast(struct sd_cond *cond)
 
 struct sd_rw_lock {
 	pthread_rwlock_t rwlock;
+#ifdef HAVE_LOCKSTAT
+	struct lock_site *holder; /* the writer */
+	uint64_t since;
+#endif
 };
 
 static inline void sd_init_rw_lock(struct sd_rw_lock *lock)
@@ -493,6 +540,11 @@ static inline void sd_write_lock(struct sd_rw_lock *lock)
 		panic("failed to lock for writing, %s", strerror(ret));
 }
 
+static inline int sd_write_trylock(struct sd_rw_lock *lock)
+{
+	return pthread_rwlock_trywrlock(&lock->rwlock);
+}
+
 static inline void sd_rw_unlock(struct sd_rw_lock *lock)
 {
 	int ret;
@@ -581,7 +633,253 @@ static inline uint64_t clock_get_time(void)
 	return (uint64_t)ts.tv_sec * 1000000000LL + (uint64_t)ts.tv_nsec;
 }
 
+#ifdef HAVE_LOCKSTAT
+
+/*
+ * Lock contention profiler, built with --enable-lockstat
+ *
+ * Every call site taking a sd_mutex or a sd_rw_lock has a static struct
+ * lock_site, named by the lock expression, which registers itself on its
+ * first use.  The lock is tried first, and only a failed try is timed into
+ * the histogram of the waits.  A lock held exclusively remembers the site
+ * holding it, which is charged with the time held and the waits it causes.
+ * Without --enable-lockstat the wrappers above are used as they are.
+ */
+#define LOCKSTAT_NR_BUCKETS 16 /* [i] counts the waits below 2^i us */
+
+struct lock_site {
+	const char *name;
+	const char *file;
+	int line;
+	int registered;
+	struct lock_site *next;
+	uint64_t nr_acquired;
+	uint64_t nr_contended;
+	uint64_t wait_ns;
+	uint64_t max_wait_ns;
+	uint64_t hold_ns;
+	uint64_t nr_blocking; /* the waits of the others while held here */
+	uint64_t wait_hist[LOCKSTAT_NR_BUCKETS];
+};
+
+void lockstat_register(struct lock_site *site);
+struct lock_site *lockstat_sites(void);
+
+#define LOCK_SITE(lock)							\
+({									\
+	static struct lock_site __site = {				\
+		.name = #lock, .file = __FILE__, .line = __LINE__,	\
+	};								\
+	&__site;							\
+})
+
+static inline void lockstat_enter(struct lock_site *site)
+{
+	if (unlikely(!uatomic_read(&site->registered)))
+		lockstat_register(site);
+	uatomic_inc(&site->nr_acquired);
+}
+
+static inline void lockstat_wait(struct lock_site *site,
+				 struct lock_site *holder, uint64_t start)
+{
+	uint64_t ns = clock_get_time() - start;
+	int b = 0;
+
+	while (b < LOCKSTAT_NR_BUCKETS - 1 && ns >= (UINT64_C(1000) << b))
+		b++;
+	uatomic_inc(&site->nr_contended);
+	uatomic_add(&site->wait_ns, ns);
+	uatomic_inc(&site->wait_hist[b]);
+	if (ns > uatomic_read(&site->max_wait_ns))
+		uatomic_set(&site->max_wait_ns, ns);
+	if (holder)
+		uatomic_inc(&holder->nr_blocking);
+}
+
+static inline void lockstat_hold(struct lock_site **holder, uint64_t *since,
+				 struct lock_site *site)
+{
+	*since = clock_get_time();
+	uatomic_set(holder, site);
+}
+
+static inline struct lock_site *lockstat_unhold(struct lock_site **holder,
+						uint64_t since)
+{
+	struct lock_site *site = *holder;
+
+	if (site) {
+		uatomic_add(&site->hold_ns, clock_get_time() - since);
+		uatomic_set(holder, NULL);
+	}
+	return site;
+}
+
+static inline void lockstat_mutex_lock(struct sd_mutex *mutex,
+				       struct lock_site *site)
+{
+	lockstat_enter(site);
+	if (pthread_mutex_trylock(&mutex->mutex)) {
+		struct lock_site *holder = uatomic_read(&mutex->holder);
+		uint64_t start = clock_get_time();
+
+		(sd_mutex_lock)(mutex);
+		lockstat_wait(site, holder, start);
+	}
+	lockstat_hold(&mutex->holder, &mutex->since, site);
+}
+
+static inline int lockstat_mutex_trylock(struct sd_mutex *mutex,
+					 struct lock_site *site)
+{
+	int ret = (sd_mutex_trylock)(mutex);
+
+	if (!ret) {
+		lockstat_enter(site);
+		lockstat_hold(&mutex->holder, &mutex->since, site);
+	}
+	return ret;
+}
+
+static inline void lockstat_mutex_unlock(struct sd_mutex *mutex)
+{
+	lockstat_unhold(&mutex->holder, mutex->since);
+	(sd_mutex_unlock)(mutex);
+}
+
+/* The waits on a condition don't count as held */
+static inline int lockstat_cond_wait(struct sd_cond *cond,
+				     struct sd_mutex *mutex,
+				     const struct timespec *deadline)
+{
+	struct lock_site *site = lockstat_unhold(&mutex->holder, mutex->since);
+	int ret;
+
+	if (deadline)
+		ret = (sd_cond_wait_until)(cond, mutex, deadline);
+	else
+		ret = (sd_cond_wait)(cond, mutex);
+	if (site)
+		lockstat_hold(&mutex->holder, &mutex->since, site);
+	return ret;
+}
+
+static inline int lockstat_cond_wait_timeout(struct sd_cond *cond,
+					     struct sd_mutex *mutex,
+					     int second)
+{
+	struct timespec deadline = { .tv_sec = time(NULL) + second };
+
+	return lockstat_cond_wait(cond, mutex, &deadline);
+}
+
+static inline void lockstat_read_lock(struct sd_rw_lock *lock,
+				      struct lock_site *site)
+{
+	lockstat_enter(site);
+	if (pthread_rwlock_tryrdlock(&lock->rwlock)) {
+		struct lock_site *holder = uatomic_read(&lock->holder);
+		uint64_t start = clock_get_time();
+
+		(sd_read_lock)(lock);
+		lockstat_wait(site, holder, start);
+	}
+}
+
+static inline void lockstat_write_lock(struct sd_rw_lock *lock,
+				       struct lock_site *site)
+{
+	lockstat_enter(site);
+	if (pthread_rwlock_trywrlock(&lock->rwlock)) {
+		struct lock_site *holder = uatomic_read(&lock->holder);
+		uint64_t start = clock_get_time();
+
+		(sd_write_lock)(lock);
+		lockstat_wait(site, holder, start);
+	}
+	lockstat_hold(&lock->holder, &lock->since, site);
+}
+
+static inline int lockstat_write_trylock(struct sd_rw_lock *lock,
+					 struct lock_site *site)
+{
+	int ret = (sd_write_trylock)(lock);
+
+	if (!ret) {
+		lockstat_enter(site);
+		lockstat_hold(&lock->holder, &lock->since, site);
+	}
+	return ret;
+}
+
+/* Only a writer holds the lock while it has a holder */
+static inline void lockstat_rw_unlock(struct sd_rw_lock *lock)
+{
+	lockstat_unhold(&lock->holder, lock->since);
+	(sd_rw_unlock)(lock);
+}
+
+#define sd_mutex_lock(m) lockstat_mutex_lock(m, LOCK_SITE(m))
+#define sd_mutex_trylock(m) lockstat_mutex_trylock(m, LOCK_SITE(m))
+#define sd_mutex_unlock(m) lockstat_mutex_unlock(m)
+#define sd_cond_wait(c, m) lockstat_cond_wait(c, m, NULL)
+#define sd_cond_wait_timeout(c, m, s) lockstat_cond_wait_timeout(c, m, s)
+#define sd_cond_wait_until(c, m, d) lockstat_cond_wait(c, m, d)
+#define sd_read_lock(l) lockstat_read_lock(l, LOCK_SITE(l))
+#define sd_write_lock(l) lockstat_write_lock(l, LOCK_SITE(l))
+#define sd_write_trylock(l) lockstat_write_trylock(l, LOCK_SITE(l))
+#define sd_rw_unlock(l) lockstat_rw_unlock(l)
+
+#endif	/* HAVE_LOCKSTAT */
+
+/* Encode v in 7 bits per byte, lowest first, into at most 10 bytes */
+static inline uint8_t *varint_put(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/* Return the next byte after the varint, or NULL if it exceeds end */
+static inline const uint8_t *varint_get(const uint8_t *p, const uint8_t *end,
+					uint64_t *v)
+{
+	uint64_t val = 0;
+
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t c = *p++;
+
+		val |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*v = val;
+			return p;
+		}
+	}
+	return NULL;
+}
+
 char *xstrdup(const char *s);
 int xsemop(int semid, struct sembuf *sops, unsigned nsops);
 
+/*
+ * A sparse buffer is the number of extents, the extents of the blocks which
+ * are not all zero and their data, in the order of the extents.
+ */
+#define SPARSE_BLOCK_SIZE 4096
+
+struct sparse_extent {
+	uint32_t offset;
+	uint32_t length;
+};
+
+bool is_zero_block(const void *buf, size_t len);
+size_t sparse_next_extent(const char *buf, size_t len, size_t pos,
+			  size_t *ext_len);
+size_t sparse_encode(const void *buf, size_t len, void *out);
+int sparse_decode(const void *in, size_t in_len, void *buf, size_t len);
+
 #endif
@@ -6,8 +6,10 @@
 #include "list.h"
 #include "util.h"
 #include "logger.h"
+#include "event.h"
 
 struct work;
+struct done_port;
 
 typedef void (*work_func_t)(struct work *);
 
@@ -15,6 +17,12 @@ struct work {
 	struct list_node w_list;
 	work_func_t fn;
 	work_func_t done;
+
+	/* set by queue_work() */
+	struct work_queue *wq;
+	struct done_port *port;
+	/* link of the lock-free stacks in lib/work.c */
+	struct work *next;
 };
 
 struct work_queue {
@@ -23,9 +31,17 @@ struct work_queue {
 };
 
 enum wq_thread_control {
-	WQ_ORDERED, /* Only 1 thread created for work queue */
-	WQ_DYNAMIC, /* # of threads proportional to nr_nodes created */
-	WQ_UNLIMITED, /* Unlimited # of threads created */
+	WQ_ORDERED, /* Only 1 work of the queue runs at a time */
+	WQ_DYNAMIC, /* # of running works proportional to nr_nodes */
+	WQ_UNLIMITED, /* Unlimited # of running works */
+};
+
+/* Works of higher priority queues are picked up first by the workers */
+enum wq_priority {
+	WQ_PRIO_HIGH,
+	WQ_PRIO_NORMAL,
+	WQ_PRIO_LOW,
+	WQ_NR_PRIO,
 };
 
 static inline bool is_main_thread(void)
@@ -35,7 +51,7 @@ static inline bool is_main_thread(void)
 
 static inline bool is_worker_thread(void)
 {
-	return !is_main_thread();
+	return !is_main_thread() && !is_reactor_thread();
 }
 
 /*
@@ -56,19 +72,40 @@ static inline bool is_worker_thread(void)
 
 /*
  * 'get_nr_nodes' is the function to get the current number of nodes and used
- * for dynamic work queues.  'create_cb' will be called when worker threads are
- * created and 'destroy_cb' will be called when worker threads are destroyed.
+ * for dynamic work queues.
  */
 int init_work_queue(size_t (*get_nr_nodes)(void));
+int init_work_done_port(void);
 struct work_queue *create_work_queue(const char *name, enum wq_thread_control);
+struct work_queue *create_work_queue_prio(const char *name,
+					  enum wq_thread_control,
+					  enum wq_priority);
 struct work_queue *create_ordered_work_queue(const char *name);
 void queue_work(struct work_queue *q, struct work *work);
+void work_queue_set_numa_node(struct work_queue *q, int node);
 bool work_queue_empty(struct work_queue *q);
+
+struct wq_stat {
+	const char *name;
+	size_t nr_queued; /* queued and not done yet */
+	size_t nr_active; /* handed to the workers, 0 for WQ_UNLIMITED */
+};
+
+int wq_get_stat(struct wq_stat *stat, int nr);
+void wq_get_pool_stat(size_t *nr_workers, size_t *nr_idle, size_t *nr_pending);
 int wq_trace_init(void);
 
 #if (defined HAVE_TRACE) || (defined HAVE_LIVEPATCH)
 void suspend_worker_threads(void);
 void resume_worker_threads(void);
+void synchronize_worker_threads(void);
+void thread_quiescent_state(void);
+void thread_offline(void);
+void thread_online(void);
+#else
+static inline void thread_quiescent_state(void) {}
+static inline void thread_offline(void) {}
+static inline void thread_online(void) {}
 #endif	/* HAVE_TRACE || HAVE_LIVEPATCH*/
 
 typedef pthread_t sd_thread_t;
@@ -24,6 +24,9 @@
 
 static struct work_queue *util_wqueue;
 
+/* see sd_place_oid() */
+bool sd_mix_placement;
+
 void register_util_wq(struct work_queue *wq)
 {
 	util_wqueue = wq;
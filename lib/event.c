@@ -15,13 +15,233 @@
 #include <unistd.h>
 #include <sys/epoll.h>
 
-#include "rbtree.h"
 #include "logger.h"
 #include "util.h"
 #include "event.h"
+#include "work.h"
 
-static int efd;
-static struct rb_root events_tree = RB_ROOT;
+/*
+ * The timers of an event loop are kept in a hierarchical timer wheel of
+ * TW_LEVELS levels of TW_SIZE slots, whose ticks are milliseconds.  A timer
+ * due within TW_SIZE ticks is in the slot of level 0 of its tick, and the one
+ * due later in the slot of the higher level whose range takes it in.  When
+ * the ticks of level 0 wrap, the next slot of level 1 is cascaded into level
+ * 0, and so on, so adding and deleting a timer is O(1).  The epoll timeout of
+ * the loop is the next tick with a timer or a cascade, found by the bitmaps of
+ * the slots in use, so the timers cost no fd and an idle wheel doesn't wake
+ * the loop up.
+ */
+#define TW_BITS		6
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+#define TW_MAX		(1ULL << (TW_BITS * TW_LEVELS)) /* about 4.6 hours */
+
+struct timer_wheel {
+	uint64_t now; /* the next tick to run */
+	uint64_t used[TW_LEVELS]; /* bitmaps of the slots with a timer */
+	struct list_head slots[TW_LEVELS][TW_SIZE];
+	unsigned int nr;
+	bool initialized;
+};
+
+/* the events are looked up in a table indexed by the fds */
+#define EVENT_TABLE_MIN 1024
+
+struct event_loop {
+	int efd;
+	struct event_info **table;
+	int nr_table;
+	struct event_info *dead; /* unregistered in the current round */
+	struct epoll_event *events;
+	int nr_events;
+	bool refresh;
+	struct timer_wheel wheel;
+
+	/* the callback running since busy_since, 0 if none, once watched */
+	bool watched;
+	void *busy_fn;
+	uint64_t busy_since;
+};
+
+static struct event_loop main_loop = {
+	.efd = -1,
+};
+
+/*
+ * Each thread which calls init_event() runs its own event loop, and the event
+ * functions work on the loop of the calling thread.  The other threads, i.e.
+ * the worker threads, fall back on the loop of the main thread.
+ */
+static __thread struct event_loop *thread_loop;
+
+static inline struct event_loop *current_loop(void)
+{
+	return thread_loop ?: &main_loop;
+}
+
+bool is_reactor_thread(void)
+{
+	return thread_loop && thread_loop != &main_loop;
+}
+
+static inline uint64_t get_msec(void)
+{
+	return clock_get_time() / 1000000;
+}
+
+static void wheel_init(struct timer_wheel *w)
+{
+	for (int l = 0; l < TW_LEVELS; l++)
+		for (int i = 0; i < TW_SIZE; i++)
+			INIT_LIST_HEAD(&w->slots[l][i]);
+	w->now = get_msec();
+	w->initialized = true;
+}
+
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expire = max(t->expire, w->now), delta;
+	int l = 0, i;
+
+	/* a timer beyond the wheel waits in the top level until it's near */
+	if (expire - w->now >= TW_MAX)
+		expire = w->now + TW_MAX - 1;
+	delta = expire - w->now;
+
+	while (delta >= (1ULL << (TW_BITS * (l + 1))))
+		l++;
+	i = (expire >> (TW_BITS * l)) & TW_MASK;
+
+	t->slot = l * TW_SIZE + i;
+	list_add_tail(&t->list, &w->slots[l][i]);
+	w->used[l] |= 1ULL << i;
+}
+
+static void wheel_remove(struct timer_wheel *w, struct timer *t)
+{
+	int l = t->slot / TW_SIZE, i = t->slot % TW_SIZE;
+
+	list_del(&t->list);
+	if (list_empty(&w->slots[l][i]))
+		w->used[l] &= ~(1ULL << i);
+}
+
+/* Move the timers of the slot of the level to the lower levels */
+static void wheel_cascade(struct timer_wheel *w, int l, int i)
+{
+	struct list_head list;
+	struct timer *t;
+
+	INIT_LIST_HEAD(&list);
+	list_splice_init(&w->slots[l][i], &list);
+	w->used[l] &= ~(1ULL << i);
+	while (!list_empty(&list)) {
+		t = list_first_entry(&list, struct timer, list);
+		list_del(&t->list);
+		wheel_insert(w, t);
+	}
+}
+
+static inline void loop_busy(struct event_loop *loop, void *fn)
+{
+	if (!loop->watched)
+		return;
+	uatomic_set(&loop->busy_fn, fn);
+	uatomic_set(&loop->busy_since, clock_get_time());
+}
+
+static inline void loop_idle(struct event_loop *loop)
+{
+	if (loop->watched)
+		uatomic_set(&loop->busy_since, 0);
+}
+
+/* Run the timers due by now */
+static void wheel_run(struct timer_wheel *w)
+{
+	struct event_loop *loop = container_of(w, struct event_loop, wheel);
+	uint64_t now = get_msec();
+	struct list_head list;
+	struct timer *t;
+
+	if (!w->nr) {
+		w->now = max(w->now, now + 1);
+		return;
+	}
+
+	INIT_LIST_HEAD(&list);
+	while (w->now <= now) {
+		int i = w->now & TW_MASK;
+
+		/* skip to the next cascade if level 0 is empty */
+		if (!w->used[0] && i) {
+			w->now = min((w->now | TW_MASK) + 1, now + 1);
+			continue;
+		}
+
+		for (int l = 1; l < TW_LEVELS; l++) {
+			int shift = TW_BITS * l;
+
+			if (w->now & ((1ULL << shift) - 1))
+				break;
+			wheel_cascade(w, l, (w->now >> shift) & TW_MASK);
+		}
+
+		list_splice_init(&w->slots[0][i], &list);
+		w->used[0] &= ~(1ULL << i);
+		w->now++;
+
+		/* the callbacks may add or delete any timer */
+		while (!list_empty(&list)) {
+			t = list_first_entry(&list, struct timer, list);
+			list_del(&t->list);
+			w->nr--;
+			loop_busy(loop, t->callback);
+			t->callback(t->data);
+			loop_idle(loop);
+		}
+	}
+}
+
+/* The distance from the slot i to the next slot in use, or -1 if none */
+static inline int next_slot(uint64_t used, int i)
+{
+	uint64_t rotated = used >> i | (i ? used << (TW_SIZE - i) : 0);
+
+	return rotated ? __builtin_ctzll(rotated) : -1;
+}
+
+/* Milliseconds to the next timer or cascade, or -1 if there is none */
+static int wheel_timeout(const struct timer_wheel *w)
+{
+	uint64_t now = get_msec(), next = UINT64_MAX, base;
+	int k;
+
+	if (!w->nr)
+		return -1;
+
+	k = next_slot(w->used[0], w->now & TW_MASK);
+	if (k >= 0)
+		next = w->now + k;
+	for (int l = 1; l < TW_LEVELS; l++) {
+		int shift = TW_BITS * l;
+
+		/*
+		 * The current slot of an upper level is cascaded when it
+		 * starts, and the timers there after it are a round later.
+		 */
+		base = w->now >> shift;
+		if (w->now & ((1ULL << shift) - 1))
+			base++;
+		k = next_slot(w->used[l], base & TW_MASK);
+		if (k >= 0)
+			next = min(next, (base + k) << shift);
+	}
+	if (next <= now)
+		return 0;
+	return min(next - now, (uint64_t)INT_MAX);
+}
 
 static void timer_handler(int fd, int events, void *data)
 {
@@ -37,7 +257,8 @@ static void timer_handler(int fd, int events, void *data)
 	close(fd);
 }
 
-void add_timer(struct timer *t, unsigned int mseconds)
+/* Timers of the worker threads, which have no event loop of their own */
+static void add_timerfd(struct timer *t, unsigned int mseconds)
 {
 	struct itimerspec it;
 	int tfd;
@@ -61,44 +282,99 @@ void add_timer(struct timer *t, unsigned int mseconds)
 		sd_err("failed to register timer fd");
 }
 
+/*
+ * Call the callback of the timer from the event loop of the thread after the
+ * milliseconds.  Adding a pending timer again moves it to the new time.
+ */
+void add_timer(struct timer *t, unsigned int mseconds)
+{
+	struct timer_wheel *w;
+
+	if (!thread_loop && !is_main_thread()) {
+		add_timerfd(t, mseconds);
+		return;
+	}
+
+	w = &current_loop()->wheel;
+	if (!w->initialized)
+		wheel_init(w);
+	if (timer_pending(t)) {
+		wheel_remove(w, t);
+		w->nr--;
+	}
+	t->expire = get_msec() + mseconds;
+	wheel_insert(w, t);
+	w->nr++;
+}
+
+/* Cancel the timer if it is pending, from the thread which added it */
+void del_timer(struct timer *t)
+{
+	struct timer_wheel *w = &current_loop()->wheel;
+
+	if (!timer_pending(t))
+		return;
+	wheel_remove(w, t);
+	w->nr--;
+}
+
 struct event_info {
-	event_handler_t handler;
+	event_handler_t handler; /* NULL once unregistered */
 	int fd;
 	void *data;
-	struct rb_node rb;
 	int prio;
+	unsigned int events;
+	struct event_info *next_dead;
 };
 
-static struct epoll_event *events;
-static int nr_events;
-
-static int event_cmp(const struct event_info *e1, const struct event_info *e2)
-{
-	return intcmp(e1->fd, e2->fd);
-}
-
 int init_event(int nr)
 {
-	nr_events = nr;
-	events = xcalloc(nr_events, sizeof(struct epoll_event));
+	struct event_loop *loop;
 
-	efd = epoll_create(nr);
-	if (efd < 0) {
+	if (is_main_thread())
+		loop = &main_loop;
+	else
+		loop = xzalloc(sizeof(*loop));
+	if (!loop->wheel.initialized)
+		wheel_init(&loop->wheel);
+
+	loop->nr_events = nr;
+	loop->events = xcalloc(nr, sizeof(struct epoll_event));
+
+	loop->efd = epoll_create(nr);
+	if (loop->efd < 0) {
 		sd_err("failed to create epoll fd");
+		free(loop->events);
+		if (loop != &main_loop)
+			free(loop);
 		return -1;
 	}
+
+	thread_loop = loop;
 	return 0;
 }
 
-static struct event_info *lookup_event(int fd)
+static inline struct event_info *lookup_event(struct event_loop *loop, int fd)
+{
+	return fd >= 0 && fd < loop->nr_table ? loop->table[fd] : NULL;
+}
+
+static void grow_table(struct event_loop *loop, int fd)
 {
-	struct event_info key = { .fd = fd };
+	int nr = max(loop->nr_table * 2, EVENT_TABLE_MIN);
 
-	return rb_search(&events_tree, &key, rb, event_cmp);
+	if (nr <= fd)
+		nr = fd + 1;
+
+	loop->table = xrealloc(loop->table, sizeof(*loop->table) * nr);
+	memset(loop->table + loop->nr_table, 0,
+	       sizeof(*loop->table) * (nr - loop->nr_table));
+	loop->nr_table = nr;
 }
 
 int register_event_prio(int fd, event_handler_t h, void *data, int prio)
 {
+	struct event_loop *loop = current_loop();
 	int ret;
 	struct epoll_event ev;
 	struct event_info *ei;
@@ -108,112 +384,180 @@ int register_event_prio(int fd, event_handler_t h, void *data, int prio)
 	ei->handler = h;
 	ei->data = data;
 	ei->prio = prio;
+	ei->events = EPOLLIN;
 
 	memset(&ev, 0, sizeof(ev));
-	ev.events = EPOLLIN;
+	ev.events = ei->events;
 	ev.data.ptr = ei;
 
-	ret = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+	ret = epoll_ctl(loop->efd, EPOLL_CTL_ADD, fd, &ev);
 	if (ret) {
 		sd_err("failed to add epoll event for fd %d: %m", fd);
 		free(ei);
-	} else
-		rb_insert(&events_tree, ei, rb, event_cmp);
+		return ret;
+	}
 
-	return ret;
+	if (fd >= loop->nr_table)
+		grow_table(loop, fd);
+	loop->table[fd] = ei;
+	return 0;
 }
 
 void unregister_event(int fd)
 {
+	struct event_loop *loop = current_loop();
 	int ret;
 	struct event_info *ei;
 
-	ei = lookup_event(fd);
+	ei = lookup_event(loop, fd);
 	if (!ei)
 		return;
 
-	ret = epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+	ret = epoll_ctl(loop->efd, EPOLL_CTL_DEL, fd, NULL);
 	if (ret)
 		sd_err("failed to delete epoll event for fd %d: %m", fd);
 
-	rb_erase(&ei->rb, &events_tree);
-	free(ei);
-
 	/*
-	 * Although ei is no longer valid pointer, ei->handler() might be about
-	 * to be called in do_event_loop().  Refreshing the event loop is safe.
+	 * The events of the fd ready in this round of do_event_loop() still
+	 * point to ei, so it is freed after the round, and skipped until then.
 	 */
-	event_force_refresh();
+	loop->table[fd] = NULL;
+	ei->handler = NULL;
+	ei->next_dead = loop->dead;
+	loop->dead = ei;
 }
 
 int modify_event(int fd, unsigned int new_events)
 {
+	struct event_loop *loop = current_loop();
 	int ret;
 	struct epoll_event ev;
 	struct event_info *ei;
 
-	ei = lookup_event(fd);
+	ei = lookup_event(loop, fd);
 	if (!ei) {
 		sd_err("event info for fd %d not found", fd);
 		return 1;
 	}
+	if (ei->events == new_events)
+		return 0;
 
 	memset(&ev, 0, sizeof(ev));
 	ev.events = new_events;
 	ev.data.ptr = ei;
 
-	ret = epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+	ret = epoll_ctl(loop->efd, EPOLL_CTL_MOD, fd, &ev);
 	if (ret) {
 		sd_err("failed to modify epoll event for fd %d: %m", fd);
 		return 1;
 	}
+	ei->events = new_events;
 	return 0;
 }
 
-static bool event_loop_refresh;
-
+/* Make do_event_loop() wait for the events again before the rest of them */
 void event_force_refresh(void)
 {
-	event_loop_refresh = true;
+	current_loop()->refresh = true;
 }
 
-static int epoll_event_cmp(const struct epoll_event *_a, struct epoll_event *_b)
+static void free_dead_events(struct event_loop *loop)
 {
-	struct event_info *a, *b;
+	struct event_info *ei;
+
+	while ((ei = loop->dead)) {
+		loop->dead = ei->next_dead;
+		free(ei);
+	}
+}
 
-	a = (struct event_info *)_a->data.ptr;
-	b = (struct event_info *)_b->data.ptr;
+static inline int event_prio(const struct epoll_event *e)
+{
+	return ((const struct event_info *)e->data.ptr)->prio;
+}
 
+static int epoll_event_cmp(const struct epoll_event *_a, struct epoll_event *_b)
+{
 	/* we need sort event_info array in reverse order */
-	return intcmp(b->prio, a->prio);
+	return intcmp(event_prio(_b), event_prio(_a));
+}
+
+/*
+ * Reorder the ready events by their priorities.  All but a few of the events
+ * are of the default priority, so they are put between the higher and the
+ * lower ones in one pass, and only the others are sorted.
+ */
+static void bucket_events(struct epoll_event *events, int nr)
+{
+	struct epoll_event tmp;
+	int hi = 0, lo = nr;
+
+	for (int i = 0; i < lo;) {
+		int prio = event_prio(events + i);
+
+		if (prio > EVENT_PRIO_DEFAULT) {
+			tmp = events[i];
+			events[i++] = events[hi];
+			events[hi++] = tmp;
+		} else if (prio < EVENT_PRIO_DEFAULT) {
+			tmp = events[i];
+			events[i] = events[--lo];
+			events[lo] = tmp;
+		} else
+			i++;
+	}
+	if (hi > 1)
+		xqsort(events, hi, epoll_event_cmp);
+	if (nr - lo > 1)
+		xqsort(events + lo, nr - lo, epoll_event_cmp);
 }
 
 static void do_event_loop(int timeout, bool sort_with_prio)
 {
-	int i, nr;
+	struct event_loop *loop = current_loop();
+	struct epoll_event *events = loop->events;
+	int i, nr, wait;
 
 refresh:
-	event_loop_refresh = false;
-	nr = epoll_wait(efd, events, nr_events, timeout);
-	if (sort_with_prio)
-		xqsort(events, nr, epoll_event_cmp);
+	loop->refresh = false;
+	/* before the wait, as the callbacks may unregister the events */
+	wheel_run(&loop->wheel);
+	wait = wheel_timeout(&loop->wheel);
+	if (wait < 0 || (timeout >= 0 && timeout < wait))
+		wait = timeout;
+	thread_offline();
+	nr = epoll_wait(loop->efd, events, loop->nr_events, wait);
+	thread_online();
+	if (!nr)
+		wheel_run(&loop->wheel);
 
 	if (nr < 0) {
 		if (errno == EINTR)
-			return;
+			goto out;
 		sd_err("epoll_wait failed: %m");
 		exit(1);
-	} else if (nr) {
-		for (i = 0; i < nr; i++) {
-			struct event_info *ei;
-
-			ei = (struct event_info *)events[i].data.ptr;
-			ei->handler(ei->fd, events[i].events, ei->data);
+	}
 
-			if (event_loop_refresh)
-				goto refresh;
+	if (sort_with_prio)
+		bucket_events(events, nr);
+	for (i = 0; i < nr; i++) {
+		struct event_info *ei;
+
+		ei = (struct event_info *)events[i].data.ptr;
+		/* unregistered by a handler of this round */
+		if (!ei->handler)
+			continue;
+		loop_busy(loop, ei->handler);
+		ei->handler(ei->fd, events[i].events, ei->data);
+		loop_idle(loop);
+
+		if (loop->refresh) {
+			free_dead_events(loop);
+			goto refresh;
 		}
 	}
+out:
+	free_dead_events(loop);
 }
 
 void event_loop(int timeout)
@@ -225,3 +569,21 @@ void event_loop_prio(int timeout)
 {
 	do_event_loop(timeout, true);
 }
+
+/* Start to record the callback the main loop runs, for event_main_busy() */
+void event_watch_main(void)
+{
+	main_loop.watched = true;
+}
+
+/*
+ * Return when the callback the main loop runs started, in ns, 0 if it waits
+ * for the events.  Called by any thread.
+ */
+uint64_t event_main_busy(void **fn)
+{
+	uint64_t since = uatomic_read(&main_loop.busy_since);
+
+	*fn = uatomic_read(&main_loop.busy_fn);
+	return since;
+}
@@ -436,10 +436,27 @@ static void _invert_vdm(uint8_t *src, unsigned d)
 	return;
 }
 
+ec_encode_data_fn isa_encode_data;
+
 void init_fec(void)
 {
+#ifdef __x86_64__
+	int features = ec_cpu_features();
+#endif
+
 	generate_gf();
 	_init_mul_table();
+
+#ifdef __x86_64__
+	if (features & EC_CPU_GFNI)
+		isa_encode_data = ec_encode_data_avx512_gfni;
+	else if (features & EC_CPU_AVX512)
+		isa_encode_data = ec_encode_data_avx512;
+	else if (features & EC_CPU_AVX2)
+		isa_encode_data = ec_encode_data_avx2;
+	else if (cpu_has_ssse3)
+		isa_encode_data = ec_encode_data_sse;
+#endif
 }
 
 /*
@@ -450,13 +467,100 @@ void init_fec(void)
 
 #define FEC_MAGIC	0xFECC0DEC
 
+/*
+ * Kernels of the common codes
+ *
+ * fec_encode() and the decoders loop over a strip count known only at run
+ * time and make a pass over the output for each input strip.  For the codes
+ * the clusters use, 2:1, 4:2 and 8:3, fec_new() picks kernels expanded by
+ * DEFINE_EC_KERNELS() for the strip counts, with the loops over the strips
+ * unrolled into a single pass: each byte of the inputs is read once and the
+ * bytes of all the outputs are summed in registers.  The other codes take the
+ * generic path.  isa-l, when the CPU has it, is faster still and comes first.
+ */
+
+/* EC_COLS<n>(m, i) expands m(i, j) for j < n, EC_ROWS<n>(m, d) m(i, d) */
+#define EC_COLS1(m, i) m(i, 0)
+#define EC_COLS2(m, i) EC_COLS1(m, i) m(i, 1)
+#define EC_COLS4(m, i) EC_COLS2(m, i) m(i, 2) m(i, 3)
+#define EC_COLS8(m, i) EC_COLS4(m, i) m(i, 4) m(i, 5) m(i, 6) m(i, 7)
+#define EC_ROWS1(m, d) m(0, d)
+#define EC_ROWS2(m, d) EC_ROWS1(m, d) m(1, d)
+#define EC_ROWS3(m, d) EC_ROWS2(m, d) m(2, d)
+
+#define EC_SRC(_, j)		const uint8_t *s##j = src[j];
+#define EC_DST(i, _)		uint8_t *f##i = fecs[i];
+#define EC_IN(_, j)		const uint8_t in##j = s##j[x];
+#define EC_TERM(i, j)		^ tbl[i][j][in##j]
+#define EC_PARITY(i, d)		f##i[x] = 0 EC_COLS##d(EC_TERM, i);
+#define EC_DOT_TERM(_, j)	^ tbl[j][s##j[x]]
+
+#define DEFINE_EC_KERNELS(d, p)						\
+static void ec_encode_##d##_##p(const struct fec *code,		\
+				const uint8_t *const *src,		\
+				uint8_t *const *fecs, size_t sz)	\
+{									\
+	const uint8_t *m = code->enc_matrix + d * d;			\
+	const uint8_t *tbl[p][d];					\
+	EC_COLS##d(EC_SRC, _)						\
+	EC_ROWS##p(EC_DST, _)						\
+									\
+	for (int i = 0; i < p; i++)					\
+		for (int j = 0; j < d; j++)				\
+			tbl[i][j] = gf_mul_table[m[i * d + j]];		\
+	for (size_t x = 0; x < sz; x++) {				\
+		EC_COLS##d(EC_IN, _)					\
+		EC_ROWS##p(EC_PARITY, d)				\
+	}								\
+}									\
+									\
+static void ec_dot_##d##_##p(const uint8_t *coef, uint8_t *const *src,	\
+			     uint8_t *dst, size_t sz)			\
+{									\
+	const uint8_t *tbl[d];						\
+	EC_COLS##d(EC_SRC, _)						\
+									\
+	for (int j = 0; j < d; j++)					\
+		tbl[j] = gf_mul_table[coef[j]];				\
+	for (size_t x = 0; x < sz; x++)					\
+		dst[x] = 0 EC_COLS##d(EC_DOT_TERM, _);			\
+}
+
+DEFINE_EC_KERNELS(2, 1)
+DEFINE_EC_KERNELS(4, 2)
+DEFINE_EC_KERNELS(8, 3)
+
+#define EC_KERNEL(d, p) { d, d + p, ec_encode_##d##_##p, ec_dot_##d##_##p }
+
+static const struct {
+	unsigned short d, dp;
+	fec_encode_fn encode;
+	fec_dot_fn dot;
+} ec_kernels[] = {
+	EC_KERNEL(2, 1),
+	EC_KERNEL(4, 2),
+	EC_KERNEL(8, 3),
+};
+
+static void fec_set_kernels(struct fec *code)
+{
+	code->encode = NULL;
+	code->dot = NULL;
+	for (int i = 0; i < ARRAY_SIZE(ec_kernels); i++)
+		if (ec_kernels[i].d == code->d &&
+		    ec_kernels[i].dp == code->dp) {
+			code->encode = ec_kernels[i].encode;
+			code->dot = ec_kernels[i].dot;
+			break;
+		}
+}
+
 void fec_free(struct fec *p)
 {
 	sd_assert(p != NULL && p->magic == (((FEC_MAGIC ^ p->d) ^ p->dp) ^
 					 (unsigned long) (p->enc_matrix)));
 	free(p->enc_matrix);
-	if (cpu_has_ssse3)
-		free(p->ec_tbl);
+	free(p->ec_tbl);
 	free(p);
 }
 
@@ -496,8 +600,9 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 	for (p = retval->enc_matrix, col = 0; col < d; col++, p += d + 1)
 		*p = 1;
 	free(tmp_m);
+	fec_set_kernels(retval);
 
-	if (cpu_has_ssse3) {
+	if (isa_encode_data) {
 		retval->ec_tbl = xmalloc(dp * d * 32);
 		ec_init_tables(d, dp - d, retval->enc_matrix + (d * d),
 			       retval->ec_tbl);
@@ -514,6 +619,18 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 #define STRIDE 8192
 #endif
 
+/* Return true if block_nums are all the parity strips of the code in order */
+static bool all_parity_strips(const struct fec *code, const int *block_nums,
+			      size_t num_block_nums)
+{
+	if (num_block_nums != code->dp - code->d)
+		return false;
+	for (size_t i = 0; i < num_block_nums; i++)
+		if (block_nums[i] != code->d + i)
+			return false;
+	return true;
+}
+
 void fec_encode(const struct fec *code,
 		const uint8_t *const *const src,
 		uint8_t *const *const fecs,
@@ -525,6 +642,13 @@ void fec_encode(const struct fec *code,
 	unsigned fecnum;
 	const uint8_t *p;
 
+	/* all the parity strips in order, as ec_encode_buffer() asks */
+	if (code->encode &&
+	    all_parity_strips(code, block_nums, num_block_nums)) {
+		code->encode(code, src, fecs, sz);
+		return;
+	}
+
 	for (d = 0; d < sz; d += STRIDE) {
 		size_t stride = ((sz-d) < STRIDE) ? (sz-d) : STRIDE;
 		for (i = 0; i < num_block_nums; i++) {
@@ -538,6 +662,22 @@ void fec_encode(const struct fec *code,
 	}
 }
 
+/*
+ * Add the change of nr data strips from idx, delta[], to the parity strips ps[]
+ *
+ * The code is linear, so the parity of the new data is the old parity plus
+ * the parity of the difference of the data strips.
+ */
+void ec_update_buffer(const struct fec *ctx, int idx, int nr,
+		      const uint8_t *delta[], uint8_t *ps[], size_t len)
+{
+	const uint8_t *m = ctx->enc_matrix + ctx->d * ctx->d;
+
+	for (int i = 0; i < ctx->dp - ctx->d; i++)
+		for (int j = 0; j < nr; j++)
+			addmul(ps[i], delta[j], m[i * ctx->d + idx + j], len);
+}
+
 /*
  * Build decode matrix into some memory space.
  *
@@ -696,47 +836,147 @@ out:
 	memcpy(output, dp[idx], strip_size);
 }
 
+/*
+ * Cache of the decode coefficients
+ *
+ * All the objects lose the same strips when a node is gone, so the
+ * coefficients which rebuild a lost strip from the input strips are computed
+ * once for each code, list of input strips and lost strip instead of inverting
+ * a decode matrix for every object or even every stripe of it.  The list of
+ * the input strips is the key rather than their bitmap because the
+ * coefficients follow the order of the inputs.
+ */
+#define EC_DECODE_CACHE_SIZE 128
+
+struct ec_decode_entry {
+	struct list_node lru;
+	unsigned short d, dp;
+	int idx;
+	uint8_t in_idx[SD_EC_MAX_STRIP];
+	uint8_t coef[SD_EC_MAX_STRIP];
+	unsigned char tbl[SD_EC_MAX_STRIP * 32];  /* for isa-l */
+};
+
+static LIST_HEAD(decode_lru);
+static int nr_decode_entries;
+static struct sd_mutex decode_lock = SD_MUTEX_INITIALIZER;
+
+static bool decode_entry_match(const struct ec_decode_entry *e,
+			       const struct fec *ctx, const int in_idx[],
+			       int idx)
+{
+	if (e->d != ctx->d || e->dp != ctx->dp || e->idx != idx)
+		return false;
+
+	for (int i = 0; i < ctx->d; i++)
+		if (e->in_idx[i] != in_idx[i])
+			return false;
+	return true;
+}
+
+static void build_decode_entry(struct fec *ctx, const int in_idx[], int idx,
+			       struct ec_decode_entry *e)
+{
+	int i, d = ctx->d;
+	uint8_t m[d * d];
+
+	for (i = 0; i < d; i++)
+		memcpy(m + i * d, ctx->enc_matrix + in_idx[i] * d, d);
+	_invert_mat(m, d);
+
+	if (idx < d)
+		memcpy(e->coef, m + idx * d, d);
+	else
+		_matmul(ctx->enc_matrix + idx * d, m, e->coef, 1, d, d);
+	ec_init_tables(d, 1, e->coef, e->tbl);
+
+	e->d = d;
+	e->dp = ctx->dp;
+	e->idx = idx;
+	for (i = 0; i < d; i++)
+		e->in_idx[i] = in_idx[i];
+}
+
+/* Get the coefficients of the strip idx over the strips in_idx */
+static void get_decode_coef(struct fec *ctx, const int in_idx[], int idx,
+			    uint8_t *coef, unsigned char *tbl)
+{
+	struct ec_decode_entry *e, *victim = NULL;
+
+	sd_mutex_lock(&decode_lock);
+	list_for_each_entry(e, &decode_lru, lru) {
+		if (decode_entry_match(e, ctx, in_idx, idx)) {
+			list_move(&e->lru, &decode_lru);
+			memcpy(coef, e->coef, ctx->d);
+			memcpy(tbl, e->tbl, ctx->d * 32);
+			sd_mutex_unlock(&decode_lock);
+			return;
+		}
+	}
+	sd_mutex_unlock(&decode_lock);
+
+	/* Racing threads might add the same entry, which just ages out */
+	e = xmalloc(sizeof(*e));
+	build_decode_entry(ctx, in_idx, idx, e);
+	memcpy(coef, e->coef, ctx->d);
+	memcpy(tbl, e->tbl, ctx->d * 32);
+
+	sd_mutex_lock(&decode_lock);
+	list_add(&e->lru, &decode_lru);
+	if (++nr_decode_entries > EC_DECODE_CACHE_SIZE) {
+		victim = list_entry(decode_lru.n.prev, struct ec_decode_entry,
+				    lru);
+		list_del(&victim->lru);
+		nr_decode_entries--;
+	}
+	sd_mutex_unlock(&decode_lock);
+	free(victim);
+}
+
+/*
+ * The code works byte by byte, so the lost strips of all the stripes are
+ * rebuilt at once from the coefficients of the lost strip.
+ */
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		      char *buf, int idx)
 {
-	int i, j, d = ctx->d;
-	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
+	int d = ctx->d;
+	size_t len = SD_DATA_OBJ_SIZE / d;
+	uint8_t coef[SD_EC_MAX_STRIP];
+	unsigned char tbl[SD_EC_MAX_STRIP * 32];
 
-	for (i = 0; i < SD_EC_NR_STRIPE_PER_OBJECT; i++) {
-		const uint8_t *in[d];
-		uint8_t out[strip_size];
+	get_decode_coef(ctx, in_idx, idx, coef, tbl);
 
-		for (j = 0; j < d; j++)
-			in[j] = input[j] + strip_size * i;
-		ec_decode(ctx, in, in_idx, out, idx);
-		memcpy(buf + strip_size * i, out, strip_size);
+	if (ctx->dot) {
+		ctx->dot(coef, input, (uint8_t *)buf, len);
+		return;
 	}
+
+	memset(buf, 0, len);
+	for (int j = 0; j < d; j++)
+		addmul((uint8_t *)buf, input[j], coef[j], len);
 }
 
 void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		       char *buf, int idx)
 {
-	int ed = ctx->d, edp = ctx->dp, len = SD_DATA_OBJ_SIZE / ed, i;
-	unsigned char ec_tbl[ed * edp * 32];
-	unsigned char bm[ed * ed];
-	unsigned char cm[ed];
-	unsigned char dm[ed * ed];
-	unsigned char em[ed * ed];
+	int ed = ctx->d, len = SD_DATA_OBJ_SIZE / ed;
+	uint8_t coef[SD_EC_MAX_STRIP];
+	unsigned char tbl[SD_EC_MAX_STRIP * 32];
 	unsigned char *lost[1];
 
-	for (i = 0; i < ed; i++)
-		memcpy(bm + (i * ed), ctx->enc_matrix + (in_idx[i] * ed), ed);
+	get_decode_coef(ctx, in_idx, idx, coef, tbl);
 
-	gf_invert_matrix(bm, dm, ed);
+	lost[0] = (unsigned char *)buf;
+	isa_encode_data(len, ed, 1, tbl, input, lost);
+}
 
-	if (idx < ed)
-		memcpy(cm, dm + (idx * ed), ed);
-	else {
-		memcpy(em, ctx->enc_matrix + (idx * ed), ed);
-		_matmul(em, dm, cm, 1, ed, ed);
-	}
+void ec_decode_partial(struct fec *ctx, const int in_idx[], int idx, int j,
+		       const uint8_t *input, uint8_t *buf, size_t len)
+{
+	uint8_t coef[SD_EC_MAX_STRIP];
+	unsigned char tbl[SD_EC_MAX_STRIP * 32];
 
-	lost[0] = (unsigned char *)buf;
-	ec_init_tables(ed, 1, cm, ec_tbl);
-	ec_encode_data_sse(len, ed, 1, ec_tbl, input, lost);
+	get_decode_coef(ctx, in_idx, idx, coef, tbl);
+	addmul(buf, input, coef[j], len);
 }
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * AVX2 and AVX-512 versions of ec_encode_data_sse()
+ *
+ * They take the same tables generated by ec_init_tables(), 32 bytes for each
+ * coefficient c: c * i for the low nibbles i and c * (i << 4) for the high
+ * nibbles.  The AVX2 and AVX-512BW kernels look the nibbles up with PSHUFB.
+ * The GFNI kernel multiplies a whole byte with one GF2P8AFFINEQB, whose 8x8
+ * bit matrix is derived from the same table since the multiplication by c is a
+ * linear map of GF(2)^8.
+ *
+ * Each pass computes up to EC_SIMD_ROWS outputs so that the sources are read
+ * once for every EC_SIMD_ROWS outputs.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "erasure_code.h"
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#if __GNUC__ >= 8 || __clang_major__ >= 7
+# define HAVE_AVX512_GFNI 1
+#endif
+
+#define EC_SIMD_ROWS 4
+/* a code over GF(2^8) has at most 255 sources */
+#define EC_GFNI_MAX_SRCS 256
+
+int ec_cpu_features(void)
+{
+	int features = 0;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		features |= EC_CPU_AVX2;
+#ifdef HAVE_AVX512_GFNI
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw")) {
+		features |= EC_CPU_AVX512;
+		if (__builtin_cpu_supports("gfni"))
+			features |= EC_CPU_GFNI;
+	}
+#endif
+	return features;
+}
+
+static inline unsigned char tbl_mul(const unsigned char *tbl, unsigned char x)
+{
+	return tbl[x & 0x0f] ^ tbl[16 + (x >> 4)];
+}
+
+/* The bytes which don't fill a vector */
+static void dot_prod_tail(int pos, int len, int k, int rows,
+			  const unsigned char *g_tbls, unsigned char **src,
+			  unsigned char **dest)
+{
+	for (int r = 0; r < rows; r++) {
+		for (int i = pos; i < len; i++) {
+			unsigned char s = 0;
+
+			for (int j = 0; j < k; j++)
+				s ^= tbl_mul(g_tbls + 32 * (r * k + j),
+					     src[j][i]);
+			dest[r][i] = s;
+		}
+	}
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void dot_prod_avx2(int len, int k, int rows, const unsigned char *g_tbls,
+		   unsigned char **src, unsigned char **dest)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	int pos;
+
+	for (pos = 0; pos + 32 <= len; pos += 32) {
+		__m256i p[EC_SIMD_ROWS];
+
+		for (int r = 0; r < rows; r++)
+			p[r] = _mm256_setzero_si256();
+
+		for (int j = 0; j < k; j++) {
+			__m256i x = _mm256_loadu_si256((__m256i *)(src[j] +
+								   pos));
+			__m256i lo = _mm256_and_si256(x, mask);
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi64(x, 4),
+						      mask);
+
+			for (int r = 0; r < rows; r++) {
+				const unsigned char *t =
+					g_tbls + 32 * (r * k + j);
+				__m256i tlo = _mm256_broadcastsi128_si256(
+					_mm_loadu_si128((__m128i *)t));
+				__m256i thi = _mm256_broadcastsi128_si256(
+					_mm_loadu_si128((__m128i *)(t + 16)));
+
+				p[r] = _mm256_xor_si256(p[r],
+					_mm256_xor_si256(
+						_mm256_shuffle_epi8(tlo, lo),
+						_mm256_shuffle_epi8(thi, hi)));
+			}
+		}
+
+		for (int r = 0; r < rows; r++)
+			_mm256_storeu_si256((__m256i *)(dest[r] + pos), p[r]);
+	}
+
+	if (pos < len)
+		dot_prod_tail(pos, len, k, rows, g_tbls, src, dest);
+}
+
+/* Instantiate the kernel for each number of rows to keep p[] in registers */
+#define DEFINE_ROWS_DISPATCH(name, kernel, attr)			\
+static attr void name(int len, int k, int rows,				\
+		      const unsigned char *g_tbls,			\
+		      unsigned char **src, unsigned char **dest)	\
+{									\
+	switch (rows) {							\
+	case 4:								\
+		kernel(len, k, 4, g_tbls, src, dest);			\
+		break;							\
+	case 3:								\
+		kernel(len, k, 3, g_tbls, src, dest);			\
+		break;							\
+	case 2:								\
+		kernel(len, k, 2, g_tbls, src, dest);			\
+		break;							\
+	case 1:								\
+		kernel(len, k, 1, g_tbls, src, dest);			\
+		break;							\
+	}								\
+}
+
+DEFINE_ROWS_DISPATCH(nvect_dot_prod_avx2, dot_prod_avx2,
+		     __attribute__((target("avx2"))))
+
+#ifdef HAVE_AVX512_GFNI
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw")))
+__mmask64 tail_mask(int n)
+{
+	return n >= 64 ? ~0ULL : (1ULL << n) - 1;
+}
+
+static inline __attribute__((always_inline, target("avx512f,avx512bw")))
+void dot_prod_avx512(int len, int k, int rows, const unsigned char *g_tbls,
+		     unsigned char **src, unsigned char **dest)
+{
+	const __m512i mask = _mm512_set1_epi8(0x0f);
+
+	for (int pos = 0; pos < len; pos += 64) {
+		__mmask64 m = tail_mask(len - pos);
+		__m512i p[EC_SIMD_ROWS];
+
+		for (int r = 0; r < rows; r++)
+			p[r] = _mm512_setzero_si512();
+
+		for (int j = 0; j < k; j++) {
+			__m512i x = _mm512_maskz_loadu_epi8(m, src[j] + pos);
+			__m512i lo = _mm512_and_si512(x, mask);
+			__m512i hi = _mm512_and_si512(_mm512_srli_epi64(x, 4),
+						      mask);
+
+			for (int r = 0; r < rows; r++) {
+				const unsigned char *t =
+					g_tbls + 32 * (r * k + j);
+				__m512i tlo = _mm512_broadcast_i32x4(
+					_mm_loadu_si128((__m128i *)t));
+				__m512i thi = _mm512_broadcast_i32x4(
+					_mm_loadu_si128((__m128i *)(t + 16)));
+
+				p[r] = _mm512_ternarylogic_epi64(p[r],
+					_mm512_shuffle_epi8(tlo, lo),
+					_mm512_shuffle_epi8(thi, hi), 0x96);
+			}
+		}
+
+		for (int r = 0; r < rows; r++)
+			_mm512_mask_storeu_epi8(dest[r] + pos, m, p[r]);
+	}
+}
+
+DEFINE_ROWS_DISPATCH(nvect_dot_prod_avx512, dot_prod_avx512,
+		     __attribute__((target("avx512f,avx512bw"))))
+
+/*
+ * Build the matrix of GF2P8AFFINEQB for the multiplication by c from its
+ * table.  Bit i of the product comes from row i, which is stored in byte
+ * 7 - i and has bit b set if bit i of c * (1 << b) is set.
+ */
+static uint64_t tbl_to_affine(const unsigned char *tbl)
+{
+	unsigned char prod[8];
+	uint64_t matrix = 0;
+
+	for (int b = 0; b < 4; b++) {
+		prod[b] = tbl[1 << b];
+		prod[b + 4] = tbl[16 + (1 << b)];
+	}
+
+	for (int i = 0; i < 8; i++) {
+		uint64_t row = 0;
+
+		for (int b = 0; b < 8; b++)
+			row |= (uint64_t)((prod[b] >> i) & 1) << b;
+		matrix |= row << (8 * (7 - i));
+	}
+	return matrix;
+}
+
+/* g_tbls points to the matrices built by tbl_to_affine() */
+static inline
+__attribute__((always_inline, target("avx512f,avx512bw,gfni")))
+void dot_prod_gfni(int len, int k, int rows, const unsigned char *g_tbls,
+		   unsigned char **src, unsigned char **dest)
+{
+	const uint64_t *matrix = (const uint64_t *)g_tbls;
+
+	for (int pos = 0; pos < len; pos += 64) {
+		__mmask64 m = tail_mask(len - pos);
+		__m512i p[EC_SIMD_ROWS];
+
+		for (int r = 0; r < rows; r++)
+			p[r] = _mm512_setzero_si512();
+
+		for (int j = 0; j < k; j++) {
+			__m512i x = _mm512_maskz_loadu_epi8(m, src[j] + pos);
+
+			for (int r = 0; r < rows; r++)
+				p[r] = _mm512_xor_si512(p[r],
+					_mm512_gf2p8affine_epi64_epi8(x,
+						_mm512_set1_epi64(
+							matrix[r * k + j]),
+						0));
+		}
+
+		for (int r = 0; r < rows; r++)
+			_mm512_mask_storeu_epi8(dest[r] + pos, m, p[r]);
+	}
+}
+
+DEFINE_ROWS_DISPATCH(nvect_dot_prod_gfni, dot_prod_gfni,
+		     __attribute__((target("avx512f,avx512bw,gfni"))))
+
+#endif /* HAVE_AVX512_GFNI */
+
+typedef void (*nvect_dot_prod_fn)(int, int, int, const unsigned char *,
+				  unsigned char **, unsigned char **);
+
+static void encode_rows(nvect_dot_prod_fn fn, int len, int k, int rows,
+			unsigned char *g_tbls, unsigned char **data,
+			unsigned char **coding)
+{
+	while (rows > 0) {
+		int n = rows < EC_SIMD_ROWS ? rows : EC_SIMD_ROWS;
+
+		fn(len, k, n, g_tbls, data, coding);
+		g_tbls += n * k * 32;
+		coding += n;
+		rows -= n;
+	}
+}
+
+void ec_encode_data_avx2(int len, int k, int rows, unsigned char *g_tbls,
+			 unsigned char **data, unsigned char **coding)
+{
+	encode_rows(nvect_dot_prod_avx2, len, k, rows, g_tbls, data, coding);
+}
+
+void ec_encode_data_avx512(int len, int k, int rows, unsigned char *g_tbls,
+			   unsigned char **data, unsigned char **coding)
+{
+#ifdef HAVE_AVX512_GFNI
+	encode_rows(nvect_dot_prod_avx512, len, k, rows, g_tbls, data, coding);
+#else
+	ec_encode_data_avx2(len, k, rows, g_tbls, data, coding);
+#endif
+}
+
+void ec_encode_data_avx512_gfni(int len, int k, int rows,
+				unsigned char *g_tbls, unsigned char **data,
+				unsigned char **coding)
+{
+#ifdef HAVE_AVX512_GFNI
+	uint64_t matrix[EC_SIMD_ROWS * EC_GFNI_MAX_SRCS];
+
+	if (k > EC_GFNI_MAX_SRCS) {
+		ec_encode_data_avx512(len, k, rows, g_tbls, data, coding);
+		return;
+	}
+
+	while (rows > 0) {
+		int n = rows < EC_SIMD_ROWS ? rows : EC_SIMD_ROWS;
+
+		for (int i = 0; i < n * k; i++)
+			matrix[i] = tbl_to_affine(g_tbls + 32 * i);
+		nvect_dot_prod_gfni(len, k, n, (unsigned char *)matrix, data,
+				    coding);
+		g_tbls += n * k * 32;
+		coding += n;
+		rows -= n;
+	}
+#else
+	ec_encode_data_avx2(len, k, rows, g_tbls, data, coding);
+#endif
+}
+
+#else /* __x86_64__ */
+
+int ec_cpu_features(void)
+{
+	return 0;
+}
+
+#endif /* __x86_64__ */
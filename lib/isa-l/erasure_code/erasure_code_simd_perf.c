@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Encode throughput of the SSE, AVX2, AVX-512 and GFNI versions for the
+ * 32x28 code of erasure_code_sse_perf and the largest sheepdog policy, 16:15.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erasure_code.h"
+#include "test.h"
+
+//#define CACHED_TEST
+#ifdef CACHED_TEST
+// Cached test, loop many times over small dataset
+# define TEST_LEN(m)  ((256*1024 / m) & ~(64-1))
+# define TEST_LOOPS(m)   (4000*m)
+# define TEST_TYPE_STR "_warm"
+#else
+// Uncached test.  Pull from large mem base.
+# define GT_L3_CACHE  32*1024*1024  /* some number > last level cache */
+# define TEST_LEN(m)  ((GT_L3_CACHE / m) & ~(64-1))
+# define TEST_LOOPS(m)   (10*m)
+# define TEST_TYPE_STR "_cold"
+#endif
+
+#define TEST_SOURCES 32
+
+typedef unsigned char u8;
+typedef void (*encode_fn)(int, int, int, u8 *, u8 **, u8 **);
+
+static const struct {
+	const char *name;
+	encode_fn fn;
+	int features;
+} variants[] = {
+	{ "sse", ec_encode_data_sse, 0 },
+	{ "avx2", ec_encode_data_avx2, EC_CPU_AVX2 },
+	{ "avx512", ec_encode_data_avx512, EC_CPU_AVX512 },
+	{ "avx512_gfni", ec_encode_data_avx512_gfni,
+	  EC_CPU_AVX512 | EC_CPU_GFNI },
+};
+
+static u8 *buffs[TEST_SOURCES];
+static u8 a[TEST_SOURCES * TEST_SOURCES], g_tbls[TEST_SOURCES * TEST_SOURCES * 32];
+
+static void encode_perf(const char *name, encode_fn fn, int m, int k)
+{
+	struct perf start, stop;
+	int rtest;
+
+	gf_gen_rs_matrix(a, m, k);
+	ec_init_tables(k, m - k, &a[k * k], g_tbls);
+
+	perf_start(&start);
+	for (rtest = 0; rtest < TEST_LOOPS(m); rtest++)
+		fn(TEST_LEN(m), k, m - k, g_tbls, buffs, &buffs[k]);
+	perf_stop(&stop);
+
+	printf("erasure_code_%s_encode_%dx%d" TEST_TYPE_STR ": ", name, m, k);
+	perf_print(stop, start, (long long)(TEST_LEN(m)) * (m) * rtest);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int codes[][2] = { { 32, 28 }, { 31, 16 } };
+	int features = ec_cpu_features(), i, j, v;
+	void *buf;
+
+	printf("erasure_code_simd_perf: %dx%d\n", TEST_SOURCES,
+	       TEST_LEN(TEST_SOURCES));
+
+	for (i = 0; i < TEST_SOURCES; i++) {
+		/* the largest TEST_LEN(m) of the codes */
+		if (posix_memalign(&buf, 64, TEST_LEN(31))) {
+			printf("alloc error: Fail");
+			return -1;
+		}
+		buffs[i] = buf;
+		for (j = 0; j < TEST_LEN(31); j++)
+			buffs[i][j] = rand();
+	}
+
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++)
+		for (v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+			if ((features & variants[v].features) !=
+			    variants[v].features) {
+				printf("erasure_code_%s_encode: not supported\n",
+				       variants[v].name);
+				continue;
+			}
+			encode_perf(variants[v].name, variants[v].fn,
+				    codes[i][0], codes[i][1]);
+		}
+
+	printf("done all: Pass\n");
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Check ec_encode_data_avx2/avx512/avx512_gfni() against the base version,
+ * for the shapes of the erasure codes used by sheepdog and random ones, with
+ * unaligned buffers and lengths which don't fill a vector.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "erasure_code.h"
+#include "types.h"
+
+#define TEST_LEN 8192
+#define TEST_SOURCES 32
+#define RANDOMS 200
+
+typedef unsigned char u8;
+typedef void (*encode_fn)(int, int, int, u8 *, u8 **, u8 **);
+
+static const struct {
+	const char *name;
+	encode_fn fn;
+	int features;
+} variants[] = {
+	{ "avx2", ec_encode_data_avx2, EC_CPU_AVX2 },
+	{ "avx512", ec_encode_data_avx512, EC_CPU_AVX512 },
+	{ "avx512_gfni", ec_encode_data_avx512_gfni,
+	  EC_CPU_AVX512 | EC_CPU_GFNI },
+};
+
+static u8 *buffs[TEST_SOURCES], *ref[TEST_SOURCES], *out[TEST_SOURCES];
+static u8 a[TEST_SOURCES * TEST_SOURCES], g_tbls[TEST_SOURCES * TEST_SOURCES * 32];
+
+/* Encode rows outputs from k sources of len bytes at offset off */
+static int check_encode(encode_fn fn, int k, int rows, int len, int off)
+{
+	u8 *src[TEST_SOURCES], *dst[TEST_SOURCES];
+	int i;
+
+	for (i = 0; i < k * rows; i++)
+		a[i] = rand();
+	ec_init_tables(k, rows, a, g_tbls);
+
+	for (i = 0; i < k; i++)
+		src[i] = buffs[i] + off;
+	for (i = 0; i < rows; i++) {
+		dst[i] = out[i] + off;
+		memset(out[i], 0x5a, TEST_LEN + 64);
+	}
+
+	ec_encode_data_base(len, k, rows, g_tbls, src, ref);
+	fn(len, k, rows, g_tbls, src, dst);
+
+	for (i = 0; i < rows; i++) {
+		if (memcmp(ref[i], dst[i], len)) {
+			printf("Fail k=%d rows=%d len=%d off=%d\n", k, rows,
+			       len, off);
+			return -1;
+		}
+		/* nothing is written beyond the vectors */
+		if (out[i][off + len] != 0x5a) {
+			printf("Overrun k=%d rows=%d len=%d off=%d\n", k,
+			       rows, len, off);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Encode with an RS matrix, lose rows of the sources and recover them */
+static int check_recover(encode_fn fn, int m, int k)
+{
+	u8 enc[TEST_SOURCES * TEST_SOURCES], b[TEST_SOURCES * TEST_SOURCES];
+	u8 d[TEST_SOURCES * TEST_SOURCES], c[TEST_SOURCES * TEST_SOURCES];
+	u8 *recov[TEST_SOURCES], *lost[TEST_SOURCES];
+	int i, j, r, nerrs = m - k;
+
+	gf_gen_rs_matrix(enc, m, k);
+	ec_init_tables(k, m - k, &enc[k * k], g_tbls);
+	fn(TEST_LEN, k, m - k, g_tbls, buffs, &buffs[k]);
+
+	/* the first nerrs sources are lost */
+	for (i = 0, r = nerrs; i < k; i++, r++) {
+		for (j = 0; j < k; j++)
+			b[k * i + j] = enc[k * r + j];
+		recov[i] = buffs[r];
+	}
+	if (gf_invert_matrix(b, d, k) < 0) {
+		printf("BAD MATRIX\n");
+		return -1;
+	}
+	for (i = 0; i < nerrs; i++) {
+		for (j = 0; j < k; j++)
+			c[k * i + j] = d[k * i + j];
+		lost[i] = out[i];
+	}
+
+	ec_init_tables(k, nerrs, c, g_tbls);
+	fn(TEST_LEN, k, nerrs, g_tbls, recov, lost);
+	for (i = 0; i < nerrs; i++) {
+		if (memcmp(lost[i], buffs[i], TEST_LEN)) {
+			printf("Fail to recover m=%d k=%d\n", m, k);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	/* data and parity strips of the sheepdog policies */
+	static const int shapes[][2] = {
+		{ 2, 1 }, { 2, 2 }, { 4, 1 }, { 4, 2 }, { 4, 3 }, { 8, 2 },
+		{ 8, 4 }, { 8, 6 }, { 16, 4 }, { 16, 8 }, { 16, 15 },
+	};
+	int features = ec_cpu_features(), i, v, rtest;
+	void *buf;
+
+	printf("erasure_code_simd_test: %dx%d ", TEST_SOURCES, TEST_LEN);
+
+	for (i = 0; i < TEST_SOURCES; i++) {
+		if (posix_memalign(&buf, 64, TEST_LEN + 64)) {
+			printf("alloc error: Fail");
+			return -1;
+		}
+		buffs[i] = buf;
+		if (posix_memalign(&buf, 64, TEST_LEN + 64)) {
+			printf("alloc error: Fail");
+			return -1;
+		}
+		out[i] = buf;
+		ref[i] = malloc(TEST_LEN);
+		if (!ref[i]) {
+			printf("alloc error: Fail");
+			return -1;
+		}
+	}
+	for (i = 0; i < TEST_SOURCES; i++)
+		for (int j = 0; j < TEST_LEN + 64; j++)
+			buffs[i][j] = rand();
+
+	for (v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+		encode_fn fn = variants[v].fn;
+
+		if ((features & variants[v].features) !=
+		    variants[v].features) {
+			printf("\n%s: not supported, skip", variants[v].name);
+			continue;
+		}
+		printf("\n%s: ", variants[v].name);
+
+		for (i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+			int k = shapes[i][0], p = shapes[i][1];
+
+			/* a stripe, a 4 KB write and an object chunk */
+			if (check_encode(fn, k, p, 512 / k, 0) ||
+			    check_encode(fn, k, p, 4096 / k, 0) ||
+			    check_encode(fn, k, p, TEST_LEN, 0) ||
+			    check_recover(fn, k + p, k))
+				return -1;
+			putchar('.');
+		}
+
+		for (rtest = 0; rtest < RANDOMS; rtest++) {
+			int k = 1 + rand() % (TEST_SOURCES / 2);
+			int rows = 1 + rand() % (TEST_SOURCES / 2);
+			int len = rand() % TEST_LEN, off = rand() % 64;
+
+			if (check_encode(fn, k, rows, len, off))
+				return -1;
+			if (rtest % 32 == 0)
+				putchar('.');
+		}
+	}
+
+	printf(" done EC SIMD tests: Pass\n");
+	return 0;
+}
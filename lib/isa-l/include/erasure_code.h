@@ -95,6 +95,32 @@ void ec_init_tables(int k, int rows, unsigned char* a, unsigned char* gftbls);
 
 void ec_encode_data_sse(int len, int k, int rows, unsigned char *gftbls, unsigned char **data, unsigned char **coding);
 
+/**
+ * @brief Generate or decode erasure codes on blocks of data with AVX2 or
+ * AVX-512.
+ *
+ * The same as ec_encode_data_sse() with the same tables.  The GFNI version
+ * multiplies with GF2P8AFFINEQB instead of the nibble table lookups.  Callers
+ * check ec_cpu_features() before calling them.
+ *
+ * @requires AVX2, AVX512F and AVX512BW, plus GFNI for the GFNI version
+ */
+
+void ec_encode_data_avx2(int len, int k, int rows, unsigned char *gftbls, unsigned char **data, unsigned char **coding);
+void ec_encode_data_avx512(int len, int k, int rows, unsigned char *gftbls, unsigned char **data, unsigned char **coding);
+void ec_encode_data_avx512_gfni(int len, int k, int rows, unsigned char *gftbls, unsigned char **data, unsigned char **coding);
+
+#define EC_CPU_AVX2	0x1
+#define EC_CPU_AVX512	0x2	/* AVX512F and AVX512BW */
+#define EC_CPU_GFNI	0x4	/* GFNI along with EC_CPU_AVX512 */
+
+/**
+ * @brief Return the EC_CPU_* flags of the instruction sets which the CPU and
+ * the OS support.
+ */
+
+int ec_cpu_features(void);
+
 
 /**
  * @brief Generate or decode erasure codes on blocks of data, runs appropriate version.
@@ -72,6 +72,27 @@ union semun {
 	struct seminfo *__buf;
 };
 
+/*
+ * Each thread stages its messages in a ring of its own, which it claims at
+ * its first message and gives back at its exit, and the logger process drains
+ * the rings and sorts the messages by time, so the threads neither take the
+ * semaphore nor contend with each other.  A ring has a single producer, the
+ * thread, and a single consumer, the logger, which only share the head and
+ * the tail, so the staging is a copy of the message and a store.  The shared
+ * area behind the semaphore takes the messages of the threads without a ring
+ * and the ones which don't fit into it.
+ */
+#define LOG_NR_RINGS 32
+#define LOG_RING_WRAP 0 /* the length of the end of a ring */
+#define LOG_FLUSH_INTERVAL 100000 /* us, so the rings don't fill up */
+
+struct log_ring {
+	pid_t owner; /* 0 if free */
+	uint64_t head; /* consumed by the logger */
+	uint64_t tail; /* produced by the owner */
+	char buf[0];
+};
+
 struct logarea {
 	bool active;
 	char *tail;
@@ -80,6 +101,8 @@ struct logarea {
 	int semid;
 	union semun semarg;
 	int fd;
+	char *rings;
+	size_t ring_size;
 };
 
 #define FUNC_NAME_SIZE 32 /* according to C89, including '\0' */
@@ -109,6 +132,8 @@ static struct log_format *format;
 static int log_fd = -1;
 static __thread const char *worker_name;
 static __thread int worker_idx;
+static __thread struct log_ring *log_ring;
+static pthread_key_t log_ring_key;
 static struct logarea *la;
 static const char *log_name;
 static char *log_nowname;
@@ -327,6 +352,29 @@ static int logarea_init(int size)
 	la->end = la->start + size;
 	la->tail = la->start;
 
+	la->ring_size = round_down(size / 16, sizeof(uint64_t));
+	shmid = shmget(IPC_PRIVATE, LOG_NR_RINGS * (sizeof(struct log_ring) +
+						   la->ring_size),
+		       0644 | IPC_CREAT | IPC_EXCL);
+	if (shmid == -1) {
+		syslog(LOG_ERR, "shmget rings failed: %m");
+		shmdt(la->start);
+		shmdt(la);
+		return 1;
+	}
+
+	la->rings = shmat(shmid, NULL, 0);
+	if (la->rings == (void *)-1) {
+		syslog(LOG_ERR, "shmat rings failed: %m");
+		shmdt(la->start);
+		shmdt(la);
+		return 1;
+	}
+	memset(la->rings, 0, LOG_NR_RINGS * (sizeof(struct log_ring) +
+					     la->ring_size));
+
+	shmctl(shmid, IPC_RMID, NULL);
+
 	la->semid = semget(IPC_PRIVATE, 1, 0666 | IPC_CREAT);
 	if (la->semid < 0) {
 		syslog(LOG_ERR, "semget failed: %m");
@@ -351,10 +399,97 @@ static void free_logarea(void)
 	if (log_fd >= 0)
 		close(log_fd);
 	semctl(la->semid, 0, IPC_RMID, la->semarg);
+	shmdt(la->rings);
 	shmdt(la->start);
 	shmdt(la);
 }
 
+static inline struct log_ring *get_ring(int i)
+{
+	return (struct log_ring *)(la->rings +
+				   i * (sizeof(struct log_ring) +
+					la->ring_size));
+}
+
+static void put_log_ring(void *ring)
+{
+	uatomic_set((pid_t *)ring, 0);
+}
+
+/* Return the ring of the thread, or NULL if all the rings are taken */
+static struct log_ring *claim_log_ring(void)
+{
+	pid_t tid;
+
+	if (log_ring)
+		return log_ring;
+
+	tid = gettid();
+	for (int i = 0; i < LOG_NR_RINGS; i++) {
+		struct log_ring *ring = get_ring(i);
+
+		if (uatomic_read(&ring->owner) ||
+		    uatomic_cmpxchg(&ring->owner, 0, tid) != 0)
+			continue;
+		log_ring = ring;
+		pthread_setspecific(log_ring_key, ring);
+		break;
+	}
+	return log_ring;
+}
+
+/* Stage the message in the ring, or return false if it doesn't fit */
+static bool log_ring_push(struct log_ring *ring, const struct logmsg *msg)
+{
+	uint32_t len = round_up(sizeof(uint64_t) + sizeof(*msg) +
+				msg->str_len + 1, sizeof(uint64_t));
+	uint64_t tail = ring->tail, head = uatomic_read(&ring->head);
+	size_t off = tail % la->ring_size, end = la->ring_size - off;
+	uint64_t need = len > end ? end + len : len;
+	char *p = ring->buf + off;
+
+	if (tail + need - head > la->ring_size)
+		return false;
+
+	if (len > end) {
+		*(uint32_t *)p = LOG_RING_WRAP;
+		tail += end;
+		p = ring->buf;
+	}
+	*(uint32_t *)p = len;
+	memcpy(p + sizeof(uint64_t), msg, sizeof(*msg) + msg->str_len + 1);
+	/* the message is there before the logger sees the tail */
+	cmm_smp_wmb();
+	uatomic_set(&ring->tail, tail + len);
+	return true;
+}
+
+/* Copy the messages of the ring to the buffer */
+static size_t log_ring_drain(struct log_ring *ring, char *buf)
+{
+	uint64_t head = ring->head, tail = uatomic_read(&ring->tail);
+	size_t done = 0;
+
+	cmm_smp_rmb();
+	while (head < tail) {
+		size_t off = head % la->ring_size;
+		uint32_t len = *(uint32_t *)(ring->buf + off);
+
+		if (len == LOG_RING_WRAP) {
+			head += la->ring_size - off;
+			continue;
+		}
+		memcpy(buf + done, ring->buf + off + sizeof(uint64_t),
+		       len - sizeof(uint64_t));
+		done += len - sizeof(uint64_t);
+		head += len;
+	}
+	/* the messages are copied before the owner reuses the space */
+	cmm_smp_mb();
+	uatomic_set(&ring->head, head);
+	return done;
+}
+
 /* this one can block under memory pressure */
 static void log_syslog(const struct logmsg *msg)
 {
@@ -409,8 +544,16 @@ static void dolog(int prio, const char *func, int line,
 	msg->str_len = min(len, MAX_MSG_SIZE - 1);
 
 	if (la) {
+		struct log_ring *ring = claim_log_ring();
 		struct sembuf ops;
 
+		if (ring) {
+			init_logmsg(msg, &tv, prio, func, line);
+			if (log_ring_push(ring, msg))
+				return;
+		}
+		len = msg->str_len;
+
 		ops.sem_num = 0;
 		ops.sem_flg = SEM_UNDO;
 		ops.sem_op = -1;
@@ -420,7 +563,8 @@ static void dolog(int prio, const char *func, int line,
 		}
 
 		/* not enough space: drop msg */
-		if (len + sizeof(struct logmsg) + 1 > la->end - la->tail)
+		if (round_up(len + sizeof(struct logmsg) + 1,
+			     sizeof(uint64_t)) > la->end - la->tail)
 			syslog(LOG_ERR, "enqueue: log area overrun, "
 			       "dropping message\n");
 		else {
@@ -429,7 +573,9 @@ static void dolog(int prio, const char *func, int line,
 			init_logmsg(msg, &tv, prio, func, line);
 			memcpy(msg->str, str, len + 1);
 			msg->str_len = len;
-			la->tail += sizeof(struct logmsg) + len + 1;
+			/* aligned as the messages of the rings */
+			la->tail += round_up(sizeof(struct logmsg) + len + 1,
+					     sizeof(uint64_t));
 		}
 
 		ops.sem_op = 1;
@@ -490,39 +636,63 @@ void log_write(int prio, const char *func, int line, const char *fmt, ...)
 	va_end(ap);
 }
 
+static int logmsg_cmp(const struct logmsg **a, const struct logmsg **b)
+{
+	int ret = intcmp((*a)->tv.tv_sec, (*b)->tv.tv_sec);
+
+	if (ret)
+		return ret;
+	ret = intcmp((*a)->tv.tv_usec, (*b)->tv.tv_usec);
+	/* keep the order of the messages of the same time */
+	return ret ?: intcmp((uintptr_t)*a, (uintptr_t)*b);
+}
+
 static void log_flush(void)
 {
+	static const struct logmsg **msgs;
+	static size_t nr_alloc;
 	struct sembuf ops;
-	size_t size, done = 0;
+	size_t size = 0, done = 0, nr = 0;
 	const struct logmsg *msg;
 
-	if (la->tail == la->start)
-		return;
-
-	ops.sem_num = 0;
-	ops.sem_flg = SEM_UNDO;
-	ops.sem_op = -1;
-	if (xsemop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "xsemop up failed: %m");
-		exit(1);
-	}
+	if (la->tail != la->start) {
+		ops.sem_num = 0;
+		ops.sem_flg = SEM_UNDO;
+		ops.sem_op = -1;
+		if (xsemop(la->semid, &ops, 1) < 0) {
+			syslog(LOG_ERR, "xsemop up failed: %m");
+			exit(1);
+		}
 
-	size = la->tail - la->start;
-	memcpy(log_buff, la->start, size);
-	memset(la->start, 0, size);
-	la->tail = la->start;
+		size = la->tail - la->start;
+		memcpy(log_buff, la->start, size);
+		memset(la->start, 0, size);
+		la->tail = la->start;
 
-	ops.sem_op = 1;
-	if (xsemop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "xsemop down failed: %m");
-		exit(1);
+		ops.sem_op = 1;
+		if (xsemop(la->semid, &ops, 1) < 0) {
+			syslog(LOG_ERR, "xsemop down failed: %m");
+			exit(1);
+		}
 	}
 
+	for (int i = 0; i < LOG_NR_RINGS; i++)
+		size += log_ring_drain(get_ring(i), log_buff + size);
+
 	while (done < size) {
 		msg = (const struct logmsg *)(log_buff + done);
-		log_syslog(msg);
-		done += sizeof(*msg) + msg->str_len + 1;
+		if (nr == nr_alloc) {
+			nr_alloc = nr_alloc ? nr_alloc * 2 : 1024;
+			msgs = xrealloc(msgs, nr_alloc * sizeof(*msgs));
+		}
+		msgs[nr++] = msg;
+		done += round_up(sizeof(*msg) + msg->str_len + 1,
+				 sizeof(uint64_t));
 	}
+
+	xqsort(msgs, nr, logmsg_cmp);
+	for (size_t i = 0; i < nr; i++)
+		log_syslog(msgs[i]);
 }
 
 static bool is_sheep_dead(int signo)
@@ -560,7 +730,8 @@ static void logger(char *log_dir, char *outfile)
 {
 	int fd;
 
-	log_buff = xzalloc(la->end - la->start);
+	log_buff = xzalloc(la->end - la->start +
+			   LOG_NR_RINGS * la->ring_size);
 
 	if (dst_type == LOG_DST_DEFAULT) {
 		log_fd = open(outfile, O_CREAT | O_RDWR | O_APPEND, 0644);
@@ -621,7 +792,7 @@ static void logger(char *log_dir, char *outfile)
 			/* My parent (sheep process) is dead. */
 			break;
 
-		sleep(1);
+		usleep(LOG_FLUSH_INTERVAL);
 	}
 
 	log_flush();
@@ -679,6 +850,8 @@ int log_init(const char *program_name, enum log_dst_type type, int level,
 			syslog(LOG_ERR, "failed to initialize the logger\n");
 			return 1;
 		}
+		/* give the ring of a thread back at its exit */
+		pthread_key_create(&log_ring_key, put_log_ring);
 
 		/*
 		 * Store the pid of the sheep process for use by the death
@@ -799,23 +972,14 @@ static int dump_stack_frames(void)
 	return gdb_cmd("thread apply all where full");
 }
 
-__attribute__ ((__noinline__))
-void sd_backtrace(void)
+/* Log the functions of the code addresses, with the lines if possible */
+void sd_print_addrs(void *const *addrs, int n)
 {
-	void *addrs[SD_MAX_STACK_DEPTH];
-	int i, n = backtrace(addrs, ARRAY_SIZE(addrs));
-
-	for (i = 1; i < n; i++) { /* addrs[0] is here, so skip it */
+	for (int i = 0; i < n; i++) {
 		void *addr = addrs[i];
 		char cmd[SD_ARG_MAX], info[256], **str;
 		FILE *f;
 
-		/*
-		 * The called function is at the previous address
-		 * because addr contains a return address
-		 */
-		addr = (void *)((char *)addr - 1);
-
 		/* try to get a line number with addr2line if possible */
 		snprintf(cmd, sizeof(cmd), "addr2line -s -e %s -f -i %p | "
 			 "perl -e '@a=<>; chomp @a; print \"$a[1]: $a[0]\"'",
@@ -844,6 +1008,22 @@ fallback:
 		sd_emerg("%s", *str);
 		free(str);
 	}
+}
+
+__attribute__ ((__noinline__))
+void sd_backtrace(void)
+{
+	void *addrs[SD_MAX_STACK_DEPTH];
+	int i, n = backtrace(addrs, ARRAY_SIZE(addrs));
+
+	/*
+	 * The called function is at the previous address because addr
+	 * contains a return address
+	 */
+	for (i = 1; i < n; i++)
+		addrs[i] = (char *)addrs[i] - 1;
+	/* addrs[0] is here, so skip it */
+	sd_print_addrs(addrs + 1, n - 1);
 
 	/* dump the stack frames if possible*/
 	dump_stack_frames();
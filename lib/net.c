@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <linux/errqueue.h>
 
 #include "sheepdog_proto.h"
 #include "sheep.h"
@@ -33,6 +34,10 @@
 #include "event.h"
 #include "net.h"
 
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0
+#endif
+
 int conn_tx_off(struct connection *conn)
 {
 	conn->events &= ~EPOLLOUT;
@@ -261,14 +266,19 @@ static void forward_iov(struct msghdr *msg, int len)
 
 static int do_write(int sockfd, struct msghdr *msg, int len,
 		    bool (*need_retry)(uint32_t), uint32_t epoch,
-		    uint32_t max_count)
+		    uint32_t max_count, int flags)
 {
 	int ret, repeat = max_count;
 rewrite:
-	ret = sendmsg(sockfd, msg, 0);
+	ret = sendmsg(sockfd, msg, flags);
 	if (ret < 0) {
 		if (errno == EINTR)
 			goto rewrite;
+		/* Out of the memory for the notifications, copy the data */
+		if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+			flags &= ~MSG_ZEROCOPY;
+			goto rewrite;
+		}
 		/*
 		 * Since we set timeout for write, we'll get EAGAIN even for
 		 * blocking sockfd.
@@ -315,7 +325,7 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	}
 
 	ret = do_write(sockfd, &msg, sizeof(*hdr) + wlen, need_retry, epoch,
-		       max_count);
+		       max_count, 0);
 	if (ret) {
 		sd_err("failed to send request %x, %d: %m", hdr->opcode, wlen);
 		ret = -1;
@@ -324,12 +334,199 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	return ret;
 }
 
+/*
+ * Send the iovecs of several requests at once, e.g. the requests queued on a
+ * connection, in as few sendmsg() as the socket buffer allows
+ */
+int send_reqs(int sockfd, struct iovec *iov, int nr_iov,
+	      bool (*need_retry)(uint32_t epoch), uint32_t epoch,
+	      uint32_t max_count)
+{
+	struct msghdr msg;
+	int len = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nr_iov;
+	for (int i = 0; i < nr_iov; i++)
+		len += iov[i].iov_len;
+
+	if (do_write(sockfd, &msg, len, need_retry, epoch, max_count, 0)) {
+		sd_err("failed to send %d bytes of requests: %m", len);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Same as send_req() but the data is sent with MSG_ZEROCOPY, i.e. the kernel
+ * transmits the user pages directly.  The socket must have SO_ZEROCOPY set
+ * and the data must not be modified until the peer replies.  The header is
+ * copied as usual because the callers reuse it.
+ */
+int send_req_zerocopy(int sockfd, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool (*need_retry)(uint32_t epoch),
+		      uint32_t epoch, uint32_t max_count)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(*hdr);
+	ret = do_write(sockfd, &msg, sizeof(*hdr), need_retry, epoch,
+		       max_count, wlen ? MSG_MORE : 0);
+	if (ret || !wlen)
+		goto out;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_base = data;
+	iov.iov_len = wlen;
+	ret = do_write(sockfd, &msg, wlen, need_retry, epoch, max_count,
+		       MSG_ZEROCOPY);
+out:
+	if (ret) {
+		sd_err("failed to send request %x, %d: %m", hdr->opcode, wlen);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Consume the completion notifications of MSG_ZEROCOPY in the error queue,
+ * which make poll() report POLLERR.  Return true if the socket has no other
+ * error.
+ */
+bool reap_zerocopy(int fd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	while (true) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				return false;
+		}
+	}
+	if (errno != EAGAIN)
+		return false;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+		return false;
+
+	return true;
+}
+
+/*
+ * Read a response and up to len bytes of its data into buf
+ *
+ * The header and the data are read by the same recvmsg(), so a small response
+ * costs one system call.  The peer sends nothing else on the socket before the
+ * next request, so reading ahead of the header never takes the bytes of
+ * another response.
+ */
+int do_read_rsp(int sockfd, struct sd_rsp *rsp, void *buf, uint32_t len,
+		bool (*need_retry)(uint32_t epoch), uint32_t epoch,
+		uint32_t max_count)
+{
+	size_t done = 0, total = sizeof(*rsp) + len;
+	int ret, repeat = max_count;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	while (done < total) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		if (done < sizeof(*rsp)) {
+			iov[0].iov_base = (char *)rsp + done;
+			iov[0].iov_len = sizeof(*rsp) - done;
+			iov[1].iov_base = buf;
+			iov[1].iov_len = len;
+			msg.msg_iovlen = len ? 2 : 1;
+		} else {
+			iov[0].iov_base = (char *)buf + done - sizeof(*rsp);
+			iov[0].iov_len = total - done;
+			msg.msg_iovlen = 1;
+		}
+
+		ret = recvmsg(sockfd, &msg, 0);
+		if (ret == 0) {
+			sd_debug("connection is closed (%zu bytes left)",
+				 total - done);
+			return 1;
+		}
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* see do_read() */
+			if (errno == EAGAIN && repeat &&
+			    (need_retry == NULL || need_retry(epoch))) {
+				repeat--;
+				continue;
+			}
+			sd_err("failed to read from socket: %d, %m", ret);
+			return 1;
+		}
+
+		if (done < sizeof(*rsp) && done + ret >= sizeof(*rsp)) {
+			/* the header tells how much data follows */
+			if (len > rsp->data_length)
+				len = rsp->data_length;
+			total = sizeof(*rsp) + len;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+/* Send wlen bytes of wdata and read up to rlen bytes of the reply to rdata */
+int exec_req_rw(int sockfd, struct sd_req *hdr, void *wdata, unsigned int wlen,
+		void *rdata, unsigned int rlen,
+		bool (*need_retry)(uint32_t epoch), uint32_t epoch,
+		uint32_t max_count)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	int ret;
+
+	if (send_req(sockfd, hdr, wdata, wlen, need_retry, epoch, max_count))
+		return 1;
+
+	ret = do_read_rsp(sockfd, rsp, rdata, rlen, need_retry, epoch,
+			  max_count);
+	if (ret) {
+		sd_err("failed to read a response");
+		return 1;
+	}
+
+	return 0;
+}
+
 int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	     bool (*need_retry)(uint32_t epoch), uint32_t epoch,
 	     uint32_t max_count)
 {
-	int ret;
-	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
 	unsigned int wlen, rlen;
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
@@ -343,27 +540,8 @@ int exec_req(int sockfd, struct sd_req *hdr, void *data,
 		rlen = hdr->data_length;
 	}
 
-	if (send_req(sockfd, hdr, data, wlen, need_retry, epoch, max_count))
-		return 1;
-
-	ret = do_read(sockfd, rsp, sizeof(*rsp), need_retry, epoch, max_count);
-	if (ret) {
-		sd_err("failed to read a response");
-		return 1;
-	}
-
-	if (rlen > rsp->data_length)
-		rlen = rsp->data_length;
-
-	if (rlen) {
-		ret = do_read(sockfd, data, rlen, need_retry, epoch, max_count);
-		if (ret) {
-			sd_err("failed to read the response data");
-			return 1;
-		}
-	}
-
-	return 0;
+	return exec_req_rw(sockfd, hdr, data, wlen, data, rlen, need_retry,
+			   epoch, max_count);
 }
 
 const char *addr_to_str(const uint8_t *addr, uint16_t port)
@@ -462,6 +640,48 @@ int set_nodelay(int fd)
 	return ret;
 }
 
+int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		sd_err("failed to set O_NONBLOCK, %m");
+		return -1;
+	}
+	return 0;
+}
+
+int set_zerocopy(int fd)
+{
+#ifdef SO_ZEROCOPY
+	int opt = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt));
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* Mark the packets of the connection with the DSCP class for the network */
+int set_dscp(int fd, int dscp)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	int tos = dscp << 2;
+
+	if (getsockname(fd, (struct sockaddr *)&ss, &len) < 0)
+		return -1;
+	/* IP_TOS covers the IPv4 mapped peers of an IPv6 socket too */
+	if (ss.ss_family == AF_INET6 &&
+	    setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos)) < 0)
+		return -1;
+	if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0 &&
+	    ss.ss_family != AF_INET6)
+		return -1;
+	return 0;
+}
+
 /*
  * Timeout after request is issued after 5s.
  *
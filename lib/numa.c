@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NUMA topology read from sysfs
+ *
+ * We only need to know the CPUs of each node and the nodes the disks and the
+ * NICs are attached to, so don't depend on libnuma for it.
+ */
+
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "numa.h"
+#include "util.h"
+
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+static int nr_nodes;
+static int cpu_nodes[CPU_SETSIZE];
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+
+static int read_sysfs_int(const char *path, int *val)
+{
+	FILE *fp = fopen(path, "r");
+	int ret;
+
+	if (!fp)
+		return -1;
+	ret = fscanf(fp, "%d", val) == 1 ? 0 : -1;
+	fclose(fp);
+	return ret;
+}
+
+/* Parse a cpu list like "0-7,16-23" */
+static int parse_cpulist(const char *path, int node)
+{
+	char buf[4096], *p;
+	FILE *fp = fopen(path, "r");
+	long start, end;
+
+	if (!fp)
+		return -1;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if (!p)
+		return -1;
+
+	while (*p && *p != '\n') {
+		start = end = strtol(p, &p, 10);
+		if (*p == '-')
+			end = strtol(p + 1, &p, 10);
+		if (start < 0 || end >= CPU_SETSIZE)
+			return -1;
+
+		for (long cpu = start; cpu <= end; cpu++) {
+			CPU_SET(cpu, &node_cpus[node]);
+			cpu_nodes[cpu] = node;
+		}
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+/* Return the number of NUMA nodes, or 0 if the topology is unknown */
+int init_numa_topology(void)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+	int node;
+
+	for (int i = 0; i < CPU_SETSIZE; i++)
+		cpu_nodes[i] = -1;
+
+	dir = opendir(SYSFS_NODE_DIR);
+	if (!dir)
+		return 0;
+
+	while ((d = readdir(dir))) {
+		if (sscanf(d->d_name, "node%d", &node) != 1 || node < 0 ||
+		    node >= MAX_NUMA_NODES)
+			continue;
+
+		snprintf(path, sizeof(path), SYSFS_NODE_DIR"/%s/cpulist",
+			 d->d_name);
+		CPU_ZERO(&node_cpus[node]);
+		if (parse_cpulist(path, node) < 0) {
+			sd_debug("failed to parse %s", path);
+			continue;
+		}
+		if (CPU_COUNT(&node_cpus[node]))
+			nr_nodes++;
+	}
+	closedir(dir);
+
+	if (nr_nodes > 1)
+		sd_debug("found %d NUMA nodes", nr_nodes);
+	return nr_nodes;
+}
+
+int nr_numa_nodes(void)
+{
+	return nr_nodes;
+}
+
+/* Return the node of the CPU, or -1 if unknown */
+int cpu_to_numa_node(int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return -1;
+	return cpu_nodes[cpu];
+}
+
+/* Walk up the sysfs device path until we find the node of the device */
+static int sysfs_dev_to_numa_node(const char *dev, const char *stop)
+{
+	char path[PATH_MAX], file[PATH_MAX + 16], *p;
+	int node;
+
+	if (!realpath(dev, path))
+		return -1;
+
+	while ((p = strrchr(path, '/')) && strcmp(path, stop)) {
+		snprintf(file, sizeof(file), "%s/numa_node", path);
+		if (read_sysfs_int(file, &node) == 0)
+			return node < MAX_NUMA_NODES ? node : -1;
+		*p = '\0';
+	}
+
+	return -1;
+}
+
+/* Return the node of the block device backing the path, or -1 if unknown */
+int path_to_numa_node(const char *path)
+{
+	char dev[64];
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	snprintf(dev, sizeof(dev), "/sys/dev/block/%u:%u", major(st.st_dev),
+		 minor(st.st_dev));
+	return sysfs_dev_to_numa_node(dev, "/sys/devices");
+}
+
+/* Return the node of the NIC which has the address, or -1 if unknown */
+int addr_to_numa_node(const uint8_t *addr)
+{
+	static const uint8_t v4_prefix[12];
+	struct ifaddrs *ifaddr, *ifa;
+	char dev[PATH_MAX];
+	int node = -1;
+
+	if (getifaddrs(&ifaddr) < 0)
+		return -1;
+
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		const void *a;
+		bool match;
+
+		if (!ifa->ifa_addr)
+			continue;
+
+		switch (ifa->ifa_addr->sa_family) {
+		case AF_INET:
+			a = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+			match = !memcmp(addr, v4_prefix, sizeof(v4_prefix)) &&
+				!memcmp(addr + 12, a, 4);
+			break;
+		case AF_INET6:
+			a = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+			match = !memcmp(addr, a, 16);
+			break;
+		default:
+			continue;
+		}
+		if (!match)
+			continue;
+
+		snprintf(dev, sizeof(dev), "/sys/class/net/%s/device",
+			 ifa->ifa_name);
+		node = sysfs_dev_to_numa_node(dev, "/sys/devices");
+		break;
+	}
+	freeifaddrs(ifaddr);
+
+	return node;
+}
+
+/* Let the calling thread run only on the CPUs of the node */
+int bind_to_numa_node(int node)
+{
+	int ret;
+
+	if (node < 0 || node >= MAX_NUMA_NODES || !CPU_COUNT(&node_cpus[node]))
+		return -1;
+
+	ret = sched_setaffinity(0, sizeof(cpu_set_t), &node_cpus[node]);
+	if (ret < 0)
+		sd_debug("failed to bind to node %d, %m", node);
+	return ret;
+}
@@ -106,6 +106,7 @@ struct find_path {
 	struct sd_indirect_idx *p_indirect_idx;
 	struct sd_index *p_index;
 	struct sd_index_header *p_index_header;
+	struct bnode *node; /* of p_index_header */
 	int depth;
 };
 
@@ -116,6 +117,247 @@ struct sd_inode_actor {
 
 static struct sd_inode_actor inode_actor;
 
+/*
+ * Cache of the ext-nodes (B-tree), 'bnode' for short.
+ *
+ * The nodes are kept in an rb-tree by oid and in an LRU list, and the lookups
+ * return the cached buffer itself, pinned by a reference, so a hit costs no
+ * copy.  sd_inode_set_vid_range() changes the nodes in place and marks them
+ * dirty, and writes them out at the end of the transaction, which is protected
+ * by the distributed lock.
+ *
+ * The nodes are kept across the transactions only up to the number set by
+ * sd_inode_cache_init(), 0 by default: another gateway might change them in
+ * the meantime, so only a user which owns the vdis for its lifetime should
+ * keep them.  Otherwise the cache lives for one transaction, like a write
+ * buffer, and the lookups of sd_inode_get_vid() read the nodes afresh.
+ */
+
+/* the nodes a transaction might hold at once */
+#define BNODE_CACHE_MIN 4
+
+struct bnode {
+	struct rb_node rb;
+	struct list_node lru;
+	uint64_t oid;
+	int refcnt;
+	bool cached; /* false for the private copies */
+	bool dirty;
+	int copies, copy_policy;
+	struct sd_index_header *mem;
+};
+
+static struct rb_root bnode_root = RB_ROOT;
+static LIST_HEAD(bnode_lru); /* the least recently used first */
+static size_t bnode_cache_max;
+static struct sd_mutex bnode_lock = SD_MUTEX_INITIALIZER;
+
+static int bnode_cmp(const struct bnode *a, const struct bnode *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static void bnode_writeout(struct bnode *node)
+{
+	int ret;
+
+	ret = inode_actor.writer(node->oid, node->mem, SD_INODE_DATA_INDEX_SIZE,
+				 0, 0, node->copies, node->copy_policy, false,
+				 false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to write %"PRIx64, node->oid);
+}
+
+static void bnode_free(struct bnode *node)
+{
+	free(node->mem);
+	free(node);
+}
+
+/*
+ * Drop the least recently used nodes which are neither pinned nor dirty, until
+ * at most max are cached.  The dirty nodes belong to the transaction of their
+ * vdi, which might look them up again, and are written out by its
+ * bnode_flush().  Called with bnode_lock held, the nodes are moved to the list
+ * evicted to be freed without it.
+ */
+static void bnode_shrink(size_t max, struct list_head *evicted)
+{
+	struct bnode *node;
+
+	list_for_each_entry(node, &bnode_lru, lru) {
+		if (bnode_root.nr <= max)
+			break;
+		if (node->refcnt || node->dirty)
+			continue;
+		rb_erase(&node->rb, &bnode_root);
+		list_move_tail(&node->lru, evicted);
+	}
+}
+
+static void bnode_release(struct list_head *evicted)
+{
+	struct bnode *node;
+
+	list_for_each_entry(node, evicted, lru) {
+		list_del(&node->lru);
+		bnode_free(node);
+	}
+}
+
+static struct bnode *bnode_read(uint64_t oid)
+{
+	struct bnode *node;
+	void *mem;
+	int ret;
+
+	node = xzalloc(sizeof(*node));
+	node->oid = oid;
+	node->refcnt = 1;
+	node->mem = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+	mem = node->mem;
+	ret = inode_actor.reader(oid, &mem, SD_INODE_DATA_INDEX_SIZE, 0);
+	if (ret != SD_RES_SUCCESS) {
+		bnode_free(node);
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Get the node of oid, pinned.  If cache is false, return a private copy read
+ * afresh, which the transaction of another thread can't change under us.
+ * Return NULL if the node can't be read.
+ */
+static struct bnode *bnode_get(uint64_t oid, bool cache)
+{
+	struct bnode key = { .oid = oid }, *node, *found;
+	LIST_HEAD(evicted);
+
+	if (!cache)
+		return bnode_read(oid);
+
+	sd_mutex_lock(&bnode_lock);
+	node = rb_search(&bnode_root, &key, rb, bnode_cmp);
+	if (node) {
+		node->refcnt++;
+		list_move_tail(&node->lru, &bnode_lru);
+		sd_mutex_unlock(&bnode_lock);
+		return node;
+	}
+	sd_mutex_unlock(&bnode_lock);
+
+	node = bnode_read(oid);
+	if (!node)
+		return NULL;
+
+	sd_mutex_lock(&bnode_lock);
+	found = rb_insert(&bnode_root, node, rb, bnode_cmp);
+	if (found) {
+		/* read by another thread meanwhile */
+		found->refcnt++;
+		list_move_tail(&found->lru, &bnode_lru);
+		sd_mutex_unlock(&bnode_lock);
+		bnode_free(node);
+		return found;
+	}
+	node->cached = true;
+	list_add_tail(&node->lru, &bnode_lru);
+	bnode_shrink(max(bnode_cache_max, (size_t)BNODE_CACHE_MIN), &evicted);
+	sd_mutex_unlock(&bnode_lock);
+
+	bnode_release(&evicted);
+	return node;
+}
+
+static void bnode_put(struct bnode *node)
+{
+	if (!node->cached) {
+		bnode_free(node);
+		return;
+	}
+
+	sd_mutex_lock(&bnode_lock);
+	node->refcnt--;
+	sd_mutex_unlock(&bnode_lock);
+}
+
+/*
+ * Write out the dirty nodes of the vdi, and drop the nodes over
+ * bnode_cache_max.  The nodes of the other vdis might be in the middle of
+ * their transactions.
+ */
+static void bnode_flush(uint32_t vid)
+{
+	struct bnode *node, **dirty;
+	LIST_HEAD(evicted);
+	int nr = 0;
+
+	sd_mutex_lock(&bnode_lock);
+	dirty = xcalloc(bnode_root.nr + 1, sizeof(*dirty));
+	list_for_each_entry(node, &bnode_lru, lru) {
+		if (!node->dirty || oid_to_vid(node->oid) != vid)
+			continue;
+		node->dirty = false;
+		node->refcnt++;
+		dirty[nr++] = node;
+	}
+	sd_mutex_unlock(&bnode_lock);
+
+	for (int i = 0; i < nr; i++) {
+		bnode_writeout(dirty[i]);
+		bnode_put(dirty[i]);
+	}
+	free(dirty);
+
+	sd_mutex_lock(&bnode_lock);
+	bnode_shrink(bnode_cache_max, &evicted);
+	sd_mutex_unlock(&bnode_lock);
+	bnode_release(&evicted);
+}
+
+/*
+ * The writer of the transactions: the writes to the cached nodes, which are
+ * made in place or which fit the node, mark them dirty instead.
+ */
+static int bnode_writer(uint64_t id, void *mem, unsigned int len,
+			uint64_t offset, uint32_t flags, int copies,
+			int copy_policy, bool create, bool direct)
+{
+	struct bnode key = { .oid = id }, *node;
+
+	if (create || direct || offset + len > SD_INODE_DATA_INDEX_SIZE)
+		goto out;
+
+	sd_mutex_lock(&bnode_lock);
+	node = rb_search(&bnode_root, &key, rb, bnode_cmp);
+	if (node) {
+		if ((char *)mem != (char *)node->mem + offset)
+			memcpy((char *)node->mem + offset, mem, len);
+		node->dirty = true;
+		node->copies = copies;
+		node->copy_policy = copy_policy;
+		sd_mutex_unlock(&bnode_lock);
+		return SD_RES_SUCCESS;
+	}
+	sd_mutex_unlock(&bnode_lock);
+out:
+	return inode_actor.writer(id, mem, len, offset, flags, copies,
+				  copy_policy, create, direct);
+}
+
+/* Keep up to nr_nodes ext-nodes cached across the calls, 0 by default */
+void sd_inode_cache_init(size_t nr_nodes)
+{
+	LIST_HEAD(evicted);
+
+	sd_mutex_lock(&bnode_lock);
+	bnode_cache_max = nr_nodes;
+	bnode_shrink(bnode_cache_max, &evicted);
+	sd_mutex_unlock(&bnode_lock);
+	bnode_release(&evicted);
+}
+
 static int index_compare(struct sd_index *a, struct sd_index *b)
 {
 	return intcmp(a->idx, b->idx);
@@ -140,11 +382,10 @@ static void traverse_btree(const struct sd_inode *inode, btree_cb_fn fn,
 			   void *arg, int interest)
 {
 	struct sd_index_header *header = INDEX_HEADER(inode->data_vdi_id);
-	struct sd_index_header *leaf_node = NULL;
+	struct sd_index_header *leaf_node;
 	struct sd_index *last, *iter;
 	struct sd_indirect_idx *last_idx, *iter_idx;
-	void *tmp;
-	int ret;
+	struct bnode *node;
 
 	if (interest & BTREE_HEAD)
 		fn(header, arg, BTREE_HEAD);
@@ -160,17 +401,15 @@ static void traverse_btree(const struct sd_inode *inode, btree_cb_fn fn,
 	} else if (header->depth == 2) {
 		last_idx = LAST_INDRECT_IDX(inode->data_vdi_id);
 		iter_idx = FIRST_INDIRECT_IDX(inode->data_vdi_id);
-		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-		tmp = (void *)leaf_node;
 
 		while (iter_idx != last_idx) {
-			ret = inode_actor.reader(iter_idx->oid, &tmp,
-						 SD_INODE_DATA_INDEX_SIZE, 0);
-			if (ret != SD_RES_SUCCESS) {
+			node = bnode_get(iter_idx->oid, bnode_cache_max > 0);
+			if (!node) {
 				sd_err("failed to read %"PRIx64, iter_idx->oid);
 				iter_idx++;
 				continue;
 			}
+			leaf_node = node->mem;
 
 			if (interest & BTREE_INDIRECT_IDX)
 				fn(iter_idx, arg, BTREE_INDIRECT_IDX);
@@ -183,10 +422,9 @@ static void traverse_btree(const struct sd_inode *inode, btree_cb_fn fn,
 					fn(iter, arg, BTREE_INDEX);
 					iter++;
 				}
+			bnode_put(node);
 			iter_idx++;
 		}
-
-		free(leaf_node);
 	} else
 		panic("This B-tree not support depth %u", header->depth);
 }
@@ -234,99 +472,6 @@ static void dump_btree(struct sd_inode *inode)
 #endif
 }
 
-/*
- * This is the cache for inode and ext-node (B-tree), so we name it 'icache'.
- * Cache of the same inode and ext-node dose not support concurrent operations
- * so it could only be used in sd_inode_set_vid() which will be protected by
- * distributed lock and should be released in the end of sd_inode_set_vid().
- */
-
-/* no rationale */
-#define NUMBER_OF_CACHE	4
-
-struct inode_cache {
-	uint64_t oid;
-	unsigned char mem[SD_INODE_DATA_INDEX_SIZE];
-} cache_array[NUMBER_OF_CACHE];
-static int cache_idx;
-
-static void icache_writeout(int copies, int policy)
-{
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		inode_actor.writer(cache_array[i].oid, cache_array[i].mem,
-				   SD_INODE_DATA_INDEX_SIZE, 0, 0, copies,
-				   policy, false, false);
-	}
-}
-
-static void icache_release(int copies, int policy)
-{
-	icache_writeout(copies, policy);
-	cache_idx = 0; /* reset icache */
-}
-
-static void icache_insert(int copies, int policy,
-			  uint64_t oid, void *mem)
-{
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		if (oid == cache_array[i].oid) {
-			memcpy(cache_array[i].mem, mem,
-			       SD_INODE_DATA_INDEX_SIZE);
-			return;
-		}
-	}
-
-	if (cache_idx == (NUMBER_OF_CACHE - 1)) {
-		sd_debug("cache for B-tree is full, so write all out");
-		icache_release(copies, policy);
-	}
-
-	/* insert new cache */
-	cache_array[cache_idx].oid = oid;
-	memcpy(cache_array[cache_idx].mem, mem, SD_INODE_DATA_INDEX_SIZE);
-	cache_idx++;
-}
-
-static void *icache_find(uint64_t oid)
-{
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		if (cache_array[i].oid == oid)
-			return cache_array[i].mem;
-	}
-	return NULL;
-}
-
-static int icache_writer(uint64_t id, void *mem, unsigned int len,
-			 uint64_t offset, uint32_t flags, int copies,
-			 int copy_policy, bool create, bool direct)
-{
-	/* Only try to cache entire ext-node */
-	if (!offset && !create && !direct && len == SD_INODE_DATA_INDEX_SIZE) {
-		icache_insert(copies, copy_policy, id, mem);
-		return SD_RES_SUCCESS;
-	}
-	return inode_actor.writer(id, mem, len, offset, flags, copies,
-				  copy_policy, create, direct);
-}
-
-static int icache_reader(uint64_t id, void **mem, unsigned int len,
-			 uint64_t offset)
-{
-	void *data;
-
-	if (!offset && len == SD_INODE_DATA_INDEX_SIZE) {
-		data = icache_find(id);
-		if (data) {
-			memcpy(*mem, data, len);
-			return SD_RES_SUCCESS;
-		}
-	}
-	return inode_actor.reader(id, mem, len, offset);
-}
-
 void sd_inode_init(void *data, int depth)
 {
 	struct sd_index_header *header = INDEX_HEADER(data);
@@ -469,15 +614,25 @@ static void transfer_to_idx_root(write_node_fn writer, struct sd_inode *inode)
 	free(right);
 }
 
+static void release_path(struct find_path *path)
+{
+	if (path->node)
+		bnode_put(path->node);
+	path->node = NULL;
+	path->p_index_header = NULL;
+}
+
 /*
  * Search whole btree for 'idx'.
  * Return available position (could insert new sd_index) if can't find 'idx'.
+ * The leaf-node found is cached if cache is true, and pinned until
+ * release_path().
  */
-static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
-			      uint32_t idx, struct find_path *path)
+static int search_whole_btree(const struct sd_inode *inode, uint32_t idx,
+			      struct find_path *path, bool cache)
 {
 	struct sd_index_header *header, *leaf_node;
-	void *tmp;
+	struct bnode *node;
 	uint64_t oid;
 	int ret = SD_RES_NOT_FOUND;
 
@@ -487,18 +642,19 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 	if (header->depth == 2) {
 		path->depth = 2;
 		path->p_indirect_idx = search_indirect_entry(header, idx);
-		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
-		tmp = (void *)leaf_node;
 
 		if (indirect_in_range(header, path->p_indirect_idx)) {
 			oid = path->p_indirect_idx->oid;
-			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
-			if (ret != SD_RES_SUCCESS) {
+			node = bnode_get(oid, cache);
+			if (!node) {
 				sd_err("read oid %"PRIu64" fail", oid);
+				ret = SD_RES_EIO;
 				goto out;
 			}
+			leaf_node = node->mem;
 			path->p_index = search_index_entry(leaf_node, idx);
 			path->p_index_header = leaf_node;
+			path->node = node;
 			if (index_in_range(leaf_node, path->p_index) &&
 			    path->p_index->idx == idx)
 				ret = SD_RES_SUCCESS;
@@ -507,19 +663,22 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 		} else {
 			/* check if last ext-node has space */
 			oid = (path->p_indirect_idx - 1)->oid;
-			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
-			if (ret != SD_RES_SUCCESS) {
+			node = bnode_get(oid, cache);
+			if (!node) {
 				sd_err("read oid %"PRIu64" fail", oid);
+				ret = SD_RES_EIO;
 				goto out;
 			}
+			leaf_node = node->mem;
 			if (leaf_node->entries < MAX_INDEX) {
 				path->p_index = search_index_entry(leaf_node,
 								 idx);
 				path->p_index_header = leaf_node;
+				path->node = node;
 			} else {
 				sd_debug("last ext-node is full (oid: %"
 					 PRIx64")", oid);
-				free(leaf_node);
+				bnode_put(node);
 			}
 			ret = SD_RES_NOT_FOUND;
 		}
@@ -539,6 +698,7 @@ out:
 uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 {
 	struct find_path path;
+	uint32_t vid = 0;
 	int ret;
 
 	if (inode->store_policy == 0)
@@ -549,14 +709,14 @@ uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 			return 0;
 
 		memset(&path, 0, sizeof(path));
-		ret = search_whole_btree(inode_actor.reader, inode, idx, &path);
+		ret = search_whole_btree(inode, idx, &path,
+					 bnode_cache_max > 0);
 		if (ret == SD_RES_SUCCESS)
-			return path.p_index->vdi_id;
-		if (path.p_index_header)
-			free(path.p_index_header);
+			vid = path.p_index->vdi_id;
+		release_path(&path);
 	}
 
-	return 0;
+	return vid;
 }
 
 /*
@@ -591,9 +751,9 @@ static void split_index_node(write_node_fn writer, struct sd_inode *inode,
  * Add new 'idx' and 'vdi_id' pair into leaf-node if depth equal 1 and
  * add new leaf-node if there is no room for new 'idx' and 'vdi_id' pair.
  */
-static int insert_new_node(write_node_fn writer, read_node_fn reader,
-			   struct sd_inode *inode, struct find_path *path,
-			   uint32_t idx, uint32_t vdi_id)
+static int insert_new_node(write_node_fn writer, struct sd_inode *inode,
+			   struct find_path *path, uint32_t idx,
+			   uint32_t vdi_id)
 {
 	struct sd_index_header *header = INDEX_HEADER(inode->data_vdi_id);
 	struct sd_index_header *leaf_node = NULL;
@@ -658,19 +818,16 @@ out:
 	return ret;
 }
 
-static void set_vid_for_btree(write_node_fn writer, read_node_fn reader,
-			      struct sd_inode *inode, uint32_t idx,
-			      uint32_t vdi_id)
+static void set_vid_for_btree(write_node_fn writer, struct sd_inode *inode,
+			      uint32_t idx, uint32_t vdi_id)
 {
 	struct find_path path;
 	uint64_t offset;
 	int ret;
 
-	path.p_index_header = NULL;
-
 	while (1) {
 		memset(&path, 0, sizeof(path));
-		ret = search_whole_btree(reader, inode, idx, &path);
+		ret = search_whole_btree(inode, idx, &path, true);
 		if (ret == SD_RES_SUCCESS) {
 			path.p_index->vdi_id = vdi_id;
 			/*
@@ -687,11 +844,10 @@ static void set_vid_for_btree(write_node_fn writer, read_node_fn reader,
 			       inode->copy_policy, false, false);
 			goto out;
 		} else if (ret == SD_RES_NOT_FOUND) {
-			ret = insert_new_node(writer, reader, inode,
-					      &path, idx, vdi_id);
+			ret = insert_new_node(writer, inode, &path, idx,
+					      vdi_id);
 			if (SD_RES_AGAIN == ret) {
-				if (path.p_index_header)
-					free(path.p_index_header);
+				release_path(&path);
 				continue;
 			} else
 				goto out;
@@ -699,8 +855,7 @@ static void set_vid_for_btree(write_node_fn writer, read_node_fn reader,
 			panic("ret: %d", ret);
 	}
 out:
-	if (path.p_index_header)
-		free(path.p_index_header);
+	release_path(&path);
 }
 
 int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
@@ -720,18 +875,16 @@ int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
 				panic("%s() B-tree in inode is corrupt!",
 				      __func__);
 			/*
-			 * use icache(write buffer) to accelerate batch set
-			 * operation. icache will be released after this
+			 * the changed nodes are written out after this
 			 * transaction to assure consistency.
 			 */
-			set_vid_for_btree(icache_writer, icache_reader, inode,
-					  idx, vdi_id);
+			set_vid_for_btree(bnode_writer, inode, idx, vdi_id);
 		}
 	}
 	if (inode->store_policy != 0)
 		dump_btree(inode);
 
-	icache_release(inode->nr_copies, inode->copy_policy);
+	bnode_flush(inode->vdi_id);
 	/* XXX: return error code */
 	return 0;
 }
@@ -801,6 +954,43 @@ out:
 	return ret;
 }
 
+/*
+ * Write out the part of the B-tree root which setting idx might have changed.
+ * A leaf root shifts the entries after the one of idx on an insertion, so only
+ * them and the sd_index_header are written, the header last so that a reader
+ * never counts entries which aren't there.  An idx root, and the btree_counter
+ * of its new nodes, is small enough to be written as a whole.
+ */
+static int write_root_delta(struct sd_inode *inode, uint32_t idx, int flags,
+			    bool create)
+{
+	struct sd_index_header *header = INDEX_HEADER(inode->data_vdi_id);
+	uint64_t oid = vid_to_vdi_oid(inode->vdi_id);
+	struct sd_index *ext;
+	uint64_t offset;
+	int ret;
+
+	if (create || header->depth != 1)
+		return sd_inode_write(inode, flags, create, false);
+
+	ext = search_index_entry(header, idx);
+	offset = (char *)ext - (char *)inode;
+	if (ext != LAST_INDEX(header)) {
+		ret = inode_actor.writer(oid, ext,
+					 (char *)LAST_INDEX(header) -
+					 (char *)ext, offset, flags,
+					 inode->nr_copies, inode->copy_policy,
+					 create, false);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return inode_actor.writer(oid, header, sizeof(*header),
+				  SD_INODE_HEADER_SIZE, flags,
+				  inode->nr_copies, inode->copy_policy,
+				  create, false);
+}
+
 /* Write the meta-data of inode out */
 int sd_inode_write_vid(struct sd_inode *inode,
 		       uint32_t idx, uint32_t vid, uint32_t value,
@@ -815,16 +1005,46 @@ int sd_inode_write_vid(struct sd_inode *inode,
 					 flags, inode->nr_copies,
 					 inode->copy_policy,
 					 create, direct);
-	else {
-		/*
-		 * For btree type sd_inode, we only have to write all
-		 * meta-data of sd_inode out.
-		 */
-		ret = sd_inode_write(inode, flags, create, direct);
-	}
+	else
+		ret = write_root_delta(inode, idx, flags, create);
 	return ret;
 }
 
+/*
+ * Read the inode in oid up to size bytes, fetching only the header and the
+ * part of data_vdi_id in use instead of the whole object.  The rest up to size
+ * is zeroed.
+ */
+int sd_inode_read(uint64_t oid, struct sd_inode *inode, size_t size)
+{
+	struct sd_index_header *header = INDEX_HEADER(inode->data_vdi_id);
+	void *mem = inode;
+	uint32_t len = 0;
+	int ret;
+
+	/* for B-tree inode, we also need sd_index_header */
+	ret = inode_actor.reader(oid, &mem,
+				 min(size, SD_INODE_HEADER_SIZE +
+				     sizeof(struct sd_index_header)), 0);
+	if (ret != SD_RES_SUCCESS || size <= SD_INODE_HEADER_SIZE)
+		return ret;
+
+	/* the B-tree of a hyper volume holds no entry yet */
+	if (inode->store_policy == 0 || header->magic == INODE_BTREE_MAGIC)
+		len = min(sd_inode_get_meta_size(inode, size),
+			  (uint32_t)(size - SD_INODE_HEADER_SIZE));
+	if (len) {
+		mem = inode->data_vdi_id;
+		ret = inode_actor.reader(oid, &mem, len, SD_INODE_HEADER_SIZE);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	memset((char *)inode->data_vdi_id + len, 0,
+	       size - SD_INODE_HEADER_SIZE - len);
+	return SD_RES_SUCCESS;
+}
+
 void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 			uint32_t *data_vdi_id, uint8_t store_policy,
 			uint8_t nr_copies, uint8_t copy_policy,
@@ -961,3 +1181,189 @@ int sd_inode_actor_init(write_node_fn writer, read_node_fn reader)
 	inode_actor.reader = reader;
 	return 0;
 }
+
+/*
+ * Compact inode
+ *
+ * struct sd_inode takes 12 MB for data_vdi_id[] and gref[], most of which a
+ * user holding many vdis open never reads.  struct sd_cinode keeps the header
+ * and the pages of data_vdi_id[] looked up, which are read on demand, and
+ * doesn't keep the pages of zeros.  gref[] is not kept at all.
+ *
+ * The index of an inode with store_policy is the B-tree, whose root is read
+ * as a whole into a zeroed buffer of the header and data_vdi_id[], so that the
+ * pages beyond the root are never touched, and looked up as usual.
+ */
+
+#define CINODE_PAGE_SHIFT	10
+#define CINODE_PAGE_ENTRIES	(1U << CINODE_PAGE_SHIFT)
+#define CINODE_PAGE_SIZE	(CINODE_PAGE_ENTRIES * sizeof(uint32_t))
+#define CINODE_NR_PAGES		(SD_INODE_DATA_INDEX >> CINODE_PAGE_SHIFT)
+
+struct sd_cinode {
+	struct sd_rw_lock lock;
+	/* the header, followed by data_vdi_id[] for the B-tree */
+	struct sd_inode *inode;
+	/* NULL for the pages of zeros and the ones not read yet */
+	uint32_t *pages[CINODE_NR_PAGES];
+	DECLARE_BITMAP(loaded, CINODE_NR_PAGES);
+};
+
+static inline bool cinode_is_btree(const struct sd_cinode *ci)
+{
+	return ci->inode->store_policy != 0;
+}
+
+/* Read the inode of vid, with the B-tree root if any, but no flat index */
+int sd_cinode_read(uint32_t vid, struct sd_cinode **cinode)
+{
+	struct sd_cinode *ci = xzalloc(sizeof(*ci));
+	uint64_t oid = vid_to_vdi_oid(vid);
+	void *buf;
+	int ret;
+
+	ci->inode = xmalloc(SD_INODE_HEADER_SIZE);
+	buf = ci->inode;
+	ret = inode_actor.reader(oid, &buf, SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	if (cinode_is_btree(ci)) {
+		struct sd_inode *inode;
+		uint32_t len;
+
+		/* large enough to be mapped, the untouched pages cost nothing */
+		inode = xcalloc(1, offsetof(struct sd_inode, gref));
+		memcpy(inode, ci->inode, SD_INODE_HEADER_SIZE);
+		free(ci->inode);
+		ci->inode = inode;
+
+		buf = inode->data_vdi_id;
+		ret = inode_actor.reader(oid, &buf,
+					 sizeof(struct sd_index_header),
+					 SD_INODE_HEADER_SIZE);
+		if (ret != SD_RES_SUCCESS)
+			goto err;
+		/* an empty tree is not initialized yet */
+		len = inode->data_vdi_id[0] ?
+			sd_inode_get_meta_size(inode, 0) : 0;
+		if (len > sizeof(struct sd_index_header)) {
+			ret = inode_actor.reader(oid, &buf, len,
+						 SD_INODE_HEADER_SIZE);
+			if (ret != SD_RES_SUCCESS)
+				goto err;
+		}
+	}
+
+	sd_init_rw_lock(&ci->lock);
+	*cinode = ci;
+	return SD_RES_SUCCESS;
+err:
+	free(ci->inode);
+	free(ci);
+	return ret;
+}
+
+void sd_cinode_free(struct sd_cinode *ci)
+{
+	if (!ci)
+		return;
+
+	for (int i = 0; i < CINODE_NR_PAGES; i++)
+		free(ci->pages[i]);
+	sd_destroy_rw_lock(&ci->lock);
+	free(ci->inode);
+	free(ci);
+}
+
+/* The header of the inode, data_vdi_id[] and gref[] are not there */
+const struct sd_inode *sd_cinode_header(const struct sd_cinode *ci)
+{
+	return ci->inode;
+}
+
+/* Read the page of data_vdi_id[] if not yet, called with the lock held */
+static int cinode_load_page(struct sd_cinode *ci, uint32_t page)
+{
+	uint32_t *p = xmalloc(CINODE_PAGE_SIZE);
+	void *buf = p;
+	int ret;
+
+	ret = inode_actor.reader(vid_to_vdi_oid(ci->inode->vdi_id), &buf,
+				 CINODE_PAGE_SIZE, SD_INODE_HEADER_SIZE +
+				 (uint64_t)page * CINODE_PAGE_SIZE);
+	if (ret != SD_RES_SUCCESS) {
+		free(p);
+		return ret;
+	}
+
+	if (is_zero_block(p, CINODE_PAGE_SIZE)) {
+		free(p);
+		p = NULL;
+	}
+	ci->pages[page] = p;
+	set_bit(page, ci->loaded);
+	return SD_RES_SUCCESS;
+}
+
+uint32_t sd_cinode_get_vid(struct sd_cinode *ci, uint32_t idx)
+{
+	uint32_t page = idx >> CINODE_PAGE_SHIFT, vid = 0;
+
+	sd_read_lock(&ci->lock);
+	if (cinode_is_btree(ci)) {
+		vid = sd_inode_get_vid(ci->inode, idx);
+		goto out;
+	}
+	if (!test_bit(page, ci->loaded)) {
+		sd_rw_unlock(&ci->lock);
+		sd_write_lock(&ci->lock);
+		if (!test_bit(page, ci->loaded) &&
+		    cinode_load_page(ci, page) != SD_RES_SUCCESS) {
+			sd_err("failed to read the index of %"PRIx32,
+			       ci->inode->vdi_id);
+			goto out;
+		}
+	}
+	if (ci->pages[page])
+		vid = ci->pages[page][idx & (CINODE_PAGE_ENTRIES - 1)];
+out:
+	sd_rw_unlock(&ci->lock);
+	return vid;
+}
+
+int sd_cinode_set_vid(struct sd_cinode *ci, uint32_t idx, uint32_t vdi_id)
+{
+	uint32_t page = idx >> CINODE_PAGE_SHIFT;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(&ci->lock);
+	if (cinode_is_btree(ci)) {
+		ret = sd_inode_set_vid(ci->inode, idx, vdi_id);
+		goto out;
+	}
+	if (!test_bit(page, ci->loaded)) {
+		ret = cinode_load_page(ci, page);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+	if (!ci->pages[page])
+		ci->pages[page] = xzalloc(CINODE_PAGE_SIZE);
+	ci->pages[page][idx & (CINODE_PAGE_ENTRIES - 1)] = vdi_id;
+out:
+	sd_rw_unlock(&ci->lock);
+	return ret;
+}
+
+/* Write the entry of idx out, as sd_inode_write_vid() */
+int sd_cinode_write_vid(struct sd_cinode *ci, uint32_t idx, uint32_t vid,
+			uint32_t value, int flags, bool create, bool direct)
+{
+	int ret;
+
+	sd_read_lock(&ci->lock);
+	ret = sd_inode_write_vid(ci->inode, idx, vid, value, flags, create,
+				 direct);
+	sd_rw_unlock(&ci->lock);
+	return ret;
+}
@@ -20,6 +20,9 @@
  *
  */
 #include <arpa/inet.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include "sha1.h"
 #include "util.h"
 
@@ -317,6 +320,236 @@ static bool avx_usable(void)
 	return true;
 }
 
+/*
+ * Four rounds of the SHA extensions.  The rounds alternate between E0 and E1,
+ * and expand the message words of the later rounds from the current ones.
+ */
+#define SHANI_ROUNDS(g)							\
+do {									\
+	__m128i *cur = (g) & 1 ? &e1 : &e0, *next = (g) & 1 ? &e0 : &e1; \
+	__m128i *m = msg + (g) % 4;					\
+									\
+	if ((g) < 4)							\
+		*m = _mm_shuffle_epi8(_mm_loadu_si128(			\
+			(const __m128i *)(data + (g) * 16)), mask);	\
+	if ((g) == 0)							\
+		*cur = _mm_add_epi32(*cur, *m);				\
+	else								\
+		*cur = _mm_sha1nexte_epu32(*cur, *m);			\
+	*next = abcd;							\
+	if ((g) >= 3 && (g) <= 18)					\
+		msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(		\
+			msg[((g) + 1) % 4], *m);			\
+	abcd = _mm_sha1rnds4_epu32(abcd, *cur, (g) / 5);		\
+	if ((g) >= 1 && (g) <= 16)					\
+		msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(		\
+			msg[((g) + 3) % 4], *m);			\
+	if ((g) >= 2 && (g) <= 17)					\
+		msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], *m); \
+} while (0)
+
+static asmlinkage __attribute__((target("sha,sse4.1"))) void
+sha1_transform_shani(uint32_t *state, const uint8_t *data,
+		     unsigned int blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+					    0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e0_save, e1, msg[4];
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+				 0x1B);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks > 0; blocks--, data += SHA1_BLOCK_SIZE) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		SHANI_ROUNDS(0); SHANI_ROUNDS(1); SHANI_ROUNDS(2);
+		SHANI_ROUNDS(3); SHANI_ROUNDS(4); SHANI_ROUNDS(5);
+		SHANI_ROUNDS(6); SHANI_ROUNDS(7); SHANI_ROUNDS(8);
+		SHANI_ROUNDS(9); SHANI_ROUNDS(10); SHANI_ROUNDS(11);
+		SHANI_ROUNDS(12); SHANI_ROUNDS(13); SHANI_ROUNDS(14);
+		SHANI_ROUNDS(15); SHANI_ROUNDS(16); SHANI_ROUNDS(17);
+		SHANI_ROUNDS(18); SHANI_ROUNDS(19);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/*
+ * Multi-buffer SHA1 with AVX2: each 32-bit lane of the ymm registers hashes a
+ * buffer of its own, so SHA1_BATCH_NR buffers of the same length take about
+ * the time of two or three with the single buffer code.
+ */
+
+#define MB_ROL(x, n) \
+	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define MB_ROUND(f, k)							\
+do {									\
+	if (t >= 16)							\
+		w[t & 15] = MB_ROL(_mm256_xor_si256(			\
+			_mm256_xor_si256(w[(t + 13) & 15], w[(t + 8) & 15]), \
+			_mm256_xor_si256(w[(t + 2) & 15], w[t & 15])), 1); \
+	tmp = _mm256_add_epi32(_mm256_add_epi32(MB_ROL(a, 5), (f)),	\
+			       _mm256_add_epi32(_mm256_add_epi32(e, k), \
+						w[t & 15]));		\
+	e = d;								\
+	d = c;								\
+	c = MB_ROL(b, 30);						\
+	b = a;								\
+	a = tmp;							\
+} while (0)
+
+/* Load the message words t to t + 7 of the lanes, transposed */
+static __attribute__((target("avx2"))) void
+mb_load_words(__m256i *w, const uint8_t **data, unsigned int off)
+{
+	const __m256i bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+					      4, 5, 6, 7, 0, 1, 2, 3,
+					      12, 13, 14, 15, 8, 9, 10, 11,
+					      4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[SHA1_BATCH_NR], t[SHA1_BATCH_NR], u[SHA1_BATCH_NR];
+
+	for (int i = 0; i < SHA1_BATCH_NR; i++)
+		r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+				(const __m256i *)(data[i] + off)), bswap);
+
+	for (int i = 0; i < SHA1_BATCH_NR; i += 2) {
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < SHA1_BATCH_NR; i += 4) {
+		u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		w[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+		w[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+	}
+}
+
+static __attribute__((target("avx2"))) void
+mb_sha1_transform(uint32_t state[5][SHA1_BATCH_NR], const uint8_t **data,
+		  unsigned int blocks)
+{
+	const __m256i k1 = _mm256_set1_epi32(0x5A827999),
+		k2 = _mm256_set1_epi32(0x6ED9EBA1),
+		k3 = _mm256_set1_epi32(0x8F1BBCDC),
+		k4 = _mm256_set1_epi32(0xCA62C1D6);
+	__m256i a, b, c, d, e, tmp, w[16], s[5];
+	const uint8_t *p[SHA1_BATCH_NR];
+	int t;
+
+	for (int i = 0; i < 5; i++)
+		s[i] = _mm256_loadu_si256((const __m256i *)state[i]);
+	memcpy(p, data, sizeof(p));
+
+	for (; blocks > 0; blocks--) {
+		mb_load_words(w, p, 0);
+		mb_load_words(w + 8, p, 32);
+		for (int i = 0; i < SHA1_BATCH_NR; i++)
+			p[i] += SHA1_BLOCK_SIZE;
+
+		a = s[0];
+		b = s[1];
+		c = s[2];
+		d = s[3];
+		e = s[4];
+
+		for (t = 0; t < 20; t++)
+			MB_ROUND(_mm256_xor_si256(d, _mm256_and_si256(b,
+					_mm256_xor_si256(c, d))), k1);
+		for (; t < 40; t++)
+			MB_ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d),
+				 k2);
+		for (; t < 60; t++)
+			MB_ROUND(_mm256_or_si256(_mm256_and_si256(b, c),
+					_mm256_and_si256(d,
+						_mm256_or_si256(b, c))), k3);
+		for (; t < 80; t++)
+			MB_ROUND(_mm256_xor_si256(_mm256_xor_si256(b, c), d),
+				 k4);
+
+		s[0] = _mm256_add_epi32(s[0], a);
+		s[1] = _mm256_add_epi32(s[1], b);
+		s[2] = _mm256_add_epi32(s[2], c);
+		s[3] = _mm256_add_epi32(s[3], d);
+		s[4] = _mm256_add_epi32(s[4], e);
+	}
+
+	for (int i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i *)state[i], s[i]);
+}
+
+/* Hash up to SHA1_BATCH_NR buffers of len bytes, the lanes left hash bufs[0] */
+static void mb_sha1(unsigned char **bufs, unsigned len, unsigned char **sha1s,
+		    int nr)
+{
+	static const uint32_t h[5] = {
+		SHA1_H0, SHA1_H1, SHA1_H2, SHA1_H3, SHA1_H4
+	};
+	unsigned int blocks = len / SHA1_BLOCK_SIZE, tail = len % SHA1_BLOCK_SIZE;
+	unsigned int pad_blocks = tail < 56 ? 1 : 2;
+	uint8_t pad[SHA1_BATCH_NR][SHA1_BLOCK_SIZE * 2];
+	uint32_t state[5][SHA1_BATCH_NR];
+	const uint8_t *data[SHA1_BATCH_NR];
+	uint64_t bits = (uint64_t)len << 3;
+
+	for (int i = 0; i < 5; i++)
+		for (int l = 0; l < SHA1_BATCH_NR; l++)
+			state[i][l] = h[i];
+	for (int l = 0; l < SHA1_BATCH_NR; l++)
+		data[l] = bufs[l < nr ? l : 0];
+
+	mb_sha1_transform(state, data, blocks);
+
+	/* the tails, padded and followed by the length, at the same time */
+	for (int l = 0; l < SHA1_BATCH_NR; l++) {
+		uint8_t *end = pad[l] + pad_blocks * SHA1_BLOCK_SIZE;
+
+		memset(pad[l], 0, sizeof(pad[l]));
+		memcpy(pad[l], data[l] + blocks * SHA1_BLOCK_SIZE, tail);
+		pad[l][tail] = 0x80;
+		for (int i = 1; i <= 8; i++)
+			end[-i] = 0xff & (bits >> ((i - 1) * 8));
+		data[l] = pad[l];
+	}
+	mb_sha1_transform(state, data, pad_blocks);
+
+	for (int l = 0; l < nr; l++)
+		for (int i = 0; i < 5; i++) {
+			uint32_t be = htonl(state[i][l]);
+
+			memcpy(sha1s[l] + i * 4, &be, 4);
+		}
+}
+
+static void mb_get_buffers_sha1(unsigned char **bufs, unsigned len,
+				unsigned char **sha1s, int nr)
+{
+	while (nr > 0) {
+		int n = min(nr, SHA1_BATCH_NR);
+
+		/* a lane costs as much as the batch with few buffers */
+		if (n < SHA1_BATCH_NR / 2) {
+			for (int i = 0; i < n; i++)
+				get_buffer_sha1(bufs[i], len, sha1s[i]);
+		} else
+			mb_sha1(bufs, len, sha1s, n);
+
+		bufs += n;
+		sha1s += n;
+		nr -= n;
+	}
+}
+
 #endif
 
 const char *sha1_to_hex(const unsigned char *sha1)
@@ -343,6 +576,26 @@ void get_buffer_sha1(unsigned char *buf, unsigned len, unsigned char *sha1)
 	sha1_final(&c, sha1);
 }
 
+static void generic_get_buffers_sha1(unsigned char **bufs, unsigned len,
+				     unsigned char **sha1s, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		get_buffer_sha1(bufs[i], len, sha1s[i]);
+}
+
+static void (*buffers_sha1)(unsigned char **, unsigned, unsigned char **, int)
+	= generic_get_buffers_sha1;
+
+/*
+ * Hash nr independent buffers of len bytes each, the digest of bufs[i] into
+ * sha1s[i].  The buffers are hashed together if the cpu can do it faster.
+ */
+void get_buffers_sha1(unsigned char **bufs, unsigned len, unsigned char **sha1s,
+		      int nr)
+{
+	buffers_sha1(bufs, len, sha1s, nr);
+}
+
 static void __attribute__((constructor)) __sha1_init(void)
 {
 	sha1_init = generic_sha1_init;
@@ -358,6 +611,13 @@ static void __attribute__((constructor)) __sha1_init(void)
 	if (avx_usable())
 		sha1_transform_asm = sha1_transform_avx;
 
+	if (cpu_has_sha_ni && cpu_has_sse4_1)
+		sha1_transform_asm = sha1_transform_shani;
+
+	/* still ahead of the SHA extensions with the full batches */
+	if (avx_usable() && cpu_has_avx2)
+		buffers_sha1 = mb_get_buffers_sha1;
+
 	sha1_update = ssse3_sha1_update;
 	sha1_final = ssse3_sha1_final;
 #endif
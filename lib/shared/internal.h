@@ -28,6 +28,9 @@ enum sheep_request_type {
 	VDI_WRITE,
 	VDI_CREATE,
 	SHEEP_CTL,
+	RING_UPDATE,
+	INODE_UPDATE,
+	VDI_PREALLOC,
 };
 
 struct sheep_aiocb {
@@ -38,12 +41,17 @@ struct sheep_aiocb {
 	uint32_t nr_requests;
 	char *buf;
 	int buf_iter;
+	/* the segment of buf_iter and the offset in it, for a vectored I/O */
+	const struct iovec *iov;
+	size_t iov_off;
 	const struct sd_op_template *op;
 	void (*aio_done_func)(struct sheep_aiocb *);
 };
 
 struct sheep_request {
 	struct list_node list;
+	struct list_node creating; /* in creating_list of the cluster */
+	struct sd_conn *conn;
 	struct sheep_aiocb *aiocb;
 	uint64_t oid;
 	uint64_t cow_oid;
@@ -52,22 +60,31 @@ struct sheep_request {
 	uint32_t offset;
 	uint32_t length;
 	char *buf;
+	/* the copies of a read sent to a node holding one, 0 for a gateway */
+	uint8_t nr_copies;
+	uint32_t epoch; /* of the ring the node is picked from */
+	unsigned int host; /* index of the node in the hosts */
+	/* buf bounces the range from iov_off of iov, if not NULL */
+	const struct iovec *iov;
+	size_t iov_off;
 };
 
 struct sd_request {
 	struct sd_cluster *cluster;
-	struct list_node list;
+	struct sd_qnode qnode;
 	union {
 		struct sd_vdi *vdi;
 		struct sd_req *hdr;
 	};
 	void *data;
+	const struct iovec *iov; /* instead of data if not NULL */
 	size_t length;
 	off_t offset;
 	uint8_t opcode;
 	void (*done_func)(void *, int);
 	void *opaque;
 	int ret;
+	struct sheep_aiocb aiocb;
 };
 
 struct sd_op_template {
@@ -78,7 +95,20 @@ struct sd_op_template {
 
 int end_sheep_request(struct sheep_request *req);
 int submit_sheep_request(struct sheep_request *req);
+struct sd_request *alloc_request(struct sd_cluster *c, void *data,
+				 size_t count, uint8_t op);
+void sd_queue_push(struct sd_queue *q, struct sd_qnode *node);
+struct sd_qnode *sd_queue_pop(struct sd_queue *q);
 
 const struct sd_op_template *get_sd_op(uint8_t opcode);
 
+struct sd_ring *ring_build(struct sd_cluster *c, const void *nodes,
+			   uint32_t nr_nodes, uint32_t epoch);
+void ring_free(struct sd_ring *ring);
+struct sd_conn *ring_pick_conn(struct sd_cluster *c,
+			       struct sheep_request *req);
+void ring_set(struct sd_cluster *c, const void *nodes, uint32_t len,
+	      uint32_t epoch);
+void ring_update(struct sd_cluster *c, uint32_t epoch);
+
 #endif
@@ -25,20 +25,60 @@ static uint32_t sheep_inode_get_vid(struct sd_request *req, uint32_t idx)
 	return vid;
 }
 
-static struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
-						       uint64_t oid)
+/* Called with blocking_lock held */
+static bool creating_object(struct sd_cluster *c, uint64_t oid)
 {
 	struct sheep_request *req;
 
-	sd_read_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
-		if (req->oid == oid) {
-			sd_rw_unlock(&c->inflight_lock);
-			return req;
-		}
+	list_for_each_entry(req, &c->creating_list, creating) {
+		if (req->oid == oid)
+			return true;
+	}
+	return false;
+}
+
+static void iov_copy(struct sheep_request *req, bool gather)
+{
+	const struct iovec *iov = req->iov;
+	size_t off = req->iov_off, done = 0;
+
+	while (done < req->length) {
+		size_t n = min(iov->iov_len - off, req->length - done);
+
+		if (gather)
+			memcpy(req->buf + done, (char *)iov->iov_base + off, n);
+		else
+			memcpy((char *)iov->iov_base + off, req->buf + done, n);
+		done += n;
+		iov++;
+		off = 0;
 	}
-	sd_rw_unlock(&c->inflight_lock);
-	return NULL;
+}
+
+/*
+ * Point the request to its range of the iovec of the aiocb, or to a bounce
+ * buffer if the range spans several segments
+ */
+static void iov_setup(struct sheep_request *req, struct sheep_aiocb *aiocb)
+{
+	const struct iovec *iov;
+
+	while (aiocb->iov_off >= aiocb->iov->iov_len) {
+		aiocb->iov_off -= aiocb->iov->iov_len;
+		aiocb->iov++;
+	}
+	iov = aiocb->iov;
+
+	if (aiocb->iov_off + req->length <= iov->iov_len)
+		req->buf = (char *)iov->iov_base + aiocb->iov_off;
+	else {
+		req->buf = xmalloc(req->length);
+		req->iov = iov;
+		req->iov_off = aiocb->iov_off;
+		if (req->opcode == VDI_WRITE)
+			iov_copy(req, true);
+	}
+	aiocb->iov_off += req->length;
 }
 
 static struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
@@ -53,25 +93,213 @@ static struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 	req->oid = oid;
 	req->cow_oid = cow_oid;
 	req->aiocb = aiocb;
-	req->buf = aiocb->buf + aiocb->buf_iter;
 	req->seq_num = uatomic_add_return(&c->seq_num, 1);
 	req->opcode = aiocb->request->opcode;
+	if (aiocb->iov)
+		iov_setup(req, aiocb);
+	else
+		req->buf = aiocb->buf + aiocb->buf_iter;
 	aiocb->buf_iter += len;
 
 	INIT_LIST_NODE(&req->list);
+	INIT_LIST_NODE(&req->creating);
 	uatomic_inc(&aiocb->nr_requests);
 
 	return req;
 }
 
+/*
+ * The entries of the index of the objects created go to the inode in batches:
+ * one write of the inode is in flight for a vdi at a time, and the entries of
+ * the creations done meanwhile go together with the next one, a write for a
+ * run of close entries.  A write completes once the entry of its object is in
+ * the inode, so it waits for the write of the inode taking the entry.
+ */
+#define INODE_UPDATE_GAP 64 /* entries rewritten at most between two runs */
+
+struct inode_waiter {
+	struct list_node list;
+	struct sheep_aiocb *aiocb;
+};
+
+struct sd_inode_update {
+	struct sd_vdi *vdi;
+	uint32_t nr;
+	uint32_t *idx; /* sorted */
+	struct list_head waiters;
+	uint32_t vids[];
+};
+
+static void put_aiocb(struct sheep_aiocb *aiocb)
+{
+	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
+		aiocb->aio_done_func(aiocb);
+}
+
+static void add_inode_waiter(struct list_head *waiters,
+			     struct sheep_aiocb *aiocb)
+{
+	struct inode_waiter *w = xmalloc(sizeof(*w));
+
+	uatomic_inc(&aiocb->nr_requests);
+	w->aiocb = aiocb;
+	list_add_tail(&w->list, waiters);
+}
+
+static int idx_cmp(const uint32_t *a, const uint32_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+static bool idx_in(const uint32_t *idx, uint32_t nr, uint32_t i)
+{
+	for (uint32_t k = 0; k < nr; k++)
+		if (idx[k] == i)
+			return true;
+	return false;
+}
+
+/* Make the aiocb wait for the entry idx if it is not in the inode yet */
+static void inode_wait(struct sd_vdi *vdi, uint32_t idx,
+		       struct sheep_aiocb *aiocb)
+{
+	struct sd_inode_update *u;
+
+	sd_mutex_lock(&vdi->inode_lock);
+	u = vdi->updating;
+	if (idx_in(vdi->dirty, vdi->nr_dirty, idx))
+		add_inode_waiter(&vdi->dirty_waiters, aiocb);
+	else if (u && xbsearch(&idx, u->idx, u->nr, idx_cmp))
+		add_inode_waiter(&u->waiters, aiocb);
+	sd_mutex_unlock(&vdi->inode_lock);
+}
+
+/* Called with inode_lock held */
+static void queue_inode_update(struct sd_vdi *vdi)
+{
+	struct sd_cluster *c = vdi->c;
+	struct sd_request *req = alloc_request(c, NULL, 0, INODE_UPDATE);
+
+	req->vdi = vdi;
+	vdi->inode_busy = true;
+	sd_queue_push(&c->request_queue, &req->qnode);
+	eventfd_xwrite(c->request_fd, 1);
+}
+
+/* Set the entry of the object created, for the aiocb */
+static void inode_set(struct sd_vdi *vdi, uint32_t idx,
+		      struct sheep_aiocb *aiocb)
+{
+	sd_mutex_lock(&vdi->inode_lock);
+	sd_write_lock(&vdi->lock);
+	vdi->inode->data_vdi_id[idx] = vdi->vid;
+	sd_rw_unlock(&vdi->lock);
+
+	if (vdi->nr_dirty == vdi->dirty_size) {
+		vdi->dirty_size = max(vdi->dirty_size * 2, 64U);
+		vdi->dirty = xrealloc(vdi->dirty,
+				      vdi->dirty_size * sizeof(*vdi->dirty));
+	}
+	vdi->dirty[vdi->nr_dirty++] = idx;
+	add_inode_waiter(&vdi->dirty_waiters, aiocb);
+	if (!vdi->inode_busy)
+		queue_inode_update(vdi);
+	sd_mutex_unlock(&vdi->inode_lock);
+}
+
+static void inode_update_done(void *opaque, int ret)
+{
+	struct sd_inode_update *u = opaque;
+	struct sd_vdi *vdi = u->vdi;
+	struct inode_waiter *w;
+
+	/* the vdi may be closed once the waiters are done */
+	sd_mutex_lock(&vdi->inode_lock);
+	vdi->updating = NULL;
+	if (vdi->nr_dirty)
+		queue_inode_update(vdi);
+	else
+		vdi->inode_busy = false;
+	sd_mutex_unlock(&vdi->inode_lock);
+
+	list_for_each_entry(w, &u->waiters, list) {
+		if (ret != SD_RES_SUCCESS)
+			w->aiocb->ret = ret;
+		put_aiocb(w->aiocb);
+		free(w);
+	}
+	free(u->idx);
+	free(u);
+}
+
+static int inode_update_request(struct sheep_aiocb *aiocb)
+{
+	struct sd_request *request = aiocb->request;
+	struct sd_vdi *vdi = request->vdi;
+	uint64_t oid = vid_to_vdi_oid(vdi->vid);
+	struct sd_inode_update *u;
+	uint32_t *idx, nr, nr_vids = 0;
+
+	/* take the entries set so far, sorted and in runs */
+	sd_mutex_lock(&vdi->inode_lock);
+	idx = vdi->dirty;
+	nr = vdi->nr_dirty;
+	vdi->dirty = NULL;
+	vdi->nr_dirty = vdi->dirty_size = 0;
+	xqsort(idx, nr, idx_cmp);
+	for (uint32_t i = 0, start = 0; i < nr; i++)
+		if (i == nr - 1 || idx[i + 1] - idx[i] > INODE_UPDATE_GAP) {
+			nr_vids += idx[i] - idx[start] + 1;
+			start = i + 1;
+		}
+
+	u = xmalloc(sizeof(*u) + nr_vids * sizeof(u->vids[0]));
+	u->vdi = vdi;
+	u->idx = idx;
+	u->nr = nr;
+	INIT_LIST_HEAD(&u->waiters);
+	list_splice_init(&vdi->dirty_waiters, &u->waiters);
+	vdi->updating = u;
+
+	request->done_func = inode_update_done;
+	request->opaque = u;
+	aiocb->buf = (char *)u->vids;
+	uatomic_inc(&aiocb->nr_requests);
+
+	sd_read_lock(&vdi->lock);
+	for (uint32_t i = 0, start = 0; i < nr; i++) {
+		struct sheep_request *req;
+		uint32_t n;
+
+		if (i < nr - 1 && idx[i + 1] - idx[i] <= INODE_UPDATE_GAP)
+			continue;
+		n = idx[i] - idx[start] + 1;
+		memcpy(aiocb->buf + aiocb->buf_iter,
+		       vdi->inode->data_vdi_id + idx[start],
+		       n * sizeof(u->vids[0]));
+		req = alloc_sheep_request(aiocb, oid, 0, n * sizeof(u->vids[0]),
+					  SD_INODE_HEADER_SIZE +
+					  idx[start] * sizeof(u->vids[0]));
+		submit_sheep_request(req);
+		start = i + 1;
+	}
+	sd_rw_unlock(&vdi->lock);
+	sd_mutex_unlock(&vdi->inode_lock);
+
+	put_aiocb(aiocb);
+	return SD_RES_SUCCESS;
+}
+
 static int vdi_rw_request(struct sheep_aiocb *aiocb)
 {
 	struct sd_request *request = aiocb->request;
 	uint64_t offset = aiocb->offset;
 	uint64_t total = aiocb->length;
-	int start = offset % SD_DATA_OBJ_SIZE;
-	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
-	int len = SD_DATA_OBJ_SIZE - start;
+	/* the size of the data objects is fixed when the vdi is created */
+	uint64_t obj_size = UINT64_C(1) << request->vdi->inode->block_size_shift;
+	int start = offset % obj_size;
+	uint32_t idx = offset / obj_size;
+	int len = obj_size - start;
 	struct sd_cluster *c = request->cluster;
 
 	if (total < len)
@@ -102,35 +330,54 @@ static int vdi_rw_request(struct sheep_aiocb *aiocb)
 		}
 
 		req = alloc_sheep_request(aiocb, oid, cow_oid, len, start);
-		if (vid && !cow_oid)
+		if (vid && !cow_oid) {
+			/* the erasure coded objects are read from a gateway */
+			if (req->opcode == VDI_READ && c->ring &&
+			    !request->vdi->inode->copy_policy)
+				req->nr_copies = request->vdi->inode->nr_copies;
+			if (req->opcode == VDI_WRITE)
+				inode_wait(request->vdi, idx, aiocb);
 			goto submit;
+		}
 
 		switch (req->opcode) {
-		case VDI_WRITE:
+		case VDI_WRITE: {
+			/* an unallocated object reads back as zeros already */
+			bool zero = !cow_oid &&
+				is_zero_block(req->buf, req->length);
+			uint32_t tmp_vid;
+
 			/*
 			 * Sheepdog can't handle concurrent creation on the same
 			 * object. We send one create req first and then send
 			 * write reqs in next.
 			 */
-			if (find_inflight_request_oid(c, oid)) {
-				uint32_t tmp_vid;
-
-				sd_write_lock(&c->blocking_lock);
-				/*
-				 * There are slim chance object was created
-				 * before we grab blocking_lock
-				 */
-				tmp_vid = sheep_inode_get_vid(request, idx);
-				if (tmp_vid && tmp_vid == request->vdi->vid) {
-					sd_rw_unlock(&c->blocking_lock);
-					goto submit;
-				}
+			sd_write_lock(&c->blocking_lock);
+			/*
+			 * There are slim chance object was created
+			 * before we grab blocking_lock
+			 */
+			tmp_vid = sheep_inode_get_vid(request, idx);
+			if (tmp_vid && tmp_vid == request->vdi->vid) {
+				sd_rw_unlock(&c->blocking_lock);
+				inode_wait(request->vdi, idx, aiocb);
+				goto submit;
+			}
+			if (creating_object(c, oid)) {
 				list_add_tail(&req->list, &c->blocking_list);
 				sd_rw_unlock(&c->blocking_lock);
 				goto done;
 			}
+			if (zero) {
+				sd_rw_unlock(&c->blocking_lock);
+				end_sheep_request(req);
+				goto done;
+			}
+			list_add_tail(&req->creating, &c->creating_list);
+			sd_rw_unlock(&c->blocking_lock);
 			req->opcode = VDI_CREATE;
 			break;
+		}
 		case VDI_READ:
 			end_sheep_request(req);
 			goto done;
@@ -140,8 +387,8 @@ submit:
 done:
 		idx++;
 		total -= len;
-		start = (start + len) % SD_DATA_OBJ_SIZE;
-		len = total > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : total;
+		start = (start + len) % obj_size;
+		len = total > obj_size ? obj_size : total;
 	} while (total > 0);
 
 	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
@@ -150,15 +397,20 @@ done:
 	return SD_RES_SUCCESS;
 }
 
-static void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid)
+static void submit_blocking_sheep_request(struct sd_cluster *c,
+					  struct sheep_request *create)
 {
 	struct sheep_request *req;
+	uint64_t oid = create->oid;
 
 	sd_write_lock(&c->blocking_lock);
+	list_del(&create->creating);
 	list_for_each_entry(req, &c->blocking_list, list) {
 		if (req->oid != oid)
 			continue;
 		list_del(&req->list);
+		inode_wait(req->aiocb->request->vdi, data_oid_to_idx(oid),
+			   req->aiocb);
 		submit_sheep_request(req);
 	}
 	sd_rw_unlock(&c->blocking_lock);
@@ -166,41 +418,59 @@ static void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid)
 
 static int vdi_create_response(struct sheep_request *req, struct sd_rsp *rsp)
 {
-	struct sd_vdi *vdi;
-	struct sheep_request *new;
-	uint32_t vid, idx;
-	uint64_t oid;
 	struct sd_cluster *c = req->aiocb->request->cluster;
 
-	vdi = req->aiocb->request->vdi;
-
-	/* We need to update inode for create */
-	new = xmalloc(sizeof(*new));
-	vid = vdi->vid;
-	oid = vid_to_vdi_oid(vid);
-	idx = data_oid_to_idx(req->oid);
-	new->offset = SD_INODE_HEADER_SIZE + sizeof(vid) * idx;
-	new->length = sizeof(vid);
-	new->oid = oid;
-	new->cow_oid = 0;
-	new->aiocb = req->aiocb;
-	new->buf = (char *)&vid;
-	new->seq_num = uatomic_add_return(&c->seq_num, 1);
-	new->opcode = VDI_WRITE;
-	uatomic_inc(&req->aiocb->nr_requests);
-	INIT_LIST_NODE(&new->list);
-
-	/* Make sure no request is queued while we update inode */
-	sd_write_lock(&vdi->lock);
-	vdi->inode->data_vdi_id[idx] = vid;
-	sd_rw_unlock(&vdi->lock);
+	if (rsp->result == SD_RES_SUCCESS)
+		inode_set(req->aiocb->request->vdi, data_oid_to_idx(req->oid),
+			  req->aiocb);
+	submit_blocking_sheep_request(c, req);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Create the objects of the range not created yet, with no data */
+static int vdi_prealloc_request(struct sheep_aiocb *aiocb)
+{
+	struct sd_request *request = aiocb->request;
+	struct sd_vdi *vdi = request->vdi;
+	struct sd_cluster *c = request->cluster;
+	uint64_t obj_size = UINT64_C(1) << vdi->inode->block_size_shift;
+	uint32_t idx = aiocb->offset / obj_size;
+	uint32_t end = (aiocb->offset + aiocb->length + obj_size - 1) /
+		obj_size;
 
-	submit_sheep_request(new);
-	submit_blocking_sheep_request(c, req->oid);
+	uatomic_inc(&aiocb->nr_requests);
+	for (; idx < end; idx++) {
+		uint64_t oid = vid_to_data_oid(vdi->vid, idx), cow_oid = 0;
+		struct sheep_request *req;
+		uint32_t vid;
+
+		sd_write_lock(&c->blocking_lock);
+		vid = sheep_inode_get_vid(request, idx);
+		if (vid == vdi->vid || creating_object(c, oid)) {
+			sd_rw_unlock(&c->blocking_lock);
+			continue;
+		}
+		if (vid)
+			cow_oid = vid_to_data_oid(vid, idx);
+		req = alloc_sheep_request(aiocb, oid, cow_oid, 0, 0);
+		req->opcode = VDI_CREATE;
+		list_add_tail(&req->creating, &c->creating_list);
+		sd_rw_unlock(&c->blocking_lock);
+		submit_sheep_request(req);
+	}
+	put_aiocb(aiocb);
 
 	return SD_RES_SUCCESS;
 }
 
+static int vdi_read_response(struct sheep_request *req, struct sd_rsp *rsp)
+{
+	if (req->iov && rsp->result == SD_RES_SUCCESS)
+		iov_copy(req, false);
+	return SD_RES_SUCCESS;
+}
+
 static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 {
 	struct sd_req *hdr = aiocb->request->hdr;
@@ -208,6 +478,7 @@ static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 	struct sheep_request *request = xzalloc(sizeof(struct sheep_request));
 
 	INIT_LIST_NODE(&request->list);
+	INIT_LIST_NODE(&request->creating);
 	request->offset = hdr->obj.offset;
 	request->length = hdr->data_length;
 	request->oid = hdr->obj.oid;
@@ -229,10 +500,31 @@ static int sheep_ctl_response(struct sheep_request *req, struct sd_rsp *rsp)
 	return SD_RES_SUCCESS;
 }
 
+static int ring_update_request(struct sheep_aiocb *aiocb)
+{
+	struct sheep_request *req;
+
+	req = alloc_sheep_request(aiocb, 0, 0, aiocb->length, 0);
+	submit_sheep_request(req);
+	return SD_RES_SUCCESS;
+}
+
+static int ring_update_response(struct sheep_request *req, struct sd_rsp *rsp)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+
+	if (rsp->result == SD_RES_SUCCESS)
+		ring_set(c, req->buf, rsp->data_length, rsp->epoch);
+	free(req->buf);
+	uatomic_set_false(&c->ring_updating);
+	return SD_RES_SUCCESS;
+}
+
 static struct sd_op_template sd_ops[] = {
 	[VDI_READ] = {
 		.name = "VDI READ",
 		.request_process = vdi_rw_request,
+		.response_process = vdi_read_response,
 	},
 	[VDI_WRITE] = {
 		.name = "VDI WRITE",
@@ -248,6 +540,19 @@ static struct sd_op_template sd_ops[] = {
 		.request_process = sheep_ctl_request,
 		.response_process = sheep_ctl_response,
 	},
+	[INODE_UPDATE] = {
+		.name = "INODE UPDATE",
+		.request_process = inode_update_request,
+	},
+	[VDI_PREALLOC] = {
+		.name = "VDI PREALLOC",
+		.request_process = vdi_prealloc_request,
+	},
+	[RING_UPDATE] = {
+		.name = "RING UPDATE",
+		.request_process = ring_update_request,
+		.response_process = ring_update_response,
+	},
 };
 
 const struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The vnode ring of the cluster for the direct reads
+ *
+ * A cluster connected by sd_connect_direct() has a connection to each node
+ * and builds the vnode ring from the node list the way the sheep do, so a
+ * read of a replicated object goes as SD_OP_READ_PEER straight to a node
+ * holding a copy, instead of through a gateway which forwards it there.  The
+ * peer read carries the epoch of the ring, and a node of another epoch turns
+ * it down, as it does for the sheep, so a read with a stale ring fails and is
+ * resent through a gateway, while the node list of the new epoch is fetched.
+ * The writes always go through the gateways, which write all the copies.
+ * The ring follows the placement of SD_CLUSTER_FLAG_MIXHASH, but has no
+ * vnodes of the disks, so there are no direct reads in a cluster of diskmode.
+ */
+
+#include "sheepdog.h"
+#include "internal.h"
+#include "internal_proto.h"
+
+struct ring_vnode {
+	uint64_t hash;
+	uint32_t node;
+};
+
+struct ring_node {
+	uint32_t zone;
+	int host; /* index in the hosts of the cluster, -1 if none */
+	int conn; /* index of the connection to the host, -1 if none */
+};
+
+struct sd_ring {
+	uint32_t epoch;
+	bool mixhash; /* sd_mix_64() for the placement, as sd_mix_placement */
+	uint32_t nr_zones;
+	uint32_t nr_nodes;
+	uint32_t nr_vnodes;
+	struct ring_node *nodes;
+	struct ring_vnode *vnodes; /* sorted by hash */
+};
+
+static int ring_vnode_cmp(const struct ring_vnode *a,
+			  const struct ring_vnode *b)
+{
+	return intcmp(a->hash, b->hash);
+}
+
+static int find_host(struct sd_cluster *c, const struct node_id *nid)
+{
+	char addr[INET_ADDRSTRLEN];
+
+	if (!inet_ntop(AF_INET, nid->addr + 12, addr, sizeof(addr)))
+		return -1;
+	for (int i = 0; i < c->nr_hosts; i++)
+		if (c->hosts[i].port == nid->port &&
+		    !strcmp(c->hosts[i].addr, addr))
+			return i;
+	return -1;
+}
+
+static int find_conn(struct sd_cluster *c, int host)
+{
+	if (host < 0)
+		return -1;
+	for (int i = 0; i < c->nr_conns; i++)
+		if (c->conns[i].host_index == host)
+			return i;
+	return -1;
+}
+
+struct sd_ring *ring_build(struct sd_cluster *c, const void *buf,
+			   uint32_t nr_nodes, uint32_t epoch)
+{
+	const struct sd_node *nodes = buf;
+	struct sd_ring *ring = xzalloc(sizeof(*ring));
+	uint32_t nr_vnodes = 0;
+
+	for (int i = 0; i < nr_nodes; i++)
+		nr_vnodes += nodes[i].nr_vnodes;
+
+	ring->epoch = epoch;
+	ring->mixhash = c->mixhash;
+	ring->nr_nodes = nr_nodes;
+	ring->nodes = xcalloc(nr_nodes, sizeof(*ring->nodes));
+	ring->vnodes = xcalloc(nr_vnodes, sizeof(*ring->vnodes));
+	for (int i = 0; i < nr_nodes; i++) {
+		const struct sd_node *n = nodes + i;
+		uint64_t hval = sd_hash(&n->nid, offsetof(typeof(n->nid),
+							  io_addr));
+		bool new_zone = true;
+
+		ring->nodes[i].zone = n->zone;
+		ring->nodes[i].host = find_host(c, &n->nid);
+		ring->nodes[i].conn = find_conn(c, ring->nodes[i].host);
+		for (int j = 0; j < i; j++)
+			if (nodes[j].nr_vnodes && nodes[j].zone == n->zone)
+				new_zone = false;
+		if (n->nr_vnodes && new_zone)
+			ring->nr_zones++;
+
+		/* the same as node_to_vnodes() of the sheep */
+		for (int j = 0; j < n->nr_vnodes; j++) {
+			hval = ring->mixhash ? sd_mix_64(hval) :
+				sd_hash_next(hval);
+			ring->vnodes[ring->nr_vnodes].hash = hval;
+			ring->vnodes[ring->nr_vnodes].node = i;
+			ring->nr_vnodes++;
+		}
+	}
+	xqsort(ring->vnodes, ring->nr_vnodes, ring_vnode_cmp);
+
+	return ring;
+}
+
+void ring_free(struct sd_ring *ring)
+{
+	if (!ring)
+		return;
+	free(ring->nodes);
+	free(ring->vnodes);
+	free(ring);
+}
+
+/* The index of the first vnode from the hash, as oid_to_first_vnode() */
+static uint32_t ring_first_vnode(const struct sd_ring *ring, uint64_t hash)
+{
+	uint32_t start = 0, end = ring->nr_vnodes;
+
+	while (start < end) {
+		uint32_t mid = start + (end - start) / 2;
+
+		if (ring->vnodes[mid].hash < hash)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	return start == ring->nr_vnodes ? 0 : start;
+}
+
+/* Return the nodes of the copies of the oid, as oid_to_vnodes() */
+static int ring_oid_to_nodes(const struct sd_ring *ring, uint64_t oid,
+			     int nr_copies, const struct ring_node **nodes)
+{
+	uint64_t hval = ring->mixhash ? sd_mix_64(oid) : sd_hash_oid(oid);
+	uint32_t v = ring_first_vnode(ring, hval);
+	int nr = 0;
+
+	nr_copies = min(nr_copies, (int)ring->nr_zones);
+	for (uint32_t i = 0; i < ring->nr_vnodes && nr < nr_copies; i++) {
+		const struct ring_node *n;
+		int j;
+
+		n = ring->nodes + ring->vnodes[(v + i) % ring->nr_vnodes].node;
+		for (j = 0; j < nr; j++)
+			if (nodes[j]->zone == n->zone)
+				break;
+		if (j == nr)
+			nodes[nr++] = n;
+	}
+	return nr;
+}
+
+/*
+ * Return the connection to a node holding a copy of the object of the read,
+ * or NULL if there is none
+ */
+struct sd_conn *ring_pick_conn(struct sd_cluster *c,
+			       struct sheep_request *req)
+{
+	const struct ring_node *nodes[SD_MAX_COPIES];
+	struct sd_conn *conn = NULL;
+	int nr, first;
+
+	sd_read_lock(&c->ring_lock);
+	nr = ring_oid_to_nodes(c->ring, req->oid, req->nr_copies, nodes);
+	/* spread the reads of the objects over their copies */
+	first = nr ? sd_hash_64(req->oid) % nr : 0;
+	for (int i = 0; i < nr; i++) {
+		const struct ring_node *n = nodes[(first + i) % nr];
+		struct sd_conn *p;
+
+		if (n->conn < 0)
+			continue;
+		p = c->conns + n->conn;
+		/* a reconnection moves the connection to another node */
+		if (p->host_index != n->host ||
+		    !uatomic_is_true(&p->connected))
+			continue;
+		req->epoch = c->ring->epoch;
+		req->host = n->host;
+		conn = p;
+		break;
+	}
+	sd_rw_unlock(&c->ring_lock);
+
+	return conn;
+}
+
+void ring_set(struct sd_cluster *c, const void *nodes, uint32_t len,
+	      uint32_t epoch)
+{
+	struct sd_ring *ring, *old;
+
+	ring = ring_build(c, nodes, len / sizeof(struct sd_node), epoch);
+	sd_write_lock(&c->ring_lock);
+	old = c->ring;
+	c->ring = ring;
+	sd_rw_unlock(&c->ring_lock);
+	ring_free(old);
+}
+
+/* Fetch the node list again if the epoch is not the one of the ring */
+void ring_update(struct sd_cluster *c, uint32_t epoch)
+{
+	struct sd_request *req;
+	bool stale;
+
+	sd_read_lock(&c->ring_lock);
+	stale = c->ring->epoch != epoch;
+	sd_rw_unlock(&c->ring_lock);
+	if (!stale || uatomic_is_true(&c->stop_request_handler) ||
+	    !uatomic_set_true(&c->ring_updating))
+		return;
+
+	req = alloc_request(c, NULL, SD_MAX_NODES * sizeof(struct sd_node),
+			    RING_UPDATE);
+	req->data = xmalloc(req->length);
+	sd_queue_push(&c->request_queue, &req->qnode);
+	eventfd_xwrite(c->request_fd, 1);
+}
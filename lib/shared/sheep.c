@@ -73,55 +73,149 @@ static ssize_t net_write(int fd, void *buf, size_t count)
 	return sum;
 }
 
-static int sheep_submit_sdreq(struct sd_cluster *c, struct sd_req *hdr,
+/*
+ * The producers link the node to the tail with an exchange, and the consumer
+ * takes from the head.  A node is seen once its producer stored the link to
+ * it, so a pop might miss a node being pushed, whose producer kicks the
+ * consumer again afterwards.
+ */
+void sd_queue_push(struct sd_queue *q, struct sd_qnode *node)
+{
+	struct sd_qnode *prev;
+
+	uatomic_set(&node->next, NULL);
+	prev = uatomic_xchg(&q->tail, node);
+	uatomic_set(&prev->next, node);
+}
+
+struct sd_qnode *sd_queue_pop(struct sd_queue *q)
+{
+	struct sd_qnode *head = q->head, *next = uatomic_read(&head->next);
+
+	if (head == &q->stub) {
+		if (!next)
+			return NULL;
+		q->head = head = next;
+		next = uatomic_read(&head->next);
+	}
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	if (head != uatomic_read(&q->tail))
+		return NULL;
+
+	/* the last node can't go before another one comes after it */
+	sd_queue_push(q, &q->stub);
+	next = uatomic_read(&head->next);
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+static void sd_queue_init(struct sd_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+static inline struct sd_inflight *inflight_bucket(struct sd_cluster *c,
+						  uint32_t seq_num)
+{
+	return c->inflight + (seq_num & ((1U << SD_INFLIGHT_BITS) - 1));
+}
+
+static int sheep_submit_sdreq(struct sd_conn *conn, struct sd_req *hdr,
 			      void *data, uint32_t wlen)
 {
 	int ret;
 
-	sd_mutex_lock(&c->submit_mutex);
-	if (!uatomic_is_true(&c->connected)) {
+	sd_mutex_lock(&conn->submit_mutex);
+	if (!uatomic_is_true(&conn->connected)) {
 		ret = -SD_RES_EIO;
 		goto out;
 	}
 
-	ret = net_write(c->sockfd, hdr, sizeof(*hdr));
+	ret = net_write(conn->sockfd, hdr, sizeof(*hdr));
 	if (ret != sizeof(*hdr)) {
 		ret = -SD_RES_EIO;
 		goto out;
 	}
 
 	if (wlen) {
-		ret = net_write(c->sockfd, data, wlen);
+		ret = net_write(conn->sockfd, data, wlen);
 		if (ret != wlen)
 			ret = -SD_RES_EIO;
 	}
 
 out:
 	if (ret < 0)
-		uatomic_set_false(&c->connected);
+		uatomic_set_false(&conn->connected);
 
-	sd_mutex_unlock(&c->submit_mutex);
+	sd_mutex_unlock(&conn->submit_mutex);
 
 	return ret;
 }
 
+/* The requests come from the pool of the cluster, the aiocb with them */
+struct sd_request *alloc_request(struct sd_cluster *c, void *data,
+				 size_t count, uint8_t op)
+{
+	struct sd_request *req = NULL;
+
+	sd_mutex_lock(&c->pool_lock);
+	if (c->request_pool) {
+		req = container_of(c->request_pool, struct sd_request, qnode);
+		c->request_pool = req->qnode.next;
+		c->nr_pooled--;
+	}
+	sd_mutex_unlock(&c->pool_lock);
+
+	if (req)
+		memset(req, 0, sizeof(*req));
+	else
+		req = xzalloc(sizeof(*req));
+	req->cluster = c;
+	req->data = data;
+	req->length = count;
+	req->opcode = op;
+
+	return req;
+}
+
+static void free_request(struct sd_request *req)
+{
+	struct sd_cluster *c = req->cluster;
+
+	sd_mutex_lock(&c->pool_lock);
+	if (c->nr_pooled < SD_REQUEST_POOL_SIZE) {
+		req->qnode.next = c->request_pool;
+		c->request_pool = &req->qnode;
+		c->nr_pooled++;
+		req = NULL;
+	}
+	sd_mutex_unlock(&c->pool_lock);
+	free(req);
+}
+
 static void aio_end_request(struct sd_request *req, int ret)
 {
 	req->ret = ret;
 	if (req->done_func)
 		req->done_func(req->opaque, ret);
-	free(req);
+	free_request(req);
 }
 
 static void aio_rw_done(struct sheep_aiocb *aiocb)
 {
 	aio_end_request(aiocb->request, aiocb->ret);
-	free(aiocb);
 }
 
 static struct sheep_aiocb *sheep_aiocb_setup(struct sd_request *req)
 {
-	struct sheep_aiocb *aiocb = xmalloc(sizeof(*aiocb));
+	struct sheep_aiocb *aiocb = &req->aiocb;
 
 	aiocb->offset = req->offset;
 	aiocb->length = req->length;
@@ -129,6 +223,8 @@ static struct sheep_aiocb *sheep_aiocb_setup(struct sd_request *req)
 	aiocb->buf_iter = 0;
 	aiocb->request = req;
 	aiocb->buf = req->data;
+	aiocb->iov = req->iov;
+	aiocb->iov_off = 0;
 	aiocb->aio_done_func = aio_rw_done;
 	uatomic_set(&aiocb->nr_requests, 0);
 
@@ -189,41 +285,44 @@ err:
 	return ret;
 }
 
-static void do_reconnect(struct sd_cluster *c)
+static void do_reconnect(struct sd_conn *conn)
 {
+	struct sd_cluster *c = conn->c;
 	struct sheep_host *p = NULL;
 	int fd = -1, retry;
 
-	sd_mutex_lock(&c->submit_mutex);
-	close(c->sockfd);
+	sd_mutex_lock(&conn->submit_mutex);
+	close(conn->sockfd);
 	while (fd < 0) {
 		retry = c->nr_hosts;
 		while (retry--) {
-			p = c->hosts + c->host_index;
+			/* move on to the next node */
+			conn->host_index = (conn->host_index + 1) % c->nr_hosts;
+			p = c->hosts + conn->host_index;
 			fprintf(stderr, "\nReconnecting to %s:%d...\n",
 					p->addr, p->port);
 			fd = connect_to(p->addr, p->port);
-			c->host_index = (c->host_index + 1) % c->nr_hosts;
 			if (fd > 0)
 				break;
 		}
 	}
 
-	c->sockfd = fd;
-	uatomic_set_true(&c->connected);
-	sd_mutex_unlock(&c->submit_mutex);
+	conn->sockfd = fd;
+	uatomic_set_true(&conn->connected);
+	sd_mutex_unlock(&conn->submit_mutex);
 }
 
 static int do_submit_sheep_request(struct sheep_request *req)
 {
 	struct sd_req hdr = {}, *hdr_ptr = NULL;
-	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_conn *c = req->conn;
 	int ret = 0;
 	uint32_t wlen = 0;
 
 	switch (req->opcode) {
 	case VDI_CREATE:
 	case VDI_WRITE:
+	case INODE_UPDATE:
 		if (req->opcode == VDI_CREATE)
 			sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
 		else
@@ -239,7 +338,14 @@ static int do_submit_sheep_request(struct sheep_request *req)
 		ret = sheep_submit_sdreq(c, &hdr, req->buf, req->length);
 		break;
 	case VDI_READ:
-		sd_init_req(&hdr, SD_OP_READ_OBJ);
+		/* the node left by a reconnection serves it as a gateway */
+		if (req->nr_copies && c->host_index != req->host)
+			req->nr_copies = 0;
+		if (req->nr_copies) {
+			sd_init_req(&hdr, SD_OP_READ_PEER);
+			hdr.epoch = req->epoch;
+		} else
+			sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.id = req->seq_num;
 		hdr.data_length = req->length;
 		hdr.obj.oid = req->oid;
@@ -253,6 +359,12 @@ static int do_submit_sheep_request(struct sheep_request *req)
 			wlen = hdr_ptr->data_length;
 		ret = sheep_submit_sdreq(c, hdr_ptr, req->buf, wlen);
 		break;
+	case RING_UPDATE:
+		sd_init_req(&hdr, SD_OP_GET_NODE_LIST);
+		hdr.id = req->seq_num;
+		hdr.data_length = req->length;
+		ret = sheep_submit_sdreq(c, &hdr, NULL, 0);
+		break;
 	default:
 		panic("Invalid opcode %d", req->opcode);
 	}
@@ -260,46 +372,77 @@ static int do_submit_sheep_request(struct sheep_request *req)
 	return ret;
 }
 
-static void reconnect_and_resend(struct sd_cluster *c)
+static void reconnect_and_resend(struct sd_conn *conn)
 {
+	struct sd_cluster *c = conn->c;
 	struct sheep_request *request;
+	struct sd_inflight *bucket;
 	int ret;
 
 	/*
-	 * We don't free inflight_lock until all requests are resent to avoid
-	 * sending duplicated requests. If the connection lost again during the
-	 * period we resend requests, we just goto label again and resend all
-	 * requests for the next time.
+	 * If the connection lost again during the period we resend requests,
+	 * we just goto label again and resend all requests for the next time.
 	 *
 	 * Some requests might be resent twice or more in multiple disconnection
 	 * events so we might get more than one response for the same request.
 	 */
-	sd_read_lock(&c->inflight_lock);
 again:
-	do_reconnect(c);
+	do_reconnect(conn);
 
-	list_for_each_entry(request, &c->inflight_list, list) {
-		ret = do_submit_sheep_request(request);
-		if (ret > 0)
-			eventfd_xwrite(c->reply_fd, 1);
-		else
-			goto again;
+	for (int i = 0; i < (1U << SD_INFLIGHT_BITS); i++) {
+		bucket = c->inflight + i;
+		sd_mutex_lock(&bucket->lock);
+		list_for_each_entry(request, &bucket->list, list) {
+			if (request->conn != conn)
+				continue;
+			ret = do_submit_sheep_request(request);
+			if (ret > 0)
+				eventfd_xwrite(conn->reply_fd, 1);
+			else {
+				sd_mutex_unlock(&bucket->lock);
+				goto again;
+			}
+		}
+		sd_mutex_unlock(&bucket->lock);
 	}
+}
 
-	sd_rw_unlock(&c->inflight_lock);
+/*
+ * The requests to an object go through the same connection in order, but the
+ * direct reads, which go to a node holding a copy
+ */
+static struct sd_conn *pick_conn(struct sd_cluster *c,
+				  struct sheep_request *req)
+{
+	struct sd_conn *conn;
+	uint64_t hval;
+
+	if (req->nr_copies) {
+		conn = ring_pick_conn(c, req);
+		if (conn)
+			return conn;
+		req->nr_copies = 0;
+	}
+
+	hval = sd_hash_64(req->oid ? req->oid : req->seq_num);
+	return c->conns + hval % c->nr_conns;
 }
 
 int submit_sheep_request(struct sheep_request *req)
 {
 	int ret;
 	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_inflight *bucket = inflight_bucket(c, req->seq_num);
+	struct sd_conn *conn = pick_conn(c, req);
 
-	sd_write_lock(&c->inflight_lock);
-	list_add_tail(&req->list, &c->inflight_list);
-	sd_rw_unlock(&c->inflight_lock);
+	req->conn = conn;
+	uatomic_inc(&conn->nr_inflight);
+	sd_mutex_lock(&bucket->lock);
+	list_add_tail(&req->list, &bucket->list);
+	sd_mutex_unlock(&bucket->lock);
 
 	ret = do_submit_sheep_request(req);
-	eventfd_xwrite(c->reply_fd, 1);
+	eventfd_xwrite(conn->reply_fd, 1);
 
 	return ret;
 }
@@ -327,49 +470,37 @@ static int submit_request(struct sd_request *req)
 
 static void *request_handler(void *data)
 {
-	struct sd_request *req;
 	struct sd_cluster *c = data;
-
-	while (!uatomic_is_true(&c->stop_request_handler) ||
-	       !list_empty(&c->request_list)) {
-		bool empty;
-		uint64_t events;
-
-		events = eventfd_xread(c->request_fd);
-
-		sd_read_lock(&c->request_lock);
-		empty = list_empty(&c->request_list);
-		sd_rw_unlock(&c->request_lock);
-
-		if (empty)
-			continue;
-
-		for (uint64_t i = 0; i < events; i++) {
-			sd_write_lock(&c->request_lock);
-			req = list_first_entry(&c->request_list,
-				struct sd_request, list);
-			list_del(&req->list);
-			sd_rw_unlock(&c->request_lock);
-
-			submit_request(req);
-		}
+	struct sd_qnode *node;
+	bool stop = false;
+
+	while (!stop) {
+		/* the requests queued before the stop go out first */
+		stop = uatomic_is_true(&c->stop_request_handler);
+		if (!stop)
+			eventfd_xread(c->request_fd);
+
+		while ((node = sd_queue_pop(&c->request_queue)))
+			submit_request(container_of(node, struct sd_request,
+						    qnode));
 	}
 	pthread_exit(NULL);
 }
 
-static struct sheep_request *find_inflight_request(struct sd_cluster *c,
+static struct sheep_request *find_inflight_request(struct sd_conn *conn,
 						    uint32_t seq_num)
 {
+	struct sd_inflight *bucket = inflight_bucket(conn->c, seq_num);
 	struct sheep_request *req;
 
-	sd_read_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
-		if (req->seq_num == seq_num)
+	sd_mutex_lock(&bucket->lock);
+	list_for_each_entry(req, &bucket->list, list) {
+		if (req->seq_num == seq_num && req->conn == conn)
 			goto out;
 	}
 	req = NULL;
 out:
-	sd_rw_unlock(&c->inflight_lock);
+	sd_mutex_unlock(&bucket->lock);
 	return req;
 }
 
@@ -380,27 +511,30 @@ int end_sheep_request(struct sheep_request *req)
 	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
 		aiocb->aio_done_func(aiocb);
 
+	if (req->iov)
+		free(req->buf);
 	free(req);
 
 	return 0;
 }
 
-static int sheep_handle_reply(struct sd_cluster *c)
+static int sheep_handle_reply(struct sd_conn *conn)
 {
 	struct sd_rsp rsp = {};
 	struct sheep_request *req;
 	struct sheep_aiocb *aiocb;
+	struct sd_inflight *bucket;
 	int ret;
 	char *temp;
 
-	if (unlikely(!uatomic_is_true(&c->connected)))
+	if (unlikely(!uatomic_is_true(&conn->connected)))
 		goto reconnect;
 
-	ret = net_read(c->sockfd, (char *)&rsp, sizeof(rsp));
+	ret = net_read(conn->sockfd, (char *)&rsp, sizeof(rsp));
 	if (ret != sizeof(rsp))
 		goto err;
 
-	req = find_inflight_request(c, rsp.id);
+	req = find_inflight_request(conn, rsp.id);
 	if (!req)
 		/*
 		 * Some request might be sent more than once because of
@@ -409,14 +543,25 @@ static int sheep_handle_reply(struct sd_cluster *c)
 		goto discard;
 
 	if (rsp.data_length > 0) {
-		ret = net_read(c->sockfd, req->buf, rsp.data_length);
+		ret = net_read(conn->sockfd, req->buf, rsp.data_length);
 		if (ret != rsp.data_length)
 			goto err;
 	}
 
-	sd_write_lock(&c->inflight_lock);
+	bucket = inflight_bucket(conn->c, req->seq_num);
+	sd_mutex_lock(&bucket->lock);
 	list_del(&req->list);
-	sd_rw_unlock(&c->inflight_lock);
+	sd_mutex_unlock(&bucket->lock);
+	uatomic_dec(&conn->nr_inflight);
+
+	if (req->nr_copies && rsp.result != SD_RES_SUCCESS) {
+		/* e.g. the ring is of an old epoch, a gateway knows better */
+		if (rsp.epoch != req->epoch)
+			ring_update(conn->c, rsp.epoch);
+		req->nr_copies = 0;
+		submit_sheep_request(req);
+		return 0;
+	}
 
 	aiocb = req->aiocb;
 	aiocb->op = get_sd_op(req->opcode);
@@ -435,39 +580,35 @@ static int sheep_handle_reply(struct sd_cluster *c)
 
 	return ret;
 err:
-	uatomic_set_false(&c->connected);
+	uatomic_set_false(&conn->connected);
 reconnect:
-	reconnect_and_resend(c);
+	reconnect_and_resend(conn);
 	return -1;
 discard:
 	if (rsp.data_length == 0)
 		return 0;
 	temp = xmalloc(rsp.data_length);
-	net_read(c->sockfd, temp, rsp.data_length);
+	net_read(conn->sockfd, temp, rsp.data_length);
 	free(temp);
 	return 0;
 }
 
 static void *reply_handler(void *data)
 {
-	struct sd_cluster *c = data;
+	struct sd_conn *conn = data;
+	struct sd_cluster *c = conn->c;
 
-	while (!uatomic_is_true(&c->stop_request_handler) ||
-	       !list_empty(&c->inflight_list)) {
-		bool empty;
+	while (!uatomic_is_true(&c->stop_reply_handler) ||
+	       uatomic_read(&conn->nr_inflight)) {
 		uint64_t events;
 
-		events = eventfd_xread(c->reply_fd);
-
-		sd_read_lock(&c->inflight_lock);
-		empty = list_empty(&c->inflight_list);
-		sd_rw_unlock(&c->inflight_lock);
+		events = eventfd_xread(conn->reply_fd);
 
-		if (empty)
+		if (!uatomic_read(&conn->nr_inflight))
 			continue;
 
 		for (uint64_t i = 0; i < events; i++) {
-			int ret = sheep_handle_reply(c);
+			int ret = sheep_handle_reply(conn);
 			if (ret < 0)
 				break;
 		}
@@ -476,48 +617,105 @@ static void *reply_handler(void *data)
 	pthread_exit(NULL);
 }
 
+static void stop_conn_handler(struct sd_conn *conn)
+{
+	eventfd_xwrite(conn->reply_fd, 1);
+	pthread_join(conn->reply_thread, NULL);
+	close(conn->reply_fd);
+}
+
+static int init_conn_handler(struct sd_cluster *c, struct sd_conn *conn,
+			     int fd, unsigned int host_index)
+{
+	int ret;
+
+	conn->c = c;
+	conn->sockfd = fd;
+	conn->host_index = host_index;
+	sd_init_mutex(&conn->submit_mutex);
+	uatomic_set_true(&conn->connected);
+
+	conn->reply_fd = eventfd(0, 0);
+	if (conn->reply_fd < 0)
+		return -SD_RES_SYSTEM_ERROR;
+
+	ret = pthread_create(&conn->reply_thread, NULL, reply_handler, conn);
+	if (ret) {
+		close(conn->reply_fd);
+		return -SD_RES_SYSTEM_ERROR;
+	}
+	return SD_RES_SUCCESS;
+}
+
 static int init_cluster_handlers(struct sd_cluster *c)
 {
-	pthread_t thread;
 	int ret;
 
 	c->request_fd = eventfd(0, 0);
 	if (c->request_fd < 0)
 		return -SD_RES_SYSTEM_ERROR;
 
-	c->reply_fd = eventfd(0, 0);
-	if (c->reply_fd < 0) {
+	ret = pthread_create(&c->request_thread, NULL, request_handler, c);
+	if (ret) {
 		close(c->request_fd);
 		return -SD_RES_SYSTEM_ERROR;
 	}
 
-	ret = pthread_create(&thread, NULL, request_handler, c);
-	if (ret < 0) {
-		close(c->request_fd);
-		close(c->reply_fd);
-		return ret;
-	}
-	c->request_thread = thread;
-	ret = pthread_create(&thread, NULL, reply_handler, c);
-	if (ret < 0) {
-		close(c->reply_fd);
-		uatomic_set_true(&c->stop_request_handler);
-		eventfd_xwrite(c->request_fd, 1);
-		pthread_join(c->request_thread, NULL);
-		return ret;
-	}
-	c->reply_thread = thread;
-
 	return SD_RES_SUCCESS;
 }
 
-static int get_all_nodes(struct sd_cluster *c)
+static void stop_cluster_handlers(struct sd_cluster *c)
+{
+	uatomic_set_true(&c->stop_request_handler);
+	eventfd_xwrite(c->request_fd, 1);
+	pthread_join(c->request_thread, NULL);
+	close(c->request_fd);
+
+	uatomic_set_true(&c->stop_reply_handler);
+	for (int i = 0; i < c->nr_conns; i++)
+		stop_conn_handler(c->conns + i);
+}
+
+/*
+ * Get the flags of the cluster from the sheep of the fd, for the placement of
+ * the ring
+ */
+static int get_cluster_flags(int fd, uint16_t *flags)
+{
+	struct epoch_log *log = xzalloc(sizeof(*log));
+	struct sd_req hdr = {};
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret = SD_RES_SUCCESS;
+
+	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
+	hdr.data_length = sizeof(*log);
+
+	if (net_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    net_read(fd, rsp, sizeof(*rsp)) != sizeof(*rsp) ||
+	    rsp->data_length > sizeof(*log) ||
+	    net_read(fd, log, rsp->data_length) != rsp->data_length)
+		ret = SD_RES_EIO;
+	else if (rsp->result != SD_RES_SUCCESS)
+		ret = rsp->result;
+	else
+		*flags = log->flags;
+
+	free(log);
+	return ret;
+}
+
+/*
+ * Get the nodes from the sheep of the fd, before the connections are set up,
+ * and return them with the epoch of the list
+ */
+static int get_all_nodes(struct sd_cluster *c, int fd, struct sd_node **nodes_p,
+			 uint32_t *epoch)
 {
 	struct sd_node *nodes = NULL;
 	struct sd_req hdr = {};
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	unsigned int nodes_size;
-	int ret;
+	int ret = SD_RES_SUCCESS;
 
 	nodes_size = SD_MAX_NODES * sizeof(struct sd_node);
 	nodes = xzalloc(nodes_size);
@@ -525,7 +723,13 @@ static int get_all_nodes(struct sd_cluster *c)
 	sd_init_req(&hdr, SD_OP_GET_NODE_LIST);
 	hdr.data_length = nodes_size;
 
-	ret = sd_run_sdreq(c, &hdr, nodes);
+	if (net_write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    net_read(fd, rsp, sizeof(*rsp)) != sizeof(*rsp) ||
+	    rsp->data_length > nodes_size ||
+	    net_read(fd, nodes, rsp->data_length) != rsp->data_length)
+		ret = SD_RES_EIO;
+	else if (rsp->result != SD_RES_SUCCESS)
+		ret = rsp->result;
 	if (ret != SD_RES_SUCCESS) {
 		free(nodes);
 		return ret;
@@ -535,7 +739,6 @@ static int get_all_nodes(struct sd_cluster *c)
 
 	c->hosts = xzalloc(nr_nodes * sizeof(struct sheep_host));
 	c->nr_hosts = nr_nodes;
-	c->host_index = 0;
 
 	for (int i = 0; i < nr_nodes; i++) {
 		struct sheep_host *p = c->hosts + i;
@@ -547,19 +750,59 @@ static int get_all_nodes(struct sd_cluster *c)
 		}
 	}
 
-	free(nodes);
+	*nodes_p = nodes;
+	*epoch = rsp->epoch;
 	return ret;
 }
 
-struct sd_cluster *sd_connect(char *host)
+/* Open the connections after the first one, spread over the nodes */
+static void connect_more(struct sd_cluster *c, char *ip, unsigned int port,
+			 unsigned int nr_conns)
+{
+	unsigned int first = 0, index;
+	int fd = -1;
+
+	for (int i = 0; i < c->nr_hosts; i++) {
+		if (!strcmp(c->hosts[i].addr, ip) && c->hosts[i].port == port) {
+			first = i;
+			break;
+		}
+	}
+	c->conns[0].host_index = first;
+
+	while (c->nr_conns < nr_conns) {
+		for (int retry = 0; retry < c->nr_hosts; retry++) {
+			index = (first + c->nr_conns + retry) % c->nr_hosts;
+			fd = connect_to(c->hosts[index].addr,
+					c->hosts[index].port);
+			if (fd >= 0)
+				break;
+		}
+		if (fd < 0)
+			break;
+		if (init_conn_handler(c, c->conns + c->nr_conns, fd,
+				      index) != SD_RES_SUCCESS) {
+			close(fd);
+			break;
+		}
+		c->nr_conns++;
+	}
+}
+
+/* nr_conns is the number of the nodes if direct */
+static struct sd_cluster *cluster_connect(char *host, unsigned int nr_conns,
+					  bool direct)
 {
 	char *ip, *pt, *h = xstrdup(host);
 	unsigned port;
 	int fd, ret;
 	struct sd_cluster *c = NULL;
+	struct sd_node *nodes = NULL;
+	bool build_ring = false;
+	uint32_t epoch;
 
 	ip = strtok(h, ":");
-	if (!ip) {
+	if (!ip || (!nr_conns && !direct)) {
 		errno = SD_RES_INVALID_PARMS;
 		goto err;
 	}
@@ -582,56 +825,118 @@ struct sd_cluster *sd_connect(char *host)
 	}
 
 	c = xzalloc(sizeof(*c));
-	c->sockfd = fd;
+	ret = get_all_nodes(c, fd, &nodes, &epoch);
+	if (ret != SD_RES_SUCCESS) {
+		errno = ret;
+		goto err_close;
+	}
+	if (direct) {
+		uint16_t flags;
+
+		ret = get_cluster_flags(fd, &flags);
+		if (ret != SD_RES_SUCCESS) {
+			errno = ret;
+			goto err_close;
+		}
+		c->mixhash = !!(flags & SD_CLUSTER_FLAG_MIXHASH);
+		/* the ring has no vnodes of the disks */
+		build_ring = !(flags & SD_CLUSTER_FLAG_DISKMODE);
+	}
+	if (direct)
+		nr_conns = max(c->nr_hosts, 1U);
+
+	c->conns = xcalloc(nr_conns, sizeof(*c->conns));
+	sd_queue_init(&c->request_queue);
+	for (int i = 0; i < (1U << SD_INFLIGHT_BITS); i++) {
+		INIT_LIST_HEAD(&c->inflight[i].list);
+		sd_init_mutex(&c->inflight[i].lock);
+	}
+	INIT_LIST_HEAD(&c->creating_list);
+	INIT_LIST_HEAD(&c->blocking_list);
+	sd_init_rw_lock(&c->blocking_lock);
+	sd_init_rw_lock(&c->ring_lock);
+	sd_init_mutex(&c->pool_lock);
+	sd_queue_init(&c->complete_queue);
+	c->complete_fd = eventfd(0, 0);
+	if (c->complete_fd < 0) {
+		errno = SD_RES_SYSTEM_ERROR;
+		goto err_close;
+	}
 
 	ret = init_cluster_handlers(c);
 	if (ret < 0) {
 		errno = -ret;
+		close(c->complete_fd);
 		goto err_close;
 	};
 
-	uatomic_set_true(&c->connected);
-	INIT_LIST_HEAD(&c->request_list);
-	INIT_LIST_HEAD(&c->inflight_list);
-	INIT_LIST_HEAD(&c->blocking_list);
-	sd_init_rw_lock(&c->request_lock);
-	sd_init_rw_lock(&c->inflight_lock);
-	sd_init_rw_lock(&c->blocking_lock);
-	sd_init_mutex(&c->submit_mutex);
-
-	ret = get_all_nodes(c);
-	if (ret != SD_RES_SUCCESS) {
-		errno = ret;
-		goto err_close;
+	ret = init_conn_handler(c, c->conns, fd, 0);
+	if (ret < 0) {
+		errno = -ret;
+		goto err_stop;
 	}
+	c->nr_conns = 1;
+	connect_more(c, ip, port, nr_conns);
+	if (build_ring)
+		c->ring = ring_build(c, nodes, c->nr_hosts, epoch);
 
+	free(nodes);
 	free(h);
 	return c;
 
+err_stop:
+	sd_disconnect(c);
+	free(nodes);
+	free(h);
+	return NULL;
 err_close:
 	close(fd);
+	free(nodes);
 	free(c->hosts);
+	free(c->conns);
 	free(c);
 err:
 	free(h);
 	return NULL;
 }
 
+struct sd_cluster *sd_connect_nr(char *host, unsigned int nr_conns)
+{
+	return cluster_connect(host, nr_conns, false);
+}
+
+struct sd_cluster *sd_connect(char *host)
+{
+	return sd_connect_nr(host, SD_NR_CONNECTIONS);
+}
+
+struct sd_cluster *sd_connect_direct(char *host)
+{
+	return cluster_connect(host, 0, true);
+}
+
 int sd_disconnect(struct sd_cluster *c)
 {
-	uatomic_set_true(&c->stop_request_handler);
-	uatomic_set_true(&c->stop_reply_handler);
-	eventfd_xwrite(c->request_fd, 1);
-	eventfd_xwrite(c->reply_fd, 1);
-	pthread_join(c->request_thread, NULL);
-	pthread_join(c->reply_thread, NULL);
-	sd_destroy_rw_lock(&c->request_lock);
-	sd_destroy_rw_lock(&c->inflight_lock);
+	stop_cluster_handlers(c);
+	for (int i = 0; i < c->nr_conns; i++) {
+		sd_destroy_mutex(&c->conns[i].submit_mutex);
+		close(c->conns[i].sockfd);
+	}
+	for (int i = 0; i < (1U << SD_INFLIGHT_BITS); i++)
+		sd_destroy_mutex(&c->inflight[i].lock);
 	sd_destroy_rw_lock(&c->blocking_lock);
-	sd_destroy_mutex(&c->submit_mutex);
-	close(c->request_fd);
-	close(c->reply_fd);
-	close(c->sockfd);
+	sd_destroy_rw_lock(&c->ring_lock);
+	ring_free(c->ring);
+	while (c->request_pool) {
+		struct sd_request *req = container_of(c->request_pool,
+						      struct sd_request, qnode);
+
+		c->request_pool = req->qnode.next;
+		free(req);
+	}
+	sd_destroy_mutex(&c->pool_lock);
+	close(c->complete_fd);
+	free(c->conns);
 	free(c->hosts);
 	free(c);
 
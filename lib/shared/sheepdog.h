@@ -28,37 +28,109 @@ extern "C" {
 
 #include <arpa/inet.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 
-struct sd_cluster {
+/* The default number of the connections of a cluster, see sd_connect() */
+#define SD_NR_CONNECTIONS 4
+#define SD_INFLIGHT_BITS 8
+/* The sd_requests kept for reuse by a cluster */
+#define SD_REQUEST_POOL_SIZE 1024
+
+struct sheep_host {
+	char addr[INET_ADDRSTRLEN];
+	unsigned int port;
+};
+
+struct sd_qnode {
+	struct sd_qnode *next;
+};
+
+/* A lock-free queue of many producers and a single consumer */
+struct sd_queue {
+	struct sd_qnode *head, *tail;
+	struct sd_qnode stub;
+};
+
+/* A connection to a sheep, with the thread reading its replies */
+struct sd_conn {
+	struct sd_cluster *c;
 	int sockfd;
 	uatomic_bool connected;
-	struct sheep_host {
-		char addr[INET_ADDRSTRLEN];
-		unsigned int port;
-	} *hosts;
-	unsigned int nr_hosts;
 	unsigned int host_index;
+	uint32_t nr_inflight;
+	pthread_t reply_thread;
+	int reply_fd;
+	struct sd_mutex submit_mutex;
+};
+
+/* The requests sent and not replied yet, hashed by seq_num */
+struct sd_inflight {
+	struct list_head list;
+	struct sd_mutex lock;
+};
+
+struct sd_ring;
+
+struct sd_cluster {
+	struct sd_conn *conns;
+	unsigned int nr_conns;
+	struct sheep_host *hosts;
+	unsigned int nr_hosts;
 	uint32_t seq_num;
 	pthread_t request_thread;
-	pthread_t reply_thread;
-	int request_fd, reply_fd;
-	struct list_head request_list;
-	struct list_head inflight_list;
+	int request_fd;
+	struct sd_queue request_queue;
+	struct sd_inflight inflight[1U << SD_INFLIGHT_BITS];
+	/* the creations of the objects in flight, and the writes after them */
+	struct list_head creating_list;
 	struct list_head blocking_list;
 	uatomic_bool stop_request_handler;
 	uatomic_bool stop_reply_handler;
-	struct sd_rw_lock request_lock;
-	struct sd_rw_lock inflight_lock;
 	struct sd_rw_lock blocking_lock;
-	struct sd_mutex submit_mutex;
+	/* the vnode ring of sd_connect_direct(), NULL otherwise */
+	struct sd_ring *ring;
+	bool mixhash; /* the placement of SD_CLUSTER_FLAG_MIXHASH */
+	struct sd_rw_lock ring_lock;
+	uatomic_bool ring_updating;
+	/* the requests done, for the next ones */
+	struct sd_qnode *request_pool;
+	unsigned int nr_pooled;
+	struct sd_mutex pool_lock;
+	/* the I/Os of sd_vdi_submit() done, for sd_vdi_poll() */
+	struct sd_queue complete_queue;
+	int complete_fd;
 };
 
+struct sd_inode_update;
+
 struct sd_vdi {
 	struct sd_cluster *c;
 	struct sd_inode *inode;
 	uint32_t vid;
 	struct sd_rw_lock lock;
 	char *name;
+	/* the entries of the index not in the inode yet, see ops.c */
+	struct sd_mutex inode_lock;
+	uint32_t *dirty;
+	uint32_t nr_dirty, dirty_size;
+	struct list_head dirty_waiters;
+	struct sd_inode_update *updating;
+	bool inode_busy;
+};
+
+/*
+ * An I/O of sd_vdi_submit().  The caller sets the fields up to opaque, and
+ * keeps the I/O and its iovec until sd_vdi_poll() returns it.
+ */
+struct sd_io {
+	struct sd_vdi *vdi;
+	bool write;
+	const struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	void *opaque; /* for the caller */
+	int ret; /* the result, error code defined in sheepdog_proto.h */
+	struct sd_qnode qnode;
 };
 
 static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
@@ -73,11 +145,39 @@ static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
  *
  * @host: string in the form of IP:PORT that identify a valid Sheepdog cluster.
  *
+ * The cluster is served by SD_NR_CONNECTIONS connections, spread over the
+ * nodes of the cluster.
+ *
  * Return a cluster descriptor on success. Otherwise, return NULL in case of
  * error and set errno as error code defined in sheepdog_proto.h.
  */
 struct sd_cluster *sd_connect(char *host);
 
+/*
+ * Connect to the specified Sheepdog cluster with nr_conns connections.
+ *
+ * @host: string in the form of IP:PORT that identify a valid Sheepdog cluster.
+ * @nr_conns: the number of the connections, spread over the nodes.
+ *
+ * The requests to an object always go through the same connection.
+ * Return a cluster descriptor on success. Otherwise, return NULL in case of
+ * error and set errno as error code defined in sheepdog_proto.h.
+ */
+struct sd_cluster *sd_connect_nr(char *host, unsigned int nr_conns);
+
+/*
+ * Connect to the specified Sheepdog cluster with a connection to each node.
+ *
+ * @host: string in the form of IP:PORT that identify a valid Sheepdog cluster.
+ *
+ * The reads of the replicated vdis go directly to a node holding a copy of
+ * the object, placed from the vnode ring of the cluster, and fall back to a
+ * gateway when the ring is out of date.  The writes go through the gateways.
+ * Return a cluster descriptor on success. Otherwise, return NULL in case of
+ * error and set errno as error code defined in sheepdog_proto.h.
+ */
+struct sd_cluster *sd_connect_direct(char *host);
+
 /*
  * Disconnect to the specified sheepdog cluster.
  *
@@ -180,6 +280,23 @@ int sd_vdi_create(struct sd_cluster *c, char *name, uint64_t size);
 int sd_vdi_clone(struct sd_cluster *c, char *srcname,
 		 char *srctag, char *dstname);
 
+/*
+ * Clone many VDIs from a snapshot at once
+ *
+ * @c: pointer to the cluster descriptor
+ * @srcname: the source VDI name
+ * @srctag: the source VDI tag
+ * @dstnames: the destination VDI names
+ * @nr: the number of the destination VDIs
+ * @results: the error code of each clone, or NULL
+ *
+ * Return error code defined in sheepdog_proto.h, the first one of the clones.
+ * The clones take a single cluster operation for hundreds of them instead of
+ * one each, to provision many VDIs from a template.
+ */
+int sd_vdi_clone_many(struct sd_cluster *c, char *srcname, char *srctag,
+		      char **dstnames, int nr, int *results);
+
 /*
  * Delete a VDI in the cluster
  *
@@ -224,6 +341,86 @@ int sd_vdi_aread(struct sd_vdi *vdi, void *buf, size_t count, off_t offset,
 int sd_vdi_awrite(struct sd_vdi *vdi, void *buf, size_t count, off_t offset,
 		  void (*done_func)(void *, int), void *opaque);
 
+/*
+ * Read from a vdi descriptor at a given offset into several buffers.
+ *
+ * @vdi: pointer to the vdi descriptor.
+ * @iov: the buffers to hold the data, filled in order.
+ * @iovcnt: the number of the buffers.
+ * @offset: the start of the vdi we try to read.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_readv(struct sd_vdi *vdi, const struct iovec *iov, int iovcnt,
+		 off_t offset);
+
+/*
+ * Write to a vdi descriptor at a given offset from several buffers.
+ *
+ * @vdi: pointer to the vdi descriptor.
+ * @iov: the buffers holding the data, written in order.
+ * @iovcnt: the number of the buffers.
+ * @offset: the start of the vdi we try to write.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_writev(struct sd_vdi *vdi, const struct iovec *iov, int iovcnt,
+		  off_t offset);
+
+/*
+ * Submit a batch of I/Os asynchronously.
+ *
+ * @ios: the I/Os, on the vdis of the same cluster.
+ * @nr: the number of the I/Os.
+ *
+ * The I/Os are queued at once, and completed I/Os are returned by
+ * sd_vdi_poll().  No I/O is submitted if a write is on a snapshot.
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_submit(struct sd_io *ios, int nr);
+
+/*
+ * Get the I/Os of sd_vdi_submit() completed on the cluster.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @ios: the array to hold the I/Os completed.
+ * @nr: the size of the array.
+ * @wait: whether to wait for an I/O if none is completed.
+ *
+ * Only one thread may poll a cluster at a time.
+ * Return the number of the I/Os stored in ios.
+ */
+int sd_vdi_poll(struct sd_cluster *c, struct sd_io **ios, int nr, bool wait);
+
+/*
+ * Create the objects of a range of a vdi descriptor ahead of the writes.
+ *
+ * @vdi: pointer to the vdi descriptor.
+ * @count: the length of the range.
+ * @offset: the start of the range.
+ *
+ * The objects of the range not created yet are created with no data, and
+ * with the data of the parent for a clone, so later writes to the range need
+ * no creation nor update of the inode.
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_preallocate(struct sd_vdi *vdi, size_t count, off_t offset);
+
+/*
+ * Create the objects of a range of a vdi descriptor asynchronously.
+ *
+ * @vdi: pointer to the vdi descriptor.
+ * @count: the length of the range.
+ * @offset: the start of the range.
+ * @done_func: the address of the function that is called at request completion.
+ * @opaque: the address of user defined data structure that is expected
+ *          to be processed in done_func()
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_vdi_apreallocate(struct sd_vdi *vdi, size_t count, off_t offset,
+			void (*done_func)(void *, int), void *opaque);
+
 /*
  * Get the size of an opened vdi.
  *
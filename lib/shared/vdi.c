@@ -13,6 +13,7 @@
 
 #include "sheepdog.h"
 #include "internal.h"
+#include "internal_proto.h"
 
 static int lock_vdi(struct sd_vdi *vdi)
 {
@@ -46,8 +47,9 @@ static struct sd_vdi *alloc_vdi(struct sd_cluster *c, char *name)
 	struct sd_vdi *new = xzalloc(sizeof(*new));
 
 	new->name = strdup(name);
-	new->inode = xmalloc(sizeof(struct sd_inode));
 	sd_init_rw_lock(&new->lock);
+	sd_init_mutex(&new->inode_lock);
+	INIT_LIST_HEAD(&new->dirty_waiters);
 
 	return new;
 }
@@ -55,6 +57,8 @@ static struct sd_vdi *alloc_vdi(struct sd_cluster *c, char *name)
 static void free_vdi(struct sd_vdi *vdi)
 {
 	sd_destroy_rw_lock(&vdi->lock);
+	sd_destroy_mutex(&vdi->inode_lock);
+	free(vdi->dirty);
 	free(vdi->name);
 	free(vdi->inode);
 	free(vdi);
@@ -106,23 +110,60 @@ static int read_object(struct sd_cluster *c, uint64_t oid, void *data,
 }
 
 static int vdi_read_inode(struct sd_cluster *c, char *name,
-			  char *tag, struct sd_inode *inode, bool onlyheader)
+			  char *tag, struct sd_inode *inode)
 {
 	int ret;
 	uint32_t vid;
-	size_t len;
 
 	ret = find_vdi(c, name, tag, &vid);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	if (onlyheader)
-		len = SD_INODE_HEADER_SIZE;
-	else
-		len = SD_INODE_SIZE;
+	return read_object(c, vid_to_vdi_oid(vid), inode, SD_INODE_HEADER_SIZE,
+			   0, true);
+}
 
-	ret = read_object(c, vid_to_vdi_oid(vid), inode, len, 0, true);
+/*
+ * Read the inode of the vdi to open with the entries of the index in use only,
+ * instead of the 12 MB object.  The buffer has no room for gref[] nor for the
+ * entries beyond vdi_size, which the requests never reach.
+ */
+static int vdi_open_inode(struct sd_cluster *c, char *name, char *tag,
+			  struct sd_inode **inodep)
+{
+	struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+	size_t nr;
+	int ret;
 
+	ret = vdi_read_inode(c, name, tag, inode);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	if (inode->store_policy != 0) {
+		inode = xrealloc(inode, SD_INODE_SIZE);
+		ret = read_object(c, vid_to_vdi_oid(inode->vdi_id), inode,
+				  SD_INODE_SIZE, 0, true);
+		if (ret != SD_RES_SUCCESS)
+			goto err;
+		*inodep = inode;
+		return SD_RES_SUCCESS;
+	}
+
+	nr = (inode->vdi_size + (UINT64_C(1) << inode->block_size_shift) - 1) >>
+		inode->block_size_shift;
+	nr = min(nr, (size_t)SD_INODE_DATA_INDEX);
+	inode = xrealloc(inode, SD_INODE_HEADER_SIZE +
+			 nr * sizeof(inode->data_vdi_id[0]));
+	ret = read_object(c, vid_to_vdi_oid(inode->vdi_id), inode->data_vdi_id,
+			  nr * sizeof(inode->data_vdi_id[0]),
+			  SD_INODE_HEADER_SIZE, true);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	*inodep = inode;
+	return SD_RES_SUCCESS;
+err:
+	free(inode);
 	return ret;
 }
 
@@ -139,7 +180,7 @@ struct sd_vdi *sd_vdi_open(struct sd_cluster *c, char *name, char *tag)
 
 	new = alloc_vdi(c, name);
 
-	ret = vdi_read_inode(c, name, tag, new->inode, false);
+	ret = vdi_open_inode(c, name, tag, &new->inode);
 	if (ret != SD_RES_SUCCESS) {
 		errno = ret;
 		goto out_free;
@@ -165,28 +206,10 @@ static void queue_request(struct sd_request *req)
 {
 	struct sd_cluster *c = req->cluster;
 
-	sd_write_lock(&c->request_lock);
-	list_add_tail(&req->list, &c->request_list);
-	sd_rw_unlock(&c->request_lock);
-
+	sd_queue_push(&c->request_queue, &req->qnode);
 	eventfd_xwrite(c->request_fd, 1);
 }
 
-static struct sd_request *alloc_request(struct sd_cluster *c, void *data,
-					size_t count, uint8_t op)
-{
-	struct sd_request *req;
-
-	req = xzalloc(sizeof(*req));
-	req->cluster = c;
-	req->data = data;
-	req->length = count;
-	req->opcode = op;
-	INIT_LIST_NODE(&req->list);
-
-	return req;
-}
-
 struct sync_state {
 	int efd;
 	int ret;
@@ -196,14 +219,24 @@ static void sync_done_func(void *opaque, int ret)
 {
 	struct sync_state *s = opaque;
 
-	eventfd_xwrite(s->efd, 1);
 	s->ret = ret;
+	eventfd_xwrite(s->efd, 1);
+}
+
+/* The inode holds the index up to vdi_size only, see vdi_open_inode() */
+static bool vdi_io_in_range(const struct sd_vdi *vdi, off_t offset,
+			    size_t count)
+{
+	return offset >= 0 && offset + count <= vdi->inode->vdi_size;
 }
 
 int sd_vdi_read(struct sd_vdi *vdi, void *buf, size_t count, off_t offset)
 {
 	struct sync_state s = {};
 
+	if (!vdi_io_in_range(vdi, offset, count))
+		return SD_RES_INVALID_PARMS;
+
 	s.efd = eventfd(0, 0);
 	if (s.efd < 0)
 		return SD_RES_SYSTEM_ERROR;
@@ -237,6 +270,8 @@ int sd_vdi_write(struct sd_vdi *vdi, void *buf, size_t count, off_t offset)
 		fprintf(stderr, "Snapshot is READ-ONLY!\n");
 		return SD_RES_INVALID_PARMS;
 	}
+	if (!vdi_io_in_range(vdi, offset, count))
+		return SD_RES_INVALID_PARMS;
 
 	s.efd = eventfd(0, 0);
 	if (s.efd < 0)
@@ -249,6 +284,133 @@ int sd_vdi_write(struct sd_vdi *vdi, void *buf, size_t count, off_t offset)
 	return s.ret;
 }
 
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static struct sd_request *alloc_iov_request(struct sd_vdi *vdi,
+					    const struct iovec *iov,
+					    int iovcnt, off_t offset,
+					    uint8_t op)
+{
+	size_t count = iov_length(iov, iovcnt);
+	struct sd_request *req = alloc_request(vdi->c, NULL, count, op);
+
+	req->vdi = vdi;
+	req->offset = offset;
+	/* an empty iovec is not walked at all */
+	req->iov = count ? iov : NULL;
+
+	return req;
+}
+
+static int vdi_rwv(struct sd_vdi *vdi, const struct iovec *iov, int iovcnt,
+		   off_t offset, uint8_t op)
+{
+	struct sd_request *req;
+	struct sync_state s = {};
+
+	if (!vdi_io_in_range(vdi, offset, iov_length(iov, iovcnt)))
+		return SD_RES_INVALID_PARMS;
+
+	s.efd = eventfd(0, 0);
+	if (s.efd < 0)
+		return SD_RES_SYSTEM_ERROR;
+
+	req = alloc_iov_request(vdi, iov, iovcnt, offset, op);
+	req->done_func = sync_done_func;
+	req->opaque = &s;
+	queue_request(req);
+	eventfd_xread(s.efd);
+	close(s.efd);
+
+	return s.ret;
+}
+
+int sd_vdi_readv(struct sd_vdi *vdi, const struct iovec *iov, int iovcnt,
+		 off_t offset)
+{
+	return vdi_rwv(vdi, iov, iovcnt, offset, VDI_READ);
+}
+
+int sd_vdi_writev(struct sd_vdi *vdi, const struct iovec *iov, int iovcnt,
+		  off_t offset)
+{
+	if (vdi_is_snapshot(vdi->inode)) {
+		fprintf(stderr, "Snapshot is READ-ONLY!\n");
+		return SD_RES_INVALID_PARMS;
+	}
+
+	return vdi_rwv(vdi, iov, iovcnt, offset, VDI_WRITE);
+}
+
+static void submit_done_func(void *opaque, int ret)
+{
+	struct sd_io *io = opaque;
+	struct sd_cluster *c = io->vdi->c;
+
+	io->ret = ret;
+	sd_queue_push(&c->complete_queue, &io->qnode);
+	eventfd_xwrite(c->complete_fd, 1);
+}
+
+int sd_vdi_submit(struct sd_io *ios, int nr)
+{
+	struct sd_cluster *c;
+
+	if (nr <= 0)
+		return SD_RES_SUCCESS;
+
+	for (int i = 0; i < nr; i++) {
+		if (ios[i].write && vdi_is_snapshot(ios[i].vdi->inode)) {
+			fprintf(stderr, "Snapshot is READ-ONLY!\n");
+			return SD_RES_INVALID_PARMS;
+		}
+		if (!vdi_io_in_range(ios[i].vdi, ios[i].offset,
+				     iov_length(ios[i].iov, ios[i].iovcnt)))
+			return SD_RES_INVALID_PARMS;
+	}
+
+	c = ios[0].vdi->c;
+	for (int i = 0; i < nr; i++) {
+		struct sd_io *io = ios + i;
+		struct sd_request *req;
+
+		req = alloc_iov_request(io->vdi, io->iov, io->iovcnt,
+					io->offset,
+					io->write ? VDI_WRITE : VDI_READ);
+		req->done_func = submit_done_func;
+		req->opaque = io;
+		sd_queue_push(&c->request_queue, &req->qnode);
+	}
+	/* one wakeup of the request handler for the whole batch */
+	eventfd_xwrite(c->request_fd, 1);
+
+	return SD_RES_SUCCESS;
+}
+
+int sd_vdi_poll(struct sd_cluster *c, struct sd_io **ios, int nr, bool wait)
+{
+	struct sd_qnode *node;
+	int n = 0;
+
+	if (nr <= 0)
+		return 0;
+
+	for (;;) {
+		while (n < nr && (node = sd_queue_pop(&c->complete_queue)))
+			ios[n++] = container_of(node, struct sd_io, qnode);
+		if (n || !wait)
+			return n;
+		eventfd_xread(c->complete_fd);
+	}
+}
+
 int sd_vdi_close(struct sd_vdi *vdi)
 {
 	int ret;
@@ -340,7 +502,7 @@ int sd_vdi_snapshot(struct sd_cluster *c, char *name, char *snap_tag)
 		return SD_RES_INVALID_PARMS;
 
 	} else if (ret == SD_RES_NO_TAG) {
-		ret = vdi_read_inode(c, name, NULL, inode, true);
+		ret = vdi_read_inode(c, name, NULL, inode);
 		if (ret != SD_RES_SUCCESS) {
 			fprintf(stderr, "Failed to read inode: %s\n", name);
 			return ret;
@@ -426,8 +588,8 @@ int sd_vdi_clone(struct sd_cluster *c, char *srcname,
 		goto out;
 	}
 
-	inode = xmalloc(sizeof(struct sd_inode));
-	ret = vdi_read_inode(c, srcname, srctag, inode, false);
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = vdi_read_inode(c, srcname, srctag, inode);
 	if (ret != SD_RES_SUCCESS) {
 		fprintf(stderr, "Failed to read inode for VDI: %s "
 			"(tag: %s)\n", srcname, srctag);
@@ -445,6 +607,79 @@ out:
 	return ret;
 }
 
+int sd_vdi_clone_many(struct sd_cluster *c, char *srcname, char *srctag,
+		      char **dstnames, int nr, int *results)
+{
+	struct sd_new_vdi *nv = NULL;
+	struct sd_inode *inode = NULL;
+	struct sd_req hdr;
+	int ret, i;
+
+	if (!srctag || *srctag == '\0') {
+		fprintf(stderr, "Only snapshot VDIs can be cloned, "
+			"please specify snapshot tag\n");
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (!srcname || *srcname == '\0') {
+		fprintf(stderr, "Source VDI name can NOT be null!\n");
+		return SD_RES_INVALID_PARMS;
+	}
+
+	for (i = 0; i < nr; i++)
+		if (!dstnames[i] || *dstnames[i] == '\0') {
+			fprintf(stderr, "Destination VDI name can NOT be "
+				"null\n");
+			return SD_RES_INVALID_PARMS;
+		}
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = vdi_read_inode(c, srcname, srctag, inode);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read inode for VDI: %s "
+			"(tag: %s)\n", srcname, srctag);
+		goto out;
+	}
+
+	nv = xzalloc(sizeof(*nv) * nr);
+	for (i = 0; i < nr; i++) {
+		pstrcpy(nv[i].name, sizeof(nv[i].name), dstnames[i]);
+		nv[i].vdi_size = inode->vdi_size;
+		nv[i].base_vid = inode->vdi_id;
+		nv[i].result = SD_RES_SUCCESS;
+	}
+
+	for (i = 0; i < nr; i += SD_MAX_NEW_VDIS) {
+		int n = min(nr - i, SD_MAX_NEW_VDIS);
+
+		memset(&hdr, 0, sizeof(hdr));
+		sd_init_req(&hdr, SD_OP_NEW_VDIS);
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		hdr.data_length = n * sizeof(*nv);
+		hdr.vdi.store_policy = inode->store_policy;
+
+		ret = sd_run_sdreq(c, &hdr, nv + i);
+		if (ret != SD_RES_SUCCESS) {
+			fprintf(stderr, "Clone vdi failed:%s\n",
+				sd_strerr(ret));
+			for (int j = i; j < nr; j++)
+				nv[j].result = ret;
+			break;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (results)
+			results[i] = nv[i].result;
+		if (nv[i].result != SD_RES_SUCCESS && ret == SD_RES_SUCCESS)
+			ret = nv[i].result;
+	}
+out:
+	free(nv);
+	free(inode);
+	return ret;
+}
+
 int sd_vdi_delete(struct sd_cluster *c, char *name, char *tag)
 {
 	int ret;
@@ -506,8 +741,12 @@ int sd_run_sdreq(struct sd_cluster *c, struct sd_req *hdr, void *data)
 int sd_vdi_aread(struct sd_vdi *vdi, void *buf, size_t count, off_t offset,
 		 void (*done_func)(void *, int), void *opaque)
 {
-	struct sd_request *req = alloc_request(vdi->c, buf, count, VDI_READ);
+	struct sd_request *req;
 
+	if (!vdi_io_in_range(vdi, offset, count))
+		return SD_RES_INVALID_PARMS;
+
+	req = alloc_request(vdi->c, buf, count, VDI_READ);
 	req->vdi = vdi;
 	req->offset = offset;
 	req->done_func = done_func;
@@ -524,12 +763,55 @@ int sd_vdi_awrite(struct sd_vdi *vdi, void *buf, size_t count, off_t offset,
 		fprintf(stderr, "Snapshot is READ-ONLY!\n");
 		return SD_RES_INVALID_PARMS;
 	}
+	if (!vdi_io_in_range(vdi, offset, count))
+		return SD_RES_INVALID_PARMS;
 
 	vdi_awrite(vdi, buf, count, offset, done_func, opaque);
 
 	return SD_RES_SUCCESS;
 }
 
+int sd_vdi_apreallocate(struct sd_vdi *vdi, size_t count, off_t offset,
+			void (*done_func)(void *, int), void *opaque)
+{
+	struct sd_request *req;
+
+	if (vdi_is_snapshot(vdi->inode)) {
+		fprintf(stderr, "Snapshot is READ-ONLY!\n");
+		return SD_RES_INVALID_PARMS;
+	}
+	if (!count || offset + count > vdi->inode->vdi_size)
+		return SD_RES_INVALID_PARMS;
+
+	req = alloc_request(vdi->c, NULL, count, VDI_PREALLOC);
+	req->vdi = vdi;
+	req->offset = offset;
+	req->done_func = done_func;
+	req->opaque = opaque;
+	queue_request(req);
+
+	return SD_RES_SUCCESS;
+}
+
+int sd_vdi_preallocate(struct sd_vdi *vdi, size_t count, off_t offset)
+{
+	struct sync_state s = {};
+	int ret;
+
+	s.efd = eventfd(0, 0);
+	if (s.efd < 0)
+		return SD_RES_SYSTEM_ERROR;
+
+	ret = sd_vdi_apreallocate(vdi, count, offset, sync_done_func, &s);
+	if (ret == SD_RES_SUCCESS) {
+		eventfd_xread(s.efd);
+		ret = s.ret;
+	}
+	close(s.efd);
+
+	return ret;
+}
+
 uint64_t sd_vdi_getsize(struct sd_vdi *vdi)
 {
 	return vdi->inode->vdi_size;
@@ -553,7 +835,7 @@ int sd_vdi_resize(struct sd_cluster *c, char *name, uint64_t new_size)
 		goto out;
 	}
 
-	ret = vdi_read_inode(c, name, (char *)"", inode, true);
+	ret = vdi_read_inode(c, name, (char *)"", inode);
 	if (ret != SD_RES_SUCCESS) {
 		fprintf(stderr, "Failed to read inode for VDI: %s\n", name);
 		goto out;
@@ -613,7 +895,7 @@ int sd_vdi_rollback(struct sd_cluster *c, char *name, char *tag)
 		return SD_RES_INVALID_PARMS;
 	}
 
-	ret = vdi_read_inode(c, name, tag, inode, true);
+	ret = vdi_read_inode(c, name, tag, inode);
 	if (ret != SD_RES_SUCCESS) {
 		fprintf(stderr, "Read inode for VDI %s failed: %s\n",
 				name, sd_strerr(ret));
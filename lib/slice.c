@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Content-defined chunking of FastCDC for the slices of the farm, so that a
+ * few bytes inserted into an object only change the slices around them
+ * instead of all the ones after.  The slices are SLICE_SIZE on average and
+ * between SLICE_MIN_SIZE and SLICE_MAX_SIZE.
+ */
+
+#include "slice.h"
+#include "util.h"
+#include "sheepdog_proto.h"
+
+/*
+ * The top bits of the gear hash which must be zero for a cut, more of them
+ * before SLICE_SIZE and less after, to keep the slices near the average
+ */
+#define SLICE_BITS 17 /* log2(SLICE_SIZE) */
+#define SLICE_MASK_SMALL (~0ULL << (64 - SLICE_BITS - 2))
+#define SLICE_MASK_LARGE (~0ULL << (64 - SLICE_BITS + 2))
+
+static uint64_t gear[256];
+
+void slice_cut_init(void)
+{
+	uint64_t hval = sd_hash_64(SLICE_SIZE);
+
+	for (int i = 0; i < ARRAY_SIZE(gear); i++) {
+		hval = sd_hash_next(hval);
+		gear[i] = hval;
+	}
+}
+
+/* Return the length of the slice at the head of the buffer */
+size_t slice_cut(const uint8_t *p, size_t len)
+{
+	size_t i = SLICE_MIN_SIZE, normal = SLICE_SIZE;
+	uint64_t h = 0;
+
+	if (len <= SLICE_MIN_SIZE)
+		return len;
+	if (len > SLICE_MAX_SIZE)
+		len = SLICE_MAX_SIZE;
+	if (normal > len)
+		normal = len;
+
+	for (; i < normal; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & SLICE_MASK_SMALL))
+			return i + 1;
+	}
+	for (; i < len; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & SLICE_MASK_LARGE))
+			return i + 1;
+	}
+	return len;
+}
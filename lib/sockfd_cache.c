@@ -25,11 +25,36 @@
  *    5 the total number of FDs is scalable to massive nodes.
  *    6 total 3 APIs: sheep_{get,put,del}_sockfd().
  *    7 support dual connections to a single node.
+ *
+ * Besides the exclusive FDs, every node has MUX_CONNS multiplexed connections
+ * which are shared by all the threads.  A request on them is tagged with a
+ * unique sd_req.id and a dispatcher thread hands the response over to the
+ * waiting request by the id, so a connection can carry any number of
+ * outstanding requests.  See sockfd_mux_send().
+ *
+ * The requests sent on a multiplexed connection at the same time are queued
+ * and the first sender writes the queue with one sendmsg(), while the others
+ * wait for it, so a burst of small requests to a node costs a system call.
+ *
+ * Every traffic class of enum sockfd_class has its own FDs and multiplexed
+ * connections of the node, which carry the DSCP class set for it by
+ * sockfd_set_dscp().  The FD slots of the classes are interleaved, slot
+ * i * SOCKFD_NR_CLASSES + cls, so that they stay in place when fds_count grows.
+ *
+ * With sockfd_probe_init(), the nodes added to the cache are connected in the
+ * background, and the idle or unreachable ones are probed every
+ * PROBE_INTERVAL.  A node we failed to connect to is marked down and the
+ * requests to it fail at once, instead of waiting for the connect timeout,
+ * until the prober reaches it again or DOWN_RETRY passes.
  */
 
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include "sockfd_cache.h"
+#include "event.h"
 #include "work.h"
 #include "rbtree.h"
 #include "util.h"
@@ -58,20 +83,76 @@ static struct sockfd_cache sockfd_cache = {
 #define FDS_WATERMARK(x) ((x) * 3 / 4)
 #define DEFAULT_FDS_COUNT	8
 
-/* How many FDs we cache for one node */
+/* How many FDs we cache for one node, per traffic class */
 static int fds_count = DEFAULT_FDS_COUNT;
 
+static inline int nr_slots(void)
+{
+	return fds_count * SOCKFD_NR_CLASSES;
+}
+
+static int sockfd_dscp[SOCKFD_NR_CLASSES];
+
 struct sockfd_cache_fd {
 	int fd;
 	uatomic_bool in_use;
 };
 
+#define MUX_CONNS 4 /* per traffic class */
+#define MUX_SLOTS (MUX_CONNS * SOCKFD_NR_CLASSES)
+#define MUX_SEND_BATCH 32 /* requests written by one sendmsg() */
+
+struct sockfd_mux {
+	int fd;
+	int idx; /* in sockfd_cache_entry.mux, class * MUX_CONNS + n */
+	struct node_id nid;
+	bool zerocopy;
+
+	struct sd_mutex send_lock; /* protects the send queue */
+	struct sd_cond send_cond;
+	struct list_head sendq;
+	bool sending; /* a sender is writing the queue */
+	uint32_t next_id;
+
+	struct sd_mutex lock; /* protects the below */
+	struct list_head inflight;
+	int nr_inflight;
+	bool dead;
+
+	/* one for the dispatcher and one for each sending request */
+	refcnt_t refcnt;
+};
+
 struct sockfd_cache_entry {
 	struct rb_node rb;
 	struct node_id nid;
 	struct sockfd_cache_fd *fds;
+	struct sockfd_mux *mux[MUX_SLOTS];
+
+	/*
+	 * Smoothed latency and its mean deviation in microseconds, updated
+	 * without locking by the users, so a racing sample can be lost.
+	 */
+	uint64_t latency;
+	uint64_t latency_var;
+	uint64_t last_update; /* in nanoseconds */
+
+	/* when we failed to connect to the node, 0 if it's reachable */
+	uint64_t down_since;
+	uatomic_bool probing;
 };
 
+/* Latency samples older than this are considered as unknown */
+#define LATENCY_EXPIRE (10ULL * 1000000000) /* 10 seconds */
+
+/* The requests try to connect to a down node again after this */
+#define DOWN_RETRY (3ULL * 1000000000) /* 3 seconds */
+#define PROBE_INTERVAL 5000 /* in milliseconds */
+
+static struct work_queue *probe_wq;
+static void probe_node(struct sockfd_cache_entry *entry);
+static int mux_connect(const struct node_id *nid, enum sockfd_class cls);
+
 static int sockfd_cache_cmp(const struct sockfd_cache_entry *a,
 			    const struct sockfd_cache_entry *b)
 {
@@ -91,11 +172,12 @@ static struct sockfd_cache_entry *sockfd_cache_search(const struct node_id *nid)
 	return rb_search(&sockfd_cache.root, &key, rb, sockfd_cache_cmp);
 }
 
-static inline int get_free_slot(struct sockfd_cache_entry *entry)
+static inline int get_free_slot(struct sockfd_cache_entry *entry,
+				enum sockfd_class cls)
 {
 	int idx = -1, i;
 
-	for (i = 0; i < fds_count; i++) {
+	for (i = cls; i < nr_slots(); i += SOCKFD_NR_CLASSES) {
 		if (!uatomic_set_true(&entry->fds[i].in_use))
 			continue;
 		idx = i;
@@ -110,6 +192,7 @@ static inline int get_free_slot(struct sockfd_cache_entry *entry)
  * If no free slot available, this typically means we should use short FD.
  */
 static struct sockfd_cache_entry *sockfd_cache_grab(const struct node_id *nid,
+						    enum sockfd_class cls,
 						    int *ret_idx)
 {
 	struct sockfd_cache_entry *entry;
@@ -121,7 +204,7 @@ static struct sockfd_cache_entry *sockfd_cache_grab(const struct node_id *nid,
 		goto out;
 	}
 
-	*ret_idx = get_free_slot(entry);
+	*ret_idx = get_free_slot(entry, cls);
 	if (*ret_idx == -1)
 		entry = NULL;
 out:
@@ -132,16 +215,25 @@ out:
 static inline bool slots_all_free(struct sockfd_cache_entry *entry)
 {
 	int i;
-	for (i = 0; i < fds_count; i++)
+	for (i = 0; i < nr_slots(); i++)
 		if (uatomic_is_true(&entry->fds[i].in_use))
 			return false;
 	return true;
 }
 
+static inline int nr_slots_in_use(struct sockfd_cache_entry *entry)
+{
+	int i, nr = 0;
+	for (i = 0; i < nr_slots(); i++)
+		if (uatomic_is_true(&entry->fds[i].in_use))
+			nr++;
+	return nr;
+}
+
 static inline void destroy_all_slots(struct sockfd_cache_entry *entry)
 {
 	int i;
-	for (i = 0; i < fds_count; i++)
+	for (i = 0; i < nr_slots(); i++)
 		if (entry->fds[i].fd != -1)
 			close(entry->fds[i].fd);
 }
@@ -175,6 +267,11 @@ static bool sockfd_cache_destroy(const struct node_id *nid)
 		goto false_out;
 	}
 
+	/* the dispatcher fails the pending requests and frees them */
+	for (int i = 0; i < MUX_SLOTS; i++)
+		if (entry->mux[i])
+			shutdown(entry->mux[i]->fd, SHUT_RDWR);
+
 	rb_erase(&entry->rb, &sockfd_cache.root);
 	sd_rw_unlock(&sockfd_cache.lock);
 
@@ -189,11 +286,11 @@ false_out:
 
 static void sockfd_cache_add_nolock(const struct node_id *nid)
 {
-	struct sockfd_cache_entry *new = xmalloc(sizeof(*new));
+	struct sockfd_cache_entry *new = xzalloc(sizeof(*new));
 	int i;
 
-	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++)
+	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * nr_slots());
+	for (i = 0; i < nr_slots(); i++)
 		new->fds[i].fd = -1;
 
 	memcpy(&new->nid, nid, sizeof(struct node_id));
@@ -202,6 +299,7 @@ static void sockfd_cache_add_nolock(const struct node_id *nid)
 		return;
 	}
 	sockfd_cache.count++;
+	probe_node(new);
 }
 
 /* Add group of nodes to the cache */
@@ -223,9 +321,9 @@ void sockfd_cache_add(const struct node_id *nid)
 	int n, i;
 
 	sd_write_lock(&sockfd_cache.lock);
-	new = xmalloc(sizeof(*new));
-	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++)
+	new = xzalloc(sizeof(*new));
+	new->fds = xzalloc(sizeof(struct sockfd_cache_fd) * nr_slots());
+	for (i = 0; i < nr_slots(); i++)
 		new->fds[i].fd = -1;
 
 	memcpy(&new->nid, nid, sizeof(struct node_id));
@@ -234,6 +332,7 @@ void sockfd_cache_add(const struct node_id *nid)
 		sd_rw_unlock(&sockfd_cache.lock);
 		return;
 	}
+	probe_node(new);
 	sd_rw_unlock(&sockfd_cache.lock);
 	n = uatomic_add_return(&sockfd_cache.count, 1);
 	sd_debug("%s, count %d", addr_to_str(nid->addr, nid->port), n);
@@ -247,16 +346,16 @@ static struct work_queue *grow_wq;
 static void do_grow_fds(struct work *work)
 {
 	struct sockfd_cache_entry *entry;
-	int old_fds_count, new_fds_count, new_size, i;
+	int old_slots, new_slots, new_size, i;
 
 	sd_debug("%d", fds_count);
 	sd_write_lock(&sockfd_cache.lock);
-	old_fds_count = fds_count;
-	new_fds_count = fds_count * 2;
-	new_size = sizeof(struct sockfd_cache_fd) * fds_count * 2;
+	old_slots = fds_count * SOCKFD_NR_CLASSES;
+	new_slots = old_slots * 2;
+	new_size = sizeof(struct sockfd_cache_fd) * new_slots;
 	rb_for_each_entry(entry, &sockfd_cache.root, rb) {
 		entry->fds = xrealloc(entry->fds, new_size);
-		for (i = old_fds_count; i < new_fds_count; i++) {
+		for (i = old_slots; i < new_slots; i++) {
 			entry->fds[i].fd = -1;
 			uatomic_set_false(&entry->fds[i].in_use);
 		}
@@ -278,7 +377,7 @@ static inline void check_idx(int idx)
 {
 	struct work *w;
 
-	if (idx <= fds_high_watermark)
+	if (idx / SOCKFD_NR_CLASSES <= fds_high_watermark)
 		return;
 	if (!uatomic_set_true(&fds_in_grow))
 		return;
@@ -289,6 +388,41 @@ static inline void check_idx(int idx)
 	queue_work(grow_wq, w);
 }
 
+static void set_node_down(const struct node_id *nid, bool down)
+{
+	struct sockfd_cache_entry *entry;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry && !entry->down_since != !down) {
+		if (down)
+			sd_info("%s is unreachable",
+				addr_to_str(nid->addr, nid->port));
+		else
+			sd_info("%s is reachable again",
+				addr_to_str(nid->addr, nid->port));
+	}
+	if (entry)
+		entry->down_since = down ? clock_get_time() : 0;
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+/* Fail the requests to a down node until DOWN_RETRY passes */
+static bool node_is_down(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *entry;
+	bool down = false;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry && entry->down_since &&
+	    clock_get_time() - entry->down_since < DOWN_RETRY)
+		down = true;
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	return down;
+}
+
 /* Add the node back if it is still alive */
 static inline int revalidate_node(const struct node_id *nid)
 {
@@ -310,7 +444,8 @@ alive:
 }
 
 /* Try to create/get cached IO connection. If failed, fallback to non-IO one */
-static struct sockfd *sockfd_cache_get_long(const struct node_id *nid)
+static struct sockfd *sockfd_cache_get_long(const struct node_id *nid,
+					    enum sockfd_class cls)
 {
 	struct sockfd_cache_entry *entry;
 	struct sockfd *sfd;
@@ -318,7 +453,7 @@ static struct sockfd *sockfd_cache_get_long(const struct node_id *nid)
 	const uint8_t *addr = use_io ? nid->io_addr : nid->addr;
 	int fd, idx = -1, port = use_io ? nid->io_port : nid->port;
 grab:
-	entry = sockfd_cache_grab(nid, &idx);
+	entry = sockfd_cache_grab(nid, cls, &idx);
 	if (!entry) {
 		/*
 		 * The node is deleted, but someone asks us to grab it.
@@ -351,10 +486,14 @@ grab:
 				goto new;
 		}
 		uatomic_set_false(&entry->fds[idx].in_use);
+		set_node_down(nid, true);
 		return NULL;
 	}
 new:
+	sockfd_mark(fd, cls);
 	entry->fds[idx].fd = fd;
+	if (entry->down_since)
+		set_node_down(nid, false);
 out:
 	sfd = xmalloc(sizeof(*sfd));
 	sfd->fd = entry->fds[idx].fd;
@@ -397,6 +536,19 @@ static void sockfd_cache_close(const struct node_id *nid, int idx)
 	sd_rw_unlock(&sockfd_cache.lock);
 }
 
+/* Mark the connections of the traffic class with the DSCP class, 0 for none */
+void sockfd_set_dscp(enum sockfd_class cls, int dscp)
+{
+	sockfd_dscp[cls] = dscp;
+}
+
+/* Mark fd as a connection of the traffic class, if it has a DSCP class */
+void sockfd_mark(int fd, enum sockfd_class cls)
+{
+	if (sockfd_dscp[cls] && set_dscp(fd, sockfd_dscp[cls]) < 0)
+		sd_debug("failed to set the DSCP class of %d, %m", fd);
+}
+
 /*
  * Create work queue for growing fds.
  * Before this function called, growing cannot be done.
@@ -413,6 +565,143 @@ int sockfd_init(void)
 	return 0;
 }
 
+struct probe_work {
+	struct work work;
+	struct node_id nid;
+};
+
+static struct node_id probe_self;
+static struct timer probe_timer;
+
+/*
+ * Return true if the node answers a request on fd, whose round trip is the
+ * latency of the node unless it has a recent sample of the real requests
+ */
+static bool probe_fd(const struct node_id *nid, int fd)
+{
+	struct recovery_state rstate;
+	struct sd_req hdr;
+	struct sockfd_load load;
+	uint64_t start = clock_get_time();
+
+	sd_init_req(&hdr, SD_OP_STAT_RECOVERY);
+	hdr.data_length = sizeof(rstate);
+	if (exec_req(fd, &hdr, &rstate, NULL, 0, MAX_RETRY_COUNT))
+		return false;
+
+	sockfd_cache_get_load(nid, &load);
+	if (!load.latency)
+		sockfd_cache_update_latency(nid,
+					    (clock_get_time() - start) / 1000);
+	return true;
+}
+
+/* Check a cached connection of the node, or connect one if it has none */
+static void do_probe_node(struct work *work)
+{
+	struct probe_work *pw = container_of(work, struct probe_work, work);
+	const struct node_id *nid = &pw->nid;
+	struct sockfd_cache_entry *entry;
+	int idx, fd;
+
+	/* all the slots are in use, the node is alive */
+	entry = sockfd_cache_grab(nid, SOCKFD_FG, &idx);
+	if (!entry)
+		return;
+
+	if (entry->fds[idx].fd != -1) {
+		if (probe_fd(nid, entry->fds[idx].fd)) {
+			sockfd_cache_put_long(nid, idx);
+			set_node_down(nid, false);
+			return;
+		}
+		sd_debug("lost the connection to %s",
+			 addr_to_str(nid->addr, nid->port));
+		sockfd_cache_close(nid, idx);
+		entry = sockfd_cache_grab(nid, SOCKFD_FG, &idx);
+		if (!entry)
+			return;
+		if (entry->fds[idx].fd != -1) {
+			sockfd_cache_put_long(nid, idx);
+			return;
+		}
+	}
+
+	fd = mux_connect(nid, SOCKFD_FG);
+	if (fd < 0) {
+		sockfd_cache_put_long(nid, idx);
+		set_node_down(nid, true);
+		return;
+	}
+	sd_debug("warmed up %s idx %d", addr_to_str(nid->addr, nid->port), idx);
+	entry->fds[idx].fd = fd;
+	sockfd_cache_put_long(nid, idx);
+	set_node_down(nid, false);
+}
+
+static void probe_node_done(struct work *work)
+{
+	struct probe_work *pw = container_of(work, struct probe_work, work);
+	struct sockfd_cache_entry *entry;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(&pw->nid);
+	if (entry)
+		uatomic_set_false(&entry->probing);
+	sd_rw_unlock(&sockfd_cache.lock);
+	free(pw);
+}
+
+/* Called with sockfd_cache.lock held */
+static void probe_node(struct sockfd_cache_entry *entry)
+{
+	struct probe_work *pw;
+
+	if (!probe_wq || !node_id_cmp(&entry->nid, &probe_self) ||
+	    !uatomic_set_true(&entry->probing))
+		return;
+
+	pw = xzalloc(sizeof(*pw));
+	pw->nid = entry->nid;
+	pw->work.fn = do_probe_node;
+	pw->work.done = probe_node_done;
+	queue_work(probe_wq, &pw->work);
+}
+
+/* Probe the down nodes and the ones we haven't talked to recently */
+static void probe_timer_fn(void *data)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t now = clock_get_time();
+
+	sd_read_lock(&sockfd_cache.lock);
+	rb_for_each_entry(entry, &sockfd_cache.root, rb)
+		if (entry->down_since ||
+		    now - entry->last_update > LATENCY_EXPIRE)
+			probe_node(entry);
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	add_timer(&probe_timer, PROBE_INTERVAL);
+}
+
+/*
+ * Start connecting the nodes added to the cache in the background and probing
+ * them, except self.  The timer needs the event loop of the sheep.
+ */
+int sockfd_probe_init(const struct node_id *self)
+{
+	probe_wq = create_work_queue("sockfd_probe", WQ_DYNAMIC);
+	if (!probe_wq) {
+		sd_err("error at creating workqueue for sockfd probe");
+		return -1;
+	}
+
+	probe_self = *self;
+	probe_timer.callback = probe_timer_fn;
+	add_timer(&probe_timer, PROBE_INTERVAL);
+	return 0;
+}
+
 /*
  * Return a sockfd connected to the node to the caller
  *
@@ -422,12 +711,16 @@ int sockfd_init(void)
  *
  * ret_idx is opaque to the caller, -1 indicates it is a short FD.
  */
-struct sockfd *sockfd_cache_get(const struct node_id *nid)
+struct sockfd *sockfd_cache_get_class(const struct node_id *nid,
+				      enum sockfd_class cls)
 {
 	struct sockfd *sfd;
 	int fd;
 
-	sfd = sockfd_cache_get_long(nid);
+	if (node_is_down(nid))
+		return NULL;
+
+	sfd = sockfd_cache_get_long(nid, cls);
 	if (sfd)
 		return sfd;
 
@@ -435,6 +728,7 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid)
 	fd = connect_to_addr(nid->addr, nid->port);
 	if (fd < 0)
 		return NULL;
+	sockfd_mark(fd, cls);
 
 	sfd = xmalloc(sizeof(*sfd));
 	sfd->idx = -1;
@@ -443,6 +737,12 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid)
 	return sfd;
 }
 
+/* Same as sockfd_cache_get_class() for the I/O of the clients */
+struct sockfd *sockfd_cache_get(const struct node_id *nid)
+{
+	return sockfd_cache_get_class(nid, SOCKFD_FG);
+}
+
 /*
  * Release a sockfd connected to the node, which is acquired from
  * sockfd_cache_get()
@@ -495,3 +795,579 @@ void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd)
 	sockfd_cache_del_node(nid);
 	free(sfd);
 }
+
+/*
+ * Close a sockfd connected to the node without touching other connections.
+ *
+ * This is for the caller which gives up waiting for the response of a healthy
+ * node, so the connection can't be reused but the node is still alive.
+ */
+void sockfd_cache_drop(const struct node_id *nid, struct sockfd *sfd)
+{
+	if (sfd->idx == -1) {
+		sd_debug("%d", sfd->fd);
+		close(sfd->fd);
+		free(sfd);
+		return;
+	}
+
+	sockfd_cache_close(nid, sfd->idx);
+	free(sfd);
+}
+
+/* Feed a latency sample of a request to the node, in microseconds */
+void sockfd_cache_update_latency(const struct node_id *nid, uint64_t latency)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t now = clock_get_time(), delta;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (!entry)
+		goto out;
+
+	/* Same estimator as the TCP retransmission timer (RFC 6298) */
+	if (!entry->latency || now - entry->last_update > LATENCY_EXPIRE) {
+		entry->latency = latency ?: 1;
+		entry->latency_var = latency / 2;
+	} else {
+		delta = entry->latency > latency ? entry->latency - latency :
+			latency - entry->latency;
+		entry->latency_var = (entry->latency_var * 3 + delta) / 4;
+		entry->latency = (entry->latency * 7 + latency) / 8 ?: 1;
+	}
+	entry->last_update = now;
+out:
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+/*
+ * Get the load of the node as seen from this node.
+ *
+ * nr_inflight is the number of cached connections being used for the requests
+ * to the node and latency is 0 if we haven't talked to the node recently.
+ */
+void sockfd_cache_get_load(const struct node_id *nid, struct sockfd_load *load)
+{
+	struct sockfd_cache_entry *entry;
+
+	memset(load, 0, sizeof(*load));
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (!entry)
+		goto out;
+
+	load->nr_inflight = nr_slots_in_use(entry);
+	for (int i = 0; i < MUX_SLOTS; i++)
+		if (entry->mux[i])
+			load->nr_inflight +=
+				uatomic_read(&entry->mux[i]->nr_inflight);
+	if (clock_get_time() - entry->last_update <= LATENCY_EXPIRE) {
+		load->latency = entry->latency;
+		load->latency_var = entry->latency_var;
+	}
+	load->down = !!entry->down_since;
+out:
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+void sockfd_cache_get_stat(struct sockfd_stat *stat)
+{
+	struct sockfd_cache_entry *entry;
+
+	memset(stat, 0, sizeof(*stat));
+
+	sd_read_lock(&sockfd_cache.lock);
+	stat->nr_fds_per_node = nr_slots();
+	rb_for_each_entry(entry, &sockfd_cache.root, rb) {
+		stat->nr_nodes++;
+		for (int i = 0; i < nr_slots(); i++)
+			if (entry->fds[i].fd != -1)
+				stat->nr_fds++;
+		stat->nr_in_use += nr_slots_in_use(entry);
+		for (int i = 0; i < MUX_SLOTS; i++) {
+			if (!entry->mux[i])
+				continue;
+			stat->nr_mux++;
+			stat->nr_mux_inflight +=
+				uatomic_read(&entry->mux[i]->nr_inflight);
+		}
+	}
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+static int mux_epfd = -1;
+static pthread_once_t mux_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mux_efd_key;
+static sd_thread_t mux_thread;
+static __thread int thread_mux_efd = -1;
+static __thread int thread_mux_idx = -1;
+static int nr_mux_threads;
+
+static void mux_put(struct sockfd_mux *mux)
+{
+	if (refcount_dec(&mux->refcnt) > 0)
+		return;
+
+	sd_debug("%s idx %d", addr_to_str(mux->nid.addr, mux->nid.port),
+		 mux->idx);
+	close(mux->fd);
+	sd_destroy_cond(&mux->send_cond);
+	sd_destroy_mutex(&mux->send_lock);
+	sd_destroy_mutex(&mux->lock);
+	free(mux);
+}
+
+/* Wake up the sender, which may free mreq right after it */
+static void mux_complete(struct sockfd_mux_req *mreq)
+{
+	int efd = mreq->efd;
+
+	uatomic_set_true(&mreq->done);
+	eventfd_xwrite(efd, 1);
+}
+
+/* Called by the dispatcher when the connection is broken */
+static void mux_fail(struct sockfd_mux *mux)
+{
+	struct sockfd_cache_entry *entry;
+	struct sockfd_mux_req *mreq;
+
+	sd_debug("%s idx %d", addr_to_str(mux->nid.addr, mux->nid.port),
+		 mux->idx);
+	epoll_ctl(mux_epfd, EPOLL_CTL_DEL, mux->fd, NULL);
+
+	sd_mutex_lock(&mux->lock);
+	mux->dead = true;
+	list_for_each_entry(mreq, &mux->inflight, list) {
+		list_del(&mreq->list);
+		mreq->rsp.result = SD_RES_NETWORK_ERROR;
+		mux_complete(mreq);
+	}
+	uatomic_set(&mux->nr_inflight, 0);
+	sd_mutex_unlock(&mux->lock);
+
+	/* the next sender reconnects */
+	sd_write_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(&mux->nid);
+	if (entry && entry->mux[mux->idx] == mux)
+		entry->mux[mux->idx] = NULL;
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	mux_put(mux);
+}
+
+static int mux_discard(int fd, uint32_t len)
+{
+	char buf[4096];
+
+	while (len) {
+		uint32_t n = min(len, (uint32_t)sizeof(buf));
+
+		if (do_read(fd, buf, n, NULL, 0, MAX_RETRY_COUNT))
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Receive one response and complete its request */
+static int mux_recv(struct sockfd_mux *mux)
+{
+	struct sockfd_mux_req *mreq = NULL;
+	struct sd_rsp rsp;
+	uint32_t len;
+	int ret;
+
+	if (do_read(mux->fd, &rsp, sizeof(rsp), NULL, 0, MAX_RETRY_COUNT))
+		return -1;
+
+	sd_mutex_lock(&mux->lock);
+	list_for_each_entry(mreq, &mux->inflight, list) {
+		if (mreq->id != rsp.id)
+			continue;
+		list_del(&mreq->list);
+		uatomic_set(&mux->nr_inflight, mux->nr_inflight - 1);
+		uatomic_set_true(&mreq->claimed);
+		goto found;
+	}
+	mreq = NULL;
+found:
+	sd_mutex_unlock(&mux->lock);
+
+	/* The response of a cancelled request is just dropped */
+	if (!mreq)
+		return mux_discard(mux->fd, rsp.data_length);
+
+	len = min(rsp.data_length, mreq->buf_len);
+	ret = do_read(mux->fd, mreq->buf, len, NULL, 0, MAX_RETRY_COUNT);
+	if (!ret && rsp.data_length > len) {
+		sd_err("response of %x is too long, %"PRIu32, rsp.opcode,
+		       rsp.data_length);
+		ret = mux_discard(mux->fd, rsp.data_length - len);
+	}
+
+	mreq->rsp = rsp;
+	if (ret)
+		mreq->rsp.result = SD_RES_NETWORK_ERROR;
+	mux_complete(mreq);
+	return ret;
+}
+
+static void *mux_dispatcher(void *arg)
+{
+	struct epoll_event events[64];
+	int nr;
+
+	while (true) {
+		nr = epoll_wait(mux_epfd, events, ARRAY_SIZE(events), -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("epoll_wait failed, %m");
+		}
+
+		for (int i = 0; i < nr; i++) {
+			struct sockfd_mux *mux = events[i].data.ptr;
+			uint32_t ev = events[i].events;
+
+			/* Completions of the zero copy sends come as EPOLLERR */
+			if ((ev & (EPOLLERR | EPOLLHUP)) == EPOLLERR &&
+			    mux->zerocopy && reap_zerocopy(mux->fd))
+				ev &= ~EPOLLERR;
+
+			if (ev & (EPOLLERR | EPOLLHUP) ||
+			    (ev & EPOLLIN && mux_recv(mux) < 0))
+				mux_fail(mux);
+		}
+	}
+	return NULL;
+}
+
+static void close_mux_efd(void *arg)
+{
+	close((int)(intptr_t)arg - 1);
+}
+
+static int mux_init_ret = -1;
+
+static void mux_init(void)
+{
+	int ret;
+
+	mux_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (mux_epfd < 0) {
+		sd_err("failed to create epoll fd, %m");
+		return;
+	}
+
+	ret = pthread_key_create(&mux_efd_key, close_mux_efd);
+	if (ret) {
+		sd_err("failed to create a thread key, %s", strerror(ret));
+		return;
+	}
+
+	ret = sd_thread_create("sockfd_mux", &mux_thread, mux_dispatcher,
+			       NULL);
+	if (ret) {
+		sd_err("failed to create the dispatcher, %s", strerror(ret));
+		return;
+	}
+	mux_init_ret = 0;
+}
+
+/*
+ * Return the eventfd of this thread, which is written every time a request
+ * sent by this thread is done.
+ */
+int sockfd_mux_efd(void)
+{
+	if (thread_mux_efd < 0) {
+		thread_mux_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (thread_mux_efd < 0)
+			panic("failed to create an eventfd, %m");
+		pthread_setspecific(mux_efd_key,
+				    (void *)(intptr_t)(thread_mux_efd + 1));
+	}
+	return thread_mux_efd;
+}
+
+static int mux_connect(const struct node_id *nid, enum sockfd_class cls)
+{
+	int fd = -1;
+
+	if (nid->io_port) {
+		fd = connect_to_addr(nid->io_addr, nid->io_port);
+		if (fd < 0)
+			sd_err("fallback to non-io connection");
+	}
+	if (fd < 0)
+		fd = connect_to_addr(nid->addr, nid->port);
+	if (fd >= 0)
+		sockfd_mark(fd, cls);
+	return fd;
+}
+
+/*
+ * Get a multiplexed connection of the traffic class to the node with a
+ * reference on it
+ */
+static struct sockfd_mux *mux_get(const struct node_id *nid,
+				  enum sockfd_class cls)
+{
+	struct sockfd_cache_entry *entry;
+	struct epoll_event ev = {};
+	struct sockfd_mux *mux;
+	bool revalidated = false;
+	int fd, idx;
+
+	/* threads are spread over the connections */
+	if (thread_mux_idx < 0)
+		thread_mux_idx = uatomic_add_return(&nr_mux_threads, 1);
+	idx = cls * MUX_CONNS + thread_mux_idx % MUX_CONNS;
+again:
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	mux = entry ? entry->mux[idx] : NULL;
+	if (mux)
+		refcount_inc(&mux->refcnt);
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	if (mux)
+		return mux;
+	if (!entry) {
+		/* see sockfd_cache_get_long() */
+		if (revalidated || !revalidate_node(nid))
+			return NULL;
+		revalidated = true;
+		goto again;
+	}
+	if (node_is_down(nid))
+		return NULL;
+
+	fd = mux_connect(nid, cls);
+	if (fd < 0) {
+		set_node_down(nid, true);
+		return NULL;
+	}
+	set_node_down(nid, false);
+
+	mux = xzalloc(sizeof(*mux));
+	mux->fd = fd;
+	mux->idx = idx;
+	mux->nid = *nid;
+	sd_init_mutex(&mux->send_lock);
+	sd_cond_init(&mux->send_cond);
+	INIT_LIST_HEAD(&mux->sendq);
+	sd_init_mutex(&mux->lock);
+	INIT_LIST_HEAD(&mux->inflight);
+	refcount_set(&mux->refcnt, 2);
+
+	sd_write_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (!entry || entry->mux[idx]) {
+		/* lost the race, use the one of the winner */
+		sd_rw_unlock(&sockfd_cache.lock);
+		refcount_set(&mux->refcnt, 1);
+		mux_put(mux);
+		goto again;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = mux;
+	if (epoll_ctl(mux_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		sd_rw_unlock(&sockfd_cache.lock);
+		sd_err("failed to add the connection to the dispatcher, %m");
+		refcount_set(&mux->refcnt, 1);
+		mux_put(mux);
+		return NULL;
+	}
+	entry->mux[idx] = mux;
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	sd_debug("create multiplexed connection %s idx %d",
+		 addr_to_str(nid->addr, nid->port), idx);
+	return mux;
+}
+
+/*
+ * Write the queued requests of the connection, called with send_lock held by
+ * the sender which set mux->sending
+ *
+ * The requests of a batch share one sendmsg() and the retries of the caller.
+ * A zerocopy request is sent alone, as only its data may go with
+ * MSG_ZEROCOPY.
+ */
+static void mux_flush(struct sockfd_mux *mux, bool (*need_retry)(uint32_t),
+		      uint32_t epoch)
+{
+	struct sockfd_mux_req *batch[MUX_SEND_BATCH], *mreq;
+	struct iovec iov[MUX_SEND_BATCH * 2];
+	int nr, nr_iov, ret = 0;
+
+	while (!list_empty(&mux->sendq)) {
+		nr = nr_iov = 0;
+		while (nr < MUX_SEND_BATCH && !list_empty(&mux->sendq)) {
+			mreq = list_first_entry(&mux->sendq,
+						struct sockfd_mux_req,
+						send_list);
+			if (nr && mreq->zerocopy)
+				break;
+			list_del(&mreq->send_list);
+			batch[nr++] = mreq;
+			if (mreq->zerocopy)
+				break;
+
+			iov[nr_iov].iov_base = mreq->hdr;
+			iov[nr_iov++].iov_len = sizeof(*mreq->hdr);
+			if (mreq->wlen) {
+				iov[nr_iov].iov_base = mreq->data;
+				iov[nr_iov++].iov_len = mreq->wlen;
+			}
+		}
+		sd_mutex_unlock(&mux->send_lock);
+
+		/* the stream is broken after a partial request */
+		if (!ret && batch[0]->zerocopy)
+			ret = send_req_zerocopy(mux->fd, batch[0]->hdr,
+						batch[0]->data, batch[0]->wlen,
+						need_retry, epoch,
+						MAX_RETRY_COUNT);
+		else if (!ret)
+			ret = send_reqs(mux->fd, iov, nr_iov, need_retry,
+					epoch, MAX_RETRY_COUNT);
+
+		sd_mutex_lock(&mux->send_lock);
+		for (int i = 0; i < nr; i++) {
+			batch[i]->send_ret = ret;
+			batch[i]->sent = true;
+		}
+		sd_cond_broadcast(&mux->send_cond);
+	}
+}
+
+/*
+ * Send a request to the node over a multiplexed connection of its traffic
+ * class
+ *
+ * hdr->id is overwritten to match the response.  On success, the caller must
+ * call sockfd_mux_finish() after the request is done or when it gives up
+ * waiting for it.  The response is in mreq->rsp, whose result is
+ * SD_RES_NETWORK_ERROR if the connection is broken.
+ */
+int sockfd_mux_send(const struct node_id *nid, struct sd_req *hdr, void *data,
+		    unsigned int wlen, bool zerocopy,
+		    bool (*need_retry)(uint32_t), uint32_t epoch,
+		    struct sockfd_mux_req *mreq)
+{
+	struct sockfd_mux *mux;
+	int ret;
+
+	pthread_once(&mux_once, mux_init);
+	if (mux_init_ret < 0)
+		return -1;
+
+	mux = mux_get(nid, sockfd_req_class(hdr));
+	if (!mux)
+		return -1;
+
+	mreq->mux = mux;
+	mreq->efd = sockfd_mux_efd();
+	uatomic_set_false(&mreq->claimed);
+	uatomic_set_false(&mreq->done);
+
+	sd_mutex_lock(&mux->send_lock);
+	if (zerocopy && !mux->zerocopy) {
+		if (set_zerocopy(mux->fd) == 0)
+			mux->zerocopy = true;
+		else
+			zerocopy = false;
+	}
+
+	hdr->id = mreq->id = mux->next_id++;
+	sd_mutex_lock(&mux->lock);
+	if (mux->dead) {
+		sd_mutex_unlock(&mux->lock);
+		sd_mutex_unlock(&mux->send_lock);
+		mux_put(mux);
+		return -1;
+	}
+	/* register it first, the response can come before send_req returns */
+	list_add_tail(&mreq->list, &mux->inflight);
+	uatomic_set(&mux->nr_inflight, mux->nr_inflight + 1);
+	sd_mutex_unlock(&mux->lock);
+
+	mreq->hdr = hdr;
+	mreq->data = data;
+	mreq->wlen = wlen;
+	mreq->zerocopy = zerocopy;
+	mreq->sent = false;
+	list_add_tail(&mreq->send_list, &mux->sendq);
+	while (!mreq->sent && mux->sending)
+		sd_cond_wait(&mux->send_cond, &mux->send_lock);
+	if (!mreq->sent) {
+		/* nobody is writing, send ours and what queues meanwhile */
+		mux->sending = true;
+		mux_flush(mux, need_retry, epoch);
+		mux->sending = false;
+	}
+	ret = mreq->send_ret;
+	sd_mutex_unlock(&mux->send_lock);
+
+	if (ret) {
+		/* a partial request breaks the stream */
+		shutdown(mux->fd, SHUT_RDWR);
+		sockfd_mux_finish(mreq);
+		return -1;
+	}
+	return 0;
+}
+
+/* Release the request, waiting for the dispatcher if it's receiving it */
+void sockfd_mux_finish(struct sockfd_mux_req *mreq)
+{
+	struct sockfd_mux *mux = mreq->mux;
+	struct pollfd pfd = { .fd = mreq->efd, .events = POLLIN };
+	bool pending = false;
+
+	sd_mutex_lock(&mux->lock);
+	if (!uatomic_is_true(&mreq->claimed) && !sockfd_mux_done(mreq)) {
+		list_del(&mreq->list);
+		uatomic_set(&mux->nr_inflight, mux->nr_inflight - 1);
+		pending = true;
+	}
+	sd_mutex_unlock(&mux->lock);
+
+	/* Callers check sockfd_mux_done() before waiting on the eventfd */
+	while (!pending && !sockfd_mux_done(mreq)) {
+		poll(&pfd, 1, 1000);
+		eventfd_xread(mreq->efd);
+	}
+
+	mux_put(mux);
+}
+
+/*
+ * Let the request wake up efd instead of the eventfd of the sender, so that
+ * another thread can wait for it after the sender goes away
+ */
+void sockfd_mux_rebind(struct sockfd_mux_req *mreq, int efd)
+{
+	struct sockfd_mux *mux = mreq->mux;
+	struct pollfd pfd = { .fd = mreq->efd, .events = POLLIN };
+	bool rebound = false;
+
+	sd_mutex_lock(&mux->lock);
+	if (!uatomic_is_true(&mreq->claimed) && !sockfd_mux_done(mreq)) {
+		mreq->efd = efd;
+		rebound = true;
+	}
+	sd_mutex_unlock(&mux->lock);
+
+	/* The dispatcher is completing it with the old eventfd */
+	while (!rebound && !sockfd_mux_done(mreq)) {
+		poll(&pfd, 1, 1000);
+		eventfd_xread(pfd.fd);
+	}
+}
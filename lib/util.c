@@ -21,6 +21,7 @@
 #include <fcntl.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>
+#include <malloc.h>
 
 #include "util.h"
 
@@ -109,6 +110,103 @@ void *xvalloc(size_t size)
 	return ret;
 }
 
+/* in bytes, protected by uatomic primitives */
+static uint64_t mem_used[SD_MEM_NR_TAGS];
+static uint64_t mem_cap[SD_MEM_NR_TAGS];
+
+static const char * const mem_tag_names[SD_MEM_NR_TAGS] = {
+	[SD_MEM_RECOVERY] = "recovery",
+	[SD_MEM_OBJLIST] = "objlist",
+	[SD_MEM_REQUEST] = "request",
+	[SD_MEM_VNODE] = "vnode",
+	[SD_MEM_INODE] = "inode",
+	[SD_MEM_KV] = "kv",
+};
+
+/* Account size bytes, negative for the ones released, to the tag */
+void sd_mem_charge(enum sd_mem_tag tag, int64_t size)
+{
+	uatomic_add(&mem_used[tag], size);
+}
+
+void *xmalloc_tag(size_t size, enum sd_mem_tag tag)
+{
+	void *ret = xmalloc(size);
+
+	sd_mem_charge(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+void *xzalloc_tag(size_t size, enum sd_mem_tag tag)
+{
+	void *ret = xzalloc(size);
+
+	sd_mem_charge(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+void *xrealloc_tag(void *ptr, size_t size, enum sd_mem_tag tag)
+{
+	size_t old = malloc_usable_size(ptr);
+	void *ret = xrealloc(ptr, size);
+
+	sd_mem_charge(tag, (int64_t)malloc_usable_size(ret) - (int64_t)old);
+	return ret;
+}
+
+void *xvalloc_tag(size_t size, enum sd_mem_tag tag)
+{
+	void *ret = xvalloc(size);
+
+	sd_mem_charge(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+void free_tag(void *ptr, enum sd_mem_tag tag)
+{
+	if (!ptr)
+		return;
+
+	sd_mem_charge(tag, -(int64_t)malloc_usable_size(ptr));
+	free(ptr);
+}
+
+uint64_t sd_mem_used(enum sd_mem_tag tag)
+{
+	return uatomic_read(&mem_used[tag]);
+}
+
+uint64_t sd_mem_cap(enum sd_mem_tag tag)
+{
+	return uatomic_read(&mem_cap[tag]);
+}
+
+/* A soft cap, 0 for none, which the subsystem backs off at when it can */
+void sd_mem_set_cap(enum sd_mem_tag tag, uint64_t cap)
+{
+	uatomic_set(&mem_cap[tag], cap);
+}
+
+bool sd_mem_over_cap(enum sd_mem_tag tag)
+{
+	uint64_t cap = uatomic_read(&mem_cap[tag]);
+
+	return cap && uatomic_read(&mem_used[tag]) > cap;
+}
+
+const char *sd_mem_tag_name(enum sd_mem_tag tag)
+{
+	return mem_tag_names[tag];
+}
+
+int sd_mem_tag_by_name(const char *name)
+{
+	for (int i = 0; i < SD_MEM_NR_TAGS; i++)
+		if (!strcmp(mem_tag_names[i], name))
+			return i;
+	return -1;
+}
+
 /* preallocate the whole object */
 int prealloc(int fd, uint64_t size)
 {
@@ -645,3 +743,133 @@ int xsemop(int semid, struct sembuf *sops, unsigned nsops)
 
 	return ret;
 }
+
+bool is_zero_block(const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	/* compare the buffer to itself shifted by the first 16 bytes */
+	if (len <= 16) {
+		for (size_t i = 0; i < len; i++)
+			if (p[i])
+				return false;
+		return true;
+	}
+	return !p[0] && !memcmp(p, p + 1, 15) && !memcmp(p, p + 16, len - 16);
+}
+
+/*
+ * Return the start of the first extent of non-zero blocks of buf at or after
+ * pos, or len if there is none, and its length in ext_len.
+ */
+size_t sparse_next_extent(const char *buf, size_t len, size_t pos,
+			  size_t *ext_len)
+{
+	size_t start, end;
+
+	for (start = pos; start < len; start += SPARSE_BLOCK_SIZE)
+		if (!is_zero_block(buf + start,
+				   min(len - start, (size_t)SPARSE_BLOCK_SIZE)))
+			break;
+	for (end = start; end < len; end += SPARSE_BLOCK_SIZE)
+		if (is_zero_block(buf + end,
+				  min(len - end, (size_t)SPARSE_BLOCK_SIZE)))
+			break;
+
+	start = min(start, len);
+	*ext_len = min(end, len) - start;
+	return start;
+}
+
+/*
+ * Encode len bytes of buf into out, which has room for len bytes.  Return the
+ * size of the sparse buffer, or 0 if it isn't smaller than buf.
+ */
+size_t sparse_encode(const void *buf, size_t len, void *out)
+{
+	uint32_t nr = 0;
+	size_t pos = 0, ext_len, data_len = 0, hdr_len;
+	char *p;
+
+	/* count the extents first to know where the data starts */
+	while ((pos = sparse_next_extent(buf, len, pos, &ext_len)) < len) {
+		nr++;
+		data_len += ext_len;
+		pos += ext_len;
+	}
+
+	hdr_len = sizeof(nr) + sizeof(struct sparse_extent) * nr;
+	if (hdr_len + data_len >= len)
+		return 0;
+
+	memcpy(out, &nr, sizeof(nr));
+	p = (char *)out + hdr_len;
+	for (pos = 0, nr = 0;
+	     (pos = sparse_next_extent(buf, len, pos, &ext_len)) < len;
+	     pos += ext_len, nr++) {
+		struct sparse_extent ext = {
+			.offset = pos,
+			.length = ext_len,
+		};
+
+		memcpy((char *)out + sizeof(nr) + sizeof(ext) * nr, &ext,
+		       sizeof(ext));
+		memcpy(p, (const char *)buf + pos, ext_len);
+		p += ext_len;
+	}
+
+	return hdr_len + data_len;
+}
+
+/* Decode in_len bytes of a sparse buffer into the len bytes of buf */
+int sparse_decode(const void *in, size_t in_len, void *buf, size_t len)
+{
+	const char *p = in, *data;
+	uint32_t nr;
+
+	if (in_len < sizeof(nr))
+		return -1;
+	memcpy(&nr, p, sizeof(nr));
+	if ((in_len - sizeof(nr)) / sizeof(struct sparse_extent) < nr)
+		return -1;
+
+	data = p + sizeof(nr) + sizeof(struct sparse_extent) * nr;
+	memset(buf, 0, len);
+	for (uint32_t i = 0; i < nr; i++) {
+		struct sparse_extent ext;
+
+		memcpy(&ext, p + sizeof(nr) + sizeof(ext) * i, sizeof(ext));
+		if (ext.offset > len || ext.length > len - ext.offset ||
+		    ext.length > p + in_len - data)
+			return -1;
+		memcpy((char *)buf + ext.offset, data, ext.length);
+		data += ext.length;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_LOCKSTAT
+
+static struct lock_site *lockstat_head;
+
+/* Push the site on the list of the sites once, by the first thread in */
+void lockstat_register(struct lock_site *site)
+{
+	struct lock_site *head;
+
+	if (uatomic_cmpxchg(&site->registered, 0, 1))
+		return;
+
+	do {
+		head = uatomic_read(&lockstat_head);
+		site->next = head;
+	} while (uatomic_cmpxchg(&lockstat_head, head, site) != head);
+}
+
+struct lock_site *lockstat_sites(void)
+{
+	return uatomic_read(&lockstat_head);
+}
+
+#endif	/* HAVE_LOCKSTAT */
@@ -33,45 +33,159 @@
 #include "bitops.h"
 #include "work.h"
 #include "event.h"
+#include "numa.h"
 
 /*
- * The protection period from shrinking work queue.  This is necessary
- * to avoid many calls of pthread_create.  Without it, threads are
+ * All the work queues share one pool of worker threads.  Each worker takes
+ * works from the run queue of its home shard first and steals from the other
+ * shards when it runs dry, so idle threads of one queue can serve another.
+ * The run queues are ordered by the priority of the work queues, and works
+ * beyond the concurrency limit of their work queue wait in the pending list of
+ * the queue until one of its running works finishes.
+ *
+ * The pool grows whenever a work is queued and no worker is idle, so that
+ * works which sleep-wait for other works can't stall the pool, and idle
+ * workers above the number of CPUs exit after the protection period.  This is
+ * necessary to avoid many calls of pthread_create.  Without it, threads are
  * frequently created and deleted and it leads poor performance.
+ *
+ * On NUMA machines each shard belongs to the node of its CPU and workers run
+ * on the CPUs of the node of their home shard.  Works of a queue with a
+ * preferred node are pushed to the shards of that node and workers steal
+ * from the shards of their own node before the remote ones.
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
 struct wq_info {
 	const char *name;
 
-	struct list_head finished_list;
-	struct list_node list;
-
-	struct sd_mutex finished_lock;
-
-	/* workers sleep on this and signaled by work producer */
-	struct sd_cond pending_cond;
-	/* locked by work producer and workers */
+	/* protects q.pending_list and nr_active */
 	struct sd_mutex pending_lock;
-	/* protected by pending_lock */
 	struct work_queue q;
-	size_t nr_threads;
+	/* works handed to the pool */
+	size_t nr_active;
 
 	/* protected by uatomic primitives */
 	size_t nr_queued_work;
 
-	/* we cannot shrink work queue till this time */
-	uint64_t tm_end_of_protection;
 	enum wq_thread_control tc;
+	enum wq_priority prio;
+	int node; /* preferred NUMA node, or -1 */
+
+	struct list_node list; /* in wq_list */
+};
+
+/* the work queues are never destroyed */
+static LIST_HEAD(wq_list);
+static struct sd_mutex wq_list_lock = SD_MUTEX_INITIALIZER;
+
+/*
+ * Producers push works to the lock-free intake stacks, and the worker holding
+ * the shard lock moves them to the run queues in the order they were pushed.
+ */
+struct wq_shard {
+	struct work *intake[WQ_NR_PRIO];
+
+	struct sd_mutex lock;
+	struct list_head runq[WQ_NR_PRIO];
+
+	/* works in intake and runq, to skip empty shards without the lock */
+	size_t nr_ready[WQ_NR_PRIO];
+
+	int node;
+};
+
+struct wq_node {
+	int *shards;
+	int nr_shards;
+	unsigned int next_shard;
+	unsigned int next_home;
+};
+
+static struct worker_pool {
+	/* protects the counters below and the creation of threads */
+	struct sd_mutex lock;
+	/* idle workers sleep on this */
+	struct sd_cond cond;
+	size_t nr_workers;
+	size_t nr_idle;
+	size_t nr_base;		/* idle workers above this exit */
+
+	/* updated under lock with uatomic primitives, read without it */
+	size_t nr_wakeups;	/* woken up but not running yet */
+	size_t nr_starting;	/* created but not running yet */
+
+	/* protected by uatomic primitives */
+	size_t nr_pending;	/* works in the run queues */
+	unsigned int next_shard;
+
+	int nr_shards;
+	struct wq_shard *shards;
+
+	/* shards of each NUMA node, only used if there are two or more */
+	bool numa;
+	struct wq_node nodes[MAX_NUMA_NODES];
+} pool = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.cond = SD_COND_INITIALIZER,
+};
+
+static __thread int home_shard = -1;
+
+/*
+ * Finished works are sent back to the event loop of the thread which queued
+ * them, so the done callback runs in the same thread as the producer.  The
+ * worker threads queueing works use the port of the main thread.
+ *
+ * Only the work which makes the stack non-empty writes the eventfd, so a
+ * batch of completions costs one wakeup of the event loop.
+ */
+struct done_port {
+	int efd;
+	struct work *head;
 };
 
-static int efd;
-static LIST_HEAD(wq_info_list);
+static struct done_port main_port;
+static __thread struct done_port *thread_port;
 static size_t nr_nodes = 1;
 static size_t (*wq_get_nr_nodes)(void);
 
 static void *worker_routine(void *arg);
 
+/*
+ * Lock-free intrusive stacks of works.  Any thread can push, and the consumer
+ * always takes all the works at once, so there is no ABA problem.
+ *
+ * Return true if the stack was empty.
+ */
+static bool work_stack_push(struct work **head, struct work *work)
+{
+	struct work *old = uatomic_read(head), *cur;
+
+	while (true) {
+		work->next = old;
+		cur = uatomic_cmpxchg(head, old, work);
+		if (cur == old)
+			return old == NULL;
+		old = cur;
+	}
+}
+
+/* Take all the works in the order they were pushed */
+static struct work *work_stack_take(struct work **head)
+{
+	struct work *work = uatomic_xchg_ptr(head, NULL), *list = NULL, *next;
+
+	while (work) {
+		next = work->next;
+		work->next = list;
+		list = work;
+		work = next;
+	}
+
+	return list;
+}
+
 #if (defined HAVE_TRACE) || (defined HAVE_LIVEPATCH)
 
 #define TID_MAX_DEFAULT 0x8000 /* default maximum tid for most systems */
@@ -83,14 +197,33 @@ static struct sd_mutex tid_map_lock = SD_MUTEX_INITIALIZER;
 static int resume_efd;
 static int ack_efd;
 
+/*
+ * Grace periods of the threads in tid_map
+ *
+ * A worker is quiescent between two works and a reactor while it waits for
+ * the events, where they run no code of the works or the handlers.
+ * synchronize_worker_threads() starts a new grace period and waits until all
+ * the threads have been quiescent since, so that the code which they can no
+ * longer enter, like the functions of a livepatch which was replaced, can be
+ * freed without stopping them.
+ */
+#define QS_OFFLINE UINT64_MAX
+
+struct thread_qs {
+	uint64_t seq; /* The last grace period seen, or QS_OFFLINE */
+	struct list_node list;
+};
+
+static __thread struct thread_qs *thread_qs;
+static LIST_HEAD(qs_list); /* Protected by tid_map_lock */
+static uint64_t gp_seq;
+
 void suspend_worker_threads(void)
 {
-	struct wq_info *wi;
 	int tid;
 
-	list_for_each_entry(wi, &wq_info_list, list) {
-		sd_mutex_lock(&wi->pending_lock);
-	}
+	/* no worker is created or destroyed until resume_worker_threads() */
+	sd_mutex_lock(&pool.lock);
 
 	FOR_EACH_BIT(tid, tid_map, tid_max) {
 		if (unlikely(tkill(tid, SIGUSR2) < 0))
@@ -99,7 +232,7 @@ void suspend_worker_threads(void)
 
 	/*
 	 * Wait for all the worker thread to suspend.  We cannot use
-	 * wi->nr_threads here because some thread may have not called set_bit()
+	 * pool.nr_workers here because some thread may have not called set_bit()
 	 * yet (then, the thread doesn't receive SIGUSR2).
 	 */
 	FOR_EACH_BIT(tid, tid_map, tid_max) {
@@ -109,7 +242,6 @@ void suspend_worker_threads(void)
 
 void resume_worker_threads(void)
 {
-	struct wq_info *wi;
 	int nr_threads = 0, tid;
 
 	FOR_EACH_BIT(tid, tid_map, tid_max) {
@@ -120,9 +252,7 @@ void resume_worker_threads(void)
 	for (int i = 0; i < nr_threads; i++)
 		eventfd_xread(ack_efd);
 
-	list_for_each_entry(wi, &wq_info_list, list) {
-		sd_mutex_unlock(&wi->pending_lock);
-	}
+	sd_mutex_unlock(&pool.lock);
 }
 
 static void suspend(int num, siginfo_t *info, void *context)
@@ -135,6 +265,61 @@ static void suspend(int num, siginfo_t *info, void *context)
 	eventfd_xwrite(ack_efd, 1); /* ack of resume */
 }
 
+/* Called by a thread in tid_map when it runs none of the code of the works */
+void thread_quiescent_state(void)
+{
+	if (!thread_qs)
+		return;
+
+	cmm_smp_mb();
+	uatomic_set(&thread_qs->seq, uatomic_read(&gp_seq));
+}
+
+/* Called before a thread in tid_map waits for long */
+void thread_offline(void)
+{
+	if (!thread_qs)
+		return;
+
+	cmm_smp_mb();
+	uatomic_set(&thread_qs->seq, QS_OFFLINE);
+}
+
+void thread_online(void)
+{
+	if (!thread_qs)
+		return;
+
+	uatomic_set(&thread_qs->seq, uatomic_read(&gp_seq));
+	cmm_smp_mb();
+}
+
+/* Called by the main thread, which is quiescent itself */
+void synchronize_worker_threads(void)
+{
+	struct thread_qs *qs;
+	uint64_t seq;
+	bool done;
+
+	cmm_smp_mb();
+	seq = uatomic_add_return(&gp_seq, 1);
+	while (true) {
+		done = true;
+		sd_mutex_lock(&tid_map_lock);
+		list_for_each_entry(qs, &qs_list, list) {
+			if (uatomic_read(&qs->seq) < seq) {
+				done = false;
+				break;
+			}
+		}
+		sd_mutex_unlock(&tid_map_lock);
+		if (done)
+			break;
+		usleep(1000);
+	}
+	cmm_smp_mb();
+}
+
 int wq_trace_init(void)
 {
 	tid_max = TID_MAX_DEFAULT;
@@ -169,6 +354,10 @@ static void trace_set_tid_map(int tid)
 		tid_map = alloc_bitmap(tid_map, old_tid_max, tid_max);
 	}
 	set_bit(tid, tid_map);
+
+	thread_qs = xzalloc(sizeof(*thread_qs));
+	thread_qs->seq = uatomic_read(&gp_seq);
+	list_add(&thread_qs->list, &qs_list);
 	sd_mutex_unlock(&tid_map_lock);
 }
 
@@ -176,6 +365,10 @@ static void trace_clear_tid_map(int tid)
 {
 	sd_mutex_lock(&tid_map_lock);
 	clear_bit(tid, tid_map);
+
+	list_del(&thread_qs->list);
+	free(thread_qs);
+	thread_qs = NULL;
 	sd_mutex_unlock(&tid_map_lock);
 }
 
@@ -195,188 +388,384 @@ static uint64_t get_msec_time(void)
 	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-static inline uint64_t wq_get_roof(struct wq_info *wi)
+/* The number of works of the queue which can run at the same time */
+static inline size_t wq_max_active(struct wq_info *wi)
 {
-	uint64_t nr = 1;
-
 	switch (wi->tc) {
 	case WQ_ORDERED:
-		break;
+		return 1;
 	case WQ_DYNAMIC:
-		/* FIXME: 2 * nr_nodes threads. No rationale yet. */
-		nr = nr_nodes * 2;
-		break;
+		/*
+		 * Dynamic queues mostly wait for the other nodes, so allow two
+		 * works in flight per node, but never fewer than the CPUs.
+		 */
+		return max(pool.nr_base, uatomic_read(&nr_nodes) * 2);
 	case WQ_UNLIMITED:
-		nr = SIZE_MAX;
-		break;
+		return SIZE_MAX;
 	default:
 		panic("Invalid threads control %d", wi->tc);
 	}
-	return nr;
 }
 
-static bool wq_need_grow(struct wq_info *wi)
+static inline bool valid_node(int node)
+{
+	return pool.numa && node >= 0 && node < MAX_NUMA_NODES &&
+		pool.nodes[node].nr_shards;
+}
+
+/* Create a worker whose home shard is on the node if it is valid */
+static int create_worker(int node)
 {
-	if (wi->nr_threads < uatomic_read(&wi->nr_queued_work) &&
-	    wi->nr_threads * 2 <= wq_get_roof(wi)) {
-		wi->tm_end_of_protection = get_msec_time() +
-			WQ_PROTECTION_PERIOD;
-		return true;
+	static unsigned int next_home;
+	pthread_t thread;
+	uintptr_t home;
+	int ret;
+
+	if (valid_node(node)) {
+		struct wq_node *n = pool.nodes + node;
+
+		home = n->shards[n->next_home++ % n->nr_shards];
+	} else
+		home = next_home++ % pool.nr_shards;
+
+	ret = pthread_create(&thread, NULL, worker_routine, (void *)home);
+	if (ret != 0) {
+		sd_err("failed to create worker thread: %s", strerror(ret));
+		return -1;
 	}
+	pool.nr_workers++;
+	uatomic_inc(&pool.nr_starting);
+	sd_debug("create worker %zu", pool.nr_workers);
 
-	return false;
+	return 0;
+}
+
+/* Make sure that somebody will pick up the works in the run queues */
+static void kick_pool(int node)
+{
+	/*
+	 * Workers which are waking up or starting kick again after taking a
+	 * work, so we don't need to wake up more of them than the pending
+	 * works.  This pairs with the decrements in get_work() and
+	 * worker_routine(), both ordered before they look at nr_pending.
+	 */
+	cmm_smp_mb();
+	if (uatomic_read(&pool.nr_pending) <= uatomic_read(&pool.nr_wakeups) +
+	    uatomic_read(&pool.nr_starting))
+		return;
+
+	sd_mutex_lock(&pool.lock);
+	if (pool.nr_idle) {
+		pool.nr_idle--;
+		uatomic_inc(&pool.nr_wakeups);
+		sd_cond_signal(&pool.cond);
+	} else if (!pool.nr_starting && !pool.nr_wakeups)
+		/* the new worker kicks again if there are still works */
+		create_worker(node);
+	sd_mutex_unlock(&pool.lock);
+}
+
+static void pool_push(struct work *work, struct wq_info *wi, bool kick)
+{
+	enum wq_priority prio = wi->prio;
+	int idx = home_shard, node = uatomic_read(&wi->node);
+	struct wq_shard *s;
+
+	/* works queued by a worker are likely to be hot in its cache */
+	if (valid_node(node) && (idx < 0 || pool.shards[idx].node != node)) {
+		struct wq_node *n = pool.nodes + node;
+
+		idx = uatomic_add_return(&n->next_shard, 1) % n->nr_shards;
+		idx = n->shards[idx];
+	} else if (idx < 0)
+		idx = uatomic_add_return(&pool.next_shard, 1) % pool.nr_shards;
+	s = pool.shards + idx;
+
+	/* count it first so that the counters never go below the works */
+	uatomic_inc(&s->nr_ready[prio]);
+	uatomic_inc(&pool.nr_pending);
+	work_stack_push(&s->intake[prio], work);
+
+	if (kick)
+		kick_pool(node);
+}
+
+static struct work *take_work(struct wq_shard *s, enum wq_priority prio)
+{
+	struct work *work;
+
+	if (!uatomic_read(&s->nr_ready[prio]))
+		return NULL;
+
+	sd_mutex_lock(&s->lock);
+	if (list_empty(&s->runq[prio])) {
+		work = work_stack_take(&s->intake[prio]);
+		for (; work; work = work->next)
+			list_add_tail(&work->w_list, &s->runq[prio]);
+	}
+	if (list_empty(&s->runq[prio])) {
+		sd_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	work = list_first_entry(&s->runq[prio], struct work, w_list);
+	list_del(&work->w_list);
+	uatomic_dec(&s->nr_ready[prio]);
+	sd_mutex_unlock(&s->lock);
+
+	uatomic_dec(&pool.nr_pending);
+	return work;
 }
 
 /*
- * Return true if more than half of threads are not used more than
- * WQ_PROTECTION_PERIOD seconds
+ * Take the oldest work of the highest priority, starting from the home shard
+ * and the other shards of the same node
  */
-static bool wq_need_shrink(struct wq_info *wi)
+static struct work *steal_work(void)
 {
-	if (uatomic_read(&wi->nr_queued_work) < wi->nr_threads / 2)
-		/* we cannot shrink work queue during protection period. */
-		return wi->tm_end_of_protection <= get_msec_time();
+	int node = pool.shards[home_shard].node;
+	struct wq_shard *s;
+	struct work *work;
+
+	for (int prio = 0; prio < WQ_NR_PRIO; prio++) {
+		for (int remote = 0; remote < 2; remote++) {
+			for (int i = 0; i < pool.nr_shards; i++) {
+				s = pool.shards +
+					(home_shard + i) % pool.nr_shards;
+				if ((s->node != node) != remote)
+					continue;
+
+				work = take_work(s, prio);
+				if (work)
+					return work;
+			}
+		}
+	}
 
-	/* update the end of protection time */
-	wi->tm_end_of_protection = get_msec_time() + WQ_PROTECTION_PERIOD;
-	return false;
+	return NULL;
 }
 
-static int create_worker_threads(struct wq_info *wi, size_t nr_threads)
+/*
+ * Return the next work to execute, or NULL if the calling worker has been idle
+ * for the protection period and should exit.
+ */
+static struct work *get_work(void)
 {
-	pthread_t thread;
+	uint64_t idle_start;
+	struct work *work;
 	int ret;
 
-	while (wi->nr_threads < nr_threads) {
-		ret = pthread_create(&thread, NULL, worker_routine, wi);
-		if (ret != 0) {
-			sd_err("failed to create worker thread: %m");
-			return -1;
+	while (!(work = steal_work())) {
+		sd_mutex_lock(&pool.lock);
+		idle_start = get_msec_time();
+		while (!uatomic_read(&pool.nr_pending)) {
+			pool.nr_idle++;
+			thread_offline();
+			ret = sd_cond_wait_timeout(&pool.cond, &pool.lock, 1);
+			thread_online();
+			if (pool.nr_wakeups) {
+				/* kick_pool() has already taken us off */
+				uatomic_dec(&pool.nr_wakeups);
+				continue;
+			}
+			pool.nr_idle--;
+
+			if (ret == ETIMEDOUT && pool.nr_workers > pool.nr_base &&
+			    get_msec_time() >= idle_start + WQ_PROTECTION_PERIOD) {
+				pool.nr_workers--;
+				trace_clear_tid_map(gettid());
+				sd_mutex_unlock(&pool.lock);
+				sd_debug("destroy worker, %zu", pool.nr_workers);
+				return NULL;
+			}
 		}
-		wi->nr_threads++;
-		sd_debug("create thread %s %zu", wi->name, wi->nr_threads);
+		sd_mutex_unlock(&pool.lock);
 	}
 
-	return 0;
+	return work;
 }
 
 void queue_work(struct work_queue *q, struct work *work)
 {
 	struct wq_info *wi = container_of(q, struct wq_info, q);
 
+	work->wq = q;
+	work->port = thread_port ?: &main_port;
+
 	uatomic_inc(&wi->nr_queued_work);
-	sd_mutex_lock(&wi->pending_lock);
 
-	if (wq_need_grow(wi))
-		/* double the thread pool size */
-		create_worker_threads(wi, wi->nr_threads * 2);
+	if (wi->tc != WQ_UNLIMITED) {
+		sd_mutex_lock(&wi->pending_lock);
+		if (wi->nr_active >= wq_max_active(wi)) {
+			/* dispatched when one of the running works finishes */
+			list_add_tail(&work->w_list, &wi->q.pending_list);
+			sd_mutex_unlock(&wi->pending_lock);
+			return;
+		}
+		wi->nr_active++;
+		sd_mutex_unlock(&wi->pending_lock);
+	}
+
+	pool_push(work, wi, true);
+}
+
+static void finish_work(struct wq_info *wi, struct work *work)
+{
+	struct done_port *port = work->port;
+	struct work *next = NULL;
+
+	if (work_stack_push(&port->head, work))
+		eventfd_xwrite(port->efd, 1);
+
+	if (wi->tc == WQ_UNLIMITED)
+		return;
 
-	list_add_tail(&work->w_list, &wi->q.pending_list);
+	/*
+	 * Dispatch the next work only after posting this one, so the done
+	 * callbacks of an ordered queue are called in order.
+	 */
+	sd_mutex_lock(&wi->pending_lock);
+	if (!list_empty(&wi->q.pending_list)) {
+		next = list_first_entry(&wi->q.pending_list, struct work,
+					w_list);
+		list_del(&next->w_list);
+	} else
+		wi->nr_active--;
 	sd_mutex_unlock(&wi->pending_lock);
 
-	sd_cond_signal(&wi->pending_cond);
+	/* we are about to be free, so run it by ourselves unless stolen */
+	if (next)
+		pool_push(next, wi, false);
 }
 
 static void worker_thread_request_done(int fd, int events, void *data)
 {
+	struct done_port *port = data;
 	struct wq_info *wi;
-	struct work *work;
-	LIST_HEAD(list);
+	struct work *work, *next;
 
-	if (wq_get_nr_nodes)
+	if (port == &main_port && wq_get_nr_nodes)
 		nr_nodes = wq_get_nr_nodes();
 
+	/* read it before taking the works not to miss the next batch */
 	eventfd_xread(fd);
 
-	list_for_each_entry(wi, &wq_info_list, list) {
-		sd_mutex_lock(&wi->finished_lock);
-		list_splice_init(&wi->finished_list, &list);
-		sd_mutex_unlock(&wi->finished_lock);
-
-		while (!list_empty(&list)) {
-			work = list_first_entry(&list, struct work, w_list);
-			list_del(&work->w_list);
-
-			work->done(work);
-			uatomic_dec(&wi->nr_queued_work);
-		}
+	for (work = work_stack_take(&port->head); work; work = next) {
+		/* work can be freed in the done callback */
+		next = work->next;
+		wi = container_of(work->wq, struct wq_info, q);
+		work->done(work);
+		uatomic_dec(&wi->nr_queued_work);
 	}
 }
 
 static void *worker_routine(void *arg)
 {
-	struct wq_info *wi = arg;
+	struct wq_info *wi;
 	struct work *work;
-	int tid = gettid();
 
-	set_thread_name(wi->name, (wi->tc != WQ_ORDERED));
+	home_shard = (uintptr_t)arg;
+	set_thread_name("worker", true);
+	if (pool.numa)
+		bind_to_numa_node(pool.shards[home_shard].node);
+	trace_set_tid_map(gettid());
 
-	trace_set_tid_map(tid);
-	while (true) {
+	sd_mutex_lock(&pool.lock);
+	uatomic_dec(&pool.nr_starting);
+	sd_mutex_unlock(&pool.lock);
 
-		sd_mutex_lock(&wi->pending_lock);
-		if (wq_need_shrink(wi)) {
-			wi->nr_threads--;
+	while ((work = get_work())) {
+		wi = container_of(work->wq, struct wq_info, q);
 
-			trace_clear_tid_map(tid);
-			sd_mutex_unlock(&wi->pending_lock);
-			pthread_detach(pthread_self());
-			sd_debug("destroy thread %s %d, %zu", wi->name, tid,
-				 wi->nr_threads);
-			break;
-		}
-retest:
-		if (list_empty(&wi->q.pending_list)) {
-			sd_cond_wait(&wi->pending_cond, &wi->pending_lock);
-			goto retest;
-		}
-
-		work = list_first_entry(&wi->q.pending_list,
-				       struct work, w_list);
-
-		list_del(&work->w_list);
-		sd_mutex_unlock(&wi->pending_lock);
+		/* let another worker take the rest */
+		if (uatomic_read(&pool.nr_pending))
+			kick_pool(-1);
 
+		set_thread_name(wi->name, false);
 		if (work->fn)
 			work->fn(work);
 
-		sd_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		sd_mutex_unlock(&wi->finished_lock);
-
-		eventfd_xwrite(efd, 1);
+		finish_work(wi, work);
+		thread_quiescent_state();
 	}
 
+	pthread_detach(pthread_self());
 	pthread_exit(NULL);
 }
 
-int init_work_queue(size_t (*get_nr_nodes)(void))
+static int init_done_port(struct done_port *port)
 {
 	int ret;
 
+	port->efd = eventfd(0, EFD_NONBLOCK);
+	if (port->efd < 0) {
+		sd_err("failed to create event fd: %m");
+		return -1;
+	}
+
+	port->head = NULL;
+
+	ret = register_event(port->efd, worker_thread_request_done, port);
+	if (ret) {
+		sd_err("failed to register event fd %m");
+		close(port->efd);
+		return -1;
+	}
+
+	thread_port = port;
+	return 0;
+}
+
+int init_work_queue(size_t (*get_nr_nodes)(void))
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
 	wq_get_nr_nodes = get_nr_nodes;
 
 	if (wq_get_nr_nodes)
 		nr_nodes = wq_get_nr_nodes();
 
-	efd = eventfd(0, EFD_NONBLOCK);
-	if (efd < 0) {
-		sd_err("failed to create event fd: %m");
-		return -1;
+	pool.nr_base = pool.nr_shards = nr_cpus > 0 ? nr_cpus : 1;
+	pool.shards = xcalloc(pool.nr_shards, sizeof(*pool.shards));
+	pool.numa = init_numa_topology() > 1;
+	for (int i = 0; i < pool.nr_shards; i++) {
+		struct wq_shard *s = pool.shards + i;
+		struct wq_node *n;
+
+		sd_init_mutex(&s->lock);
+		for (int prio = 0; prio < WQ_NR_PRIO; prio++)
+			INIT_LIST_HEAD(&s->runq[prio]);
+
+		/* assume that the online CPUs are numbered from 0 */
+		s->node = max(cpu_to_numa_node(i), 0);
+		n = pool.nodes + s->node;
+		n->shards = xrealloc(n->shards,
+				     sizeof(int) * (n->nr_shards + 1));
+		n->shards[n->nr_shards++] = i;
 	}
 
-	ret = register_event(efd, worker_thread_request_done, NULL);
-	if (ret) {
-		sd_err("failed to register event fd %m");
-		close(efd);
+	return init_done_port(&main_port);
+}
+
+/*
+ * Make the done callbacks of the works queued by the calling thread run in
+ * its own event loop.  The thread must have called init_event() and lives as
+ * long as the process, so it is also suspended with the worker threads.
+ */
+int init_work_done_port(void)
+{
+	struct done_port *port = xzalloc(sizeof(*port));
+
+	if (init_done_port(port) < 0) {
+		free(port);
 		return -1;
 	}
 
+	trace_set_tid_map(gettid());
 	return 0;
 }
 
 /*
- * Allowing unlimited threads to be created is necessary to solve the following
+ * Allowing unlimited works to run is necessary to solve the following
  * problems:
  *
  *  1. timeout of IO requests from guests. With on-demand short threads, we
@@ -386,38 +775,32 @@ int init_work_queue(size_t (*get_nr_nodes)(void))
  *     local requests that ask for creation of another thread to execute the
  *     requests and sleep-wait for responses.
  */
-struct work_queue *create_work_queue(const char *name,
-				     enum wq_thread_control tc)
+struct work_queue *create_work_queue_prio(const char *name,
+					  enum wq_thread_control tc,
+					  enum wq_priority prio)
 {
-	int ret;
 	struct wq_info *wi;
 
 	wi = xzalloc(sizeof(*wi));
 	wi->name = name;
 	wi->tc = tc;
+	wi->prio = prio;
+	wi->node = -1;
 
 	INIT_LIST_HEAD(&wi->q.pending_list);
-	INIT_LIST_HEAD(&wi->finished_list);
-
-	sd_cond_init(&wi->pending_cond);
-
-	sd_init_mutex(&wi->finished_lock);
 	sd_init_mutex(&wi->pending_lock);
 
-	ret = create_worker_threads(wi, 1);
-	if (ret < 0)
-		goto destroy_threads;
-
-	list_add(&wi->list, &wq_info_list);
+	sd_mutex_lock(&wq_list_lock);
+	list_add_tail(&wi->list, &wq_list);
+	sd_mutex_unlock(&wq_list_lock);
 
 	return &wi->q;
-destroy_threads:
-	sd_destroy_cond(&wi->pending_cond);
-	sd_destroy_mutex(&wi->pending_lock);
-	sd_destroy_mutex(&wi->finished_lock);
-	free(wi);
+}
 
-	return NULL;
+struct work_queue *create_work_queue(const char *name,
+				     enum wq_thread_control tc)
+{
+	return create_work_queue_prio(name, tc, WQ_PRIO_NORMAL);
 }
 
 struct work_queue *create_ordered_work_queue(const char *name)
@@ -425,6 +808,21 @@ struct work_queue *create_ordered_work_queue(const char *name)
 	return create_work_queue(name, WQ_ORDERED);
 }
 
+/*
+ * Prefer the CPUs of the NUMA node for the works of the queue, e.g. the node of
+ * the devices they access.  -1 means no preference.
+ */
+void work_queue_set_numa_node(struct work_queue *q, int node)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	if (!valid_node(node))
+		node = -1;
+	uatomic_set(&wi->node, node);
+	if (node >= 0)
+		sd_info("%s works run on NUMA node %d", wi->name, node);
+}
+
 bool work_queue_empty(struct work_queue *q)
 {
 	struct wq_info *wi = container_of(q, struct wq_info, q);
@@ -432,6 +830,37 @@ bool work_queue_empty(struct work_queue *q)
 	return uatomic_read(&wi->nr_queued_work) == 0;
 }
 
+/*
+ * Fill in the counters of up to nr work queues and return the number of the
+ * queues.  They are read without the locks, so they can be off by the works
+ * in flight.
+ */
+int wq_get_stat(struct wq_stat *stat, int nr)
+{
+	struct wq_info *wi;
+	int i = 0;
+
+	sd_mutex_lock(&wq_list_lock);
+	list_for_each_entry(wi, &wq_list, list) {
+		if (i < nr) {
+			stat[i].name = wi->name;
+			stat[i].nr_queued = uatomic_read(&wi->nr_queued_work);
+			stat[i].nr_active = uatomic_read(&wi->nr_active);
+		}
+		i++;
+	}
+	sd_mutex_unlock(&wq_list_lock);
+
+	return i;
+}
+
+void wq_get_pool_stat(size_t *nr_workers, size_t *nr_idle, size_t *nr_pending)
+{
+	*nr_workers = uatomic_read(&pool.nr_workers);
+	*nr_idle = uatomic_read(&pool.nr_idle);
+	*nr_pending = uatomic_read(&pool.nr_pending);
+}
+
 struct thread_args {
 	const char *name;
 	void *(*start_routine)(void *);
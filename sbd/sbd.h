@@ -13,17 +13,38 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/hashtable.h>
 #include <linux/kthread.h>
 #include <linux/gfp.h>
 #include <linux/version.h>
 
 #include "sheepdog_proto.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+# error "sbd needs the blk-mq of v4.13 or later"
+#endif
+
+/* The poll queues and the polling of any completion came with v5.1 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+# define SBD_POLL
+#endif
+
 #define DRV_NAME "sbd"
 #define DEV_NAME_LEN 32
 #define SBD_MINORS_SHIFT 5 /* at most 31 partitions for a single device */
 #define SECTOR_SIZE 512
 
+/*
+ * A block request spans at most two objects, and each write of them might
+ * update the inode afterwards, so an aiocb issues at most four sheep requests
+ * and the id of a sheep request is the tag of its block request with the
+ * index of the sheep request in the aiocb.
+ */
+#define SBD_AIOCB_REQS_SHIFT 2
+#define SBD_AIOCB_REQS (1 << SBD_AIOCB_REQS_SHIFT)
+#define SBD_CREATING_BITS 8
+
 /* __GFP_MEMALLOC was introduced since v3.6, if not defined, nullify it */
 #ifndef __GFP_MEMALLOC
 # define __GFP_MEMALLOC GFP_NOIO
@@ -43,42 +64,40 @@ struct sheep_vdi {
 	char name[SD_MAX_VDI_LEN];
 };
 
-struct sbd_device {
+/* A hardware context of the device, with its own connection to the sheep */
+struct sbd_queue {
+	struct sbd_device *dev;
+	int index;
+	bool polled;	/* the replies are read by sbd_poll(), not a reaper */
 	struct socket *sock;
+	struct mutex send_mutex;
+	struct mutex poll_mutex;
+	atomic_t nr_inflight;
+
+	struct task_struct *reaper;
+	wait_queue_head_t reaper_wq;
+};
+
+struct sbd_device {
 	int id;		/* blkdev unique id */
-	atomic_t seq_num;
 
 	int major;
 	int minor;
 	struct gendisk *disk;
 	struct request_queue *rq;
-	spinlock_t queue_lock;   /* request queue lock */
+	struct blk_mq_tag_set tag_set;
+	struct sbd_queue *queues;
+	int nr_queues;
+	int nr_poll_queues; /* after the nr_queues others */
 
 	struct sheep_vdi vdi;		/* Associated sheep image */
 	spinlock_t vdi_lock;
 
-	struct list_head request_head; /* protected by queue lock */
-	struct list_head inflight_head; /* for inflight sheep requests */
-	struct list_head blocking_head; /* for blocking sheep requests */
-	rwlock_t inflight_lock;
-	rwlock_t blocking_lock;
+	/* The creations in flight by oid, which block the other writes */
+	DECLARE_HASHTABLE(creating, SBD_CREATING_BITS);
+	spinlock_t create_lock;
 
 	struct list_head list;
-	struct task_struct *reaper;
-	struct task_struct *submiter;
-	wait_queue_head_t reaper_wq;
-	wait_queue_head_t submiter_wq;
-};
-
-struct sheep_aiocb {
-	struct request *request;
-	u64 offset;
-	u64 length;
-	int ret;
-	atomic_t nr_requests;
-	char *buf;
-	int buf_iter;
-	void (*aio_done_func)(struct sheep_aiocb *);
 };
 
 enum sheep_request_type {
@@ -87,25 +106,47 @@ enum sheep_request_type {
 	SHEEP_CREATE,
 };
 
+struct sheep_aiocb;
+
 struct sheep_request {
-	struct list_head list;
+	struct list_head list;		/* in the blocked of a creation */
+	struct hlist_node hash;		/* in the creating of the device */
+	struct list_head blocked;	/* the writes waiting for a creation */
 	struct sheep_aiocb *aiocb;
 	u64 oid;
 	u64 cow_oid;
-	u32 seq_num;
+	u32 id;
+	u32 vid;			/* the payload of an inode update */
 	int type;
 	int offset;
 	int length;
-	char *buf;
+	int buf_off;			/* of the data in the block request */
+	char *buf;			/* or the data, if not NULL */
+};
+
+/* The pdu of a block request */
+struct sheep_aiocb {
+	struct request *request;
+	struct sbd_queue *queue;
+	u64 offset;
+	u64 length;
+	int ret;
+	atomic_t nr_requests;
+	atomic_t nr_reqs;		/* the reqs used */
+	unsigned long inflight;		/* a bit for each of the reqs */
+	int buf_iter;
+	void (*aio_done_func)(struct sheep_aiocb *);
+	struct sheep_request reqs[SBD_AIOCB_REQS];
 };
 
-void socket_shutdown(struct socket *sock);
 int sheep_setup_vdi(struct sbd_device *dev);
-struct sheep_aiocb *sheep_aiocb_setup(struct request *req);
+int sheep_setup_queue(struct sbd_queue *q);
+void sheep_cleanup_queue(struct sbd_queue *q);
+struct sheep_aiocb *sheep_aiocb_setup(struct sbd_queue *q,
+				      struct request *req);
 int sheep_aiocb_submit(struct sheep_aiocb *aiocb);
-int sheep_handle_reply(struct sbd_device *dev);
-int sheep_slab_create(void);
-void sheep_slab_destroy(void);
+int sheep_handle_reply(struct sbd_queue *q);
+int sheep_poll_replies(struct sbd_queue *q);
 
 static inline int sbd_dev_id_to_minor(int id)
 {
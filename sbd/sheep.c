@@ -11,24 +11,17 @@
 
 #include "sbd.h"
 
-static DEFINE_MUTEX(socket_mutex);
-static struct kmem_cache *sheep_aiocb_pool;
-static struct kmem_cache *sheep_request_pool;
-
-void socket_shutdown(struct socket *sock)
+static void socket_close(struct socket *sock)
 {
-	if (sock)
-		kernel_sock_shutdown(sock, SHUT_RDWR);
-}
-
-static struct sbd_device *sheep_request_to_device(struct sheep_request *req)
-{
-	return req->aiocb->request->q->queuedata;
+	if (!sock)
+		return;
+	kernel_sock_shutdown(sock, SHUT_RDWR);
+	sock_release(sock);
 }
 
 static struct sbd_device *sheep_aiocb_to_device(struct sheep_aiocb *aiocb)
 {
-	return aiocb->request->q->queuedata;
+	return aiocb->queue->dev;
 }
 
 static int socket_create(struct socket **sock, const char *ip_addr, int port)
@@ -72,7 +65,7 @@ static int socket_create(struct socket **sock, const char *ip_addr, int port)
 
 	return ret;
 shutdown:
-	socket_shutdown(*sock);
+	socket_close(*sock);
 	*sock = NULL;
 	return ret;
 }
@@ -131,22 +124,81 @@ static int socket_write(struct socket *sock, void *buf, int len)
 	return socket_xmit(sock, buf, len, true, 0);
 }
 
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 14, 0)
+
+# define DEFINE_BVEC(x) struct bio_vec *x
+# define BVEC_ADDR(x) x
+# define BVEC_FIELD(x, y) x->y
+
+#else
+
+# define DEFINE_BVEC(x) struct bio_vec x
+# define BVEC_ADDR(x) &x
+# define BVEC_FIELD(x, y) x.y
+
+#endif
+
+enum sheep_data_op {
+	SHEEP_DATA_SEND,
+	SHEEP_DATA_RECV,
+	SHEEP_DATA_ZERO,
+};
+
+/*
+ * Send, receive or zero the data of a sheep request in the pages of its block
+ * request, without copying it to a bounce buffer
+ */
+static int sheep_request_data(struct socket *sock, struct sheep_request *req,
+			      enum sheep_data_op op)
+{
+	struct req_iterator iter;
+	DEFINE_BVEC(bvec);
+	int pos = 0, start = req->buf_off, end = start + req->length, ret = 0;
+
+	rq_for_each_segment(bvec, req->aiocb->request, iter) {
+		int len = BVEC_FIELD(bvec, bv_len);
+		int from = max(start, pos), to = min(end, pos + len);
+		char *addr;
+
+		pos += len;
+		if (from >= to)
+			continue;
+
+		addr = kmap(BVEC_FIELD(bvec, bv_page));
+		addr += BVEC_FIELD(bvec, bv_offset) + from - (pos - len);
+		switch (op) {
+		case SHEEP_DATA_SEND:
+			ret = socket_xmit(sock, addr, to - from, true,
+					  to < end ? MSG_MORE : 0);
+			break;
+		case SHEEP_DATA_RECV:
+			ret = socket_read(sock, addr, to - from);
+			break;
+		case SHEEP_DATA_ZERO:
+			memset(addr, 0, to - from);
+			break;
+		}
+		flush_dcache_page(BVEC_FIELD(bvec, bv_page));
+		kunmap(BVEC_FIELD(bvec, bv_page));
+		if (ret < 0 || pos >= end)
+			goto out;
+	}
+out:
+	return ret;
+}
+
+/* The caller serializes the requests on the socket */
 static int sheep_submit_sdreq(struct socket *sock, struct sd_req *hdr,
 			      void *data, unsigned int wlen)
 {
 	int ret;
 
-	/* Make sheep_submit_sdreq thread safe */
-	mutex_lock(&socket_mutex);
-
-	ret = socket_write(sock, hdr, sizeof(*hdr));
+	ret = socket_xmit(sock, hdr, sizeof(*hdr), true, wlen ? MSG_MORE : 0);
 	if (ret < 0)
-		goto out;
+		return ret;
 
 	if (wlen)
 		ret = socket_write(sock, data, wlen);
-out:
-	mutex_unlock(&socket_mutex);
 	return ret;
 }
 
@@ -202,7 +254,7 @@ static int sheep_run_sdreq(struct socket *sock, struct sd_req *hdr,
 	return 0;
 }
 
-static int lookup_sheep_vdi(struct sbd_device *dev)
+static int lookup_sheep_vdi(struct sbd_device *dev, struct socket *sock)
 {
 	struct sd_req hdr = {};
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -211,7 +263,7 @@ static int lookup_sheep_vdi(struct sbd_device *dev)
 	hdr.opcode = SD_OP_LOCK_VDI;
 	hdr.data_length = SD_MAX_VDI_LEN;
 	hdr.flags = SD_FLAG_CMD_WRITE;
-	ret = sheep_run_sdreq(dev->sock, &hdr, dev->vdi.name);
+	ret = sheep_run_sdreq(sock, &hdr, dev->vdi.name);
 	if (ret < 0)
 		return ret;
 
@@ -224,6 +276,7 @@ int sheep_setup_vdi(struct sbd_device *dev)
 {
 	struct sd_req hdr = {};
 	struct sd_inode *inode;
+	struct socket *sock;
 	int ret;
 
 	inode = vmalloc(sizeof(*inode));
@@ -231,11 +284,11 @@ int sheep_setup_vdi(struct sbd_device *dev)
 		return -ENOMEM;
 	memset(inode, 0 , sizeof(*inode));
 
-	ret = socket_create(&dev->sock, dev->vdi.ip, dev->vdi.port);
+	ret = socket_create(&sock, dev->vdi.ip, dev->vdi.port);
 	if (ret < 0)
 		goto out;
 
-	ret = lookup_sheep_vdi(dev);
+	ret = lookup_sheep_vdi(dev, sock);
 	if (ret < 0) {
 		pr_err("Cannot get VDI for %s, %d\n", dev->vdi.name, ret);
 		goto out_release;
@@ -245,7 +298,7 @@ int sheep_setup_vdi(struct sbd_device *dev)
 	hdr.data_length = SD_INODE_SIZE;
 	hdr.obj.oid = vid_to_vdi_oid(dev->vdi.vid);
 	hdr.obj.offset = 0;
-	ret = sheep_run_sdreq(dev->sock, &hdr, inode);
+	ret = sheep_run_sdreq(sock, &hdr, inode);
 	if (ret < 0) {
 		pr_err("Cannot read inode for %s, %d\n", dev->vdi.name, ret);
 		goto out_release;
@@ -258,34 +311,55 @@ int sheep_setup_vdi(struct sbd_device *dev)
 		goto out_release;
 	}
 
+	socket_close(sock);
 	dev->vdi.inode = inode;
 	pr_info("%s: Associated to %s\n", DRV_NAME, inode->name);
 	return 0;
 out_release:
-	socket_shutdown(dev->sock);
-	dev->sock = NULL;
+	socket_close(sock);
 out:
 	vfree(inode);
 	return ret;
 }
 
+/* Connect the queue to the gateway of the device */
+int sheep_setup_queue(struct sbd_queue *q)
+{
+	struct sbd_device *dev = q->dev;
+
+	mutex_init(&q->send_mutex);
+	mutex_init(&q->poll_mutex);
+	atomic_set(&q->nr_inflight, 0);
+	init_waitqueue_head(&q->reaper_wq);
+
+	return socket_create(&q->sock, dev->vdi.ip, dev->vdi.port);
+}
+
+void sheep_cleanup_queue(struct sbd_queue *q)
+{
+	socket_close(q->sock);
+	q->sock = NULL;
+}
+
 /* FIXME: handle submit failure */
 static int submit_sheep_request(struct sheep_request *req)
 {
 	struct sd_req hdr = {};
-	struct sbd_device *dev = sheep_request_to_device(req);
+	struct sheep_aiocb *aiocb = req->aiocb;
+	struct sbd_queue *q = aiocb->queue;
 	int ret = 0;
 
-	hdr.id = req->seq_num;
+	hdr.id = req->id;
 	hdr.data_length = req->length;
 	hdr.obj.oid = req->oid;
 	hdr.obj.cow_oid = req->cow_oid;
 	hdr.obj.offset = req->offset;
 
-	write_lock(&dev->inflight_lock);
 	BUG_ON(!list_empty(&req->list));
-	list_add_tail(&req->list, &dev->inflight_head);
-	write_unlock(&dev->inflight_lock);
+	set_bit(req->id & (SBD_AIOCB_REQS - 1), &aiocb->inflight);
+	atomic_inc(&q->nr_inflight);
+
+	mutex_lock(&q->send_mutex);
 
 	switch (req->type) {
 	case SHEEP_CREATE:
@@ -297,114 +371,73 @@ static int submit_sheep_request(struct sheep_request *req)
 		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
 		if (req->cow_oid)
 			hdr.flags |= SD_FLAG_CMD_COW;
-		ret = sheep_submit_sdreq(dev->sock, &hdr, req->buf,
-					 req->length);
+		if (req->buf) {
+			ret = sheep_submit_sdreq(q->sock, &hdr, req->buf,
+						 req->length);
+			if (ret < 0)
+				goto err;
+			break;
+		}
+		ret = socket_xmit(q->sock, &hdr, sizeof(hdr), true, MSG_MORE);
+		if (ret < 0)
+			goto err;
+		ret = sheep_request_data(q->sock, req, SHEEP_DATA_SEND);
 		if (ret < 0)
 			goto err;
 		break;
 	case SHEEP_READ:
 		hdr.opcode = SD_OP_READ_OBJ;
-		ret = sheep_submit_sdreq(dev->sock, &hdr, NULL, 0);
+		ret = sheep_submit_sdreq(q->sock, &hdr, NULL, 0);
 		if (ret < 0)
 			goto err;
 		break;
 	}
-	sbd_debug("add oid %llx off %d, len %d, seq %u, type %d\n", req->oid,
-		  req->offset, req->length, req->seq_num, req->type);
+	sbd_debug("add oid %llx off %d, len %d, id %u, type %d\n", req->oid,
+		  req->offset, req->length, req->id, req->type);
 err:
-	wake_up(&dev->reaper_wq);
+	mutex_unlock(&q->send_mutex);
+	if (!q->polled)
+		wake_up(&q->reaper_wq);
 	return ret;
 }
 
-static inline void free_sheep_aiocb(struct sheep_aiocb *aiocb)
+static void sheep_aiocb_end(struct sheep_aiocb *aiocb)
 {
-	vfree(aiocb->buf);
-	kmem_cache_free(sheep_aiocb_pool, aiocb);
+	blk_mq_end_request(aiocb->request,
+			   aiocb->ret ? BLK_STS_IOERR : BLK_STS_OK);
 }
 
 static void aio_write_done(struct sheep_aiocb *aiocb)
 {
 	sbd_debug("wdone off %llu, len %llu\n", aiocb->offset, aiocb->length);
 
-	blk_end_request_all(aiocb->request, aiocb->ret);
-	free_sheep_aiocb(aiocb);
+	sheep_aiocb_end(aiocb);
 }
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 14, 0)
-
-# define DEFINE_BVEC(x) struct bio_vec *x
-# define BVEC_ADDR(x) x
-# define BVEC_FIELD(x, y) x->y
-
-#else
-
-# define DEFINE_BVEC(x) struct bio_vec x
-# define BVEC_ADDR(x) &x
-# define BVEC_FIELD(x, y) x.y
-
-#endif
-
 static void aio_read_done(struct sheep_aiocb *aiocb)
 {
-	struct req_iterator iter;
-	DEFINE_BVEC(bvec);
-	struct request *req = aiocb->request;
-	int len = 0;
-
 	sbd_debug("rdone off %llu, len %llu\n", aiocb->offset, aiocb->length);
 
-	rq_for_each_segment(bvec, req, iter) {
-		unsigned long flags;
-		void *addr = bvec_kmap_irq(BVEC_ADDR(bvec), &flags);
-
-		memcpy(addr, aiocb->buf + len, BVEC_FIELD(bvec, bv_len));
-		flush_dcache_page(BVEC_FIELD(bvec, bv_page));
-		bvec_kunmap_irq(addr, &flags);
-
-		len += BVEC_FIELD(bvec, bv_len);
-	}
-
-	blk_end_request_all(aiocb->request, aiocb->ret);
-	free_sheep_aiocb(aiocb);
+	sheep_aiocb_end(aiocb);
 }
 
-struct sheep_aiocb *sheep_aiocb_setup(struct request *req)
+struct sheep_aiocb *sheep_aiocb_setup(struct sbd_queue *q,
+				      struct request *req)
 {
-	struct sheep_aiocb *aiocb = kmem_cache_alloc(sheep_aiocb_pool,
-						     SBD_GFP_FLAGS);
-	struct req_iterator iter;
-	DEFINE_BVEC(bvec);
-	int len = 0;
-
-	if (!aiocb)
-		return ERR_PTR(-ENOMEM);
+	struct sheep_aiocb *aiocb = blk_mq_rq_to_pdu(req);
 
 	aiocb->offset = blk_rq_pos(req) * SECTOR_SIZE;
 	aiocb->length = blk_rq_bytes(req);
 	aiocb->ret = 0;
 	aiocb->buf_iter = 0;
 	aiocb->request = req;
-	aiocb->buf = vzalloc(aiocb->length);
+	aiocb->queue = q;
+	aiocb->inflight = 0;
 	atomic_set(&aiocb->nr_requests, 0);
-
-	if (!aiocb->buf) {
-		kmem_cache_free(sheep_aiocb_pool, aiocb);
-		return ERR_PTR(-ENOMEM);
-	}
+	atomic_set(&aiocb->nr_reqs, 0);
 
 	switch (rq_data_dir(req)) {
 	case WRITE:
-		rq_for_each_segment(bvec, req, iter) {
-			unsigned long flags;
-			void *addr = bvec_kmap_irq(BVEC_ADDR(bvec), &flags);
-
-			memcpy(aiocb->buf + len, addr,
-			       BVEC_FIELD(bvec, bv_len));
-			flush_dcache_page(BVEC_FIELD(bvec, bv_page));
-			bvec_kunmap_irq(addr, &flags);
-
-			len += BVEC_FIELD(bvec, bv_len);
-		}
 		aiocb->aio_done_func = aio_write_done;
 		break;
 	case READ:
@@ -413,7 +446,6 @@ struct sheep_aiocb *sheep_aiocb_setup(struct request *req)
 	default:
 		/* impossible case */
 		WARN_ON(1);
-		free_sheep_aiocb(aiocb);
 		return ERR_PTR(-EINVAL);
 	}
 
@@ -425,31 +457,32 @@ static inline bool aiocb_is_write(struct sheep_aiocb *aiocb)
 	return aiocb->aio_done_func == aio_write_done;
 }
 
+/*
+ * Take the next of the reqs of the aiocb, whose data is at buf_off in the
+ * block request unless the caller sets its buf
+ */
 static struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 						 u64 oid, u64 cow_oid, int len,
 						 int offset)
 {
-	struct sheep_request *req = kmem_cache_alloc(sheep_request_pool,
-						     SBD_GFP_FLAGS);
-	struct sbd_device *dev = sheep_aiocb_to_device(aiocb);
-
-	if (!req)
-		return ERR_PTR(-ENOMEM);
+	int i = atomic_inc_return(&aiocb->nr_reqs) - 1;
+	struct sheep_request *req;
 
+	BUG_ON(i >= SBD_AIOCB_REQS);
+	req = aiocb->reqs + i;
 	req->offset = offset;
 	req->length = len;
 	req->oid = oid;
 	req->cow_oid = cow_oid;
 	req->aiocb = aiocb;
-	req->buf = aiocb->buf + aiocb->buf_iter;
-	req->seq_num = atomic_inc_return(&dev->seq_num);
+	req->id = (aiocb->request->tag << SBD_AIOCB_REQS_SHIFT) | i;
+	req->buf = NULL;
 	INIT_LIST_HEAD(&req->list);
 	if (aiocb_is_write(aiocb))
 		req->type = SHEEP_WRITE;
 	else
 		req->type = SHEEP_READ;
 
-	aiocb->buf_iter += len;
 	atomic_inc(&aiocb->nr_requests);
 
 	return req;
@@ -459,28 +492,22 @@ static void end_sheep_request(struct sheep_request *req)
 {
 	struct sheep_aiocb *aiocb = req->aiocb;
 
-	sbd_debug("end oid %llx off %d, len %d, seq %u\n", req->oid,
-		  req->offset, req->length, req->seq_num);
+	sbd_debug("end oid %llx off %d, len %d, id %u\n", req->oid,
+		  req->offset, req->length, req->id);
 
+	BUG_ON(!list_empty(&req->list));
 	if (atomic_dec_return(&aiocb->nr_requests) <= 0)
 		aiocb->aio_done_func(aiocb);
-	BUG_ON(!list_empty(&req->list));
-	kmem_cache_free(sheep_request_pool, req);
 }
 
-static struct sheep_request *find_inflight_request_oid(struct sbd_device *dev,
-						       uint64_t oid)
+static struct sheep_request *find_creating_request(struct sbd_device *dev,
+						   uint64_t oid)
 {
 	struct sheep_request *req;
 
-	read_lock(&dev->inflight_lock);
-	list_for_each_entry(req, &dev->inflight_head, list) {
-		if (req->oid == oid) {
-			read_unlock(&dev->inflight_lock);
+	hash_for_each_possible(dev->creating, req, hash, oid)
+		if (req->oid == oid)
 			return req;
-		}
-	}
-	read_unlock(&dev->inflight_lock);
 	return NULL;
 }
 
@@ -495,6 +522,70 @@ static uint32_t sheep_inode_get_idx(struct sbd_device *dev, u32 idx)
 	return vid;
 }
 
+/*
+ * Sheepdog can't handle concurrent creation on the same object. The first
+ * write to the object creates it and the others wait for the creation in its
+ * blocked. Return false if the req is blocked.
+ */
+static bool sheep_start_creation(struct sbd_device *dev,
+				 struct sheep_request *req, u32 idx)
+{
+	struct sheep_request *creator;
+	bool ret = true;
+
+	spin_lock(&dev->create_lock);
+	creator = find_creating_request(dev, req->oid);
+	if (creator) {
+		list_add_tail(&req->list, &creator->blocked);
+		sbd_debug("block oid %llx off %d, len %d, id %u\n", req->oid,
+			  req->offset, req->length, req->id);
+		ret = false;
+		goto out;
+	}
+	/* There are slim chance object was created before we grab the lock */
+	if (unlikely(sheep_inode_get_idx(dev, idx) == dev->vdi.vid))
+		goto out;
+
+	req->type = SHEEP_CREATE;
+	INIT_LIST_HEAD(&req->blocked);
+	hash_add(dev->creating, &req->hash, req->oid);
+out:
+	spin_unlock(&dev->create_lock);
+	return ret;
+}
+
+/* Release the writes blocked by the creation of req */
+static void sheep_end_creation(struct sbd_device *dev,
+			       struct sheep_request *req, bool created)
+{
+	struct sheep_request *blocked, *t;
+	u32 idx = data_oid_to_idx(req->oid);
+	LIST_HEAD(head);
+
+	spin_lock(&dev->create_lock);
+	if (created) {
+		/* Make sure no request is queued while we update inode */
+		spin_lock(&dev->vdi_lock);
+		dev->vdi.inode->data_vdi_id[idx] = dev->vdi.vid;
+		spin_unlock(&dev->vdi_lock);
+	}
+	hash_del(&req->hash);
+	list_splice_init(&req->blocked, &head);
+	spin_unlock(&dev->create_lock);
+
+	list_for_each_entry_safe(blocked, t, &head, list) {
+		list_del_init(&blocked->list);
+		if (created) {
+			/* a plain write to the object now, as the others */
+			blocked->cow_oid = 0;
+			submit_sheep_request(blocked);
+		} else {
+			blocked->aiocb->ret = -EIO;
+			end_sheep_request(blocked);
+		}
+	}
+}
+
 int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 {
 	struct sbd_device *dev = sheep_aiocb_to_device(aiocb);
@@ -532,43 +623,19 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 		}
 
 		req = alloc_sheep_request(aiocb, oid, cow_oid, len, start);
-		if (IS_ERR(req))
-			return PTR_ERR(req);
+		req->buf_off = aiocb->buf_iter;
+		aiocb->buf_iter += len;
 
 		if (likely(vid && !cow_oid))
 			goto submit;
 
 		switch (req->type) {
 		case SHEEP_WRITE:
-			/*
-			 * Sheepdog can't handle concurrent creation on the same
-			 * object. We send one create req first and then send
-			 * write reqs in next.
-			 */
-			if (find_inflight_request_oid(dev, oid)) {
-				uint32_t tmp_vid;
-
-				write_lock(&dev->blocking_lock);
-				/*
-				 * There are slim chance object was created
-				 * before we grab blocking_lock
-				 */
-				tmp_vid = sheep_inode_get_idx(dev, idx);
-				if (unlikely(tmp_vid && tmp_vid ==
-					     dev->vdi.vid)) {
-					write_unlock(&dev->blocking_lock);
-					goto submit;
-				}
-				list_add_tail(&req->list, &dev->blocking_head);
-				sbd_debug("block oid %llx off %d, len %d,"
-					  " seq %u\n", req->oid, req->offset,
-					  req->length, req->seq_num);
-				write_unlock(&dev->blocking_lock);
+			if (!sheep_start_creation(dev, req, idx))
 				goto done;
-			}
-			req->type = SHEEP_CREATE;
 			break;
 		case SHEEP_READ:
+			sheep_request_data(NULL, req, SHEEP_DATA_ZERO);
 			end_sheep_request(req);
 			goto done;
 		}
@@ -587,152 +654,148 @@ done:
 	return 0;
 }
 
-static struct sheep_request *fetch_inflight_request(struct sbd_device *dev,
-						    u32 seq_num)
+/* Take the request out of the inflight of its aiocb */
+static struct sheep_request *fetch_request(struct sbd_queue *q,
+					   unsigned int tag, unsigned int i)
 {
-	struct sheep_request *req, *t;
-
-	write_lock(&dev->inflight_lock);
-	list_for_each_entry_safe(req, t, &dev->inflight_head, list) {
-		if (req->seq_num == seq_num) {
-			list_del_init(&req->list);
-			goto out;
-		}
-	}
-	req = NULL;
-out:
-	write_unlock(&dev->inflight_lock);
-	return req;
+	struct request *rq;
+	struct sheep_aiocb *aiocb;
+
+	if (tag >= q->dev->tag_set.queue_depth)
+		return NULL;
+	rq = blk_mq_tag_to_rq(q->dev->tag_set.tags[q->index], tag);
+	if (!rq)
+		return NULL;
+	aiocb = blk_mq_rq_to_pdu(rq);
+	if (!test_and_clear_bit(i, &aiocb->inflight))
+		return NULL;
+	atomic_dec(&q->nr_inflight);
+	return aiocb->reqs + i;
 }
 
-static struct sheep_request *fetch_first_inflight_request(
-	struct sbd_device *dev)
+static struct sheep_request *fetch_inflight_request(struct sbd_queue *q,
+						    u32 id)
 {
-	struct sheep_request *req;
-
-	write_lock(&dev->inflight_lock);
-	if (!list_empty(&dev->inflight_head)) {
-		req = list_first_entry(&dev->inflight_head,
-			struct sheep_request, list);
-		list_del_init(&req->list);
-	} else
-		req = NULL;
-	write_unlock(&dev->inflight_lock);
-	return req;
+	return fetch_request(q, id >> SBD_AIOCB_REQS_SHIFT,
+			     id & (SBD_AIOCB_REQS - 1));
 }
 
-static void submit_blocking_sheep_request(struct sbd_device *dev, uint64_t oid)
+static struct sheep_request *fetch_first_inflight_request(struct sbd_queue *q)
 {
-	struct sheep_request *req, *t;
+	struct sheep_request *req;
+	unsigned int tag, i;
 
-	write_lock(&dev->blocking_lock);
-	list_for_each_entry_safe(req, t, &dev->blocking_head, list) {
-		if (req->oid != oid)
-			continue;
-		list_del_init(&req->list);
-		submit_sheep_request(req);
-	}
-	write_unlock(&dev->blocking_lock);
+	for (tag = 0; tag < q->dev->tag_set.queue_depth; tag++)
+		for (i = 0; i < SBD_AIOCB_REQS; i++) {
+			req = fetch_request(q, tag, i);
+			if (req)
+				return req;
+		}
+	return NULL;
 }
 
 /* FIXME: add auto-reconnect support */
-int sheep_handle_reply(struct sbd_device *dev)
+int sheep_handle_reply(struct sbd_queue *q)
 {
+	struct sbd_device *dev = q->dev;
 	struct sd_rsp rsp = {};
 	struct sheep_request *req, *new;
-	uint32_t vid, idx;
-	uint64_t oid;
+	uint32_t idx;
 	int ret;
 
-	ret = socket_read(dev->sock, (char *)&rsp, sizeof(rsp));
+	ret = socket_read(q->sock, (char *)&rsp, sizeof(rsp));
 	if (ret < 0) {
 		pr_err("failed to read reply header %d\n", ret);
-		req = fetch_first_inflight_request(dev);
+		req = fetch_first_inflight_request(q);
 		if (req != NULL) {
-			req->aiocb->ret = EIO;
+			req->aiocb->ret = -EIO;
 			goto end_request;
 		}
 		goto err;
 	}
 
-	req = fetch_inflight_request(dev, rsp.id);
+	req = fetch_inflight_request(q, rsp.id);
 	if (!req) {
 		pr_err("failed to find req %u\n", rsp.id);
 		return 0;
 	}
 	if (rsp.data_length > 0) {
-		ret = socket_read(dev->sock, req->buf, req->length);
+		if (req->buf)
+			ret = socket_read(q->sock, req->buf, req->length);
+		else
+			ret = sheep_request_data(q->sock, req,
+						 SHEEP_DATA_RECV);
 		if (ret < 0) {
 			pr_err("failed to read reply payload %d\n", ret);
-			req->aiocb->ret = EIO;
+			req->aiocb->ret = -EIO;
 			goto end_request;
 		}
 	}
 
 	if (rsp.result != SD_RES_SUCCESS) {
 		pr_err("I/O request failed: %d", rsp.result);
-		req->aiocb->ret = EIO;
+		req->aiocb->ret = -EIO;
 		goto end_request;
 	}
 
 	switch (req->type) {
 	case SHEEP_CREATE:
 		/* We need to update inode for create */
-		new = kmem_cache_alloc(sheep_request_pool, SBD_GFP_FLAGS);
-		if (!new) {
-			ret = -ENOMEM;
-			req->aiocb->ret = EIO;
-			goto end_request;
-		}
-
-		vid = dev->vdi.vid;
-		oid = vid_to_vdi_oid(vid);
 		idx = data_oid_to_idx(req->oid);
-		new->offset = SD_INODE_HEADER_SIZE + sizeof(vid) * idx;
-		new->length = sizeof(vid);
-		new->oid = oid;
-		new->cow_oid = 0;
-		new->aiocb = req->aiocb;
-		new->buf = (char *)&vid;
-		new->seq_num = atomic_inc_return(&dev->seq_num);
+		new = alloc_sheep_request(req->aiocb,
+					  vid_to_vdi_oid(dev->vdi.vid), 0,
+					  sizeof(dev->vdi.vid),
+					  SD_INODE_HEADER_SIZE +
+					  sizeof(dev->vdi.vid) * idx);
+		new->vid = dev->vdi.vid;
+		new->buf = (char *)&new->vid;
 		new->type = SHEEP_WRITE;
-		atomic_inc(&req->aiocb->nr_requests);
-		INIT_LIST_HEAD(&new->list);
-
-		/* Make sure no request is queued while we update inode */
-		spin_lock(&dev->vdi_lock);
-		dev->vdi.inode->data_vdi_id[idx] = vid;
-		spin_unlock(&dev->vdi_lock);
 
+		sheep_end_creation(dev, req, true);
 		submit_sheep_request(new);
-		submit_blocking_sheep_request(dev, req->oid);
 		/* fall thru */
 	case SHEEP_WRITE:
 	case SHEEP_READ:
 		break;
 	}
+	end_sheep_request(req);
+	return ret;
 end_request:
+	if (req->type == SHEEP_CREATE)
+		sheep_end_creation(dev, req, false);
 	end_sheep_request(req);
 err:
 	return ret;
 }
 
-int sheep_slab_create(void)
+/* Return true if a reply, or an error, waits on the socket of the queue */
+static bool sheep_reply_ready(struct sbd_queue *q)
 {
-	sheep_aiocb_pool = KMEM_CACHE(sheep_aiocb, 0);
-	if (!sheep_aiocb_pool)
-		return -ENOMEM;
+	struct sd_rsp rsp;
+	struct msghdr msg = {};
+	struct kvec iov = { .iov_base = &rsp, .iov_len = sizeof(rsp) };
+	int ret;
 
-	sheep_request_pool = KMEM_CACHE(sheep_request, 0);
-	if (!sheep_request_pool) {
-		kmem_cache_destroy(sheep_aiocb_pool);
-		return -ENOMEM;
-	}
-	return 0;
+	ret = kernel_recvmsg(q->sock, &msg, &iov, 1, sizeof(rsp),
+			     MSG_PEEK | MSG_DONTWAIT);
+	return ret == sizeof(rsp) || (ret <= 0 && ret != -EAGAIN);
 }
 
-void sheep_slab_destroy(void)
+/*
+ * Handle the replies received by a polled queue. The reply is only read once
+ * all its header is there, so only the payload which follows it might wait.
+ */
+int sheep_poll_replies(struct sbd_queue *q)
 {
-	kmem_cache_destroy(sheep_aiocb_pool);
-	kmem_cache_destroy(sheep_request_pool);
+	int nr = 0;
+
+	if (!mutex_trylock(&q->poll_mutex))
+		return 0;
+	while (sheep_reply_ready(q)) {
+		if (sheep_handle_reply(q) < 0)
+			break;
+		nr++;
+	}
+	mutex_unlock(&q->poll_mutex);
+	return nr;
 }
@@ -43,6 +43,11 @@
  *    In this example, we remove the mapping with blkdev unique id 1.
  *
  *    $ echo 1 > /sys/bus/sbd/remove
+ *
+ * A device has a hardware queue, with its own connection to the sheep daemon
+ * and its own reaper of the replies, for each online cpu or for each of the
+ * nr_queues of the module, and nr_poll_queues more queues without reapers,
+ * whose replies are read by the polling of the hipri requests on them.
  */
 
 #include "sbd.h"
@@ -52,47 +57,106 @@ static DEFINE_MUTEX(dev_list_mutex);
 
 static int sbd_major;
 
+static unsigned int nr_queues;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "Number of the hardware queues of a device, "
+		 "one for each online cpu by default");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of the tags of a hardware queue");
+
+#ifdef SBD_POLL
+static unsigned int nr_poll_queues;
+module_param(nr_poll_queues, uint, 0444);
+MODULE_PARM_DESC(nr_poll_queues, "Number of the polled hardware queues of a "
+		 "device, for the hipri requests");
+#endif
+
 static const struct block_device_operations sbd_bd_ops = {
 	.owner		= THIS_MODULE,
 };
 
-static int sbd_submit_request(struct request *req)
+static blk_status_t sbd_queue_rq(struct blk_mq_hw_ctx *hctx,
+				 const struct blk_mq_queue_data *bd)
 {
-	struct sheep_aiocb *aiocb = sheep_aiocb_setup(req);
+	struct request *req = bd->rq;
+	struct sheep_aiocb *aiocb;
+	int ret;
+
+	/* filter out block requests we don't understand */
+	if (unlikely(blk_rq_is_passthrough(req))) {
+		blk_mq_start_request(req);
+		blk_mq_end_request(req, BLK_STS_OK);
+		return BLK_STS_OK;
+	}
 
+	aiocb = sheep_aiocb_setup(hctx->driver_data, req);
 	if (IS_ERR(aiocb))
-		return PTR_ERR(aiocb);
+		return PTR_ERR(aiocb) == -ENOMEM ? BLK_STS_RESOURCE :
+			BLK_STS_IOERR;
+
+	blk_mq_start_request(req);
+	ret = sheep_aiocb_submit(aiocb);
+	if (unlikely(ret < 0))
+		pr_err("failed to submit request\n");
 
-	return sheep_aiocb_submit(aiocb);
+	return BLK_STS_OK;
 }
 
-static void sbd_request_fn(struct request_queue *q)
-__releases(q->queue_lock) __acquires(q->queue_lock)
+static int sbd_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			 unsigned int hctx_idx)
 {
-	struct request *req;
-	struct sbd_device *dev = q->queuedata;
-
-	while ((req = blk_fetch_request(q)) != NULL) {
+	struct sbd_device *dev = data;
 
-		/* filter out block requests we don't understand */
-		if (unlikely(req->cmd_type != REQ_TYPE_FS)) {
-			__blk_end_request_all(req, 0);
-			continue;
-		}
+	hctx->driver_data = dev->queues + hctx_idx;
+	return 0;
+}
 
-		list_add_tail(&req->queuelist, &dev->request_head);
-		spin_unlock_irq(q->queue_lock);
+#ifdef SBD_POLL
 
-		wake_up(&dev->submiter_wq);
+static int sbd_map_queues(struct blk_mq_tag_set *set)
+{
+	struct sbd_device *dev = set->driver_data;
+	struct blk_mq_queue_map *map = set->map + HCTX_TYPE_DEFAULT;
+
+	map->nr_queues = dev->nr_queues;
+	map->queue_offset = 0;
+	blk_mq_map_queues(map);
+	if (set->nr_maps <= HCTX_TYPE_POLL)
+		return 0;
+
+	/* the reads share the queues of the writes */
+	set->map[HCTX_TYPE_READ] = *map;
+	map = set->map + HCTX_TYPE_POLL;
+	map->nr_queues = dev->nr_poll_queues;
+	map->queue_offset = dev->nr_queues;
+	blk_mq_map_queues(map);
+	return 0;
+}
 
-		spin_lock_irq(q->queue_lock);
-	}
+static int sbd_poll(struct blk_mq_hw_ctx *hctx)
+{
+	return sheep_poll_replies(hctx->driver_data);
 }
 
+#endif
+
+static const struct blk_mq_ops sbd_mq_ops = {
+	.queue_rq	= sbd_queue_rq,
+	.init_hctx	= sbd_init_hctx,
+#ifdef SBD_POLL
+	.map_queues	= sbd_map_queues,
+	.poll		= sbd_poll,
+#endif
+};
+
 static int sbd_add_disk(struct sbd_device *dev)
 {
+	struct blk_mq_tag_set *set = &dev->tag_set;
 	struct gendisk *disk;
 	struct request_queue *rq;
+	int ret;
 
 	disk = alloc_disk(1 << SBD_MINORS_SHIFT);
 	if (!disk)
@@ -104,12 +168,34 @@ static int sbd_add_disk(struct sbd_device *dev)
 	disk->fops = &sbd_bd_ops;
 	disk->private_data = dev;
 
-	rq = blk_init_queue(sbd_request_fn, &dev->queue_lock);
-	if (!rq) {
-		put_disk(disk);
-		return -ENOMEM;
+	set->ops = &sbd_mq_ops;
+	set->nr_hw_queues = dev->nr_queues + dev->nr_poll_queues;
+	set->queue_depth = queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct sheep_aiocb);
+	/* the requests are sent in queue_rq */
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	set->driver_data = dev;
+#ifdef SBD_POLL
+	if (dev->nr_poll_queues)
+		set->nr_maps = HCTX_TYPE_POLL + 1;
+#endif
+	ret = blk_mq_alloc_tag_set(set);
+	if (ret < 0)
+		goto err_put_disk;
+
+	rq = blk_mq_init_queue(set);
+	if (IS_ERR(rq)) {
+		ret = PTR_ERR(rq);
+		goto err_free_tag_set;
 	}
 
+	/*
+	 * Merge the bios up to an object but never across two, so a request
+	 * is a single sheep request, as the writes of a database or of the
+	 * direct I/O come sequential in pieces far smaller than an object.
+	 */
+	blk_queue_chunk_sectors(rq, SD_DATA_OBJ_SIZE / SECTOR_SIZE);
 	blk_queue_max_hw_sectors(rq, SD_DATA_OBJ_SIZE / SECTOR_SIZE);
 	blk_queue_max_segments(rq, SD_DATA_OBJ_SIZE / SECTOR_SIZE);
 	blk_queue_max_segment_size(rq, SD_DATA_OBJ_SIZE);
@@ -124,65 +210,82 @@ static int sbd_add_disk(struct sbd_device *dev)
 	add_disk(disk);
 
 	return 0;
+err_free_tag_set:
+	blk_mq_free_tag_set(set);
+err_put_disk:
+	put_disk(disk);
+	return ret;
 }
 
 static int sbd_request_reaper(void *data)
 {
-	struct sbd_device *dev = data;
+	struct sbd_queue *q = data;
 	int ret;
 
-	while (!kthread_should_stop() || !list_empty(&dev->inflight_head)) {
-		bool empty;
-
-		wait_event_interruptible(dev->reaper_wq,
+	while (!kthread_should_stop() || atomic_read(&q->nr_inflight)) {
+		wait_event_interruptible(q->reaper_wq,
 					 kthread_should_stop() ||
-					 !list_empty(&dev->inflight_head));
-
-		read_lock(&dev->inflight_lock);
-		empty = list_empty(&dev->inflight_head);
-		read_unlock(&dev->inflight_lock);
+					 atomic_read(&q->nr_inflight));
 
-		if (unlikely(empty))
+		if (unlikely(!atomic_read(&q->nr_inflight)))
 			continue;
 
-		ret = sheep_handle_reply(dev);
+		ret = sheep_handle_reply(q);
 		if (unlikely(ret < 0))
 			pr_err("reaper: failed to handle reply\n");
 	}
 	return 0;
 }
 
-static int sbd_request_submiter(void *data)
+static void sbd_stop_queues(struct sbd_device *dev, int nr)
 {
-	struct sbd_device *dev = data;
-	int ret;
+	int i;
 
-	while (!kthread_should_stop() || !list_empty(&dev->request_head)) {
-		struct request *req;
+	for (i = 0; i < nr; i++) {
+		struct sbd_queue *q = dev->queues + i;
 
-		wait_event_interruptible(dev->submiter_wq,
-					 kthread_should_stop() ||
-					 !list_empty(&dev->request_head));
+		if (q->reaper)
+			kthread_stop(q->reaper);
+		sheep_cleanup_queue(q);
+	}
+}
 
-		spin_lock_irq(&dev->queue_lock);
-		if (unlikely(list_empty(&dev->request_head))) {
-			spin_unlock_irq(&dev->queue_lock);
+/* Connect a socket and start a reaper for each queue */
+static int sbd_start_queues(struct sbd_device *dev)
+{
+	int i, ret;
+
+	for (i = 0; i < dev->nr_queues + dev->nr_poll_queues; i++) {
+		struct sbd_queue *q = dev->queues + i;
+
+		q->dev = dev;
+		q->index = i;
+		q->polled = i >= dev->nr_queues;
+		ret = sheep_setup_queue(q);
+		if (ret < 0)
+			goto err;
+		if (q->polled)
 			continue;
-		}
-		req = list_entry_rq(dev->request_head.next);
-		list_del_init(&req->queuelist);
-		spin_unlock_irq(&dev->queue_lock);
 
-		ret = sbd_submit_request(req);
-		if (unlikely(ret < 0))
-			pr_err("submiter: failed to submit request\n");
+		q->reaper = kthread_run(sbd_request_reaper, q,
+					"sbd%d_reaper%d", dev->id, i);
+		if (IS_ERR(q->reaper)) {
+			ret = PTR_ERR(q->reaper);
+			q->reaper = NULL;
+			i++;
+			goto err;
+		}
+		q->reaper->flags |= PF_MEMALLOC;
 	}
 	return 0;
+err:
+	sbd_stop_queues(dev, i);
+	return ret;
 }
 
 static inline void free_sbd_device(struct sbd_device *dev)
 {
-	socket_shutdown(dev->sock);
+	kfree(dev->queues);
 	vfree(dev->vdi.inode);
 	kfree(dev);
 }
@@ -193,7 +296,6 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 	struct sbd_device *dev, *tmp;
 	ssize_t ret;
 	int new_id = 0;
-	char name[DEV_NAME_LEN];
 
 	if (!try_module_get(THIS_MODULE))
 		return -ENODEV;
@@ -210,15 +312,20 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 		goto err_free_dev;
 	}
 
-	spin_lock_init(&dev->queue_lock);
 	spin_lock_init(&dev->vdi_lock);
-	INIT_LIST_HEAD(&dev->inflight_head);
-	INIT_LIST_HEAD(&dev->blocking_head);
-	INIT_LIST_HEAD(&dev->request_head);
-	init_waitqueue_head(&dev->reaper_wq);
-	init_waitqueue_head(&dev->submiter_wq);
-	rwlock_init(&dev->inflight_lock);
-	rwlock_init(&dev->blocking_lock);
+	spin_lock_init(&dev->create_lock);
+	hash_init(dev->creating);
+
+	dev->nr_queues = nr_queues ? nr_queues : num_online_cpus();
+#ifdef SBD_POLL
+	dev->nr_poll_queues = nr_poll_queues;
+#endif
+	dev->queues = kcalloc(dev->nr_queues + dev->nr_poll_queues,
+			      sizeof(*dev->queues), GFP_KERNEL);
+	if (!dev->queues) {
+		ret = -ENOMEM;
+		goto err_free_dev;
+	}
 
 	mutex_lock(&dev_list_mutex);
 	list_for_each_entry(tmp, &sbd_dev_list, list) {
@@ -232,33 +339,23 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 		goto err_free_dev;
 
 	dev->id = new_id;
-	snprintf(name, DEV_NAME_LEN, DRV_NAME "%d", dev->id);
 	dev->major = sbd_major;
 	dev->minor = sbd_dev_id_to_minor(dev->id);
-	dev->reaper = kthread_run(sbd_request_reaper, dev, "sbd_reaper");
-	if (IS_ERR(dev->reaper))
+	ret = sbd_start_queues(dev);
+	if (ret < 0)
 		goto err_free_dev;
-	dev->submiter = kthread_run(sbd_request_submiter, dev, "sbd_submiter");
-	if (IS_ERR(dev->submiter))
-		goto err_stop_reaper;
-	dev->reaper->flags |= PF_MEMALLOC;
-	dev->submiter->flags |= PF_MEMALLOC;
 
 	ret = sbd_add_disk(dev);
 	if (ret < 0)
-		goto err_stop_kthreads;
+		goto err_stop_queues;
 
 	mutex_lock(&dev_list_mutex);
 	list_add_tail(&dev->list, &sbd_dev_list);
 	mutex_unlock(&dev_list_mutex);
 
 	return count;
-err_stop_kthreads:
-	kthread_stop(dev->submiter);
-	wake_up(&dev->submiter_wq);
-err_stop_reaper:
-	kthread_stop(dev->reaper);
-	wake_up(&dev->reaper_wq);
+err_stop_queues:
+	sbd_stop_queues(dev, dev->nr_queues + dev->nr_poll_queues);
 err_free_dev:
 	free_sbd_device(dev);
 err_put:
@@ -278,6 +375,7 @@ static void sbd_del_disk(struct sbd_device *dev)
 		del_gendisk(disk);
 	if (disk->queue)
 		blk_cleanup_queue(disk->queue);
+	blk_mq_free_tag_set(&dev->tag_set);
 	put_disk(disk);
 }
 
@@ -314,12 +412,9 @@ static ssize_t sbd_remove(struct bus_type *bus, const char *buf,
 	if (!dev)
 		return -ENOENT;
 
-	kthread_stop(dev->reaper);
-	kthread_stop(dev->submiter);
-	wake_up(&dev->reaper_wq);
-	wake_up(&dev->submiter_wq);
-
+	/* the reapers complete the requests flushed by del_gendisk */
 	sbd_del_disk(dev);
+	sbd_stop_queues(dev, dev->nr_queues + dev->nr_poll_queues);
 	free_sbd_device(dev);
 	module_put(THIS_MODULE);
 
@@ -343,9 +438,11 @@ static ssize_t sbd_list(struct bus_type *bus, char *buf)
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0)
 
-static BUS_ATTR(add, S_IWUSR, NULL, sbd_add);
-static BUS_ATTR(remove, S_IWUSR, NULL, sbd_remove);
-static BUS_ATTR(list, S_IRUSR, sbd_list, NULL);
+static struct bus_attribute bus_attr_add = __ATTR(add, S_IWUSR, NULL, sbd_add);
+static struct bus_attribute bus_attr_remove = __ATTR(remove, S_IWUSR, NULL,
+						     sbd_remove);
+static struct bus_attribute bus_attr_list = __ATTR(list, S_IRUSR, sbd_list,
+						   NULL);
 
 static struct attribute *sbd_bus_attrs[] = {
 	&bus_attr_add.attr,
@@ -421,15 +518,9 @@ int __init sbd_init(void)
 	if (ret < 0)
 		goto err_unreg_blkdev;
 
-	ret = sheep_slab_create();
-	if (ret < 0)
-		goto err_sysfs_cleanup;
-
 	pr_info("%s: Sheepdog block device loaded\n", DRV_NAME);
 	return 0;
 
-err_sysfs_cleanup:
-	sbd_sysfs_cleanup();
 err_unreg_blkdev:
 	unregister_blkdev(sbd_major, DRV_NAME);
 	return ret;
@@ -439,7 +530,6 @@ void __exit sbd_exit(void)
 {
 	sbd_sysfs_cleanup();
 	unregister_blkdev(sbd_major, DRV_NAME);
-	sheep_slab_destroy();
 	pr_info("%s: Sheepdog block device unloaded\n", DRV_NAME);
 }
 
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pool of request buffers
+ *
+ * Request payloads and EC strips are allocated from power-of-two size classes
+ * between 4 KB and 4 MB.  Each thread caches a few free buffers of each class
+ * and moves them to and from the global free lists in batches, so that most
+ * allocations touch neither malloc nor a lock and never fault in fresh pages.
+ * Buffers are requested by the net workers and mostly freed by the main thread
+ * or the reactors, so the batches keep them flowing back.
+ *
+ * Buffers of 2 MB and more are mapped on their own and backed by transparent
+ * huge pages.  The global free lists keep at most BUF_HIGH_WATERMARK bytes,
+ * and buffers freed above it are returned to the system.
+ *
+ * The buffers from the system are accounted to SD_MEM_REQUEST, and while it is
+ * over its cap, the freed buffers are returned to the system instead of cached.
+ *
+ * With RDMA, buffers are registered when they come from the system and stay
+ * registered while they are cached, so the peer I/O uses them in place.
+ */
+
+#include "sheep_priv.h"
+
+#define BUF_MIN_SHIFT		12
+#define BUF_MAX_SHIFT		22
+#define BUF_NR_CLASSES		(BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+#define BUF_HUGE_SHIFT		21
+
+/* per class and thread, in bytes and in buffers */
+#define BUF_THREAD_CACHE	(8 * 1024 * 1024)
+#define BUF_THREAD_CACHE_MAX	64
+
+#define BUF_HIGH_WATERMARK	(UINT64_C(256) * 1024 * 1024)
+
+struct free_buf {
+	struct free_buf *next;
+};
+
+struct buf_class_cache {
+	struct free_buf *head;
+	int nr;
+};
+
+struct buf_thread_cache {
+	struct list_node list;
+	struct buf_class_cache classes[BUF_NR_CLASSES];
+
+	/* only written by the owner thread */
+	uint64_t alloc;
+	uint64_t hit;
+	uint64_t miss;
+};
+
+static struct buf_global_list {
+	struct sd_mutex lock;
+	struct free_buf *head;
+} global_lists[BUF_NR_CLASSES];
+
+/* protected by uatomic primitives */
+static uint64_t cached_bytes;
+static uint64_t trimmed;
+
+static LIST_HEAD(cache_list);
+static struct sd_mutex cache_lock = SD_MUTEX_INITIALIZER;
+/* counters of the exited threads, protected by cache_lock */
+static uint64_t retired_alloc, retired_hit, retired_miss;
+
+static pthread_key_t cache_key;
+static __thread struct buf_thread_cache *thread_cache;
+
+static inline int size_to_class(size_t size)
+{
+	int shift;
+
+	if (size > (1UL << BUF_MAX_SHIFT))
+		return -1;
+
+	shift = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+	return max(shift, BUF_MIN_SHIFT) - BUF_MIN_SHIFT;
+}
+
+static inline size_t class_size(int c)
+{
+	return 1UL << (c + BUF_MIN_SHIFT);
+}
+
+static inline int class_cache_max(int c)
+{
+	size_t nr = BUF_THREAD_CACHE / class_size(c);
+
+	if (nr < 2)
+		return 2;
+	return min(nr, (size_t)BUF_THREAD_CACHE_MAX);
+}
+
+static void *class_alloc(int c)
+{
+	size_t size = class_size(c), huge = 1UL << BUF_HUGE_SHIFT;
+	char *p, *buf;
+
+	if (size < huge) {
+		buf = valloc(size);
+		if (buf) {
+			rdma_register_buffer(buf, size);
+			sd_mem_charge(SD_MEM_REQUEST, size);
+		}
+		return buf;
+	}
+
+	/* align the buffer to the huge page so that THP can back all of it */
+	p = mmap(NULL, size + huge, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	buf = (char *)roundup((uintptr_t)p, huge);
+	if (buf != p)
+		munmap(p, buf - p);
+	munmap(buf + size, p + huge - buf);
+	madvise(buf, size, MADV_HUGEPAGE);
+	rdma_register_buffer(buf, size);
+	sd_mem_charge(SD_MEM_REQUEST, size);
+
+	return buf;
+}
+
+static void class_release(void *buf, int c)
+{
+	size_t size = class_size(c);
+
+	rdma_unregister_buffer(buf);
+	sd_mem_charge(SD_MEM_REQUEST, -(int64_t)size);
+	if (size < (1UL << BUF_HUGE_SHIFT))
+		free(buf);
+	else
+		munmap(buf, size);
+}
+
+/* Move up to nr buffers of the thread cache to the global list */
+static void flush_class_cache(struct buf_class_cache *cc, int c, int nr)
+{
+	struct buf_global_list *gl = global_lists + c;
+	struct free_buf *b, *release = NULL;
+	size_t size = class_size(c);
+	int nr_released = 0;
+
+	sd_mutex_lock(&gl->lock);
+	while (nr-- > 0 && (b = cc->head)) {
+		cc->head = b->next;
+		cc->nr--;
+
+		if (uatomic_read(&cached_bytes) + size > BUF_HIGH_WATERMARK ||
+		    sd_mem_over_cap(SD_MEM_REQUEST)) {
+			b->next = release;
+			release = b;
+			continue;
+		}
+		b->next = gl->head;
+		gl->head = b;
+		uatomic_add(&cached_bytes, size);
+	}
+	sd_mutex_unlock(&gl->lock);
+
+	while ((b = release)) {
+		release = b->next;
+		class_release(b, c);
+		nr_released++;
+	}
+	if (nr_released)
+		uatomic_add(&trimmed, nr_released);
+}
+
+/* Take up to nr buffers from the global list into the thread cache */
+static void refill_class_cache(struct buf_class_cache *cc, int c, int nr)
+{
+	struct buf_global_list *gl = global_lists + c;
+	struct free_buf *b;
+
+	if (!uatomic_read(&gl->head))
+		return;
+
+	sd_mutex_lock(&gl->lock);
+	while (nr-- > 0 && (b = gl->head)) {
+		gl->head = b->next;
+		uatomic_sub(&cached_bytes, class_size(c));
+
+		b->next = cc->head;
+		cc->head = b;
+		cc->nr++;
+	}
+	sd_mutex_unlock(&gl->lock);
+}
+
+static void put_thread_cache(void *arg)
+{
+	struct buf_thread_cache *tc = arg;
+
+	for (int c = 0; c < BUF_NR_CLASSES; c++)
+		flush_class_cache(tc->classes + c, c, tc->classes[c].nr);
+
+	sd_mutex_lock(&cache_lock);
+	list_del(&tc->list);
+	retired_alloc += tc->alloc;
+	retired_hit += tc->hit;
+	retired_miss += tc->miss;
+	sd_mutex_unlock(&cache_lock);
+
+	free(tc);
+}
+
+static struct buf_thread_cache *get_thread_cache(void)
+{
+	struct buf_thread_cache *tc = thread_cache;
+
+	if (likely(tc))
+		return tc;
+
+	tc = xzalloc(sizeof(*tc));
+	sd_mutex_lock(&cache_lock);
+	list_add(&tc->list, &cache_list);
+	sd_mutex_unlock(&cache_lock);
+
+	/* give the buffers back when the thread exits */
+	pthread_setspecific(cache_key, tc);
+	thread_cache = tc;
+	return tc;
+}
+
+/*
+ * Allocate a page aligned buffer, which has to be freed by buffer_free() with
+ * the same size.  Return NULL if we are out of memory.
+ */
+void *buffer_alloc(size_t size)
+{
+	int c = size_to_class(size);
+	struct buf_thread_cache *tc;
+	struct buf_class_cache *cc;
+	struct free_buf *b;
+
+	if (c < 0) {
+		void *buf = valloc(size);
+
+		if (buf)
+			sd_mem_charge(SD_MEM_REQUEST, size);
+		return buf;
+	}
+
+	tc = get_thread_cache();
+	cc = tc->classes + c;
+	uatomic_set(&tc->alloc, tc->alloc + 1);
+
+	if (!cc->head)
+		refill_class_cache(cc, c, class_cache_max(c) / 2);
+
+	b = cc->head;
+	if (b) {
+		cc->head = b->next;
+		cc->nr--;
+		uatomic_set(&tc->hit, tc->hit + 1);
+		return b;
+	}
+
+	uatomic_set(&tc->miss, tc->miss + 1);
+	return class_alloc(c);
+}
+
+void *xbuffer_alloc(size_t size)
+{
+	void *buf = buffer_alloc(size);
+
+	if (unlikely(!buf))
+		panic("Out of memory");
+	return buf;
+}
+
+void buffer_free(void *buf, size_t size)
+{
+	int c = size_to_class(size);
+	struct buf_class_cache *cc;
+	struct free_buf *b = buf;
+
+	if (!buf)
+		return;
+
+	if (c < 0) {
+		sd_mem_charge(SD_MEM_REQUEST, -(int64_t)size);
+		free(buf);
+		return;
+	}
+
+	if (sd_mem_over_cap(SD_MEM_REQUEST)) {
+		class_release(buf, c);
+		uatomic_inc(&trimmed);
+		uatomic_inc(&sys->stat.mem.throttled);
+		return;
+	}
+
+	cc = get_thread_cache()->classes + c;
+	if (cc->nr >= class_cache_max(c))
+		flush_class_cache(cc, c, cc->nr / 2);
+
+	b->next = cc->head;
+	cc->head = b;
+	cc->nr++;
+}
+
+void buffer_pool_stat(struct s_buffer_pool *stat)
+{
+	struct buf_thread_cache *tc;
+	uint64_t cached = uatomic_read(&cached_bytes);
+
+	sd_mutex_lock(&cache_lock);
+	stat->alloc = retired_alloc;
+	stat->hit = retired_hit;
+	stat->miss = retired_miss;
+	list_for_each_entry(tc, &cache_list, list) {
+		stat->alloc += uatomic_read(&tc->alloc);
+		stat->hit += uatomic_read(&tc->hit);
+		stat->miss += uatomic_read(&tc->miss);
+		/* racy, but good enough for the statistics */
+		for (int c = 0; c < BUF_NR_CLASSES; c++)
+			cached += (uint64_t)uatomic_read(&tc->classes[c].nr) *
+				class_size(c);
+	}
+	sd_mutex_unlock(&cache_lock);
+
+	stat->cached = cached;
+	stat->trimmed = uatomic_read(&trimmed);
+}
+
+int buffer_pool_init(void)
+{
+	int ret = pthread_key_create(&cache_key, put_thread_cache);
+
+	if (ret) {
+		sd_err("failed to create a thread key, %s", strerror(ret));
+		return -1;
+	}
+
+	for (int c = 0; c < BUF_NR_CLASSES; c++)
+		sd_init_mutex(&global_lists[c].lock);
+	return 0;
+}
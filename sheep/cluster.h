@@ -132,11 +132,14 @@ struct cluster_driver {
 	 * Release the distributed lock.
 	 *
 	 * If the owner of the cluster lock release it (or the owner is
-	 * killed by accident), zookeeper will trigger zk_watch() which will
-	 * wake up all waiting threads to compete new owner of the lock
+	 * killed by accident), the lock becomes available to the waiting
+	 * threads.
 	 *
 	 * After all thread unlock, all the resource of this distributed lock
 	 * will be released.
+	 *
+	 * The drivers without locks of their own use sheep_lock() and
+	 * sheep_unlock(), served by the sheep themselves.
 	 */
 	void (*unlock)(uint64_t lock_id);
 
@@ -210,4 +213,24 @@ bool sd_join_handler(const struct sd_node *joining,
 		     const struct rb_root *nroot, size_t nr_nodes,
 		     void *opaque);
 
+/* cluster locks served by the sheep, see lock.c */
+void sheep_lock(uint64_t lock_id);
+void sheep_unlock(uint64_t lock_id);
+
+/*
+ * cluster messages above CLUSTER_MSG_OFFLOAD_SIZE sent point to point, see
+ * offload.c
+ */
+#define CLUSTER_MSG_OFFLOAD_SIZE (16 * 1024)
+
+typedef void (*cluster_msg_fn)(const struct node_id *nid, uint64_t id,
+			       void *msg, size_t msg_len);
+
+uint64_t cluster_msg_offload(const struct node_id *nid, const void *msg,
+			     size_t msg_len);
+void *cluster_msg_lookup(const struct node_id *nid, uint64_t id);
+void cluster_msg_fetch(const struct node_id *nid, uint64_t id, size_t msg_len,
+		       const struct node_id *members, int nr_members,
+		       cluster_msg_fn fn);
+
 #endif
@@ -75,18 +75,35 @@ struct corosync_event {
 
 	bool callbacked;
 
+	/* waiting for the offloaded message, see offload.c */
+	bool pending;
+	struct node_id offload_nid;
+	uint64_t offload_id;
+
 	struct list_node list;
 };
 
+/*
+ * The message follows the nr_nodes nodes, or is offloaded to offload_nid if
+ * offload_id is set
+ */
 struct corosync_message {
 	struct cpg_node sender;
 	enum corosync_message_type type:16;
 	uint16_t nr_nodes;
 	uint32_t msg_len;
-	struct cpg_node nodes[COROSYNC_MAX_NODES];
-	uint8_t msg[0];
+	struct node_id offload_nid;
+	uint64_t offload_id;
+	struct cpg_node nodes[0];
 };
 
+static inline void *cmsg_payload(struct corosync_message *cmsg)
+{
+	if (cmsg->offload_id)
+		return NULL;
+	return cmsg->nodes + cmsg->nr_nodes;
+}
+
 static int cpg_node_cmp(struct cpg_node *a, struct cpg_node *b)
 {
 	int cmp = intcmp(a->nodeid, b->nodeid);
@@ -164,7 +181,7 @@ static int send_message(enum corosync_message_type type,
 			struct cpg_node *sender, struct cpg_node *nodes,
 			size_t nr_nodes, void *msg, size_t msg_len)
 {
-	struct iovec iov[2];
+	struct iovec iov[3];
 	int ret, iov_cnt = 1;
 	size_t mlen = MIN(msg_len, SD_MAX_EVENT_BUF_SIZE);
 
@@ -172,17 +189,31 @@ static int send_message(enum corosync_message_type type,
 		.type = type,
 		.msg_len = mlen,
 		.sender = *sender,
-		.nr_nodes = nr_nodes,
+		.nr_nodes = nodes ? nr_nodes : 0,
 	};
 
-	if (nodes)
-		memcpy(cmsg.nodes, nodes, sizeof(*nodes) * nr_nodes);
+	/*
+	 * The ordered multicast of a large message stalls the ring, so only
+	 * the descriptor goes in it.  The joining node isn't in the cluster
+	 * to serve its JOIN.
+	 */
+	if (msg && mlen > CLUSTER_MSG_OFFLOAD_SIZE &&
+	    type != COROSYNC_MSG_TYPE_JOIN) {
+		cmsg.offload_nid = this_node.node.nid;
+		cmsg.offload_id = cluster_msg_offload(&cmsg.offload_nid, msg,
+						      mlen);
+	}
 
 	iov[0].iov_base = &cmsg;
 	iov[0].iov_len = sizeof(cmsg);
-	if (msg) {
-		iov[1].iov_base = msg;
-		iov[1].iov_len = mlen;
+	if (cmsg.nr_nodes) {
+		iov[iov_cnt].iov_base = nodes;
+		iov[iov_cnt].iov_len = sizeof(*nodes) * nr_nodes;
+		iov_cnt++;
+	}
+	if (msg && !cmsg.offload_id) {
+		iov[iov_cnt].iov_base = msg;
+		iov[iov_cnt].iov_len = mlen;
 		iov_cnt++;
 	}
 retry:
@@ -367,6 +398,10 @@ static void __corosync_dispatch(void)
 			cevent = list_first_entry(&corosync_block_event_list,
 						  typeof(*cevent), list);
 
+		if (cevent->pending)
+			/* events are handled in order, see offload_fetched() */
+			return;
+
 		join_finished = update_join_status(cevent);
 
 		if (join_finished) {
@@ -400,7 +435,7 @@ update_event(enum corosync_event_type type, struct cpg_node *sender, void *msg,
 		return NULL;
 
 	cevent->msg_len = msg_len;
-	if (msg_len) {
+	if (msg && msg_len) {
 		cevent->msg = realloc(cevent->msg, msg_len);
 		if (!cevent->msg)
 			panic("failed to allocate memory");
@@ -421,6 +456,68 @@ static void queue_event(struct corosync_event *cevent)
 		list_add_tail(&cevent->list, &corosync_nonblock_event_list);
 }
 
+static struct corosync_event *find_pending_event(const struct node_id *nid,
+						 uint64_t id)
+{
+	struct corosync_event *cevent;
+
+	list_for_each_entry(cevent, &corosync_nonblock_event_list, list)
+		if (cevent->pending && cevent->offload_id == id &&
+		    !node_id_cmp(&cevent->offload_nid, nid))
+			return cevent;
+
+	return NULL;
+}
+
+static void offload_fetched(const struct node_id *nid, uint64_t id, void *msg,
+			    size_t msg_len)
+{
+	struct corosync_event *cevent = find_pending_event(nid, id);
+
+	if (!cevent)
+		return;
+
+	if (!msg) {
+		/* the sender and everyone who had the message are gone */
+		list_del(&cevent->list);
+		free(cevent);
+	} else {
+		cevent->msg = xmalloc(msg_len);
+		memcpy(cevent->msg, msg, msg_len);
+		cevent->pending = false;
+	}
+
+	__corosync_dispatch();
+}
+
+/* Get the message the descriptor in cmsg points to for cevent */
+static void fetch_offloaded(struct corosync_event *cevent,
+			    struct corosync_message *cmsg)
+{
+	struct node_id members[COROSYNC_MAX_NODES];
+	struct cpg_node *nodes = cpg_nodes;
+	size_t nr_nodes = nr_cpg_nodes;
+
+	cevent->offload_nid = cmsg->offload_nid;
+	cevent->offload_id = cmsg->offload_id;
+	cevent->msg = cluster_msg_lookup(&cmsg->offload_nid,
+					 cmsg->offload_id);
+	if (cevent->msg)
+		return;
+
+	/* the joining node knows the members from ACCEPT only */
+	if (cmsg->nr_nodes) {
+		nodes = cmsg->nodes;
+		nr_nodes = cmsg->nr_nodes;
+	}
+	for (int i = 0; i < nr_nodes; i++)
+		members[i] = nodes[i].node.nid;
+
+	cevent->pending = true;
+	cluster_msg_fetch(&cmsg->offload_nid, cmsg->offload_id, cmsg->msg_len,
+			  members, nr_nodes, offload_fetched);
+}
+
 static void cdrv_cpg_deliver(cpg_handle_t handle,
 			     const struct cpg_name *group_name,
 			     uint32_t nodeid, uint32_t pid,
@@ -434,7 +531,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 	switch (cmsg->type) {
 	case COROSYNC_MSG_TYPE_JOIN:
 		cevent = update_event(COROSYNC_EVENT_TYPE_JOIN, &cmsg->sender,
-				      cmsg->msg, cmsg->msg_len);
+				      cmsg_payload(cmsg), cmsg->msg_len);
 		if (!cevent)
 			break;
 
@@ -443,7 +540,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		break;
 	case COROSYNC_MSG_TYPE_UNBLOCK:
 		cevent = update_event(COROSYNC_EVENT_TYPE_BLOCK, &cmsg->sender,
-				      cmsg->msg, cmsg->msg_len);
+				      NULL, 0);
 		if (cevent) {
 			list_del(&cevent->list);
 			free(cevent->msg);
@@ -468,9 +565,11 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 
 		cevent->sender = cmsg->sender;
 		cevent->msg_len = cmsg->msg_len;
-		if (cmsg->msg_len) {
+		if (cmsg->offload_id)
+			fetch_offloaded(cevent, cmsg);
+		else if (cmsg->msg_len) {
 			cevent->msg = xzalloc(cmsg->msg_len);
-			memcpy(cevent->msg, cmsg->msg, cmsg->msg_len);
+			memcpy(cevent->msg, cmsg_payload(cmsg), cmsg->msg_len);
 		} else
 			cevent->msg = NULL;
 
@@ -483,7 +582,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		cevent->msg_len = cmsg->msg_len;
 		if (cmsg->msg_len) {
 			cevent->msg = xzalloc(cmsg->msg_len);
-			memcpy(cevent->msg, cmsg->msg, cmsg->msg_len);
+			memcpy(cevent->msg, cmsg_payload(cmsg), cmsg->msg_len);
 		} else
 			cevent->msg = NULL;
 
@@ -491,7 +590,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		break;
 	case COROSYNC_MSG_TYPE_ACCEPT:
 		cevent = update_event(COROSYNC_EVENT_TYPE_JOIN, &cmsg->sender,
-				      cmsg->msg, cmsg->msg_len);
+				      cmsg_payload(cmsg), cmsg->msg_len);
 		if (!cevent)
 			break;
 
@@ -499,6 +598,8 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		cevent->nr_nodes = cmsg->nr_nodes;
 		memcpy(cevent->nodes, cmsg->nodes,
 		       sizeof(*cmsg->nodes) * cmsg->nr_nodes);
+		if (cmsg->offload_id)
+			fetch_offloaded(cevent, cmsg);
 
 		break;
 	}
@@ -749,14 +850,6 @@ again:
 	return 0;
 }
 
-static void corosync_lock(uint64_t lock_id)
-{
-}
-
-static void corosync_unlock(uint64_t lock_id)
-{
-}
-
 static int corosync_update_node(struct sd_node *node)
 {
 	struct cpg_node cnode = this_node;
@@ -777,8 +870,8 @@ static struct cluster_driver cdrv_corosync = {
 	.notify		= corosync_notify,
 	.block		= corosync_block,
 	.unblock	= corosync_unblock,
-	.lock		= corosync_lock,
-	.unlock		= corosync_unlock,
+	.lock		= sheep_lock,
+	.unlock		= sheep_unlock,
 	.update_node	= corosync_update_node,
 };
 
@@ -280,19 +280,12 @@ static void sph_event_handler(int fd, int events, void *data)
 		;
 }
 
-static void msg_new_node(struct sph_msg *rcv)
+static void msg_new_node(struct sph_msg *rcv, void *body)
 {
 	int ret;
-	struct sph_msg_join *join;
+	struct sph_msg_join *join = body;
 	struct sph_msg snd;
 
-	join = xzalloc(rcv->body_len);
-	ret = xread(sph_comm_fd, join, rcv->body_len);
-	if (ret != rcv->body_len) {
-		sd_err("xread() failed: %m");
-		exit(1);
-	}
-
 	/* FIXME: member change events must be ordered with nonblocked events */
 	if (!sd_join_handler(&join->new_node, join->nodes, join->nr_nodes,
 			     join->opaque))
@@ -311,20 +304,11 @@ static void msg_new_node(struct sph_msg *rcv)
 		sd_err("writev() failed: %m");
 		exit(1);
 	}
-	free(join);
 }
 
-static void msg_new_node_finish(struct sph_msg *rcv)
+static void msg_new_node_finish(struct sph_msg *rcv, void *body)
 {
-	int ret;
-	struct sph_msg_join_node_finish *join_node_finish;
-
-	join_node_finish = xzalloc(rcv->body_len);
-	ret = xread(sph_comm_fd, join_node_finish, rcv->body_len);
-	if (ret != rcv->body_len) {
-		sd_err("xread() failed: %m");
-		exit(1);
-	}
+	struct sph_msg_join_node_finish *join_node_finish = body;
 
 	memcpy(nodes, join_node_finish->nodes,
 	       join_node_finish->nr_nodes * sizeof(struct sd_node));
@@ -335,21 +319,11 @@ static void msg_new_node_finish(struct sph_msg *rcv)
 	/* FIXME: member change events must be ordered with nonblocked events */
 	sd_accept_handler(&join_node_finish->new_node, nodes, nr_nodes,
 			  join_node_finish->opaque);
-
-	free(join_node_finish);
 }
 
-static void msg_notify_forward(struct sph_msg *rcv)
+static void msg_notify_forward(struct sph_msg *rcv, void *body)
 {
-	int ret;
-	struct sph_msg_notify_forward *notify_forward;
-
-	notify_forward = xzalloc(rcv->body_len);
-	ret = xread(sph_comm_fd, notify_forward, rcv->body_len);
-	if (ret != rcv->body_len) {
-		sd_err("xread() failed: %m");
-		exit(1);
-	}
+	struct sph_msg_notify_forward *notify_forward = body;
 
 	if (notify_forward->unblock)
 		remove_one_block_event();
@@ -357,85 +331,118 @@ static void msg_notify_forward(struct sph_msg *rcv)
 	push_sph_event(true, &notify_forward->from_node,
 		notify_forward->notify_msg,
 		rcv->body_len - sizeof(*notify_forward));
-
-	free(notify_forward);
 }
 
-static void msg_block_forward(struct sph_msg *rcv)
+static void msg_block_forward(struct sph_msg *rcv, void *body)
 {
-	int ret;
-	struct sd_node sender;
-
-	ret = xread(sph_comm_fd, &sender, sizeof(sender));
-	if (ret != sizeof(sender)) {
-		sd_err("xread() failed: %m");
-		exit(1);
-	}
-
-	push_sph_event(false, &sender, NULL, 0);
+	push_sph_event(false, body, NULL, 0);
 }
 
-static void do_leave_sheep(void)
+static void do_leave_sheep(struct sd_node *sender)
 {
-	int ret;
-	struct sd_node sender;
-
-	ret = xread(sph_comm_fd, &sender, sizeof(sender));
-	if (ret != sizeof(sender)) {
-		sd_err("xread() failed: %m");
-		exit(1);
-	}
+	sd_info("removing node: %s", node_to_str(sender));
 
-	sd_info("removing node: %s", node_to_str(&sender));
-
-	if (xlremove(&sender, nodes, &nr_nodes, node_cmp))
+	if (xlremove(sender, nodes, &nr_nodes, node_cmp))
 		goto removed;
 
-	sd_info("leave message from unknown node: %s", node_to_str(&sender));
+	sd_info("leave message from unknown node: %s", node_to_str(sender));
 	return;
 
 removed:
 	sd_debug("calling sd_leave_handler(), sender: %s",
-		 node_to_str(&sender));
+		 node_to_str(sender));
 	/* FIXME: member change events must be ordered with nonblocked events */
-	sd_leave_handler(&sender, nodes, nr_nodes);
+	sd_leave_handler(sender, nodes, nr_nodes);
 }
 
-static void msg_remove(struct sph_msg *rcv)
+static void msg_remove(struct sph_msg *rcv, void *body)
 {
 	sd_info("sudden leaving of sheep is caused");
-	do_leave_sheep();
+	do_leave_sheep(body);
 }
 
-static void msg_leave_forward(struct sph_msg *rcv)
+static void msg_leave_forward(struct sph_msg *rcv, void *body)
 {
 	sd_info("intuitive leaving of sheep is caused");
-	do_leave_sheep();
+	do_leave_sheep(body);
 }
 
-static void (*msg_handlers[])(struct sph_msg *) = {
+static void msg_batch(struct sph_msg *rcv, void *body);
+
+/* the least body of each message */
+static const size_t msg_body_len[] = {
+	[SPH_SRV_MSG_NEW_NODE] = sizeof(struct sph_msg_join),
+	[SPH_SRV_MSG_NEW_NODE_FINISH] = sizeof(struct sph_msg_join_node_finish),
+	[SPH_SRV_MSG_NOTIFY_FORWARD] = sizeof(struct sph_msg_notify_forward),
+	[SPH_SRV_MSG_BLOCK_FORWARD] = sizeof(struct sd_node),
+	[SPH_SRV_MSG_REMOVE] = sizeof(struct sd_node),
+	[SPH_SRV_MSG_LEAVE_FORWARD] = sizeof(struct sd_node),
+};
+
+static void (*msg_handlers[])(struct sph_msg *, void *) = {
 	[SPH_SRV_MSG_NEW_NODE] = msg_new_node,
 	[SPH_SRV_MSG_NEW_NODE_FINISH] = msg_new_node_finish,
 	[SPH_SRV_MSG_NOTIFY_FORWARD] = msg_notify_forward,
 	[SPH_SRV_MSG_BLOCK_FORWARD] = msg_block_forward,
 	[SPH_SRV_MSG_REMOVE] = msg_remove,
 	[SPH_SRV_MSG_LEAVE_FORWARD] = msg_leave_forward,
+	[SPH_SRV_MSG_BATCH] = msg_batch,
 };
 
-static void interpret_msg(struct sph_msg *rcv)
+static void interpret_msg(struct sph_msg *rcv, void *body)
 {
-	if (!(0 <= rcv->type && rcv->type < ARRAY_SIZE(msg_handlers))) {
+	if (!(0 <= rcv->type && rcv->type < ARRAY_SIZE(msg_handlers)) ||
+	    !msg_handlers[rcv->type]) {
 		sd_err("invalid message from shepherd: %s",
 		       sph_srv_msg_to_str(rcv->type));
 		exit(1);
 	}
+	if (rcv->type < ARRAY_SIZE(msg_body_len) &&
+	    rcv->body_len < msg_body_len[rcv->type]) {
+		sd_err("short message from shepherd: %s, %"PRIu32" bytes",
+		       sph_srv_msg_to_str(rcv->type), rcv->body_len);
+		exit(1);
+	}
 
-	msg_handlers[rcv->type](rcv);
+	msg_handlers[rcv->type](rcv, body);
+}
+
+/* The messages shepherd sent together, in the order it got them */
+static void msg_batch(struct sph_msg *rcv, void *body)
+{
+	char *p = body, *end = p + rcv->body_len;
+	struct sph_msg msg;
+
+	while (p < end) {
+		if (end - p < sizeof(msg))
+			goto broken;
+		memcpy(&msg, p, sizeof(msg));
+		p += sizeof(msg);
+		if (end - p < msg.body_len || msg.type == SPH_SRV_MSG_BATCH)
+			goto broken;
+
+		/* the bodies are packed, the structures need alignment */
+		if ((uintptr_t)p % sizeof(uint64_t)) {
+			void *copy = xmalloc(msg.body_len);
+
+			memcpy(copy, p, msg.body_len);
+			interpret_msg(&msg, copy);
+			free(copy);
+		} else
+			interpret_msg(&msg, p);
+		p += msg.body_len;
+	}
+	return;
+broken:
+	sd_err("broken batch of messages from shepherd");
+	exit(1);
 }
 
 static void read_msg_from_shepherd(void)
 {
 	struct sph_msg rcv;
+	void *body;
+	int ret;
 
 	switch (state) {
 	case STATE_PRE_JOIN:
@@ -443,7 +450,14 @@ static void read_msg_from_shepherd(void)
 		break;
 	case STATE_JOINED:
 		read_msg(&rcv);
-		interpret_msg(&rcv);
+		body = xzalloc(rcv.body_len);
+		ret = xread(sph_comm_fd, body, rcv.body_len);
+		if (ret != rcv.body_len) {
+			sd_err("xread() failed: %m");
+			exit(1);
+		}
+		interpret_msg(&rcv, body);
+		free(body);
 		break;
 	default:
 		panic("invalid state of shepherd cluster driver: %d",
@@ -632,6 +646,8 @@ static struct cluster_driver cdrv_shepherd = {
 	.notify		= shepherd_notify,
 	.block		= shepherd_block,
 	.unblock	= shepherd_unblock,
+	.lock		= sheep_lock,
+	.unlock		= sheep_unlock,
 	.update_node	= shepherd_update_node,
 	.get_local_addr = get_local_addr,
 };
@@ -16,7 +16,6 @@
 #include <sys/epoll.h>
 #include <zookeeper/zookeeper.h>
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "cluster.h"
 #include "config.h"
@@ -31,42 +30,14 @@
 #define QUEUE_ZNODE "/queue"
 #define MEMBER_ZNODE "/member"
 #define MASTER_ZNODE "/master"
-#define LOCK_ZNODE "/lock"
 #define QUEUE_POS_ZNODE "/queue_pos"
 
 static int zk_timeout = SESSION_TIMEOUT;
 static int my_master_seq;
 static char zk_hosts[MAX_NODE_STR_LEN];
 
-/* structure for distributed lock */
-struct cluster_lock {
-	struct hlist_node hnode;
-	/* id is passed by users to represent a lock handle */
-	uint64_t id;
-	/* referenced by different threads in one sheepdog daemon */
-	uint64_t ref;
-	/* wait for the release of id by other lock owner */
-	sem_t wait_wakeup;
-	/* lock for different threads of the same node on the same id */
-	struct sd_mutex id_lock;
-	char lock_path[MAX_NODE_STR_LEN];
-};
-
 #define WAIT_TIME	1		/* second */
 
-#define HASH_BUCKET_NR	1021
-static struct hlist_head *cluster_locks_table;
-static struct sd_mutex table_locks[HASH_BUCKET_NR];
-
-/*
- * Wait a while when create, delete or get_children fail on
- * zookeeper lock so it will not print too much loop log
- */
-static void zk_wait(void)
-{
-	sleep(WAIT_TIME);
-}
-
 /* iterate child znodes */
 #define FOR_EACH_ZNODE(parent, path, strs)			       \
 	for ((strs)->data += (strs)->count;			       \
@@ -83,6 +54,7 @@ enum zk_event_type {
 	EVENT_UNBLOCK,
 	EVENT_NOTIFY,
 	EVENT_UPDATE_NODE,
+	EVENT_BATCH,
 };
 
 struct zk_node {
@@ -91,6 +63,7 @@ struct zk_node {
 	struct sd_node node;
 	bool callbacked;
 	bool gone;
+	bool seen; /* its member znode was listed, see watch_members() */
 };
 
 #define ZK_MAX_BUF_SIZE (1*1024*1024) /* 1M */
@@ -105,6 +78,20 @@ struct zk_event {
 	uint8_t buf[ZK_MAX_BUF_SIZE];
 };
 
+/*
+ * The block, unblock and notify events of this node issued in a round of the
+ * main loop are pushed as one EVENT_BATCH, whose buf is a sequence of the
+ * entries below, and applied in order by every node.
+ */
+struct zk_batch_entry {
+	uint32_t type;
+	uint32_t buf_len;
+	uint8_t buf[];
+};
+
+/* maximum events handled in a run of the event handler */
+#define ZK_POP_BATCH 64
+
 static struct rb_root sd_node_root = RB_ROOT;
 static size_t nr_sd_nodes;
 static struct rb_root zk_node_root = RB_ROOT;
@@ -115,6 +102,10 @@ static uatomic_bool is_master;
 static uatomic_bool stop;
 static bool joined;
 static bool first_push = true;
+static struct zk_event *zk_batch;
+static size_t zk_batch_nr;
+static struct timer zk_batch_timer;
+static bool zk_batch_retrying;
 
 static void zk_compete_master(void);
 
@@ -268,6 +259,23 @@ static inline ZOOAPI int zk_get_data(const char *path, void *buffer,
 	return rc;
 }
 
+/*
+ * Get the data without a watch, for the queue znodes, whose changes don't
+ * matter once they are read, and the positions of the members
+ */
+static inline ZOOAPI int zk_get_data_nowatch(const char *path, void *buffer,
+					   int *buffer_len)
+{
+	int rc;
+	do {
+		rc = zoo_get(zhandle, path, 0, (char *)buffer,
+			     buffer_len, NULL);
+	} while (rc == ZOPERATIONTIMEOUT || rc == ZCONNECTIONLOSS);
+	CHECK_ZK_RC(rc, path);
+
+	return rc;
+}
+
 static inline ZOOAPI int
 zk_set_data(const char *path, const char *buffer, int buflen, int version)
 {
@@ -303,154 +311,6 @@ static inline ZOOAPI int zk_get_children(const char *path,
 	return rc;
 }
 
-/*
- * All the operations of the lock table is protected by
- * cluster_lock->id_lock so we don't need to add lock here
- */
-
-static int lock_table_lookup_wakeup(uint64_t lock_id)
-{
-	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
-	int res = -1;
-	struct hlist_node *iter;
-	struct cluster_lock *lock;
-
-	sd_mutex_lock(table_locks + hval);
-	hlist_for_each_entry(lock, iter, cluster_locks_table + hval, hnode) {
-		if (lock->id == lock_id) {
-			sem_post(&lock->wait_wakeup);
-			res = 0;
-			break;
-		}
-	}
-	sd_mutex_unlock(table_locks + hval);
-	return res;
-}
-
-static struct cluster_lock *lock_table_lookup_acquire(uint64_t lock_id)
-{
-	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
-	int rc;
-	struct hlist_node *iter;
-	struct cluster_lock *lock, *ret_lock = NULL;
-	char path[MAX_NODE_STR_LEN];
-
-	sd_mutex_lock(table_locks + hval);
-	hlist_for_each_entry(lock, iter, cluster_locks_table + hval, hnode) {
-		if (lock->id == lock_id) {
-			ret_lock = lock;
-			ret_lock->ref++;
-			break;
-		}
-	}
-
-	if (!ret_lock) {
-		/* create lock and add it to hash table */
-		ret_lock = xzalloc(sizeof(*ret_lock));
-		ret_lock->id = lock_id;
-		ret_lock->ref = 1;
-		snprintf(path, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64,
-			 ret_lock->id);
-		rc = zk_init_node(path);
-		if (rc)
-			panic("Failed to init node %s", path);
-
-		sem_init(&ret_lock->wait_wakeup, 0, 1);
-		sd_init_mutex(&ret_lock->id_lock);
-
-		hlist_add_head(&(ret_lock->hnode), cluster_locks_table + hval);
-	}
-	sd_mutex_unlock(table_locks + hval);
-
-	/*
-	 * if many threads use locks with same id, we should use
-	 * ->id_lock to avoid the only zookeeper handler to
-	 * create many seq-ephemeral files.
-	 */
-	sd_mutex_lock(&ret_lock->id_lock);
-	return ret_lock;
-}
-
-static void lock_table_lookup_release(uint64_t lock_id)
-{
-	uint64_t hval = sd_hash_64(lock_id) % HASH_BUCKET_NR;
-	int rc;
-	struct hlist_node *iter;
-	struct cluster_lock *lock;
-	char path[MAX_NODE_STR_LEN];
-
-	sd_mutex_lock(table_locks + hval);
-	hlist_for_each_entry(lock, iter, cluster_locks_table + hval, hnode) {
-		if (lock->id != lock_id)
-			continue;
-		while (true) {
-			rc = zk_delete_node(lock->lock_path, -1);
-			if (rc == ZOK || rc == ZNONODE) {
-				sd_debug("delete path: %s ok", lock->lock_path);
-				break;
-			}
-			sd_err("Failed to delete path: %s %s", lock->lock_path,
-			       zerror(rc));
-			zk_wait();
-		}
-		lock->lock_path[0] = '\0';
-		sd_mutex_unlock(&lock->id_lock);
-		lock->ref--;
-		if (!lock->ref) {
-			hlist_del(iter);
-			/* free all resource used by this lock */
-			sd_destroy_mutex(&lock->id_lock);
-			sem_destroy(&lock->wait_wakeup);
-			snprintf(path, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64,
-				 lock->id);
-			/*
-			 * If deletion of directory 'lock_id' fail, we only get
-			 * a * empty directory in zookeeper. That's unharmful
-			 * so we don't need to retry it.
-			 */
-			rc = zk_delete_node(path, -1);
-			if (rc != ZOK)
-				sd_err("Failed to delete path: %s %s", path,
-				      zerror(rc));
-			free(lock);
-		}
-		break;
-	}
-	sd_mutex_unlock(table_locks + hval);
-}
-
-/*
- * If this node leave the cluster, we need to delete the znode which created
- * for distributed lock. Otherwise, the lock will never be released.
- */
-static void lock_table_remove_znodes(void)
-{
-	uint64_t hval;
-	int rc;
-	struct hlist_node *iter;
-	struct cluster_lock *lock;
-
-	for (hval = 0; hval < HASH_BUCKET_NR; hval++) {
-		sd_mutex_lock(table_locks + hval);
-		hlist_for_each_entry(lock, iter, cluster_locks_table + hval,
-				     hnode) {
-			while (true) {
-				rc = zk_delete_node(lock->lock_path, -1);
-				if (rc == ZOK || rc == ZNONODE) {
-					sd_debug("delete path: %s ok",
-						 lock->lock_path);
-					break;
-				}
-				sd_err("Failed to delete path: %s %s",
-				       lock->lock_path,
-				       zerror(rc));
-				zk_wait();
-			}
-		}
-		sd_mutex_unlock(table_locks + hval);
-	}
-}
-
 /* ZooKeeper-based queue give us an totally ordered events */
 static int efd;
 static int32_t queue_pos;
@@ -488,7 +348,7 @@ static int zk_find_seq_node(uint64_t id, char *seq_path, int seq_path_len,
 
 		snprintf(seq_path, seq_path_len, QUEUE_ZNODE"/%010"PRId32, seq);
 		len = offsetof(typeof(ev), id) + sizeof(ev.id);
-		rc = zk_get_data(seq_path, &ev, &len);
+		rc = zk_get_data_nowatch(seq_path, &ev, &len);
 		switch (rc) {
 		case ZOK:
 			if (ev.id == id) {
@@ -579,16 +439,29 @@ static int push_join_response(struct zk_event *ev)
 	return ZOK;
 }
 
-static int zk_queue_pop_advance(struct zk_event *ev)
+/*
+ * Pop the event at queue_pos into ev.  If there is none, *popped is false and
+ * a watch is left on the next position.
+ */
+static int zk_queue_pop_advance(struct zk_event *ev, bool *popped)
 {
-	int len;
+	int len, rc;
 	char path[MAX_NODE_STR_LEN];
 	char queue_pos_path[MAX_NODE_STR_LEN];
 
 	len = sizeof(*ev);
 	snprintf(path, sizeof(path), QUEUE_ZNODE "/%010"PRId32, queue_pos);
 
-	RETURN_IF_ERROR(zk_get_data(path, ev, &len), "path %s", path);
+	rc = zk_get_data_nowatch(path, ev, &len);
+	if (rc == ZNONODE) {
+		/* the get leaves no watch on a missing node */
+		RETURN_IF_ERROR(zk_queue_peek(popped), "");
+		if (!*popped)
+			return ZOK;
+		rc = zk_get_data_nowatch(path, ev, &len);
+	}
+	RETURN_IF_ERROR(rc, "path %s", path);
+	*popped = true;
 	sd_debug("%s, type:%d, len:%d, pos:%" PRId32, path, ev->type, len,
 		 queue_pos);
 
@@ -606,6 +479,133 @@ static int zk_queue_pop_advance(struct zk_event *ev)
 	return ZOK;
 }
 
+/*
+ * Garbage collection of the queue
+ *
+ * Each member writes its position in the queue to QUEUE_POS_ZNODE every
+ * QUEUE_DEL_BATCH events, so every member has consumed the events below the
+ * least of the positions.  Every QUEUE_GC_INTERVAL seconds the master deletes
+ * up to QUEUE_GC_BATCH of them from the oldest on.  It keeps the last
+ * QUEUE_DEL_BATCH below the least position for the nodes joining, which have
+ * no position until they are accepted.  The queue znodes aren't watched, so
+ * their deletions notify nobody.
+ */
+#define QUEUE_GC_INTERVAL	10 /* seconds */
+#define QUEUE_GC_BATCH		1000
+
+static struct work_queue *queue_gc_wqueue;
+static struct timer queue_gc_timer;
+static bool queue_gc_running;
+static int32_t queue_gc_pos = -1; /* the oldest event left, -1 if unknown */
+
+static inline void queue_seq_path(char *path, size_t len, int32_t seq)
+{
+	snprintf(path, len, QUEUE_ZNODE "/%010"PRId32, seq);
+}
+
+/* The least position of the members, -1 if none */
+static int32_t zk_queue_least_pos(void)
+{
+	struct String_vector strs;
+	char path[MAX_NODE_STR_LEN];
+	int32_t pos, least = INT32_MAX;
+	int len, rc;
+
+	do {
+		rc = zoo_get_children(zhandle, QUEUE_POS_ZNODE, 0, &strs);
+	} while (rc == ZOPERATIONTIMEOUT || rc == ZCONNECTIONLOSS);
+	if (rc != ZOK)
+		return -1;
+
+	FOR_EACH_ZNODE(QUEUE_POS_ZNODE, path, &strs) {
+		len = sizeof(pos);
+		if (zk_get_data_nowatch(path, &pos, &len) == ZOK &&
+		    pos != -1 && pos < least)
+			least = pos;
+	}
+	return least == INT32_MAX ? -1 : least;
+}
+
+/*
+ * The oldest event below end.  The deleted ones are below the others, by
+ * this collection or by 'zk_control purge', so it's searched by bisection
+ * instead of listing the queue, which may be too long to get.
+ */
+static int32_t zk_queue_oldest(int32_t end)
+{
+	char path[MAX_NODE_STR_LEN];
+	int32_t lo = 0, hi = end, mid;
+	int rc;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		queue_seq_path(path, sizeof(path), mid);
+		do {
+			rc = zoo_exists(zhandle, path, 0, NULL);
+		} while (rc == ZOPERATIONTIMEOUT || rc == ZCONNECTIONLOSS);
+		if (rc == ZOK)
+			hi = mid;
+		else if (rc == ZNONODE)
+			lo = mid + 1;
+		else
+			return -1;
+	}
+	return lo;
+}
+
+static void queue_gc_work(struct work *work)
+{
+	char path[MAX_NODE_STR_LEN];
+	int32_t end, nr = 0;
+	int rc;
+
+	end = zk_queue_least_pos();
+	if (end < 0)
+		return;
+	end -= QUEUE_DEL_BATCH;
+	if (queue_gc_pos < 0)
+		queue_gc_pos = zk_queue_oldest(max(end, 0));
+	if (queue_gc_pos < 0)
+		return;
+
+	for (; queue_gc_pos < end && nr < QUEUE_GC_BATCH; queue_gc_pos++) {
+		queue_seq_path(path, sizeof(path), queue_gc_pos);
+		do {
+			rc = zoo_delete(zhandle, path, -1);
+		} while (rc == ZOPERATIONTIMEOUT || rc == ZCONNECTIONLOSS);
+		if (rc == ZOK)
+			nr++;
+		else if (rc != ZNONODE) {
+			sd_err("failed to delete %s, %s", path, zerror(rc));
+			break;
+		}
+	}
+	if (nr)
+		sd_debug("deleted %"PRId32" events of the queue, up to %"PRId32,
+			 nr, queue_gc_pos);
+}
+
+static void queue_gc_done(struct work *work)
+{
+	free(work);
+	queue_gc_running = false;
+}
+
+static void queue_gc_tick(void *data)
+{
+	struct work *work;
+
+	add_timer(&queue_gc_timer, QUEUE_GC_INTERVAL * 1000);
+	if (queue_gc_running || !uatomic_is_true(&is_master))
+		return;
+
+	queue_gc_running = true;
+	work = xzalloc(sizeof(*work));
+	work->fn = queue_gc_work;
+	work->done = queue_gc_done;
+	queue_work(queue_gc_wqueue, work);
+}
+
 static inline void zk_tree_add(struct zk_node *node)
 {
 	struct zk_node *zk = xzalloc(sizeof(*zk));
@@ -701,6 +701,130 @@ static int add_event(enum zk_event_type type, struct zk_node *znode, void *buf,
 	}
 }
 
+/* Push the pending events of this node, if any */
+static int zk_batch_flush(void)
+{
+	struct zk_batch_entry *e;
+	int rc;
+
+	if (!zk_batch_nr)
+		return ZOK;
+
+	if (zk_batch_nr == 1) {
+		/* an event alone goes as is */
+		e = (struct zk_batch_entry *)zk_batch->buf;
+		if (add_event(e->type, &this_node, e->buf, e->buf_len) !=
+		    SD_RES_SUCCESS)
+			return ZSYSTEMERROR;
+	} else {
+		rc = zk_queue_push(zk_batch);
+		if (rc != ZOK)
+			return rc;
+		sd_debug("pushed %zu events", zk_batch_nr);
+	}
+	zk_batch_nr = 0;
+	zk_batch->buf_len = 0;
+	return ZOK;
+}
+
+/*
+ * Queue an event of this node to the batch pushed by the next run of the event
+ * handler, so that the cluster operations issued together take one znode.
+ */
+static int add_batch_event(enum zk_event_type type, void *buf, size_t buf_len)
+{
+	struct zk_batch_entry *e;
+
+	if (!zk_batch)
+		zk_batch = xzalloc(sizeof(*zk_batch));
+
+	if (zk_batch->buf_len + sizeof(*e) + buf_len > ZK_MAX_BUF_SIZE &&
+	    zk_batch_flush() != ZOK) {
+		sd_err("failed to push the pending events");
+		return SD_RES_CLUSTER_ERROR;
+	}
+
+	if (!zk_batch_nr) {
+		/* the id identifies the znode on a retry of the push */
+		zk_batch->id = get_uniq_id();
+		zk_batch->type = EVENT_BATCH;
+		zk_batch->sender = this_node;
+		zk_batch->msg_len = 0;
+		zk_batch->nr_nodes = 0;
+	}
+
+	e = (struct zk_batch_entry *)(zk_batch->buf + zk_batch->buf_len);
+	e->type = type;
+	e->buf_len = buf_len;
+	if (buf)
+		memcpy(e->buf, buf, buf_len);
+	zk_batch->buf_len += sizeof(*e) + buf_len;
+	if (!zk_batch_nr++)
+		eventfd_xwrite(efd, 1);
+
+	return SD_RES_SUCCESS;
+}
+
+static void zk_batch_retry(void *arg)
+{
+	zk_batch_retrying = false;
+	eventfd_xwrite(efd, 1);
+}
+
+/*
+ * Membership by a single watch on the children of MEMBER_ZNODE
+ *
+ * A watch of every member on the znode of every other member makes the
+ * watches grow with the square of the nodes.  Instead each node lists the
+ * members with a watch on the list, and a change of the list triggers the
+ * watch, so the node lists them again and compares them with its tree.  A
+ * node in the tree whose znode was listed before and isn't anymore has left.
+ * The znode of a joining node may be created before or after the other nodes
+ * handle its acceptance, hence zk_handle_accept() checks whether it's there.
+ */
+static void watch_members(void)
+{
+	struct String_vector strs;
+	char path[MAX_NODE_STR_LEN];
+	struct node_id *nids;
+	struct zk_node *n, *gone = NULL;
+	int nr = 0, nr_gone = 0;
+
+	RETURN_VOID_IF_ERROR(zk_get_children(MEMBER_ZNODE, &strs), "");
+
+	nids = xcalloc(strs.count ?: 1, sizeof(*nids));
+	FOR_EACH_ZNODE(MEMBER_ZNODE, path, &strs) {
+		struct sd_node node;
+
+		if (str_to_node(strrchr(path, '/') + 1, &node))
+			nids[nr++] = node.nid;
+	}
+	xqsort(nids, nr, node_id_cmp);
+
+	sd_write_lock(&zk_tree_lock);
+	rb_for_each_entry(n, &zk_node_root, rb) {
+		/* our session going away is handled on its own */
+		if (node_eq(&n->node, &this_node.node))
+			continue;
+		if (xbsearch(&n->node.nid, nids, nr, node_id_cmp)) {
+			n->seen = true;
+			continue;
+		}
+		if (!n->seen || n->gone)
+			continue;
+		n->gone = true;
+		gone = xrealloc(gone, sizeof(*gone) * (nr_gone + 1));
+		memset(gone + nr_gone, 0, sizeof(*gone));
+		gone[nr_gone++].node = n->node;
+	}
+	sd_rw_unlock(&zk_tree_lock);
+
+	for (int i = 0; i < nr_gone; i++)
+		add_event(EVENT_LEAVE, gone + i, NULL, 0);
+	free(gone);
+	free(nids);
+}
+
 /*
  * Type value:
  * -1 SESSION_EVENT, use State to indicate what kind of sub-event
@@ -725,9 +849,7 @@ static int add_event(enum zk_event_type type, struct zk_node *znode, void *buf,
 static void zk_watcher(zhandle_t *zh, int type, int state, const char *path,
 		       void *ctx)
 {
-	struct zk_node znode;
-	char str[MAX_NODE_STR_LEN], *p;
-	uint64_t lock_id;
+	char str[MAX_NODE_STR_LEN];
 	int ret;
 
 	sd_debug("path:%s, type:%d, state:%d", path, type, state);
@@ -741,25 +863,16 @@ static void zk_watcher(zhandle_t *zh, int type, int state, const char *path,
 		return;
 	}
 
+	if (type == ZOO_CHILD_EVENT) {
+		if (!strcmp(path, MEMBER_ZNODE))
+			watch_members();
+		return;
+	}
+
 	if (type == ZOO_CREATED_EVENT || type == ZOO_CHANGED_EVENT) {
-		ret = sscanf(path, MEMBER_ZNODE "/%s", str);
-		if (ret == 1)
-			zk_node_exists(path);
 		/* kick off the event handler */
 		eventfd_xwrite(efd, 1);
 	} else if (type == ZOO_DELETED_EVENT) {
-		struct zk_node *n;
-
-		/* process distributed lock */
-		ret = sscanf(path, LOCK_ZNODE "/%"PRIu64"/%s", &lock_id, str);
-		if (ret == 2) {
-			ret = lock_table_lookup_wakeup(lock_id);
-			if (ret)
-				sd_debug("release lock %"PRIu64" %s",
-					 lock_id, str);
-			return;
-		}
-
 		ret = sscanf(path, MASTER_ZNODE "/%s", str);
 		if (ret == 1) {
 			zk_compete_master();
@@ -767,25 +880,8 @@ static void zk_watcher(zhandle_t *zh, int type, int state, const char *path,
 		}
 
 		ret = sscanf(path, QUEUE_ZNODE "/%s", str);
-		if (ret == 1) {
+		if (ret == 1)
 			sd_debug("deleted queue %s", str);
-			return;
-		}
-
-		ret = sscanf(path, MEMBER_ZNODE "/%s", str);
-		if (ret != 1)
-			return;
-		p = strrchr(path, '/');
-		p++;
-		str_to_node(p, &znode.node);
-		/* FIXME: remove redundant leave events */
-		sd_read_lock(&zk_tree_lock);
-		n = zk_tree_search_nolock(&znode.node.nid);
-		if (n)
-			n->gone = true;
-		sd_rw_unlock(&zk_tree_lock);
-		if (n)
-			add_event(EVENT_LEAVE, &znode, NULL, 0);
 	}
 }
 
@@ -1085,9 +1181,8 @@ static void recover_zk_states(void)
 	RETURN_VOID_IF_ERROR(zk_get_children(MEMBER_ZNODE, &strs), "");
 	FOR_EACH_ZNODE(MEMBER_ZNODE, path, &strs) {
 		struct sd_node n;
-		struct zk_node zk;
+		struct zk_node zk = { .seen = true };
 
-		RETURN_VOID_IF_ERROR(zk_node_exists(path), "");
 		str_to_node(path, &n);
 		mempcpy(&zk.node, &n, sizeof(struct sd_node));
 		zk_tree_add(&zk); /* current sd_nodes just have ip:port */
@@ -1221,25 +1316,26 @@ static int zk_leave(void)
 
 	snprintf(path, sizeof(path), MEMBER_ZNODE"/%s",
 		 node_to_str(&this_node.node));
+	if (zk_batch_flush() != ZOK)
+		sd_err("failed to push the pending events");
 	add_event(EVENT_LEAVE, &this_node, NULL, 0);
-	lock_table_remove_znodes();
 	zk_delete_node(path, -1);
 	return 0;
 }
 
 static int zk_notify(void *msg, size_t msg_len)
 {
-	return add_event(EVENT_NOTIFY, &this_node, msg, msg_len);
+	return add_batch_event(EVENT_NOTIFY, msg, msg_len);
 }
 
 static int zk_block(void)
 {
-	return add_event(EVENT_BLOCK, &this_node, NULL, 0);
+	return add_batch_event(EVENT_BLOCK, NULL, 0);
 }
 
 static int zk_unblock(void *msg, size_t msg_len)
 {
-	return add_event(EVENT_UNBLOCK, &this_node, msg, msg_len);
+	return add_batch_event(EVENT_UNBLOCK, msg, msg_len);
 }
 
 static void zk_handle_join(struct zk_event *ev)
@@ -1267,18 +1363,6 @@ static void zk_handle_join(struct zk_event *ev)
 	sd_debug("I'm the master now");
 }
 
-static void watch_all_nodes(void)
-{
-	struct String_vector strs;
-	char path[MAX_NODE_STR_LEN];
-
-	RETURN_VOID_IF_ERROR(zk_get_children(MEMBER_ZNODE, &strs), "");
-
-	FOR_EACH_ZNODE(MEMBER_ZNODE, path, &strs) {
-		RETURN_VOID_IF_ERROR(zk_node_exists(path), "");
-	}
-}
-
 static void init_node_list(struct zk_event *ev)
 {
 	uint8_t *p = zk_event_sd_nodes(ev);
@@ -1287,13 +1371,14 @@ static void init_node_list(struct zk_event *ev)
 
 	sd_debug("%zu", node_nr);
 	for (i = 0; i < node_nr; i++) {
-		struct zk_node zk;
+		struct zk_node zk = {};
+
 		mempcpy(&zk.node, p, sizeof(struct sd_node));
 		zk_tree_add(&zk);
 		p += sizeof(struct sd_node);
 	}
 
-	watch_all_nodes();
+	watch_members();
 }
 
 static void zk_handle_accept(struct zk_event *ev)
@@ -1330,10 +1415,20 @@ static void zk_handle_accept(struct zk_event *ev)
 				    &ZOO_OPEN_ACL_UNSAFE,
 				    ZOO_EPHEMERAL, NULL, 0);
 		RETURN_VOID_IF_ERROR(rc, "");
-	} else
-		zk_node_exists(path);
+	}
 
+	ev->sender.seen = false;
 	zk_tree_add(&ev->sender);
+	if (!node_eq(&ev->sender.node, &this_node.node) &&
+	    zoo_exists(zhandle, path, 0, NULL) == ZOK) {
+		struct zk_node *n;
+
+		sd_write_lock(&zk_tree_lock);
+		n = zk_tree_search_nolock(&ev->sender.node.nid);
+		if (n)
+			n->seen = true;
+		sd_rw_unlock(&zk_tree_lock);
+	}
 
 	build_node_list();
 	sd_accept_handler(&ev->sender.node, &sd_node_root, nr_sd_nodes,
@@ -1429,6 +1524,36 @@ static void zk_handle_update_node(struct zk_event *ev)
 	sd_update_node_handler(snode, &sd_node_root);
 }
 
+static void zk_handle_batch(struct zk_event *ev)
+{
+	static struct zk_event sub;
+	struct zk_batch_entry e;
+
+	sd_debug("BATCH");
+	sub.id = ev->id;
+	sub.sender = ev->sender;
+	for (size_t off = 0; off < ev->buf_len; off += sizeof(e) + e.buf_len) {
+		memcpy(&e, ev->buf + off, sizeof(e));
+		sub.type = e.type;
+		sub.buf_len = e.buf_len;
+		memcpy(sub.buf, ev->buf + off + sizeof(e), e.buf_len);
+
+		switch (e.type) {
+		case EVENT_BLOCK:
+			zk_handle_block(&sub);
+			break;
+		case EVENT_UNBLOCK:
+			zk_handle_unblock(&sub);
+			break;
+		case EVENT_NOTIFY:
+			zk_handle_notify(&sub);
+			break;
+		default:
+			panic("unhandled type %d in a batch", e.type);
+		}
+	}
+}
+
 static void (*const zk_event_handlers[])(struct zk_event *ev) = {
 	[EVENT_JOIN]		= zk_handle_join,
 	[EVENT_ACCEPT]		= zk_handle_accept,
@@ -1437,6 +1562,7 @@ static void (*const zk_event_handlers[])(struct zk_event *ev) = {
 	[EVENT_UNBLOCK]		= zk_handle_unblock,
 	[EVENT_NOTIFY]		= zk_handle_notify,
 	[EVENT_UPDATE_NODE]	= zk_handle_update_node,
+	[EVENT_BATCH]		= zk_handle_batch,
 };
 
 static const int zk_max_event_handlers = ARRAY_SIZE(zk_event_handlers);
@@ -1456,6 +1582,9 @@ static inline void handle_session_expire(void)
 	zk_tree_destroy();
 	INIT_RB_ROOT(&zk_node_root);
 	INIT_LIST_HEAD(&zk_block_list);
+	zk_batch_nr = 0;
+	if (zk_batch)
+		zk_batch->buf_len = 0;
 	nr_sd_nodes = 0;
 	INIT_RB_ROOT(&sd_node_root);
 	first_push = true;
@@ -1470,7 +1599,8 @@ static inline void handle_session_expire(void)
 static void zk_event_handler(int listen_fd, int events, void *data)
 {
 	struct zk_event ev;
-	bool peek;
+	bool popped;
+	int rc;
 
 	sd_debug("%d, %d", events, queue_pos);
 	if (events & EPOLLHUP) {
@@ -1496,22 +1626,34 @@ static void zk_event_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
-	RETURN_VOID_IF_ERROR(zk_queue_peek(&peek), "");
-	if (!peek)
-		goto kick_block_event;
+	rc = zk_batch_flush();
+	if (rc != ZOK && !zk_batch_retrying) {
+		sd_err("failed to push the pending events, %s", zerror(rc));
+		zk_batch_retrying = true;
+		zk_batch_timer.callback = zk_batch_retry;
+		add_timer(&zk_batch_timer, WAIT_TIME * 1000);
+	}
+
+	/* pop the events which are there without a wakeup for each */
+	for (int i = 0; i < ZK_POP_BATCH; i++) {
+		RETURN_VOID_IF_ERROR(zk_queue_pop_advance(&ev, &popped), "");
+		if (!popped)
+			goto kick_block_event;
 
-	RETURN_VOID_IF_ERROR(zk_queue_pop_advance(&ev), "");
-	if (ev.type < zk_max_event_handlers && zk_event_handlers[ev.type])
-		zk_event_handlers[ev.type](&ev);
-	else
-		panic("unhandled type %d", ev.type);
+		if (ev.type < zk_max_event_handlers &&
+		    zk_event_handlers[ev.type])
+			zk_event_handlers[ev.type](&ev);
+		else
+			panic("unhandled type %d", ev.type);
 
-	RETURN_VOID_IF_ERROR(zk_queue_peek(&peek), "");
-	if (peek) {
-		/* Someone has created next event, go kick event handler. */
-		eventfd_xwrite(efd, 1);
-		return;
+		/* the membership changes wait for the watches */
+		if (ev.type == EVENT_JOIN || ev.type == EVENT_ACCEPT)
+			break;
 	}
+
+	/* Someone may have created next event, go kick event handler. */
+	eventfd_xwrite(efd, 1);
+	return;
 kick_block_event:
 	/*
 	 * Kick block event only if there is no nonblock event. We prefer to
@@ -1524,92 +1666,6 @@ kick_block_event:
 	kick_block_event();
 }
 
-/*
- * This operation will create a seq-ephemeral znode in lock directory
- * of zookeeper (use lock-id as dir name). The smallest file path in
- * this directory wil be the owner of the lock; the other threads will
- * wait on a sem_t (cluster_lock->wait_wakeup)
- */
-static void zk_lock(uint64_t lock_id)
-{
-	int rc, len = MAX_NODE_STR_LEN;
-	char *my_path;
-	char parent[MAX_NODE_STR_LEN];
-	char parent_node[MAX_NODE_STR_LEN];
-	char lowest_seq_path[MAX_NODE_STR_LEN];
-	char owner_name[MAX_NODE_STR_LEN];
-	struct cluster_lock *cluster_lock;
-
-	cluster_lock = lock_table_lookup_acquire(lock_id);
-
-	my_path = cluster_lock->lock_path;
-
-	snprintf(parent, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64"/",
-		 cluster_lock->id);
-	/*
-	 * It need using path without end of '/' to create node of lock_id in
-	 * zookeeper's API, so we use 'parent_node'.
-	 */
-	snprintf(parent_node, MAX_NODE_STR_LEN, LOCK_ZNODE "/%"PRIu64,
-		 cluster_lock->id);
-create_seq_node:
-	/* compete owner of lock is just like zk_compete_master() */
-	while (true) {
-		rc = zk_create_seq_node(parent, node_to_str(&this_node.node),
-					MAX_NODE_STR_LEN, my_path,
-					MAX_NODE_STR_LEN, true);
-		if (rc == ZOK)
-			break;
-		if (rc == ZNONODE) {
-			zk_init_node(parent_node);
-			/*
-			 * We don't need to check the return code of
-			 * zk_init_node() because the routine must stay in loop
-			 * if it doesn't take the lock, no matter what kind of
-			 * error happened.
-			 */
-			continue;
-		}
-		sd_err("failed to create path:%s, %s", my_path, zerror(rc));
-		zk_wait();
-	}
-	sd_debug("create path %s success", my_path);
-
-	/* create node ok now */
-	while (true) {
-		rc = zk_get_least_seq(parent_node, lowest_seq_path,
-				      MAX_NODE_STR_LEN, owner_name, &len);
-		/* may be expired */
-		if (rc == ZNONODE) {
-			sd_debug("Recreate seq node");
-			goto create_seq_node;
-		}
-		/* I got the lock */
-		if (!strncmp(lowest_seq_path, my_path, strlen(my_path))) {
-			sd_debug("I am master now. %s", lowest_seq_path);
-			return;
-		}
-
-		/* I failed to get the lock */
-		rc = zk_node_exists(lowest_seq_path);
-		if (rc == ZOK) {
-			sd_debug("call zoo_exists success %s", lowest_seq_path);
-			/* Use wait_timeout to avoid missing wakeup signal */
-			sem_wait(&cluster_lock->wait_wakeup);
-		} else {
-			sd_debug("failed to call zoo_exists %s", zerror(rc));
-			if (rc != ZNONODE)
-				zk_wait();
-		}
-	}
-}
-
-static void zk_unlock(uint64_t lock_id)
-{
-	lock_table_lookup_release(lock_id);
-	sd_debug("unlock %"PRIu64, lock_id);
-}
-
 static int zk_prepare_root(const char *hosts)
 {
 	char root[MAX_NODE_STR_LEN];
@@ -1688,20 +1744,12 @@ static int zk_init(const char *option)
 		return -1;
 	}
 
-	/* init distributed lock structures */
-	cluster_locks_table = xzalloc(sizeof(struct hlist_head) *
-				      HASH_BUCKET_NR);
-	for (uint64_t i = 0; i < HASH_BUCKET_NR; i++) {
-		INIT_HLIST_HEAD(cluster_locks_table + i);
-		sd_init_mutex(table_locks + i);
-	}
-
-	ret = zk_init_node(LOCK_ZNODE);
-	if (ret != ZOK) {
-		sd_err("Failed to create %s %s", LOCK_ZNODE, zerror(ret));
-		free(cluster_locks_table);
+	queue_gc_wqueue = create_ordered_work_queue("zk_queue_gc");
+	if (!queue_gc_wqueue)
 		return -1;
-	}
+	queue_gc_timer.callback = queue_gc_tick;
+	add_timer(&queue_gc_timer, QUEUE_GC_INTERVAL * 1000);
+
 	return 0;
 }
 
@@ -1737,8 +1785,8 @@ static struct cluster_driver cdrv_zookeeper = {
 	.notify     = zk_notify,
 	.block      = zk_block,
 	.unblock    = zk_unblock,
-	.lock         = zk_lock,
-	.unlock       = zk_unlock,
+	.lock         = sheep_lock,
+	.unlock       = sheep_unlock,
 	.update_node  = zk_update_node,
 	.get_local_addr = get_local_addr,
 	.block_event_number = zk_block_event_number,
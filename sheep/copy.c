@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background change of the copy number of a vdi
+ *
+ * SD_OP_ALTER_VDI_COPY tells all the nodes the new copy number and the old one
+ * by SD_OP_SET_VDI_COPY, writes the new one to the inode, and queues the vdi
+ * to convert on the node which got it.  The converter walks the objects of the
+ * vdi, its inode and then the data objects it owns, COPY_BATCH entries of the
+ * index a work on a low priority queue and within the rate of the request.  A
+ * new copy is fetched from an old one with SD_OP_REPAIR_REPLICA, and then
+ * once more, which copies only the blocks a write racing the first fetch has
+ * changed.  The old copies beyond the new number are removed.  Once all are
+ * converted, SD_OP_SET_VDI_COPY clears the old number.
+ *
+ * Meanwhile the objects are read from the copies under both numbers, and
+ * written to the ones under the new number, where a new copy refusing a write
+ * as it doesn't exist yet is repaired by the gateway, see repair_new_copies().
+ * So the I/O never waits for the conversion.  The converter stops while the
+ * node recovers and resumes from the last batch.  If it fails on an object,
+ * the vdi stays converting and SD_OP_ALTER_VDI_COPY again starts over.
+ */
+
+#include "sheep_priv.h"
+
+#define COPY_BATCH 1024
+#define COPY_INTERVAL (10 * 1000) /* ms to wait for the recovery */
+
+struct copy_conv {
+	struct vdi_copy vc; /* the counters are updated by the converter */
+	struct list_node list;
+};
+
+struct copy_work {
+	struct work work;
+	struct vnode_info *vinfo;
+	uint32_t epoch;
+	struct copy_conv *conv;
+	uint64_t start;
+	uint64_t bytes;
+	bool done; /* all the entries of the index are converted */
+};
+
+/* the conversions queued on this node, the first one running */
+static LIST_HEAD(copy_convs);
+static bool copy_running;
+
+static void copy_throttle(struct copy_work *cw)
+{
+	uint64_t rate = cw->conv->vc.rate, expect, elapsed;
+	struct timespec ts;
+
+	if (!rate)
+		return;
+
+	expect = (double)cw->bytes / rate * 1000000000ULL;
+	elapsed = clock_get_time() - cw->start;
+	if (expect <= elapsed)
+		return;
+
+	ts.tv_sec = (expect - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (expect - elapsed) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int copy_repair(uint64_t oid, uint32_t epoch, const struct node_id *nid,
+		       const struct node_id *src)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+	hdr.epoch = epoch;
+	memcpy(hdr.forw.addr, src->addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = src->port;
+	hdr.forw.oid = oid;
+	return sheep_exec_req(nid, &hdr, NULL);
+}
+
+/* Make the copy of oid on nid from one of the old copies */
+static int copy_add(struct copy_work *cw, uint64_t oid,
+		    const struct sd_node *nid, const struct sd_node **old,
+		    int nr_old)
+{
+	int ret = SD_RES_NO_OBJ;
+
+	for (int i = 0; i < nr_old; i++) {
+		ret = copy_repair(oid, cw->epoch, &nid->nid, &old[i]->nid);
+		if (ret != SD_RES_SUCCESS)
+			continue;
+		/* the blocks changed by a write racing the first fetch */
+		ret = copy_repair(oid, cw->epoch, &nid->nid, &old[i]->nid);
+		if (ret == SD_RES_SUCCESS)
+			break;
+	}
+	return ret;
+}
+
+static int copy_remove(struct copy_work *cw, uint64_t oid,
+		       const struct sd_node *nid)
+{
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_REMOVE_PEER);
+	hdr.epoch = cw->epoch;
+	hdr.obj.oid = oid;
+	ret = sheep_exec_req(&nid->nid, &hdr, NULL);
+	return ret == SD_RES_NO_OBJ ? SD_RES_SUCCESS : ret;
+}
+
+static void copy_object(struct copy_work *cw, uint64_t oid)
+{
+	struct vdi_copy *vc = &cw->conv->vc;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int nr_zones = cw->vinfo->nr_zones;
+	int nr_old = min((int)vc->old_nr_copies, nr_zones);
+	int nr_new = min((int)vc->nr_copies, nr_zones);
+	int ret;
+
+	/* the copies under the smaller number are the same under both */
+	vinfo_oid_to_nodes(cw->vinfo, oid, max(nr_old, nr_new), nodes);
+
+	for (int i = nr_old; i < nr_new; i++) {
+		ret = copy_add(cw, oid, nodes[i], nodes, nr_old);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to copy %016"PRIx64" to %s, %s", oid,
+			       node_to_str(nodes[i]), sd_strerror(ret));
+			uatomic_inc(&vc->nr_failed);
+			continue;
+		}
+		uatomic_inc(&vc->nr_copied);
+		cw->bytes += get_store_objsize(oid);
+	}
+
+	for (int i = nr_new; i < nr_old; i++) {
+		ret = copy_remove(cw, oid, nodes[i]);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to remove %016"PRIx64" from %s, %s", oid,
+			       node_to_str(nodes[i]), sd_strerror(ret));
+			uatomic_inc(&vc->nr_failed);
+			continue;
+		}
+		uatomic_inc(&vc->nr_removed);
+	}
+}
+
+static void copy_work(struct work *work)
+{
+	struct copy_work *cw = container_of(work, struct copy_work, work);
+	struct vdi_copy *vc = &cw->conv->vc;
+	uint32_t vid = vc->vid, *vids;
+	uint64_t idx = uatomic_read(&vc->nr_done), nr;
+	int ret;
+
+	cw->start = clock_get_time();
+	if (!idx)
+		copy_object(cw, vid_to_vdi_oid(vid));
+
+	nr = min(vc->nr_objs - idx, (uint64_t)COPY_BATCH);
+	vids = xmalloc(COPY_BATCH * sizeof(*vids));
+	ret = nr ? sd_read_object(vid_to_vdi_oid(vid), (char *)vids,
+				  nr * sizeof(*vids),
+				  offsetof(struct sd_inode, data_vdi_id) +
+				  idx * sizeof(*vids)) : SD_RES_SUCCESS;
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read the index of %"PRIx32", %s", vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	for (uint64_t i = 0; i < nr; i++) {
+		/* a recovery follows the change of the epoch */
+		if (sys_epoch() != cw->epoch)
+			goto out;
+		/* the shared objects go with the copies of their vdi */
+		if (vids[i] == vid) {
+			copy_object(cw, vid_to_data_oid(vid, idx + i));
+			copy_throttle(cw);
+		}
+		uatomic_inc(&vc->nr_done);
+	}
+	if (uatomic_read(&vc->nr_done) < vc->nr_objs)
+		goto out;
+
+	cw->done = true;
+	if (uatomic_read(&vc->nr_failed)) {
+		sd_err("failed to convert %"PRIu64" objects of %"PRIx32
+		       ", it stays converting", uatomic_read(&vc->nr_failed),
+		       vid);
+		goto out;
+	}
+
+	ret = copy_set_vdi(vid, vc->nr_copies, 0);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to finish converting %"PRIx32", %s", vid,
+		       sd_strerror(ret));
+	else
+		sd_notice("converted %"PRIx32" to %d copies", vid,
+			  vc->nr_copies);
+out:
+	free(vids);
+}
+
+static void copy_queue(void);
+
+static void copy_timer_fn(void *data)
+{
+	copy_queue();
+}
+
+static struct timer copy_timer = {
+	.callback = copy_timer_fn,
+};
+
+static void copy_done(struct work *work)
+{
+	struct copy_work *cw = container_of(work, struct copy_work, work);
+
+	copy_running = false;
+	if (cw->done) {
+		list_del(&cw->conv->list);
+		free(cw->conv);
+	}
+	put_vnode_info(cw->vinfo);
+	free(cw);
+
+	if (node_in_recovery())
+		add_timer(&copy_timer, COPY_INTERVAL);
+	else
+		copy_queue();
+}
+
+static void copy_queue(void)
+{
+	struct copy_work *cw;
+
+	if (copy_running || list_empty(&copy_convs))
+		return;
+	if (node_in_recovery() || sys->cinfo.status != SD_STATUS_OK) {
+		add_timer(&copy_timer, COPY_INTERVAL);
+		return;
+	}
+
+	cw = xzalloc(sizeof(*cw));
+	cw->vinfo = get_vnode_info();
+	cw->epoch = sys_epoch();
+	cw->conv = list_first_entry(&copy_convs, struct copy_conv, list);
+	cw->work.fn = copy_work;
+	cw->work.done = copy_done;
+	copy_running = true;
+	queue_work(sys->copy_wqueue, &cw->work);
+}
+
+static struct copy_conv *find_copy_conv(uint32_t vid)
+{
+	struct copy_conv *conv;
+
+	list_for_each_entry(conv, &copy_convs, list)
+		if (conv->vc.vid == vid)
+			return conv;
+	return NULL;
+}
+
+/* Tell all the nodes the copy number of vid, old_nr_copies while converting */
+int copy_set_vdi(uint32_t vid, uint8_t nr_copies, uint8_t old_nr_copies)
+{
+	struct vdi_copy vc = {
+		.vid = vid,
+		.nr_copies = nr_copies,
+		.old_nr_copies = old_nr_copies,
+	};
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_SET_VDI_COPY);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(vc);
+	return exec_local_req(&hdr, &vc);
+}
+
+/*
+ * Start changing the copy number of the vdi to vc->nr_copies, the part of
+ * SD_OP_ALTER_VDI_COPY in a worker thread.  old_nr_copies is set to the
+ * number converted from.
+ */
+int copy_start_vdi(struct vdi_copy *vc)
+{
+	struct sd_inode *inode;
+	uint64_t oid = vid_to_vdi_oid(vc->vid);
+	int nr_copies, old_nr_copies, ret;
+
+	if (!vc->nr_copies)
+		return SD_RES_SUCCESS;
+	if (vc->nr_copies > SD_MAX_COPIES)
+		return SD_RES_INVALID_PARMS;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = sd_read_object(oid, (char *)inode, SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (inode->name[0] == '\0') {
+		ret = SD_RES_NO_VDI;
+		goto out;
+	}
+	/* the erasure coded objects and the B-tree move as a whole */
+	if (inode->copy_policy || inode->store_policy) {
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
+	}
+
+	if (get_vdi_copies(vc->vid, &nr_copies, &old_nr_copies)) {
+		/* go on with the old copies of a conversion which failed */
+		if (old_nr_copies && nr_copies != vc->nr_copies) {
+			ret = SD_RES_VDI_LOCKED;
+			goto out;
+		}
+		vc->old_nr_copies = old_nr_copies ?: nr_copies;
+	} else
+		vc->old_nr_copies = inode->nr_copies ?: sys->cinfo.nr_copies;
+	vc->nr_objs = min(count_data_objs(inode), (size_t)SD_INODE_DATA_INDEX);
+	if (vc->old_nr_copies == vc->nr_copies)
+		goto out;
+
+	ret = copy_set_vdi(vc->vid, vc->nr_copies, vc->old_nr_copies);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	/* the clients opening the vdi later read it from the inode */
+	ret = sd_write_object(oid, (char *)&vc->nr_copies,
+			      sizeof(vc->nr_copies),
+			      offsetof(struct sd_inode, nr_copies), false);
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Queue the conversion started by copy_start_vdi(), or report it if
+ * vc->nr_copies is 0, in the main thread
+ */
+void copy_queue_vdi(struct vdi_copy *vc)
+{
+	struct copy_conv *conv = find_copy_conv(vc->vid);
+	int nr_copies, old_nr_copies;
+
+	if (!vc->nr_copies || conv) {
+		if (conv) {
+			memcpy(vc, &conv->vc, sizeof(*vc));
+			vc->nr_done = uatomic_read(&conv->vc.nr_done);
+			vc->nr_copied = uatomic_read(&conv->vc.nr_copied);
+			vc->nr_removed = uatomic_read(&conv->vc.nr_removed);
+			vc->nr_failed = uatomic_read(&conv->vc.nr_failed);
+		} else if (get_vdi_copies(vc->vid, &nr_copies,
+					  &old_nr_copies)) {
+			/* not converting on this node, or stopped by a failure */
+			vc->nr_copies = nr_copies;
+			vc->old_nr_copies = old_nr_copies;
+		}
+		return;
+	}
+
+	if (vc->old_nr_copies == vc->nr_copies) {
+		vc->old_nr_copies = 0;
+		return;
+	}
+
+	sd_notice("converting %"PRIx32" from %d to %d copies, %"PRIu64
+		  " objects", vc->vid, vc->old_nr_copies, vc->nr_copies,
+		  vc->nr_objs);
+	conv = xzalloc(sizeof(*conv));
+	conv->vc = *vc;
+	conv->vc.nr_done = 0;
+	list_add_tail(&conv->list, &copy_convs);
+	copy_queue();
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Saving the objects of a farm snapshot on the nodes
+ *
+ * 'dog cluster snapshot save -N' sorts the objects of the snapshot out by the
+ * nodes of their first copies and sends each node its objects with
+ * SD_OP_FARM_SAVE, a batch at a time.  The sheep reads them, mostly from its
+ * own copies, slices them as dog/farm/slice.c does and writes the slices to
+ * the farm at the path, which the nodes share, and returns the sha1 of the
+ * slice files for dog to merge into the trunk.  So the snapshot goes through
+ * all the nodes instead of the host of dog.
+ *
+ * A file of the farm is written to a temporary one and linked to its sha1,
+ * as the nodes write the same slices, e.g. the zeroed ones, at the same time.
+ */
+
+#include "sheep_priv.h"
+#include "sha1.h"
+#include "slice.h"
+
+static int farm_file_write(const char *dir, const void *buf, size_t len,
+			   unsigned char *sha1)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 64];
+	const char *hex;
+	int fd;
+
+	get_buffer_sha1((unsigned char *)buf, len, sha1);
+	hex = sha1_to_hex(sha1);
+	snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, hex, hex + 2);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.%s.%d.tmp", path,
+		 addr_to_str(sys->this_node.nid.addr, sys->this_node.nid.port),
+		 gettid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", tmp);
+		return -1;
+	}
+	if (xwrite(fd, buf, len) != len) {
+		sd_err("failed to write %s, %m", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	if (link(tmp, path) < 0 && errno != EEXIST) {
+		sd_err("failed to link %s, %m", path);
+		unlink(tmp);
+		return -1;
+	}
+	unlink(tmp);
+	return 0;
+}
+
+/* Save the object and its slice file, whose sha1 goes to the entry */
+static int farm_save_object(const char *dir, struct sd_farm_entry *e)
+{
+	size_t size, len, slen = 0;
+	unsigned char *sbuf = NULL;
+	char *buf, *p;
+	int ret;
+
+	if (is_data_obj(e->oid) && e->block_size_shift)
+		size = UINT64_C(1) << e->block_size_shift;
+	else
+		size = get_objsize(e->oid);
+	buf = xmalloc(size);
+
+	ret = sd_read_object(e->oid, buf, size, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %016"PRIx64", %s", e->oid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	sbuf = xmalloc(DIV_ROUND_UP(size, SLICE_MIN_SIZE) * SHA1_DIGEST_SIZE);
+	for (p = buf, len = size; len > 0;) {
+		size_t wlen = slice_cut((uint8_t *)p, len);
+
+		if (farm_file_write(dir, p, wlen, sbuf + slen) < 0) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		slen += SHA1_DIGEST_SIZE;
+		p += wlen;
+		len -= wlen;
+	}
+	if (farm_file_write(dir, sbuf, slen, e->sha1) < 0)
+		ret = SD_RES_EIO;
+out:
+	free(sbuf);
+	free(buf);
+	return ret;
+}
+
+/* Save the objects to the farm at dir */
+int farm_save(const char *dir, struct sd_farm_entry *ents, uint32_t nr)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		sd_err("%s is not a farm shared with this node", dir);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	for (uint32_t i = 0; i < nr; i++) {
+		ret = farm_save_object(dir, ents + i);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	return SD_RES_SUCCESS;
+}
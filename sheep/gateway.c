@@ -12,11 +12,19 @@
 
 #include "sheep_priv.h"
 
-static inline void gateway_init_fwd_hdr(struct sd_req *fwd, struct sd_req *hdr)
+static inline void gateway_init_fwd_hdr(struct sd_req *fwd,
+					const struct request *req)
 {
-	memcpy(fwd, hdr, sizeof(*fwd));
-	fwd->opcode = gateway_to_peer_opcode(hdr->opcode);
+	memcpy(fwd, &req->rq, sizeof(*fwd));
+	fwd->opcode = gateway_to_peer_opcode(req->rq.opcode);
 	fwd->proto_ver = SD_SHEEP_PROTO_VER;
+	/* the peers drop it when what is left of the deadline passes */
+	fwd->obj.deadline = request_budget(req);
+	/* see gateway_handle_cow() */
+	if (req->rq.flags & SD_FLAG_CMD_COW)
+		fwd->opcode = SD_OP_COPY_PEER;
+	else
+		fwd->obj.span_id = req->span_id; /* see peer_span_id() */
 }
 
 struct req_iter {
@@ -24,6 +32,7 @@ struct req_iter {
 	uint32_t wlen;
 	uint32_t dlen;
 	uint64_t off;
+	bool skip; /* nothing to send to this strip */
 };
 
 static struct req_iter *prepare_replication_requests(struct request *req,
@@ -50,74 +59,177 @@ static struct req_iter *prepare_replication_requests(struct request *req,
 /*
  * Make sure we don't overwrite the existing data for misaligned write
  *
- * If either offset or length of request isn't aligned to
- * SD_EC_DATA_STRIPE_SIZE, we have to read the unaligned blocks before write.
- * This kind of write amplification indeed slow down the write operation with
- * extra read overhead.
+ * If either offset or length of request isn't aligned to the stripe size of
+ * the vdi, we have to read the unaligned blocks before write.  This kind of
+ * write amplification indeed slow down the write operation with extra read
+ * overhead.
  */
-static void *init_erasure_buffer(struct request *req, int buf_len)
+static void *init_erasure_buffer(struct request *req, uint32_t stripe,
+				 int buf_len)
 {
-	char *buf = xvalloc(buf_len);
+	char *buf = xbuffer_alloc(buf_len);
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	uint64_t oid = req->rq.obj.oid;
 	int opcode = req->rq.opcode;
 	struct sd_req hdr;
-	uint64_t head = round_down(off, SD_EC_DATA_STRIPE_SIZE);
-	uint64_t tail = round_down(off + len, SD_EC_DATA_STRIPE_SIZE);
+	uint64_t head = round_down(off, stripe);
+	uint64_t tail = round_down(off + len, stripe);
 	uint64_t done = UINT64_MAX;
 	int ret;
 
 	if (opcode != SD_OP_WRITE_OBJ)
 		goto out;
 
-	if (off % SD_EC_DATA_STRIPE_SIZE) {
+	if (off % stripe) {
 		/* Read head */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe;
 		hdr.obj.offset = head;
 		done = head;
 		ret = exec_local_req(&hdr, buf);
 		if (ret != SD_RES_SUCCESS) {
-			free(buf);
+			buffer_free(buf, buf_len);
 			return NULL;
 		}
 	}
 
-	if ((len + off) % SD_EC_DATA_STRIPE_SIZE && done != tail) {
+	if ((len + off) % stripe && done != tail) {
 		/* Read tail */
 		sd_init_req(&hdr, SD_OP_READ_OBJ);
 		hdr.obj.oid = oid;
-		hdr.data_length = SD_EC_DATA_STRIPE_SIZE;
+		hdr.data_length = stripe;
 		hdr.obj.offset = tail;
 		ret = exec_local_req(&hdr, buf + tail - head);
 		if (ret != SD_RES_SUCCESS) {
-			free(buf);
+			buffer_free(buf, buf_len);
 			return NULL;
 		}
 	}
 out:
-	memcpy(buf + off % SD_EC_DATA_STRIPE_SIZE, req->data, len);
+	memcpy(buf + off % stripe, req->data, len);
 	return buf;
 }
 
+static int read_strip(struct request *req, int idx, void *buf, uint32_t len,
+		      uint64_t off)
+{
+	const struct sd_node *n = vinfo_oid_to_node(req->vinfo,
+						    req->rq.obj.oid, idx);
+	struct sd_req hdr;
+
+	if (n->nid.status == NODE_STATUS_OFFLINE)
+		return SD_RES_NETWORK_ERROR;
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = req->rq.epoch;
+	hdr.data_length = len;
+	hdr.obj.oid = req->rq.obj.oid;
+	hdr.obj.offset = off;
+	hdr.obj.ec_index = idx;
+	hdr.obj.copy_policy = req->rq.obj.copy_policy;
+	return sheep_exec_req(&n->nid, &hdr, buf);
+}
+
+/*
+ * Update only the strips which a small write changes
+ *
+ * A write within one stripe which changes fewer data strips than there are
+ * data strips to read for the whole stripe, reads the old data of those strips
+ * and the old parity, and writes them with the parity updated by the delta of
+ * the data, leaving the other data strips alone.
+ *
+ * Return NULL if the write doesn't fit or we fail to read, so that the caller
+ * goes for the whole stripe.
+ */
+static struct req_iter *prepare_erasure_update(struct request *req,
+					       struct fec *ctx, uint32_t stripe,
+					       int ed, int ep)
+{
+	uint32_t len = req->rq.data_length;
+	uint64_t off = req->rq.obj.offset;
+	uint64_t head = round_down(off, stripe);
+	int strip_size = stripe / ed;
+	int first = (off - head) / strip_size;
+	int last = (off + len - 1 - head) / strip_size;
+	int nr = last - first + 1, i, ret;
+	uint64_t strip_off = head / ed;
+	const uint8_t *delta[SD_EC_MAX_STRIP];
+	uint8_t *ps[SD_EC_MAX_STRIP];
+	struct req_iter *reqs;
+	uint8_t *buf;
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ || !len ||
+	    off + len > head + stripe || nr + ep >= ed)
+		return NULL;
+
+	reqs = xzalloc(sizeof(*reqs) * (ed + ep));
+	for (i = 0; i < ed + ep; i++) {
+		if (i < first || (i > last && i < ed)) {
+			reqs[i].skip = true;
+			continue;
+		}
+		reqs[i].buf = xbuffer_alloc(strip_size);
+		reqs[i].dlen = reqs[i].wlen = strip_size;
+		reqs[i].off = strip_off;
+		ret = read_strip(req, i, reqs[i].buf, strip_size, strip_off);
+		if (ret != SD_RES_SUCCESS) {
+			sd_debug("failed to read strip %d of %"PRIx64", %s", i,
+				 req->rq.obj.oid, sd_strerror(ret));
+			goto err;
+		}
+	}
+
+	/* The new data of the strips, and their delta over the old */
+	buf = xmalloc(strip_size * nr);
+	for (i = 0; i < nr; i++)
+		memcpy(buf + strip_size * i, reqs[first + i].buf, strip_size);
+	memcpy(buf + off - head - strip_size * first, req->data, len);
+	for (i = 0; i < nr; i++) {
+		uint8_t *p = reqs[first + i].buf, *q = buf + strip_size * i;
+
+		for (int j = 0; j < strip_size; j++)
+			p[j] ^= q[j];
+		delta[i] = p;
+	}
+	for (i = 0; i < ep; i++)
+		ps[i] = reqs[ed + i].buf;
+	ec_update_buffer(ctx, first, nr, delta, ps, strip_size);
+	for (i = 0; i < nr; i++)
+		memcpy(reqs[first + i].buf, buf + strip_size * i, strip_size);
+	free(buf);
+
+	return reqs;
+err:
+	for (i = 0; i < ed + ep; i++)
+		buffer_free(reqs[i].buf, reqs[i].dlen);
+	free(reqs);
+	return NULL;
+}
+
 /*
  * We spread data strips of req along with its parity strips onto replica for
  * write operation. For read we only need to prepare data strip buffers.
+ *
+ * The stripes are in the size of the vdi, so that the strips of a vdi with
+ * large stripes take fewer and bigger I/Os on their holders.
  */
 static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 {
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
+	uint32_t stripe = get_vdi_stripe_size(oid_to_vid(req->rq.obj.oid));
+	int start = off / stripe;
+	int end = DIV_ROUND_UP(off + len, stripe), i, j;
 	int nr_stripe = end - start;
 	struct fec *ctx;
 	int strip_size, nr_to_send;
 	struct req_iter *reqs;
 	char *p, *buf = NULL;
+	const uint8_t *ds[SD_EC_MAX_STRIP];
+	uint8_t *ps[SD_EC_MAX_STRIP];
 	uint8_t policy = req->rq.obj.copy_policy ?:
 		get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
 	int ed = 0, ep = 0, edp;
@@ -125,7 +237,12 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	edp = ec_policy_to_dp(policy, &ed, &ep);
 	ctx = ec_init(ed, edp);
 	*nr = nr_to_send = (opcode == SD_OP_READ_OBJ) ? ed : edp;
-	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+	strip_size = stripe / ed;
+	if (nr_stripe == 1) {
+		reqs = prepare_erasure_update(req, ctx, stripe, ed, ep);
+		if (reqs)
+			goto out;
+	}
 	reqs = xzalloc(sizeof(*reqs) * nr_to_send);
 
 	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
@@ -134,7 +251,7 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	for (i = 0; i < nr_to_send; i++) {
 		int l = strip_size * nr_stripe;
 
-		reqs[i].buf = xmalloc(l);
+		reqs[i].buf = xbuffer_alloc(l);
 		reqs[i].dlen = l;
 		reqs[i].off = start * strip_size;
 		switch (opcode) {
@@ -150,42 +267,39 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	if (opcode != SD_OP_WRITE_OBJ && opcode != SD_OP_CREATE_AND_WRITE_OBJ)
 		goto out; /* Read and remove operation */
 
-	p = buf = init_erasure_buffer(req, SD_EC_DATA_STRIPE_SIZE * nr_stripe);
+	p = buf = init_erasure_buffer(req, stripe, stripe * nr_stripe);
 	if (!buf) {
 		sd_err("failed to init erasure buffer %"PRIx64,
 		       req->rq.obj.oid);
 		for (i = 0; i < nr_to_send; i++)
-			free(reqs[i].buf);
+			buffer_free(reqs[i].buf, reqs[i].dlen);
 		free(reqs);
 		reqs = NULL;
 		goto out;
 	}
 	for (i = 0; i < nr_stripe; i++) {
-		const uint8_t *ds[ed];
-		uint8_t *ps[ep];
-
-		for (j = 0; j < ed; j++)
-			ds[j] = reqs[j].buf + strip_size * i;
-
-		for (j = 0; j < ep; j++)
-			ps[j] = reqs[ed + j].buf + strip_size * i;
-
 		for (j = 0; j < ed; j++)
-			memcpy((uint8_t *)ds[j], p + j * strip_size,
+			memcpy(reqs[j].buf + strip_size * i, p + j * strip_size,
 			       strip_size);
-		ec_encode(ctx, ds, ps);
-		p += SD_EC_DATA_STRIPE_SIZE;
+		p += stripe;
 	}
+
+	/* The strips of all the stripes are contiguous, encode them at once */
+	for (j = 0; j < ed; j++)
+		ds[j] = reqs[j].buf;
+	for (j = 0; j < ep; j++)
+		ps[j] = reqs[ed + j].buf;
+	ec_encode_buffer(ctx, ds, ps, strip_size * nr_stripe);
 out:
 	ec_destroy(ctx);
-	free(buf);
+	buffer_free(buf, stripe * nr_stripe);
 
 	return reqs;
 }
 
 bool is_erasure_oid(uint64_t oid)
 {
-	return !is_vdi_obj(oid) && !is_vdi_btree_obj(oid) &&
+	return !is_vdi_obj(oid) && !is_vdi_btree_obj(oid) && !is_hot_obj(oid) &&
 		get_vdi_copy_policy(oid_to_vid(oid)) > 0;
 }
 
@@ -205,25 +319,29 @@ static void finish_requests(struct request *req, struct req_iter *reqs,
 	uint32_t len = req->rq.data_length;
 	uint64_t off = req->rq.obj.offset;
 	int opcode = req->rq.opcode;
-	int start = off / SD_EC_DATA_STRIPE_SIZE;
-	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE), i, j;
-	int nr_stripe = end - start;
+	int start, end, nr_stripe, i, j;
+	uint32_t stripe;
 
 	if (!is_erasure_oid(oid))
 		goto out;
 
+	stripe = get_vdi_stripe_size(oid_to_vid(oid));
+	start = off / stripe;
+	end = DIV_ROUND_UP(off + len, stripe);
+	nr_stripe = end - start;
 	sd_debug("start %d, end %d, send %d, off %"PRIu64 ", len %"PRIu32,
 		 start, end, nr_to_send, off, len);
 
 	/* We need to assemble the data strips into the req buffer for read */
 	if (opcode == SD_OP_READ_OBJ) {
-		char *p, *buf = xmalloc(SD_EC_DATA_STRIPE_SIZE * nr_stripe);
+		size_t buf_len = stripe * nr_stripe;
+		char *p, *buf = xbuffer_alloc(buf_len);
 		uint8_t policy = req->rq.obj.copy_policy ?:
 			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
 		int ed = 0, strip_size;
 
 		ec_policy_to_dp(policy, &ed, NULL);
-		strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+		strip_size = stripe / ed;
 
 		p = buf;
 		for (i = 0; i < nr_stripe; i++) {
@@ -233,281 +351,1099 @@ static void finish_requests(struct request *req, struct req_iter *reqs,
 				p += strip_size;
 			}
 		}
-		memcpy(req->data, buf + off % SD_EC_DATA_STRIPE_SIZE, len);
+		memcpy(req->data, buf + off % stripe, len);
 		req->rp.data_length = req->rq.data_length;
-		free(buf);
+		buffer_free(buf, buf_len);
 	}
 	for (i = 0; i < nr_to_send; i++)
-		free(reqs[i].buf);
+		buffer_free(reqs[i].buf, reqs[i].dlen);
 out:
 	free(reqs);
 }
 
+/* Hedged reads are never sent sooner than this, in microseconds */
+#define HEDGE_MIN_DELAY		1000
+/* Used when we know nothing about the latency of the replica */
+#define HEDGE_DEFAULT_DELAY	(100 * 1000)
+
+struct read_target {
+	const struct sd_node *node;
+	uint64_t cost;
+};
+
+static int read_target_cmp(const struct read_target *a,
+			   const struct read_target *b)
+{
+	return intcmp(a->cost, b->cost);
+}
+
 /*
- * Try our best to read one copy and read local first.
+ * Copies on the slow disks of the other nodes
  *
- * Return success if any read succeed. We don't call gateway_forward_request()
- * because we only read once.
+ * A node replies to the read of a copy on one of its slow disks with
+ * rsp.obj.slow, see md_slow_timer_fn().  We remember the node for the object
+ * for SLOW_COPY_TIME seconds and read its other copies first.  The table is
+ * direct-mapped and not locked, so a racy entry only misplaces a read.
  */
-static int gateway_replication_read(struct request *req)
+#define SLOW_COPY_BITS	12
+#define SLOW_COPY_TIME	60 /* seconds */
+
+static struct slow_copy {
+	uint64_t oid;
+	uint64_t node; /* hash of the node id */
+	uint64_t expire;
+} slow_copies[1 << SLOW_COPY_BITS];
+
+static inline uint64_t slow_copy_node(const struct node_id *nid)
 {
-	int i, ret = SD_RES_SUCCESS;
-	struct sd_req fwd_hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
-	const struct sd_vnode *v;
-	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
-	uint64_t oid = req->rq.obj.oid;
-	int nr_copies, j;
+	return sd_hash(nid->addr, sizeof(nid->addr)) ^ nid->port;
+}
 
-	nr_copies = get_req_copy_number(req);
+static bool is_slow_copy(uint64_t oid, const struct node_id *nid)
+{
+	struct slow_copy *c = slow_copies + hash_64(oid, SLOW_COPY_BITS);
 
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
-	for (i = 0; i < nr_copies; i++) {
-		v = obj_vnodes[i];
-		if (!vnode_is_local(v))
-			continue;
-		ret = peer_read_obj(req);
-		if (ret == SD_RES_SUCCESS)
-			goto out;
+	return uatomic_read(&c->oid) == oid &&
+		uatomic_read(&c->node) == slow_copy_node(nid) &&
+		uatomic_read(&c->expire) > clock_get_time();
+}
 
-		sd_debug("local read %"PRIx64" failed, %s", oid,
-			 sd_strerror(ret));
-		break;
-	}
+/* Take the hint of the reply of nid, which isn't for the client */
+static void note_slow_copy(struct request *req, const struct node_id *nid)
+{
+	struct slow_copy *c;
+
+	if (!req->rp.obj.slow)
+		return;
+
+	req->rp.obj.slow = 0;
+	c = slow_copies + hash_64(req->rq.obj.oid, SLOW_COPY_BITS);
+	uatomic_set(&c->oid, req->rq.obj.oid);
+	uatomic_set(&c->node, slow_copy_node(nid));
+	uatomic_set(&c->expire, clock_get_time() +
+		    SLOW_COPY_TIME * 1000000000ULL);
+}
+
+/*
+ * Collect the remote copies we can read from, in the order to try them.
+ *
+ * By default we start from a random copy for better load balance, useful for
+ * reading base VM's COW objects.  With the balanced read policy, the copies
+ * are sorted by the expected time to serve the read, that is, the smoothed
+ * latency of the node times the requests outstanding to it.  Nodes we haven't
+ * talked to recently cost nothing, so slow nodes are probed again later.
+ * The copies on slow disks are tried after the others, and the nodes the
+ * sockfd cache found down last in any case.
+ */
+static int get_read_targets(uint64_t oid, const struct sd_vnode **vnodes,
+			    int nr_copies, struct read_target *targets)
+{
+	int i, j = random(), nr = 0;
+	struct sockfd_load load;
+	bool has_last = false;
 
-	/*
-	 * Read random copy from cluster for better load balance, useful for
-	 * reading base VM's COW objects
-	 */
-	j = random();
 	for (i = 0; i < nr_copies; i++) {
-		int idx = (i + j) % nr_copies;
+		const struct sd_vnode *v = vnodes[(i + j) % nr_copies];
 
-		v = obj_vnodes[idx];
 		if (vnode_is_local(v))
 			continue;
 
 		/* If node is in recovery or offline, we don't read from it */
 		if (v->node->nid.status != NODE_STATUS_RUNNING)
 			continue;
-		/*
-		 * We need to re-init it because rsp and req share the same
-		 * structure.
-		 */
-		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
-		ret = sheep_exec_req(&v->node->nid, &fwd_hdr, req->data);
-		if (ret != SD_RES_SUCCESS)
-			continue;
 
-		/* Read success */
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		break;
+		sockfd_cache_get_load(&v->node->nid, &load);
+		targets[nr].node = v->node;
+		targets[nr].cost = 0;
+		if (load.down) {
+			targets[nr].cost = UINT64_MAX;
+			has_last = true;
+		} else if (is_slow_copy(oid, &v->node->nid)) {
+			targets[nr].cost = UINT64_MAX - 1;
+			has_last = true;
+		} else if (sys->read_balance)
+			targets[nr].cost = load.latency *
+				(load.nr_inflight + 1);
+		nr++;
 	}
-out:
+
+	if (sys->read_balance || has_last)
+		xqsort(targets, nr, read_target_cmp);
+
+	return nr;
+}
+
+static int read_one_target(struct request *req, const struct node_id *nid)
+{
+	struct sd_req fwd_hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
+	uint64_t start = clock_get_time();
+	int ret;
+
+	/* We need to re-init it because rsp and req share the same structure */
+	gateway_init_fwd_hdr(&fwd_hdr, req);
+	ret = sheep_exec_req(nid, &fwd_hdr, req->data);
+	if (ret != SD_RES_NETWORK_ERROR)
+		sockfd_cache_update_latency(nid,
+					    (clock_get_time() - start) / 1000);
+	if (ret == SD_RES_SUCCESS) {
+		memcpy(&req->rp, rsp, sizeof(*rsp));
+		note_slow_copy(req, nid);
+	} else if (ret == SD_RES_OLD_NODE_VER)
+		req->rp.epoch = rsp->epoch;
+
 	return ret;
 }
 
-struct forward_info_entry {
-	struct pollfd pfd;
+struct hedged_read {
 	const struct node_id *nid;
 	struct sockfd *sfd;
-	void *buf;
-};
-
-struct forward_info {
-	struct forward_info_entry ent[SD_MAX_NODES];
-	int nr_sent;
+	uint64_t start;
 };
 
-static inline void forward_info_update(struct forward_info *fi, int pos)
+/*
+ * The delay before we send the read to another copy: the smoothed latency
+ * plus four times its deviation, which roughly covers the 99th percentile.
+ */
+static int hedge_delay(const struct node_id *nid)
 {
-	sd_debug("%d, %d", fi->nr_sent, pos);
-	fi->nr_sent--;
-	memmove(fi->ent + pos, fi->ent + pos + 1,
-		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
-}
+	struct sockfd_load load;
+	uint64_t delay = HEDGE_DEFAULT_DELAY;
 
-static inline void finish_one_entry(struct forward_info *fi, int i)
-{
-	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
+	sockfd_cache_get_load(nid, &load);
+	if (load.latency)
+		delay = max(load.latency + 4 * load.latency_var,
+			    (uint64_t)HEDGE_MIN_DELAY);
+
+	return min(DIV_ROUND_UP(delay, 1000), (uint64_t)1000 * POLL_TIMEOUT);
 }
 
-static inline void finish_one_entry_err(struct forward_info *fi, int i)
+static int send_hedged_read(struct request *req, struct hedged_read *hr,
+			    const struct node_id *nid)
 {
-	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
+	struct sd_req hdr;
+
+	hr->sfd = sockfd_cache_get(nid);
+	if (!hr->sfd)
+		return -1;
+
+	gateway_init_fwd_hdr(&hdr, req);
+	if (send_req(hr->sfd->fd, &hdr, NULL, 0, sheep_need_retry,
+		     req->rq.epoch, MAX_RETRY_COUNT)) {
+		sockfd_cache_del(nid, hr->sfd);
+		return -1;
+	}
+
+	hr->nid = nid;
+	hr->start = clock_get_time();
+	return 0;
 }
 
-static inline struct forward_info_entry *
-forward_info_find(struct forward_info *fi, int fd)
+static int recv_hedged_read(struct request *req, struct hedged_read *hr)
 {
-	for (int i = 0; i < fi->nr_sent; i++)
-		if (fi->ent[i].pfd.fd == fd)
-			return &fi->ent[i];
+	struct sd_rsp rsp;
+	int fd = hr->sfd->fd;
 
-	panic("can't find entry for %d", fd);
-	return NULL;
-}
+	if (do_read_rsp(fd, &rsp, req->data, req->rq.data_length,
+			sheep_need_retry, req->rq.epoch, MAX_RETRY_COUNT)) {
+		sd_err("remote node might have gone away");
+		sockfd_cache_del(hr->nid, hr->sfd);
+		return SD_RES_NETWORK_ERROR;
+	}
 
-struct pfd_info {
-	struct pollfd pfds[SD_MAX_NODES];
-	int nr;
-};
+	sockfd_cache_put(hr->nid, hr->sfd);
+	sockfd_cache_update_latency(hr->nid,
+				    (clock_get_time() - hr->start) / 1000);
+	if (rsp.result == SD_RES_SUCCESS) {
+		memcpy(&req->rp, &rsp, sizeof(rsp));
+		note_slow_copy(req, hr->nid);
+	} else {
+		if (rsp.result == SD_RES_OLD_NODE_VER)
+			req->rp.epoch = rsp.epoch;
+		sd_debug("failed %"PRIx64", %s", req->rq.obj.oid,
+			 sd_strerror(rsp.result));
+	}
 
-static inline void pfd_info_init(struct forward_info *fi, struct pfd_info *pi)
-{
-	int i;
-	for (i = 0; i < fi->nr_sent; i++)
-		pi->pfds[i] = fi->ent[i].pfd;
-	pi->nr = fi->nr_sent;
+	return rsp.result;
 }
 
 /*
- * Wait for all forward requests completion.
- *
- * Even if something goes wrong, we have to wait forward requests completion to
- * avoid interleaved requests.
- *
- * Return error code if any one request fails.
+ * Read the copies one by one as usual, but if the current one doesn't answer
+ * within its hedge delay, send the same read to the next copy and take the
+ * response which comes first.  The connection of the loser is closed since we
+ * won't read its response.
  */
-static int wait_forward_request(struct forward_info *fi, struct request *req)
+static int gateway_hedged_read(struct request *req,
+			       const struct read_target *targets, int nr)
 {
-	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
-	    repeat = MAX_RETRY_COUNT;
-	struct pfd_info pi;
-	struct sd_rsp *rsp = &req->rp;
-again:
-	pfd_info_init(fi, &pi);
-	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
-	if (pollret < 0) {
-		if (errno == EINTR)
-			goto again;
+	struct hedged_read hr[2];
+	struct pollfd pfds[2];
+	int i, ret = SD_RES_NETWORK_ERROR, nr_sent = 0, next = 0, timeout,
+	    pollret, repeat = MAX_RETRY_COUNT;
+
+	while (nr_sent > 0 || next < nr) {
+		if (nr_sent == 0) {
+			if (send_hedged_read(req, &hr[0],
+					     &targets[next++].node->nid) < 0)
+				continue;
+			nr_sent = 1;
+		}
 
-		panic("%m");
-	} else if (pollret == 0) {
-		/*
-		 * If IO NIC is down, epoch isn't incremented, so we can't retry
-		 * for ever.
-		 */
-		if (sheep_need_retry(req->rq.epoch) && repeat) {
-			repeat--;
-			sd_warn("poll timeout %d, disks of some nodes or "
-				"network is busy. Going to poll-wait again",
-				fi->nr_sent);
-			goto again;
+		if (nr_sent == 1 && next < nr)
+			timeout = hedge_delay(hr[0].nid);
+		else
+			timeout = 1000 * POLL_TIMEOUT;
+
+		for (i = 0; i < nr_sent; i++) {
+			pfds[i].fd = hr[i].sfd->fd;
+			pfds[i].events = POLLIN;
+		}
+		pollret = poll(pfds, nr_sent, timeout);
+		if (pollret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			panic("%m");
+		} else if (pollret == 0) {
+			if (nr_sent == 1 && next < nr) {
+				const struct node_id *nid =
+					&targets[next++].node->nid;
+
+				sd_debug("hedge %"PRIx64" to %s after %d ms",
+					 req->rq.obj.oid,
+					 addr_to_str(nid->addr, nid->port),
+					 timeout);
+				if (send_hedged_read(req, &hr[1], nid) == 0)
+					nr_sent = 2;
+				continue;
+			}
+
+			if (sheep_need_retry(req->rq.epoch) && repeat) {
+				repeat--;
+				sd_warn("poll timeout %d, disks of some nodes "
+					"or network is busy. Going to poll-wait"
+					" again", nr_sent);
+				continue;
+			}
+
+			for (i = 0; i < nr_sent; i++)
+				sockfd_cache_del(hr[i].nid, hr[i].sfd);
+
+			return SD_RES_NETWORK_ERROR;
 		}
 
-		nr_sent = fi->nr_sent;
-		/* XXX Blindly close all the connections */
 		for (i = 0; i < nr_sent; i++)
-			sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+			if (pfds[i].revents)
+				break;
+
+		if (pfds[i].revents & POLLIN)
+			ret = recv_hedged_read(req, &hr[i]);
+		else {
+			sockfd_cache_del(hr[i].nid, hr[i].sfd);
+			ret = SD_RES_NETWORK_ERROR;
+		}
+		hr[i] = hr[--nr_sent];
 
-		return SD_RES_NETWORK_ERROR;
+		if (ret == SD_RES_SUCCESS) {
+			for (i = 0; i < nr_sent; i++)
+				sockfd_cache_drop(hr[i].nid, hr[i].sfd);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static void quorum_wait_object(uint64_t oid);
+
+/*
+ * Retry at the new epoch in the gateway
+ *
+ * A peer answers SD_RES_OLD_NODE_VER to a request of an epoch older than its
+ * own.  Instead of sleeping the request on the wait queue of the main thread
+ * until the epoch of this node is lifted and forwarding it to all the copies
+ * again, the worker waits up to GATEWAY_RETRY_WAIT for the epoch, takes the
+ * vnode info of the epoch from the epoch log and forwards the request again
+ * by the new placement, only to the nodes which haven't done it yet.  If the
+ * epoch doesn't come in time, gateway_op_done() handles the request as before.
+ */
+#define GATEWAY_RETRY_WAIT	1000 /* ms */
+#define GATEWAY_MAX_RETRY	3
+
+/* Move req to the epoch in req->rp.epoch, false if we can't */
+static bool gateway_move_epoch(struct request *req, int *retries)
+{
+	uint32_t epoch;
+	struct vnode_info *vinfo;
+
+	if ((*retries)++ == GATEWAY_MAX_RETRY ||
+	    !after(req->rp.epoch, req->rq.epoch))
+		return false;
+
+	for (int ms = 0; before(uatomic_read(&sys->cinfo.epoch),
+				req->rp.epoch); ms++) {
+		if (ms == GATEWAY_RETRY_WAIT)
+			return false;
+		usleep(1000);
 	}
 
-	nr_sent = fi->nr_sent;
-	for (i = 0; i < nr_sent; i++)
-		if (pi.pfds[i].revents & POLLIN)
+	epoch = uatomic_read(&sys->cinfo.epoch);
+	vinfo = get_cached_vnode_info_epoch(epoch, req->vinfo);
+	if (!vinfo)
+		return false;
+
+	sd_debug("%"PRIx64" from epoch %"PRIu32" to %"PRIu32,
+		 req->rq.obj.oid, req->rq.epoch, epoch);
+	put_req_vnode_info(req);
+	req->vinfo = vinfo;
+	req->rq.epoch = epoch;
+	return true;
+}
+
+/*
+ * Try our best to read one copy and read local first.
+ *
+ * Return success if any read succeed. We don't call gateway_forward_request()
+ * because we only read once.
+ */
+static int replication_read(struct request *req)
+{
+	int i, ret = SD_RES_SUCCESS;
+	const struct sd_vnode *v;
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	struct read_target targets[SD_MAX_COPIES];
+	uint64_t oid = req->rq.obj.oid, start;
+	int nr_copies, nr;
+	bool local_slow = false;
+
+	quorum_wait_object(oid);
+	nr_copies = get_req_copy_number(req);
+
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[i];
+		if (!vnode_is_local(v))
+			continue;
+		/* the local copy is the last resort */
+		if (nr_copies > 1 && md_oid_slow(oid)) {
+			local_slow = true;
 			break;
-	if (i < nr_sent) {
-		int re = pi.pfds[i].revents;
-		sd_debug("%d, revents %x", i, re);
-		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
-			goto out;
 		}
-		if (do_read(pi.pfds[i].fd, rsp, sizeof(*rsp), sheep_need_retry,
-			    req->rq.epoch, MAX_RETRY_COUNT)) {
-			sd_err("remote node might have gone away");
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
+		ret = peer_read_obj(req);
+		if (ret == SD_RES_SUCCESS)
 			goto out;
-		}
 
-		if (rsp->data_length) {
-			struct forward_info_entry *ent;
+		sd_debug("local read %"PRIx64" failed, %s", oid,
+			 sd_strerror(ret));
+		break;
+	}
 
-			ent = forward_info_find(fi, pi.pfds[i].fd);
-			if (do_read(pi.pfds[i].fd, ent->buf, rsp->data_length,
-				    sheep_need_retry, req->rq.epoch,
-				    MAX_RETRY_COUNT)) {
-				sd_err("remote node might have gone away");
-				err_ret = SD_RES_NETWORK_ERROR;
-				finish_one_entry_err(fi, i);
-				goto out;
-			}
-		}
-		ret = rsp->result;
-		if (ret != SD_RES_SUCCESS) {
-			sd_debug("fail %"PRIx64", %s", req->rq.obj.oid,
-				 sd_strerror(ret));
-			err_ret = ret;
+	start = clock_get_time();
+	nr = get_read_targets(oid, obj_vnodes, nr_copies, targets);
+	if (sys->hedged_read && nr > 1)
+		ret = gateway_hedged_read(req, targets, nr);
+	else {
+		for (i = 0; i < nr; i++) {
+			ret = read_one_target(req, &targets[i].node->nid);
+			/* no hot form of the object, see hybrid_read() */
+			if (ret == SD_RES_SUCCESS ||
+			    (ret == SD_RES_NO_OBJ && is_hot_obj(oid)))
+				break;
 		}
-		finish_one_entry(fi, i);
 	}
+	request_latency(req, SD_LAT_PEER, start);
+	if (local_slow && (!nr || ret != SD_RES_SUCCESS))
+		ret = peer_read_obj(req);
 out:
-	if (fi->nr_sent > 0)
-		goto again;
-
-	return err_ret;
+	return ret;
 }
 
-static inline void forward_info_init(struct forward_info *fi, size_t nr_to_send)
+static int replication_read_retry(struct request *req)
 {
-	int i;
-	for (i = 0; i < nr_to_send; i++)
-		fi->ent[i].pfd.fd = -1;
-	fi->nr_sent = 0;
+	int ret, retries = 0;
+
+	do {
+		ret = replication_read(req);
+	} while (ret == SD_RES_OLD_NODE_VER &&
+		 gateway_move_epoch(req, &retries));
+
+	return ret;
 }
 
-static inline void
-forward_info_advance(struct forward_info *fi, const struct node_id *nid,
-		     struct sockfd *sfd, void *buf)
+/*
+ * Coalescing of the reads of the snapshot objects
+ *
+ * When the guests of many clones boot at once, they read the same objects of
+ * their snapshot at the same time.  A read of a read-only object finding the
+ * same read in flight, by the oid, the range and the flags, waits for it and
+ * takes a copy of its reply instead of reading a copy of the object again.
+ * The writable objects aren't coalesced, because the read in flight could miss
+ * a write done before the later read arrived.  The failed reads are retried by
+ * each request on its own.
+ */
+#define INFLIGHT_HASH_BITS	8
+#define INFLIGHT_HASH_SIZE	(1 << INFLIGHT_HASH_BITS)
+
+struct inflight_read {
+	uint64_t oid;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t flags;
+	struct hlist_node hash;
+	struct sd_cond cond;
+	int nr_waiters;
+	bool done;
+	int ret;
+	struct sd_rsp rp;
+	const void *data; /* the reply of the first read, until no waiter */
+};
+
+static struct inflight_bucket {
+	struct sd_mutex lock;
+	struct hlist_head hash;
+} inflight_reads[INFLIGHT_HASH_SIZE] = {
+	[0 ... INFLIGHT_HASH_SIZE - 1] = { .lock = SD_MUTEX_INITIALIZER },
+};
+
+static struct inflight_read *find_inflight_read(struct inflight_bucket *b,
+						const struct sd_req *hdr)
 {
-	fi->ent[fi->nr_sent].nid = nid;
-	fi->ent[fi->nr_sent].pfd.fd = sfd->fd;
-	fi->ent[fi->nr_sent].pfd.events = POLLIN;
-	fi->ent[fi->nr_sent].sfd = sfd;
-	fi->ent[fi->nr_sent].buf = buf;
-	fi->nr_sent++;
+	struct inflight_read *ir;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(ir, node, &b->hash, hash) {
+		if (ir->oid == hdr->obj.oid && ir->offset == hdr->obj.offset &&
+		    ir->length == hdr->data_length && ir->flags == hdr->flags)
+			return ir;
+	}
+	return NULL;
 }
 
-static int gateway_forward_request(struct request *req)
+/* Wait for the read in flight ir, with the lock of the bucket held */
+static int wait_inflight_read(struct request *req, struct inflight_bucket *b,
+			      struct inflight_read *ir)
 {
-	int i, err_ret = SD_RES_SUCCESS, ret;
-	unsigned wlen;
-	uint64_t oid = req->rq.obj.oid;
-	struct forward_info fi;
-	struct sd_req hdr;
-	const struct sd_node *target_nodes[SD_MAX_COPIES];
-	int nr_copies = get_req_copy_number(req), nr_reqs, nr_to_send = 0;
-	struct req_iter *reqs = NULL;
+	int ret;
 
-	sd_debug("%"PRIx64, oid);
+	ir->nr_waiters++;
+	while (!ir->done)
+		sd_cond_wait(&ir->cond, &b->lock);
+	sd_mutex_unlock(&b->lock);
 
-	gateway_init_fwd_hdr(&hdr, &req->rq);
-	oid_to_nodes(oid, &req->vinfo->vroot, nr_copies, target_nodes);
-	forward_info_init(&fi, nr_copies);
-	reqs = prepare_requests(req, &nr_to_send);
-	if (!reqs)
-		return SD_RES_NETWORK_ERROR;
+	ret = ir->ret;
+	if (ret == SD_RES_SUCCESS) {
+		req->rp = ir->rp;
+		memcpy(req->data, ir->data, ir->rp.data_length);
+	}
 
-	/*
-	 * For replication, we send number of available zones copies.
-	 *
-	 * For erasure, we need at least number of data strips to send to avoid
-	 * overflow of target_nodes.
-	 */
-	nr_reqs = nr_to_send;
-	if (nr_to_send > nr_copies) {
-		uint8_t policy = req->rq.obj.copy_policy ?:
-			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
-		int ds;
-		/* Only for erasure code, nr_to_send might > nr_copies */
-		ec_policy_to_dp(policy, &ds, NULL);
-		if (nr_copies < ds) {
+	sd_mutex_lock(&b->lock);
+	if (!--ir->nr_waiters)
+		sd_cond_broadcast(&ir->cond);
+	sd_mutex_unlock(&b->lock);
+
+	if (ret != SD_RES_SUCCESS)
+		return replication_read_retry(req);
+	sd_debug("%"PRIx64" coalesced", req->rq.obj.oid);
+	return ret;
+}
+
+static int gateway_replication_read(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct inflight_bucket *b;
+	struct inflight_read *ir;
+	int ret;
+
+	if (!oid_is_readonly(hdr->obj.oid))
+		return replication_read_retry(req);
+
+	b = inflight_reads + hash_64(hdr->obj.oid ^ hdr->obj.offset,
+				     INFLIGHT_HASH_BITS);
+	sd_mutex_lock(&b->lock);
+	ir = find_inflight_read(b, hdr);
+	if (ir)
+		return wait_inflight_read(req, b, ir);
+
+	ir = xzalloc(sizeof(*ir));
+	ir->oid = hdr->obj.oid;
+	ir->offset = hdr->obj.offset;
+	ir->length = hdr->data_length;
+	ir->flags = hdr->flags;
+	sd_cond_init(&ir->cond);
+	hlist_add_head(&ir->hash, &b->hash);
+	sd_mutex_unlock(&b->lock);
+
+	ret = replication_read_retry(req);
+
+	sd_mutex_lock(&b->lock);
+	/* the reads from now on go on their own */
+	hlist_del(&ir->hash);
+	ir->ret = ret;
+	ir->rp = req->rp;
+	ir->data = req->data;
+	ir->done = true;
+	sd_cond_broadcast(&ir->cond);
+	while (ir->nr_waiters)
+		sd_cond_wait(&ir->cond, &b->lock);
+	sd_mutex_unlock(&b->lock);
+
+	sd_destroy_cond(&ir->cond);
+	free(ir);
+	return ret;
+}
+
+struct forward_info_entry {
+	struct sockfd_mux_req mreq;
+	const struct node_id *nid;
+	bool finished;
+};
+
+struct forward_info {
+	struct forward_info_entry ent[SD_MAX_COPIES];
+	int nr_sent;
+	int nr_pending;
+};
+
+static inline void forward_info_init(struct forward_info *fi)
+{
+	fi->nr_sent = 0;
+	fi->nr_pending = 0;
+}
+
+static inline void finish_one_entry(struct forward_info *fi, int i)
+{
+	if (fi->ent[i].mreq.transport)
+		rdma_finish_req(&fi->ent[i].mreq);
+	else
+		sockfd_mux_finish(&fi->ent[i].mreq);
+	fi->ent[i].finished = true;
+	fi->nr_pending--;
+}
+
+/*
+ * Wait for all forward requests completion.
+ *
+ * The requests share the multiplexed connections with other threads, so
+ * giving up one of them doesn't disturb the others.  The response of a request
+ * which we have given up is dropped by the dispatcher.
+ *
+ * With a non-zero quorum, return success as soon as that many requests
+ * succeed, leaving the others pending.
+ *
+ * Return error code if any one request fails.
+ */
+static int wait_forward_request(struct forward_info *fi, struct request *req,
+				int quorum)
+{
+	int err_ret = SD_RES_SUCCESS, ret, i, repeat = MAX_RETRY_COUNT;
+	int nr_acked = 0;
+	struct pollfd pfd = { .fd = sockfd_mux_efd(), .events = POLLIN };
+
+	while (true) {
+		for (i = 0; i < fi->nr_sent; i++) {
+			struct sockfd_mux_req *mreq = &fi->ent[i].mreq;
+
+			if (fi->ent[i].finished || !sockfd_mux_done(mreq))
+				continue;
+
+			memcpy(&req->rp, &mreq->rsp, sizeof(req->rp));
+			ret = mreq->rsp.result;
+			if (ret == SD_RES_NETWORK_ERROR) {
+				sd_err("remote node might have gone away");
+				sockfd_cache_del_node(fi->ent[i].nid);
+			} else if (ret != SD_RES_SUCCESS)
+				sd_debug("fail %"PRIx64", %s", req->rq.obj.oid,
+					 sd_strerror(ret));
+			if (ret != SD_RES_SUCCESS)
+				err_ret = ret;
+			else
+				nr_acked++;
+			finish_one_entry(fi, i);
+		}
+		if (!fi->nr_pending ||
+		    (quorum && err_ret == SD_RES_SUCCESS && nr_acked >= quorum))
+			break;
+
+		ret = poll(&pfd, 1, 1000 * POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("%m");
+		} else if (ret == 0) {
+			/*
+			 * If IO NIC is down, epoch isn't incremented, so we
+			 * can't retry for ever.
+			 */
+			if (sheep_need_retry(req->rq.epoch) && repeat) {
+				repeat--;
+				sd_warn("poll timeout %d, disks of some nodes or "
+					"network is busy. Going to poll-wait "
+					"again", fi->nr_pending);
+				continue;
+			}
+
+			for (i = 0; i < fi->nr_sent; i++)
+				if (!fi->ent[i].finished)
+					finish_one_entry(fi, i);
+			return SD_RES_NETWORK_ERROR;
+		}
+		eventfd_xread(pfd.fd);
+	}
+
+	return err_ret;
+}
+
+/* Don't bother the zero copy for small writes, the page pinning costs more */
+#define ZEROCOPY_MIN_LEN	(16 * 1024)
+
+static int forward_send_req(struct forward_info *fi, const struct node_id *nid,
+			    struct sd_req *hdr, void *buf, unsigned int wlen,
+			    uint32_t epoch)
+{
+	struct forward_info_entry *ent = fi->ent + fi->nr_sent;
+	int ret;
+
+	/* the response data, if any, goes to the same buffer */
+	ent->mreq.buf = buf;
+	ent->mreq.buf_len = hdr->data_length;
+	ent->mreq.transport = NULL;
+	if (rdma_send_req(nid, hdr, &ent->mreq) < 0) {
+		ret = sockfd_mux_send(nid, hdr, buf, wlen,
+				      sys->zerocopy && wlen >= ZEROCOPY_MIN_LEN,
+				      sheep_need_retry, epoch, &ent->mreq);
+		if (ret)
+			return ret;
+	}
+
+	ent->nid = nid;
+	ent->finished = false;
+	fi->nr_sent++;
+	fi->nr_pending++;
+	return 0;
+}
+
+/*
+ * Write quorum
+ *
+ * With a write quorum, a replicated write of a data object is acked as soon
+ * as the quorum of the copies are written.  The lagging copies are handed over
+ * to the quorum thread together with the write data, and if the write fails
+ * or times out on a node, the thread asks the node to fetch the object from an
+ * acked copy with SD_OP_REPAIR_REPLICA.  If the epoch has changed meanwhile,
+ * the repair fails and the recovery takes care of the object.
+ *
+ * Requests to an object with lagging copies wait for them first, so a copy
+ * never sees the writes out of order and reads never see the old data.
+ */
+struct quorum_write {
+	struct forward_info fi;
+	struct list_node list;
+	struct vnode_info *vinfo; /* keeps the node ids in fi valid */
+	const struct node_id *src; /* an acked copy */
+	uint64_t oid;
+	uint32_t epoch;
+	uint64_t start;
+	void *data;
+	uint32_t data_length;
+};
+
+static struct {
+	int efd;
+	sd_thread_t thread;
+	struct sd_mutex lock;
+	struct sd_cond cond; /* broadcast when lagging writes are done */
+	struct list_head pending;
+	int nr_pending;
+} quorum = {
+	.efd = -1,
+};
+
+/*
+ * The copies of a vdi converted to more copies, which exist before the
+ * conversion, or 0
+ */
+static int nr_copies_converted_from(uint64_t oid)
+{
+	int nr_copies, old_nr_copies;
+
+	if (is_hot_obj(oid) || is_erasure_oid(oid) ||
+	    !get_vdi_copies(oid_to_vid(oid), &nr_copies, &old_nr_copies) ||
+	    old_nr_copies >= nr_copies)
+		return 0;
+	return old_nr_copies;
+}
+
+/* Return the number of copies to ack the write after, or 0 to wait for all */
+static int get_write_quorum(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int nr;
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ &&
+	    req->rq.opcode != SD_OP_CREATE_AND_WRITE_OBJ)
+		return 0;
+
+	/*
+	 * Local and shared memory requests don't pass the ownership of their
+	 * buffers
+	 */
+	if (quorum.efd < 0 || req->local || req->shm || !is_data_obj(oid) ||
+	    is_erasure_oid(oid))
+		return 0;
+
+	/* a copy refusing a write of a hot object must be heard, hybrid.c */
+	if (is_hot_obj(oid))
+		return 0;
+
+	/* so must a new copy of a converted object, see repair_new_copies() */
+	if (nr_copies_converted_from(oid))
+		return 0;
+
+	nr = get_vdi_write_quorum(oid_to_vid(oid));
+	return nr < get_req_copy_number(req) ? nr : 0;
+}
+
+/* Wait until the lagging copies of the object are done */
+static void quorum_wait_object(uint64_t oid)
+{
+	struct quorum_write *qw;
+
+	if (!uatomic_read(&quorum.nr_pending))
+		return;
+
+	sd_mutex_lock(&quorum.lock);
+again:
+	list_for_each_entry(qw, &quorum.pending, list) {
+		if (qw->oid == oid) {
+			sd_cond_wait(&quorum.cond, &quorum.lock);
+			goto again;
+		}
+	}
+	sd_mutex_unlock(&quorum.lock);
+}
+
+/* Whether a write to the object still has lagging copies in flight */
+bool quorum_object_pending(uint64_t oid)
+{
+	struct quorum_write *qw;
+	bool ret = false;
+
+	if (!uatomic_read(&quorum.nr_pending))
+		return false;
+
+	sd_mutex_lock(&quorum.lock);
+	list_for_each_entry(qw, &quorum.pending, list) {
+		if (qw->oid == oid) {
+			ret = true;
+			break;
+		}
+	}
+	sd_mutex_unlock(&quorum.lock);
+	return ret;
+}
+
+/* Hand the lagging copies of the write over to the quorum thread */
+static void quorum_hand_over(struct quorum_write *qw, struct request *req)
+{
+	struct forward_info *fi = &qw->fi;
+
+	if (!fi->nr_pending) {
+		free(qw);
+		return;
+	}
+
+	for (int i = 0; i < fi->nr_sent; i++) {
+		struct forward_info_entry *ent = fi->ent + i;
+
+		if (ent->finished) {
+			if (!qw->src)
+				qw->src = ent->nid;
+		} else if (ent->mreq.transport)
+			rdma_rebind_req(&ent->mreq, quorum.efd);
+		else
+			sockfd_mux_rebind(&ent->mreq, quorum.efd);
+	}
+
+	qw->oid = req->rq.obj.oid;
+	qw->epoch = req->rq.epoch;
+	qw->start = clock_get_time();
+	qw->vinfo = grab_vnode_info(req->vinfo);
+	/* The lagging copies may still read the write data */
+	qw->data = req->data;
+	qw->data_length = req->data_length;
+	req->data = NULL;
+	req->data_length = 0;
+
+	sd_debug("%"PRIx64", %d copies lagging", qw->oid, fi->nr_pending);
+	sd_mutex_lock(&quorum.lock);
+	list_add_tail(&qw->list, &quorum.pending);
+	uatomic_inc(&quorum.nr_pending);
+	sd_mutex_unlock(&quorum.lock);
+	eventfd_xwrite(quorum.efd, 1);
+}
+
+static bool quorum_expired(struct quorum_write *qw, uint64_t now)
+{
+	uint64_t timeout = POLL_TIMEOUT * 1000000000ULL;
+
+	/* the same as the retries of wait_forward_request() */
+	if (sheep_need_retry(qw->epoch))
+		timeout *= MAX_RETRY_COUNT + 1;
+
+	return now - qw->start > timeout;
+}
+
+/* Called with quorum.lock held */
+static void quorum_poll(struct quorum_write *qw, uint64_t now)
+{
+	struct forward_info *fi = &qw->fi;
+	bool expired = quorum_expired(qw, now);
+
+	for (int i = 0; i < fi->nr_sent; i++) {
+		struct forward_info_entry *ent = fi->ent + i;
+
+		if (ent->finished)
+			continue;
+		if (!sockfd_mux_done(&ent->mreq)) {
+			if (!expired)
+				continue;
+			ent->mreq.rsp.result = SD_RES_NETWORK_ERROR;
+		}
+		finish_one_entry(fi, i);
+	}
+}
+
+/* Ask the node nid to fetch the object from the node src */
+static int repair_copy(uint64_t oid, uint32_t epoch, const struct node_id *nid,
+		       const struct node_id *src)
+{
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+	hdr.epoch = epoch;
+	memcpy(hdr.forw.addr, src->addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = src->port;
+	hdr.forw.oid = oid;
+
+	ret = sheep_exec_req(nid, &hdr, NULL);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to repair %"PRIx64" on %s, %s", oid,
+		       addr_to_str(nid->addr, nid->port), sd_strerror(ret));
+	return ret;
+}
+
+static void quorum_repair(struct quorum_write *qw, const struct node_id *nid)
+{
+	repair_copy(qw->oid, qw->epoch, nid, qw->src);
+}
+
+static void quorum_finish(struct quorum_write *qw)
+{
+	for (int i = 0; i < qw->fi.nr_sent; i++) {
+		struct forward_info_entry *ent = qw->fi.ent + i;
+		int ret = ent->mreq.rsp.result;
+
+		if (ret == SD_RES_SUCCESS)
+			continue;
+
+		sd_err("lagging write %"PRIx64" to %s failed, %s", qw->oid,
+		       addr_to_str(ent->nid->addr, ent->nid->port),
+		       sd_strerror(ret));
+		if (ret == SD_RES_NETWORK_ERROR)
+			sockfd_cache_del_node(ent->nid);
+		quorum_repair(qw, ent->nid);
+	}
+
+	put_vnode_info(qw->vinfo);
+	buffer_free(qw->data, qw->data_length);
+	free(qw);
+}
+
+static void *quorum_routine(void *arg)
+{
+	struct pollfd pfd = { .fd = quorum.efd, .events = POLLIN };
+	struct quorum_write *qw;
+	uint64_t now;
+	LIST_HEAD(done);
+	int nr_done;
+
+	while (true) {
+		if (poll(&pfd, 1, 1000) > 0)
+			eventfd_xread(quorum.efd);
+
+		now = clock_get_time();
+		nr_done = 0;
+		sd_mutex_lock(&quorum.lock);
+		list_for_each_entry(qw, &quorum.pending, list) {
+			quorum_poll(qw, now);
+			if (qw->fi.nr_pending)
+				continue;
+			list_del(&qw->list);
+			list_add_tail(&qw->list, &done);
+			nr_done++;
+		}
+		if (nr_done) {
+			uatomic_sub(&quorum.nr_pending, nr_done);
+			sd_cond_broadcast(&quorum.cond);
+		}
+		sd_mutex_unlock(&quorum.lock);
+
+		list_for_each_entry(qw, &done, list) {
+			list_del(&qw->list);
+			quorum_finish(qw);
+		}
+	}
+	return NULL;
+}
+
+int init_write_quorum(void)
+{
+	int ret;
+
+	sd_init_mutex(&quorum.lock);
+	sd_cond_init(&quorum.cond);
+	INIT_LIST_HEAD(&quorum.pending);
+
+	quorum.efd = eventfd(0, EFD_NONBLOCK);
+	if (quorum.efd < 0) {
+		sd_err("failed to create an eventfd, %m");
+		return -1;
+	}
+
+	ret = sd_thread_create("quorum", &quorum.thread, quorum_routine, NULL);
+	if (ret) {
+		sd_err("failed to create the quorum thread, %s", strerror(ret));
+		close(quorum.efd);
+		quorum.efd = -1;
+		return -1;
+	}
+
+	sd_info("replicated writes are acked after %d copies",
+		sys->write_quorum);
+	return 0;
+}
+
+static bool node_in(const struct node_id *nid, const struct node_id *nids,
+		    int nr)
+{
+	for (int i = 0; i < nr; i++)
+		if (node_id_cmp(nid, nids + i) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Add the nodes which have done the request to acked, and set req->rp.epoch
+ * to the newest epoch of the peers which have answered SD_RES_OLD_NODE_VER.
+ */
+static void note_acked_nodes(struct forward_info *fi, struct request *req,
+			     struct node_id *acked, int *nr_acked)
+{
+	req->rp.epoch = 0;
+	for (int i = 0; i < fi->nr_sent; i++) {
+		const struct sd_rsp *rsp = &fi->ent[i].mreq.rsp;
+
+		if (!fi->ent[i].finished)
+			continue;
+		if (rsp->result == SD_RES_SUCCESS)
+			acked[(*nr_acked)++] = *fi->ent[i].nid;
+		else if (rsp->result == SD_RES_OLD_NODE_VER &&
+			 after(rsp->epoch, req->rp.epoch))
+			req->rp.epoch = rsp->epoch;
+	}
+}
+
+/*
+ * The new copies of an object of a vdi converted to more copies don't exist
+ * until copy.c makes them.  A request which they refuse for that is done by
+ * the old copies, and the new ones of a write are repaired from an old one,
+ * as the lagging copies of a write quorum are, so that they are never older
+ * than the write once they exist.
+ */
+static int repair_new_copies(struct request *req, struct forward_info *fi,
+			     const struct sd_node **target_nodes, int nr_old)
+{
+	const struct node_id *src = NULL, *missing[SD_MAX_COPIES];
+	int nr_missing = 0;
+
+	for (int i = 0; i < fi->nr_sent; i++) {
+		const struct node_id *nid = fi->ent[i].nid;
+		int ret = fi->ent[i].mreq.rsp.result;
+		bool old = false;
+
+		for (int j = 0; j < nr_old; j++)
+			if (!node_id_cmp(nid, &target_nodes[j]->nid))
+				old = true;
+		if (ret == SD_RES_SUCCESS) {
+			if (old)
+				src = nid;
+			continue;
+		}
+		if (ret != SD_RES_NO_OBJ || old)
+			return ret;
+		missing[nr_missing++] = nid;
+	}
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ)
+		return SD_RES_SUCCESS;
+	if (!src)
+		return SD_RES_NO_OBJ;
+	for (int i = 0; i < nr_missing; i++)
+		repair_copy(req->rq.obj.oid, req->rq.epoch, missing[i], src);
+	return SD_RES_SUCCESS;
+}
+
+static int forward_request(struct request *req, struct node_id *acked,
+			   int *nr_acked)
+{
+	int i, err_ret = SD_RES_SUCCESS, ret;
+	unsigned wlen;
+	uint64_t oid = req->rq.obj.oid;
+	struct forward_info fi_local, *fi = &fi_local;
+	struct quorum_write *qw = NULL;
+	struct sd_req hdr;
+	const struct sd_node *target_nodes[SD_MAX_COPIES];
+	int nr_copies = get_req_copy_number(req), nr_reqs, nr_to_send = 0;
+	int nr_quorum = get_write_quorum(req);
+	int nr_old = nr_copies_converted_from(oid);
+	struct req_iter *reqs = NULL;
+	uint64_t start = clock_get_time();
+	uint16_t flags;
+	void *wbuf = NULL, *buf;
+	uint32_t wbuf_len = 0;
+	bool deflated = false;
+
+	sd_debug("%"PRIx64, oid);
+
+	quorum_wait_object(oid);
+	gateway_init_fwd_hdr(&hdr, req);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
+	reqs = prepare_requests(req, &nr_to_send);
+	if (!reqs)
+		return SD_RES_NETWORK_ERROR;
+
+	/* The lagging requests outlive this function */
+	if (nr_quorum) {
+		qw = xzalloc(sizeof(*qw));
+		fi = &qw->fi;
+	}
+	forward_info_init(fi);
+
+	/*
+	 * For replication, we send number of available zones copies.
+	 *
+	 * For erasure, we need at least number of data strips to send to avoid
+	 * overflow of target_nodes.
+	 */
+	nr_reqs = nr_to_send;
+	if (nr_to_send > nr_copies) {
+		uint8_t policy = req->rq.obj.copy_policy ?:
+			get_vdi_copy_policy(oid_to_vid(req->rq.obj.oid));
+		int ds;
+		/* Only for erasure code, nr_to_send might > nr_copies */
+		ec_policy_to_dp(policy, &ds, NULL);
+		if (nr_copies < ds) {
 			sd_err("There isn't enough copies(%d) to send out (%d)",
 			       nr_copies, nr_to_send);
 			err_ret = SD_RES_SYSTEM_ERROR;
@@ -516,8 +1452,8 @@ static int gateway_forward_request(struct request *req)
 		nr_to_send = ds;
 	}
 
+	flags = hdr.flags;
 	for (i = 0; i < nr_to_send; i++) {
-		struct sockfd *sfd;
 		const struct node_id *nid;
 
 		nid = &target_nodes[i]->nid;
@@ -527,43 +1463,79 @@ static int gateway_forward_request(struct request *req)
 		 * recovery, but this is the best way to keep the delta data
 		 * scyn code as simple as possible.
 		 */
-		if (nid->status == NODE_STATUS_OFFLINE)
+		if (nid->status == NODE_STATUS_OFFLINE || reqs[i].skip ||
+		    node_in(nid, acked, *nr_acked))
 			continue;
 
-		sfd = sockfd_cache_get(nid);
-		if (!sfd) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			break;
-		}
-
+		hdr.flags = flags;
 		hdr.data_length = reqs[i].dlen;
 		wlen = reqs[i].wlen;
+		buf = reqs[i].buf;
 		hdr.obj.offset = reqs[i].off;
 		hdr.obj.ec_index = i;
 		hdr.obj.copy_policy = req->rq.obj.copy_policy;
-		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
-			       sheep_need_retry, req->rq.epoch,
-			       MAX_RETRY_COUNT);
+		/* the copies share the data, deflated once for the far ones */
+		if (wlen && !nr_quorum && !is_erasure_oid(oid) &&
+		    wire_deflate_to(target_nodes[i])) {
+			if (!deflated) {
+				wbuf = wire_deflate(buf, wlen, &wbuf_len);
+				deflated = true;
+			}
+			if (wbuf) {
+				hdr.flags |= SD_FLAG_CMD_DEFLATE;
+				hdr.data_length = wlen = wbuf_len;
+				buf = wbuf;
+			}
+		}
+		ret = forward_send_req(fi, nid, &hdr, buf, wlen,
+				       req->rq.epoch);
 		if (ret) {
 			sockfd_cache_del_node(nid);
 			err_ret = SD_RES_NETWORK_ERROR;
 			sd_debug("fail %d", ret);
 			break;
 		}
-		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
 	}
 
-	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
-	if (fi.nr_sent > 0) {
-		ret = wait_forward_request(&fi, req);
+	sd_debug("nr_sent %d, err %x", fi->nr_sent, err_ret);
+	if (fi->nr_sent > 0) {
+		ret = wait_forward_request(fi, req, nr_quorum);
+		if (ret == SD_RES_NO_OBJ && nr_old)
+			ret = repair_new_copies(req, fi, target_nodes, nr_old);
 		if (ret != SD_RES_SUCCESS)
 			err_ret = ret;
 	}
 out:
+	/* A failed request can be retried, which needs its buffer */
+	if (qw && err_ret != SD_RES_SUCCESS && fi->nr_pending)
+		wait_forward_request(fi, req, 0);
+	if (err_ret == SD_RES_OLD_NODE_VER)
+		note_acked_nodes(fi, req, acked, nr_acked);
+	if (qw)
+		quorum_hand_over(qw, req);
 	finish_requests(req, reqs, nr_reqs);
+	free(wbuf);
+	request_latency(req, SD_LAT_PEER, start);
 	return err_ret;
 }
 
+static int gateway_forward_request(struct request *req)
+{
+	struct node_id acked[SD_MAX_COPIES];
+	int ret, nr_acked = 0, retries = 0;
+
+	/* the copies of an erasure coded object move as a whole */
+	do {
+		if (request_expired(req))
+			return SD_RES_EXPIRED;
+		ret = forward_request(req, acked, &nr_acked);
+	} while (ret == SD_RES_OLD_NODE_VER &&
+		 !is_erasure_oid(req->rq.obj.oid) &&
+		 gateway_move_epoch(req, &retries));
+
+	return ret;
+}
+
 static int prepare_object_refcnt(const struct sd_req *hdr, uint32_t *vids,
 				 struct generation_reference *refs)
 {
@@ -642,9 +1614,10 @@ static int unref_cow_object(const struct sd_req *hdr, uint32_t *vids,
 			    uint32_t *new_vids,
 			    struct generation_reference *refs)
 {
-	int i, start, ret = SD_RES_SUCCESS;
+	int i, start, nr = 0, ret = SD_RES_SUCCESS;
 	size_t nr_vids = hdr->data_length / sizeof(*vids);
-	uint64_t offset;
+	uint64_t offset, *oids = xmalloc(nr_vids * sizeof(*oids));
+	struct generation_reference *grefs = xmalloc(nr_vids * sizeof(*grefs));
 	bool need_update = false;
 
 	offset = hdr->obj.offset - offsetof(struct sd_inode, data_vdi_id);
@@ -655,10 +1628,8 @@ static int unref_cow_object(const struct sd_req *hdr, uint32_t *vids,
 			continue;
 
 		/* Unrefount a COW object in the referenced vdi */
-		ret = sd_unref_object(vid_to_data_oid(vids[i], i + start),
-				      refs[i].generation, refs[i].count);
-		if (ret != SD_RES_SUCCESS)
-			sd_err("fail, %d", ret);
+		oids[nr] = vid_to_data_oid(vids[i], i + start);
+		grefs[nr++] = refs[i];
 
 		if (refs[i].generation != 0 || refs[i].count != 0) {
 			need_update = true;
@@ -668,6 +1639,15 @@ static int unref_cow_object(const struct sd_req *hdr, uint32_t *vids,
 		}
 	}
 
+	/* the messages to a ledger are applied in one write */
+	if (nr) {
+		ret = sd_unref_objects(oids, grefs, nr);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("fail, %d", ret);
+	}
+	free(oids);
+	free(grefs);
+
 	sd_debug("oid %"PRIx64 ", need update: %d", hdr->obj.oid, need_update);
 	if (need_update)
 		return sd_write_object(hdr->obj.oid, (char *)refs,
@@ -679,25 +1659,385 @@ static int unref_cow_object(const struct sd_req *hdr, uint32_t *vids,
 		return SD_RES_SUCCESS;
 }
 
-int gateway_read_object(struct request *req)
+/*
+ * The data objects of a hybrid vdi
+ *
+ * An object of a hybrid vdi is written in the hot form, replicated to one more
+ * copy than the parity strips with HOT_BIT in its oid, and erasure coded in
+ * the cold form, the oid of the clients, once it's left unwritten for
+ * sys->hybrid_age, see hybrid.c.  The hot form wins whenever it exists, so a
+ * read tries it first and the cold form next, and a write to a cold object
+ * takes it back to the hot form, under the cluster lock of the object.  The
+ * requests of the hot oids, and of SD_FLAG_CMD_COLD, go to the form of their
+ * oid.
+ */
+static bool is_hybrid_req(const struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
 
-	if (!bypass_object_cache(req))
-		return object_cache_handle_request(req);
-
-	if (is_erasure_oid(oid))
-		return gateway_forward_request(req);
-	else
-		return gateway_replication_read(req);
+	return sys->cinfo.copy_policy && is_data_obj(oid) && !is_hot_obj(oid) &&
+		!(req->rq.flags & SD_FLAG_CMD_COLD) &&
+		vdi_is_hybrid(oid_to_vid(oid));
 }
 
-int gateway_write_object(struct request *req)
+/* Run fn for the hot form of the object of req */
+static int hybrid_hot_exec(struct request *req, int (*fn)(struct request *))
 {
 	uint64_t oid = req->rq.obj.oid;
+	uint8_t copies = req->rq.obj.copies;
+	uint8_t copy_policy = req->rq.obj.copy_policy;
 	int ret;
-	struct sd_req *hdr = &req->rq;
-	uint32_t *vids = NULL, *new_vids = req->data;
+
+	req->rq.obj.oid = oid | HOT_BIT;
+	req->rq.obj.copies = 0;
+	req->rq.obj.copy_policy = 0;
+	ret = fn(req);
+	req->rq.obj.oid = oid;
+	req->rq.obj.copies = copies;
+	req->rq.obj.copy_policy = copy_policy;
+	return ret;
+}
+
+static int hybrid_read(struct request *req)
+{
+	int ret;
+
+	ret = hybrid_hot_exec(req, gateway_replication_read);
+	if (ret != SD_RES_NO_OBJ)
+		return ret;
+
+	ret = gateway_forward_request(req);
+	/* a write may have taken it to the hot form meanwhile */
+	if (ret == SD_RES_NO_OBJ)
+		ret = hybrid_hot_exec(req, gateway_replication_read);
+	return ret;
+}
+
+/* Take the cold object of req to the hot form, with the write of req */
+static int hybrid_promote(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	size_t len = get_vdi_objsize(oid);
+	char *buf = xvalloc(len);
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.flags = SD_FLAG_CMD_COLD;
+	hdr.obj.oid = oid;
+	hdr.data_length = len;
+	ret = exec_local_req(&hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	memcpy(buf + req->rq.obj.offset, req->data, req->rq.data_length);
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.obj.oid = oid | HOT_BIT;
+	hdr.data_length = len;
+	ret = exec_local_req(&hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	/* the hot form wins from now on, whether this fails or not */
+	sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+	hdr.flags = SD_FLAG_CMD_COLD;
+	hdr.obj.oid = oid;
+	if (exec_local_req(&hdr, NULL) != SD_RES_SUCCESS)
+		sd_warn("failed to remove the cold %016"PRIx64, oid);
+	sd_debug("%016"PRIx64, oid);
+out:
+	free(buf);
+	return ret;
+}
+
+static int hybrid_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int ret;
+
+	ret = hybrid_hot_exec(req, gateway_forward_request);
+	if (ret != SD_RES_NO_OBJ)
+		return ret;
+
+	sheep_lock(oid);
+	/* another write may have taken it to the hot form meanwhile */
+	ret = hybrid_hot_exec(req, gateway_forward_request);
+	if (ret == SD_RES_NO_OBJ)
+		ret = hybrid_promote(req);
+	sheep_unlock(oid);
+	return ret;
+}
+
+int gateway_read_object(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	/* only the replicas are read as they are stored */
+	if (!bypass_object_cache(req) || is_erasure_oid(oid))
+		req->rq.flags &= ~SD_FLAG_CMD_SPARSE;
+
+	if (!bypass_object_cache(req))
+		return object_cache_handle_request(req);
+
+	if (is_hybrid_req(req))
+		return hybrid_read(req);
+
+	if (is_erasure_oid(oid))
+		return gateway_forward_request(req);
+	else
+		return gateway_replication_read(req);
+}
+
+/*
+ * Coalescing of the adjacent writes
+ *
+ * With the write window of its vdi set, a write of a data object waits up to
+ * that many microseconds for the writes to the same object which are adjacent
+ * to or overlap the range gathered so far, and the first write forwards them
+ * all as one, the later ones over the earlier ones where they overlap.  Every
+ * write is acknowledged once the merged write is done, so a write acked is on
+ * the disks as before and SD_OP_FLUSH_VDI only closes the windows of the vdi
+ * early.  A write which isn't adjacent to the batch open on its object goes on
+ * its own.  The failed writes are retried by each request on its own.
+ */
+#define WRITE_BATCH_MAX		32
+#define WRITE_BATCH_MAX_LEN	(1024 * 1024)
+
+struct write_batch {
+	uint64_t oid;
+	uint32_t start, end;
+	struct hlist_node hash;
+	struct request *reqs[WRITE_BATCH_MAX];
+	int nr_reqs;
+	struct sd_cond cond;
+	bool closed; /* no more writes join it */
+	int nr_waiters;
+	bool done;
+	int ret;
+};
+
+static struct inflight_bucket write_batches[INFLIGHT_HASH_SIZE] = {
+	[0 ... INFLIGHT_HASH_SIZE - 1] = { .lock = SD_MUTEX_INITIALIZER },
+};
+
+static bool is_coalescable_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	return req->write_window && req->rq.opcode == SD_OP_WRITE_OBJ &&
+		is_data_obj(oid) && !is_erasure_oid(oid) &&
+		!get_write_quorum(req);
+}
+
+static struct write_batch *find_write_batch(struct inflight_bucket *b,
+					    uint64_t oid)
+{
+	struct write_batch *wb;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(wb, node, &b->hash, hash) {
+		if (wb->oid == oid)
+			return wb;
+	}
+	return NULL;
+}
+
+/* Must be called with the lock of the bucket held */
+static void close_write_batch(struct write_batch *wb)
+{
+	if (wb->closed)
+		return;
+	wb->closed = true;
+	hlist_del(&wb->hash);
+	sd_cond_broadcast(&wb->cond);
+}
+
+/* Join the open batch wb, with the lock of the bucket held */
+static int join_write_batch(struct request *req, struct inflight_bucket *b,
+			    struct write_batch *wb)
+{
+	struct sd_req *hdr = &req->rq;
+	int ret;
+
+	wb->reqs[wb->nr_reqs++] = req;
+	wb->start = min(wb->start, hdr->obj.offset);
+	wb->end = max(wb->end, (uint32_t)(hdr->obj.offset + hdr->data_length));
+	if (wb->nr_reqs == WRITE_BATCH_MAX)
+		close_write_batch(wb);
+
+	wb->nr_waiters++;
+	while (!wb->done)
+		sd_cond_wait(&wb->cond, &b->lock);
+	ret = wb->ret;
+	if (!--wb->nr_waiters)
+		sd_cond_broadcast(&wb->cond);
+	sd_mutex_unlock(&b->lock);
+
+	if (ret != SD_RES_SUCCESS)
+		return gateway_forward_request(req);
+	sd_debug("%"PRIx64" coalesced", hdr->obj.oid);
+	return ret;
+}
+
+/* Forward the writes of the closed batch as one, by req which leads it */
+static int forward_write_batch(struct request *req, struct write_batch *wb)
+{
+	struct sd_req *hdr = &req->rq;
+	uint32_t offset = hdr->obj.offset, length = hdr->data_length;
+	void *data = req->data;
+	char *buf;
+	int ret;
+
+	if (wb->nr_reqs == 1)
+		return gateway_forward_request(req);
+
+	buf = xvalloc(wb->end - wb->start);
+	for (int i = 0; i < wb->nr_reqs; i++) {
+		struct request *r = wb->reqs[i];
+
+		memcpy(buf + (r->rq.obj.offset - wb->start), r->data,
+		       r->rq.data_length);
+	}
+
+	hdr->obj.offset = wb->start;
+	hdr->data_length = wb->end - wb->start;
+	req->data = buf;
+	ret = gateway_forward_request(req);
+	hdr->obj.offset = offset;
+	hdr->data_length = length;
+	req->data = data;
+
+	free(buf);
+	sd_debug("%"PRIx64" %d writes of %"PRIu32" bytes", hdr->obj.oid,
+		 wb->nr_reqs, wb->end - wb->start);
+	return ret;
+}
+
+static int gateway_coalesce_write(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint32_t start = hdr->obj.offset, end = start + hdr->data_length;
+	struct inflight_bucket *b;
+	struct write_batch *wb;
+	struct timespec deadline;
+	uint64_t ns;
+	int ret;
+
+	b = write_batches + hash_64(hdr->obj.oid, INFLIGHT_HASH_BITS);
+	sd_mutex_lock(&b->lock);
+	wb = find_write_batch(b, hdr->obj.oid);
+	if (wb) {
+		if (start <= wb->end && end >= wb->start &&
+		    max(end, wb->end) - min(start, wb->start) <=
+		    WRITE_BATCH_MAX_LEN)
+			return join_write_batch(req, b, wb);
+		sd_mutex_unlock(&b->lock);
+		return gateway_forward_request(req);
+	}
+
+	wb = xzalloc(sizeof(*wb));
+	wb->oid = hdr->obj.oid;
+	wb->start = start;
+	wb->end = end;
+	wb->reqs[wb->nr_reqs++] = req;
+	sd_cond_init(&wb->cond);
+	hlist_add_head(&wb->hash, &b->hash);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	ns = deadline.tv_nsec + (uint64_t)req->write_window * 1000;
+	deadline.tv_sec += ns / 1000000000;
+	deadline.tv_nsec = ns % 1000000000;
+	while (!wb->closed) {
+		if (sd_cond_wait_until(&wb->cond, &b->lock, &deadline) ==
+		    ETIMEDOUT)
+			break;
+	}
+	close_write_batch(wb);
+	sd_mutex_unlock(&b->lock);
+
+	ret = forward_write_batch(req, wb);
+
+	sd_mutex_lock(&b->lock);
+	wb->ret = ret;
+	wb->done = true;
+	sd_cond_broadcast(&wb->cond);
+	while (wb->nr_waiters)
+		sd_cond_wait(&wb->cond, &b->lock);
+	sd_mutex_unlock(&b->lock);
+
+	sd_destroy_cond(&wb->cond);
+	free(wb);
+	return ret;
+}
+
+/* Forward the writes waiting in the windows of the vdi, for a flush */
+void gateway_flush_writes(uint32_t vid)
+{
+	for (int i = 0; i < INFLIGHT_HASH_SIZE; i++) {
+		struct inflight_bucket *b = write_batches + i;
+		struct write_batch *wb;
+		struct hlist_node *node;
+
+		sd_mutex_lock(&b->lock);
+		hlist_for_each_entry(wb, node, &b->hash, hash) {
+			if (oid_to_vid(wb->oid) == vid)
+				close_write_batch(wb);
+		}
+		sd_mutex_unlock(&b->lock);
+	}
+}
+
+/*
+ * A long write of zeros to a replicated data object is forwarded as a discard
+ * of its range, so the zeros don't go over the network and the copies punch a
+ * hole instead of allocating the blocks.  The discarded range reads back as
+ * zeros, see default_discard(), so it's only done for a store which discards.
+ */
+#define ZERO_WRITE_MIN (64 * 1024)
+
+static bool is_zero_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	return sd_store->discard &&
+		req->rq.opcode == SD_OP_WRITE_OBJ && is_data_obj(oid) &&
+		!is_erasure_oid(oid) && req->rq.data_length >= ZERO_WRITE_MIN &&
+		is_zero_block(req->data, req->rq.data_length);
+}
+
+static int gateway_zero_write(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint32_t length = hdr->data_length;
+	int ret;
+
+	hdr->opcode = SD_OP_DISCARD_RANGE;
+	hdr->flags &= ~SD_FLAG_CMD_WRITE;
+	hdr->data_length = 0;
+	hdr->obj.length = length;
+	ret = gateway_forward_request(req);
+	/* field by field, as the epoch may have moved on */
+	hdr->opcode = SD_OP_WRITE_OBJ;
+	hdr->flags |= SD_FLAG_CMD_WRITE;
+	hdr->data_length = length;
+	hdr->obj.length = 0;
+
+	/* an older peer doesn't know the discard, so the zeros are written */
+	if (sheep_op_unknown(ret) || ret == SD_RES_NO_SUPPORT)
+		return gateway_forward_request(req);
+
+	sd_debug("%"PRIx64" %"PRIu32" zeros discarded", hdr->obj.oid,
+		 hdr->data_length);
+	return ret;
+}
+
+int gateway_write_object(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	int ret;
+	struct sd_req *hdr = &req->rq;
+	uint32_t *vids = NULL, *new_vids = req->data;
 	struct generation_reference *refs = NULL;
 
 	if (oid_is_readonly(oid))
@@ -706,6 +2046,15 @@ int gateway_write_object(struct request *req)
 	if (!bypass_object_cache(req))
 		return object_cache_handle_request(req);
 
+	if (is_hybrid_req(req))
+		return hybrid_write(req);
+
+	if (is_zero_write(req))
+		return gateway_zero_write(req);
+
+	if (is_coalescable_write(req))
+		return gateway_coalesce_write(req);
+
 	if (is_data_vid_update(hdr)) {
 		size_t nr_vids = hdr->data_length / sizeof(*vids);
 
@@ -730,23 +2079,49 @@ out:
 	return ret;
 }
 
+/*
+ * A partial write of a replicated object is copied from the cow oid by each
+ * of the copies, see peer_copy_obj(), so the object doesn't come through the
+ * gateway.  If a copy fails, the object is read and created here as a whole.
+ */
 static int gateway_handle_cow(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
-	size_t len = get_objsize(oid);
+	size_t len = get_vdi_objsize(oid);
 	struct sd_req hdr, *req_hdr = &req->rq;
-	char *buf = xvalloc(len);
+	char *buf;
 	int ret;
 
+	if (req->rq.data_length != len && !is_erasure_oid(oid) &&
+	    !is_hybrid_req(req)) {
+		if (vdi_is_compressed(oid_to_vid(oid)))
+			req->rq.flags |= SD_FLAG_CMD_COMPRESS;
+		ret = gateway_forward_request(req);
+		if (ret == SD_RES_SUCCESS)
+			return ret;
+		sd_debug("failed to copy %016"PRIx64", %s", oid,
+			 sd_strerror(ret));
+	}
+
+	buf = xvalloc(len);
 	if (req->rq.data_length != len) {
-		/* Partial write, need read the copy first */
-		sd_init_req(&hdr, SD_OP_READ_OBJ);
-		hdr.obj.oid = req_hdr->obj.cow_oid;
-		hdr.data_length = len;
-		hdr.obj.offset = 0;
-		ret = exec_local_req(&hdr, buf);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
+		/*
+		 * Partial write, need read the copy first.  The object of the
+		 * snapshot is shared by all its clones, so it's likely cached.
+		 */
+		ret = SD_RES_NO_CACHE;
+		if (sys->enable_object_cache)
+			ret = object_cache_read(req_hdr->obj.cow_oid, buf, len,
+						0);
+		if (ret != SD_RES_SUCCESS) {
+			sd_init_req(&hdr, SD_OP_READ_OBJ);
+			hdr.obj.oid = req_hdr->obj.cow_oid;
+			hdr.data_length = len;
+			hdr.obj.offset = 0;
+			ret = exec_local_req(&hdr, buf);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
 	}
 
 	memcpy(buf + req_hdr->obj.offset, req->data, req_hdr->data_length);
@@ -764,8 +2139,10 @@ out:
 int gateway_create_object(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
+	bool hybrid;
 
-	if (oid_is_readonly(oid))
+	/* the snapshots are erasure coded too */
+	if (oid_is_readonly(oid) && !(req->rq.flags & SD_FLAG_CMD_COLD))
 		return SD_RES_READONLY;
 
 	if (req->rq.flags & SD_FLAG_CMD_COW)
@@ -774,79 +2151,358 @@ int gateway_create_object(struct request *req)
 	if (!bypass_object_cache(req))
 		return object_cache_handle_request(req);
 
+	/* the peers built without compression create it plain */
+	hybrid = is_hybrid_req(req);
+	if (is_data_obj(oid) && (hybrid || !is_erasure_oid(oid)) &&
+	    vdi_is_compressed(oid_to_vid(oid)))
+		req->rq.flags |= SD_FLAG_CMD_COMPRESS;
+
+	if (hybrid)
+		return hybrid_hot_exec(req, gateway_forward_request);
 	return gateway_forward_request(req);
 }
 
 int gateway_remove_object(struct request *req)
 {
-	return gateway_forward_request(req);
+	int ret, hot;
+
+	if (!is_hybrid_req(req))
+		return gateway_forward_request(req);
+
+	/* either of the forms, or both while it's changing */
+	hot = hybrid_hot_exec(req, gateway_forward_request);
+	ret = gateway_forward_request(req);
+	return ret == SD_RES_NO_OBJ ? hot : ret;
 }
 
-static bool object_noref(uint32_t *ledger)
+/*
+ * Discard a range of the replicas, the rest of the object stays.  A discard
+ * only frees the space, so it's skipped where it doesn't map to the store.
+ */
+int gateway_discard_object(struct request *req)
 {
+	uint64_t oid = req->rq.obj.oid;
+	int ret;
+
+	if (oid_is_readonly(oid))
+		return SD_RES_READONLY;
+
+	if (!sd_store->discard)
+		return SD_RES_SUCCESS;
+
+	/* the cache would keep serving the discarded data */
+	if (sys->enable_object_cache && object_is_cached(oid))
+		return SD_RES_SUCCESS;
+
+	if (is_hybrid_req(req)) {
+		ret = hybrid_hot_exec(req, gateway_forward_request);
+		return ret == SD_RES_NO_OBJ ? SD_RES_SUCCESS : ret;
+	}
+
+	/* the range is spread over the strips */
+	if (is_erasure_oid(oid))
+		return SD_RES_SUCCESS;
+
+	ret = gateway_forward_request(req);
+	return ret == SD_RES_NO_SUPPORT ? SD_RES_SUCCESS : ret;
+}
+
+/*
+ * The ledgers updated by this node, whose first copies it holds
+ *
+ * The decrement messages of a ledger all go to the node of its first copy,
+ * which applies the messages of a batch in one write and keeps the ledger in
+ * memory for the next ones.  No other node writes the ledger meanwhile, so the
+ * cached one is the one on the disks until the epoch changes.  Only the
+ * nonzero generations are kept, at most one for each level of the snapshot
+ * chain of the object.
+ */
+#define LEDGER_CACHE_SIZE 65536
+#define LEDGER_NR_GENS (SD_LEDGER_OBJ_SIZE / sizeof(int32_t))
+
+struct ledger_gen {
+	uint32_t generation;
+	int32_t count;
+};
+
+struct ledger {
+	uint64_t oid; /* of the ledger */
+	uint32_t epoch; /* the fields below are valid in, 0 if not read */
+	bool exists; /* the ledger object is created */
+	int nr_gens;
+	struct ledger_gen *gens;
+	int users;
+	struct sd_mutex lock; /* of the updates */
+	struct rb_node node;
+	struct list_node lru;
+};
+
+static struct rb_root ledger_root = RB_ROOT;
+static LIST_HEAD(ledger_lru);
+static int nr_ledgers;
+static struct sd_mutex ledger_cache_lock = SD_MUTEX_INITIALIZER;
+
+static int ledger_cmp(const struct ledger *a, const struct ledger *b)
+{
+	return intcmp(a->oid, b->oid);
+}
 
-	static uint32_t zero[1024];
+static void ledger_free(struct ledger *l)
+{
+	rb_erase(&l->node, &ledger_root);
+	list_del(&l->lru);
+	nr_ledgers--;
+	sd_destroy_mutex(&l->lock);
+	free(l->gens);
+	free(l);
+}
+
+/* Get the ledger of oid locked, evicting the least recently used ones */
+static struct ledger *ledger_get(uint64_t oid)
+{
+	struct ledger key = { .oid = oid }, *l, *victim;
+
+	sd_mutex_lock(&ledger_cache_lock);
+	l = rb_search(&ledger_root, &key, node, ledger_cmp);
+	if (l)
+		list_move_tail(&l->lru, &ledger_lru);
+	else {
+		l = xzalloc(sizeof(*l));
+		l->oid = oid;
+		sd_init_mutex(&l->lock);
+		rb_insert(&ledger_root, l, node, ledger_cmp);
+		list_add_tail(&l->lru, &ledger_lru);
+		nr_ledgers++;
+		list_for_each_entry(victim, &ledger_lru, lru) {
+			if (nr_ledgers <= LEDGER_CACHE_SIZE)
+				break;
+			if (!victim->users && victim != l)
+				ledger_free(victim);
+		}
+	}
+	l->users++;
+	sd_mutex_unlock(&ledger_cache_lock);
+
+	sd_mutex_lock(&l->lock);
+	return l;
+}
+
+static void ledger_put(struct ledger *l)
+{
+	sd_mutex_unlock(&l->lock);
+
+	sd_mutex_lock(&ledger_cache_lock);
+	/* a ledger reclaimed or failed to update is read again */
+	if (!--l->users && !l->epoch)
+		ledger_free(l);
+	sd_mutex_unlock(&ledger_cache_lock);
+}
+
+static void ledger_add(struct ledger *l, uint32_t generation, int32_t delta)
+{
 	int i;
 
-	for (i = 0; i < SD_LEDGER_OBJ_SIZE/sizeof(zero); i++) {
-		if (memcmp(zero, ledger, sizeof(zero)))
-			return false;
-		ledger += 1024;
+	for (i = 0; i < l->nr_gens; i++)
+		if (l->gens[i].generation == generation)
+			break;
+	if (i == l->nr_gens) {
+		if (!delta)
+			return;
+		l->gens = xrealloc(l->gens, (l->nr_gens + 1) * sizeof(*l->gens));
+		l->gens[l->nr_gens].generation = generation;
+		l->gens[l->nr_gens++].count = 0;
 	}
 
-	return true;
+	l->gens[i].count += delta;
+	if (!l->gens[i].count)
+		l->gens[i] = l->gens[--l->nr_gens];
 }
 
-int gateway_unref_object(struct request *req)
+static int ledger_load(struct ledger *l, uint32_t epoch)
 {
-	struct sd_req *h = &req->rq;
-	uint64_t data_oid = h->ref.oid;
-	uint64_t ledger_oid = data_oid_to_ledger_oid(data_oid);
-	uint32_t generation = h->ref.generation;
-	uint32_t count = h->ref.count;
-	uint32_t *ledger = xvalloc(SD_LEDGER_OBJ_SIZE);
-	int ret, offset;
+	int32_t *buf;
+	int ret;
 
-	sd_debug("%"PRIx64 " gen %"PRIu32 ", count %"PRIu32, data_oid,
-		 generation, count);
+	if (l->epoch == epoch)
+		return SD_RES_SUCCESS;
 
-	ret = sd_read_object(ledger_oid, (char *)ledger, SD_LEDGER_OBJ_SIZE, 0);
+	l->nr_gens = 0;
+	buf = xvalloc(SD_LEDGER_OBJ_SIZE);
+	ret = sd_read_object(l->oid, (char *)buf, SD_LEDGER_OBJ_SIZE, 0);
 	switch (ret) {
 	case SD_RES_SUCCESS:
+		l->exists = true;
+		for (uint32_t i = 0; i < LEDGER_NR_GENS; i++)
+			if (buf[i])
+				ledger_add(l, i, buf[i]);
 		break;
 	case SD_RES_NO_OBJ:
 		/* We create ledger when we access it first time */
-		sd_debug("create ref %"PRIx64, data_oid);
-		ledger[0] = 1;
-		ledger[generation]--;
-		ledger[generation + 1] += count;
-		ret = sd_write_object(ledger_oid, (char *)ledger,
-				      SD_LEDGER_OBJ_SIZE, 0, true);
-		/* fall thru */
+		l->exists = false;
+		ledger_add(l, 0, 1);
+		ret = SD_RES_SUCCESS;
+		break;
 	default:
 		goto out;
 	}
+	l->epoch = epoch;
+out:
+	free(buf);
+	return ret;
+}
 
-	ledger[generation]--;
-	ledger[generation + 1] += count;
+/* Write the generations [lo, hi] of the ledger, or reclaim the object */
+static int ledger_flush(struct ledger *l, uint32_t lo, uint32_t hi)
+{
+	uint64_t data_oid = ledger_oid_to_data_oid(l->oid);
+	int32_t *buf;
+	size_t len;
+	int ret;
 
-	if (object_noref(ledger)) {
+	if (!l->nr_gens) {
 		sd_debug("remove %"PRIx64, data_oid);
+		l->epoch = 0;
 		ret = sd_remove_object(data_oid);
 		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
-			goto out;
+			return ret;
 
-		ret = sd_remove_object(ledger_oid);
-		if (ret == SD_RES_NO_OBJ)
-			ret = SD_RES_SUCCESS;
-		goto out;
+		ret = sd_remove_object(l->oid);
+		return ret == SD_RES_NO_OBJ ? SD_RES_SUCCESS : ret;
+	}
+
+	if (!l->exists) {
+		lo = 0;
+		hi = LEDGER_NR_GENS - 1;
+	}
+	len = (hi - lo + 1) * sizeof(*buf);
+	buf = xvalloc(len);
+	memset(buf, 0, len);
+	for (int i = 0; i < l->nr_gens; i++)
+		if (lo <= l->gens[i].generation && l->gens[i].generation <= hi)
+			buf[l->gens[i].generation - lo] = l->gens[i].count;
+
+	sd_debug("update ref %"PRIx64", generation %"PRIu32"-%"PRIu32,
+		 data_oid, lo, hi);
+	ret = sd_write_object(l->oid, (char *)buf, len, lo * sizeof(*buf),
+			      !l->exists);
+	if (ret == SD_RES_SUCCESS)
+		l->exists = true;
+	free(buf);
+	return ret;
+}
+
+static int unref_cmp(const struct sd_unref *a, const struct sd_unref *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+/*
+ * Apply the decrement messages to the ledgers this node holds the first
+ * copies of in epoch, one write per ledger
+ */
+int ledger_unref(struct sd_unref *refs, int nr, uint32_t epoch)
+{
+	int ret = SD_RES_SUCCESS, err;
+
+	xqsort(refs, nr, unref_cmp);
+	for (int i = 0, j; i < nr; i = j) {
+		struct ledger *l = ledger_get(data_oid_to_ledger_oid(refs[i].oid));
+		uint32_t lo = UINT32_MAX, hi = 0;
+
+		err = ledger_load(l, epoch);
+		for (j = i; j < nr && refs[j].oid == refs[i].oid; j++) {
+			sd_debug("%"PRIx64" gen %"PRIu32", count %"PRIu32,
+				 refs[j].oid, refs[j].generation,
+				 refs[j].count);
+			if (err != SD_RES_SUCCESS)
+				continue;
+			ledger_add(l, refs[j].generation, -1);
+			ledger_add(l, refs[j].generation + 1, refs[j].count);
+			lo = min(lo, refs[j].generation);
+			hi = max(hi, refs[j].generation + 1);
+		}
+		if (err == SD_RES_SUCCESS)
+			err = ledger_flush(l, lo, hi);
+		if (err != SD_RES_SUCCESS) {
+			sd_err("failed to unref %"PRIx64", %s", refs[i].oid,
+			       sd_strerror(err));
+			l->epoch = 0;
+			ret = err;
+		}
+		ledger_put(l);
 	}
 
-	sd_debug("update ref %"PRIx64, data_oid);
-	offset = generation * sizeof(uint32_t);
-	ret = sd_write_object(ledger_oid, (char *)ledger + offset,
-			      sizeof(uint32_t) * 2, offset, false);
+	return ret;
+}
+
+/* Send the decrement messages to the nodes of the first copies of ledgers */
+static int gateway_unref(struct vnode_info *vinfo, struct sd_unref *refs,
+			 int nr)
+{
+	const struct sd_node **owners = xmalloc(nr * sizeof(*owners));
+	struct sd_unref *group = xmalloc(nr * sizeof(*group));
+	uint32_t epoch = sys_epoch();
+	int ret = SD_RES_SUCCESS, err;
+	struct sd_req hdr;
+
+	for (int i = 0; i < nr; i++) {
+		if (refs[i].generation >= LEDGER_NR_GENS - 1) {
+			ret = SD_RES_INVALID_PARMS;
+			goto out;
+		}
+		owners[i] = vinfo_oid_to_node(vinfo,
+				data_oid_to_ledger_oid(refs[i].oid), 0);
+	}
+
+	for (int i = 0; i < nr; i++) {
+		const struct sd_node *n = owners[i];
+		int nr_group = 0;
+
+		if (!n)
+			continue;
+		for (int j = i; j < nr; j++)
+			if (owners[j] == n) {
+				group[nr_group++] = refs[j];
+				owners[j] = NULL;
+			}
+
+		if (node_is_local(n))
+			err = ledger_unref(group, nr_group, epoch);
+		else {
+			sd_init_req(&hdr, SD_OP_UNREF_PEER);
+			hdr.flags = SD_FLAG_CMD_WRITE;
+			hdr.epoch = epoch;
+			hdr.data_length = nr_group * sizeof(*group);
+			err = sheep_exec_req(&n->nid, &hdr, group);
+		}
+		if (err != SD_RES_SUCCESS) {
+			sd_err("failed to unref %d objects on %s, %s",
+			       nr_group, node_to_str(n), sd_strerror(err));
+			ret = err;
+		}
+	}
 out:
-	free(ledger);
+	free(owners);
+	free(group);
 	return ret;
 }
+
+int gateway_unref_object(struct request *req)
+{
+	struct sd_unref ref = {
+		.oid = req->rq.ref.oid,
+		.generation = req->rq.ref.generation,
+		.count = req->rq.ref.count,
+	};
+
+	return gateway_unref(req->vinfo, &ref, 1);
+}
+
+int gateway_unref_objects(struct request *req)
+{
+	if (req->rq.data_length % sizeof(struct sd_unref))
+		return SD_RES_INVALID_PARMS;
+
+	return gateway_unref(req->vinfo, req->data,
+			     req->rq.data_length / sizeof(struct sd_unref));
+}
@@ -18,14 +18,22 @@ struct node {
 
 struct get_vdis_work {
 	struct work work;
-	DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
-	struct sd_node joined;
+	struct sd_node from;
+	/* the nodes to get the vdis from if from fails, or empty */
 	struct rb_root nroot;
+	bool join; /* of this node */
+	int ret;
 };
 
 static struct sd_mutex wait_vdis_lock = SD_MUTEX_INITIALIZER;
 static struct sd_cond wait_vdis_cond = SD_COND_INITIALIZER;
 static refcnt_t nr_get_vdis_works;
+/* whether the vdis of the cluster are merged since this node joined */
+static main_thread(bool) vdis_synced;
+static main_thread(int) nr_join_works;
+
+/* The vdis in the first try of SD_OP_GET_VDI_STATE */
+#define VDI_STATE_NR (64 * 1024)
 
 static main_thread(struct vnode_info *) current_vnode_info;
 static main_thread(struct list_head *) pending_block_list;
@@ -88,12 +96,287 @@ main_fn struct vnode_info *get_vnode_info(void)
 	return grab_vnode_info(cur_vinfo);
 }
 
+/*
+ * Borrowed references of the requests
+ *
+ * A reference of every request to the current vnode_info would bounce its
+ * refcount between the main thread queuing the requests and the threads
+ * freeing them.  Instead a request borrows the current one and counts itself
+ * in the generation of the borrow, in a counter of the thread which takes or
+ * returns it, so that nothing is shared on the way.  The counters of
+ * a generation sum up to the requests still holding it.
+ *
+ * The vnode_info replaced by a new epoch is retired instead of dropped.  The
+ * main thread flips the generation once the older one is drained, and drops
+ * the retired vnode_info once the generation they were borrowed in drains in
+ * turn, like a grace period of RCU.  The requests span threads, so they can't
+ * be read-side critical sections of liburcu.
+ */
+#define VINFO_GRACE_POLL 10 /* milliseconds */
+
+struct vinfo_borrows {
+	long nr[2]; /* borrowed minus returned by the thread, per generation */
+	bool used; /* by a thread */
+	struct list_node list;
+} __attribute__((aligned(64)));
+
+static LIST_HEAD(vinfo_borrows_list);
+static struct sd_mutex vinfo_borrows_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t vinfo_borrows_key;
+static pthread_once_t vinfo_borrows_once = PTHREAD_ONCE_INIT;
+static __thread struct vinfo_borrows *my_borrows;
+
+static main_thread(int) vinfo_gen;
+/* retired in the current generation, and in the older one being drained */
+static LIST_HEAD(vinfo_retired);
+static LIST_HEAD(vinfo_draining);
+static struct timer vinfo_grace_timer;
+
+/* The counters of an exited thread go on with the next one */
+static void vinfo_borrows_release(void *arg)
+{
+	struct vinfo_borrows *b = arg;
+
+	sd_mutex_lock(&vinfo_borrows_lock);
+	b->used = false;
+	sd_mutex_unlock(&vinfo_borrows_lock);
+}
+
+static void vinfo_borrows_init(void)
+{
+	pthread_key_create(&vinfo_borrows_key, vinfo_borrows_release);
+}
+
+static struct vinfo_borrows *get_my_borrows(void)
+{
+	struct vinfo_borrows *b;
+
+	if (likely(my_borrows))
+		return my_borrows;
+
+	pthread_once(&vinfo_borrows_once, vinfo_borrows_init);
+	sd_mutex_lock(&vinfo_borrows_lock);
+	list_for_each_entry(b, &vinfo_borrows_list, list)
+		if (!b->used)
+			goto found;
+	b = xzalloc(sizeof(*b));
+	list_add_tail(&b->list, &vinfo_borrows_list);
+found:
+	b->used = true;
+	sd_mutex_unlock(&vinfo_borrows_lock);
+	pthread_setspecific(vinfo_borrows_key, b);
+	my_borrows = b;
+	return b;
+}
+
+/*
+ * The decrements only follow the flip, so a sum read counter by counter is
+ * never below the real one, and zero means drained.
+ */
+static bool vinfo_gen_drained(int gen)
+{
+	struct vinfo_borrows *b;
+	long sum = 0;
+
+	sd_mutex_lock(&vinfo_borrows_lock);
+	list_for_each_entry(b, &vinfo_borrows_list, list)
+		sum += uatomic_read(&b->nr[gen]);
+	sd_mutex_unlock(&vinfo_borrows_lock);
+	return sum == 0;
+}
+
+static main_fn void put_draining_vnode_info(void)
+{
+	struct vnode_info *vinfo;
+
+	list_for_each_entry(vinfo, &vinfo_draining, retired) {
+		list_del(&vinfo->retired);
+		put_vnode_info(vinfo);
+	}
+}
+
+static main_fn void vinfo_grace_poll(void *arg)
+{
+	int gen = main_thread_get(vinfo_gen);
+
+	if (!list_empty(&vinfo_draining) && vinfo_gen_drained(!gen))
+		put_draining_vnode_info();
+
+	if (list_empty(&vinfo_draining) && !list_empty(&vinfo_retired)) {
+		list_splice_init(&vinfo_retired, &vinfo_draining);
+		main_thread_set(vinfo_gen, !gen);
+		if (vinfo_gen_drained(gen))
+			put_draining_vnode_info();
+	}
+
+	if (!list_empty(&vinfo_draining) || !list_empty(&vinfo_retired))
+		add_timer(&vinfo_grace_timer, VINFO_GRACE_POLL);
+}
+
+/* Drop the reference of the replaced current vnode_info after the requests */
+static main_fn void retire_vnode_info(struct vnode_info *vinfo)
+{
+	list_add_tail(&vinfo->retired, &vinfo_retired);
+	vinfo_grace_timer.callback = vinfo_grace_poll;
+	if (!timer_pending(&vinfo_grace_timer))
+		vinfo_grace_poll(NULL);
+}
+
+/* Borrow the current vnode_info for the request, see put_req_vnode_info() */
+main_fn void get_req_vnode_info(struct request *req)
+{
+	int gen = main_thread_get(vinfo_gen);
+
+	req->vinfo = main_thread_get(current_vnode_info);
+	if (!req->vinfo)
+		return;
+	req->vinfo_gen = gen;
+	uatomic_inc(&get_my_borrows()->nr[gen]);
+}
+
+/* Return the vnode_info of the request, by any thread */
+void put_req_vnode_info(struct request *req)
+{
+	if (!req->vinfo)
+		return;
+	if (req->vinfo_gen < 0)
+		put_vnode_info(req->vinfo);
+	else {
+		/* the request is done with it before the count drops */
+		cmm_smp_mb();
+		uatomic_dec(&get_my_borrows()->nr[req->vinfo_gen]);
+	}
+	req->vinfo = NULL;
+	req->vinfo_gen = -1;
+}
+
+/*
+ * Placement cache
+ *
+ * VMs access the same objects over and over, so every vnode_info caches the
+ * placement of the recently accessed objects in a direct-mapped table.  The
+ * cache lives and dies with the vnode_info, hence it is dropped as a whole
+ * when the epoch changes.
+ *
+ * Each slot is protected by a sequence counter: writers make it odd while
+ * they are updating the slot, and readers take a changed counter as a miss
+ * instead of retrying.  The placement of fewer copies is a prefix of a
+ * longer one, so a slot can serve any nr_copies up to the cached one.
+ */
+#define PLACEMENT_CACHE_BITS	12
+#define PLACEMENT_CACHE_SIZE	(1 << PLACEMENT_CACHE_BITS)
+
+struct placement_slot {
+	unsigned long seq;
+	uint64_t oid;
+	uint32_t nr_copies;
+	uint32_t idxs[SD_MAX_COPIES];
+} __attribute__((aligned(64)));
+
+static struct placement_slot *alloc_placement_cache(void)
+{
+	size_t size = sizeof(struct placement_slot) * PLACEMENT_CACHE_SIZE;
+	struct placement_slot *pcache = xvalloc(size);
+
+	memset(pcache, 0, size);
+	return pcache;
+}
+
+static bool placement_cache_get(const struct vnode_info *vinfo, uint64_t oid,
+				int nr_copies, uint32_t *idxs)
+{
+	struct placement_slot *slot = vinfo->pcache +
+		hash_64(oid, PLACEMENT_CACHE_BITS);
+	unsigned long seq = uatomic_read(&slot->seq);
+
+	if (seq & 1)
+		return false;
+	cmm_smp_rmb();
+	if (slot->oid != oid || slot->nr_copies < nr_copies)
+		return false;
+	memcpy(idxs, slot->idxs, sizeof(*idxs) * nr_copies);
+	cmm_smp_rmb();
+
+	return uatomic_read(&slot->seq) == seq;
+}
+
+static void placement_cache_set(const struct vnode_info *vinfo, uint64_t oid,
+				int nr_copies, const uint32_t *idxs)
+{
+	struct placement_slot *slot = vinfo->pcache +
+		hash_64(oid, PLACEMENT_CACHE_BITS);
+	unsigned long seq = uatomic_read(&slot->seq);
+
+	/* Leave the slot to the other writer */
+	if ((seq & 1) || uatomic_cmpxchg(&slot->seq, seq, seq + 1) != seq)
+		return;
+	cmm_smp_wmb();
+	slot->oid = oid;
+	slot->nr_copies = nr_copies;
+	memcpy(slot->idxs, idxs, sizeof(*idxs) * nr_copies);
+	cmm_smp_wmb();
+	uatomic_set(&slot->seq, seq + 2);
+}
+
+static void vinfo_oid_to_idx(const struct vnode_info *vinfo, uint64_t oid,
+			     int nr_copies, uint32_t *idxs)
+{
+	/* The counters are statistics, racy updates are fine */
+	if (placement_cache_get(vinfo, oid, nr_copies, idxs)) {
+		sys->stat.pc.hit++;
+		return;
+	}
+
+	sys->stat.pc.miss++;
+	vnode_array_to_idx(&vinfo->varray, oid, nr_copies, idxs);
+	placement_cache_set(vinfo, oid, nr_copies, idxs);
+}
+
+/* Look up the vnodes of the object through the placement cache */
+void vinfo_oid_to_vnodes(const struct vnode_info *vinfo, uint64_t oid,
+			 int nr_copies, const struct sd_vnode **vnodes)
+{
+	uint32_t idxs[SD_MAX_COPIES];
+
+	if (unlikely(!vinfo->varray.nr)) {
+		for (int i = 0; i < nr_copies; i++)
+			vnodes[i] = NULL;
+		return;
+	}
+
+	vinfo_oid_to_idx(vinfo, oid, nr_copies, idxs);
+	for (int i = 0; i < nr_copies; i++)
+		vnodes[i] = vinfo->varray.vnodes[idxs[i]];
+}
+
+const struct sd_node *vinfo_oid_to_node(const struct vnode_info *vinfo,
+					uint64_t oid, int copy_idx)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, copy_idx + 1, vnodes);
+
+	return vnodes[copy_idx]->node;
+}
+
+void vinfo_oid_to_nodes(const struct vnode_info *vinfo, uint64_t oid,
+			int nr_copies, const struct sd_node **nodes)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++)
+		nodes[i] = vnodes[i]->node;
+}
+
 /* Release a reference to the current vnode information. */
 void put_vnode_info(struct vnode_info *vnode_info)
 {
 	if (vnode_info) {
 		if (refcount_dec(&vnode_info->refcnt) == 0) {
-			rb_destroy(&vnode_info->vroot, struct sd_vnode, rb);
+			free(vnode_info->pcache);
+			vnode_array_free(&vnode_info->varray);
+			free_tag(vnode_info->vnodes, SD_MEM_VNODE);
 			rb_destroy(&vnode_info->nroot, struct sd_node, rb);
 			free(vnode_info);
 		}
@@ -127,7 +410,13 @@ static void recalculate_vnodes(struct rb_root *nroot)
 	}
 }
 
-struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+/*
+ * Allocate the vnode_info of the nodes.  The vnodes are built from the ones of
+ * old if it is given, so that a membership change costs the vnodes which
+ * change only.
+ */
+struct vnode_info *rebuild_vnode_info(const struct rb_root *nroot,
+				      const struct vnode_info *old)
 {
 	struct vnode_info *vnode_info;
 	struct sd_node *n;
@@ -146,15 +435,39 @@ struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
 
 	recalculate_vnodes(&vnode_info->nroot);
 
-	if (is_cluster_diskmode(&sys->cinfo))
-		disks_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
-	else
-		nodes_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
+	vnode_info->diskmode = is_cluster_diskmode(&sys->cinfo);
+	vnode_info->mixhash = !!(sys->cinfo.flags & SD_CLUSTER_FLAG_MIXHASH);
+	sd_mix_placement = vnode_info->mixhash;
+	if (!old || old->diskmode != vnode_info->diskmode ||
+	    old->mixhash != vnode_info->mixhash ||
+	    !old->varray.nr || !merge_vnodes(vnode_info, old))
+		build_vnodes(vnode_info);
+	vnode_array_build(&vnode_info->varray, &vnode_info->vroot);
+	vnode_info->pcache = alloc_placement_cache();
 	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
 	refcount_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
 
+struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+{
+	return rebuild_vnode_info(nroot, NULL);
+}
+
+/* Rebuild the vnodes if the format changed the placement hash */
+main_fn void refresh_vnode_info(void)
+{
+	struct vnode_info *old = main_thread_get(current_vnode_info);
+	bool mixhash = !!(sys->cinfo.flags & SD_CLUSTER_FLAG_MIXHASH);
+
+	if (!old || old->mixhash == mixhash)
+		return;
+
+	main_thread_set(current_vnode_info,
+			rebuild_vnode_info(&old->nroot, old));
+	retire_vnode_info(old);
+}
+
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo)
 {
@@ -172,7 +485,43 @@ struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 	for (int i = 0; i < nr_nodes; i++)
 		rb_insert(&nroot, &nodes[i], rb, node_cmp);
 
-	return alloc_vnode_info(&nroot);
+	return rebuild_vnode_info(&nroot, cur_vinfo);
+}
+
+#define NR_EPOCH_VINFO 4
+
+static struct {
+	struct sd_mutex lock; /* Protects the below */
+	uint32_t epoch[NR_EPOCH_VINFO];
+	struct vnode_info *vinfo[NR_EPOCH_VINFO];
+	int next; /* the slot replaced next */
+} epoch_vinfo = {
+	.lock = SD_MUTEX_INITIALIZER,
+};
+
+/* Like get_vnode_info_epoch(), but built once for all the workers */
+struct vnode_info *get_cached_vnode_info_epoch(uint32_t epoch,
+					       struct vnode_info *cur_vinfo)
+{
+	struct vnode_info *vinfo = NULL;
+	int i;
+
+	sd_mutex_lock(&epoch_vinfo.lock);
+	for (i = 0; i < NR_EPOCH_VINFO; i++)
+		if (epoch_vinfo.vinfo[i] && epoch_vinfo.epoch[i] == epoch)
+			break;
+	if (i == NR_EPOCH_VINFO) {
+		i = epoch_vinfo.next;
+		put_vnode_info(epoch_vinfo.vinfo[i]);
+		epoch_vinfo.vinfo[i] = get_vnode_info_epoch(epoch, cur_vinfo);
+		epoch_vinfo.epoch[i] = epoch;
+		epoch_vinfo.next = (i + 1) % NR_EPOCH_VINFO;
+	}
+	if (epoch_vinfo.vinfo[i])
+		vinfo = grab_vnode_info(epoch_vinfo.vinfo[i]);
+	sd_mutex_unlock(&epoch_vinfo.lock);
+
+	return vinfo;
 }
 
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
@@ -349,48 +698,131 @@ error:
 	put_request(req);
 }
 
+/* Room for the deltas of the epochs after the first one sent in full */
+#define EPOCH_RANGE_LEN (1024 * 1024)
+
+/* Log the epoch fetched from a node if it's missing here */
+static void log_fetched_epoch(uint32_t epoch, struct sd_node *nodes,
+			      int nr_nodes, time_t timestamp)
+{
+	struct timespec ts;
+
+	if (epoch_log_mtime(epoch, &ts) == SD_RES_NO_TAG)
+		update_epoch_log(epoch, nodes, nr_nodes, timestamp, false);
+}
+
+static int fetch_epoch(const struct node_id *nid, uint32_t epoch,
+		       struct sd_node *nodes, int len, int *nr_nodes,
+		       time_t *timestamp)
+{
+	char *buf = xzalloc(len + sizeof(time_t));
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret, nodes_len;
+	time_t t;
+
+	sd_init_req(&hdr, SD_OP_GET_EPOCH);
+	hdr.data_length = len + sizeof(time_t);
+	hdr.obj.tgt_epoch = epoch;
+	hdr.epoch = sys_epoch();
+	ret = sheep_exec_req(nid, &hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	nodes_len = rsp->data_length - sizeof(t);
+	memcpy((void *)nodes, buf, nodes_len);
+	memcpy(&t, buf + nodes_len, sizeof(t));
+	if (timestamp)
+		*timestamp = t;
+	*nr_nodes = nodes_len / sizeof(struct sd_node);
+	log_fetched_epoch(epoch, nodes, *nr_nodes, t);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Fetch the logs from epoch down from a node in one SD_OP_GET_EPOCHS, and log
+ * the ones missing here, so that the reads of the older epochs which follow,
+ * e.g. of 'dog cluster info' or the rollbacks of the recovery, stay local.
+ */
+static int fetch_epoch_range(const struct node_id *nid, uint32_t epoch,
+			     struct sd_node *nodes, int len, int *nr_nodes,
+			     time_t *timestamp)
+{
+	size_t buf_len = len + EPOCH_RANGE_LEN;
+	size_t nodes_len = SD_MAX_NODES * sizeof(struct sd_node);
+	struct sd_node *cur = xmalloc(nodes_len), *next = xmalloc(nodes_len);
+	char *buf = xmalloc(buf_len), *p, *end;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	const struct epoch_delta *d;
+	int ret, nr_cur = 0, nr;
+
+	sd_init_req(&hdr, SD_OP_GET_EPOCHS);
+	hdr.data_length = buf_len;
+	hdr.obj.tgt_epoch = epoch;
+	hdr.epoch = sys_epoch();
+	ret = sheep_exec_req(nid, &hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = SD_RES_NO_TAG;
+	end = buf + rsp->data_length;
+	for (p = buf; p + sizeof(*d) <= end; p += epoch_delta_size(d)) {
+		d = (const struct epoch_delta *)p;
+		if (p + epoch_delta_size(d) > end)
+			break;
+		nr = epoch_delta_apply(d, cur, nr_cur, next, SD_MAX_NODES);
+		if (nr < 0)
+			break;
+		SWAP(cur, next);
+		nr_cur = nr;
+
+		if (d->epoch == epoch) {
+			if (nr_cur * sizeof(struct sd_node) > len) {
+				ret = SD_RES_BUFFER_SMALL;
+				break;
+			}
+			memcpy(nodes, cur, nr_cur * sizeof(struct sd_node));
+			*nr_nodes = nr_cur;
+			if (timestamp)
+				*timestamp = d->time;
+			ret = SD_RES_SUCCESS;
+		} else if (ret != SD_RES_SUCCESS)
+			/* the reply doesn't start from epoch */
+			break;
+
+		log_fetched_epoch(d->epoch, cur, nr_cur, d->time);
+	}
+out:
+	free(cur);
+	free(next);
+	free(buf);
+	return ret;
+}
+
 int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes, int len,
 					  int *nr_nodes, time_t *timestamp,
 					  struct vnode_info *vinfo)
 {
-	char *buf = xzalloc(len + sizeof(time_t));
 	const struct sd_node *node;
 	int ret;
 
 	rb_for_each_entry(node, &vinfo->nroot, rb) {
-		struct sd_req hdr;
-		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-		int nodes_len;
-
 		if (node_is_local(node))
 			continue;
 
-		sd_init_req(&hdr, SD_OP_GET_EPOCH);
-		hdr.data_length = len;
-		hdr.obj.tgt_epoch = epoch;
-		hdr.epoch = sys_epoch();
-		ret = sheep_exec_req(&node->nid, &hdr, buf);
-		if (ret == SD_RES_BUFFER_SMALL) {
-			free(buf);
+		ret = fetch_epoch_range(&node->nid, epoch, nodes, len,
+					nr_nodes, timestamp);
+		if (sheep_op_unknown(ret))
+			/* the node may not know SD_OP_GET_EPOCHS */
+			ret = fetch_epoch(&node->nid, epoch, nodes, len,
+					  nr_nodes, timestamp);
+		if (ret == SD_RES_SUCCESS || ret == SD_RES_BUFFER_SMALL)
 			return ret;
-		}
-		if (ret != SD_RES_SUCCESS)
-			continue;
-
-		nodes_len = rsp->data_length - sizeof(*timestamp);
-		memcpy((void *)nodes, buf, nodes_len);
-		if (timestamp)
-			memcpy(timestamp, buf + nodes_len, sizeof(*timestamp));
-		free(buf);
-
-		*nr_nodes = nodes_len / sizeof(struct sd_node);
-		/* epoch file is missing in local node, try to create one */
-		update_epoch_log(epoch, nodes, *nr_nodes, *(time_t *)(buf + nodes_len),
-                         false);
-		return SD_RES_SUCCESS;
 	}
 
-	free(buf);
 	return SD_RES_NO_TAG;
 }
 
@@ -473,60 +905,99 @@ static enum sd_status cluster_wait_check(const struct sd_node *joining,
 	return sys->cinfo.status;
 }
 
-static int get_vdi_bitmap_from(struct sd_node *node)
+static int get_vdi_bitmap_from(const struct sd_node *node)
 {
+	unsigned long *tmp_vdi_inuse = xmalloc(sizeof(sys->vdi_inuse));
 	struct sd_req hdr;
-	static DECLARE_BITMAP(tmp_vdi_inuse, SD_NR_VDIS);
 	int i, ret;
-	unsigned int rlen = sizeof(tmp_vdi_inuse);
 
 	sd_init_req(&hdr, SD_OP_READ_VDIS);
-	hdr.data_length = rlen;
+	hdr.data_length = sizeof(sys->vdi_inuse);
 	ret = sheep_exec_req(&node->nid, &hdr, (char *)tmp_vdi_inuse);
 	if (ret != SD_RES_SUCCESS)
-		return ret;
-
-        for (i = 0; i < ARRAY_SIZE(sys->vdi_inuse); i++)
-                sys->vdi_inuse[i] |= tmp_vdi_inuse[i];
-
+		goto out;
+
+	/* the bitmap is merged from the nodes in parallel */
+	for (i = 0; i < ARRAY_SIZE(sys->vdi_inuse); i++)
+		if (tmp_vdi_inuse[i])
+			uatomic_or(&sys->vdi_inuse[i], tmp_vdi_inuse[i]);
+out:
+	free(tmp_vdi_inuse);
 	return ret;
 }
 
-static void do_get_vdi_bitmap(struct work *work)
+/*
+ * Get the vdis in use with their snapshot flags, a few bytes a vdi.  synced
+ * tells whether the node holds the ones of the cluster.
+ */
+static int get_vdi_state_from(const struct sd_node *node, bool *synced)
 {
-	struct get_vdis_work *w =
-		container_of(work, struct get_vdis_work, work);
-	struct sd_node *n;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct vdi_state *vs = NULL;
+	size_t nr = VDI_STATE_NR;
 	int ret;
 
-	if (!node_is_local(&w->joined)) {
-		sd_debug("try to get vdi bitmap from %s",
-			 node_to_str(&w->joined));
-		ret = get_vdi_bitmap_from(&w->joined);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to get vdi bitmap from %s",
-			       node_to_str(&w->joined));
-		}
-		return;
+	for (;;) {
+		vs = xrealloc(vs, nr * sizeof(*vs));
+		sd_init_req(&hdr, SD_OP_GET_VDI_STATE);
+		hdr.data_length = nr * sizeof(*vs);
+		ret = sheep_exec_req(&node->nid, &hdr, vs);
+		if (ret != SD_RES_BUFFER_SMALL || nr >= SD_NR_VDIS)
+			break;
+		nr *= 2;
+	}
+	if (ret == SD_RES_SUCCESS) {
+		merge_vdi_state_list(vs, rsp->data_length / sizeof(*vs));
+		*synced = rsp->vdi_state.synced;
 	}
 
-	rb_for_each_entry(n, &w->nroot, rb) {
-		/* We should not fetch vdi_bitmap and copy list from myself */
-		if (node_is_local(n))
-			continue;
+	free(vs);
+	return ret;
+}
 
-		sd_debug("try to get vdi bitmap from %s", node_to_str(n));
-		ret = get_vdi_bitmap_from(n);
-		if (ret != SD_RES_SUCCESS)
-			sd_err("failed to get vdi bitmap from %s",
-			       node_to_str(n));
-	}
+static void do_get_vdis(struct work *work)
+{
+	struct get_vdis_work *w =
+		container_of(work, struct get_vdis_work, work);
+	bool synced = false;
+
+	sd_debug("try to get vdis from %s", node_to_str(&w->from));
+	w->ret = get_vdi_state_from(&w->from, &synced);
+	if (sheep_op_unknown(w->ret))
+		/* the node may not know SD_OP_GET_VDI_STATE */
+		w->ret = get_vdi_bitmap_from(&w->from);
+	if (w->ret == SD_RES_SUCCESS && !synced && !RB_EMPTY_ROOT(&w->nroot)) {
+		sd_debug("%s is joining too", node_to_str(&w->from));
+		w->ret = SD_RES_AGAIN;
+	} else if (w->ret != SD_RES_SUCCESS)
+		sd_err("failed to get vdis from %s, %s",
+		       node_to_str(&w->from), sd_strerror(w->ret));
 }
 
-static void get_vdi_bitmap_done(struct work *work)
+static void queue_get_vdis(const struct sd_node *from,
+			   const struct rb_root *nroot, bool join);
+
+static void get_vdis_done(struct work *work)
 {
 	struct get_vdis_work *w =
 		container_of(work, struct get_vdis_work, work);
+	struct sd_node *n;
+
+	if (w->ret != SD_RES_SUCCESS && !RB_EMPTY_ROOT(&w->nroot)) {
+		sd_info("get vdis from all the nodes");
+		rb_for_each_entry(n, &w->nroot, rb) {
+			if (!node_is_local(n) && node_cmp(n, &w->from))
+				queue_get_vdis(n, NULL, w->join);
+		}
+	}
+
+	if (w->join) {
+		main_thread_set(nr_join_works,
+				main_thread_get(nr_join_works) - 1);
+		if (!main_thread_get(nr_join_works))
+			main_thread_set(vdis_synced, true);
+	}
 
 	sd_mutex_lock(&wait_vdis_lock);
 	refcount_dec(&nr_get_vdis_works);
@@ -551,6 +1022,7 @@ int inc_and_log_epoch(void)
 		sys->cinfo.nr_nodes = 0;
 
 	uatomic_inc(&sys->cinfo.epoch);
+	reclaim_cluster_locks();
 
 	return update_epoch_log(sys->cinfo.epoch, sys->cinfo.nodes,
 				sys->cinfo.nr_nodes, 0, true);
@@ -603,28 +1075,85 @@ static void setup_backend_store(const struct cluster_info *cinfo,
 	 * after crash
 	 */
 	if (node_is_local(joined) && !was_cluster_shutdowned()) {
+		sys->purged_epoch = get_latest_epoch();
 		ret = sd_store->purge_obj();
 		if (ret != SD_RES_SUCCESS)
 			panic("can't remove stale objects");
 	}
 }
 
-static void get_vdi_bitmap(const struct rb_root *nroot,
-			   const struct sd_node *joined)
+static void queue_get_vdis(const struct sd_node *from,
+			   const struct rb_root *nroot, bool join)
 {
 	struct get_vdis_work *w;
 
-	w = xmalloc(sizeof(*w));
-	w->joined = *joined;
+	w = xzalloc(sizeof(*w));
+	w->from = *from;
 	INIT_RB_ROOT(&w->nroot);
-	rb_copy(nroot, struct sd_node, rb, &w->nroot, node_cmp);
+	if (nroot)
+		rb_copy(nroot, struct sd_node, rb, &w->nroot, node_cmp);
+	w->join = join;
+	if (join)
+		main_thread_set(nr_join_works,
+				main_thread_get(nr_join_works) + 1);
 	refcount_inc(&nr_get_vdis_works);
 
-	w->work.fn = do_get_vdi_bitmap;
-	w->work.done = get_vdi_bitmap_done;
+	w->work.fn = do_get_vdis;
+	w->work.done = get_vdis_done;
 	queue_work(sys->recovery_wqueue, &w->work);
 }
 
+/*
+ * The members of a running cluster share the vdis, so this node takes them
+ * from one of them when it joins, and merges the ones of all the others in
+ * parallel if it fails or the cluster is starting up.  The others merge the
+ * vdis of the node joined.
+ */
+static void get_vdi_bitmap(const struct cluster_info *cinfo,
+			   const struct rb_root *nroot,
+			   const struct sd_node *joined)
+{
+	const struct sd_node *n, *peer = NULL;
+	int nr_peers = 0, pick, i = 0;
+
+	if (!node_is_local(joined)) {
+		queue_get_vdis(joined, NULL, false);
+		return;
+	}
+
+	rb_for_each_entry(n, nroot, rb) {
+		if (!node_is_local(n))
+			nr_peers++;
+	}
+	main_thread_set(vdis_synced, !nr_peers);
+	if (!nr_peers)
+		return;
+
+	if (cinfo->status != SD_STATUS_OK) {
+		rb_for_each_entry(n, nroot, rb) {
+			if (!node_is_local(n))
+				queue_get_vdis(n, NULL, true);
+		}
+		return;
+	}
+
+	/* spread the joins over the members */
+	pick = random() % nr_peers;
+	rb_for_each_entry(n, nroot, rb) {
+		if (!node_is_local(n) && i++ == pick) {
+			peer = n;
+			break;
+		}
+	}
+	queue_get_vdis(peer, nroot, true);
+}
+
+/* Whether the vdis of the cluster are merged since this node joined */
+bool vdi_bitmap_synced(void)
+{
+	return main_thread_get(vdis_synced);
+}
+
 void wait_get_vdi_bitmap_done(void)
 {
 	sd_debug("waiting for vdi list");
@@ -729,10 +1258,11 @@ static void auto_update_cluster_info(const struct cluster_info *cinfo,
 				     const struct rb_root *nroot,
 				     size_t nr_nodes)
 {
-	struct vnode_info *old_vnode_info;
+	struct vnode_info *old_vnode_info, *prev;
 
-	put_vnode_info(main_thread_get(current_vnode_info));
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	prev = main_thread_get(current_vnode_info);
+	main_thread_set(current_vnode_info, rebuild_vnode_info(nroot, prev));
+	retire_vnode_info(prev);
 
 	if (cinfo->status != SD_STATUS_OK)
 		return;
@@ -781,7 +1311,7 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 	if (node_is_local(joined))
 		sockfd_cache_add_group(nroot);
 	sockfd_cache_add(&joined->nid);
-	get_vdi_bitmap(nroot, joined);
+	get_vdi_bitmap(cinfo, nroot, joined);
 
 	if (cinfo->status == SD_STATUS_OK && !is_cluster_formatted())
 		/* initialize config file */
@@ -1084,7 +1614,8 @@ static void auto_leave_handler(const struct sd_node *left,
 	 * because of the same reason of update_cluster_info()
 	 */
 	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info,
+			rebuild_vnode_info(nroot, old_vnode_info));
 	if (sys->cinfo.status == SD_STATUS_OK) {
 		if (is_gateway_only_cluster(nroot)) {
 			sd_info("only gateway nodes are remaining, exiting");
@@ -1099,7 +1630,7 @@ static void auto_leave_handler(const struct sd_node *left,
 				       old_vnode_info, true);
 	}
 
-	put_vnode_info(old_vnode_info);
+	retire_vnode_info(old_vnode_info);
 }
 
 main_fn void sd_leave_handler(const struct sd_node *left,
@@ -1128,7 +1659,7 @@ main_fn void sd_update_node_handler(struct sd_node *node, struct rb_root *nroot)
 	struct vnode_info *old = main_thread_get(current_vnode_info);
 	int ret;
 
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info, rebuild_vnode_info(nroot, old));
 
 	if (is_cluster_diskmode(&sys->cinfo)) {
 		struct sd_node *n = rb_search(nroot, node, rb, node_cmp);
@@ -1143,7 +1674,7 @@ main_fn void sd_update_node_handler(struct sd_node *node, struct rb_root *nroot)
 	if (ret != 0)
 		panic("cannot log current epoch %d", sys->cinfo.epoch);
 	start_recovery(main_thread_get(current_vnode_info), old, true);
-	put_vnode_info(old);
+	retire_vnode_info(old);
 }
 
 int create_cluster(int port, int64_t zone, int nr_vnodes,
@@ -1200,7 +1731,9 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 	INIT_LIST_HEAD(main_thread_get(pending_notify_list));
 
 	INIT_LIST_HEAD(&sys->local_req_queue);
-	INIT_LIST_HEAD(&sys->req_wait_queue);
+	INIT_LIST_HEAD(&sys->req_wait_epoch);
+	for (int i = 0; i < REQ_WAIT_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sys->req_wait_oid[i]);
 
 	ret = send_join_request();
 	if (ret != 0)
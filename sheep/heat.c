@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The access heat of the objects
+ *
+ * The gateway and peer requests of the clients are counted by their oid in a
+ * count-min sketch of HEAT_DEPTH rows of HEAT_WIDTH counters, each row indexed
+ * by its bits of sd_hash_oid().  A count bumps the smallest counters of the
+ * oid only, and the counters are halved every HEAT_HALF_LIFE, so heat_of()
+ * estimates how often the object has been accessed lately, never less.  The
+ * recovery orders the objects it recovers by their heat.  The sketch is
+ * updated by the main thread and read by any.
+ */
+
+#include "sheep_priv.h"
+
+#define HEAT_DEPTH 4
+#define HEAT_WIDTH_BITS 14
+#define HEAT_WIDTH (1U << HEAT_WIDTH_BITS)
+#define HEAT_HALF_LIFE (60 * 1000) /* ms */
+
+static uint16_t heat_sketch[HEAT_DEPTH][HEAT_WIDTH];
+
+static inline uint32_t heat_index(uint64_t hval, int row)
+{
+	return (hval >> (row * HEAT_WIDTH_BITS)) & (HEAT_WIDTH - 1);
+}
+
+/* The copies of a hybrid object share its heat */
+static inline uint64_t heat_hash(uint64_t oid)
+{
+	return sd_hash_oid(oid & ~HOT_BIT);
+}
+
+static struct timer heat_timer;
+
+static void heat_timer_fn(void *data)
+{
+	for (int i = 0; i < HEAT_DEPTH; i++)
+		for (uint32_t j = 0; j < HEAT_WIDTH; j++)
+			uatomic_set(&heat_sketch[i][j], heat_sketch[i][j] / 2);
+	add_timer(&heat_timer, HEAT_HALF_LIFE);
+}
+
+main_fn void heat_note(uint64_t oid)
+{
+	uint64_t hval = heat_hash(oid);
+	uint16_t *c[HEAT_DEPTH], least = UINT16_MAX;
+
+	for (int i = 0; i < HEAT_DEPTH; i++) {
+		c[i] = &heat_sketch[i][heat_index(hval, i)];
+		least = min(least, *c[i]);
+	}
+	if (least == UINT16_MAX)
+		return;
+
+	for (int i = 0; i < HEAT_DEPTH; i++)
+		if (*c[i] == least)
+			uatomic_set(c[i], least + 1);
+
+	if (!heat_timer.callback) {
+		heat_timer.callback = heat_timer_fn;
+		add_timer(&heat_timer, HEAT_HALF_LIFE);
+	}
+}
+
+uint32_t heat_of(uint64_t oid)
+{
+	uint64_t hval = heat_hash(oid);
+	uint16_t least = UINT16_MAX;
+
+	for (int i = 0; i < HEAT_DEPTH; i++)
+		least = min(least,
+			    uatomic_read(&heat_sketch[i][heat_index(hval, i)]));
+	return least;
+}
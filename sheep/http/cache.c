@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of the lookups of the bnodes and the onodes
+ *
+ * A bnode or an onode is found by probing the slots of the vdi from the hash
+ * of its name, which reads the inode and the names of the slots up to the
+ * name or a hole.  The cache keeps the slots probed the last time by the vdi
+ * and the name in a table of the last lookup of a hash, and the lookup checks
+ * them instead: a read of the object for a name found, and the reads of the
+ * names probed and of the hole for a name not found.  The updates of the
+ * other nodes show up in these reads, so the entries need no invalidation
+ * from the cluster, and the local updates replace them.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+#define KV_CACHE_BITS 16
+#define KV_CACHE_NR_LOCKS 256
+
+struct kv_cache_entry {
+	uint32_t vid;
+	char *name; /* NULL if the entry is free */
+	struct kv_lookup lookup;
+};
+
+static struct kv_cache_entry *kv_cache;
+static struct sd_mutex kv_cache_locks[KV_CACHE_NR_LOCKS] = {
+	[0 ... KV_CACHE_NR_LOCKS - 1] = SD_MUTEX_INITIALIZER,
+};
+
+static inline uint32_t kv_cache_slot(uint32_t vid, const char *name)
+{
+	uint64_t hval = sd_hash(name, strlen(name));
+
+	hval = sd_hash_next(hval ^ vid);
+	return hval & ((1U << KV_CACHE_BITS) - 1);
+}
+
+static inline struct sd_mutex *kv_cache_lock(uint32_t slot)
+{
+	return kv_cache_locks + slot % KV_CACHE_NR_LOCKS;
+}
+
+/* Return in lookup the slots probed for the name in the vdi */
+bool kv_cache_get(uint32_t vid, const char *name, struct kv_lookup *lookup)
+{
+	uint32_t slot = kv_cache_slot(vid, name);
+	struct kv_cache_entry *e = kv_cache + slot;
+	bool ret = false;
+
+	sd_mutex_lock(kv_cache_lock(slot));
+	if (e->name && e->vid == vid && !strcmp(e->name, name)) {
+		*lookup = e->lookup;
+		ret = true;
+	}
+	sd_mutex_unlock(kv_cache_lock(slot));
+
+	if (ret)
+		uatomic_inc(&sys->stat.kv_cache.hit);
+	else
+		uatomic_inc(&sys->stat.kv_cache.miss);
+	return ret;
+}
+
+void kv_cache_put(uint32_t vid, const char *name,
+		  const struct kv_lookup *lookup)
+{
+	uint32_t slot = kv_cache_slot(vid, name);
+	struct kv_cache_entry *e = kv_cache + slot;
+
+	if (!lookup->nr)
+		return;
+
+	sd_mutex_lock(kv_cache_lock(slot));
+	if (!e->name || e->vid != vid || strcmp(e->name, name)) {
+		free(e->name);
+		e->name = xstrdup(name);
+		e->vid = vid;
+	}
+	e->lookup = *lookup;
+	sd_mutex_unlock(kv_cache_lock(slot));
+}
+
+void kv_cache_drop(uint32_t vid, const char *name)
+{
+	uint32_t slot = kv_cache_slot(vid, name);
+	struct kv_cache_entry *e = kv_cache + slot;
+
+	sd_mutex_lock(kv_cache_lock(slot));
+	if (e->name && e->vid == vid && !strcmp(e->name, name)) {
+		free(e->name);
+		e->name = NULL;
+	}
+	sd_mutex_unlock(kv_cache_lock(slot));
+}
+
+int kv_cache_init(void)
+{
+	kv_cache = xcalloc(1U << KV_CACHE_BITS, sizeof(*kv_cache));
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background collection of the data of the deleted objects
+ *
+ * A DELETE or an overwrite zeroes the onode and hands its extents to the
+ * collector, so the request doesn't wait for the discard of the data objects
+ * and the update of the free list of the allocator.  Every KV_GC_INTERVAL
+ * seconds the collector frees up to KV_GC_BATCH objects of a data vdi with
+ * oalloc_free(), in a single update of its inode, on a work queue of its own.
+ *
+ * The extents not freed yet are appended to KV_GC_FILE of the sheep, which
+ * the next start picks up.  A batch leaves the file before it's freed, so a
+ * crash in the middle orphans its objects instead of freeing them twice.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+#define KV_GC_INTERVAL 1 /* second */
+#define KV_GC_BATCH 128 /* objects */
+#define KV_GC_FILE "/kv_gc"
+
+/* the extents to free of a data vdi */
+struct gc_vdi {
+	uint32_t vid;
+	int nr;
+	int max;
+	struct oalloc_extent *ext;
+	struct rb_node node;
+};
+
+/* an extent of KV_GC_FILE */
+struct kv_gc_rec {
+	uint32_t vid;
+	uint32_t __pad;
+	uint64_t start;
+	uint64_t count;
+};
+
+static struct rb_root gc_root = RB_ROOT;
+static struct sd_mutex gc_lock = SD_MUTEX_INITIALIZER;
+static char *gc_path;
+static int gc_fd = -1;
+static struct work_queue *gc_wqueue;
+static struct timer gc_timer;
+static bool gc_running;
+
+static int gc_cmp(const struct gc_vdi *a, const struct gc_vdi *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static void gc_add(uint32_t vid, uint64_t start, uint64_t count)
+{
+	struct gc_vdi *gv, key = { .vid = vid };
+
+	gv = rb_search(&gc_root, &key, node, gc_cmp);
+	if (!gv) {
+		gv = xzalloc(sizeof(*gv));
+		gv->vid = vid;
+		rb_insert(&gc_root, gv, node, gc_cmp);
+	}
+	if (gv->nr == gv->max) {
+		gv->max = gv->max ? gv->max * 2 : 16;
+		gv->ext = xrealloc(gv->ext, sizeof(*gv->ext) * gv->max);
+	}
+	gv->ext[gv->nr].start = start;
+	gv->ext[gv->nr].count = count;
+	gv->nr++;
+}
+
+static int gc_open(void)
+{
+	gc_fd = open(gc_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (gc_fd < 0) {
+		sd_err("failed to open %s, %m", gc_path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Rewrite KV_GC_FILE with the extents left */
+static void gc_save(void)
+{
+	struct kv_gc_rec *recs;
+	struct gc_vdi *gv;
+	int nr = 0, i = 0;
+
+	rb_for_each_entry(gv, &gc_root, node)
+		nr += gv->nr;
+	recs = xzalloc(sizeof(*recs) * (nr ?: 1));
+	rb_for_each_entry(gv, &gc_root, node)
+		for (int n = 0; n < gv->nr; n++, i++) {
+			recs[i].vid = gv->vid;
+			recs[i].start = gv->ext[n].start;
+			recs[i].count = gv->ext[n].count;
+		}
+
+	if (gc_fd >= 0)
+		close(gc_fd);
+	if (atomic_create_and_write(gc_path, (char *)recs,
+				    sizeof(*recs) * nr, true) < 0)
+		sd_err("failed to write %s, %m", gc_path);
+	gc_open();
+	free(recs);
+}
+
+/* Queue the objects of the data vdi to free */
+void kv_gc_free(uint32_t vid, uint64_t start, uint64_t count)
+{
+	struct kv_gc_rec rec = {
+		.vid = vid,
+		.start = start,
+		.count = count,
+	};
+
+	sd_mutex_lock(&gc_lock);
+	gc_add(vid, start, count);
+	if (gc_fd < 0 || xwrite(gc_fd, &rec, sizeof(rec)) != sizeof(rec))
+		sd_err("failed to write %s, %m", gc_path);
+	sd_mutex_unlock(&gc_lock);
+}
+
+/* Take up to KV_GC_BATCH objects of the first data vdi */
+static int gc_take(uint32_t *vid, struct oalloc_extent *batch)
+{
+	struct gc_vdi *gv = rb_entry(rb_first(&gc_root), struct gc_vdi, node);
+	uint64_t left = KV_GC_BATCH;
+	int nr = 0;
+
+	*vid = gv->vid;
+	while (gv->nr && left) {
+		struct oalloc_extent *e = gv->ext + gv->nr - 1;
+
+		batch[nr].start = e->start;
+		batch[nr].count = min(e->count, left);
+		e->start += batch[nr].count;
+		e->count -= batch[nr].count;
+		left -= batch[nr].count;
+		if (!e->count)
+			gv->nr--;
+		nr++;
+	}
+
+	if (!gv->nr) {
+		rb_erase(&gv->node, &gc_root);
+		free(gv->ext);
+		free(gv);
+	}
+	return nr;
+}
+
+static void gc_work(struct work *work)
+{
+	struct oalloc_extent batch[KV_GC_BATCH];
+	uint32_t vid;
+	int nr, ret;
+
+	sd_mutex_lock(&gc_lock);
+	nr = gc_take(&vid, batch);
+	gc_save();
+	sd_mutex_unlock(&gc_lock);
+
+	ret = oalloc_free(vid, batch, nr);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to free %d extents of %"PRIx32", %s", nr, vid,
+		       sd_strerror(ret));
+}
+
+static void gc_done(struct work *work)
+{
+	free(work);
+	gc_running = false;
+}
+
+static void gc_tick(void *data)
+{
+	struct work *work;
+	bool empty;
+
+	add_timer(&gc_timer, KV_GC_INTERVAL);
+	if (gc_running || sys->cinfo.status != SD_STATUS_OK)
+		return;
+
+	sd_mutex_lock(&gc_lock);
+	empty = RB_EMPTY_ROOT(&gc_root);
+	sd_mutex_unlock(&gc_lock);
+	if (empty)
+		return;
+
+	gc_running = true;
+	work = xzalloc(sizeof(*work));
+	work->fn = gc_work;
+	work->done = gc_done;
+	queue_work(gc_wqueue, work);
+}
+
+int kv_gc_init(const char *dir)
+{
+	struct kv_gc_rec *recs;
+	struct stat st;
+	size_t len;
+	int fd;
+
+	len = strlen(dir) + strlen(KV_GC_FILE) + 1;
+	gc_path = xzalloc(len);
+	snprintf(gc_path, len, "%s" KV_GC_FILE, dir);
+
+	gc_wqueue = create_ordered_work_queue("kv_gc");
+	if (!gc_wqueue)
+		return -1;
+
+	fd = open(gc_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			sd_err("failed to open %s, %m", gc_path);
+			return -1;
+		}
+		goto out;
+	}
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", gc_path);
+		close(fd);
+		return -1;
+	}
+	len = st.st_size;
+	recs = xmalloc(len ?: 1);
+	if (xread(fd, recs, len) != len) {
+		sd_err("failed to read %s, %m", gc_path);
+		close(fd);
+		free(recs);
+		return -1;
+	}
+	close(fd);
+
+	for (size_t i = 0; i < len / sizeof(*recs); i++)
+		gc_add(recs[i].vid, recs[i].start, recs[i].count);
+	if (len)
+		sd_info("%zu extents to free from the last run",
+			len / sizeof(*recs));
+	free(recs);
+out:
+	if (gc_open() < 0)
+		return -1;
+	gc_timer.callback = gc_tick;
+	add_timer(&gc_timer, KV_GC_INTERVAL);
+	return 0;
+}
@@ -11,7 +11,10 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-/* This files implement RESTful interface to sheepdog storage via fastcgi */
+/*
+ * This files implement RESTful interface to sheepdog storage via fastcgi, or
+ * HTTP/1.1 served by httpd.c
+ */
 
 #include "http.h"
 #include "sheep_priv.h"
@@ -19,6 +22,7 @@
 
 static const char *http_host = "localhost";
 static const char *http_port = "8000";
+static bool http_native;
 
 LIST_HEAD(http_drivers);
 static LIST_HEAD(http_enabled_drivers);
@@ -51,11 +55,13 @@ static inline const char *strstatus(enum http_status status)
 		[ACCEPTED] = "202 Accepted",
 		[NO_CONTENT] = "204 No Content",
 		[PARTIAL_CONTENT] = "206 Partial Content",
+		[NOT_MODIFIED] = "304 Not Modified",
 		[BAD_REQUEST] = "400 Bad Request",
 		[UNAUTHORIZED] = "401 Unauthorized",
 		[NOT_FOUND] = "404 Not Found",
 		[METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
 		[CONFLICT] = "409 Conflict",
+		[PRECONDITION_FAILED] = "412 Precondition Failed",
 		[REQUEST_RANGE_NOT_SATISFIABLE] =
 			"416 Requested Range Not Satisfiable",
 		[INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
@@ -102,23 +108,91 @@ static inline void http_request_error(struct http_request *req)
 
 int http_request_write(struct http_request *req, const void *buf, int len)
 {
-	int ret = FCGX_PutStr(buf, len, req->fcgx.out);
-	if (ret < 0)
-		http_request_error(req);
+	uint64_t start = clock_get_time();
+	int ret;
+
+	if (req->conn)
+		ret = httpd_write(req->conn, buf, len);
+	else {
+		ret = FCGX_PutStr(buf, len, req->fcgx.out);
+		if (ret < 0)
+			http_request_error(req);
+	}
+	req->io_ns += clock_get_time() - start;
 	return ret;
 }
 
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Copy the decoded value of the parameter key of the query string to buf, an
+ * empty string for a parameter without value.  Return false if there is no
+ * such parameter.
+ */
+bool http_request_query(struct http_request *req, const char *key, char *buf,
+			size_t len)
+{
+	const char *p = FCGX_GetParam("QUERY_STRING", req->envp);
+	size_t klen = strlen(key), i = 0;
+	const char *end;
+	int hi, lo;
+
+	for (; p && *p; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, "&");
+		if (strncmp(p, key, klen) ||
+		    (p + klen != end && p[klen] != '='))
+			continue;
+
+		for (p += klen + (p + klen != end); p < end && i + 1 < len;
+		     p++) {
+			if (*p == '+')
+				buf[i++] = ' ';
+			else if (*p == '%' && end - p > 2 &&
+				 (hi = hex_digit(p[1])) >= 0 &&
+				 (lo = hex_digit(p[2])) >= 0) {
+				buf[i++] = hi << 4 | lo;
+				p += 2;
+			} else
+				buf[i++] = *p;
+		}
+		buf[i] = '\0';
+		return true;
+	}
+	return false;
+}
+
 int http_request_read(struct http_request *req, void *buf, int len)
 {
-	int ret = FCGX_GetStr(buf, len, req->fcgx.in);
-	if (ret < 0)
-		http_request_error(req);
+	uint64_t start = clock_get_time();
+	int ret;
+
+	if (req->conn)
+		ret = httpd_read(req->conn, buf, len);
+	else {
+		ret = FCGX_GetStr(buf, len, req->fcgx.in);
+		if (ret < 0)
+			http_request_error(req);
+	}
+	req->io_ns += clock_get_time() - start;
 	return ret;
 }
 
 int http_request_writes(struct http_request *req, const char *str)
 {
-	int ret = FCGX_PutS(str, req->fcgx.out);
+	int ret;
+
+	if (req->conn)
+		return httpd_write(req->conn, str, strlen(str));
+
+	ret = FCGX_PutS(str, req->fcgx.out);
 	if (ret < 0)
 		http_request_error(req);
 	return ret;
@@ -128,9 +202,19 @@ __printf(2, 3)
 int http_request_writef(struct http_request *req, const char *fmt, ...)
 {
 	va_list ap;
+	char *s;
 	int ret;
 
 	va_start(ap, fmt);
+	if (req->conn) {
+		ret = vasprintf(&s, fmt, ap);
+		va_end(ap);
+		if (ret < 0)
+			return ret;
+		ret = httpd_write(req->conn, s, ret);
+		free(s);
+		return ret;
+	}
 	ret = FCGX_VFPrintF(req->fcgx.out, fmt, ap);
 	va_end(ap);
 	if (ret < 0)
@@ -138,9 +222,173 @@ int http_request_writef(struct http_request *req, const char *fmt, ...)
 	return ret;
 }
 
+/*
+ * Parse the byte ranges of RFC 7233 in the Range header.  A header which can't
+ * be parsed is ignored, which serves the whole entity.
+ */
+static void request_init_ranges(struct http_request *req, const char *p)
+{
+	const char *header = p;
+	struct http_range *r;
+	char *end;
+
+	if (strncmp(p, "bytes=", 6))
+		goto ignore;
+	for (p += 6;; p++) {
+		p += strspn(p, " \t");
+		if (req->nr_ranges == HTTP_MAX_RANGES)
+			goto ignore;
+		r = req->ranges + req->nr_ranges;
+		r->first = r->last = UINT64_MAX;
+
+		if (isdigit(*p)) {
+			r->first = strtoull(p, &end, 10);
+			p = end;
+		}
+		if (*p++ != '-')
+			goto ignore;
+		if (isdigit(*p)) {
+			r->last = strtoull(p, &end, 10);
+			p = end;
+		} else if (r->first == UINT64_MAX)
+			goto ignore;
+		if (r->first != UINT64_MAX && r->last < r->first)
+			goto ignore;
+		req->nr_ranges++;
+
+		p += strspn(p, " \t");
+		if (*p == '\0')
+			return;
+		if (*p != ',')
+			goto ignore;
+	}
+ignore:
+	sd_debug("ignore the range %s", header);
+	req->nr_ranges = 0;
+}
+
+/*
+ * Resolve the ranges of the request for an entity of size bytes, dropping the
+ * ones which can't be satisfied.  Return the number of the ranges left.
+ */
+int http_request_ranges(struct http_request *req, uint64_t size)
+{
+	struct http_range *r;
+	int nr = 0;
+
+	for (int i = 0; i < req->nr_ranges; i++) {
+		r = req->ranges + i;
+		if (r->first == UINT64_MAX) {
+			/* the suffix of r->last bytes */
+			if (r->last == 0 || size == 0)
+				continue;
+			r->first = size - min(r->last, size);
+			r->last = size - 1;
+		} else if (r->first >= size)
+			continue;
+		else
+			r->last = min(r->last, size - 1);
+		req->ranges[nr++] = *r;
+	}
+	req->nr_ranges = nr;
+	return nr;
+}
+
+const char *http_request_param(struct http_request *req, const char *name)
+{
+	return FCGX_GetParam(name, req->envp);
+}
+
+/*
+ * Whether the entity tag is in the list of the header, or the list is '*'.
+ * The weak tags match by the weak comparison only.
+ */
+static bool etag_match(const char *list, const char *etag, bool strong)
+{
+	bool weak = !strncmp(etag, "W/", 2);
+	const char *p = list;
+	size_t len;
+
+	if (weak) {
+		if (strong)
+			return false;
+		etag += 2;
+	}
+
+	for (;;) {
+		p += strspn(p, " \t,");
+		if (*p == '\0')
+			return false;
+		if (*p == '*')
+			return true;
+		weak = !strncmp(p, "W/", 2);
+		if (weak)
+			p += 2;
+		len = strcspn(p, " \t,");
+		if (!(weak && strong) && len == strlen(etag) &&
+		    !strncmp(p, etag, len))
+			return true;
+		p += len;
+	}
+}
+
+static bool parse_http_time(const char *s, uint64_t *t)
+{
+	struct tm tm = {};
+
+	if (!strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return false;
+	*t = timegm(&tm);
+	return true;
+}
+
+/*
+ * Evaluate the conditional headers of RFC 7232 for the entity of the etag
+ * modified at mtime in seconds.  Return OK to serve the request, or the status
+ * to answer it with.  An If-Range which fails drops the ranges, which serves
+ * the whole entity.
+ */
+enum http_status http_request_precondition(struct http_request *req,
+					   const char *etag, uint64_t mtime)
+{
+	bool read = req->opcode == HTTP_GET || req->opcode == HTTP_HEAD;
+	const char *p;
+	uint64_t t;
+
+	p = http_request_param(req, "HTTP_IF_MATCH");
+	if (p && p[0] != '\0') {
+		if (!etag_match(p, etag, true))
+			return PRECONDITION_FAILED;
+	} else {
+		p = http_request_param(req, "HTTP_IF_UNMODIFIED_SINCE");
+		if (p && parse_http_time(p, &t) && mtime > t)
+			return PRECONDITION_FAILED;
+	}
+
+	p = http_request_param(req, "HTTP_IF_NONE_MATCH");
+	if (p && p[0] != '\0') {
+		if (etag_match(p, etag, false))
+			return read ? NOT_MODIFIED : PRECONDITION_FAILED;
+	} else if (read) {
+		p = http_request_param(req, "HTTP_IF_MODIFIED_SINCE");
+		if (p && parse_http_time(p, &t) && mtime <= t)
+			return NOT_MODIFIED;
+	}
+
+	p = http_request_param(req, "HTTP_IF_RANGE");
+	if (req->nr_ranges && p && p[0] != '\0') {
+		if (p[0] == '"' || !strncmp(p, "W/", 2)) {
+			if (!etag_match(p, etag, true))
+				req->nr_ranges = 0;
+		} else if (!parse_http_time(p, &t) || t != mtime)
+			req->nr_ranges = 0;
+	}
+	return OK;
+}
+
 static int request_init_operation(struct http_request *req)
 {
-	char **env = req->fcgx.envp;
+	char **env = req->envp;
 	char *p, *endp;
 
 	p = FCGX_GetParam("REQUEST_METHOD", env);
@@ -170,33 +418,8 @@ static int request_init_operation(struct http_request *req)
 	if (!req->uri)
 		return BAD_REQUEST;
 	p = FCGX_GetParam("HTTP_RANGE", env);
-	if (p && p[0] != '\0') {
-		const char prefix[] = "bytes=";
-		char *left, *right, num[64];
-		uint64_t max;
-		left = strstr(p, prefix);
-		if (!left)
-			goto invalid_range;
-		right = strchr(left, '-');
-		pstrcpy(num, right - left, left + sizeof(prefix) - 1);
-		req->offset = strtoll(num, &endp, 10);
-		if (num == endp)
-			goto invalid_range;
-		strcpy(num, right + 1);
-		/*
-		 * In swift spec, the second number of RANGE should be included
-		 * which means [num1, num2], but our common means for read and
-		 * write data by 'offset' and 'len' is [num1, num2), so we
-		 * should add 1 to num2.
-		 */
-		max = strtoll(num, &endp, 10) + 1;
-		if (num == endp)
-			goto invalid_range;
-		if (max <= req->offset)
-			goto invalid_range;
-		req->data_length = max - req->offset;
-		sd_debug("HTTP_RANGE: %"PRIu64" %"PRIu64, req->offset, max);
-	}
+	if (p && p[0] != '\0')
+		request_init_ranges(req, p);
 	p = FCGX_GetParam("FORCE", env);
 	if (p && p[0] != '\0') {
 		if (!strcmp("true", p))
@@ -213,17 +436,13 @@ static int request_init_operation(struct http_request *req)
 	req->status = UNKNOWN;
 
 	return OK;
-
-invalid_range:
-	sd_err("invalid range %s", p);
-	return REQUEST_RANGE_NOT_SATISFIABLE;
 }
 
 static int http_init_request(struct http_request *req)
 {
 	char *p;
 
-	for (int i = 0; (p = req->fcgx.envp[i]); ++i)
+	for (int i = 0; (p = req->envp[i]); ++i)
 		sd_debug("%s", p);
 
 	return request_init_operation(req);
@@ -237,24 +456,105 @@ void http_response_header(struct http_request *req, enum http_status status)
 
 	req->status = status;
 	http_request_writef(req, "Status: %s\r\n", strstatus(status));
-	if (req->opcode == HTTP_GET || req->opcode == HTTP_HEAD)
+	if ((req->opcode == HTTP_GET || req->opcode == HTTP_HEAD) &&
+	    !req->stream)
 		http_request_writef(req, "Content-Length: %"PRIu64"\r\n",
 				    req->data_length);
-	http_request_writes(req, "Content-type: text/plain;\r\n\r\n");
+	if (req->content_type)
+		http_request_writef(req, "Content-Type: %s\r\n\r\n",
+				    req->content_type);
+	else
+		http_request_writes(req, "Content-type: text/plain;\r\n\r\n");
+}
+
+void http_stream_init(struct http_stream *s, struct http_request *req)
+{
+	s->req = req;
+	strbuf_init(&s->buf, 0);
+}
+
+static void http_stream_flush(struct http_stream *s)
+{
+	struct http_request *req = s->req;
+
+	if (req->status == UNKNOWN) {
+		req->stream = true;
+		http_response_header(req, OK);
+	}
+	if (s->buf.len)
+		http_request_write(req, s->buf.buf, s->buf.len);
+	strbuf_reset(&s->buf);
+}
+
+void http_stream_addf(struct http_stream *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	strbuf_vaddf(&s->buf, fmt, ap);
+	va_end(ap);
+
+	if (s->buf.len >= HTTP_STREAM_BUF)
+		http_stream_flush(s);
+}
+
+/* Write out the rest of the body */
+void http_stream_end(struct http_stream *s)
+{
+	http_stream_flush(s);
+	strbuf_release(&s->buf);
+}
+
+/*
+ * Drop the rest of the body after an error.  Return false if nothing was sent
+ * yet, so the error can still be answered, or else the response is cut short.
+ */
+bool http_stream_abort(struct http_stream *s)
+{
+	struct http_request *req = s->req;
+
+	strbuf_release(&s->buf);
+	if (req->status == UNKNOWN)
+		return false;
+
+	sd_err("cut short the body of %s", str_http_req(req));
+	req->aborted = true;
+	return true;
 }
 
 static void http_end_request(struct http_request *req)
 {
-	FCGX_Finish_r(&req->fcgx);
+	if (req->conn && req->aborted)
+		httpd_abort_request(req->conn);
+	if (req->conn)
+		httpd_end_request(req->conn);
+	else
+		FCGX_Finish_r(&req->fcgx);
 	free(req);
 }
 
-static void http_run_request(struct work *work)
+/* Account the request in the stages of sys->stat.http */
+static void http_account_request(struct http_request *req, uint64_t start)
+{
+	struct s_http *stat = &sys->stat.http;
+	int i = req->opcode - HTTP_GET;
+
+	if (i < 0 || i >= SD_HTTP_NR_METHODS)
+		return;
+
+	uatomic_inc(&stat->nr[i]);
+	if (req->start)
+		uatomic_add(&stat->queue[i], start - req->start);
+	uatomic_add(&stat->io[i], req->io_ns);
+	uatomic_add(&stat->alloc[i], req->alloc_ns);
+	uatomic_add(&stat->handle[i], clock_get_time() - start);
+}
+
+static void http_handle_request(struct http_request *req)
 {
-	struct http_work *hw = container_of(work, struct http_work, work);
-	struct http_request *req = hw->request;
 	int op = req->opcode;
 	struct http_driver *hdrv;
+	uint64_t start = clock_get_time();
 
 	list_for_each_entry(hdrv, &http_enabled_drivers, list) {
 		void (*method)(struct http_request *req) = NULL;
@@ -289,9 +589,30 @@ static void http_run_request(struct work *work)
 
 	http_response_header(req, METHOD_NOT_ALLOWED);
 out:
+	http_account_request(req, start);
 	http_end_request(req);
 }
 
+static void http_run_request(struct work *work)
+{
+	struct http_work *hw = container_of(work, struct http_work, work);
+
+	http_handle_request(hw->request);
+}
+
+/* Run a request of the native front end in the worker it was read by */
+void http_serve_request(struct http_request *req)
+{
+	int ret = http_init_request(req);
+
+	if (ret != OK) {
+		http_response_header(req, ret);
+		http_end_request(req);
+		return;
+	}
+	http_handle_request(req);
+}
+
 static void http_request_done(struct work *work)
 {
 	struct http_work *hw = container_of(work, struct http_work, work);
@@ -305,6 +626,7 @@ static void http_queue_request(struct http_request *req)
 	hw->work.fn = http_run_request;
 	hw->work.done = http_request_done;
 	hw->request = req;
+	req->start = clock_get_time();
 	queue_work(sys->http_wqueue, &hw->work);
 }
 
@@ -332,6 +654,7 @@ static void *http_main_loop(void *ignored)
 			sd_err("accept failed, %d, %d", http_sockfd, ret);
 			goto out;
 		}
+		req->envp = req->fcgx.envp;
 		ret = http_init_request(req);
 		if (ret != OK) {
 			http_response_header(req, ret);
@@ -359,6 +682,17 @@ static int http_opt_port_parser(const char *s)
 	return 0;
 }
 
+static int http_opt_proto_parser(const char *s)
+{
+	if (!strcmp(s, "http"))
+		http_native = true;
+	else if (strcmp(s, "fcgi")) {
+		sd_err("Invalid proto option '%s', either http or fcgi", s);
+		return -1;
+	}
+	return 0;
+}
+
 static int http_opt_buffer_parser(const char *s)
 {
 	const uint64_t max_buffer_size = SD_DATA_OBJ_SIZE * 256;
@@ -379,6 +713,22 @@ static int http_opt_buffer_parser(const char *s)
 	return 0;
 }
 
+static int http_opt_inline_parser(const char *s)
+{
+	uint64_t inline_size;
+
+	if (option_parse_size(s, &inline_size) < 0)
+		return -1;
+	if (inline_size > KV_MAX_INLINE_SIZE) {
+		sd_err("Invalid inline option '%s': size must be up to %"PRIu64,
+		       s, (uint64_t)KV_MAX_INLINE_SIZE);
+		return -1;
+	}
+	kv_inline_size = inline_size;
+	sd_info("kv_inline_size: %"PRIu64, kv_inline_size);
+	return 0;
+}
+
 static int http_opt_default_parser(const char *s)
 {
 	struct http_driver *hdrv;
@@ -408,12 +758,14 @@ static int http_opt_default_parser(const char *s)
 static struct option_parser http_opt_parsers[] = {
 	{ "host=", http_opt_host_parser },
 	{ "port=", http_opt_port_parser },
+	{ "proto=", http_opt_proto_parser },
 	{ "buffer=", http_opt_buffer_parser },
+	{ "inline=", http_opt_inline_parser },
 	{ "", http_opt_default_parser },
 	{ NULL, NULL },
 };
 
-int http_init(const char *options)
+int http_init(const char *dir, const char *options)
 {
 	sd_thread_t t;
 	int err;
@@ -437,6 +789,18 @@ int http_init(const char *options)
 	if (!sys->http_wqueue)
 		return -1;
 
+	if (kv_cache_init() < 0)
+		return -1;
+
+	if (kv_usage_init(dir) < 0)
+		return -1;
+
+	if (kv_gc_init(dir) < 0)
+		return -1;
+
+	if (http_native)
+		return httpd_init(http_host, http_port);
+
 	FCGX_Init();
 
 #define LISTEN_QUEUE_DEPTH 1024 /* No rationale */
@@ -454,3 +818,8 @@ int http_init(const char *options)
 	}
 	return 0;
 }
+
+void http_exit(void)
+{
+	kv_usage_exit();
+}
@@ -15,6 +15,7 @@
 
 #include "sheepdog_proto.h"
 #include "sheep.h"
+#include "strbuf.h"
 
 enum http_opcode {
 	HTTP_GET = 1,
@@ -31,27 +32,49 @@ enum http_status {
 	ACCEPTED,                       /* 202 */
 	NO_CONTENT,                     /* 204 */
 	PARTIAL_CONTENT,                /* 206 */
+	NOT_MODIFIED,                   /* 304 */
 	BAD_REQUEST,                    /* 400 */
 	UNAUTHORIZED,			/* 401 */
 	NOT_FOUND,                      /* 404 */
 	METHOD_NOT_ALLOWED,             /* 405 */
 	CONFLICT,                       /* 409 */
+	PRECONDITION_FAILED,            /* 412 */
 	REQUEST_RANGE_NOT_SATISFIABLE,  /* 416 */
 	INTERNAL_SERVER_ERROR,          /* 500 */
 	NOT_IMPLEMENTED,                /* 501 */
 	SERVICE_UNAVAILABLE,            /* 503 */
 };
 
+struct http_conn;
+
+#define HTTP_MAX_RANGES 16
+
+/* The bytes first to last, UINT64_MAX for the start or the end of the entity */
+struct http_range {
+	uint64_t first, last;
+};
+
 struct http_request {
 	FCGX_Request fcgx;
+	struct http_conn *conn; /* for the native front end, NULL for FastCGI */
+	char **envp; /* the CGI parameters */
 	char *uri;
 	enum http_opcode opcode;
 	enum http_status status;
 	uint64_t data_length;
-	uint64_t offset;
+	int nr_ranges; /* of the Range header, 0 for the whole entity */
+	struct http_range ranges[HTTP_MAX_RANGES];
+	const char *content_type; /* of the response, NULL for text */
 	bool force;
 	bool append;
 	bool eof;
+	bool stream; /* the body has no Content-Length, see http_stream */
+	bool aborted; /* the body was cut short by an error */
+
+	/* for the stages in sys->stat.http */
+	uint64_t start; /* when it was queued */
+	uint64_t io_ns; /* reading and writing the bodies */
+	uint64_t alloc_ns; /* allocating the data objects */
 };
 
 struct http_driver {
@@ -112,6 +135,40 @@ int http_request_write(struct http_request *req, const void *buf, int len);
 int http_request_writes(struct http_request *req, const char *str);
 __printf(2, 3)
 int http_request_writef(struct http_request *req, const char *fmt, ...);
+bool http_request_query(struct http_request *req, const char *key, char *buf,
+			size_t len);
+void http_serve_request(struct http_request *req);
+const char *http_request_param(struct http_request *req, const char *name);
+int http_request_ranges(struct http_request *req, uint64_t size);
+enum http_status http_request_precondition(struct http_request *req,
+					   const char *etag, uint64_t mtime);
+
+/* the most of a streamed body buffered before it is written out */
+#define HTTP_STREAM_BUF (64 * 1024)
+
+/*
+ * A body of OK written in pieces as it is produced, e.g. a listing, so a
+ * large one takes no more than HTTP_STREAM_BUF of memory and its first bytes
+ * go out early.  The header goes with the first piece, so an error before it
+ * can still be answered with its own status.
+ */
+struct http_stream {
+	struct http_request *req;
+	struct strbuf buf;
+};
+
+void http_stream_init(struct http_stream *s, struct http_request *req);
+__printf(2, 3)
+void http_stream_addf(struct http_stream *s, const char *fmt, ...);
+void http_stream_end(struct http_stream *s);
+bool http_stream_abort(struct http_stream *s);
+
+/* http/httpd.c */
+int httpd_read(struct http_conn *conn, void *buf, int len);
+int httpd_write(struct http_conn *conn, const void *buf, int len);
+void httpd_end_request(struct http_conn *conn);
+void httpd_abort_request(struct http_conn *conn);
+int httpd_init(const char *host, const char *port);
 
 /* For kv.c */
 
@@ -122,6 +179,10 @@ int http_request_writef(struct http_request *req, const char *fmt, ...);
 #define DEFAULT_KV_RW_BUFFER (SD_DATA_OBJ_SIZE * 8)
 extern uint64_t kv_rw_buffer;
 
+/* The objects up to kv_inline_size are kept in their onodes */
+#define KV_MAX_INLINE_SIZE (SD_DATA_OBJ_SIZE - BLOCK_SIZE)
+extern uint64_t kv_inline_size;
+
 /* Account operations */
 int kv_create_account(const char *account);
 int kv_read_account_meta(struct http_request *req, const char *account);
@@ -159,10 +220,85 @@ int kv_iterate_object(const char *account, const char *bucket,
 		      void (*cb)(const char *object, void *opaque),
 		      void *opaque);
 
+/* Multipart upload operations */
+#define KV_UPLOAD_ID_LEN 16
+int kv_initiate_upload(const char *account, const char *bucket,
+		       char *upload_id);
+int kv_create_part(struct http_request *req, const char *account,
+		   const char *bucket, const char *upload_id, uint32_t part);
+int kv_complete_upload(const char *account, const char *bucket,
+		       const char *name, const char *upload_id,
+		       const uint32_t *parts, int nr_parts);
+int kv_abort_upload(const char *account, const char *bucket,
+		    const char *upload_id);
+
+/* A page of the listing of the objects of a bucket in the order of names */
+struct kv_list {
+	const char *prefix;
+	const char *marker;
+	char delimiter; /* '\0' for none */
+	uint32_t max_keys;
+	/* called for the names and the common prefixes of the page in order */
+	void (*cb)(const char *name, bool common_prefix, void *opaque);
+	void *opaque;
+
+	uint32_t nr;
+	bool truncated;
+	char last_prefix[SD_MAX_OBJECT_NAME];
+};
+
+int kv_list_objects(const char *account, const char *bucket,
+		    struct kv_list *list);
+int kv_flush_usage(const char *account, const char *bucket);
+int kv_recount_usage(const char *account, const char *bucket);
+
 /* http/oalloc.c */
+struct oalloc_extent {
+	uint64_t start;
+	uint64_t count;
+};
+
 int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count);
 int oalloc_new_finish(uint32_t vid, uint64_t start, uint64_t count);
-int oalloc_free(uint32_t vid, uint64_t start, uint64_t count);
+int oalloc_free(uint32_t vid, const struct oalloc_extent *ext, int nr);
 int oalloc_init(uint32_t vid);
 
+/* http/index.c */
+int kv_index_init(uint32_t vid);
+int kv_index_insert(uint32_t vid, const char *name);
+int kv_index_remove(uint32_t vid, const char *name);
+int kv_index_list(uint32_t vid, struct kv_list *list);
+void kv_list_names(struct kv_list *list, char **names, size_t nr);
+
+/* http/cache.c */
+#define KV_CACHE_PROBES 8
+
+/* The slots of a vdi probed for a name, the last is the name or a hole */
+struct kv_lookup {
+	bool found;
+	int nr; /* 0 if the probe took more than KV_CACHE_PROBES slots */
+	uint64_t oids[KV_CACHE_PROBES];
+};
+
+bool kv_cache_get(uint32_t vid, const char *name, struct kv_lookup *lookup);
+void kv_cache_put(uint32_t vid, const char *name,
+		  const struct kv_lookup *lookup);
+void kv_cache_drop(uint32_t vid, const char *name);
+int kv_cache_init(void);
+
+/* http/usage.c */
+void kv_usage_add(const char *account, const char *bucket, int64_t objects,
+		  int64_t bytes);
+void kv_usage_peek(const char *account, const char *bucket, int64_t *objects,
+		   int64_t *bytes);
+void kv_usage_take(const char *account, const char *bucket, int64_t *objects,
+		   int64_t *bytes);
+void kv_usage_recounted(const char *account, const char *bucket);
+int kv_usage_init(const char *dir);
+void kv_usage_exit(void);
+
+/* http/gc.c */
+void kv_gc_free(uint32_t vid, uint64_t start, uint64_t count);
+int kv_gc_init(const char *dir);
+
 #endif /* __SHEEP_HTTP_H__ */
@@ -0,0 +1,664 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * HTTP/1.1 front end of the gateway
+ *
+ * With 'proto=http', sheep serves the clients on its port itself instead of
+ * a web server passing the requests over FastCGI.  A connection waits in the
+ * event loop between its requests, so an idle keep-alive connection costs an
+ * fd only.  When a request arrives, a worker of the http queue reads its
+ * header, translates it into the CGI parameters the drivers take from
+ * FastCGI, and runs the request on the connection.
+ *
+ * The drivers write a CGI response, i.e. the lines of the header with a
+ * Status line, an empty line and the body.  The header of HTTP/1.1 made of it
+ * goes out with the first write of the body, which is sent from the buffer of
+ * the driver, and a body of no Content-Length is sent chunked to keep the
+ * connection.  The request bodies have to come with a Content-Length.
+ */
+
+#include <sys/uio.h>
+
+#include "http.h"
+#include "sheep_priv.h"
+
+#define HTTPD_MAX_HEADER 8192
+#define HTTPD_MAX_PARAMS 64
+/* the most of a request body left unread to discard for the next request */
+#define HTTPD_MAX_DISCARD (1024 * 1024)
+
+struct http_conn {
+	int fd;
+	struct work work;
+	bool keep_alive;
+	uint64_t queued; /* when the work was queued */
+
+	/* the bytes read ahead of the request, from in_start to in_end */
+	char in[HTTPD_MAX_HEADER];
+	size_t in_start, in_end;
+	uint64_t body_left; /* of the request to read */
+	bool head;
+
+	/* the CGI parameters of the request */
+	char env[HTTPD_MAX_HEADER * 3];
+	size_t env_len;
+	int nr_env;
+	char *envp[HTTPD_MAX_PARAMS + 1];
+
+	/* the response */
+	struct strbuf cgi; /* the CGI header until its end */
+	struct strbuf hdr; /* the HTTP header to send */
+	bool hdr_parsed, hdr_sent;
+	bool no_body, chunked, has_length;
+	uint64_t body_length, body_sent;
+};
+
+static void httpd_conn_close(struct http_conn *conn)
+{
+	sd_debug("close the http connection %d", conn->fd);
+	close(conn->fd);
+	strbuf_release(&conn->cgi);
+	strbuf_release(&conn->hdr);
+	free(conn);
+}
+
+static int httpd_writev(struct http_conn *conn, struct iovec *iov, int cnt)
+{
+	ssize_t ret;
+
+	while (cnt) {
+		ret = writev(conn->fd, iov, cnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			sd_err("failed to send to %d, %m", conn->fd);
+			conn->keep_alive = false;
+			return -1;
+		}
+		for (; cnt && ret >= iov->iov_len; iov++, cnt--)
+			ret -= iov->iov_len;
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/* Answer a request which can't be served, and close the connection */
+static void httpd_reject(struct http_conn *conn, const char *status)
+{
+	char buf[128];
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\n"
+			       "Content-Length: 0\r\nConnection: close\r\n\r\n",
+			       status);
+	conn->keep_alive = false;
+	httpd_writev(conn, &iov, 1);
+}
+
+/* Return the end of the header in buf, i.e. after its empty line, or NULL */
+static char *header_end(char *buf, size_t len)
+{
+	char *end = buf + len;
+
+	for (char *p = buf; (p = memchr(p, '\n', end - p));) {
+		p++;
+		if (p < end && *p == '\n')
+			return p + 1;
+		if (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+			return p + 2;
+	}
+	return NULL;
+}
+
+static bool env_add(struct http_conn *conn, const char *key, const char *val,
+		    size_t len)
+{
+	size_t klen = strlen(key), need = klen + len + 2;
+	char *p = conn->env + conn->env_len;
+
+	if (conn->nr_env == HTTPD_MAX_PARAMS ||
+	    conn->env_len + need > sizeof(conn->env))
+		return false;
+
+	memcpy(p, key, klen);
+	p[klen] = '=';
+	memcpy(p + klen + 1, val, len);
+	p[klen + 1 + len] = '\0';
+	conn->env_len += need;
+	conn->envp[conn->nr_env++] = p;
+	conn->envp[conn->nr_env] = NULL;
+	return true;
+}
+
+/*
+ * Decode the path of the URI like the DOCUMENT_URI of a web server.  Return
+ * false for a path which isn't one of the objects.
+ */
+static bool decode_path(const char *s, size_t len, char *buf)
+{
+	size_t i, j = 0;
+
+	if (len == 0 || s[0] != '/')
+		return false;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '%' && i + 2 < len && isxdigit(s[i + 1]) &&
+		    isxdigit(s[i + 2])) {
+			char hex[3] = { s[i + 1], s[i + 2] };
+
+			buf[j] = strtol(hex, NULL, 16);
+			if (buf[j] == '\0')
+				return false;
+			i += 2;
+		} else
+			buf[j] = s[i];
+		/* merge the slashes */
+		if (buf[j] == '/' && j > 0 && buf[j - 1] == '/')
+			continue;
+		j++;
+	}
+	buf[j] = '\0';
+
+	/* the dot segments would escape the account or the bucket */
+	return !strstr(buf, "/./") && !strstr(buf, "/../") &&
+		!(j >= 2 && !strcmp(buf + j - 2, "/.")) &&
+		!(j >= 3 && !strcmp(buf + j - 3, "/.."));
+}
+
+/* Add the header field of the line to the parameters of the request */
+static const char *parse_field(struct http_conn *conn, char *line,
+			       bool *expect)
+{
+	char key[256] = "HTTP_", *val, *endp;
+	size_t len, i;
+
+	val = strchr(line, ':');
+	if (!val || val == line || val - line + 5 >= sizeof(key))
+		return "400 Bad Request";
+	*val++ = '\0';
+	val += strspn(val, " \t");
+	len = strlen(val);
+	while (len && (val[len - 1] == ' ' || val[len - 1] == '\t'))
+		val[--len] = '\0';
+
+	if (!strcasecmp(line, "Content-Length")) {
+		conn->body_left = strtoull(val, &endp, 10);
+		if (endp == val || *endp)
+			return "400 Bad Request";
+		if (!env_add(conn, "CONTENT_LENGTH", val, len))
+			return "431 Request Header Fields Too Large";
+		return NULL;
+	}
+	if (!strcasecmp(line, "Transfer-Encoding") &&
+	    strcasecmp(val, "identity"))
+		return "411 Length Required";
+	if (!strcasecmp(line, "Connection")) {
+		if (strcasestr(val, "close"))
+			conn->keep_alive = false;
+		else if (strcasestr(val, "keep-alive"))
+			conn->keep_alive = true;
+	}
+	if (!strcasecmp(line, "Expect") && !strcasecmp(val, "100-continue"))
+		*expect = true;
+	if (!strcasecmp(line, "Content-Type"))
+		pstrcpy(key, sizeof(key), "CONTENT_TYPE");
+	else if (!strcasecmp(line, "Force"))
+		pstrcpy(key, sizeof(key), "FORCE");
+	else
+		for (i = 0; line[i]; i++)
+			key[i + 5] = line[i] == '-' ? '_' : toupper(line[i]);
+
+	if (!env_add(conn, key, val, len))
+		return "431 Request Header Fields Too Large";
+	return NULL;
+}
+
+/*
+ * Translate the header of the request ending at end into its CGI parameters.
+ * Return the status to reject the request with, or NULL.
+ */
+static const char *parse_request(struct http_conn *conn, char *end)
+{
+	char *line = conn->in + conn->in_start, *nl, *target, *version, *query;
+	char path[HTTPD_MAX_HEADER], *fields;
+	bool expect = false, has_length = false;
+	const char *status;
+
+	conn->env_len = 0;
+	conn->nr_env = 0;
+	conn->envp[0] = NULL;
+	conn->body_left = 0;
+
+	for (char *p = line; p < end; p++)
+		if (*p == '\r' || *p == '\n')
+			*p = '\0';
+	fields = line + strlen(line) + 1;
+
+	/* the request line */
+	target = strchr(line, ' ');
+	if (!target)
+		return "400 Bad Request";
+	*target++ = '\0';
+	version = strchr(target, ' ');
+	if (!version)
+		return "400 Bad Request";
+	*version++ = '\0';
+	if (!strcmp(version, "HTTP/1.1"))
+		conn->keep_alive = true;
+	else if (!strcmp(version, "HTTP/1.0"))
+		conn->keep_alive = false;
+	else
+		return "505 HTTP Version Not Supported";
+	conn->head = !strcmp(line, "HEAD");
+
+	query = strchr(target, '?');
+	if (!decode_path(target, query ? query - target : strlen(target),
+			 path))
+		return "400 Bad Request";
+
+	if (!env_add(conn, "REQUEST_METHOD", line, strlen(line)) ||
+	    !env_add(conn, "REQUEST_URI", target, strlen(target)) ||
+	    !env_add(conn, "DOCUMENT_URI", path, strlen(path)) ||
+	    !env_add(conn, "QUERY_STRING", query ? query + 1 : "",
+		     query ? strlen(query + 1) : 0))
+		return "431 Request Header Fields Too Large";
+
+	for (line = fields; line < end; line = nl + 1) {
+		nl = line + strlen(line);
+		if (*line == '\0')
+			continue;
+		if (!strncasecmp(line, "Content-Length:", 15))
+			has_length = true;
+		status = parse_field(conn, line, &expect);
+		if (status)
+			return status;
+	}
+
+	/* the drivers take an empty CONTENT_LENGTH for none */
+	if (!has_length && !env_add(conn, "CONTENT_LENGTH", "", 0))
+		return "431 Request Header Fields Too Large";
+
+	conn->in_start = end - conn->in;
+	if (expect && conn->body_left) {
+		char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+		struct iovec iov = { cont, sizeof(cont) - 1 };
+
+		httpd_writev(conn, &iov, 1);
+	}
+	return NULL;
+}
+
+/*
+ * Read the header of the next request.  Return the end of the header, or NULL
+ * with *status set to reject the request, or to NULL if the connection is
+ * closed.
+ */
+static char *read_request(struct http_conn *conn, const char **status)
+{
+	char *end;
+	ssize_t ret;
+
+	*status = NULL;
+	/* the blank lines between the requests are allowed */
+	while (conn->in_start < conn->in_end &&
+	       (conn->in[conn->in_start] == '\r' ||
+		conn->in[conn->in_start] == '\n'))
+		conn->in_start++;
+	memmove(conn->in, conn->in + conn->in_start,
+		conn->in_end - conn->in_start);
+	conn->in_end -= conn->in_start;
+	conn->in_start = 0;
+
+	for (;;) {
+		end = header_end(conn->in, conn->in_end);
+		if (end)
+			return end;
+		if (conn->in_end == sizeof(conn->in)) {
+			*status = "431 Request Header Fields Too Large";
+			return NULL;
+		}
+
+		ret = read(conn->fd, conn->in + conn->in_end,
+			   sizeof(conn->in) - conn->in_end);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret < 0 || conn->in_end)
+				sd_debug("the connection %d is closed, %m",
+					 conn->fd);
+			return NULL;
+		}
+		conn->in_end += ret;
+	}
+}
+
+int httpd_read(struct http_conn *conn, void *buf, int len)
+{
+	size_t want = min((uint64_t)len, conn->body_left), done;
+	ssize_t ret;
+
+	done = min(want, conn->in_end - conn->in_start);
+	memcpy(buf, conn->in + conn->in_start, done);
+	conn->in_start += done;
+
+	while (done < want) {
+		ret = read(conn->fd, (char *)buf + done, want - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			sd_err("failed to read from %d, %m", conn->fd);
+			conn->keep_alive = false;
+			if (!done)
+				return -1;
+			break;
+		}
+		done += ret;
+	}
+	conn->body_left -= done;
+	return done;
+}
+
+/* Translate the CGI header of the response from p to end */
+static void parse_response(struct http_conn *conn, const char *p,
+			   const char *end)
+{
+	const char *status = "200 OK", *line, *nl;
+	size_t status_len = strlen(status), len;
+	int code;
+
+	for (line = p; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		len = nl - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		if (!strncasecmp(line, "Status:", 7)) {
+			status = line + 7 + strspn(line + 7, " ");
+			status_len = line + len - status;
+		}
+	}
+
+	strbuf_addstr(&conn->hdr, "HTTP/1.1 ");
+	strbuf_add(&conn->hdr, status, status_len);
+	strbuf_addstr(&conn->hdr, "\r\n");
+	code = atoi(status);
+	conn->no_body = conn->head || code < 200 || code == 204 || code == 304;
+
+	for (line = p; line < end; line = nl + 1) {
+		nl = memchr(line, '\n', end - line);
+		len = nl - line;
+		if (len && line[len - 1] == '\r')
+			len--;
+		if (len == 0 || !strncasecmp(line, "Status:", 7))
+			continue;
+		if (!strncasecmp(line, "Content-Length:", 15)) {
+			conn->has_length = true;
+			conn->body_length = strtoull(line + 15, NULL, 10);
+		}
+		strbuf_add(&conn->hdr, line, len);
+		strbuf_addstr(&conn->hdr, "\r\n");
+	}
+	conn->hdr_parsed = true;
+}
+
+/* Complete the header before it is sent with the body, if any */
+static void finish_header(struct http_conn *conn, bool empty_body)
+{
+	if (conn->body_left > HTTPD_MAX_DISCARD)
+		conn->keep_alive = false;
+	/* the close ends the body for the clients of HTTP/1.0 too */
+	if (!conn->has_length && !conn->no_body) {
+		if (empty_body)
+			strbuf_addstr(&conn->hdr, "Content-Length: 0\r\n");
+		else if (conn->keep_alive) {
+			conn->chunked = true;
+			strbuf_addstr(&conn->hdr,
+				      "Transfer-Encoding: chunked\r\n");
+		}
+	}
+	strbuf_addstr(&conn->hdr, conn->keep_alive ?
+		      "Connection: keep-alive\r\n\r\n" :
+		      "Connection: close\r\n\r\n");
+}
+
+static int send_body(struct http_conn *conn, const void *buf, size_t len)
+{
+	struct iovec iov[4];
+	char chunk[32];
+	int n = 0;
+
+	if (conn->no_body || len == 0)
+		return 0;
+	if (conn->has_length && conn->hdr_sent &&
+	    conn->body_sent >= conn->body_length)
+		return 0;
+
+	if (!conn->hdr_sent) {
+		finish_header(conn, false);
+		iov[n].iov_base = conn->hdr.buf;
+		iov[n++].iov_len = conn->hdr.len;
+		conn->hdr_sent = true;
+	}
+	if (conn->chunked) {
+		iov[n].iov_base = chunk;
+		iov[n++].iov_len = snprintf(chunk, sizeof(chunk), "%zx\r\n",
+					    len);
+	} else if (conn->has_length)
+		/* the body is cut to its Content-Length */
+		len = min((uint64_t)len, conn->body_length - conn->body_sent);
+	iov[n].iov_base = (void *)buf;
+	iov[n++].iov_len = len;
+	if (conn->chunked) {
+		iov[n].iov_base = (void *)"\r\n";
+		iov[n++].iov_len = 2;
+	}
+
+	conn->body_sent += len;
+	return httpd_writev(conn, iov, n);
+}
+
+int httpd_write(struct http_conn *conn, const void *buf, int len)
+{
+	char *end;
+
+	if (conn->hdr_parsed)
+		return send_body(conn, buf, len) < 0 ? -1 : len;
+
+	strbuf_add(&conn->cgi, buf, len);
+	end = header_end(conn->cgi.buf, conn->cgi.len);
+	if (!end)
+		return len;
+
+	parse_response(conn, conn->cgi.buf, end);
+	if (send_body(conn, end, conn->cgi.buf + conn->cgi.len - end) < 0)
+		return -1;
+	return len;
+}
+
+/* Complete the response to the request on the connection */
+void httpd_end_request(struct http_conn *conn)
+{
+	const char *last_chunk = "0\r\n\r\n";
+	struct iovec iov[2];
+	int n = 0;
+
+	if (!conn->hdr_parsed) {
+		sd_err("the response has no end of its header");
+		httpd_reject(conn, "500 Internal Server Error");
+		goto out;
+	}
+
+	/* the client can't tell the end of a short body but by the close */
+	if (conn->has_length && !conn->no_body &&
+	    conn->body_sent != conn->body_length)
+		conn->keep_alive = false;
+
+	if (!conn->hdr_sent) {
+		finish_header(conn, true);
+		iov[n].iov_base = conn->hdr.buf;
+		iov[n++].iov_len = conn->hdr.len;
+	}
+	if (conn->chunked) {
+		iov[n].iov_base = (void *)last_chunk;
+		iov[n++].iov_len = strlen(last_chunk);
+	}
+	if (n)
+		httpd_writev(conn, iov, n);
+out:
+	strbuf_reset(&conn->cgi);
+	strbuf_reset(&conn->hdr);
+	conn->hdr_parsed = conn->hdr_sent = false;
+	conn->no_body = conn->chunked = conn->has_length = false;
+	conn->body_length = conn->body_sent = 0;
+}
+
+/*
+ * Close the connection without the end of a chunked body cut short by an
+ * error, which the client could take for the whole of it
+ */
+void httpd_abort_request(struct http_conn *conn)
+{
+	conn->keep_alive = false;
+	conn->chunked = false;
+}
+
+/* Drop what is left of the request body to read the next request */
+static void discard_body(struct http_conn *conn)
+{
+	char buf[4096];
+
+	if (conn->body_left > HTTPD_MAX_DISCARD)
+		conn->keep_alive = false;
+	while (conn->keep_alive && conn->body_left)
+		if (httpd_read(conn, buf, sizeof(buf)) <= 0)
+			conn->keep_alive = false;
+}
+
+static void httpd_conn_work(struct work *work)
+{
+	struct http_conn *conn = container_of(work, struct http_conn, work);
+	struct http_request *req;
+	const char *status;
+	char *end;
+
+	end = read_request(conn, &status);
+	if (end)
+		status = parse_request(conn, end);
+	else
+		conn->keep_alive = false;
+	if (status) {
+		httpd_reject(conn, status);
+		return;
+	}
+	if (!end)
+		return;
+
+	req = xzalloc(sizeof(*req));
+	req->conn = conn;
+	req->envp = conn->envp;
+	req->start = conn->queued;
+	http_serve_request(req);
+
+	discard_body(conn);
+}
+
+static void httpd_conn_handler(int fd, int events, void *data);
+
+static void httpd_conn_done(struct work *work)
+{
+	struct http_conn *conn = container_of(work, struct http_conn, work);
+
+	if (!conn->keep_alive) {
+		httpd_conn_close(conn);
+		return;
+	}
+
+	/* the client sent the next request already */
+	if (conn->in_end > conn->in_start) {
+		conn->queued = clock_get_time();
+		queue_work(sys->http_wqueue, &conn->work);
+		return;
+	}
+
+	if (register_event(conn->fd, httpd_conn_handler, conn) < 0)
+		httpd_conn_close(conn);
+}
+
+static void httpd_conn_handler(int fd, int events, void *data)
+{
+	struct http_conn *conn = data;
+
+	/* the worker takes the connection up to the end of the request */
+	unregister_event(fd);
+	conn->queued = clock_get_time();
+	queue_work(sys->http_wqueue, &conn->work);
+}
+
+static int httpd_set_timeout(int fd)
+{
+	struct timeval timeout = { .tv_sec = MAX_POLLTIME };
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		       sizeof(timeout)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		       sizeof(timeout)) < 0) {
+		sd_err("failed to set the timeout, %m");
+		return -1;
+	}
+	return 0;
+}
+
+static void httpd_listen_handler(int listen_fd, int events, void *data)
+{
+	struct http_conn *conn;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		sd_err("failed to accept a new http connection: %m");
+		return;
+	}
+	if (set_nodelay(fd) < 0 || set_keepalive(fd) < 0 ||
+	    httpd_set_timeout(fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	conn = xzalloc(sizeof(*conn));
+	conn->fd = fd;
+	conn->work.fn = httpd_conn_work;
+	conn->work.done = httpd_conn_done;
+	strbuf_init(&conn->cgi, 0);
+	strbuf_init(&conn->hdr, 0);
+	if (register_event(fd, httpd_conn_handler, conn) < 0) {
+		httpd_conn_close(conn);
+		return;
+	}
+	sd_debug("accepted a new http connection: %d", fd);
+}
+
+static int httpd_listen_fn(int fd, void *data)
+{
+	return register_event(fd, httpd_listen_handler, data);
+}
+
+int httpd_init(const char *host, const char *port)
+{
+	if (create_listen_ports(host, atoi(port), httpd_listen_fn, NULL))
+		return -1;
+
+	sd_info("http service listen at %s:%s, HTTP/1.1", host, port);
+	return 0;
+}
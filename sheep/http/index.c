@@ -0,0 +1,575 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sorted index of the objects of a bucket
+ *
+ * The onodes are hashed to the slots of the bucket vdi, so a listing in the
+ * order of the names would read and sort all of them.  The index vdi of a
+ * bucket keeps the names sorted in a B+tree of two levels: the root, the
+ * first object, holds the separators of the leaves, and a leaf holds up to
+ * INDEX_LEAF_SIZE bytes of names.  A listing seeks the leaf of its marker or
+ * prefix and reads the leaves in order, and skips a common prefix of the
+ * delimiter by a seek past it, so a page costs the leaves it covers.
+ *
+ * A full leaf is split in two, and the separator of the new leaf is the
+ * shortest prefix of its first name.  The new leaf is written before the
+ * root, and a leaf is read up to the separator of the next one, so a split
+ * cut short leaves no duplicate names.
+ *
+ * The index is updated under its own lock when an onode is created or
+ * deleted.  The buckets created before the index have no index vdi and are
+ * listed by a scan of their onodes.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+#define INDEX_LEAF_SIZE (256 * 1024)
+#define INDEX_ROOT_IDX 0
+
+struct index_hdr {
+	uint32_t nr;
+	uint32_t used; /* bytes of the entries */
+	uint64_t next_leaf; /* idx of the next leaf to create, in the root */
+};
+
+/* The leaf is 0 in the entries of the leaves */
+struct index_entry {
+	uint32_t leaf;
+	uint16_t len;
+	char name[];
+} __packed;
+
+struct index_node {
+	uint32_t vid;
+	uint64_t idx;
+	uint32_t size; /* of the node, header included */
+	char *buf;
+};
+
+static inline struct index_hdr *node_hdr(const struct index_node *node)
+{
+	return (struct index_hdr *)node->buf;
+}
+
+static inline struct index_entry *node_entry(const struct index_node *node,
+					     uint32_t off)
+{
+	return (struct index_entry *)(node->buf + sizeof(struct index_hdr) +
+				      off);
+}
+
+static inline uint32_t entry_size(const struct index_entry *e)
+{
+	return sizeof(*e) + e->len;
+}
+
+static int entry_cmp(const struct index_entry *e, const char *name,
+		     size_t len)
+{
+	int ret = memcmp(e->name, name, e->len < len ? e->len : len);
+
+	return ret ? ret : intcmp((size_t)e->len, len);
+}
+
+static int node_read(uint32_t vid, uint64_t idx, struct index_node *node)
+{
+	uint64_t oid = vid_to_data_oid(vid, idx);
+	struct index_hdr *hd;
+	int ret;
+
+	node->vid = vid;
+	node->idx = idx;
+	node->size = idx == INDEX_ROOT_IDX ? SD_DATA_OBJ_SIZE : INDEX_LEAF_SIZE;
+	free(node->buf);
+	node->buf = xmalloc(node->size);
+
+	hd = node_hdr(node);
+	ret = sd_read_object(oid, node->buf, sizeof(*hd), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read index %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		return ret;
+	}
+	if (hd->used > node->size - sizeof(*hd)) {
+		sd_err("bad index %" PRIx64, oid);
+		return SD_RES_EIO;
+	}
+	if (!hd->used)
+		return SD_RES_SUCCESS;
+
+	ret = sd_read_object(oid, node->buf + sizeof(*hd), hd->used,
+			     sizeof(*hd));
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to read index %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
+/* Write the entries of the node from off on, then the header */
+static int node_write(const struct index_node *node, uint32_t off)
+{
+	uint64_t oid = vid_to_data_oid(node->vid, node->idx);
+	struct index_hdr *hd = node_hdr(node);
+	int ret = SD_RES_SUCCESS;
+
+	if (off < hd->used)
+		ret = sd_write_object(oid, (char *)node_entry(node, off),
+				      hd->used - off, sizeof(*hd) + off,
+				      false);
+	if (ret == SD_RES_SUCCESS)
+		ret = sd_write_object(oid, node->buf, sizeof(*hd), 0, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update index %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
+static int node_create(const struct index_node *node)
+{
+	uint64_t oid = vid_to_data_oid(node->vid, node->idx);
+	struct sd_inode *inode = xmalloc(sizeof(*inode));
+	int ret;
+
+	ret = sd_write_object(oid, node->buf,
+			      sizeof(struct index_hdr) + node_hdr(node)->used,
+			      0, true);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to create index %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	ret = sd_read_object(vid_to_vdi_oid(node->vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode, %" PRIx32 ", %s", node->vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+	sd_inode_set_vid(inode, node->idx, node->vid);
+	ret = sd_inode_write_vid(inode, node->idx, node->vid, node->vid, 0,
+				 false, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update inode, %" PRIx32 ", %s", node->vid,
+		       sd_strerror(ret));
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Return the offset of the first entry not less than the name, and whether
+ * it is the name in found
+ */
+static uint32_t node_lower_bound(const struct index_node *node,
+				 const char *name, size_t len, bool *found)
+{
+	struct index_hdr *hd = node_hdr(node);
+	struct index_entry *e;
+	uint32_t off;
+	int cmp = 1;
+
+	for (off = 0; off < hd->used; off += entry_size(e)) {
+		e = node_entry(node, off);
+		cmp = entry_cmp(e, name, len);
+		if (cmp >= 0)
+			break;
+	}
+	if (found)
+		*found = off < hd->used && cmp == 0;
+	return off;
+}
+
+/* Return the offset of the entry of the root for the leaf of the name */
+static uint32_t root_find(const struct index_node *root, const char *name,
+			  size_t len)
+{
+	struct index_hdr *hd = node_hdr(root);
+	struct index_entry *e;
+	uint32_t off, prev = 0;
+
+	/* the separator of the first leaf is empty */
+	for (off = 0; off < hd->used; off += entry_size(e)) {
+		e = node_entry(root, off);
+		if (entry_cmp(e, name, len) > 0)
+			break;
+		prev = off;
+	}
+	return prev;
+}
+
+/* Return the entry next to the one at off, NULL for the last one */
+static struct index_entry *node_next(const struct index_node *node,
+				     uint32_t off)
+{
+	off += entry_size(node_entry(node, off));
+	return off < node_hdr(node)->used ? node_entry(node, off) : NULL;
+}
+
+static void node_insert(struct index_node *node, uint32_t off, uint32_t leaf,
+			const char *name, size_t len)
+{
+	struct index_hdr *hd = node_hdr(node);
+	struct index_entry *e = node_entry(node, off);
+
+	memmove((char *)e + sizeof(*e) + len, e, hd->used - off);
+	e->leaf = leaf;
+	e->len = len;
+	memcpy(e->name, name, len);
+	hd->used += sizeof(*e) + len;
+	hd->nr++;
+}
+
+static void node_remove(struct index_node *node, uint32_t off)
+{
+	struct index_hdr *hd = node_hdr(node);
+	struct index_entry *e = node_entry(node, off);
+	uint32_t size = entry_size(e);
+
+	memmove(e, (char *)e + size, hd->used - off - size);
+	hd->used -= size;
+	hd->nr--;
+}
+
+static inline bool node_fits(const struct index_node *node, size_t len)
+{
+	return node_hdr(node)->used + sizeof(struct index_entry) + len <=
+		node->size - sizeof(struct index_hdr);
+}
+
+/*
+ * Split the leaf at roff of the root, whose entries are in the buffer of
+ * INDEX_LEAF_SIZE * 2 bytes and changed from the offset from on, in two
+ * halves
+ */
+static int leaf_split(struct index_node *root, uint32_t roff,
+		      struct index_node *leaf, uint32_t from)
+{
+	struct index_hdr *hd = node_hdr(leaf), *rhd = node_hdr(root);
+	struct index_node right = {
+		.vid = leaf->vid,
+		.idx = rhd->next_leaf,
+		.size = INDEX_LEAF_SIZE,
+	};
+	struct index_entry *last = NULL, *first, *e;
+	uint32_t off, nr = 0, sep_len = 0;
+	int ret;
+
+	for (off = 0; off < hd->used / 2; off += entry_size(e), nr++) {
+		e = node_entry(leaf, off);
+		last = e;
+	}
+	first = node_entry(leaf, off);
+	/* the shortest prefix of the first name above the last one */
+	while (sep_len < last->len && sep_len < first->len &&
+	       last->name[sep_len] == first->name[sep_len])
+		sep_len++;
+	sep_len++;
+
+	if (!node_fits(root, sep_len))
+		return SD_RES_NO_SPACE;
+
+	right.buf = xzalloc(INDEX_LEAF_SIZE);
+	node_hdr(&right)->nr = hd->nr - nr;
+	node_hdr(&right)->used = hd->used - off;
+	memcpy(node_entry(&right, 0), first, hd->used - off);
+	ret = node_create(&right);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	rhd->next_leaf++;
+	roff += entry_size(node_entry(root, roff));
+	node_insert(root, roff, right.idx, first->name, sep_len);
+	ret = node_write(root, roff);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	hd->nr = nr;
+	hd->used = off;
+	ret = node_write(leaf, min(from, off));
+out:
+	free(right.buf);
+	return ret;
+}
+
+/*
+ * Initialize the index vdi with an empty leaf
+ *
+ * @vid: the vdi where the index resides
+ */
+int kv_index_init(uint32_t vid)
+{
+	struct index_node root = {
+		.vid = vid,
+		.idx = INDEX_ROOT_IDX,
+		.size = SD_DATA_OBJ_SIZE,
+	};
+	struct index_node leaf = {
+		.vid = vid,
+		.idx = INDEX_ROOT_IDX + 1,
+		.size = INDEX_LEAF_SIZE,
+	};
+	int ret;
+
+	leaf.buf = xzalloc(sizeof(struct index_hdr));
+	ret = node_create(&leaf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	root.buf = xzalloc(sizeof(struct index_hdr) +
+			   sizeof(struct index_entry));
+	node_hdr(&root)->next_leaf = leaf.idx + 1;
+	node_insert(&root, 0, leaf.idx, NULL, 0);
+	ret = node_create(&root);
+out:
+	free(leaf.buf);
+	free(root.buf);
+	return ret;
+}
+
+/* Add the name to the index, if it isn't there */
+int kv_index_insert(uint32_t vid, const char *name)
+{
+	struct index_node root = {}, leaf = {};
+	size_t len = strlen(name);
+	uint32_t roff, off;
+	bool found;
+	int ret;
+
+	sys->cdrv->lock(vid);
+	ret = node_read(vid, INDEX_ROOT_IDX, &root);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	roff = root_find(&root, name, len);
+	ret = node_read(vid, node_entry(&root, roff)->leaf, &leaf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	off = node_lower_bound(&leaf, name, len, &found);
+	if (found)
+		goto out;
+
+	if (node_fits(&leaf, len)) {
+		node_insert(&leaf, off, 0, name, len);
+		ret = node_write(&leaf, off);
+		goto out;
+	}
+
+	/* split the leaf with the name in it */
+	leaf.buf = xrealloc(leaf.buf, INDEX_LEAF_SIZE * 2);
+	node_insert(&leaf, off, 0, name, len);
+	ret = leaf_split(&root, roff, &leaf, off);
+out:
+	sys->cdrv->unlock(vid);
+	free(root.buf);
+	free(leaf.buf);
+	return ret;
+}
+
+/* Remove the name from the index, if it is there */
+int kv_index_remove(uint32_t vid, const char *name)
+{
+	struct index_node root = {}, leaf = {};
+	size_t len = strlen(name);
+	uint32_t roff, off;
+	bool found;
+	int ret;
+
+	sys->cdrv->lock(vid);
+	ret = node_read(vid, INDEX_ROOT_IDX, &root);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	roff = root_find(&root, name, len);
+	ret = node_read(vid, node_entry(&root, roff)->leaf, &leaf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	off = node_lower_bound(&leaf, name, len, &found);
+	if (!found)
+		goto out;
+	node_remove(&leaf, off);
+	ret = node_write(&leaf, off);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	/* drop an empty leaf but the first one, the object stays */
+	if (!node_hdr(&leaf)->nr && roff) {
+		node_remove(&root, roff);
+		ret = node_write(&root, roff);
+	}
+out:
+	sys->cdrv->unlock(vid);
+	free(root.buf);
+	free(leaf.buf);
+	return ret;
+}
+
+enum page_next {
+	PAGE_NEXT,
+	PAGE_SKIP, /* the names of the last common prefix */
+	PAGE_STOP,
+};
+
+static void page_init(struct kv_list *list)
+{
+	const char *d;
+
+	if (!list->prefix)
+		list->prefix = "";
+	list->nr = 0;
+	list->truncated = false;
+	list->last_prefix[0] = '\0';
+
+	/* the common prefix of the marker is on the last page */
+	if (!list->delimiter || !list->marker ||
+	    strncmp(list->marker, list->prefix, strlen(list->prefix)))
+		return;
+	d = strchr(list->marker + strlen(list->prefix), list->delimiter);
+	if (d)
+		pstrcpy(list->last_prefix,
+			min((size_t)(d - list->marker + 2),
+			    sizeof(list->last_prefix)),
+			list->marker);
+}
+
+/* Add the name, above the marker and not below the prefix, to the page */
+static enum page_next page_add(struct kv_list *list, const char *name)
+{
+	size_t plen = strlen(list->prefix), len;
+	const char *d;
+
+	if (strncmp(name, list->prefix, plen))
+		return strcmp(name, list->prefix) > 0 ? PAGE_STOP : PAGE_NEXT;
+
+	d = list->delimiter ? strchr(name + plen, list->delimiter) : NULL;
+	if (d) {
+		len = d - name + 1;
+		if (!strncmp(list->last_prefix, name, len) &&
+		    list->last_prefix[len] == '\0')
+			return PAGE_SKIP;
+	}
+
+	if (list->nr == list->max_keys) {
+		list->truncated = true;
+		return PAGE_STOP;
+	}
+	list->nr++;
+	if (!d) {
+		list->cb(name, false, list->opaque);
+		return PAGE_NEXT;
+	}
+	pstrcpy(list->last_prefix, len + 1, name);
+	list->cb(list->last_prefix, true, list->opaque);
+	return PAGE_SKIP;
+}
+
+/* List a page of the sorted names */
+void kv_list_names(struct kv_list *list, char **names, size_t nr)
+{
+	page_init(list);
+	for (size_t i = 0; i < nr; i++) {
+		if (list->marker && strcmp(names[i], list->marker) <= 0)
+			continue;
+		if (strcmp(names[i], list->prefix) < 0)
+			continue;
+		if (page_add(list, names[i]) == PAGE_STOP)
+			break;
+	}
+}
+
+/*
+ * Set the key to the first name above the ones of the last common prefix, or
+ * above the name if there is no such key
+ */
+static size_t page_skip_key(const struct kv_list *list, const char *name,
+			    char *key)
+{
+	size_t len = strlen(list->last_prefix);
+
+	if ((unsigned char)list->delimiter != UCHAR_MAX) {
+		memcpy(key, list->last_prefix, len);
+		key[len - 1]++;
+		return len;
+	}
+	len = strlen(name);
+	memcpy(key, name, len + 1);
+	return len + 1;
+}
+
+/* List a page of the names of the index */
+int kv_index_list(uint32_t vid, struct kv_list *list)
+{
+	char key[SD_MAX_OBJECT_NAME + 1], name[SD_MAX_OBJECT_NAME + 1];
+	struct index_node root = {}, leaf = {};
+	struct index_entry *e, *sep;
+	uint32_t roff, off;
+	size_t klen;
+	int ret;
+
+	page_init(list);
+	if (list->marker && strcmp(list->marker, list->prefix) >= 0) {
+		/* the first name above the marker */
+		pstrcpy(key, sizeof(key) - 1, list->marker);
+		klen = strlen(key) + 1;
+	} else {
+		pstrcpy(key, sizeof(key), list->prefix);
+		klen = strlen(key);
+	}
+
+	sys->cdrv->lock(vid);
+	ret = node_read(vid, INDEX_ROOT_IDX, &root);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	for (;;) {
+		roff = root_find(&root, key, klen);
+		e = node_entry(&root, roff);
+		if (!leaf.buf || leaf.idx != e->leaf) {
+			ret = node_read(vid, e->leaf, &leaf);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
+		sep = node_next(&root, roff);
+
+		off = node_lower_bound(&leaf, key, klen, NULL);
+		for (; off < node_hdr(&leaf)->used; off += entry_size(e)) {
+			e = node_entry(&leaf, off);
+			/* left by a split cut short */
+			if (sep && entry_cmp(e, sep->name, sep->len) >= 0)
+				break;
+
+			memcpy(name, e->name, e->len);
+			name[e->len] = '\0';
+			switch (page_add(list, name)) {
+			case PAGE_NEXT:
+				continue;
+			case PAGE_SKIP:
+				klen = page_skip_key(list, name, key);
+				goto next;
+			case PAGE_STOP:
+				goto out;
+			}
+		}
+		if (!sep)
+			goto out;
+		klen = sep->len;
+		memcpy(key, sep->name, klen);
+next:
+		;
+	}
+out:
+	sys->cdrv->unlock(vid);
+	free(root.buf);
+	free(leaf.buf);
+	return ret;
+}
@@ -17,6 +17,7 @@
 #include "http.h"
 
 uint64_t kv_rw_buffer = DEFAULT_KV_RW_BUFFER;
+uint64_t kv_inline_size = KV_MAX_INLINE_SIZE;
 
 struct kv_bnode {
 	char name[SD_MAX_BUCKET_NAME];
@@ -57,6 +58,9 @@ struct onode_extent {
 
 #define ONODE_HDR_SIZE  BLOCK_SIZE
 
+/* the objects of the parts of the multipart uploads, see kv_create_part() */
+#define KV_PART_PREFIX ".multipart/"
+
 struct kv_onode {
 	union {
 		struct {
@@ -89,6 +93,7 @@ struct bucket_iterater_arg {
 	uint64_t bucket_count;
 	uint64_t object_count;
 	uint64_t bytes_used;
+	const char *account; /* to add the deltas not flushed yet */
 };
 
 /* Account operations */
@@ -123,6 +128,7 @@ static void bucket_iterater(struct sd_index *idx, void *arg, int ignore)
 {
 	struct bucket_iterater_arg *biarg = arg;
 	struct kv_bnode bnode;
+	int64_t objects = 0, bytes = 0;
 	uint64_t oid;
 	int ret;
 
@@ -140,16 +146,18 @@ static void bucket_iterater(struct sd_index *idx, void *arg, int ignore)
 		return;
 	if (biarg->cb)
 		biarg->cb(bnode.name, biarg->opaque);
+	if (biarg->account)
+		kv_usage_peek(biarg->account, bnode.name, &objects, &bytes);
 	biarg->bucket_count++;
-	biarg->object_count += bnode.object_count;
-	biarg->bytes_used += bnode.bytes_used;
+	biarg->object_count += bnode.object_count + objects;
+	biarg->bytes_used += bnode.bytes_used + bytes;
 }
 
 static int read_account_meta(const char *account, uint64_t *bucket_count,
 			     uint64_t *object_count, uint64_t *used)
 {
 	struct sd_inode *inode = NULL;
-	struct bucket_iterater_arg arg = {};
+	struct bucket_iterater_arg arg = { .account = account };
 	uint32_t account_vid;
 	uint64_t oid;
 	int ret;
@@ -273,6 +281,131 @@ out:
 	return ret;
 }
 
+/*
+ * Check the slots of a cached lookup of the name in the vdi.  Return
+ * SD_RES_SUCCESS with the node in buf, SD_RES_NO_OBJ if the name is still
+ * missing, or SD_RES_AGAIN if the slots changed since.
+ */
+static int slot_validate(const char *name, char *buf, size_t len,
+			 const struct kv_lookup *lookup)
+{
+	char slot_name[SD_MAX_OBJECT_NAME];
+	size_t name_len = min(len, sizeof(slot_name));
+	int i, ret;
+
+	if (lookup->found) {
+		ret = sd_read_object(lookup->oids[lookup->nr - 1], buf, len, 0);
+		if (ret != SD_RES_SUCCESS)
+			return ret == SD_RES_NO_OBJ ? SD_RES_AGAIN : ret;
+		return strcmp(buf, name) ? SD_RES_AGAIN : SD_RES_SUCCESS;
+	}
+
+	for (i = 0; i < lookup->nr - 1; i++) {
+		ret = sd_read_object(lookup->oids[i], slot_name, name_len, 0);
+		if (ret != SD_RES_SUCCESS)
+			return ret == SD_RES_NO_OBJ ? SD_RES_AGAIN : ret;
+		/* created in a slot deleted before */
+		if (strncmp(slot_name, name, name_len) == 0)
+			return SD_RES_AGAIN;
+	}
+	/* the hole ends the probe as long as nothing is created there */
+	ret = sd_read_object(lookup->oids[i], slot_name, name_len, 0);
+	switch (ret) {
+	case SD_RES_NO_OBJ:
+		return SD_RES_NO_OBJ;
+	case SD_RES_SUCCESS:
+		return SD_RES_AGAIN;
+	default:
+		return ret;
+	}
+}
+
+/*
+ * Probe the slots of the vdi from the hash of the name up to the name or a
+ * hole, and record them in lookup
+ */
+static int slot_probe(uint32_t vid, const char *name, char *buf, size_t len,
+		      struct kv_lookup *lookup)
+{
+	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
+	char slot_name[SD_MAX_OBJECT_NAME];
+	size_t name_len = min(len, sizeof(slot_name));
+	uint32_t idx;
+	uint64_t hval, i, oid;
+	int ret;
+
+	lookup->nr = 0;
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %" PRIx32 " %s", vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	hval = sd_hash(name, strlen(name));
+	for (i = 0; i < MAX_DATA_OBJS; i++) {
+		idx = (hval + i) % MAX_DATA_OBJS;
+		oid = vid_to_data_oid(vid, idx);
+		if (i < KV_CACHE_PROBES)
+			lookup->oids[i] = oid;
+		if (!sd_inode_get_vid(inode, idx)) {
+			ret = SD_RES_NO_OBJ;
+			break;
+		}
+
+		/* the name is enough to skip the slot */
+		ret = sd_read_object(oid, slot_name, name_len, 0);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		if (strncmp(slot_name, name, name_len) == 0) {
+			ret = sd_read_object(oid, buf, len, 0);
+			break;
+		}
+	}
+	if (i == MAX_DATA_OBJS) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	lookup->found = ret == SD_RES_SUCCESS;
+	if (i < KV_CACHE_PROBES)
+		lookup->nr = i + 1;
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Look up the node of the name in the vdi into buf, which has the name at the
+ * start.  The slots probed the last time are checked first.
+ */
+static int slot_lookup(uint32_t vid, const char *name, char *buf, size_t len)
+{
+	struct kv_lookup lookup;
+	int ret;
+
+	if (kv_cache_get(vid, name, &lookup)) {
+		ret = slot_validate(name, buf, len, &lookup);
+		if (ret != SD_RES_AGAIN)
+			return ret;
+		uatomic_inc(&sys->stat.kv_cache.stale);
+	}
+
+	ret = slot_probe(vid, name, buf, len, &lookup);
+	if (ret == SD_RES_SUCCESS || ret == SD_RES_NO_OBJ)
+		kv_cache_put(vid, name, &lookup);
+	return ret;
+}
+
+/* Cache the node created at oid for the lookups of its name */
+static void slot_created(uint32_t vid, const char *name, uint64_t oid)
+{
+	struct kv_lookup lookup = { .found = true, .nr = 1, .oids = { oid } };
+
+	kv_cache_put(vid, name, &lookup);
+}
+
 static int bnode_create(struct kv_bnode *bnode, uint32_t account_vid)
 {
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
@@ -314,6 +447,8 @@ static int bnode_create(struct kv_bnode *bnode, uint32_t account_vid)
 
 create:
 	ret = bnode_do_create(bnode, inode, idx, create);
+	if (ret == SD_RES_SUCCESS)
+		slot_created(account_vid, bnode->name, bnode->oid);
 out:
 	free(inode);
 	return ret;
@@ -324,6 +459,7 @@ static int bucket_create(const char *account, uint32_t account_vid,
 {
 	char onode_name[SD_MAX_VDI_LEN];
 	char alloc_name[SD_MAX_VDI_LEN];
+	char index_name[SD_MAX_VDI_LEN];
 	struct kv_bnode bnode;
 	uint32_t vid;
 	int ret;
@@ -347,13 +483,27 @@ static int bucket_create(const char *account, uint32_t account_vid,
 		sd_err("Failed to init allocator for bucket %s", bucket);
 		goto err;
 	}
+	snprintf(index_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	ret = sd_create_hyper_volume(index_name, &vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to create bucket %s index vid", bucket);
+		goto err;
+	}
+	ret = kv_index_init(vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to init index for bucket %s", bucket);
+		sd_delete_vdi(index_name);
+		goto err;
+	}
 
 	pstrcpy(bnode.name, sizeof(bnode.name), bucket);
 	bnode.bytes_used = 0;
 	bnode.object_count = 0;
 	ret = bnode_create(&bnode, account_vid);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS) {
+		sd_delete_vdi(index_name);
 		goto err;
+	}
 
 	return SD_RES_SUCCESS;
 err:
@@ -364,92 +514,65 @@ err:
 
 static int bnode_lookup(struct kv_bnode *bnode, uint32_t vid, const char *name)
 {
-	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
-	uint32_t tmp_vid, idx;
-	uint64_t hval, i;
+	return slot_lookup(vid, name, (char *)bnode, sizeof(*bnode));
+}
+
+/* Add the deltas of the usage of the bucket to its bnode */
+static int bnode_add_usage(uint32_t account_vid, const char *bucket,
+			   int64_t objects, int64_t bytes)
+{
+	struct kv_bnode bnode;
 	int ret;
 
-	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
-			     sizeof(*inode), 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read %" PRIx32 " %s", vid,
-		       sd_strerror(ret));
-		goto out;
-	}
+	ret = bnode_lookup(&bnode, account_vid, bucket);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
-	hval = sd_hash(name, strlen(name));
-	for (i = 0; i < MAX_DATA_OBJS; i++) {
-		idx = (hval + i) % MAX_DATA_OBJS;
-		tmp_vid = sd_inode_get_vid(inode, idx);
-		if (tmp_vid) {
-			uint64_t oid = vid_to_data_oid(vid, idx);
-			ret = sd_read_object(oid, (char *)bnode,
-							sizeof(*bnode), 0);
-			if (ret != SD_RES_SUCCESS)
-				goto out;
-			if (strcmp(bnode->name, name) == 0)
-				break;
-		} else {
-			ret = SD_RES_NO_OBJ;
-			break;
-		}
-	}
-	if (i == MAX_DATA_OBJS) {
-		ret = SD_RES_NO_OBJ;
-		goto out;
-	}
+	bnode.object_count += objects;
+	bnode.bytes_used += bytes;
+	ret = sd_write_object(bnode.oid, (char *)&bnode.object_count,
+			      sizeof(bnode.object_count) +
+			      sizeof(bnode.bytes_used),
+			      offsetof(struct kv_bnode, object_count), false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update bnode for %s", bucket);
+	return ret;
+}
 
-out:
-	free(inode);
+/* Flush the deltas of the bucket, with the lock of the account held */
+static int bnode_flush_usage(const char *account, uint32_t account_vid,
+			     const char *bucket)
+{
+	int64_t objects, bytes;
+	int ret;
+
+	kv_usage_take(account, bucket, &objects, &bytes);
+	if (!objects && !bytes)
+		return SD_RES_SUCCESS;
+
+	ret = bnode_add_usage(account_vid, bucket, objects, bytes);
+	if (ret != SD_RES_SUCCESS)
+		kv_usage_add(account, bucket, objects, bytes);
 	return ret;
 }
 
-/*
- * For object create/delete, we can't easily maintain the bnode consistent by
- * playing around the operations order.
- *
- * We should inform the user the deletion failure if bnode_update() fails even
- * though we might delete the onode successfully. Then subsequent 'delete' for
- * the same object won't skew up the bnode metadata.
- * The true fix for the inconsistency (for whatever reason it happens), is a
- * check request that does a server side consistency check. This is left for a
- * future patch.
- *
- * Alternative fix is that we drop the redundant data about bytes_used,
- * object_counts from bnode, and so for "HEAD" operation, we just iterate all
- * the objects. This can't scale if we have huge objects.
- */
-static int bnode_update(const char *account, const char *bucket, uint64_t used,
-			bool create)
+/* Add the deltas of the bucket in the table to its bnode, see usage.c */
+int kv_flush_usage(const char *account, const char *bucket)
 {
 	uint32_t account_vid;
-	struct kv_bnode bnode;
 	int ret;
 
 	ret = sd_lookup_vdi(account, &account_vid);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("Failed to find account %s", account);
-		return ret;
-	}
-
-	ret = bnode_lookup(&bnode, account_vid, bucket);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	if (create) {
-		bnode.object_count++;
-		bnode.bytes_used += used;
-	} else {
-		bnode.object_count--;
-		bnode.bytes_used -= used;
-	}
-
-	ret = sd_write_object(bnode.oid, (char *)&bnode, sizeof(bnode), 0, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update bnode for %s", bucket);
-		return ret;
-	}
-	return SD_RES_SUCCESS;
+	sys->cdrv->lock(account_vid);
+	ret = bnode_flush_usage(account, account_vid, bucket);
+	sys->cdrv->unlock(account_vid);
+	/* the bucket is gone, and its deltas with it */
+	if (ret == SD_RES_NO_OBJ || ret == SD_RES_NO_VDI)
+		kv_usage_recounted(account, bucket);
+	return ret;
 }
 
 static int bucket_delete(const char *account, uint32_t avid, const char *bucket)
@@ -457,13 +580,18 @@ static int bucket_delete(const char *account, uint32_t avid, const char *bucket)
 	struct kv_bnode bnode;
 	char onode_name[SD_MAX_VDI_LEN];
 	char alloc_name[SD_MAX_VDI_LEN];
+	char index_name[SD_MAX_VDI_LEN];
 	char name[SD_MAX_BUCKET_NAME] = {};
 	int ret;
 
 	snprintf(onode_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
 	snprintf(alloc_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account,
 		 bucket);
+	snprintf(index_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
 
+	ret = bnode_flush_usage(account, avid, bucket);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 	ret = bnode_lookup(&bnode, avid, bucket);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
@@ -481,8 +609,11 @@ static int bucket_delete(const char *account, uint32_t avid, const char *bucket)
 		sd_err("failed to zero bnode for %s", bucket);
 		return ret;
 	}
+	kv_cache_drop(avid, bucket);
 	sd_delete_vdi(onode_name);
 	sd_delete_vdi(alloc_name);
+	/* the buckets created before the index have none */
+	sd_delete_vdi(index_name);
 
 	return SD_RES_SUCCESS;
 }
@@ -493,8 +624,15 @@ struct object_iterater_arg {
 	void *opaque;
 	object_iter_cb cb;
 	uint32_t count;
+	/* of the parts to iterate, which are hidden otherwise */
+	const char *prefix;
 };
 
+static inline bool is_part_name(const char *name)
+{
+	return !strncmp(name, KV_PART_PREFIX, strlen(KV_PART_PREFIX));
+}
+
 static void object_iterater(struct sd_index *idx, void *arg, int ignore)
 {
 	struct object_iterater_arg *oiarg = arg;
@@ -516,6 +654,10 @@ static void object_iterater(struct sd_index *idx, void *arg, int ignore)
 
 	if (onode->name[0] == '\0')
 		goto out;
+	if (oiarg->prefix ?
+	    strncmp(onode->name, oiarg->prefix, strlen(oiarg->prefix)) :
+	    is_part_name(onode->name))
+		goto out;
 	if (oiarg->cb)
 		oiarg->cb(onode->name, oiarg->opaque);
 	oiarg->count++;
@@ -523,10 +665,10 @@ out:
 	free(onode);
 }
 
-static int bucket_iterate_object(uint32_t bucket_vid, object_iter_cb cb,
-				 void *opaque)
+static int bucket_iterate_object(uint32_t bucket_vid, const char *prefix,
+				 object_iter_cb cb, void *opaque)
 {
-	struct object_iterater_arg arg = {opaque, cb, 0};
+	struct object_iterater_arg arg = {opaque, cb, 0, prefix};
 	struct sd_inode *inode;
 	int ret;
 
@@ -544,6 +686,144 @@ out:
 	return ret;
 }
 
+struct usage_iterater_arg {
+	uint64_t objects;
+	uint64_t bytes;
+	int ret;
+};
+
+static void usage_iterater(struct sd_index *idx, void *arg, int ignore)
+{
+	struct usage_iterater_arg *uarg = arg;
+	struct kv_onode *onode;
+	uint64_t oid, read_size;
+	int ret;
+
+	if (!idx->vdi_id)
+		return;
+
+	read_size = offsetof(struct kv_onode, size) + sizeof(onode->size);
+	onode = xmalloc(read_size);
+	oid = vid_to_data_oid(idx->vdi_id, idx->idx);
+	ret = sd_read_object(oid, (char *)onode, read_size, 0);
+	if (ret != SD_RES_SUCCESS)
+		uarg->ret = ret;
+	else if (onode->name[0] != '\0') {
+		/* the parts are accounted until they are completed */
+		uarg->objects++;
+		uarg->bytes += onode->size;
+	}
+	free(onode);
+}
+
+/*
+ * Recount the usage of the bucket from its onodes, for the deltas lost by a
+ * crash.  The deltas of the other gateways held meanwhile count twice.
+ */
+int kv_recount_usage(const char *account, const char *bucket)
+{
+	struct usage_iterater_arg arg = {};
+	char vdi_name[SD_MAX_VDI_LEN];
+	uint32_t account_vid, bucket_vid;
+	struct kv_bnode bnode;
+	struct sd_inode *inode;
+	int ret;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	if (ret == SD_RES_SUCCESS)
+		ret = sd_lookup_vdi(account, &account_vid);
+	if (ret != SD_RES_SUCCESS) {
+		if (ret == SD_RES_NO_VDI)
+			kv_usage_recounted(account, bucket);
+		return ret;
+	}
+
+	inode = xmalloc(sizeof(*inode));
+	/* the objects are created and accounted under the lock of the bucket */
+	sys->cdrv->lock(bucket_vid);
+	sys->cdrv->lock(account_vid);
+	ret = sd_read_object(vid_to_vdi_oid(bucket_vid), (char *)inode,
+			     sizeof(struct sd_inode), 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	sd_inode_index_walk(inode, usage_iterater, &arg);
+	ret = arg.ret;
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = bnode_lookup(&bnode, account_vid, bucket);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	bnode.object_count = arg.objects;
+	bnode.bytes_used = arg.bytes;
+	ret = sd_write_object(bnode.oid, (char *)&bnode.object_count,
+			      sizeof(bnode.object_count) +
+			      sizeof(bnode.bytes_used),
+			      offsetof(struct kv_bnode, object_count), false);
+	if (ret == SD_RES_SUCCESS) {
+		kv_usage_recounted(account, bucket);
+		sd_info("recounted %s/%s, %"PRIu64" objects, %"PRIu64" bytes",
+			account, bucket, arg.objects, arg.bytes);
+	}
+out:
+	sys->cdrv->unlock(account_vid);
+	sys->cdrv->unlock(bucket_vid);
+	free(inode);
+	return ret;
+}
+
+struct name_list {
+	char **names;
+	int nr;
+};
+
+static void collect_name(const char *name, void *opaque)
+{
+	struct name_list *nl = opaque;
+
+	nl->names = xrealloc(nl->names, sizeof(*nl->names) * (nl->nr + 1));
+	nl->names[nl->nr++] = xstrdup(name);
+}
+
+static void free_name_list(struct name_list *nl)
+{
+	for (int i = 0; i < nl->nr; i++)
+		free(nl->names[i]);
+	free(nl->names);
+}
+
+/*
+ * Add the name to the index of the bucket, or remove it.  The buckets created
+ * before the index have none.
+ */
+static int index_update(const char *account, const char *bucket,
+			const char *name, bool insert)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	uint32_t index_vid;
+	int ret;
+
+	if (is_part_name(name))
+		return SD_RES_SUCCESS;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &index_vid);
+	if (ret == SD_RES_NO_VDI)
+		return SD_RES_SUCCESS;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (insert)
+		ret = kv_index_insert(index_vid, name);
+	else
+		ret = kv_index_remove(index_vid, name);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update the index of %s for %s, %s", bucket,
+		       name, sd_strerror(ret));
+	return ret;
+}
+
 int kv_create_bucket(const char *account, const char *bucket)
 {
 	uint32_t account_vid, vid;
@@ -578,6 +858,7 @@ int kv_read_bucket(struct http_request *req, const char *account,
 {
 	uint32_t account_vid;
 	struct kv_bnode bnode;
+	int64_t objects, bytes;
 	int ret;
 
 	ret = sd_lookup_vdi(account, &account_vid);
@@ -589,11 +870,12 @@ int kv_read_bucket(struct http_request *req, const char *account,
 	ret = bnode_lookup(&bnode, account_vid, bucket);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
+	kv_usage_peek(account, bucket, &objects, &bytes);
 	http_request_writef(req, "X-Container-Object-Count: %"PRIu64"\n",
-			    bnode.object_count);
+			    bnode.object_count + objects);
 
 	http_request_writef(req, "X-Container-Bytes-Used: %"PRIu64"\n",
-			    bnode.bytes_used);
+			    bnode.bytes_used + bytes);
 out:
 	return ret;
 }
@@ -632,7 +914,7 @@ out:
 int kv_iterate_bucket(const char *account, bucket_iter_cb cb, void *opaque)
 {
 	struct sd_inode *account_inode;
-	struct bucket_iterater_arg arg = {opaque, cb, 0, 0, 0};
+	struct bucket_iterater_arg arg = {opaque, cb, 0, 0, 0, NULL};
 	uint32_t account_vid;
 	uint64_t oid;
 	int ret;
@@ -662,10 +944,13 @@ out:
 
 /* Object operations */
 
-#define KV_ONODE_INLINE_SIZE (SD_DATA_OBJ_SIZE - ONODE_HDR_SIZE)
-
-static int vdi_read_write(uint32_t vid, char *data, size_t length,
-			  off_t offset, bool is_read, bool create)
+/*
+ * Issue the requests to the data objects of the range in parallel, and return
+ * the iocb to wait for them with local_req_wait(), or NULL
+ */
+static struct request_iocb *vdi_read_write_async(uint32_t vid, char *data,
+						 size_t length, off_t offset,
+						 bool is_read, bool create)
 {
 	struct sd_req hdr;
 	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
@@ -675,7 +960,7 @@ static int vdi_read_write(uint32_t vid, char *data, size_t length,
 
 	iocb = local_req_init();
 	if (!iocb)
-		return SD_RES_SYSTEM_ERROR;
+		return NULL;
 
 	offset %= SD_DATA_OBJ_SIZE;
 	while (done < length) {
@@ -709,13 +994,26 @@ static int vdi_read_write(uint32_t vid, char *data, size_t length,
 		create = true;
 	}
 
+	return iocb;
+}
+
+static int vdi_read_write(uint32_t vid, char *data, size_t length,
+			  off_t offset, bool is_read, bool create)
+{
+	struct request_iocb *iocb;
+
+	iocb = vdi_read_write_async(vid, data, length, offset, is_read,
+				    create);
+	if (!iocb)
+		return SD_RES_SYSTEM_ERROR;
+
 	return local_req_wait(iocb);
 }
 
 static int onode_allocate_extents(struct kv_onode *onode,
 				  struct http_request *req)
 {
-	uint64_t start = 0, count, reserv_len = 0;
+	uint64_t start = 0, count, reserv_len = 0, begin = 0;
 	int ret = SD_RES_SUCCESS;
 	uint32_t data_vid = onode->data_vid, idx = onode->nr_extent;
 
@@ -734,9 +1032,8 @@ static int onode_allocate_extents(struct kv_onode *onode,
 			onode->o_extent[idx - 1].data_len += reserv_len;
 	}
 	count = DIV_ROUND_UP((req->data_length - reserv_len), SD_DATA_OBJ_SIZE);
-	sys->cdrv->lock(data_vid);
+	begin = clock_get_time();
 	ret = oalloc_new_prepare(data_vid, &start, count);
-	sys->cdrv->unlock(data_vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("oalloc_new_prepare failed for %s, %s", onode->name,
 		       sd_strerror(ret));
@@ -757,12 +1054,14 @@ static int onode_allocate_extents(struct kv_onode *onode,
 	onode->o_extent[idx].data_len = req->data_length - reserv_len;
 	onode->nr_extent++;
 out:
+	if (begin)
+		req->alloc_ns += clock_get_time() - begin;
 	return ret;
 }
 
 static int do_vdi_write(struct http_request *req, uint32_t data_vid,
 			uint64_t offset, uint64_t total, char *data_buf,
-			bool create)
+			bool create, struct sha1_ctx *ctx)
 {
 	uint64_t done = 0, size;
 	int ret = SD_RES_SUCCESS;
@@ -775,6 +1074,8 @@ static int do_vdi_write(struct http_request *req, uint32_t data_vid,
 			ret = SD_RES_EIO;
 			goto out;
 		}
+		if (ctx)
+			sha1_update(ctx, (uint8_t *)data_buf, size);
 		ret = vdi_read_write(data_vid, data_buf, size, offset,
 				     false, create);
 		sd_debug("vdi_write offset: %"PRIu64", size: %" PRIu64
@@ -793,7 +1094,8 @@ out:
 }
 
 static int onode_populate_extents(struct kv_onode *onode,
-				  struct http_request *req)
+				  struct http_request *req,
+				  struct sha1_ctx *ctx)
 {
 	struct onode_extent *ext;
 	struct onode_extent *last_ext = onode->o_extent + onode->nr_extent - 1;
@@ -804,7 +1106,7 @@ static int onode_populate_extents(struct kv_onode *onode,
 	uint32_t data_vid = onode->data_vid;
 	bool create = true;
 
-	data_buf = xmalloc(write_buffer_size);
+	data_buf = xmalloc_tag(write_buffer_size, SD_MEM_KV);
 
 	if (last_ext->data_len < req->data_length) {
 		ext = last_ext - 1;
@@ -812,7 +1114,7 @@ static int onode_populate_extents(struct kv_onode *onode,
 		offset = (ext->start + ext->count) * SD_DATA_OBJ_SIZE -
 			 reserv_len;
 		ret = do_vdi_write(req, data_vid, offset, reserv_len,
-				   data_buf, false);
+				   data_buf, false, ctx);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to do_vdi_write data_vid: %" PRIx32
 			       ", offset: %" PRIx64 ", total: %" PRIx64
@@ -830,14 +1132,15 @@ static int onode_populate_extents(struct kv_onode *onode,
 			create = false;
 	}
 
-	ret = do_vdi_write(req, data_vid, offset, total, data_buf, create);
+	ret = do_vdi_write(req, data_vid, offset, total, data_buf, create,
+			   ctx);
 	if (ret != SD_RES_SUCCESS)
 		sd_err("Failed to do_vdi_write data_vid: %" PRIx32
 		       ", offset: %" PRIx64 ", total: %" PRIx64
 		       ", ret: %s", data_vid, offset, total,
 		       sd_strerror(ret));
 out:
-	free(data_buf);
+	free_tag(data_buf, SD_MEM_KV);
 	return ret;
 }
 
@@ -851,13 +1154,28 @@ static uint64_t get_seconds(void)
 	return seconds;
 }
 
-static int onode_allocate_data(struct kv_onode *onode, struct http_request *req)
+/* the parts are put together by their extents */
+static bool onode_inlinable(const char *name, uint64_t size)
+{
+	return size <= kv_inline_size && !is_part_name(name);
+}
+
+/*
+ * The data of an inlined object, read from the request beforehand, goes with
+ * the creation of its onode, so a small object costs a single write.
+ */
+static int onode_allocate_data(struct kv_onode *onode, struct http_request *req,
+			       const char *data)
 {
 	int ret = SD_RES_SUCCESS;
 
-	if (req->data_length <= KV_ONODE_INLINE_SIZE)
+	if (data) {
 		onode->inlined = 1;
-	else {
+		memcpy(onode->data, data, req->data_length);
+		get_buffer_sha1(onode->data, req->data_length, onode->sha1);
+		onode->mtime = get_seconds();
+		onode->flags = ONODE_COMPLETE;
+	} else {
 		ret = onode_allocate_extents(onode, req);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
@@ -899,37 +1217,33 @@ static int onode_do_update(struct kv_onode *onode)
 	return ret;
 }
 
+/*
+ * The SHA1 of the data is the ETag of the object, when the whole object comes
+ * in the request.  The objects appended or put together from the parts have
+ * none.
+ */
 static int onode_populate_data(struct kv_onode *onode, struct http_request *req)
 {
-	ssize_t size;
+	bool whole = onode->size == req->data_length;
+	struct sha1_ctx ctx;
 	int ret = SD_RES_SUCCESS;
 
 	onode->mtime = get_seconds();
 	onode->flags = ONODE_COMPLETE;
+	memset(onode->sha1, 0, sizeof(onode->sha1));
 
-	if (req->data_length <= KV_ONODE_INLINE_SIZE) {
-		size = http_request_read(req, onode->data, sizeof(onode->data));
-		if (size < 0 || req->data_length != size) {
-			sd_err("Failed to read from web server for %s",
-			       onode->name);
-			ret = SD_RES_SYSTEM_ERROR;
-			goto out;
-		}
-		ret = sd_write_object(onode->oid, (char *)onode,
-				      ONODE_HDR_SIZE + size, 0, false);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
-	} else {
-		ret = onode_populate_extents(onode, req);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
-		/* write mtime and flag ONODE_COMPLETE to onode */
-		ret = onode_do_update(onode);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("Failed to write mtime and flags of onode %s",
-			       onode->name);
-			goto out;
-		}
+	sha1_init(&ctx);
+	ret = onode_populate_extents(onode, req, whole ? &ctx : NULL);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (whole)
+		sha1_final(&ctx, onode->sha1);
+	/* write mtime and flag ONODE_COMPLETE to onode */
+	ret = onode_do_update(onode);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to write mtime and flags of onode %s",
+		       onode->name);
+		goto out;
 	}
 out:
 	return ret;
@@ -941,8 +1255,10 @@ static int onode_populate_append_data(struct kv_onode *onode,
 	int ret;
 
 	onode->mtime = get_seconds();
+	/* the ETag of the data before is stale */
+	memset(onode->sha1, 0, sizeof(onode->sha1));
 
-	ret = onode_populate_extents(onode, req);
+	ret = onode_populate_extents(onode, req, NULL);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 	ret = onode_do_update(onode);
@@ -1027,75 +1343,124 @@ static int onode_create(struct kv_onode *onode, uint32_t bucket_vid)
 	}
 create:
 	ret = onode_do_create(onode, inode, idx, create);
+	if (ret == SD_RES_SUCCESS)
+		slot_created(bucket_vid, onode->name, onode->oid);
 out:
 	free(inode);
 	return ret;
 }
 
-static int onode_free_data(struct kv_onode *onode)
+/* Hand the data of the dead onode to the collector */
+static void onode_free_data(struct kv_onode *onode)
 {
-	uint32_t data_vid = onode->data_vid;
-	int ret = SD_RES_SUCCESS, i;
-
 	/* it don't need to free data for inlined onode */
-	if (!onode->inlined) {
-		sys->cdrv->lock(data_vid);
-		for (i = 0; i < onode->nr_extent; i++) {
-			ret = oalloc_free(data_vid, onode->o_extent[i].start,
-					  onode->o_extent[i].count);
-			if (ret != SD_RES_SUCCESS)
-				sd_err("failed to free start: %"PRIu64
-				       ", count: %"PRIu64", for %s",
-				       onode->o_extent[i].start,
-				       onode->o_extent[i].count,
-				       onode->name);
-		}
-		sys->cdrv->unlock(data_vid);
-	}
-	return ret;
+	if (onode->inlined)
+		return;
+
+	for (int i = 0; i < onode->nr_extent; i++)
+		kv_gc_free(onode->data_vid, onode->o_extent[i].start,
+			   onode->o_extent[i].count);
 }
 
-static int onode_read_extents(struct kv_onode *onode, struct http_request *req)
+/* The chunks of a GET in flight, the one sent and the ones read ahead */
+#define KV_READ_DEPTH 2
+
+struct onode_cursor {
+	const struct kv_onode *onode;
+	uint64_t idx; /* of the extent */
+	uint64_t off; /* in the extent */
+	uint64_t left; /* to read */
+};
+
+struct read_chunk {
+	char *buf;
+	uint64_t size;
+	struct request_iocb *iocb;
+};
+
+/*
+ * Find the offset and the size of the next chunk of up to max bytes in the
+ * vdi of the data, false if the read is done
+ */
+static bool onode_cursor_next(struct onode_cursor *c, uint64_t max,
+			      uint64_t *offset, uint64_t *size)
 {
-	struct onode_extent *ext;
-	uint64_t size, total, total_size, offset, done = 0, i, ext_len;
-	uint64_t off = req->offset, len = req->data_length;
-	int ret = SD_RES_SUCCESS;
-	char *data_buf = NULL;
-	uint64_t read_buffer_size = MIN(kv_rw_buffer, onode->size);
-
-	data_buf = xmalloc(read_buffer_size);
-	total_size = len;
-	for (i = 0; i < onode->nr_extent; i++) {
-		ext = onode->o_extent + i;
-		ext_len = ext->data_len;
-		if (off >= ext_len) {
-			off -= ext_len;
+	const struct onode_extent *ext;
+
+	while (c->left && c->idx < c->onode->nr_extent) {
+		ext = c->onode->o_extent + c->idx;
+		if (c->off >= ext->data_len) {
+			c->off -= ext->data_len;
+			c->idx++;
 			continue;
 		}
-		total = min(ext_len - off, total_size);
-		offset = ext->start * SD_DATA_OBJ_SIZE + off;
-		off = 0;
-		done = 0;
-		while (done < total) {
-			size = MIN(total - done, read_buffer_size);
-			ret = vdi_read_write(onode->data_vid, data_buf,
-					     size, offset, true, false);
-			sd_debug("vdi_read size: %"PRIu64", offset: %"
-				 PRIu64", ret:%d", size, offset, ret);
-			if (ret != SD_RES_SUCCESS) {
-				sd_err("Failed to read for vid %"PRIx32,
-				       onode->data_vid);
-				goto out;
+		*size = min(ext->data_len - c->off, c->left);
+		*size = min(*size, max);
+		*offset = ext->start * SD_DATA_OBJ_SIZE + c->off;
+		c->off += *size;
+		c->left -= *size;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Stream the len bytes at off of the object to the client.  The objects of the
+ * next chunk are read while the last one is sent, so that the reads of the
+ * cluster and the sends to the client overlap.
+ */
+static int onode_read_extents(struct kv_onode *onode, struct http_request *req,
+			      uint64_t off, uint64_t len)
+{
+	struct onode_cursor c = {
+		.onode = onode,
+		.off = off,
+		.left = len,
+	};
+	uint64_t read_buffer_size = MIN(kv_rw_buffer, len), offset;
+	struct read_chunk chunks[KV_READ_DEPTH] = {}, *ch;
+	int ret = SD_RES_SUCCESS, head = 0, nr = 0, i, err;
+
+	for (i = 0; i < KV_READ_DEPTH; i++)
+		chunks[i].buf = xmalloc_tag(read_buffer_size, SD_MEM_KV);
+
+	for (;;) {
+		while (nr < KV_READ_DEPTH && ret == SD_RES_SUCCESS) {
+			ch = chunks + (head + nr) % KV_READ_DEPTH;
+			if (!onode_cursor_next(&c, read_buffer_size, &offset,
+					       &ch->size))
+				break;
+			ch->iocb = vdi_read_write_async(onode->data_vid,
+							ch->buf, ch->size,
+							offset, true, false);
+			if (!ch->iocb) {
+				ret = SD_RES_SYSTEM_ERROR;
+				break;
 			}
-			http_request_write(req, data_buf, size);
-			done += size;
-			offset += size;
-			total_size -= size;
+			nr++;
 		}
+		if (!nr)
+			break;
+
+		/* the reads in flight are waited for even after an error */
+		ch = chunks + head;
+		err = local_req_wait(ch->iocb);
+		head = (head + 1) % KV_READ_DEPTH;
+		nr--;
+		sd_debug("vdi_read size: %"PRIu64", ret:%d", ch->size, err);
+		if (ret != SD_RES_SUCCESS)
+			continue;
+		if (err != SD_RES_SUCCESS) {
+			sd_err("Failed to read for vid %"PRIx32,
+			       onode->data_vid);
+			ret = err;
+			continue;
+		}
+		http_request_write(req, ch->buf, ch->size);
 	}
-out:
-	free(data_buf);
+
+	for (i = 0; i < KV_READ_DEPTH; i++)
+		free_tag(chunks[i].buf, SD_MEM_KV);
 	return ret;
 }
 
@@ -1116,99 +1481,203 @@ out:
 static int onode_lookup_nolock(struct kv_onode *onode, uint32_t ovid,
 			       const char *name)
 {
-	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
-	uint32_t tmp_vid, idx;
-	uint64_t hval, i;
-	int ret;
+	return slot_lookup(ovid, name, (char *)onode, sizeof(*onode));
+}
 
-	ret = sd_read_object(vid_to_vdi_oid(ovid), (char *)inode,
-			     sizeof(*inode), 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read %" PRIx32 " %s", ovid,
-		       sd_strerror(ret));
-		goto out;
-	}
+static int onode_lookup(struct kv_onode *onode, uint32_t ovid, const char *name)
+{
+	int ret;
 
-	hval = sd_hash(name, strlen(name));
-	for (i = 0; i < MAX_DATA_OBJS; i++) {
-		idx = (hval + i) % MAX_DATA_OBJS;
-		tmp_vid = sd_inode_get_vid(inode, idx);
-		if (tmp_vid) {
-			uint64_t oid = vid_to_data_oid(ovid, idx);
+	sys->cdrv->lock(ovid);
+	ret = onode_lookup_nolock(onode, ovid, name);
+	sys->cdrv->unlock(ovid);
 
-			ret = sd_read_object(oid, (char *)onode,
-					     sizeof(*onode), 0);
-			if (ret != SD_RES_SUCCESS)
-				goto out;
-			if (strcmp(onode->name, name) == 0)
-				break;
-		} else {
-			ret = SD_RES_NO_OBJ;
-			break;
-		}
-	}
-	if (i == MAX_DATA_OBJS) {
-		ret = SD_RES_NO_OBJ;
-		goto out;
-	}
-out:
-	free(inode);
 	return ret;
 }
 
-static int onode_lookup(struct kv_onode *onode, uint32_t ovid, const char *name)
+/* Look up the header of the onode only, without its data or extents */
+static int onode_lookup_hdr(struct kv_onode *onode, uint32_t ovid,
+			    const char *name)
 {
 	int ret;
 
 	sys->cdrv->lock(ovid);
-	ret = onode_lookup_nolock(onode, ovid, name);
+	ret = slot_lookup(ovid, name, (char *)onode, ONODE_HDR_SIZE);
 	sys->cdrv->unlock(ovid);
 
 	return ret;
 }
 
-static int onode_read_data(struct kv_onode *onode, struct http_request *req)
+static char *http_time(uint64_t time_sec)
 {
-	int ret;
-	uint64_t off = 0, len = onode->size;
-
-	if (req->offset || req->data_length) {
-		off = req->offset;
-		len = req->data_length;
-		if ((off + len - 1) > onode->size) {
-			if (onode->size > off)
-				len = onode->size - off;
-			else
-				len = 0;
-		}
-	}
+	static __thread char time_str[128];
 
-	req->data_length = len;
-	if (!len)
-		return SD_RES_INVALID_PARMS;
+	strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT",
+		 gmtime((time_t *)&time_sec));
+	return time_str;
+}
+
+#define ONODE_ETAG_LEN 64
+
+static void onode_etag(const struct kv_onode *onode, char *etag)
+{
+	static const uint8_t zero[SHA1_DIGEST_SIZE];
+
+	if (memcmp(onode->sha1, zero, SHA1_DIGEST_SIZE))
+		snprintf(etag, ONODE_ETAG_LEN, "\"%s\"",
+			 sha1_to_hex(onode->sha1));
+	else
+		snprintf(etag, ONODE_ETAG_LEN, "W/\"%"PRIx64"-%"PRIx64"\"",
+			 onode->size, onode->mtime);
+}
+
+/*
+ * Write the validators of the object and evaluate the conditions of the
+ * request on them.  Return the status to answer the request with, or OK.
+ */
+static enum http_status onode_precondition(struct kv_onode *onode,
+					   struct http_request *req)
+{
+	char etag[ONODE_ETAG_LEN];
+
+	onode_etag(onode, etag);
+	http_request_writef(req, "ETag: %s\n", etag);
+	http_request_writef(req, "Last-Modified: %s\n",
+			    http_time(onode->mtime));
+	return http_request_precondition(req, etag, onode->mtime);
+}
 
-	http_response_header(req, OK);
+/* Send the len bytes at off of the object, reading these bytes only */
+static int onode_send_range(struct kv_onode *onode, struct http_request *req,
+			    uint64_t off, uint64_t len)
+{
+	int ret;
 
+	if (!len)
+		return SD_RES_SUCCESS;
 	if (!onode->inlined)
-		return onode_read_extents(onode, req);
+		return onode_read_extents(onode, req, off, len);
 
-	ret = http_request_write(req, onode->data + off, len);
-	if (ret != len)
+	ret = sd_read_object(onode->oid, (char *)onode->data + off, len,
+			     ONODE_HDR_SIZE + off);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	if (http_request_write(req, onode->data + off, len) != len)
 		return SD_RES_SYSTEM_ERROR;
+	return SD_RES_SUCCESS;
+}
+
+static int byterange_header(char *buf, size_t len, const char *boundary,
+			    const struct http_range *r, uint64_t size)
+{
+	return snprintf(buf, len, "\r\n--%s\r\n"
+			"Content-Type: application/octet-stream\r\n"
+			"Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64
+			"\r\n\r\n", boundary, r->first, r->last, size);
+}
 
+/* Send the ranges of the request as the parts of a multipart/byteranges */
+static int onode_send_ranges(struct kv_onode *onode, struct http_request *req)
+{
+	char boundary[32], type[64], hdr[256];
+	const struct http_range *r;
+	int ret, len;
+
+	snprintf(boundary, sizeof(boundary), "%016"PRIx64,
+		 clock_get_time() ^ onode->oid);
+	req->data_length = snprintf(hdr, sizeof(hdr), "\r\n--%s--\r\n",
+				    boundary);
+	for (int i = 0; i < req->nr_ranges; i++) {
+		r = req->ranges + i;
+		req->data_length += byterange_header(hdr, sizeof(hdr), boundary,
+						     r, onode->size) +
+			r->last - r->first + 1;
+	}
+
+	snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+		 boundary);
+	req->content_type = type;
+	http_response_header(req, PARTIAL_CONTENT);
+	req->content_type = NULL;
+
+	for (int i = 0; i < req->nr_ranges; i++) {
+		r = req->ranges + i;
+		len = byterange_header(hdr, sizeof(hdr), boundary, r,
+				       onode->size);
+		http_request_write(req, hdr, len);
+		ret = onode_send_range(onode, req, r->first,
+				       r->last - r->first + 1);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	http_request_writef(req, "\r\n--%s--\r\n", boundary);
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Serve the ranges of the request, or the whole object.  The extents or the
+ * data of the onode are read for the bytes to send only, and a revalidation
+ * reads nothing more than the header.
+ */
+static int onode_read_data(struct kv_onode *onode, struct http_request *req)
+{
+	const struct http_range *r = req->ranges;
+	enum http_status status;
+	int ret;
+
+	http_request_writes(req, "Accept-Ranges: bytes\n");
+	req->data_length = 0;
+	status = onode_precondition(onode, req);
+	if (status != OK) {
+		/* of the entity which would be sent */
+		if (status == NOT_MODIFIED)
+			req->data_length = onode->size;
+		http_response_header(req, status);
+		return SD_RES_SUCCESS;
+	}
+
+	if (req->nr_ranges && !http_request_ranges(req, onode->size)) {
+		http_request_writef(req, "Content-Range: bytes */%"PRIu64"\n",
+				    onode->size);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (!onode->inlined && onode->nr_extent) {
+		ret = sd_read_object(onode->oid, (char *)onode->o_extent,
+				     sizeof(struct onode_extent) *
+				     onode->nr_extent, ONODE_HDR_SIZE);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	switch (req->nr_ranges) {
+	case 0:
+		req->data_length = onode->size;
+		http_response_header(req, OK);
+		return onode_send_range(onode, req, 0, onode->size);
+	case 1:
+		req->data_length = r->last - r->first + 1;
+		http_request_writef(req, "Content-Range: bytes %"PRIu64"-%"
+				    PRIu64"/%"PRIu64"\n", r->first, r->last,
+				    onode->size);
+		http_response_header(req, PARTIAL_CONTENT);
+		return onode_send_range(onode, req, r->first,
+				       req->data_length);
+	default:
+		return onode_send_ranges(onode, req);
+	}
+}
+
 /*
  * We free the data and meta data in following sequence:
  *
  * 1. zero onode
  *  - we can't discard it because onode_lookup() need it to find if some object
  *    exists or not by checking adjacent objects
- * 2. discard data
+ * 2. queue the data to the collector, which discards it in the background
  *
- * If (1) success, we consider it a successful deletion of user object. If (2)
- * fails, data objects become orphan(s).
+ * If (1) success, we consider it a successful deletion of user object. If the
+ * sheep dies before (2) or the collector fails, data objects become orphan(s).
  *
  * XXX: GC the orphans
  */
@@ -1222,10 +1691,8 @@ static int onode_delete(struct kv_onode *onode)
 		sd_err("failed to zero onode for %s", onode->name);
 		return ret;
 	}
-
-	ret = onode_free_data(onode);
-	if (ret != SD_RES_SUCCESS)
-		sd_err("failed to free data for %s", onode->name);
+	kv_cache_drop(oid_to_vid(onode->oid), onode->name);
+	onode_free_data(onode);
 
 	return SD_RES_SUCCESS;
 }
@@ -1244,12 +1711,13 @@ onode_create_and_update_bnode(struct http_request *req, const char *account,
 		goto out;
 	}
 
-	ret = bnode_update(account, bucket, req->data_length, true);
+	ret = index_update(account, bucket, onode->name, true);
 	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update bucket for %s", onode->name);
 		onode_delete(onode);
 		goto out;
 	}
+
+	kv_usage_add(account, bucket, 1, req->data_length);
 out:
 	return ret;
 }
@@ -1257,7 +1725,8 @@ out:
 /* Create onode and allocate space for it */
 static int onode_allocate_space(struct http_request *req, const char *account,
 				uint32_t bucket_vid, const char *bucket,
-				const char *name, struct kv_onode *onode)
+				const char *name, const char *data,
+				struct kv_onode *onode)
 {
 	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t data_vid;
@@ -1278,11 +1747,7 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 			sd_err("Failed to delete exists object %s", name);
 			goto out;
 		}
-		ret = bnode_update(account, bucket, onode->size, false);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("Failed to update bnode for %s", name);
-			goto out;
-		}
+		kv_usage_add(account, bucket, -1, -(int64_t)onode->size);
 	} else if (ret != SD_RES_NO_OBJ) {
 		sd_err("Failed to lookup onode %s %s", name, sd_strerror(ret));
 		goto out;
@@ -1298,7 +1763,7 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 	onode->data_vid = data_vid;
 	onode->flags = ONODE_INIT;
 
-	ret = onode_allocate_data(onode, req);
+	ret = onode_allocate_data(onode, req, data);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to write data for %s", name);
 		goto out;
@@ -1448,7 +1913,9 @@ int kv_create_object(struct http_request *req, const char *account,
 {
 	char vdi_name[SD_MAX_VDI_LEN];
 	struct kv_onode *onode = NULL;
+	char *data = NULL;
 	uint32_t bucket_vid;
+	ssize_t size;
 	int ret;
 
 	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
@@ -1456,13 +1923,26 @@ int kv_create_object(struct http_request *req, const char *account,
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
+	/* read a small object before taking the lock of the bucket */
+	if (onode_inlinable(name, req->data_length)) {
+		data = xmalloc(req->data_length + 1);
+		size = http_request_read(req, data, req->data_length);
+		if (size < 0 || req->data_length != size) {
+			sd_err("Failed to read from web server for %s", name);
+			ret = SD_RES_SYSTEM_ERROR;
+			goto out;
+		}
+	}
+
 	onode = xzalloc(sizeof(*onode));
 	ret = onode_allocate_space(req, account, bucket_vid, bucket,
-				   name, onode);
+				   name, data, onode);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("Failed to create onode and allocate space %s", name);
 		goto out;
 	}
+	if (data)
+		goto out;
 
 	ret = onode_populate_data(onode, req);
 	if (ret != SD_RES_SUCCESS) {
@@ -1470,6 +1950,7 @@ int kv_create_object(struct http_request *req, const char *account,
 		goto out;
 	}
 out:
+	free(data);
 	free(onode);
 	return ret;
 }
@@ -1513,6 +1994,211 @@ out:
 	return ret;
 }
 
+/*
+ * Multipart uploads
+ *
+ * A part of an upload is an object of the bucket named after the upload and
+ * the number of the part, which is hidden from the listings and always keeps
+ * its data in extents.  The parts are uploaded like any object, so the
+ * requests write them in parallel, and the completion makes an object of the
+ * extents of the parts in the order of their numbers, then drops the onodes
+ * of the parts without touching the data.
+ */
+
+#define KV_MAX_PARTS 10000
+#define KV_ONODE_MAX_EXTENTS \
+	((SD_DATA_OBJ_SIZE - ONODE_HDR_SIZE) / sizeof(struct onode_extent))
+
+static bool valid_upload_id(const char *upload_id)
+{
+	return strlen(upload_id) == KV_UPLOAD_ID_LEN &&
+		strspn(upload_id, "0123456789abcdef") == KV_UPLOAD_ID_LEN;
+}
+
+static void part_name(char *name, const char *upload_id, uint32_t part)
+{
+	snprintf(name, SD_MAX_OBJECT_NAME, KV_PART_PREFIX "%s/%05"PRIu32,
+		 upload_id, part);
+}
+
+/* Start an upload to the bucket, whose id is returned in upload_id */
+int kv_initiate_upload(const char *account, const char *bucket,
+		       char *upload_id)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	uint32_t bucket_vid;
+	int ret;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	snprintf(upload_id, KV_UPLOAD_ID_LEN + 1, "%016"PRIx64,
+		 clock_get_time() ^ ((uint64_t)random() << 32));
+	return SD_RES_SUCCESS;
+}
+
+/* Upload a part of an upload, which replaces the one of the same number */
+int kv_create_part(struct http_request *req, const char *account,
+		   const char *bucket, const char *upload_id, uint32_t part)
+{
+	char name[SD_MAX_OBJECT_NAME];
+
+	if (!valid_upload_id(upload_id) || !part || part > KV_MAX_PARTS ||
+	    !req->data_length)
+		return SD_RES_INVALID_PARMS;
+
+	part_name(name, upload_id, part);
+	return kv_create_object(req, account, bucket, name);
+}
+
+/*
+ * Make the object of the parts of the upload, in the ascending order of their
+ * numbers, and drop the parts which are not listed
+ */
+int kv_complete_upload(const char *account, const char *bucket,
+		       const char *name, const char *upload_id,
+		       const uint32_t *parts, int nr_parts)
+{
+	char vdi_name[SD_MAX_VDI_LEN], pname[SD_MAX_OBJECT_NAME] = {};
+	struct kv_onode *onode = NULL, *part = NULL, *old = NULL;
+	uint64_t *part_oids = NULL, *part_sizes = NULL;
+	uint32_t bucket_vid, data_vid;
+	int ret, i;
+
+	if (!valid_upload_id(upload_id) || !nr_parts)
+		return SD_RES_INVALID_PARMS;
+	for (i = 1; i < nr_parts; i++)
+		if (parts[i] <= parts[i - 1])
+			return SD_RES_INVALID_PARMS;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &data_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	onode = xzalloc(sizeof(*onode));
+	part = xzalloc(sizeof(*part));
+	old = xzalloc(sizeof(*old));
+	part_oids = xcalloc(nr_parts, sizeof(*part_oids));
+	part_sizes = xcalloc(nr_parts, sizeof(*part_sizes));
+
+	pstrcpy(onode->name, sizeof(onode->name), name);
+	onode->data_vid = data_vid;
+	onode->flags = ONODE_COMPLETE;
+	onode->ctime = onode->mtime = get_seconds();
+
+	sys->cdrv->lock(bucket_vid);
+	for (i = 0; i < nr_parts; i++) {
+		part_name(pname, upload_id, parts[i]);
+		ret = onode_lookup_nolock(part, bucket_vid, pname);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to find part %s, %s", pname,
+			       sd_strerror(ret));
+			goto out;
+		}
+		if (part->flags != ONODE_COMPLETE || part->inlined ||
+		    part->data_vid != data_vid ||
+		    onode->nr_extent + part->nr_extent > KV_ONODE_MAX_EXTENTS) {
+			sd_err("invalid part %s", pname);
+			ret = SD_RES_INVALID_PARMS;
+			goto out;
+		}
+
+		memcpy(onode->o_extent + onode->nr_extent, part->o_extent,
+		       sizeof(struct onode_extent) * part->nr_extent);
+		onode->nr_extent += part->nr_extent;
+		onode->size += part->size;
+		part_oids[i] = part->oid;
+		part_sizes[i] = part->size;
+	}
+
+	/* For overwrite, we delete old object and then create */
+	ret = onode_lookup_nolock(old, bucket_vid, name);
+	if (ret == SD_RES_SUCCESS) {
+		if (old->flags != ONODE_COMPLETE) {
+			ret = SD_RES_INCOMPLETE;
+			sd_err("The exists onode %s is incomplete", name);
+			goto out;
+		}
+		ret = onode_delete(old);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		kv_usage_add(account, bucket, -1, -(int64_t)old->size);
+	} else if (ret != SD_RES_NO_OBJ)
+		goto out;
+
+	ret = onode_create(onode, bucket_vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to create onode for %s", name);
+		goto out;
+	}
+	ret = index_update(account, bucket, name, true);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	kv_usage_add(account, bucket, 1, onode->size);
+
+	/* the data of the parts is the object's now */
+	memset(pname, 0, sizeof(pname));
+	for (i = 0; i < nr_parts; i++) {
+		ret = sd_write_object(part_oids[i], pname, sizeof(pname), 0,
+				      false);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to zero onode %"PRIx64, part_oids[i]);
+			goto out;
+		}
+		kv_usage_add(account, bucket, -1, -(int64_t)part_sizes[i]);
+	}
+out:
+	sys->cdrv->unlock(bucket_vid);
+	if (ret == SD_RES_SUCCESS)
+		kv_abort_upload(account, bucket, upload_id);
+	free(onode);
+	free(part);
+	free(old);
+	free(part_oids);
+	free(part_sizes);
+	return ret;
+}
+
+/* Drop the parts uploaded to the upload */
+int kv_abort_upload(const char *account, const char *bucket,
+		    const char *upload_id)
+{
+	char vdi_name[SD_MAX_VDI_LEN], prefix[SD_MAX_OBJECT_NAME];
+	struct name_list up = {};
+	uint32_t bucket_vid;
+	int ret, err, i;
+
+	if (!valid_upload_id(upload_id))
+		return SD_RES_INVALID_PARMS;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	snprintf(prefix, sizeof(prefix), KV_PART_PREFIX "%s/", upload_id);
+	sys->cdrv->lock(bucket_vid);
+	ret = bucket_iterate_object(bucket_vid, prefix, collect_name, &up);
+	sys->cdrv->unlock(bucket_vid);
+	if (ret == SD_RES_SUCCESS && !up.nr)
+		ret = SD_RES_NO_OBJ;
+
+	for (i = 0; i < up.nr; i++) {
+		err = kv_delete_object(account, bucket, up.names[i], true);
+		if (err != SD_RES_SUCCESS && err != SD_RES_NO_OBJ)
+			ret = err;
+	}
+	free_name_list(&up);
+	return ret;
+}
+
 int kv_read_object(struct http_request *req, const char *account,
 		   const char *bucket, const char *name)
 {
@@ -1526,8 +2212,8 @@ int kv_read_object(struct http_request *req, const char *account,
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	onode = xzalloc(sizeof(*onode));
-	ret = onode_lookup(onode, bucket_vid, name);
+	onode = xmalloc(sizeof(*onode));
+	ret = onode_lookup_hdr(onode, bucket_vid, name);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -1592,11 +2278,10 @@ int kv_delete_object(const char *account, const char *bucket, const char *name,
 		sd_err("failed to delete onode for %s", name);
 		goto out;
 	}
-	ret = bnode_update(account, bucket, onode->size, false);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update bnode for %s", name);
+	ret = index_update(account, bucket, name, false);
+	if (ret != SD_RES_SUCCESS)
 		goto out;
-	}
+	kv_usage_add(account, bucket, -1, -(int64_t)onode->size);
 out:
 	free(onode);
 	return ret;
@@ -1615,19 +2300,48 @@ int kv_iterate_object(const char *account, const char *bucket,
 		return ret;
 
 	sys->cdrv->lock(bucket_vid);
-	ret = bucket_iterate_object(bucket_vid, cb, opaque);
+	ret = bucket_iterate_object(bucket_vid, NULL, cb, opaque);
 	sys->cdrv->unlock(bucket_vid);
 
 	return ret;
 }
 
-static char *http_time(uint64_t time_sec)
+static int name_cmp(char *const *a, char *const *b)
 {
-	static __thread char time_str[128];
+	return strcmp(*a, *b);
+}
 
-	strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT",
-		 gmtime((time_t *)&time_sec));
-	return time_str;
+/* List a page of the objects of the bucket in the order of their names */
+int kv_list_objects(const char *account, const char *bucket,
+		    struct kv_list *list)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	struct name_list nl = {};
+	uint32_t bucket_vid, index_vid;
+	int ret;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &index_vid);
+	if (ret == SD_RES_SUCCESS)
+		return kv_index_list(index_vid, list);
+	if (ret != SD_RES_NO_VDI)
+		return ret;
+
+	/* a bucket without index, sort all the names */
+	sys->cdrv->lock(bucket_vid);
+	ret = bucket_iterate_object(bucket_vid, NULL, collect_name, &nl);
+	sys->cdrv->unlock(bucket_vid);
+	if (ret == SD_RES_SUCCESS) {
+		xqsort(nl.names, nl.nr, name_cmp);
+		kv_list_names(list, nl.names, nl.nr);
+	}
+	free_name_list(&nl);
+	return ret;
 }
 
 int kv_read_object_meta(struct http_request *req, const char *account,
@@ -1635,6 +2349,7 @@ int kv_read_object_meta(struct http_request *req, const char *account,
 {
 	struct kv_onode *onode = NULL;
 	char vdi_name[SD_MAX_VDI_LEN];
+	enum http_status status;
 	uint32_t bucket_vid;
 	int ret;
 
@@ -1643,22 +2358,29 @@ int kv_read_object_meta(struct http_request *req, const char *account,
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	onode = xzalloc(sizeof(*onode));
-	ret = onode_lookup(onode, bucket_vid, name);
+	onode = xmalloc(ONODE_HDR_SIZE);
+	ret = onode_lookup_hdr(onode, bucket_vid, name);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
 	req->data_length = onode->size;
 	http_request_writef(req, "Created: %s\n",
 			    http_time(onode->ctime));
-	http_request_writef(req, "Last-Modified: %s\n",
-			    http_time(onode->mtime));
+	http_request_writes(req, "Accept-Ranges: bytes\n");
 
 	/* this object has not been uploaded complete */
 	if (onode->flags != ONODE_COMPLETE) {
+		http_request_writef(req, "Last-Modified: %s\n",
+				    http_time(onode->mtime));
 		ret = SD_RES_INCOMPLETE;
 		goto out;
 	}
+
+	status = onode_precondition(onode, req);
+	if (status == PRECONDITION_FAILED)
+		req->data_length = 0;
+	if (status != OK)
+		http_response_header(req, status);
 out:
 	free(onode);
 	return ret;
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metrics of the sheep for Prometheus
+ *
+ * With 'sheep -r metrics,...', GET /metrics returns the counters of 'dog node
+ * stat' and 'dog node info' along with the work queues, the object cache, the
+ * sockfd cache, the recovery, the I/O time of each disk and the stages of the
+ * http requests, in the text format 0.0.4 of Prometheus, which the OpenMetrics
+ * scrapers take as well.  The I/O
+ * path only bumps the counters, with atomic adds or in the thread owning them,
+ * and a scrape reads them in the http worker.  The driver leaves the other
+ * URIs to the drivers after it, so it goes before swift or s3 in the options.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+#define METRICS_URI		"/metrics"
+#define METRICS_MAX_WQ		64
+
+struct stat_metric {
+	const char *name; /* with the labels */
+	const char *type; /* NULL for the same family as the previous one */
+	const char *help;
+	size_t offset; /* in struct sd_stat */
+};
+
+#define STAT_METRIC(name, type, help, field) \
+	{ name, type, help, offsetof(struct sd_stat, field) }
+#define STAT_LABEL(name, field) STAT_METRIC(name, NULL, NULL, field)
+
+static const struct stat_metric stat_metrics[] = {
+	STAT_METRIC("sheep_requests_total{role=\"gateway\"}", "counter",
+		    "Requests received", r.gway_total_nr),
+	STAT_LABEL("sheep_requests_total{role=\"peer\"}", r.peer_total_nr),
+	STAT_METRIC("sheep_requests_active{role=\"gateway\"}", "gauge",
+		    "Requests running", r.gway_active_nr),
+	STAT_LABEL("sheep_requests_active{role=\"peer\"}", r.peer_active_nr),
+	STAT_METRIC("sheep_received_bytes_total{role=\"gateway\"}", "counter",
+		    "Bytes of the request data received", r.gway_total_rx),
+	STAT_LABEL("sheep_received_bytes_total{role=\"peer\"}",
+		   r.peer_total_rx),
+	STAT_METRIC("sheep_sent_bytes_total{role=\"gateway\"}", "counter",
+		    "Bytes of the response data sent", r.gway_total_tx),
+	STAT_LABEL("sheep_sent_bytes_total{role=\"peer\"}", r.peer_total_tx),
+	STAT_METRIC("sheep_operations_total{role=\"gateway\",op=\"read\"}",
+		    "counter", "Requests by the operation",
+		    r.gway_total_read_nr),
+	STAT_LABEL("sheep_operations_total{role=\"gateway\",op=\"write\"}",
+		   r.gway_total_write_nr),
+	STAT_LABEL("sheep_operations_total{role=\"gateway\",op=\"remove\"}",
+		   r.gway_total_remove_nr),
+	STAT_LABEL("sheep_operations_total{role=\"gateway\",op=\"flush\"}",
+		   r.gway_total_flush_nr),
+	STAT_LABEL("sheep_operations_total{role=\"peer\",op=\"read\"}",
+		   r.peer_total_read_nr),
+	STAT_LABEL("sheep_operations_total{role=\"peer\",op=\"write\"}",
+		   r.peer_total_write_nr),
+	STAT_LABEL("sheep_operations_total{role=\"peer\",op=\"remove\"}",
+		   r.peer_total_remove_nr),
+	STAT_METRIC("sheep_expired_requests_total", "counter",
+		    "Requests dropped past their deadline", r.expired_nr),
+	STAT_METRIC("sheep_fd_cache_fds", "gauge",
+		    "Fds of the objects cached", fd.nr),
+	STAT_METRIC("sheep_fd_cache_lookups_total{result=\"hit\"}", "counter",
+		    "Lookups of the fd cache", fd.hit),
+	STAT_LABEL("sheep_fd_cache_lookups_total{result=\"miss\"}", fd.miss),
+	STAT_METRIC("sheep_fd_cache_evictions_total", "counter",
+		    "Fds evicted from the fd cache", fd.evict),
+	STAT_METRIC("sheep_placement_cache_lookups_total{result=\"hit\"}",
+		    "counter", "Lookups of the placement cache", pc.hit),
+	STAT_LABEL("sheep_placement_cache_lookups_total{result=\"miss\"}",
+		   pc.miss),
+	STAT_METRIC("sheep_buffer_pool_allocs_total{result=\"hit\"}",
+		    "counter", "Buffers allocated from the pool", bp.hit),
+	STAT_LABEL("sheep_buffer_pool_allocs_total{result=\"miss\"}", bp.miss),
+	STAT_METRIC("sheep_buffer_pool_cached_bytes", "gauge",
+		    "Bytes of the free buffers in the pool", bp.cached),
+	STAT_METRIC("sheep_buffer_pool_trimmed_total", "counter",
+		    "Buffers returned to the system", bp.trimmed),
+	STAT_METRIC("sheep_dedup_blocks_total{result=\"shared\"}", "counter",
+		    "Blocks of the dedup index lookups", dd.shared),
+	STAT_LABEL("sheep_dedup_blocks_total{result=\"differed\"}",
+		   dd.differed),
+	STAT_LABEL("sheep_dedup_blocks_total{result=\"recovered\"}",
+		   dd.recovered),
+	STAT_METRIC("sheep_prealloc_pool_total{result=\"claimed\"}", "counter",
+		    "Objects created from the preallocated files",
+		    pool.claimed),
+	STAT_LABEL("sheep_prealloc_pool_total{result=\"missed\"}", pool.missed),
+	STAT_METRIC("sheep_kv_cache_lookups_total{result=\"hit\"}", "counter",
+		    "Lookups of the http gateway cache", kv_cache.hit),
+	STAT_LABEL("sheep_kv_cache_lookups_total{result=\"miss\"}",
+		   kv_cache.miss),
+	STAT_LABEL("sheep_kv_cache_lookups_total{result=\"stale\"}",
+		   kv_cache.stale),
+	STAT_METRIC("sheep_scrub_objects_total{result=\"scanned\"}", "counter",
+		    "Local objects verified by the scrubber", scrub.scanned),
+	STAT_LABEL("sheep_scrub_objects_total{result=\"mismatched\"}",
+		   scrub.mismatched),
+	STAT_LABEL("sheep_scrub_objects_total{result=\"repaired\"}",
+		   scrub.repaired),
+	STAT_LABEL("sheep_scrub_objects_total{result=\"failed\"}",
+		   scrub.failed),
+	STAT_METRIC("sheep_scrub_bytes_total", "counter",
+		    "Bytes of the objects verified by the scrubber",
+		    scrub.bytes),
+	STAT_METRIC("sheep_read_cache_lookups_total{result=\"hit\"}",
+		    "counter", "Local reads of the memory cache", rc.hit),
+	STAT_LABEL("sheep_read_cache_lookups_total{result=\"miss\"}",
+		   rc.miss),
+	STAT_METRIC("sheep_read_cache_evictions_total", "counter",
+		    "Blocks evicted from the memory cache", rc.evict),
+	STAT_METRIC("sheep_read_cache_bytes", "gauge",
+		    "Bytes of the blocks in the memory cache", rc.cached),
+	STAT_METRIC("sheep_wire_bytes_total{stage=\"raw\"}", "counter",
+		    "Bytes of the peer payloads coded on the wire", wire.raw),
+	STAT_LABEL("sheep_wire_bytes_total{stage=\"deflated\"}",
+		   wire.deflated),
+	STAT_LABEL("sheep_wire_bytes_total{stage=\"inflated\"}",
+		   wire.inflated),
+	STAT_METRIC("sheep_wire_nanoseconds_total", "counter",
+		    "Time spent coding the peer payloads", wire.ns),
+	STAT_METRIC("sheep_loop_lag_samples_total{below=\"1ms\"}", "counter",
+		    "Samples of the time the main loop has run a callback",
+		    loop.lag[0]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"4ms\"}",
+		   loop.lag[1]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"16ms\"}",
+		   loop.lag[2]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"64ms\"}",
+		   loop.lag[3]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"256ms\"}",
+		   loop.lag[4]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"1s\"}",
+		   loop.lag[5]),
+	STAT_LABEL("sheep_loop_lag_samples_total{below=\"inf\"}",
+		   loop.lag[6]),
+	STAT_METRIC("sheep_loop_lag_max_nanoseconds", "gauge",
+		    "The longest time the main loop has run a callback",
+		    loop.max_lag),
+	STAT_METRIC("sheep_loop_stalls_total", "counter",
+		    "Callbacks of the main loop over the stall threshold",
+		    loop.stalls),
+	STAT_METRIC("sheep_memory_bytes{tag=\"recovery\"}", "gauge",
+		    "Bytes of the memory accounted to the subsystems",
+		    mem.used[SD_MEM_RECOVERY]),
+	STAT_LABEL("sheep_memory_bytes{tag=\"objlist\"}",
+		   mem.used[SD_MEM_OBJLIST]),
+	STAT_LABEL("sheep_memory_bytes{tag=\"request\"}",
+		   mem.used[SD_MEM_REQUEST]),
+	STAT_LABEL("sheep_memory_bytes{tag=\"vnode\"}",
+		   mem.used[SD_MEM_VNODE]),
+	STAT_LABEL("sheep_memory_bytes{tag=\"inode\"}",
+		   mem.used[SD_MEM_INODE]),
+	STAT_LABEL("sheep_memory_bytes{tag=\"kv\"}",
+		   mem.used[SD_MEM_KV]),
+	STAT_METRIC("sheep_memory_throttled_total", "counter",
+		    "Times a subsystem backed off its memory cap",
+		    mem.throttled),
+};
+
+static void metric_family(struct strbuf *buf, const char *name,
+			  const char *type, const char *help)
+{
+	int len = strcspn(name, "{");
+
+	strbuf_addf(buf, "# HELP %.*s %s\n# TYPE %.*s %s\n", len, name, help,
+		    len, name, type);
+}
+
+/* Add the label value, escaped as the text format wants */
+static void metric_label(struct strbuf *buf, const char *value)
+{
+	for (const char *p = value; *p; p++) {
+		if (*p == '\\' || *p == '"')
+			strbuf_addch(buf, '\\');
+		if (*p == '\n')
+			strbuf_addstr(buf, "\\n");
+		else
+			strbuf_addch(buf, *p);
+	}
+}
+
+static void metrics_stat(struct strbuf *buf)
+{
+	struct sd_stat stat = sys->stat;
+
+	buffer_pool_stat(&stat.bp);
+	for (int i = 0; i < SD_MEM_NR_TAGS; i++)
+		stat.mem.used[i] = sd_mem_used(i);
+	for (int i = 0; i < ARRAY_SIZE(stat_metrics); i++) {
+		const struct stat_metric *m = stat_metrics + i;
+
+		if (m->type)
+			metric_family(buf, m->name, m->type, m->help);
+		strbuf_addf(buf, "%s %"PRIu64"\n", m->name,
+			    *(uint64_t *)((char *)&stat + m->offset));
+	}
+}
+
+static void metrics_work_queue(struct strbuf *buf)
+{
+	struct wq_stat stat[METRICS_MAX_WQ];
+	size_t nr_workers, nr_idle, nr_pending;
+	int nr = min(wq_get_stat(stat, METRICS_MAX_WQ), METRICS_MAX_WQ);
+
+	metric_family(buf, "sheep_work_queue_queued", "gauge",
+		      "Works queued and not done yet");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(buf, "sheep_work_queue_queued{queue=\"%s\"} %zu\n",
+			    stat[i].name, stat[i].nr_queued);
+	metric_family(buf, "sheep_work_queue_active", "gauge",
+		      "Works handed to the workers of the limited queues");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(buf, "sheep_work_queue_active{queue=\"%s\"} %zu\n",
+			    stat[i].name, stat[i].nr_active);
+
+	wq_get_pool_stat(&nr_workers, &nr_idle, &nr_pending);
+	metric_family(buf, "sheep_workers", "gauge", "Worker threads");
+	strbuf_addf(buf, "sheep_workers %zu\n", nr_workers);
+	metric_family(buf, "sheep_workers_idle", "gauge",
+		      "Worker threads waiting for a work");
+	strbuf_addf(buf, "sheep_workers_idle %zu\n", nr_idle);
+	metric_family(buf, "sheep_works_pending", "gauge",
+		      "Works in the run queues of the workers");
+	strbuf_addf(buf, "sheep_works_pending %zu\n", nr_pending);
+}
+
+static void metrics_object_cache(struct strbuf *buf)
+{
+	struct object_cache_info *info;
+
+	if (!sys->enable_object_cache)
+		return;
+
+	info = xmalloc(sizeof(*info));
+	object_cache_get_info(info);
+	metric_family(buf, "sheep_object_cache_size_bytes", "gauge",
+		      "Size of the object cache");
+	strbuf_addf(buf, "sheep_object_cache_size_bytes %"PRIu64"\n",
+		    info->size);
+	metric_family(buf, "sheep_object_cache_used_bytes", "gauge",
+		      "Bytes of the objects in the object cache");
+	strbuf_addf(buf, "sheep_object_cache_used_bytes %"PRIu64"\n",
+		    info->used);
+	metric_family(buf, "sheep_object_cache_lookups_total", "counter",
+		      "Lookups of the object cache");
+	strbuf_addf(buf, "sheep_object_cache_lookups_total{result=\"hit\"} %"
+		    PRIu64"\n", info->hits);
+	strbuf_addf(buf, "sheep_object_cache_lookups_total{result=\"miss\"} %"
+		    PRIu64"\n", info->misses);
+	strbuf_addf(buf, "sheep_object_cache_lookups_total{result=\"ghost\"} %"
+		    PRIu64"\n", info->ghost_hits);
+	metric_family(buf, "sheep_object_cache_dirty_objects", "gauge",
+		      "Dirty objects of the object cache");
+	strbuf_addf(buf, "sheep_object_cache_dirty_objects %"PRIu32"\n",
+		    info->dirty);
+	metric_family(buf, "sheep_object_cache_pushing_objects", "gauge",
+		      "Objects being pushed back");
+	strbuf_addf(buf, "sheep_object_cache_pushing_objects %"PRIu32"\n",
+		    info->pushing);
+	free(info);
+}
+
+static void metrics_sockfd(struct strbuf *buf)
+{
+	struct sockfd_stat stat;
+
+	sockfd_cache_get_stat(&stat);
+	metric_family(buf, "sheep_sockfd_nodes", "gauge",
+		      "Nodes in the sockfd cache");
+	strbuf_addf(buf, "sheep_sockfd_nodes %d\n", stat.nr_nodes);
+	metric_family(buf, "sheep_sockfd_slots", "gauge",
+		      "Slots for the cached fds of a node");
+	strbuf_addf(buf, "sheep_sockfd_slots %d\n", stat.nr_fds_per_node);
+	metric_family(buf, "sheep_sockfd_fds", "gauge",
+		      "Cached connections to the nodes");
+	strbuf_addf(buf, "sheep_sockfd_fds{state=\"open\"} %d\n", stat.nr_fds);
+	strbuf_addf(buf, "sheep_sockfd_fds{state=\"in_use\"} %d\n",
+		    stat.nr_in_use);
+	metric_family(buf, "sheep_sockfd_mux_conns", "gauge",
+		      "Multiplexed connections to the nodes");
+	strbuf_addf(buf, "sheep_sockfd_mux_conns %d\n", stat.nr_mux);
+	metric_family(buf, "sheep_sockfd_mux_inflight", "gauge",
+		      "Requests in flight on the multiplexed connections");
+	strbuf_addf(buf, "sheep_sockfd_mux_inflight %d\n",
+		    stat.nr_mux_inflight);
+}
+
+static void metrics_recovery(struct strbuf *buf)
+{
+	struct recovery_state state;
+	struct sd_req hdr;
+
+	/* get_recovery_state() is for the main thread */
+	sd_init_req(&hdr, SD_OP_STAT_RECOVERY);
+	hdr.data_length = sizeof(state);
+	if (exec_local_req(&hdr, &state) != SD_RES_SUCCESS)
+		return;
+
+	metric_family(buf, "sheep_recovery_active", "gauge",
+		      "Whether the node is recovering");
+	strbuf_addf(buf, "sheep_recovery_active %d\n", !!state.in_recovery);
+	metric_family(buf, "sheep_recovery_objects", "gauge",
+		      "Objects to recover in the current recovery");
+	strbuf_addf(buf, "sheep_recovery_objects %"PRIu64"\n",
+		    state.in_recovery ? state.nr_total : 0);
+	metric_family(buf, "sheep_recovery_finished_objects", "gauge",
+		      "Objects recovered in the current recovery");
+	strbuf_addf(buf, "sheep_recovery_finished_objects %"PRIu64"\n",
+		    state.in_recovery ? state.nr_finished : 0);
+}
+
+/* Add the name and the disk label, for the rest of the labels and the value */
+static void metrics_disk(struct strbuf *buf, const char *name,
+			 const struct md_info *disk)
+{
+	strbuf_addf(buf, "%s{disk=\"", name);
+	metric_label(buf, disk->path);
+	strbuf_addch(buf, '"');
+}
+
+static void metrics_md(struct strbuf *buf)
+{
+	struct sd_md_info *info = xmalloc(sizeof(*info));
+	struct md_io_stat *io;
+
+	md_get_info(info);
+	io = xcalloc(info->nr, sizeof(*io));
+	for (int i = 0; i < info->nr; i++)
+		md_io_get_stat(info->disk[i].path, io + i);
+
+	metric_family(buf, "sheep_disk_free_bytes", "gauge",
+		      "Free space of the disk");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_free_bytes", info->disk + i);
+		strbuf_addf(buf, "} %"PRIu64"\n", info->disk[i].free);
+	}
+	metric_family(buf, "sheep_disk_used_bytes", "gauge",
+		      "Space of the objects on the disk");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_used_bytes", info->disk + i);
+		strbuf_addf(buf, "} %"PRIu64"\n", info->disk[i].used);
+	}
+	metric_family(buf, "sheep_disk_stale_bytes", "gauge",
+		      "Stale objects on the disk to purge");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_stale_bytes", info->disk + i);
+		strbuf_addf(buf, "} %"PRIu64"\n", info->disk[i].stale);
+	}
+	metric_family(buf, "sheep_disk_latency_seconds", "gauge",
+		      "Smoothed mean latency of the I/O of the disk");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_latency_seconds", info->disk + i);
+		strbuf_addf(buf, "} %.6f\n", info->disk[i].lat_us / 1e6);
+	}
+	metric_family(buf, "sheep_disk_slow", "gauge",
+		      "Whether the disk is flagged slow against the others");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_slow", info->disk + i);
+		strbuf_addf(buf, "} %d\n", info->disk[i].slow);
+	}
+	metric_family(buf, "sheep_disk_io_total", "counter",
+		      "Reads and writes of the objects on the disk");
+	for (int i = 0; i < info->nr; i++) {
+		metrics_disk(buf, "sheep_disk_io_total", info->disk + i);
+		strbuf_addf(buf, ",op=\"read\"} %"PRIu64"\n", io[i].nr_reads);
+		metrics_disk(buf, "sheep_disk_io_total", info->disk + i);
+		strbuf_addf(buf, ",op=\"write\"} %"PRIu64"\n",
+			    io[i].nr_writes);
+	}
+	metric_family(buf, "sheep_disk_io_seconds_total", "counter",
+		      "Time of the I/O of the objects on the disk");
+	for (int i = 0; i < info->nr; i++) {
+		const char *name = "sheep_disk_io_seconds_total";
+
+		metrics_disk(buf, name, info->disk + i);
+		strbuf_addf(buf, ",op=\"read\"} %.9f\n", io[i].read_ns / 1e9);
+		metrics_disk(buf, name, info->disk + i);
+		strbuf_addf(buf, ",op=\"write\"} %.9f\n",
+			    io[i].write_ns / 1e9);
+	}
+	free(io);
+	free(info);
+}
+
+static void metrics_http(struct strbuf *buf)
+{
+	static const char * const methods[SD_HTTP_NR_METHODS] = {
+		"GET", "PUT", "POST", "DELETE", "HEAD",
+	};
+	static const char * const stages[] = {
+		"queue", "io", "alloc", "handle",
+	};
+	struct s_http stat = sys->stat.http;
+	const uint64_t *ns[] = {
+		stat.queue, stat.io, stat.alloc, stat.handle,
+	};
+
+	metric_family(buf, "sheep_http_requests_total", "counter",
+		      "Requests of the http gateway by the method");
+	for (int i = 0; i < SD_HTTP_NR_METHODS; i++)
+		strbuf_addf(buf, "sheep_http_requests_total{method=\"%s\"} %"
+			    PRIu64"\n", methods[i], stat.nr[i]);
+
+	metric_family(buf, "sheep_http_seconds_total", "counter",
+		      "Time the requests of the http gateway spent in the "
+		      "stages, the handle one including io and alloc");
+	for (int s = 0; s < ARRAY_SIZE(stages); s++)
+		for (int i = 0; i < SD_HTTP_NR_METHODS; i++)
+			strbuf_addf(buf, "sheep_http_seconds_total{method="
+				    "\"%s\",stage=\"%s\"} %.9f\n", methods[i],
+				    stages[s], ns[s][i] / 1e9);
+}
+
+static void metrics_get(struct http_request *req)
+{
+	struct strbuf buf = STRBUF_INIT;
+
+	if (strcmp(req->uri, METRICS_URI))
+		return;
+
+	metrics_stat(&buf);
+	metrics_work_queue(&buf);
+	metrics_object_cache(&buf);
+	metrics_sockfd(&buf);
+	metrics_recovery(&buf);
+	metrics_md(&buf);
+	metrics_http(&buf);
+
+	req->content_type = "text/plain; version=0.0.4";
+	req->data_length = buf.len;
+	http_response_header(req, OK);
+	http_request_write(req, buf.buf, buf.len);
+	strbuf_release(&buf);
+}
+
+static int metrics_init(const char *option)
+{
+	return 0;
+}
+
+static struct http_driver hdrv_metrics = {
+	.name	= "metrics",
+
+	.init	= metrics_init,
+	.get	= metrics_get,
+};
+
+hdrv_register(hdrv_metrics);
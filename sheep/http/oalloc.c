@@ -23,15 +23,21 @@
  *            |                               |
  *            |  sorted list               v------v
  * +--------------------------------+-----------------------+     +--------+
- * | Header | fd1 | fd2 | ... | fdN | .... object data .... | <-- | bitmap |
+ * | Header | fd1 | fd2 | ... | fdN | ... | Trailer | data  | <-- | bitmap |
  * +--------------------------------+-----------------------+     +---------
- * |<--           4M             -->|
+ * |<--           4M                           -->|
  *
- * Best-fit algorithm for allocation and merge and sort the free list at
- * deallocation. One simple sorted list is efficient enough for extent based
- * invariable user object.
+ * The index space of the data vdi is split into allocation groups, each with
+ * a meta object of its own at the start of the group and the lock of the
+ * meta object, so the allocations in different groups don't contend.  The
+ * requests start from the groups in turn, and take the next group when one
+ * is full.  The data vdis created before the groups have a single group.
  *
- * XXX: Add allocation group for scalability and solve the meta size limitation
+ * Every node caches the free list of a group in a tree by start, to merge the
+ * freed objects with their neighbours, and a tree by count, for the best-fit
+ * allocation.  The trailer carries the generation of the free list, which
+ * every update bumps, so a node takes its cache as long as the generation on
+ * the disk is the one it saw last.
  */
 
 struct header {
@@ -44,6 +50,18 @@ struct free_desc {
 	uint64_t count;
 };
 
+#define OALLOC_MAGIC 0x6f616c6c6f637472ULL /* "oalloctr" */
+#define OALLOC_NR_GROUPS 16
+
+struct trailer {
+	uint64_t magic;
+	uint32_t nr_groups;
+	uint32_t __pad;
+	uint64_t gen;
+};
+
+#define TRAILER_OFFSET (SD_DATA_OBJ_SIZE - sizeof(struct trailer))
+
 static inline uint32_t oalloc_meta_length(struct header *hd)
 {
 	return sizeof(struct header) + sizeof(struct free_desc) * hd->nr_free;
@@ -52,9 +70,345 @@ static inline uint32_t oalloc_meta_length(struct header *hd)
 #define HEADER_TO_FREE_DESC(hd) ((struct free_desc *) \
 				 ((char *)hd + sizeof(struct header)))
 
-#define MAX_FREE_DESC ((SD_DATA_OBJ_SIZE - sizeof(struct header)) / \
+#define MAX_FREE_DESC ((TRAILER_OFFSET - sizeof(struct header)) / \
 		       sizeof(struct free_desc))
 
+struct free_extent {
+	struct rb_node start_node;
+	struct rb_node count_node;
+	uint64_t start;
+	uint64_t count;
+};
+
+struct alloc_group {
+	bool cached;
+	uint64_t gen;
+	uint64_t used;
+	struct rb_root start_root;
+	struct rb_root count_root;
+};
+
+struct alloc_vdi {
+	struct rb_node rb;
+	uint32_t vid;
+	uint32_t nr_groups;
+	uint64_t group_size; /* in objects */
+	struct alloc_group groups[];
+};
+
+static struct rb_root alloc_vdi_root = RB_ROOT;
+static struct sd_mutex alloc_vdi_lock = SD_MUTEX_INITIALIZER;
+static uint32_t next_group;
+
+static int alloc_vdi_cmp(const struct alloc_vdi *a, const struct alloc_vdi *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int free_start_cmp(const struct free_extent *a,
+			  const struct free_extent *b)
+{
+	return intcmp(a->start, b->start);
+}
+
+static int free_count_cmp(const struct free_extent *a,
+			  const struct free_extent *b)
+{
+	int ret = intcmp(a->count, b->count);
+
+	return ret ? ret : intcmp(a->start, b->start);
+}
+
+/* The meta object of the group, which is the first object of the group */
+static inline uint64_t group_meta_oid(const struct alloc_vdi *av, uint32_t g)
+{
+	return vid_to_data_oid(av->vid, g * av->group_size);
+}
+
+/* The lock of the group is the one of its meta object */
+static inline void group_lock(const struct alloc_vdi *av, uint32_t g)
+{
+	sys->cdrv->lock(group_meta_oid(av, g));
+}
+
+static inline void group_unlock(const struct alloc_vdi *av, uint32_t g)
+{
+	sys->cdrv->unlock(group_meta_oid(av, g));
+}
+
+static int read_trailer(uint64_t oid, struct trailer *tr)
+{
+	int ret;
+
+	ret = sd_read_object(oid, (char *)tr, sizeof(*tr), TRAILER_OFFSET);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read meta %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		return ret;
+	}
+	/* the meta objects written before the groups */
+	if (tr->magic != OALLOC_MAGIC) {
+		tr->magic = OALLOC_MAGIC;
+		tr->nr_groups = 1;
+		tr->gen = 0;
+	}
+	return SD_RES_SUCCESS;
+}
+
+static struct alloc_vdi *get_alloc_vdi(uint32_t vid)
+{
+	struct alloc_vdi *av, key = { .vid = vid };
+	struct trailer tr;
+
+	sd_mutex_lock(&alloc_vdi_lock);
+	av = rb_search(&alloc_vdi_root, &key, rb, alloc_vdi_cmp);
+	sd_mutex_unlock(&alloc_vdi_lock);
+	if (av)
+		return av;
+
+	if (read_trailer(vid_to_data_oid(vid, 0), &tr) != SD_RES_SUCCESS)
+		return NULL;
+	if (!tr.nr_groups || tr.nr_groups > OALLOC_NR_GROUPS) {
+		sd_err("bad number of groups %" PRIu32 " of %" PRIx32,
+		       tr.nr_groups, vid);
+		return NULL;
+	}
+
+	av = xzalloc(sizeof(*av) + sizeof(av->groups[0]) * tr.nr_groups);
+	av->vid = vid;
+	av->nr_groups = tr.nr_groups;
+	av->group_size = MAX_DATA_OBJS / tr.nr_groups;
+	for (uint32_t g = 0; g < av->nr_groups; g++) {
+		INIT_RB_ROOT(&av->groups[g].start_root);
+		INIT_RB_ROOT(&av->groups[g].count_root);
+	}
+
+	sd_mutex_lock(&alloc_vdi_lock);
+	key.vid = vid;
+	if (rb_insert(&alloc_vdi_root, av, rb, alloc_vdi_cmp)) {
+		free(av);
+		av = rb_search(&alloc_vdi_root, &key, rb, alloc_vdi_cmp);
+	}
+	sd_mutex_unlock(&alloc_vdi_lock);
+	return av;
+}
+
+static void group_insert(struct alloc_group *grp, uint64_t start,
+			 uint64_t count)
+{
+	struct free_extent *fe = xmalloc(sizeof(*fe));
+
+	fe->start = start;
+	fe->count = count;
+	rb_insert(&grp->start_root, fe, start_node, free_start_cmp);
+	rb_insert(&grp->count_root, fe, count_node, free_count_cmp);
+}
+
+static void group_erase(struct alloc_group *grp, struct free_extent *fe)
+{
+	rb_erase(&fe->start_node, &grp->start_root);
+	rb_erase(&fe->count_node, &grp->count_root);
+	free(fe);
+}
+
+static void group_drop(struct alloc_group *grp)
+{
+	rb_destroy(&grp->start_root, struct free_extent, start_node);
+	INIT_RB_ROOT(&grp->count_root);
+	grp->cached = false;
+}
+
+static int group_load(struct alloc_vdi *av, uint32_t g)
+{
+	struct alloc_group *grp = av->groups + g;
+	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
+	uint64_t oid = group_meta_oid(av, g);
+	struct trailer *tr;
+	struct header *hd;
+	struct free_desc *fd;
+	int ret;
+
+	group_drop(grp);
+	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read meta %" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	hd = (struct header *)meta;
+	tr = (struct trailer *)(meta + TRAILER_OFFSET);
+	if (hd->nr_free > MAX_FREE_DESC) {
+		sd_err("bad free list of meta %" PRIx64, oid);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	fd = HEADER_TO_FREE_DESC(hd);
+	for (uint64_t i = 0; i < hd->nr_free; i++, fd++)
+		group_insert(grp, fd->start, fd->count);
+
+	grp->used = hd->used;
+	grp->gen = tr->magic == OALLOC_MAGIC ? tr->gen : 0;
+	grp->cached = true;
+	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
+out:
+	free(meta);
+	return ret;
+}
+
+/* Take the free list of the group in the cache.  Called with the group lock */
+static int group_get(struct alloc_vdi *av, uint32_t g)
+{
+	struct alloc_group *grp = av->groups + g;
+	struct trailer tr;
+	int ret;
+
+	ret = read_trailer(group_meta_oid(av, g), &tr);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	if (grp->cached && grp->gen == tr.gen)
+		return SD_RES_SUCCESS;
+
+	return group_load(av, g);
+}
+
+/*
+ * Write the free list of the group back, in the descending order of the start
+ * the meta object always had.  Called with the group lock.
+ */
+static int group_put(struct alloc_vdi *av, uint32_t g)
+{
+	struct alloc_group *grp = av->groups + g;
+	uint64_t oid = group_meta_oid(av, g);
+	struct trailer tr = {
+		.magic = OALLOC_MAGIC,
+		.nr_groups = av->nr_groups,
+		.gen = grp->gen + 1,
+	};
+	struct header *hd;
+	struct free_desc *fd;
+	struct rb_node *n;
+	char *meta;
+	int ret;
+
+	/* the other nodes drop their cache before the free list changes */
+	ret = sd_write_object(oid, (char *)&tr, sizeof(tr), TRAILER_OFFSET,
+			      false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to update meta %"PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		group_drop(grp);
+		return ret;
+	}
+
+	meta = xmalloc(sizeof(*hd) + sizeof(*fd) * grp->start_root.nr);
+	hd = (struct header *)meta;
+	hd->used = grp->used;
+	hd->nr_free = grp->start_root.nr;
+	fd = HEADER_TO_FREE_DESC(hd);
+	for (n = rb_last(&grp->start_root); n; n = rb_prev(n), fd++) {
+		struct free_extent *fe = rb_entry(n, struct free_extent,
+						  start_node);
+
+		fd->start = fe->start;
+		fd->count = fe->count;
+	}
+
+	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to update meta %"PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+		group_drop(grp);
+	} else
+		grp->gen = tr.gen;
+	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
+	free(meta);
+	return ret;
+}
+
+/* Best fit in the group.  Called with the group lock. */
+static int group_alloc(struct alloc_vdi *av, uint32_t g, uint64_t *start,
+		       uint64_t count)
+{
+	struct alloc_group *grp = av->groups + g;
+	struct free_extent *fe, key = { .count = count };
+	int ret;
+
+	ret = group_get(av, g);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	fe = rb_nsearch(&grp->count_root, &key, count_node, free_count_cmp);
+	if (!fe || fe->count < count)
+		return SD_RES_NO_SPACE;
+
+	*start = fe->start;
+	if (fe->count == count)
+		group_erase(grp, fe);
+	else {
+		/* the order by start holds */
+		rb_erase(&fe->count_node, &grp->count_root);
+		fe->start += count;
+		fe->count -= count;
+		rb_insert(&grp->count_root, fe, count_node, free_count_cmp);
+	}
+	grp->used += count;
+
+	return group_put(av, g);
+}
+
+/*
+ * Merge the freed objects with their neighbours in the free list.  Called with
+ * the group lock.
+ */
+static int group_free(struct alloc_vdi *av, uint32_t g, uint64_t start,
+		      uint64_t count)
+{
+	struct alloc_group *grp = av->groups + g;
+	struct free_extent *prev, *next, key = { .start = start };
+	struct rb_node *n;
+	int ret;
+
+	ret = group_get(av, g);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	next = rb_nsearch(&grp->start_root, &key, start_node, free_start_cmp);
+	if (next && next->start < start)
+		/* rb_nsearch wraps around */
+		next = NULL;
+	n = next ? rb_prev(&next->start_node) : rb_last(&grp->start_root);
+	prev = n ? rb_entry(n, struct free_extent, start_node) : NULL;
+
+	if ((next && start + count > next->start) ||
+	    (prev && prev->start + prev->count > start)) {
+		sd_emerg("bad free descriptor found at %"PRIx32, av->vid);
+		return SD_RES_EIO;
+	}
+
+	if (prev && prev->start + prev->count == start) {
+		rb_erase(&prev->count_node, &grp->count_root);
+		prev->count += count;
+		if (next && start + count == next->start) {
+			prev->count += next->count;
+			group_erase(grp, next);
+		}
+		rb_insert(&grp->count_root, prev, count_node, free_count_cmp);
+	} else if (next && start + count == next->start) {
+		rb_erase(&next->count_node, &grp->count_root);
+		next->start = start;
+		next->count += count;
+		rb_insert(&grp->count_root, next, count_node, free_count_cmp);
+	} else {
+		if (grp->start_root.nr >= MAX_FREE_DESC)
+			return SD_RES_NO_SPACE;
+		group_insert(grp, start, count);
+	}
+	grp->used -= count;
+
+	return group_put(av, g);
+}
+
 /*
  * Initialize the data vdi
  *
@@ -62,20 +416,25 @@ static inline uint32_t oalloc_meta_length(struct header *hd)
  */
 int oalloc_init(uint32_t vid)
 {
-	struct strbuf buf = STRBUF_INIT;
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
-	struct header hd = {
-		.nr_free = 1,
+	struct alloc_vdi *av, key = { .vid = vid };
+	uint64_t group_size = MAX_DATA_OBJS / OALLOC_NR_GROUPS;
+	struct {
+		struct header hd;
+		struct free_desc fd;
+	} meta = {
+		.hd.nr_free = 1,
+		.fd.count = group_size - 1,
 	};
-	struct free_desc fd = {
-		.start = 1, /* Use first object as the meta object */
-		.count = MAX_DATA_OBJS - 1,
+	struct trailer tr = {
+		.magic = OALLOC_MAGIC,
+		.nr_groups = OALLOC_NR_GROUPS,
+		/* the caches of a deleted vdi of the same vid don't match */
+		.gen = clock_get_time(),
 	};
+	uint64_t oid;
 	int ret;
 
-	strbuf_add(&buf, &hd, sizeof(hd));
-	strbuf_add(&buf, &fd, sizeof(fd));
-
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(*inode), 0);
 	if (ret != SD_RES_SUCCESS) {
@@ -83,22 +442,40 @@ int oalloc_init(uint32_t vid)
 		       sd_strerror(ret));
 		goto out;
 	}
-	ret = sd_write_object(vid_to_data_oid(vid, 0), buf.buf,
-			      buf.len, 0, true);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to create meta object for %" PRIx32", %s", vid,
-		       sd_strerror(ret));
-		goto out;
+
+	for (uint32_t g = 0; g < OALLOC_NR_GROUPS; g++) {
+		oid = vid_to_data_oid(vid, g * group_size);
+		/* Use first object of the group as the meta object */
+		meta.fd.start = g * group_size + 1;
+		ret = sd_write_object(oid, (char *)&meta, sizeof(meta), 0,
+				      true);
+		if (ret == SD_RES_SUCCESS)
+			ret = sd_write_object(oid, (char *)&tr, sizeof(tr),
+					      TRAILER_OFFSET, false);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to create meta object for %" PRIx32
+			       ", %s", vid, sd_strerror(ret));
+			goto out;
+		}
+		sd_inode_set_vid(inode, g * group_size, vid);
 	}
-	sd_inode_set_vid(inode, 0, vid);
-	ret = sd_inode_write_vid(inode, 0, vid, vid, 0, false, false);
+	ret = sd_inode_write(inode, 0, false, false);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to update inode, %" PRIx32", %s", vid,
 		       sd_strerror(ret));
 		goto out;
 	}
+
+	sd_mutex_lock(&alloc_vdi_lock);
+	av = rb_search(&alloc_vdi_root, &key, rb, alloc_vdi_cmp);
+	if (av) {
+		rb_erase(&av->rb, &alloc_vdi_root);
+		for (uint32_t g = 0; g < av->nr_groups; g++)
+			group_drop(av->groups + g);
+		free(av);
+	}
+	sd_mutex_unlock(&alloc_vdi_lock);
 out:
-	strbuf_release(&buf);
 	free(inode);
 	return ret;
 }
@@ -115,45 +492,22 @@ out:
  */
 int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
 {
-	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
-	struct header *hd;
-	struct free_desc *fd;
-	uint64_t oid = vid_to_data_oid(vid, 0), i;
-	int ret;
-
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-		goto out;
-	}
-
-	hd = (struct header *)meta;
-	fd = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
-	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
-	for (i = 0; i < hd->nr_free; i++, fd--) {
-		sd_debug("start %"PRIu64", count %"PRIu64, fd->start,
-			 fd->count);
-		if (fd->count > count)
+	struct alloc_vdi *av = get_alloc_vdi(vid);
+	uint32_t first, g;
+	int ret = SD_RES_NO_SPACE;
+
+	if (!av)
+		return SD_RES_EIO;
+
+	first = uatomic_add_return(&next_group, 1);
+	for (uint32_t i = 0; i < av->nr_groups; i++) {
+		g = (first + i) % av->nr_groups;
+		group_lock(av, g);
+		ret = group_alloc(av, g, start, count);
+		group_unlock(av, g);
+		if (ret != SD_RES_NO_SPACE)
 			break;
 	}
-	if (i == hd->nr_free) {
-		ret = SD_RES_NO_SPACE;
-		goto out;
-	}
-
-	*start = fd->start;
-	fd->start += count;
-	fd->count -= count;
-	hd->used += count;
-
-	/* Update the meta object */
-	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
-	if (ret != SD_RES_SUCCESS)
-		sd_err("failed to update meta %"PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-out:
-	free(meta);
 	return ret;
 }
 
@@ -191,138 +545,81 @@ out:
 	return ret;
 }
 
-static int free_desc_cmp(struct free_desc *a, struct free_desc *b)
-{
-	return -intcmp(a->start, b->start);
-}
-
-static inline int update_and_merge_free_desc(char *meta, uint64_t start,
-					     uint64_t count, uint32_t vid)
-{
-	struct header *hd = (struct header *)meta;
-	struct free_desc *tail, *fd = HEADER_TO_FREE_DESC(hd);
-	uint64_t i, j;
-
-	/* Try our best to merge it in place, or append it to tail */
-	for (i = 0; i < hd->nr_free; i++) {
-		if (start + count == fd->start) {
-			fd->start = start;
-			fd->count += count;
-			break;
-		} else if(fd->start + fd->count == start) {
-			fd->count +=count;
-			break;
-		}
-		fd++;
-	}
-
-	if (i == hd->nr_free) {
-		if (hd->nr_free >= MAX_FREE_DESC)
-			return SD_RES_NO_SPACE;
-
-		tail = (struct free_desc *)(meta + oalloc_meta_length(hd));
-		tail->start = start;
-		tail->count = count;
-		hd->nr_free++;
-	}
-
-	hd->used -= count;
-	xqsort(HEADER_TO_FREE_DESC(hd), hd->nr_free, free_desc_cmp);
-
-	/* Merge as hard as we can */
-	j = hd->nr_free - 1;
-	tail = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
-	for (i = 0; i < j; i++, tail--) {
-		struct free_desc *front = tail - 1;
-
-		sd_debug("start %"PRIu64", count %"PRIu64, tail->start,
-			 tail->count);
-		if (tail->start + tail->count > front->start)
-			sd_emerg("bad free descriptor found at %"PRIx32, vid);
-		if (tail->start + tail->count == front->start) {
-			front->start = tail->start;
-			front->count += tail->count;
-			memmove(tail, tail + 1, sizeof(*tail) * i);
-			hd->nr_free--;
-		}
-	}
-
-	return SD_RES_SUCCESS;
-}
-
 /*
  * Discard the allocated objects and update the free list of the allocator
  *
- * Caller should check the return value since it might fail.
+ * The extents are discarded with a single update of the inode.  Caller should
+ * check the return value since it might fail.
  *
  * @vid: the vdi where the allocator resides
- * @start: start index of the objects to free
- * @count: number of the objects to free
+ * @ext: the extents of the objects to free
+ * @nr: number of the extents
  */
-int oalloc_free(uint32_t vid, uint64_t start, uint64_t count)
+int oalloc_free(uint32_t vid, const struct oalloc_extent *ext, int nr)
 {
-	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
-	struct header *hd;
-	uint64_t oid = vid_to_data_oid(vid, 0), i;
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
-	int ret;
+	struct alloc_vdi *av = get_alloc_vdi(vid);
+	uint32_t g;
+	uint64_t i;
+	int ret, err, n;
 
+	if (!av) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	sys->cdrv->lock(vid);
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(*inode), 0);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to read inode, %" PRIx64 ", %s",
 		       vid_to_vdi_oid(vid), sd_strerror(ret));
+		sys->cdrv->unlock(vid);
 		goto out;
 	}
 
-	sd_debug("discard start %"PRIu64" end %"PRIu64, start,
-		 start + count - 1);
-	sd_inode_set_vid_range(inode, start, (start + count - 1), 0);
+	for (n = 0; n < nr; n++) {
+		sd_debug("discard start %"PRIu64" end %"PRIu64, ext[n].start,
+			 ext[n].start + ext[n].count - 1);
+		sd_inode_set_vid_range(inode, ext[n].start,
+				       ext[n].start + ext[n].count - 1, 0);
+	}
 
 	ret = sd_inode_write(inode, 0, false, false);
+	sys->cdrv->unlock(vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to update inode, %" PRIx64", %s",
 		       vid_to_vdi_oid(vid), sd_strerror(ret));
 		goto out;
 	}
 
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-		goto out;
-	}
-
-	ret = update_and_merge_free_desc(meta, start, count, vid);
-	if (ret != SD_RES_SUCCESS)
-		goto out;
-
 	/* XXX use aio to speed up remove of objects */
-	for (i = 0; i < count; i++) {
-		struct sd_req hdr;
-		int res;
-
-		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
-		hdr.obj.oid = vid_to_data_oid(vid, start + i);
-		res = exec_local_req(&hdr, NULL);
-		/*
-		 * return the error code if it does not
-		 * success or can't find obj.
-		 */
-		if (res != SD_RES_SUCCESS && res != SD_RES_NO_OBJ)
-			ret = res;
-	}
+	for (n = 0; n < nr; n++)
+		for (i = 0; i < ext[n].count; i++) {
+			struct sd_req hdr;
+			int res;
+
+			sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+			hdr.obj.oid = vid_to_data_oid(vid, ext[n].start + i);
+			res = exec_local_req(&hdr, NULL);
+			/*
+			 * return the error code if it does not
+			 * success or can't find obj.
+			 */
+			if (res != SD_RES_SUCCESS && res != SD_RES_NO_OBJ)
+				ret = res;
+		}
 
-	hd = (struct header *)meta;
-	ret = sd_write_object(oid, meta, oalloc_meta_length(hd), 0, false);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to update meta %"PRIx64 ", %s", oid,
-		       sd_strerror(ret));
-		goto out;
+	for (n = 0; n < nr; n++) {
+		/* the objects are allocated in a group */
+		g = ext[n].start / av->group_size;
+		group_lock(av, g);
+		err = group_free(av, g, ext[n].start, ext[n].count);
+		group_unlock(av, g);
+		if (err != SD_RES_SUCCESS)
+			ret = err;
 	}
-	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
 out:
-	free(meta);
 	free(inode);
 	return ret;
 }
@@ -9,9 +9,12 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "strbuf.h"
 #include "http.h"
 
 #define MAX_BUCKET_LISTING 1000
+/* of the request to complete a multipart upload */
+#define MAX_COMPLETE_BODY (1024 * 1024)
 
 static void s3_write_err_response(struct http_request *req, const char *code,
 				  const char *desc)
@@ -27,15 +30,24 @@ static void s3_write_err_response(struct http_request *req, const char *code,
 
 static void s3_get_service_cb(const char *bucket, void *opaque)
 {
+	http_stream_addf(opaque, "<Bucket><Name>%s</Name></Bucket>\r\n",
+			 bucket);
 }
 
 static void s3_get_service(struct http_request *req)
 {
-	bool print_header = true;
-
-	kv_iterate_bucket("s3", s3_get_service_cb, &print_header);
-
-	http_request_writes(req, "</Buckets></ListAllMyBucketsResult>\r\n");
+	struct http_stream s;
+	int ret;
+
+	http_stream_init(&s, req);
+	http_stream_addf(&s, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+			 "<ListAllMyBucketsResult><Buckets>\r\n");
+	ret = kv_iterate_bucket("s3", s3_get_service_cb, &s);
+	if (ret == SD_RES_SUCCESS) {
+		http_stream_addf(&s, "</Buckets></ListAllMyBucketsResult>\r\n");
+		http_stream_end(&s);
+	} else if (!http_stream_abort(&s))
+		http_response_header(req, INTERNAL_SERVER_ERROR);
 }
 
 /* Operations on Buckets */
@@ -45,25 +57,83 @@ static void s3_head_bucket(struct http_request *req, const char *bucket)
 	http_response_header(req, NOT_IMPLEMENTED);
 }
 
-static void s3_get_bucket_cb(const char *object, void *opaque)
+struct s3_listing {
+	struct http_stream s;
+	char last[SD_MAX_OBJECT_NAME];
+};
+
+static void s3_get_bucket_cb(const char *name, bool common_prefix,
+			     void *opaque)
 {
+	struct s3_listing *sl = opaque;
+
+	if (common_prefix)
+		http_stream_addf(&sl->s, "<CommonPrefixes><Prefix>%s</Prefix>"
+				 "</CommonPrefixes>\r\n", name);
+	else
+		http_stream_addf(&sl->s, "<Contents><Key>%s</Key>"
+				 "</Contents>\r\n", name);
+	pstrcpy(sl->last, sizeof(sl->last), name);
 }
 
+/*
+ * GET /bucket?prefix=P&marker=M&delimiter=D&max-keys=N
+ *
+ * The entries are streamed in the order of names as they are listed, so
+ * IsTruncated and NextMarker, only known at the end, follow them.
+ */
 static void s3_get_bucket(struct http_request *req, const char *bucket)
 {
-	bool print_header = true;
-
-	kv_iterate_object("s3", bucket, s3_get_bucket_cb, &print_header);
+	char prefix[SD_MAX_OBJECT_NAME] = "", marker[SD_MAX_OBJECT_NAME] = "";
+	char delimiter[2] = "", max_keys[16];
+	struct s3_listing sl = {};
+	struct kv_list list = {
+		.prefix = prefix,
+		.max_keys = MAX_BUCKET_LISTING,
+		.cb = s3_get_bucket_cb,
+		.opaque = &sl,
+	};
+	int ret;
+
+	http_request_query(req, "prefix", prefix, sizeof(prefix));
+	if (http_request_query(req, "marker", marker, sizeof(marker)))
+		list.marker = marker;
+	if (http_request_query(req, "delimiter", delimiter, sizeof(delimiter)))
+		list.delimiter = delimiter[0];
+	if (http_request_query(req, "max-keys", max_keys, sizeof(max_keys)) &&
+	    atoi(max_keys) >= 0)
+		list.max_keys = min(atoi(max_keys), MAX_BUCKET_LISTING);
+
+	http_stream_init(&sl.s, req);
+	http_stream_addf(&sl.s,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+		"<ListBucketResult>\r\n"
+		"<Name>%s</Name>\r\n<Prefix>%s</Prefix>\r\n"
+		"<Marker>%s</Marker>\r\n"
+		"<MaxKeys>%"PRIu32"</MaxKeys>\r\n",
+		bucket, prefix, marker, list.max_keys);
+	ret = kv_list_objects("s3", bucket, &list);
+	if (ret == SD_RES_SUCCESS) {
+		http_stream_addf(&sl.s, "<IsTruncated>%s</IsTruncated>\r\n",
+				 list.truncated ? "true" : "false");
+		if (list.truncated && list.delimiter)
+			http_stream_addf(&sl.s,
+				"<NextMarker>%s</NextMarker>\r\n", sl.last);
+		http_stream_addf(&sl.s, "</ListBucketResult>\r\n");
+		http_stream_end(&sl.s);
+		return;
+	}
+	if (http_stream_abort(&sl.s))
+		return;
 
-	switch (req->status) {
-	case OK:
-		http_request_writes(req, "</ListBucketResult>\r\n");
-		break;
-	case NOT_FOUND:
+	switch (ret) {
+	case SD_RES_NO_VDI:
+		http_response_header(req, NOT_FOUND);
 		s3_write_err_response(req, "NoSuchBucket",
 			"The specified bucket does not exist");
 		break;
 	default:
+		http_response_header(req, INTERNAL_SERVER_ERROR);
 		break;
 	}
 }
@@ -105,22 +175,114 @@ static void s3_delete_bucket(struct http_request *req, const char *bucket)
 static void s3_head_object(struct http_request *req, const char *bucket,
 			   const char *object)
 {
-	http_response_header(req, NOT_IMPLEMENTED);
+	switch (kv_read_object_meta(req, "s3", bucket, object)) {
+	case SD_RES_SUCCESS:
+		http_response_header(req, OK);
+		break;
+	case SD_RES_NO_VDI:
+	case SD_RES_NO_OBJ:
+		http_response_header(req, NOT_FOUND);
+		break;
+	default:
+		http_response_header(req, INTERNAL_SERVER_ERROR);
+		break;
+	}
 }
 
 static void s3_get_object(struct http_request *req, const char *bucket,
 			  const char *object)
 {
-	kv_read_object(req, "s3", bucket, object);
+	int ret = kv_read_object(req, "s3", bucket, object);
 
-	if (req->status == NOT_FOUND)
+	/* the data is sent already */
+	if (ret == SD_RES_SUCCESS || req->status != UNKNOWN)
+		return;
+
+	switch (ret) {
+	case SD_RES_NO_VDI:
+		http_response_header(req, NOT_FOUND);
+		s3_write_err_response(req, "NoSuchBucket",
+			"The specified bucket does not exist");
+		break;
+	case SD_RES_NO_OBJ:
+		http_response_header(req, NOT_FOUND);
 		s3_write_err_response(req, "NoSuchKey",
 			"The resource you requested does not exist");
+		break;
+	case SD_RES_INVALID_PARMS:
+		http_response_header(req, REQUEST_RANGE_NOT_SATISFIABLE);
+		s3_write_err_response(req, "InvalidRange",
+			"The requested range is not satisfiable");
+		break;
+	default:
+		http_response_header(req, INTERNAL_SERVER_ERROR);
+		break;
+	}
+}
+
+static void s3_upload_err_response(struct http_request *req, int ret)
+{
+	switch (ret) {
+	case SD_RES_NO_VDI:
+		http_response_header(req, NOT_FOUND);
+		s3_write_err_response(req, "NoSuchBucket",
+			"The specified bucket does not exist");
+		break;
+	case SD_RES_NO_OBJ:
+		http_response_header(req, NOT_FOUND);
+		s3_write_err_response(req, "NoSuchUpload",
+			"The specified multipart upload does not exist");
+		break;
+	case SD_RES_INVALID_PARMS:
+		http_response_header(req, BAD_REQUEST);
+		s3_write_err_response(req, "InvalidPart",
+			"One or more of the specified parts can't be found");
+		break;
+	case SD_RES_NO_SPACE:
+		http_response_header(req, SERVICE_UNAVAILABLE);
+		break;
+	case SD_RES_INCOMPLETE:
+		http_response_header(req, CONFLICT);
+		break;
+	default:
+		http_response_header(req, INTERNAL_SERVER_ERROR);
+		break;
+	}
+}
+
+/* Upload a part, PUT /bucket/object?partNumber=N&uploadId=ID */
+static void s3_put_part(struct http_request *req, const char *bucket,
+			const char *upload_id, const char *part)
+{
+	char *end;
+	unsigned long nr = strtoul(part, &end, 10);
+	int ret;
+
+	if (*end || end == part)
+		ret = SD_RES_INVALID_PARMS;
+	else
+		ret = kv_create_part(req, "s3", bucket, upload_id, nr);
+	if (ret != SD_RES_SUCCESS) {
+		s3_upload_err_response(req, ret);
+		return;
+	}
+
+	http_request_writef(req, "ETag: \"%s-%lu\"\r\n", upload_id, nr);
+	http_response_header(req, OK);
 }
 
 static void s3_put_object(struct http_request *req, const char *bucket,
 			  const char *object)
 {
+	/* one more byte to refuse the longer ids */
+	char upload_id[KV_UPLOAD_ID_LEN + 2], part[16];
+
+	if (http_request_query(req, "uploadId", upload_id, sizeof(upload_id)) &&
+	    http_request_query(req, "partNumber", part, sizeof(part))) {
+		s3_put_part(req, bucket, upload_id, part);
+		return;
+	}
+
 	kv_create_object(req, "s3", bucket, object);
 
 	if (req->status == NOT_FOUND)
@@ -128,15 +290,130 @@ static void s3_put_object(struct http_request *req, const char *bucket,
 			"The specified bucket does not exist");
 }
 
+/* Start an upload, POST /bucket/object?uploads */
+static void s3_initiate_upload(struct http_request *req, const char *bucket,
+			       const char *object)
+{
+	char upload_id[KV_UPLOAD_ID_LEN + 1];
+	int ret;
+
+	ret = kv_initiate_upload("s3", bucket, upload_id);
+	if (ret != SD_RES_SUCCESS) {
+		s3_upload_err_response(req, ret);
+		return;
+	}
+
+	http_response_header(req, OK);
+	http_request_writef(req,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+		"<InitiateMultipartUploadResult>\r\n"
+		"<Bucket>%s</Bucket>\r\n<Key>%s</Key>\r\n"
+		"<UploadId>%s</UploadId>\r\n"
+		"</InitiateMultipartUploadResult>\r\n",
+		bucket, object, upload_id);
+}
+
+/*
+ * Parse the part numbers of the body of the completion, which lists the
+ * <Part> elements in the ascending order of their <PartNumber>.  Return the
+ * number of parts, or -1 for a malformed body.
+ */
+static int s3_parse_parts(char *body, uint32_t **parts)
+{
+	static const char tag[] = "<PartNumber>";
+	unsigned long nr;
+	char *p = body, *end;
+	int n = 0;
+
+	*parts = NULL;
+	while ((p = strstr(p, tag))) {
+		p += sizeof(tag) - 1;
+		nr = strtoul(p, &end, 10);
+		if (end == p || strncmp(end, "</PartNumber>", 13) ||
+		    !nr || nr > UINT32_MAX) {
+			free(*parts);
+			*parts = NULL;
+			return -1;
+		}
+		*parts = xrealloc(*parts, sizeof(**parts) * (n + 1));
+		(*parts)[n++] = nr;
+		p = end;
+	}
+	return n;
+}
+
+/* Complete an upload, POST /bucket/object?uploadId=ID */
+static void s3_complete_upload(struct http_request *req, const char *bucket,
+			       const char *object, const char *upload_id)
+{
+	uint32_t *parts = NULL;
+	char *body = NULL;
+	int ret, len, nr = 0;
+
+	if (!req->data_length || req->data_length > MAX_COMPLETE_BODY) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+	body = xmalloc(req->data_length + 1);
+	len = http_request_read(req, body, req->data_length);
+	if (len != req->data_length) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	body[len] = '\0';
+
+	nr = s3_parse_parts(body, &parts);
+	if (nr <= 0) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+	ret = kv_complete_upload("s3", bucket, object, upload_id, parts, nr);
+out:
+	if (ret == SD_RES_SUCCESS) {
+		http_response_header(req, OK);
+		http_request_writef(req,
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+			"<CompleteMultipartUploadResult>\r\n"
+			"<Bucket>%s</Bucket>\r\n<Key>%s</Key>\r\n"
+			"<ETag>\"%s-%d\"</ETag>\r\n"
+			"</CompleteMultipartUploadResult>\r\n",
+			bucket, object, upload_id, nr);
+	} else
+		s3_upload_err_response(req, ret);
+	free(body);
+	free(parts);
+}
+
 static void s3_post_object(struct http_request *req, const char *bucket,
 			   const char *object)
 {
-	http_response_header(req, NOT_IMPLEMENTED);
+	char upload_id[KV_UPLOAD_ID_LEN + 2];
+
+	if (http_request_query(req, "uploads", upload_id, sizeof(upload_id)))
+		s3_initiate_upload(req, bucket, object);
+	else if (http_request_query(req, "uploadId", upload_id,
+				    sizeof(upload_id)))
+		s3_complete_upload(req, bucket, object, upload_id);
+	else
+		http_response_header(req, NOT_IMPLEMENTED);
 }
 
 static void s3_delete_object(struct http_request *req, const char *bucket,
 			     const char *object)
 {
+	char upload_id[KV_UPLOAD_ID_LEN + 2];
+	int ret;
+
+	/* Abort an upload, DELETE /bucket/object?uploadId=ID */
+	if (http_request_query(req, "uploadId", upload_id, sizeof(upload_id))) {
+		ret = kv_abort_upload("s3", bucket, upload_id);
+		if (ret == SD_RES_SUCCESS)
+			http_response_header(req, NO_CONTENT);
+		else
+			s3_upload_err_response(req, ret);
+		return;
+	}
+
 	kv_delete_object("s3", bucket, object, 0);
 
 	if (req->status == NOT_FOUND)
@@ -12,6 +12,9 @@
 #include "strbuf.h"
 #include "http.h"
 
+/* the default and the most names of a container listing, as swift does */
+#define SWIFT_MAX_LISTING 10000
+
 /* Operations on Accounts */
 
 static void swift_head_account(struct http_request *req, const char *account)
@@ -27,23 +30,24 @@ static void swift_head_account(struct http_request *req, const char *account)
 
 static void swift_get_account_cb(const char *bucket, void *opaque)
 {
-	struct strbuf *buf = (struct strbuf *)opaque;
-
-	strbuf_addf(buf, "%s\n", bucket);
+	http_stream_addf(opaque, "%s\n", bucket);
 }
 
 static void swift_get_account(struct http_request *req, const char *account)
 {
-	struct strbuf buf = STRBUF_INIT;
+	struct http_stream s;
 	int ret;
 
-	ret = kv_iterate_bucket(account, swift_get_account_cb, &buf);
+	http_stream_init(&s, req);
+	ret = kv_iterate_bucket(account, swift_get_account_cb, &s);
+	if (ret == SD_RES_SUCCESS) {
+		http_stream_end(&s);
+		return;
+	}
+	if (http_stream_abort(&s))
+		return;
+
 	switch (ret) {
-	case SD_RES_SUCCESS:
-		req->data_length = buf.len;
-		http_response_header(req, OK);
-		http_request_write(req, buf.buf, buf.len);
-		break;
 	case SD_RES_NO_VDI:
 		http_response_header(req, NOT_FOUND);
 		break;
@@ -51,7 +55,6 @@ static void swift_get_account(struct http_request *req, const char *account)
 		http_response_header(req, INTERNAL_SERVER_ERROR);
 		break;
 	}
-	strbuf_release(&buf);
 }
 
 static void swift_put_account(struct http_request *req, const char *account)
@@ -116,27 +119,45 @@ static void swift_head_container(struct http_request *req, const char *account,
 	}
 }
 
-static void swift_get_container_cb(const char *object, void *opaque)
+static void swift_get_container_cb(const char *object, bool common_prefix,
+				   void *opaque)
 {
-	struct strbuf *buf = (struct strbuf *)opaque;
-
-	strbuf_addf(buf, "%s\n", object);
+	http_stream_addf(opaque, "%s\n", object);
 }
 
 static void swift_get_container(struct http_request *req, const char *account,
 				const char *container)
 {
-	struct strbuf buf = STRBUF_INIT;
+	char prefix[SD_MAX_OBJECT_NAME] = "", marker[SD_MAX_OBJECT_NAME];
+	char delimiter[2] = "", limit[16];
+	struct http_stream s;
+	struct kv_list list = {
+		.prefix = prefix,
+		.max_keys = SWIFT_MAX_LISTING,
+		.cb = swift_get_container_cb,
+		.opaque = &s,
+	};
 	int ret;
 
-	ret = kv_iterate_object(account, container, swift_get_container_cb,
-				&buf);
+	http_request_query(req, "prefix", prefix, sizeof(prefix));
+	if (http_request_query(req, "marker", marker, sizeof(marker)))
+		list.marker = marker;
+	if (http_request_query(req, "delimiter", delimiter, sizeof(delimiter)))
+		list.delimiter = delimiter[0];
+	if (http_request_query(req, "limit", limit, sizeof(limit)) &&
+	    atoi(limit) > 0)
+		list.max_keys = min(atoi(limit), SWIFT_MAX_LISTING);
+
+	http_stream_init(&s, req);
+	ret = kv_list_objects(account, container, &list);
+	if (ret == SD_RES_SUCCESS) {
+		http_stream_end(&s);
+		return;
+	}
+	if (http_stream_abort(&s))
+		return;
+
 	switch (ret) {
-	case SD_RES_SUCCESS:
-		req->data_length = buf.len;
-		http_response_header(req, OK);
-		http_request_write(req, buf.buf, buf.len);
-		break;
 	case SD_RES_NO_VDI:
 		http_response_header(req, NOT_FOUND);
 		break;
@@ -144,7 +165,6 @@ static void swift_get_container(struct http_request *req, const char *account,
 		http_response_header(req, INTERNAL_SERVER_ERROR);
 		break;
 	}
-	strbuf_release(&buf);
 }
 
 static void swift_put_container(struct http_request *req, const char *account,
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous accounting of the usage of the buckets
+ *
+ * The object_count and the bytes_used of a bucket are in its bnode.  The PUTs
+ * and the DELETEs of the objects add their deltas to a table in memory instead
+ * of rewriting the bnode, so the writes to a bucket don't serialize on it.
+ * Every KV_USAGE_INTERVAL seconds the deltas of a bucket are added to its bnode
+ * under the lock of the account, and the reads of the usage add those still
+ * in the table.  The deltas of the other gateways show up within
+ * KV_USAGE_INTERVAL.
+ *
+ * The buckets in the table are listed in KV_USAGE_FILE of the sheep, rewritten
+ * when a bucket comes in or leaves, which it does after an interval without a
+ * delta.  On exit the deltas go to the file too and the next start flushes
+ * them; after a crash they are lost, so the next start recounts the usage of
+ * the buckets listed from their onodes.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+#define KV_USAGE_INTERVAL 5 /* seconds */
+#define KV_USAGE_FILE "/kv_usage"
+
+struct kv_usage {
+	char account[SD_MAX_VDI_LEN];
+	char bucket[SD_MAX_BUCKET_NAME];
+	int64_t objects;
+	int64_t bytes;
+	bool idle; /* no delta since the last flush */
+	bool recount; /* the deltas of a crash are lost */
+	struct rb_node node;
+};
+
+/* a bucket of KV_USAGE_FILE */
+struct kv_usage_rec {
+	char account[SD_MAX_VDI_LEN];
+	char bucket[SD_MAX_BUCKET_NAME];
+	int64_t objects;
+	int64_t bytes;
+	uint8_t exact; /* written on exit, the deltas are to be flushed */
+	uint8_t __pad[7];
+};
+
+static struct rb_root usage_root = RB_ROOT;
+static int nr_usages;
+static struct sd_mutex usage_lock = SD_MUTEX_INITIALIZER;
+static char *usage_path;
+static struct timer usage_timer;
+static bool usage_flushing;
+
+static int usage_cmp(const struct kv_usage *a, const struct kv_usage *b)
+{
+	int ret = strcmp(a->account, b->account);
+
+	return ret ? ret : strcmp(a->bucket, b->bucket);
+}
+
+static struct kv_usage *usage_find(const char *account, const char *bucket)
+{
+	struct kv_usage key;
+
+	pstrcpy(key.account, sizeof(key.account), account);
+	pstrcpy(key.bucket, sizeof(key.bucket), bucket);
+	return rb_search(&usage_root, &key, node, usage_cmp);
+}
+
+/* Rewrite the list of the buckets, with their deltas on exit */
+static void usage_save(bool exact)
+{
+	struct kv_usage_rec *recs;
+	struct kv_usage *u;
+	int i = 0;
+
+	recs = xzalloc(sizeof(*recs) * (nr_usages ?: 1));
+	rb_for_each_entry(u, &usage_root, node) {
+		pstrcpy(recs[i].account, sizeof(recs[i].account), u->account);
+		pstrcpy(recs[i].bucket, sizeof(recs[i].bucket), u->bucket);
+		recs[i].objects = u->objects;
+		recs[i].bytes = u->bytes;
+		recs[i].exact = exact && !u->recount;
+		i++;
+	}
+	if (atomic_create_and_write(usage_path, (char *)recs,
+				    sizeof(*recs) * nr_usages, true) < 0)
+		sd_err("failed to write %s, %m", usage_path);
+	free(recs);
+}
+
+static struct kv_usage *usage_get(const char *account, const char *bucket)
+{
+	struct kv_usage *u = usage_find(account, bucket);
+
+	if (u)
+		return u;
+
+	u = xzalloc(sizeof(*u));
+	pstrcpy(u->account, sizeof(u->account), account);
+	pstrcpy(u->bucket, sizeof(u->bucket), bucket);
+	rb_insert(&usage_root, u, node, usage_cmp);
+	nr_usages++;
+	/* listed before the delta is, for a recount after a crash */
+	usage_save(false);
+	return u;
+}
+
+/* Account an object of the bucket created or deleted */
+void kv_usage_add(const char *account, const char *bucket, int64_t objects,
+		  int64_t bytes)
+{
+	struct kv_usage *u;
+
+	sd_mutex_lock(&usage_lock);
+	u = usage_get(account, bucket);
+	u->objects += objects;
+	u->bytes += bytes;
+	u->idle = false;
+	sd_mutex_unlock(&usage_lock);
+}
+
+/* The deltas of the bucket not in its bnode yet */
+void kv_usage_peek(const char *account, const char *bucket, int64_t *objects,
+		   int64_t *bytes)
+{
+	struct kv_usage *u;
+
+	*objects = *bytes = 0;
+	sd_mutex_lock(&usage_lock);
+	u = usage_find(account, bucket);
+	if (u) {
+		*objects = u->objects;
+		*bytes = u->bytes;
+	}
+	sd_mutex_unlock(&usage_lock);
+}
+
+/*
+ * Take the deltas of the bucket to add them to its bnode, which gives them
+ * back by kv_usage_add() if it fails
+ */
+void kv_usage_take(const char *account, const char *bucket, int64_t *objects,
+		   int64_t *bytes)
+{
+	struct kv_usage *u;
+
+	*objects = *bytes = 0;
+	sd_mutex_lock(&usage_lock);
+	u = usage_find(account, bucket);
+	if (u) {
+		*objects = u->objects;
+		*bytes = u->bytes;
+		u->objects = u->bytes = 0;
+	}
+	sd_mutex_unlock(&usage_lock);
+}
+
+/* The bnode is recounted, the deltas until now are in it */
+void kv_usage_recounted(const char *account, const char *bucket)
+{
+	struct kv_usage *u;
+
+	sd_mutex_lock(&usage_lock);
+	u = usage_find(account, bucket);
+	if (u) {
+		u->objects = u->bytes = 0;
+		u->recount = false;
+	}
+	sd_mutex_unlock(&usage_lock);
+}
+
+struct usage_work {
+	struct work work;
+};
+
+static void usage_flush_work(struct work *work)
+{
+	struct kv_usage *u, key;
+	bool changed = false;
+	int ret;
+
+	sd_mutex_lock(&usage_lock);
+	rb_for_each_entry(u, &usage_root, node) {
+		if (!u->recount && !u->objects && !u->bytes)
+			continue;
+
+		key = *u;
+		sd_mutex_unlock(&usage_lock);
+		if (key.recount)
+			ret = kv_recount_usage(key.account, key.bucket);
+		else
+			ret = kv_flush_usage(key.account, key.bucket);
+		if (ret != SD_RES_SUCCESS)
+			sd_debug("failed to account %s/%s, %s", key.account,
+				 key.bucket, sd_strerror(ret));
+		/* the buckets leave only below, the iteration goes on */
+		sd_mutex_lock(&usage_lock);
+	}
+
+	rb_for_each_entry(u, &usage_root, node) {
+		if (u->recount || u->objects || u->bytes)
+			continue;
+		if (!u->idle) {
+			u->idle = true;
+			continue;
+		}
+		rb_erase(&u->node, &usage_root);
+		free(u);
+		nr_usages--;
+		changed = true;
+	}
+	if (changed)
+		usage_save(false);
+	sd_mutex_unlock(&usage_lock);
+}
+
+static void usage_flush_done(struct work *work)
+{
+	free(container_of(work, struct usage_work, work));
+	usage_flushing = false;
+}
+
+static void usage_tick(void *data)
+{
+	struct usage_work *uw;
+
+	add_timer(&usage_timer, KV_USAGE_INTERVAL);
+	if (usage_flushing || sys->cinfo.status != SD_STATUS_OK)
+		return;
+
+	usage_flushing = true;
+	uw = xzalloc(sizeof(*uw));
+	uw->work.fn = usage_flush_work;
+	uw->work.done = usage_flush_done;
+	queue_work(sys->http_wqueue, &uw->work);
+}
+
+int kv_usage_init(const char *dir)
+{
+	struct kv_usage_rec *recs;
+	struct kv_usage *u;
+	struct stat st;
+	size_t len;
+	int fd;
+
+	len = strlen(dir) + strlen(KV_USAGE_FILE) + 1;
+	usage_path = xzalloc(len);
+	snprintf(usage_path, len, "%s" KV_USAGE_FILE, dir);
+
+	fd = open(usage_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			sd_err("failed to open %s, %m", usage_path);
+			return -1;
+		}
+		goto out;
+	}
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", usage_path);
+		close(fd);
+		return -1;
+	}
+	len = st.st_size;
+	recs = xmalloc(len ?: 1);
+	if (xread(fd, recs, len) != len) {
+		sd_err("failed to read %s, %m", usage_path);
+		close(fd);
+		free(recs);
+		return -1;
+	}
+	close(fd);
+
+	for (size_t i = 0; i < len / sizeof(*recs); i++) {
+		u = usage_get(recs[i].account, recs[i].bucket);
+		if (recs[i].exact) {
+			u->objects += recs[i].objects;
+			u->bytes += recs[i].bytes;
+		} else
+			u->recount = true;
+	}
+	free(recs);
+	if (nr_usages)
+		sd_info("%d buckets to account from the last run", nr_usages);
+out:
+	usage_timer.callback = usage_tick;
+	add_timer(&usage_timer, KV_USAGE_INTERVAL);
+	return 0;
+}
+
+/* Keep the deltas in the file for the next start */
+void kv_usage_exit(void)
+{
+	sd_mutex_lock(&usage_lock);
+	usage_save(true);
+	sd_mutex_unlock(&usage_lock);
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The conversion of the hot objects of the hybrid vdis
+ *
+ * Every HYBRID_INTERVAL the converter walks the hot objects of the local disks
+ * in the order of the oids, HYBRID_BATCH objects a work on a low priority
+ * queue, and erasure codes the ones left unwritten for sys->hybrid_age, as
+ * the mtime of their file tells.  Only the node of the first copy converts an
+ * object.  The object is converted under its cluster lock, which the gateway
+ * takes to promote a cold object, and its local copy is read while the writes
+ * to it are refused with SD_RES_NO_OBJ, so the gateway of a write racing with
+ * the conversion waits for it and promotes the object again with the write.
+ * The converter stops while the node recovers.
+ */
+
+#include "sheep_priv.h"
+
+#define HYBRID_BATCH 1024
+#define HYBRID_INTERVAL (60 * 1000) /* ms between two passes */
+#define HYBRID_NR_LOCKS 64
+
+struct hybrid_work {
+	struct work work;
+	struct vnode_info *vinfo;
+	uint32_t epoch;
+	uint64_t cursor; /* the last oid converted */
+	bool done; /* no object left after the cursor */
+};
+
+static struct sd_rw_lock hybrid_locks[HYBRID_NR_LOCKS] = {
+	[0 ... HYBRID_NR_LOCKS - 1] = SD_RW_LOCK_INITIALIZER,
+};
+static uint64_t hybrid_converting; /* the hot oid read by the converter */
+static uint64_t hybrid_cursor;
+
+/* the disk paths and the oids of a batch, only used by the hybrid queue */
+static char (*hybrid_disks)[PATH_MAX];
+static int nr_hybrid_disks;
+static uint64_t *hybrid_oids;
+static size_t nr_hybrid_oids;
+
+static struct sd_rw_lock *hybrid_lock(uint64_t oid)
+{
+	return hybrid_locks + sd_hash_oid(oid) % HYBRID_NR_LOCKS;
+}
+
+/* Called before a local write of the hot oid, false if it's converted */
+bool hybrid_write_begin(uint64_t oid)
+{
+	struct sd_rw_lock *lock = hybrid_lock(oid);
+
+	sd_read_lock(lock);
+	if (uatomic_read(&hybrid_converting) == oid) {
+		sd_rw_unlock(lock);
+		return false;
+	}
+	return true;
+}
+
+void hybrid_write_end(uint64_t oid)
+{
+	sd_rw_unlock(hybrid_lock(oid));
+}
+
+static void hybrid_set_converting(uint64_t oid, uint64_t lock_oid)
+{
+	struct sd_rw_lock *lock = hybrid_lock(lock_oid);
+
+	/* wait for the writes in flight */
+	sd_write_lock(lock);
+	uatomic_set(&hybrid_converting, oid);
+	sd_rw_unlock(lock);
+}
+
+static int hybrid_add_disk(const char *path)
+{
+	hybrid_disks = xrealloc(hybrid_disks,
+				sizeof(*hybrid_disks) * (nr_hybrid_disks + 1));
+	pstrcpy(hybrid_disks[nr_hybrid_disks++], PATH_MAX, path);
+	return SD_RES_SUCCESS;
+}
+
+/* Collect the smallest HYBRID_BATCH cold enough hot oids after the cursor */
+static void hybrid_collect(uint64_t cursor)
+{
+	time_t age = time(NULL) - sys->hybrid_age;
+	size_t alloc = 0;
+
+	nr_hybrid_disks = 0;
+	nr_hybrid_oids = 0;
+	for_each_obj_path(hybrid_add_disk);
+
+	for (int i = 0; i < nr_hybrid_disks; i++) {
+		DIR *dir = opendir(hybrid_disks[i]);
+		struct dirent *d;
+		struct stat st;
+
+		if (!dir) {
+			sd_err("failed to open %s, %m", hybrid_disks[i]);
+			continue;
+		}
+		while ((d = readdir(dir))) {
+			uint64_t oid;
+			char *p;
+
+			oid = strtoull(d->d_name, &p, 16);
+			if (p - d->d_name != 16 || *p != '\0' ||
+			    oid <= cursor || !is_hot_obj(oid))
+				continue;
+			if (fstatat(dirfd(dir), d->d_name, &st, 0) < 0 ||
+			    st.st_mtime > age)
+				continue;
+
+			if (nr_hybrid_oids == alloc) {
+				alloc = alloc ? alloc * 2 : HYBRID_BATCH;
+				hybrid_oids = xrealloc(hybrid_oids, alloc *
+						       sizeof(uint64_t));
+			}
+			hybrid_oids[nr_hybrid_oids++] = oid;
+		}
+		closedir(dir);
+	}
+
+	xqsort(hybrid_oids, nr_hybrid_oids, oid_cmp);
+	nr_hybrid_oids = min(nr_hybrid_oids, (size_t)HYBRID_BATCH);
+}
+
+static int hybrid_exec(int opcode, uint16_t flags, uint64_t oid, void *buf,
+		       uint32_t len)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, opcode);
+	hdr.flags = flags;
+	hdr.obj.oid = oid;
+	hdr.data_length = len;
+	return exec_local_req(&hdr, buf);
+}
+
+static void hybrid_convert(struct hybrid_work *hw, uint64_t hot)
+{
+	uint64_t oid = hot & ~HOT_BIT;
+	uint32_t len = get_vdi_objsize(oid);
+	struct siocb iocb = {};
+	char *buf;
+	int ret;
+
+	/* converted by the node of the first copy, or a stale object */
+	if (!node_is_local(vinfo_oid_to_node(hw->vinfo, hot, 0)))
+		return;
+
+	buf = xvalloc(len);
+	sheep_lock(oid);
+	hybrid_set_converting(hot, hot);
+
+	iocb.epoch = hw->epoch;
+	iocb.buf = buf;
+	iocb.length = len;
+	ret = sd_store->read(hot, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		/* promoted meanwhile, or a stale object */
+		goto out;
+
+	ret = hybrid_exec(SD_OP_CREATE_AND_WRITE_OBJ,
+			  SD_FLAG_CMD_WRITE | SD_FLAG_CMD_COLD, oid, buf, len);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to erasure code %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+		/* the strips written, so the cold object doesn't shadow it */
+		hybrid_exec(SD_OP_REMOVE_OBJ, SD_FLAG_CMD_COLD, oid, NULL, 0);
+		goto out;
+	}
+
+	ret = hybrid_exec(SD_OP_REMOVE_OBJ, 0, hot, NULL, 0);
+	if (ret != SD_RES_SUCCESS)
+		sd_warn("failed to remove the hot %016"PRIx64", %s", hot,
+			sd_strerror(ret));
+	sd_debug("%016"PRIx64, oid);
+out:
+	hybrid_set_converting(0, hot);
+	sheep_unlock(oid);
+	free(buf);
+}
+
+static void hybrid_work(struct work *work)
+{
+	struct hybrid_work *hw = container_of(work, struct hybrid_work, work);
+
+	hybrid_collect(hw->cursor);
+	if (!nr_hybrid_oids) {
+		hw->done = true;
+		hw->cursor = 0;
+	}
+
+	for (size_t i = 0; i < nr_hybrid_oids; i++) {
+		/* a recovery follows the change of the epoch */
+		if (sys_epoch() != hw->epoch)
+			break;
+		hybrid_convert(hw, hybrid_oids[i]);
+		hw->cursor = hybrid_oids[i];
+	}
+}
+
+static void hybrid_queue(void);
+
+static void hybrid_timer_fn(void *data)
+{
+	hybrid_queue();
+}
+
+static struct timer hybrid_timer = {
+	.callback = hybrid_timer_fn,
+};
+
+static void hybrid_done(struct work *work)
+{
+	struct hybrid_work *hw = container_of(work, struct hybrid_work, work);
+	bool pause = hw->done || node_in_recovery() ||
+		sys_epoch() != hw->epoch;
+
+	hybrid_cursor = hw->cursor;
+	put_vnode_info(hw->vinfo);
+	free(hw);
+
+	if (pause)
+		add_timer(&hybrid_timer, HYBRID_INTERVAL);
+	else
+		hybrid_queue();
+}
+
+static void hybrid_queue(void)
+{
+	struct hybrid_work *hw;
+
+	if (!sys->cinfo.copy_policy || node_in_recovery() ||
+	    sys->cinfo.status != SD_STATUS_OK) {
+		add_timer(&hybrid_timer, HYBRID_INTERVAL);
+		return;
+	}
+
+	hw = xzalloc(sizeof(*hw));
+	hw->vinfo = get_vnode_info();
+	hw->epoch = sys_epoch();
+	hw->cursor = hybrid_cursor;
+	hw->work.fn = hybrid_work;
+	hw->work.done = hybrid_done;
+	queue_work(sys->hybrid_wqueue, &hw->work);
+}
+
+void hybrid_start(void)
+{
+	if (!sys->hybrid_age)
+		return;
+
+	sd_info("erasure coding the hot objects unwritten for %"PRIu32
+		" seconds", sys->hybrid_age);
+	add_timer(&hybrid_timer, HYBRID_INTERVAL);
+}
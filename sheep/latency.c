@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Latency histograms and spans of the requests
+ *
+ * Each thread records into its own histograms without any lock or atomic
+ * operation, and SD_OP_STAT sums up the histograms of all the threads.  The
+ * histograms of an exited thread are handed over to the next new thread, which
+ * is fine because they are only ever added up.
+ *
+ * The stages of a request are also kept in it, and make its span when it is
+ * sent back.  A gateway request gets a span id, which the requests forwarded
+ * to the peers carry in obj.span_id, in place of the cow oid they don't use,
+ * so the sheep which know nothing of the spans take them as usual.  The
+ * gateway keeps the spans of its SD_SPAN_SLOWEST slowest requests and a peer
+ * the spans of its last SPAN_PEER_NR requests in a ring, so dog finds the
+ * spans of the peers of a slow request by its id on the other nodes.
+ */
+
+#include "sheep_priv.h"
+
+static const uint8_t lat_opcodes[SD_LAT_NR_OPS] = {
+	SD_OP_CREATE_AND_WRITE_OBJ,
+	SD_OP_READ_OBJ,
+	SD_OP_WRITE_OBJ,
+	SD_OP_REMOVE_OBJ,
+	SD_OP_DISCARD_OBJ,
+	SD_OP_FLUSH_VDI,
+	SD_OP_CREATE_AND_WRITE_PEER,
+	SD_OP_READ_PEER,
+	SD_OP_WRITE_PEER,
+	SD_OP_REMOVE_PEER,
+	0, /* others */
+};
+
+struct latency_hist {
+	struct list_node list;
+	struct list_node free_list;
+	uint64_t hist[SD_LAT_NR_OPS][SD_LAT_NR_STAGES][SD_LAT_NR_BUCKETS];
+};
+
+#define SPAN_PEER_NR (1U << 16)
+
+static LIST_HEAD(hist_list);
+static LIST_HEAD(free_hist_list);
+static struct sd_mutex hist_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t hist_key;
+static __thread struct latency_hist *thread_hist;
+
+static uint64_t span_seq;
+static struct sd_span slowest_spans[SD_SPAN_SLOWEST];
+static uint32_t slowest_min; /* the total of the fastest slowest span */
+static struct sd_mutex slowest_lock = SD_MUTEX_INITIALIZER;
+static struct sd_span *peer_spans;
+static uint32_t peer_span_pos;
+
+static int opcode_to_idx(uint8_t opcode)
+{
+	for (int i = 0; i < SD_LAT_NR_OPS - 1; i++)
+		if (lat_opcodes[i] == opcode)
+			return i;
+
+	return SD_LAT_NR_OPS - 1;
+}
+
+static void put_thread_hist(void *arg)
+{
+	struct latency_hist *h = arg;
+
+	sd_mutex_lock(&hist_lock);
+	list_add(&h->free_list, &free_hist_list);
+	sd_mutex_unlock(&hist_lock);
+}
+
+static struct latency_hist *get_thread_hist(void)
+{
+	struct latency_hist *h;
+
+	sd_mutex_lock(&hist_lock);
+	if (list_empty(&free_hist_list)) {
+		h = xzalloc(sizeof(*h));
+		list_add(&h->list, &hist_list);
+	} else {
+		h = list_first_entry(&free_hist_list, struct latency_hist,
+				     free_list);
+		list_del(&h->free_list);
+	}
+	sd_mutex_unlock(&hist_lock);
+
+	/* hand the histograms over when the thread exits */
+	pthread_setspecific(hist_key, h);
+	return h;
+}
+
+/* Record the latency of the stage which started at 'start' and return it */
+uint64_t latency_record(uint8_t opcode, enum sd_latency_stage stage,
+			uint64_t start)
+{
+	struct latency_hist *h = thread_hist;
+	uint64_t us = (clock_get_time() - start) / 1000;
+	uint64_t *bucket;
+
+	if (unlikely(!h))
+		h = thread_hist = get_thread_hist();
+
+	bucket = &h->hist[opcode_to_idx(opcode)][stage][sd_lat_bucket(us)];
+	/* only this thread updates it, which makes the store enough */
+	uatomic_set(bucket, *bucket + 1);
+	return us;
+}
+
+uint64_t span_new_id(void)
+{
+	/* 0 is no span */
+	return uatomic_add_return(&span_seq, 1) ?: span_new_id();
+}
+
+static void slowest_span_add(const struct sd_span *span)
+{
+	int min = 0;
+
+	sd_mutex_lock(&slowest_lock);
+	for (int i = 1; i < SD_SPAN_SLOWEST; i++)
+		if (slowest_spans[i].us[SD_LAT_TOTAL] <
+		    slowest_spans[min].us[SD_LAT_TOTAL])
+			min = i;
+	if (slowest_spans[min].us[SD_LAT_TOTAL] < span->us[SD_LAT_TOTAL]) {
+		slowest_spans[min] = *span;
+		min = 0;
+		for (int i = 1; i < SD_SPAN_SLOWEST; i++)
+			if (slowest_spans[i].us[SD_LAT_TOTAL] <
+			    slowest_spans[min].us[SD_LAT_TOTAL])
+				min = i;
+		uatomic_set(&slowest_min, slowest_spans[min].us[SD_LAT_TOTAL]);
+	}
+	sd_mutex_unlock(&slowest_lock);
+}
+
+/*
+ * The slot is cleared before and its id set after the copy, so a reader sees
+ * a slot being written as a free one, unless the ring wraps around meanwhile.
+ */
+static void peer_span_add(const struct sd_span *span)
+{
+	uint32_t pos = uatomic_add_return(&peer_span_pos, 1);
+	struct sd_span *slot = peer_spans + pos % SPAN_PEER_NR;
+
+	uatomic_set(&slot->id, 0);
+	cmm_smp_wmb();
+	memcpy((char *)slot + sizeof(slot->id), (char *)span + sizeof(span->id),
+	       sizeof(*span) - sizeof(span->id));
+	cmm_smp_wmb();
+	uatomic_set(&slot->id, span->id);
+}
+
+/* The span id of the gateway of a forwarded peer request, or 0 */
+static uint64_t peer_span_id(const struct request *req)
+{
+	switch (req->rq.opcode) {
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_READ_PEER:
+	case SD_OP_WRITE_PEER:
+	case SD_OP_REMOVE_PEER:
+	case SD_OP_DISCARD_PEER:
+		return req->rq.obj.span_id;
+	default:
+		return 0;
+	}
+}
+
+static void span_record(const struct request *req)
+{
+	struct sd_span span = {
+		.opcode = req->rq.opcode,
+		.oid = req->rq.obj.oid,
+		.time = time(NULL),
+	};
+
+	memcpy(span.us, req->span, sizeof(span.us));
+	span.id = peer_span_id(req);
+	if (span.id) {
+		peer_span_add(&span);
+	} else if (req->span_id &&
+		   span.us[SD_LAT_TOTAL] > uatomic_read(&slowest_min)) {
+		span.id = req->span_id;
+		slowest_span_add(&span);
+	}
+}
+
+/* Record the stage of the request for the histograms and its span */
+void request_latency(struct request *req, enum sd_latency_stage stage,
+		     uint64_t start)
+{
+	uint64_t us = latency_record(req->rq.opcode, stage, start);
+
+	req->span[stage] = min(us, (uint64_t)UINT32_MAX);
+	if (stage == SD_LAT_TOTAL)
+		span_record(req);
+}
+
+static int span_total_cmp(const struct sd_span *a, const struct sd_span *b)
+{
+	/* the slowest first */
+	return -intcmp(a->us[SD_LAT_TOTAL], b->us[SD_LAT_TOTAL]);
+}
+
+static int span_id_cmp(const uint64_t *a, const uint64_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+/*
+ * Fill data with the slowest spans if nr is 0, or else with the peer spans
+ * of the nr span ids in it, and return the length
+ */
+uint32_t span_get(void *data, uint32_t nr, uint32_t len)
+{
+	struct sd_span *spans = data;
+	uint64_t *ids;
+	uint32_t n = 0;
+
+	if (!nr) {
+		sd_mutex_lock(&slowest_lock);
+		for (int i = 0; i < SD_SPAN_SLOWEST; i++)
+			if (slowest_spans[i].id &&
+			    (n + 1) * sizeof(*spans) <= len)
+				spans[n++] = slowest_spans[i];
+		sd_mutex_unlock(&slowest_lock);
+		xqsort(spans, n, span_total_cmp);
+		return n * sizeof(*spans);
+	}
+
+	if (nr > len / sizeof(*ids))
+		return 0;
+	ids = xmalloc(nr * sizeof(*ids));
+	memcpy(ids, data, nr * sizeof(*ids));
+	xqsort(ids, nr, span_id_cmp);
+	for (uint32_t i = 0; i < SPAN_PEER_NR; i++) {
+		uint64_t id = uatomic_read(&peer_spans[i].id);
+
+		if ((n + 1) * sizeof(*spans) > len)
+			break;
+		if (id && xbsearch(&id, ids, nr, span_id_cmp))
+			spans[n++] = peer_spans[i];
+	}
+	free(ids);
+	return n * sizeof(*spans);
+}
+
+void latency_merge(struct sd_latency_stat *stat)
+{
+	struct latency_hist *h;
+
+	memset(stat, 0, sizeof(*stat));
+	memcpy(stat->opcodes, lat_opcodes, sizeof(stat->opcodes));
+
+	sd_mutex_lock(&hist_lock);
+	list_for_each_entry(h, &hist_list, list)
+		for (int i = 0; i < SD_LAT_NR_OPS; i++)
+			for (int j = 0; j < SD_LAT_NR_STAGES; j++)
+				for (int k = 0; k < SD_LAT_NR_BUCKETS; k++)
+					stat->hist[i][j][k] +=
+						uatomic_read(&h->hist[i][j][k]);
+	sd_mutex_unlock(&hist_lock);
+}
+
+int latency_init(void)
+{
+	int ret = pthread_key_create(&hist_key, put_thread_hist);
+
+	if (ret) {
+		sd_err("failed to create a thread key, %s", strerror(ret));
+		return -1;
+	}
+
+	peer_spans = xzalloc(sizeof(*peer_spans) * SPAN_PEER_NR);
+	/* apart from the ids of the other gateways */
+	span_seq = sd_hash_64(clock_get_time() ^ getpid()) << 32;
+	return 0;
+}
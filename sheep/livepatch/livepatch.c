@@ -31,6 +31,7 @@
 #define ALIGN_MASK(x, mask)    (((x) + (mask)) & ~(mask))
 #define ALIGN(x, a) ALIGN_MASK((x), (typeof(x))(a) - 1)
 #define INIT_OFFSET_MASK (1UL << (BITS_PER_LONG - 1))
+#define CACHE_LINE_SIZE 64
 
 static const char *exe_path;
 static char *patch_path;
@@ -69,6 +70,27 @@ static void replace_call(unsigned long ip, unsigned long func)
 	memcpy((void *)ip, new, INSN_SIZE);
 }
 
+/*
+ * The threads run on while the calls are replaced.  Only the offset of a call
+ * changes, which is written in one store if it doesn't cross a cache line, so
+ * that a thread runs either the old call or the new one.  Otherwise the
+ * worker threads are suspended for the write.
+ */
+static void patch_call(unsigned long ip, unsigned long func)
+{
+    unsigned long offset = ip + 1;
+
+    if (*(unsigned char *)ip == 0xe8 &&
+        (offset & (CACHE_LINE_SIZE - 1)) + sizeof(int) <= CACHE_LINE_SIZE) {
+        uatomic_set((int *)offset, (int)(func - ip - INSN_SIZE));
+        return;
+    }
+
+    suspend_worker_threads();
+    replace_call(ip, func);
+    resume_worker_threads();
+}
+
 static inline unsigned int patch_hash(unsigned long addr)
 {
     return (unsigned int)(sd_hash_64(addr) % PATCH_HASH_SIZE);
@@ -76,12 +98,18 @@ static inline unsigned int patch_hash(unsigned long addr)
 
 static void register_patched_func(struct livepatch_func *func)
 {
-    unsigned int hval = patch_hash(func->old_addr);
+    struct hlist_head *head = patched_func_table + patch_hash(func->old_addr);
 
     sd_info("register function (%s) old_addr %lu, new_addr %lu",
             func->name, func->old_addr, func->new_addr);
 
-    hlist_add_head(&func->node, patched_func_table + hval);
+    /* livepatch_handler() looks up the table without a lock */
+    func->node.next = head->first;
+    func->node.pprev = &head->first;
+    if (head->first)
+        head->first->pprev = &func->node.next;
+    cmm_smp_wmb();
+    uatomic_set(&head->first, &func->node);
 }
 
 static void unregister_patched_func(struct livepatch_func *func)
@@ -89,7 +117,8 @@ static void unregister_patched_func(struct livepatch_func *func)
     sd_info("unregister function (%s) old_addr %lu, new_addr %lu",
             func->name, func->old_addr, func->new_addr);
 
-    hlist_del(&func->node);
+    /* freed after synchronize_worker_threads() */
+    __hlist_del(&func->node);
 }
 
 /* magic happens here */
@@ -759,6 +788,22 @@ static int write_relocations(struct livepatch_patch *patch)
     return 0;
 }
 
+static bool patch_has_func(struct livepatch_patch *patch, unsigned long addr)
+{
+    struct livepatch_func *func;
+
+    list_for_each_entry(func, &patch->funcs, list) {
+        if (func->old_addr == addr)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * The new functions are registered before the calls to them are patched in,
+ * ahead of the old ones of a replaced patch.  The functions unregistered are
+ * freed after the worker threads have left them.
+ */
 static int lp_enable(struct livepatch_patch *new_patch,
                      struct livepatch_patch *old_patch, bool replace)
 {
@@ -772,15 +817,6 @@ static int lp_enable(struct livepatch_patch *new_patch,
         return ret;
     }
 
-    suspend_worker_threads();
-    if (replace) {
-        /* unpatch old functions */
-        list_for_each_entry(func, &old_patch->funcs, list) {
-            replace_call(func->old_addr, (unsigned long)__fentry__);
-            unregister_patched_func(func);
-        }
-    }
-
     /* patch new functions */
     list_for_each_entry(func, &new_patch->funcs, list) {
         ret = verify_symbol(func->name, func->old_addr);
@@ -793,50 +829,52 @@ static int lp_enable(struct livepatch_patch *new_patch,
         if (make_text_available((void*)func->old_addr, INSN_SIZE) < 0) {
             sd_err("failed to make function (%s) replacable", func->name);
             failed = func;
+            ret = -1;
             goto rollback;
         }
 
         register_patched_func(func);
 
-        replace_call(func->old_addr, (unsigned long)livepatch_caller);
+        patch_call(func->old_addr, (unsigned long)livepatch_caller);
     }
 
     if (replace) {
+        /* unpatch old functions */
+        list_for_each_entry(func, &old_patch->funcs, list) {
+            if (!patch_has_func(new_patch, func->old_addr))
+                patch_call(func->old_addr, (unsigned long)__fentry__);
+            unregister_patched_func(func);
+        }
+
         list_del(&old_patch->list);
+        synchronize_worker_threads();
         lp_unload(old_patch);
     }
 
-out:
-    resume_worker_threads();
-    return ret;
+    return 0;
 
 rollback:
     /* resume old patch status */
     list_for_each_entry(func, &new_patch->funcs, list) {
         if (func == failed)
             break;
-        replace_call(func->old_addr, (unsigned long)__fentry__);
+        if (!replace || !patch_has_func(old_patch, func->old_addr))
+            patch_call(func->old_addr, (unsigned long)__fentry__);
         unregister_patched_func(func);
     }
-    if (replace) {
-        list_for_each_entry(func, &old_patch->funcs, list) {
-            replace_call(func->old_addr, (unsigned long)livepatch_caller);
-            register_patched_func(func);
-        }
-    }
-    goto out;
+    synchronize_worker_threads();
+    return ret;
 }
 
 static void lp_disable(struct livepatch_patch *patch)
 {
     struct livepatch_func *func;
 
-    suspend_worker_threads();
     list_for_each_entry(func, &patch->funcs, list) {
-        replace_call(func->old_addr, (unsigned long)__fentry__);
+        patch_call(func->old_addr, (unsigned long)__fentry__);
         unregister_patched_func(func);
     }
-    resume_worker_threads();
+    synchronize_worker_threads();
 }
 
 static struct livepatch_patch *check_patch_overlap(struct livepatch_patch *patch)
@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cluster locks served by the sheep
+ *
+ * The lock of an id is granted by its owner, the node of the id in the vnode
+ * ring, which keeps the holder of each lock granted in a table.  The threads
+ * of a node take a lock one at a time and ask the owner for it with
+ * SD_OP_CLUSTER_LOCK, retrying with a backoff while another node holds it, so
+ * an acquisition costs a round trip to a sheep and a release wakes nobody.
+ *
+ * A grant is a lease on the epoch it was given in, and the owner refuses the
+ * requests of another epoch.  When the epoch changes, the owner drops the
+ * locks of the nodes which left and of the ids it doesn't own anymore, and
+ * grants nothing but reclaims for LOCK_GRACE_MS, while the holders reclaim
+ * their locks from the owners of the new epoch.
+ */
+
+#include "sheep_priv.h"
+
+#define LOCK_GRACE_MS 3000
+#define LOCK_BACKOFF_MIN 1 /* ms */
+#define LOCK_BACKOFF_MAX 128
+
+/* A lock granted by this node */
+struct granted_lock {
+	struct rb_node rb;
+	uint64_t id;
+	struct node_id holder;
+};
+
+/* A lock taken by the threads of this node */
+struct held_lock {
+	struct rb_node rb;
+	uint64_t id;
+	int ref;
+	bool held;
+	/* for the threads of this node */
+	struct sd_mutex id_lock;
+	/* for the requests to the owner */
+	struct sd_mutex req_lock;
+};
+
+static struct rb_root granted_root = RB_ROOT;
+static struct sd_mutex granted_lock = SD_MUTEX_INITIALIZER;
+static uint32_t granted_epoch;
+static uint64_t grace_end;
+
+static struct rb_root held_root = RB_ROOT;
+static struct sd_mutex held_lock = SD_MUTEX_INITIALIZER;
+
+static int granted_cmp(const struct granted_lock *a,
+		       const struct granted_lock *b)
+{
+	return intcmp(a->id, b->id);
+}
+
+static int held_cmp(const struct held_lock *a, const struct held_lock *b)
+{
+	return intcmp(a->id, b->id);
+}
+
+static const struct sd_node *lock_owner(uint64_t id, struct vnode_info *vinfo)
+{
+	if (RB_EMPTY_ROOT(&vinfo->vroot))
+		return NULL;
+	return oid_to_node(id, &vinfo->vroot, 0);
+}
+
+/*
+ * Drop the locks which don't hold in the epoch anymore and start the grace
+ * period of the reclaims.  Called with granted_lock held.
+ */
+static void granted_update_epoch(uint32_t epoch)
+{
+	struct vnode_info *vinfo;
+	struct granted_lock *lock;
+	const struct sd_node *owner;
+
+	if (epoch == granted_epoch)
+		return;
+
+	vinfo = get_vnode_info();
+	rb_for_each_entry(lock, &granted_root, rb) {
+		struct sd_node key = { .nid = lock->holder };
+
+		owner = lock_owner(lock->id, vinfo);
+		if (owner && node_is_local(owner) &&
+		    rb_search(&vinfo->nroot, &key, rb, node_cmp))
+			continue;
+
+		sd_debug("drop the lock %" PRIx64 " of %s", lock->id,
+			 addr_to_str(lock->holder.addr, lock->holder.port));
+		rb_erase(&lock->rb, &granted_root);
+		free(lock);
+	}
+	put_vnode_info(vinfo);
+
+	granted_epoch = epoch;
+	grace_end = clock_get_time() + LOCK_GRACE_MS * 1000000ULL;
+}
+
+int grant_cluster_lock(uint64_t id, const struct node_id *holder,
+		       uint32_t epoch, bool reclaim)
+{
+	struct granted_lock *lock, key = { .id = id };
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&granted_lock);
+	if (epoch != sys_epoch()) {
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+	granted_update_epoch(epoch);
+
+	lock = rb_search(&granted_root, &key, rb, granted_cmp);
+	if (lock) {
+		if (node_id_cmp(&lock->holder, holder))
+			ret = SD_RES_AGAIN;
+		goto out;
+	}
+
+	/* the holders of the last epoch are reclaiming their locks */
+	if (!reclaim && clock_get_time() < grace_end) {
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+
+	lock = xmalloc(sizeof(*lock));
+	lock->id = id;
+	lock->holder = *holder;
+	rb_insert(&granted_root, lock, rb, granted_cmp);
+out:
+	sd_mutex_unlock(&granted_lock);
+	return ret;
+}
+
+int release_cluster_lock(uint64_t id, const struct node_id *holder,
+			 uint32_t epoch)
+{
+	struct granted_lock *lock, key = { .id = id };
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&granted_lock);
+	if (epoch != sys_epoch()) {
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+	granted_update_epoch(epoch);
+
+	lock = rb_search(&granted_root, &key, rb, granted_cmp);
+	if (lock && !node_id_cmp(&lock->holder, holder)) {
+		rb_erase(&lock->rb, &granted_root);
+		free(lock);
+	}
+out:
+	sd_mutex_unlock(&granted_lock);
+	return ret;
+}
+
+static int send_lock_req(uint64_t id, int opcode, uint32_t flags)
+{
+	struct node_id nid = sys->this_node.nid;
+	uint32_t epoch = sys_epoch();
+	const struct sd_node *owner;
+	struct vnode_info *vinfo;
+	struct sd_req hdr;
+	int ret;
+
+	vinfo = get_vnode_info();
+	if (!vinfo)
+		return SD_RES_AGAIN;
+	owner = lock_owner(id, vinfo);
+	if (!owner) {
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+
+	if (node_is_local(owner)) {
+		if (opcode == SD_OP_CLUSTER_LOCK)
+			ret = grant_cluster_lock(id, &nid, epoch,
+						 flags & SD_LOCK_RECLAIM);
+		else
+			ret = release_cluster_lock(id, &nid, epoch);
+		goto out;
+	}
+
+	sd_init_req(&hdr, opcode);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(nid);
+	hdr.lock.id = id;
+	hdr.lock.epoch = epoch;
+	hdr.lock.flags = flags;
+	ret = sheep_exec_req(&owner->nid, &hdr, &nid);
+out:
+	put_vnode_info(vinfo);
+	return ret;
+}
+
+static struct held_lock *held_lock_get(uint64_t id)
+{
+	struct held_lock *lock, key = { .id = id };
+
+	sd_mutex_lock(&held_lock);
+	lock = rb_search(&held_root, &key, rb, held_cmp);
+	if (!lock) {
+		lock = xzalloc(sizeof(*lock));
+		lock->id = id;
+		sd_init_mutex(&lock->id_lock);
+		sd_init_mutex(&lock->req_lock);
+		rb_insert(&held_root, lock, rb, held_cmp);
+	}
+	lock->ref++;
+	sd_mutex_unlock(&held_lock);
+
+	return lock;
+}
+
+static void held_lock_put(struct held_lock *lock)
+{
+	sd_mutex_lock(&held_lock);
+	if (--lock->ref == 0) {
+		rb_erase(&lock->rb, &held_root);
+		sd_destroy_mutex(&lock->id_lock);
+		sd_destroy_mutex(&lock->req_lock);
+		free(lock);
+	}
+	sd_mutex_unlock(&held_lock);
+}
+
+void sheep_lock(uint64_t lock_id)
+{
+	struct held_lock *lock = held_lock_get(lock_id);
+	unsigned int backoff = LOCK_BACKOFF_MIN;
+	int ret;
+
+	sd_mutex_lock(&lock->id_lock);
+	for (;;) {
+		sd_mutex_lock(&lock->req_lock);
+		ret = send_lock_req(lock_id, SD_OP_CLUSTER_LOCK, 0);
+		if (ret == SD_RES_SUCCESS)
+			lock->held = true;
+		sd_mutex_unlock(&lock->req_lock);
+		if (ret == SD_RES_SUCCESS)
+			break;
+
+		if (ret != SD_RES_AGAIN)
+			sd_debug("failed to lock %" PRIx64 ", %s", lock_id,
+				 sd_strerror(ret));
+		usleep(backoff * 1000);
+		backoff = min(backoff * 2, (unsigned int)LOCK_BACKOFF_MAX);
+	}
+	sd_debug("locked %" PRIx64, lock_id);
+}
+
+void sheep_unlock(uint64_t lock_id)
+{
+	struct held_lock *lock, key = { .id = lock_id };
+	unsigned int backoff = LOCK_BACKOFF_MIN;
+	int ret;
+
+	sd_mutex_lock(&held_lock);
+	lock = rb_search(&held_root, &key, rb, held_cmp);
+	sd_mutex_unlock(&held_lock);
+	sd_assert(lock);
+
+	sd_mutex_lock(&lock->req_lock);
+	/* an owner gone takes the lock with it */
+	while ((ret = send_lock_req(lock_id, SD_OP_CLUSTER_UNLOCK, 0)) ==
+	       SD_RES_AGAIN) {
+		usleep(backoff * 1000);
+		backoff = min(backoff * 2, (unsigned int)LOCK_BACKOFF_MAX);
+	}
+	if (ret != SD_RES_SUCCESS)
+		sd_debug("failed to unlock %" PRIx64 ", %s", lock_id,
+			 sd_strerror(ret));
+	lock->held = false;
+	sd_mutex_unlock(&lock->req_lock);
+
+	sd_mutex_unlock(&lock->id_lock);
+	held_lock_put(lock);
+	sd_debug("unlocked %" PRIx64, lock_id);
+}
+
+/* Reclaim a lock held by this node from its owner in the current epoch */
+static void reclaim_lock(struct held_lock *lock)
+{
+	uint64_t end = clock_get_time() + LOCK_GRACE_MS * 1000000ULL;
+	unsigned int backoff = LOCK_BACKOFF_MIN;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&lock->req_lock);
+	while (lock->held) {
+		ret = send_lock_req(lock->id, SD_OP_CLUSTER_LOCK,
+				    SD_LOCK_RECLAIM);
+		if (ret != SD_RES_AGAIN || clock_get_time() > end)
+			break;
+		usleep(backoff * 1000);
+		backoff = min(backoff * 2, (unsigned int)LOCK_BACKOFF_MAX);
+	}
+	sd_mutex_unlock(&lock->req_lock);
+
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to reclaim the lock %" PRIx64 ", %s", lock->id,
+		       sd_strerror(ret));
+}
+
+struct reclaim_work {
+	struct work work;
+	int nr;
+	struct held_lock *locks[];
+};
+
+static void reclaim_locks_work(struct work *work)
+{
+	struct reclaim_work *rw = container_of(work, struct reclaim_work,
+					       work);
+
+	for (int i = 0; i < rw->nr; i++)
+		reclaim_lock(rw->locks[i]);
+}
+
+static void reclaim_locks_done(struct work *work)
+{
+	struct reclaim_work *rw = container_of(work, struct reclaim_work,
+					       work);
+
+	for (int i = 0; i < rw->nr; i++)
+		held_lock_put(rw->locks[i]);
+	free(rw);
+}
+
+/* Reclaim the locks held by this node after a change of the epoch */
+main_fn void reclaim_cluster_locks(void)
+{
+	struct reclaim_work *rw;
+	struct held_lock *lock;
+
+	sd_mutex_lock(&held_lock);
+	if (!held_root.nr) {
+		sd_mutex_unlock(&held_lock);
+		return;
+	}
+	rw = xzalloc(sizeof(*rw) + sizeof(rw->locks[0]) * held_root.nr);
+	rb_for_each_entry(lock, &held_root, rb) {
+		lock->ref++;
+		rw->locks[rw->nr++] = lock;
+	}
+	sd_mutex_unlock(&held_lock);
+
+	rw->work.fn = reclaim_locks_work;
+	rw->work.done = reclaim_locks_done;
+	queue_work(sys->io_wqueue, &rw->work);
+}
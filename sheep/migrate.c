@@ -425,6 +425,137 @@ static int migrate_from_v2_to_v3(void)
 	return -1;
 }
 
+/*
+ * The steps which convert the objects run in a thread per disk.  A disk
+ * records the version it's converted to in MIGRATE_CHECKPOINT of its
+ * directory, and the version of the store is bumped after each step, so that
+ * an interrupted upgrade resumes from the step and skips the disks done.  The
+ * steps skip the objects converted already for the disks which were being
+ * converted.
+ */
+#define MIGRATE_CHECKPOINT ".migrate"
+
+struct migrate_disk {
+	char path[PATH_MAX];
+	int to;
+	int (*fn)(const char *path);
+	int result;
+};
+
+static struct migrate_disk *migrate_disks;
+static int nr_migrate_disks;
+
+static int add_migrate_disk(const char *path)
+{
+	migrate_disks = xrealloc(migrate_disks, sizeof(*migrate_disks) *
+				 (nr_migrate_disks + 1));
+	pstrcpy(migrate_disks[nr_migrate_disks].path, PATH_MAX, path);
+	nr_migrate_disks++;
+	return SD_RES_SUCCESS;
+}
+
+static int read_checkpoint(const char *dir)
+{
+	char path[PATH_MAX], buf[16] = {};
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, MIGRATE_CHECKPOINT);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	ret = xread(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return 0;
+	return atoi(buf);
+}
+
+static int write_checkpoint(const char *dir, int version)
+{
+	char path[PATH_MAX], buf[16];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, MIGRATE_CHECKPOINT);
+	snprintf(buf, sizeof(buf), "%d\n", version);
+	if (atomic_create_and_write(path, buf, strlen(buf), true) < 0) {
+		sd_err("failed to write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+static void *migrate_disk_thread(void *arg)
+{
+	struct migrate_disk *d = arg;
+
+	d->result = d->fn(d->path);
+	if (d->result == 0)
+		d->result = write_checkpoint(d->path, d->to);
+	return arg;
+}
+
+/* Convert the disks to the version 'to' with 'fn', in a thread per disk */
+static int for_each_disk_migrate(int to, int (*fn)(const char *path))
+{
+	sd_thread_t *threads;
+	int ret = 0, nr = 0;
+
+	free(migrate_disks);
+	migrate_disks = NULL;
+	nr_migrate_disks = 0;
+	for_each_obj_path(add_migrate_disk);
+
+	threads = xcalloc(nr_migrate_disks, sizeof(*threads));
+	for (int i = 0; i < nr_migrate_disks; i++) {
+		struct migrate_disk *d = migrate_disks + i;
+
+		d->to = to;
+		d->fn = fn;
+		d->result = 0;
+		if (read_checkpoint(d->path) >= to) {
+			sd_info("%s is converted to v%d already", d->path, to);
+			continue;
+		}
+		if (sd_thread_create_with_idx("migrate", threads + nr,
+					      migrate_disk_thread, d))
+			panic("failed to create thread for path %s", d->path);
+		nr++;
+	}
+
+	for (int i = 0; i < nr; i++)
+		sd_thread_join(threads[i], NULL);
+
+	for (int i = 0; i < nr_migrate_disks; i++)
+		if (migrate_disks[i].result < 0) {
+			sd_err("failed to convert %s to v%d",
+			       migrate_disks[i].path, to);
+			ret = -1;
+		}
+
+	free(threads);
+	return ret;
+}
+
+/* Record the version which the steps so far converted the store to */
+static int set_store_version(uint16_t version)
+{
+	int fd, ret;
+
+	fd = open(config_path, O_WRONLY | O_DSYNC);
+	if (fd < 0) {
+		sd_err("failed to open config file, %m");
+		return -1;
+	}
+
+	ret = xpwrite(fd, &version, sizeof(version),
+		      offsetof(struct sheepdog_config_v2, version));
+	close(fd);
+	if (ret != sizeof(version)) {
+		sd_err("failed to write config data, %m");
+		return -1;
+	}
+	return 0;
+}
+
 #define OLD_ECNAME "user.ec.index"
 
 static int convert_ecidx_xattr2path(uint64_t oid, const char *wd,
@@ -437,6 +568,10 @@ static int convert_ecidx_xattr2path(uint64_t oid, const char *wd,
 	char path[PATH_MAX + 1], new_path[PATH_MAX + 1];
 	bool is_stale = *(bool *)arg;
 
+	/* converted before the upgrade was interrupted */
+	if (ec_index != SD_MAX_COPIES)
+		goto out;
+
 	if (is_stale)
 		snprintf(path, PATH_MAX, "%s/%016"PRIx64".%u", wd, oid, epoch);
 	else
@@ -472,27 +607,41 @@ out:
 	return ret;
 }
 
-static int migrate_from_v3_to_v4(void)
+static int convert_disk_v3_to_v4(const char *dir)
 {
+	char path[PATH_MAX];
 	bool is_stale = true;
 	int ret;
 
-	ret = for_each_object_in_stale(convert_ecidx_xattr2path,
-				       (void *)&is_stale);
-	if (ret < 0) {
-		sd_emerg("converting store format of stale object directory"
-			 "failed");
-		return ret;
+	snprintf(path, sizeof(path), "%s/.stale", dir);
+	if (access(path, F_OK) == 0) {
+		ret = for_each_object_in_path(path, convert_ecidx_xattr2path,
+					      false, NULL, (void *)&is_stale);
+		if (ret != SD_RES_SUCCESS) {
+			sd_emerg("converting store format of %s failed", path);
+			return -1;
+		}
 	}
 
 	is_stale = false;
-	ret = for_each_object_in_wd(convert_ecidx_xattr2path, false,
-				    (void *)&is_stale);
-	if (ret < 0) {
-		sd_emerg("converting store format of object directory failed");
-		return ret;
+	ret = for_each_object_in_path(dir, convert_ecidx_xattr2path, false,
+				      NULL, (void *)&is_stale);
+	if (ret != SD_RES_SUCCESS) {
+		sd_emerg("converting store format of %s failed", dir);
+		return -1;
 	}
 
+	return 0;
+}
+
+static int migrate_from_v3_to_v4(void)
+{
+	int ret;
+
+	ret = for_each_disk_migrate(4, convert_disk_v3_to_v4);
+	if (ret < 0)
+		return ret;
+
 	sd_info("converting store format v3 to v4 is ended successfully");
 	return 0;
 }
@@ -541,6 +690,10 @@ int sd_migrate_store(int from, int to)
 		ret = migrate[ver]();
 		if (ret < 0)
 			return ret;
+		/* resume from the next step if interrupted */
+		ret = set_store_version(ver + 1);
+		if (ret < 0)
+			return ret;
 	}
 
 	/* success */
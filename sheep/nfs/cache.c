@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Caches of the attributes and of the dentries
+ *
+ * GETATTR, ACCESS, READ and LOOKUP need the header of an inode, and LOOKUP the
+ * dentry of a name, which cost a read of the object each.  The headers read
+ * or written are kept for ATTR_TIMEOUT_MS, the time_delta told the clients by
+ * FSINFO, so the updates through the nfs servers of the other nodes show up
+ * within it, as the clients cache the attributes anyway.  The dentries are
+ * never removed from a directory, so a name found stays true, and a name not
+ * found is cached with the size of the directory, which any new dentry grows.
+ */
+
+#include "nfs.h"
+
+#define ATTR_CACHE_BITS 12
+#define DENTRY_CACHE_BITS 16
+#define ATTR_TIMEOUT_MS 1000
+
+struct attr_entry {
+	uint64_t ino; /* 0 if the entry is free */
+	uint64_t time;
+	uint8_t hdr[INODE_HDR_SIZE];
+};
+
+struct dentry_entry {
+	uint64_t dir;
+	char *name; /* NULL if the entry is free */
+	uint64_t dir_size;
+	uint64_t ino; /* 0 if the name is not found */
+};
+
+static struct attr_entry attr_cache[1U << ATTR_CACHE_BITS];
+static struct dentry_entry dentry_cache[1U << DENTRY_CACHE_BITS];
+/* nfs_create() makes the root out of the nfsd thread */
+static struct sd_mutex cache_lock = SD_MUTEX_INITIALIZER;
+
+static inline struct attr_entry *attr_slot(uint64_t ino)
+{
+	return attr_cache + (sd_hash_64(ino) & ((1U << ATTR_CACHE_BITS) - 1));
+}
+
+static inline struct dentry_entry *dentry_slot(uint64_t dir, const char *name)
+{
+	uint64_t hval = sd_hash(name, strlen(name));
+
+	hval = sd_hash_next(hval ^ dir);
+	return dentry_cache + (hval & ((1U << DENTRY_CACHE_BITS) - 1));
+}
+
+/* Return a copy of the header of the inode, or NULL */
+struct inode *attr_cache_get(uint64_t ino)
+{
+	struct attr_entry *e = attr_slot(ino);
+	struct inode *inode = NULL;
+
+	sd_mutex_lock(&cache_lock);
+	if (e->ino == ino &&
+	    clock_get_time() - e->time < ATTR_TIMEOUT_MS * 1000000ULL) {
+		inode = xmalloc(INODE_HDR_SIZE);
+		memcpy(inode, e->hdr, INODE_HDR_SIZE);
+	}
+	sd_mutex_unlock(&cache_lock);
+	return inode;
+}
+
+void attr_cache_put(const struct inode *inode)
+{
+	struct attr_entry *e = attr_slot(inode->ino);
+
+	sd_mutex_lock(&cache_lock);
+	e->ino = inode->ino;
+	e->time = clock_get_time();
+	memcpy(e->hdr, inode, INODE_HDR_SIZE);
+	sd_mutex_unlock(&cache_lock);
+}
+
+void attr_cache_drop(uint64_t ino)
+{
+	struct attr_entry *e = attr_slot(ino);
+
+	sd_mutex_lock(&cache_lock);
+	if (e->ino == ino)
+		e->ino = 0;
+	sd_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Return in ino the inode of the name in the directory of the size, 0 if it
+ * is not there, or false if the cache doesn't know
+ */
+bool dentry_cache_get(uint64_t dir, uint64_t dir_size, const char *name,
+		      uint64_t *ino)
+{
+	struct dentry_entry *e = dentry_slot(dir, name);
+	bool ret = false;
+
+	sd_mutex_lock(&cache_lock);
+	if (e->name && e->dir == dir && !strcmp(e->name, name) &&
+	    (e->ino || e->dir_size == dir_size)) {
+		*ino = e->ino;
+		ret = true;
+	}
+	sd_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+void dentry_cache_put(uint64_t dir, uint64_t dir_size, const char *name,
+		      uint64_t ino)
+{
+	struct dentry_entry *e = dentry_slot(dir, name);
+
+	sd_mutex_lock(&cache_lock);
+	if (!e->name || e->dir != dir || strcmp(e->name, name)) {
+		free(e->name);
+		e->name = xstrdup(name);
+		e->dir = dir;
+	}
+	e->dir_size = dir_size;
+	e->ino = ino;
+	sd_mutex_unlock(&cache_lock);
+}
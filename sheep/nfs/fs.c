@@ -60,6 +60,7 @@ static int inode_do_create(struct inode_data *id)
 		sd_err("failed to create object, %" PRIx64, oid);
 		goto out;
 	}
+	attr_cache_put(inode);
 	if (!create)
 		goto out;
 
@@ -139,13 +140,28 @@ static inline int inode_create(struct inode *inode, uint32_t vid,
 	return ret;
 }
 
-static void dentry_add(struct inode *parent, struct dentry *dentry)
+static inline uint32_t dentry_bucket(const char *name)
+{
+	return sd_hash(name, strlen(name)) % INODE_NR_BUCKETS;
+}
+
+static void dentry_append(struct inode *dir, const struct dentry *dentry)
 {
-	uint8_t *tail = parent->data + parent->size;
+	struct dentry *tail = (struct dentry *)(dir->data + dir->size);
+	uint32_t b = dentry_bucket(dentry->name);
 
+	*tail = *dentry;
+	if (dir->flags & INODE_INDEXED) {
+		tail->next = dir->bucket[b];
+		dir->bucket[b] = dir->size / sizeof(*dentry) + 1;
+	}
+	dir->size += sizeof(*dentry);
+}
+
+static void dentry_add(struct inode *parent, struct dentry *dentry)
+{
 	parent->nlink++;
-	memcpy(tail, dentry, sizeof(*dentry));
-	parent->size += sizeof(*dentry);
+	dentry_append(parent, dentry);
 }
 
 int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
@@ -153,7 +169,7 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 	uint64_t myino, pino = parent->ino;
 	uint32_t vid = oid_to_vid(pino);
 	struct inode_data *id = prepare_inode_data(inode, vid, name);
-	struct dentry *entry;
+	struct dentry entry = {};
 	int ret;
 
 	sys->cdrv->lock(vid);
@@ -166,17 +182,17 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 	myino = vid_to_data_oid(id->vid, id->idx);
 
 	inode->nlink = 2; /* '.' and 'name' */
-	inode->size = 2 * sizeof(struct dentry);
+	inode->size = 0;
 	inode->used = INODE_DATA_SIZE;
-	entry = (struct dentry *)inode->data;
-	entry->ino = myino;
-	entry->nlen = 1;
-	entry->name[0] = '.';
-	entry++;
-	entry->ino = pino;
-	entry->nlen = 2;
-	entry->name[0] = '.';
-	entry->name[1] = '.';
+	inode->flags = INODE_INDEXED;
+	entry.ino = myino;
+	entry.nlen = 1;
+	pstrcpy(entry.name, NFS_MAXNAMLEN, ".");
+	dentry_append(inode, &entry);
+	entry.ino = pino;
+	entry.nlen = 2;
+	pstrcpy(entry.name, NFS_MAXNAMLEN, "..");
+	dentry_append(inode, &entry);
 
 	if (unlikely(inode == parent))
 		inode->nlink++; /* I'm root */
@@ -193,6 +209,8 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 	ret = fs_write_inode_full(parent);
+	if (ret == SD_RES_SUCCESS && inode != parent)
+		dentry_cache_put(pino, parent->size, name, myino);
 out:
 	sys->cdrv->unlock(vid);
 	finish_inode_data(id);
@@ -229,8 +247,9 @@ static struct inode *inode_read(uint64_t ino, uint64_t size)
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to read %" PRIx64 " %s", ino, sd_strerror(ret));
 		free(inode);
-		inode = (struct inode *)-ret;
+		return (struct inode *)-ret;
 	}
+	attr_cache_put(inode);
 	return inode;
 }
 
@@ -244,14 +263,25 @@ struct inode *fs_read_inode_full(uint64_t ino)
 	return inode_read(ino, sizeof(struct inode));
 }
 
+/* Return the header of the inode, which might be ATTR_TIMEOUT_MS old */
+struct inode *fs_read_inode_attr(uint64_t ino)
+{
+	struct inode *inode = attr_cache_get(ino);
+
+	return inode ? inode : fs_read_inode_hdr(ino);
+}
+
 static int inode_write(struct inode *inode, uint64_t size)
 {
 	uint64_t oid = inode->ino;
 	int ret;
 
 	ret = sd_write_object(oid, (char *)inode, size, 0, 0);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to write %" PRIx64" %s", oid, sd_strerror(ret));
+		attr_cache_drop(oid);
+	} else
+		attr_cache_put(inode);
 
 	return ret;
 }
@@ -290,24 +320,86 @@ static int dentry_compare(struct dentry *a, struct dentry *b)
 	return strcmp(a->name, b->name);
 }
 
-struct dentry *fs_lookup_dir(struct inode *inode, const char *name)
+/* Walk the hash chain of the name, reading the dentries one by one */
+static int lookup_dir_indexed(struct inode *inode, struct dentry *key)
 {
-	struct dentry *tmp, *base = (struct dentry *)inode->data;
-	struct dentry *key = xmalloc(sizeof(*key));
-	uint64_t dentry_count = inode->size / sizeof(struct dentry);
+	uint64_t dentry_count = inode->size / sizeof(*key), i;
+	uint32_t next;
+	int ret;
 
-	sd_debug("%"PRIx64", %s", inode->ino, name);
+	ret = sd_read_object(inode->ino, (char *)&next, sizeof(next),
+			     INODE_HDR_SIZE +
+			     dentry_bucket(key->name) * sizeof(next));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
-	pstrcpy(key->name, NFS_MAXNAMLEN, name);
+	/* a broken chain can't make us loop */
+	for (i = 0; next && next <= dentry_count && i < dentry_count; i++) {
+		struct dentry dentry;
+
+		ret = sd_read_object(inode->ino, (char *)&dentry,
+				     sizeof(dentry), INODE_META_SIZE +
+				     (next - 1) * sizeof(dentry));
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		if (!dentry_compare(&dentry, key)) {
+			*key = dentry;
+			return SD_RES_SUCCESS;
+		}
+		next = dentry.next;
+	}
+	return SD_RES_NOT_FOUND;
+}
+
+static int lookup_dir_linear(struct inode *inode, struct dentry *key)
+{
+	struct inode *full = fs_read_inode_full(inode->ino);
+	struct dentry *tmp, *base;
+	uint64_t dentry_count;
+
+	if (IS_ERR(full))
+		return PTR_ERR(full);
 
+	base = (struct dentry *)full->data;
+	dentry_count = full->size / sizeof(struct dentry);
 	tmp = xlfind(key, base, dentry_count, dentry_compare);
 	if (tmp)
 		*key = *tmp;
-	else {
-		free(key);
-		key = (struct dentry *)-SD_RES_NOT_FOUND;
+	free(full);
+	return tmp ? SD_RES_SUCCESS : SD_RES_NOT_FOUND;
+}
+
+/* inode is the header of the directory */
+struct dentry *fs_lookup_dir(struct inode *inode, const char *name)
+{
+	struct dentry *key = xzalloc(sizeof(*key));
+	uint64_t ino;
+	long ret;
+
+	sd_debug("%"PRIx64", %s", inode->ino, name);
+
+	pstrcpy(key->name, NFS_MAXNAMLEN, name);
+
+	if (dentry_cache_get(inode->ino, inode->size, key->name, &ino)) {
+		ret = ino ? SD_RES_SUCCESS : SD_RES_NOT_FOUND;
+		key->ino = ino;
+		key->nlen = strlen(key->name);
+		goto out;
 	}
 
+	if (inode->flags & INODE_INDEXED)
+		ret = lookup_dir_indexed(inode, key);
+	else
+		ret = lookup_dir_linear(inode, key);
+	if (ret == SD_RES_SUCCESS)
+		dentry_cache_put(inode->ino, inode->size, key->name, key->ino);
+	else if (ret == SD_RES_NOT_FOUND)
+		dentry_cache_put(inode->ino, inode->size, key->name, 0);
+out:
+	if (ret != SD_RES_SUCCESS) {
+		free(key);
+		key = (struct dentry *)-ret;
+	}
 	return key;
 }
 
@@ -315,7 +407,7 @@ int fs_create_file(uint64_t pino, struct inode *new, const char *name)
 {
 	uint32_t vid = oid_to_vid(pino);
 	struct inode *inode;
-	struct dentry *dentry;
+	struct dentry dentry = {};
 	int ret;
 
 	ret = inode_create(new, vid, name);
@@ -326,53 +418,218 @@ int fs_create_file(uint64_t pino, struct inode *new, const char *name)
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
-	dentry = (struct dentry *)(inode->data + inode->size);
-	pstrcpy(dentry->name, NFS_MAXNAMLEN, name);
-	dentry->ino = new->ino;
-	inode->size += sizeof(*dentry);
+	dentry.ino = new->ino;
+	dentry.nlen = strlen(name);
+	pstrcpy(dentry.name, NFS_MAXNAMLEN, name);
+	dentry_append(inode, &dentry);
 
 	ret = fs_write_inode_full(inode);
+	if (ret == SD_RES_SUCCESS)
+		dentry_cache_put(pino, inode->size, name, new->ino);
 	free(inode);
 	return ret;
 }
 
-/* TODO: support extent */
-int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
+/*
+ * The data of a file lives in its inode object after the metadata.  The calls
+ * to a file are served in order by the same worker, see nfs_queue_req(), so a
+ * buffer of gathered writes and a buffer of read-ahead data of each worker are
+ * enough for the sequential streams of the clients.
+ *
+ * The UNSTABLE writes to a file which overlap or extend the gathered range
+ * are held back, and go down in one write of the object when another call
+ * comes in to the worker, e.g. the COMMIT.  A read starting where the previous
+ * read of the file stopped fills the read-ahead buffer, and the next reads
+ * copy from it.
+ */
+#define FS_READAHEAD_SIZE (1024 * 1024)
+
+struct gather_buf {
+	uint64_t ino; /* 0 if nothing is gathered */
+	uint64_t start, len;
+	uint64_t mtime;
+	uint8_t data[INODE_DATA_SIZE];
+};
+
+struct read_ahead_buf {
+	uint64_t ino; /* of the last read */
+	uint64_t next; /* offset after the last read */
+	uint64_t start, len;
+	uint8_t data[FS_READAHEAD_SIZE];
+};
+
+/* of the worker, allocated by its first call */
+static __thread struct gather_buf *gather;
+static __thread int gather_err = SD_RES_SUCCESS;
+static __thread struct read_ahead_buf *read_ahead;
+
+static void fs_buffers_init(void)
+{
+	if (gather)
+		return;
+
+	gather = xzalloc(sizeof(*gather));
+	read_ahead = xzalloc(sizeof(*read_ahead));
+}
+
+static void read_ahead_drop(uint64_t ino)
+{
+	if (read_ahead->ino == ino)
+		read_ahead->ino = 0;
+}
+
+/* The attributes of the file with the gathered writes applied */
+static void gather_fold(struct inode *inode)
+{
+	if (gather->ino != inode->ino)
+		return;
+
+	inode->size = max(inode->size, gather->start + gather->len);
+	inode->mtime = gather->mtime;
+}
+
+static void gather_flush(void)
+{
+	uint64_t ino;
+	struct inode *inode;
+	int ret;
+
+	if (!gather || !gather->ino)
+		return;
+
+	ino = gather->ino;
+	gather->ino = 0;
+	read_ahead_drop(ino);
+	ret = sd_write_object(ino, (char *)gather->data, gather->len,
+			      INODE_META_SIZE + gather->start, false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	inode = fs_read_inode_hdr(ino);
+	if (IS_ERR(inode)) {
+		ret = PTR_ERR(inode);
+		goto out;
+	}
+	inode->size = max(inode->size, gather->start + gather->len);
+	inode->mtime = gather->mtime;
+	ret = fs_write_inode_hdr(inode);
+	free(inode);
+out:
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to flush the writes to %" PRIx64 " %s", ino,
+		       sd_strerror(ret));
+		gather_err = ret;
+	}
+}
+
+void fs_flush(void)
+{
+	gather_flush();
+}
+
+/* Flush the gathered writes and return any error since the last commit */
+int fs_commit(void)
+{
+	int ret;
+
+	gather_flush();
+	ret = gather_err;
+	gather_err = SD_RES_SUCCESS;
+	return ret;
+}
+
+/*
+ * inode is the header of the file.  The data is read into *buffer, or *buffer
+ * is pointed at the data in the read-ahead buffer.
+ */
+int64_t fs_read(struct inode *inode, void **buffer, uint64_t count,
 		uint64_t offset)
 {
-	uint8_t *start = inode->data + offset;
-	int64_t done = count;
+	uint64_t ino = inode->ino, len;
+	bool stream;
+	int ret;
 
 	if (offset >= inode->size || count == 0)
 		return 0;
 
-	if (offset + count > inode->size)
-		done = inode->size - offset;
+	fs_buffers_init();
+	stream = read_ahead->ino == ino && read_ahead->next == offset;
+
+	count = min(count, inode->size - offset);
+	read_ahead->ino = ino;
+	read_ahead->next = offset + count;
 
-	memcpy(buffer, start, done);
+	if (stream && offset >= read_ahead->start &&
+	    offset + count <= read_ahead->start + read_ahead->len)
+		goto copy;
 
-	return done;
+	if (!stream || count > FS_READAHEAD_SIZE) {
+		ret = sd_read_object(ino, *buffer, count,
+				     INODE_META_SIZE + offset);
+		if (ret != SD_RES_SUCCESS)
+			goto err;
+		return count;
+	}
+
+	len = min((uint64_t)FS_READAHEAD_SIZE, inode->size - offset);
+	ret = sd_read_object(ino, (char *)read_ahead->data, len,
+			     INODE_META_SIZE + offset);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+	read_ahead->start = offset;
+	read_ahead->len = len;
+copy:
+	*buffer = read_ahead->data + offset - read_ahead->start;
+	return count;
+err:
+	sd_err("failed to read %" PRIx64 " %s", ino, sd_strerror(ret));
+	read_ahead->ino = 0;
+	return -1;
 }
 
+/* inode is the header of the file, and gets the attributes after the write */
 int64_t fs_write(struct inode *inode, void *buffer, uint64_t count,
-		 uint64_t offset)
+		 uint64_t offset, bool stable)
 {
-	uint8_t *start = inode->data + offset;
-	int64_t done = count;
+	uint64_t ino = inode->ino;
 	int ret;
 
 	if (count == 0)
 		return 0;
+	if (offset > INODE_DATA_SIZE || count > INODE_DATA_SIZE - offset)
+		return -1;
 
-	memcpy(start, buffer, done);
-
-	/* TODO: lock inode */
-	if ((offset + done) > inode->size)
-		inode->size = offset + done;
+	fs_buffers_init();
+	gather_fold(inode);
+	read_ahead_drop(ino);
+	if (stable || gather->ino != ino || offset < gather->start ||
+	    offset > gather->start + gather->len)
+		gather_flush();
 
+	inode->size = max(inode->size, offset + count);
 	inode->mtime = time(NULL);
-	ret = fs_write_inode_full(inode);
+
+	if (!stable) {
+		if (!gather->ino) {
+			gather->ino = ino;
+			gather->start = offset;
+			gather->len = 0;
+		}
+		memcpy(gather->data + offset - gather->start, buffer, count);
+		gather->len = max(gather->len, offset + count - gather->start);
+		gather->mtime = inode->mtime;
+		return count;
+	}
+
+	ret = sd_write_object(ino, buffer, count, INODE_META_SIZE + offset,
+			      false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write %" PRIx64 " %s", ino,
+		       sd_strerror(ret));
+		return -1;
+	}
+	ret = fs_write_inode_hdr(inode);
 	if (ret != SD_RES_SUCCESS)
-		done = -1;
-	return done;
+		return -1;
+	return count;
 }
@@ -24,6 +24,10 @@ struct extent {
 #define INODE_EXTENT_SIZE (BLOCK_SIZE * 2)
 #define INODE_META_SIZE (INODE_HDR_SIZE + INODE_EXTENT_SIZE)
 #define INODE_DATA_SIZE (SD_DATA_OBJ_SIZE - INODE_META_SIZE)
+#define INODE_NR_BUCKETS (INODE_EXTENT_SIZE / sizeof(uint32_t))
+
+/* The dentries of the directory are hashed in bucket[] */
+#define INODE_INDEXED 0x1
 
 struct inode {
 	union {
@@ -39,11 +43,14 @@ struct inode {
 			uint64_t mtime;	/* Modification time */
 			uint64_t ino;   /* Inode number */
 			uint16_t extent_count; /* Number of extents */
+			uint16_t flags;
 		};
 		uint8_t __pad1[INODE_HDR_SIZE];
 	};
 	union {
 		struct extent extent[0];
+		/* 1 + index of the first dentry of the hash, of a directory */
+		uint32_t bucket[INODE_NR_BUCKETS];
 		uint8_t __pad2[INODE_EXTENT_SIZE];
 	};
 	uint8_t data[INODE_DATA_SIZE];
@@ -53,12 +60,14 @@ struct dentry {
 	uint64_t ino;             /* Inode number */
 	uint16_t nlen;            /* Name length */
 	char name[NFS_MAXNAMLEN]; /* File name */
+	uint32_t next;            /* 1 + index of the next dentry of the hash */
 };
 
 int fs_make_root(uint32_t vid);
 uint64_t fs_root_ino(uint32_t vid);
 struct inode *fs_read_inode_hdr(uint64_t ino);
 struct inode *fs_read_inode_full(uint64_t ino);
+struct inode *fs_read_inode_attr(uint64_t ino);
 int fs_write_inode_hdr(struct inode *inode);
 int fs_write_inode_full(struct inode *inode);
 int fs_read_dir(struct inode *inode, uint64_t offset,
@@ -66,8 +75,20 @@ int fs_read_dir(struct inode *inode, uint64_t offset,
 		void *data);
 struct dentry *fs_lookup_dir(struct inode *inode, const char *name);
 int fs_create_file(uint64_t pino, struct inode *new, const char *name);
-int64_t fs_read(struct inode *inode, void *buffer, uint64_t count, uint64_t);
-int64_t fs_write(struct inode *inode, void *buffer, uint64_t count, uint64_t);
+int64_t fs_read(struct inode *inode, void **buffer, uint64_t count, uint64_t);
+int64_t fs_write(struct inode *inode, void *buffer, uint64_t count, uint64_t,
+		 bool stable);
+void fs_flush(void);
+int fs_commit(void);
 int fs_create_dir(struct inode *inode, const char *name, struct inode *parent);
 
+/* cache.c */
+struct inode *attr_cache_get(uint64_t ino);
+void attr_cache_put(const struct inode *inode);
+void attr_cache_drop(uint64_t ino);
+bool dentry_cache_get(uint64_t dir, uint64_t dir_size, const char *name,
+		      uint64_t *ino);
+void dentry_cache_put(uint64_t dir, uint64_t dir_size, const char *name,
+		      uint64_t ino);
+
 #endif
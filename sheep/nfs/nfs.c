@@ -75,19 +75,19 @@ static void update_post_attr(struct inode *inode, fattr3 *post)
 
 void *nfs3_null(struct svc_req *req, struct nfs_arg *argp)
 {
-	static void *result;
+	static __thread void *result;
 
 	return &result;
 }
 
 void *nfs3_getattr(struct svc_req *req, struct nfs_arg *argp)
 {
-	static GETATTR3res result;
+	static __thread GETATTR3res result;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct fattr3 *post = &result.GETATTR3res_u.resok.obj_attributes;
 	struct inode *inode;
 
-	inode = fs_read_inode_hdr(fh->ino);
+	inode = fs_read_inode_attr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -110,7 +110,7 @@ out:
 /* FIXME: Add nanotime support */
 void *nfs3_setattr(struct svc_req *req, struct nfs_arg *argp)
 {
-	static SETATTR3res result;
+	static __thread SETATTR3res result;
 	SETATTR3args *arg = &argp->setattr;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct sattr3 *sattr = &arg->new_attributes;
@@ -157,7 +157,7 @@ out:
 
 void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 {
-	static LOOKUP3res result;
+	static __thread LOOKUP3res result;
 	static struct svc_fh den_fh;
 	LOOKUP3args *arg = &argp->lookup;
 	struct svc_fh *fh = get_svc_fh(argp);
@@ -167,7 +167,7 @@ void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 
 	sd_debug("%"PRIx64" %s", fh->ino, name);
 
-	inode = fs_read_inode_full(fh->ino);
+	inode = fs_read_inode_attr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -208,7 +208,7 @@ out:
 /* FIXME: implement UNIX ACL */
 void *nfs3_access(struct svc_req *req, struct nfs_arg *argp)
 {
-	static ACCESS3res result;
+	static __thread ACCESS3res result;
 	ACCESS3args *arg = &argp->access;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct post_op_attr *poa = &result.ACCESS3res_u.resok.obj_attributes;
@@ -216,7 +216,7 @@ void *nfs3_access(struct svc_req *req, struct nfs_arg *argp)
 	uint32_t access;
 	struct inode *inode;
 
-	inode = fs_read_inode_hdr(fh->ino);
+	inode = fs_read_inode_attr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -250,11 +250,12 @@ void *nfs3_readlink(struct svc_req *req, struct nfs_arg *argp)
 	return NULL;
 }
 
-static char nfs_read_buffer[RPCSVC_MAXPAYLOAD];
+/* of the worker, allocated by its first READ */
+static __thread char *nfs_read_buffer;
 
 void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READ3res result;
+	static __thread READ3res result;
 	READ3args *arg = &argp->read;
 	struct svc_fh *fh = get_svc_fh(argp);
 	uint64_t offset = arg->offset, count = arg->count;
@@ -262,12 +263,13 @@ void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 		&result.READ3res_u.resok.file_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
+	void *data;
 	int ret;
 
 	sd_debug("%"PRIx64"count %"PRIu64" offset %"PRIu64, fh->ino,
 		 count, offset);
 
-	inode = fs_read_inode_full(fh->ino);
+	inode = fs_read_inode_attr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -279,7 +281,10 @@ void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 		}
 	}
 
-	ret = fs_read(inode, nfs_read_buffer, count, offset);
+	if (!nfs_read_buffer)
+		nfs_read_buffer = xmalloc(RPCSVC_MAXPAYLOAD);
+	data = nfs_read_buffer;
+	ret = fs_read(inode, &data, count, offset);
 	if (ret < 0) {
 		result.status = NFS3ERR_IO;
 		goto out_free;
@@ -287,7 +292,7 @@ void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 	result.status = NFS3_OK;
 	result.READ3res_u.resok.count = ret;
 	result.READ3res_u.resok.eof = ret < count;
-	result.READ3res_u.resok.data.data_val = nfs_read_buffer;
+	result.READ3res_u.resok.data.data_val = data;
 	result.READ3res_u.resok.data.data_len = ret;
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
@@ -299,7 +304,7 @@ out:
 
 void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 {
-	static WRITE3res result;
+	static __thread WRITE3res result;
 	WRITE3args *arg = &argp->write;
 	struct svc_fh *fh = get_svc_fh(argp);
 	uint64_t offset = arg->offset, count = arg->count;
@@ -309,11 +314,12 @@ void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 	struct inode *inode;
 	int64_t done;
 	void *buffer = arg->data.data_val;
+	bool stable;
 
 	sd_debug("%"PRIx64" count %"PRIu64" offset %"PRIu64" stable %d",
 		 fh->ino, count, offset, arg->stable);
 
-	inode = fs_read_inode_full(fh->ino);
+	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -325,14 +331,15 @@ void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 		}
 	}
 
-	done = fs_write(inode, buffer, count, offset);
+	stable = arg->stable != UNSTABLE;
+	done = fs_write(inode, buffer, count, offset, stable);
 	if (done < 0) {
 		result.status = NFS3ERR_IO;
 		goto out_free;
 	}
 	result.status = NFS3_OK;
 	result.WRITE3res_u.resok.count = done;
-	result.WRITE3res_u.resok.committed = FILE_SYNC;
+	result.WRITE3res_u.resok.committed = stable ? FILE_SYNC : UNSTABLE;
 	memcpy(&result.WRITE3res_u.resok.verf, &nfs_boot_time,
 	       sizeof(nfs_boot_time));
 	poa->attributes_follow = true;
@@ -346,7 +353,7 @@ out:
 /* FIXME: support GUARDED and EXCLUSIVE */
 void *nfs3_create(struct svc_req *req, struct nfs_arg *argp)
 {
-	static CREATE3res result;
+	static __thread CREATE3res result;
 	static struct svc_fh file_fh;
 	CREATE3args *arg = &argp->create;
 	struct svc_fh *fh = get_svc_fh(argp);
@@ -388,7 +395,7 @@ out:
 
 void *nfs3_mkdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static MKDIR3res result;
+	static __thread MKDIR3res result;
 	static struct svc_fh file_fh;
 	MKDIR3args *arg = &argp->mkdir;
 	struct svc_fh *fh = get_svc_fh(argp);
@@ -453,7 +460,7 @@ void *nfs3_symlink(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_mknod(struct svc_req *req, struct nfs_arg *argp)
 {
-	static MKNOD3res result;
+	static __thread MKNOD3res result;
 
 	result.status = NFS3ERR_NOTSUPP;
 
@@ -463,7 +470,7 @@ void *nfs3_mknod(struct svc_req *req, struct nfs_arg *argp)
 /* TODO: implement btree or hash based kv store to manage dentries */
 void *nfs3_remove(struct svc_req *req, struct nfs_arg *argp)
 {
-	static REMOVE3res result;
+	static __thread REMOVE3res result;
 
 	result.status = NFS3ERR_NOTSUPP;
 
@@ -472,7 +479,7 @@ void *nfs3_remove(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_rmdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static RMDIR3res result;
+	static __thread RMDIR3res result;
 
 	result.status = NFS3ERR_NOTSUPP;
 
@@ -481,7 +488,7 @@ void *nfs3_rmdir(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_rename(struct svc_req *req, struct nfs_arg *argp)
 {
-	static RENAME3res result;
+	static __thread RENAME3res result;
 
 	result.status = NFS3ERR_NOTSUPP;
 
@@ -496,8 +503,9 @@ void *nfs3_link(struct svc_req *req, struct nfs_arg *argp)
 /* Linux NFS client will issue at most 32k count for readdir on my test */
 #define ENTRY3_MAX_LEN (32*1024)
 
-static char entry3_buffer[ENTRY3_MAX_LEN];
-static char entry3_name[ENTRY3_MAX_LEN];
+/* of the worker, allocated by its first READDIR */
+static __thread char *entry3_buffer;
+static __thread char *entry3_name;
 
 /*
  * static READDIR3resok size with XDR overhead
@@ -555,7 +563,7 @@ static int nfs_dentry_reader(struct inode *inode, struct dentry *dentry,
 
 void *nfs3_readdir(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READDIR3res result;
+	static __thread READDIR3res result;
 	READDIR3args *arg = &argp->readdir;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct post_op_attr *poa =
@@ -585,6 +593,10 @@ void *nfs3_readdir(struct svc_req *req, struct nfs_arg *argp)
 		goto out_free;
 	}
 
+	if (!entry3_buffer) {
+		entry3_buffer = xmalloc(ENTRY3_MAX_LEN);
+		entry3_name = xmalloc(ENTRY3_MAX_LEN);
+	}
 	wd.count = arg->count;
 	wd.entries = (entry3 *)entry3_buffer;
 	wd.iter = 0;
@@ -614,7 +626,7 @@ out:
 
 void *nfs3_readdirplus(struct svc_req *req, struct nfs_arg *argp)
 {
-	static READDIRPLUS3res result;
+	static __thread READDIRPLUS3res result;
 
 	result.status = NFS3ERR_NOTSUPP;
 
@@ -623,7 +635,7 @@ void *nfs3_readdirplus(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp)
 {
-	static FSSTAT3res result;
+	static __thread FSSTAT3res result;
 	struct svc_fh *fh = get_svc_fh(argp);
 	struct sd_inode *sd_inode = xmalloc(sizeof(*sd_inode));
 	uint32_t vid = oid_to_vid(fh->ino);
@@ -662,6 +674,10 @@ static uint32_t get_max_size(struct svc_req *req)
 	int v, ret;
 	socklen_t l;
 
+	/* the calls over TCP are served by nfsd.c itself */
+	if (!req->rq_xprt)
+		return RPCSVC_MAXPAYLOAD_TCP;
+
 	l = sizeof(v);
 	ret = getsockopt(req->rq_xprt->xp_sock, SOL_SOCKET, SO_TYPE, &v, &l);
 	if (ret < 0) {
@@ -677,7 +693,7 @@ out:
 
 void *nfs3_fsinfo(struct svc_req *req, struct nfs_arg *argp)
 {
-	static FSINFO3res result;
+	static __thread FSINFO3res result;
 	uint32_t maxsize = get_max_size(req);
 
 	result.status = NFS3_OK;
@@ -699,7 +715,7 @@ void *nfs3_fsinfo(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp)
 {
-	static PATHCONF3res result;
+	static __thread PATHCONF3res result;
 
 	result.status = NFS3_OK;
 	result.PATHCONF3res_u.resok.obj_attributes.attributes_follow = false;
@@ -715,9 +731,16 @@ void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp)
 
 void *nfs3_commit(struct svc_req *req, struct nfs_arg *argp)
 {
-	static COMMIT3res result;
-
-	result.status = NFS3ERR_NOTSUPP;
+	static __thread COMMIT3res result;
 
+	/* all the writes of the files go down, not only the range asked */
+	if (fs_commit() != SD_RES_SUCCESS) {
+		result.status = NFS3ERR_IO;
+		goto out;
+	}
+	result.status = NFS3_OK;
+	memcpy(&result.COMMIT3res_u.resok.verf, &nfs_boot_time,
+	       sizeof(nfs_boot_time));
+out:
 	return &result;
 }
@@ -77,11 +77,188 @@ static struct svc_handler mount3_handlers[] = {
 	MOUNT_HANDLER(export, null_args, exports),
 };
 
+/*
+ * The NFS calls are served by a pool of ordered work queues.  The calls to a
+ * file go to the same queue, hashed by the inode of the handle, so they are
+ * served in order, see fs.c, while the calls to the other files run on the
+ * other workers.
+ *
+ * The svc library of the RPC is not multi-threaded, so the TCP transport of
+ * NFS is served here: the connections wait in the event loop of sheep, a
+ * worker of nfs_recv_wqueue reads and decodes a call, and the worker of the
+ * file sends the reply on the connection once the call is done, in any order
+ * as the xid tells the client which call it answers.  The UDP transport and
+ * MOUNT stay with svc_run(), which waits for the worker of each call.
+ */
+#define NFSD_MAX_WORKERS 16
+/* a call or a reply of a 1M READ or WRITE, see nfs3_fsinfo(), and headers */
+#define NFSD_MAX_RECORD (1024 * 1024 + 64 * 1024)
+#define NFSD_LAST_FRAG 0x80000000U
+
+struct nfs_conn {
+	int fd;
+	struct work work; /* to read the next call */
+	struct nfs_req *req; /* decoded by the work */
+	struct sd_mutex lock; /* of the replies */
+	int nr_reqs; /* in flight, only in the main thread */
+	bool eof; /* seen by the work */
+	bool dead; /* only in the main thread */
+	char *rec; /* the record of the call */
+	size_t rec_len;
+};
+
+struct nfs_req {
+	struct work work;
+	struct nfs_conn *conn; /* NULL for the calls of svc_run() */
+	SVCXPRT *transp;
+	struct svc_handler *handler;
+	struct svc_req svc;
+	uint32_t xid;
+	bool done;
+	struct nfs_arg arg;
+};
+
+static struct work_queue *nfs_wqueues[NFSD_MAX_WORKERS];
+static int nr_nfs_wqueues;
+static struct work_queue *nfs_recv_wqueue;
+static uint16_t nfsd_tcp_port;
+
+/* to wait for the calls of svc_run() */
+static struct sd_mutex svc_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond svc_cond = SD_COND_INITIALIZER;
+
+/* of the worker, allocated by its first reply */
+static __thread char *reply_buf;
+
+static void nfs_conn_put(struct nfs_conn *conn)
+{
+	if (!conn->dead || conn->nr_reqs)
+		return;
+
+	sd_debug("close the nfs connection %d", conn->fd);
+	close(conn->fd);
+	sd_destroy_mutex(&conn->lock);
+	free(conn->rec);
+	free(conn);
+}
+
+static void nfs_reply(struct nfs_conn *conn, uint32_t xid,
+		      enum accept_stat stat, xdrproc_t encoder, void *result)
+{
+	struct rpc_msg reply = {
+		.rm_xid = xid,
+		.rm_direction = REPLY,
+	};
+	uint32_t mark;
+	XDR xdrs;
+	int ret;
+
+	reply.rm_reply.rp_stat = MSG_ACCEPTED;
+	reply.acpted_rply.ar_verf = _null_auth;
+	reply.acpted_rply.ar_stat = stat;
+	if (stat == SUCCESS) {
+		reply.acpted_rply.ar_results.where = result;
+		reply.acpted_rply.ar_results.proc = encoder;
+	} else if (stat == PROG_MISMATCH) {
+		reply.acpted_rply.ar_vers.low = NFS_V3;
+		reply.acpted_rply.ar_vers.high = NFS_V3;
+	}
+
+	if (!reply_buf)
+		reply_buf = xmalloc(NFSD_MAX_RECORD);
+	xdrmem_create(&xdrs, reply_buf + sizeof(mark),
+		      NFSD_MAX_RECORD - sizeof(mark), XDR_ENCODE);
+	if (!xdr_replymsg(&xdrs, &reply)) {
+		sd_err("failed to encode the reply of %"PRIx32, xid);
+		goto err;
+	}
+	mark = htonl(NFSD_LAST_FRAG | xdr_getpos(&xdrs));
+	memcpy(reply_buf, &mark, sizeof(mark));
+
+	sd_mutex_lock(&conn->lock);
+	ret = xwrite(conn->fd, reply_buf, sizeof(mark) + xdr_getpos(&xdrs));
+	sd_mutex_unlock(&conn->lock);
+	if (ret < 0) {
+		sd_err("failed to send the reply of %"PRIx32", %m", xid);
+		goto err;
+	}
+	xdr_destroy(&xdrs);
+	return;
+err:
+	xdr_destroy(&xdrs);
+	/* the reader sees the end of the connection */
+	shutdown(conn->fd, SHUT_RDWR);
+}
+
+static struct work_queue *nfs_wqueue_of(struct nfs_arg *arg, uint32_t proc)
+{
+	struct nfs_fh3 *nfh = (struct nfs_fh3 *)arg;
+	uint64_t ino = 0;
+
+	if (proc != NFSPROC3_NULL &&
+	    nfh->data.data_len == sizeof(struct svc_fh))
+		ino = ((struct svc_fh *)nfh->data.data_val)->ino;
+	return nfs_wqueues[sd_hash_oid(ino) % nr_nfs_wqueues];
+}
+
+static void nfs_req_work(struct work *work)
+{
+	struct nfs_req *req = container_of(work, struct nfs_req, work);
+	struct svc_handler *handler = req->handler;
+	void *result;
+
+	/* the other calls see the gathered writes, see fs_write() */
+	if (req->svc.rq_proc != NFSPROC3_WRITE)
+		fs_flush();
+
+	result = handler->func(&req->svc, &req->arg);
+	if (!result)
+		goto out;
+
+	if (req->conn)
+		nfs_reply(req->conn, req->xid, SUCCESS, handler->encoder,
+			  result);
+	else if (!svc_sendreply(req->transp, handler->encoder, result)) {
+		sd_err("svc_sendreply failed");
+		svcerr_systemerr(req->transp);
+	}
+out:
+	if (req->conn)
+		xdr_free(handler->decoder, (char *)&req->arg);
+}
+
+static void nfs_req_done(struct work *work)
+{
+	struct nfs_req *req = container_of(work, struct nfs_req, work);
+	struct nfs_conn *conn = req->conn;
+
+	if (!conn) {
+		/* svc_run() frees the call */
+		sd_mutex_lock(&svc_lock);
+		req->done = true;
+		sd_cond_signal(&svc_cond);
+		sd_mutex_unlock(&svc_lock);
+		return;
+	}
+
+	free(req);
+	conn->nr_reqs--;
+	nfs_conn_put(conn);
+}
+
+static void nfs_queue_req(struct nfs_req *req)
+{
+	req->work.fn = nfs_req_work;
+	req->work.done = nfs_req_done;
+	queue_work(nfs_wqueue_of(&req->arg, req->svc.rq_proc), &req->work);
+}
+
 static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 {
 	struct nfs_arg arg = {};
 	int prog = reg->rq_prog, vers = reg->rq_vers, proc = reg->rq_proc;
 	struct svc_handler *handlers;
+	struct nfs_req *req;
 	void *result;
 
 	if (prog == NFS_PROGRAM && vers == NFS_V3)
@@ -94,6 +271,33 @@ static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 	}
 
 	sd_debug("%s", handlers[proc].name);
+	uatomic_inc(&handlers[proc].count);
+
+	if (prog == NFS_PROGRAM) {
+		req = xzalloc(sizeof(*req));
+		req->transp = transp;
+		req->handler = handlers + proc;
+		req->svc = *reg;
+		if (!svc_getargs(transp, req->handler->decoder,
+				 (caddr_t)&req->arg)) {
+			sd_err("svc_getargs failed");
+			svcerr_decode(transp);
+			free(req);
+			return;
+		}
+
+		nfs_queue_req(req);
+		sd_mutex_lock(&svc_lock);
+		while (!req->done)
+			sd_cond_wait(&svc_cond, &svc_lock);
+		sd_mutex_unlock(&svc_lock);
+
+		if (!svc_freeargs(transp, req->handler->decoder,
+				  (caddr_t)&req->arg))
+			panic("unable to free arguments");
+		free(req);
+		return;
+	}
 
 	if (!svc_getargs(transp, handlers[proc].decoder, (caddr_t)&arg)) {
 		sd_err("svc_getargs failed");
@@ -101,7 +305,6 @@ static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 		return;
 	}
 
-	handlers[proc].count++;
 	result = handlers[proc].func(reg, &arg);
 	if (result && !svc_sendreply(transp, handlers[proc].encoder,
 				     result)) {
@@ -115,6 +318,198 @@ static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 	return;
 }
 
+/* Read the fragments of the next record of the connection */
+static bool nfs_read_record(struct nfs_conn *conn)
+{
+	uint32_t mark, len;
+
+	conn->rec_len = 0;
+	do {
+		if (xread(conn->fd, &mark, sizeof(mark)) != sizeof(mark))
+			return false;
+		mark = ntohl(mark);
+		len = mark & ~NFSD_LAST_FRAG;
+		if (conn->rec_len + len > NFSD_MAX_RECORD) {
+			sd_err("too large an nfs call, %zu bytes",
+			       conn->rec_len + len);
+			return false;
+		}
+		if (xread(conn->fd, conn->rec + conn->rec_len, len) != len)
+			return false;
+		conn->rec_len += len;
+	} while (!(mark & NFSD_LAST_FRAG));
+
+	return true;
+}
+
+static void nfs_conn_work(struct work *work)
+{
+	struct nfs_conn *conn = container_of(work, struct nfs_conn, work);
+	char cred[MAX_AUTH_BYTES], verf[MAX_AUTH_BYTES];
+	struct rpc_msg msg = {};
+	struct nfs_req *req;
+	uint32_t proc;
+	XDR xdrs;
+
+	if (!conn->rec)
+		conn->rec = xmalloc(NFSD_MAX_RECORD);
+	if (!nfs_read_record(conn)) {
+		conn->eof = true;
+		return;
+	}
+
+	msg.rm_call.cb_cred.oa_base = cred;
+	msg.rm_call.cb_verf.oa_base = verf;
+	xdrmem_create(&xdrs, conn->rec, conn->rec_len, XDR_DECODE);
+	if (!xdr_callmsg(&xdrs, &msg) || msg.rm_direction != CALL ||
+	    msg.rm_call.cb_rpcvers != RPC_MSG_VERSION) {
+		sd_err("invalid rpc call");
+		conn->eof = true;
+		goto out;
+	}
+
+	proc = msg.rm_call.cb_proc;
+	if (msg.rm_call.cb_prog != NFS_PROGRAM) {
+		nfs_reply(conn, msg.rm_xid, PROG_UNAVAIL, NULL, NULL);
+		goto out;
+	}
+	if (msg.rm_call.cb_vers != NFS_V3) {
+		nfs_reply(conn, msg.rm_xid, PROG_MISMATCH, NULL, NULL);
+		goto out;
+	}
+	if (proc >= ARRAY_SIZE(nfs3_handlers)) {
+		nfs_reply(conn, msg.rm_xid, PROC_UNAVAIL, NULL, NULL);
+		goto out;
+	}
+
+	sd_debug("%s", nfs3_handlers[proc].name);
+	uatomic_inc(&nfs3_handlers[proc].count);
+
+	req = xzalloc(sizeof(*req));
+	req->conn = conn;
+	req->handler = nfs3_handlers + proc;
+	req->xid = msg.rm_xid;
+	req->svc.rq_prog = NFS_PROGRAM;
+	req->svc.rq_vers = NFS_V3;
+	req->svc.rq_proc = proc;
+	if (!req->handler->decoder(&xdrs, &req->arg)) {
+		sd_err("failed to decode the arguments of %s",
+		       req->handler->name);
+		xdr_free(req->handler->decoder, (char *)&req->arg);
+		free(req);
+		nfs_reply(conn, msg.rm_xid, GARBAGE_ARGS, NULL, NULL);
+		goto out;
+	}
+	conn->req = req;
+out:
+	xdr_destroy(&xdrs);
+}
+
+static void nfs_conn_handler(int fd, int events, void *data);
+
+static void nfs_conn_done(struct work *work)
+{
+	struct nfs_conn *conn = container_of(work, struct nfs_conn, work);
+
+	if (conn->req) {
+		conn->nr_reqs++;
+		nfs_queue_req(conn->req);
+		conn->req = NULL;
+	}
+
+	if (conn->eof ||
+	    register_event(conn->fd, nfs_conn_handler, conn) < 0)
+		conn->dead = true;
+	nfs_conn_put(conn);
+}
+
+static void nfs_conn_handler(int fd, int events, void *data)
+{
+	struct nfs_conn *conn = data;
+
+	unregister_event(fd);
+	queue_work(nfs_recv_wqueue, &conn->work);
+}
+
+static void nfs_listen_handler(int listen_fd, int events, void *data)
+{
+	struct nfs_conn *conn;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		sd_err("failed to accept a new nfs connection: %m");
+		return;
+	}
+	if (set_nodelay(fd) < 0 || set_keepalive(fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	conn = xzalloc(sizeof(*conn));
+	conn->fd = fd;
+	conn->work.fn = nfs_conn_work;
+	conn->work.done = nfs_conn_done;
+	sd_init_mutex(&conn->lock);
+	if (register_event(fd, nfs_conn_handler, conn) < 0) {
+		conn->dead = true;
+		nfs_conn_put(conn);
+		return;
+	}
+	sd_debug("accepted a new nfs connection: %d", fd);
+}
+
+/* Listen for NFS over TCP on a port of the kernel's choice, like svc does */
+static int nfs_listen_tcp(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	socklen_t len = sizeof(addr);
+	int fd, opt = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		sd_err("failed to create a socket, %m");
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		sd_err("failed to listen for nfs, %m");
+		close(fd);
+		return -1;
+	}
+	if (register_event(fd, nfs_listen_handler, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	nfsd_tcp_port = ntohs(addr.sin_port);
+	return 0;
+}
+
+static int nfs_init_workers(void)
+{
+	char name[16];
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	nr_nfs_wqueues = min(max(nr_cpus, 1L), (long)NFSD_MAX_WORKERS);
+	for (int i = 0; i < nr_nfs_wqueues; i++) {
+		snprintf(name, sizeof(name), "nfs%d", i);
+		nfs_wqueues[i] = create_ordered_work_queue(strdup(name));
+		if (!nfs_wqueues[i])
+			return -1;
+	}
+
+	nfs_recv_wqueue = create_work_queue("nfs_recv", WQ_DYNAMIC);
+	if (!nfs_recv_wqueue)
+		return -1;
+	return 0;
+}
+
 static int nfs_init_transport(void)
 {
 	SVCXPRT *nfs_trans = NULL;
@@ -135,18 +530,11 @@ static int nfs_init_transport(void)
 	}
 	sd_info("nfs service listen at %d, proto udp", nfs_trans->xp_port);
 
-	nfs_trans = svctcp_create(RPC_ANYSOCK, 0, 0);
-	if (!nfs_trans) {
-		sd_err("svctcp_create failed");
+	if (!pmap_set(NFS_PROGRAM, NFS_V3, IPPROTO_TCP, nfsd_tcp_port)) {
+		sd_err("pmap_set tcp, failed");
 		return -1;
 	}
-
-	if (!svc_register(nfs_trans, NFS_PROGRAM, NFS_V3, svc_dispatcher,
-			  IPPROTO_TCP)) {
-		sd_err("svc_register tcp, failed");
-		return -1;
-	}
-	sd_info("nfs service listen at %d, proto tcp", nfs_trans->xp_port);
+	sd_info("nfs service listen at %d, proto tcp", nfsd_tcp_port);
 
 	nfs_trans = svcudp_create(RPC_ANYSOCK);
 	if (!nfs_trans) {
@@ -201,6 +589,9 @@ int nfs_init(const char *options)
 	sd_thread_t t;
 	int err;
 
+	if (nfs_init_workers() < 0 || nfs_listen_tcp() < 0)
+		return -1;
+
 	err = sd_thread_create("nfs", &t, nfsd, NULL);
 	if (err) {
 		sd_err("%s", strerror(err));
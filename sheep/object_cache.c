@@ -20,6 +20,10 @@
  *  32 - 51 (20 bits): reserved
  *  52 - 59 (8 bits): object flag space
  *  60 - 63 (4 bits): object type identifier space
+ *
+ * The caches are of the vid of the oid, which the clients resolve with
+ * sd_inode_get_vid(), so the objects of a snapshot are cached once for all the
+ * clones reading them.
  */
 #define CACHE_VDI_SHIFT       63 /* if the entry is identified as VDI object */
 #define CACHE_CREATE_SHIFT    59 /* If the entry should be created at backend */
@@ -29,54 +33,235 @@
 
 #define CACHE_INDEX_MASK      (CACHE_CREATE_BIT)
 
-#define CACHE_OBJECT_SIZE (SD_DATA_OBJ_SIZE / 1024 / 1024) /* M */
+/* The nominal size of the objects to size the queues, in MB */
+#define CACHE_OBJECT_SIZE (SD_DATA_OBJ_SIZE / 1024 / 1024)
+
+/*
+ * The objects are cached in blocks of 4 KB, or larger for the objects larger
+ * than CACHE_MAX_BLOCKS blocks.  A miss fetches the blocks which the request
+ * touches and the others are fetched when they are accessed.  The blocks of a
+ * partially fetched object are remembered in the CACHE_VALID_XATTR of its file
+ * to survive the restart.
+ */
+#define CACHE_MAX_BLOCKS	1024
+#define CACHE_VALID_XATTR	"user.sheepdog.cache_valid"
+
+/* The clean blocks between two dirty runs to push them in one request */
+#define CACHE_PUSH_MERGE_GAP	16
+
+/*
+ * The entries are journaled in CACHE_META_FILE of the cache directory, one slot
+ * for each, so that sheep restarts with the dirty blocks and the queues of the
+ * objects in one sequential read instead of scanning the directories and
+ * marking everything dirty.  A slot is written when the object is cached and
+ * when its dirty or fetched blocks change.  The first slot is the header.
+ *
+ * The slots aren't synced.  A crash can leave a slot of an object whose file
+ * is removed or a file without a slot, which the sweep after the load cleans
+ * up, and lose the dirty bits of the writes which weren't flushed.
+ */
+#define CACHE_META_FILE		".meta"
+#define CACHE_META_MAGIC	0x5344434d /* SDCM */
+#define CACHE_META_VERSION	1
+#define CACHE_META_SLOT_SIZE	512
+
+struct cache_meta_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t max_blocks;
+	uint32_t slot_size;
+};
+
+struct cache_meta {
+	uint64_t checksum; /* Of the below, or 0 if the slot is free */
+	uint64_t idx; /* Index of the entry with CACHE_CREATE_BIT */
+	uint64_t seq; /* The entries are queued again in this order */
+	uint32_t vid;
+	uint8_t queue;
+	uint8_t partial; /* If valid holds the fetched blocks */
+	uint8_t shift; /* block_size_shift of the vdi, 0 for the default */
+	uint8_t pad;
+	uint64_t dirty[CACHE_MAX_BLOCKS / 64];
+	uint64_t valid[CACHE_MAX_BLOCKS / 64];
+};
+
+/*
+ * The flusher pushes the dirty objects back in the background, at most
+ * FLUSH_BATCH objects of each VDI in a round so that a VDI can't burst at the
+ * cluster:
+ *
+ *  - every FLUSH_INTERVAL, the objects which are dirty for longer than
+ *    sys->object_cache_expire seconds.
+ *  - in rounds back to back, the oldest dirty objects when they are more than
+ *    sys->object_cache_dirty_ratio percent of the cache.
+ *
+ * The objects of a round are pushed in the order of the index, which keeps the
+ * sequential runs together.
+ */
+#define FLUSH_INTERVAL	1000 /* ms */
+#define FLUSH_BATCH	16
+
+/*
+ * The entries which a FLUSH or a round of the flusher takes are sorted by the
+ * nodes they are pushed to and queued in works of at most PUSH_GROUP_MAX of
+ * them, which push them one after another.  The requests to the same nodes
+ * then follow each other on the connections of the sockfd cache, instead of
+ * every work contending for every node.
+ *
+ * The pushes are in the push list of their cache in the order they are queued.
+ * A FLUSH waits for those up to its own, which covers the entries taken by the
+ * flusher or the other FLUSHes before it, and not for the entries dirtied and
+ * queued after it came.
+ */
+#define PUSH_GROUP_MAX	8
+
+/*
+ * A cache created at runtime, which is when its VDI is opened or the first of
+ * the clones of a snapshot boots, traces the data objects read or written in
+ * the first TRACE_WINDOW seconds, at most TRACE_MAX_OBJS of them in the order
+ * of the first access.  The trace is saved in the attribute
+ * SD_BOOT_TRACE_ATTR_KEY of the VDI at the first access after the window, and
+ * the next time the cache is created the objects of the trace are pulled in
+ * parallel in the background, so that a boot storm of the VMs of the same
+ * image finds its objects cached instead of pulling them one by one.
+ */
+#define TRACE_WINDOW	60 /* seconds */
+#define TRACE_MAX_OBJS	512
+
+/*
+ * The objects are replaced with 2Q across all the VDIs so that a scan of one
+ * VDI, like a backup or dd of the whole disk, can't flush the objects which the
+ * other VDIs use again and again:
+ *
+ *  - a1in: the objects which are referenced once, in FIFO order. The repeated
+ *    references of a scan just after the reference are not counted.
+ *  - am: the objects which were referenced again after they left a1in, in LRU
+ *    order approximated with CLOCK.  A hit only marks the entry referenced,
+ *    without any lock, and the reclaimer gives it another round.
+ *  - a1out: the ghosts of the objects reclaimed from a1in, in FIFO order. A
+ *    miss of an object which has a ghost brings it into am.
+ */
+enum cache_queue {
+	CACHE_NONE,
+	CACHE_A1IN,
+	CACHE_AM,
+};
+
+#define GHOST_HASH_BITS	10
+#define GHOST_HASH_SIZE	(1 << GHOST_HASH_BITS)
 
-/* Kick background pusher if dirty_count greater than it */
-#define MAX_DIRTY_OBJECT_COUNT	10 /* Just a random number, no rationale */
+struct cache_ghost {
+	uint32_t vid;
+	uint64_t idx;
+	struct hlist_node hash;
+	struct list_node list;
+};
 
 struct global_cache {
-	uint32_t capacity; /* The real capacity of object cache of this node */
+	uint64_t capacity; /* The real capacity of object cache of this node, KB */
 	uatomic_bool in_reclaim; /* If the reclaimer is working */
+	uatomic_bool in_flush; /* If the flusher is working */
+	uint32_t nr_dirty; /* Dirty objects of all the VDIs */
+	uint32_t nr_pushing; /* Objects being pushed back */
+	uint32_t nr_flushing; /* Objects of the round of the flusher */
+
+	/* The lock is taken inside the cache lock and protects the below */
+	struct sd_mutex lru_lock;
+	struct list_head a1in;
+	struct list_head am;
+	struct list_head a1out;
+	uint32_t nr_a1in, nr_am, nr_a1out;
+	struct hlist_head ghost_hash[GHOST_HASH_SIZE];
+
+	uint64_t hits, misses, ghost_hits;
 };
 
 struct object_cache_entry {
 	uint64_t idx; /* Index of this entry */
 	refcnt_t refcnt; /* Reference count of this entry */
-	uint64_t bmap; /* Each bit represents one dirty block in object */
+	/* Each bit represents one dirty block in object */
+	DECLARE_BITMAP(bmap, CACHE_MAX_BLOCKS);
+	unsigned long *valid; /* The fetched blocks, or NULL if all of them */
 	struct object_cache *oc; /* Object cache this entry belongs to */
 	struct rb_node node; /* For lru tree of object cache */
 	struct list_node dirty_list; /* For dirty list of object cache */
-	struct list_node lru_list; /* For lru list of object cache */
+	uint64_t dirty_time; /* When it was added to the dirty list, in ns */
+	struct list_node lru_list; /* For the replacement queue */
+	enum cache_queue queue; /* The queue the entry is in */
+	uatomic_bool referenced; /* Hit in am since the reclaimer passed it */
+	uint32_t slot; /* The slot in the metadata file, or 0 if none */
+	struct push_item *push; /* The push queued, under the push lock */
 
 	struct sd_rw_lock lock; /* Entry lock */
 };
 
 struct object_cache {
 	uint32_t vid; /* The VID of this VDI */
-	uint32_t push_count; /* How many push threads queued in push phase. */
 	uint32_t dirty_count; /* How many dirty object in this cache */
 	uint32_t total_count; /* Count of objects include dirty and clean */
 	struct hlist_node hash; /* VDI is linked to the global hash lists */
 	struct rb_root lru_tree; /* For faster object search */
-	struct list_head lru_head; /* Per VDI LRU list for reclaimer */
 	struct list_head dirty_head; /* Dirty objects linked to this list */
-	int push_efd; /* Used to synchronize between pusher and push threads */
-	struct sd_mutex push_mutex; /* mutex for pushing cache */
+	struct list_head push_list; /* Pushes queued, in the order of seq */
+	uint64_t push_seq; /* Seq of the last push queued */
+	struct sd_mutex push_lock; /* For the above */
+	struct sd_cond push_cond; /* Broadcast when a push is done */
+
+	uatomic_bool traced; /* If the trace was started */
+	uatomic_bool tracing; /* If the trace window is open */
+	struct sd_mutex trace_lock; /* For the below */
+	uint32_t *trace; /* The data objects accessed, NULL if not tracing */
+	uint32_t nr_trace;
+	time_t trace_start;
 
 	struct sd_rw_lock lock; /* Cache lock */
 };
 
-struct push_work {
-	struct work work;
+struct push_item {
 	struct object_cache_entry *entry;
-	struct object_cache *oc;
+	uint64_t seq;
+	uint64_t key; /* Of the nodes pushed to, see push_key() */
+	struct list_node list;
+};
+
+struct push_group {
+	struct work work;
+	bool flusher;
+	int nr;
+	struct push_item *items[PUSH_GROUP_MAX];
+};
+
+struct trace_work {
+	struct work work;
+	uint32_t vid;
+	uint32_t *trace;
+	uint32_t nr_trace;
+};
+
+struct prefetch_work {
+	struct work work;
+	uint32_t vid;
+	uint64_t idx;
 };
 
-static struct global_cache gcache;
+static struct global_cache gcache = {
+	.lru_lock = SD_MUTEX_INITIALIZER,
+	.a1in = LIST_HEAD_INIT(gcache.a1in),
+	.am = LIST_HEAD_INIT(gcache.am),
+	.a1out = LIST_HEAD_INIT(gcache.a1out),
+};
 static char object_cache_dir[PATH_MAX];
 static int def_open_flags = O_RDWR;
+static bool partial_pull; /* If the cache directory supports the xattr */
+static int flush_efd; /* Signaled when a round of the flusher is pushed */
+
+static int meta_fd = -1;
+static struct sd_mutex meta_lock = SD_MUTEX_INITIALIZER; /* For the slots */
+static unsigned long *meta_slots;
+static uint32_t nr_meta_slots;
+static uint64_t meta_seq;
 
-#define HASH_BITS	5
+#define HASH_BITS	8
 #define HASH_SIZE	(1 << HASH_BITS)
 
 static struct sd_rw_lock hashtable_lock[HASH_SIZE] = {
@@ -85,11 +270,10 @@ static struct sd_rw_lock hashtable_lock[HASH_SIZE] = {
 
 static struct hlist_head cache_hashtable[HASH_SIZE];
 
-static int object_cache_push(struct object_cache *oc);
-
 static inline bool entry_is_dirty(const struct object_cache_entry *entry)
 {
-	return !!entry->bmap;
+	return find_next_bit(entry->bmap, CACHE_MAX_BLOCKS, 0) <
+		CACHE_MAX_BLOCKS;
 }
 
 static inline int hash(uint64_t vid)
@@ -124,28 +308,60 @@ static inline bool idx_has_vdi_bit(uint64_t idx)
 	return !!(idx & CACHE_VDI_BIT);
 }
 
+static uint64_t idx_to_oid(uint32_t vid, uint64_t idx)
+{
+	if (idx_has_vdi_bit(idx))
+		return vid_to_vdi_oid(vid);
+	else
+		return vid_to_data_oid(vid, idx);
+}
+
 static inline size_t get_cache_block_size(uint64_t oid)
 {
-	size_t bsize = DIV_ROUND_UP(get_objsize(oid),
-				    sizeof(uint64_t) * BITS_PER_BYTE);
+	size_t bsize = DIV_ROUND_UP(get_vdi_objsize(oid), CACHE_MAX_BLOCKS);
 
 	return round_up(bsize, BLOCK_SIZE); /* To be FS friendly */
 }
 
-static uint64_t calc_object_bmap(uint64_t oid, size_t len, off_t offset)
+static inline int get_cache_nr_blocks(uint64_t oid)
+{
+	return DIV_ROUND_UP(get_vdi_objsize(oid), get_cache_block_size(oid));
+}
+
+/* The capacity of the cache the object takes, in KB */
+static inline uint32_t cache_object_kb(uint64_t oid)
+{
+	return DIV_ROUND_UP(get_vdi_objsize(oid), 1024);
+}
+
+static inline size_t valid_bitmap_size(uint64_t oid)
+{
+	return BITS_TO_LONGS(get_cache_nr_blocks(oid)) * sizeof(long);
+}
+
+static void set_blocks(unsigned long *bmap, int start, int end)
+{
+	for (int i = start; i < end; i++)
+		set_bit(i, bmap);
+}
+
+/* Mark the blocks which the range touches in bmap */
+static void calc_object_bmap(uint64_t oid, size_t len, off_t offset,
+			     unsigned long *bmap)
 {
-	int start, end, nr;
-	uint64_t bmap = 0;
 	size_t bsize = get_cache_block_size(oid);
 
-	start = offset / bsize;
-	end = DIV_ROUND_UP(len + offset, bsize);
-	nr = end - start;
+	set_blocks(bmap, offset / bsize, DIV_ROUND_UP(len + offset, bsize));
+}
 
-	while (nr--)
-		set_bit_64(start + nr, &bmap);
+/* The byte range of the blocks [start, end) */
+static void blocks_to_range(uint64_t oid, int start, int end, off_t *offset,
+			    size_t *len)
+{
+	size_t bsize = get_cache_block_size(oid);
 
-	return bmap;
+	*offset = start * bsize;
+	*len = min((end - start) * bsize, get_vdi_objsize(oid) - (size_t)*offset);
 }
 
 static inline void get_cache_entry(struct object_cache_entry *entry)
@@ -219,33 +435,210 @@ static struct object_cache_entry *lru_tree_search(struct rb_root *root,
 	return rb_search(root, &key, node, object_cache_cmp);
 }
 
-static void do_background_push(struct work *work)
+/* The sizes of a1in and a1out suggested by the 2Q paper, in objects */
+static inline uint32_t a1in_size(void)
+{
+	return sys->object_cache_size / CACHE_OBJECT_SIZE / 4;
+}
+
+static inline uint32_t a1out_size(void)
+{
+	return sys->object_cache_size / CACHE_OBJECT_SIZE / 2;
+}
+
+static inline int ghost_hash(uint32_t vid, uint64_t idx)
+{
+	return hash_64(idx ^ ((uint64_t)vid << 32), GHOST_HASH_BITS);
+}
+
+/* Must be called with the lru lock held */
+static void del_ghost(struct cache_ghost *ghost)
+{
+	hlist_del(&ghost->hash);
+	list_del(&ghost->list);
+	gcache.nr_a1out--;
+	free(ghost);
+}
+
+/* Must be called with the lru lock held */
+static void add_ghost(uint32_t vid, uint64_t idx)
+{
+	struct cache_ghost *ghost = xmalloc(sizeof(*ghost));
+
+	ghost->vid = vid;
+	ghost->idx = idx;
+	hlist_add_head(&ghost->hash, &gcache.ghost_hash[ghost_hash(vid, idx)]);
+	list_add_tail(&ghost->list, &gcache.a1out);
+	if (++gcache.nr_a1out > a1out_size())
+		del_ghost(list_first_entry(&gcache.a1out, struct cache_ghost,
+					   list));
+}
+
+/* Must be called with the lru lock held */
+static struct cache_ghost *find_ghost(uint32_t vid, uint64_t idx)
+{
+	struct hlist_head *head = &gcache.ghost_hash[ghost_hash(vid, idx)];
+	struct cache_ghost *ghost;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(ghost, node, head, hash) {
+		if (ghost->vid == vid && ghost->idx == idx)
+			return ghost;
+	}
+	return NULL;
+}
+
+/* Must be called with the lru lock held */
+static void __add_to_cache_queue(struct object_cache_entry *entry,
+				 enum cache_queue queue)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	struct object_cache *oc = pw->oc;
+	entry->queue = queue;
+	if (queue == CACHE_AM) {
+		list_add_tail(&entry->lru_list, &gcache.am);
+		gcache.nr_am++;
+	} else {
+		list_add_tail(&entry->lru_list, &gcache.a1in);
+		gcache.nr_a1in++;
+	}
+}
 
-	if (sd_mutex_trylock(&oc->push_mutex) == EBUSY)
+static void add_to_cache_queue(struct object_cache_entry *entry)
+{
+	struct cache_ghost *ghost;
+
+	sd_mutex_lock(&gcache.lru_lock);
+	ghost = find_ghost(entry->oc->vid, entry_idx(entry));
+	if (ghost) {
+		del_ghost(ghost);
+		uatomic_inc(&gcache.ghost_hits);
+		__add_to_cache_queue(entry, CACHE_AM);
+	} else {
+		__add_to_cache_queue(entry, CACHE_A1IN);
+	}
+	sd_mutex_unlock(&gcache.lru_lock);
+}
+
+/* Must be called with the lru lock held */
+static void __del_from_cache_queue(struct object_cache_entry *entry)
+{
+	switch (entry->queue) {
+	case CACHE_A1IN:
+		gcache.nr_a1in--;
+		break;
+	case CACHE_AM:
+		gcache.nr_am--;
+		break;
+	case CACHE_NONE:
 		return;
+	}
+	list_del(&entry->lru_list);
+	entry->queue = CACHE_NONE;
+}
 
-	object_cache_push(oc);
-	sd_mutex_unlock(&oc->push_mutex);
+static void del_from_cache_queue(struct object_cache_entry *entry)
+{
+	sd_mutex_lock(&gcache.lru_lock);
+	__del_from_cache_queue(entry);
+	sd_mutex_unlock(&gcache.lru_lock);
 }
 
-static void background_push_done(struct work *work)
+/* Only a reference in am makes the entry recently used */
+static void touch_cache_entry(struct object_cache_entry *entry)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	free(pw);
+	if (uatomic_read(&entry->queue) == CACHE_AM &&
+	    !uatomic_is_true(&entry->referenced))
+		uatomic_set_true(&entry->referenced);
+}
+
+static uint32_t alloc_meta_slot(void)
+{
+	uint32_t slot;
+
+	sd_mutex_lock(&meta_lock);
+	slot = find_next_zero_bit(meta_slots, nr_meta_slots, 1);
+	if (slot >= nr_meta_slots) {
+		uint32_t nr = max(nr_meta_slots * 2, 1024U);
+
+		slot = max(nr_meta_slots, 1U);
+		meta_slots = alloc_bitmap(meta_slots, nr_meta_slots, nr);
+		nr_meta_slots = nr;
+	}
+	set_bit(slot, meta_slots);
+	sd_mutex_unlock(&meta_lock);
+
+	return slot;
 }
 
-static void kick_background_pusher(struct object_cache *oc)
+static uint64_t meta_checksum(const struct cache_meta *meta)
 {
-	struct push_work *pw;
+	size_t off = offsetof(struct cache_meta, idx);
 
-	pw = xzalloc(sizeof(struct push_work));
-	pw->oc = oc;
-	pw->work.fn = do_background_push;
-	pw->work.done = background_push_done;
-	queue_work(sys->oc_push_wqueue, &pw->work);
+	/* 0 is reserved for the free slots */
+	return sd_hash((const char *)meta + off, sizeof(*meta) - off) ?: 1;
+}
+
+static void write_meta_slot(uint32_t slot, const void *buf)
+{
+	if (xpwrite(meta_fd, buf, CACHE_META_SLOT_SIZE,
+		    (off_t)slot * CACHE_META_SLOT_SIZE) != CACHE_META_SLOT_SIZE)
+		sd_err("failed to write the cache metadata slot %"PRIu32", %m",
+		       slot);
+}
+
+/*
+ * Journal the state of the entry in its slot
+ *
+ * Must be called with the entry write locked, or read locked by the pusher,
+ * or the cache write locked before the entry is accessed
+ */
+static void update_cache_meta(struct object_cache_entry *entry)
+{
+	char buf[CACHE_META_SLOT_SIZE] = {};
+	struct cache_meta *meta = (struct cache_meta *)buf;
+	uint32_t vid = entry->oc->vid;
+
+	BUILD_BUG_ON(sizeof(*meta) > CACHE_META_SLOT_SIZE);
+	if (meta_fd < 0)
+		return;
+	if (!entry->slot)
+		entry->slot = alloc_meta_slot();
+
+	meta->idx = entry->idx;
+	meta->seq = uatomic_add_return(&meta_seq, 1);
+	meta->vid = vid;
+	meta->queue = entry->queue;
+	meta->shift = get_vdi_block_size_shift(vid);
+	memcpy(meta->dirty, entry->bmap, sizeof(meta->dirty));
+	if (entry->valid) {
+		meta->partial = 1;
+		memcpy(meta->valid, entry->valid,
+		       valid_bitmap_size(idx_to_oid(vid, entry_idx(entry))));
+	}
+	meta->checksum = meta_checksum(meta);
+	write_meta_slot(entry->slot, buf);
+}
+
+static void clear_cache_meta(struct object_cache_entry *entry)
+{
+	char buf[CACHE_META_SLOT_SIZE] = {};
+
+	if (meta_fd < 0 || !entry->slot)
+		return;
+
+	write_meta_slot(entry->slot, buf);
+	sd_mutex_lock(&meta_lock);
+	clear_bit(entry->slot, meta_slots);
+	sd_mutex_unlock(&meta_lock);
+	entry->slot = 0;
+}
+
+static void kick_flusher(void);
+
+/* The dirty objects which the flusher pushes regardless of their age */
+static inline uint32_t dirty_limit(void)
+{
+	return (uint64_t)sys->object_cache_size / CACHE_OBJECT_SIZE *
+		sys->object_cache_dirty_ratio / 100;
 }
 
 static void del_from_dirty_list(struct object_cache_entry *entry)
@@ -254,17 +647,19 @@ static void del_from_dirty_list(struct object_cache_entry *entry)
 
 	list_del(&entry->dirty_list);
 	uatomic_dec(&oc->dirty_count);
+	uatomic_dec(&gcache.nr_dirty);
 }
 
+/* The dirty list is in the order of the time the entries became dirty */
 static void add_to_dirty_list(struct object_cache_entry *entry)
 {
 	struct object_cache *oc = entry->oc;
 
+	entry->dirty_time = clock_get_time();
 	list_add_tail(&entry->dirty_list, &oc->dirty_head);
-	/* FIXME read sys->status atomically */
-	if (uatomic_add_return(&oc->dirty_count, 1) > MAX_DIRTY_OBJECT_COUNT
-	    && sys->cinfo.status == SD_STATUS_OK)
-		kick_background_pusher(oc);
+	uatomic_inc(&oc->dirty_count);
+	if (uatomic_add_return(&gcache.nr_dirty, 1) > dirty_limit())
+		kick_flusher();
 }
 
 static inline void free_cache_entry(struct object_cache_entry *entry)
@@ -272,22 +667,16 @@ static inline void free_cache_entry(struct object_cache_entry *entry)
 	struct object_cache *oc = entry->oc;
 
 	rb_erase(&entry->node, &oc->lru_tree);
-	list_del(&entry->lru_list);
+	del_from_cache_queue(entry);
 	oc->total_count--;
 	if (list_linked(&entry->dirty_list))
 		del_from_dirty_list(entry);
+	clear_cache_meta(entry);
 	sd_destroy_rw_lock(&entry->lock);
+	free(entry->valid);
 	free(entry);
 }
 
-static uint64_t idx_to_oid(uint32_t vid, uint64_t idx)
-{
-	if (idx_has_vdi_bit(idx))
-		return vid_to_vdi_oid(vid);
-	else
-		return vid_to_data_oid(vid, idx);
-}
-
 static int remove_cache_object(struct object_cache *oc, uint64_t idx)
 {
 	int ret = SD_RES_SUCCESS;
@@ -317,10 +706,8 @@ static int read_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
 	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%016"PRIx64, object_cache_dir,
 		 vid, idx);
 
-	if (sys->object_cache_directio && !idx_has_vdi_bit(idx)) {
-		sd_assert(is_aligned_to_pagesize(buf));
+	if (sys->object_cache_directio && !idx_has_vdi_bit(idx))
 		flags |= O_DIRECT;
-	}
 
 	fd = open(p, flags, sd_def_fmode);
 	if (unlikely(fd < 0)) {
@@ -329,7 +716,11 @@ static int read_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
 		goto out;
 	}
 
-	size = xpread(fd, buf, count, offset);
+	/* dio_pread() bounces the unaligned edges */
+	if (flags & O_DIRECT)
+		size = dio_pread(fd, buf, count, offset);
+	else
+		size = xpread(fd, buf, count, offset);
 
 	if (unlikely(size != count)) {
 		sd_err("size %zu, count:%zu, offset %jd %m", size, count,
@@ -353,10 +744,8 @@ static int write_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
 
 	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%016"PRIx64, object_cache_dir,
 		 vid, idx);
-	if (sys->object_cache_directio && !idx_has_vdi_bit(idx)) {
-		sd_assert(is_aligned_to_pagesize(buf));
+	if (sys->object_cache_directio && !idx_has_vdi_bit(idx))
 		flags |= O_DIRECT;
-	}
 
 	fd = open(p, flags, sd_def_fmode);
 	if (unlikely(fd < 0)) {
@@ -365,7 +754,11 @@ static int write_cache_object_noupdate(uint32_t vid, uint64_t idx, void *buf,
 		goto out;
 	}
 
-	size = xpwrite(fd, buf, count, offset);
+	if (flags & O_DIRECT)
+		size = dio_pwrite(idx_to_oid(vid, idx), fd, buf, count,
+				  offset);
+	else
+		size = xpwrite(fd, buf, count, offset);
 
 	if (unlikely(size != count)) {
 		sd_err("size %zu, count:%zu, offset %jd %m", size, count,
@@ -380,21 +773,126 @@ out:
 	return ret;
 }
 
+/* An empty path, which no syscall finds, if the cache path is too long */
+static void get_cache_path(uint32_t vid, uint64_t idx, char *path)
+{
+	if (unlikely(snprintf(path, PATH_MAX, "%s/%06"PRIx32"/%016"PRIx64,
+			      object_cache_dir, vid, idx) >= PATH_MAX))
+		path[0] = '\0';
+}
+
+/* Return the valid bitmap in the xattr of path, or NULL if it is complete */
+static unsigned long *load_valid_bitmap(const char *path, uint64_t oid)
+{
+	size_t size = valid_bitmap_size(oid);
+	unsigned long *valid = xzalloc(size);
+
+	if (getxattr(path, CACHE_VALID_XATTR, valid, size) < 0) {
+		if (errno != ENODATA && errno != ENOTSUP)
+			sd_err("failed to get the valid blocks of %s, %m",
+			       path);
+		free(valid);
+		return NULL;
+	}
+	return valid;
+}
+
+/* Must be called with the entry write locked */
+static void save_valid_bitmap(struct object_cache_entry *entry)
+{
+	uint32_t vid = entry->oc->vid;
+	uint64_t idx = entry_idx(entry), oid = idx_to_oid(vid, idx);
+	int nr = get_cache_nr_blocks(oid);
+	char path[PATH_MAX];
+
+	get_cache_path(vid, idx, path);
+	if (find_next_zero_bit(entry->valid, nr, 0) < nr) {
+		if (setxattr(path, CACHE_VALID_XATTR, entry->valid,
+			     valid_bitmap_size(oid), 0) < 0)
+			sd_err("failed to save the valid blocks of %s, %m",
+			       path);
+		update_cache_meta(entry);
+		return;
+	}
+
+	/* All the blocks are fetched */
+	if (removexattr(path, CACHE_VALID_XATTR) < 0 && errno != ENODATA) {
+		sd_err("failed to remove the valid blocks of %s, %m", path);
+		return;
+	}
+	free(entry->valid);
+	uatomic_set(&entry->valid, NULL);
+	update_cache_meta(entry);
+}
+
+/*
+ * Fetch the blocks [start, end) of the object which aren't in the cache yet
+ *
+ * Must be called with the entry write locked
+ */
+static int fill_cache_blocks(struct object_cache_entry *entry, int start,
+			     int end)
+{
+	uint32_t vid = entry->oc->vid;
+	uint64_t idx = entry_idx(entry), oid = idx_to_oid(vid, idx);
+	bool filled = false;
+	int s, e, ret = SD_RES_SUCCESS;
+
+	if (!entry->valid)
+		return SD_RES_SUCCESS;
+
+	for (s = find_next_zero_bit(entry->valid, end, start); s < end;
+	     s = find_next_zero_bit(entry->valid, end, e)) {
+		size_t len;
+		off_t offset;
+		void *buf;
+
+		e = find_next_bit(entry->valid, end, s);
+		blocks_to_range(oid, s, e, &offset, &len);
+		buf = xvalloc(len);
+		ret = read_backend_object(oid, buf, len, offset);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("failed to fetch %"PRIx64", %s", oid,
+			       sd_strerror(ret));
+		else
+			ret = write_cache_object_noupdate(vid, idx, buf, len,
+							  offset);
+		free(buf);
+		if (ret != SD_RES_SUCCESS)
+			break;
+
+		sd_debug("%"PRIx64" blocks %d - %d fetched", oid, s, e);
+		set_blocks(entry->valid, s, e);
+		filled = true;
+	}
+
+	if (filled)
+		save_valid_bitmap(entry);
+	return ret;
+}
+
 static int read_cache_object(struct object_cache_entry *entry, void *buf,
 			     size_t count, off_t offset)
 {
 	uint32_t vid = entry->oc->vid;
 	uint64_t idx = entry_idx(entry);
-	struct object_cache *oc = entry->oc;
+	size_t bsize = get_cache_block_size(idx_to_oid(vid, idx));
 	int ret;
 
+	/* The blocks are never dropped once they are fetched */
+	if (uatomic_read(&entry->valid)) {
+		write_lock_entry(entry);
+		ret = fill_cache_blocks(entry, offset / bsize,
+					DIV_ROUND_UP(offset + count, bsize));
+		unlock_entry(entry);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
 	ret = read_cache_object_noupdate(vid, idx, buf, count, offset);
 
-	if (ret == SD_RES_SUCCESS) {
-		write_lock_cache(oc);
-		list_move_tail(&entry->lru_list, &oc->lru_head);
-		unlock_cache(oc);
-	}
+	if (ret == SD_RES_SUCCESS)
+		touch_cache_entry(entry);
 	return ret;
 }
 
@@ -406,23 +904,43 @@ static int write_cache_object(struct object_cache_entry *entry, void *buf,
 	uint64_t idx = entry_idx(entry);
 	uint64_t oid = idx_to_oid(vid, idx);
 	struct object_cache *oc = entry->oc;
+	size_t bsize = get_cache_block_size(oid);
+	int start = offset / bsize, end = DIV_ROUND_UP(offset + count, bsize);
 	struct sd_req hdr;
-	int ret;
+	int ret = SD_RES_SUCCESS;
 
 	write_lock_entry(entry);
 
-	ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
+	/* The blocks which the write doesn't fully cover must be fetched */
+	if (offset % bsize)
+		ret = fill_cache_blocks(entry, start, start + 1);
+	if (ret == SD_RES_SUCCESS && (offset + count) % bsize &&
+	    offset + count < get_vdi_objsize(oid))
+		ret = fill_cache_blocks(entry, end - 1, end);
+	if (ret == SD_RES_SUCCESS)
+		ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
 	if (ret != SD_RES_SUCCESS) {
 		unlock_entry(entry);
 		return ret;
 	}
+	if (entry->valid &&
+	    find_next_zero_bit(entry->valid, end, start) < end) {
+		set_blocks(entry->valid, start, end);
+		save_valid_bitmap(entry);
+	}
+
 	write_lock_cache(oc);
 	if (writeback) {
-		entry->bmap |= calc_object_bmap(oid, count, offset);
+		/* Journal only the new dirty blocks */
+		bool fresh = find_next_zero_bit(entry->bmap, end, start) < end;
+
+		calc_object_bmap(oid, count, offset, entry->bmap);
 		if (!list_linked(&entry->dirty_list))
 			add_to_dirty_list(entry);
+		if (fresh)
+			update_cache_meta(entry);
 	}
-	list_move_tail(&entry->lru_list, &oc->lru_head);
+	touch_cache_entry(entry);
 	unlock_cache(oc);
 
 	unlock_entry(entry);
@@ -450,31 +968,16 @@ out:
 	return ret;
 }
 
-static int push_cache_object(uint32_t vid, uint64_t idx, uint64_t bmap,
-			     bool create)
+static int push_cache_range(uint32_t vid, uint64_t idx, off_t offset,
+			    size_t data_length, bool create)
 {
 	struct sd_req hdr;
-	void *buf;
-	off_t offset;
 	uint64_t oid = idx_to_oid(vid, idx);
-	size_t data_length, bsize = get_cache_block_size(oid);
-	int ret = SD_RES_NO_MEM;
-	int first_bit, last_bit;
-
-	if (!bmap) {
-		sd_debug("WARN: nothing to flush %"PRIx64, oid);
-		return SD_RES_SUCCESS;
-	}
-
-	first_bit = ffsll(bmap) - 1;
-	last_bit = fls64(bmap) - 1;
-
-	sd_debug("%"PRIx64" bmap(%zd):0x%"PRIx64", first_bit:%d, last_bit:%d",
-		 oid, bsize, bmap, first_bit, last_bit);
-	offset = first_bit * bsize;
-	data_length = min((last_bit - first_bit + 1) * bsize,
-			  get_objsize(oid) - (size_t)offset);
+	void *buf;
+	int ret;
 
+	sd_debug("%"PRIx64" offset %jd, length %zu", oid, (intmax_t)offset,
+		 data_length);
 	buf = xvalloc(data_length);
 	ret = read_cache_object_noupdate(vid, idx, buf, data_length, offset);
 	if (ret != SD_RES_SUCCESS)
@@ -498,53 +1001,175 @@ out:
 	return ret;
 }
 
+/*
+ * Push the dirty blocks in bmap.  The contiguous dirty blocks are pushed in
+ * one request, and so are two runs separated by a few clean blocks which are
+ * in the cache, to save the requests.  Only the first request creates the
+ * object.
+ *
+ * @valid: the blocks in the cache, or NULL if all of them
+ */
+static int push_cache_object(uint32_t vid, uint64_t idx,
+			     const unsigned long *bmap,
+			     const unsigned long *valid, bool create)
+{
+	uint64_t oid = idx_to_oid(vid, idx);
+	int nr = get_cache_nr_blocks(oid), start, end, next;
+	int ret = SD_RES_SUCCESS;
+
+	start = find_next_bit(bmap, nr, 0);
+	if (start >= nr) {
+		sd_debug("WARN: nothing to flush %"PRIx64, oid);
+		return SD_RES_SUCCESS;
+	}
+
+	while (start < nr) {
+		size_t data_length;
+		off_t offset;
+
+		end = find_next_zero_bit(bmap, nr, start);
+		next = find_next_bit(bmap, nr, end);
+		while (next < nr && next - end <= CACHE_PUSH_MERGE_GAP &&
+		       (!valid || find_next_zero_bit(valid, next, end) >= next)) {
+			end = find_next_zero_bit(bmap, nr, next);
+			next = find_next_bit(bmap, nr, end);
+		}
+
+		blocks_to_range(oid, start, end, &offset, &data_length);
+		ret = push_cache_range(vid, idx, offset, data_length, create);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		create = false;
+		start = next;
+	}
+	return ret;
+}
+
 /*
  * The reclaim algorithm is similar to Linux kernel's page cache:
  *  - only tries to reclaim 'clean' object, which doesn't has any dirty updates,
- *    in a LRU list.
+ *    from a1in if it is larger than its size, otherwise from am.
  *  - skip the object when it is in R/W operation.
  *  - skip the dirty object if it is not in push(writeback) phase.
- *  - wait on the dirty object if it is in push phase.
+ *  - the skipped objects are rotated to the end of their queue, so the next
+ *    scan doesn't start with them.
  */
 
 /*
  * 90% is targeted for a large cache quota such as 200G, then we have 20G
  * buffer which is large enough to prevent cache overrun.
  */
-#define HIGH_WATERMARK (sys->object_cache_size * 9 / 10)
-static void do_reclaim_object(struct object_cache *oc)
+#define HIGH_WATERMARK ((uint64_t)sys->object_cache_size * 1024 * 9 / 10)
+
+static bool entry_is_reclaimable(struct object_cache_entry *entry)
+{
+	uint64_t oid = idx_to_oid(entry->oc->vid, entry_idx(entry));
+
+	if (entry_in_use(entry)) {
+		sd_debug("%"PRIx64" is in use, skip...", oid);
+		return false;
+	}
+
+	/*
+	 * The shared snapshot objects won't be released after being
+	 * pulled and if sheep restarts, the remaining snapshot objects
+	 * will be marked as dirty. So for these kind of objects, we
+	 * can reclaim them safely.
+	 */
+	if (entry_is_dirty(entry) && !oid_is_readonly(oid)) {
+		sd_debug("%"PRIx64" is dirty, skip...", oid);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Take the victim out of the queue and return it with its cache write locked.
+ * The cache lock is only tried because it is taken before the lru lock.
+ *
+ * Must be called with the lru lock held
+ */
+static struct object_cache_entry *find_victim(struct list_head *queue,
+					      uint32_t nr)
 {
 	struct object_cache_entry *entry;
-	uint64_t oid;
-	uint32_t cap;
 
-	write_lock_cache(oc);
-	list_for_each_entry(entry, &oc->lru_head, lru_list) {
-		oid = idx_to_oid(oc->vid, entry_idx(entry));
-		if (entry_in_use(entry)) {
-			sd_debug("%"PRIx64" is in use, skip...", oid);
-			continue;
-		}
+	/* The second round of am finds the entries which weren't hit again */
+	if (queue == &gcache.am)
+		nr *= 2;
 
-		/*
-		 * The shared snapshot objects won't be released after being
-		 * pulled and if sheep restarts, the remaining snapshot objects
-		 * will be marked as dirty. So for these kind of objects, we
-		 * can reclaim them safely.
-		 */
-		if (entry_is_dirty(entry) && !oid_is_readonly(oid)) {
-			sd_debug("%"PRIx64" is dirty, skip...", oid);
+	for (uint32_t i = 0; i < nr && !list_empty(queue); i++) {
+		entry = list_first_entry(queue, struct object_cache_entry,
+					 lru_list);
+		list_move_tail(&entry->lru_list, queue);
+
+		if (uatomic_is_true(&entry->referenced)) {
+			uatomic_set_false(&entry->referenced);
 			continue;
 		}
-		if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS)
+		if (!entry_is_reclaimable(entry))
 			continue;
-		free_cache_entry(entry);
-		cap = uatomic_sub_return(&gcache.capacity, CACHE_OBJECT_SIZE);
-		sd_debug("%"PRIx64" reclaimed. capacity:%"PRId32, oid, cap);
-		if (cap <= HIGH_WATERMARK)
-			break;
+		if (sd_write_trylock(&entry->oc->lock))
+			continue;
+		/* the references and dirty bits are stable from now on */
+		if (!entry_is_reclaimable(entry)) {
+			unlock_cache(entry->oc);
+			continue;
+		}
+
+		if (entry->queue == CACHE_A1IN)
+			add_ghost(entry->oc->vid, entry_idx(entry));
+		__del_from_cache_queue(entry);
+		return entry;
 	}
+	return NULL;
+}
+
+static struct object_cache_entry *get_victim(void)
+{
+	struct object_cache_entry *entry;
+
+	sd_mutex_lock(&gcache.lru_lock);
+	if (gcache.nr_a1in > a1in_size()) {
+		entry = find_victim(&gcache.a1in, gcache.nr_a1in);
+		if (!entry)
+			entry = find_victim(&gcache.am, gcache.nr_am);
+	} else {
+		entry = find_victim(&gcache.am, gcache.nr_am);
+		if (!entry)
+			entry = find_victim(&gcache.a1in, gcache.nr_a1in);
+	}
+	sd_mutex_unlock(&gcache.lru_lock);
+
+	return entry;
+}
+
+static bool do_reclaim_object(void)
+{
+	struct object_cache_entry *entry = get_victim();
+	struct object_cache *oc;
+	uint64_t oid;
+	uint64_t cap;
+
+	if (!entry)
+		return false;
+
+	oc = entry->oc;
+	oid = idx_to_oid(oc->vid, entry_idx(entry));
+	if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS) {
+		/* Keep it and try again in the next round */
+		sd_mutex_lock(&gcache.lru_lock);
+		__add_to_cache_queue(entry, CACHE_AM);
+		sd_mutex_unlock(&gcache.lru_lock);
+		unlock_cache(oc);
+		return false;
+	}
+	free_cache_entry(entry);
 	unlock_cache(oc);
+
+	cap = uatomic_sub_return(&gcache.capacity, cache_object_kb(oid));
+	sd_debug("%"PRIx64" reclaimed. capacity:%"PRIu64, oid, cap);
+	return true;
 }
 
 struct reclaim_work {
@@ -555,33 +1180,18 @@ struct reclaim_work {
 static void do_reclaim(struct work *work)
 {
 	struct reclaim_work *rw = container_of(work, struct reclaim_work, work);
-	struct object_cache *cache;
-	struct hlist_node *node;
-	int i, j;
+	uint64_t cap;
 
 	if (rw->delay)
 		sleep(rw->delay);
-	/* We choose a random victim to avoid reclaim the same one every time */
-	j = random();
-	for (i = 0; i < HASH_SIZE; i++) {
-		int idx = (i + j) % HASH_SIZE;
-		struct hlist_head *head = cache_hashtable + idx;
 
-		sd_read_lock(&hashtable_lock[idx]);
-		hlist_for_each_entry(cache, node, head, hash) {
-			uint32_t cap;
-
-			do_reclaim_object(cache);
-			cap = uatomic_read(&gcache.capacity);
-			if (cap <= HIGH_WATERMARK) {
-				sd_rw_unlock(&hashtable_lock[idx]);
-				sd_debug("complete, capacity %"PRIu32, cap);
-				return;
-			}
+	while ((cap = uatomic_read(&gcache.capacity)) > HIGH_WATERMARK) {
+		if (!do_reclaim_object()) {
+			sd_debug("nothing to reclaim, capacity %"PRIu64, cap);
+			return;
 		}
-		sd_rw_unlock(&hashtable_lock[idx]);
 	}
-	sd_debug("finished");
+	sd_debug("complete, capacity %"PRIu64, cap);
 }
 
 static void reclaim_done(struct work *work)
@@ -604,44 +1214,50 @@ static int create_dir_for(uint32_t vid)
 	return ret;
 }
 
-static struct object_cache *find_object_cache(uint32_t vid, bool create)
+/* Must be called with the hashtable lock of the bucket held */
+static struct object_cache *__find_object_cache(uint32_t vid,
+						struct hlist_head *head)
 {
-	int h = hash(vid);
-	struct hlist_head *head = cache_hashtable + h;
-	struct object_cache *cache = NULL;
+	struct object_cache *cache;
 	struct hlist_node *node;
 
-	if (create)
-		sd_write_lock(&hashtable_lock[h]);
-	else
-		sd_read_lock(&hashtable_lock[h]);
-
-	if (hlist_empty(head))
-		goto not_found;
-
 	hlist_for_each_entry(cache, node, head, hash) {
 		if (cache->vid == vid)
-			goto out;
+			return cache;
 	}
-not_found:
-	if (create) {
+	return NULL;
+}
+
+static struct object_cache *find_object_cache(uint32_t vid, bool create)
+{
+	int h = hash(vid);
+	struct hlist_head *head = cache_hashtable + h;
+	struct object_cache *cache;
+
+	/* The cache exists for all but the first request of the VDI */
+	sd_read_lock(&hashtable_lock[h]);
+	cache = __find_object_cache(vid, head);
+	sd_rw_unlock(&hashtable_lock[h]);
+	if (cache || !create)
+		return cache;
+
+	sd_write_lock(&hashtable_lock[h]);
+	cache = __find_object_cache(vid, head);
+	if (!cache) {
 		cache = xzalloc(sizeof(*cache));
 		cache->vid = vid;
 		INIT_RB_ROOT(&cache->lru_tree);
 		create_dir_for(vid);
-		cache->push_efd = eventfd(0, 0);
-
 		INIT_LIST_HEAD(&cache->dirty_head);
-		INIT_LIST_HEAD(&cache->lru_head);
+		INIT_LIST_HEAD(&cache->push_list);
 
 		sd_init_rw_lock(&cache->lock);
 		hlist_add_head(&cache->hash, head);
 
-		sd_init_mutex(&cache->push_mutex);
-	} else {
-		cache = NULL;
+		sd_init_mutex(&cache->push_lock);
+		sd_cond_init(&cache->push_cond);
+		sd_init_mutex(&cache->trace_lock);
 	}
-out:
 	sd_rw_unlock(&hashtable_lock[h]);
 	return cache;
 }
@@ -678,28 +1294,51 @@ alloc_cache_entry(struct object_cache *oc, uint64_t idx)
 	sd_init_rw_lock(&entry->lock);
 	INIT_LIST_NODE(&entry->dirty_list);
 	INIT_LIST_NODE(&entry->lru_list);
+	entry->queue = CACHE_NONE;
 
 	return entry;
 }
 
-static void add_to_lru_cache(struct object_cache *oc, uint64_t idx, bool create)
+/*
+ * @valid: the fetched blocks of a partially cached object, which is passed over
+ * to the entry, or NULL if the object is cached in full
+ *
+ * Must be called with the cache write locked, which keeps the file and the
+ * entry of the object in step
+ */
+static void __add_to_lru_cache(struct object_cache *oc, uint64_t idx,
+			       bool create, unsigned long *valid)
 {
 	struct object_cache_entry *entry = alloc_cache_entry(oc, idx);
+	uint64_t oid = idx_to_oid(oc->vid, idx);
 
-	sd_debug("oid %"PRIx64" added", idx_to_oid(oc->vid, idx));
+	sd_debug("oid %"PRIx64" added", oid);
+	entry->valid = valid;
 
-	write_lock_cache(oc);
 	if (unlikely(lru_tree_insert(&oc->lru_tree, entry)))
 		panic("the object already exist");
-	uatomic_add(&gcache.capacity, CACHE_OBJECT_SIZE);
-	list_add_tail(&entry->lru_list, &oc->lru_head);
+	uatomic_add(&gcache.capacity, cache_object_kb(oid));
+	add_to_cache_queue(entry);
 	oc->total_count++;
 	if (create) {
 		/* Cache lock assure it is not raced with pusher */
-		entry->bmap = UINT64_MAX;
-		entry->idx |= CACHE_CREATE_BIT;
+		if (valid) {
+			/* Only the fetched blocks can be dirty */
+			memcpy(entry->bmap, valid, valid_bitmap_size(oid));
+		} else {
+			set_blocks(entry->bmap, 0, get_cache_nr_blocks(oid));
+			entry->idx |= CACHE_CREATE_BIT;
+		}
 		add_to_dirty_list(entry);
 	}
+	update_cache_meta(entry);
+}
+
+static void add_to_lru_cache(struct object_cache *oc, uint64_t idx, bool create,
+			     unsigned long *valid)
+{
+	write_lock_cache(oc);
+	__add_to_lru_cache(oc, idx, create, valid);
 	unlock_cache(oc);
 }
 
@@ -726,32 +1365,49 @@ static int object_cache_lookup(struct object_cache *oc, uint64_t idx,
 
 	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%016"PRIx64,
 		 object_cache_dir, oc->vid, idx);
-	if (!create)
-		return lookup_path(path);
+	if (!create) {
+		bool cached;
+
+		/* The entry is only added after its file is created */
+		read_lock_cache(oc);
+		cached = !!lru_tree_search(&oc->lru_tree, idx);
+		unlock_cache(oc);
+		return cached ? SD_RES_SUCCESS : lookup_path(path);
+	}
 
 	flags |= O_CREAT | O_TRUNC;
+	write_lock_cache(oc);
 	fd = open(path, flags, sd_def_fmode);
 	if (unlikely(fd < 0)) {
 		sd_debug("%s, %m", path);
 		ret = SD_RES_EIO;
 		goto out;
 	}
-	ret = prealloc(fd, get_objsize(idx_to_oid(oc->vid, idx)));
+	ret = prealloc(fd, get_vdi_objsize(idx_to_oid(oc->vid, idx)));
 	if (unlikely(ret < 0)) {
 		ret = SD_RES_EIO;
 		goto out_close;
 	}
-	add_to_lru_cache(oc, idx, writeback);
-	object_cache_try_to_reclaim(0);
+	__add_to_lru_cache(oc, idx, writeback, NULL);
 out_close:
 	close(fd);
 out:
+	unlock_cache(oc);
+	if (ret == SD_RES_SUCCESS)
+		object_cache_try_to_reclaim(0);
 	return ret;
 }
 
+/*
+ * Create the cache object with buf_size bytes at offset and add it to the
+ * cache, which is a partial object if valid isn't NULL.  valid is passed over
+ * to the entry on success.
+ */
 static int create_cache_object(struct object_cache *oc, uint64_t idx,
-			       void *buffer, size_t buf_size)
+			       void *buffer, size_t buf_size, off_t offset,
+			       unsigned long *valid)
 {
+	uint64_t oid = idx_to_oid(oc->vid, idx);
 	int flags = def_open_flags | O_CREAT | O_EXCL, fd;
 	int ret = SD_RES_OID_EXIST;
 	char path[PATH_MAX], tmp_path[PATH_MAX];
@@ -769,7 +1425,15 @@ static int create_cache_object(struct object_cache *oc, uint64_t idx,
 		goto out;
 	}
 
-	ret = xwrite(fd, buffer, buf_size);
+	if (valid && (ftruncate(fd, get_vdi_objsize(oid)) < 0 ||
+		      fsetxattr(fd, CACHE_VALID_XATTR, valid,
+				valid_bitmap_size(oid), 0) < 0)) {
+		ret = SD_RES_EIO;
+		sd_err("failed to create partial object %s, %m", tmp_path);
+		goto out_close;
+	}
+
+	ret = xpwrite(fd, buffer, buf_size, offset);
 	if (unlikely(ret != buf_size)) {
 		ret = SD_RES_EIO;
 		sd_err("failed, vid %"PRIx32", idx %"PRIx64, oc->vid, idx);
@@ -778,17 +1442,28 @@ static int create_cache_object(struct object_cache *oc, uint64_t idx,
 	/* This is intended to take care of partial write due to crash */
 	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%016"PRIx64,
 		 object_cache_dir, oc->vid, idx);
+	write_lock_cache(oc);
+	if (lru_tree_search(&oc->lru_tree, idx)) {
+		unlock_cache(oc);
+		ret = SD_RES_OID_EXIST;
+		goto out_close;
+	}
 	ret = link(tmp_path, path);
+	if (unlikely(ret < 0) && errno == EEXIST) {
+		/* Left by a crash before its slot was written */
+		sd_info("replace the stale cache object %s", path);
+		if (unlink(path) == 0)
+			ret = link(tmp_path, path);
+	}
 	if (unlikely(ret < 0)) {
-		if (errno == EEXIST) {
-			ret = SD_RES_OID_EXIST;
-			goto out_close;
-		}
+		unlock_cache(oc);
 		sd_debug("failed to link %s to %s: %m", tmp_path, path);
 		/* FIXME: teach object cache handle EIO gracefully */
 		ret = SD_RES_EIO;
 		goto out_close;
 	}
+	__add_to_lru_cache(oc, idx, false, valid);
+	unlock_cache(oc);
 	ret = SD_RES_SUCCESS;
 	sd_debug("%016"PRIx64" size %zu", idx, buf_size);
 out_close:
@@ -798,53 +1473,278 @@ out:
 	return ret;
 }
 
-/* Fetch the object, cache it in the clean state */
-static int object_cache_pull(struct object_cache *oc, uint64_t idx)
+/*
+ * Fetch the blocks of the object which the request touches, cache it in the
+ * clean state.  The whole object is fetched if the cache directory can't
+ * remember the fetched blocks.
+ */
+static int object_cache_pull(struct object_cache *oc, uint64_t idx,
+			     uint64_t req_offset, uint32_t req_len)
+{
+	int ret;
+	uint64_t oid = idx_to_oid(oc->vid, idx);
+	size_t bsize = get_cache_block_size(oid), data_length;
+	int nr = get_cache_nr_blocks(oid), start = 0, end = nr;
+	unsigned long *valid = NULL;
+	off_t offset;
+	void *buf;
+
+	if (partial_pull && req_len) {
+		start = req_offset / bsize;
+		end = min(nr, (int)DIV_ROUND_UP(req_offset + req_len, bsize));
+	}
+	if (end - start < nr) {
+		valid = xzalloc(valid_bitmap_size(oid));
+		set_blocks(valid, start, end);
+	}
+
+	blocks_to_range(oid, start, end, &offset, &data_length);
+	buf = xvalloc(data_length);
+	ret = read_backend_object(oid, buf, data_length, offset);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	sd_debug("oid %"PRIx64" blocks %d - %d pulled successfully", oid,
+		 start, end);
+	ret = create_cache_object(oc, idx, buf, data_length, offset, valid);
+	/*
+	 * We try to delay reclaim objects to avoid object ping-pong
+	 * because the pulled object is clean and likely to be reclaimed
+	 * in a cache over high watermark. We can't simply pass without
+	 * waking up reclaimer because the cache is easy to be filled
+	 * full with a read storm.
+	 */
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		valid = NULL;
+		object_cache_try_to_reclaim(1);
+		break;
+	case SD_RES_OID_EXIST:
+		ret = SD_RES_SUCCESS;
+		break;
+	default:
+		break;
+	}
+err:
+	free(valid);
+	free(buf);
+	return ret;
+}
+
+/* Fill the name and the key of the trace attribute of the vdi */
+static int get_trace_attr(uint32_t vid, struct sheepdog_vdi_attr *vattr,
+			  uint32_t *name_vid, uint64_t *ctime)
+{
+	struct sd_inode *inode;
+	int ret;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret == SD_RES_SUCCESS) {
+		/* the attributes are of the name, see cluster_get_vdi_attr() */
+		pstrcpy(vattr->name, sizeof(vattr->name), inode->name);
+		pstrcpy(vattr->key, sizeof(vattr->key), SD_BOOT_TRACE_ATTR_KEY);
+		*name_vid = sd_hash_vdi(inode->name);
+		*ctime = inode->create_time;
+	}
+	free(inode);
+	return ret;
+}
+
+static void do_save_trace(struct work *work)
+{
+	struct trace_work *tw = container_of(work, struct trace_work, work);
+	struct sheepdog_vdi_attr *vattr;
+	uint32_t name_vid, attrid;
+	uint64_t ctime;
+	int ret;
+
+	vattr = xzalloc(sizeof(*vattr));
+	ret = get_trace_attr(tw->vid, vattr, &name_vid, &ctime);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	vattr->value_len = sizeof(*tw->trace) * tw->nr_trace;
+	memcpy(vattr->value, tw->trace, vattr->value_len);
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, name_vid, &attrid, ctime,
+			   true, false, false);
+out:
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to save the trace of %"PRIx32", %s", tw->vid,
+		       sd_strerror(ret));
+	else
+		sd_debug("saved %"PRIu32" objects of %"PRIx32, tw->nr_trace,
+			 tw->vid);
+	free(vattr);
+}
+
+static void trace_done(struct work *work)
+{
+	struct trace_work *tw = container_of(work, struct trace_work, work);
+
+	free(tw->trace);
+	free(tw);
+}
+
+/* Record the first access of the data object in the trace window */
+static void trace_object(struct object_cache *oc, uint64_t idx)
+{
+	struct trace_work *tw;
+
+	if (idx_has_vdi_bit(idx) || !uatomic_is_true(&oc->tracing))
+		return;
+
+	sd_mutex_lock(&oc->trace_lock);
+	if (!oc->trace)
+		goto out;
+
+	if (time(NULL) - oc->trace_start < TRACE_WINDOW) {
+		for (int i = 0; i < oc->nr_trace; i++)
+			if (oc->trace[i] == idx)
+				goto out;
+		oc->trace[oc->nr_trace++] = idx;
+		if (oc->nr_trace < TRACE_MAX_OBJS)
+			goto out;
+	}
+
+	/* the window is closed, keep the last trace if nothing is accessed */
+	uatomic_set_false(&oc->tracing);
+	if (oc->nr_trace) {
+		tw = xzalloc(sizeof(*tw));
+		tw->vid = oc->vid;
+		tw->trace = oc->trace;
+		tw->nr_trace = oc->nr_trace;
+		tw->work.fn = do_save_trace;
+		tw->work.done = trace_done;
+		queue_work(sys->oc_trace_wqueue, &tw->work);
+	} else
+		free(oc->trace);
+	oc->trace = NULL;
+out:
+	sd_mutex_unlock(&oc->trace_lock);
+}
+
+static void do_prefetch_object(struct work *work)
+{
+	struct prefetch_work *pw = container_of(work, struct prefetch_work,
+						work);
+	struct object_cache *cache = find_object_cache(pw->vid, false);
+	int ret;
+
+	if (!cache)
+		return;
+
+	/* the objects accessed since take the room */
+	if (sys->object_cache_size &&
+	    uatomic_read(&gcache.capacity) >= HIGH_WATERMARK)
+		return;
+
+	if (object_cache_lookup(cache, pw->idx, false, false) !=
+	    SD_RES_NO_CACHE)
+		return;
+
+	ret = object_cache_pull(cache, pw->idx, 0, 0);
+	if (ret != SD_RES_SUCCESS)
+		sd_debug("failed to prefetch %"PRIx64", %s",
+			 idx_to_oid(pw->vid, pw->idx), sd_strerror(ret));
+}
+
+static void prefetch_object_done(struct work *work)
+{
+	struct prefetch_work *pw = container_of(work, struct prefetch_work,
+						work);
+
+	free(pw);
+}
+
+static void do_load_trace(struct work *work)
+{
+	struct trace_work *tw = container_of(work, struct trace_work, work);
+	struct sheepdog_vdi_attr *vattr;
+	struct prefetch_work *pw;
+	uint32_t name_vid, attrid, nr, idx;
+	uint64_t ctime;
+	int ret;
+
+	vattr = xzalloc(sizeof(*vattr));
+	ret = get_trace_attr(tw->vid, vattr, &name_vid, &ctime);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, name_vid, &attrid, ctime,
+			   false, false, false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	nr = min(vattr->value_len / (uint32_t)sizeof(*tw->trace),
+		 (uint32_t)TRACE_MAX_OBJS);
+	sd_debug("prefetch %"PRIu32" objects of %"PRIx32, nr, tw->vid);
+	for (int i = 0; i < nr; i++) {
+		memcpy(&idx, vattr->value + sizeof(idx) * i, sizeof(idx));
+		pw = xzalloc(sizeof(*pw));
+		pw->vid = tw->vid;
+		pw->idx = idx;
+		pw->work.fn = do_prefetch_object;
+		pw->work.done = prefetch_object_done;
+		queue_work(sys->oc_trace_wqueue, &pw->work);
+	}
+out:
+	if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
+		sd_err("failed to load the trace of %"PRIx32", %s", tw->vid,
+		       sd_strerror(ret));
+	free(vattr);
+}
+
+/* Prefetch the objects of the last trace and start a new one */
+static void start_trace(struct object_cache *oc)
+{
+	struct trace_work *tw;
+
+	if (!uatomic_set_true(&oc->traced))
+		return;
+
+	sd_mutex_lock(&oc->trace_lock);
+	oc->trace = xmalloc(sizeof(*oc->trace) * TRACE_MAX_OBJS);
+	oc->nr_trace = 0;
+	oc->trace_start = time(NULL);
+	sd_mutex_unlock(&oc->trace_lock);
+	uatomic_set_true(&oc->tracing);
+
+	tw = xzalloc(sizeof(*tw));
+	tw->vid = oc->vid;
+	tw->work.fn = do_load_trace;
+	tw->work.done = trace_done;
+	queue_work(sys->oc_trace_wqueue, &tw->work);
+}
+
+static int push_item_cmp(struct push_item *const *a, struct push_item *const *b)
+{
+	return intcmp((*a)->key, (*b)->key) ?:
+		object_cache_cmp((*a)->entry, (*b)->entry);
+}
+
+/* The nodes which the object is pushed to, as a hash of their set */
+static uint64_t push_key(const struct vnode_info *vinfo, uint64_t oid)
 {
-	struct sd_req hdr;
-	int ret;
-	uint64_t oid = idx_to_oid(oc->vid, idx);
-	uint32_t data_length = get_objsize(oid);
-	void *buf;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int nr_copies;
+	uint64_t key = 0;
 
-	buf = xvalloc(data_length);
-	sd_init_req(&hdr, SD_OP_READ_OBJ);
-	hdr.data_length = data_length;
-	hdr.obj.oid = oid;
-	hdr.obj.offset = 0;
-	ret = exec_local_req(&hdr, buf);
-	if (ret != SD_RES_SUCCESS)
-		goto err;
+	if (!vinfo)
+		return 0;
 
-	sd_debug("oid %"PRIx64" pulled successfully", oid);
-	ret = create_cache_object(oc, idx, buf, data_length);
-	/*
-	 * We try to delay reclaim objects to avoid object ping-pong
-	 * because the pulled object is clean and likely to be reclaimed
-	 * in a cache over high watermark. We can't simply pass without
-	 * waking up reclaimer because the cache is easy to be filled
-	 * full with a read storm.
-	 */
-	switch (ret) {
-	case SD_RES_SUCCESS:
-		add_to_lru_cache(oc, idx, false);
-		object_cache_try_to_reclaim(1);
-		break;
-	case SD_RES_OID_EXIST:
-		ret = SD_RES_SUCCESS;
-		break;
-	default:
-		break;
-	}
-err:
-	free(buf);
-	return ret;
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_nodes(vinfo, oid, nr_copies, nodes);
+	for (int i = 0; i < nr_copies; i++)
+		key ^= sd_hash(&nodes[i]->nid, sizeof(nodes[i]->nid));
+
+	return key;
 }
 
-static void do_push_object(struct work *work)
+static void push_entry(struct push_item *item, bool flusher)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	struct object_cache_entry *entry = pw->entry;
+	struct object_cache_entry *entry = item->entry;
 	struct object_cache *oc = entry->oc;
 	uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
 
@@ -857,28 +1757,134 @@ static void do_push_object(struct work *work)
 	 * 2. sheep crashed
 	 * 3. sheep restarted and marked all the objects in cache dirty blindly
 	 */
-	if (oid_is_readonly(idx_to_oid(oc->vid, entry_idx(entry))))
+	if (oid_is_readonly(oid))
 		goto clean;
 
 	if (unlikely(push_cache_object(oc->vid, entry_idx(entry), entry->bmap,
+				       entry->valid,
 				       !!(entry->idx & CACHE_CREATE_BIT))
 		     != SD_RES_SUCCESS))
 		panic("push failed but should never fail");
 clean:
-	if (uatomic_sub_return(&oc->push_count, 1) == 0)
-		eventfd_xwrite(oc->push_efd, 1);
 	entry->idx &= ~CACHE_CREATE_BIT;
-	entry->bmap = 0;
+	memset(entry->bmap, 0, sizeof(entry->bmap));
+	update_cache_meta(entry);
+	/* The writes from now on are for the next push */
+	sd_mutex_lock(&oc->push_lock);
+	entry->push = NULL;
+	sd_mutex_unlock(&oc->push_lock);
 	unlock_entry(entry);
+	put_cache_entry(entry);
 
 	sd_debug("%"PRIx64" done", oid);
-	put_cache_entry(entry);
+	uatomic_dec(&gcache.nr_pushing);
+	if (flusher && uatomic_sub_return(&gcache.nr_flushing, 1) == 0)
+		eventfd_xwrite(flush_efd, 1);
+
+	/* The cache may go away once its push list is empty */
+	sd_mutex_lock(&oc->push_lock);
+	list_del(&item->list);
+	sd_cond_broadcast(&oc->push_cond);
+	sd_mutex_unlock(&oc->push_lock);
+	free(item);
 }
 
-static void push_object_done(struct work *work)
+static void do_push_group(struct work *work)
 {
-	struct push_work *pw = container_of(work, struct push_work, work);
-	free(pw);
+	struct push_group *pg = container_of(work, struct push_group, work);
+
+	for (int i = 0; i < pg->nr; i++)
+		push_entry(pg->items[i], pg->flusher);
+}
+
+static void push_group_done(struct work *work)
+{
+	struct push_group *pg = container_of(work, struct push_group, work);
+
+	free(pg);
+}
+
+/*
+ * Take the dirty entry to push it.  Return NULL if it is being pushed, which
+ * the writes before the end of that push don't need another push for.
+ *
+ * Must be called with the cache write locked.
+ */
+static struct push_item *take_dirty_entry(struct object_cache_entry *entry)
+{
+	struct object_cache *oc = entry->oc;
+	struct push_item *item;
+
+	sd_mutex_lock(&oc->push_lock);
+	if (entry->push) {
+		sd_mutex_unlock(&oc->push_lock);
+		return NULL;
+	}
+	item = xzalloc(sizeof(*item));
+	item->entry = entry;
+	item->seq = ++oc->push_seq;
+	list_add_tail(&item->list, &oc->push_list);
+	entry->push = item;
+	sd_mutex_unlock(&oc->push_lock);
+
+	get_cache_entry(entry);
+	del_from_dirty_list(entry);
+	return item;
+}
+
+/*
+ * Queue the pushes of the taken entries, grouped by the nodes they go to in
+ * works of at most PUSH_GROUP_MAX of them.
+ */
+static void queue_push_items(struct push_item **items, int nr, bool flusher)
+{
+	struct vnode_info *vinfo;
+	struct push_group *pg = NULL;
+
+	if (!nr)
+		return;
+
+	vinfo = get_cached_vnode_info_epoch(sys_epoch(), NULL);
+	for (int i = 0; i < nr; i++)
+		items[i]->key = push_key(vinfo,
+					 idx_to_oid(items[i]->entry->oc->vid,
+						    entry_idx(items[i]->entry)));
+	put_vnode_info(vinfo);
+	xqsort(items, nr, push_item_cmp);
+
+	uatomic_add(&gcache.nr_pushing, nr);
+	if (flusher)
+		uatomic_add(&gcache.nr_flushing, nr);
+	for (int i = 0; i < nr; i++) {
+		if (!pg) {
+			pg = xzalloc(sizeof(*pg));
+			pg->work.fn = do_push_group;
+			pg->work.done = push_group_done;
+			pg->flusher = flusher;
+		}
+		pg->items[pg->nr++] = items[i];
+		if (i + 1 == nr || pg->nr == PUSH_GROUP_MAX ||
+		    items[i + 1]->key != items[i]->key) {
+			queue_work(sys->oc_push_wqueue, &pg->work);
+			pg = NULL;
+		}
+	}
+}
+
+/* Wait for the pushes of the cache queued up to 'seq' */
+static void wait_pushes(struct object_cache *oc, uint64_t seq)
+{
+	struct push_item *first;
+
+	sd_mutex_lock(&oc->push_lock);
+	while (!list_empty(&oc->push_list)) {
+		first = list_first_entry(&oc->push_list, struct push_item,
+					 list);
+		if (first->seq > seq)
+			break;
+		sd_cond_wait(&oc->push_cond, &oc->push_lock);
+	}
+	sd_mutex_unlock(&oc->push_lock);
 }
 
 /*
@@ -888,38 +1894,141 @@ static void push_object_done(struct work *work)
  * 1. Don't grab cache lock tight so we can serve RW requests while pushing.
  *    It is okay for allow subsequent RW after FLUSH because we only need to
  *    grantee the dirty objects before FLUSH to be pushed.
- * 2. Use threaded AIO to boost push performance, such as fsync(2) from VM.
+ * 2. Wait for the objects being pushed by the flusher or the other FLUSHes as
+ *    well, but not for those queued after ours.
  */
 static int object_cache_push(struct object_cache *oc)
 {
 	struct object_cache_entry *entry;
+	struct push_item **items, *item;
+	uint64_t seq;
+	int nr = 0;
 
 	write_lock_cache(oc);
-	if (list_empty(&oc->dirty_head)) {
-		unlock_cache(oc);
-		return SD_RES_SUCCESS;
-	}
-
-	uatomic_set(&oc->push_count, uatomic_read(&oc->dirty_count));
+	items = xmalloc(sizeof(*items) * (uatomic_read(&oc->dirty_count) ?: 1));
 	list_for_each_entry(entry, &oc->dirty_head, dirty_list) {
-		struct push_work *pw;
-
-		get_cache_entry(entry);
-		pw = xzalloc(sizeof(struct push_work));
-		pw->work.fn = do_push_object;
-		pw->work.done = push_object_done;
-		pw->entry = entry;
-		queue_work(sys->oc_push_wqueue, &pw->work);
-		del_from_dirty_list(entry);
+		item = take_dirty_entry(entry);
+		if (item)
+			items[nr++] = item;
 	}
+	sd_mutex_lock(&oc->push_lock);
+	seq = oc->push_seq;
+	sd_mutex_unlock(&oc->push_lock);
 	unlock_cache(oc);
 
-	eventfd_xread(oc->push_efd);
+	queue_push_items(items, nr, false);
+	free(items);
+	wait_pushes(oc, seq);
 
 	sd_debug("%"PRIx32" completed", oc->vid);
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Take a batch of the expired dirty entries of the VDI, or the oldest ones
+ * regardless of their age if all_ages is true.  Return the number of the
+ * taken entries.
+ */
+static int flush_cache_batch(struct object_cache *oc, bool all_ages,
+			     struct push_item **items)
+{
+	struct object_cache_entry *entry;
+	struct push_item *item;
+	uint64_t expire = clock_get_time() -
+		(uint64_t)sys->object_cache_expire * 1000000000;
+	int nr = 0;
+
+	write_lock_cache(oc);
+	list_for_each_entry(entry, &oc->dirty_head, dirty_list) {
+		if (nr == FLUSH_BATCH ||
+		    (!all_ages && entry->dirty_time > expire))
+			break;
+		item = take_dirty_entry(entry);
+		if (item)
+			items[nr++] = item;
+	}
+	unlock_cache(oc);
+
+	return nr;
+}
+
+/*
+ * A round of the flusher takes the batches of all the VDIs and pushes them
+ * together, so that the objects of the VDIs going to the same nodes are
+ * grouped as well.
+ */
+static void do_flush(struct work *work)
+{
+	struct push_item **items = NULL;
+	int nr, max = 0;
+	bool over;
+
+	do {
+		over = uatomic_read(&gcache.nr_dirty) > dirty_limit();
+		nr = 0;
+		for (int i = 0; i < HASH_SIZE; i++) {
+			struct hlist_head *head = cache_hashtable + i;
+			struct object_cache *cache;
+			struct hlist_node *node;
+
+			/* The lock excludes object_cache_delete() */
+			sd_read_lock(&hashtable_lock[i]);
+			hlist_for_each_entry(cache, node, head, hash) {
+				if (nr + FLUSH_BATCH > max) {
+					max = max ? max * 2 : FLUSH_BATCH * 16;
+					items = xrealloc(items,
+							 sizeof(*items) * max);
+				}
+				nr += flush_cache_batch(cache, over,
+							items + nr);
+			}
+			sd_rw_unlock(&hashtable_lock[i]);
+		}
+
+		if (nr) {
+			queue_push_items(items, nr, true);
+			eventfd_xread(flush_efd);
+			sd_debug("%d objects pushed", nr);
+		}
+	} while (over && nr && sys->cinfo.status == SD_STATUS_OK);
+	free(items);
+}
+
+static void flush_done(struct work *work)
+{
+	uatomic_set_false(&gcache.in_flush);
+	free(work);
+}
+
+static void kick_flusher(void)
+{
+	struct work *work;
+
+	/* FIXME read sys->status atomically */
+	if (sys->cinfo.status != SD_STATUS_OK)
+		return;
+	if (!uatomic_set_true(&gcache.in_flush))
+		return;
+
+	work = xzalloc(sizeof(*work));
+	work->fn = do_flush;
+	work->done = flush_done;
+	queue_work(sys->oc_push_wqueue, work);
+}
+
+static void flush_timer_fn(void *data);
+
+static struct timer flush_timer = {
+	.callback = flush_timer_fn,
+};
+
+static void flush_timer_fn(void *data)
+{
+	if (uatomic_read(&gcache.nr_dirty))
+		kick_flusher();
+	add_timer(&flush_timer, FLUSH_INTERVAL);
+}
+
 bool object_is_cached(uint64_t oid)
 {
 	uint32_t vid = oid_to_vid(oid);
@@ -948,15 +2057,21 @@ void object_cache_delete(uint32_t vid)
 	sd_write_lock(&hashtable_lock[h]);
 	hlist_del(&cache->hash);
 	sd_rw_unlock(&hashtable_lock[h]);
+	wait_pushes(cache, UINT64_MAX);
 
 	write_lock_cache(cache);
-	list_for_each_entry(entry, &cache->lru_head, lru_list) {
+	rb_for_each_entry(entry, &cache->lru_tree, node) {
+		uatomic_sub(&gcache.capacity,
+			    cache_object_kb(idx_to_oid(cache->vid,
+						       entry_idx(entry))));
 		free_cache_entry(entry);
-		uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
 	}
 	unlock_cache(cache);
 	sd_destroy_rw_lock(&cache->lock);
-	close(cache->push_efd);
+	sd_destroy_mutex(&cache->push_lock);
+	sd_destroy_cond(&cache->push_cond);
+	sd_destroy_mutex(&cache->trace_lock);
+	free(cache->trace);
 	free(cache);
 
 	/* Then we free disk */
@@ -990,6 +2105,8 @@ static struct object_cache_entry *oid_to_entry(uint64_t oid)
 	struct object_cache_entry *entry;
 
 	cache = find_object_cache(vid, false);
+	if (!cache)
+		return NULL;
 	entry = get_cache_entry_from(cache, idx);
 	if (!entry) {
 		sd_debug("%" PRIx64 " doesn't exist", oid);
@@ -998,16 +2115,23 @@ static struct object_cache_entry *oid_to_entry(uint64_t oid)
 	return entry;
 }
 
+static inline bool is_tmp_cache_name(const char *name)
+{
+	return strstr(name, ".tmp") != NULL;
+}
+
 static int object_cache_flush_and_delete(struct object_cache *oc)
 {
 	DIR *dir;
 	struct dirent *d;
 	uint32_t vid = oc->vid;
 	uint64_t idx;
-	uint64_t all = UINT64_MAX;
+	DECLARE_BITMAP(all, CACHE_MAX_BLOCKS);
+	unsigned long *valid;
 	int ret = 0;
-	char p[PATH_MAX];
+	char p[PATH_MAX], path[PATH_MAX];
 
+	memset(all, 0xff, sizeof(all));
 	sd_debug("%"PRIx32, vid);
 	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
 	dir = opendir(p);
@@ -1020,7 +2144,7 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 	while ((d = readdir(dir))) {
 		if (!strncmp(d->d_name, ".", 1))
 			continue;
-		if (strcmp(d->d_name + 8, ".tmp") == 0) {
+		if (is_tmp_cache_name(d->d_name)) {
 			sd_debug("try to del %s", d->d_name);
 			if (unlinkat(dirfd(dir), d->d_name, 0) < 0)
 				sd_err("%m");
@@ -1030,11 +2154,16 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 		idx = strtoull(d->d_name, NULL, 16);
 		if (idx == ULLONG_MAX)
 			continue;
-		if (push_cache_object(vid, idx, all, true) !=
-		    SD_RES_SUCCESS) {
+
+		get_cache_path(vid, idx, path);
+		valid = load_valid_bitmap(path, idx_to_oid(vid, idx));
+		ret = push_cache_object(vid, idx, valid ?: all, valid, !valid);
+		free(valid);
+		if (ret != SD_RES_SUCCESS) {
 			ret = -1;
 			goto out_close_dir;
 		}
+		ret = 0;
 	}
 
 	object_cache_delete(vid);
@@ -1089,21 +2218,37 @@ int object_cache_handle_request(struct request *req)
 	struct object_cache *cache;
 	struct object_cache_entry *entry;
 	int ret;
-	bool create = false;
+	bool create = false, miss;
 
 	sd_debug("%08" PRIx64 ", len %" PRIu32 ", off %" PRIu32, idx,
 		 hdr->data_length, hdr->obj.offset);
 
-	cache = find_object_cache(vid, true);
+	/* The caches loaded at the start aren't of a boot */
+	cache = find_object_cache(vid, false);
+	if (!cache) {
+		cache = find_object_cache(vid, true);
+		start_trace(cache);
+	}
+	trace_object(cache, idx);
 
 	if (req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ)
 		create = true;
+	miss = create;
+
+	/* A hit takes only the read locks */
+	if (!create) {
+		entry = get_cache_entry_from(cache, idx);
+		if (entry)
+			goto hit;
+	}
 retry:
 	ret = object_cache_lookup(cache, idx, create,
 				  hdr->flags & SD_FLAG_CMD_CACHE);
 	switch (ret) {
 	case SD_RES_NO_CACHE:
-		ret = object_cache_pull(cache, idx);
+		miss = true;
+		ret = object_cache_pull(cache, idx, hdr->obj.offset,
+					hdr->data_length);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
 		break;
@@ -1122,6 +2267,8 @@ retry:
 		pthread_yield();
 		goto retry;
 	}
+hit:
+	uatomic_inc(miss ? &gcache.misses : &gcache.hits);
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
 		ret = write_cache_object(entry, req->data, hdr->data_length,
@@ -1178,7 +2325,6 @@ int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 int object_cache_flush_vdi(uint32_t vid)
 {
 	struct object_cache *cache;
-	int ret;
 
 	cache = find_object_cache(vid, false);
 	if (!cache) {
@@ -1186,16 +2332,7 @@ int object_cache_flush_vdi(uint32_t vid)
 		return SD_RES_SUCCESS;
 	}
 
-	/*
-	 * We have to wait for last pusher finishing and push again so
-	 * that dirty bits produced while it is waiting are guaranteed
-	 * to be pushed back
-	 */
-	sd_mutex_lock(&cache->push_mutex);
-	ret = object_cache_push(cache);
-	sd_mutex_unlock(&cache->push_mutex);
-
-	return ret;
+	return object_cache_push(cache);
 }
 
 int object_cache_flush_and_del(const struct request *req)
@@ -1211,6 +2348,19 @@ int object_cache_flush_and_del(const struct request *req)
 	return SD_RES_SUCCESS;
 }
 
+/* The cached data objects are in the full size, see create_cache_object() */
+static void seed_block_size_shift(uint32_t vid, const char *path)
+{
+	struct stat st;
+	uint8_t shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+
+	if (stat(path, &st) == 0 && !(st.st_size & (st.st_size - 1)) &&
+	    st.st_size >= (UINT64_C(1) << SD_MIN_BLOCK_SIZE_SHIFT) &&
+	    st.st_size <= (UINT64_C(1) << SD_MAX_BLOCK_SIZE_SHIFT))
+		shift = ffsll(st.st_size) - 1;
+	vdi_set_block_size_shift(vid, shift);
+}
+
 static int load_cache_object(struct object_cache *cache)
 {
 	DIR *dir;
@@ -1232,7 +2382,7 @@ static int load_cache_object(struct object_cache *cache)
 		if (!strncmp(d->d_name, ".", 1))
 			continue;
 
-		if (strcmp(d->d_name + 8, ".tmp") == 0) {
+		if (is_tmp_cache_name(d->d_name)) {
 			sd_debug("try to del %s", d->d_name);
 			if (unlinkat(dirfd(dir), d->d_name, 0) < 0)
 				sd_err("%m");
@@ -1249,7 +2399,12 @@ static int load_cache_object(struct object_cache *cache)
 		 * false reclaim. Don't try to reclaim at loading phase because
 		 * cluster isn't fully working.
 		 */
-		add_to_lru_cache(cache, idx, true);
+		get_cache_path(cache->vid, idx, path);
+		if (!idx_has_vdi_bit(idx))
+			seed_block_size_shift(cache->vid, path);
+		add_to_lru_cache(cache, idx, true,
+				 load_valid_bitmap(path,
+						   idx_to_oid(cache->vid, idx)));
 		sd_debug("%"PRIx64, idx_to_oid(cache->vid, idx));
 	}
 
@@ -1289,6 +2444,254 @@ out:
 	return ret;
 }
 
+static int meta_seq_cmp(struct cache_meta *const *a, struct cache_meta *const *b)
+{
+	return intcmp((*a)->seq, (*b)->seq);
+}
+
+static void load_cache_entry(const struct cache_meta *meta, uint32_t slot)
+{
+	struct object_cache *cache = find_object_cache(meta->vid, true);
+	struct object_cache_entry *entry = alloc_cache_entry(cache, meta->idx);
+	uint64_t oid = idx_to_oid(meta->vid, entry_idx(entry));
+
+	/* the inode can't be read for the size in the main thread */
+	vdi_set_block_size_shift(meta->vid, meta->shift ?:
+				 SD_DEFAULT_BLOCK_SIZE_SHIFT);
+	entry->slot = slot;
+	memcpy(entry->bmap, meta->dirty, sizeof(meta->dirty));
+	if (meta->partial) {
+		entry->valid = xzalloc(valid_bitmap_size(oid));
+		memcpy(entry->valid, meta->valid, valid_bitmap_size(oid));
+	}
+
+	write_lock_cache(cache);
+	if (unlikely(lru_tree_insert(&cache->lru_tree, entry))) {
+		unlock_cache(cache);
+		sd_err("duplicate cache metadata of %"PRIx64, oid);
+		clear_cache_meta(entry);
+		sd_destroy_rw_lock(&entry->lock);
+		free(entry->valid);
+		free(entry);
+		return;
+	}
+	uatomic_add(&gcache.capacity, cache_object_kb(oid));
+	sd_mutex_lock(&gcache.lru_lock);
+	__add_to_cache_queue(entry, meta->queue == CACHE_AM ?
+			     CACHE_AM : CACHE_A1IN);
+	sd_mutex_unlock(&gcache.lru_lock);
+	cache->total_count++;
+	if (entry_is_dirty(entry))
+		add_to_dirty_list(entry);
+	unlock_cache(cache);
+	sd_debug("%"PRIx64, oid);
+}
+
+/*
+ * Load the entries from the metadata file in their order in the queues.
+ * Return -1 if the file isn't complete, and the directories must be scanned.
+ */
+static int load_cache_meta(void)
+{
+	const struct cache_meta_header *hdr;
+	struct cache_meta **metas;
+	uint32_t nr_slots, nr = 0;
+	struct stat st;
+	char *buf;
+	int ret = -1;
+
+	if (fstat(meta_fd, &st) < 0 || st.st_size < CACHE_META_SLOT_SIZE ||
+	    st.st_size % CACHE_META_SLOT_SIZE)
+		return -1;
+
+	nr_slots = st.st_size / CACHE_META_SLOT_SIZE;
+	buf = xmalloc(st.st_size);
+	metas = xmalloc(sizeof(*metas) * nr_slots);
+	if (xpread(meta_fd, buf, st.st_size, 0) != st.st_size) {
+		sd_err("failed to read the cache metadata, %m");
+		goto out;
+	}
+
+	hdr = (const struct cache_meta_header *)buf;
+	if (hdr->magic != CACHE_META_MAGIC ||
+	    hdr->version != CACHE_META_VERSION ||
+	    hdr->max_blocks != CACHE_MAX_BLOCKS ||
+	    hdr->slot_size != CACHE_META_SLOT_SIZE)
+		goto out;
+
+	for (uint32_t slot = 1; slot < nr_slots; slot++) {
+		struct cache_meta *meta = (struct cache_meta *)
+			(buf + (size_t)slot * CACHE_META_SLOT_SIZE);
+
+		if (!meta->checksum)
+			continue;
+		if (meta->checksum != meta_checksum(meta)) {
+			sd_err("the cache metadata slot %"PRIu32" is corrupted",
+			       slot);
+			goto out;
+		}
+		metas[nr++] = meta;
+	}
+
+	meta_slots = alloc_bitmap(NULL, 0, nr_slots);
+	nr_meta_slots = nr_slots;
+	xqsort(metas, nr, meta_seq_cmp);
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t slot = ((char *)metas[i] - buf) / CACHE_META_SLOT_SIZE;
+
+		set_bit(slot, meta_slots);
+		load_cache_entry(metas[i], slot);
+	}
+	if (nr)
+		meta_seq = metas[nr - 1]->seq;
+
+	sd_info("%"PRIu32" objects loaded from the cache metadata", nr);
+	ret = 0;
+out:
+	free(metas);
+	free(buf);
+	return ret;
+}
+
+/* Start over with an empty metadata file */
+static int reset_cache_meta(void)
+{
+	char buf[CACHE_META_SLOT_SIZE] = {};
+	struct cache_meta_header *hdr = (struct cache_meta_header *)buf;
+
+	hdr->magic = CACHE_META_MAGIC;
+	hdr->version = CACHE_META_VERSION;
+	hdr->max_blocks = CACHE_MAX_BLOCKS;
+	hdr->slot_size = CACHE_META_SLOT_SIZE;
+	if (ftruncate(meta_fd, 0) < 0 ||
+	    xpwrite(meta_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+		sd_err("failed to reset the cache metadata, %m");
+		return -1;
+	}
+	return 0;
+}
+
+static int idx_cmp(const uint64_t *a, const uint64_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+/*
+ * Remove the files of the cache without entries and the entries without files,
+ * which a crash can leave behind the metadata file
+ */
+static void sweep_cache_dir(struct object_cache *cache)
+{
+	struct object_cache_entry *entry;
+	uint64_t *idxs = NULL;
+	size_t nr = 0, i = 0;
+	char path[PATH_MAX + 16];
+	struct dirent *d;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/%06"PRIx32, object_cache_dir,
+		 cache->vid);
+	dir = opendir(path);
+	if (!dir) {
+		sd_debug("%m");
+		return;
+	}
+	while ((d = readdir(dir))) {
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		if (is_tmp_cache_name(d->d_name)) {
+			sd_debug("try to del %s", d->d_name);
+			if (unlinkat(dirfd(dir), d->d_name, 0) < 0)
+				sd_err("%m");
+			continue;
+		}
+		if (nr % 256 == 0)
+			idxs = xrealloc(idxs, sizeof(*idxs) * (nr + 256));
+		idxs[nr++] = strtoull(d->d_name, NULL, 16);
+	}
+	closedir(dir);
+	xqsort(idxs, nr, idx_cmp);
+
+	/* Both the tree and the names are sorted by the index */
+	write_lock_cache(cache);
+	rb_for_each_entry(entry, &cache->lru_tree, node) {
+		for (; i < nr && idxs[i] < entry_idx(entry); i++) {
+			get_cache_path(cache->vid, idxs[i], path);
+			sd_info("remove the stale cache object %s", path);
+			unlink(path);
+		}
+		if (i < nr && idxs[i] == entry_idx(entry)) {
+			i++;
+			continue;
+		}
+
+		/* It may be created after the directory is read */
+		get_cache_path(cache->vid, entry_idx(entry), path);
+		if (entry_in_use(entry) || lookup_path(path) != SD_RES_NO_CACHE)
+			continue;
+		sd_info("drop the cache entry of the removed %s", path);
+		uatomic_sub(&gcache.capacity,
+			    cache_object_kb(idx_to_oid(cache->vid,
+						       entry_idx(entry))));
+		free_cache_entry(entry);
+	}
+	for (; i < nr; i++) {
+		get_cache_path(cache->vid, idxs[i], path);
+		sd_info("remove the stale cache object %s", path);
+		unlink(path);
+	}
+	unlock_cache(cache);
+	free(idxs);
+}
+
+static void do_sweep_cache(struct work *work)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(object_cache_dir);
+	if (!dir) {
+		sd_err("%m");
+		return;
+	}
+	while ((d = readdir(dir))) {
+		unsigned long vid;
+		struct object_cache *cache;
+		int h;
+
+		if (!strncmp(d->d_name, ".", 1))
+			continue;
+		vid = strtoull(d->d_name, NULL, 16);
+		if (vid == ULLONG_MAX)
+			continue;
+
+		/* The lock excludes object_cache_delete() */
+		find_object_cache(vid, true);
+		h = hash(vid);
+		sd_read_lock(&hashtable_lock[h]);
+		cache = __find_object_cache(vid, cache_hashtable + h);
+		if (cache)
+			sweep_cache_dir(cache);
+		sd_rw_unlock(&hashtable_lock[h]);
+	}
+	closedir(dir);
+	sd_debug("done");
+}
+
+static void sweep_cache_done(struct work *work)
+{
+	free(work);
+}
+
+static void queue_sweep_cache(void)
+{
+	struct work *work = xzalloc(sizeof(*work));
+
+	work->fn = do_sweep_cache;
+	work->done = sweep_cache_done;
+	queue_work(sys->oc_reclaim_wqueue, work);
+}
+
 int object_cache_remove(uint64_t oid)
 {
 	/* Inc the entry refcount to exclude the reclaimer */
@@ -1321,7 +2724,7 @@ int object_cache_remove(uint64_t oid)
 	free_cache_entry(entry);
 	unlock_cache(oc);
 
-	uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
+	uatomic_sub(&gcache.capacity, cache_object_kb(oid));
 
 	return SD_RES_SUCCESS;
 }
@@ -1330,6 +2733,7 @@ int object_cache_init(const char *p)
 {
 	int ret = 0;
 	struct strbuf buf = STRBUF_INIT;
+	char path[PATH_MAX + 8];
 
 	strbuf_addstr(&buf, p);
 	if (xmkdir(buf.buf, sd_def_dmode) < 0) {
@@ -1345,10 +2749,41 @@ int object_cache_init(const char *p)
 	}
 	strbuf_copyout(&buf, object_cache_dir, sizeof(object_cache_dir));
 
+	/* Partial objects need the xattr to remember their fetched blocks */
+	if (setxattr(object_cache_dir, CACHE_VALID_XATTR, "", 0, 0) < 0) {
+		sd_info("%s doesn't support xattr, pull whole objects, %m",
+			object_cache_dir);
+	} else {
+		removexattr(object_cache_dir, CACHE_VALID_XATTR);
+		partial_pull = true;
+	}
+
+	flush_efd = eventfd(0, 0);
+	if (flush_efd < 0) {
+		sd_err("failed to create an eventfd, %m");
+		ret = -1;
+		goto err;
+	}
+
 	uatomic_set(&gcache.capacity, 0);
 	uatomic_set_false(&gcache.in_reclaim);
+	add_timer(&flush_timer, FLUSH_INTERVAL);
 
-	ret = load_cache();
+	snprintf(path, sizeof(path), "%s/%s", object_cache_dir,
+		 CACHE_META_FILE);
+	meta_fd = open(path, O_RDWR | O_CREAT, sd_def_fmode);
+	if (meta_fd < 0)
+		sd_err("failed to open %s, start without it, %m", path);
+
+	if (meta_fd >= 0 && load_cache_meta() == 0) {
+		queue_sweep_cache();
+	} else {
+		if (meta_fd >= 0 && reset_cache_meta() < 0) {
+			close(meta_fd);
+			meta_fd = -1;
+		}
+		ret = load_cache();
+	}
 err:
 	strbuf_release(&buf);
 	return ret;
@@ -1374,7 +2809,7 @@ int object_cache_get_info(struct object_cache_info *info)
 	int j = 0;
 
 	memset(info, 0, sizeof(*info));
-	info->used = (uint64_t)gcache.capacity * 1024 * 1024;
+	info->used = gcache.capacity * 1024;
 	info->size = (uint64_t)sys->object_cache_size * 1024 * 1024;
 
 	for (int i = 0; i < HASH_SIZE; i++) {
@@ -1395,6 +2830,11 @@ int object_cache_get_info(struct object_cache_info *info)
 	}
 	info->count = j;
 	info->directio = sys->object_cache_directio;
+	info->hits = uatomic_read(&gcache.hits);
+	info->misses = uatomic_read(&gcache.misses);
+	info->ghost_hits = uatomic_read(&gcache.ghost_hits);
+	info->dirty = uatomic_read(&gcache.nr_dirty);
+	info->pushing = uatomic_read(&gcache.nr_pushing);
 
 	return sizeof(*info);
 }
@@ -13,18 +13,43 @@
 
 #include "sheep_priv.h"
 
-struct objlist_cache_entry {
+/*
+ * The object list is a sorted array of oids, which is shared by the readers
+ * as an immutable snapshot, plus a log of the insertions and removals since
+ * the snapshot was built.  When the log grows to a fraction of the snapshot,
+ * a new snapshot is merged in the background, out of the lock, while the new
+ * updates go to a fresh log.  Readers which need the latest list merge the
+ * log first.
+ *
+ * An object costs 8 bytes instead of an rb node and its allocation, and the
+ * list is serialized with a memcpy of the snapshot.
+ */
+struct objlist_snapshot {
+	refcnt_t refcnt;
+	size_t nr;
+	uint64_t oids[];
+};
+
+struct objlist_update {
 	uint64_t oid;
-	struct rb_node node;
+	uint32_t seq;
+	bool add;
 };
 
+#define OBJLIST_MIN_UPDATES 4096
+
 struct objlist_cache {
-	int tree_version;
-	int buf_version;
-	int cache_size;
-	uint64_t *buf;
-	struct rb_root root;
+	struct objlist_snapshot *snap;
+	struct objlist_update *log;
+	size_t nr_log, log_size;
+	uatomic_bool merge_queued;
 	struct sd_rw_lock lock;
+	struct sd_mutex merge_lock; /* serializes the merges */
+};
+
+struct objlist_cache_entry {
+	uint64_t oid;
+	struct rb_node node;
 };
 
 struct objlist_migrate_cache {
@@ -33,9 +58,8 @@ struct objlist_migrate_cache {
 };
 
 static struct objlist_cache obj_list_cache = {
-	.tree_version	= 1,
-	.root		= RB_ROOT,
 	.lock		= SD_RW_LOCK_INITIALIZER,
+	.merge_lock	= SD_MUTEX_INITIALIZER,
 };
 
 static struct objlist_migrate_cache migrate_cache = {
@@ -55,51 +79,177 @@ static struct objlist_cache_entry *objlist_cache_rb_insert(struct rb_root *root,
 	return rb_insert(root, new, node, objlist_cache_cmp);
 }
 
-static int objlist_cache_rb_remove(struct rb_root *root, uint64_t oid)
+static struct objlist_snapshot *alloc_snapshot(size_t nr)
 {
-	struct objlist_cache_entry *entry,  key = { .oid = oid  };
+	struct objlist_snapshot *snap;
 
-	entry = rb_search(root, &key, node, objlist_cache_cmp);
-	if (!entry)
-		return -1;
+	snap = xmalloc_tag(sizeof(*snap) + nr * sizeof(uint64_t),
+			  SD_MEM_OBJLIST);
+	refcount_set(&snap->refcnt, 1);
+	snap->nr = nr;
+	return snap;
+}
 
-	rb_erase(&entry->node, root);
-	free(entry);
+static void put_snapshot(struct objlist_snapshot *snap)
+{
+	if (snap && refcount_dec(&snap->refcnt) == 0)
+		free_tag(snap, SD_MEM_OBJLIST);
+}
 
-	return 0;
+/* Return the current snapshot, which the caller must put */
+static struct objlist_snapshot *get_snapshot(void)
+{
+	struct objlist_snapshot *snap;
+
+	sd_read_lock(&obj_list_cache.lock);
+	snap = obj_list_cache.snap;
+	if (snap)
+		refcount_inc(&snap->refcnt);
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	return snap;
 }
 
-void objlist_cache_remove(uint64_t oid)
+static int update_cmp(const struct objlist_update *a,
+		      const struct objlist_update *b)
 {
-	sd_write_lock(&obj_list_cache.lock);
-	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
-		obj_list_cache.cache_size--;
-		obj_list_cache.tree_version++;
+	return intcmp(a->oid, b->oid) ?: intcmp(a->seq, b->seq);
+}
+
+/* Apply the log, sorted by oid and then by age, to the old snapshot */
+static struct objlist_snapshot *
+merge_snapshot(const struct objlist_snapshot *old,
+	       const struct objlist_update *log, size_t nr_log)
+{
+	size_t nr_old = old ? old->nr : 0, i = 0, j = 0;
+	struct objlist_snapshot *snap = alloc_snapshot(nr_old + nr_log);
+	uint64_t *p = snap->oids;
+
+	while (i < nr_old || j < nr_log) {
+		if (j == nr_log || (i < nr_old && old->oids[i] < log[j].oid)) {
+			*p++ = old->oids[i++];
+			continue;
+		}
+
+		/* the last update of the oid wins */
+		while (j + 1 < nr_log && log[j + 1].oid == log[j].oid)
+			j++;
+		if (i < nr_old && old->oids[i] == log[j].oid)
+			i++;
+		if (log[j].add)
+			*p++ = log[j].oid;
+		j++;
 	}
-	sd_rw_unlock(&obj_list_cache.lock);
+
+	snap->nr = p - snap->oids;
+	return snap;
 }
 
-int objlist_cache_insert(uint64_t oid)
+static void merge_objlist_cache(void)
 {
-	struct objlist_cache_entry *entry, *p;
+	struct objlist_snapshot *old, *snap;
+	struct objlist_update *log;
+	size_t nr_log;
 
-	entry = xzalloc(sizeof(*entry));
-	entry->oid = oid;
-	rb_init_node(&entry->node);
+	sd_mutex_lock(&obj_list_cache.merge_lock);
 
 	sd_write_lock(&obj_list_cache.lock);
-	p = objlist_cache_rb_insert(&obj_list_cache.root, entry);
-	if (p)
-		free(entry);
-	else {
-		obj_list_cache.cache_size++;
-		obj_list_cache.tree_version++;
+	log = obj_list_cache.log;
+	nr_log = obj_list_cache.nr_log;
+	obj_list_cache.log = NULL;
+	obj_list_cache.nr_log = 0;
+	obj_list_cache.log_size = 0;
+	old = obj_list_cache.snap;
+	if (old)
+		refcount_inc(&old->refcnt);
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	if (nr_log) {
+		xqsort(log, nr_log, update_cmp);
+		snap = merge_snapshot(old, log, nr_log);
+
+		sd_write_lock(&obj_list_cache.lock);
+		put_snapshot(obj_list_cache.snap);
+		obj_list_cache.snap = snap;
+		sd_rw_unlock(&obj_list_cache.lock);
 	}
+
+	put_snapshot(old);
+	free_tag(log, SD_MEM_OBJLIST);
+	sd_mutex_unlock(&obj_list_cache.merge_lock);
+}
+
+static void objlist_merge_work(struct work *work)
+{
+	merge_objlist_cache();
+}
+
+static void objlist_merge_done(struct work *work)
+{
+	uatomic_set_false(&obj_list_cache.merge_queued);
+	free(work);
+}
+
+/* Called with the lock held */
+static void objlist_cache_log(uint64_t oid, bool add)
+{
+	struct objlist_cache *c = &obj_list_cache;
+	size_t limit = OBJLIST_MIN_UPDATES;
+	struct work *work;
+
+	if (c->nr_log == c->log_size) {
+		c->log_size = c->log_size ? c->log_size * 2 : 256;
+		c->log = xrealloc_tag(c->log, c->log_size * sizeof(*c->log),
+				      SD_MEM_OBJLIST);
+	}
+	c->log[c->nr_log].oid = oid;
+	c->log[c->nr_log].seq = c->nr_log;
+	c->log[c->nr_log].add = add;
+	c->nr_log++;
+
+	if (c->snap)
+		limit = max(limit, c->snap->nr / 16);
+	if (c->nr_log < limit || !sys->objlist_wqueue ||
+	    !uatomic_set_true(&c->merge_queued))
+		return;
+
+	work = xzalloc(sizeof(*work));
+	work->fn = objlist_merge_work;
+	work->done = objlist_merge_done;
+	queue_work(sys->objlist_wqueue, work);
+}
+
+void objlist_cache_remove(uint64_t oid)
+{
+	sd_write_lock(&obj_list_cache.lock);
+	objlist_cache_log(oid, false);
+	sd_rw_unlock(&obj_list_cache.lock);
+}
+
+int objlist_cache_insert(uint64_t oid)
+{
+	sd_write_lock(&obj_list_cache.lock);
+	objlist_cache_log(oid, true);
 	sd_rw_unlock(&obj_list_cache.lock);
 
 	return 0;
 }
 
+/* The snapshot including all the updates so far */
+static struct objlist_snapshot *get_latest_snapshot(void)
+{
+	size_t nr_log;
+
+	sd_read_lock(&obj_list_cache.lock);
+	nr_log = obj_list_cache.nr_log;
+	sd_rw_unlock(&obj_list_cache.lock);
+
+	if (nr_log)
+		merge_objlist_cache();
+
+	return get_snapshot();
+}
+
 int objlist_migrate_cache_insert(uint64_t oid)
 {
 	struct objlist_cache_entry *entry, *p;
@@ -165,54 +315,80 @@ void objlist_migrate_cache_retire(void)
 
 int get_obj_list(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
 {
-	int nr = 0;
-	struct objlist_cache_entry *entry;
+	struct objlist_snapshot *snap = get_latest_snapshot();
+	size_t len = snap ? snap->nr * sizeof(uint64_t) : 0;
 
-	/* first try getting the cached buffer with only a read lock held */
-	sd_read_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
-		goto out;
+	if (hdr->data_length < len) {
+		put_snapshot(snap);
+		sd_debug("GET_OBJ_LIST buffer too small");
+		return SD_RES_BUFFER_SMALL;
+	}
 
-	/* if that fails grab a write lock for the usually necessary update */
-	sd_rw_unlock(&obj_list_cache.lock);
-	sd_write_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
+	rsp->data_length = len;
+	if (len)
+		memcpy(data, snap->oids, len);
+	put_snapshot(snap);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Return the objects after hdr->obj.oid in the order of oid, encoded as
+ * varints of the difference from the previous one, as many as fit in the
+ * buffer.  The objects of a vdi are mostly contiguous, so most of them take a
+ * byte.  An empty page means the end of the list.
+ *
+ * The first page brings the snapshot up to date and the next ones reuse it
+ * unless it is merged again meanwhile, so that listing doesn't merge the list
+ * for every page.
+ */
+int get_obj_list_page(const struct sd_req *hdr, struct sd_rsp *rsp,
+		      void *data)
+{
+	uint64_t prev = hdr->obj.oid;
+	uint8_t *p = data, *end = p + hdr->data_length;
+	struct objlist_snapshot *snap;
+	size_t lo = 0, hi;
+
+	if (hdr->data_length < 10)
+		return SD_RES_BUFFER_SMALL;
+
+	snap = prev ? get_snapshot() : get_latest_snapshot();
+	if (!snap)
 		goto out;
 
-	obj_list_cache.buf_version = obj_list_cache.tree_version;
-	obj_list_cache.buf = xrealloc(obj_list_cache.buf,
-				obj_list_cache.cache_size * sizeof(uint64_t));
+	/* the first object after the cursor */
+	hi = snap->nr;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
 
-	rb_for_each_entry(entry, &obj_list_cache.root, node) {
-		obj_list_cache.buf[nr++] = entry->oid;
+		if (snap->oids[mid] <= prev)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-out:
-	if (hdr->data_length < obj_list_cache.cache_size * sizeof(uint64_t)) {
-		sd_rw_unlock(&obj_list_cache.lock);
-		sd_debug("GET_OBJ_LIST buffer too small");
-		return SD_RES_BUFFER_SMALL;
+	for (; lo < snap->nr && end - p >= 10; lo++) {
+		p = varint_put(p, snap->oids[lo] - prev);
+		prev = snap->oids[lo];
 	}
-
-	rsp->data_length = obj_list_cache.cache_size * sizeof(uint64_t);
-	memcpy(data, obj_list_cache.buf, rsp->data_length);
-	sd_rw_unlock(&obj_list_cache.lock);
+	put_snapshot(snap);
+out:
+	rsp->data_length = p - (uint8_t *)data;
 	return SD_RES_SUCCESS;
 }
 
 void objlist_cache_format(void)
 {
+	sd_mutex_lock(&obj_list_cache.merge_lock);
 	sd_write_lock(&obj_list_cache.lock);
-	rb_destroy(&obj_list_cache.root, struct objlist_cache_entry, node);
-	INIT_RB_ROOT(&obj_list_cache.root);
-	obj_list_cache.tree_version = 1;
-	obj_list_cache.buf_version = 0;
-	if (NULL != obj_list_cache.buf) {
-		free(obj_list_cache.buf);
-		obj_list_cache.buf = NULL;
-	}
-	obj_list_cache.cache_size = 0;
+	put_snapshot(obj_list_cache.snap);
+	obj_list_cache.snap = NULL;
+	free_tag(obj_list_cache.log, SD_MEM_OBJLIST);
+	obj_list_cache.log = NULL;
+	obj_list_cache.nr_log = 0;
+	obj_list_cache.log_size = 0;
 	sd_rw_unlock(&obj_list_cache.lock);
+	sd_mutex_unlock(&obj_list_cache.merge_lock);
 
 	sd_write_lock(&migrate_cache.lock);
 	rb_destroy(&migrate_cache.root, struct objlist_cache_entry, node);
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Large cluster messages sent point to point
+ *
+ * A cluster driver whose ordered multicast stalls on large messages, like
+ * corosync, multicasts only a descriptor of a message above
+ * CLUSTER_MSG_OFFLOAD_SIZE, the node and the id cluster_msg_offload() gave it.
+ * The nodes fetch the message from that node over the sheep port with
+ * SD_OP_READ_CLUSTER_MSG, or from the other members if it's gone, before they
+ * handle the event of the descriptor.  Each node keeps the last
+ * OFFLOAD_KEEP messages it sent or fetched for the others.
+ */
+
+#include "sheep_priv.h"
+
+#define OFFLOAD_KEEP 256
+
+struct offload_msg {
+	struct node_id nid; /* of the node which offloaded it */
+	uint64_t id;
+	void *msg;
+	size_t msg_len;
+	struct list_node list;
+};
+
+/* the messages kept, the oldest first, only in the main thread */
+static LIST_HEAD(offload_msgs);
+static int nr_offload_msgs;
+static uint64_t offload_id;
+static struct work_queue *offload_wqueue;
+
+struct offload_work {
+	struct work work;
+	struct node_id nid;
+	uint64_t id;
+	void *msg;
+	size_t msg_len;
+	struct node_id *members; /* to fetch from if nid is gone */
+	int nr_members;
+	bool fetched;
+	cluster_msg_fn fn;
+};
+
+static struct offload_msg *find_offload_msg(const struct node_id *nid,
+					    uint64_t id)
+{
+	struct offload_msg *m;
+
+	list_for_each_entry(m, &offload_msgs, list)
+		if (m->id == id && !node_id_cmp(&m->nid, nid))
+			return m;
+	return NULL;
+}
+
+static void keep_offload_msg(const struct node_id *nid, uint64_t id,
+			     const void *msg, size_t msg_len)
+{
+	struct offload_msg *m;
+
+	if (find_offload_msg(nid, id))
+		return;
+
+	if (nr_offload_msgs == OFFLOAD_KEEP) {
+		m = list_first_entry(&offload_msgs, struct offload_msg, list);
+		list_del(&m->list);
+		free(m->msg);
+		free(m);
+		nr_offload_msgs--;
+	}
+
+	m = xzalloc(sizeof(*m));
+	m->nid = *nid;
+	m->id = id;
+	m->msg = xmalloc(msg_len);
+	memcpy(m->msg, msg, msg_len);
+	m->msg_len = msg_len;
+	list_add_tail(&m->list, &offload_msgs);
+	nr_offload_msgs++;
+}
+
+/* Keep the message nid sends and return its id for the descriptor */
+main_fn uint64_t cluster_msg_offload(const struct node_id *nid,
+				     const void *msg, size_t msg_len)
+{
+	/* not reused by this node after a restart */
+	if (!offload_id)
+		offload_id = (uint64_t)time(NULL) << 32;
+	keep_offload_msg(nid, ++offload_id, msg, msg_len);
+	return offload_id;
+}
+
+/* Return a copy of the message if this node has it, NULL otherwise */
+main_fn void *cluster_msg_lookup(const struct node_id *nid, uint64_t id)
+{
+	struct offload_msg *m = find_offload_msg(nid, id);
+	void *msg;
+
+	if (!m)
+		return NULL;
+
+	msg = xmalloc(m->msg_len);
+	memcpy(msg, m->msg, m->msg_len);
+	return msg;
+}
+
+/* Serve SD_OP_READ_CLUSTER_MSG */
+main_fn int cluster_msg_read(const struct node_id *nid, uint64_t id,
+			     void *buf, uint32_t len, uint32_t *rsp_len)
+{
+	struct offload_msg *m = find_offload_msg(nid, id);
+
+	if (!m)
+		return SD_RES_NO_OBJ;
+	if (m->msg_len != len)
+		return SD_RES_INVALID_PARMS;
+
+	memcpy(buf, m->msg, len);
+	*rsp_len = len;
+	return SD_RES_SUCCESS;
+}
+
+static bool fetch_from(struct offload_work *ow, const struct node_id *from)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_CLUSTER_MSG);
+	hdr.data_length = ow->msg_len;
+	hdr.forw.oid = ow->id;
+	memcpy(hdr.forw.addr, ow->nid.addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = ow->nid.port;
+
+	ret = sheep_exec_req(from, &hdr, ow->msg);
+	if (ret != SD_RES_SUCCESS || rsp->data_length != ow->msg_len) {
+		sd_debug("failed to fetch %"PRIx64" from %s, %s", ow->id,
+			 addr_to_str(from->addr, from->port),
+			 sd_strerror(ret));
+		return false;
+	}
+	return true;
+}
+
+static void offload_fetch_work(struct work *work)
+{
+	struct offload_work *ow = container_of(work, struct offload_work, work);
+
+	if (fetch_from(ow, &ow->nid)) {
+		ow->fetched = true;
+		return;
+	}
+
+	for (int i = 0; i < ow->nr_members; i++) {
+		if (!node_id_cmp(&ow->members[i], &ow->nid) ||
+		    !node_id_cmp(&ow->members[i], &sys->this_node.nid))
+			continue;
+		if (fetch_from(ow, &ow->members[i])) {
+			ow->fetched = true;
+			return;
+		}
+	}
+}
+
+static void offload_fetch_done(struct work *work)
+{
+	struct offload_work *ow = container_of(work, struct offload_work, work);
+
+	if (ow->fetched) {
+		keep_offload_msg(&ow->nid, ow->id, ow->msg, ow->msg_len);
+		ow->fn(&ow->nid, ow->id, ow->msg, ow->msg_len);
+	} else {
+		sd_err("no node has the cluster message %"PRIx64" of %s",
+		       ow->id, addr_to_str(ow->nid.addr, ow->nid.port));
+		ow->fn(&ow->nid, ow->id, NULL, ow->msg_len);
+	}
+
+	free(ow->msg);
+	free(ow->members);
+	free(ow);
+}
+
+/*
+ * Fetch the message in the background and pass it to fn in the main thread,
+ * NULL if no node has it.  The members are tried after nid.
+ */
+main_fn void cluster_msg_fetch(const struct node_id *nid, uint64_t id,
+			       size_t msg_len, const struct node_id *members,
+			       int nr_members, cluster_msg_fn fn)
+{
+	struct offload_work *ow;
+
+	if (!offload_wqueue) {
+		offload_wqueue = create_ordered_work_queue("offload");
+		if (!offload_wqueue)
+			panic("failed to create the work queue");
+	}
+
+	ow = xzalloc(sizeof(*ow));
+	ow->nid = *nid;
+	ow->id = id;
+	ow->msg = xmalloc(msg_len);
+	ow->msg_len = msg_len;
+	ow->members = xmalloc(sizeof(*members) * nr_members);
+	memcpy(ow->members, members, sizeof(*members) * nr_members);
+	ow->nr_members = nr_members;
+	ow->fn = fn;
+	ow->work.fn = offload_fetch_work;
+	ow->work.done = offload_fetch_done;
+	queue_work(offload_wqueue, &ow->work);
+}
@@ -69,40 +69,76 @@ static int stat_sheep(uint64_t *store_size, uint64_t *store_free)
 	return SD_RES_SUCCESS;
 }
 
-static int cluster_new_vdi(struct request *req)
+/* Fill iocb by the header of SD_OP_NEW_VDI(S) but the name and the base */
+static int new_vdi_iocb(const struct sd_req *hdr, struct vdi_iocb *iocb)
 {
-	const struct sd_req *hdr = &req->rq;
-	struct sd_rsp *rsp = &req->rp;
-	uint32_t vid;
-	int ret;
 	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
 
-	struct vdi_iocb iocb = {
-		.name = req->data,
-		.data_len = hdr->data_length,
+	*iocb = (struct vdi_iocb) {
+		.data_len = SD_MAX_VDI_LEN,
 		.size = hdr->vdi.vdi_size,
 		.base_vid = hdr->vdi.base_vdi_id,
 		.create_snapshot = !!hdr->vdi.snapid,
 		.copy_policy = hdr->vdi.copy_policy,
 		.store_policy = hdr->vdi.store_policy,
 		.nr_copies = hdr->vdi.copies,
+		.compress = hdr->vdi.compress,
+		.hybrid = hdr->vdi.hybrid,
+		.block_size_shift = hdr->vdi.block_size_shift,
+		.stripe_shift = hdr->vdi.stripe_shift,
 		.time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000,
 	};
 
 	/* Client doesn't specify redundancy scheme (copy = 0) */
 	if (!hdr->vdi.copies) {
-		iocb.nr_copies = sys->cinfo.nr_copies;
-		iocb.copy_policy = sys->cinfo.copy_policy;
+		iocb->nr_copies = sys->cinfo.nr_copies;
+		iocb->copy_policy = sys->cinfo.copy_policy;
 	}
 
-	if (iocb.copy_policy)
-		iocb.nr_copies = ec_policy_to_dp(iocb.copy_policy, NULL, NULL);
+	if (iocb->copy_policy)
+		iocb->nr_copies = ec_policy_to_dp(iocb->copy_policy, NULL,
+						  NULL);
+
+	/* the cold objects are erasure coded by the policy of the cluster */
+	if (iocb->hybrid && !sys->cinfo.copy_policy)
+		return SD_RES_INVALID_PARMS;
+
+	if (!iocb->block_size_shift)
+		iocb->block_size_shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	if (iocb->block_size_shift < SD_MIN_BLOCK_SIZE_SHIFT ||
+	    iocb->block_size_shift > SD_MAX_BLOCK_SIZE_SHIFT)
+		return SD_RES_INVALID_PARMS;
+	/* the erasure code works on the strips of the default objects */
+	if ((iocb->copy_policy || iocb->hybrid) &&
+	    iocb->block_size_shift != SD_DEFAULT_BLOCK_SIZE_SHIFT)
+		return SD_RES_INVALID_PARMS;
+	if (iocb->stripe_shift &&
+	    (!(iocb->copy_policy || iocb->hybrid) ||
+	     iocb->stripe_shift < SD_EC_MIN_STRIPE_SHIFT ||
+	     iocb->stripe_shift > SD_EC_MAX_STRIPE_SHIFT))
+		return SD_RES_INVALID_PARMS;
+
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_new_vdi(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	struct vdi_iocb iocb;
+	uint32_t vid;
+	int ret;
 
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
 
+	ret = new_vdi_iocb(hdr, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	iocb.name = req->data;
+
 	if (iocb.create_snapshot)
 		ret = vdi_snapshot(&iocb, &vid);
 	else
@@ -149,11 +185,67 @@ static int post_cluster_new_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 		 */
 		vdi_mark_snapshot(req->vdi.base_vdi_id);
 		atomic_set_bit(nr, sys->vdi_inuse);
+		/* the tag of a snapshot is written before */
+		vdi_invalidate_header(req->vdi.base_vdi_id);
+		vdi_invalidate_header(nr);
 	}
 
 	return ret;
 }
 
+/*
+ * Create the vdis of the data, struct sd_new_vdi each, all with the redundancy
+ * and the policies of the header.  The results of the vdis are in the data,
+ * which goes back to the client and to the other nodes.
+ */
+static int cluster_new_vdis(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct sd_new_vdi *nv = req->data;
+	int nr = hdr->data_length / sizeof(*nv), ret;
+	struct vdi_iocb iocb;
+
+	if (!nr || nr > SD_MAX_NEW_VDIS ||
+	    hdr->data_length != nr * sizeof(*nv))
+		return SD_RES_INVALID_PARMS;
+
+	ret = new_vdi_iocb(hdr, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	for (int i = 0; i < nr; i++)
+		nv[i].name[SD_MAX_VDI_LEN - 1] = '\0';
+	vdi_create_many(&iocb, nv, nr);
+
+	req->rp.data_length = hdr->data_length;
+	return SD_RES_SUCCESS;
+}
+
+static int post_cluster_new_vdis(const struct sd_req *req, struct sd_rsp *rsp,
+				 void *data, const struct sd_node *sender)
+{
+	struct sd_new_vdi *nv = data;
+	int nr = req->data_length / sizeof(*nv), nr_created = 0;
+
+	for (int i = 0; i < nr; i++) {
+		if (nv[i].result != SD_RES_SUCCESS)
+			continue;
+
+		/* see post_cluster_new_vdi() */
+		if (nv[i].snapshot)
+			vdi_mark_snapshot(nv[i].base_vid);
+		atomic_set_bit(nv[i].vid, sys->vdi_inuse);
+		if (nv[i].base_vid)
+			vdi_invalidate_header(nv[i].base_vid);
+		vdi_invalidate_header(nv[i].vid);
+		nr_created++;
+	}
+
+	sd_info("%d of %d vdis created, sender: %s", nr_created, nr,
+		node_to_str(sender));
+	return SD_RES_SUCCESS;
+}
+
 static int vdi_init_tag(const char **tag, const char *buf, uint32_t len)
 {
 	if (len == SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN)
@@ -224,6 +316,8 @@ static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 		node_to_str(sender));
 
 	vdi_delete_state(vid);
+	/* the attributes of the vdi are looked up again */
+	vdi_attr_cache_clear();
 
 	if (!sys->enable_object_cache)
 		return ret;
@@ -322,6 +416,7 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 		sys->cinfo.nr_copies = SD_DEFAULT_COPIES;
 	sys->cinfo.ctime = req->cluster.ctime;
 	set_cluster_config(&sys->cinfo);
+	refresh_vnode_info();
 
 	for (i = 1; i <= latest_epoch; i++)
 		remove_epoch(i);
@@ -372,23 +467,33 @@ static int cluster_get_vdi_attr(struct request *req)
 	int ret;
 
 	vattr = req->data;
+	/*
+	 * the current VDI id can change if we take a snapshot,
+	 * so we use the hash value of the VDI name as the VDI id
+	 */
+	vid = sd_hash_vdi(vattr->name);
+	if (!(hdr->flags & (SD_FLAG_CMD_CREAT | SD_FLAG_CMD_DEL)) &&
+	    vdi_attr_cached(vattr, hdr->vdi.snapid, vid, &attrid)) {
+		ret = (hdr->flags & SD_FLAG_CMD_EXCL) ?
+			SD_RES_VDI_EXIST : SD_RES_SUCCESS;
+		goto out;
+	}
+
 	iocb.name = vattr->name;
 	iocb.tag = vattr->tag;
 	iocb.snapid = hdr->vdi.snapid;
 	ret = vdi_lookup(&iocb, &info);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
-	/*
-	 * the current VDI id can change if we take a snapshot,
-	 * so we use the hash value of the VDI name as the VDI id
-	 */
-	vid = sd_hash_vdi(vattr->name);
 	ret = get_vdi_attr(req->data, hdr->data_length,
 			   vid, &attrid, info.create_time,
 			   !!(hdr->flags & SD_FLAG_CMD_CREAT),
 			   !!(hdr->flags & SD_FLAG_CMD_EXCL),
 			   !!(hdr->flags & SD_FLAG_CMD_DEL));
-
+	if (ret == SD_RES_SUCCESS)
+		vdi_attr_cache_update(vattr, hdr->vdi.snapid, attrid,
+				      !!(hdr->flags & SD_FLAG_CMD_DEL));
+out:
 	rsp->vdi.vdi_id = vid;
 	rsp->vdi.attr_id = attrid;
 	rsp->vdi.copies = get_vdi_copy_number(vid);
@@ -437,6 +542,77 @@ static int local_read_vdis(const struct sd_req *req, struct sd_rsp *rsp,
 	return read_vdis(data, req->data_length, &rsp->data_length);
 }
 
+static int local_list_vdi_headers(struct request *req)
+{
+	return list_vdi_headers(req->rq.obj.oid, req->data,
+				req->rq.data_length, &req->rp.data_length);
+}
+
+static int local_alter_vdi_copy(struct request *req)
+{
+	if (req->rq.data_length != sizeof(struct vdi_copy))
+		return SD_RES_INVALID_PARMS;
+
+	req->rp.data_length = sizeof(struct vdi_copy);
+	return copy_start_vdi(req->data);
+}
+
+static int local_alter_vdi_copy_main(const struct sd_req *req,
+				     struct sd_rsp *rsp, void *data,
+				     const struct sd_node *sender)
+{
+	if (rsp->result != SD_RES_SUCCESS)
+		return rsp->result;
+
+	copy_queue_vdi(data);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_vdi_state(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	/* this node might be merging the vdis of the others yet */
+	rsp->vdi_state.synced = vdi_bitmap_synced();
+	return fill_vdi_state_list(req, rsp, data);
+}
+
+static int local_get_spans(struct request *req)
+{
+	req->rp.data_length = span_get(req->data, req->rq.span.nr,
+				       req->rq.data_length);
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_lock_stat(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+#ifdef HAVE_LOCKSTAT
+	uint32_t nr = req->data_length / sizeof(struct sd_lock_stat), n = 0;
+	struct sd_lock_stat *ls = data;
+
+	BUILD_BUG_ON(SD_LOCK_NR_BUCKETS != LOCKSTAT_NR_BUCKETS);
+	for (struct lock_site *s = lockstat_sites(); s && n < nr; s = s->next) {
+		struct sd_lock_stat *e = ls + n++;
+
+		memset(e, 0, sizeof(*e));
+		pstrcpy(e->name, sizeof(e->name), s->name);
+		snprintf(e->site, sizeof(e->site), "%s:%d", s->file, s->line);
+		e->nr_acquired = uatomic_read(&s->nr_acquired);
+		e->nr_contended = uatomic_read(&s->nr_contended);
+		e->wait_ns = uatomic_read(&s->wait_ns);
+		e->max_wait_ns = uatomic_read(&s->max_wait_ns);
+		e->hold_ns = uatomic_read(&s->hold_ns);
+		e->nr_blocking = uatomic_read(&s->nr_blocking);
+		for (int i = 0; i < SD_LOCK_NR_BUCKETS; i++)
+			e->wait_hist[i] = uatomic_read(&s->wait_hist[i]);
+	}
+	rsp->data_length = n * sizeof(*ls);
+	return SD_RES_SUCCESS;
+#else
+	return SD_RES_NO_SUPPORT;
+#endif
+}
+
 static int local_stat_sheep(struct request *req)
 {
 	struct sd_rsp *rsp = &req->rp;
@@ -453,6 +629,17 @@ static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
+static int local_recovery_throttle(const struct sd_req *req,
+				   struct sd_rsp *rsp, void *data,
+				   const struct sd_node *sender)
+{
+	if (req->data_length < sizeof(struct recovery_throttle))
+		return SD_RES_INVALID_PARMS;
+
+	set_recovery_throttle(data);
+	return SD_RES_SUCCESS;
+}
+
 static int local_stat_cluster(struct request *req)
 {
 	struct sd_rsp *rsp = &req->rp;
@@ -538,6 +725,11 @@ static int local_get_obj_list(struct request *req)
 	return get_obj_list(&req->rq, &req->rp, req->data);
 }
 
+static int local_get_obj_list_page(struct request *req)
+{
+	return get_obj_list_page(&req->rq, &req->rp, req->data);
+}
+
 static int local_get_epoch(struct request *req)
 {
 	uint32_t epoch = req->rq.obj.tgt_epoch;
@@ -560,6 +752,22 @@ static int local_get_epoch(struct request *req)
 	return SD_RES_SUCCESS;
 }
 
+static int local_get_epochs(struct request *req)
+{
+	size_t used;
+	int ret;
+
+	sd_debug("%"PRIu32, req->rq.obj.tgt_epoch);
+
+	ret = epoch_log_read_range(req->rq.obj.tgt_epoch, req->data,
+				   req->rq.data_length, &used);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	req->rp.data_length = used;
+	return SD_RES_SUCCESS;
+}
+
 static int cluster_force_recover_work(struct request *req)
 {
 	struct vnode_info *old_vnode_info;
@@ -641,7 +849,44 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 {
 	if (req->vdi_state.set_bitmap)
 		atomic_set_bit(req->vdi_state.new_vid, sys->vdi_inuse);
+	vdi_invalidate_header(req->vdi_state.new_vid);
+
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_set_vdi_qos(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	if (req->data_length != sizeof(struct vdi_qos))
+		return SD_RES_INVALID_PARMS;
+
+	qos_update(req->vdi.base_vdi_id, data);
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_set_vdi_replica(const struct sd_req *req,
+				   struct sd_rsp *rsp, void *data,
+				   const struct sd_node *sender)
+{
+	char *name = (char *)data + sizeof(struct vdi_replica);
+
+	if (req->data_length != sizeof(struct vdi_replica) + SD_MAX_VDI_LEN)
+		return SD_RES_INVALID_PARMS;
+
+	name[SD_MAX_VDI_LEN - 1] = '\0';
+	replica_update(name, data);
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_set_vdi_copy(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data, const struct sd_node *sender)
+{
+	struct vdi_copy *vc = data;
+
+	if (req->data_length != sizeof(*vc))
+		return SD_RES_INVALID_PARMS;
 
+	vdi_set_copies(vc->vid, vc->nr_copies, vc->old_nr_copies);
 	return SD_RES_SUCCESS;
 }
 
@@ -656,6 +901,90 @@ static int cluster_delete_cache(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * The space of this node reweighted in steps toward target, each moving about
+ * budget bytes of data, so that a change of the disks doesn't move a large
+ * share of the data in one epoch.  Only in the main thread.
+ */
+static struct {
+	uint64_t target;
+	uint64_t budget;
+} reweight;
+
+/*
+ * The objects are spread by the space of the nodes, so a change of the space
+ * of this node moves about its share of the data here.  Take a step of as much
+ * as moves the budget, but at least the 1% which the reconfig ignores below.
+ */
+static uint64_t reweight_next_space(uint64_t old)
+{
+	uint64_t target = reweight.target, used, delta, step;
+
+	delta = target > old ? target - old : old - target;
+	if (!reweight.budget || !old)
+		return target;
+
+	md_get_size(&used);
+	step = used ? (uint64_t)((double)reweight.budget * old / used) : delta;
+	step = max(step, old / 100);
+	if (delta <= step)
+		return target;
+
+	return target > old ? old + step : old - step;
+}
+
+static bool node_size_varied(void)
+{
+	uint64_t new, used, old = sys->this_node.space;
+	double diff;
+
+	if (sys->gateway_only)
+		return false;
+
+	new = md_get_size(&used);
+	/* If !old, it is forced-out-gateway. Not supported by current node */
+	if (!old) {
+		if (new)
+			return true;
+		else
+			return false;
+	}
+
+	diff = new > old ? (double)(new - old) : (double)(old - new);
+	sd_debug("new %"PRIu64 ", old %"PRIu64", ratio %f", new, old,
+		 diff / (double)old);
+	if (diff / (double)old < 0.01)
+		return false;
+
+	reweight.target = new;
+	new = reweight_next_space(old);
+	if (new != reweight.target)
+		sd_notice("reweight to %" PRIu64 " in steps, %" PRIu64 " first",
+			  reweight.target, new);
+
+	sys->this_node.space = new;
+	set_node_space(new);
+
+	return true;
+}
+
+/* Take the next step of a staged reweight after the cluster is recovered */
+static void reweight_next_step(void)
+{
+	uint64_t old = sys->this_node.space, new;
+
+	if (!reweight.budget || !old || old == reweight.target)
+		return;
+
+	new = reweight_next_space(old);
+	sd_notice("reweight from %" PRIu64 " to %" PRIu64 ", target %" PRIu64,
+		  old, new, reweight.target);
+	sys->this_node.space = new;
+	set_node_space(new);
+	if (sys->cdrv->update_node(&sys->this_node) != SD_RES_SUCCESS)
+		sd_err("failed to update the space of this node");
+}
+
 static int cluster_recovery_completion(const struct sd_req *req,
 				       struct sd_rsp *rsp,
 				       void *data, const struct sd_node *sender)
@@ -690,8 +1019,11 @@ static int cluster_recovery_completion(const struct sd_req *req,
 			}
 			sd_notice("live nodes are recovered, epoch %d", epoch);
 			if (cur_vinfo->nr_zones >= ec_max_data_strip() &&
-			    sd_store && sd_store->cleanup)
+			    sd_store && sd_store->cleanup) {
 				sd_store->cleanup();
+				sys->purged_epoch = 0;
+			}
+			reweight_next_step();
 		} else {
 			sd_err("can't find %s", node_to_str(node));
 		}
@@ -736,8 +1068,11 @@ out:
 			sd_notice("all nodes are recovered, epoch %d", epoch);
 			/* sd_store can be NULL if this node is a gateway */
 			if (vnode_info->nr_zones >= ec_max_data_strip() &&
-			    sd_store && sd_store->cleanup)
+			    sd_store && sd_store->cleanup) {
 				sd_store->cleanup();
+				sys->purged_epoch = 0;
+			}
+			reweight_next_step();
 		}
 	}
 
@@ -757,35 +1092,6 @@ static int cluster_alter_cluster_copy(const struct sd_req *req,
 	return set_cluster_config(&sys->cinfo);
 }
 
-static bool node_size_varied(void)
-{
-	uint64_t new, used, old = sys->this_node.space;
-	double diff;
-
-	if (sys->gateway_only)
-		return false;
-
-	new = md_get_size(&used);
-	/* If !old, it is forced-out-gateway. Not supported by current node */
-	if (!old) {
-		if (new)
-			return true;
-		else
-			return false;
-	}
-
-	diff = new > old ? (double)(new - old) : (double)(old - new);
-	sd_debug("new %"PRIu64 ", old %"PRIu64", ratio %f", new, old,
-		 diff / (double)old);
-	if (diff / (double)old < 0.01)
-		return false;
-
-	sys->this_node.space = new;
-	set_node_space(new);
-
-	return true;
-}
-
 static int local_reconfig(struct request *req)
 {
 	if (sys->cinfo.flags & SD_CLUSTER_FLAG_MANUAL)
@@ -796,6 +1102,7 @@ static int local_reconfig(struct request *req)
 static int cluster_reconfig(const struct sd_req *req, struct sd_rsp *rsp,
 			    void *data, const struct sd_node *sender)
 {
+	reweight.budget = req->reweight.budget;
 	if (node_size_varied())
 		return sys->cdrv->update_node(&sys->this_node);
 
@@ -828,6 +1135,49 @@ static int local_md_unplug(const struct sd_req *req, struct sd_rsp *rsp,
 	return md_unplug_disks(disks);
 }
 
+static int local_get_block_hash(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+
+	if (!sd_store->get_block_hash)
+		return SD_RES_NO_SUPPORT;
+
+	if (req->data_length < SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE)
+		return SD_RES_BUFFER_SMALL;
+
+	request->rp.data_length = SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE;
+	return sd_store->get_block_hash(req->obj.oid, req->obj.tgt_epoch,
+					request->data);
+}
+
+static int local_replica_write(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+
+	return replica_write(req->obj.oid, req->obj.offset, request->data,
+			     req->data_length);
+}
+
+static int local_farm_save(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	uint32_t off = round_up(req->farm.path_len, 8);
+	char *dir = request->data;
+	int ret;
+
+	if (!req->farm.path_len || off > req->data_length ||
+	    req->data_length - off !=
+	    req->farm.nr * sizeof(struct sd_farm_entry) ||
+	    dir[req->farm.path_len - 1])
+		return SD_RES_INVALID_PARMS;
+
+	ret = farm_save(dir, (struct sd_farm_entry *)(dir + off),
+			req->farm.nr);
+	if (ret == SD_RES_SUCCESS)
+		request->rp.data_length = req->data_length;
+	return ret;
+}
+
 static int local_get_hash(struct request *request)
 {
 	struct sd_req *req = &request->rq;
@@ -836,8 +1186,8 @@ static int local_get_hash(struct request *request)
 	if (!sd_store->get_hash)
 		return SD_RES_NO_SUPPORT;
 
-	return sd_store->get_hash(req->obj.oid, req->obj.tgt_epoch,
-				  rsp->hash.digest);
+	return sd_store->get_hash(req->obj.oid, req->obj.ec_index,
+				  req->obj.tgt_epoch, rsp->hash.digest);
 }
 
 static int local_get_cache_info(struct request *request)
@@ -868,20 +1218,38 @@ out:
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data, const struct sd_node *sender)
 {
-	memcpy(data, &sys->stat, sizeof(struct sd_stat));
-	rsp->data_length = sizeof(struct sd_stat);
+	uint32_t len = min(req->data_length, (uint32_t)sizeof(struct sd_stat));
+	struct sd_stat stat = sys->stat;
+
+	buffer_pool_stat(&stat.bp);
+	BUILD_BUG_ON(SD_MEM_NR_TAGS > SD_MEM_STAT_NR);
+	for (int i = 0; i < SD_MEM_NR_TAGS; i++) {
+		stat.mem.used[i] = sd_mem_used(i);
+		stat.mem.cap[i] = sd_mem_cap(i);
+	}
+	/* older dog doesn't know the trailing counters */
+	memcpy(data, &stat, len);
+	rsp->data_length = len;
+
+	if (req->stat.version >= SD_STAT_VERSION_LATENCY &&
+	    req->data_length >= sizeof(struct sd_stat) +
+	    sizeof(struct sd_latency_stat)) {
+		latency_merge((struct sd_latency_stat *)
+			      ((char *)data + sizeof(struct sd_stat)));
+		rsp->data_length += sizeof(struct sd_latency_stat);
+	}
 	return SD_RES_SUCCESS;
 }
 
 /* Return SD_RES_INVALID_PARMS to ask client not to send flush req again */
 static int local_flush_vdi(struct request *req)
 {
+	uint32_t vid = oid_to_vid(req->rq.obj.oid);
 	int ret = SD_RES_INVALID_PARMS;
 
-	if (sys->enable_object_cache) {
-		uint32_t vid = oid_to_vid(req->rq.obj.oid);
+	gateway_flush_writes(vid);
+	if (sys->enable_object_cache)
 		ret = object_cache_flush_vdi(vid);
-	}
 
 	return ret;
 }
@@ -894,6 +1262,20 @@ static int local_discard_obj(struct request *req)
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
 
 	sd_debug("%"PRIx64, oid);
+
+	/* a part of the object, which stays allocated in the inode */
+	if (req->rq.obj.length &&
+	    (req->rq.obj.offset || req->rq.obj.length < get_vdi_objsize(oid))) {
+		struct sd_req hdr;
+
+		free(inode);
+		sd_init_req(&hdr, SD_OP_DISCARD_RANGE);
+		hdr.obj.oid = oid;
+		hdr.obj.offset = req->rq.obj.offset;
+		hdr.obj.length = req->rq.obj.length;
+		return exec_local_req(&hdr, NULL);
+	}
+
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(struct sd_inode), 0);
 	if (ret != SD_RES_SUCCESS)
@@ -991,24 +1373,93 @@ static int local_kill_node(const struct sd_req *req, struct sd_rsp *rsp,
 
 static int peer_remove_obj(struct request *req)
 {
-	uint64_t oid = req->rq.obj.oid;
+	uint64_t oid = req->rq.obj.oid, start = clock_get_time();
 	uint8_t ec_index = req->rq.obj.ec_index;
+	int ret;
 
 	objlist_cache_remove(oid);
 
-	return sd_store->remove_object(oid, ec_index);
+	ret = sd_store->remove_object(oid, ec_index);
+	request_latency(req, SD_LAT_STORE, start);
+	return ret;
 }
 
-int peer_read_obj(struct request *req)
+static int peer_unref_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
-	struct sd_rsp *rsp = &req->rp;
-	int ret;
-	uint32_t epoch = hdr->epoch;
-	struct siocb iocb;
 
-	if (sys->gateway_only)
-		return SD_RES_NO_OBJ;
+	if (hdr->data_length % sizeof(struct sd_unref))
+		return SD_RES_INVALID_PARMS;
+	/* the ledgers are cached by the node of their first copies */
+	if (before(hdr->epoch, sys_epoch()))
+		return SD_RES_OLD_NODE_VER;
+	if (after(hdr->epoch, sys_epoch()))
+		return SD_RES_NEW_NODE_VER;
+
+	return ledger_unref(req->data, hdr->data_length /
+			    sizeof(struct sd_unref), hdr->epoch);
+}
+
+/* Reply the data as a sparse buffer if it's smaller */
+static void reply_sparse(struct request *req)
+{
+	struct sd_rsp *rsp = &req->rp;
+	char *buf = xvalloc(rsp->data_length);
+	size_t len = sparse_encode(req->data, rsp->data_length, buf);
+
+	if (len) {
+		memcpy(req->data, buf, len);
+		rsp->data_length = len;
+		rsp->flags |= SD_FLAG_CMD_SPARSE;
+	}
+	free(buf);
+}
+
+/*
+ * Reply the file of a compressed object for the recovery, as a sparse buffer
+ * if it fits.  The holes make the buffer as small as the compressed data.
+ */
+static bool reply_compressed(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	void *file, *buf;
+	uint32_t len;
+	size_t size;
+
+	if (!sd_store->read_compressed || hdr->obj.offset ||
+	    sd_store->read_compressed(hdr->obj.oid, hdr->epoch, &file, &len) !=
+	    SD_RES_SUCCESS)
+		return false;
+
+	buf = xvalloc(len);
+	size = sparse_encode(file, len, buf);
+	if (size && size <= hdr->data_length) {
+		memcpy(req->data, buf, size);
+		rsp->data_length = size;
+		rsp->flags |= SD_FLAG_CMD_COMPRESS | SD_FLAG_CMD_SPARSE;
+	}
+	free(buf);
+	free(file);
+	return size && size <= hdr->data_length;
+}
+
+int peer_read_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	int ret;
+	uint32_t epoch = hdr->epoch;
+	struct siocb iocb;
+	uint64_t start = clock_get_time();
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+
+	if ((hdr->flags & SD_FLAG_CMD_COMPRESS) && reply_compressed(req)) {
+		request_latency(req, SD_LAT_STORE, start);
+		return SD_RES_SUCCESS;
+	}
 
 	memset(&iocb, 0, sizeof(iocb));
 	iocb.epoch = epoch;
@@ -1017,20 +1468,247 @@ int peer_read_obj(struct request *req)
 	iocb.offset = hdr->obj.offset;
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
+	iocb.background = !!(hdr->flags &
+			     (SD_FLAG_CMD_BACKGROUND | SD_FLAG_CMD_RECOVERY));
 	ret = sd_store->read(hdr->obj.oid, &iocb);
+	request_latency(req, SD_LAT_STORE, start);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
 	rsp->data_length = hdr->data_length;
+	if (hdr->flags & SD_FLAG_CMD_SPARSE)
+		reply_sparse(req);
+	if (hdr->opcode == SD_OP_READ_PEER)
+		rsp->obj.slow = md_oid_slow(hdr->obj.oid);
+out:
+	return ret;
+}
+
+/*
+ * Read the replicated objects of the oids in the data one after another, see
+ * SD_READ_PEERS_MAX.  The reply is larger than the request, so it goes in a
+ * new buffer.
+ */
+static int peer_read_peers(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	int nr = hdr->data_length / sizeof(uint64_t);
+	uint32_t size = hdr->obj.length;
+	const uint64_t *oids = req->data;
+	struct sd_read_peers_entry *e;
+	uint64_t off;
+	char *buf;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+	off = round_up(nr * sizeof(*e), SD_READ_PEERS_ALIGN);
+	if (req->local || req->shm || !nr ||
+	    nr * sizeof(uint64_t) != hdr->data_length ||
+	    size > SD_READ_PEERS_MAX || off > size)
+		return SD_RES_INVALID_PARMS;
+
+	buf = xbuffer_alloc(size);
+	e = (struct sd_read_peers_entry *)buf;
+	for (int i = 0; i < nr; i++) {
+		uint32_t len = get_store_objsize(oids[i]);
+		struct siocb iocb = {};
+		int ret;
+
+		if (is_erasure_oid(oids[i]))
+			ret = SD_RES_NO_SUPPORT;
+		else if (off + len > size)
+			ret = SD_RES_BUFFER_SMALL;
+		else {
+			iocb.epoch = hdr->epoch;
+			iocb.buf = buf + off;
+			iocb.length = len;
+			iocb.background = !!(hdr->flags &
+					     (SD_FLAG_CMD_BACKGROUND |
+					      SD_FLAG_CMD_RECOVERY));
+			ret = sd_store->read(oids[i], &iocb);
+		}
+		e[i].oid = oids[i];
+		e[i].result = ret;
+		e[i].length = ret == SD_RES_SUCCESS ? len : 0;
+		if (ret == SD_RES_SUCCESS)
+			off = min(round_up(off + len, SD_READ_PEERS_ALIGN),
+				  (uint64_t)size);
+	}
+
+	buffer_free(req->data, req->data_length);
+	req->data = buf;
+	req->data_length = size;
+	rsp->data_length = off;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Sum the shares of the strips in hdr->obj.chain in the lost strip
+ * hdr->obj.ec_index.  This node adds the share of its strip, the highest in
+ * the chain, to the sum of the rest which the node of the next highest one
+ * returns, so each node of the chain receives and sends one strip.
+ */
+static int peer_read_partial(struct request *req)
+{
+	struct sd_req *hdr = &req->rq, fhdr;
+	uint64_t oid = hdr->obj.oid;
+	uint32_t strips = hdr->obj.strips, chain = hdr->obj.chain, rest;
+	uint8_t lost = hdr->obj.ec_index;
+	int ed, edp, nr = 0, j = 0, idx, ret;
+	int in_idx[SD_MAX_COPIES];
+	struct vnode_info *vinfo;
+	const struct sd_node *n;
+	struct siocb iocb = {};
+	struct fec *ctx;
+	uint8_t *strip;
+
+	if (sys->gateway_only || !is_erasure_oid(oid))
+		return SD_RES_NO_OBJ;
+
+	edp = ec_policy_to_dp(get_vdi_copy_policy(oid_to_vid(oid)), &ed, NULL);
+	if (!chain || chain & ~strips || strips >> edp ||
+	    strips & (1U << lost))
+		return SD_RES_INVALID_PARMS;
+	idx = 31 - __builtin_clz(chain);
+	for (int i = 0; i < edp; i++) {
+		if (!(strips & (1U << i)))
+			continue;
+		if (i == idx)
+			j = nr;
+		in_idx[nr++] = i;
+	}
+	if (nr != ed)
+		return SD_RES_INVALID_PARMS;
+
+	strip = xvalloc(hdr->data_length);
+	iocb.epoch = hdr->epoch;
+	iocb.buf = strip;
+	iocb.length = hdr->data_length;
+	iocb.ec_index = idx;
+	/* only the repair of a lost strip asks for the partial sums */
+	iocb.background = true;
+	ret = sd_store->read(oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	rest = chain & ~(1U << idx);
+	if (rest) {
+		vinfo = get_cached_vnode_info_epoch(hdr->obj.tgt_epoch,
+						    req->vinfo);
+		if (!vinfo) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		n = vinfo_oid_to_node(vinfo, oid, 31 - __builtin_clz(rest));
+		fhdr = *hdr;
+		fhdr.epoch = sys_epoch();
+		fhdr.obj.chain = rest;
+		ret = sheep_exec_req(&n->nid, &fhdr, req->data);
+		put_vnode_info(vinfo);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	} else
+		memset(req->data, 0, hdr->data_length);
+
+	ctx = ec_init(ed, edp);
+	ec_decode_partial(ctx, in_idx, lost, j, strip, req->data,
+			  hdr->data_length);
+	ec_destroy(ctx);
+	req->rp.data_length = hdr->data_length;
 out:
+	free(strip);
 	return ret;
 }
 
+/*
+ * Create the object as a copy of hdr->obj.cow_oid with the data over it, so
+ * the gateway of a copy-on-write doesn't move the object.  The store clones
+ * the source if it's local, or else the source is read from one of its copies.
+ */
+static int peer_copy_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq, rhdr;
+	uint64_t oid = hdr->obj.oid, src = hdr->obj.cow_oid;
+	uint32_t len = get_store_objsize(oid);
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	struct siocb iocb = {}, riocb = {};
+	int nr, ret = SD_RES_NO_OBJ;
+	char *buf;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+	if (is_erasure_oid(oid) || hdr->obj.offset > len ||
+	    hdr->data_length > len - hdr->obj.offset)
+		return SD_RES_INVALID_PARMS;
+
+	iocb.epoch = hdr->epoch;
+	iocb.buf = req->data;
+	iocb.length = hdr->data_length;
+	iocb.offset = hdr->obj.offset;
+	iocb.compress = !!(hdr->flags & SD_FLAG_CMD_COMPRESS);
+	if (sd_store->copy && sd_store->exist(src, 0)) {
+		ret = sd_store->copy(oid, src, &iocb);
+		if (ret != SD_RES_NO_SUPPORT)
+			return ret;
+		ret = SD_RES_NO_OBJ;
+	}
+
+	buf = xvalloc(len);
+	if (sd_store->exist(src, 0)) {
+		riocb.epoch = hdr->epoch;
+		riocb.buf = buf;
+		riocb.length = len;
+		ret = sd_store->read(src, &riocb);
+	}
+	if (ret != SD_RES_SUCCESS) {
+		nr = get_obj_copy_number(src, req->vinfo->nr_zones);
+		vinfo_oid_to_nodes(req->vinfo, src, nr, nodes);
+		for (int i = 0; i < nr; i++) {
+			if (node_is_local(nodes[i]))
+				continue;
+			sd_init_req(&rhdr, SD_OP_READ_PEER);
+			rhdr.epoch = hdr->epoch;
+			rhdr.data_length = len;
+			rhdr.obj.oid = src;
+			ret = sheep_exec_req(&nodes[i]->nid, &rhdr, buf);
+			if (ret == SD_RES_SUCCESS)
+				break;
+		}
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	memcpy(buf + hdr->obj.offset, req->data, hdr->data_length);
+	iocb.buf = buf;
+	iocb.length = len;
+	iocb.offset = 0;
+	ret = sd_store->create_and_write(oid, &iocb);
+out:
+	free(buf);
+	return ret;
+}
+
+static int peer_obj_unchanged(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+
+	if (!sd_store->check_unchanged || !hdr->obj.tgt_epoch)
+		return SD_RES_NO_SUPPORT;
+
+	return sd_store->check_unchanged(hdr->obj.oid, hdr->obj.tgt_epoch,
+					 false);
+}
+
 static int peer_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct siocb iocb = { };
-	uint64_t oid = hdr->obj.oid;
+	uint64_t oid = hdr->obj.oid, start = clock_get_time();
+	int ret;
 
 	iocb.epoch = hdr->epoch;
 	iocb.buf = req->data;
@@ -1039,13 +1717,43 @@ static int peer_write_obj(struct request *req)
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 
-	return sd_store->write(oid, &iocb);
+	/* the object may be becoming erasure coded, see hybrid.c */
+	if (is_hot_obj(oid) && !hybrid_write_begin(oid))
+		return SD_RES_NO_OBJ;
+	ret = sd_store->write(oid, &iocb);
+	if (is_hot_obj(oid))
+		hybrid_write_end(oid);
+	request_latency(req, SD_LAT_STORE, start);
+	return ret;
+}
+
+static int peer_discard_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = { };
+	uint64_t start = clock_get_time();
+	int ret;
+
+	/* the caller may rely on the range reading back as zeros */
+	if (!sd_store->discard)
+		return SD_RES_NO_SUPPORT;
+
+	iocb.epoch = hdr->epoch;
+	iocb.length = hdr->obj.length;
+	iocb.offset = hdr->obj.offset;
+	iocb.ec_index = hdr->obj.ec_index;
+
+	ret = sd_store->discard(hdr->obj.oid, &iocb);
+	request_latency(req, SD_LAT_STORE, start);
+	return ret;
 }
 
 static int peer_create_and_write_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct siocb iocb = { };
+	uint64_t start = clock_get_time();
+	int ret;
 
 	iocb.epoch = hdr->epoch;
 	iocb.buf = req->data;
@@ -1053,8 +1761,11 @@ static int peer_create_and_write_obj(struct request *req)
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.offset = hdr->obj.offset;
+	iocb.compress = !!(hdr->flags & SD_FLAG_CMD_COMPRESS);
 
-	return sd_store->create_and_write(hdr->obj.oid, &iocb);
+	ret = sd_store->create_and_write(hdr->obj.oid, &iocb);
+	request_latency(req, SD_LAT_STORE, start);
+	return ret;
 }
 
 static int local_get_loglevel(struct request *req)
@@ -1161,6 +1872,99 @@ static inline int local_nfs_delete(struct request *req)
 
 #endif
 
+/*
+ * Copy only the blocks whose digests differ from the ones of the source.
+ * Return SD_RES_NO_SUPPORT to copy the whole object.
+ */
+static int repair_replica_blocks(uint64_t oid, const struct node_id *nid,
+				 uint32_t epoch)
+{
+	uint8_t local[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint8_t remote[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint32_t bsize = get_store_objsize(oid) / SD_BLOCK_HASH_NR;
+	struct sd_req hdr;
+	struct siocb iocb = { 0 };
+	void *buf;
+	int ret, nr = 0;
+
+	if (!sd_store->get_block_hash || is_erasure_oid(oid) ||
+	    !sd_store->exist(oid, 0) ||
+	    sd_store->get_block_hash(oid, epoch, (uint8_t *)local))
+		return SD_RES_NO_SUPPORT;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.epoch = epoch;
+	hdr.data_length = sizeof(remote);
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = epoch;
+	if (sheep_exec_req(nid, &hdr, remote) != SD_RES_SUCCESS)
+		return SD_RES_NO_SUPPORT;
+
+	buf = xvalloc(bsize);
+	for (int i = 0; i < SD_BLOCK_HASH_NR; i++) {
+		if (!memcmp(local[i], remote[i], SHA1_DIGEST_SIZE))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = epoch;
+		hdr.data_length = bsize;
+		hdr.obj.oid = oid;
+		hdr.obj.offset = (uint64_t)i * bsize;
+		ret = sheep_exec_req(nid, &hdr, buf);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+
+		iocb.epoch = epoch;
+		iocb.buf = buf;
+		iocb.length = bsize;
+		iocb.offset = (uint64_t)i * bsize;
+		ret = sd_store->write(oid, &iocb);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		nr++;
+	}
+	sd_debug("repaired %d blocks of %016"PRIx64, nr, oid);
+	ret = SD_RES_SUCCESS;
+out:
+	free(buf);
+	return ret;
+}
+
+static int local_cluster_lock(struct request *req)
+{
+	const struct node_id *holder = req->data;
+
+	if (req->rq.data_length < sizeof(*holder))
+		return SD_RES_INVALID_PARMS;
+
+	return grant_cluster_lock(req->rq.lock.id, holder, req->rq.lock.epoch,
+				  req->rq.lock.flags & SD_LOCK_RECLAIM);
+}
+
+static int local_cluster_unlock(struct request *req)
+{
+	const struct node_id *holder = req->data;
+
+	if (req->rq.data_length < sizeof(*holder))
+		return SD_RES_INVALID_PARMS;
+
+	return release_cluster_lock(req->rq.lock.id, holder,
+				    req->rq.lock.epoch);
+}
+
+static int local_read_cluster_msg(const struct sd_req *req,
+				  struct sd_rsp *rsp, void *data,
+				  const struct sd_node *sender)
+{
+	struct node_id nid = {};
+
+	memcpy(nid.addr, req->forw.addr, sizeof(nid.addr));
+	nid.port = req->forw.port;
+
+	return cluster_msg_read(&nid, req->forw.oid, data, req->data_length,
+				&rsp->data_length);
+}
+
 static int local_repair_replica(struct request *req)
 {
 	int ret;
@@ -1170,15 +1974,21 @@ static int local_repair_replica(struct request *req)
 	struct siocb iocb = { 0 };
 	uint64_t oid = req->rq.forw.oid;
 	size_t rlen = get_store_objsize(oid);
-	void *buf = xvalloc(rlen);
+	void *buf;
+
+	memcpy(nid.addr, req->rq.forw.addr, sizeof(nid.addr));
+	nid.port = req->rq.forw.port;
 
+	ret = repair_replica_blocks(oid, &nid, req->rq.epoch);
+	if (ret != SD_RES_NO_SUPPORT)
+		return ret;
+
+	buf = xvalloc(rlen);
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = req->rq.epoch;
 	hdr.data_length = rlen;
 	hdr.obj.oid = oid;
 
-	memcpy(nid.addr, req->rq.forw.addr, sizeof(nid.addr));
-	nid.port = req->rq.forw.port;
 	ret = sheep_exec_req(&nid, &hdr, buf);
 	if (ret == SD_RES_SUCCESS) {
 		sd_debug("read object %016"PRIx64" from %s successfully, "
@@ -1240,6 +2050,14 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = post_cluster_new_vdi,
 	},
 
+	[SD_OP_NEW_VDIS] = {
+		.name = "NEW_VDIS",
+		.type = SD_OP_TYPE_CLUSTER,
+		.is_admin_op = true,
+		.process_work = cluster_new_vdis,
+		.process_main = post_cluster_new_vdis,
+	},
+
 	[SD_OP_DEL_VDI] = {
 		.name = "DEL_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
@@ -1286,6 +2104,27 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = cluster_notify_vdi_add,
 	},
 
+	[SD_OP_SET_VDI_QOS] = {
+		.name = "SET_VDI_QOS",
+		.type = SD_OP_TYPE_CLUSTER,
+		.force = true,
+		.process_main = cluster_set_vdi_qos,
+	},
+
+	[SD_OP_SET_VDI_REPLICA] = {
+		.name = "SET_VDI_REPLICA",
+		.type = SD_OP_TYPE_CLUSTER,
+		.force = true,
+		.process_main = cluster_set_vdi_replica,
+	},
+
+	[SD_OP_SET_VDI_COPY] = {
+		.name = "SET_VDI_COPY",
+		.type = SD_OP_TYPE_CLUSTER,
+		.force = true,
+		.process_main = cluster_set_vdi_copy,
+	},
+
 	[SD_OP_DELETE_CACHE] = {
 		.name = "DELETE_CACHE",
 		.type = SD_OP_TYPE_CLUSTER,
@@ -1348,6 +2187,40 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_read_vdis,
 	},
 
+	[SD_OP_LIST_VDI_HEADERS] = {
+		.name = "LIST_VDI_HEADERS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_list_vdi_headers,
+	},
+
+	[SD_OP_ALTER_VDI_COPY] = {
+		.name = "ALTER_VDI_COPY",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_alter_vdi_copy,
+		.process_main = local_alter_vdi_copy_main,
+	},
+
+	[SD_OP_GET_VDI_STATE] = {
+		.name = "GET_VDI_STATE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_vdi_state,
+	},
+
+	[SD_OP_GET_SPANS] = {
+		.name = "GET_SPANS",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_work = local_get_spans,
+	},
+
+	[SD_OP_GET_LOCK_STAT] = {
+		.name = "GET_LOCK_STAT",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_lock_stat,
+	},
+
 	[SD_OP_GET_NODE_LIST] = {
 		.name = "GET_NODE_LIST",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1367,6 +2240,13 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_stat_recovery,
 	},
 
+	[SD_OP_RECOVERY_THROTTLE] = {
+		.name = "RECOVERY_THROTTLE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_recovery_throttle,
+	},
+
 	[SD_OP_STAT_CLUSTER] = {
 		.name = "STAT_CLUSTER",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1380,12 +2260,24 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_obj_list,
 	},
 
+	[SD_OP_GET_OBJ_LIST_PAGE] = {
+		.name = "GET_OBJ_LIST_PAGE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_obj_list_page,
+	},
+
 	[SD_OP_GET_EPOCH] = {
 		.name = "GET_EPOCH",
 		.type = SD_OP_TYPE_LOCAL,
 		.process_work = local_get_epoch,
 	},
 
+	[SD_OP_GET_EPOCHS] = {
+		.name = "GET_EPOCHS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_epochs,
+	},
+
 	[SD_OP_FLUSH_VDI] = {
 		.name = "FLUSH_VDI",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1487,6 +2379,31 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_hash,
 	},
 
+	[SD_OP_GET_BLOCK_HASH] = {
+		.name = "GET_BLOCK_HASH",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_block_hash,
+	},
+
+	[SD_OP_REPLICA_WRITE] = {
+		.name = "REPLICA_WRITE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_replica_write,
+	},
+
+	[SD_OP_FARM_SAVE] = {
+		.name = "FARM_SAVE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_farm_save,
+	},
+
+	/* SD_OP_GET_VDI_ATTR which only looks up, see queue_request() */
+	[SD_OP_LOOKUP_VDI_ATTR] = {
+		.name = "LOOKUP_VDI_ATTR",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = cluster_get_vdi_attr,
+	},
+
 	[SD_OP_GET_CACHE_INFO] = {
 		.name = "GET_CACHE_INFO",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1562,6 +2479,25 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_repair_replica,
 	},
 
+	[SD_OP_CLUSTER_LOCK] = {
+		.name = "CLUSTER_LOCK",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_cluster_lock,
+	},
+
+	[SD_OP_CLUSTER_UNLOCK] = {
+		.name = "CLUSTER_UNLOCK",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_cluster_unlock,
+	},
+
+	[SD_OP_READ_CLUSTER_MSG] = {
+		.name = "READ_CLUSTER_MSG",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_read_cluster_msg,
+	},
+
 	[SD_OP_GET_CLUSTER_DEFAULT] = {
 		.name = "GET_CLUSTER_DEFAULT",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1569,6 +2505,13 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_get_cluster_default,
 	},
 
+	/* handled by the connection, see shm_attach() */
+	[SD_OP_SHM_ATTACH] = {
+		.name = "SHM_ATTACH",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+	},
+
 	/* gateway I/O operations */
 	[SD_OP_CREATE_AND_WRITE_OBJ] = {
 		.name = "CREATE_AND_WRITE_OBJ",
@@ -1600,6 +2543,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = gateway_unref_object,
 	},
 
+	[SD_OP_UNREF_OBJS] = {
+		.name = "UNREF_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_unref_objects,
+	},
+
+	[SD_OP_DISCARD_RANGE] = {
+		.name = "DISCARD_RANGE",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_discard_object,
+	},
+
 	/* peer I/O operations */
 	[SD_OP_CREATE_AND_WRITE_PEER] = {
 		.name = "CREATE_AND_WRITE_PEER",
@@ -1624,6 +2579,42 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_remove_obj,
 	},
+
+	[SD_OP_UNREF_PEER] = {
+		.name = "UNREF_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_unref_obj,
+	},
+
+	[SD_OP_DISCARD_PEER] = {
+		.name = "DISCARD_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_discard_obj,
+	},
+
+	[SD_OP_READ_PARTIAL] = {
+		.name = "READ_PARTIAL",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_read_partial,
+	},
+
+	[SD_OP_COPY_PEER] = {
+		.name = "COPY_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_copy_obj,
+	},
+
+	[SD_OP_READ_PEERS] = {
+		.name = "READ_PEERS",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_read_peers,
+	},
+
+	[SD_OP_OBJ_UNCHANGED_PEER] = {
+		.name = "OBJ_UNCHANGED_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_obj_unchanged,
+	},
 };
 
 const struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -1691,12 +2682,38 @@ void do_process_work(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
 	int ret = SD_RES_SUCCESS;
+	uint64_t start = clock_get_time();
 
 	sd_debug("%x, %" PRIx64", %"PRIu32, req->rq.opcode, req->rq.obj.oid,
 		 req->rq.epoch);
 
-	if (req->op->process_work)
+	if (req->queue_start) {
+		request_latency(req, SD_LAT_QUEUE, req->queue_start);
+		req->queue_start = 0;
+	}
+	/* dropped at the dequeue, before any work */
+	if (request_expired(req)) {
+		req->rp.result = SD_RES_EXPIRED;
+		return;
+	}
+
+	/* the oids of SD_OP_READ_PEERS go as they are */
+	if ((is_peer_op(req->op) || req->rq.opcode == SD_OP_REPLICA_WRITE) &&
+	    (req->rq.flags & SD_FLAG_CMD_DEFLATE) &&
+	    (req->rq.flags & SD_FLAG_CMD_WRITE) &&
+	    req->rq.opcode != SD_OP_READ_PEERS)
+		ret = wire_inflate_request(req);
+
+	trace_sample_begin();
+	if (ret == SD_RES_SUCCESS && req->op->process_work)
 		ret = req->op->process_work(req);
+	trace_sample_end();
+	request_latency(req, SD_LAT_WORK, start);
+
+	if (ret == SD_RES_SUCCESS && (req->rq.flags & SD_FLAG_CMD_DEFLATE) &&
+	    (req->rq.opcode == SD_OP_READ_PEER ||
+	     req->rq.opcode == SD_OP_READ_PEERS))
+		wire_deflate_reply(req);
 
 	if (ret != SD_RES_SUCCESS) {
 		sd_debug("failed: %x, %" PRIx64" , %u, %s", req->rq.opcode,
@@ -1723,6 +2740,7 @@ static int map_table[] = {
 	[SD_OP_READ_OBJ] = SD_OP_READ_PEER,
 	[SD_OP_WRITE_OBJ] = SD_OP_WRITE_PEER,
 	[SD_OP_REMOVE_OBJ] = SD_OP_REMOVE_PEER,
+	[SD_OP_DISCARD_RANGE] = SD_OP_DISCARD_PEER,
 };
 
 int gateway_to_peer_opcode(int opcode)
@@ -0,0 +1,323 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The QoS scheduler of the gateway
+ *
+ * The gateway requests of the clients wait in a class per vdi, keyed by the
+ * vid of their object, before they go to the work queues.  A class is
+ * scheduled by three tags in microseconds, as mClock does: the reservation tag
+ * is when its next I/O is due to meet the reservation, the limit tag the
+ * earliest time its next I/O may go within the IOPS and bandwidth limits, and
+ * the proportional tag its virtual time of start-time fair queueing, which
+ * advances by the cost of an I/O over the weight.  A class behind its
+ * reservation goes first, even over sys->qos_depth; otherwise the class with
+ * the smallest proportional tag within its limits goes while fewer than
+ * sys->qos_depth requests are in flight.  The classes throttled by their limit
+ * wait for a timer.  Within a class the reads go before the writes, unless
+ * the oldest write has waited for QOS_DEADLINE.
+ *
+ * The QoS of a vdi is its attribute SD_QOS_ATTR_KEY, which a class loads when
+ * it is created, by the name of the vdi of its vid, so the snapshots share
+ * it with their working vdi.  SD_OP_SET_VDI_QOS tells the gateways that it
+ * has changed.  The requests of the sheep themselves are not scheduled.
+ */
+
+#include "sheep_priv.h"
+
+#define QOS_DEADLINE 50 /* ms */
+#define QOS_IO_SIZE (64 * 1024) /* bytes of the cost of an I/O */
+
+struct qos_class {
+	uint32_t vid;
+	uint32_t name_vid; /* sd_hash_vdi() of the name, 0 until loaded */
+	bool loading;
+	struct vdi_qos qos;
+
+	uint64_t r_tag, l_tag, p_tag;
+	struct list_head reads, writes;
+	int nr_queued;
+	struct list_node active_list; /* with requests queued */
+	struct rb_node node;
+};
+
+struct qos_load_work {
+	struct work work;
+	uint32_t vid;
+	uint32_t gen;
+	uint32_t name_vid;
+	struct vdi_qos qos;
+	int ret;
+};
+
+static struct rb_root qos_root = RB_ROOT;
+static LIST_HEAD(qos_active);
+static int qos_inflight;
+static uint64_t qos_vtime;
+static uint32_t qos_gen; /* bumped by SD_OP_SET_VDI_QOS */
+static struct timer qos_timer;
+static uint64_t qos_timer_expire;
+
+static void qos_dispatch(void);
+
+static int qos_cmp(const struct qos_class *a, const struct qos_class *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static uint64_t qos_now(void)
+{
+	return clock_get_time() / 1000;
+}
+
+static void qos_load_work(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct sheepdog_vdi_attr *vattr;
+	struct sd_inode *inode;
+	uint32_t attrid;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	lw->ret = sd_read_object(vid_to_vdi_oid(lw->vid), (char *)inode,
+				 SD_INODE_HEADER_SIZE, 0);
+	if (lw->ret != SD_RES_SUCCESS) {
+		free(inode);
+		return;
+	}
+
+	/* the attributes are of the name, see cluster_get_vdi_attr() */
+	vattr = xzalloc(sizeof(*vattr));
+	pstrcpy(vattr->name, sizeof(vattr->name), inode->name);
+	pstrcpy(vattr->key, sizeof(vattr->key), SD_QOS_ATTR_KEY);
+	lw->name_vid = sd_hash_vdi(inode->name);
+	lw->ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, lw->name_vid, &attrid,
+			       inode->create_time, false, false, false);
+	if (lw->ret == SD_RES_SUCCESS &&
+	    vattr->value_len == sizeof(lw->qos))
+		memcpy(&lw->qos, vattr->value, sizeof(lw->qos));
+	else if (lw->ret == SD_RES_NO_OBJ)
+		lw->ret = SD_RES_SUCCESS;
+	free(vattr);
+	free(inode);
+}
+
+static void qos_load_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct qos_class key = { .vid = lw->vid }, *c;
+
+	c = rb_search(&qos_root, &key, node, qos_cmp);
+	if (lw->gen != qos_gen) {
+		/* the QoS may have changed while we read it */
+		memset(&lw->qos, 0, sizeof(lw->qos));
+		lw->gen = qos_gen;
+		queue_work(sys->gateway_wqueue, &lw->work);
+		return;
+	}
+
+	c->loading = false;
+	if (lw->ret != SD_RES_SUCCESS)
+		/* tried again by the next request */
+		sd_debug("failed to load the QoS of %"PRIx32", %s", lw->vid,
+			 sd_strerror(lw->ret));
+	else {
+		c->name_vid = lw->name_vid;
+		c->qos = lw->qos;
+		qos_dispatch();
+	}
+	free(lw);
+}
+
+static struct qos_class *qos_get_class(uint32_t vid)
+{
+	struct qos_class key = { .vid = vid }, *c;
+	struct qos_load_work *lw;
+
+	c = rb_search(&qos_root, &key, node, qos_cmp);
+	if (!c) {
+		c = xzalloc(sizeof(*c));
+		c->vid = vid;
+		INIT_LIST_HEAD(&c->reads);
+		INIT_LIST_HEAD(&c->writes);
+		INIT_LIST_NODE(&c->active_list);
+		rb_insert(&qos_root, c, node, qos_cmp);
+	}
+
+	if (!c->name_vid && !c->loading) {
+		c->loading = true;
+		lw = xzalloc(sizeof(*lw));
+		lw->vid = vid;
+		lw->gen = qos_gen;
+		lw->work.fn = qos_load_work;
+		lw->work.done = qos_load_done;
+		queue_work(sys->gateway_wqueue, &lw->work);
+	}
+	return c;
+}
+
+static void qos_submit(struct request *req)
+{
+	queue_work(req->qos_wq, &req->work);
+}
+
+/* The next request of the class, the reads before the writes */
+static struct request *qos_peek(struct qos_class *c)
+{
+	uint64_t deadline = (uint64_t)(sys->qos_deadline ?: QOS_DEADLINE) *
+		1000000;
+	struct request *w = NULL;
+
+	if (!list_empty(&c->writes)) {
+		w = list_first_entry(&c->writes, struct request, qos_list);
+		if (clock_get_time() - w->queue_start >= deadline)
+			return w;
+	}
+	if (!list_empty(&c->reads))
+		return list_first_entry(&c->reads, struct request, qos_list);
+	return w;
+}
+
+static void qos_take(struct qos_class *c, struct request *req, uint64_t now)
+{
+	uint64_t len = req->rq.data_length, cost;
+	uint32_t weight = c->qos.weight ?: SD_QOS_DEFAULT_WEIGHT;
+
+	list_del(&req->qos_list);
+	if (!--c->nr_queued)
+		list_del(&c->active_list);
+
+	if (c->qos.reservation)
+		c->r_tag = max(c->r_tag, now) + 1000000 / c->qos.reservation;
+	cost = 0;
+	if (c->qos.iops)
+		cost = 1000000 / c->qos.iops;
+	if (c->qos.bps)
+		cost = max(cost, len * 1000000 / c->qos.bps);
+	c->l_tag = max(c->l_tag, now) + cost;
+	qos_vtime = c->p_tag;
+	c->p_tag += (1 + len / QOS_IO_SIZE) * 1000000 / weight;
+
+	qos_inflight++;
+	qos_submit(req);
+}
+
+static void qos_timer_fn(void *data)
+{
+	qos_dispatch();
+}
+
+static void qos_dispatch(void)
+{
+	struct qos_class *c, *best;
+	uint64_t now = qos_now(), wake;
+
+	for (;;) {
+		best = NULL;
+		wake = UINT64_MAX;
+
+		/* the reservations first */
+		list_for_each_entry(c, &qos_active, active_list) {
+			if (!c->qos.reservation)
+				continue;
+			if (c->r_tag > now) {
+				wake = min(wake, c->r_tag);
+				continue;
+			}
+			if (!best || c->r_tag < best->r_tag)
+				best = c;
+		}
+		if (best)
+			goto take;
+
+		if (sys->qos_depth && qos_inflight >= sys->qos_depth)
+			break;
+
+		list_for_each_entry(c, &qos_active, active_list) {
+			if (c->l_tag > now) {
+				wake = min(wake, c->l_tag);
+				continue;
+			}
+			if (!best || c->p_tag < best->p_tag)
+				best = c;
+		}
+		if (!best)
+			break;
+take:
+		qos_take(best, qos_peek(best), now);
+	}
+
+	if (wake == UINT64_MAX)
+		return;
+	if (timer_pending(&qos_timer)) {
+		if (qos_timer_expire <= wake)
+			return;
+		del_timer(&qos_timer);
+	}
+	qos_timer.callback = qos_timer_fn;
+	qos_timer_expire = wake;
+	add_timer(&qos_timer, (wake - now + 999) / 1000);
+}
+
+main_fn void qos_queue(struct request *req, struct work_queue *wq)
+{
+	struct qos_class *c;
+
+	req->qos_wq = wq;
+	if (req->local) {
+		qos_submit(req);
+		return;
+	}
+
+	c = qos_get_class(oid_to_vid(req->rq.obj.oid));
+	req->qos = c;
+	req->write_window = min(c->qos.write_window,
+				(uint32_t)SD_QOS_MAX_WRITE_WINDOW);
+	if (!c->nr_queued++) {
+		/* an idle class doesn't save up the share of the others */
+		c->p_tag = max(c->p_tag, qos_vtime);
+		list_add_tail(&c->active_list, &qos_active);
+	}
+	if (req->rq.flags & SD_FLAG_CMD_WRITE)
+		list_add_tail(&req->qos_list, &c->writes);
+	else
+		list_add_tail(&req->qos_list, &c->reads);
+	qos_dispatch();
+}
+
+/* Called when a request dispatched by qos_queue() is done */
+main_fn void qos_done(struct request *req)
+{
+	if (!req->qos)
+		return;
+
+	req->qos = NULL;
+	qos_inflight--;
+	if (!list_empty(&qos_active))
+		qos_dispatch();
+}
+
+main_fn void qos_update(uint32_t name_vid, const struct vdi_qos *qos)
+{
+	struct qos_class *c;
+
+	qos_gen++;
+	rb_for_each_entry(c, &qos_root, node) {
+		if (c->name_vid != name_vid)
+			continue;
+		c->qos = *qos;
+		/* the new limits from now on */
+		c->r_tag = min(c->r_tag, qos_now());
+		c->l_tag = min(c->l_tag, qos_now());
+	}
+	qos_dispatch();
+}
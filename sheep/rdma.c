@@ -0,0 +1,1262 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RDMA transport for the peer I/O
+ *
+ * The object I/O between sheep (SD_OP_{CREATE_AND_WRITE,READ,WRITE}_PEER) can
+ * go over reliable connected QPs instead of TCP.  Only the request and the
+ * response headers are sent as messages, and the data moves memory to memory:
+ *
+ *   client                                server
+ *   SEND {sd_req, addr, rkey, len}  -->
+ *                                         RDMA READ the write data from addr
+ *                                         process the request
+ *                                  <--    RDMA WRITE the read data to addr
+ *                                  <--    SEND sd_rsp
+ *
+ * so neither side copies the payload, which has to live in the registered
+ * buffers of the buffer pool.  Requests whose buffers are not registered, or
+ * which find their node without RDMA, simply go over TCP.
+ *
+ * The server side runs in the main thread, which owns the requests.  The
+ * completions of the client side are handled by the "rdma" thread, which wakes
+ * up the senders the same way as the multiplexed sockets do, see
+ * sockfd_mux_send().  Only one RDMA device, the one of the address we listen
+ * on, is used.
+ */
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+
+#include "sheep_priv.h"
+
+#define RDMA_QUEUE_DEPTH	128 /* outstanding requests per connection */
+#define RDMA_CONNECT_TIMEOUT	2000 /* in milliseconds */
+#define RDMA_RETRY_INTERVAL	(10ULL * 1000000000) /* 10 seconds */
+#define RDMA_MAX_RD_ATOMIC	16
+
+/* the message of the requests and the responses */
+struct rdma_msg {
+	struct sd_req hdr; /* struct sd_rsp for the responses */
+	uint64_t addr; /* data buffer of the client */
+	uint32_t rkey;
+	uint32_t len;
+};
+
+struct rdma_conn;
+
+/* wr_id of the messages, the RDMA READs use the request with WR_REQ */
+struct rdma_slot {
+	struct rdma_conn *conn;
+	struct rdma_msg *msg;
+	bool recv;
+	struct request *req; /* the server request whose response is sent */
+	struct list_node list;
+};
+
+#define WR_REQ 1UL
+
+struct rdma_conn {
+	struct rdma_cm_id *id;
+	struct ibv_cq *cq;
+	struct rdma_event_channel *ch; /* only for the client */
+
+	struct rdma_msg *msgs;
+	struct ibv_mr *msgs_mr;
+	struct rdma_slot slots[RDMA_QUEUE_DEPTH * 2]; /* recvs, then sends */
+	struct list_head free_slots;
+
+	bool dead;
+	bool zombie;
+	int nr_posted; /* signaled work requests which haven't completed */
+
+	/* server side, in the main thread */
+	struct client_info ci; /* requests are accounted to it */
+	struct list_head pending_tx;
+	bool polling;
+
+	/* client side, protected by lock */
+	struct sd_mutex lock;
+	struct node_id nid;
+	struct list_head inflight;
+	int nr_inflight;
+	uint32_t next_id;
+	int refcnt; /* the peer and the requests in flight */
+	struct list_node zombie_list;
+};
+
+struct rdma_peer {
+	struct rb_node rb;
+	struct node_id nid;
+	struct rdma_conn *conn;
+	bool connecting;
+	uint64_t retry_after;
+};
+
+struct rdma_region {
+	struct rb_node rb;
+	void *addr;
+	size_t len;
+	struct ibv_mr *mr;
+};
+
+static struct {
+	bool enabled;
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	uint8_t rd_atomic;
+
+	struct rdma_event_channel *listen_ch;
+	struct rdma_cm_id *listen_id;
+	struct ibv_comp_channel *server_cc;
+
+	/* client side */
+	struct ibv_comp_channel *client_cc;
+	int zombie_efd;
+	struct sd_mutex zombie_lock;
+	struct list_head zombies;
+	sd_thread_t thread;
+	struct rb_root peers;
+	struct sd_mutex peers_lock;
+
+	struct rb_root regions;
+	struct sd_rw_lock regions_lock;
+} rdma = {
+	.peers = RB_ROOT,
+	.regions = RB_ROOT,
+	.peers_lock = SD_MUTEX_INITIALIZER,
+	.zombie_lock = SD_MUTEX_INITIALIZER,
+	.zombies = LIST_HEAD_INIT(rdma.zombies),
+	.regions_lock = SD_RW_LOCK_INITIALIZER,
+};
+
+static int region_cmp(const struct rdma_region *a, const struct rdma_region *b)
+{
+	return intcmp((uintptr_t)a->addr, (uintptr_t)b->addr);
+}
+
+static int peer_cmp(const struct rdma_peer *a, const struct rdma_peer *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+/* Register a buffer of the pool, which is looked up by its start address */
+void rdma_register_buffer(void *addr, size_t len)
+{
+	struct rdma_region *r;
+
+	if (!rdma.enabled)
+		return;
+
+	r = xzalloc(sizeof(*r));
+	r->addr = addr;
+	r->len = len;
+	r->mr = ibv_reg_mr(rdma.pd, addr, len, IBV_ACCESS_LOCAL_WRITE |
+			   IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if (!r->mr) {
+		sd_debug("failed to register %p, %zu, %m", addr, len);
+		free(r);
+		return;
+	}
+
+	sd_write_lock(&rdma.regions_lock);
+	if (rb_insert(&rdma.regions, r, rb, region_cmp)) {
+		sd_rw_unlock(&rdma.regions_lock);
+		ibv_dereg_mr(r->mr);
+		free(r);
+		return;
+	}
+	sd_rw_unlock(&rdma.regions_lock);
+}
+
+void rdma_unregister_buffer(void *addr)
+{
+	struct rdma_region key = { .addr = addr }, *r;
+
+	if (!rdma.enabled)
+		return;
+
+	sd_write_lock(&rdma.regions_lock);
+	r = rb_search(&rdma.regions, &key, rb, region_cmp);
+	if (r)
+		rb_erase(&r->rb, &rdma.regions);
+	sd_rw_unlock(&rdma.regions_lock);
+
+	if (r) {
+		ibv_dereg_mr(r->mr);
+		free(r);
+	}
+}
+
+/* Return the MR covering [addr, addr + len), or NULL if there is none */
+static struct ibv_mr *find_mr(void *addr, size_t len)
+{
+	struct rdma_region key = { .addr = addr }, *r;
+	struct ibv_mr *mr = NULL;
+
+	sd_read_lock(&rdma.regions_lock);
+	r = rb_search(&rdma.regions, &key, rb, region_cmp);
+	if (r && len <= r->len)
+		mr = r->mr;
+	sd_rw_unlock(&rdma.regions_lock);
+
+	return mr;
+}
+
+static int post_recv(struct rdma_conn *conn, struct rdma_slot *slot)
+{
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)slot->msg,
+		.length = sizeof(*slot->msg),
+		.lkey = conn->msgs_mr->lkey,
+	};
+	struct ibv_recv_wr wr = {
+		.wr_id = (uintptr_t)slot,
+		.sg_list = &sge,
+		.num_sge = 1,
+	}, *bad;
+
+	if (ibv_post_recv(conn->id->qp, &wr, &bad)) {
+		sd_err("failed to post a receive, %m");
+		return -1;
+	}
+	conn->nr_posted++;
+	return 0;
+}
+
+/* Create the QP and the buffers of the messages of the connecting id */
+static struct rdma_conn *create_conn(struct rdma_cm_id *id,
+				     struct ibv_comp_channel *cc)
+{
+	struct rdma_conn *conn = xzalloc(sizeof(*conn));
+	struct ibv_qp_init_attr attr = {};
+	int i;
+
+	if (id->verbs != rdma.verbs) {
+		sd_err("the connection is on another RDMA device");
+		goto err;
+	}
+
+	conn->id = id;
+	id->context = conn;
+	sd_init_mutex(&conn->lock);
+	INIT_LIST_HEAD(&conn->free_slots);
+	INIT_LIST_HEAD(&conn->inflight);
+	INIT_LIST_HEAD(&conn->pending_tx);
+
+	conn->msgs = xzalloc(sizeof(struct rdma_msg) * ARRAY_SIZE(conn->slots));
+	conn->msgs_mr = ibv_reg_mr(rdma.pd, conn->msgs,
+				   sizeof(struct rdma_msg) *
+				   ARRAY_SIZE(conn->slots),
+				   IBV_ACCESS_LOCAL_WRITE);
+	if (!conn->msgs_mr) {
+		sd_err("failed to register the message buffers, %m");
+		goto err_msgs;
+	}
+
+	/* every work request of the connection may complete */
+	conn->cq = ibv_create_cq(rdma.verbs, RDMA_QUEUE_DEPTH * 4, conn, cc, 0);
+	if (!conn->cq) {
+		sd_err("failed to create a completion queue, %m");
+		goto err_mr;
+	}
+	if (ibv_req_notify_cq(conn->cq, 0)) {
+		sd_err("failed to request completion notification, %m");
+		goto err_cq;
+	}
+
+	attr.send_cq = conn->cq;
+	attr.recv_cq = conn->cq;
+	attr.qp_type = IBV_QPT_RC;
+	/* a response takes an RDMA WRITE and a SEND */
+	attr.cap.max_send_wr = RDMA_QUEUE_DEPTH * 3;
+	attr.cap.max_recv_wr = RDMA_QUEUE_DEPTH;
+	attr.cap.max_send_sge = 1;
+	attr.cap.max_recv_sge = 1;
+	if (rdma_create_qp(id, rdma.pd, &attr)) {
+		sd_err("failed to create a queue pair, %m");
+		goto err_cq;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(conn->slots); i++) {
+		struct rdma_slot *slot = conn->slots + i;
+
+		slot->conn = conn;
+		slot->msg = conn->msgs + i;
+		INIT_LIST_NODE(&slot->list);
+		if (i < RDMA_QUEUE_DEPTH) {
+			slot->recv = true;
+			if (post_recv(conn, slot) < 0)
+				goto err_qp;
+		} else
+			list_add_tail(&slot->list, &conn->free_slots);
+	}
+	return conn;
+err_qp:
+	/* nothing has been received yet, the CQ goes away with the QP */
+	rdma_destroy_qp(id);
+err_cq:
+	ibv_destroy_cq(conn->cq);
+err_mr:
+	ibv_dereg_mr(conn->msgs_mr);
+err_msgs:
+	free(conn->msgs);
+err:
+	id->context = NULL;
+	free(conn);
+	return NULL;
+}
+
+static void destroy_conn(struct rdma_conn *conn)
+{
+	struct rdma_cm_id *id = conn->id;
+
+	sd_debug("%p", conn);
+	rdma_destroy_qp(id);
+	ibv_destroy_cq(conn->cq);
+	ibv_dereg_mr(conn->msgs_mr);
+	free(conn->msgs);
+	rdma_destroy_id(id);
+	if (conn->ch)
+		rdma_destroy_event_channel(conn->ch);
+	sd_destroy_mutex(&conn->lock);
+	free(conn);
+}
+
+static struct rdma_slot *get_send_slot(struct rdma_conn *conn)
+{
+	struct rdma_slot *slot;
+
+	if (list_empty(&conn->free_slots))
+		return NULL;
+
+	slot = list_first_entry(&conn->free_slots, struct rdma_slot, list);
+	list_del(&slot->list);
+	return slot;
+}
+
+/* Move the QP to the error state, which flushes all the work requests */
+static void kill_qp(struct rdma_conn *conn)
+{
+	struct ibv_qp_attr attr = { .qp_state = IBV_QPS_ERR };
+
+	if (ibv_modify_qp(conn->id->qp, &attr, IBV_QP_STATE))
+		sd_err("failed to move the QP to the error state, %m");
+}
+
+/* Server side */
+
+static main_fn void server_fail(struct rdma_conn *conn)
+{
+	if (conn->dead)
+		return;
+
+	sd_info("RDMA connection from %s is closed", conn->ci.conn.ipstr);
+	conn->dead = true;
+	rdma_disconnect(conn->id);
+	kill_qp(conn);
+}
+
+/* Destroy the connection if nothing refers to it any longer */
+static main_fn void server_try_destroy(struct rdma_conn *conn)
+{
+	if (!conn->dead || conn->polling || conn->nr_posted ||
+	    refcount_read(&conn->ci.refcnt))
+		return;
+
+	destroy_conn(conn);
+}
+
+static main_fn void server_send_rsp(struct rdma_conn *conn,
+				    struct request *req,
+				    struct rdma_slot *slot)
+{
+	struct rdma_msg *msg = slot->msg;
+	struct sd_rsp *rsp = (struct sd_rsp *)&msg->hdr;
+	struct ibv_sge data_sge, msg_sge = {
+		.addr = (uintptr_t)msg,
+		.length = sizeof(msg->hdr),
+		.lkey = conn->msgs_mr->lkey,
+	};
+	struct ibv_send_wr data_wr = {}, msg_wr = {}, *bad;
+	struct ibv_mr *mr;
+	uint32_t len;
+
+	/* use cpu_to_le */
+	memcpy(rsp, &req->rp, sizeof(*rsp));
+	rsp->epoch = sys->cinfo.epoch;
+	rsp->opcode = req->rq.opcode;
+	rsp->id = req->rq.id;
+
+	msg_wr.wr_id = (uintptr_t)slot;
+	msg_wr.sg_list = &msg_sge;
+	msg_wr.num_sge = 1;
+	msg_wr.opcode = IBV_WR_SEND;
+	msg_wr.send_flags = IBV_SEND_SIGNALED;
+	slot->req = req;
+
+	len = min(rsp->data_length, req->rbuf.len);
+	rsp->data_length = len;
+	if (len) {
+		mr = find_mr(req->data, len);
+		if (!mr) {
+			sd_err("the buffer of the response isn't registered");
+			rsp->data_length = 0;
+			rsp->result = SD_RES_NO_MEM;
+			goto send;
+		}
+		data_sge.addr = (uintptr_t)req->data;
+		data_sge.length = len;
+		data_sge.lkey = mr->lkey;
+		/* unsignaled, SEND completes after it */
+		data_wr.wr_id = 0;
+		data_wr.sg_list = &data_sge;
+		data_wr.num_sge = 1;
+		data_wr.opcode = IBV_WR_RDMA_WRITE;
+		data_wr.wr.rdma.remote_addr = req->rbuf.addr;
+		data_wr.wr.rdma.rkey = req->rbuf.rkey;
+		data_wr.next = &msg_wr;
+	}
+send:
+	request_latency(req, SD_LAT_TOTAL, req->rx_start);
+	if (ibv_post_send(conn->id->qp, rsp->data_length ? &data_wr : &msg_wr,
+			  &bad)) {
+		sd_err("failed to post the response, %m");
+		slot->req = NULL;
+		list_add(&slot->list, &conn->free_slots);
+		free_remote_request(req);
+		server_fail(conn);
+		return;
+	}
+	conn->nr_posted++;
+}
+
+/* Called by put_request() when the request from RDMA is done */
+main_fn void rdma_put_request(struct request *req)
+{
+	struct rdma_conn *conn = req->rconn;
+	struct rdma_slot *slot;
+
+	if (conn->dead) {
+		free_remote_request(req);
+		server_try_destroy(conn);
+		return;
+	}
+
+	slot = get_send_slot(conn);
+	if (!slot) {
+		/* sent when a response completes */
+		list_add_tail(&req->request_list, &conn->pending_tx);
+		return;
+	}
+	server_send_rsp(conn, req, slot);
+}
+
+static main_fn void server_recv(struct rdma_conn *conn, struct rdma_slot *slot)
+{
+	struct sd_req *hdr = &slot->msg->hdr;
+	struct request *req;
+	struct ibv_sge sge;
+	struct ibv_send_wr wr = {}, *bad;
+	struct ibv_mr *mr;
+
+	if (hdr->proto_ver != SD_SHEEP_PROTO_VER) {
+		sd_err("bad request from %s, ver %d, op %x",
+		       conn->ci.conn.ipstr, hdr->proto_ver, hdr->opcode);
+		server_fail(conn);
+		return;
+	}
+
+	req = alloc_remote_request(&conn->ci, hdr->data_length);
+	if (!req) {
+		sd_err("failed to allocate request");
+		server_fail(conn);
+		return;
+	}
+	req->rx_start = clock_get_time();
+	req->rconn = conn;
+	memcpy(&req->rq, hdr, sizeof(req->rq));
+	req->rbuf.addr = slot->msg->addr;
+	req->rbuf.rkey = slot->msg->rkey;
+	req->rbuf.len = slot->msg->len;
+
+	/* the message is copied, give the buffer back to the client */
+	if (post_recv(conn, slot) < 0) {
+		free_remote_request(req);
+		server_fail(conn);
+		return;
+	}
+
+	if (!(hdr->flags & SD_FLAG_CMD_WRITE) || !hdr->data_length) {
+		queue_remote_request(req);
+		return;
+	}
+
+	mr = find_mr(req->data, req->rq.data_length);
+	if (!mr || req->rbuf.len < req->rq.data_length) {
+		sd_err("can't read the data of %x", req->rq.opcode);
+		free_remote_request(req);
+		server_fail(conn);
+		return;
+	}
+
+	sge.addr = (uintptr_t)req->data;
+	sge.length = req->rq.data_length;
+	sge.lkey = mr->lkey;
+	wr.wr_id = (uintptr_t)req | WR_REQ;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_READ;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.rdma.remote_addr = req->rbuf.addr;
+	wr.wr.rdma.rkey = req->rbuf.rkey;
+	if (ibv_post_send(conn->id->qp, &wr, &bad)) {
+		sd_err("failed to post an RDMA READ, %m");
+		free_remote_request(req);
+		server_fail(conn);
+		return;
+	}
+	conn->nr_posted++;
+}
+
+static main_fn void server_complete(struct rdma_conn *conn, struct ibv_wc *wc)
+{
+	struct rdma_slot *slot;
+	struct request *req;
+
+	if (!wc->wr_id) {
+		/* only an unsignaled RDMA WRITE which failed */
+		server_fail(conn);
+		return;
+	}
+	conn->nr_posted--;
+
+	if (wc->wr_id & WR_REQ) {
+		req = (struct request *)(uintptr_t)(wc->wr_id & ~WR_REQ);
+		if (wc->status != IBV_WC_SUCCESS || conn->dead) {
+			free_remote_request(req);
+			goto fail;
+		}
+		request_latency(req, SD_LAT_RX, req->rx_start);
+		queue_remote_request(req);
+		return;
+	}
+
+	slot = (struct rdma_slot *)(uintptr_t)wc->wr_id;
+	if (slot->recv) {
+		if (wc->status != IBV_WC_SUCCESS || conn->dead)
+			goto fail;
+		server_recv(conn, slot);
+		return;
+	}
+
+	/* a response is sent */
+	req = slot->req;
+	slot->req = NULL;
+	list_add(&slot->list, &conn->free_slots);
+	free_remote_request(req);
+	if (wc->status != IBV_WC_SUCCESS)
+		goto fail;
+
+	if (!conn->dead && !list_empty(&conn->pending_tx)) {
+		req = list_first_entry(&conn->pending_tx, struct request,
+				       request_list);
+		list_del(&req->request_list);
+		server_send_rsp(conn, req, get_send_slot(conn));
+	}
+	return;
+fail:
+	if (wc->status != IBV_WC_SUCCESS && wc->status != IBV_WC_WR_FLUSH_ERR)
+		sd_err("%s", ibv_wc_status_str(wc->status));
+	server_fail(conn);
+}
+
+static main_fn void server_cq_handler(int fd, int events, void *data)
+{
+	struct ibv_wc wc[32];
+	struct ibv_cq *cq;
+	struct rdma_conn *conn;
+	struct request *req;
+	void *ctx;
+	int nr;
+
+	if (ibv_get_cq_event(rdma.server_cc, &cq, &ctx))
+		return;
+
+	conn = ctx;
+	ibv_ack_cq_events(cq, 1);
+	if (ibv_req_notify_cq(cq, 0))
+		server_fail(conn);
+
+	/* requests can be done during the loop, see server_try_destroy() */
+	conn->polling = true;
+	while ((nr = ibv_poll_cq(cq, ARRAY_SIZE(wc), wc)) > 0)
+		for (int i = 0; i < nr; i++)
+			server_complete(conn, wc + i);
+	conn->polling = false;
+
+	if (conn->dead) {
+		list_for_each_entry(req, &conn->pending_tx, request_list) {
+			list_del(&req->request_list);
+			free_remote_request(req);
+		}
+		server_try_destroy(conn);
+	}
+}
+
+static main_fn void server_accept(struct rdma_cm_id *id)
+{
+	struct rdma_conn_param param = {
+		.responder_resources = rdma.rd_atomic,
+		.initiator_depth = rdma.rd_atomic,
+		.rnr_retry_count = 7,
+	};
+	struct sockaddr *sa = rdma_get_peer_addr(id);
+	struct rdma_conn *conn;
+
+	conn = create_conn(id, rdma.server_cc);
+	if (!conn) {
+		rdma_reject(id, NULL, 0);
+		rdma_destroy_id(id);
+		return;
+	}
+
+	conn->ci.conn.fd = -1;
+	if (sa->sa_family == AF_INET)
+		inet_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr,
+			  conn->ci.conn.ipstr, sizeof(conn->ci.conn.ipstr));
+	else
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr,
+			  conn->ci.conn.ipstr, sizeof(conn->ci.conn.ipstr));
+	INIT_LIST_HEAD(&conn->ci.done_reqs);
+
+	if (rdma_accept(id, &param)) {
+		sd_err("failed to accept an RDMA connection, %m");
+		/* no completion has been generated yet */
+		conn->dead = true;
+		kill_qp(conn);
+		return;
+	}
+	sd_info("RDMA connection from %s", conn->ci.conn.ipstr);
+}
+
+static main_fn void listen_handler(int fd, int events, void *data)
+{
+	struct rdma_cm_event *ev;
+	struct rdma_cm_id *id;
+	enum rdma_cm_event_type type;
+
+	while (rdma_get_cm_event(rdma.listen_ch, &ev) == 0) {
+		id = ev->id;
+		type = ev->event;
+		sd_debug("%s", rdma_event_str(type));
+
+		/* the id of a new connection can't be destroyed before ack */
+		rdma_ack_cm_event(ev);
+
+		switch (type) {
+		case RDMA_CM_EVENT_CONNECT_REQUEST:
+			server_accept(id);
+			break;
+		case RDMA_CM_EVENT_DISCONNECTED:
+		case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		case RDMA_CM_EVENT_CONNECT_ERROR:
+		case RDMA_CM_EVENT_UNREACHABLE:
+		case RDMA_CM_EVENT_REJECTED:
+			if (id->context)
+				server_fail(id->context);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Client side */
+
+static void client_try_destroy(struct rdma_conn *conn);
+static void rdma_conn_put(struct rdma_conn *conn);
+
+static void client_fail(struct rdma_conn *conn)
+{
+	struct sockfd_mux_req *mreq;
+	struct rdma_peer *peer, key = { .nid = conn->nid };
+	bool put = false;
+
+	sd_mutex_lock(&conn->lock);
+	if (conn->dead) {
+		sd_mutex_unlock(&conn->lock);
+		return;
+	}
+	conn->dead = true;
+	rdma_disconnect(conn->id);
+	kill_qp(conn);
+
+	/* No response can land in the buffers any longer */
+	list_for_each_entry(mreq, &conn->inflight, list) {
+		int efd = mreq->efd;
+
+		list_del(&mreq->list);
+		mreq->rsp.result = SD_RES_NETWORK_ERROR;
+		uatomic_set_true(&mreq->done);
+		eventfd_xwrite(efd, 1);
+	}
+	conn->nr_inflight = 0;
+	client_try_destroy(conn);
+	sd_mutex_unlock(&conn->lock);
+
+	sd_mutex_lock(&rdma.peers_lock);
+	peer = rb_search(&rdma.peers, &key, rb, peer_cmp);
+	if (peer && peer->conn == conn) {
+		peer->conn = NULL;
+		peer->retry_after = clock_get_time() + RDMA_RETRY_INTERVAL;
+		put = true;
+	}
+	sd_mutex_unlock(&rdma.peers_lock);
+
+	sd_info("RDMA connection to %s is closed",
+		addr_to_str(conn->nid.addr, conn->nid.port));
+	if (put)
+		rdma_conn_put(conn);
+}
+
+/* Called with conn->lock held, the rdma thread destroys it */
+static void client_try_destroy(struct rdma_conn *conn)
+{
+	if (!conn->dead || conn->refcnt || conn->nr_posted || conn->zombie)
+		return;
+
+	conn->zombie = true;
+	sd_mutex_lock(&rdma.zombie_lock);
+	list_add_tail(&conn->zombie_list, &rdma.zombies);
+	sd_mutex_unlock(&rdma.zombie_lock);
+	eventfd_xwrite(rdma.zombie_efd, 1);
+}
+
+static void rdma_conn_put(struct rdma_conn *conn)
+{
+	sd_mutex_lock(&conn->lock);
+	conn->refcnt--;
+	client_try_destroy(conn);
+	sd_mutex_unlock(&conn->lock);
+}
+
+static void client_complete(struct rdma_conn *conn, struct ibv_wc *wc)
+{
+	struct rdma_slot *slot = (struct rdma_slot *)(uintptr_t)wc->wr_id;
+	struct sd_rsp *rsp = (struct sd_rsp *)&slot->msg->hdr;
+	struct sockfd_mux_req *mreq;
+	int efd;
+
+	sd_mutex_lock(&conn->lock);
+	conn->nr_posted--;
+	if (wc->status != IBV_WC_SUCCESS) {
+		if (!slot->recv)
+			list_add(&slot->list, &conn->free_slots);
+		client_try_destroy(conn);
+		sd_mutex_unlock(&conn->lock);
+		if (wc->status != IBV_WC_WR_FLUSH_ERR)
+			sd_err("%s", ibv_wc_status_str(wc->status));
+		client_fail(conn);
+		return;
+	}
+
+	if (!slot->recv) {
+		list_add(&slot->list, &conn->free_slots);
+		sd_mutex_unlock(&conn->lock);
+		return;
+	}
+
+	list_for_each_entry(mreq, &conn->inflight, list) {
+		if (mreq->id != rsp->id)
+			continue;
+		list_del(&mreq->list);
+		conn->nr_inflight--;
+		mreq->rsp = *rsp;
+		efd = mreq->efd;
+		uatomic_set_true(&mreq->done);
+		eventfd_xwrite(efd, 1);
+		break;
+	}
+
+	if (conn->dead) {
+		client_try_destroy(conn);
+		sd_mutex_unlock(&conn->lock);
+		return;
+	}
+	if (post_recv(conn, slot) < 0) {
+		sd_mutex_unlock(&conn->lock);
+		client_fail(conn);
+		return;
+	}
+	sd_mutex_unlock(&conn->lock);
+}
+
+static void reap_zombies(void)
+{
+	struct rdma_conn *conn;
+	LIST_HEAD(list);
+
+	eventfd_xread(rdma.zombie_efd);
+
+	sd_mutex_lock(&rdma.zombie_lock);
+	list_splice_init(&rdma.zombies, &list);
+	sd_mutex_unlock(&rdma.zombie_lock);
+
+	list_for_each_entry(conn, &list, zombie_list) {
+		list_del(&conn->zombie_list);
+		destroy_conn(conn);
+	}
+}
+
+static void *rdma_routine(void *arg)
+{
+	struct pollfd pfds[2] = {
+		{ .fd = rdma.client_cc->fd, .events = POLLIN },
+		{ .fd = rdma.zombie_efd, .events = POLLIN },
+	};
+	struct ibv_wc wc[32];
+	struct ibv_cq *cq;
+	void *ctx;
+	int nr;
+
+	while (true) {
+		if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("poll failed, %m");
+		}
+
+		/* the channel fd is non-blocking */
+		while (ibv_get_cq_event(rdma.client_cc, &cq, &ctx) == 0) {
+			ibv_ack_cq_events(cq, 1);
+			if (ibv_req_notify_cq(cq, 0))
+				client_fail(ctx);
+
+			while ((nr = ibv_poll_cq(cq, ARRAY_SIZE(wc), wc)) > 0)
+				for (int i = 0; i < nr; i++)
+					client_complete(ctx, wc + i);
+		}
+
+		/* only this thread polls the CQs, so it destroys them */
+		if (pfds[1].revents & POLLIN)
+			reap_zombies();
+	}
+	return NULL;
+}
+
+static int wait_cm_event(struct rdma_event_channel *ch,
+			 enum rdma_cm_event_type expected)
+{
+	struct pollfd pfd = { .fd = ch->fd, .events = POLLIN };
+	struct rdma_cm_event *ev;
+	int ret, status;
+
+	ret = poll(&pfd, 1, RDMA_CONNECT_TIMEOUT);
+	if (ret <= 0) {
+		sd_debug("timeout waiting for %s", rdma_event_str(expected));
+		return -1;
+	}
+	if (rdma_get_cm_event(ch, &ev))
+		return -1;
+
+	ret = ev->event == expected ? 0 : -1;
+	status = ev->status;
+	if (ret)
+		sd_debug("got %s (%d) instead of %s",
+			 rdma_event_str(ev->event), status,
+			 rdma_event_str(expected));
+	rdma_ack_cm_event(ev);
+	return ret;
+}
+
+static int resolve_node(const struct node_id *nid, struct sockaddr_storage *ss)
+{
+	const uint8_t *addr = nid->io_port ? nid->io_addr : nid->addr;
+	int port = nid->io_port ? nid->io_port : nid->port;
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+		.ai_socktype = SOCK_STREAM,
+	}, *res;
+	char serv[8];
+	int ret;
+
+	snprintf(serv, sizeof(serv), "%d", port);
+	ret = getaddrinfo(addr_to_str(addr, 0), serv, &hints, &res);
+	if (ret) {
+		sd_err("failed to resolve %s, %s", addr_to_str(addr, port),
+		       gai_strerror(ret));
+		return -1;
+	}
+	memcpy(ss, res->ai_addr, res->ai_addrlen);
+	freeaddrinfo(res);
+	return 0;
+}
+
+static struct rdma_conn *client_connect(const struct node_id *nid)
+{
+	struct rdma_conn_param param = {
+		.responder_resources = rdma.rd_atomic,
+		.initiator_depth = rdma.rd_atomic,
+		.retry_count = 7,
+		.rnr_retry_count = 7,
+	};
+	struct rdma_event_channel *ch;
+	struct rdma_cm_id *id;
+	struct rdma_conn *conn;
+	struct sockaddr_storage ss;
+
+	if (resolve_node(nid, &ss) < 0)
+		return NULL;
+
+	ch = rdma_create_event_channel();
+	if (!ch) {
+		sd_err("failed to create an event channel, %m");
+		return NULL;
+	}
+	if (set_nonblocking(ch->fd) < 0)
+		goto err_ch;
+
+	if (rdma_create_id(ch, &id, NULL, RDMA_PS_TCP)) {
+		sd_err("failed to create an RDMA id, %m");
+		goto err_ch;
+	}
+
+	if (rdma_resolve_addr(id, NULL, (struct sockaddr *)&ss,
+			      RDMA_CONNECT_TIMEOUT) ||
+	    wait_cm_event(ch, RDMA_CM_EVENT_ADDR_RESOLVED) ||
+	    rdma_resolve_route(id, RDMA_CONNECT_TIMEOUT) ||
+	    wait_cm_event(ch, RDMA_CM_EVENT_ROUTE_RESOLVED))
+		goto err_id;
+
+	conn = create_conn(id, rdma.client_cc);
+	if (!conn)
+		goto err_id;
+	conn->ch = ch;
+	conn->nid = *nid;
+	conn->refcnt = 1; /* for the peer */
+
+	if (rdma_connect(id, &param) ||
+	    wait_cm_event(ch, RDMA_CM_EVENT_ESTABLISHED)) {
+		/* the rdma thread destroys it after the receives are flushed */
+		sd_mutex_lock(&conn->lock);
+		conn->dead = true;
+		conn->refcnt = 0;
+		kill_qp(conn);
+		client_try_destroy(conn);
+		sd_mutex_unlock(&conn->lock);
+		return NULL;
+	}
+
+	sd_info("RDMA connection to %s", addr_to_str(nid->addr, nid->port));
+	return conn;
+err_id:
+	rdma_destroy_id(id);
+err_ch:
+	rdma_destroy_event_channel(ch);
+	return NULL;
+}
+
+/* Get the connection to the node with a reference, or NULL to use TCP */
+static struct rdma_conn *get_conn(const struct node_id *nid)
+{
+	struct rdma_peer *peer, key = { .nid = *nid };
+	struct rdma_conn *conn = NULL;
+
+	sd_mutex_lock(&rdma.peers_lock);
+	peer = rb_search(&rdma.peers, &key, rb, peer_cmp);
+	if (!peer) {
+		peer = xzalloc(sizeof(*peer));
+		peer->nid = *nid;
+		rb_insert(&rdma.peers, peer, rb, peer_cmp);
+	}
+
+	if (peer->conn) {
+		conn = peer->conn;
+		sd_mutex_lock(&conn->lock);
+		conn->refcnt++;
+		sd_mutex_unlock(&conn->lock);
+		sd_mutex_unlock(&rdma.peers_lock);
+		return conn;
+	}
+
+	/* others use TCP while connecting or after a failure */
+	if (peer->connecting || clock_get_time() < peer->retry_after) {
+		sd_mutex_unlock(&rdma.peers_lock);
+		return NULL;
+	}
+	peer->connecting = true;
+	sd_mutex_unlock(&rdma.peers_lock);
+
+	conn = client_connect(nid);
+
+	sd_mutex_lock(&rdma.peers_lock);
+	peer->connecting = false;
+	if (conn) {
+		peer->conn = conn;
+		conn->refcnt++;
+	} else
+		peer->retry_after = clock_get_time() + RDMA_RETRY_INTERVAL;
+	sd_mutex_unlock(&rdma.peers_lock);
+
+	return conn;
+}
+
+static bool is_rdma_op(uint8_t opcode)
+{
+	switch (opcode) {
+	case SD_OP_CREATE_AND_WRITE_PEER:
+	case SD_OP_READ_PEER:
+	case SD_OP_WRITE_PEER:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Send the peer request over RDMA
+ *
+ * This works like sockfd_mux_send() with the data and the response data in
+ * the same registered buffer mreq->buf.  Return -1 if the request can't go
+ * over RDMA, in which case the caller should use TCP.  Otherwise the caller
+ * must call rdma_finish_req() when the request is done or it gives up.
+ */
+int rdma_send_req(const struct node_id *nid, struct sd_req *hdr,
+		  struct sockfd_mux_req *mreq)
+{
+	struct ibv_mr *mr = NULL;
+	struct rdma_conn *conn;
+	struct rdma_slot *slot;
+	struct rdma_msg *msg;
+	struct ibv_sge sge;
+	struct ibv_send_wr wr = {}, *bad;
+
+	if (!rdma.enabled || !is_rdma_op(hdr->opcode))
+		return -1;
+
+	if (hdr->data_length) {
+		mr = find_mr(mreq->buf, hdr->data_length);
+		if (!mr)
+			return -1;
+	}
+
+	conn = get_conn(nid);
+	if (!conn)
+		return -1;
+
+	sd_mutex_lock(&conn->lock);
+	if (conn->dead || conn->nr_inflight >= RDMA_QUEUE_DEPTH ||
+	    !(slot = get_send_slot(conn))) {
+		sd_mutex_unlock(&conn->lock);
+		rdma_conn_put(conn);
+		return -1;
+	}
+
+	hdr->id = mreq->id = conn->next_id++;
+	msg = slot->msg;
+	memcpy(&msg->hdr, hdr, sizeof(msg->hdr));
+	msg->addr = (uintptr_t)mreq->buf;
+	msg->rkey = mr ? mr->rkey : 0;
+	msg->len = hdr->data_length;
+
+	mreq->transport = conn;
+	mreq->efd = sockfd_mux_efd();
+	uatomic_set_false(&mreq->done);
+
+	sge.addr = (uintptr_t)msg;
+	sge.length = sizeof(*msg);
+	sge.lkey = conn->msgs_mr->lkey;
+	wr.wr_id = (uintptr_t)slot;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	if (ibv_post_send(conn->id->qp, &wr, &bad)) {
+		sd_err("failed to post a request, %m");
+		list_add(&slot->list, &conn->free_slots);
+		sd_mutex_unlock(&conn->lock);
+		client_fail(conn);
+		rdma_conn_put(conn);
+		return -1;
+	}
+	conn->nr_posted++;
+	list_add_tail(&mreq->list, &conn->inflight);
+	conn->nr_inflight++;
+	sd_mutex_unlock(&conn->lock);
+	return 0;
+}
+
+/*
+ * Release the request.  Giving up a pending request closes the connection,
+ * otherwise the late response data could overwrite the reused buffer.
+ */
+void rdma_finish_req(struct sockfd_mux_req *mreq)
+{
+	struct rdma_conn *conn = mreq->transport;
+
+	if (!sockfd_mux_done(mreq))
+		client_fail(conn);
+	rdma_conn_put(conn);
+	mreq->transport = NULL;
+}
+
+/* See sockfd_mux_rebind(), the completion reads efd under conn->lock */
+void rdma_rebind_req(struct sockfd_mux_req *mreq, int efd)
+{
+	struct rdma_conn *conn = mreq->transport;
+
+	sd_mutex_lock(&conn->lock);
+	mreq->efd = efd;
+	sd_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Execute the peer request over RDMA like exec_req()
+ *
+ * Return -1 if the request can't go over RDMA, otherwise 0 with the response
+ * in hdr, or 1 if the connection is broken.
+ */
+int rdma_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
+{
+	struct sockfd_mux_req mreq = { .buf = buf };
+	struct pollfd pfd;
+	int repeat = MAX_RETRY_COUNT, ret;
+
+	if (rdma_send_req(nid, hdr, &mreq) < 0)
+		return -1;
+
+	pfd.fd = mreq.efd;
+	pfd.events = POLLIN;
+	while (!sockfd_mux_done(&mreq)) {
+		ret = poll(&pfd, 1, 1000 * POLL_TIMEOUT);
+		if (ret > 0) {
+			eventfd_xread(pfd.fd);
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0 && sheep_need_retry(hdr->epoch) && repeat--)
+			continue;
+		sd_err("RDMA request %x timed out", hdr->opcode);
+		break;
+	}
+
+	ret = sockfd_mux_done(&mreq) &&
+		mreq.rsp.result != SD_RES_NETWORK_ERROR ? 0 : 1;
+	if (!ret)
+		memcpy(hdr, &mreq.rsp, sizeof(mreq.rsp));
+	rdma_finish_req(&mreq);
+	return ret;
+}
+
+static int init_listen(void)
+{
+	const struct node_id *nid = &sys->this_node.nid;
+	struct ibv_device_attr attr;
+	struct sockaddr_storage ss;
+
+	if (resolve_node(nid, &ss) < 0)
+		return -1;
+
+	rdma.listen_ch = rdma_create_event_channel();
+	if (!rdma.listen_ch) {
+		sd_err("failed to create an event channel, %m");
+		return -1;
+	}
+	if (set_nonblocking(rdma.listen_ch->fd) < 0)
+		return -1;
+
+	if (rdma_create_id(rdma.listen_ch, &rdma.listen_id, NULL,
+			   RDMA_PS_TCP)) {
+		sd_err("failed to create an RDMA id, %m");
+		return -1;
+	}
+
+	if (rdma_bind_addr(rdma.listen_id, (struct sockaddr *)&ss)) {
+		sd_err("failed to bind RDMA to %s, %m",
+		       addr_to_str(nid->io_port ? nid->io_addr : nid->addr,
+				   nid->io_port ?: nid->port));
+		return -1;
+	}
+
+	/* the device of the address is used for all the connections */
+	rdma.verbs = rdma.listen_id->verbs;
+	if (!rdma.verbs) {
+		sd_err("no RDMA device for the address");
+		return -1;
+	}
+	if (ibv_query_device(rdma.verbs, &attr)) {
+		sd_err("failed to query the RDMA device, %m");
+		return -1;
+	}
+	rdma.rd_atomic = min(attr.max_qp_rd_atom, attr.max_qp_init_rd_atom);
+	if (rdma.rd_atomic > RDMA_MAX_RD_ATOMIC)
+		rdma.rd_atomic = RDMA_MAX_RD_ATOMIC;
+
+	if (rdma_listen(rdma.listen_id, SOMAXCONN)) {
+		sd_err("failed to listen on RDMA, %m");
+		return -1;
+	}
+	return 0;
+}
+
+int rdma_init(void)
+{
+	int ret;
+
+	if (init_listen() < 0)
+		return -1;
+
+	rdma.pd = ibv_alloc_pd(rdma.verbs);
+	if (!rdma.pd) {
+		sd_err("failed to allocate a protection domain, %m");
+		return -1;
+	}
+
+	rdma.server_cc = ibv_create_comp_channel(rdma.verbs);
+	rdma.client_cc = ibv_create_comp_channel(rdma.verbs);
+	if (!rdma.server_cc || !rdma.client_cc) {
+		sd_err("failed to create a completion channel, %m");
+		return -1;
+	}
+	if (set_nonblocking(rdma.server_cc->fd) < 0 ||
+	    set_nonblocking(rdma.client_cc->fd) < 0)
+		return -1;
+
+	rdma.zombie_efd = eventfd(0, EFD_NONBLOCK);
+	if (rdma.zombie_efd < 0) {
+		sd_err("failed to create an eventfd, %m");
+		return -1;
+	}
+
+	if (register_event(rdma.listen_ch->fd, listen_handler, NULL) < 0 ||
+	    register_event(rdma.server_cc->fd, server_cq_handler, NULL) < 0) {
+		sd_err("failed to register RDMA event handlers");
+		return -1;
+	}
+
+	ret = sd_thread_create("rdma", &rdma.thread, rdma_routine, NULL);
+	if (ret) {
+		sd_err("failed to create the rdma thread, %s", strerror(ret));
+		return -1;
+	}
+
+	/* buffers allocated from now on are registered */
+	rdma.enabled = true;
+	sd_info("RDMA peer I/O enabled on %s",
+		ibv_get_device_name(rdma.verbs->device));
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reactors for client connections.
+ *
+ * Accepted client connections are hashed to one of the reactor threads.  Each
+ * reactor runs its own event loop, which receives the events of its
+ * connections and the completions of their rx/tx works, so the main thread
+ * doesn't see any per-connection event.
+ *
+ * Requests are still queued and completed in the main thread, which owns the
+ * global state like the current vnode info, the wait queues and the cluster
+ * status.  Threads hand requests over to each other by posting messages:
+ *
+ *   reactor                          main
+ *   rx_main()   -- request -->       queue_request()
+ *   tx          <-- request --       put_request()
+ *
+ * so a client_info is only touched by its reactor and a request is only
+ * touched by the main thread and the works between queue_request() and
+ * put_request().
+ */
+
+#include "sheep_priv.h"
+
+#define REACTOR_EPOLL_SIZE 4096
+
+struct mailbox {
+	int efd;
+	struct sd_mutex lock;
+	struct list_head list;
+};
+
+struct reactor {
+	int idx;
+	sd_thread_t thread;
+	struct mailbox mbox;
+};
+
+static struct mailbox main_mbox;
+static struct reactor *reactors;
+static int nr_reactors;
+
+static void mailbox_handler(int fd, int events, void *data)
+{
+	struct mailbox *mbox = data;
+	struct reactor_msg *msg;
+	LIST_HEAD(list);
+
+	eventfd_xread(fd);
+
+	sd_mutex_lock(&mbox->lock);
+	list_splice_init(&mbox->list, &list);
+	sd_mutex_unlock(&mbox->lock);
+
+	list_for_each_entry(msg, &list, list) {
+		list_del(&msg->list);
+		msg->fn(msg);
+	}
+}
+
+static int init_mailbox(struct mailbox *mbox)
+{
+	mbox->efd = eventfd(0, EFD_NONBLOCK);
+	if (mbox->efd < 0) {
+		sd_err("failed to create event fd: %m");
+		return -1;
+	}
+
+	sd_init_mutex(&mbox->lock);
+	INIT_LIST_HEAD(&mbox->list);
+	return 0;
+}
+
+/* Run msg->fn in the reactor r, or in the main thread if r is NULL */
+void reactor_post(struct reactor *r, struct reactor_msg *msg)
+{
+	struct mailbox *mbox = r ? &r->mbox : &main_mbox;
+
+	sd_mutex_lock(&mbox->lock);
+	list_add_tail(&msg->list, &mbox->list);
+	sd_mutex_unlock(&mbox->lock);
+
+	eventfd_xwrite(mbox->efd, 1);
+}
+
+/* Let the main thread re-evaluate its loop condition, e.g. at shutdown */
+void reactor_wakeup_main(void)
+{
+	eventfd_xwrite(main_mbox.efd, 1);
+}
+
+/* Return the reactor handling the connection, or NULL if there is none */
+struct reactor *fd_to_reactor(int fd)
+{
+	if (!nr_reactors)
+		return NULL;
+
+	return reactors + fd % nr_reactors;
+}
+
+static void *reactor_routine(void *arg)
+{
+	struct reactor *r = arg;
+
+	if (init_event(REACTOR_EPOLL_SIZE) < 0)
+		panic("failed to init event loop of reactor %d", r->idx);
+
+	if (init_work_done_port() < 0)
+		panic("failed to init work queue of reactor %d", r->idx);
+
+	if (register_event(r->mbox.efd, mailbox_handler, &r->mbox) < 0)
+		panic("failed to register mailbox of reactor %d", r->idx);
+
+	sd_debug("reactor %d started", r->idx);
+	while (true)
+		event_loop(-1);
+
+	return NULL;
+}
+
+main_fn int init_reactors(int nr)
+{
+	int ret;
+
+	if (init_mailbox(&main_mbox) < 0)
+		return -1;
+
+	ret = register_event(main_mbox.efd, mailbox_handler, &main_mbox);
+	if (ret) {
+		sd_err("failed to register mailbox of main thread");
+		return -1;
+	}
+
+	reactors = xcalloc(nr, sizeof(*reactors));
+	for (int i = 0; i < nr; i++) {
+		struct reactor *r = reactors + i;
+
+		r->idx = i;
+		if (init_mailbox(&r->mbox) < 0)
+			return -1;
+
+		ret = sd_thread_create_with_idx("reactor", &r->thread,
+						reactor_routine, r);
+		if (ret) {
+			sd_err("failed to create reactor thread: %s",
+			       strerror(ret));
+			return -1;
+		}
+	}
+
+	/* Connections are only hashed after all the reactors are created */
+	nr_reactors = nr;
+	sd_info("%d reactors for client connections", nr);
+	return 0;
+}
@@ -30,14 +30,47 @@ struct recovery_list_work {
 
 	uint64_t count;
 	uint64_t *oids;
+
+	/* the checkpointed list, see recovery_ckpt_load() */
+	uint64_t gen;
+	uint64_t nr_done; /* the first ones of oids */
+	uint64_t *prio;
+	uint64_t nr_prio;
 };
 
+/* The most objects a recovery work reads from a node at once */
+#define RECOVERY_BATCH 8
+
 /* for recovering objects */
 struct recovery_obj_work {
 	struct recovery_work base;
 
 	uint64_t oid; /* the object to be recovered */
 	bool stop;
+	bool prio; /* a request waits for it */
+
+	/* the objects of the work from the same source, see fill_batch() */
+	uint64_t batch[RECOVERY_BATCH];
+	int nr_batch;
+};
+
+/*
+ * A hash set of oids with a state each, probed linearly from the hash of an
+ * oid.  A slot is empty if its oid is 0.
+ */
+struct oid_set {
+	uint64_t *oids;
+	uint8_t *states;
+	uint64_t mask;
+	uint64_t nr;
+};
+
+/* The states of the objects of the list to recover */
+enum oid_state {
+	OID_PENDING,
+	OID_SCHEDULED, /* moved up in the list for a request */
+	OID_RECOVERING,
+	OID_RECOVERED,
 };
 
 /*
@@ -63,6 +96,10 @@ struct recovery_info {
 	uint64_t nr_prio_oids;
 	uint64_t nr_scheduled_prio_oids;
 
+	/* the states of oids and the set of prio_oids, see oid_slot() */
+	struct oid_set states;
+	struct oid_set prio_set;
+
 	struct vnode_info *old_vinfo;
 	struct vnode_info *cur_vinfo;
 
@@ -71,60 +108,174 @@ struct recovery_info {
 	struct sd_mutex vinfo_lock;
 
 	uint32_t recover_threads;
+
+	/* the generation of the checkpointed list and the state saved */
+	uint64_t ckpt_gen;
+	uint64_t ckpt_done;
+	uint64_t ckpt_nr_prio;
 };
 
 static struct recovery_info *next_rinfo;
 static main_thread(struct recovery_info *) current_rinfo;
 
+/*
+ * Token buckets of the recovery bytes and objects.  The tokens are taken
+ * before an object is recovered and may go below zero for a large object, and
+ * the next one waits until the debt is paid.  The rates are lowered while the
+ * gateway serves the client I/O, by half with RECOVERY_ADAPT_DEPTH requests in
+ * flight.
+ */
+#define RECOVERY_ADAPT_DEPTH	8
+#define RECOVERY_MAX_WAIT	100000 /* us */
+
+static struct recovery_bucket {
+	struct sd_mutex lock; /* Protects the below */
+	struct recovery_throttle limit;
+	double bytes, objs; /* Tokens */
+	uint64_t last; /* When the tokens were refilled, in ns */
+} bucket = {
+	.lock = SD_MUTEX_INITIALIZER,
+};
+
 static void queue_recovery_work(struct recovery_info *rinfo);
+static void recover_next_object(struct recovery_info *rinfo);
+
+static void oid_set_free(struct oid_set *set)
+{
+	free_tag(set->oids, SD_MEM_RECOVERY);
+	free_tag(set->states, SD_MEM_RECOVERY);
+	memset(set, 0, sizeof(*set));
+}
+
+/* The slot of oid, or the empty one where it would go */
+static uint64_t oid_slot(const struct oid_set *set, uint64_t oid)
+{
+	uint64_t i = sd_hash_oid(oid) & set->mask;
+
+	while (set->oids[i] && set->oids[i] != oid)
+		i = (i + 1) & set->mask;
+	return i;
+}
+
+static void oid_set_grow(struct oid_set *set, uint64_t nr)
+{
+	struct oid_set old = *set;
+	uint64_t size = 16;
+
+	/* at most half full */
+	while (size < nr * 2)
+		size <<= 1;
+	if (size <= old.mask + 1 && old.oids)
+		return;
+
+	set->oids = xzalloc_tag(size * sizeof(*set->oids), SD_MEM_RECOVERY);
+	set->states = xzalloc_tag(size, SD_MEM_RECOVERY);
+	set->mask = size - 1;
+	for (uint64_t i = 0; old.oids && i <= old.mask; i++)
+		if (old.oids[i]) {
+			uint64_t s = oid_slot(set, old.oids[i]);
+
+			set->oids[s] = old.oids[i];
+			set->states[s] = old.states[i];
+		}
+	free_tag(old.oids, SD_MEM_RECOVERY);
+	free_tag(old.states, SD_MEM_RECOVERY);
+}
+
+static void oid_set_add(struct oid_set *set, uint64_t oid,
+			enum oid_state state)
+{
+	uint64_t s;
+
+	oid_set_grow(set, set->nr + 1);
+	s = oid_slot(set, oid);
+	if (!set->oids[s]) {
+		set->oids[s] = oid;
+		set->nr++;
+	}
+	set->states[s] = state;
+}
+
+static bool oid_set_lookup(const struct oid_set *set, uint64_t oid,
+			   enum oid_state *state)
+{
+	uint64_t s;
+
+	if (!set->oids)
+		return false;
+	s = oid_slot(set, oid);
+	if (!set->oids[s])
+		return false;
+	if (state)
+		*state = set->states[s];
+	return true;
+}
 
 /* Dynamically grown list buffer default as 4M (2T storage) */
 #define DEFAULT_LIST_BUFFER_SIZE (UINT64_C(1) << 22)
 static size_t list_buffer_size = DEFAULT_LIST_BUFFER_SIZE;
 
-static int obj_cmp(const uint64_t *oid1, const uint64_t *oid2)
+static inline bool node_is_gateway_only(void)
 {
-	return intcmp(*oid1, *oid2);
+	return sys->this_node.nr_vnodes == 0;
 }
 
-static inline bool node_is_gateway_only(void)
+static struct vnode_info *grab_epoch_vnode_info(uint32_t epoch,
+						struct recovery_info *rinfo,
+						struct vnode_info *cur)
 {
-	return sys->this_node.nr_vnodes == 0;
+	struct sd_node nodes[SD_MAX_NODES];
+	int nr_nodes;
+	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *next;
+
+	/* the rollbacks of the objects go down the same epochs */
+	if (uatomic_read(&rinfo->vinfo_array[epoch]))
+		goto out;
+
+	nr_nodes = get_nodes_epoch(epoch, cur, nodes, sizeof(nodes));
+	if (!nr_nodes)
+		return NULL;
+
+	/* double check */
+	if (rinfo->vinfo_array[epoch] == NULL) {
+		sd_mutex_lock(&rinfo->vinfo_lock);
+		if (rinfo->vinfo_array[epoch] == NULL) {
+			for (int i = 0; i < nr_nodes; i++)
+				rb_insert(&nroot, &nodes[i], rb, node_cmp);
+			/* the ring of the next epoch is mostly the same */
+			next = epoch + 1 < rinfo->max_epoch ?
+				rinfo->vinfo_array[epoch + 1] : NULL;
+			rinfo->vinfo_array[epoch] =
+				rebuild_vnode_info(&nroot, next ?: cur);
+		}
+		sd_mutex_unlock(&rinfo->vinfo_lock);
+	}
+out:
+	grab_vnode_info(rinfo->vinfo_array[epoch]);
+	return rinfo->vinfo_array[epoch];
 }
 
 static struct vnode_info *rollback_vnode_info(uint32_t *epoch,
 					      struct recovery_info *rinfo,
 					      struct vnode_info *cur)
 {
-	struct sd_node nodes[SD_MAX_NODES];
-	int nr_nodes;
-	struct rb_root nroot = RB_ROOT;
+	struct vnode_info *vinfo;
 
 rollback:
 	*epoch -= 1;
 	if (!*epoch)
 		return NULL;
 
-	nr_nodes = get_nodes_epoch(*epoch, cur, nodes, sizeof(nodes));
-	if (!nr_nodes) {
+	vinfo = grab_epoch_vnode_info(*epoch, rinfo, cur);
+	if (!vinfo) {
 		/* We rollback in case we don't get a valid epoch */
 		sd_alert("cannot get epoch %d", *epoch);
 		sd_alert("clients may see old data");
 
 		goto rollback;
 	}
-	/* double check */
-	if (rinfo->vinfo_array[*epoch] == NULL) {
-		sd_mutex_lock(&rinfo->vinfo_lock);
-		if (rinfo->vinfo_array[*epoch] == NULL) {
-			for (int i = 0; i < nr_nodes; i++)
-				rb_insert(&nroot, &nodes[i], rb, node_cmp);
-			rinfo->vinfo_array[*epoch] = alloc_vnode_info(&nroot);
-		}
-		sd_mutex_unlock(&rinfo->vinfo_lock);
-	}
-	grab_vnode_info(rinfo->vinfo_array[*epoch]);
-	return rinfo->vinfo_array[*epoch];
+	return vinfo;
 }
 
 /*
@@ -196,7 +347,7 @@ again:
 		else
 			goto rollback;
 	}
-	node = oid_to_node(oid, &old->vroot, idx);
+	node = vinfo_oid_to_node(old, oid, idx);
 	sd_debug("%"PRIx64" epoch %"PRIu32" tgt %"PRIu32" idx %d, %s",
 		 oid, epoch, tgt_epoch, idx, node_to_str(node));
 	if (invalid_node(node, rw->cur_vinfo))
@@ -243,11 +394,125 @@ done:
 	return buf;
 }
 
+/*
+ * With dedup, take the blocks of the object which are on the local disks from
+ * them and fetch the others only.  Return SD_RES_NO_SUPPORT to fetch the whole
+ * object.
+ */
+static int recover_blocks_local(uint64_t oid, const struct sd_node *node,
+				uint32_t epoch, uint32_t tgt_epoch, char *buf)
+{
+	uint8_t digests[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint32_t bsize = get_store_objsize(oid) / SD_BLOCK_HASH_NR;
+	bool local[SD_BLOCK_HASH_NR];
+	struct sd_req hdr;
+	int ret, nr = 0;
+
+	if (!sys->dedup || !is_data_obj(oid) || is_erasure_oid(oid))
+		return SD_RES_NO_SUPPORT;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.epoch = epoch;
+	hdr.data_length = sizeof(digests);
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+	if (sheep_exec_req(&node->nid, &hdr, digests) != SD_RES_SUCCESS)
+		return SD_RES_NO_SUPPORT;
+
+	for (int i = 0; i < SD_BLOCK_HASH_NR; i++) {
+		local[i] = dedup_read_block(digests[i], buf + i * bsize, bsize);
+		nr += local[i];
+	}
+	/* e.g. a compressed replica is better fetched as it is */
+	if (!nr)
+		return SD_RES_NO_SUPPORT;
+
+	for (int i = 0; i < SD_BLOCK_HASH_NR; i++) {
+		if (local[i])
+			continue;
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.data_length = bsize;
+		hdr.obj.oid = oid;
+		hdr.obj.offset = (uint64_t)i * bsize;
+		hdr.obj.tgt_epoch = tgt_epoch;
+		ret = sheep_exec_req(&node->nid, &hdr, buf + i * bsize);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	sd_debug("recovered %d blocks of %"PRIx64" from the local disks", nr,
+		 oid);
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Fetch the object from the remote replica into *buf, without sending the
+ * holes, and as it is if it's compressed
+ */
+static int fetch_object(uint64_t oid, const struct sd_node *node,
+			uint32_t epoch, uint32_t tgt_epoch, void **buf,
+			struct siocb *iocb)
+{
+	unsigned rlen = get_store_objsize(oid);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	bool old_peer = false;
+	int ret;
+
+again:
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	if (!old_peer) {
+		hdr.flags |= SD_FLAG_CMD_SPARSE;
+		if (sd_store->read_compressed && compress_supported(oid))
+			hdr.flags |= SD_FLAG_CMD_COMPRESS;
+		if (wire_deflate_to(node))
+			hdr.flags |= SD_FLAG_CMD_DEFLATE;
+	}
+	hdr.data_length = rlen;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+
+	ret = sheep_exec_req(&node->nid, &hdr, *buf);
+	/* a sheep of an older version drops us on the flags it doesn't know */
+	if (!old_peer && sheep_op_unknown(ret)) {
+		old_peer = true;
+		goto again;
+	}
+	if (ret == SD_RES_SUCCESS)
+		ret = wire_inflate_reply(rsp, *buf, rlen);
+	if (ret == SD_RES_SUCCESS && (rsp->flags & SD_FLAG_CMD_SPARSE)) {
+		size_t len = (rsp->flags & SD_FLAG_CMD_COMPRESS) ?
+			compress_file_size(oid) : rlen;
+		void *dense = xvalloc(len);
+
+		if (sparse_decode(*buf, rsp->data_length, dense, len) < 0) {
+			sd_err("corrupted sparse data of %"PRIx64, oid);
+			free(dense);
+			ret = SD_RES_EIO;
+		} else {
+			free(*buf);
+			*buf = dense;
+			rsp->data_length = len;
+		}
+	}
+	if (ret == SD_RES_SUCCESS) {
+		iocb->length = rsp->data_length;
+		iocb->offset = rsp->obj.offset;
+		iocb->raw = !!(rsp->flags & SD_FLAG_CMD_COMPRESS);
+	}
+
+	return ret;
+}
+
 /*
  * Read object from targeted node and store it in the local node.
  *
  * tgt_epoch: the specific epoch that the object has stayed
- * idx: erasure index. For non-erasure object, pass 0.
  */
 static int recover_object_from(struct recovery_obj_work *row,
 			       const struct sd_node *node,
@@ -258,13 +523,11 @@ static int recover_object_from(struct recovery_obj_work *row,
 	int ret;
 	unsigned rlen;
 	void *buf = NULL;
-	struct sd_req hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	struct siocb iocb = { 0 };
 
 	if (node_is_local(node)) {
 		if (tgt_epoch < sys_epoch())
-			return sd_store->link(oid, tgt_epoch);
+			return sd_store->link(oid, 0, tgt_epoch);
 
 		return SD_RES_NO_OBJ;
 	}
@@ -272,19 +535,13 @@ static int recover_object_from(struct recovery_obj_work *row,
 	rlen = get_store_objsize(oid);
 	buf = xvalloc(rlen);
 
-	/* recover from remote replica */
-	sd_init_req(&hdr, SD_OP_READ_PEER);
-	hdr.epoch = epoch;
-	hdr.flags = SD_FLAG_CMD_RECOVERY;
-	hdr.data_length = rlen;
-	hdr.obj.oid = oid;
-	hdr.obj.tgt_epoch = tgt_epoch;
-
-	ret = sheep_exec_req(&node->nid, &hdr, buf);
+	ret = recover_blocks_local(oid, node, epoch, tgt_epoch, buf);
+	if (ret == SD_RES_SUCCESS)
+		iocb.length = rlen;
+	else if (ret == SD_RES_NO_SUPPORT)
+		ret = fetch_object(oid, node, epoch, tgt_epoch, &buf, &iocb);
 	if (ret == SD_RES_SUCCESS) {
 		iocb.epoch = epoch;
-		iocb.length = rsp->data_length;
-		iocb.offset = rsp->obj.offset;
 		iocb.buf = buf;
 		ret = sd_store->create_and_write(oid, &iocb);
 	}
@@ -293,13 +550,50 @@ static int recover_object_from(struct recovery_obj_work *row,
 	return ret;
 }
 
-static void get_targeted_nodes(uint64_t oid, struct rb_root *vroot,
+/*
+ * Sort the copies by the distance in the topology, so that the recovery reads
+ * from our zone or rack rather than across the spine, and then by the expected
+ * time to serve the read, as the balanced read of the gateway does, so that
+ * the recovery threads don't all read from the first copy of the objects.  The
+ * ties, e.g. the nodes we haven't talked to, are rotated by oid.
+ */
+static void spread_targeted_nodes(uint64_t oid, const struct sd_node *nodes[],
+				  int nr)
+{
+	const struct sd_node *sorted[SD_MAX_COPIES];
+	uint64_t cost[SD_MAX_COPIES];
+	struct sockfd_load load;
+	int i, j, start;
+
+	if (nr < 2)
+		return;
+
+	start = sd_hash_oid(oid) % nr;
+	for (i = 0; i < nr; i++) {
+		const struct sd_node *n = nodes[(start + i) % nr];
+		uint64_t c;
+
+		sockfd_cache_get_load(&n->nid, &load);
+		c = min(load.latency * (load.nr_inflight + 1),
+			(uint64_t)UINT32_MAX);
+		c |= (uint64_t)node_distance(n) << 32;
+		for (j = i; j > 0 && cost[j - 1] > c; j--) {
+			sorted[j] = sorted[j - 1];
+			cost[j] = cost[j - 1];
+		}
+		sorted[j] = n;
+		cost[j] = c;
+	}
+	memcpy(nodes, sorted, sizeof(*nodes) * nr);
+}
+
+static void get_targeted_nodes(uint64_t oid, const struct vnode_info *vinfo,
 			       int nr_copies, const struct sd_node *ret_nodes[])
 {
 	const struct sd_node *target_nodes[SD_MAX_COPIES];
 	int i, j = 0;
 
-	oid_to_nodes(oid, vroot, nr_copies, target_nodes);
+	vinfo_oid_to_nodes(vinfo, oid, nr_copies, target_nodes);
 
 	if (sys->cinfo.flags & SD_CLUSTER_FLAG_MANUAL) {
 		for (i = 0; i < nr_copies; i++) {
@@ -330,6 +624,47 @@ static void get_targeted_nodes(uint64_t oid, struct rb_root *vroot,
 		}
 		ret_nodes[j++] = node;
 	}
+
+	if (j && node_is_local(ret_nodes[0]))
+		spread_targeted_nodes(oid, ret_nodes + 1, j - 1);
+	else
+		spread_targeted_nodes(oid, ret_nodes, j);
+}
+
+/*
+ * The node to read the replicated object from along with the others of the
+ * same node, the nearest copy in the topology, rotated by oid among the equal
+ * ones.  NULL if the object is read on its own, e.g. when we hold a copy or it
+ * isn't read as it is.  The placement is looked up in the flat vnode array, as
+ * screen_object() does.
+ */
+static const struct sd_node *batch_source(const struct vnode_info *old,
+					  struct vnode_info *cur, uint64_t oid)
+{
+	const struct sd_node *best = NULL;
+	uint32_t idxs[SD_MAX_COPIES];
+	int nr_copies, start, dist = INT_MAX;
+
+	if (is_erasure_oid(oid) || !old->varray.nr || sys->dedup ||
+	    sys->cinfo.flags & SD_CLUSTER_FLAG_MANUAL ||
+	    (sd_store->read_compressed && compress_supported(oid)))
+		return NULL;
+
+	nr_copies = get_obj_copy_number(oid, old->nr_zones);
+	vnode_array_to_idx(&old->varray, oid, nr_copies, idxs);
+	start = sd_hash_oid(oid) % nr_copies;
+	for (int i = 0; i < nr_copies; i++) {
+		const struct sd_node *n =
+			old->varray.vnodes[idxs[(start + i) % nr_copies]]->node;
+
+		if (node_is_local(n))
+			return NULL;
+		if (invalid_node(n, cur) || node_distance(n) >= dist)
+			continue;
+		best = n;
+		dist = node_distance(n);
+	}
+	return best;
 }
 
 static int recover_object_from_replica(struct recovery_obj_work *row,
@@ -343,7 +678,7 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
 	const struct sd_node *nodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, old->nr_zones);
-	get_targeted_nodes(oid, &old->vroot, nr_copies, nodes);
+	get_targeted_nodes(oid, old, nr_copies, nodes);
 
 	/* Let's do a breadth-first search */
 	for (int i = 0; i < nr_copies; i++) {
@@ -386,6 +721,81 @@ static int recover_object_from_replica(struct recovery_obj_work *row,
  * the routine will try to recovery it from the nodes it has stayed,
  * at least, *theoretically* on consistent hash ring.
  */
+static bool oid_held_at_epoch(uint64_t oid, uint32_t epoch,
+			      struct recovery_work *rw)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	struct vnode_info *vinfo;
+	int nr_copies;
+	bool held = false;
+
+	vinfo = grab_epoch_vnode_info(epoch, rw->rinfo, rw->cur_vinfo);
+	if (!vinfo)
+		return false;
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_nodes(vinfo, oid, nr_copies, nodes);
+	for (int i = 0; i < nr_copies; i++)
+		if (node_is_local(nodes[i]))
+			held = true;
+
+	put_vnode_info(vinfo);
+	return held;
+}
+
+/*
+ * A node joining back after crash has moved its objects to the stale
+ * directory at sys->purged_epoch.  If it held a replica at that epoch and
+ * neither its copy nor any current replica has been written since the epoch
+ * started, link the stale copy instead of reading the object from a peer.
+ */
+static int reuse_purged_object(struct recovery_obj_work *row)
+{
+	struct recovery_work *rw = &row->base;
+	uint64_t oid = row->oid;
+	uint32_t purged_epoch = sys->purged_epoch;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int nr_copies, nr_peers = 0, ret;
+	struct sd_req hdr;
+
+	if (!purged_epoch || !sd_store->check_unchanged)
+		return SD_RES_NO_SUPPORT;
+
+	if (!oid_held_at_epoch(oid, purged_epoch, rw))
+		return SD_RES_NO_OBJ;
+
+	ret = sd_store->check_unchanged(oid, purged_epoch, true);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	nr_copies = get_obj_copy_number(oid, rw->cur_vinfo->nr_zones);
+	vinfo_oid_to_nodes(rw->cur_vinfo, oid, nr_copies, nodes);
+	for (int i = 0; i < nr_copies; i++) {
+		if (node_is_local(nodes[i]))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_OBJ_UNCHANGED_PEER);
+		hdr.epoch = rw->epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.obj.oid = oid;
+		hdr.obj.tgt_epoch = purged_epoch;
+		ret = sheep_exec_req(&nodes[i]->nid, &hdr, NULL);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		nr_peers++;
+	}
+
+	/* Nobody can tell whether the stale copy is the latest one */
+	if (!nr_peers)
+		return SD_RES_NO_OBJ;
+
+	ret = sd_store->link(oid, 0, purged_epoch);
+	if (ret == SD_RES_SUCCESS)
+		sd_debug("reused %"PRIx64" purged at epoch %"PRIu32, oid,
+			 purged_epoch);
+	return ret;
+}
+
 static int recover_replication_object(struct recovery_obj_work *row)
 {
 	struct recovery_work *rw = &row->base;
@@ -395,6 +805,9 @@ static int recover_replication_object(struct recovery_obj_work *row)
 	int ret;
 	struct vnode_info *new_old;
 
+	if (reuse_purged_object(row) == SD_RES_SUCCESS)
+		return SD_RES_SUCCESS;
+
 	old = grab_vnode_info(rw->old_vinfo);
 again:
 	sd_debug("try recover object %"PRIx64" from epoch %"PRIu32, oid,
@@ -442,6 +855,157 @@ out:
 	return ret;
 }
 
+/*
+ * Read ed strips other than the lost one from the nodes of the current target
+ * epoch at once.  The strips which fail are left NULL for read_erasure_object()
+ * to search the older epochs.
+ */
+static void read_erasure_strips(uint64_t oid, uint8_t lost, int ed, int edp,
+				struct recovery_obj_work *row, uint8_t **strips)
+{
+	struct recovery_work *rw = &row->base;
+	struct vnode_info *old = rw->old_vinfo;
+	struct sockfd_mux_req mreqs[SD_MAX_COPIES];
+	bool pending[SD_MAX_COPIES] = { false };
+	struct pollfd pfd = { .fd = sockfd_mux_efd(), .events = POLLIN };
+	unsigned rlen = get_store_objsize(oid);
+	int i, ret, nr_sent = 0, nr_pending = 0, repeat = MAX_RETRY_COUNT;
+
+	/* the strips are not placed by idx on such a small cluster */
+	if (old->nr_zones < edp)
+		return;
+
+	for (i = 0; i < edp && nr_sent < ed; i++) {
+		const struct sd_node *node = vinfo_oid_to_node(old, oid, i);
+		struct sd_req hdr;
+
+		if (i == lost || invalid_node(node, rw->cur_vinfo))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = rw->epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.data_length = rlen;
+		hdr.obj.oid = oid;
+		hdr.obj.tgt_epoch = rw->tgt_epoch;
+		hdr.obj.ec_index = i;
+
+		strips[i] = xvalloc(rlen);
+		mreqs[i].buf = strips[i];
+		mreqs[i].buf_len = rlen;
+		mreqs[i].transport = NULL;
+		if (sockfd_mux_send(&node->nid, &hdr, NULL, 0, false,
+				    sheep_need_retry, rw->epoch, &mreqs[i])) {
+			free(strips[i]);
+			strips[i] = NULL;
+			continue;
+		}
+		pending[i] = true;
+		nr_sent++;
+		nr_pending++;
+	}
+
+	while (nr_pending) {
+		for (i = 0; i < edp; i++) {
+			if (!pending[i] || !sockfd_mux_done(&mreqs[i]))
+				continue;
+
+			ret = mreqs[i].rsp.result;
+			if (ret != SD_RES_SUCCESS) {
+				sd_debug("%"PRIx64" idx %d, %s", oid, i,
+					 sd_strerror(ret));
+				if (ret == SD_RES_OLD_NODE_VER)
+					row->stop = true;
+				free(strips[i]);
+				strips[i] = NULL;
+			}
+			sockfd_mux_finish(&mreqs[i]);
+			pending[i] = false;
+			nr_pending--;
+		}
+		if (!nr_pending)
+			break;
+
+		ret = poll(&pfd, 1, 1000 * POLL_TIMEOUT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("%m");
+		} else if (ret == 0) {
+			if (sheep_need_retry(rw->epoch) && repeat) {
+				repeat--;
+				continue;
+			}
+
+			for (i = 0; i < edp; i++) {
+				if (!pending[i])
+					continue;
+				sockfd_mux_finish(&mreqs[i]);
+				free(strips[i]);
+				strips[i] = NULL;
+			}
+			break;
+		}
+		eventfd_xread(pfd.fd);
+	}
+}
+
+/*
+ * Read the lost strip summed up by a chain of the nodes of ed other strips of
+ * the current target epoch, see peer_read_partial(), so we receive one strip
+ * instead of ed of them.
+ */
+static int read_partial_sum(uint64_t oid, uint8_t lost, int ed, int edp,
+			    struct recovery_obj_work *row, void *buf)
+{
+	struct recovery_work *rw = &row->base;
+	struct vnode_info *old = rw->old_vinfo;
+	const struct sd_node *node = NULL;
+	uint32_t strips = 0;
+	struct sd_req hdr;
+	int nr = 0, ret;
+
+	/* the strips are not placed by idx on such a small cluster */
+	if (old->nr_zones < edp)
+		return SD_RES_NO_OBJ;
+
+	for (int i = 0; i < edp && nr < ed; i++) {
+		const struct sd_node *n = vinfo_oid_to_node(old, oid, i);
+
+		if (i == lost || invalid_node(n, rw->cur_vinfo))
+			continue;
+		strips |= 1U << i;
+		node = n;
+		nr++;
+	}
+	if (nr < ed)
+		return SD_RES_NO_OBJ;
+
+	sd_init_req(&hdr, SD_OP_READ_PARTIAL);
+	hdr.epoch = rw->epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.data_length = get_store_objsize(oid);
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = rw->tgt_epoch;
+	hdr.obj.ec_index = lost;
+	hdr.obj.strips = strips;
+	hdr.obj.chain = strips;
+
+	/* the chain starts from the node of the highest strip */
+	ret = sheep_exec_req(&node->nid, &hdr, buf);
+	if (ret != SD_RES_SUCCESS) {
+		sd_debug("%"PRIx64" idx %d, %s", oid, lost, sd_strerror(ret));
+		if (ret == SD_RES_OLD_NODE_VER)
+			row->stop = true;
+	}
+	return ret;
+}
+
+/*
+ * The code works byte by byte and a strip of every stripe sits at the same
+ * offset in each replica, so the lost replica is rebuilt as a whole whatever
+ * the stripe size of the vdi is.
+ */
 static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 				    struct recovery_obj_work *row)
 {
@@ -452,6 +1016,7 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 	int ed = 0, edp;
 	edp = ec_policy_to_dp(policy, &ed, NULL);
 	struct fec *ctx = ec_init(ed, edp);
+	uint8_t *strips[SD_MAX_COPIES] = { NULL };
 	uint8_t *bufs[ed];
 	int idxs[ed];
 
@@ -460,15 +1025,21 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 		idxs[i] = 0;
 	}
 
-	/* Prepare replica */
-	for (i = 0, j = 0; i < edp && j < ed; i++) {
-		if (i == idx)
+	if (read_partial_sum(oid, idx, ed, edp, row, lost) == SD_RES_SUCCESS)
+		goto out;
+
+	/* Prepare replica, the peers may not sum the strips */
+	read_erasure_strips(oid, idx, ed, edp, row, strips);
+	for (i = 0, j = 0; i < edp && j < ed && !row->stop; i++) {
+		if (i == idx)
 			continue;
-		bufs[j] = read_erasure_object(oid, i, row);
+		if (!strips[i])
+			strips[i] = read_erasure_object(oid, i, row);
 		if (row->stop)
 			break;
-		if (!bufs[j])
+		if (!strips[i])
 			continue;
+		bufs[j] = strips[i];
 		idxs[j++] = i;
 	}
 	if (j != ed) {
@@ -481,8 +1052,8 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 	ec_decode_buffer(ctx, bufs, idxs, lost, idx);
 out:
 	ec_destroy(ctx);
-	for (i = 0; i < ed; i++)
-		free(bufs[i]);
+	for (i = 0; i < edp; i++)
+		free(strips[i]);
 	return lost;
 }
 
@@ -494,7 +1065,7 @@ uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid)
 		return SD_MAX_COPIES;
 
 	for (idx = 0; idx < m; idx++) {
-		const struct sd_node *n = oid_to_node(oid, &vinfo->vroot, idx);
+		const struct sd_node *n = vinfo_oid_to_node(vinfo, oid, idx);
 		if (node_is_local(n))
 			return idx;
 	}
@@ -561,6 +1132,143 @@ static int do_recover_object(struct recovery_obj_work *row)
 		return recover_replication_object(row);
 }
 
+void set_recovery_throttle(const struct recovery_throttle *t)
+{
+	sd_mutex_lock(&bucket.lock);
+	bucket.limit = *t;
+	bucket.bytes = 0;
+	bucket.objs = 0;
+	bucket.last = clock_get_time();
+	sd_mutex_unlock(&bucket.lock);
+
+	sd_info("recovery throttle %"PRIu64" bytes/s, %"PRIu32" objects/s",
+		t->max_bw, t->max_objs);
+}
+
+/* Refill a bucket of rate tokens per second, which holds a second of them */
+static void refill_tokens(double *tokens, double rate, double elapsed)
+{
+	*tokens = min(*tokens + rate * elapsed, rate);
+}
+
+/* Wait for the tokens to recover len bytes */
+static void throttle_recovery(size_t len)
+{
+	sd_mutex_lock(&bucket.lock);
+	for (;;) {
+		uint64_t depth = uatomic_read(&sys->stat.r.gway_active_nr);
+		double scale = (double)RECOVERY_ADAPT_DEPTH /
+			(RECOVERY_ADAPT_DEPTH + depth);
+		double bw = bucket.limit.max_bw * scale;
+		double objs = bucket.limit.max_objs * scale;
+		uint64_t now = clock_get_time();
+		double elapsed = (now - bucket.last) / 1e9, wait = 0;
+
+		bucket.last = now;
+		if (bw)
+			refill_tokens(&bucket.bytes, bw, elapsed);
+		if (objs)
+			refill_tokens(&bucket.objs, objs, elapsed);
+
+		if ((!bw || bucket.bytes >= 0) && (!objs || bucket.objs >= 0)) {
+			if (bw)
+				bucket.bytes -= len;
+			if (objs)
+				bucket.objs -= 1;
+			break;
+		}
+
+		if (bw && bucket.bytes < 0)
+			wait = -bucket.bytes / bw;
+		if (objs && bucket.objs < 0)
+			wait = max(wait, -bucket.objs / objs);
+
+		/* The limits and the load may change while waiting */
+		sd_mutex_unlock(&bucket.lock);
+		usleep(min(wait * 1e6, (double)RECOVERY_MAX_WAIT) + 1);
+		sd_mutex_lock(&bucket.lock);
+	}
+	sd_mutex_unlock(&bucket.lock);
+}
+
+/*
+ * Read the objects of the work from their batch source with one
+ * SD_OP_READ_PEERS and store the ones read.  The others are recovered one by
+ * one as usual.
+ */
+static void recover_batch(struct recovery_obj_work *row)
+{
+	struct recovery_work *rw = &row->base;
+	const struct sd_read_peers_entry *e;
+	const struct sd_node *src;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t oids[RECOVERY_BATCH], off, size;
+	int nr = 0, nr_done = 0, ret;
+	char *buf;
+
+	src = batch_source(rw->old_vinfo, rw->cur_vinfo, row->batch[0]);
+	if (!src)
+		return;
+
+	size = round_up(sizeof(*e) * row->nr_batch, SD_READ_PEERS_ALIGN);
+	for (int i = 0; i < row->nr_batch; i++) {
+		uint32_t len = get_store_objsize(row->batch[i]);
+
+		if (sd_store->exist(row->batch[i], 0))
+			continue;
+		throttle_recovery(len);
+		oids[nr++] = row->batch[i];
+		size += round_up(len, SD_READ_PEERS_ALIGN);
+	}
+	if (nr < 2)
+		return;
+
+	buf = xvalloc(size);
+	sd_init_req(&hdr, SD_OP_READ_PEERS);
+	hdr.epoch = rw->epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_WRITE;
+	if (wire_deflate_to(src))
+		hdr.flags |= SD_FLAG_CMD_DEFLATE;
+	hdr.data_length = sizeof(uint64_t) * nr;
+	hdr.obj.oid = oids[0];
+	hdr.obj.tgt_epoch = rw->tgt_epoch;
+	hdr.obj.length = size;
+	ret = sheep_exec_req_rw(&src->nid, &hdr, oids, buf, size);
+	if (ret == SD_RES_SUCCESS)
+		ret = wire_inflate_reply(rsp, buf, size);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	e = (const struct sd_read_peers_entry *)buf;
+	off = round_up(sizeof(*e) * nr, SD_READ_PEERS_ALIGN);
+	for (int i = 0; i < nr; i++) {
+		struct siocb iocb = {};
+
+		if (e[i].result != SD_RES_SUCCESS)
+			continue;
+		if (e[i].oid != oids[i] ||
+		    e[i].length != get_store_objsize(oids[i]) ||
+		    off + e[i].length > rsp->data_length) {
+			sd_err("bad reply of %"PRIx64" from %s", oids[i],
+			       addr_to_str(src->nid.addr, src->nid.port));
+			break;
+		}
+
+		iocb.epoch = rw->epoch;
+		iocb.buf = buf + off;
+		iocb.length = e[i].length;
+		if (sd_store->create_and_write(oids[i], &iocb) ==
+		    SD_RES_SUCCESS)
+			nr_done++;
+		off = round_up(off + e[i].length, SD_READ_PEERS_ALIGN);
+	}
+	sd_debug("recovered %d of %d objects from %s at once", nr_done, nr,
+		 addr_to_str(src->nid.addr, src->nid.port));
+out:
+	free(buf);
+}
+
 static void recover_object_work(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work,
@@ -568,18 +1276,29 @@ static void recover_object_work(struct work *work)
 	struct recovery_obj_work *row = container_of(rw,
 						     struct recovery_obj_work,
 						     base);
-	uint64_t oid = row->oid;
 	struct vnode_info *cur = rw->cur_vinfo;
 	int ret;
 
-	if (sd_store->exist(oid, local_ec_index(cur, oid))) {
-		sd_debug("the object is already recovered");
-		return;
-	}
+	if (row->nr_batch > 1)
+		recover_batch(row);
 
-	ret = do_recover_object(row);
-	if (ret != 0)
-		sd_err("failed to recover object %"PRIx64, oid);
+	for (int i = 0; i < row->nr_batch && !row->stop; i++) {
+		uint64_t oid = row->batch[i];
+
+		row->oid = oid;
+		if (sd_store->exist(oid, local_ec_index(cur, oid))) {
+			sd_debug("the object is already recovered");
+			continue;
+		}
+
+		/* not held back by the background recovery */
+		if (!row->prio)
+			throttle_recovery(get_store_objsize(oid));
+		ret = do_recover_object(row);
+		if (ret != 0)
+			sd_err("failed to recover object %"PRIx64, oid);
+	}
+	row->oid = row->batch[0];
 }
 
 bool node_in_recovery(void)
@@ -587,33 +1306,43 @@ bool node_in_recovery(void)
 	return main_thread_get(current_rinfo) != NULL;
 }
 
-static inline void prepare_schedule_oid(uint64_t oid)
+static uint32_t nr_recovery_threads(void)
+{
+	return sys->recovery_window ?: md_nr_disks() * 2;
+}
+
+/* Return true if oid is newly scheduled */
+static inline bool prepare_schedule_oid(uint64_t oid)
 {
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+	enum oid_state state;
 
-	if (xlfind(&oid, rinfo->prio_oids, rinfo->nr_prio_oids, oid_cmp)) {
+	if (oid_set_lookup(&rinfo->prio_set, oid, NULL)) {
 		sd_debug("%" PRIx64 " has been already in prio_oids", oid);
-		return;
+		return false;
 	}
 
-	if (rinfo->last_prio > rinfo->next
-		&& xlfind(&oid, rinfo->oids + rinfo->next,
-			rinfo->last_prio - rinfo->next, oid_cmp)) {
+	if (oid_set_lookup(&rinfo->states, oid, &state) &&
+	    state == OID_SCHEDULED) {
 		sd_debug("%" PRIx64 " has been already scheduled", oid);
-		return;
+		return false;
 	}
 
+	oid_set_add(&rinfo->prio_set, oid, OID_SCHEDULED);
 	rinfo->nr_prio_oids++;
-	rinfo->prio_oids = xrealloc(rinfo->prio_oids,
-				    rinfo->nr_prio_oids * sizeof(uint64_t));
+	rinfo->prio_oids = xrealloc_tag(rinfo->prio_oids,
+					rinfo->nr_prio_oids * sizeof(uint64_t),
+					SD_MEM_RECOVERY);
 	rinfo->prio_oids[rinfo->nr_prio_oids - 1] = oid;
 	sd_debug("%"PRIx64" nr_prio_oids %"PRIu64, oid, rinfo->nr_prio_oids);
+	return true;
 }
 
 main_fn bool oid_in_recovery(uint64_t oid, uint8_t opcode)
 {
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
 	struct vnode_info *cur;
+	enum oid_state state;
 
 	if (!node_in_recovery())
 		return false;
@@ -642,42 +1371,37 @@ main_fn bool oid_in_recovery(uint64_t oid, uint8_t opcode)
 		/* oid is not recovered yet */
 		break;
 	case RW_RECOVER_OBJ:
-		if (xlfind(&oid, rinfo->oids, rinfo->done, oid_cmp)) {
-			sd_debug("%" PRIx64 " has been already recovered", oid);
+		if (!oid_set_lookup(&rinfo->states, oid, &state)) {
+			/*
+			 * Newly created object after prepare_object_list()
+			 * might not be in the list
+			 */
+			sd_debug("%"PRIx64" is not in the recovery list", oid);
 			return false;
 		}
 
-		if (xlfind(&oid, rinfo->oids + rinfo->done,
-			   rinfo->next - rinfo->done, oid_cmp)) {
-			/*
-			 * rinfo->oids[rinfo->done .. rinfo->next) is currently
-			 * being recovered and no need to call
-			 * prepare_schedule_oid().
-			 */
-			return true;
+		if (state == OID_RECOVERED) {
+			sd_debug("%" PRIx64 " has been already recovered", oid);
+			return false;
 		}
 
 		/*
-		 * Check if oid is in the list that to be recovered later
-		 *
-		 * FIXME: do we need more efficient yet complex data structure?
+		 * rinfo->oids[rinfo->done .. rinfo->next) is currently being
+		 * recovered and no need to call prepare_schedule_oid().
 		 */
-		if (xlfind(&oid, rinfo->oids + rinfo->next,
-			   rinfo->count - rinfo->next + 1, oid_cmp))
-			break;
+		if (state == OID_RECOVERING)
+			return true;
 
-		/*
-		 * Newly created object after prepare_object_list() might not be
-		 * in the list
-		 */
-		sd_debug("%"PRIx64" is not in the recovery list", oid);
-		return false;
+		/* oid is in the list that to be recovered later */
+		break;
 	case RW_NOTIFY_COMPLETION:
 		sd_debug("the object %" PRIx64 " is already recovered", oid);
 		return false;
 	}
 
-	prepare_schedule_oid(oid);
+	/* recover it now, over the window, not after the ones in flight */
+	if (prepare_schedule_oid(oid) && rinfo->state == RW_RECOVER_OBJ)
+		recover_next_object(rinfo);
 	return true;
 }
 
@@ -692,7 +1416,8 @@ static void free_recovery_list_work(struct recovery_list_work *rlw)
 {
 	put_vnode_info(rlw->base.cur_vinfo);
 	put_vnode_info(rlw->base.old_vinfo);
-	free(rlw->oids);
+	free_tag(rlw->oids, SD_MEM_RECOVERY);
+	free(rlw->prio);
 	free(rlw);
 }
 
@@ -707,8 +1432,10 @@ static void free_recovery_info(struct recovery_info *rinfo)
 {
 	put_vnode_info(rinfo->cur_vinfo);
 	put_vnode_info(rinfo->old_vinfo);
-	free(rinfo->oids);
-	free(rinfo->prio_oids);
+	free_tag(rinfo->oids, SD_MEM_RECOVERY);
+	free_tag(rinfo->prio_oids, SD_MEM_RECOVERY);
+	oid_set_free(&rinfo->states);
+	oid_set_free(&rinfo->prio_set);
 	for (int i = 0; i < rinfo->max_epoch; i++)
 		put_vnode_info(rinfo->vinfo_array[i]);
 	free(rinfo->vinfo_array);
@@ -716,6 +1443,345 @@ static void free_recovery_info(struct recovery_info *rinfo)
 	free(rinfo);
 }
 
+/*
+ * Checkpoints of the recovery
+ *
+ * The screened list of a recovery goes to RECOVERY_LIST_FILE of the base
+ * directory before any object of it is recovered.  Every RECOVERY_CKPT_INTERVAL
+ * seconds the objects recovered since are appended to RECOVERY_DONE_FILE, and
+ * the ones the requests moved up are saved to RECOVERY_PRIO_FILE.  The first
+ * recovery after a restart in the same epochs takes the list up from there,
+ * with the recovered objects done, instead of fetching and screening the lists
+ * of all the nodes again.  The records carry the generation of their list, so
+ * those of a superseded recovery are ignored.
+ */
+#define RECOVERY_CKPT_INTERVAL	10 /* seconds */
+#define RECOVERY_LIST_FILE	"/recovery_list"
+#define RECOVERY_DONE_FILE	"/recovery_done"
+#define RECOVERY_PRIO_FILE	"/recovery_prio"
+
+/* the header of the files, and of each record of RECOVERY_DONE_FILE */
+struct recovery_ckpt_hdr {
+	uint64_t gen;
+	uint32_t epoch;
+	uint32_t tgt_epoch;
+	uint32_t nr_disks;
+	uint32_t __pad;
+	uint64_t count; /* of the oids after it */
+};
+
+struct recovery_ckpt_work {
+	struct work work;
+	struct recovery_ckpt_hdr done;
+	uint64_t *done_oids;
+	struct recovery_ckpt_hdr prio;
+	uint64_t *prio_oids;
+};
+
+static char ckpt_list_path[PATH_MAX];
+static char ckpt_done_path[PATH_MAX];
+static char ckpt_prio_path[PATH_MAX];
+/* only the first recovery after the start takes the list up */
+static bool ckpt_resumable;
+static struct timer ckpt_timer;
+static bool ckpt_timer_on, ckpt_running;
+
+static void recovery_ckpt_remove(void)
+{
+	if (!ckpt_list_path[0])
+		return;
+
+	unlink(ckpt_list_path);
+	unlink(ckpt_done_path);
+	unlink(ckpt_prio_path);
+}
+
+static void recovery_ckpt_save_list(struct recovery_list_work *rlw)
+{
+	struct recovery_work *rw = &rlw->base;
+	struct recovery_ckpt_hdr hdr = {
+		.gen = clock_get_time(),
+		.epoch = rw->epoch,
+		.tgt_epoch = rw->tgt_epoch,
+		.nr_disks = md_nr_disks(),
+		.count = rlw->count,
+	};
+	char tmp_path[PATH_MAX + 8];
+	size_t len = sizeof(uint64_t) * rlw->count;
+	int fd;
+
+	if (!ckpt_list_path[0])
+		return;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", ckpt_list_path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", tmp_path);
+		return;
+	}
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    xwrite(fd, rlw->oids, len) != len || fdatasync(fd) < 0 ||
+	    rename(tmp_path, ckpt_list_path) < 0) {
+		sd_err("failed to write %s, %m", ckpt_list_path);
+		close(fd);
+		unlink(tmp_path);
+		return;
+	}
+	close(fd);
+	rlw->gen = hdr.gen;
+}
+
+static void *recovery_ckpt_read(const char *path, size_t *len)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct recovery_ckpt_hdr)) {
+		close(fd);
+		return NULL;
+	}
+	buf = xmalloc(st.st_size);
+	if (xread(fd, buf, st.st_size) != st.st_size) {
+		sd_err("failed to read %s, %m", path);
+		close(fd);
+		free(buf);
+		return NULL;
+	}
+	close(fd);
+	*len = st.st_size;
+	return buf;
+}
+
+/*
+ * Take the list of the checkpoint up if it's of the epochs of the recovery,
+ * with the objects recovered first in it
+ */
+static bool recovery_ckpt_load(struct recovery_list_work *rlw)
+{
+	struct recovery_work *rw = &rlw->base;
+	struct recovery_ckpt_hdr hdr, *rec;
+	struct oid_set done = {};
+	uint64_t *oids, nr = 0;
+	size_t len, off;
+	char *buf;
+	int fd;
+
+	fd = open(ckpt_list_path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (xread(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.epoch != rw->epoch || hdr.tgt_epoch != rw->tgt_epoch ||
+	    hdr.nr_disks != md_nr_disks()) {
+		close(fd);
+		return false;
+	}
+	while (hdr.count * sizeof(uint64_t) >= list_buffer_size)
+		list_buffer_size *= 2;
+	rlw->oids = xrealloc_tag(rlw->oids, list_buffer_size, SD_MEM_RECOVERY);
+	len = hdr.count * sizeof(uint64_t);
+	if (xread(fd, rlw->oids, len) != len) {
+		sd_err("%s is short, recovering from scratch", ckpt_list_path);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	rlw->count = hdr.count;
+	rlw->gen = hdr.gen;
+
+	oid_set_grow(&done, rlw->count);
+	for (uint64_t i = 0; i < rlw->count; i++)
+		oid_set_add(&done, rlw->oids[i], OID_PENDING);
+
+	/* the records of the list, up to one written partially */
+	oids = xmalloc_tag(list_buffer_size, SD_MEM_RECOVERY);
+	buf = recovery_ckpt_read(ckpt_done_path, &len);
+	for (off = 0; buf && off + sizeof(*rec) <= len;
+	     off += sizeof(*rec) + rec->count * sizeof(uint64_t)) {
+		rec = (struct recovery_ckpt_hdr *)(buf + off);
+		if (off + sizeof(*rec) + rec->count * sizeof(uint64_t) > len)
+			break;
+		if (rec->gen != hdr.gen)
+			continue;
+		for (uint64_t i = 0; i < rec->count; i++) {
+			uint64_t oid = ((uint64_t *)(rec + 1))[i];
+			enum oid_state state;
+
+			if (!oid_set_lookup(&done, oid, &state) ||
+			    state == OID_RECOVERED)
+				continue;
+			oid_set_add(&done, oid, OID_RECOVERED);
+			oids[nr++] = oid;
+		}
+	}
+	free(buf);
+
+	rlw->nr_done = nr;
+	for (uint64_t i = 0; i < rlw->count; i++) {
+		enum oid_state state = OID_PENDING;
+
+		oid_set_lookup(&done, rlw->oids[i], &state);
+		if (state != OID_RECOVERED)
+			oids[nr++] = rlw->oids[i];
+	}
+	free_tag(rlw->oids, SD_MEM_RECOVERY);
+	rlw->oids = oids;
+	oid_set_free(&done);
+
+	buf = recovery_ckpt_read(ckpt_prio_path, &len);
+	rec = (struct recovery_ckpt_hdr *)buf;
+	if (buf && rec->gen == hdr.gen &&
+	    sizeof(*rec) + rec->count * sizeof(uint64_t) == len) {
+		rlw->nr_prio = rec->count;
+		rlw->prio = xmalloc(sizeof(uint64_t) * (rlw->nr_prio ?: 1));
+		memcpy(rlw->prio, rec + 1, sizeof(uint64_t) * rlw->nr_prio);
+	}
+	free(buf);
+
+	sd_info("taking up the recovery of epoch %"PRIu32" at %"PRIu64"/%"
+		PRIu64" objects", rw->epoch, rlw->nr_done, rlw->count);
+	return true;
+}
+
+static void recovery_ckpt_work(struct work *work)
+{
+	struct recovery_ckpt_work *cw =
+		container_of(work, struct recovery_ckpt_work, work);
+	size_t len = sizeof(uint64_t) * cw->done.count;
+	void *buf;
+	int fd;
+
+	if (cw->done.count) {
+		fd = open(ckpt_done_path, O_WRONLY | O_CREAT | O_APPEND,
+			  sd_def_fmode);
+		if (fd < 0) {
+			sd_err("failed to open %s, %m", ckpt_done_path);
+		} else {
+			if (xwrite(fd, &cw->done, sizeof(cw->done)) !=
+			    sizeof(cw->done) ||
+			    xwrite(fd, cw->done_oids, len) != len ||
+			    fdatasync(fd) < 0)
+				sd_err("failed to write %s, %m",
+				       ckpt_done_path);
+			close(fd);
+		}
+	}
+
+	if (!cw->prio_oids)
+		return;
+	len = sizeof(uint64_t) * cw->prio.count;
+	buf = xmalloc(sizeof(cw->prio) + len);
+	memcpy(buf, &cw->prio, sizeof(cw->prio));
+	memcpy((char *)buf + sizeof(cw->prio), cw->prio_oids, len);
+	if (atomic_create_and_write(ckpt_prio_path, buf,
+				    sizeof(cw->prio) + len, true) < 0)
+		sd_err("failed to write %s", ckpt_prio_path);
+	free(buf);
+}
+
+static void recovery_ckpt_done(struct work *work)
+{
+	struct recovery_ckpt_work *cw =
+		container_of(work, struct recovery_ckpt_work, work);
+
+	free(cw->done_oids);
+	free(cw->prio_oids);
+	free(cw);
+	ckpt_running = false;
+}
+
+/* The objects moved up by the requests and not recovered yet */
+static uint64_t *recovery_prio_oids(struct recovery_info *rinfo, uint64_t *nr)
+{
+	uint64_t *oids, max = rinfo->nr_prio_oids;
+	enum oid_state state;
+
+	if (rinfo->last_prio > rinfo->next)
+		max += rinfo->last_prio - rinfo->next;
+	oids = xmalloc(sizeof(uint64_t) * (max ?: 1));
+	*nr = 0;
+	for (uint64_t i = rinfo->next; i < rinfo->last_prio; i++)
+		if (oid_set_lookup(&rinfo->states, rinfo->oids[i], &state) &&
+		    state == OID_SCHEDULED)
+			oids[(*nr)++] = rinfo->oids[i];
+	for (uint64_t i = 0; i < rinfo->nr_prio_oids; i++)
+		oids[(*nr)++] = rinfo->prio_oids[i];
+	return oids;
+}
+
+static main_fn void recovery_ckpt_tick(void *data)
+{
+	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+	struct recovery_ckpt_work *cw;
+	struct recovery_ckpt_hdr hdr;
+	uint64_t nr_prio;
+
+	if (!rinfo) {
+		ckpt_timer_on = false;
+		return;
+	}
+	add_timer(&ckpt_timer, RECOVERY_CKPT_INTERVAL);
+	if (ckpt_running || rinfo->state != RW_RECOVER_OBJ ||
+	    !rinfo->ckpt_gen || uatomic_read(&next_rinfo))
+		return;
+
+	cw = xzalloc(sizeof(*cw));
+	hdr = (struct recovery_ckpt_hdr) {
+		.gen = rinfo->ckpt_gen,
+		.epoch = rinfo->epoch,
+		.tgt_epoch = rinfo->tgt_epoch,
+	};
+	cw->done = cw->prio = hdr;
+	cw->done.count = rinfo->done - rinfo->ckpt_done;
+	if (cw->done.count) {
+		cw->done_oids = xmalloc(sizeof(uint64_t) * cw->done.count);
+		memcpy(cw->done_oids, rinfo->oids + rinfo->ckpt_done,
+		       sizeof(uint64_t) * cw->done.count);
+		rinfo->ckpt_done = rinfo->done;
+	}
+	cw->prio_oids = recovery_prio_oids(rinfo, &nr_prio);
+	cw->prio.count = nr_prio;
+	/* an empty set is saved once */
+	if (!nr_prio && !rinfo->ckpt_nr_prio) {
+		free(cw->prio_oids);
+		cw->prio_oids = NULL;
+	}
+	rinfo->ckpt_nr_prio = nr_prio;
+
+	if (!cw->done.count && !cw->prio_oids) {
+		free(cw);
+		return;
+	}
+	ckpt_running = true;
+	cw->work.fn = recovery_ckpt_work;
+	cw->work.done = recovery_ckpt_done;
+	queue_work(sys->recovery_wqueue, &cw->work);
+}
+
+static void recovery_ckpt_start(void)
+{
+	if (ckpt_timer_on)
+		return;
+	ckpt_timer_on = true;
+	ckpt_timer.callback = recovery_ckpt_tick;
+	add_timer(&ckpt_timer, RECOVERY_CKPT_INTERVAL);
+}
+
+/* Checkpoint the recoveries to the base directory and take the last one up */
+void recovery_ckpt_init(const char *dir)
+{
+	snprintf(ckpt_list_path, sizeof(ckpt_list_path),
+		 "%s" RECOVERY_LIST_FILE, dir);
+	snprintf(ckpt_done_path, sizeof(ckpt_done_path),
+		 "%s" RECOVERY_DONE_FILE, dir);
+	snprintf(ckpt_prio_path, sizeof(ckpt_prio_path),
+		 "%s" RECOVERY_PRIO_FILE, dir);
+	ckpt_resumable = true;
+}
+
 static inline void kick_next_rw(void)
 {
 	struct recovery_info *nrinfo = uatomic_read(&next_rinfo);
@@ -794,6 +1860,7 @@ static inline void finish_recovery(struct recovery_info *rinfo)
 {
 	uint32_t recovered_epoch = rinfo->epoch;
 	main_thread_set(current_rinfo, NULL);
+	recovery_ckpt_remove();
 
 	wakeup_all_requests();
 
@@ -809,10 +1876,7 @@ static inline void finish_recovery(struct recovery_info *rinfo)
 
 static inline bool oid_in_prio_oids(struct recovery_info *rinfo, uint64_t oid)
 {
-	for (uint64_t i = 0; i < rinfo->nr_prio_oids; i++)
-		if (rinfo->prio_oids[i] == oid)
-			return true;
-	return false;
+	return oid_set_lookup(&rinfo->prio_set, oid, NULL);
 }
 
 /*
@@ -833,7 +1897,7 @@ static inline void finish_schedule_oids(struct recovery_info *rinfo)
 	if (nr_recovered == rinfo->count - 1)
 		goto done;
 
-	new_oids = xmalloc(list_buffer_size);
+	new_oids = xmalloc_tag(list_buffer_size, SD_MEM_RECOVERY);
 	if (last_prio > 0 && last_prio > nr_recovered) {
 		memcpy(new_oids, rinfo->oids, last_prio * sizeof(uint64_t));
 		memcpy(new_oids + last_prio, rinfo->prio_oids,
@@ -860,11 +1924,16 @@ static inline void finish_schedule_oids(struct recovery_info *rinfo)
 		 rinfo->count == new_idx ? "" : "WARN: ", nr_recovered,
 		 rinfo->nr_prio_oids, rinfo->count, new_idx);
 
-	free(rinfo->oids);
+	free_tag(rinfo->oids, SD_MEM_RECOVERY);
 	rinfo->oids = new_oids;
 done:
-	free(rinfo->prio_oids);
+	for (i = 0; i < rinfo->nr_prio_oids; i++)
+		if (oid_set_lookup(&rinfo->states, rinfo->prio_oids[i], NULL))
+			oid_set_add(&rinfo->states, rinfo->prio_oids[i],
+				    OID_SCHEDULED);
+	free_tag(rinfo->prio_oids, SD_MEM_RECOVERY);
 	rinfo->prio_oids = NULL;
+	oid_set_free(&rinfo->prio_set);
 	rinfo->nr_scheduled_prio_oids += rinfo->nr_prio_oids;
 	rinfo->nr_prio_oids = 0;
 }
@@ -881,9 +1950,8 @@ static void recover_next_object(struct recovery_info *rinfo)
 	if (rinfo->next >= rinfo->count)
 		return;
 
-	/* Try recover next object */
+	/* Try recover next object, and the following ones of its batch */
 	queue_recovery_work(rinfo);
-	rinfo->next++;
 	rinfo->recover_threads++;
 }
 
@@ -895,6 +1963,7 @@ static void recover_object_main(struct work *work)
 						     struct recovery_obj_work,
 						     base);
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+	uint64_t step = DIV_ROUND_UP(rinfo->count, 100), done = rinfo->done;
 
 	rinfo->recover_threads--;
 
@@ -902,15 +1971,24 @@ static void recover_object_main(struct work *work)
 	if (row->stop == true)
 		goto skip;
 
-	/* ->oids[done, next] is out of order since finish order is random */
-	if (rinfo->oids[rinfo->done] != row->oid) {
-		uint64_t *p = xlfind(&row->oid, rinfo->oids + rinfo->done,
-				     rinfo->next - rinfo->done, oid_cmp);
+	for (int i = 0; i < row->nr_batch; i++) {
+		uint64_t oid = row->batch[i];
 
-		*p = rinfo->oids[rinfo->done];
-		rinfo->oids[rinfo->done] = row->oid;
+		/*
+		 * ->oids[done, next] is out of order since finish order is
+		 * random
+		 */
+		if (rinfo->oids[rinfo->done] != oid) {
+			uint64_t *p = xlfind(&oid, rinfo->oids + rinfo->done,
+					     rinfo->next - rinfo->done,
+					     oid_cmp);
+
+			*p = rinfo->oids[rinfo->done];
+			rinfo->oids[rinfo->done] = oid;
+		}
+		rinfo->done++;
+		oid_set_add(&rinfo->states, oid, OID_RECOVERED);
 	}
-	rinfo->done++;
 
 skip:
 	if (run_next_rw()) {
@@ -918,9 +1996,10 @@ skip:
 		return;
 	}
 
-	wakeup_requests_on_oid(row->oid);
+	for (int i = 0; i < row->nr_batch; i++)
+		wakeup_requests_on_oid(row->batch[i]);
 
-	if (!(rinfo->done % DIV_ROUND_UP(rinfo->count, 100)))
+	if (done / step != rinfo->done / step)
 		sd_info("object recovery progress %3.0lf%% ",
 			(double)rinfo->done / rinfo->count * 100);
 	sd_debug("object %"PRIx64" is recovered (%"PRIu64"/%"PRIu64")",
@@ -929,7 +2008,9 @@ skip:
 	if (rinfo->done >= rinfo->count)
 		goto finish_recovery;
 
-	recover_next_object(rinfo);
+	/* shrink back to the window after the requested objects */
+	if (rinfo->recover_threads < nr_recovery_threads())
+		recover_next_object(rinfo);
 	free_recovery_obj_work(row);
 	return;
 finish_recovery:
@@ -958,20 +2039,38 @@ static void finish_object_list(struct work *work)
 	 *    this node. Speedy recovery not only improve data reliability but
 	 *    also cause less writing blocking on the lost data.
 	 *
-	 * We choose md_nr_disks() * 2 threads for recovery, no rationale.
+	 * We choose md_nr_disks() * 2 threads for recovery by default, no
+	 * rationale, or as many as the recovery window.  The sources of the
+	 * objects in flight are spread over the copies.
 	 */
-	uint32_t nr_threads = md_nr_disks() * 2;
+	uint32_t nr_threads = nr_recovery_threads();
 
 	rinfo->state = RW_RECOVER_OBJ;
 	rinfo->count = rlw->count;
 	rinfo->oids = rlw->oids;
 	rlw->oids = NULL;
+
+	oid_set_grow(&rinfo->states, rinfo->count);
+	for (uint64_t i = 0; i < rinfo->count; i++)
+		oid_set_add(&rinfo->states, rinfo->oids[i],
+			    i < rlw->nr_done ? OID_RECOVERED : OID_PENDING);
+	rinfo->done = rinfo->next = rinfo->ckpt_done = rlw->nr_done;
+	rinfo->ckpt_gen = rlw->gen;
+	for (uint64_t i = 0; i < rlw->nr_prio; i++) {
+		enum oid_state state;
+
+		if (oid_set_lookup(&rinfo->states, rlw->prio[i], &state) &&
+		    state == OID_PENDING)
+			prepare_schedule_oid(rlw->prio[i]);
+	}
 	free_recovery_list_work(rlw);
+	if (rinfo->ckpt_gen)
+		recovery_ckpt_start();
 
 	if (run_next_rw())
 		return;
 
-	if (!rinfo->count) {
+	if (rinfo->done >= rinfo->count) {
 		finish_recovery(rinfo);
 		return;
 	}
@@ -981,9 +2080,9 @@ static void finish_object_list(struct work *work)
 	return;
 }
 
-/* Fetch the object list from all the nodes in the cluster */
-static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
-				   size_t *nr_oids)
+/* Fetch the whole object list from the sheep without the paged one */
+static uint64_t *fetch_full_object_list(struct sd_node *e, uint32_t epoch,
+					size_t *nr_oids)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -1020,94 +2119,449 @@ retry:
 	return buf;
 }
 
-/* Screen out objects that don't belong to this node */
-static void screen_object_list(struct recovery_list_work *rlw,
-			       uint64_t *oids, size_t nr_oids)
+/* The objects of a node which belong to this node, in the order of oid */
+struct object_run {
+	uint64_t *oids;
+	size_t nr, size;
+	size_t pos; /* of the next oid to merge */
+};
+
+/* The oids screened at a time, hashed by sd_place_oids() together */
+#define SCREEN_BATCH 256
+
+/*
+ * Called by the list threads.  The placement is looked up in the flat vnode
+ * array directly, the placement cache would only miss on the whole list.
+ */
+static void screen_object(struct recovery_list_work *rlw,
+			  struct object_run *run, uint64_t oid, uint64_t hval)
 {
-	struct recovery_work *rw = &rlw->base;
-	const struct sd_vnode *vnodes[SD_MAX_COPIES];
-	uint64_t old_count = rlw->count;
-	uint64_t nr_objs;
-	uint64_t i, j;
-
-	for (i = 0; i < nr_oids; i++) {
-		if (xbsearch(&oids[i], rlw->oids, old_count, obj_cmp))
-			/* the object is already scheduled to be recovered */
+	const struct vnode_info *vinfo = rlw->base.cur_vinfo;
+	uint32_t idxs[SD_MAX_COPIES];
+	int nr_objs = get_obj_copy_number(oid, vinfo->nr_zones);
+
+	vnode_array_hash_to_idx(&vinfo->varray, hval, nr_objs, idxs);
+	for (int i = 0; i < nr_objs; i++) {
+		if (!vnode_is_local(vinfo->varray.vnodes[idxs[i]]))
 			continue;
 
-		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
+		if (run->nr == run->size) {
+			run->size = run->size ? run->size * 2 : 4096;
+			run->oids = xrealloc_tag(run->oids,
+						 run->size * sizeof(uint64_t),
+						 SD_MEM_RECOVERY);
+		}
+		run->oids[run->nr++] = oid;
+		break;
+	}
+}
+
+static void screen_objects(struct recovery_list_work *rlw,
+			   struct object_run *run, const uint64_t *oids,
+			   size_t nr)
+{
+	uint64_t hvals[SCREEN_BATCH];
 
-		oid_to_vnodes(oids[i], &rw->cur_vinfo->vroot, nr_objs, vnodes);
-		for (j = 0; j < nr_objs; j++) {
-			if (!vnode_is_local(vnodes[j]))
-				continue;
+	if (unlikely(!rlw->base.cur_vinfo->varray.nr))
+		return;
 
-			rlw->oids[rlw->count++] = oids[i];
-			/* enlarge the list buffer if full */
-			if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
-				list_buffer_size *= 2;
-				rlw->oids = xrealloc(rlw->oids,
-						     list_buffer_size);
-			}
-			break;
-		}
+	for (size_t i = 0; i < nr; i += SCREEN_BATCH) {
+		size_t n = min(nr - i, (size_t)SCREEN_BATCH);
+
+		sd_place_oids(oids + i, hvals, n);
+		for (size_t j = 0; j < n; j++)
+			screen_object(rlw, run, oids[i + j], hvals[j]);
 	}
+}
 
-	xqsort(rlw->oids, rlw->count, obj_cmp);
+static inline uint64_t run_head(const struct object_run *run)
+{
+	return run->oids[run->pos];
 }
 
-/* Prepare the object list that belongs to this node */
-static void prepare_object_list(struct work *work)
+static void run_heap_down(struct object_run *runs, int *heap, int n, int i)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work,
-						work);
-	struct recovery_list_work *rlw = container_of(rw,
-						      struct recovery_list_work,
-						      base);
-	int nr_nodes = rw->cur_vinfo->nr_nodes;
-	int start = random() % nr_nodes, i, end = nr_nodes;
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, m = i, t;
+
+		if (l < n &&
+		    run_head(runs + heap[l]) < run_head(runs + heap[m]))
+			m = l;
+		if (r < n &&
+		    run_head(runs + heap[r]) < run_head(runs + heap[m]))
+			m = r;
+		if (m == i)
+			return;
+		t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+/*
+ * Merge the sorted runs of the nodes into the sorted list of the objects to
+ * recover at once, through a heap of their heads, dropping the duplicates.
+ */
+static void merge_object_runs(struct recovery_list_work *rlw,
+			      struct object_run *runs, int nr_runs)
+{
+	int *heap = xmalloc(sizeof(*heap) * nr_runs), n = 0;
+	size_t total = 0;
 	uint64_t *oids;
+
+	for (int i = 0; i < nr_runs; i++) {
+		if (!runs[i].nr)
+			continue;
+		runs[i].pos = 0;
+		total += runs[i].nr;
+		heap[n++] = i;
+	}
+
+	while (total * sizeof(uint64_t) >= list_buffer_size)
+		list_buffer_size *= 2;
+	rlw->oids = oids = xrealloc_tag(rlw->oids, list_buffer_size,
+					SD_MEM_RECOVERY);
+	rlw->count = 0;
+
+	for (int i = n / 2 - 1; i >= 0; i--)
+		run_heap_down(runs, heap, n, i);
+	while (n) {
+		struct object_run *run = runs + heap[0];
+		uint64_t oid = run->oids[run->pos++];
+
+		if (!rlw->count || oids[rlw->count - 1] != oid)
+			oids[rlw->count++] = oid;
+		if (run->pos == run->nr)
+			heap[0] = heap[--n];
+		run_heap_down(runs, heap, n, 0);
+	}
+	free(heap);
+}
+
+/*
+ * Lay the list out in chunks of RECOVERY_BATCH objects of the same batch
+ * source, taking a chunk of each source in turn, so that a recovery work reads
+ * a chunk at once and the sources are still read evenly.  The objects without
+ * one go in chunks of their own.
+ */
+static void chunk_object_list(struct recovery_list_work *rlw)
+{
+	struct recovery_work *rw = &rlw->base;
+	int nr_nodes = rw->old_vinfo->nr_nodes, nr_groups = nr_nodes + 1;
+	uint64_t *start, *end, *oids, n = rlw->count, k;
 	struct sd_node *nodes;
+	uint16_t *group;
 
-	if (node_is_gateway_only())
+	if (n < 2 || !nr_nodes)
 		return;
 
-	sd_debug("%u", rw->epoch);
-	wait_get_vdi_bitmap_done();
+	nodes = xmalloc(sizeof(*nodes) * nr_nodes);
+	nodes_to_buffer(&rw->old_vinfo->nroot, nodes);
+	group = xmalloc(sizeof(*group) * n);
+	start = xzalloc(sizeof(*start) * nr_groups);
+	end = xzalloc(sizeof(*end) * nr_groups);
+	for (uint64_t i = 0; i < n; i++) {
+		const struct sd_node *src, *p = NULL;
+
+		src = batch_source(rw->old_vinfo, rw->cur_vinfo, rlw->oids[i]);
+		if (src)
+			p = xbsearch(src, nodes, nr_nodes, node_cmp);
+		group[i] = p ? p - nodes : nr_nodes;
+		end[group[i]]++;
+	}
+	k = 0;
+	for (int g = 0; g < nr_groups; g++) {
+		start[g] = k;
+		k += end[g];
+		end[g] = start[g];
+	}
 
-	nodes = xmalloc(sizeof(struct sd_node) * nr_nodes);
-	nodes_to_buffer(&rw->cur_vinfo->nroot, nodes);
-again:
-	/* We need to start at random node for better load balance */
-	for (i = start; i < end; i++) {
-		size_t nr_oids;
-		struct sd_node *node = nodes + i;
+	/* bucket the list by the source, in the order of oid */
+	oids = xmalloc_tag(list_buffer_size, SD_MEM_RECOVERY);
+	for (uint64_t i = 0; i < n; i++)
+		oids[end[group[i]]++] = rlw->oids[i];
+
+	for (k = 0; k < n;) {
+		for (int g = 0; g < nr_groups; g++) {
+			uint64_t len = min(end[g] - start[g],
+					   (uint64_t)RECOVERY_BATCH);
+
+			memcpy(rlw->oids + k, oids + start[g],
+			       len * sizeof(uint64_t));
+			start[g] += len;
+			k += len;
+		}
+	}
+
+	free_tag(oids, SD_MEM_RECOVERY);
+	free(end);
+	free(start);
+	free(group);
+	free(nodes);
+}
+
+/* The least heat of the tiers of the objects recovered first, hottest first */
+static const uint32_t heat_tiers[] = { 64, 8, 2 };
+#define NR_HEAT_TIERS (ARRAY_SIZE(heat_tiers) + 1)
+
+/*
+ * Move the objects accessed lately to the front of the list by their tier of
+ * heat_of(), so the guests wait for the recovery of fewer objects.  The order
+ * within a tier is kept, and so are most of the chunks of chunk_object_list().
+ */
+static void order_hot_objects(struct recovery_list_work *rlw)
+{
+	uint64_t start[NR_HEAT_TIERS] = {}, n = rlw->count, k, *oids;
+	uint8_t *tier;
+	bool hot = false;
+
+	if (n < 2)
+		return;
+
+	tier = xmalloc(n);
+	for (uint64_t i = 0; i < n; i++) {
+		uint32_t heat = heat_of(rlw->oids[i]);
+		int t = 0;
+
+		while (t < ARRAY_SIZE(heat_tiers) && heat < heat_tiers[t])
+			t++;
+		tier[i] = t;
+		start[t]++;
+		hot |= t < ARRAY_SIZE(heat_tiers);
+	}
+	if (!hot)
+		goto out;
+
+	k = 0;
+	for (int t = 0; t < NR_HEAT_TIERS; t++) {
+		uint64_t nr = start[t];
+
+		start[t] = k;
+		k += nr;
+	}
+	oids = xmalloc_tag(list_buffer_size, SD_MEM_RECOVERY);
+	for (uint64_t i = 0; i < n; i++)
+		oids[start[tier[i]]++] = rlw->oids[i];
+	memcpy(rlw->oids, oids, n * sizeof(uint64_t));
+	free_tag(oids, SD_MEM_RECOVERY);
+	sd_debug("%"PRIu64" hot objects first", start[NR_HEAT_TIERS - 2]);
+out:
+	free(tier);
+}
+
+#define OBJ_LIST_PAGE_SIZE (UINT32_C(1) << 20)
+
+#define LIST_PAUSE_MS		100
+#define LIST_PAUSE_MAX_MS	1000
+
+/*
+ * Hold off the next page while the recovery is over its memory cap, so that
+ * the lists of the recovery being replaced are freed first.  A page waits at
+ * most LIST_PAUSE_MAX_MS, a recovery over the cap on its own still goes on.
+ */
+static void throttle_list_fetch(void)
+{
+	int waited = 0;
+
+	while (waited < LIST_PAUSE_MAX_MS &&
+	       sd_mem_over_cap(SD_MEM_RECOVERY) && !uatomic_read(&next_rinfo)) {
+		usleep(LIST_PAUSE_MS * 1000);
+		waited += LIST_PAUSE_MS;
+	}
+	if (waited)
+		uatomic_inc(&sys->stat.mem.throttled);
+}
+
+/*
+ * Fetch the object list of a node page by page and screen out the objects that
+ * don't belong to this node into the run as they come.  The pages are in the
+ * order of oid, so the run is sorted.
+ */
+static int fetch_object_list(struct recovery_list_work *rlw,
+			     struct sd_node *e, uint32_t epoch,
+			     struct object_run *run)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint8_t *page = xmalloc(OBJ_LIST_PAGE_SIZE);
+	uint64_t oid = 0, *oids, batch[SCREEN_BATCH];
+	size_t nr_oids = 0, nr_batch;
+	int ret;
+
+	sd_debug("%s", addr_to_str(e->nid.addr, e->nid.port));
+
+	for (;;) {
+		const uint8_t *p = page, *end;
+
+		throttle_list_fetch();
+		sd_init_req(&hdr, SD_OP_GET_OBJ_LIST_PAGE);
+		hdr.data_length = OBJ_LIST_PAGE_SIZE;
+		hdr.epoch = epoch;
+		hdr.obj.oid = oid;
+		ret = sheep_exec_req(&e->nid, &hdr, page);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		if (!rsp->data_length)
+			goto done;
+
+		end = page + rsp->data_length;
+		nr_batch = 0;
+		while (p < end) {
+			uint64_t delta;
+
+			p = varint_get(p, end, &delta);
+			if (!p || !delta) {
+				sd_err("corrupted object list from %s",
+				       addr_to_str(e->nid.addr, e->nid.port));
+				ret = SD_RES_EIO;
+				goto out;
+			}
+			oid += delta;
+			batch[nr_batch++] = oid;
+			nr_oids++;
+			if (nr_batch == SCREEN_BATCH) {
+				screen_objects(rlw, run, batch, nr_batch);
+				nr_batch = 0;
+			}
+		}
+		screen_objects(rlw, run, batch, nr_batch);
+	}
+
+	if (!sheep_op_unknown(ret))
+		goto out;
+
+	/* an older sheep which doesn't know the paged list, start over */
+	run->nr = 0;
+	oids = fetch_full_object_list(e, epoch, &nr_oids);
+	if (!oids) {
+		/* logged by fetch_full_object_list() */
+		ret = SD_RES_NETWORK_ERROR;
+		goto out_free;
+	}
+	screen_objects(rlw, run, oids, nr_oids);
+	free(oids);
+	/* an older sheep may not sort it */
+	xqsort(run->oids, run->nr, oid_cmp);
+done:
+	sd_debug("%zu, %zu for this node", nr_oids, run->nr);
+	ret = SD_RES_SUCCESS;
+out:
+	if (ret != SD_RES_SUCCESS) {
+		sd_alert("cannot get object list from %s",
+			 addr_to_str(e->nid.addr, e->nid.port));
+		sd_alert("some objects may be not recovered at epoch %d",
+			 epoch);
+	}
+out_free:
+	free(page);
+	return ret;
+}
+
+#define LIST_MAX_THREADS 16
+
+/* The nodes whose lists the list threads fetch and screen */
+struct list_fetch {
+	struct recovery_list_work *rlw;
+	struct sd_node *nodes;
+	struct object_run *runs; /* of the nodes */
+	int nr_nodes, start;
+	int next; /* the next node to take */
+};
+
+static void *list_fetch_routine(void *arg)
+{
+	struct list_fetch *lf = arg;
+	struct recovery_work *rw = &lf->rlw->base;
+	int i;
+
+	while ((i = uatomic_add_return(&lf->next, 1) - 1) < lf->nr_nodes) {
+		/* We need to start at random node for better load balance */
+		int idx = (lf->start + i) % lf->nr_nodes;
+		struct sd_node *node = lf->nodes + idx;
 
 		if (uatomic_read(&next_rinfo)) {
 			sd_debug("go to the next recovery");
-			goto out;
+			break;
 		}
 
 		if (sys->cinfo.flags & SD_CLUSTER_FLAG_MANUAL &&
 		    node->nid.status == NODE_STATUS_OFFLINE)
 			continue;
 
-		oids = fetch_object_list(node, rw->epoch, &nr_oids);
-		if (!oids)
-			continue;
-		screen_object_list(rlw, oids, nr_oids);
-		free(oids);
+		fetch_object_list(lf->rlw, node, rw->epoch, lf->runs + idx);
 	}
+	return NULL;
+}
 
-	if (start != 0) {
-		end = start;
-		start = 0;
-		goto again;
+/*
+ * Prepare the object list that belongs to this node
+ *
+ * The lists of the nodes are fetched and screened by as many threads as the
+ * cores, up to LIST_MAX_THREADS, into a sorted run per node, and the runs are
+ * merged in one pass then.
+ */
+static void prepare_object_list(struct work *work)
+{
+	struct recovery_work *rw = container_of(work, struct recovery_work,
+						work);
+	struct recovery_list_work *rlw = container_of(rw,
+						      struct recovery_list_work,
+						      base);
+	int nr_nodes = rw->cur_vinfo->nr_nodes, nr_threads, i;
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct list_fetch lf = {
+		.rlw = rlw,
+		.nr_nodes = nr_nodes,
+		.start = random() % nr_nodes,
+	};
+	sd_thread_t *threads;
+
+	if (node_is_gateway_only())
+		return;
+
+	sd_debug("%u", rw->epoch);
+	if (ckpt_resumable) {
+		ckpt_resumable = false;
+		if (recovery_ckpt_load(rlw))
+			return;
 	}
+	/* a restart in the middle of this one starts it over */
+	recovery_ckpt_remove();
+	wait_get_vdi_bitmap_done();
 
+	lf.nodes = xmalloc(sizeof(struct sd_node) * nr_nodes);
+	lf.runs = xzalloc(sizeof(*lf.runs) * nr_nodes);
+	nodes_to_buffer(&rw->cur_vinfo->nroot, lf.nodes);
+
+	nr_threads = min(nr_nodes, LIST_MAX_THREADS);
+	if (nr_cpus > 0 && nr_cpus < nr_threads)
+		nr_threads = nr_cpus;
+	threads = xmalloc(sizeof(*threads) * nr_threads);
+	for (i = 0; i < nr_threads; i++)
+		if (sd_thread_create_with_idx("list", threads + i,
+					      list_fetch_routine, &lf))
+			break;
+	if (!i)
+		/* no thread, do it ourselves */
+		list_fetch_routine(&lf);
+	nr_threads = i;
+	for (i = 0; i < nr_threads; i++)
+		sd_thread_join(threads[i], NULL);
+
+	if (!uatomic_read(&next_rinfo)) {
+		merge_object_runs(rlw, lf.runs, nr_nodes);
+		chunk_object_list(rlw);
+		order_hot_objects(rlw);
+		recovery_ckpt_save_list(rlw);
+	}
 	sd_debug("%"PRIu64, rlw->count);
-out:
-	free(nodes);
+
+	for (i = 0; i < nr_nodes; i++)
+		free_tag(lf.runs[i].oids, SD_MEM_RECOVERY);
+	free(lf.runs);
+	free(threads);
+	free(lf.nodes);
 }
 
 int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *old_vinfo,
@@ -1167,16 +2621,55 @@ int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *old_vinfo,
 	return 0;
 }
 
+/*
+ * Take the objects after row->oid in the list which have the same batch source
+ * along with it, as chunk_object_list() lays them out.  The works for the
+ * objects a request waits for go alone.
+ */
+static void fill_batch(struct recovery_info *rinfo,
+		       struct recovery_obj_work *row)
+{
+	const struct sd_node *src = NULL;
+	uint64_t size;
+	enum oid_state state;
+
+	row->batch[0] = row->oid;
+	row->nr_batch = 1;
+	if (!row->prio)
+		src = batch_source(rinfo->old_vinfo, rinfo->cur_vinfo,
+				   row->oid);
+	if (!src)
+		return;
+
+	size = SD_READ_PEERS_ALIGN +
+		round_up(get_store_objsize(row->oid), SD_READ_PEERS_ALIGN);
+	for (uint64_t i = rinfo->next + 1; i < rinfo->count &&
+		     row->nr_batch < RECOVERY_BATCH; i++) {
+		uint64_t oid = rinfo->oids[i];
+
+		if (!oid_set_lookup(&rinfo->states, oid, &state) ||
+		    state != OID_PENDING ||
+		    batch_source(rinfo->old_vinfo, rinfo->cur_vinfo,
+				 oid) != src)
+			break;
+		size += round_up(get_store_objsize(oid), SD_READ_PEERS_ALIGN);
+		if (size > SD_READ_PEERS_MAX)
+			break;
+		row->batch[row->nr_batch++] = oid;
+	}
+}
+
 static void queue_recovery_work(struct recovery_info *rinfo)
 {
 	struct recovery_work *rw;
 	struct recovery_list_work *rlw;
 	struct recovery_obj_work *row;
+	enum oid_state state;
 
 	switch (rinfo->state) {
 	case RW_PREPARE_LIST:
 		rlw = xzalloc(sizeof(*rlw));
-		rlw->oids = xmalloc(list_buffer_size);
+		rlw->oids = xmalloc_tag(list_buffer_size, SD_MEM_RECOVERY);
 
 		rw = &rlw->base;
 		rw->work.fn = prepare_object_list;
@@ -1186,6 +2679,13 @@ static void queue_recovery_work(struct recovery_info *rinfo)
 		row = xzalloc(sizeof(*row));
 		row->oid = rinfo->oids[rinfo->next];
 		row->stop = false;
+		row->prio = oid_set_lookup(&rinfo->states, row->oid, &state) &&
+			state == OID_SCHEDULED;
+		fill_batch(rinfo, row);
+		for (int i = 0; i < row->nr_batch; i++)
+			oid_set_add(&rinfo->states, row->batch[i],
+				    OID_RECOVERING);
+		rinfo->next += row->nr_batch;
 
 		rw = &row->base;
 		rw->work.fn = recover_object_work;
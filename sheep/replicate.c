@@ -0,0 +1,732 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous replication of the vdis to a remote cluster
+ *
+ * A vdi with the attribute SD_REPLICA_ATTR_KEY is replicated to the vdi of the
+ * same name in the cluster of the sheep at vdi_replica.addr, a round every
+ * vdi_replica.interval seconds, by the node of the first vnode of the inode
+ * object of sd_hash_vdi() of its name.  A round snapshots the vdi by the tag
+ * "replica-<seq>" and sends the changes since the snapshot of the round
+ * before: the data objects whose vid differs in the two inodes, and of those
+ * which are replicated, only the blocks whose SD_OP_GET_BLOCK_HASH digests
+ * differ, as 'dog vdi backup' does.  The blocks go by SD_OP_REPLICA_WRITE,
+ * deflated if they shrink, REPLICA_JOBS objects at once.  The remote gateway
+ * writes them to its working vdi with copy-on-write, in parallel in its
+ * workers, and the round then snapshots it by the same tag, a consistent copy
+ * of the vdi at the start of the round.  The snapshots of the round before are
+ * deleted on both sides and the attribute records the new one.
+ *
+ * A failed round deletes its local snapshot and the next one sends the
+ * changes again.  The nodes learn the attributes from SD_OP_SET_VDI_REPLICA
+ * and, once the cluster is up, by reading those of the working vdis.  The
+ * discarded objects and the hyper volumes aren't replicated.
+ */
+
+#include "sheep_priv.h"
+
+#define REPLICA_TICK 10 /* seconds */
+#define REPLICA_JOBS 16 /* objects sent at once */
+
+struct replica {
+	uint32_t name_vid;
+	char name[SD_MAX_VDI_LEN];
+	uint32_t interval;
+	uint64_t next; /* time of the next round */
+	bool running;
+	struct rb_node node;
+};
+
+struct replica_round {
+	struct work work;
+	char name[SD_MAX_VDI_LEN];
+	struct vnode_info *vinfo;
+	struct vdi_replica conf;
+	struct node_id nid; /* of the remote sheep */
+	uint32_t remote_vid;
+	uatomic_bool deflate;
+	uint64_t sent; /* bytes on the wire */
+	uint64_t raw;
+
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	int nr_inflight;
+	int ret;
+};
+
+struct replica_obj_work {
+	struct work work;
+	struct replica_round *rr;
+	uint32_t idx, from_vid, to_vid;
+};
+
+struct replica_scan_work {
+	struct work work;
+	struct vdi_replica *confs;
+	char (*names)[SD_MAX_VDI_LEN];
+	int nr;
+	int ret;
+};
+
+static struct rb_root replica_root = RB_ROOT;
+static bool replica_scanned, replica_scanning;
+static struct timer replica_timer;
+
+static int replica_cmp(const struct replica *a, const struct replica *b)
+{
+	return intcmp(a->name_vid, b->name_vid);
+}
+
+/* Execute the request on the remote sheep nid, or locally if it's NULL */
+static int replica_exec(const struct node_id *nid, struct sd_req *hdr,
+			void *data)
+{
+	return nid ? sheep_exec_req(nid, hdr, data) : exec_local_req(hdr, data);
+}
+
+static int replica_lookup(const struct node_id *nid, const char *name,
+			  uint32_t *vid)
+{
+	char buf[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN] = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	pstrcpy(buf, SD_MAX_VDI_LEN, name);
+	sd_init_req(&hdr, SD_OP_GET_VDI_INFO);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(buf);
+	ret = replica_exec(nid, &hdr, buf);
+	if (ret == SD_RES_SUCCESS)
+		*vid = rsp->vdi.vdi_id;
+	return ret;
+}
+
+static int replica_read_header(const struct node_id *nid, uint32_t vid,
+			       struct sd_inode *inode)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.data_length = SD_INODE_HEADER_SIZE;
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	return replica_exec(nid, &hdr, inode);
+}
+
+/*
+ * Snapshot the working vdi vid of the inode by the tag, as 'dog vdi snapshot'
+ * does
+ */
+static int replica_snapshot(const struct node_id *nid,
+			    const struct sd_inode *inode, uint32_t vid,
+			    const char *tag)
+{
+	char t[SD_MAX_VDI_TAG_LEN] = {}, name[SD_MAX_VDI_LEN] = {};
+	struct sd_req hdr;
+	int ret;
+
+	pstrcpy(t, sizeof(t), tag);
+	sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(t);
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	hdr.obj.offset = offsetof(struct sd_inode, tag);
+	ret = replica_exec(nid, &hdr, t);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	pstrcpy(name, sizeof(name), inode->name);
+	sd_init_req(&hdr, SD_OP_NEW_VDI);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = SD_MAX_VDI_LEN;
+	hdr.vdi.base_vdi_id = vid;
+	hdr.vdi.snapid = 1;
+	hdr.vdi.vdi_size = inode->vdi_size;
+	hdr.vdi.copy_policy = inode->copy_policy;
+	hdr.vdi.store_policy = inode->store_policy;
+	hdr.vdi.block_size_shift = inode->block_size_shift;
+	return replica_exec(nid, &hdr, name);
+}
+
+static void replica_delete(const struct node_id *nid, const char *name,
+			   const char *tag)
+{
+	char buf[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN] = {};
+	struct sd_req hdr;
+	int ret;
+
+	pstrcpy(buf, SD_MAX_VDI_LEN, name);
+	pstrcpy(buf + SD_MAX_VDI_LEN, SD_MAX_VDI_TAG_LEN, tag);
+	sd_init_req(&hdr, SD_OP_DEL_VDI);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(buf);
+	ret = replica_exec(nid, &hdr, buf);
+	if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_VDI)
+		sd_warn("failed to delete %s:%s%s, %s", name, tag,
+			nid ? " of the remote" : "", sd_strerror(ret));
+}
+
+/* Read or write the replication of the vdi of the inode */
+static int replica_attr(const struct sd_inode *inode, struct vdi_replica *conf,
+			bool wr)
+{
+	struct sheepdog_vdi_attr *vattr;
+	uint32_t attrid;
+	int ret;
+
+	vattr = xzalloc(sizeof(*vattr));
+	pstrcpy(vattr->name, sizeof(vattr->name), inode->name);
+	pstrcpy(vattr->key, sizeof(vattr->key), SD_REPLICA_ATTR_KEY);
+	if (wr) {
+		vattr->value_len = sizeof(*conf);
+		memcpy(vattr->value, conf, sizeof(*conf));
+	}
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, sd_hash_vdi(inode->name),
+			   &attrid, inode->create_time, wr, false, false);
+	if (ret == SD_RES_SUCCESS && !wr) {
+		if (vattr->value_len == sizeof(*conf))
+			memcpy(conf, vattr->value, sizeof(*conf));
+		else
+			ret = SD_RES_NO_OBJ;
+	}
+	free(vattr);
+	return ret;
+}
+
+/* Find the remote vdi, created and grown to the size of the inode */
+static int replica_remote_vdi(struct replica_round *rr,
+			      const struct sd_inode *inode,
+			      struct sd_inode *remote)
+{
+	char name[SD_MAX_VDI_LEN] = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	ret = replica_lookup(&rr->nid, inode->name, &rr->remote_vid);
+	if (ret == SD_RES_NO_VDI) {
+		pstrcpy(name, sizeof(name), inode->name);
+		sd_init_req(&hdr, SD_OP_NEW_VDI);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.data_length = SD_MAX_VDI_LEN;
+		hdr.vdi.vdi_size = inode->vdi_size;
+		hdr.vdi.block_size_shift = inode->block_size_shift;
+		ret = sheep_exec_req(&rr->nid, &hdr, name);
+		rr->remote_vid = rsp->vdi.vdi_id;
+	}
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	ret = replica_read_header(&rr->nid, rr->remote_vid, remote);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	if (remote->store_policy ||
+	    remote->block_size_shift != inode->block_size_shift)
+		return SD_RES_INVALID_PARMS;
+	if (remote->vdi_size >= inode->vdi_size)
+		return SD_RES_SUCCESS;
+
+	/* resized as 'dog vdi resize' does */
+	remote->vdi_size = inode->vdi_size;
+	sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(remote->vdi_size);
+	hdr.obj.oid = vid_to_vdi_oid(rr->remote_vid);
+	hdr.obj.offset = offsetof(struct sd_inode, vdi_size);
+	return sheep_exec_req(&rr->nid, &hdr, &remote->vdi_size);
+}
+
+static int replica_block_hash(struct replica_round *rr, uint64_t oid,
+			      uint8_t digests[][SHA1_DIGEST_SIZE])
+{
+	const struct sd_node *n;
+	struct sd_req hdr;
+
+	n = oid_to_vnode(oid, &rr->vinfo->vroot, 0)->node;
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.data_length = SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = sys_epoch();
+	if (node_is_local(n))
+		return exec_local_req(&hdr, digests);
+	return sheep_exec_req(&n->nid, &hdr, digests);
+}
+
+static int replica_send(struct replica_round *rr, uint32_t idx, void *buf,
+			uint32_t len, uint32_t offset)
+{
+	struct sd_req hdr;
+	uint32_t zlen = 0;
+	void *z = NULL;
+	int ret;
+
+	if (uatomic_is_true(&rr->deflate))
+		z = wire_deflate(buf, len, &zlen);
+	sd_init_req(&hdr, SD_OP_REPLICA_WRITE);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.obj.oid = vid_to_data_oid(rr->remote_vid, idx);
+	hdr.obj.offset = offset;
+	if (z) {
+		hdr.flags |= SD_FLAG_CMD_DEFLATE;
+		hdr.data_length = zlen;
+		ret = sheep_exec_req(&rr->nid, &hdr, z);
+		free(z);
+		if (ret != SD_RES_NO_SUPPORT)
+			goto out;
+		/* the remote sheep is built without compression */
+		uatomic_set_false(&rr->deflate);
+		hdr.flags &= ~SD_FLAG_CMD_DEFLATE;
+	}
+	hdr.data_length = len;
+	ret = sheep_exec_req(&rr->nid, &hdr, buf);
+	zlen = len;
+out:
+	if (ret == SD_RES_SUCCESS) {
+		uatomic_add(&rr->sent, zlen);
+		uatomic_add(&rr->raw, len);
+	}
+	return ret;
+}
+
+static void replica_object_work(struct work *work)
+{
+	struct replica_obj_work *ow = container_of(work, struct replica_obj_work,
+						   work);
+	struct replica_round *rr = ow->rr;
+	uint64_t oid = vid_to_data_oid(ow->to_vid, ow->idx);
+	uint32_t objsize = get_vdi_objsize(oid);
+	uint32_t bsize = objsize / SD_BLOCK_HASH_NR;
+	uint8_t from[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	uint8_t to[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	bool whole = true;
+	char *buf;
+	int ret = SD_RES_SUCCESS;
+
+	/* the digests of the erasure coded objects are of their strips */
+	if (ow->from_vid && !is_erasure_oid(oid) &&
+	    replica_block_hash(rr, vid_to_data_oid(ow->from_vid, ow->idx),
+			       from) == SD_RES_SUCCESS &&
+	    replica_block_hash(rr, oid, to) == SD_RES_SUCCESS)
+		whole = false;
+
+	buf = xvalloc(objsize);
+	for (int i = 0, j; i < SD_BLOCK_HASH_NR; i = j) {
+		if (!whole && !memcmp(from[i], to[i], SHA1_DIGEST_SIZE)) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < SD_BLOCK_HASH_NR; j++)
+			if (!whole && !memcmp(from[j], to[j], SHA1_DIGEST_SIZE))
+				break;
+
+		ret = sd_read_object(oid, buf, (j - i) * bsize, i * bsize);
+		if (ret == SD_RES_SUCCESS)
+			ret = replica_send(rr, ow->idx, buf, (j - i) * bsize,
+					   i * bsize);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to replicate %"PRIx64" of %s, %s", oid,
+			       rr->name, sd_strerror(ret));
+			break;
+		}
+	}
+	free(buf);
+
+	sd_mutex_lock(&rr->lock);
+	if (ret != SD_RES_SUCCESS)
+		rr->ret = ret;
+	rr->nr_inflight--;
+	sd_cond_signal(&rr->cond);
+	sd_mutex_unlock(&rr->lock);
+}
+
+static void replica_object_done(struct work *work)
+{
+	free(container_of(work, struct replica_obj_work, work));
+}
+
+/* Send the objects of to which differ from those of from, NULL for all */
+static int replica_send_objects(struct replica_round *rr,
+				const struct sd_inode *from,
+				const struct sd_inode *to)
+{
+	struct replica_obj_work *ow;
+	int ret;
+
+	for (uint32_t idx = 0; idx < count_data_objs(to); idx++) {
+		uint32_t to_vid = to->data_vdi_id[idx];
+		uint32_t from_vid = 0;
+
+		if (from && idx < count_data_objs(from))
+			from_vid = from->data_vdi_id[idx];
+		if (!to_vid || to_vid == from_vid)
+			continue;
+
+		sd_mutex_lock(&rr->lock);
+		while (rr->nr_inflight >= REPLICA_JOBS)
+			sd_cond_wait(&rr->cond, &rr->lock);
+		ret = rr->ret;
+		if (ret == SD_RES_SUCCESS)
+			rr->nr_inflight++;
+		sd_mutex_unlock(&rr->lock);
+		if (ret != SD_RES_SUCCESS)
+			break;
+
+		ow = xzalloc(sizeof(*ow));
+		ow->rr = rr;
+		ow->idx = idx;
+		ow->from_vid = from_vid;
+		ow->to_vid = to_vid;
+		ow->work.fn = replica_object_work;
+		ow->work.done = replica_object_done;
+		queue_work(sys->replica_obj_wqueue, &ow->work);
+	}
+
+	sd_mutex_lock(&rr->lock);
+	while (rr->nr_inflight)
+		sd_cond_wait(&rr->cond, &rr->lock);
+	ret = rr->ret;
+	sd_mutex_unlock(&rr->lock);
+	return ret;
+}
+
+/* The snapshot of the last round, NULL if it's gone */
+static struct sd_inode *replica_read_snapshot(const struct vdi_replica *conf,
+					      const char *name)
+{
+	struct sd_inode *inode;
+
+	if (!conf->seq || !conf->snap_vid)
+		return NULL;
+
+	inode = xmalloc(sizeof(*inode));
+	if (sd_inode_read(vid_to_vdi_oid(conf->snap_vid), inode,
+			  sizeof(*inode)) != SD_RES_SUCCESS ||
+	    strcmp(inode->name, name) || !inode->snap_ctime) {
+		free(inode);
+		return NULL;
+	}
+	return inode;
+}
+
+static int replica_do_round(struct replica_round *rr)
+{
+	struct sd_inode *inode = NULL, *old = NULL, *remote;
+	char tag[SD_MAX_VDI_TAG_LEN], old_tag[SD_MAX_VDI_TAG_LEN];
+	uint32_t vid, snap_vid;
+	int ret;
+
+	remote = xmalloc(SD_INODE_HEADER_SIZE);
+	inode = xmalloc(sizeof(*inode));
+	ret = replica_lookup(NULL, rr->name, &vid);
+	if (ret == SD_RES_SUCCESS)
+		ret = replica_read_header(NULL, vid, inode);
+	if (ret == SD_RES_SUCCESS)
+		ret = replica_attr(inode, &rr->conf, false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (!rr->conf.interval)
+		goto out;
+	if (inode->store_policy) {
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
+	}
+
+	memcpy(rr->nid.addr, rr->conf.addr, sizeof(rr->nid.addr));
+	rr->nid.port = rr->conf.port;
+	ret = replica_remote_vdi(rr, inode, remote);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	snprintf(tag, sizeof(tag), "replica-%"PRIu32, rr->conf.seq + 1);
+	snprintf(old_tag, sizeof(old_tag), "replica-%"PRIu32, rr->conf.seq);
+	ret = replica_snapshot(NULL, inode, vid, tag);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	snap_vid = vid;
+
+	ret = sd_inode_read(vid_to_vdi_oid(snap_vid), inode, sizeof(*inode));
+	if (ret == SD_RES_SUCCESS) {
+		old = replica_read_snapshot(&rr->conf, rr->name);
+		ret = replica_send_objects(rr, old, inode);
+	}
+	if (ret == SD_RES_SUCCESS)
+		ret = replica_snapshot(&rr->nid, remote, rr->remote_vid, tag);
+	if (ret != SD_RES_SUCCESS) {
+		replica_delete(NULL, rr->name, tag);
+		goto out;
+	}
+
+	if (rr->conf.seq) {
+		replica_delete(&rr->nid, rr->name, old_tag);
+		replica_delete(NULL, rr->name, old_tag);
+	}
+	rr->conf.seq++;
+	rr->conf.snap_vid = snap_vid;
+	ret = replica_attr(inode, &rr->conf, true);
+out:
+	free(remote);
+	free(inode);
+	free(old);
+	return ret;
+}
+
+static void replica_round_work(struct work *work)
+{
+	struct replica_round *rr = container_of(work, struct replica_round,
+						work);
+
+	rr->ret = replica_do_round(rr);
+}
+
+static void replica_round_done(struct work *work)
+{
+	struct replica_round *rr = container_of(work, struct replica_round,
+						work);
+	struct replica key = {}, *r;
+
+	key.name_vid = sd_hash_vdi(rr->name);
+	r = rb_search(&replica_root, &key, node, replica_cmp);
+	if (r) {
+		r->running = false;
+		if (rr->ret == SD_RES_SUCCESS)
+			r->interval = rr->conf.interval;
+		r->next = time(NULL) + r->interval;
+		if (!r->interval) {
+			rb_erase(&r->node, &replica_root);
+			free(r);
+		}
+	}
+
+	if (rr->ret != SD_RES_SUCCESS)
+		sd_err("failed to replicate %s to %s, %s", rr->name,
+		       addr_to_str(rr->nid.addr, rr->nid.port),
+		       sd_strerror(rr->ret));
+	else if (rr->raw)
+		sd_info("replicated %s to %s, round %"PRIu32", %"PRIu64
+			" bytes in %"PRIu64" on the wire", rr->name,
+			addr_to_str(rr->nid.addr, rr->nid.port), rr->conf.seq,
+			rr->raw, rr->sent);
+
+	put_vnode_info(rr->vinfo);
+	sd_destroy_cond(&rr->cond);
+	sd_destroy_mutex(&rr->lock);
+	free(rr);
+}
+
+static void replica_scan_work(struct work *work)
+{
+	struct replica_scan_work *sw = container_of(work,
+						    struct replica_scan_work,
+						    work);
+	struct sd_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+	struct vdi_replica conf;
+	unsigned long vid;
+	int ret;
+
+	FOR_EACH_BIT(vid, sys->vdi_inuse, SD_NR_VDIS) {
+		ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+				     SD_INODE_HEADER_SIZE, 0);
+		if (ret != SD_RES_SUCCESS) {
+			sw->ret = ret;
+			break;
+		}
+		/* the deleted vdis have no name */
+		if (inode->snap_ctime || !inode->name[0])
+			continue;
+
+		ret = replica_attr(inode, &conf, false);
+		if (ret == SD_RES_NO_OBJ)
+			continue;
+		if (ret != SD_RES_SUCCESS) {
+			sw->ret = ret;
+			break;
+		}
+		if (!conf.interval)
+			continue;
+
+		sw->confs = xrealloc(sw->confs,
+				     sizeof(*sw->confs) * (sw->nr + 1));
+		sw->names = xrealloc(sw->names,
+				     sizeof(*sw->names) * (sw->nr + 1));
+		sw->confs[sw->nr] = conf;
+		pstrcpy(sw->names[sw->nr], SD_MAX_VDI_LEN, inode->name);
+		sw->nr++;
+	}
+	free(inode);
+}
+
+static void replica_scan_done(struct work *work)
+{
+	struct replica_scan_work *sw = container_of(work,
+						    struct replica_scan_work,
+						    work);
+	struct replica *r;
+
+	replica_scanning = false;
+	if (sw->ret != SD_RES_SUCCESS)
+		/* tried again at the next tick */
+		sd_debug("failed to scan the replicated vdis, %s",
+			 sd_strerror(sw->ret));
+	else {
+		replica_scanned = true;
+		for (int i = 0; i < sw->nr; i++) {
+			r = xzalloc(sizeof(*r));
+			r->name_vid = sd_hash_vdi(sw->names[i]);
+			pstrcpy(r->name, sizeof(r->name), sw->names[i]);
+			r->interval = sw->confs[i].interval;
+			/* SD_OP_SET_VDI_REPLICA goes first */
+			if (rb_insert(&replica_root, r, node, replica_cmp))
+				free(r);
+		}
+	}
+	free(sw->confs);
+	free(sw->names);
+	free(sw);
+}
+
+static void replica_queue_round(struct replica *r, struct vnode_info *vinfo)
+{
+	struct replica_round *rr;
+
+	rr = xzalloc(sizeof(*rr));
+	pstrcpy(rr->name, sizeof(rr->name), r->name);
+	rr->vinfo = grab_vnode_info(vinfo);
+	uatomic_set_true(&rr->deflate);
+	sd_init_mutex(&rr->lock);
+	sd_cond_init(&rr->cond);
+	rr->work.fn = replica_round_work;
+	rr->work.done = replica_round_done;
+	r->running = true;
+	queue_work(sys->replica_wqueue, &rr->work);
+}
+
+static void replica_tick(void *data)
+{
+	struct replica_scan_work *sw;
+	struct vnode_info *vinfo;
+	const struct sd_node *n;
+	struct replica *r;
+	uint64_t now = time(NULL);
+
+	add_timer(&replica_timer, REPLICA_TICK);
+	if (sys->cinfo.status != SD_STATUS_OK)
+		return;
+
+	if (!replica_scanned && !replica_scanning) {
+		replica_scanning = true;
+		sw = xzalloc(sizeof(*sw));
+		sw->work.fn = replica_scan_work;
+		sw->work.done = replica_scan_done;
+		queue_work(sys->replica_wqueue, &sw->work);
+	}
+
+	vinfo = get_vnode_info();
+	if (!vinfo)
+		return;
+	rb_for_each_entry(r, &replica_root, node) {
+		if (r->running || now < r->next)
+			continue;
+		n = oid_to_vnode(vid_to_vdi_oid(r->name_vid), &vinfo->vroot,
+				 0)->node;
+		if (node_is_local(n))
+			replica_queue_round(r, vinfo);
+	}
+	put_vnode_info(vinfo);
+}
+
+/* SD_OP_SET_VDI_REPLICA, the first round starts at the next tick */
+main_fn void replica_update(const char *name, const struct vdi_replica *conf)
+{
+	struct replica key = {}, *r;
+
+	key.name_vid = sd_hash_vdi(name);
+	r = rb_search(&replica_root, &key, node, replica_cmp);
+	if (!r) {
+		if (!conf->interval)
+			return;
+		r = xzalloc(sizeof(*r));
+		r->name_vid = key.name_vid;
+		pstrcpy(r->name, sizeof(r->name), name);
+		rb_insert(&replica_root, r, node, replica_cmp);
+	}
+
+	r->interval = conf->interval;
+	r->next = 0;
+	if (!r->interval && !r->running) {
+		rb_erase(&r->node, &replica_root);
+		free(r);
+	}
+}
+
+/*
+ * Write the blocks of SD_OP_REPLICA_WRITE to the working vdi of the oid, with
+ * copy-on-write from the object of its inode if it's of another vdi.  The
+ * senders write an object from one request at a time.
+ */
+int replica_write(uint64_t oid, uint32_t offset, void *data, uint32_t len)
+{
+	uint32_t vid = oid_to_vid(oid), idx = data_oid_to_idx(oid), cur;
+	struct sd_inode *inode;
+	struct sd_req hdr;
+	int ret;
+
+	if (!is_data_obj(oid) || offset + len > get_vdi_objsize(oid))
+		return SD_RES_INVALID_PARMS;
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (inode->snap_ctime) {
+		ret = SD_RES_READONLY;
+		goto out;
+	}
+	if (inode->store_policy) {
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
+	}
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)&cur, sizeof(cur),
+			     SD_INODE_HEADER_SIZE + sizeof(cur) * idx);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (cur == vid) {
+		ret = sd_write_object(oid, data, len, offset, false);
+		goto out;
+	}
+
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	if (cur) {
+		hdr.flags |= SD_FLAG_CMD_COW;
+		hdr.obj.cow_oid = vid_to_data_oid(cur, idx);
+	}
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	hdr.obj.copies = inode->nr_copies;
+	hdr.obj.copy_policy = inode->copy_policy;
+	ret = exec_local_req(&hdr, data);
+	if (ret == SD_RES_SUCCESS)
+		ret = sd_inode_write_vid(inode, idx, vid, vid, 0, false,
+					 false);
+out:
+	free(inode);
+	return ret;
+}
+
+void replica_start(void)
+{
+	replica_timer.callback = replica_tick;
+	add_timer(&replica_timer, REPLICA_TICK);
+}
@@ -10,9 +10,16 @@
  */
 
 #include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "sheep_priv.h"
 
+#define PIPE_RX_BUF_SIZE (64 * 1024)
+#define PIPE_RX_BUDGET 64 /* requests received per event */
+#define PIPE_TX_IOVS 64
+#define ADMIT_RETRY_INTERVAL 10 /* ms, see admit_timer_fn() */
+
 static void del_requeue_request(struct request *req)
 {
 	list_del(&req->request_list);
@@ -26,7 +33,7 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	int i;
 
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
 			return true;
@@ -81,10 +88,24 @@ static void io_op_done(struct work *work)
  *      4. Object requested doesn't exist and is being recovered
  *         In this case, we put the request into wait queue of receiver and when
  *         we recover an object we try to wake up the request on this oid.
+ *
+ * The requests of the cases 1 and 2 wait on sys->req_wait_epoch, and the ones
+ * of the cases 3 and 4 on the queue of their oid in sys->req_wait_oid, so the
+ * wakeup of an oid doesn't walk all the sleeping requests.
  */
 static inline void sleep_on_wait_queue(struct request *req)
 {
-	list_add_tail(&req->request_list, &sys->req_wait_queue);
+	list_add_tail(&req->request_list, &sys->req_wait_epoch);
+}
+
+static inline struct list_head *oid_wait_queue(uint64_t oid)
+{
+	return sys->req_wait_oid + sd_hash_oid(oid) % REQ_WAIT_HASH_SIZE;
+}
+
+static inline void sleep_on_oid_queue(struct request *req)
+{
+	list_add_tail(&req->request_list, oid_wait_queue(req->local_oid));
 }
 
 static void gateway_op_done(struct work *work)
@@ -92,6 +113,7 @@ static void gateway_op_done(struct work *work)
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	qos_done(req);
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->cinfo.epoch) {
@@ -121,6 +143,7 @@ static void gateway_op_done(struct work *work)
 		break;
 	case SD_RES_SUCCESS:
 	case SD_RES_READONLY:
+	case SD_RES_EXPIRED:
 		break;
 	default:
 		if (req->local)
@@ -200,7 +223,7 @@ static bool request_in_recovery(struct request *req)
 
 	if (oid_in_recovery(req->local_oid, req->rq.opcode)) {
 		sd_debug("%"PRIx64" wait on oid", req->local_oid);
-		sleep_on_wait_queue(req);
+		sleep_on_oid_queue(req);
 		return true;
 	}
 	return false;
@@ -212,7 +235,7 @@ void wakeup_requests_on_epoch(void)
 	struct request *req;
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(&sys->req_wait_epoch, &pending_list);
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		switch (req->rp.result) {
@@ -240,7 +263,7 @@ void wakeup_requests_on_epoch(void)
 		}
 	}
 
-	list_splice_init(&pending_list, &sys->req_wait_queue);
+	list_splice_init(&pending_list, &sys->req_wait_epoch);
 }
 
 /* Wakeup the requests on the oid that was previously being recovered */
@@ -249,7 +272,7 @@ void wakeup_requests_on_oid(uint64_t oid)
 	struct request *req;
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(oid_wait_queue(oid), &pending_list);
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		if (req->local_oid != oid)
@@ -257,7 +280,7 @@ void wakeup_requests_on_oid(uint64_t oid)
 		sd_debug("retry %" PRIx64, req->local_oid);
 		del_requeue_request(req);
 	}
-	list_splice_init(&pending_list, &sys->req_wait_queue);
+	list_splice_init(&pending_list, oid_wait_queue(oid));
 }
 
 void wakeup_all_requests(void)
@@ -265,7 +288,9 @@ void wakeup_all_requests(void)
 	struct request *req;
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(&sys->req_wait_epoch, &pending_list);
+	for (int i = 0; i < REQ_WAIT_HASH_SIZE; i++)
+		list_splice_tail_init(&sys->req_wait_oid[i], &pending_list);
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		sd_debug("%"PRIx64, req->rq.obj.oid);
@@ -288,7 +313,15 @@ static void queue_peer_request(struct request *req)
 
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
-	queue_work(sys->io_wqueue, &req->work);
+	/* the deflated payloads are coded by the workers */
+	if (!(req->rq.flags & SD_FLAG_CMD_DEFLATE) && sd_store &&
+	    sd_store->queue_request && sd_store->queue_request(req))
+		return;
+	/* the workers take the foreground ones first */
+	if (sockfd_req_class(&req->rq) == SOCKFD_BG)
+		queue_work(sys->bg_io_wqueue, &req->work);
+	else
+		queue_work(sys->io_wqueue, &req->work);
 }
 
 /*
@@ -307,12 +340,70 @@ static bool has_enough_zones(struct request *req)
 	return req->vinfo->nr_zones >= get_vdi_copy_number(oid_to_vid(oid));
 }
 
+static void local_read_work(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	uint64_t start = clock_get_time();
+
+	if (req->queue_start) {
+		request_latency(req, SD_LAT_QUEUE, req->queue_start);
+		req->queue_start = 0;
+	}
+	if (request_expired(req)) {
+		req->rp.result = SD_RES_EXPIRED;
+		return;
+	}
+	req->rp.result = peer_read_obj(req);
+	request_latency(req, SD_LAT_WORK, start);
+}
+
+static void local_read_done(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+
+	if (req->rp.result == SD_RES_SUCCESS ||
+	    req->rp.result == SD_RES_EXPIRED)
+		return gateway_op_done(work);
+
+	/* the gateway reads the other copies */
+	sd_debug("local read %"PRIx64" failed, %s", req->rq.obj.oid,
+		 sd_strerror(req->rp.result));
+	req->rp.result = SD_RES_SUCCESS;
+	req->work.fn = do_process_work;
+	req->work.done = gateway_op_done;
+	queue_work(sys->gateway_wqueue, &req->work);
+}
+
+/*
+ * A read of a replicated object with a copy on this node goes straight to
+ * the store on the io queue, without the gateway queue and the forwarding.
+ * Only a failed local read takes the gateway path to the other copies.
+ */
+static bool queue_local_read(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	if (req->rq.opcode != SD_OP_READ_OBJ || !req->local_oid ||
+	    sys->gateway_only || !bypass_object_cache(req) ||
+	    is_erasure_oid(oid) || quorum_object_pending(oid) ||
+	    /* replication_read() reads the other copies first */
+	    md_oid_slow(oid))
+		return false;
+
+	req->work.fn = local_read_work;
+	req->work.done = local_read_done;
+	qos_queue(req, sys->io_wqueue);
+	return true;
+}
+
 static void queue_gateway_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
 	if (is_access_local(req, hdr->obj.oid))
 		req->local_oid = hdr->obj.oid;
+	if (!req->span_id)
+		req->span_id = span_new_id();
 
 	/*
 	 * If we go for cache object, we don't care if it is being recovered
@@ -330,6 +421,9 @@ static void queue_gateway_request(struct request *req)
 		if (request_in_recovery(req))
 			return;
 
+	if (queue_local_read(req))
+		return;
+
 queue_work:
 	if (RB_EMPTY_ROOT(&req->vinfo->vroot)) {
 		sd_err("there is no living nodes");
@@ -345,7 +439,7 @@ queue_work:
 
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
-	queue_work(sys->gateway_wqueue, &req->work);
+	qos_queue(req, sys->gateway_wqueue);
 	return;
 
 end_request:
@@ -429,17 +523,64 @@ static main_fn inline void stat_request_end(struct request *req)
 		sys->stat.r.gway_active_nr--;
 }
 
-static void queue_request(struct request *req)
+/*
+ * Whether the deadline of the request has passed, in which case it's counted
+ * and not to run, the client has given up on it
+ */
+bool request_expired(struct request *req)
+{
+	if (!req->deadline || clock_get_time() < req->deadline)
+		return false;
+
+	sd_debug("%s %"PRIx64" expired", op_name(req->op), req->rq.obj.oid);
+	uatomic_inc(&sys->stat.r.expired_nr);
+	return true;
+}
+
+/* What is left of the deadline of the request, for the forwarded ones */
+uint8_t request_budget(const struct request *req)
+{
+	uint64_t unit = SD_DEADLINE_UNIT * 1000000ULL, now;
+
+	if (!req->deadline)
+		return 0;
+
+	now = clock_get_time();
+	if (now >= req->deadline)
+		return 1;
+	return min(DIV_ROUND_UP(req->deadline - now, unit), (uint64_t)UINT8_MAX);
+}
+
+static main_fn void queue_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct sd_rsp *rsp = &req->rp;
 
+	/* time in the wait queues counts as queueing delay too */
+	if (!req->queue_start)
+		req->queue_start = clock_get_time();
+
 	req->op = get_sd_op(hdr->opcode);
 	if (!req->op) {
 		sd_err("invalid opcode %d", hdr->opcode);
 		rsp->result = SD_RES_INVALID_PARMS;
 		goto done;
 	}
+	/* a lookup of an attribute needn't be ordered in the cluster */
+	if (hdr->opcode == SD_OP_GET_VDI_ATTR &&
+	    !(hdr->flags & (SD_FLAG_CMD_CREAT | SD_FLAG_CMD_EXCL |
+			    SD_FLAG_CMD_DEL)))
+		req->op = get_sd_op(SD_OP_LOOKUP_VDI_ATTR);
+
+	/* obj.deadline counts from the first time here, not from a requeue */
+	if (!req->deadline && hdr->obj.deadline &&
+	    (is_peer_op(req->op) || is_gateway_op(req->op)))
+		req->deadline = req->queue_start +
+			hdr->obj.deadline * SD_DEADLINE_UNIT * 1000000ULL;
+	if (request_expired(req)) {
+		rsp->result = SD_RES_EXPIRED;
+		goto done;
+	}
 
 	sd_debug("%s, %d", op_name(req->op), sys->cinfo.status);
 
@@ -471,8 +612,12 @@ static void queue_request(struct request *req)
 		break;
 	}
 
-	req->vinfo = get_vnode_info();
+	get_req_vnode_info(req);
 	stat_request_begin(req);
+	if (!req->local && hdr->obj.oid &&
+	    !(hdr->flags & SD_FLAG_CMD_RECOVERY) &&
+	    (is_peer_op(req->op) || is_gateway_op(req->op)))
+		heat_note(hdr->obj.oid);
 	if (is_peer_op(req->op)) {
 		queue_peer_request(req);
 	} else if (is_gateway_op(req->op)) {
@@ -500,10 +645,7 @@ done:
 
 void requeue_request(struct request *req)
 {
-	if (req->vinfo) {
-		put_vnode_info(req->vinfo);
-		req->vinfo = NULL;
-	}
+	put_req_vnode_info(req);
 	stat_request_end(req);
 	queue_request(req);
 }
@@ -529,7 +671,7 @@ static struct request *alloc_local_request(void *data, int data_length)
 
 static void free_local_request(struct request *req)
 {
-	put_vnode_info(req->vinfo);
+	put_req_vnode_info(req);
 	free(req);
 }
 
@@ -660,7 +802,7 @@ static struct request *alloc_request(struct client_info *ci,
 
 	if (data_length) {
 		req->data_length = data_length;
-		req->data = valloc(data_length);
+		req->data = buffer_alloc(data_length);
 		if (!req->data) {
 			free(req);
 			return NULL;
@@ -682,16 +824,191 @@ static struct request *alloc_request(struct client_info *ci,
 	return req;
 }
 
+/*
+ * Admission control of the client requests
+ *
+ * A client connection isn't read any more once it has sys->admit_conn
+ * requests in flight, or this node has sys->admit_node client requests in
+ * flight, so the overload stays in the socket buffers and the clients instead
+ * of our queues.  The connections are read again as the requests complete.
+ *
+ * The connections of the other sheep are never throttled, since the gateway
+ * requests of a node wait for the peer requests they send to the others.  A
+ * connection is known to be of a sheep once it sends a peer request.
+ *
+ * Each event loop keeps its throttled connections, which are rechecked as
+ * its requests complete and every ADMIT_RETRY_INTERVAL for the completions in
+ * the other loops.
+ */
+static __thread struct list_head throttled_clients;
+static __thread struct timer admit_timer;
+
+static inline bool client_admitted(const struct client_info *ci)
+{
+	if (ci->peer)
+		return true;
+	if (sys->admit_conn && ci->nr_admitted >= sys->admit_conn)
+		return false;
+	if (sys->admit_node &&
+	    uatomic_read(&sys->nr_admitted) >= sys->admit_node)
+		return false;
+	return true;
+}
+
+static reactor_fn void admit_request(struct client_info *ci,
+				     struct request *req)
+{
+	if (!ci->peer && is_peer_op(get_sd_op(req->rq.opcode)))
+		ci->peer = true;
+	/* the senders keep a connection for each traffic class */
+	if (!ci->bg && sockfd_req_class(&req->rq) == SOCKFD_BG) {
+		ci->bg = true;
+		sockfd_mark(ci->conn.fd, SOCKFD_BG);
+	}
+	if (ci->peer || (!sys->admit_conn && !sys->admit_node))
+		return;
+
+	req->admitted = true;
+	ci->nr_admitted++;
+	uatomic_inc(&sys->nr_admitted);
+}
+
+static reactor_fn void pipe_rx(struct client_info *ci);
+
+static reactor_fn void admit_timer_fn(void *data)
+{
+	struct client_info *ci;
+
+	list_for_each_entry(ci, &throttled_clients, throttled_list) {
+		if (!ci->conn.dead && !client_admitted(ci))
+			continue;
+
+		list_del(&ci->throttled_list);
+		ci->throttled = false;
+		if (ci->conn.dead)
+			continue;
+		if (conn_rx_on(&ci->conn)) {
+			sd_err("switch on receiving flag failure, "
+			       "connection maybe closed");
+			ci->conn.dead = true;
+			continue;
+		}
+		/* the headers already received wake nobody up */
+		if (ci->pipeline && ci->rx_pos != ci->rx_len) {
+			pipe_rx(ci);
+			if (ci->conn.dead)
+				clear_client_info(ci);
+		}
+	}
+
+	if (!list_empty(&throttled_clients))
+		add_timer(&admit_timer, ADMIT_RETRY_INTERVAL);
+}
+
+/* Stop reading the connection if it has no credit, return true if so */
+static reactor_fn bool throttle_client(struct client_info *ci)
+{
+	if (client_admitted(ci))
+		return false;
+
+	if (conn_rx_off(&ci->conn)) {
+		ci->conn.dead = true;
+		return true;
+	}
+
+	sd_debug("throttle %s:%d, %d in flight", ci->conn.ipstr,
+		 ci->conn.port, ci->nr_admitted);
+	if (!throttled_clients.n.next)
+		INIT_LIST_HEAD(&throttled_clients);
+	list_add_tail(&ci->throttled_list, &throttled_clients);
+	ci->throttled = true;
+
+	admit_timer.callback = admit_timer_fn;
+	if (!timer_pending(&admit_timer))
+		add_timer(&admit_timer, ADMIT_RETRY_INTERVAL);
+	return true;
+}
+
+static reactor_fn void release_admission(struct client_info *ci)
+{
+	ci->nr_admitted--;
+	uatomic_dec(&sys->nr_admitted);
+
+	/* recheck the throttled connections from the event loop */
+	if (throttled_clients.n.next && !list_empty(&throttled_clients))
+		add_timer(&admit_timer, 0);
+}
+
 static void free_request(struct request *req)
 {
-	uatomic_dec(&sys->nr_outstanding_reqs);
+	/* The main thread may be waiting for the last request at shutdown */
+	if (uatomic_sub_return(&sys->nr_outstanding_reqs, 1) == 0 &&
+	    is_reactor_thread())
+		reactor_wakeup_main();
 
+	if (req->admitted)
+		release_admission(req->ci);
 	refcount_dec(&req->ci->refcnt);
-	put_vnode_info(req->vinfo);
-	free(req->data);
+	put_req_vnode_info(req);
+	if (!req->shm)
+		buffer_free(req->data, req->data_length);
 	free(req);
 }
 
+static reactor_fn void shm_complete(struct client_info *ci,
+				    struct request *req);
+
+static reactor_fn void finish_client_request(struct request *req)
+{
+	struct client_info *ci = req->ci;
+
+	if (ci->conn.dead) {
+		/*
+		 * free_request should be called prior to clear_client_info
+		 * because refcnt of ci will be decreased in free_request.
+		 * Otherwise, ci cannot be freed in clear_client_info.
+		 */
+		free_request(req);
+		clear_client_info(ci);
+	} else if (req->shm) {
+		shm_complete(ci, req);
+	} else if (ci->pipeline) {
+		/* fill the header now, pipe_tx() may send it piecemeal */
+		req->rp.epoch = sys->cinfo.epoch;
+		req->rp.opcode = req->rq.opcode;
+		req->rp.id = req->rq.id;
+		req->tx_start = clock_get_time();
+		list_add_tail(&req->request_list, &ci->done_reqs);
+
+		/* pipe_tx() sends all the finished requests at once */
+		if (!(ci->conn.events & EPOLLOUT) && conn_tx_on(&ci->conn)) {
+			sd_err("switch on sending flag failure, "
+			       "connection maybe closed");
+			clear_client_info(ci);
+		}
+	} else {
+		list_add_tail(&req->request_list, &ci->done_reqs);
+
+		if (ci->tx_req == NULL)
+			/* There is no request being sent. */
+			if (conn_tx_on(&ci->conn)) {
+				sd_err("switch on sending flag failure, "
+				       "connection maybe closed");
+				/*
+				 * should not free_request(req) here because
+				 * it is already in done list clear_client_info
+				 * will free it
+				 */
+				clear_client_info(ci);
+			}
+	}
+}
+
+static void finish_client_request_msg(struct reactor_msg *msg)
+{
+	finish_client_request(container_of(msg, struct request, msg));
+}
+
 main_fn void put_request(struct request *req)
 {
 	struct client_info *ci = req->ci;
@@ -703,33 +1020,13 @@ main_fn void put_request(struct request *req)
 
 	if (req->local)
 		eventfd_xwrite(req->local_req_efd, 1);
-	else {
-		if (ci->conn.dead) {
-			/*
-			 * free_request should be called prior to
-			 * clear_client_info because refcnt of ci will
-			 * be decreased in free_request. Otherwise, ci
-			 * cannot be freed in clear_client_info.
-			 */
-			free_request(req);
-			clear_client_info(ci);
-		} else {
-			list_add_tail(&req->request_list, &ci->done_reqs);
-
-			if (ci->tx_req == NULL)
-				/* There is no request being sent. */
-				if (conn_tx_on(&ci->conn)) {
-					sd_err("switch on sending flag failure, "
-						"connection maybe closed");
-					/*
-					 * should not free_request(req) here
-					 * because it is already in done list
-					 * clear_client_info will free it
-					 */
-					clear_client_info(ci);
-				}
-		}
-	}
+	else if (req->rconn)
+		rdma_put_request(req);
+	else if (ci->reactor) {
+		req->msg.fn = finish_client_request_msg;
+		reactor_post(ci->reactor, &req->msg);
+	} else
+		finish_client_request(req);
 }
 
 main_fn void get_request(struct request *req)
@@ -737,6 +1034,26 @@ main_fn void get_request(struct request *req)
 	refcount_inc(&req->refcnt);
 }
 
+/*
+ * Helpers for the transports other than the client sockets, which complete
+ * their requests by themselves
+ */
+main_fn struct request *alloc_remote_request(struct client_info *ci,
+					     uint32_t data_length)
+{
+	return alloc_request(ci, data_length);
+}
+
+main_fn void free_remote_request(struct request *req)
+{
+	free_request(req);
+}
+
+main_fn void queue_remote_request(struct request *req)
+{
+	queue_request(req);
+}
+
 static inline bool check_hdr(struct sd_req *hdr)
 {
 	bool ret = true;
@@ -781,7 +1098,9 @@ static inline bool check_hdr(struct sd_req *hdr)
 		}
 		/* fall thru */
 	case SD_OP_READ_OBJ:
-		if (unlikely(hdr->data_length > SD_INODE_SIZE)) {
+		if (unlikely(hdr->data_length >
+			     max(SD_INODE_SIZE,
+				 (size_t)1 << SD_MAX_BLOCK_SIZE_SHIFT))) {
 			sd_debug("bad length %"PRIu32, hdr->data_length);
 			ret = false;
 		}
@@ -801,6 +1120,7 @@ static void rx_work(struct work *work)
 	struct connection *conn = &ci->conn;
 	struct sd_req hdr;
 	struct request *req;
+	uint64_t start = clock_get_time();
 
 	ret = do_read(conn->fd, &hdr, sizeof(hdr), NULL, 0, UINT32_MAX);
 	if (ret) {
@@ -825,6 +1145,7 @@ static void rx_work(struct work *work)
 		return;
 	}
 	ci->rx_req = req;
+	req->rx_start = start;
 
 	/* use le_to_cpu */
 	memcpy(&req->rq, &hdr, sizeof(req->rq));
@@ -835,11 +1156,22 @@ static void rx_work(struct work *work)
 		if (ret) {
 			sd_err("failed to read data");
 			conn->dead = true;
+			return;
 		}
 	}
+	request_latency(req, SD_LAT_RX, start);
+}
+
+static void queue_request_msg(struct reactor_msg *msg)
+{
+	queue_request(container_of(msg, struct request, msg));
 }
 
-static void rx_main(struct work *work)
+static reactor_fn void shm_attach(struct client_info *ci,
+				  struct request *req);
+static reactor_fn void shm_start(struct client_info *ci);
+
+static reactor_fn void rx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      rx_work);
@@ -857,7 +1189,12 @@ static void rx_main(struct work *work)
 		return;
 	}
 
-	if (conn_rx_on(&ci->conn))
+	/* the socket stays quiet until the ring is attached */
+	if (unlikely(req->rq.opcode == SD_OP_SHM_ATTACH))
+		return shm_attach(ci, req);
+
+	admit_request(ci, req);
+	if (!throttle_client(ci) && conn_rx_on(&ci->conn))
 		sd_err("switch on receiving flag failure, "
 				"connection maybe closed");
 
@@ -874,7 +1211,12 @@ static void rx_main(struct work *work)
 			 ci->conn.ipstr,
 			 ci->conn.port);
 	}
-	queue_request(req);
+
+	if (ci->reactor) {
+		req->msg.fn = queue_request_msg;
+		reactor_post(NULL, &req->msg);
+	} else
+		queue_request(req);
 }
 
 static void tx_work(struct work *work)
@@ -886,6 +1228,7 @@ static void tx_work(struct work *work)
 	struct sd_rsp rsp;
 	struct request *req = ci->tx_req;
 	void *data = NULL;
+	uint64_t start = clock_get_time();
 
 	/* use cpu_to_le */
 	memcpy(&rsp, &req->rp, sizeof(rsp));
@@ -902,10 +1245,13 @@ static void tx_work(struct work *work)
 	if (ret != 0) {
 		sd_err("failed to send a request");
 		conn->dead = true;
+		return;
 	}
+	request_latency(req, SD_LAT_TX, start);
+	request_latency(req, SD_LAT_TOTAL, req->rx_start);
 }
 
-static void tx_main(struct work *work)
+static reactor_fn void tx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      tx_work);
@@ -930,6 +1276,9 @@ static void tx_main(struct work *work)
 	free_request(ci->tx_req);
 	ci->tx_req = NULL;
 
+	if (ci->shm_pending && list_empty(&ci->done_reqs))
+		shm_start(ci);
+
 	if (ci->conn.dead) {
 		clear_client_info(ci);
 		return;
@@ -941,19 +1290,555 @@ static void tx_main(struct work *work)
 					"connection maybe closed");
 }
 
+/*
+ * Pipelined connections
+ *
+ * With '--pipeline', the sockets of the clients are non-blocking and their
+ * event loop (the main thread or the reactor) does the I/O by itself instead
+ * of handing one request at a time to the net workers.  A readiness event
+ * parses as many headers as have arrived, and all the finished requests are
+ * sent back with one writev(), so a client with many outstanding requests
+ * costs a few syscalls per batch rather than a worker round trip for each
+ * request.  Responses are sent in completion order, not submission order;
+ * clients match them by id.
+ */
+
+/* Hand the fully received ci->rx_req over to the main thread */
+static reactor_fn void pipe_submit(struct client_info *ci)
+{
+	struct request *req = ci->rx_req;
+
+	ci->rx_req = NULL;
+	ci->rx_off = 0;
+	request_latency(req, SD_LAT_RX, req->rx_start);
+
+	if (unlikely(req->rq.opcode == SD_OP_SHM_ATTACH)) {
+		/* stop reading, the client may not send anything else */
+		if (conn_rx_off(&ci->conn))
+			ci->conn.dead = true;
+		return shm_attach(ci, req);
+	}
+
+	if (is_logging_op(get_sd_op(req->rq.opcode)))
+		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s", req,
+			ci->conn.fd, ci->conn.ipstr, ci->conn.port,
+			op_name(get_sd_op(req->rq.opcode)),
+			data_to_str(req->data, req->rq.data_length));
+
+	admit_request(ci, req);
+	if (ci->reactor) {
+		req->msg.fn = queue_request_msg;
+		reactor_post(NULL, &req->msg);
+	} else
+		queue_request(req);
+}
+
+/* Start a new request from the header at the head of rx_buf */
+static reactor_fn int pipe_rx_hdr(struct client_info *ci)
+{
+	struct sd_req hdr;
+	struct request *req;
+
+	memcpy(&hdr, ci->rx_buf + ci->rx_pos, sizeof(hdr));
+	ci->rx_pos += sizeof(hdr);
+
+	if (unlikely(!check_hdr(&hdr))) {
+		sd_err("found bad data stream, close the connection %s:%d",
+		       ci->conn.ipstr, ci->conn.port);
+		sd_err("ver %d, op %x, flags %d, epoch %"PRIu32, hdr.proto_ver,
+		       hdr.opcode, hdr.flags, hdr.epoch);
+		return -1;
+	}
+
+	req = alloc_request(ci, hdr.data_length);
+	if (!req) {
+		sd_err("failed to allocate request");
+		return -1;
+	}
+	req->rx_start = clock_get_time();
+	/* use le_to_cpu */
+	memcpy(&req->rq, &hdr, sizeof(req->rq));
+	ci->rx_req = req;
+	ci->rx_off = 0;
+	return 0;
+}
+
+/* Return the number of bytes read, 0 if nothing is left, or -1 on error */
+static int pipe_read(struct client_info *ci, void *buf, size_t len)
+{
+	ssize_t ret;
+reread:
+	ret = read(ci->conn.fd, buf, len);
+	if (ret > 0)
+		return ret;
+	if (ret < 0 && errno == EINTR)
+		goto reread;
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+
+	if (ret < 0)
+		sd_debug("failed to read from %s:%d, %m", ci->conn.ipstr,
+			 ci->conn.port);
+	return -1;
+}
+
+static reactor_fn void pipe_rx(struct client_info *ci)
+{
+	int nr = 0, ret;
+
+	if (!ci->rx_buf)
+		ci->rx_buf = xmalloc(PIPE_RX_BUF_SIZE);
+
+	/* the socket is level triggered, so stopping early loses nothing */
+	while (nr < PIPE_RX_BUDGET && !ci->shm_pending) {
+		struct request *req = ci->rx_req;
+		uint32_t avail = ci->rx_len - ci->rx_pos, need;
+
+		if (!req) {
+			if (avail >= sizeof(struct sd_req)) {
+				if (pipe_rx_hdr(ci) < 0)
+					goto dead;
+				req = ci->rx_req;
+				if (!(req->rq.flags & SD_FLAG_CMD_WRITE) ||
+				    !req->rq.data_length) {
+					pipe_submit(ci);
+					nr++;
+					if (throttle_client(ci))
+						return;
+				}
+				continue;
+			}
+
+			/* keep the partial header and refill the buffer */
+			memmove(ci->rx_buf, ci->rx_buf + ci->rx_pos, avail);
+			ci->rx_pos = 0;
+			ci->rx_len = avail;
+			ret = pipe_read(ci, ci->rx_buf + avail,
+					PIPE_RX_BUF_SIZE - avail);
+			if (ret <= 0)
+				goto out;
+			ci->rx_len += ret;
+			continue;
+		}
+
+		need = req->rq.data_length - ci->rx_off;
+		if (avail) {
+			uint32_t len = min(avail, need);
+
+			memcpy((char *)req->data + ci->rx_off,
+			       ci->rx_buf + ci->rx_pos, len);
+			ci->rx_pos += len;
+			ci->rx_off += len;
+		} else if (need >= PIPE_RX_BUF_SIZE) {
+			/* large payloads skip the copy through rx_buf */
+			ret = pipe_read(ci, (char *)req->data + ci->rx_off,
+					need);
+			if (ret <= 0)
+				goto out;
+			ci->rx_off += ret;
+		} else {
+			ci->rx_pos = 0;
+			ci->rx_len = 0;
+			ret = pipe_read(ci, ci->rx_buf, PIPE_RX_BUF_SIZE);
+			if (ret <= 0)
+				goto out;
+			ci->rx_len = ret;
+			continue;
+		}
+
+		if (ci->rx_off == req->rq.data_length) {
+			pipe_submit(ci);
+			nr++;
+			if (throttle_client(ci))
+				return;
+		}
+	}
+	return;
+out:
+	if (ret == 0)
+		return;
+dead:
+	ci->conn.dead = true;
+}
+
+static reactor_fn void pipe_tx_done(struct client_info *ci,
+				    struct request *req)
+{
+	list_del(&req->request_list);
+	request_latency(req, SD_LAT_TX, req->tx_start);
+	request_latency(req, SD_LAT_TOTAL, req->rx_start);
+
+	if (is_logging_op(req->op))
+		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, result=%02X",
+			req, ci->conn.fd, ci->conn.ipstr, ci->conn.port,
+			op_name(req->op), req->rp.result);
+
+	free_request(req);
+}
+
+static reactor_fn void pipe_tx(struct client_info *ci)
+{
+	struct iovec iov[PIPE_TX_IOVS];
+	struct request *req;
+	size_t skip = ci->tx_off, sent;
+	ssize_t ret;
+	int cnt = 0;
+
+	list_for_each_entry(req, &ci->done_reqs, request_list) {
+		if (cnt + 2 > PIPE_TX_IOVS)
+			break;
+		iov[cnt].iov_base = &req->rp;
+		iov[cnt].iov_len = sizeof(req->rp);
+		cnt++;
+		if (req->rp.data_length) {
+			iov[cnt].iov_base = req->data;
+			iov[cnt].iov_len = req->rp.data_length;
+			cnt++;
+		}
+	}
+
+	/* drop what the previous call has sent of the first request */
+	for (int i = 0; skip; i++) {
+		size_t len = min(skip, iov[i].iov_len);
+
+		iov[i].iov_base = (char *)iov[i].iov_base + len;
+		iov[i].iov_len -= len;
+		skip -= len;
+	}
+rewrite:
+	ret = writev(ci->conn.fd, iov, cnt);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto rewrite;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		sd_err("failed to send to %s:%d, %m", ci->conn.ipstr,
+		       ci->conn.port);
+		ci->conn.dead = true;
+		return;
+	}
+
+	sent = ret + ci->tx_off;
+	list_for_each_entry(req, &ci->done_reqs, request_list) {
+		size_t len = sizeof(req->rp) + req->rp.data_length;
+
+		if (sent < len)
+			break;
+		sent -= len;
+		pipe_tx_done(ci, req);
+	}
+	ci->tx_off = sent;
+
+	/* wait for EPOLLOUT again if anything is left */
+	if (list_empty(&ci->done_reqs) && conn_tx_off(&ci->conn)) {
+		sd_err("switch off sending flag failure, "
+		       "connection maybe closed");
+		ci->conn.dead = true;
+	}
+
+	if (ci->shm_pending && list_empty(&ci->done_reqs) && !ci->conn.dead)
+		shm_start(ci);
+}
+
+/*
+ * Shared memory rings
+ *
+ * A local client can attach a ring in /dev/shm to its unix socket with
+ * SD_OP_SHM_ATTACH, see struct sd_shm_ring.  The requests are read from the
+ * slots of the ring and their data is read and written in place, so the
+ * payloads are never copied through the socket, and the socket carries only
+ * a doorbell byte for each batch of requests or responses.  The ring is
+ * handled by the event loop of the connection like a pipelined one, but the
+ * client isn't trusted any more than any other: the indexes from the ring
+ * are checked and the layout is the one validated at attach time.
+ */
+struct shm_conn {
+	struct sd_shm_ring *ring;
+	size_t size;
+	uint32_t nr_slots, slot_size;
+	uint32_t *sq, *cq;
+	struct sd_shm_slot *slots;
+	char *data;
+	uint32_t sq_head, cq_tail; /* private copies of the ring */
+	bool doorbell; /* a doorbell for the responses is pending */
+	bool *busy; /* the slots of the requests in flight */
+};
+
+static void shm_free(struct shm_conn *sc)
+{
+	if (!sc)
+		return;
+	munmap(sc->ring, sc->size);
+	free(sc->busy);
+	free(sc);
+}
+
+static int shm_map(struct client_info *ci, const char *name, uint32_t len)
+{
+	struct sd_shm_ring hdr, *ring;
+	struct shm_conn *sc;
+	struct ucred cred;
+	socklen_t optlen = sizeof(cred);
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t size;
+	int fd;
+
+	if (!ci->unix_socket || ci->shm || ci->shm_pending || !len ||
+	    len > NAME_MAX ||
+	    strnlen(name, len) == len || strchr(name, '/'))
+		return SD_RES_INVALID_PARMS;
+
+	if (getsockopt(ci->conn.fd, SOL_SOCKET, SO_PEERCRED, &cred,
+		       &optlen) < 0) {
+		sd_err("failed to get the credentials of %d, %m", ci->conn.fd);
+		return SD_RES_SYSTEM_ERROR;
+	}
+
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+	fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	/* only a ring of the client itself */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != cred.uid || st.st_size < sizeof(hdr) ||
+	    xpread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto err;
+
+	if (hdr.magic != SD_SHM_MAGIC || !hdr.nr_slots ||
+	    hdr.nr_slots > SD_SHM_MAX_SLOTS ||
+	    (hdr.nr_slots & (hdr.nr_slots - 1)) || !hdr.slot_size ||
+	    hdr.slot_size % SD_SHM_ALIGN ||
+	    hdr.slot_size > round_up(SD_INODE_SIZE, SD_SHM_ALIGN))
+		goto err;
+
+	size = SD_SHM_SIZE(hdr.nr_slots, hdr.slot_size);
+	if (st.st_size < size)
+		goto err;
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		sd_err("failed to map %s, %m", path);
+		close(fd);
+		return SD_RES_NO_MEM;
+	}
+	close(fd);
+
+	/* the layout of the validated header, whatever the client writes */
+	sc = xzalloc(sizeof(*sc));
+	sc->ring = ring;
+	sc->size = size;
+	sc->nr_slots = hdr.nr_slots;
+	sc->slot_size = hdr.slot_size;
+	sc->sq = (uint32_t *)(ring + 1);
+	sc->cq = sc->sq + sc->nr_slots;
+	sc->slots = (struct sd_shm_slot *)(sc->cq + sc->nr_slots);
+	sc->data = (char *)ring + sd_shm_data_offset(sc->nr_slots);
+	sc->busy = xzalloc(sc->nr_slots * sizeof(*sc->busy));
+	uatomic_set(&ring->sq_head, 0);
+	uatomic_set(&ring->cq_tail, 0);
+
+	ci->shm_pending = sc;
+	sd_info("%s with %"PRIu32" slots of %"PRIu32" bytes, fd %d", path,
+		sc->nr_slots, sc->slot_size, ci->conn.fd);
+	return SD_RES_SUCCESS;
+err:
+	sd_err("invalid ring %s", path);
+	close(fd);
+	return SD_RES_INVALID_PARMS;
+}
+
+/* Map the ring and answer SD_OP_SHM_ATTACH, the first step of shm_start() */
+static reactor_fn void shm_attach(struct client_info *ci, struct request *req)
+{
+	uint32_t len = req->rq.flags & SD_FLAG_CMD_WRITE ?
+		req->rq.data_length : 0;
+
+	req->op = get_sd_op(req->rq.opcode);
+	req->rp.data_length = 0;
+	req->rp.result = shm_map(ci, req->data, len);
+	if (req->rp.result != SD_RES_SUCCESS && conn_rx_on(&ci->conn))
+		ci->conn.dead = true;
+
+	finish_client_request(req);
+}
+
+/* Switch the connection to the ring once the attach response is sent */
+static reactor_fn void shm_start(struct client_info *ci)
+{
+	struct shm_conn *sc = ci->shm_pending;
+
+	ci->shm_pending = NULL;
+
+	/* the client must wait for the response before using the ring */
+	if (refcount_read(&ci->refcnt) || ci->rx_req ||
+	    ci->rx_pos != ci->rx_len) {
+		sd_err("requests in flight on attaching, fd %d", ci->conn.fd);
+		goto dead;
+	}
+
+	if (!ci->pipeline && set_nonblocking(ci->conn.fd))
+		goto dead;
+	ci->shm = sc;
+	if (conn_rx_on(&ci->conn)) {
+		sd_err("switch on receiving flag failure, "
+		       "connection maybe closed");
+		ci->conn.dead = true;
+	}
+	return;
+dead:
+	shm_free(sc);
+	ci->conn.dead = true;
+}
+
+static reactor_fn void shm_rx(struct client_info *ci)
+{
+	struct shm_conn *sc = ci->shm;
+	uint64_t start = clock_get_time();
+	uint32_t tail, mask = sc->nr_slots - 1;
+	char doorbells[64];
+	int ret;
+
+	do {
+		ret = pipe_read(ci, doorbells, sizeof(doorbells));
+	} while (ret == sizeof(doorbells));
+	if (ret < 0)
+		goto dead;
+
+	tail = uatomic_read(&sc->ring->sq_tail);
+	if (tail - sc->sq_head > sc->nr_slots)
+		goto bad;
+	/* read the entries after the tail */
+	cmm_smp_rmb();
+
+	while (sc->sq_head != tail) {
+		uint32_t idx = uatomic_read(&sc->sq[sc->sq_head & mask]);
+		struct request *req;
+		struct sd_req hdr;
+
+		if (idx >= sc->nr_slots || sc->busy[idx])
+			goto bad;
+		memcpy(&hdr, &sc->slots[idx].req, sizeof(hdr));
+		if (unlikely(!check_hdr(&hdr)) ||
+		    hdr.opcode == SD_OP_SHM_ATTACH ||
+		    hdr.data_length > sc->slot_size)
+			goto bad;
+
+		req = alloc_request(ci, 0);
+		if (!req) {
+			sd_err("failed to allocate request");
+			goto dead;
+		}
+		req->rx_start = start;
+		/* use le_to_cpu */
+		memcpy(&req->rq, &hdr, sizeof(req->rq));
+		req->shm = true;
+		req->shm_slot = idx;
+		req->data = sc->data + (uint64_t)idx * sc->slot_size;
+		req->data_length = hdr.data_length;
+		sc->busy[idx] = true;
+		sc->sq_head++;
+		request_latency(req, SD_LAT_RX, start);
+
+		if (ci->reactor) {
+			req->msg.fn = queue_request_msg;
+			reactor_post(NULL, &req->msg);
+		} else
+			queue_request(req);
+	}
+	uatomic_set(&sc->ring->sq_head, sc->sq_head);
+	return;
+bad:
+	sd_err("found bad ring entries, close the connection %d",
+	       ci->conn.fd);
+dead:
+	uatomic_set(&sc->ring->sq_head, sc->sq_head);
+	ci->conn.dead = true;
+}
+
+/* Post the response of a ring request, shm_tx() rings the doorbell */
+static reactor_fn void shm_complete(struct client_info *ci,
+				    struct request *req)
+{
+	struct shm_conn *sc = ci->shm;
+	uint32_t idx = req->shm_slot;
+
+	req->rp.epoch = sys->cinfo.epoch;
+	req->rp.opcode = req->rq.opcode;
+	req->rp.id = req->rq.id;
+	memcpy(&sc->slots[idx].rsp, &req->rp, sizeof(req->rp));
+	uatomic_set(&sc->cq[sc->cq_tail & (sc->nr_slots - 1)], idx);
+	sc->busy[idx] = false;
+	/* publish the response before the tail */
+	cmm_smp_wmb();
+	uatomic_set(&sc->ring->cq_tail, ++sc->cq_tail);
+
+	request_latency(req, SD_LAT_TOTAL, req->rx_start);
+	free_request(req);
+
+	/* one doorbell for all the responses of this loop */
+	if (!sc->doorbell) {
+		sc->doorbell = true;
+		if (conn_tx_on(&ci->conn)) {
+			sd_err("switch on sending flag failure, "
+			       "connection maybe closed");
+			clear_client_info(ci);
+		}
+	}
+}
+
+static reactor_fn void shm_tx(struct client_info *ci)
+{
+	char doorbell = 0;
+	ssize_t ret;
+rewrite:
+	ret = write(ci->conn.fd, &doorbell, sizeof(doorbell));
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto rewrite;
+		/* the client has yet to read the previous ones */
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		sd_err("failed to ring the doorbell of %d, %m", ci->conn.fd);
+		ci->conn.dead = true;
+		return;
+	}
+
+	ci->shm->doorbell = false;
+	if (conn_tx_off(&ci->conn)) {
+		sd_err("switch off sending flag failure, "
+		       "connection maybe closed");
+		ci->conn.dead = true;
+	}
+}
+
 static void destroy_client(struct client_info *ci)
 {
 	sd_debug("connection from: %s:%d", ci->conn.ipstr, ci->conn.port);
+	if (ci->throttled)
+		list_del(&ci->throttled_list);
 	close(ci->conn.fd);
+	shm_free(ci->shm);
+	shm_free(ci->shm_pending);
+	free(ci->rx_buf);
 	free(ci);
 }
 
-static void clear_client_info(struct client_info *ci)
+static reactor_fn void clear_client_info(struct client_info *ci)
 {
 	struct request *req;
 
 	sd_debug("connection seems to be dead");
 
+	/* the partially received request of a pipelined connection */
+	if (ci->pipeline && ci->rx_req) {
+		free_request(ci->rx_req);
+		ci->rx_req = NULL;
+	}
+
 	list_for_each_entry(req, &ci->done_reqs, request_list) {
 		list_del(&req->request_list);
 		free_request(req);
@@ -996,6 +1881,9 @@ static struct client_info *create_client(int fd)
 		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&from)->sin6_addr,
 				ci->conn.ipstr, sizeof(ci->conn.ipstr));
 		break;
+	case AF_UNIX:
+		ci->unix_socket = true;
+		break;
 	}
 
 	ci->conn.fd = fd;
@@ -1007,7 +1895,7 @@ static struct client_info *create_client(int fd)
 	return ci;
 }
 
-static void client_handler(int fd, int events, void *data)
+static reactor_fn void client_handler(int fd, int events, void *data)
 {
 	struct client_info *ci = (struct client_info *)data;
 
@@ -1023,6 +1911,26 @@ static void client_handler(int fd, int events, void *data)
 	if (ci->conn.dead)
 		return clear_client_info(ci);
 
+	if (ci->shm) {
+		if (events & EPOLLIN)
+			shm_rx(ci);
+		if (!ci->conn.dead && events & EPOLLOUT)
+			shm_tx(ci);
+		if (ci->conn.dead)
+			clear_client_info(ci);
+		return;
+	}
+
+	if (ci->pipeline) {
+		if (events & EPOLLIN)
+			pipe_rx(ci);
+		if (!ci->conn.dead && events & EPOLLOUT)
+			pipe_tx(ci);
+		if (ci->conn.dead)
+			clear_client_info(ci);
+		return;
+	}
+
 	if (events & EPOLLIN) {
 		if (conn_rx_off(&ci->conn) != 0) {
 			sd_err("switch off receiving flag failure, "
@@ -1063,6 +1971,21 @@ static void client_handler(int fd, int events, void *data)
 	}
 }
 
+static reactor_fn void register_client(struct client_info *ci)
+{
+	if (register_event(ci->conn.fd, client_handler, ci)) {
+		destroy_client(ci);
+		return;
+	}
+
+	sd_debug("accepted a new connection: %d", ci->conn.fd);
+}
+
+static void register_client_msg(struct reactor_msg *msg)
+{
+	register_client(container_of(msg, struct client_info, msg));
+}
+
 static void listen_handler(int listen_fd, int events, void *data)
 {
 	struct sockaddr_storage from;
@@ -1092,19 +2015,24 @@ static void listen_handler(int listen_fd, int events, void *data)
 		}
 	}
 
-	ci = create_client(fd);
-	if (!ci) {
+	if (sys->pipeline && set_nonblocking(fd)) {
 		close(fd);
 		return;
 	}
 
-	ret = register_event(fd, client_handler, ci);
-	if (ret) {
-		destroy_client(ci);
+	ci = create_client(fd);
+	if (!ci) {
+		close(fd);
 		return;
 	}
-
-	sd_debug("accepted a new connection: %d", fd);
+	ci->pipeline = sys->pipeline;
+
+	ci->reactor = fd_to_reactor(fd);
+	if (ci->reactor) {
+		ci->msg.fn = register_client_msg;
+		reactor_post(ci->reactor, &ci->msg);
+	} else
+		register_client(ci);
 }
 
 static LIST_HEAD(listening_fd_list);
@@ -1192,7 +2120,14 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 	struct sockfd *sfd;
 	int ret;
 
-	sfd = sockfd_cache_get(nid);
+	/* The object I/O goes over RDMA if the buffer and the node allow */
+	ret = rdma_exec_req(nid, hdr, buf);
+	if (ret > 0)
+		return SD_RES_NETWORK_ERROR;
+	else if (ret == 0)
+		goto out;
+
+	sfd = sockfd_cache_get_class(nid, sockfd_req_class(hdr));
 	if (!sfd)
 		return SD_RES_NETWORK_ERROR;
 
@@ -1203,6 +2138,8 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 		sockfd_cache_del(nid, sfd);
 		return SD_RES_NETWORK_ERROR;
 	}
+	sockfd_cache_put(nid, sfd);
+out:
 	ret = rsp->result;
 	if (ret != SD_RES_SUCCESS)
 		sd_debug("failed %s, remote address: %s, op name: %s",
@@ -1210,7 +2147,37 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 			 addr_to_str(nid->addr, nid->port),
 			 op_name(get_sd_op(hdr->opcode)));
 
+	return ret;
+}
+
+/* Same as sheep_exec_req() but the reply goes to rbuf of rlen bytes */
+worker_fn int sheep_exec_req_rw(const struct node_id *nid, struct sd_req *hdr,
+				void *wbuf, void *rbuf, uint32_t rlen)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	struct sockfd *sfd;
+	int ret;
+
+	sfd = sockfd_cache_get_class(nid, sockfd_req_class(hdr));
+	if (!sfd)
+		return SD_RES_NETWORK_ERROR;
+
+	ret = exec_req_rw(sfd->fd, hdr, wbuf, hdr->data_length, rbuf, rlen,
+			  sheep_need_retry, hdr->epoch, MAX_RETRY_COUNT);
+	if (ret) {
+		sd_debug("remote node might have gone away");
+		sockfd_cache_del(nid, sfd);
+		return SD_RES_NETWORK_ERROR;
+	}
 	sockfd_cache_put(nid, sfd);
+
+	ret = rsp->result;
+	if (ret != SD_RES_SUCCESS)
+		sd_debug("failed %s, remote address: %s, op name: %s",
+			 sd_strerror(ret),
+			 addr_to_str(nid->addr, nid->port),
+			 op_name(get_sd_op(hdr->opcode)));
+
 	return ret;
 }
 
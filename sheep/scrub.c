@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background scrubbing of the local objects
+ *
+ * The scrubber walks the replicated objects of the local disks in the order
+ * of the oids, SCRUB_BATCH objects a work on a low priority queue and within
+ * sys->scrub_rate bytes a second, and compares the block digests of each
+ * object with the ones of the other copies, as SD_OP_GET_BLOCK_HASH reports
+ * them.  Only the node of the first copy scrubs an object, so an object is
+ * checked once a pass in the cluster.  A copy which differs from the majority
+ * is repaired by SD_OP_REPAIR_REPLICA on its node from a node of the majority,
+ * which copies only the differing blocks.  The last oid scrubbed is kept in
+ * the scrub file of the base directory, so a restart resumes the pass, and a
+ * pass done starts over after SCRUB_INTERVAL.  The scrub stops while the node
+ * recovers, as the copies are moving.
+ */
+
+#include "sheep_priv.h"
+
+#define SCRUB_BATCH 4096
+#define SCRUB_INTERVAL (60 * 1000) /* ms between two passes */
+
+struct scrub_work {
+	struct work work;
+	struct vnode_info *vinfo;
+	uint32_t epoch;
+	uint64_t cursor; /* the last oid scrubbed */
+	uint64_t start;
+	uint64_t bytes;
+	bool done; /* no object left after the cursor */
+};
+
+static char scrub_path[PATH_MAX];
+static uint64_t scrub_cursor;
+
+/* the disk paths and the oids of a batch, only used by the scrub queue */
+static char (*scrub_disks)[PATH_MAX];
+static int nr_scrub_disks;
+static uint64_t *scrub_oids;
+static size_t nr_scrub_oids;
+
+static void scrub_throttle(struct scrub_work *sw)
+{
+	uint64_t expect = (double)sw->bytes / sys->scrub_rate * 1000000000ULL;
+	uint64_t elapsed = clock_get_time() - sw->start;
+	struct timespec ts;
+
+	if (expect <= elapsed)
+		return;
+
+	ts.tv_sec = (expect - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (expect - elapsed) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int scrub_add_disk(const char *path)
+{
+	scrub_disks = xrealloc(scrub_disks,
+			       sizeof(*scrub_disks) * (nr_scrub_disks + 1));
+	pstrcpy(scrub_disks[nr_scrub_disks++], PATH_MAX, path);
+	return SD_RES_SUCCESS;
+}
+
+/* Collect the smallest SCRUB_BATCH replicated oids after the cursor */
+static void scrub_collect(uint64_t cursor)
+{
+	size_t alloc = 0;
+
+	nr_scrub_disks = 0;
+	nr_scrub_oids = 0;
+	for_each_obj_path(scrub_add_disk);
+
+	for (int i = 0; i < nr_scrub_disks; i++) {
+		DIR *dir = opendir(scrub_disks[i]);
+		struct dirent *d;
+
+		if (!dir) {
+			sd_err("failed to open %s, %m", scrub_disks[i]);
+			continue;
+		}
+		while ((d = readdir(dir))) {
+			uint64_t oid;
+			char *p;
+
+			/* skip the temporary, stale and erasure coded ones */
+			oid = strtoull(d->d_name, &p, 16);
+			if (p - d->d_name != 16 || *p != '\0' ||
+			    oid <= cursor || is_erasure_oid(oid))
+				continue;
+
+			if (nr_scrub_oids == alloc) {
+				alloc = alloc ? alloc * 2 : SCRUB_BATCH;
+				scrub_oids = xrealloc(scrub_oids,
+						      alloc * sizeof(uint64_t));
+			}
+			scrub_oids[nr_scrub_oids++] = oid;
+		}
+		closedir(dir);
+	}
+
+	xqsort(scrub_oids, nr_scrub_oids, oid_cmp);
+	nr_scrub_oids = min(nr_scrub_oids, (size_t)SCRUB_BATCH);
+}
+
+static int scrub_get_block_hash(const struct node_id *nid, uint64_t oid,
+				uint32_t epoch, uint8_t *digests)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.epoch = epoch;
+	hdr.data_length = SD_BLOCK_HASH_NR * SHA1_DIGEST_SIZE;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = epoch;
+	return sheep_exec_req(nid, &hdr, digests);
+}
+
+static void scrub_repair(uint64_t oid, uint32_t epoch,
+			 const struct node_id *nid, const struct node_id *src)
+{
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+	hdr.epoch = epoch;
+	memcpy(hdr.forw.addr, src->addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = src->port;
+	hdr.forw.oid = oid;
+
+	ret = sheep_exec_req(nid, &hdr, NULL);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to repair %016"PRIx64" on %s, %s", oid,
+		       addr_to_str(nid->addr, nid->port), sd_strerror(ret));
+		uatomic_inc(&sys->stat.scrub.failed);
+		return;
+	}
+	sd_info("repaired %016"PRIx64" on %s from %s", oid,
+		addr_to_str(nid->addr, nid->port),
+		addr_to_str(src->addr, src->port));
+	uatomic_inc(&sys->stat.scrub.repaired);
+}
+
+static void scrub_object(struct scrub_work *sw, uint64_t oid)
+{
+	uint8_t digests[SD_MAX_COPIES][SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	bool valid[SD_MAX_COPIES] = {};
+	int nr_copies, votes, major = -1;
+
+	nr_copies = get_obj_copy_number(oid, sw->vinfo->nr_zones);
+	if (nr_copies < 2)
+		return;
+	vinfo_oid_to_nodes(sw->vinfo, oid, nr_copies, nodes);
+	/* scrubbed by the node of the first copy, or a stale object */
+	if (!node_is_local(nodes[0]))
+		return;
+
+	if (sd_store->get_block_hash(oid, sw->epoch, (uint8_t *)digests[0]))
+		return;
+	valid[0] = true;
+	sw->bytes += get_store_objsize(oid);
+	uatomic_inc(&sys->stat.scrub.scanned);
+	uatomic_add(&sys->stat.scrub.bytes, get_store_objsize(oid));
+
+	for (int i = 1; i < nr_copies; i++)
+		valid[i] = scrub_get_block_hash(&nodes[i]->nid, oid, sw->epoch,
+						(uint8_t *)digests[i]) ==
+			SD_RES_SUCCESS;
+
+	for (int i = 0; i < nr_copies && major < 0; i++) {
+		if (!valid[i])
+			continue;
+		votes = 0;
+		for (int j = 0; j < nr_copies; j++)
+			if (valid[j] && !memcmp(digests[i], digests[j],
+						sizeof(digests[i])))
+				votes++;
+		if (votes == nr_copies)
+			return;
+		if (votes > nr_copies / 2)
+			major = i;
+	}
+
+	uatomic_inc(&sys->stat.scrub.mismatched);
+	if (major < 0) {
+		sd_err("no majority of the copies of %016"PRIx64, oid);
+		uatomic_inc(&sys->stat.scrub.failed);
+		return;
+	}
+
+	/* a copy which failed to answer is left to the recovery */
+	for (int i = 0; i < nr_copies; i++)
+		if (valid[i] && memcmp(digests[i], digests[major],
+				       sizeof(digests[i])))
+			scrub_repair(oid, sw->epoch, &nodes[i]->nid,
+				     &nodes[major]->nid);
+}
+
+static void scrub_work(struct work *work)
+{
+	struct scrub_work *sw = container_of(work, struct scrub_work, work);
+
+	sw->start = clock_get_time();
+	scrub_collect(sw->cursor);
+	if (!nr_scrub_oids) {
+		sw->done = true;
+		sw->cursor = 0;
+	}
+
+	for (size_t i = 0; i < nr_scrub_oids; i++) {
+		/* a recovery follows the change of the epoch */
+		if (sys_epoch() != sw->epoch)
+			break;
+		scrub_object(sw, scrub_oids[i]);
+		sw->cursor = scrub_oids[i];
+		scrub_throttle(sw);
+	}
+
+	if (atomic_create_and_write(scrub_path, (char *)&sw->cursor,
+				    sizeof(sw->cursor), true) < 0)
+		sd_err("failed to save the scrub cursor to %s", scrub_path);
+}
+
+static void scrub_queue(void);
+
+static void scrub_timer_fn(void *data)
+{
+	scrub_queue();
+}
+
+static struct timer scrub_timer = {
+	.callback = scrub_timer_fn,
+};
+
+static void scrub_done(struct work *work)
+{
+	struct scrub_work *sw = container_of(work, struct scrub_work, work);
+	bool pause = sw->done || node_in_recovery() ||
+		sys_epoch() != sw->epoch;
+
+	if (sw->done)
+		sd_info("scrubbed the local objects");
+	scrub_cursor = sw->cursor;
+	put_vnode_info(sw->vinfo);
+	free(sw);
+
+	if (pause)
+		add_timer(&scrub_timer, SCRUB_INTERVAL);
+	else
+		scrub_queue();
+}
+
+static void scrub_queue(void)
+{
+	struct scrub_work *sw;
+
+	if (node_in_recovery() || sys->cinfo.status != SD_STATUS_OK) {
+		add_timer(&scrub_timer, SCRUB_INTERVAL);
+		return;
+	}
+
+	sw = xzalloc(sizeof(*sw));
+	sw->vinfo = get_vnode_info();
+	sw->epoch = sys_epoch();
+	sw->cursor = scrub_cursor;
+	sw->work.fn = scrub_work;
+	sw->work.done = scrub_done;
+	queue_work(sys->scrub_wqueue, &sw->work);
+}
+
+/* Start scrubbing from the cursor saved in the base directory */
+void scrub_start(const char *dir)
+{
+	int fd;
+
+	if (!sys->scrub_rate || !sd_store->get_block_hash)
+		return;
+
+	snprintf(scrub_path, sizeof(scrub_path), "%s/scrub", dir);
+	fd = open(scrub_path, O_RDONLY);
+	if (fd >= 0) {
+		if (xread(fd, &scrub_cursor, sizeof(scrub_cursor)) !=
+		    sizeof(scrub_cursor))
+			scrub_cursor = 0;
+		close(fd);
+	}
+
+	sd_info("scrubbing the local objects from %016"PRIx64" at %"PRIu64
+		" bytes a second", scrub_cursor, sys->scrub_rate);
+	add_timer(&scrub_timer, SCRUB_INTERVAL);
+}
@@ -13,11 +13,16 @@
 #include <malloc.h>
 
 #include "sheep_priv.h"
+#include "slice.h"
+#include "numa.h"
 #include "trace/trace.h"
 #include "livepatch/livepatch.h"
 #include "option.h"
 
 #define EPOLL_SIZE 4096
+#define MAX_REACTORS 256
+#define MAX_RECOVERY_WINDOW 1024
+#define MAX_DELETE_WINDOW 1024
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
 
@@ -41,11 +46,99 @@ static const char http_help[] =
 "\thost=: specify a host to communicate with http server (default: localhost)\n"
 "\tport=: specify a port to communicate with http server (default: 8000)\n"
 "\tbuffer=: specify buffer size for http request (default: 32M)\n"
+"\tinline=: keep the objects up to this size in the onodes (default: 4092K)\n"
+"\tproto=: http to serve HTTP/1.1 itself, or fcgi (default: fcgi)\n"
 "\tswift: enable swift API\n"
+"\tmetrics: serve the metrics for Prometheus at /metrics, before swift or s3\n"
 "Example:\n\t$ sheep -r host=localhost,port=7001,buffer=64M,swift ...\n"
 "This tries to enable Swift API and use localhost:7001 to\n"
 "communicate with http server, using 64MB buffer.\n";
 
+static const char journal_help[] =
+"Available arguments:\n"
+"\tdir=: path to the journal files (default: metastore directory)\n"
+"\tsize=: size of each of the two journal files (default: 256M)\n"
+"Example:\n\t$ sheep -j dir=/ssd/journal,size=512M ...\n"
+"This tries to append the writes of the objects to the journal on /ssd and\n"
+"write the objects without O_DSYNC, which cuts the latency of small writes.\n";
+
+static const char md_help[] =
+"Available arguments:\n"
+"\tweighted: place objects by weighted rendezvous hashing over the disks\n"
+"\ttier: keep the hot objects, the inodes and the btree indexes on the\n"
+"\t      non-rotational disks, implies weighted\n"
+"\tgroupsync: write the objects without O_DSYNC and sync each disk once\n"
+"\t           for the writes done meanwhile, unless journaled\n"
+"\tdrain: unplug a disk whose latency stays well above the one of the\n"
+"\t       other disks, so that its objects are recovered elsewhere\n"
+"\trate=: specify the bandwidth moving objects between the disks after a\n"
+"\t       disk is plugged or between the tiers (default: 64M)\n"
+"\tpool=: keep up to this many preallocated files on each disk for the\n"
+"\t       data objects created by sequential writes (default: 0)\n"
+"\tpurge=: specify the stale objects purged a second after the recovery\n"
+"\t        (default: 1000)\n"
+"\tscrub=: specify the bandwidth verifying the local objects against their\n"
+"\t        other copies in the background (default: 0, disabled)\n"
+"Example:\n\t$ sheep -m weighted,rate=128M ...\n"
+"This tries to look up the disk of an object without the virtual disks and\n"
+"move the objects to a plugged disk in the background at 128 MB/s.\n";
+
+static const char read_help[] =
+"Available arguments:\n"
+"\tbalance: read the copy with the least expected latency\n"
+"\thedge: read another copy too if the first one doesn't answer in time\n"
+"\tcache=: specify the memory caching the objects read from the local disks\n"
+"\t        (default: 0, disabled)\n"
+"Example:\n\t$ sheep -R balance,hedge,cache=1G ...\n"
+"This tries to read the remote copy of the least loaded node and send the\n"
+"same read to the next copy if the node is slower than it used to be, and\n"
+"to serve the local reads of the hot objects from 1 GB of memory.\n";
+
+static const char qos_help[] =
+"Available arguments:\n"
+"\tdepth=: specify the gateway requests in flight, above which the vdis\n"
+"\t        share the gateway by their weights (default: 0, no limit)\n"
+"\tdeadline=: specify the milliseconds a write waits for the reads of its\n"
+"\t           vdi at most (default: 50)\n"
+"\tconn=: specify the requests in flight of a client connection, above\n"
+"\t       which it isn't read any more (default: 0, no limit)\n"
+"\tnode=: specify the client requests in flight on this node, above which\n"
+"\t       no client connection is read (default: 0, no limit)\n"
+"Example:\n\t$ sheep -Q depth=128 ...\n"
+"This tries to dispatch at most 128 gateway requests at a time, the ones of\n"
+"the vdi the furthest behind its share first.  The weight, the reservation\n"
+"and the limits of a vdi are set by 'dog vdi qos'.  The connections of the\n"
+"other sheep are never throttled by conn= and node=.\n";
+
+static const char wire_help[] =
+"Available arguments:\n"
+"\tpair=: specify two zones, as for -z, the payloads between which are\n"
+"\t       deflated, repeatable\n"
+"\tlevel=: specify the zlib level of the compression, 1 to 9 (default: 1)\n"
+"Example:\n\t$ sheep -Y pair=1:2,pair=1:3 ...\n"
+"This tries to deflate the writes of the replicas and the objects recovered\n"
+"between the zone 1 and the zones 2 and 3, the sites of a stretched cluster.\n";
+
+static const char dscp_help[] =
+"Available arguments:\n"
+"\tfg=: specify the DSCP class of the I/O of the clients, 0 to 63\n"
+"\tbg=: specify the DSCP class of recovery and the bulk reads, 0 to 63\n"
+"Example:\n\t$ sheep -o fg=46,bg=8 ...\n"
+"This marks the peer connections carrying the requests of the clients as EF\n"
+"and the ones of recovery, the checks and the backups as CS1, so that the\n"
+"switches can queue them apart.\n";
+
+static const char memcap_help[] =
+"Available arguments:\n"
+"\trecovery=: specify the soft cap of the oid lists of the recovery, over\n"
+"\t           which the object lists of the peers are fetched slowly\n"
+"\trequest=: specify the soft cap of the request buffers, over which the\n"
+"\t          freed ones are returned to the system instead of the pool\n"
+"Example:\n\t$ sheep -C recovery=4G,request=1G ...\n"
+"This tries to keep the memory of the recovery under 4 GB and the one of the\n"
+"request buffers under 1 GB.  'dog node stat' shows the memory of each\n"
+"subsystem.\n";
+
 static const char myaddr_help[] =
 "Example:\n\t$ sheep -y 192.168.1.1:7000 ...\n"
 "This tries to tell other nodes through what address they can talk to this\n"
@@ -54,7 +147,10 @@ static const char myaddr_help[] =
 static const char zone_help[] =
 "Example:\n\t$ sheep -z 1 ...\n"
 "This tries to set the zone ID of this sheep to 1 and sheepdog won't store\n"
-"more than one copy of any object into this same zone\n";
+"more than one copy of any object into this same zone\n"
+"\t$ sheep -z 1.2.3 ...\n"
+"The zone of host 3 in rack 2 of row 1, up to four levels of 0 to 255 from\n"
+"the top, so that the recovery prefers the copies in the same rack and row\n";
 
 static const char cluster_help[] =
 "Available arguments:\n"
@@ -76,6 +172,9 @@ static const char cache_help[] =
 "\tdir=: path to the location of the cache (default: $STORE/cache)\n"
 "\tdirectio: use directio mode for cache IO, "
 "if not specified use buffered IO\n"
+"\tdirty_ratio=: percentage of the cache which can be dirty before it is\n"
+"\t              pushed back regardless of the age (default: 10)\n"
+"\texpire=: seconds an object can stay dirty (default: 30)\n"
 "\nExample:\n\t$ sheep -w size=200G,dir=/my_ssd,directio ...\n"
 "This tries to use /my_ssd as the cache storage with 200G allocted to the\n"
 "cache in directio mode\n";
@@ -116,29 +215,67 @@ static struct sd_option sheep_options[] = {
 	{'c', "cluster", true,
 	 "specify the cluster driver (default: "DEFAULT_CLUSTER_DRIVER")",
 	 cluster_help},
+	{'C', "memcap", true, "specify the soft caps of the memory of the"
+	 " subsystems (default: none)", memcap_help},
+	{'d', "dedup", false, "share the identical blocks of the data objects"
+	 " on disk (default: disabled)"},
 	{'D', "directio", false, "use direct IO for backend store"},
+	{'e', "pipeline", false, "receive and reply pipelined client requests in"
+	 " the event loop (default: disabled)"},
 	{'f', "foreground", false, "make the program run in foreground"},
 	{'g', "gateway", false, "make the program run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
+	{'H', "hybrid", true, "specify the seconds after which the unwritten"
+	 " hot objects of the hybrid vdis are erasure coded"
+	 " (default: 0, never)"},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"
 	 " (default: disabled)", ioaddr_help},
+	{'j', "journal", true, "journal the writes of the objects instead of"
+	 " writing them synchronously (default: disabled)", journal_help},
 	{'l', "log", true,
 	 "specify the log level, the log directory and the log format"
 	 "(log level default: 6 [SDOG_INFO])", log_help},
+	{'m', "md", true, "specify the placement of objects over the local"
+	 " disks (default: virtual disks)", md_help},
+	{'M', "rdma", false, "use RDMA for the object I/O between sheep"
+	 " (default: disabled)"},
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
+	{'o', "dscp", true, "mark the peer connections with the DSCP classes of"
+	 " their traffic (default: none)", dscp_help},
 	{'p', "port", true, "specify the TCP port on which to listen "
 	 "(default: 7000)"},
 	{'P', "pidfile", true, "create a pid file"},
+	{'q', "quorum", true, "ack replicated writes after this many copies are"
+	 " written (default: 0, all the copies)"},
 	{'r', "http", true, "enable http service. (default: disabled)",
 	 http_help},
+	{'Q', "qos", true, "specify the scheduling of the gateway requests by"
+	 " the QoS of the vdis", qos_help},
+	{'R', "read", true, "specify the policy of reading remote copies"
+	 " (default: random)", read_help},
+	{'S', "stall", true, "log the stack of the main loop once a callback"
+	 " runs for the given milliseconds (default: 0, disabled)"},
+	{'t', "reactors", true, "specify the number of threads handling client"
+	 " connections (default: 0, use the main thread)"},
+	{'T', "trace", true, "trace the function graph of one of the given"
+	 " number of requests (default: 0, disabled)"},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
+	{'U', "uring", false, "use io_uring for I/O of backend store"},
 	{'v', "version", false, "show the version"},
 	{'w', "cache", true, "enable object cache", cache_help},
+	{'W', "window", true, "specify the number of objects recovered in"
+	 " parallel (default: 0, two per disk)"},
+	{'x', "delete", true, "specify the number of objects deleted in"
+	 " parallel (default: 0, 32)"},
 	{'y', "myaddr", true, "specify the address advertised to other sheep",
 	 myaddr_help},
+	{'Y', "wire", true, "deflate the peer payloads between the given zones"
+	 " (default: none)", wire_help},
 	{'z', "zone", true,
 	 "specify the zone id (default: determined by listen address)",
 	 zone_help},
+	{'Z', "zerocopy", false, "forward write data to the replicas without"
+	 " copying it (default: disabled)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -186,6 +323,42 @@ static void sdlog_help(void)
 	       "  debug      debugging messages\n");
 }
 
+/* The zone of the levels "a.b.c.d", laid out as the zone of an address */
+static int64_t parse_zone(const char *s)
+{
+	uint32_t zone = 0;
+	char *p;
+
+	for (int i = 0; i < 4; i++) {
+		long level = strtol(s, &p, 10);
+
+		if (s == p || level < 0 || level > UINT8_MAX)
+			return -1;
+		zone |= level << (i * 8);
+		if (*p == '\0')
+			return zone;
+		if (*p != '.')
+			return -1;
+		s = p + 1;
+	}
+	return -1;
+}
+
+/* The zone id of -z, an integer or the levels "a.b.c.d", -1 if invalid */
+static int64_t parse_zone_id(const char *s)
+{
+	int64_t zone;
+	char *p;
+
+	if (strchr(s, '.'))
+		return parse_zone(s);
+
+	zone = strtoll(s, &p, 10);
+	if (s == p || *p != '\0' || zone < 0 || UINT32_MAX < zone)
+		return -1;
+	return zone;
+}
+
 static int create_pidfile(const char *filename)
 {
 	int fd;
@@ -298,6 +471,34 @@ static int cache_directio_parser(const char *s)
 	return 0;
 }
 
+static int cache_dirty_ratio_parser(const char *s)
+{
+	char *p;
+	long ratio = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || ratio < 1 || ratio > 100) {
+		sd_err("Invalid dirty ratio '%s': must be between 1 and 100",
+		       s);
+		return -1;
+	}
+	sys->object_cache_dirty_ratio = ratio;
+	return 0;
+}
+
+static int cache_expire_parser(const char *s)
+{
+	char *p;
+	long expire = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || expire < 1 || expire > UINT32_MAX) {
+		sd_err("Invalid expire '%s': must be a positive number of "
+		       "seconds", s);
+		return -1;
+	}
+	sys->object_cache_expire = expire;
+	return 0;
+}
+
 static char ocpath[PATH_MAX];
 
 static int cache_dir_parser(const char *s)
@@ -310,6 +511,8 @@ static struct option_parser cache_parsers[] = {
 	{ "size=", cache_size_parser },
 	{ "directio", cache_directio_parser },
 	{ "dir=", cache_dir_parser },
+	{ "dirty_ratio=", cache_dirty_ratio_parser },
+	{ "expire=", cache_expire_parser },
 	{ NULL, NULL },
 };
 
@@ -385,6 +588,318 @@ static struct option_parser ionic_parsers[] = {
 	{ NULL, NULL },
 };
 
+static int read_balance_parser(const char *s)
+{
+	sys->read_balance = true;
+	return 0;
+}
+
+static int read_hedge_parser(const char *s)
+{
+	sys->hedged_read = true;
+	return 0;
+}
+
+static int read_cache_parser(const char *s)
+{
+	if (option_parse_size(s, &sys->rcache_size) < 0) {
+		sd_err("Invalid read cache size '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser read_parsers[] = {
+	{ "balance", read_balance_parser },
+	{ "hedge", read_hedge_parser },
+	{ "cache=", read_cache_parser },
+	{ NULL, NULL },
+};
+
+static int qos_depth_parser(const char *s)
+{
+	char *p;
+	long nr = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || nr < 0 || nr > INT_MAX) {
+		sd_err("Invalid qos depth '%s': must be a non-negative number",
+		       s);
+		return -1;
+	}
+	sys->qos_depth = nr;
+	return 0;
+}
+
+static int qos_deadline_parser(const char *s)
+{
+	char *p;
+	long ms = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || ms < 1 || ms > INT_MAX) {
+		sd_err("Invalid qos deadline '%s': must be a positive number"
+		       " of milliseconds", s);
+		return -1;
+	}
+	sys->qos_deadline = ms;
+	return 0;
+}
+
+static int qos_admit_parser(const char *s, int *limit, const char *name)
+{
+	char *p;
+	long nr = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || nr < 0 || nr > INT_MAX) {
+		sd_err("Invalid qos %s '%s': must be a non-negative number",
+		       name, s);
+		return -1;
+	}
+	*limit = nr;
+	return 0;
+}
+
+static int qos_conn_parser(const char *s)
+{
+	return qos_admit_parser(s, &sys->admit_conn, "conn");
+}
+
+static int qos_node_parser(const char *s)
+{
+	return qos_admit_parser(s, &sys->admit_node, "node");
+}
+
+static struct option_parser qos_parsers[] = {
+	{ "depth=", qos_depth_parser },
+	{ "deadline=", qos_deadline_parser },
+	{ "conn=", qos_conn_parser },
+	{ "node=", qos_node_parser },
+	{ NULL, NULL },
+};
+
+static int wire_pair_parser(const char *s)
+{
+	char *buf = xstrdup(s), *sep = strchr(buf, ':');
+	int64_t a = -1, b = -1;
+
+	if (sep) {
+		*sep = '\0';
+		a = parse_zone_id(buf);
+		b = parse_zone_id(sep + 1);
+	}
+	free(buf);
+	if (a < 0 || b < 0 || a == b) {
+		sd_err("Invalid wire pair '%s': must be two different zones "
+		       "A:B", s);
+		return -1;
+	}
+	if (sys->nr_wire_pairs == SD_MAX_WIRE_PAIRS) {
+		sd_err("Too many wire pairs, at most %d", SD_MAX_WIRE_PAIRS);
+		return -1;
+	}
+	sys->wire_pairs[sys->nr_wire_pairs][0] = a;
+	sys->wire_pairs[sys->nr_wire_pairs][1] = b;
+	sys->nr_wire_pairs++;
+	return 0;
+}
+
+static int wire_level_parser(const char *s)
+{
+	char *p;
+	long level = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || level < 1 || level > 9) {
+		sd_err("Invalid wire level '%s': must be between 1 and 9", s);
+		return -1;
+	}
+	sys->wire_level = level;
+	return 0;
+}
+
+static struct option_parser wire_parsers[] = {
+	{ "pair=", wire_pair_parser },
+	{ "level=", wire_level_parser },
+	{ NULL, NULL },
+};
+
+static int dscp_parser(enum sockfd_class cls, const char *s)
+{
+	int dscp = atoi(s);
+
+	if (dscp < 0 || dscp > 63) {
+		sd_err("Invalid DSCP class '%s': must be between 0 and 63", s);
+		return -1;
+	}
+	sockfd_set_dscp(cls, dscp);
+	return 0;
+}
+
+static int dscp_fg_parser(const char *s)
+{
+	return dscp_parser(SOCKFD_FG, s);
+}
+
+static int dscp_bg_parser(const char *s)
+{
+	return dscp_parser(SOCKFD_BG, s);
+}
+
+static struct option_parser dscp_parsers[] = {
+	{ "fg=", dscp_fg_parser },
+	{ "bg=", dscp_bg_parser },
+	{ NULL, NULL },
+};
+
+static int memcap_parser(enum sd_mem_tag tag, const char *s)
+{
+	uint64_t cap;
+
+	if (option_parse_size(s, &cap) < 0) {
+		sd_err("Invalid %s memory cap '%s'", sd_mem_tag_name(tag), s);
+		return -1;
+	}
+	sd_mem_set_cap(tag, cap);
+	return 0;
+}
+
+static int memcap_recovery_parser(const char *s)
+{
+	return memcap_parser(SD_MEM_RECOVERY, s);
+}
+
+static int memcap_request_parser(const char *s)
+{
+	return memcap_parser(SD_MEM_REQUEST, s);
+}
+
+static struct option_parser memcap_parsers[] = {
+	{ "recovery=", memcap_recovery_parser },
+	{ "request=", memcap_request_parser },
+	{ NULL, NULL },
+};
+
+#define JOURNAL_SIZE ((uint64_t)256 * 1024 * 1024)
+#define MIN_JOURNAL_SIZE ((uint64_t)16 * 1024 * 1024)
+
+static char jpath[PATH_MAX];
+static uint64_t jsize = JOURNAL_SIZE;
+
+static int journal_dir_parser(const char *s)
+{
+	snprintf(jpath, sizeof(jpath), "%s", s);
+	return 0;
+}
+
+static int journal_size_parser(const char *s)
+{
+	if (option_parse_size(s, &jsize) < 0)
+		return -1;
+	if (jsize < MIN_JOURNAL_SIZE) {
+		sd_err("Invalid journal size '%s': must be at least %"PRIu64
+		       "M", s, MIN_JOURNAL_SIZE / 1024 / 1024);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser journal_parsers[] = {
+	{ "dir=", journal_dir_parser },
+	{ "size=", journal_size_parser },
+	{ NULL, NULL },
+};
+
+static int md_weighted_parser(const char *s)
+{
+	sys->md_weighted = true;
+	return 0;
+}
+
+static int md_tier_parser(const char *s)
+{
+	sys->md_weighted = true;
+	sys->md_tier = true;
+	return 0;
+}
+
+static int md_groupsync_parser(const char *s)
+{
+	sys->md_group_sync = true;
+	return 0;
+}
+
+static int md_drain_parser(const char *s)
+{
+	sys->md_drain = true;
+	return 0;
+}
+
+static int md_rate_parser(const char *s)
+{
+	uint64_t rate;
+
+	if (option_parse_size(s, &rate) < 0)
+		return -1;
+	if (rate < 1024 * 1024) {
+		sd_err("Invalid md rate '%s': must be at least 1M", s);
+		return -1;
+	}
+	sys->md_move_rate = rate;
+	return 0;
+}
+
+static int md_pool_parser(const char *s)
+{
+	char *p;
+	long nr = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || nr < 0 || nr > 1024) {
+		sd_err("Invalid md pool '%s': must be between 0 and 1024", s);
+		return -1;
+	}
+	sys->md_pool = nr;
+	return 0;
+}
+
+static int md_purge_parser(const char *s)
+{
+	char *p;
+	long rate = strtol(s, &p, 10);
+
+	if (s == p || *p != '\0' || rate < 1) {
+		sd_err("Invalid md purge rate '%s': must be a positive number"
+		       " of objects a second", s);
+		return -1;
+	}
+	sys->stale_purge_rate = rate;
+	return 0;
+}
+
+static int md_scrub_parser(const char *s)
+{
+	uint64_t rate;
+
+	if (option_parse_size(s, &rate) < 0)
+		return -1;
+	if (rate && rate < 1024 * 1024) {
+		sd_err("Invalid md scrub rate '%s': must be 0 or at least 1M",
+		       s);
+		return -1;
+	}
+	sys->scrub_rate = rate;
+	return 0;
+}
+
+static struct option_parser md_parsers[] = {
+	{ "weighted", md_weighted_parser },
+	{ "tier", md_tier_parser },
+	{ "groupsync", md_groupsync_parser },
+	{ "drain", md_drain_parser },
+	{ "rate=", md_rate_parser },
+	{ "pool=", md_pool_parser },
+	{ "purge=", md_purge_parser },
+	{ "scrub=", md_scrub_parser },
+	{ NULL, NULL },
+};
+
 static size_t get_nr_nodes(void)
 {
 	struct vnode_info *vinfo;
@@ -398,6 +913,50 @@ static size_t get_nr_nodes(void)
 	return nr;
 }
 
+static int disk_nodes[MAX_NUMA_NODES];
+
+static int count_disk_node(const char *path)
+{
+	int node = path_to_numa_node(path);
+
+	if (node >= 0)
+		disk_nodes[node]++;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Run io works near the disks and net and gateway works near the NIC, so the
+ * request buffers, which are first touched by the net workers, live on the
+ * node of the NIC.
+ */
+static void init_numa_affinity(void)
+{
+	int nic_node, disk_node = -1;
+
+	if (nr_numa_nodes() < 2)
+		return;
+
+	nic_node = addr_to_numa_node(sys->this_node.nid.addr);
+	if (nic_node >= 0) {
+		work_queue_set_numa_node(sys->net_wqueue, nic_node);
+		work_queue_set_numa_node(sys->gateway_wqueue, nic_node);
+	}
+
+	if (sys->gateway_only)
+		return;
+
+	/* md may have disks on several nodes, take the node of the most */
+	for_each_obj_path(count_disk_node);
+	for (int i = 0; i < MAX_NUMA_NODES; i++)
+		if (disk_nodes[i] && (disk_node < 0 ||
+				      disk_nodes[i] > disk_nodes[disk_node]))
+			disk_node = i;
+	if (disk_node >= 0) {
+		work_queue_set_numa_node(sys->io_wqueue, disk_node);
+		work_queue_set_numa_node(sys->bg_io_wqueue, disk_node);
+	}
+}
+
 static int create_work_queues(void)
 {
 	struct work_queue *util_wq;
@@ -405,24 +964,77 @@ static int create_work_queues(void)
 	if (init_work_queue(get_nr_nodes))
 		return -1;
 
-	sys->net_wqueue = create_work_queue("net", WQ_UNLIMITED);
-	sys->gateway_wqueue = create_work_queue("gway", WQ_UNLIMITED);
-	sys->io_wqueue = create_work_queue("io", WQ_UNLIMITED);
-	sys->recovery_wqueue = create_work_queue("rw", WQ_UNLIMITED);
-	sys->deletion_wqueue = create_work_queue("delete", WQ_DYNAMIC);
+	/* client I/O first, background jobs last */
+	sys->net_wqueue = create_work_queue_prio("net", WQ_UNLIMITED,
+						 WQ_PRIO_HIGH);
+	sys->gateway_wqueue = create_work_queue_prio("gway", WQ_UNLIMITED,
+						     WQ_PRIO_HIGH);
+	sys->io_wqueue = create_work_queue_prio("io", WQ_UNLIMITED,
+						WQ_PRIO_HIGH);
+	sys->bg_io_wqueue = create_work_queue_prio("bg_io", WQ_UNLIMITED,
+						   WQ_PRIO_LOW);
+	sys->recovery_wqueue = create_work_queue_prio("rw", WQ_UNLIMITED,
+						      WQ_PRIO_LOW);
+	sys->deletion_wqueue = create_work_queue_prio("delete", WQ_DYNAMIC,
+						      WQ_PRIO_LOW);
 	sys->block_wqueue = create_ordered_work_queue("block");
 	sys->md_wqueue = create_ordered_work_queue("md");
+	sys->md_move_wqueue = create_work_queue_prio("md_move", WQ_ORDERED,
+						     WQ_PRIO_LOW);
+	sys->objlist_wqueue = create_ordered_work_queue("objlist");
+	sys->stale_wqueue = create_work_queue_prio("stale", WQ_ORDERED,
+						   WQ_PRIO_LOW);
+	sys->copy_wqueue = create_work_queue_prio("copy", WQ_ORDERED,
+						  WQ_PRIO_LOW);
+	sys->replica_wqueue = create_work_queue_prio("replica", WQ_ORDERED,
+						     WQ_PRIO_LOW);
+	sys->replica_obj_wqueue = create_work_queue_prio("replica_obj",
+							 WQ_DYNAMIC,
+							 WQ_PRIO_LOW);
+	if (sys->scrub_rate) {
+		sys->scrub_wqueue = create_work_queue_prio("scrub", WQ_ORDERED,
+							   WQ_PRIO_LOW);
+		if (!sys->scrub_wqueue)
+			return -1;
+	}
+	if (sys->hybrid_age) {
+		sys->hybrid_wqueue = create_work_queue_prio("hybrid",
+							    WQ_ORDERED,
+							    WQ_PRIO_LOW);
+		if (!sys->hybrid_wqueue)
+			return -1;
+	}
+	if (sys->journal) {
+		sys->journal_wqueue = create_ordered_work_queue("journal");
+		if (!sys->journal_wqueue)
+			return -1;
+	}
+	if (sys->md_pool) {
+		sys->pool_wqueue = create_work_queue_prio("pool", WQ_ORDERED,
+							  WQ_PRIO_LOW);
+		if (!sys->pool_wqueue)
+			return -1;
+	}
 	sys->areq_wqueue = create_work_queue("async_req", WQ_UNLIMITED);
 	if (sys->enable_object_cache) {
 		sys->oc_reclaim_wqueue =
 			create_ordered_work_queue("oc_reclaim");
-		sys->oc_push_wqueue = create_work_queue("oc_push", WQ_DYNAMIC);
-		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue)
+		sys->oc_push_wqueue = create_work_queue_prio("oc_push",
+							     WQ_DYNAMIC,
+							     WQ_PRIO_LOW);
+		sys->oc_trace_wqueue = create_work_queue_prio("oc_trace",
+							      WQ_DYNAMIC,
+							      WQ_PRIO_LOW);
+		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue ||
+		    !sys->oc_trace_wqueue)
 			return -1;
 	}
-	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
-	    !sys->deletion_wqueue || !sys->block_wqueue || !sys->md_wqueue ||
-	    !sys->areq_wqueue)
+	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->bg_io_wqueue ||
+	    !sys->recovery_wqueue || !sys->deletion_wqueue ||
+	    !sys->block_wqueue || !sys->md_wqueue || !sys->md_move_wqueue ||
+	    !sys->stale_wqueue || !sys->copy_wqueue || !sys->areq_wqueue ||
+	    !sys->objlist_wqueue || !sys->replica_wqueue ||
+	    !sys->replica_obj_wqueue)
 			return -1;
 
 	util_wq = create_ordered_work_queue("util");
@@ -587,7 +1199,7 @@ int main(int argc, char **argv)
 	     *argp = NULL;
 	bool explicit_addr = false;
 	bool daemonize = true;
-	int64_t zone = -1;
+	int64_t zone = -1, nr_reactors, stall_ms;
 	struct cluster_driver *cdrv;
 	struct option *long_options;
 	const char *http_options = NULL;
@@ -620,6 +1232,35 @@ int main(int argc, char **argv)
 		case 'r':
 			http_options = optarg;
 			break;
+		case 'Q':
+			if (option_parse(optarg, ",", qos_parsers) < 0)
+				exit(1);
+			break;
+		case 'R':
+			if (option_parse(optarg, ",", read_parsers) < 0)
+				exit(1);
+			break;
+		case 'Y':
+			if (option_parse(optarg, ",", wire_parsers) < 0)
+				exit(1);
+			break;
+		case 'o':
+			if (option_parse(optarg, ",", dscp_parsers) < 0)
+				exit(1);
+			break;
+		case 'C':
+			if (option_parse(optarg, ",", memcap_parsers) < 0)
+				exit(1);
+			break;
+		case 'j':
+			sys->journal = true;
+			if (option_parse(optarg, ",", journal_parsers) < 0)
+				exit(1);
+			break;
+		case 'm':
+			if (option_parse(optarg, ",", md_parsers) < 0)
+				exit(1);
+			break;
 		case 'l':
 			if (option_parse(optarg, ",", log_parsers) < 0)
 				exit(1);
@@ -627,6 +1268,9 @@ int main(int argc, char **argv)
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'd':
+			sys->dedup = true;
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				sd_err("Invalid address: '%s'", optarg);
@@ -637,6 +1281,9 @@ int main(int argc, char **argv)
 		case 'D':
 			sys->backend_dio = true;
 			break;
+		case 'e':
+			sys->pipeline = true;
+			break;
 		case 'f':
 			daemonize = false;
 			break;
@@ -645,19 +1292,97 @@ int main(int argc, char **argv)
 			nr_vnodes = 0;
 			break;
 		case 'z':
-			zone = strtol(optarg, &p, 10);
-			if (optarg == p || zone < 0 || UINT32_MAX < zone
-				|| *p != '\0') {
+			zone = parse_zone_id(optarg);
+			if (zone < 0) {
 				sd_err("Invalid zone id '%s': must be "
-				       "an integer between 0 and %u", optarg,
-				       UINT32_MAX);
+				       "an integer between 0 and %u, or "
+				       "levels a.b.c.d", optarg, UINT32_MAX);
 				exit(1);
 			}
 			sys->this_node.zone = zone;
 			break;
+		case 't':
+			nr_reactors = strtol(optarg, &p, 10);
+			if (optarg == p || nr_reactors < 0 ||
+			    MAX_REACTORS < nr_reactors || *p != '\0') {
+				sd_err("Invalid number of reactors '%s': must "
+				       "be an integer between 0 and %d", optarg,
+				       MAX_REACTORS);
+				exit(1);
+			}
+			sys->nr_reactors = nr_reactors;
+			break;
+		case 'T':
+			sys->trace_sample = strtol(optarg, &p, 10);
+			if (optarg == p || sys->trace_sample < 1 ||
+			    *p != '\0') {
+				sd_err("Invalid number of requests '%s': must "
+				       "be a positive integer", optarg);
+				exit(1);
+			}
+			break;
+		case 'S':
+			stall_ms = strtol(optarg, &p, 10);
+			if (optarg == p || stall_ms < 0 ||
+			    stall_ms > UINT32_MAX || *p != '\0') {
+				sd_err("Invalid stall threshold '%s': must be "
+				       "a number of milliseconds", optarg);
+				exit(1);
+			}
+			sys->stall_ms = stall_ms;
+			break;
+		case 'q':
+			sys->write_quorum = strtol(optarg, &p, 10);
+			if (optarg == p || sys->write_quorum < 0 ||
+			    SD_MAX_COPIES < sys->write_quorum || *p != '\0') {
+				sd_err("Invalid write quorum '%s': must be an "
+				       "integer between 0 and %d", optarg,
+				       SD_MAX_COPIES);
+				exit(1);
+			}
+			break;
+		case 'W':
+			sys->recovery_window = strtol(optarg, &p, 10);
+			if (optarg == p || sys->recovery_window < 0 ||
+			    MAX_RECOVERY_WINDOW < sys->recovery_window ||
+			    *p != '\0') {
+				sd_err("Invalid recovery window '%s': must be "
+				       "an integer between 0 and %d", optarg,
+				       MAX_RECOVERY_WINDOW);
+				exit(1);
+			}
+			break;
+		case 'x':
+			sys->delete_window = strtol(optarg, &p, 10);
+			if (optarg == p || sys->delete_window < 0 ||
+			    MAX_DELETE_WINDOW < sys->delete_window ||
+			    *p != '\0') {
+				sd_err("Invalid delete window '%s': must be "
+				       "an integer between 0 and %d", optarg,
+				       MAX_DELETE_WINDOW);
+				exit(1);
+			}
+			break;
+		case 'H':
+			sys->hybrid_age = strtoul(optarg, &p, 10);
+			if (optarg == p || *p != '\0') {
+				sd_err("Invalid hybrid age '%s': must be a"
+				       " number of seconds", optarg);
+				exit(1);
+			}
+			break;
 		case 'u':
 			sys->upgrade = true;
 			break;
+		case 'U':
+			sys->backend_uring = true;
+			break;
+		case 'M':
+			sys->rdma = true;
+			break;
+		case 'Z':
+			sys->zerocopy = true;
+			break;
 		case 'c':
 			sys->cdrv = find_cdrv(optarg);
 			if (!sys->cdrv) {
@@ -675,6 +1400,8 @@ int main(int argc, char **argv)
 		case 'w':
 			sys->enable_object_cache = true;
 			sys->object_cache_size = 0;
+			sys->object_cache_dirty_ratio = 10;
+			sys->object_cache_expire = 30;
 
 			if (option_parse(optarg, ",", cache_parsers) < 0)
 				exit(1);
@@ -848,6 +1575,14 @@ int main(int argc, char **argv)
 
 	init_fec();
 
+	ret = latency_init();
+	if (ret)
+		goto cleanup_log;
+
+	ret = buffer_pool_init();
+	if (ret)
+		goto cleanup_log;
+
 	/*
 	 * After this function, we are multi-threaded.
 	 *
@@ -863,10 +1598,65 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_log;
 
+	if (sys->nr_reactors) {
+		ret = init_reactors(sys->nr_reactors);
+		if (ret)
+			goto cleanup_log;
+	}
+
+	if (sys->journal && !sys->gateway_only) {
+		ret = journal_init(strlen(jpath) ? jpath : dir, jsize);
+		if (ret)
+			goto cleanup_log;
+	} else
+		sys->journal = false;
+	/* the journal syncs the writes already */
+	if (sys->journal || sys->nosync)
+		sys->md_group_sync = false;
+
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		goto cleanup_log;
 
+	/* Disks might be added or removed while sheep was down */
+	if (!sys->gateway_only) {
+		md_start_move();
+		md_init_tier();
+		md_init_slow();
+		scrub_start(dir);
+		recovery_ckpt_init(dir);
+		hybrid_start();
+	}
+	replica_start();
+	slice_cut_init();
+
+	if (sys->backend_uring && !sys->gateway_only) {
+		ret = uring_init();
+		if (ret)
+			goto cleanup_log;
+	}
+
+	if (sys->dedup && !sys->gateway_only) {
+		ret = dedup_init();
+		if (ret)
+			goto cleanup_log;
+	} else
+		sys->dedup = false;
+
+	if (sys->md_pool && !sys->gateway_only) {
+		ret = pool_init();
+		if (ret)
+			goto cleanup_log;
+	} else
+		sys->md_pool = 0;
+
+	if (sys->rcache_size && !sys->gateway_only) {
+		ret = rcache_init();
+		if (ret)
+			goto cleanup_log;
+	} else
+		sys->rcache_size = 0;
+
 	if (sys->enable_object_cache) {
 		if (!strlen(ocpath))
 			/* use object cache internally */
@@ -880,11 +1670,17 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_log;
 
+	if (sys->stall_ms) {
+		ret = watchdog_init();
+		if (ret)
+			goto cleanup_log;
+	}
+
 	ret = livepatch_init(dir);
 	if (ret)
 		goto cleanup_log;
 
-	if (http_options && http_init(http_options) != 0)
+	if (http_options && http_init(dir, http_options) != 0)
 		goto cleanup_log;
 
 	ret = nfs_init(NULL);
@@ -909,6 +1705,33 @@ int main(int argc, char **argv)
 		goto cleanup_pid_file;
 	}
 
+	/* after create_cluster(), which sets the address of this node */
+	if (sys->rdma) {
+		ret = rdma_init();
+		if (ret)
+			goto cleanup_log;
+	}
+
+	ret = sockfd_probe_init(&sys->this_node.nid);
+	if (ret)
+		goto cleanup_log;
+
+	if (sys->write_quorum) {
+		ret = init_write_quorum();
+		if (ret)
+			goto cleanup_log;
+	}
+
+	if (sys->nr_wire_pairs) {
+		if (!sys->wire_level)
+			sys->wire_level = 1;
+		ret = wire_init();
+		if (ret)
+			goto cleanup_log;
+	}
+
+	init_numa_affinity();
+
 	sd_info("sheepdog daemon (version %s) started", PACKAGE_VERSION);
 
 	while (sys->nr_outstanding_reqs != 0 ||
@@ -919,7 +1742,11 @@ int main(int argc, char **argv)
 	rc = 0;
 	sd_info("shutdown");
 
+	if (http_options)
+		http_exit();
+
 	leave_cluster();
+	md_close_manifests();
 
 cleanup_pid_file:
 	if (pid_file)
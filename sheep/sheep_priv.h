@@ -52,20 +52,38 @@
   * Functions that can sleep (e.g. disk I/Os or network I/Os) must be
   * called in the worker threads.  Add worker_fn markers to such
   * functions.
+  *
+  * Functions that handle client connections must be called in the
+  * thread owning the connection, that is, a reactor thread if there are
+  * reactors or the main thread otherwise.  Add reactor_fn markers to such
+  * functions.
   */
 #ifdef HAVE_TRACE
 #define MAIN_FN_SECTION ".sd_main"
 #define WORKER_FN_SECTION ".sd_worker"
+#define REACTOR_FN_SECTION ".sd_reactor"
 
 #define main_fn __attribute__((section(MAIN_FN_SECTION)))
 #define worker_fn __attribute__((section(WORKER_FN_SECTION)))
+#define reactor_fn __attribute__((section(REACTOR_FN_SECTION)))
 #else
 #define main_fn
 #define worker_fn
+#define reactor_fn
 #endif
 
+struct reactor;
+
+/* A message to run fn in another thread, see reactor_post() */
+struct reactor_msg {
+	struct list_node list;
+	void (*fn)(struct reactor_msg *msg);
+};
+
 struct client_info {
 	struct connection conn;
+	struct reactor *reactor; /* NULL if owned by the main thread */
+	struct reactor_msg msg;
 
 	struct request *rx_req;
 	struct work rx_work;
@@ -75,6 +93,25 @@ struct client_info {
 
 	struct list_head done_reqs;
 
+	/* pipelined connection, see pipe_rx() and pipe_tx() */
+	bool pipeline;
+	char *rx_buf;
+	uint32_t rx_pos, rx_len; /* consumed and filled bytes of rx_buf */
+	uint32_t rx_off; /* received data bytes of rx_req */
+	uint32_t tx_off; /* sent bytes of the first request in done_reqs */
+
+	/* shared memory ring of a local client, see shm_rx() */
+	bool unix_socket;
+	struct shm_conn *shm, *shm_pending; /* pending until attached */
+
+	/* admission control, see client_admitted() */
+	bool peer; /* of another sheep, never throttled */
+	bool throttled;
+	int nr_admitted; /* requests in flight against the credits */
+	struct list_node throttled_list;
+
+	bool bg; /* its replies are marked as SOCKFD_BG, see sockfd_mark() */
+
 	refcnt_t refcnt;
 };
 
@@ -108,20 +145,53 @@ struct request {
 	struct client_info *ci;
 	struct list_node request_list;
 	struct list_node pending_list;
+	struct reactor_msg msg;
 
 	refcnt_t refcnt;
 	bool local;
+	bool admitted; /* counted against the credits of its client */
 	int local_req_efd;
 
 	uint64_t local_oid;
 
+	/* the data is in place in the slot of a shared memory ring */
+	bool shm;
+	uint32_t shm_slot;
+
+	/* for the QoS scheduler of the gateway, see qos.c */
+	struct qos_class *qos;
+	struct work_queue *qos_wq;
+	struct list_node qos_list;
+	uint32_t write_window; /* of the vdi, see gateway_coalesce_write() */
+
 	struct vnode_info *vinfo;
+	int vinfo_gen; /* of the borrowed vinfo, -1 if a reference is held */
 
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+
+	/* for the latency histograms, in nanoseconds */
+	uint64_t rx_start;
+	uint64_t queue_start;
+	uint64_t tx_start; /* pipelined connections only */
+	uint64_t deadline; /* from obj.deadline, 0 for none */
+	/* the stages in microseconds, and the id of the span of a gateway */
+	uint32_t span[SD_LAT_NR_STAGES];
+	uint64_t span_id;
+
+	/* for the requests over RDMA, see rdma.c */
+	struct rdma_conn *rconn;
+	struct {
+		uint64_t addr;
+		uint32_t rkey;
+		uint32_t len;
+	} rbuf;
 };
 
+#define REQ_WAIT_HASH_SIZE 1024
+#define SD_MAX_WIRE_PAIRS 16
+
 struct system_info {
 	struct cluster_driver *cdrv;
 	const char *cdrv_option;
@@ -138,22 +208,38 @@ struct system_info {
 
 	struct sd_mutex local_req_lock;
 	struct list_head local_req_queue;
-	struct list_head req_wait_queue;
+	/* the requests waiting for the epoch and, by local_oid, for objects */
+	struct list_head req_wait_epoch;
+	struct list_head req_wait_oid[REQ_WAIT_HASH_SIZE];
 	int nr_outstanding_reqs;
 
 	bool gateway_only;
 	bool nosync;
 
+	uint32_t purged_epoch; /* objects moved to stale on joining back */
+
 	struct work_queue *net_wqueue;
 	struct work_queue *gateway_wqueue;
 	struct work_queue *io_wqueue;
+	struct work_queue *bg_io_wqueue; /* the peer requests of SOCKFD_BG */
 	struct work_queue *deletion_wqueue;
 	struct work_queue *recovery_wqueue;
 	struct work_queue *recovery_notify_wqueue;
 	struct work_queue *block_wqueue;
 	struct work_queue *oc_reclaim_wqueue;
 	struct work_queue *oc_push_wqueue;
+	struct work_queue *oc_trace_wqueue;
 	struct work_queue *md_wqueue;
+	struct work_queue *md_move_wqueue;
+	struct work_queue *journal_wqueue;
+	struct work_queue *pool_wqueue;
+	struct work_queue *stale_wqueue;
+	struct work_queue *scrub_wqueue;
+	struct work_queue *copy_wqueue;
+	struct work_queue *hybrid_wqueue;
+	struct work_queue *replica_wqueue;
+	struct work_queue *replica_obj_wqueue;
+	struct work_queue *objlist_wqueue;
 	struct work_queue *areq_wqueue;
 #ifdef HAVE_HTTP
 	struct work_queue *http_wqueue;
@@ -162,8 +248,43 @@ struct system_info {
 
 	uint32_t object_cache_size;
 	bool object_cache_directio;
+	uint32_t object_cache_dirty_ratio; /* Percentage of the cache size */
+	uint32_t object_cache_expire; /* Seconds */
 
 	bool backend_dio;
+	bool journal; /* journal the writes instead of O_DSYNC */
+	bool dedup; /* share the identical blocks of the data objects */
+	bool backend_uring;
+	bool rdma; /* use RDMA for the peer I/O */
+	bool zerocopy; /* forward writes to the replicas with MSG_ZEROCOPY */
+	bool read_balance; /* read the least loaded copy */
+	bool hedged_read; /* read another copy if the first one is slow */
+	uint64_t rcache_size; /* bytes caching the local reads, 0 for none */
+	int write_quorum; /* ack replicated writes after this many copies */
+	int qos_depth; /* gateway requests in flight, 0 for no limit */
+	int admit_conn; /* client requests in flight per connection */
+	int admit_node; /* client requests in flight on this node */
+	int nr_admitted;
+	int qos_deadline; /* ms a write waits for the reads of its vdi */
+	int nr_reactors; /* threads handling client connections */
+	int recovery_window; /* objects recovered in parallel */
+	int delete_window; /* objects deleted in parallel */
+	bool md_weighted; /* weighted rendezvous placement over the disks */
+	bool md_tier; /* keep the hot objects on the non-rotational disks */
+	bool md_group_sync; /* sync the writes by disk, see md_sync_disk() */
+	bool md_drain; /* unplug the slow disks, see md_slow_timer_fn() */
+	uint64_t md_move_rate; /* bytes per second moved between the disks */
+	int md_pool; /* preallocated object files per disk, 0 for none */
+	uint64_t stale_purge_rate; /* stale objects purged a second */
+	uint64_t scrub_rate; /* bytes per second scrubbed, 0 for none */
+	uint32_t hybrid_age; /* seconds a hot object is kept, 0 for ever */
+	/* the zones deflating the payloads between them, see wire.c */
+	uint32_t wire_pairs[SD_MAX_WIRE_PAIRS][2];
+	int nr_wire_pairs;
+	int wire_level; /* of zlib */
+	uint32_t stall_ms; /* the main loop may run a callback, 0 for ever */
+	int trace_sample; /* requests for one traced by the sample tracer */
+	bool pipeline; /* handle client connections in the event loops */
 	/* upgrade data layout before starting service if necessary*/
 	bool upgrade;
 	struct sd_stat stat;
@@ -174,6 +295,18 @@ struct disk {
 	char path[PATH_MAX];
 	uint64_t space;
 	uint64_t fsid;
+	uint64_t hash; /* seed of the weighted placement */
+	bool fast; /* non-rotational, the fast tier */
+	bool reflink; /* the file system clones the files */
+	uint64_t stale; /* bytes of the stale objects to purge */
+	int manifest_fd; /* opened by md_load_objects() to log objects */
+	uatomic_bool manifest_failed;
+
+	/* group sync of the writes, by the number written and synced */
+	int sync_fd;
+	struct sd_mutex sync_lock;
+	uint64_t nr_written;
+	uint64_t nr_synced;
 };
 
 struct vdisk {
@@ -188,10 +321,24 @@ struct md {
 	struct sd_rw_lock lock;
 	uint64_t space;
 	uint32_t nr_disks;
+	uint32_t nr_fast;
+	uint32_t gen; /* bumped whenever a disk is added or removed */
 };
 
 extern struct md md;
 
+/* An open object file handed out by md_get_fd() */
+struct md_fd {
+	struct hlist_node hash;
+	struct list_node lru;
+	uint64_t oid;
+	uint8_t ec_index;
+	int flags;
+	int fd;
+	bool compressed;
+	refcnt_t refcnt;
+};
+
 void update_node_disks(void);
 
 struct siocb {
@@ -201,6 +348,9 @@ struct siocb {
 	uint32_t offset;
 	uint8_t ec_index;
 	uint8_t copy_policy;
+	bool compress; /* create the object compressed */
+	bool raw; /* create the file of the object as buf, see read_compressed */
+	bool background; /* a bulk read to keep out of the page cache */
 };
 
 /* This structure is used to pass parameters to vdi_* functions. */
@@ -215,6 +365,10 @@ struct vdi_iocb {
 	uint8_t copy_policy;
 	uint8_t store_policy;
 	uint8_t nr_copies;
+	uint8_t compress;
+	uint8_t hybrid;
+	uint8_t block_size_shift;
+	uint8_t stripe_shift;
 	uint64_t time;
 };
 
@@ -238,13 +392,44 @@ struct store_driver {
 	int (*read)(uint64_t oid, const struct siocb *);
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid, uint8_t ec_index);
-	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	int (*get_hash)(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			uint8_t *sha1);
+	/* Optional, SD_BLOCK_HASH_NR digests of the blocks of the object */
+	int (*get_block_hash)(uint64_t oid, uint32_t epoch, uint8_t *digests);
 	/* Operations in recovery */
-	int (*link)(uint64_t oid, uint32_t tgt_epoch);
+	int (*link)(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
 	int (*purge_obj)(void);
+	/*
+	 * Optional, check if the replica, or its stale copy at the epoch, has
+	 * not been written since the epoch started
+	 */
+	int (*check_unchanged)(uint64_t oid, uint32_t epoch, bool stale);
+	/*
+	 * Optional, discard the length bytes of the object from offset, which
+	 * read back as zeros afterwards
+	 */
+	int (*discard)(uint64_t oid, const struct siocb *);
+	/*
+	 * Optional, create the object as a copy of the local object src with
+	 * the data of siocb over it, cheaper than a read and a create.
+	 * SD_RES_NO_SUPPORT if it can't.
+	 */
+	int (*copy)(uint64_t oid, uint64_t src, const struct siocb *);
+	/*
+	 * Optional, read the file of a compressed object as it is, for the
+	 * recovery to create it with siocb.raw.  SD_RES_NO_SUPPORT if the
+	 * object isn't compressed.
+	 */
+	int (*read_compressed)(uint64_t oid, uint32_t epoch, void **buf,
+			       uint32_t *len);
 	/* Operations for snapshot */
 	int (*cleanup)(void);
+	/*
+	 * Optional asynchronous path for the peer I/O, called in the main
+	 * thread.  Return false to let the worker threads process the request.
+	 */
+	bool (*queue_request)(struct request *req);
 };
 
 /* backend store */
@@ -255,25 +440,31 @@ bool default_exist(uint64_t oid, uint8_t ec_index);
 int default_create_and_write(uint64_t oid, const struct siocb *iocb);
 int default_write(uint64_t oid, const struct siocb *iocb);
 int default_read(uint64_t oid, const struct siocb *iocb);
-int default_link(uint64_t oid, uint32_t tgt_epoch);
+int default_discard(uint64_t oid, const struct siocb *iocb);
+int default_copy(uint64_t oid, uint64_t src, const struct siocb *iocb);
+int default_link(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch);
 int default_update_epoch(uint32_t epoch);
 int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid, uint8_t ec_index);
-int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_get_hash(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		     uint8_t *sha1);
+int default_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *digests);
 int default_purge_obj(void);
+int default_check_unchanged(uint64_t oid, uint32_t epoch, bool stale);
 
 int tree_init(void);
 bool tree_exist(uint64_t oid, uint8_t ec_index);
 int tree_create_and_write(uint64_t oid, const struct siocb *iocb);
 int tree_write(uint64_t oid, const struct siocb *iocb);
 int tree_read(uint64_t oid, const struct siocb *iocb);
-int tree_link(uint64_t oid, uint32_t tgt_epoch);
+int tree_link(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch);
 int tree_update_epoch(uint32_t epoch);
 int tree_cleanup(void);
 int tree_format(void);
 int tree_remove_object(uint64_t oid, uint8_t ec_index);
-int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int tree_get_hash(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		  uint8_t *sha1);
 int tree_purge_obj(void);
 
 int for_each_object_in_wd(int (*func)(uint64_t, const char *, uint32_t,
@@ -284,6 +475,13 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 struct vnode_info *, void *arg),
 			     void *arg);
 int for_each_obj_path(int (*func)(const char *path));
+int for_each_object_in_path(const char *path,
+			    int (*func)(uint64_t, const char *, uint32_t,
+					uint8_t, struct vnode_info *, void *),
+			    bool cleanup, struct vnode_info *vinfo, void *arg);
+int md_load_objects(int (*func)(uint64_t, const char *, uint32_t, uint8_t,
+				struct vnode_info *, void *), void *);
+size_t get_vdi_objsize(uint64_t oid);
 size_t get_store_objsize(uint64_t oid);
 
 extern struct list_head store_drivers;
@@ -315,11 +513,6 @@ static inline uint32_t sys_epoch(void)
 	return uatomic_read(&sys->cinfo.epoch);
 }
 
-static inline bool is_aligned_to_pagesize(void *p)
-{
-	return ((uintptr_t)p & (getpagesize() - 1)) == 0;
-}
-
 int create_listen_port(const char *bindaddr, int port);
 int init_unix_domain_socket(const char *dir);
 void unregister_listening_fds(void);
@@ -332,18 +525,30 @@ int lock_base_dir(const char *d);
 
 int fill_vdi_state_list(const struct sd_req *hdr,
 		struct sd_rsp *rsp, void *data);
+void merge_vdi_state_list(const struct vdi_state *vs, int nr);
 bool oid_is_readonly(uint64_t oid);
 int get_vdi_copy_number(uint32_t vid);
+bool get_vdi_copies(uint32_t vid, int *nr_copies, int *old_nr_copies);
+void vdi_set_copies(uint32_t vid, uint8_t nr_copies, uint8_t old_nr_copies);
+int get_vdi_write_quorum(uint32_t vid);
 int get_vdi_copy_policy(uint32_t vid);
+bool vdi_is_compressed(uint32_t vid);
+bool vdi_is_hybrid(uint32_t vid);
+uint8_t get_vdi_block_size_shift(uint32_t vid);
+uint32_t get_vdi_stripe_size(uint32_t vid);
+void vdi_set_block_size_shift(uint32_t vid, uint8_t shift);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_req_copy_number(struct request *req);
 int vdi_exist(uint32_t vid);
 int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid);
+void vdi_create_many(const struct vdi_iocb *iocb, struct sd_new_vdi *nv,
+		     int nr);
 int vdi_delete(uint32_t vid, bool);
 int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info);
 void vdi_mark_snapshot(uint32_t vid);
 void vdi_delete_state(uint32_t vid);
+void vdi_invalidate_header(uint32_t vid);
 void clean_vdi_state(void);
 int sd_delete_vdi(const char *name);
 int sd_lookup_vdi(const char *name, uint32_t *vid);
@@ -354,24 +559,49 @@ bool vdi_lock(uint32_t vid, const struct node_id *owner);
 bool vdi_unlock(uint32_t vid, const struct node_id *owner);
 
 int read_vdis(char *data, int len, unsigned int *rsp_len);
+int list_vdi_headers(uint64_t start, void *data, uint32_t len,
+		     uint32_t *rsp_len);
 
 int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len, uint32_t vid,
 		uint32_t *attrid, uint64_t ctime, bool write,
 		bool excl, bool delete);
+bool vdi_attr_cached(const struct sheepdog_vdi_attr *vattr, uint32_t snapid,
+		     uint32_t vid, uint32_t *attrid);
+void vdi_attr_cache_update(const struct sheepdog_vdi_attr *vattr,
+			   uint32_t snapid, uint32_t attrid, bool deleted);
+void vdi_attr_cache_clear(void);
 
 int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 			void *data, const struct sd_node *sender);
 
 struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info);
 struct vnode_info *get_vnode_info(void);
+void get_req_vnode_info(struct request *req);
+void put_req_vnode_info(struct request *req);
 void put_vnode_info(struct vnode_info *vinfo);
 struct vnode_info *alloc_vnode_info(const struct rb_root *);
+struct vnode_info *rebuild_vnode_info(const struct rb_root *nroot,
+				      const struct vnode_info *old);
+void refresh_vnode_info(void);
+
+/* vnodes.c */
+void build_vnodes(struct vnode_info *vinfo);
+bool merge_vnodes(struct vnode_info *vinfo, const struct vnode_info *old);
+void vinfo_oid_to_vnodes(const struct vnode_info *vinfo, uint64_t oid,
+			 int nr_copies, const struct sd_vnode **vnodes);
+const struct sd_node *vinfo_oid_to_node(const struct vnode_info *vinfo,
+					uint64_t oid, int copy_idx);
+void vinfo_oid_to_nodes(const struct vnode_info *vinfo, uint64_t oid,
+			int nr_copies, const struct sd_node **nodes);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo);
+struct vnode_info *get_cached_vnode_info_epoch(uint32_t epoch,
+					       struct vnode_info *cur_vinfo);
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
 		    struct sd_node *nodes, int len);
 
 void wait_get_vdi_bitmap_done(void);
+bool vdi_bitmap_synced(void);
 
 int get_nr_copies(struct vnode_info *vnode_info);
 
@@ -386,6 +616,11 @@ int leave_cluster(void);
 void queue_cluster_request(struct request *req);
 
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create);
+bool dio_supported(uint64_t oid);
+bool dio_aligned(const void *buf, size_t len, off_t offset);
+ssize_t dio_pread(int fd, void *buf, size_t len, off_t offset);
+ssize_t dio_pwrite(uint64_t oid, int fd, const void *buf, size_t len,
+		   off_t offset);
 int err_to_sderr(const char *path, uint64_t oid, int err);
 
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes,
@@ -411,16 +646,24 @@ int epoch_log_read_remote(uint32_t epoch, struct sd_node *nodes,
 				int len, int *nr_nodes, time_t *timestamp,
 				struct vnode_info *vinfo);
 uint32_t get_latest_epoch(void);
+int epoch_log_mtime(uint32_t epoch, struct timespec *ts);
+int epoch_log_read_range(uint32_t epoch, void *buf, size_t len, size_t *used);
+int epoch_delta_apply(const struct epoch_delta *d,
+		      const struct sd_node *nodes, int nr_nodes,
+		      struct sd_node *out, int max);
 void init_config_path(const char *base_path);
 int init_config_file(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
+int get_obj_list_page(const struct sd_req *, struct sd_rsp *, void *);
 void objlist_cache_format(void);
 int objlist_migrate_cache_insert(uint64_t oid);
 
 int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *, bool);
+void recovery_ckpt_init(const char *dir);
 bool oid_in_recovery(uint64_t oid, uint8_t opcode);
 bool node_in_recovery(void);
 void get_recovery_state(struct recovery_state *state);
+void set_recovery_throttle(const struct recovery_throttle *t);
 
 int read_backend_object(uint64_t oid, char *data, unsigned int datalen,
 		       uint64_t offset);
@@ -432,6 +675,8 @@ int sd_remove_object(uint64_t oid);
 int sd_discard_object(uint64_t oid);
 int sd_unref_object(uint64_t data_oid, uint32_t generation,
 			 uint32_t refcnt);
+int sd_unref_objects(const uint64_t *oids,
+		     const struct generation_reference *grefs, int nr);
 
 struct request_iocb *local_req_init(void);
 int exec_local_req(struct sd_req *rq, void *data);
@@ -445,8 +690,14 @@ void objlist_cache_remove(uint64_t oid);
 void objlist_migrate_cache_retire(void);
 
 void put_request(struct request *req);
+struct request *alloc_remote_request(struct client_info *ci,
+				     uint32_t data_length);
+void free_remote_request(struct request *req);
+void queue_remote_request(struct request *req);
 void get_request(struct request *req);
 void requeue_request(struct request *req);
+bool request_expired(struct request *req);
+uint8_t request_budget(const struct request *req);
 
 int sheep_bnode_writer(uint64_t oid, void *mem, unsigned int len,
 		       uint64_t offset, uint32_t flags, int copies,
@@ -484,12 +735,31 @@ static inline bool node_is_local(const struct sd_node *n)
 	return node_eq(n, &sys->this_node);
 }
 
+/*
+ * How far the node is from this one in the topology, from 0 of the same zone
+ * to 4.  The bytes of a zone are the levels of the topology from the lowest
+ * one, e.g. the row, the rack and the host of "-z 1.2.3", as the octets of
+ * the address make the default zone.
+ */
+static inline int node_distance(const struct sd_node *n)
+{
+	uint32_t diff = n->zone ^ sys->this_node.zone;
+
+	return diff ? 4 - __builtin_ctz(diff) / 8 : 0;
+}
+
 /* gateway operations */
 int gateway_read_object(struct request *req);
 int gateway_write_object(struct request *req);
 int gateway_create_object(struct request *req);
 int gateway_remove_object(struct request *req);
 int gateway_unref_object(struct request *req);
+int gateway_unref_objects(struct request *req);
+int ledger_unref(struct sd_unref *refs, int nr, uint32_t epoch);
+int gateway_discard_object(struct request *req);
+void gateway_flush_writes(uint32_t vid);
+int init_write_quorum(void);
+bool quorum_object_pending(uint64_t oid);
 
 bool is_erasure_oid(uint64_t oid);
 uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid);
@@ -533,12 +803,26 @@ struct sockfd *sheep_get_sockfd(const struct node_id *);
 void sheep_put_sockfd(const struct node_id *, struct sockfd *);
 void sheep_del_sockfd(const struct node_id *, struct sockfd *);
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
+int sheep_exec_req_rw(const struct node_id *nid, struct sd_req *hdr,
+		      void *wbuf, void *rbuf, uint32_t rlen);
 bool sheep_need_retry(uint32_t epoch);
 
+/*
+ * Return true if a request to a peer failed with ret because the peer may not
+ * know its opcode.  A sheep of this version answers SD_RES_INVALID_PARMS, but
+ * an older one closes the connection, which is a network error.
+ */
+static inline bool sheep_op_unknown(int ret)
+{
+	return ret == SD_RES_INVALID_PARMS || ret == SD_RES_NETWORK_ERROR;
+}
+
 /* md.c */
 bool md_add_disk(const char *path, bool);
 uint64_t md_init_space(void);
 const char *md_get_object_dir(uint64_t oid);
+bool md_reflink_supported(uint64_t oid);
+int md_sync_disk(const char *path, int fd);
 int md_handle_eio(const char *);
 bool md_exist(uint64_t oid, uint8_t ec_index, char *path);
 int md_get_stale_path(uint64_t oid, uint32_t epoch, uint8_t ec_index, char *);
@@ -548,6 +832,284 @@ int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 uint32_t md_nr_disks(void);
 bool md_verify_disk(const char *path);
+bool md_has_disk(const char *path);
+void md_stale_account(const char *path, int64_t bytes);
+void md_stale_reset(void);
+
+struct md_io_stat {
+	uint64_t nr_reads;
+	uint64_t nr_writes;
+	uint64_t read_ns; /* spent in the reads */
+	uint64_t write_ns;
+};
+
+void md_io_account(const char *path, bool write, uint64_t start);
+void md_io_get_stat(const char *disk, struct md_io_stat *stat);
+void md_start_move(void);
+void md_init_tier(void);
+void md_init_slow(void);
+bool md_path_slow(const char *path);
+bool md_oid_slow(uint64_t oid);
+
+/* scrub.c */
+void scrub_start(const char *dir);
+
+/* copy.c */
+int copy_set_vdi(uint32_t vid, uint8_t nr_copies, uint8_t old_nr_copies);
+int copy_start_vdi(struct vdi_copy *vc);
+void copy_queue_vdi(struct vdi_copy *vc);
+
+/* hybrid.c */
+void hybrid_start(void);
+bool hybrid_write_begin(uint64_t oid);
+void hybrid_write_end(uint64_t oid);
+
+/* watchdog.c */
+int watchdog_init(void);
+
+/* heat.c */
+void heat_note(uint64_t oid);
+uint32_t heat_of(uint64_t oid);
+
+/* qos.c */
+void qos_queue(struct request *req, struct work_queue *wq);
+void qos_done(struct request *req);
+void qos_update(uint32_t name_vid, const struct vdi_qos *qos);
+
+/* replicate.c */
+void replica_start(void);
+void replica_update(const char *name, const struct vdi_replica *conf);
+int replica_write(uint64_t oid, uint32_t offset, void *data, uint32_t len);
+
+/* farm.c */
+int farm_save(const char *dir, struct sd_farm_entry *ents, uint32_t nr);
+
+/* journal.c */
+int journal_init(const char *dir, uint64_t size);
+int journal_write_store(uint64_t oid, uint8_t ec_index, int fd,
+			const char *buf, size_t size, off_t offset);
+int journal_discard(uint64_t oid, uint8_t ec_index, int fd, off_t offset,
+		    size_t len);
+int journal_remove_object(uint64_t oid, uint8_t ec_index);
+void journal_done(int idx);
+void journal_checkpoint(void);
+
+/* dedup.c */
+int dedup_init(void);
+bool dedup_covers_block(uint64_t oid, uint64_t offset, uint32_t length);
+void dedup_object(uint64_t oid, int fd, const struct siocb *iocb);
+bool dedup_read_block(const uint8_t *digest, void *buf, uint32_t len);
+
+/* pool.c */
+int pool_init(void);
+bool pool_serves(uint64_t oid);
+int pool_claim(uint64_t oid, const char *path, char *pool_path);
+
+/* rcache.c */
+int rcache_init(void);
+bool rcache_lookup(uint64_t oid, const struct siocb *iocb);
+int rcache_read(uint64_t oid, const struct siocb *iocb,
+		int (*read_fn)(uint64_t oid, const struct siocb *iocb));
+void rcache_invalidate(uint64_t oid);
+void rcache_purge(void);
+void md_manifest_log(const char *path, uint64_t oid, uint8_t ec_index,
+		     bool add);
+void md_reset_manifests(void);
+void md_close_manifests(void);
+struct md_fd *md_get_fd(uint64_t oid, uint8_t ec_index, int flags,
+			char *path);
+struct md_fd *md_lookup_fd(uint64_t oid, uint8_t ec_index, int flags);
+void md_put_fd(struct md_fd *mfd);
+void md_invalidate_fd(uint64_t oid);
+void md_purge_fd_cache(void);
+
+/* lock.c */
+int grant_cluster_lock(uint64_t id, const struct node_id *holder,
+		       uint32_t epoch, bool reclaim);
+int release_cluster_lock(uint64_t id, const struct node_id *holder,
+			 uint32_t epoch);
+void reclaim_cluster_locks(void);
+
+/* offload.c */
+int cluster_msg_read(const struct node_id *nid, uint64_t id, void *buf,
+		     uint32_t len, uint32_t *rsp_len);
+
+/* buffer.c */
+int buffer_pool_init(void);
+void *buffer_alloc(size_t size);
+void *xbuffer_alloc(size_t size);
+void buffer_free(void *buf, size_t size);
+void buffer_pool_stat(struct s_buffer_pool *stat);
+
+/* latency.c */
+int latency_init(void);
+uint64_t latency_record(uint8_t opcode, enum sd_latency_stage stage,
+			uint64_t start);
+void request_latency(struct request *req, enum sd_latency_stage stage,
+		     uint64_t start);
+void latency_merge(struct sd_latency_stat *stat);
+uint64_t span_new_id(void);
+uint32_t span_get(void *data, uint32_t nr, uint32_t len);
+
+/* reactor.c */
+int init_reactors(int nr);
+struct reactor *fd_to_reactor(int fd);
+void reactor_post(struct reactor *r, struct reactor_msg *msg);
+void reactor_wakeup_main(void);
+
+/* uring.c */
+struct uring_iocb {
+	void (*done)(struct uring_iocb *iocb, int res);
+};
+
+#ifdef HAVE_IO_URING
+int uring_init(void);
+bool uring_has_room(void);
+bool uring_fs_ops_enabled(void);
+int uring_submit_rw(struct uring_iocb *iocb, bool write, int fd, void *buf,
+		    uint32_t len, uint64_t offset);
+int uring_submit_openat(struct uring_iocb *iocb, const char *path, int flags,
+			mode_t mode);
+int uring_submit_fallocate(struct uring_iocb *iocb, int fd, uint64_t len);
+int uring_submit_renameat(struct uring_iocb *iocb, const char *old,
+			  const char *new);
+#else
+static inline int uring_init(void)
+{
+	sd_notice("io_uring backend is not compiled");
+	return 0;
+}
+#endif
+
+/* compress.c */
+#ifdef HAVE_COMPRESS
+bool compress_supported(uint64_t oid);
+bool compress_is_file(uint64_t oid, int fd);
+uint64_t compress_file_size(uint64_t oid);
+int compress_create(int fd, uint64_t oid, const char *path,
+		    const struct siocb *iocb);
+int compress_read(int fd, uint64_t oid, const char *path,
+		  const struct siocb *iocb);
+int compress_write(int fd, uint64_t oid, const char *path,
+		   const struct siocb *iocb);
+int compress_read_file(int fd, uint64_t oid, const char *path, void *buf);
+#else
+static inline bool compress_supported(uint64_t oid)
+{
+	return false;
+}
+
+static inline bool compress_is_file(uint64_t oid, int fd)
+{
+	return false;
+}
+
+static inline uint64_t compress_file_size(uint64_t oid)
+{
+	return 0;
+}
+
+static inline int compress_create(int fd, uint64_t oid, const char *path,
+				  const struct siocb *iocb)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline int compress_read(int fd, uint64_t oid, const char *path,
+				const struct siocb *iocb)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline int compress_write(int fd, uint64_t oid, const char *path,
+				 const struct siocb *iocb)
+{
+	return SD_RES_NO_SUPPORT;
+}
+#endif
+
+/* wire.c */
+#ifdef HAVE_COMPRESS
+bool wire_deflate_to(const struct sd_node *n);
+void *wire_deflate(const void *buf, uint32_t len, uint32_t *out_len);
+int wire_inflate_request(struct request *req);
+void wire_deflate_reply(struct request *req);
+int wire_inflate_reply(struct sd_rsp *rsp, void *buf, uint32_t size);
+int wire_init(void);
+#else
+static inline bool wire_deflate_to(const struct sd_node *n)
+{
+	return false;
+}
+
+static inline void *wire_deflate(const void *buf, uint32_t len,
+				 uint32_t *out_len)
+{
+	return NULL;
+}
+
+static inline int wire_inflate_request(struct request *req)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline void wire_deflate_reply(struct request *req)
+{
+}
+
+static inline int wire_inflate_reply(struct sd_rsp *rsp, void *buf,
+				     uint32_t size)
+{
+	return rsp->flags & SD_FLAG_CMD_DEFLATE ? SD_RES_NO_SUPPORT :
+		SD_RES_SUCCESS;
+}
+
+static inline int wire_init(void)
+{
+	sd_notice("the compression on the wire is not compiled");
+	sys->nr_wire_pairs = 0;
+	return 0;
+}
+#endif
+
+/* rdma.c */
+#ifdef HAVE_RDMA
+int rdma_init(void);
+void rdma_register_buffer(void *addr, size_t len);
+void rdma_unregister_buffer(void *addr);
+int rdma_send_req(const struct node_id *nid, struct sd_req *hdr,
+		  struct sockfd_mux_req *mreq);
+void rdma_finish_req(struct sockfd_mux_req *mreq);
+void rdma_rebind_req(struct sockfd_mux_req *mreq, int efd);
+int rdma_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf);
+void rdma_put_request(struct request *req);
+#else
+static inline int rdma_init(void)
+{
+	sd_notice("RDMA transport is not compiled");
+	return 0;
+}
+
+static inline void rdma_register_buffer(void *addr, size_t len) {}
+static inline void rdma_unregister_buffer(void *addr) {}
+
+static inline int rdma_send_req(const struct node_id *nid, struct sd_req *hdr,
+				struct sockfd_mux_req *mreq)
+{
+	return -1;
+}
+
+static inline void rdma_finish_req(struct sockfd_mux_req *mreq) {}
+static inline void rdma_rebind_req(struct sockfd_mux_req *mreq, int efd) {}
+
+static inline int rdma_exec_req(const struct node_id *nid, struct sd_req *hdr,
+				void *buf)
+{
+	return -1;
+}
+
+static inline void rdma_put_request(struct request *req) {}
+#endif
 
 static inline bool is_stale_path(const char *path)
 {
@@ -571,13 +1133,18 @@ static inline bool is_ec_dentry(const char *dentry)
 
 /* http.c */
 #ifdef HAVE_HTTP
-int http_init(const char *options);
+int http_init(const char *dir, const char *options);
+void http_exit(void);
 #else
-static inline int http_init(const char *options)
+static inline int http_init(const char *dir, const char *options)
 {
 	sd_notice("http service is not compiled");
 	return 0;
 }
+
+static inline void http_exit(void)
+{
+}
 #endif /* END BUILD_HTTP */
 
 #ifdef HAVE_NFS
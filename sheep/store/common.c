@@ -19,25 +19,191 @@ char *epoch_path;
 struct store_driver *sd_store;
 LIST_HEAD(store_drivers);
 
-#define sector_algined(x) ({ ((x) & (SECTOR_SIZE - 1)) == 0; })
+/*
+ * With -D, the objects whose size is a multiple of DIO_ALIGN, i.e. the data
+ * objects, are always opened with O_DIRECT.  The requests are served by
+ * dio_pread() and dio_pwrite(), which take the unaligned edges of a request
+ * through a bounce buffer of the blocks around them, and the rest directly
+ * from the request buffer if it is aligned as the offset is.  The buffers of
+ * the requests, the peer replies and the EC strips are page aligned.
+ */
+#define DIO_ALIGN 4096
+#define DIO_BOUNCE_SIZE (1024 * 1024)
+#define DIO_NR_LOCKS 256
+
+/* the writes of the edges read the blocks back, exclusive of the others */
+static struct sd_rw_lock dio_locks[DIO_NR_LOCKS] = {
+	[0 ... DIO_NR_LOCKS - 1] = SD_RW_LOCK_INITIALIZER,
+};
+
+static inline bool dio_aligned_to(uintptr_t x)
+{
+	return (x & (DIO_ALIGN - 1)) == 0;
+}
 
-static inline bool iocb_is_aligned(const struct siocb *iocb)
+bool dio_aligned(const void *buf, size_t len, off_t offset)
 {
-	return  sector_algined(iocb->offset) && sector_algined(iocb->length);
+	return dio_aligned_to((uintptr_t)buf | len | offset);
+}
+
+bool dio_supported(uint64_t oid)
+{
+	return sys->backend_dio && dio_aligned_to(get_store_objsize(oid));
+}
+
+/*
+ * The piece of [offset, end) at pos which dio_pread() or dio_pwrite() does
+ * next: the aligned blocks directly from buf + (pos - offset), or else the
+ * blocks [*bstart, *bend) through the bounce buffer.  Return the length of
+ * the direct piece, 0 for a bounced one.
+ */
+static size_t dio_next(const void *buf, off_t offset, off_t end, off_t pos,
+		       off_t *bstart, off_t *bend)
+{
+	const char *p = (const char *)buf + (pos - offset);
+	bool congruent = dio_aligned_to((uintptr_t)p - pos);
+
+	if (congruent && dio_aligned_to(pos) && end - pos >= DIO_ALIGN)
+		return round_down(end - pos, DIO_ALIGN);
+
+	*bstart = round_down(pos, DIO_ALIGN);
+	if (congruent)
+		/* an edge */
+		*bend = *bstart + DIO_ALIGN;
+	else
+		*bend = min(round_up(end, DIO_ALIGN),
+			    *bstart + DIO_BOUNCE_SIZE);
+	return 0;
+}
+
+ssize_t dio_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	off_t pos = offset, end = offset + len, bstart, bend;
+	char *bounce = NULL;
+	ssize_t size;
+	size_t n;
+
+	if (dio_aligned(buf, len, offset))
+		return xpread(fd, buf, len, offset);
+
+	while (pos < end) {
+		n = dio_next(buf, offset, end, pos, &bstart, &bend);
+		if (n) {
+			size = xpread(fd, (char *)buf + (pos - offset), n, pos);
+			if (size < 0)
+				goto out;
+			pos += size;
+			if (size < n)
+				break;
+			continue;
+		}
+
+		if (!bounce)
+			bounce = xvalloc(DIO_BOUNCE_SIZE);
+		size = xpread(fd, bounce, bend - bstart, bstart);
+		if (size < 0)
+			goto out;
+		if (bstart + size <= pos)
+			break;
+		n = min(bstart + size, end) - pos;
+		memcpy((char *)buf + (pos - offset), bounce + (pos - bstart),
+		       n);
+		pos += n;
+		if (size < bend - bstart)
+			break;
+	}
+	size = pos - offset;
+out:
+	free(bounce);
+	return size;
+}
+
+/* Read the block at offset into buf, zeros beyond the end of the file */
+static int dio_read_block(int fd, char *buf, off_t offset)
+{
+	ssize_t size = xpread(fd, buf, DIO_ALIGN, offset);
+
+	if (size < 0)
+		return -1;
+	memset(buf + size, 0, DIO_ALIGN - size);
+	return 0;
+}
+
+static ssize_t dio_pwrite_unaligned(int fd, const void *buf, size_t len,
+				    off_t offset)
+{
+	off_t pos = offset, end = offset + len, bstart, bend;
+	char *bounce = NULL;
+	ssize_t size;
+	size_t n;
+
+	while (pos < end) {
+		n = dio_next(buf, offset, end, pos, &bstart, &bend);
+		if (n) {
+			size = xpwrite(fd, (const char *)buf + (pos - offset),
+				       n, pos);
+			if (size != n)
+				goto fail;
+			pos += n;
+			continue;
+		}
+
+		if (!bounce)
+			bounce = xvalloc(DIO_BOUNCE_SIZE);
+		/* the blocks the write leaves partly */
+		if (bstart < pos && dio_read_block(fd, bounce, bstart) < 0)
+			goto fail;
+		if (bend > end && bend - DIO_ALIGN >= pos &&
+		    dio_read_block(fd, bounce + (bend - DIO_ALIGN - bstart),
+				   bend - DIO_ALIGN) < 0)
+			goto fail;
+		n = min(bend, end) - pos;
+		memcpy(bounce + (pos - bstart), (const char *)buf +
+		       (pos - offset), n);
+		if (xpwrite(fd, bounce, bend - bstart, bstart) != bend - bstart)
+			goto fail;
+		pos += n;
+	}
+
+	free(bounce);
+	return len;
+fail:
+	free(bounce);
+	return -1;
+}
+
+ssize_t dio_pwrite(uint64_t oid, int fd, const void *buf, size_t len,
+		   off_t offset)
+{
+	struct sd_rw_lock *lock = dio_locks + sd_hash_oid(oid) % DIO_NR_LOCKS;
+	ssize_t size;
+
+	if (dio_aligned(buf, len, offset)) {
+		sd_read_lock(lock);
+		size = xpwrite(fd, buf, len, offset);
+	} else {
+		sd_write_lock(lock);
+		size = dio_pwrite_unaligned(fd, buf, len, offset);
+	}
+	sd_rw_unlock(lock);
+
+	return size;
 }
 
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
 {
 	int flags = O_DSYNC | O_RDWR;
 
-	if (sys->nosync == true)
+	/*
+	 * The journal or the group sync makes the writes durable, but not
+	 * the creation
+	 */
+	if (sys->nosync == true ||
+	    ((sys->journal || sys->md_group_sync) && !create))
 		flags &= ~O_DSYNC;
 
-	if (sys->backend_dio && iocb_is_aligned(iocb)) {
-		if (!is_aligned_to_pagesize(iocb->buf))
-			panic("Memory isn't aligned to pagesize %p", iocb->buf);
+	if (dio_supported(oid))
 		flags |= O_DIRECT;
-	}
 
 	if (create)
 		flags |= O_CREAT | O_EXCL;
@@ -202,6 +368,142 @@ int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
 	return do_epoch_log_read(epoch, nodes, len, nr_nodes, timestamp);
 }
 
+/* The local time when this node logged the epoch */
+int epoch_log_mtime(uint32_t epoch, struct timespec *ts)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
+	if (stat(path, &st) < 0) {
+		sd_debug("failed to stat epoch %"PRIu32" log, %m", epoch);
+		return SD_RES_NO_TAG;
+	}
+
+	*ts = st.st_mtim;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Fill d with the delta from the sorted nodes of prev to the ones of cur, or
+ * only count the nodes of it.  A node changed is removed and added again.
+ */
+static void epoch_delta_encode(struct epoch_delta *d, bool fill,
+			       const struct sd_node *prev, int nr_prev,
+			       const struct sd_node *cur, int nr_cur)
+{
+	struct sd_node *added = (struct sd_node *)(d + 1);
+	struct node_id *removed = (struct node_id *)(added + d->nr_added);
+	int i = 0, j = 0, nr_added = 0, nr_removed = 0, cmp;
+
+	while (i < nr_prev || j < nr_cur) {
+		if (i == nr_prev)
+			cmp = 1;
+		else if (j == nr_cur)
+			cmp = -1;
+		else
+			cmp = node_cmp(prev + i, cur + j);
+
+		/* the rb of the nodes in the epoch logs is zero-filled */
+		if (cmp == 0 && !memcmp(prev + i, cur + j, sizeof(*cur))) {
+			i++;
+			j++;
+			continue;
+		}
+		if (cmp <= 0) {
+			if (fill)
+				removed[nr_removed] = prev[i].nid;
+			nr_removed++;
+			i++;
+		}
+		if (cmp >= 0) {
+			if (fill)
+				added[nr_added] = cur[j];
+			nr_added++;
+			j++;
+		}
+	}
+	d->nr_added = nr_added;
+	d->nr_removed = nr_removed;
+}
+
+/*
+ * Read the logs from epoch down into buf for SD_OP_GET_EPOCHS, as many as len
+ * bytes hold, and return the length of them in used.  The first one is sent
+ * in full and each of the others as the delta from the one before it, which
+ * is a node or two for the most of the epochs.
+ */
+int epoch_log_read_range(uint32_t epoch, void *buf, size_t len, size_t *used)
+{
+	size_t nodes_len = SD_MAX_NODES * sizeof(struct sd_node), off = 0;
+	struct sd_node *prev = xmalloc(nodes_len), *cur = xmalloc(nodes_len);
+	int nr_prev = 0, nr_cur, ret = SD_RES_NO_TAG;
+	struct epoch_delta *d, count = {};
+	time_t t;
+
+	for (; epoch > 0; epoch--) {
+		ret = epoch_log_read_with_timestamp(epoch, cur, nodes_len,
+						    &nr_cur, &t);
+		if (ret != SD_RES_SUCCESS)
+			break;
+
+		epoch_delta_encode(&count, false, prev, nr_prev, cur, nr_cur);
+		if (off + epoch_delta_size(&count) > len) {
+			if (!off)
+				ret = SD_RES_BUFFER_SMALL;
+			break;
+		}
+
+		d = (struct epoch_delta *)((char *)buf + off);
+		d->epoch = epoch;
+		d->time = t;
+		d->nr_added = count.nr_added;
+		epoch_delta_encode(d, true, prev, nr_prev, cur, nr_cur);
+		off += epoch_delta_size(d);
+
+		SWAP(prev, cur);
+		nr_prev = nr_cur;
+	}
+
+	free(prev);
+	free(cur);
+	*used = off;
+	/* the epochs down from a missing one are left to another call */
+	return off ? SD_RES_SUCCESS : ret;
+}
+
+/*
+ * Apply the delta d to the sorted nodes, into out which holds max nodes.
+ * Return the number of the nodes of the epoch of d, or -1 if max is short.
+ */
+int epoch_delta_apply(const struct epoch_delta *d,
+		      const struct sd_node *nodes, int nr_nodes,
+		      struct sd_node *out, int max)
+{
+	const struct sd_node *added = (const struct sd_node *)(d + 1);
+	const struct node_id *removed =
+		(const struct node_id *)(added + d->nr_added);
+	int i = 0, j = 0, k = 0, nr = 0;
+
+	while (i < nr_nodes || j < d->nr_added) {
+		if (i < nr_nodes && k < d->nr_removed &&
+		    !node_id_cmp(&nodes[i].nid, removed + k)) {
+			i++;
+			k++;
+			continue;
+		}
+		if (nr == max)
+			return -1;
+		if (j == d->nr_added ||
+		    (i < nr_nodes && node_cmp(nodes + i, added + j) < 0))
+			out[nr++] = nodes[i++];
+		else
+			out[nr++] = added[j++];
+	}
+
+	return nr;
+}
+
 uint32_t get_latest_epoch(void)
 {
 	DIR *dir;
@@ -595,3 +897,56 @@ int sd_unref_object(uint64_t data_oid, uint32_t generation, uint32_t refcnt)
 
 	return ret;
 }
+
+/*
+ * Unref the nr objects of oids in parallel, like sd_unref_object().  grefs
+ * holds their generation references, NULL for the objects without ledger.
+ * The decrement messages go in one SD_OP_UNREF_OBJS, which batches them by
+ * ledger.  Return an error if any of them fails, without telling which.
+ */
+int sd_unref_objects(const uint64_t *oids,
+		     const struct generation_reference *grefs, int nr)
+{
+	struct request_iocb *iocb;
+	struct sd_unref *refs;
+	int ret = SD_RES_SUCCESS, err, nr_refs = 0;
+	struct sd_req hdr;
+
+	iocb = local_req_init();
+	if (!iocb)
+		return SD_RES_SYSTEM_ERROR;
+
+	refs = xmalloc(nr * sizeof(*refs));
+	for (int i = 0; i < nr; i++) {
+		uint32_t generation = grefs ? grefs[i].generation : 0;
+		uint32_t refcnt = grefs ? grefs[i].count : 0;
+
+		if (generation || refcnt) {
+			refs[nr_refs].oid = oids[i];
+			refs[nr_refs].generation = generation;
+			refs[nr_refs++].count = refcnt;
+			continue;
+		}
+
+		if (sys->enable_object_cache && object_is_cached(oids[i])) {
+			err = object_cache_remove(oids[i]);
+			if (err != SD_RES_SUCCESS) {
+				ret = err;
+				continue;
+			}
+		}
+		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+		hdr.obj.oid = oids[i];
+		exec_local_req_async(&hdr, NULL, iocb);
+	}
+	if (nr_refs) {
+		sd_init_req(&hdr, SD_OP_UNREF_OBJS);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.data_length = nr_refs * sizeof(*refs);
+		exec_local_req_async(&hdr, refs, iocb);
+	}
+
+	err = local_req_wait(iocb);
+	free(refs);
+	return err != SD_RES_SUCCESS ? err : ret;
+}
@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compressed data objects
+ *
+ * The data objects of a vdi created with 'dog vdi create -z' are compressed
+ * by the store.  The file of such an object is a header and a slot for each
+ * block of COMPRESS_BLOCK_SIZE bytes of the object.  A slot starts with the
+ * block header and the block deflated, or stored as it is if it doesn't
+ * shrink, and the rest of the slot is a hole.  So the file takes the space of
+ * the compressed data, and a read or a write inflates only the blocks it
+ * covers.  A slot whose header is all zero, e.g. a hole, is a zero block.
+ *
+ * The file is longer than the object, which tells it from the file of a plain
+ * object.  The block header has the checksum of the data, which turns a torn
+ * write of a slot into an EIO of the replica.  The writes of the slots go
+ * through the journal like the plain writes.
+ *
+ * The file is sent as a sparse buffer in the recovery, so the network carries
+ * the compressed data too.  The I/O of the gateway is the plain data.
+ */
+
+#include <zlib.h>
+
+#include "sheep_priv.h"
+
+#define COMPRESS_MAGIC 0x73647a31 /* "sdz1" */
+#define COMPRESS_BLOCK_SIZE (64 * 1024)
+/* the I/O of the file is aligned to it for O_DIRECT */
+#define COMPRESS_ALIGN SPARSE_BLOCK_SIZE
+#define COMPRESS_HDR_SIZE COMPRESS_ALIGN
+#define COMPRESS_SLOT_SIZE (COMPRESS_BLOCK_SIZE + COMPRESS_ALIGN)
+#define COMPRESS_NR_LOCKS 256
+
+struct compress_header {
+	uint32_t magic;
+	uint32_t block_size;
+	uint8_t algo;
+	uint8_t reserved[7];
+};
+
+struct compress_block {
+	uint32_t magic;
+	uint32_t length; /* of the data after the header */
+	uint32_t csum; /* crc32 of the data */
+	uint8_t algo; /* SD_COMPRESS_NONE if the block is stored as it is */
+	uint8_t reserved[3];
+};
+
+/* serialize the read-modify-write of the blocks */
+static struct sd_mutex compress_locks[COMPRESS_NR_LOCKS] = {
+	[0 ... COMPRESS_NR_LOCKS - 1] = SD_MUTEX_INITIALIZER,
+};
+
+static inline struct sd_mutex *compress_lock(uint64_t oid)
+{
+	return compress_locks + sd_hash_oid(oid) % COMPRESS_NR_LOCKS;
+}
+
+static inline uint32_t nr_blocks(uint64_t oid)
+{
+	return DIV_ROUND_UP(get_store_objsize(oid), COMPRESS_BLOCK_SIZE);
+}
+
+static inline uint32_t block_length(uint64_t oid, uint32_t idx)
+{
+	return min(get_store_objsize(oid) - (uint64_t)idx * COMPRESS_BLOCK_SIZE,
+		   (uint64_t)COMPRESS_BLOCK_SIZE);
+}
+
+static inline off_t slot_offset(uint32_t idx)
+{
+	return COMPRESS_HDR_SIZE + (off_t)idx * COMPRESS_SLOT_SIZE;
+}
+
+/* The erasure coded objects are strips, which aren't worth it */
+bool compress_supported(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_erasure_oid(oid);
+}
+
+uint64_t compress_file_size(uint64_t oid)
+{
+	return slot_offset(nr_blocks(oid));
+}
+
+bool compress_is_file(uint64_t oid, int fd)
+{
+	struct stat st;
+
+	if (!compress_supported(oid) || fstat(fd, &st) < 0)
+		return false;
+
+	return st.st_size == compress_file_size(oid);
+}
+
+/* Read the block idx into buf, slot is a buffer of COMPRESS_SLOT_SIZE */
+static int read_block(int fd, uint64_t oid, const char *path, uint32_t idx,
+		      void *slot, void *buf)
+{
+	struct compress_block *blk = slot;
+	uLongf len = block_length(oid, idx);
+	off_t offset = slot_offset(idx);
+	size_t size;
+
+	if (xpread(fd, slot, COMPRESS_ALIGN, offset) != COMPRESS_ALIGN) {
+		sd_err("failed to read %s, %m", path);
+		return err_to_sderr(path, oid, errno);
+	}
+
+	if (is_zero_block(blk, sizeof(*blk))) {
+		memset(buf, 0, len);
+		return SD_RES_SUCCESS;
+	}
+	if (blk->magic != COMPRESS_MAGIC ||
+	    blk->length > COMPRESS_SLOT_SIZE - sizeof(*blk))
+		goto corrupt;
+
+	size = round_up(sizeof(*blk) + blk->length, COMPRESS_ALIGN);
+	if (size > COMPRESS_ALIGN &&
+	    xpread(fd, (char *)slot + COMPRESS_ALIGN, size - COMPRESS_ALIGN,
+		   offset + COMPRESS_ALIGN) != size - COMPRESS_ALIGN) {
+		sd_err("failed to read %s, %m", path);
+		return err_to_sderr(path, oid, errno);
+	}
+	if (crc32(0, (Bytef *)(blk + 1), blk->length) != blk->csum)
+		goto corrupt;
+
+	switch (blk->algo) {
+	case SD_COMPRESS_NONE:
+		if (blk->length != len)
+			goto corrupt;
+		memcpy(buf, blk + 1, len);
+		break;
+	case SD_COMPRESS_ZLIB:
+		if (uncompress(buf, &len, (Bytef *)(blk + 1), blk->length) !=
+		    Z_OK || len != block_length(oid, idx))
+			goto corrupt;
+		break;
+	default:
+		goto corrupt;
+	}
+
+	return SD_RES_SUCCESS;
+corrupt:
+	sd_err("block %"PRIu32" of %s is corrupted", idx, path);
+	return SD_RES_EIO;
+}
+
+/*
+ * Write buf as the block idx.  *sync is set if the fd has to be synced after
+ * the write, i.e. the journal couldn't take it.
+ */
+static int write_block(int fd, uint64_t oid, const char *path,
+		       const struct siocb *iocb, uint32_t idx, const void *buf,
+		       void *slot, bool journal, bool *sync)
+{
+	struct compress_block *blk = slot;
+	uint32_t len = block_length(oid, idx);
+	uLongf clen = COMPRESS_SLOT_SIZE - sizeof(*blk);
+	off_t offset = slot_offset(idx);
+	size_t size;
+	int jf = -1;
+
+	memset(slot, 0, COMPRESS_ALIGN);
+	if (!is_zero_block(buf, len)) {
+		blk->magic = COMPRESS_MAGIC;
+		blk->algo = SD_COMPRESS_ZLIB;
+		if (compress2((Bytef *)(blk + 1), &clen, buf, len,
+			      Z_BEST_SPEED) != Z_OK || clen >= len) {
+			blk->algo = SD_COMPRESS_NONE;
+			memcpy(blk + 1, buf, len);
+			clen = len;
+		}
+		blk->length = clen;
+		blk->csum = crc32(0, (Bytef *)(blk + 1), clen);
+	}
+	size = round_up(sizeof(*blk) + blk->length, COMPRESS_ALIGN);
+	memset((char *)slot + sizeof(*blk) + blk->length, 0,
+	       size - sizeof(*blk) - blk->length);
+
+	if (journal && sys->journal) {
+		jf = journal_write_store(oid, iocb->ec_index, fd, slot, size,
+					 offset);
+		if (unlikely(jf == -2))
+			return SD_RES_EIO;
+		if (jf < 0)
+			*sync = true;
+	}
+	if (xpwrite(fd, slot, size, offset) != size) {
+		sd_err("failed to write %s, %m", path);
+		if (jf >= 0)
+			journal_done(jf);
+		return err_to_sderr(path, oid, errno);
+	}
+	if (jf >= 0)
+		journal_done(jf);
+
+	/* the data of the previous writes, if any, is garbage now */
+	if (size < COMPRESS_SLOT_SIZE &&
+	    xfallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       offset + size, COMPRESS_SLOT_SIZE - size) < 0 &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		sd_debug("failed to punch %s, %m", path);
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Write the range of iocb to the blocks.  The blocks written partially are
+ * read first, except for a new object which is all zero.
+ */
+static int write_blocks(int fd, uint64_t oid, const char *path,
+			const struct siocb *iocb, bool create)
+{
+	uint64_t start = iocb->offset, end = start + iocb->length;
+	void *slot = xvalloc(COMPRESS_SLOT_SIZE);
+	void *block = xvalloc(COMPRESS_BLOCK_SIZE);
+	const char *buf = iocb->buf;
+	bool sync = false;
+	int ret = SD_RES_SUCCESS;
+
+	for (uint32_t i = start / COMPRESS_BLOCK_SIZE;
+	     i < DIV_ROUND_UP(end, COMPRESS_BLOCK_SIZE); i++) {
+		uint64_t off = (uint64_t)i * COMPRESS_BLOCK_SIZE;
+		uint64_t from = max(off, start);
+		uint64_t to = min(off + block_length(oid, i), end);
+		const void *data;
+
+		if (from == off && to == off + block_length(oid, i)) {
+			data = buf + (off - start);
+		} else {
+			if (create)
+				memset(block, 0, COMPRESS_BLOCK_SIZE);
+			else {
+				ret = read_block(fd, oid, path, i, slot, block);
+				if (ret != SD_RES_SUCCESS)
+					break;
+			}
+			memcpy((char *)block + (from - off),
+			       buf + (from - start), to - from);
+			data = block;
+		}
+
+		ret = write_block(fd, oid, path, iocb, i, data, slot, !create,
+				  &sync);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	if (ret == SD_RES_SUCCESS && sync && !sys->nosync &&
+	    unlikely(fdatasync(fd) < 0)) {
+		sd_err("failed to sync %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+	}
+
+	free(block);
+	free(slot);
+	return ret;
+}
+
+/* Make fd, a new file, the compressed object with the data of iocb */
+int compress_create(int fd, uint64_t oid, const char *path,
+		    const struct siocb *iocb)
+{
+	struct compress_header *hdr = xvalloc(COMPRESS_HDR_SIZE);
+	int ret = SD_RES_SUCCESS;
+
+	hdr->magic = COMPRESS_MAGIC;
+	hdr->block_size = COMPRESS_BLOCK_SIZE;
+	hdr->algo = SD_COMPRESS_ZLIB;
+	if (xftruncate(fd, compress_file_size(oid)) < 0 ||
+	    xpwrite(fd, hdr, COMPRESS_HDR_SIZE, 0) != COMPRESS_HDR_SIZE) {
+		sd_err("failed to create %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	if (iocb->length)
+		ret = write_blocks(fd, oid, path, iocb, true);
+out:
+	free(hdr);
+	return ret;
+}
+
+int compress_read(int fd, uint64_t oid, const char *path,
+		  const struct siocb *iocb)
+{
+	uint64_t start = iocb->offset, end = start + iocb->length;
+	void *slot = xvalloc(COMPRESS_SLOT_SIZE);
+	void *block = xvalloc(COMPRESS_BLOCK_SIZE);
+	char *buf = iocb->buf;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(compress_lock(oid));
+	for (uint32_t i = start / COMPRESS_BLOCK_SIZE;
+	     i < DIV_ROUND_UP(end, COMPRESS_BLOCK_SIZE); i++) {
+		uint64_t off = (uint64_t)i * COMPRESS_BLOCK_SIZE;
+		uint64_t from = max(off, start);
+		uint64_t to = min(off + block_length(oid, i), end);
+
+		/* a whole block is inflated in place */
+		if (from == off && to == off + block_length(oid, i)) {
+			ret = read_block(fd, oid, path, i, slot,
+					 buf + (off - start));
+			if (ret != SD_RES_SUCCESS)
+				break;
+			continue;
+		}
+
+		ret = read_block(fd, oid, path, i, slot, block);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		memcpy(buf + (from - start), (char *)block + (from - off),
+		       to - from);
+	}
+	sd_mutex_unlock(compress_lock(oid));
+
+	free(block);
+	free(slot);
+	return ret;
+}
+
+int compress_write(int fd, uint64_t oid, const char *path,
+		   const struct siocb *iocb)
+{
+	int ret;
+
+	sd_mutex_lock(compress_lock(oid));
+	ret = write_blocks(fd, oid, path, iocb, false);
+	sd_mutex_unlock(compress_lock(oid));
+
+	return ret;
+}
+
+/* Read the whole file, of compress_file_size() bytes, as it is */
+int compress_read_file(int fd, uint64_t oid, const char *path, void *buf)
+{
+	size_t size = compress_file_size(oid);
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(compress_lock(oid));
+	if (xpread(fd, buf, size, 0) != size) {
+		sd_err("failed to read %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+	}
+	sd_mutex_unlock(compress_lock(oid));
+
+	return ret;
+}
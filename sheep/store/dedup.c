@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Deduplication of the blocks of the data objects
+ *
+ * The vdis created independently from the same image hold the same blocks in
+ * different objects, which COW doesn't share.  With '-d', the blocks written
+ * to the data objects are indexed by their SHA1, the unit of the block hashes
+ * of the plain store, and a block found in the index is shared with the one
+ * on disk by FIDEDUPERANGE.  The file system compares the blocks before it
+ * shares them and refcounts the extents, so a stale entry of the index costs
+ * a compare only, and the removal of an object, e.g. when SD_OP_UNREF_OBJ
+ * drops its last reference, frees the blocks nobody else shares.
+ *
+ * The index is a table of the last writer of a digest, filled since the start
+ * of sheep.  The recovery takes the blocks of an object which are in the
+ * index from the local disks instead of fetching them from the replica.
+ */
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+/* linux/fs.h has its own definition */
+#undef BLOCK_SIZE
+
+#include "sheep_priv.h"
+#include "sha1.h"
+
+#define DEDUP_TABLE_BITS 20
+#define DEDUP_NR_LOCKS 256
+
+struct dedup_entry {
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	uint32_t idx; /* of the block in the object */
+	uint64_t oid; /* 0 if the entry is free */
+};
+
+static struct dedup_entry *dedup_table;
+static struct sd_mutex dedup_locks[DEDUP_NR_LOCKS] = {
+	[0 ... DEDUP_NR_LOCKS - 1] = SD_MUTEX_INITIALIZER,
+};
+/* the holes aren't indexed, but a block of zeros is always at hand */
+static uint8_t zero_digest[SHA1_DIGEST_SIZE];
+
+static inline uint32_t dedup_slot(const uint8_t *digest)
+{
+	uint32_t slot;
+
+	memcpy(&slot, digest, sizeof(slot));
+	return slot & ((1U << DEDUP_TABLE_BITS) - 1);
+}
+
+static inline struct sd_mutex *dedup_lock(uint32_t slot)
+{
+	return dedup_locks + slot % DEDUP_NR_LOCKS;
+}
+
+static inline uint32_t dedup_bsize(uint64_t oid)
+{
+	return get_store_objsize(oid) / SD_BLOCK_HASH_NR;
+}
+
+static inline bool dedup_oid(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_erasure_oid(oid);
+}
+
+/* Return the entry of the digest in e, false if there is none */
+static bool dedup_lookup(const uint8_t *digest, struct dedup_entry *e)
+{
+	uint32_t slot = dedup_slot(digest);
+
+	sd_mutex_lock(dedup_lock(slot));
+	*e = dedup_table[slot];
+	sd_mutex_unlock(dedup_lock(slot));
+
+	return e->oid && !memcmp(e->digest, digest, SHA1_DIGEST_SIZE);
+}
+
+static void dedup_insert(const uint8_t *digest, uint64_t oid, uint32_t idx)
+{
+	uint32_t slot = dedup_slot(digest);
+	struct dedup_entry *e = dedup_table + slot;
+
+	sd_mutex_lock(dedup_lock(slot));
+	memcpy(e->digest, digest, SHA1_DIGEST_SIZE);
+	e->oid = oid;
+	e->idx = idx;
+	sd_mutex_unlock(dedup_lock(slot));
+}
+
+static struct md_fd *dedup_get_fd(uint64_t oid)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, md_get_object_dir(oid),
+		 oid);
+	return md_get_fd(oid, 0, O_RDONLY, path);
+}
+
+/*
+ * Share the len bytes at src_off of src with dst at dst_off.  Return 0 if
+ * they are shared, 1 if they differ, or -1 for an error.
+ */
+static int share_range(int src, off_t src_off, int dst, off_t dst_off,
+		       size_t len)
+{
+	struct file_dedupe_range *range;
+	int ret = 1;
+
+	range = xzalloc(sizeof(*range) + sizeof(range->info[0]));
+	range->src_offset = src_off;
+	range->src_length = len;
+	range->dest_count = 1;
+	range->info[0].dest_fd = dst;
+	range->info[0].dest_offset = dst_off;
+
+	if (ioctl(src, FIDEDUPERANGE, range) < 0)
+		ret = -1;
+	else if (range->info[0].status == FILE_DEDUPE_RANGE_SAME &&
+		 range->info[0].bytes_deduped == len)
+		ret = 0;
+	else if (range->info[0].status < 0) {
+		errno = -range->info[0].status;
+		ret = -1;
+	}
+
+	free(range);
+	return ret;
+}
+
+/* Share the block idx of the object in fd with the one of e */
+static void dedup_share(const struct dedup_entry *e, uint64_t oid, int fd,
+			uint32_t idx)
+{
+	uint32_t bsize = dedup_bsize(oid);
+	struct md_fd *src;
+	int ret;
+
+	src = dedup_get_fd(e->oid);
+	if (!src) {
+		/* the object is gone, the block is the new entry */
+		dedup_insert(e->digest, oid, idx);
+		return;
+	}
+
+	ret = share_range(src->fd, (off_t)e->idx * bsize, fd,
+			  (off_t)idx * bsize, bsize);
+	md_put_fd(src);
+	switch (ret) {
+	case 0:
+		uatomic_inc(&sys->stat.dd.shared);
+		break;
+	case 1:
+		dedup_insert(e->digest, oid, idx);
+		uatomic_inc(&sys->stat.dd.differed);
+		break;
+	default:
+		if (errno == EOPNOTSUPP || errno == ENOTTY) {
+			sd_warn("the file system can't share blocks, %m,"
+				" dedup is disabled");
+			sys->dedup = false;
+		} else
+			/* e.g. EXDEV, the objects are on different disks */
+			dedup_insert(e->digest, oid, idx);
+		break;
+	}
+}
+
+/* Whether the range covers a block to deduplicate */
+bool dedup_covers_block(uint64_t oid, uint64_t offset, uint32_t length)
+{
+	uint32_t bsize;
+
+	if (!sys->dedup || !dedup_oid(oid))
+		return false;
+
+	bsize = dedup_bsize(oid);
+	return round_up(offset, bsize) + bsize <= offset + length;
+}
+
+/* Return false if the deduplication is turned off meanwhile */
+static bool dedup_blocks(uint64_t oid, int fd, unsigned char **blks,
+			 const uint32_t *idxs, int nr, uint32_t bsize)
+{
+	uint8_t digests[SHA1_BATCH_NR][SHA1_DIGEST_SIZE];
+	unsigned char *sha1s[SHA1_BATCH_NR];
+	struct dedup_entry e;
+
+	for (int i = 0; i < nr; i++)
+		sha1s[i] = digests[i];
+	get_buffers_sha1(blks, bsize, sha1s, nr);
+
+	for (int i = 0; i < nr; i++) {
+		if (!dedup_lookup(digests[i], &e)) {
+			dedup_insert(digests[i], oid, idxs[i]);
+			continue;
+		}
+		if (e.oid == oid && e.idx == idxs[i])
+			continue;
+
+		dedup_share(&e, oid, fd, idxs[i]);
+		if (!sys->dedup)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Index the blocks covered by the write of iocb to the object in fd, and
+ * share the ones found in the index.  The blocks are hashed SHA1_BATCH_NR at
+ * a time.
+ */
+void dedup_object(uint64_t oid, int fd, const struct siocb *iocb)
+{
+	uint64_t start = iocb->offset, end = start + iocb->length;
+	unsigned char *blks[SHA1_BATCH_NR];
+	uint32_t idxs[SHA1_BATCH_NR];
+	uint32_t bsize = dedup_bsize(oid);
+	unsigned char *data = iocb->buf;
+	int nr = 0;
+
+	if (!dedup_covers_block(oid, iocb->offset, iocb->length))
+		return;
+
+	for (uint64_t off = round_up(start, bsize); off + bsize <= end;
+	     off += bsize) {
+		unsigned char *buf = data + (off - start);
+
+		/* the holes of the sparse objects take no space already */
+		if (is_zero_block(buf, bsize))
+			continue;
+
+		blks[nr] = buf;
+		idxs[nr++] = off / bsize;
+		if (nr < SHA1_BATCH_NR)
+			continue;
+		if (!dedup_blocks(oid, fd, blks, idxs, nr, bsize))
+			return;
+		nr = 0;
+	}
+	if (nr)
+		dedup_blocks(oid, fd, blks, idxs, nr, bsize);
+}
+
+/*
+ * Read a block of len bytes with the digest from the local objects.  Return
+ * false if there is no such block.
+ */
+bool dedup_read_block(const uint8_t *digest, void *buf, uint32_t len)
+{
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	struct dedup_entry e;
+	struct md_fd *mfd;
+	ssize_t size;
+
+	if (len == SD_DATA_OBJ_SIZE / SD_BLOCK_HASH_NR &&
+	    !memcmp(digest, zero_digest, SHA1_DIGEST_SIZE)) {
+		memset(buf, 0, len);
+		return true;
+	}
+
+	if (!dedup_lookup(digest, &e) || dedup_bsize(e.oid) != len)
+		return false;
+
+	mfd = dedup_get_fd(e.oid);
+	if (!mfd)
+		return false;
+	/* the compressed objects are never indexed, but could replace one */
+	if (mfd->compressed) {
+		md_put_fd(mfd);
+		return false;
+	}
+	size = xpread(mfd->fd, buf, len, (off_t)e.idx * len);
+	md_put_fd(mfd);
+	if (size != len)
+		return false;
+
+	get_buffer_sha1(buf, len, sha1);
+	if (memcmp(sha1, digest, SHA1_DIGEST_SIZE))
+		return false;
+
+	uatomic_inc(&sys->stat.dd.recovered);
+	return true;
+}
+
+int dedup_init(void)
+{
+	void *zero = xvalloc(SD_DATA_OBJ_SIZE / SD_BLOCK_HASH_NR);
+
+	get_buffer_sha1(zero, SD_DATA_OBJ_SIZE / SD_BLOCK_HASH_NR, zero_digest);
+	free(zero);
+
+	dedup_table = xcalloc(1U << DEDUP_TABLE_BITS, sizeof(*dedup_table));
+	sd_info("deduplicate the blocks of the data objects, %zu entries",
+		(size_t)1 << DEDUP_TABLE_BITS);
+	return 0;
+}
@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Write-ahead journal of the writes to the objects
+ *
+ * Without '-n', every write of an object is O_DSYNC and pays a sync of the
+ * file system for a few KB at a random offset of the object file.  With '-j',
+ * default_write() appends the write to a journal file, preferably on a fast
+ * device, and writes the object without O_DSYNC.  The writes appended at the
+ * same time are flushed by one fdatasync() of the journal.
+ *
+ * There are two journal files used in turn.  When the active one is full the
+ * other one takes over, and the full one is checkpointed in the background:
+ * once its writes have all reached the object files, the file systems of the
+ * disks are synced and the journal file is invalidated.  The journal files
+ * are replayed into the objects when sheep starts.
+ *
+ * An entry is a descriptor, the data and an end marker, padded to a sector.
+ * A round of a journal file has its own generation, so the entries left by
+ * the previous rounds and the torn ones are told by the generation, the
+ * marker and the checksum of the data.  An entry applies only to the object
+ * file of the inode it was written to, and a removal of the object discards
+ * its entries before it.  A discard of a range of an object is replayed as a
+ * hole punched in its file, in the order of the entries.
+ */
+
+#include "sheep_priv.h"
+
+/*
+ * CAUTION: tests/dynamorio/journaling/journaling.c has a copy of the
+ * descriptor, update it too.
+ */
+struct journal_descriptor {
+	uint32_t magic;
+	uint16_t flag;
+	uint16_t ec_index;
+	union {
+		uint32_t epoch;
+		uint64_t oid;
+	};
+	uint64_t offset;
+	uint64_t size;
+	uint8_t create;
+	uint8_t reserved[7];
+	uint64_t gen;
+	uint64_t ino; /* inode of the object file */
+	uint64_t csum; /* of the data */
+	uint64_t hole; /* bytes discarded from offset */
+	uint8_t pad[436];
+} __packed;
+
+/* JOURNAL_DESC + JOURNAL_MARKER must be 512 algined for DIO */
+#define JOURNAL_DESC_MAGIC 0xfee1900d
+#define JOURNAL_DESC_SIZE 508
+#define JOURNAL_MARKER_SIZE 4 /* Use marker to detect partial write */
+#define JOURNAL_META_SIZE (JOURNAL_DESC_SIZE + JOURNAL_MARKER_SIZE)
+
+#define JOURNAL_END_MARKER 0xdeadbeef
+
+#define JF_STORE 0
+#define JF_REMOVE_OBJ 2
+#define JF_DISCARD 3
+
+#define JOURNAL_FILE_NAME "journal_file"
+
+struct journal_file {
+	int fd;
+	uint64_t gen; /* of the current round, 0 if invalidated */
+	uint64_t pos;
+	uint32_t nr_inflight; /* entries not written to the objects yet */
+	bool checkpointing;
+
+	/* group commit of the entries, by the number written and synced */
+	struct sd_mutex sync_lock;
+	uint64_t nr_written;
+	uint64_t nr_synced;
+};
+
+static struct journal {
+	struct sd_mutex lock;
+	/* broadcast when an entry is done or a checkpoint finishes */
+	struct sd_cond cond;
+	struct journal_file files[2];
+	struct journal_file *active;
+	uint64_t size;
+	uint64_t gen;
+} journal = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.cond = SD_COND_INITIALIZER,
+	.files = {
+		{ .fd = -1, .sync_lock = SD_MUTEX_INITIALIZER },
+		{ .fd = -1, .sync_lock = SD_MUTEX_INITIALIZER },
+	},
+};
+
+static inline size_t entry_len(size_t size)
+{
+	return round_up(JOURNAL_META_SIZE + size, 512);
+}
+
+static inline uint32_t entry_marker(uint64_t gen)
+{
+	return JOURNAL_END_MARKER ^ (uint32_t)gen;
+}
+
+static uint64_t data_csum(const char *buf, size_t size)
+{
+	uint64_t hval = FNV1A_64_INIT, v;
+	size_t i;
+
+	for (i = 0; i + sizeof(v) <= size; i += sizeof(v)) {
+		memcpy(&v, buf + i, sizeof(v));
+		hval = fnv_64a_64(v, hval);
+	}
+	for (; i < size; i++)
+		hval = fnv_64a_64((uint8_t)buf[i], hval);
+
+	return hval;
+}
+
+static inline struct journal_file *other_file(struct journal_file *jf)
+{
+	return journal.files + (jf == journal.files);
+}
+
+/* Must be called with journal.lock held, returns the full file */
+static struct journal_file *switch_file(void)
+{
+	struct journal_file *full = journal.active, *next = other_file(full);
+
+	full->checkpointing = true;
+	next->gen = ++journal.gen;
+	next->pos = 0;
+	journal.active = next;
+
+	return full;
+}
+
+static int sync_disk(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+	if (syncfs(fd) < 0)
+		sd_err("failed to sync %s, %m", path);
+	close(fd);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Invalidate the entries of jf, whose writes are in the objects already */
+static void invalidate_file(struct journal_file *jf)
+{
+	char zero[JOURNAL_DESC_SIZE] = {};
+
+	if (xpwrite(jf->fd, zero, sizeof(zero), 0) != sizeof(zero) ||
+	    fdatasync(jf->fd) < 0)
+		sd_err("failed to invalidate the journal, %m");
+}
+
+static void do_checkpoint(struct journal_file *jf)
+{
+	sd_mutex_lock(&journal.lock);
+	while (jf->nr_inflight)
+		sd_cond_wait(&journal.cond, &journal.lock);
+	sd_mutex_unlock(&journal.lock);
+
+	for_each_obj_path(sync_disk);
+	invalidate_file(jf);
+
+	sd_mutex_lock(&journal.lock);
+	jf->gen = 0;
+	jf->checkpointing = false;
+	sd_cond_broadcast(&journal.cond);
+	sd_mutex_unlock(&journal.lock);
+}
+
+struct checkpoint_work {
+	struct work work;
+	struct journal_file *jf;
+};
+
+static void checkpoint_work(struct work *work)
+{
+	struct checkpoint_work *cw = container_of(work, struct checkpoint_work,
+						  work);
+
+	do_checkpoint(cw->jf);
+}
+
+static void checkpoint_done(struct work *work)
+{
+	struct checkpoint_work *cw = container_of(work, struct checkpoint_work,
+						  work);
+
+	free(cw);
+}
+
+/*
+ * Checkpoint all the entries, for the operations moving the object files
+ * around.
+ */
+void journal_checkpoint(void)
+{
+	struct journal_file *full;
+
+	if (!sys->journal)
+		return;
+
+	sd_mutex_lock(&journal.lock);
+	while (other_file(journal.active)->checkpointing)
+		sd_cond_wait(&journal.cond, &journal.lock);
+	if (!journal.active->pos) {
+		sd_mutex_unlock(&journal.lock);
+		return;
+	}
+	full = switch_file();
+	sd_mutex_unlock(&journal.lock);
+
+	do_checkpoint(full);
+}
+
+static struct journal_file *journal_reserve(size_t len, uint64_t *pos,
+					    uint64_t *gen)
+{
+	struct journal_file *jf, *full = NULL;
+	struct checkpoint_work *cw;
+
+	sd_mutex_lock(&journal.lock);
+	for (;;) {
+		jf = journal.active;
+		if (jf->pos + len <= journal.size)
+			break;
+		/* wait for the other file if it isn't checkpointed yet */
+		if (other_file(jf)->checkpointing)
+			sd_cond_wait(&journal.cond, &journal.lock);
+		else
+			full = switch_file();
+	}
+	*pos = jf->pos;
+	*gen = jf->gen;
+	jf->pos += len;
+	jf->nr_inflight++;
+	sd_mutex_unlock(&journal.lock);
+
+	if (full) {
+		cw = xzalloc(sizeof(*cw));
+		cw->jf = full;
+		cw->work.fn = checkpoint_work;
+		cw->work.done = checkpoint_done;
+		queue_work(sys->journal_wqueue, &cw->work);
+	}
+
+	return jf;
+}
+
+/* Flush the entries written so far unless another thread did it for us */
+static int journal_sync(struct journal_file *jf, uint64_t ticket)
+{
+	uint64_t written;
+	int ret = 0;
+
+	sd_mutex_lock(&jf->sync_lock);
+	if (jf->nr_synced < ticket) {
+		written = uatomic_read(&jf->nr_written);
+		ret = fdatasync(jf->fd);
+		if (ret == 0)
+			jf->nr_synced = written;
+	}
+	sd_mutex_unlock(&jf->sync_lock);
+
+	return ret;
+}
+
+static int journal_append(struct journal_descriptor *jd, const char *buf)
+{
+	size_t len = entry_len(jd->size);
+	struct journal_file *jf;
+	uint64_t pos, gen, ticket;
+	uint32_t marker;
+	char *p;
+
+	if (len > journal.size / 2) {
+		/* too large to be journaled, write it synchronously */
+		journal_checkpoint();
+		return -1;
+	}
+
+	jf = journal_reserve(len, &pos, &gen);
+	jd->gen = gen;
+	jd->magic = JOURNAL_DESC_MAGIC;
+	marker = entry_marker(jd->gen);
+
+	p = xzalloc(len);
+	memcpy(p, jd, JOURNAL_DESC_SIZE);
+	if (jd->size)
+		memcpy(p + JOURNAL_DESC_SIZE, buf, jd->size);
+	memcpy(p + JOURNAL_DESC_SIZE + jd->size, &marker, sizeof(marker));
+
+	if (xpwrite(jf->fd, p, len, pos) != len) {
+		sd_err("failed to write the journal, %m");
+		goto err;
+	}
+	ticket = uatomic_add_return(&jf->nr_written, 1);
+	if (journal_sync(jf, ticket) < 0) {
+		sd_err("failed to sync the journal, %m");
+		goto err;
+	}
+	free(p);
+
+	return jf - journal.files;
+err:
+	free(p);
+	journal_done(jf - journal.files);
+	return -2;
+}
+
+/*
+ * Journal a write to the object file fd.  Returns the journal file to pass to
+ * journal_done() after the write to the object, -1 if the write has to be
+ * synchronous, or -2 if the journal failed.
+ */
+int journal_write_store(uint64_t oid, uint8_t ec_index, int fd,
+			const char *buf, size_t size, off_t offset)
+{
+	struct journal_descriptor jd = {
+		.flag = JF_STORE,
+		.ec_index = ec_index,
+		.oid = oid,
+		.offset = offset,
+		.size = size,
+		.csum = data_csum(buf, size),
+	};
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %016"PRIx64", %m", oid);
+		return -2;
+	}
+	jd.ino = st.st_ino;
+
+	return journal_append(&jd, buf);
+}
+
+/* Journal the punch of a hole of len bytes at offset in the object file fd */
+int journal_discard(uint64_t oid, uint8_t ec_index, int fd, off_t offset,
+		    size_t len)
+{
+	struct journal_descriptor jd = {
+		.flag = JF_DISCARD,
+		.ec_index = ec_index,
+		.oid = oid,
+		.offset = offset,
+		.hole = len,
+		.csum = data_csum(NULL, 0),
+	};
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %016"PRIx64", %m", oid);
+		return -2;
+	}
+	jd.ino = st.st_ino;
+
+	return journal_append(&jd, NULL);
+}
+
+/* Journal the removal of an object, which discards its previous entries */
+int journal_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	struct journal_descriptor jd = {
+		.flag = JF_REMOVE_OBJ,
+		.ec_index = ec_index,
+		.oid = oid,
+		.csum = data_csum(NULL, 0),
+	};
+
+	return journal_append(&jd, NULL);
+}
+
+void journal_done(int idx)
+{
+	struct journal_file *jf = journal.files + idx;
+
+	sd_mutex_lock(&journal.lock);
+	if (--jf->nr_inflight == 0 && jf->checkpointing)
+		sd_cond_broadcast(&journal.cond);
+	sd_mutex_unlock(&journal.lock);
+}
+
+/* Replay */
+
+struct replay_entry {
+	struct journal_descriptor jd;
+	int fd;
+	uint64_t pos;
+	uint64_t seq;
+};
+
+struct replay {
+	struct replay_entry *entries;
+	size_t nr, alloc;
+	/* the last removal of the objects, sorted by oid */
+	struct replay_entry **removals;
+	size_t nr_removals;
+};
+
+/* Read the valid entries of a round of a journal file, returns its gen */
+static uint64_t read_journal_file(int fd, struct replay *rp)
+{
+	struct journal_descriptor jd;
+	uint64_t gen = 0, pos = 0, size = journal.size;
+	char *buf = NULL;
+	uint32_t marker;
+
+	while (pos + JOURNAL_META_SIZE <= size) {
+		if (xpread(fd, &jd, sizeof(jd), pos) != sizeof(jd) ||
+		    jd.magic != JOURNAL_DESC_MAGIC ||
+		    (gen && jd.gen != gen) ||
+		    (jd.flag != JF_STORE && jd.flag != JF_REMOVE_OBJ &&
+		     jd.flag != JF_DISCARD) ||
+		    pos + entry_len(jd.size) > size)
+			break;
+
+		buf = xrealloc(buf, jd.size + JOURNAL_MARKER_SIZE);
+		if (xpread(fd, buf, jd.size + JOURNAL_MARKER_SIZE,
+			   pos + JOURNAL_DESC_SIZE) !=
+		    jd.size + JOURNAL_MARKER_SIZE)
+			break;
+		memcpy(&marker, buf + jd.size, sizeof(marker));
+		if (marker != entry_marker(jd.gen) ||
+		    data_csum(buf, jd.size) != jd.csum)
+			break;
+
+		gen = jd.gen;
+		if (rp->nr == rp->alloc) {
+			rp->alloc = rp->alloc ? rp->alloc * 2 : 1024;
+			rp->entries = xrealloc(rp->entries, rp->alloc *
+					       sizeof(*rp->entries));
+		}
+		rp->entries[rp->nr++] = (struct replay_entry) {
+			.jd = jd,
+			.fd = fd,
+			.pos = pos + JOURNAL_DESC_SIZE,
+		};
+		pos += entry_len(jd.size);
+	}
+	free(buf);
+
+	return gen;
+}
+
+static int removal_cmp(struct replay_entry * const *a,
+		       struct replay_entry * const *b)
+{
+	int ret = intcmp((*a)->jd.oid, (*b)->jd.oid);
+
+	if (ret)
+		return ret;
+	ret = intcmp((*a)->jd.ec_index, (*b)->jd.ec_index);
+	if (ret)
+		return ret;
+	/* the last one first */
+	return -intcmp((*a)->seq, (*b)->seq);
+}
+
+static bool removed_later(const struct replay *rp,
+			  const struct replay_entry *e)
+{
+	size_t lo = 0, hi = rp->nr_removals;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const struct replay_entry *r = rp->removals[mid];
+		int ret = intcmp(r->jd.oid, e->jd.oid) ?:
+			intcmp(r->jd.ec_index, e->jd.ec_index);
+
+		if (ret == 0)
+			return r->seq > e->seq;
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return false;
+}
+
+static void replay_entry(const struct replay_entry *e, char *buf)
+{
+	const struct journal_descriptor *jd = &e->jd;
+	char path[PATH_MAX];
+	struct stat st;
+	int fd;
+
+	if (is_erasure_oid(jd->oid))
+		snprintf(path, sizeof(path), "%s/%016"PRIx64"_%d",
+			 md_get_object_dir(jd->oid), jd->oid, jd->ec_index);
+	else
+		snprintf(path, sizeof(path), "%s/%016"PRIx64,
+			 md_get_object_dir(jd->oid), jd->oid);
+
+	if (!md_exist(jd->oid, jd->ec_index, path))
+		return;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return;
+	}
+	/* the file was replaced since */
+	if (fstat(fd, &st) < 0 || st.st_ino != jd->ino)
+		goto out;
+
+	if (jd->flag == JF_DISCARD) {
+		if (xfallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       jd->offset, jd->hole) < 0)
+			sd_err("failed to replay the discard of %016"PRIx64
+			       ", %m", jd->oid);
+	} else if (xpread(e->fd, buf, jd->size, e->pos) != jd->size ||
+		   xpwrite(fd, buf, jd->size, jd->offset) != jd->size)
+		sd_err("failed to replay %016"PRIx64", %m", jd->oid);
+out:
+	close(fd);
+}
+
+static void journal_replay(int fds[2])
+{
+	struct replay rp = {};
+	uint64_t gens[2];
+	size_t split, nr_applied = 0;
+	char *buf = NULL;
+
+	gens[0] = read_journal_file(fds[0], &rp);
+	split = rp.nr;
+	gens[1] = read_journal_file(fds[1], &rp);
+	if (!rp.nr)
+		return;
+
+	/* the older round first */
+	if (gens[0] && gens[1] && gens[1] < gens[0]) {
+		struct replay_entry *entries = xmalloc(sizeof(*entries) *
+						       rp.nr);
+
+		memcpy(entries, rp.entries + split,
+		       sizeof(*entries) * (rp.nr - split));
+		memcpy(entries + rp.nr - split, rp.entries,
+		       sizeof(*entries) * split);
+		free(rp.entries);
+		rp.entries = entries;
+	}
+	for (size_t i = 0; i < rp.nr; i++)
+		rp.entries[i].seq = i;
+	journal.gen = max(gens[0], gens[1]);
+
+	rp.removals = xmalloc(sizeof(*rp.removals) * rp.nr);
+	for (size_t i = 0; i < rp.nr; i++)
+		if (rp.entries[i].jd.flag == JF_REMOVE_OBJ)
+			rp.removals[rp.nr_removals++] = rp.entries + i;
+	xqsort(rp.removals, rp.nr_removals, removal_cmp);
+
+	for (size_t i = 0; i < rp.nr; i++) {
+		const struct replay_entry *e = rp.entries + i;
+
+		if (e->jd.flag == JF_REMOVE_OBJ || removed_later(&rp, e))
+			continue;
+		buf = xrealloc(buf, e->jd.size);
+		replay_entry(e, buf);
+		nr_applied++;
+	}
+
+	for_each_obj_path(sync_disk);
+	sd_info("replayed %zu of %zu journal entries", nr_applied, rp.nr);
+
+	free(buf);
+	free(rp.removals);
+	free(rp.entries);
+}
+
+int journal_init(const char *dir, uint64_t size)
+{
+	char path[PATH_MAX];
+	int fds[2];
+
+	BUILD_BUG_ON(sizeof(struct journal_descriptor) != JOURNAL_DESC_SIZE);
+
+	if (xmkdir(dir, sd_def_dmode) < 0) {
+		sd_err("can't mkdir for %s, %m", dir);
+		return -1;
+	}
+
+	journal.size = size;
+	for (int i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/"JOURNAL_FILE_NAME"%d", dir,
+			 i);
+		fds[i] = open(path, O_RDWR | O_CREAT, sd_def_fmode);
+		if (fds[i] < 0) {
+			sd_err("failed to open %s, %m", path);
+			return -1;
+		}
+		if (prealloc(fds[i], size) < 0) {
+			sd_err("failed to allocate %s, %m", path);
+			return -1;
+		}
+	}
+
+	/* the entries which didn't reach the objects before we went down */
+	journal_replay(fds);
+
+	for (int i = 0; i < 2; i++) {
+		journal.files[i].fd = fds[i];
+		invalidate_file(journal.files + i);
+	}
+	journal.active = journal.files;
+	journal.active->gen = ++journal.gen;
+
+	sd_info("journal at %s, %"PRIu64" MB", dir, size / 1024 / 1024);
+	return 0;
+}
@@ -11,9 +11,16 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+/* linux/fs.h has its own definition */
+#undef BLOCK_SIZE
+
 #include "sheep_priv.h"
 
 #define MD_VDISK_SIZE ((uint64_t)1*1024*1024*1024) /* 1G */
+#define MD_MOVE_RATE ((uint64_t)64*1024*1024) /* 64M per second */
 
 #define NONE_EXIST_PATH "/all/disks/are/broken/,ps/əʌo7/!"
 
@@ -67,6 +74,196 @@ static struct vdisk *oid_to_vdisk(uint64_t oid)
 	return hval_to_vdisk(sd_hash_oid(oid));
 }
 
+/*
+ * The disks of the cluster wide diskmode are the vnodes of the cluster, so we
+ * have to stick to the same vdisks as the nodes do in that case.
+ */
+static inline bool md_weighted_placement(void)
+{
+	return sys->md_weighted && !is_cluster_diskmode(&sys->cinfo);
+}
+
+/*
+ * Weighted rendezvous hashing: every disk scores the object with a hash of
+ * the pair scaled by the disk space, and the object goes to the highest
+ * score.  A lookup costs a hash per disk instead of a walk down the tree of
+ * the vdisks, and adding or removing a disk moves only the objects which the
+ * disk wins or loses.
+ */
+static struct disk *oid_to_disk(uint64_t oid, bool tiered, bool fast)
+{
+	uint64_t hval = sd_hash_oid(oid);
+	struct disk *disk, *best = NULL;
+	double score, best_score = 0;
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		uint64_t h;
+		double u;
+
+		if (tiered && disk->fast != fast)
+			continue;
+
+		h = sd_hash_next(fnv_64a_64(hval, disk->hash));
+		/* uniform in (0, 1) */
+		u = ((h >> 11) + 0.5) / (double)(1ULL << 53);
+		score = (double)disk->space / -log(u);
+		if (!best || score > best_score) {
+			best = disk;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Tiers of the disks.  With '-m tier', the data objects live on the
+ * rotational disks until they get hot, and the non-rotational ones hold the
+ * hot objects, the inodes and the btree indexes.  The objects are placed by
+ * oid_to_disk() within their tier, and the hot set decides the tier of a data
+ * object.
+ *
+ * The accesses are counted in a direct-mapped table, where a colliding object
+ * wears the count of the resident one out before taking the slot, so that the
+ * table keeps the objects hit most often.
+ */
+#define MD_HEAT_BITS		16
+#define MD_HEAT_NR_LOCKS	256
+#define MD_HOT_BITS		12
+
+struct md_heat {
+	uint64_t oid;
+	uint32_t hits;
+};
+
+static struct md_heat heat_table[1 << MD_HEAT_BITS];
+static struct sd_mutex heat_locks[MD_HEAT_NR_LOCKS] = {
+	[0 ... MD_HEAT_NR_LOCKS - 1] = SD_MUTEX_INITIALIZER,
+};
+
+struct hot_obj {
+	struct hlist_node hash;
+	uint64_t oid;
+};
+
+static struct hot_set {
+	struct sd_rw_lock lock;
+	struct hlist_head hash[1 << MD_HOT_BITS];
+	uint32_t nr;
+} hot_set = {
+	.lock = SD_RW_LOCK_INITIALIZER,
+};
+
+/* Must be called with md.lock held */
+static inline bool md_tiered(void)
+{
+	return sys->md_tier && !is_cluster_diskmode(&sys->cinfo) &&
+		md.nr_fast && md.nr_fast < md.nr_disks;
+}
+
+static inline bool oid_pinned(uint64_t oid)
+{
+	return is_vdi_obj(oid) || is_vdi_btree_obj(oid);
+}
+
+static inline uint32_t heat_slot(uint64_t oid)
+{
+	return sd_hash_oid(oid) >> (64 - MD_HEAT_BITS);
+}
+
+static void heat_hit(uint64_t oid)
+{
+	uint32_t slot = heat_slot(oid);
+	struct md_heat *h = heat_table + slot;
+	struct sd_mutex *lock = heat_locks + slot % MD_HEAT_NR_LOCKS;
+
+	sd_mutex_lock(lock);
+	if (h->oid == oid)
+		h->hits++;
+	else if (h->hits > 1)
+		h->hits--;
+	else {
+		h->oid = oid;
+		h->hits = 1;
+	}
+	sd_mutex_unlock(lock);
+}
+
+static uint32_t heat_hits(uint64_t oid)
+{
+	uint32_t slot = heat_slot(oid), hits = 0;
+	struct sd_mutex *lock = heat_locks + slot % MD_HEAT_NR_LOCKS;
+
+	sd_mutex_lock(lock);
+	if (heat_table[slot].oid == oid)
+		hits = heat_table[slot].hits;
+	sd_mutex_unlock(lock);
+
+	return hits;
+}
+
+static inline struct hlist_head *hot_head(uint64_t oid)
+{
+	return hot_set.hash + hash_64(oid, MD_HOT_BITS);
+}
+
+/* Must be called with hot_set.lock held */
+static struct hot_obj *hot_lookup(uint64_t oid)
+{
+	struct hot_obj *h;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(h, node, hot_head(oid), hash) {
+		if (h->oid == oid)
+			return h;
+	}
+	return NULL;
+}
+
+static bool oid_is_hot(uint64_t oid)
+{
+	bool hot;
+
+	sd_read_lock(&hot_set.lock);
+	hot = hot_lookup(oid) != NULL;
+	sd_rw_unlock(&hot_set.lock);
+
+	return hot;
+}
+
+static void hot_insert(uint64_t oid)
+{
+	struct hot_obj *h;
+
+	sd_write_lock(&hot_set.lock);
+	if (!hot_lookup(oid)) {
+		h = xmalloc(sizeof(*h));
+		h->oid = oid;
+		hlist_add_head(&h->hash, hot_head(oid));
+		hot_set.nr++;
+	}
+	sd_rw_unlock(&hot_set.lock);
+}
+
+static void hot_remove(uint64_t oid)
+{
+	struct hot_obj *h;
+
+	sd_write_lock(&hot_set.lock);
+	h = hot_lookup(oid);
+	if (h) {
+		hlist_del(&h->hash);
+		free(h);
+		hot_set.nr--;
+	}
+	sd_rw_unlock(&hot_set.lock);
+}
+
+static inline bool oid_on_fast_tier(uint64_t oid)
+{
+	return oid_pinned(oid) || oid_is_hot(oid);
+}
+
 static void create_vdisks(const struct disk *disk)
 {
 	uint64_t hval = sd_hash(disk->path, strlen(disk->path));
@@ -142,15 +339,23 @@ static struct disk *path_to_disk(const char *path)
 	return rb_search(&md.root, &key, rb, disk_cmp);
 }
 
+/* The size of oid, of a data object the one its vdi was created with */
+size_t get_vdi_objsize(uint64_t oid)
+{
+	if (is_data_obj(oid))
+		return UINT64_C(1) << get_vdi_block_size_shift(oid_to_vid(oid));
+	return get_objsize(oid);
+}
+
 size_t get_store_objsize(uint64_t oid)
 {
 	if (is_erasure_oid(oid)) {
 		uint8_t policy = get_vdi_copy_policy(oid_to_vid(oid));
 		int d;
 		ec_policy_to_dp(policy, &d, NULL);
-		return SD_DATA_OBJ_SIZE / d;
+		return get_vdi_objsize(oid) / d;
 	}
-	return get_objsize(oid);
+	return get_vdi_objsize(oid);
 }
 
 static int get_total_object_size(uint64_t oid, const char *wd, uint32_t epoch,
@@ -185,12 +390,10 @@ static int64_t find_string_integer(const char *str, const char *delimiter)
 }
 
 /* If cleanup is true, temporary objects will be removed */
-static int for_each_object_in_path(const char *path,
-				   int (*func)(uint64_t, const char *, uint32_t,
-					       uint8_t, struct vnode_info *,
-					       void *),
-				   bool cleanup, struct vnode_info *vinfo,
-				   void *arg)
+int for_each_object_in_path(const char *path,
+			    int (*func)(uint64_t, const char *, uint32_t,
+					uint8_t, struct vnode_info *, void *),
+			    bool cleanup, struct vnode_info *vinfo, void *arg)
 {
 	DIR *dir;
 	struct dirent *d;
@@ -332,6 +535,240 @@ static uint64_t init_path_fsid(const char *path)
 	return fs.f_fsid;
 }
 
+/* Non-rotational disks make the fast tier */
+static bool init_path_fast(const char *path)
+{
+	char sysfs[PATH_MAX];
+	struct stat st;
+	FILE *fp;
+	int c;
+
+	if (stat(path, &st) < 0)
+		return false;
+
+	snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/queue/rotational",
+		 major(st.st_dev), minor(st.st_dev));
+	if (access(sysfs, R_OK) < 0)
+		/* a partition */
+		snprintf(sysfs, sizeof(sysfs),
+			 "/sys/dev/block/%u:%u/../queue/rotational",
+			 major(st.st_dev), minor(st.st_dev));
+
+	fp = fopen(sysfs, "r");
+	if (!fp)
+		return false;
+	c = fgetc(fp);
+	fclose(fp);
+
+	return c == '0';
+}
+
+/* Whether the file system of the disk clones a file, e.g. XFS and btrfs */
+static bool init_path_reflink(const char *path)
+{
+	char src[PATH_MAX], dst[PATH_MAX], buf[512] = {};
+	int sfd, dfd = -1;
+	bool ret = false;
+
+	snprintf(src, sizeof(src), "%s/.reflink", path);
+	snprintf(dst, sizeof(dst), "%s/.reflink.clone", path);
+	sfd = open(src, O_RDWR | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (sfd < 0)
+		goto out;
+	dfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (dfd < 0)
+		goto out;
+	if (xwrite(sfd, buf, sizeof(buf)) == sizeof(buf))
+		ret = ioctl(dfd, FICLONE, sfd) == 0;
+out:
+	if (dfd >= 0) {
+		close(dfd);
+		unlink(dst);
+	}
+	if (sfd >= 0) {
+		close(sfd);
+		unlink(src);
+	}
+	return ret;
+}
+
+/* Bytes of the stale objects left on the disk */
+static uint64_t init_path_stale(const char *path)
+{
+	char p[PATH_MAX];
+	uint64_t bytes = 0;
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	snprintf(p, sizeof(p), "%s/.stale", path);
+	dir = opendir(p);
+	if (!dir)
+		return 0;
+	while ((d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), d->d_name, &st, 0) == 0)
+			bytes += st.st_blocks * SECTOR_SIZE;
+	}
+	closedir(dir);
+
+	return bytes;
+}
+
+/*
+ * Object location index
+ *
+ * Where the objects out of their place are, so that md_exist() doesn't have
+ * to probe every disk for them.  The load of the objects records the ones
+ * which the placement puts on other disks and the manifest log keeps the
+ * entries up to date as the objects are created, moved and removed.  A lookup
+ * which finds an object nowhere leaves a negative entry until the object is
+ * created.
+ *
+ * The disks of the entries are valid under md.lock, and a change of the disks
+ * purges the whole index.  Beyond LOC_INDEX_SIZE entries the least recently
+ * used ones are evicted, which only costs the probe of the disks again.
+ */
+#define LOC_INDEX_SIZE		(1 << 20)
+#define LOC_HASH_BITS		16
+#define LOC_HASH_SIZE		(1 << LOC_HASH_BITS)
+
+struct md_loc {
+	struct hlist_node hash;
+	struct list_node lru;
+	uint64_t oid;
+	uint8_t ec_index;
+	const struct disk *disk; /* NULL if the object is nowhere */
+};
+
+static struct loc_index {
+	struct sd_mutex lock;
+	struct hlist_head hash[LOC_HASH_SIZE];
+	struct list_head lru;
+	uint32_t nr;
+	/* bumped on every update to catch the racy negative lookup */
+	uint64_t gen;
+} loc_index = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.lru = LIST_HEAD_INIT(loc_index.lru),
+};
+
+static inline uint8_t loc_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : 0;
+}
+
+/* Must be called with loc_index.lock held */
+static struct md_loc *loc_find(uint64_t oid, uint8_t ec_index)
+{
+	struct md_loc *loc;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(loc, node,
+			     loc_index.hash + hash_64(oid, LOC_HASH_BITS),
+			     hash) {
+		if (loc->oid == oid && loc->ec_index == ec_index)
+			return loc;
+	}
+
+	return NULL;
+}
+
+/* Must be called with loc_index.lock held */
+static void loc_unhash(struct md_loc *loc)
+{
+	hlist_del(&loc->hash);
+	list_del(&loc->lru);
+	loc_index.nr--;
+	free(loc);
+}
+
+/* Must be called with loc_index.lock held */
+static void loc_set_nolock(uint64_t oid, uint8_t ec_index,
+			   const struct disk *disk)
+{
+	struct md_loc *loc = loc_find(oid, ec_index);
+
+	if (loc) {
+		loc->disk = disk;
+		list_move(&loc->lru, &loc_index.lru);
+		return;
+	}
+
+	loc = xzalloc(sizeof(*loc));
+	INIT_HLIST_NODE(&loc->hash);
+	INIT_LIST_NODE(&loc->lru);
+	loc->oid = oid;
+	loc->ec_index = ec_index;
+	loc->disk = disk;
+	hlist_add_head(&loc->hash,
+		       loc_index.hash + hash_64(oid, LOC_HASH_BITS));
+	list_add(&loc->lru, &loc_index.lru);
+	loc_index.nr++;
+
+	while (loc_index.nr > LOC_INDEX_SIZE)
+		loc_unhash(list_entry(loc_index.lru.n.prev, struct md_loc,
+				      lru));
+}
+
+/* Record that the object is on 'disk', or forget it if 'disk' is NULL */
+static void loc_update(uint64_t oid, uint8_t ec_index, const struct disk *disk)
+{
+	struct md_loc *loc;
+
+	ec_index = loc_ec_index(oid, ec_index);
+	sd_mutex_lock(&loc_index.lock);
+	loc_index.gen++;
+	if (disk)
+		loc_set_nolock(oid, ec_index, disk);
+	else if ((loc = loc_find(oid, ec_index)))
+		loc_unhash(loc);
+	sd_mutex_unlock(&loc_index.lock);
+}
+
+/*
+ * Look up where the object is.  Return false if it isn't indexed, else set
+ * 'disk' to its disk or NULL if it is nowhere.  'gen' is for loc_none().
+ */
+static bool loc_lookup(uint64_t oid, uint8_t ec_index,
+		       const struct disk **disk, uint64_t *gen)
+{
+	struct md_loc *loc;
+
+	sd_mutex_lock(&loc_index.lock);
+	*gen = loc_index.gen;
+	loc = loc_find(oid, loc_ec_index(oid, ec_index));
+	if (loc) {
+		*disk = loc->disk;
+		list_move(&loc->lru, &loc_index.lru);
+	}
+	sd_mutex_unlock(&loc_index.lock);
+
+	return loc != NULL;
+}
+
+/* Record that the object is nowhere, unless the index changed since 'gen' */
+static void loc_none(uint64_t oid, uint8_t ec_index, uint64_t gen)
+{
+	sd_mutex_lock(&loc_index.lock);
+	if (gen == loc_index.gen)
+		loc_set_nolock(oid, loc_ec_index(oid, ec_index), NULL);
+	sd_mutex_unlock(&loc_index.lock);
+}
+
+static void loc_purge(void)
+{
+	struct md_loc *loc;
+
+	sd_mutex_lock(&loc_index.lock);
+	loc_index.gen++;
+	list_for_each_entry(loc, &loc_index.lru, lru) {
+		loc_unhash(loc);
+	}
+	sd_mutex_unlock(&loc_index.lock);
+}
+
 /* We don't need lock at init stage */
 bool md_add_disk(const char *path, bool purge)
 {
@@ -347,7 +784,9 @@ bool md_add_disk(const char *path, bool purge)
 		return false;
 	}
 
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
+	new->manifest_fd = -1;
+	uatomic_set_false(&new->manifest_failed);
 	pstrcpy(new->path, PATH_MAX, path);
 	trim_last_slash(new->path);
 	new->space = init_path_space(new->path, purge);
@@ -362,13 +801,31 @@ bool md_add_disk(const char *path, bool purge)
 		return false;
 	}
 
+	new->sync_fd = open(new->path, O_RDONLY | O_DIRECTORY);
+	if (new->sync_fd < 0) {
+		sd_err("failed to open %s, %m", new->path);
+		free(new);
+		return false;
+	}
+	sd_init_mutex(&new->sync_lock);
+
+	new->hash = sd_hash(new->path, strlen(new->path));
+	new->fast = init_path_fast(new->path);
+	new->reflink = init_path_reflink(new->path);
+	new->stale = init_path_stale(new->path);
 	create_vdisks(new);
 	rb_insert(&md.root, new, rb, disk_cmp);
 	md.space += new->space;
 	md.nr_disks++;
-
-	sd_info("%s, vdisk nr %d, total disk %d", new->path, vdisk_number(new),
-		md.nr_disks);
+	if (new->fast)
+		md.nr_fast++;
+	md.gen++;
+	loc_purge();
+
+	sd_info("%s, vdisk nr %d, total disk %d%s%s", new->path,
+		vdisk_number(new), md.nr_disks,
+		new->fast ? ", non-rotational" : "",
+		new->reflink ? ", reflink" : "");
 	return true;
 }
 
@@ -377,8 +834,17 @@ static inline void md_remove_disk(struct disk *disk)
 	sd_info("%s from multi-disk array", disk->path);
 	rb_erase(&disk->rb, &md.root);
 	md.nr_disks--;
+	if (disk->fast)
+		md.nr_fast--;
+	md.gen++;
+	loc_purge();
 	remove_vdisks(disk);
+	if (disk->manifest_fd >= 0)
+		close(disk->manifest_fd);
+	close(disk->sync_fd);
+	sd_destroy_mutex(&disk->sync_lock);
 	free(disk);
+	md_purge_fd_cache();
 }
 
 uint64_t md_init_space(void)
@@ -393,89 +859,702 @@ static const char *md_get_object_dir_nolock(uint64_t oid)
 	if (unlikely(md.nr_disks == 0))
 		return NONE_EXIST_PATH; /* To generate EIO */
 
+	if (md_tiered())
+		return oid_to_disk(oid, true, oid_on_fast_tier(oid))->path;
+
+	if (md_weighted_placement())
+		return oid_to_disk(oid, false, false)->path;
+
 	vd = oid_to_vdisk(oid);
 	return vd->disk->path;
 }
 
+/* Whether the disk of oid clones the files, see init_path_reflink() */
+bool md_reflink_supported(uint64_t oid)
+{
+	const struct disk *disk;
+	bool ret;
+
+	sd_read_lock(&md.lock);
+	disk = path_to_disk(md_get_object_dir_nolock(oid));
+	ret = disk && disk->reflink;
+	sd_rw_unlock(&md.lock);
+
+	return ret;
+}
+
+/*
+ * Make the write to the object file fd at the path durable.  With '-m
+ * groupsync' the objects are written without O_DSYNC, and a write syncs the
+ * file system of its disk unless a sync started since it was written covers
+ * it, so the writes done while a sync runs share the next one.  Return 0 or
+ * -1 with errno set, as fdatasync() does.
+ */
+int md_sync_disk(const char *path, int fd)
+{
+	char dir[PATH_MAX], *p;
+	struct disk *disk;
+	uint64_t ticket, written;
+	int ret = 0;
+
+	pstrcpy(dir, sizeof(dir), path);
+	p = strrchr(dir, '/');
+	if (p)
+		*p = '\0';
+
+	sd_read_lock(&md.lock);
+	disk = path_to_disk(dir);
+	if (!disk) {
+		/* unplugged meanwhile */
+		sd_rw_unlock(&md.lock);
+		return fdatasync(fd);
+	}
+
+	ticket = uatomic_add_return(&disk->nr_written, 1);
+	sd_mutex_lock(&disk->sync_lock);
+	if (disk->nr_synced < ticket) {
+		written = uatomic_read(&disk->nr_written);
+		ret = syncfs(disk->sync_fd);
+		if (ret == 0)
+			disk->nr_synced = written;
+	}
+	sd_mutex_unlock(&disk->sync_lock);
+	sd_rw_unlock(&md.lock);
+
+	return ret;
+}
+
 const char *md_get_object_dir(uint64_t oid)
 {
 	const char *p;
 
 	sd_read_lock(&md.lock);
 	p = md_get_object_dir_nolock(oid);
+	if (md_tiered() && !oid_pinned(oid))
+		heat_hit(oid);
 	sd_rw_unlock(&md.lock);
 
 	return p;
 }
 
-struct process_path_arg {
-	const char *path;
-	struct vnode_info *vinfo;
-	int (*func)(uint64_t oid, const char *, uint32_t, uint8_t,
-		    struct vnode_info *, void *arg);
-	bool cleanup;
-	void *opaque;
-	int result;
+/*
+ * Cache of open fds for the objects in the working directory.
+ *
+ * Looking up the object path, checking its existence and open()/close() cost
+ * more than the I/O itself for small requests, so we keep the recently used
+ * fds around.  Hashed entries hold one reference for the cache and users grab
+ * another one, so that an fd is closed only after the last user puts it even
+ * if the entry is evicted or invalidated in the middle of I/O.
+ *
+ * Whoever renames or unlinks an object file must call md_invalidate_fd(), and
+ * changes of the disk layout drop the whole cache.  Both drop the blocks of the
+ * read cache as well, see rcache.c.
+ */
+#define FD_CACHE_SIZE		4096
+#define FD_HASH_BITS		10
+#define FD_HASH_SIZE		(1 << FD_HASH_BITS)
+
+static struct fd_cache {
+	struct sd_mutex lock;
+	struct hlist_head hash[FD_HASH_SIZE];
+	struct list_head lru;
+	uint32_t nr;
+	/* bumped on every invalidation to catch the racy cache miss */
+	uint64_t gen;
+} fd_cache = {
+	.lock = SD_MUTEX_INITIALIZER,
+	.lru = LIST_HEAD_INIT(fd_cache.lru),
 };
 
-static void *thread_process_path(void *arg)
+static inline struct hlist_head *fd_hash_head(uint64_t oid)
 {
-	int ret;
-	struct process_path_arg *parg = (struct process_path_arg *)arg;
+	return fd_cache.hash + hash_64(oid, FD_HASH_BITS);
+}
 
-	ret = for_each_object_in_path(parg->path, parg->func, parg->cleanup,
-				      parg->vinfo, parg->opaque);
-	if (ret != SD_RES_SUCCESS)
-		parg->result = ret;
+static void fd_release(struct md_fd *mfd)
+{
+	if (refcount_dec(&mfd->refcnt) > 0)
+		return;
 
-	return arg;
+	close(mfd->fd);
+	free(mfd);
 }
 
-main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
-				      uint32_t epoch, uint8_t ec_index,
-				      struct vnode_info *vinfo, void *arg),
-				  bool cleanup, void *arg)
+/* Must be called with fd_cache.lock held */
+static void fd_unhash(struct md_fd *mfd)
 {
-	int ret = SD_RES_SUCCESS;
-	const struct disk *disk;
-	struct process_path_arg *thread_args, *path_arg;
-	struct vnode_info *vinfo;
-	void *ret_arg;
-	sd_thread_t *thread_array;
-	int nr_thread = 0, idx = 0;
+	hlist_del(&mfd->hash);
+	list_del(&mfd->lru);
+	fd_cache.nr--;
+	sys->stat.fd.nr = fd_cache.nr;
+	fd_release(mfd);
+}
 
-	sd_read_lock(&md.lock);
+static struct md_fd *fd_lookup(uint64_t oid, uint8_t ec_index, int flags)
+{
+	struct md_fd *mfd;
+	struct hlist_node *node;
 
-	rb_for_each_entry(disk, &md.root, rb) {
-		nr_thread++;
+	hlist_for_each_entry(mfd, node, fd_hash_head(oid), hash) {
+		if (mfd->oid == oid && mfd->ec_index == ec_index &&
+		    mfd->flags == flags)
+			return mfd;
 	}
 
-	thread_args = xmalloc(nr_thread * sizeof(struct process_path_arg));
-	thread_array = xmalloc(nr_thread * sizeof(sd_thread_t));
+	return NULL;
+}
 
-	vinfo = get_vnode_info();
+static void fd_insert(struct md_fd *mfd)
+{
+	struct md_fd *victim;
 
-	rb_for_each_entry(disk, &md.root, rb) {
-		thread_args[idx].path = disk->path;
-		thread_args[idx].vinfo = vinfo;
-		thread_args[idx].func = func;
-		thread_args[idx].cleanup = cleanup;
-		thread_args[idx].opaque = arg;
-		thread_args[idx].result = SD_RES_SUCCESS;
-		ret = sd_thread_create_with_idx("foreach wd",
-						thread_array + idx,
-						thread_process_path,
-						(void *)(thread_args + idx));
-		if (ret) {
-			/*
-			 * If we can't create enough threads to process
-			 * files, the data-consistent will be broken if
-			 * we continued.
-			 */
-			panic("Failed to create thread for path %s",
-			      disk->path);
-		}
-		idx++;
+	hlist_add_head(&mfd->hash, fd_hash_head(mfd->oid));
+	list_add(&mfd->lru, &fd_cache.lru);
+	refcount_inc(&mfd->refcnt);
+	fd_cache.nr++;
+
+	while (fd_cache.nr > FD_CACHE_SIZE) {
+		victim = list_entry(fd_cache.lru.n.prev, struct md_fd, lru);
+		fd_unhash(victim);
+		sys->stat.fd.evict++;
+	}
+	sys->stat.fd.nr = fd_cache.nr;
+}
+
+/*
+ * Get an fd of the object file at 'path' in the working directory.  On a cache
+ * miss, this does the md_exist() job and opens the file, so the caller can
+ * pass errno to err_to_sderr() if NULL is returned.
+ *
+ * The returned fd must be released by md_put_fd().
+ */
+struct md_fd *md_get_fd(uint64_t oid, uint8_t ec_index, int flags, char *path)
+{
+	struct md_fd *mfd, *old;
+	uint64_t gen;
+	int fd;
+
+	sd_mutex_lock(&fd_cache.lock);
+	mfd = fd_lookup(oid, ec_index, flags);
+	if (mfd) {
+		refcount_inc(&mfd->refcnt);
+		list_move(&mfd->lru, &fd_cache.lru);
+		sys->stat.fd.hit++;
+		sd_mutex_unlock(&fd_cache.lock);
+		return mfd;
+	}
+	sys->stat.fd.miss++;
+	gen = fd_cache.gen;
+	sd_mutex_unlock(&fd_cache.lock);
+
+	if (!md_exist(oid, ec_index, path))
+		return NULL;
+
+	fd = open(path, flags, sd_def_fmode);
+	if (unlikely(fd < 0))
+		return NULL;
+
+	mfd = xzalloc(sizeof(*mfd));
+	INIT_HLIST_NODE(&mfd->hash);
+	INIT_LIST_NODE(&mfd->lru);
+	mfd->oid = oid;
+	mfd->ec_index = ec_index;
+	mfd->flags = flags;
+	mfd->fd = fd;
+	mfd->compressed = compress_is_file(oid, fd);
+	refcount_set(&mfd->refcnt, 1);
+
+	sd_mutex_lock(&fd_cache.lock);
+	/*
+	 * If the object was invalidated while we were opening it, the fd might
+	 * point to a stale file.  Hand it out uncached for this I/O only.
+	 */
+	if (gen != fd_cache.gen)
+		goto out;
+
+	old = fd_lookup(oid, ec_index, flags);
+	if (old) {
+		/* Someone else has cached the same file, use it */
+		refcount_inc(&old->refcnt);
+		sd_mutex_unlock(&fd_cache.lock);
+		fd_release(mfd);
+		return old;
+	}
+	fd_insert(mfd);
+out:
+	sd_mutex_unlock(&fd_cache.lock);
+	return mfd;
+}
+
+/*
+ * Get a cached fd without touching the disk, for the callers which must not
+ * sleep.  Return NULL on a cache miss.
+ */
+struct md_fd *md_lookup_fd(uint64_t oid, uint8_t ec_index, int flags)
+{
+	struct md_fd *mfd;
+
+	sd_mutex_lock(&fd_cache.lock);
+	mfd = fd_lookup(oid, ec_index, flags);
+	if (mfd) {
+		refcount_inc(&mfd->refcnt);
+		list_move(&mfd->lru, &fd_cache.lru);
+		sys->stat.fd.hit++;
+	}
+	sd_mutex_unlock(&fd_cache.lock);
+
+	return mfd;
+}
+
+void md_put_fd(struct md_fd *mfd)
+{
+	fd_release(mfd);
+}
+
+/* Drop all the cached fds of the object, regardless of the ec index */
+void md_invalidate_fd(uint64_t oid)
+{
+	struct md_fd *mfd;
+	struct hlist_node *node;
+
+	sd_mutex_lock(&fd_cache.lock);
+	fd_cache.gen++;
+	hlist_for_each_entry(mfd, node, fd_hash_head(oid), hash) {
+		if (mfd->oid == oid)
+			fd_unhash(mfd);
+	}
+	sd_mutex_unlock(&fd_cache.lock);
+	rcache_invalidate(oid);
+}
+
+void md_purge_fd_cache(void)
+{
+	struct md_fd *mfd;
+
+	sd_mutex_lock(&fd_cache.lock);
+	fd_cache.gen++;
+	list_for_each_entry(mfd, &fd_cache.lru, lru) {
+		fd_unhash(mfd);
+	}
+	sd_mutex_unlock(&fd_cache.lock);
+	rcache_purge();
+}
+
+/*
+ * Object manifest
+ *
+ * Every disk logs the objects created on it and removed from it to
+ * $disk/.manifest, so that the next start can rebuild the object list from
+ * the log instead of reading the whole directory.  The header is marked clean
+ * only at graceful shutdown after the log is synced.  Any other state makes the
+ * start fall back to the directory scan, which rewrites the manifest from
+ * scratch.  Stale objects are not logged, the .stale directories are scanned
+ * as before.
+ */
+#define MANIFEST_NAME	".manifest"
+#define MANIFEST_MAGIC	0x6d6e6673
+
+struct manifest_header {
+	uint32_t magic;
+	uint32_t clean;
+};
+
+enum manifest_op {
+	MANIFEST_ADD = 1,
+	MANIFEST_DEL,
+};
+
+struct manifest_rec {
+	uint64_t oid;
+	uint32_t seq; /* position in the log, only used for loading */
+	uint8_t ec_index;
+	uint8_t op;
+	uint16_t reserved;
+};
+
+static int manifest_rec_cmp(const struct manifest_rec *a,
+			    const struct manifest_rec *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret)
+		return ret;
+	ret = intcmp(a->ec_index, b->ec_index);
+	if (ret)
+		return ret;
+	return intcmp(a->seq, b->seq);
+}
+
+/* Return the live objects in the manifest or NULL if it can't be trusted */
+static struct manifest_rec *read_manifest(const struct disk *disk, size_t *nr)
+{
+	char path[PATH_MAX + 16];
+	struct manifest_header *hdr;
+	struct manifest_rec *recs, *live = NULL;
+	struct stat st;
+	void *buf = NULL;
+	size_t n, i, j;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" MANIFEST_NAME, disk->path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", path);
+		goto out;
+	}
+	if (st.st_size < sizeof(*hdr) ||
+	    (st.st_size - sizeof(*hdr)) % sizeof(*recs))
+		goto unclean;
+
+	buf = xmalloc(st.st_size);
+	if (xread(fd, buf, st.st_size) != st.st_size) {
+		sd_err("failed to read %s, %m", path);
+		goto out;
+	}
+
+	hdr = buf;
+	if (hdr->magic != MANIFEST_MAGIC || !hdr->clean)
+		goto unclean;
+
+	recs = (struct manifest_rec *)(hdr + 1);
+	n = (st.st_size - sizeof(*hdr)) / sizeof(*recs);
+	for (i = 0; i < n; i++)
+		recs[i].seq = i;
+	xqsort(recs, n, manifest_rec_cmp);
+
+	live = xmalloc(sizeof(*live) * (n + 1));
+	for (i = 0, j = 0; i < n; i++) {
+		/* Only the last record of the object counts */
+		if (i + 1 < n && recs[i + 1].oid == recs[i].oid &&
+		    recs[i + 1].ec_index == recs[i].ec_index)
+			continue;
+		if (recs[i].op == MANIFEST_ADD)
+			live[j++] = recs[i];
+	}
+	*nr = j;
+	goto out;
+unclean:
+	sd_info("%s is not shut down cleanly, scan the objects", disk->path);
+out:
+	free(buf);
+	close(fd);
+	return live;
+}
+
+/*
+ * Replace the manifest with the given objects and open it for logging.  The
+ * new manifest is unclean until md_close_manifests() is called.
+ */
+static int write_manifest(struct disk *disk, const struct manifest_rec *recs,
+			  size_t nr)
+{
+	char path[PATH_MAX + 16], tmp_path[PATH_MAX + 16];
+	struct manifest_header hdr = { .magic = MANIFEST_MAGIC };
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/" MANIFEST_NAME, disk->path);
+	snprintf(tmp_path, sizeof(tmp_path), "%s/" MANIFEST_NAME ".tmp",
+		 disk->path);
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", tmp_path);
+		goto out;
+	}
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    xwrite(fd, recs, sizeof(*recs) * nr) != sizeof(*recs) * nr) {
+		sd_err("failed to write %s, %m", tmp_path);
+		close(fd);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s, %m", tmp_path);
+		goto out;
+	}
+
+	/* The old clean manifest must not come back after a crash */
+	fd = open(disk->path, O_RDONLY);
+	if (fd < 0 || fsync(fd) < 0) {
+		sd_err("failed to sync %s, %m", disk->path);
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	close(fd);
+
+	disk->manifest_fd = open(path, O_WRONLY | O_APPEND);
+	if (disk->manifest_fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		goto out;
+	}
+	uatomic_set_false(&disk->manifest_failed);
+	ret = 0;
+out:
+	if (ret < 0) {
+		unlink(tmp_path);
+		unlink(path);
+	}
+	return ret;
+}
+
+/* Must be called with md.lock held */
+static void manifest_log(const char *path, uint64_t oid, uint8_t ec_index,
+			 bool add)
+{
+	struct manifest_rec rec = {
+		.oid = oid,
+		.ec_index = is_erasure_oid(oid) ? ec_index : SD_MAX_COPIES,
+		.op = add ? MANIFEST_ADD : MANIFEST_DEL,
+	};
+	char dir[PATH_MAX], *p;
+	struct disk *disk;
+
+	pstrcpy(dir, sizeof(dir), path);
+	p = strrchr(dir, '/');
+	if (unlikely(!p))
+		return;
+	*p = '\0';
+
+	disk = path_to_disk(dir);
+	if (!disk)
+		return;
+
+	if (add && strcmp(md_get_object_dir_nolock(oid), disk->path))
+		loc_update(oid, ec_index, disk);
+	else
+		loc_update(oid, ec_index, NULL);
+
+	if (disk->manifest_fd < 0)
+		return;
+
+	if (xwrite(disk->manifest_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		sd_err("failed to log %"PRIx64" to the manifest of %s, %m",
+		       oid, disk->path);
+		/* The next start has to scan the disk */
+		uatomic_set_true(&disk->manifest_failed);
+	}
+}
+
+/*
+ * Record that the object file at 'path' has been created or removed.  Only
+ * the objects in the working directories are tracked.
+ */
+void md_manifest_log(const char *path, uint64_t oid, uint8_t ec_index,
+		     bool add)
+{
+	sd_read_lock(&md.lock);
+	manifest_log(path, oid, ec_index, add);
+	sd_rw_unlock(&md.lock);
+}
+
+/* Start the manifests over after all the objects are purged */
+void md_reset_manifests(void)
+{
+	struct disk *disk;
+
+	sd_write_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->manifest_fd < 0)
+			continue;
+		close(disk->manifest_fd);
+		disk->manifest_fd = -1;
+		write_manifest(disk, NULL, 0);
+	}
+	loc_purge();
+	sd_rw_unlock(&md.lock);
+}
+
+/* Mark the manifests clean at graceful shutdown */
+main_fn void md_close_manifests(void)
+{
+	struct manifest_header hdr = { .magic = MANIFEST_MAGIC, .clean = 1 };
+	char path[PATH_MAX + 16];
+	struct disk *disk;
+	int fd;
+
+	sd_write_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->manifest_fd < 0)
+			continue;
+		if (uatomic_is_true(&disk->manifest_failed) ||
+		    fdatasync(disk->manifest_fd) < 0)
+			goto next;
+
+		snprintf(path, sizeof(path), "%s/" MANIFEST_NAME, disk->path);
+		fd = open(path, O_WRONLY);
+		if (fd < 0) {
+			sd_err("failed to open %s, %m", path);
+			goto next;
+		}
+		if (xpwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+		    fdatasync(fd) < 0)
+			sd_err("failed to mark %s clean, %m", path);
+		close(fd);
+next:
+		close(disk->manifest_fd);
+		disk->manifest_fd = -1;
+	}
+	sd_rw_unlock(&md.lock);
+}
+
+struct manifest_scan {
+	int (*func)(uint64_t oid, const char *, uint32_t, uint8_t,
+		    struct vnode_info *, void *arg);
+	void *arg;
+	struct manifest_rec *recs;
+	size_t nr, size;
+};
+
+/* Collect the objects found by the directory scan to rebuild the manifest */
+static int manifest_scan_object(uint64_t oid, const char *path, uint32_t epoch,
+				uint8_t ec_index, struct vnode_info *vinfo,
+				void *arg)
+{
+	struct manifest_scan *scan = arg;
+
+	if (scan->nr == scan->size) {
+		scan->size = max(scan->size * 2, (size_t)1024);
+		scan->recs = xrealloc(scan->recs,
+				      sizeof(*scan->recs) * scan->size);
+	}
+	scan->recs[scan->nr++] = (struct manifest_rec) {
+		.oid = oid,
+		.ec_index = ec_index,
+		.op = MANIFEST_ADD,
+	};
+
+	return scan->func(oid, path, epoch, ec_index, vinfo, scan->arg);
+}
+
+struct process_path_arg {
+	struct disk *disk;
+	const char *path;
+	struct vnode_info *vinfo;
+	int (*func)(uint64_t oid, const char *, uint32_t, uint8_t,
+		    struct vnode_info *, void *arg);
+	bool cleanup;
+	void *opaque;
+	int result;
+};
+
+static void *thread_process_path(void *arg)
+{
+	int ret;
+	struct process_path_arg *parg = (struct process_path_arg *)arg;
+
+	ret = for_each_object_in_path(parg->path, parg->func, parg->cleanup,
+				      parg->vinfo, parg->opaque);
+	if (ret != SD_RES_SUCCESS)
+		parg->result = ret;
+
+	return arg;
+}
+
+static void *thread_load_path(void *arg)
+{
+	struct process_path_arg *parg = (struct process_path_arg *)arg;
+	struct disk *disk = parg->disk;
+	struct manifest_scan scan = {
+		.func = parg->func,
+		.arg = parg->opaque,
+	};
+	int ret = SD_RES_SUCCESS;
+
+	scan.recs = read_manifest(disk, &scan.nr);
+	if (scan.recs) {
+		sd_info("%s, %zu objects in the manifest", disk->path,
+			scan.nr);
+		for (size_t i = 0; i < scan.nr; i++) {
+			ret = parg->func(scan.recs[i].oid, disk->path, 0,
+					 scan.recs[i].ec_index, parg->vinfo,
+					 parg->opaque);
+			if (ret != SD_RES_SUCCESS)
+				break;
+		}
+	} else
+		ret = for_each_object_in_path(disk->path, manifest_scan_object,
+					      parg->cleanup, parg->vinfo,
+					      &scan);
+
+	/* Index the objects which the placement puts on other disks */
+	if (ret == SD_RES_SUCCESS)
+		for (size_t i = 0; i < scan.nr; i++)
+			if (strcmp(md_get_object_dir_nolock(scan.recs[i].oid),
+				   disk->path))
+				loc_update(scan.recs[i].oid,
+					   scan.recs[i].ec_index, disk);
+
+	/* The data objects found on the fast tier are the hot ones */
+	if (ret == SD_RES_SUCCESS && sys->md_tier && disk->fast)
+		for (size_t i = 0; i < scan.nr; i++)
+			if (!oid_pinned(scan.recs[i].oid))
+				hot_insert(scan.recs[i].oid);
+
+	if (ret == SD_RES_SUCCESS)
+		write_manifest(disk, scan.recs, scan.nr);
+	else
+		parg->result = ret;
+	free(scan.recs);
+
+	return arg;
+}
+
+/* Run 'fn' against every disk, with a thread per disk */
+static int for_each_disk_in_thread(void *(*fn)(void *),
+				   int (*func)(uint64_t oid, const char *path,
+					       uint32_t epoch, uint8_t ec_index,
+					       struct vnode_info *vinfo,
+					       void *arg),
+				   bool cleanup, void *arg)
+{
+	int ret = SD_RES_SUCCESS;
+	struct disk *disk;
+	struct process_path_arg *thread_args, *path_arg;
+	struct vnode_info *vinfo;
+	void *ret_arg;
+	sd_thread_t *thread_array;
+	int nr_thread = 0, idx = 0;
+
+	sd_read_lock(&md.lock);
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		nr_thread++;
+	}
+
+	thread_args = xmalloc(nr_thread * sizeof(struct process_path_arg));
+	thread_array = xmalloc(nr_thread * sizeof(sd_thread_t));
+
+	vinfo = get_vnode_info();
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		thread_args[idx].disk = disk;
+		thread_args[idx].path = disk->path;
+		thread_args[idx].vinfo = vinfo;
+		thread_args[idx].func = func;
+		thread_args[idx].cleanup = cleanup;
+		thread_args[idx].opaque = arg;
+		thread_args[idx].result = SD_RES_SUCCESS;
+		ret = sd_thread_create_with_idx("foreach wd",
+						thread_array + idx, fn,
+						(void *)(thread_args + idx));
+		if (ret) {
+			/*
+			 * If we can't create enough threads to process
+			 * files, the data-consistent will be broken if
+			 * we continued.
+			 */
+			panic("Failed to create thread for path %s",
+			      disk->path);
+		}
+		idx++;
 	}
 
 	sd_debug("Create %d threads for all path", nr_thread);
@@ -500,6 +1579,27 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 	return ret;
 }
 
+main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
+				      uint32_t epoch, uint8_t ec_index,
+				      struct vnode_info *vinfo, void *arg),
+				  bool cleanup, void *arg)
+{
+	return for_each_disk_in_thread(thread_process_path, func, cleanup, arg);
+}
+
+/*
+ * Call 'func' against every object in the working directories, which are
+ * read from the manifests if sheep was shut down cleanly.  The manifests are
+ * rewritten and opened for logging.
+ */
+main_fn int md_load_objects(int (*func)(uint64_t oid, const char *path,
+					uint32_t epoch, uint8_t ec_index,
+					struct vnode_info *vinfo, void *arg),
+			    void *arg)
+{
+	return for_each_disk_in_thread(thread_load_path, func, true, arg);
+}
+
 int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 uint32_t epoch, uint8_t,
 					 struct vnode_info *, void *arg),
@@ -668,26 +1768,90 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return 0;
 }
 
-static int md_move_object(uint64_t oid, const char *old, const char *new)
+/*
+ * Copy the file of fd to new without passing the data through us: a clone
+ * sharing the extents on the same file system, or copy_file_range() that the
+ * kernel may offload.  1 if neither works and the caller copies it, -1 with
+ * errno on an error.
+ */
+static int md_clone_file(int fd, size_t sz, const char *new)
 {
-	struct strbuf buf = STRBUF_INIT;
-	int fd, ret = -1;
-	size_t sz = get_store_objsize(oid);
+	char tmp_path[PATH_MAX];
+	int tfd, ret = -1, err;
 
-	fd = open(old, O_RDONLY);
-	if (fd < 0) {
-		sd_err("failed to open %s", old);
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", new);
+	/* see atomic_create_and_write() */
+	tfd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, sd_def_fmode);
+	if (tfd < 0)
+		return -1;
+
+	if (ioctl(tfd, FICLONE, fd) < 0) {
+#ifdef HAVE_COPY_FILE_RANGE
+		loff_t off = 0;
+		ssize_t n;
+
+		while (off < sz) {
+			n = copy_file_range(fd, &off, tfd, NULL, sz - off, 0);
+			if (n <= 0)
+				break;
+		}
+		if (off < sz) {
+			ret = 1;
+			goto out;
+		}
+#else
+		ret = 1;
 		goto out;
+#endif
 	}
 
-	ret = strbuf_read(&buf, fd, sz);
-	if (ret != sz) {
-		sd_err("failed to read %s, size %zu, %d, %m", old, sz, ret);
-		ret = -1;
-		goto out_close;
+	if (fsync(tfd) < 0 || rename(tmp_path, new) < 0) {
+		sd_err("failed to clone %s, %m", new);
+		goto out;
 	}
+	ret = 0;
+out:
+	err = errno;
+	close(tfd);
+	if (ret)
+		unlink(tmp_path);
+	errno = err;
+	return ret;
+}
 
-	if (atomic_create_and_write(new, buf.buf, buf.len, false) < 0) {
+static int md_copy_object(uint64_t oid, const char *old, const char *new)
+{
+	struct strbuf buf = STRBUF_INIT;
+	int fd, ret = -1;
+	struct stat st;
+	size_t sz;
+
+	fd = open(old, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s", old);
+		goto out;
+	}
+
+	/* the file of a compressed object is longer than the object */
+	if (fstat(fd, &st) < 0) {
+		sd_err("failed to stat %s, %m", old);
+		goto out_close;
+	}
+	sz = st.st_size;
+
+	ret = md_clone_file(fd, sz, new);
+	if (ret > 0) {
+		ret = strbuf_read(&buf, fd, sz);
+		if (ret != sz) {
+			sd_err("failed to read %s, size %zu, %d, %m", old, sz,
+			       ret);
+			ret = -1;
+			goto out_close;
+		}
+		ret = atomic_create_and_write(new, buf.buf, buf.len, false);
+	}
+
+	if (ret < 0) {
 		if (errno != EEXIST) {
 			sd_err("failed to create %s", new);
 			ret = -1;
@@ -701,7 +1865,6 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 			}
 		}
 	}
-	unlink(old);
 	ret = 0;
 out_close:
 	close(fd);
@@ -710,6 +1873,18 @@ out:
 	return ret;
 }
 
+static int md_move_object(uint64_t oid, const char *old, const char *new)
+{
+	/* the disks may share a file system, then the file stays where it is */
+	if (link(old, new) < 0 && errno != EEXIST &&
+	    md_copy_object(oid, old, new) < 0)
+		return -1;
+
+	unlink(old);
+	md_invalidate_fd(oid);
+	return 0;
+}
+
 static int md_check_and_move(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 			     const char *path)
 {
@@ -731,26 +1906,449 @@ static int md_check_and_move(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 		sd_err("move old %s to new %s failed", old, new);
 		return SD_RES_EIO;
 	}
+	if (!epoch) {
+		manifest_log(old, oid, ec_index, false);
+		manifest_log(new, oid, ec_index, true);
+	}
 
 	sd_debug("from %s to %s", old, new);
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Find the object on the disks and move it into place.  The objects of the
+ * working directories are looked up in the location index first, so only an
+ * object not indexed costs the probe of every disk.
+ */
 static int scan_wd(uint64_t oid, uint32_t epoch, uint8_t ec_index)
 {
 	int ret = SD_RES_EIO;
 	const struct disk *disk;
+	uint64_t gen;
 
 	sd_read_lock(&md.lock);
+	if (!epoch && loc_lookup(oid, ec_index, &disk, &gen)) {
+		if (!disk)
+			goto out;
+		ret = md_check_and_move(oid, epoch, ec_index, disk->path);
+		if (ret == SD_RES_SUCCESS)
+			goto out;
+		/* a stale entry, probe the disks */
+	}
+
 	rb_for_each_entry(disk, &md.root, rb) {
 		ret = md_check_and_move(oid, epoch, ec_index, disk->path);
 		if (ret == SD_RES_SUCCESS)
 			break;
 	}
+	if (!epoch && ret != SD_RES_SUCCESS)
+		loc_none(oid, ec_index, gen);
+out:
+	sd_rw_unlock(&md.lock);
+	return ret;
+}
+
+/*
+ * Move the objects which the weighted placement puts on other disks in the
+ * background, within sys->md_move_rate.  Until an object is moved, lookups
+ * find it by scan_wd() as usual.  A change of the disks in the middle
+ * restarts the scan.
+ */
+static uatomic_bool md_move_queued;
+
+struct md_move {
+	struct work work;
+	const char *path; /* the disk being scanned */
+	uint32_t gen;
+	uint64_t start;
+	uint64_t moved; /* bytes */
+	uint64_t nr;
+};
+
+static void md_move_throttle(struct md_move *mm)
+{
+	uint64_t rate = sys->md_move_rate ?: MD_MOVE_RATE;
+	uint64_t expect = (double)mm->moved / rate * 1000000000ULL;
+	uint64_t elapsed = clock_get_time() - mm->start;
+	struct timespec ts;
+
+	if (expect <= elapsed)
+		return;
+
+	ts.tv_sec = (expect - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (expect - elapsed) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static int md_move_misplaced(uint64_t oid, const char *path, uint32_t epoch,
+			     uint8_t ec_index, struct vnode_info *vinfo,
+			     void *arg)
+{
+	struct md_move *mm = arg;
+	bool moved = false;
+
+	sd_read_lock(&md.lock);
+	if (mm->gen != md.gen) {
+		sd_rw_unlock(&md.lock);
+		return SD_RES_AGAIN;
+	}
+	if (strcmp(md_get_object_dir_nolock(oid), mm->path))
+		/* the object might be removed or moved by a lookup meanwhile */
+		moved = md_check_and_move(oid, epoch, ec_index, mm->path) ==
+			SD_RES_SUCCESS;
+	sd_rw_unlock(&md.lock);
+
+	if (moved) {
+		mm->moved += get_store_objsize(oid);
+		mm->nr++;
+		md_move_throttle(mm);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int md_move_disks(struct md_move *mm)
+{
+	char (*paths)[PATH_MAX], stale[PATH_MAX];
+	const struct disk *disk;
+	int nr = 0, ret = SD_RES_SUCCESS;
+
+	sd_read_lock(&md.lock);
+	mm->gen = md.gen;
+	paths = xmalloc(sizeof(*paths) * (md.nr_disks ?: 1));
+	rb_for_each_entry(disk, &md.root, rb)
+		pstrcpy(paths[nr++], PATH_MAX, disk->path);
 	sd_rw_unlock(&md.lock);
+
+	for (int i = 0; i < nr; i++) {
+		mm->path = paths[i];
+		ret = for_each_object_in_path(paths[i], md_move_misplaced,
+					      false, NULL, mm);
+		if (ret == SD_RES_AGAIN)
+			break;
+
+		snprintf(stale, sizeof(stale), "%s/.stale", paths[i]);
+		ret = for_each_object_in_path(stale, md_move_misplaced, false,
+					      NULL, mm);
+		if (ret == SD_RES_AGAIN)
+			break;
+	}
+	free(paths);
+
 	return ret;
 }
 
+static void md_move_work(struct work *work)
+{
+	struct md_move *mm = container_of(work, struct md_move, work);
+	int ret;
+
+	uatomic_set_false(&md_move_queued);
+	mm->start = clock_get_time();
+	do {
+		ret = md_move_disks(mm);
+		/* the queued one will do it */
+		if (uatomic_is_true(&md_move_queued))
+			break;
+	} while (ret == SD_RES_AGAIN);
+
+	if (mm->nr)
+		sd_info("moved %" PRIu64 " objects, %" PRIu64 " MB", mm->nr,
+			mm->moved / 1024 / 1024);
+}
+
+static void md_move_done(struct work *work)
+{
+	struct md_move *mm = container_of(work, struct md_move, work);
+
+	free(mm);
+}
+
+void md_start_move(void)
+{
+	struct md_move *mm;
+
+	if (!md_weighted_placement())
+		return;
+
+	if (!uatomic_set_true(&md_move_queued))
+		return;
+
+	mm = xzalloc(sizeof(*mm));
+	mm->work.fn = md_move_work;
+	mm->work.done = md_move_done;
+	queue_work(sys->md_move_wqueue, &mm->work);
+}
+
+/*
+ * Every MD_TIER_INTERVAL, promote the hottest data objects while the fast
+ * tier is used less than MD_TIER_LOW percent, or demote the coldest hot ones
+ * down to it once the usage goes over MD_TIER_HIGH, and then halve the counts
+ * of the accesses.  The moves share sys->md_move_rate with md_start_move().
+ */
+#define MD_TIER_INTERVAL	60000 /* ms */
+#define MD_TIER_HOT_HITS	8
+#define MD_TIER_LOW		80
+#define MD_TIER_HIGH		90
+
+static uatomic_bool md_tier_queued;
+
+static int heat_cmp(const struct md_heat *a, const struct md_heat *b)
+{
+	/* the hottest first */
+	return -intcmp(a->hits, b->hits);
+}
+
+/* Collect the counts of the accesses and halve them */
+static struct md_heat *heat_snapshot(size_t *nr)
+{
+	struct md_heat *heats = xmalloc(sizeof(heat_table));
+
+	*nr = 0;
+	for (int i = 0; i < MD_HEAT_NR_LOCKS; i++) {
+		sd_mutex_lock(heat_locks + i);
+		for (int j = i; j < (1 << MD_HEAT_BITS); j += MD_HEAT_NR_LOCKS) {
+			if (!heat_table[j].hits)
+				continue;
+			heats[(*nr)++] = heat_table[j];
+			heat_table[j].hits /= 2;
+		}
+		sd_mutex_unlock(heat_locks + i);
+	}
+
+	xqsort(heats, *nr, heat_cmp);
+	return heats;
+}
+
+/* Must be called with md.lock held */
+static void fast_tier_usage(uint64_t *used, uint64_t *total)
+{
+	const struct disk *disk;
+	uint64_t free = 0;
+
+	*total = 0;
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (!disk->fast)
+			continue;
+		*total += disk->space;
+		free += get_path_free_size(disk->path, NULL);
+	}
+	*used = *total > free ? *total - free : 0;
+}
+
+/* An empty path, which no syscall finds, if the disk path is too long */
+static inline void object_path(char *path, const char *dir, uint64_t oid,
+			       uint8_t ec_index)
+{
+	int len;
+
+	if (is_erasure_oid(oid))
+		len = snprintf(path, PATH_MAX, "%s/%016"PRIx64"_%d", dir, oid,
+			       ec_index);
+	else
+		len = snprintf(path, PATH_MAX, "%s/%016"PRIx64, dir, oid);
+	if (unlikely(len >= PATH_MAX))
+		path[0] = '\0';
+}
+
+static inline bool same_mtime(const char *path, const struct stat *st)
+{
+	struct stat now;
+
+	return stat(path, &now) == 0 &&
+		now.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		now.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Copy the files of oid to the other tier and flip its tier once all of them
+ * are copied.  A file written during its copy makes us give up until the next
+ * round.  Returns the bytes moved.
+ */
+static uint64_t md_tier_move(uint64_t oid, bool promote)
+{
+	char old[SD_MAX_COPIES][PATH_MAX], new[PATH_MAX];
+	int nr_files = is_erasure_oid(oid) ? SD_MAX_COPIES : 1, nr = 0;
+	uint8_t idx[SD_MAX_COPIES];
+	const char *from, *to;
+	uint64_t moved = 0;
+	struct stat st;
+
+	sd_read_lock(&md.lock);
+	if (!md_tiered() || oid_on_fast_tier(oid) == promote)
+		goto out;
+
+	from = oid_to_disk(oid, true, !promote)->path;
+	to = oid_to_disk(oid, true, promote)->path;
+	for (int i = 0; i < nr_files; i++) {
+		object_path(old[nr], from, oid, i);
+		if (stat(old[nr], &st) < 0)
+			continue;
+
+		object_path(new, to, oid, i);
+		if (md_copy_object(oid, old[nr], new) < 0 ||
+		    !same_mtime(old[nr], &st)) {
+			unlink(new);
+			goto undo;
+		}
+		idx[nr++] = i;
+	}
+	if (!nr) {
+		/* removed meanwhile */
+		if (!promote)
+			hot_remove(oid);
+		goto out;
+	}
+
+	if (promote)
+		hot_insert(oid);
+	else
+		hot_remove(oid);
+	md_invalidate_fd(oid);
+	for (int i = 0; i < nr; i++) {
+		object_path(new, to, oid, idx[i]);
+		unlink(old[i]);
+		manifest_log(old[i], oid, idx[i], false);
+		manifest_log(new, oid, idx[i], true);
+		moved += get_store_objsize(oid);
+	}
+	sd_debug("%016"PRIx64" to %s", oid, promote ? "fast" : "slow");
+	goto out;
+undo:
+	for (int i = 0; i < nr; i++) {
+		object_path(new, to, oid, idx[i]);
+		unlink(new);
+	}
+out:
+	sd_rw_unlock(&md.lock);
+	return moved;
+}
+
+struct hot_heat {
+	uint64_t oid;
+	uint32_t hits;
+};
+
+static int hot_heat_cmp(const struct hot_heat *a, const struct hot_heat *b)
+{
+	/* the coldest first */
+	return intcmp(a->hits, b->hits);
+}
+
+static void md_demote(struct md_move *mm, uint64_t used, uint64_t total)
+{
+	struct hot_heat *hots;
+	struct hot_obj *h;
+	struct hlist_node *node;
+	size_t nr = 0;
+
+	sd_read_lock(&hot_set.lock);
+	hots = xmalloc(sizeof(*hots) * (hot_set.nr ?: 1));
+	for (int i = 0; i < (1 << MD_HOT_BITS); i++)
+		hlist_for_each_entry(h, node, hot_set.hash + i, hash)
+			hots[nr++].oid = h->oid;
+	sd_rw_unlock(&hot_set.lock);
+
+	for (size_t i = 0; i < nr; i++)
+		hots[i].hits = heat_hits(hots[i].oid);
+	xqsort(hots, nr, hot_heat_cmp);
+
+	for (size_t i = 0; i < nr && used * 100 > total * MD_TIER_LOW; i++) {
+		uint64_t moved = md_tier_move(hots[i].oid, false);
+
+		used -= min(used, moved);
+		mm->moved += moved;
+		mm->nr += !!moved;
+		md_move_throttle(mm);
+	}
+	free(hots);
+}
+
+static void md_promote(struct md_move *mm, const struct md_heat *heats,
+		       size_t nr, uint64_t used, uint64_t total)
+{
+	for (size_t i = 0; i < nr && heats[i].hits >= MD_TIER_HOT_HITS; i++) {
+		uint64_t moved;
+
+		if (oid_is_hot(heats[i].oid))
+			continue;
+		if ((used + get_store_objsize(heats[i].oid)) * 100 >
+		    total * MD_TIER_LOW)
+			break;
+
+		moved = md_tier_move(heats[i].oid, true);
+		used += moved;
+		mm->moved += moved;
+		mm->nr += !!moved;
+		md_move_throttle(mm);
+	}
+}
+
+static void md_tier_work(struct work *work)
+{
+	struct md_move mm = { .start = clock_get_time() };
+	uint64_t used = 0, total = 0;
+	struct md_heat *heats;
+	bool tiered;
+	size_t nr;
+
+	uatomic_set_false(&md_tier_queued);
+	heats = heat_snapshot(&nr);
+
+	sd_read_lock(&md.lock);
+	tiered = md_tiered();
+	if (tiered)
+		fast_tier_usage(&used, &total);
+	sd_rw_unlock(&md.lock);
+
+	if (!tiered || !total)
+		goto out;
+
+	if (used * 100 > total * MD_TIER_HIGH)
+		md_demote(&mm, used, total);
+	else
+		md_promote(&mm, heats, nr, used, total);
+
+	if (mm.nr)
+		sd_info("moved %" PRIu64 " objects between the tiers, %" PRIu64
+			" MB, %" PRIu32 " hot", mm.nr, mm.moved / 1024 / 1024,
+			uatomic_read(&hot_set.nr));
+out:
+	free(heats);
+}
+
+static void md_tier_done(struct work *work)
+{
+	free(work);
+}
+
+static void tier_timer_fn(void *data);
+
+static struct timer tier_timer = {
+	.callback = tier_timer_fn,
+};
+
+static void tier_timer_fn(void *data)
+{
+	struct work *work;
+
+	if (uatomic_set_true(&md_tier_queued)) {
+		work = xzalloc(sizeof(*work));
+		work->fn = md_tier_work;
+		work->done = md_tier_done;
+		queue_work(sys->md_move_wqueue, work);
+	}
+	add_timer(&tier_timer, MD_TIER_INTERVAL);
+}
+
+void md_init_tier(void)
+{
+	if (!sys->md_tier)
+		return;
+
+	add_timer(&tier_timer, MD_TIER_INTERVAL);
+}
+
 bool md_exist(uint64_t oid, uint8_t ec_index, char *path)
 {
 	if (md_access(path))
@@ -791,24 +2389,319 @@ int md_get_stale_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return SD_RES_NO_OBJ;
 }
 
+/* Account the bytes moved to or purged from the stale objects of the disk */
+void md_stale_account(const char *path, int64_t bytes)
+{
+	struct disk *disk;
+
+	sd_read_lock(&md.lock);
+	disk = path_to_disk(path);
+	if (disk) {
+		/* the disk might be plugged with the stale objects uncounted */
+		if (bytes < 0 && uatomic_read(&disk->stale) < -bytes)
+			uatomic_set(&disk->stale, 0);
+		else
+			uatomic_add(&disk->stale, bytes);
+	}
+	sd_rw_unlock(&md.lock);
+}
+
+void md_stale_reset(void)
+{
+	struct disk *disk;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb)
+		uatomic_set(&disk->stale, 0);
+	sd_rw_unlock(&md.lock);
+}
+
+/*
+ * I/O counters of the disks for the metrics.  The slot of a disk is found by
+ * the hash of the directory of the object path, without md.lock, so the I/O
+ * path pays for a few atomic adds only.  The first I/O of a disk claims its
+ * slot for good, and there are slots for the disks plugged since the start
+ * twice over.
+ */
+#define MD_IO_SLOTS (MD_MAX_DISK * 2)
+
+static struct md_io_slot {
+	uint64_t hash; /* of the disk path, 0 if the slot is free */
+	uint64_t nr[2]; /* of the reads and the writes */
+	uint64_t ns[2];
+	uint32_t hist[SD_LAT_NR_BUCKETS]; /* of the window, see md_slow_tick() */
+
+	/* updated by md_slow_tick() only */
+	uint64_t last_nr;
+	uint64_t last_ns;
+	uint32_t avg_us; /* smoothed mean latency of the windows */
+	uint32_t p99_us; /* of the last window */
+	int strikes;
+	int slow;
+} md_io_slots[MD_IO_SLOTS];
+
+static struct md_io_slot *md_io_slot(const char *path, size_t len, bool claim)
+{
+	uint64_t hash = sd_hash(path, len) ?: 1, h;
+
+	for (int i = 0; i < MD_IO_SLOTS; i++) {
+		struct md_io_slot *s = md_io_slots + (hash + i) % MD_IO_SLOTS;
+
+		h = uatomic_read(&s->hash);
+		if (h == hash)
+			return s;
+		if (h)
+			continue;
+		if (!claim)
+			return NULL;
+		h = uatomic_cmpxchg(&s->hash, 0, hash);
+		if (!h || h == hash)
+			return s;
+	}
+	return NULL;
+}
+
+/* Account the I/O started at start on the object file at the path */
+void md_io_account(const char *path, bool write, uint64_t start)
+{
+	const char *p = strrchr(path, '/');
+	struct md_io_slot *s;
+	uint64_t ns;
+
+	if (!p)
+		return;
+	s = md_io_slot(path, p - path, true);
+	if (!s)
+		return;
+	ns = clock_get_time() - start;
+	uatomic_inc(&s->nr[write]);
+	uatomic_add(&s->ns[write], ns);
+	uatomic_inc(&s->hist[sd_lat_bucket(ns / 1000)]);
+}
+
+void md_io_get_stat(const char *disk, struct md_io_stat *stat)
+{
+	struct md_io_slot *s = md_io_slot(disk, strlen(disk), false);
+
+	memset(stat, 0, sizeof(*stat));
+	if (!s)
+		return;
+	stat->nr_reads = uatomic_read(&s->nr[0]);
+	stat->nr_writes = uatomic_read(&s->nr[1]);
+	stat->read_ns = uatomic_read(&s->ns[0]);
+	stat->write_ns = uatomic_read(&s->ns[1]);
+}
+
+/*
+ * Detection of the slow disks
+ *
+ * A degraded disk may serve every I/O slowly without ever failing one, which
+ * md_handle_eio() doesn't catch.  Every MD_SLOW_INTERVAL seconds the mean
+ * latency of the I/O of each disk in the window is smoothed into avg_us, and
+ * the 99th percentile of the window is taken from its histogram.  A disk with
+ * an average MD_SLOW_FACTOR times the median of the disks of the node, and
+ * above MD_SLOW_MIN_US, is an outlier.  After MD_SLOW_STRIKES outlying
+ * windows in a row it's flagged slow, and it's cleared after as many normal
+ * ones.  The windows with fewer than MD_SLOW_MIN_IOS don't count either way.
+ *
+ * The reads of the objects on a slow disk go to their other copies first,
+ * see replication_read(), and with '-m drain' a slow disk is unplugged as if
+ * it had failed, so that its objects are recovered onto the other disks.
+ */
+#define MD_SLOW_INTERVAL	10 /* seconds */
+#define MD_SLOW_FACTOR		4
+#define MD_SLOW_MIN_US		20000
+#define MD_SLOW_MIN_IOS		64
+#define MD_SLOW_STRIKES		3
+
+static int md_nr_slow;
+
+/* Close the window of the slot, false if it has too few I/Os to judge */
+static bool md_slow_window(struct md_io_slot *s)
+{
+	uint64_t nr = uatomic_read(&s->nr[0]) + uatomic_read(&s->nr[1]),
+		 ns = uatomic_read(&s->ns[0]) + uatomic_read(&s->ns[1]),
+		 n = 0, sum = 0;
+	uint32_t hist[SD_LAT_NR_BUCKETS], avg;
+	int i;
+
+	for (i = 0; i < SD_LAT_NR_BUCKETS; i++) {
+		hist[i] = uatomic_xchg(&s->hist[i], 0);
+		n += hist[i];
+	}
+	nr -= s->last_nr;
+	ns -= s->last_ns;
+	s->last_nr += nr;
+	s->last_ns += ns;
+	if (nr < MD_SLOW_MIN_IOS || !n)
+		return false;
+
+	for (i = 0; i < SD_LAT_NR_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum * 100 >= n * 99)
+			break;
+	}
+	uatomic_set(&s->p99_us, sd_lat_bucket_min(i));
+
+	avg = ns / nr / 1000;
+	uatomic_set(&s->avg_us, s->avg_us ? (s->avg_us * 3 + avg) / 4 : avg);
+	return true;
+}
+
+static int avg_cmp(const uint32_t *a, const uint32_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+static void md_slow_judge(struct md_io_slot *s, const char *path,
+			  uint32_t limit)
+{
+	if (s->avg_us > limit) {
+		if (s->strikes < MD_SLOW_STRIKES)
+			s->strikes++;
+		if (s->strikes == MD_SLOW_STRIKES && !s->slow) {
+			sd_warn("%s is slow, %"PRIu32" us against %"PRIu32
+				" us of the median", path, s->avg_us,
+				limit / MD_SLOW_FACTOR);
+			uatomic_set(&s->slow, true);
+		}
+	} else if (s->strikes && !--s->strikes && s->slow) {
+		sd_info("%s is not slow anymore", path);
+		uatomic_set(&s->slow, false);
+	}
+}
+
+static void md_slow_timer_fn(void *data);
+
+static struct timer md_slow_timer = {
+	.callback = md_slow_timer_fn,
+};
+
+static void md_slow_timer_fn(void *data)
+{
+	struct md_io_slot *slots[MD_MAX_DISK];
+	bool judged[MD_MAX_DISK];
+	uint32_t avgs[MD_MAX_DISK], limit;
+	char drain[PATH_MAX] = "";
+	const struct disk *disk;
+	int i, nr = 0, nr_judged = 0, nr_slow = 0;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (nr == MD_MAX_DISK)
+			break;
+		slots[nr] = md_io_slot(disk->path, strlen(disk->path), true);
+		judged[nr] = slots[nr] && md_slow_window(slots[nr]);
+		if (judged[nr])
+			avgs[nr_judged++] = slots[nr]->avg_us;
+		nr++;
+	}
+
+	xqsort(avgs, nr_judged, avg_cmp);
+	limit = nr_judged > 1 ?
+		max(avgs[(nr_judged - 1) / 2] * MD_SLOW_FACTOR,
+		    (uint32_t)MD_SLOW_MIN_US) : UINT32_MAX;
+
+	i = 0;
+	rb_for_each_entry(disk, &md.root, rb) {
+		struct md_io_slot *s;
+
+		if (i == nr)
+			break;
+		s = slots[i];
+		if (judged[i++])
+			md_slow_judge(s, disk->path, limit);
+		if (s && s->slow) {
+			nr_slow++;
+			if (!drain[0])
+				pstrcpy(drain, sizeof(drain), disk->path);
+		}
+	}
+	uatomic_set(&md_nr_slow, nr_slow);
+	/* leave the node a disk at least */
+	if (!sys->md_drain || nr_slow == md.nr_disks)
+		drain[0] = '\0';
+	sd_rw_unlock(&md.lock);
+
+	if (drain[0]) {
+		struct md_work *mw = xzalloc(sizeof(*mw));
+
+		sd_warn("draining the slow disk %s", drain);
+		mw->work.done = md_do_recover;
+		pstrcpy(mw->path, PATH_MAX, drain);
+		queue_work(sys->md_wqueue, &mw->work);
+	}
+
+	add_timer(&md_slow_timer, MD_SLOW_INTERVAL);
+}
+
+void md_init_slow(void)
+{
+	add_timer(&md_slow_timer, MD_SLOW_INTERVAL);
+}
+
+static bool disk_is_slow(const char *dir, size_t len)
+{
+	struct md_io_slot *s = md_io_slot(dir, len, false);
+
+	return s && uatomic_read(&s->slow);
+}
+
+/* Whether the object file at the path is on a slow disk */
+bool md_path_slow(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	if (!uatomic_read(&md_nr_slow) || !p)
+		return false;
+	return disk_is_slow(path, p - path);
+}
+
+/* Whether the object is placed on a slow disk of this node */
+bool md_oid_slow(uint64_t oid)
+{
+	const char *dir;
+	bool ret;
+
+	if (!uatomic_read(&md_nr_slow))
+		return false;
+
+	sd_read_lock(&md.lock);
+	dir = md_get_object_dir_nolock(oid);
+	ret = disk_is_slow(dir, strlen(dir));
+	sd_rw_unlock(&md.lock);
+
+	return ret;
+}
+
 uint32_t md_get_info(struct sd_md_info *info)
 {
 	uint32_t ret = sizeof(*info);
 	const struct disk *disk;
+	struct md_io_slot *s;
 	int i = 0;
 
 	memset(info, 0, ret);
 	sd_read_lock(&md.lock);
 	rb_for_each_entry(disk, &md.root, rb) {
 		info->disk[i].idx = i;
+		info->disk[i].fast = disk->fast;
 		pstrcpy(info->disk[i].path, PATH_MAX, disk->path);
 		/* FIXME: better handling failure case. */
 		info->disk[i].free = get_path_free_size(info->disk[i].path,
 							&info->disk[i].used);
+		info->disk[i].stale = uatomic_read(&disk->stale);
+		s = md_io_slot(disk->path, strlen(disk->path), false);
+		if (s) {
+			info->disk[i].slow = uatomic_read(&s->slow);
+			info->disk[i].lat_us = uatomic_read(&s->avg_us);
+			info->disk[i].p99_us = uatomic_read(&s->p99_us);
+		}
 		i++;
 	}
 	info->nr = md.nr_disks;
 	sd_rw_unlock(&md.lock);
+	info->nr_hot = uatomic_read(&hot_set.nr);
 	return ret;
 }
 
@@ -880,15 +2773,28 @@ static int do_plug_unplug(char *disks, bool plug)
 	if (old_nr == md.nr_disks)
 		goto out;
 
+	/* Objects will be placed on the other disks */
+	if (plug)
+		md_purge_fd_cache();
 	ret = SD_RES_SUCCESS;
 out:
 	sd_rw_unlock(&md.lock);
 
-	if (ret == SD_RES_SUCCESS) {
-		update_node_disks();
-		kick_recover();
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/*
+	 * The objects of the other disks are all still here, they just have
+	 * to be moved to the plugged disks.
+	 */
+	if (plug && md_weighted_placement()) {
+		md_start_move();
+		return ret;
 	}
 
+	update_node_disks();
+	kick_recover();
+
 	return ret;
 }
 
@@ -922,6 +2828,17 @@ uint32_t md_nr_disks(void)
 	return nr_online_disks();
 }
 
+bool md_has_disk(const char *path)
+{
+	bool ret;
+
+	sd_read_lock(&md.lock);
+	ret = path_to_disk(path) != NULL;
+	sd_rw_unlock(&md.lock);
+
+	return ret;
+}
+
 bool md_verify_disk(const char *path)
 {
 	struct statvfs fs;
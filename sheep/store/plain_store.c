@@ -10,6 +10,11 @@
  */
 
 #include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+/* linux/fs.h has its own definition */
+#undef BLOCK_SIZE
 
 #include "sheep_priv.h"
 
@@ -45,6 +50,148 @@ static int get_store_stale_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return md_get_stale_path(oid, epoch, ec_index, path);
 }
 
+/*
+ * Block hashes
+ *
+ * The object is hashed in SD_BLOCK_HASH_NR blocks and its digest is the sha1
+ * of the block digests, which are kept in an xattr together with the mtime of
+ * the object when they were computed.  The writes mark their blocks dirty in
+ * the tracker, which remembers the objects hashed since the sheep started, so
+ * that only the dirty blocks are read again.  After a restart, the digests
+ * are reused if the mtime hasn't changed, and all the blocks are read
+ * otherwise.
+ */
+#define BHASH_NAME "user.obj.bhash"
+#define BHASH_ALL_DIRTY UINT64_MAX
+#define BHASH_TABLE_BITS 16
+#define BHASH_NR_LOCKS 256
+#define BHASH_MAX_TRACKS (1U << 20)
+/* the mtime is trusted only if no write could share the timestamp with it */
+#define BHASH_MTIME_MARGIN (1000000000ULL)
+
+struct block_hash {
+	uint64_t id; /* identifies the digests for the tracker */
+	uint64_t mtime; /* in nanoseconds, 0 if not trusted */
+	uint8_t digests[SD_BLOCK_HASH_NR][SHA1_DIGEST_SIZE];
+};
+
+struct bhash_track {
+	struct hlist_node hash;
+	uint64_t oid;
+	uint64_t id; /* of the digests the dirty blocks are relative to */
+	uint64_t dirty;
+};
+
+static struct hlist_head bhash_table[1 << BHASH_TABLE_BITS];
+static struct sd_mutex bhash_locks[BHASH_NR_LOCKS] = {
+	[0 ... BHASH_NR_LOCKS - 1] = SD_MUTEX_INITIALIZER,
+};
+static uatomic_bool bhash_full;
+static uint32_t nr_bhash_tracks;
+
+static inline struct hlist_head *bhash_head(uint64_t oid)
+{
+	return bhash_table + (sd_hash_oid(oid) >> (64 - BHASH_TABLE_BITS));
+}
+
+/* The lock covers the whole bucket, so it has to be derived from it */
+static inline struct sd_mutex *bhash_lock(uint64_t oid)
+{
+	return bhash_locks + (bhash_head(oid) - bhash_table) % BHASH_NR_LOCKS;
+}
+
+/* Called with the lock of oid held */
+static struct bhash_track *find_bhash_track(uint64_t oid)
+{
+	struct bhash_track *t;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(t, n, bhash_head(oid), hash)
+		if (t->oid == oid)
+			return t;
+	return NULL;
+}
+
+static uint64_t bhash_blocks(uint64_t oid, uint64_t offset, uint64_t len)
+{
+	uint64_t bsize = get_store_objsize(oid) / SD_BLOCK_HASH_NR;
+	uint64_t first = offset / bsize, last = (offset + len - 1) / bsize;
+
+	if (!len)
+		return 0;
+	if (last >= SD_BLOCK_HASH_NR - 1)
+		last = SD_BLOCK_HASH_NR - 1;
+	if (last - first == SD_BLOCK_HASH_NR - 1)
+		return BHASH_ALL_DIRTY;
+	return ((UINT64_C(1) << (last - first + 1)) - 1) << first;
+}
+
+/* Mark the blocks dirty once they are written */
+static void bhash_track_write(uint64_t oid, uint64_t offset, uint64_t len)
+{
+	struct sd_mutex *lock = bhash_lock(oid);
+	struct bhash_track *t;
+
+	sd_mutex_lock(lock);
+	t = find_bhash_track(oid);
+	if (t)
+		t->dirty |= bhash_blocks(oid, offset, len);
+	sd_mutex_unlock(lock);
+}
+
+static void bhash_track_remove(uint64_t oid)
+{
+	struct sd_mutex *lock = bhash_lock(oid);
+	struct bhash_track *t;
+
+	sd_mutex_lock(lock);
+	t = find_bhash_track(oid);
+	if (t) {
+		hlist_del(&t->hash);
+		free(t);
+		uatomic_dec(&nr_bhash_tracks);
+	}
+	sd_mutex_unlock(lock);
+}
+
+/*
+ * Return the dirty blocks of the object against bh and start tracking it with
+ * the digests identified by id.
+ */
+static uint64_t bhash_track_start(uint64_t oid, const struct block_hash *bh,
+				  uint64_t mtime, uint64_t id)
+{
+	struct sd_mutex *lock = bhash_lock(oid);
+	struct bhash_track *t;
+	uint64_t dirty;
+
+	sd_mutex_lock(lock);
+	t = find_bhash_track(oid);
+	if (t && bh && t->id == bh->id)
+		dirty = t->dirty;
+	else if (bh && bh->mtime && bh->mtime == mtime)
+		dirty = 0;
+	else
+		dirty = BHASH_ALL_DIRTY;
+
+	if (!t && uatomic_add_return(&nr_bhash_tracks, 1) <= BHASH_MAX_TRACKS) {
+		t = xmalloc(sizeof(*t));
+		t->oid = oid;
+		hlist_add_head(&t->hash, bhash_head(oid));
+	} else if (!t) {
+		uatomic_dec(&nr_bhash_tracks);
+		if (uatomic_set_true(&bhash_full))
+			sd_warn("too many objects to track the block hashes");
+	}
+	if (t) {
+		t->id = dirty ? id : bh->id;
+		t->dirty = 0;
+	}
+	sd_mutex_unlock(lock);
+
+	return dirty;
+}
+
 /*
  * Check if oid is in this nodes (if oid is in the wrong place, it will be moved
  * to the correct one after this call in a MD setup.
@@ -58,12 +205,83 @@ bool default_exist(uint64_t oid, uint8_t ec_index)
 	return md_exist(oid, ec_index, path);
 }
 
+/* The fds opened with O_DIRECT take dio_pread(), see prepare_iocb() */
+static inline ssize_t obj_pread(bool dio, int fd, void *buf, size_t len,
+				off_t offset)
+{
+	if (dio)
+		return dio_pread(fd, buf, len, offset);
+	return xpread(fd, buf, len, offset);
+}
+
+/*
+ * Background reads
+ *
+ * Recovery, scrub, 'dog vdi check' and the backups read every object once,
+ * and through the page cache they would evict the working set of the guests.
+ * Their reads, marked by SD_FLAG_CMD_BACKGROUND or SD_FLAG_CMD_RECOVERY, take
+ * an O_DIRECT fd of their own unless the object is opened with O_DIRECT
+ * anyway, which still sees the dirty pages, and the thread reads them at the
+ * lowest best-effort I/O priority.  A file system without O_DIRECT reads them
+ * with a POSIX_FADV_NOREUSE hint instead.
+ */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_BACKGROUND	(IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | 7)
+
+/* Lower the I/O priority of the thread, returning the one to restore */
+static int background_begin(void)
+{
+	int prio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+	if (prio >= 0)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_BACKGROUND);
+	return prio;
+}
+
+static void background_end(int prio)
+{
+	if (prio >= 0)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+}
+
+/*
+ * The fd to read the object around the page cache, or -1 to read it through
+ * fd, which is then hinted not to keep the pages of the range
+ */
+static int background_open(uint64_t oid, const char *path, int fd,
+			   off_t offset, off_t len)
+{
+	int dfd;
+
+	if (dio_supported(oid))
+		return -1;
+
+	dfd = open(path, O_RDONLY | O_DIRECT);
+	if (dfd < 0)
+		posix_fadvise(fd, offset, len, POSIX_FADV_NOREUSE);
+	return dfd;
+}
+
+static inline ssize_t obj_pwrite(uint64_t oid, int fd, const void *buf,
+				 size_t len, off_t offset)
+{
+	if (dio_supported(oid))
+		return dio_pwrite(oid, fd, buf, len, offset);
+	return xpwrite(fd, buf, len, offset);
+}
+
 int default_write(uint64_t oid, const struct siocb *iocb)
 {
-	int flags = prepare_iocb(oid, iocb, false), fd,
+	int flags = prepare_iocb(oid, iocb, false),
 	    ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
+	struct md_fd *mfd;
+	uint64_t start;
 	ssize_t size;
+	int jf = -1;
 
 	if (iocb->epoch < sys_epoch()) {
 		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
@@ -76,15 +294,34 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 	 * Make sure oid is in the right place because oid might be misplaced
 	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
 	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
+	 *
+	 * md_get_fd() does the default_exist() job if the fd isn't cached.
 	 */
-	if (!default_exist(oid, iocb->ec_index))
+	mfd = md_get_fd(oid, iocb->ec_index, flags, path);
+	if (unlikely(!mfd))
 		return err_to_sderr(path, oid, errno);
 
-	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
-		return err_to_sderr(path, oid, errno);
+	start = clock_get_time();
+	if (mfd->compressed) {
+		ret = compress_write(mfd->fd, oid, path, iocb);
+		bhash_track_write(oid, iocb->offset, iocb->length);
+		goto out;
+	}
 
-	size = xpwrite(fd, iocb->buf, iocb->length, iocb->offset);
+	if (sys->journal) {
+		jf = journal_write_store(oid, iocb->ec_index, mfd->fd,
+					 iocb->buf, iocb->length,
+					 iocb->offset);
+		if (unlikely(jf == -2)) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	}
+
+	size = obj_pwrite(oid, mfd->fd, iocb->buf, iocb->length,
+			  iocb->offset);
+	/* after the write so that a concurrent hashing can't miss it */
+	bhash_track_write(oid, iocb->offset, iocb->length);
 	if (unlikely(size != iocb->length)) {
 		sd_err("failed to write object %"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
@@ -92,8 +329,108 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	if (sys->dedup)
+		dedup_object(oid, mfd->fd, iocb);
+	/* not journaled, and the fd has no O_DSYNC */
+	if (sys->journal && jf < 0 && !sys->nosync &&
+	    unlikely(fdatasync(mfd->fd) < 0)) {
+		sd_err("failed to sync object %"PRIx64", %m", oid);
+		ret = err_to_sderr(path, oid, errno);
+	}
+	if (sys->md_group_sync && unlikely(md_sync_disk(path, mfd->fd) < 0)) {
+		sd_err("failed to sync object %"PRIx64", %m", oid);
+		ret = err_to_sderr(path, oid, errno);
+	}
 out:
-	close(fd);
+	md_io_account(path, true, start);
+	if (jf >= 0)
+		journal_done(jf);
+	md_put_fd(mfd);
+	rcache_invalidate(oid);
+	return ret;
+}
+
+/*
+ * Punch a hole of the range in the object.  If the file system can't, the
+ * range is zeroed, so that the replicas still read back the same data.
+ */
+int default_discard(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = prepare_iocb(oid, iocb, false),
+	    ret = SD_RES_SUCCESS;
+	char path[PATH_MAX];
+	struct md_fd *mfd;
+	int jf = -1;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	get_store_path(oid, iocb->ec_index, path);
+	mfd = md_get_fd(oid, iocb->ec_index, flags, path);
+	if (unlikely(!mfd))
+		return err_to_sderr(path, oid, errno);
+
+	/* the blocks are rewritten as zero blocks, which are holes */
+	if (mfd->compressed) {
+		struct siocb zero = *iocb;
+
+		zero.buf = xvalloc(iocb->length);
+		ret = compress_write(mfd->fd, oid, path, &zero);
+		free(zero.buf);
+		bhash_track_write(oid, iocb->offset, iocb->length);
+		goto out;
+	}
+
+	if (sys->journal) {
+		jf = journal_discard(oid, iocb->ec_index, mfd->fd,
+				     iocb->offset, iocb->length);
+		if (unlikely(jf < 0)) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	}
+
+	if (xfallocate(mfd->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		       iocb->offset, iocb->length) < 0) {
+		void *zero;
+		ssize_t size;
+
+		if (errno != EOPNOTSUPP && errno != ENOSYS) {
+			sd_err("failed to discard object %"PRIx64", %m", oid);
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+
+		zero = xvalloc(iocb->length);
+		size = obj_pwrite(oid, mfd->fd, zero, iocb->length,
+				  iocb->offset);
+		free(zero);
+		if (size != iocb->length) {
+			sd_err("failed to zero object %"PRIx64", %m", oid);
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+	}
+	bhash_track_write(oid, iocb->offset, iocb->length);
+
+	/* O_DSYNC doesn't cover the punch */
+	if (sys->md_group_sync) {
+		if (unlikely(md_sync_disk(path, mfd->fd) < 0)) {
+			sd_err("failed to sync object %"PRIx64", %m", oid);
+			ret = err_to_sderr(path, oid, errno);
+		}
+	} else if (jf < 0 && !sys->nosync &&
+		   unlikely(fdatasync(mfd->fd) < 0)) {
+		sd_err("failed to sync object %"PRIx64", %m", oid);
+		ret = err_to_sderr(path, oid, errno);
+	}
+out:
+	if (jf >= 0)
+		journal_done(jf);
+	md_put_fd(mfd);
+	rcache_invalidate(oid);
 	return ret;
 }
 
@@ -117,14 +454,93 @@ static int purge_dir(const char *path)
 	return SD_RES_SUCCESS;
 }
 
-static int purge_stale_dir(const char *path)
+/*
+ * The stale objects are purged in the background, a disk at a time on a low
+ * priority queue and within sys->stale_purge_rate unlinks a second, so that
+ * the purge after a big recovery doesn't stall the foreground I/O on the
+ * disks.  Only the objects moved to .stale up to the epoch of the cleanup are
+ * purged, the ones of a recovery started since are left to its own cleanup.
+ */
+#define STALE_PURGE_RATE 1000 /* unlinks a second */
+
+struct stale_purge {
+	struct work work;
+	char path[PATH_MAX]; /* of the disk */
+	uint32_t epoch;
+};
+
+static void stale_purge_throttle(uint64_t start, uint64_t nr)
 {
-	char p[PATH_MAX];
+	uint64_t rate = sys->stale_purge_rate ?: STALE_PURGE_RATE;
+	uint64_t expect = nr * 1000000000ULL / rate;
+	uint64_t elapsed = clock_get_time() - start;
+	struct timespec ts;
 
-	snprintf(p, PATH_MAX, "%s/.stale", path);
+	if (expect <= elapsed)
+		return;
 
-	if (purge_directory_async(p) < 0)
-		return SD_RES_EIO;
+	ts.tv_sec = (expect - elapsed) / 1000000000ULL;
+	ts.tv_nsec = (expect - elapsed) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+static void stale_purge_work(struct work *work)
+{
+	struct stale_purge *sp = container_of(work, struct stale_purge, work);
+	uint64_t start = clock_get_time(), nr = 0;
+	char p[PATH_MAX + 8];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	snprintf(p, sizeof(p), "%s/.stale", sp->path);
+	dir = opendir(p);
+	if (!dir) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", p);
+		return;
+	}
+
+	while ((d = readdir(dir))) {
+		const char *dot = strrchr(d->d_name, '.');
+
+		if (d->d_name[0] == '.')
+			continue;
+		/* moved by a later recovery */
+		if (dot && strtoul(dot + 1, NULL, 10) > sp->epoch)
+			continue;
+
+		if (fstatat(dirfd(dir), d->d_name, &st, 0) < 0)
+			st.st_blocks = 0;
+		if (unlinkat(dirfd(dir), d->d_name, 0) < 0) {
+			sd_err("failed to remove %s/%s, %m", p, d->d_name);
+			continue;
+		}
+		md_stale_account(sp->path, -(int64_t)(st.st_blocks *
+						     SECTOR_SIZE));
+		stale_purge_throttle(start, ++nr);
+	}
+	closedir(dir);
+
+	sd_info("purged %"PRIu64" stale objects of %s", nr, sp->path);
+}
+
+static void stale_purge_done(struct work *work)
+{
+	struct stale_purge *sp = container_of(work, struct stale_purge, work);
+
+	free(sp);
+}
+
+static int purge_stale_dir(const char *path)
+{
+	struct stale_purge *sp = xzalloc(sizeof(*sp));
+
+	pstrcpy(sp->path, sizeof(sp->path), path);
+	sp->epoch = sys_epoch();
+	sp->work.fn = stale_purge_work;
+	sp->work.done = stale_purge_done;
+	queue_work(sys->stale_wqueue, &sp->work);
 
 	return SD_RES_SUCCESS;
 }
@@ -141,12 +557,65 @@ int default_cleanup(void)
 	return SD_RES_SUCCESS;
 }
 
-static int default_read_from_path(uint64_t oid, const char *path,
+/* The smaller reads don't look for the holes, it costs two lseek() each */
+#define SPARSE_READ_MIN (64 * 1024)
+
+/*
+ * Read the range of the object, zeroing its holes instead of reading them.
+ * Returns the number of bytes read as xpread() does.
+ */
+static ssize_t read_sparse(int fd, bool dio, const struct siocb *iocb)
+{
+	off_t start = iocb->offset, end = start + iocb->length, pos, data, hole;
+	char *buf = iocb->buf;
+	ssize_t size;
+
+	if (iocb->length < SPARSE_READ_MIN)
+		return obj_pread(dio, fd, iocb->buf, iocb->length,
+				 iocb->offset);
+
+	for (pos = start; pos < end; pos = hole) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			/* no SEEK_DATA support, read the rest as it is */
+			if (errno != ENXIO) {
+				size = obj_pread(dio, fd, buf + (pos - start),
+						 end - pos, pos);
+				if (size < 0)
+					return size;
+				return pos - start + size;
+			}
+			/* no more data up to the end of the file */
+			data = end;
+		}
+		data = min(data, end);
+		memset(buf + (pos - start), 0, data - pos);
+		if (data == end)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		hole = hole < 0 ? end : min(hole, end);
+		size = obj_pread(dio, fd, buf + (data - start), hole - data,
+				 data);
+		if (size < 0)
+			return size;
+		if (size < hole - data)
+			return data - start + size;
+	}
+
+	return iocb->length;
+}
+
+static int default_read_from_path(uint64_t oid, char *path,
 				  const struct siocb *iocb)
 {
 	int flags = prepare_iocb(oid, iocb, false), fd,
 	    ret = SD_RES_SUCCESS;
+	struct md_fd *mfd = NULL;
+	bool compressed;
+	uint64_t start;
 	ssize_t size;
+	int dfd = -1, prio = -1;
 
 	/*
 	 * Make sure oid is in the right place because oid might be misplaced
@@ -154,22 +623,54 @@ static int default_read_from_path(uint64_t oid, const char *path,
 	 * bugs. We need call err_to_sderr() to return EIO if disk is broken.
 	 *
 	 * For stale path, get_store_stale_path already does default_exist job.
+	 * Otherwise md_get_fd() does it if the fd isn't cached.
 	 */
-	if (!is_stale_path(path) && !default_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, errno);
+	if (is_stale_path(path)) {
+		fd = open(path, flags);
+		if (fd < 0)
+			return err_to_sderr(path, oid, errno);
+		compressed = compress_is_file(oid, fd);
+	} else {
+		mfd = md_get_fd(oid, iocb->ec_index, flags, path);
+		if (!mfd)
+			return err_to_sderr(path, oid, errno);
+		fd = mfd->fd;
+		compressed = mfd->compressed;
+	}
 
-	fd = open(path, flags);
-	if (fd < 0)
-		return err_to_sderr(path, oid, errno);
+	start = clock_get_time();
+	if (iocb->background)
+		prio = background_begin();
+	if (compressed) {
+		ret = compress_read(fd, oid, path, iocb);
+		goto out;
+	}
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+	if (iocb->background)
+		dfd = background_open(oid, path, fd, iocb->offset,
+				      iocb->length);
+	if (dfd >= 0)
+		size = read_sparse(dfd, true, iocb);
+	else
+		size = read_sparse(fd, dio_supported(oid), iocb);
 	if (size < 0) {
 		sd_err("failed to read object %"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
 	}
-	close(fd);
+out:
+	if (dfd >= 0)
+		close(dfd);
+	if (iocb->background)
+		background_end(prio);
+	if (mfd) {
+		/* the stale objects are not on the I/O path */
+		md_io_account(path, false, start);
+		md_put_fd(mfd);
+	} else {
+		close(fd);
+	}
 	return ret;
 }
 
@@ -202,7 +703,15 @@ int default_init(void)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
+	return md_load_objects(init_objlist_and_vdi_bitmap, NULL);
+}
+
+static int default_read_live(uint64_t oid, const struct siocb *iocb)
+{
+	char path[PATH_MAX];
+
+	get_store_path(oid, iocb->ec_index, path);
+	return default_read_from_path(oid, path, iocb);
 }
 
 int default_read(uint64_t oid, const struct siocb *iocb)
@@ -210,8 +719,11 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	int ret;
 	char path[PATH_MAX];
 
-	get_store_path(oid, iocb->ec_index, path);
-	ret = default_read_from_path(oid, path, iocb);
+	/* nor do the background reads fill the read cache */
+	if (iocb->background)
+		ret = default_read_live(oid, iocb);
+	else
+		ret = rcache_read(oid, iocb, default_read_live);
 
 	/*
 	 * If the request is against the older epoch, try to read from
@@ -226,16 +738,89 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	return ret;
 }
 
+/*
+ * Data objects are created sparse, so that a thin provisioned vdi takes the
+ * space of the blocks written only.  The other objects are preallocated.
+ */
+static inline bool oid_is_sparse(uint64_t oid)
+{
+	return is_data_obj(oid);
+}
+
+/* Write the blocks of the data which aren't all zero, the rest is a hole */
+static ssize_t write_sparse(uint64_t oid, int fd, const struct siocb *iocb)
+{
+	const char *buf = iocb->buf;
+	size_t pos = 0, len;
+
+	while ((pos = sparse_next_extent(buf, iocb->length, pos, &len)) <
+	       iocb->length) {
+		if (obj_pwrite(oid, fd, buf + pos, len, iocb->offset + pos) !=
+		    len)
+			return -1;
+		pos += len;
+	}
+
+	return iocb->length;
+}
+
+/* Create the object from a preallocated file of the pool, see pool.c */
+static int create_from_pool(uint64_t oid, const struct siocb *iocb, int fd,
+			    int flags, const char *path, const char *pool_path)
+{
+	int ret;
+
+	if ((flags & O_DIRECT) && fcntl(fd, F_SETFL, O_DIRECT) < 0) {
+		sd_err("failed to set O_DIRECT on %s: %m", pool_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	/* the file is allocated already, no holes to keep */
+	if (obj_pwrite(oid, fd, iocb->buf, iocb->length, iocb->offset) !=
+	    iocb->length) {
+		sd_err("failed to write object. %m");
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	if (rename(pool_path, path) < 0) {
+		sd_err("failed to rename %s to %s: %m", pool_path, path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	md_invalidate_fd(oid);
+	md_manifest_log(path, oid, iocb->ec_index, true);
+	if (sys->dedup)
+		dedup_object(oid, fd, iocb);
+
+	ret = SD_RES_SUCCESS;
+	objlist_cache_insert(oid);
+out:
+	if (ret != SD_RES_SUCCESS && unlink(pool_path) != 0)
+		sd_err("failed to unlink %s: %m", pool_path);
+	close(fd);
+	return ret;
+}
+
 int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 {
-	char path[PATH_MAX], tmp_path[PATH_MAX];
+	char path[PATH_MAX], tmp_path[PATH_MAX], pool_path[PATH_MAX];
 	int flags = prepare_iocb(oid, iocb, true);
 	int ret, fd;
 	uint32_t len = iocb->length;
+	bool compressed = iocb->compress && compress_supported(oid);
 	size_t obj_size;
 
 	sd_debug("%"PRIx64, oid);
 	get_store_path(oid, iocb->ec_index, path);
+	if (!iocb->raw && !compressed) {
+		fd = pool_claim(oid, path, pool_path);
+		if (fd >= 0)
+			return create_from_pool(oid, iocb, fd, flags, path,
+						pool_path);
+	}
+
 	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
 	fd = open(tmp_path, flags, sd_def_fmode);
 	if (fd < 0) {
@@ -255,19 +840,34 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		return err_to_sderr(path, oid, errno);
 	}
 
-	obj_size = get_store_objsize(oid);
-	ret = prealloc(fd, obj_size);
+	if (compressed) {
+		ret = compress_create(fd, oid, path, iocb);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		goto done;
+	}
+
+	/* a raw file is the compressed object as it is */
+	obj_size = iocb->raw ? iocb->length : get_store_objsize(oid);
+	if (oid_is_sparse(oid))
+		ret = xftruncate(fd, obj_size);
+	else
+		ret = prealloc(fd, obj_size);
 	if (ret < 0) {
 	          ret = err_to_sderr(path, oid, errno);
 		  goto out;
 	}
 
-	ret = xpwrite(fd, iocb->buf, len, iocb->offset);
+	if (oid_is_sparse(oid))
+		ret = write_sparse(oid, fd, iocb);
+	else
+		ret = obj_pwrite(oid, fd, iocb->buf, len, iocb->offset);
 	if (ret != len) {
 		sd_err("failed to write object. %m");
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+done:
 
 	/*
 	 * Modern FS like ext4, xfs defaults to automatic syncing of files after
@@ -280,27 +880,128 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	md_invalidate_fd(oid);
+	md_manifest_log(path, oid, iocb->ec_index, true);
+	if (sys->dedup && !iocb->raw && !compressed)
+		dedup_object(oid, fd, iocb);
+
+	ret = SD_RES_SUCCESS;
+	objlist_cache_insert(oid);
+out:
+	if (ret != SD_RES_SUCCESS && unlink(tmp_path) != 0)
+		sd_err("failed to unlink %s: %m", tmp_path);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Create the object as a clone of the local object src, which shares its
+ * extents on XFS and btrfs, with the data of iocb written over it.
+ * SD_RES_NO_SUPPORT if the file system or the file of src can't.
+ */
+int default_copy(uint64_t oid, uint64_t src, const struct siocb *iocb)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX], src_path[PATH_MAX];
+	int flags = prepare_iocb(oid, iocb, true), fd, sfd, ret;
+
+	if (!md_reflink_supported(oid) ||
+	    (iocb->compress && compress_supported(oid)))
+		return SD_RES_NO_SUPPORT;
+
+	get_store_path(src, iocb->ec_index, src_path);
+	sfd = open(src_path, O_RDONLY);
+	if (sfd < 0)
+		return SD_RES_NO_SUPPORT;
+	if (compress_is_file(src, sfd)) {
+		close(sfd);
+		return SD_RES_NO_SUPPORT;
+	}
+
+	get_store_path(oid, iocb->ec_index, path);
+	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
+	fd = open(tmp_path, flags, sd_def_fmode);
+	if (fd < 0) {
+		close(sfd);
+		/* see default_create_and_write() */
+		if (errno == EEXIST)
+			return SD_RES_SUCCESS;
+		sd_err("failed to open %s: %m", tmp_path);
+		return err_to_sderr(path, oid, errno);
+	}
+
+	if (ioctl(fd, FICLONE, sfd) < 0) {
+		sd_debug("failed to clone %s, %m", src_path);
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
+	}
+	if (obj_pwrite(oid, fd, iocb->buf, iocb->length, iocb->offset) !=
+	    iocb->length) {
+		sd_err("failed to write object. %m");
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	/* O_DSYNC covers the write only */
+	if (!sys->nosync && fdatasync(fd) < 0) {
+		sd_err("failed to sync %s, %m", tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
 
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s to %s: %m", tmp_path, path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	md_invalidate_fd(oid);
+	md_manifest_log(path, oid, iocb->ec_index, true);
 	ret = SD_RES_SUCCESS;
 	objlist_cache_insert(oid);
 out:
 	if (ret != SD_RES_SUCCESS && unlink(tmp_path) != 0)
 		sd_err("failed to unlink %s: %m", tmp_path);
 	close(fd);
+	close(sfd);
 	return ret;
 }
 
-int default_link(uint64_t oid, uint32_t tgt_epoch)
+/*
+ * A clone of the stale file, so the writes to the object don't change the
+ * stale copy of the older epoch.  -1 if the file system can't.
+ */
+static int link_clone(uint64_t oid, const char *stale_path, const char *path)
+{
+	char tmp_path[PATH_MAX];
+	int fd, sfd, ret = -1;
+
+	get_store_tmp_path(oid, 0, tmp_path);
+	sfd = open(stale_path, O_RDONLY);
+	if (sfd < 0)
+		return -1;
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, sd_def_fmode);
+	if (fd < 0)
+		goto out;
+	if (ioctl(fd, FICLONE, sfd) == 0 && (sys->nosync || fsync(fd) == 0))
+		ret = link(tmp_path, path);
+	unlink(tmp_path);
+	close(fd);
+out:
+	close(sfd);
+	return ret;
+}
+
+int default_link(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch)
 {
 	char path[PATH_MAX], stale_path[PATH_MAX];
 
 	sd_debug("try link %"PRIx64" from snapshot with epoch %d", oid,
 		 tgt_epoch);
 
-	snprintf(path, PATH_MAX, "%s/%016"PRIx64, md_get_object_dir(oid), oid);
-	get_store_stale_path(oid, tgt_epoch, 0, stale_path);
+	get_store_path(oid, ec_index, path);
+	get_store_stale_path(oid, tgt_epoch, ec_index, stale_path);
 
-	if (link(stale_path, path) < 0) {
+	if ((!md_reflink_supported(oid) ||
+	     link_clone(oid, stale_path, path) < 0) &&
+	    link(stale_path, path) < 0) {
 		/*
 		 * Recovery thread and main thread might try to recover the
 		 * same object and we might get EEXIST in such case.
@@ -311,6 +1012,7 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 		sd_debug("failed to link from %s to %s, %m", stale_path, path);
 		return err_to_sderr(path, oid, errno);
 	}
+	md_manifest_log(path, oid, ec_index, true);
 out:
 	return SD_RES_SUCCESS;
 }
@@ -331,7 +1033,7 @@ static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
-	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -354,6 +1056,7 @@ static int move_object_to_stale_dir(uint64_t oid, const char *wd,
 {
 	char path[PATH_MAX], stale_path[PATH_MAX];
 	uint32_t tgt_epoch = *(uint32_t *)arg;
+	struct stat st;
 
 	/* ec_index from md.c is reliable so we can directly use it */
 	if (ec_index < SD_MAX_COPIES) {
@@ -369,11 +1072,16 @@ static int move_object_to_stale_dir(uint64_t oid, const char *wd,
 			 wd, oid, tgt_epoch);
 	}
 
+	if (stat(path, &st) < 0)
+		st.st_blocks = 0;
 	if (unlikely(rename(path, stale_path)) < 0) {
 		sd_err("failed to move stale object %" PRIX64 " to %s, %m", oid,
 		       path);
 		return SD_RES_EIO;
 	}
+	md_stale_account(wd, st.st_blocks * SECTOR_SIZE);
+	md_invalidate_fd(oid);
+	md_manifest_log(path, oid, ec_index, false);
 
 	objlist_migrate_cache_insert(oid);
 
@@ -395,6 +1103,8 @@ static int check_stale_objects(uint64_t oid, const char *wd, uint32_t epoch,
 int default_update_epoch(uint32_t epoch)
 {
 	sd_assert(epoch);
+	/* the journal can't follow the objects moved to the stale dir */
+	journal_checkpoint();
 	return for_each_object_in_wd(check_stale_objects, false, &epoch);
 }
 
@@ -403,10 +1113,14 @@ int default_format(void)
 	unsigned ret;
 
 	sd_debug("try get a clean store");
+	md_purge_fd_cache();
 	ret = for_each_obj_path(purge_dir);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	md_reset_manifests();
+	md_stale_reset();
+
 	if (sys->enable_object_cache)
 		object_cache_format();
 
@@ -416,54 +1130,41 @@ int default_format(void)
 int default_remove_object(uint64_t oid, uint8_t ec_index)
 {
 	char path[PATH_MAX];
+	int jf = -1;
 
 	get_store_path(oid, ec_index, path);
 
+	/* the journaled writes must not reach an object created again */
+	if (sys->journal) {
+		jf = journal_remove_object(oid, ec_index);
+		if (jf < 0)
+			return SD_RES_EIO;
+	}
+
 	if (unlink(path) < 0) {
+		if (jf >= 0)
+			journal_done(jf);
 		if (errno == ENOENT)
 			return SD_RES_NO_OBJ;
 
 		return err_to_sderr(path, oid, errno);
 	}
+	if (jf >= 0)
+		journal_done(jf);
+	md_invalidate_fd(oid);
+	md_manifest_log(path, oid, ec_index, false);
+	bhash_track_remove(oid);
 
 	return SD_RES_SUCCESS;
 }
 
-#define SHA1NAME "user.obj.sha1"
-
-static int get_object_sha1(const char *path, uint8_t *sha1)
-{
-	if (getxattr(path, SHA1NAME, sha1, SHA1_DIGEST_SIZE)
-	    != SHA1_DIGEST_SIZE) {
-		if (errno == ENODATA)
-			sd_debug("sha1 is not cached yet, %s", path);
-		else
-			sd_err("fail to get xattr, %s", path);
-		return -1;
-	}
-
-	return 0;
-}
-
-static int set_object_sha1(const char *path, const uint8_t *sha1)
+static int get_object_path(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			   char *path, size_t size)
 {
-	int ret;
-
-	ret = setxattr(path, SHA1NAME, sha1, SHA1_DIGEST_SIZE, 0);
-	if (ret < 0)
-		sd_err("fail to set sha1, %s", path);
-
-	return ret;
-}
-
-static int get_object_path(uint64_t oid, uint32_t epoch, char *path,
-			   size_t size)
-{
-	if (default_exist(oid, 0)) {
-		snprintf(path, PATH_MAX, "%s/%016"PRIx64,
-			 md_get_object_dir(oid), oid);
+	if (default_exist(oid, ec_index)) {
+		get_store_path(oid, ec_index, path);
 	} else {
-		get_store_stale_path(oid, epoch, 0, path);
+		get_store_stale_path(oid, epoch, ec_index, path);
 		if (access(path, F_OK) < 0) {
 			if (errno == ENOENT)
 				return SD_RES_NO_OBJ;
@@ -475,62 +1176,509 @@ static int get_object_path(uint64_t oid, uint32_t epoch, char *path,
 	return SD_RES_SUCCESS;
 }
 
-int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+/*
+ * Bring the block digests of the object up to date, reading only the dirty
+ * blocks
+ */
+static int get_block_hash(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			  struct block_hash *bh)
 {
-	int ret;
-	void *buf;
-	struct siocb iocb = {};
-	uint32_t length;
-	bool is_readonly_obj = oid_is_readonly(oid);
+	uint64_t bsize = get_store_objsize(oid) / SD_BLOCK_HASH_NR;
+	uint64_t dirty, mtime, id = clock_get_time();
+	unsigned char *blks[SHA1_BATCH_NR], *digests[SHA1_BATCH_NR];
+	int nr = 0;
 	char path[PATH_MAX];
+	bool valid, in_wd;
+	struct stat st;
+	void *buf = NULL;
+	bool compressed;
+	int fd, dfd = -1, prio = -1, ret;
 
-	ret = get_object_path(oid, epoch, path, sizeof(path));
+	ret = get_object_path(oid, ec_index, epoch, path, sizeof(path));
 	if (ret != SD_RES_SUCCESS)
 		return ret;
+	in_wd = !strstr(path, "/.stale/");
 
-	if (is_readonly_obj) {
-		if (get_object_sha1(path, sha1) == 0) {
-			sd_debug("use cached sha1 digest %s",
-				 sha1_to_hex(sha1));
-			return SD_RES_SUCCESS;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return err_to_sderr(path, oid, errno);
+
+	valid = fgetxattr(fd, BHASH_NAME, bh, sizeof(*bh)) == sizeof(*bh);
+	if (fstat(fd, &st) < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+	if (in_wd)
+		dirty = bhash_track_start(oid, valid ? bh : NULL, mtime, id);
+	else if (valid && bh->mtime && bh->mtime == mtime)
+		dirty = 0;
+	else
+		dirty = BHASH_ALL_DIRTY;
+
+	if (!dirty)
+		goto out;
+
+	/* the digests are of the data, whatever the format of the replica */
+	compressed = compress_is_file(oid, fd);
+	/* only the scrub, the checks, the backups and recovery ask for them */
+	prio = background_begin();
+	if (!compressed)
+		dfd = background_open(oid, path, fd, 0, 0);
+	/* the dirty blocks are hashed SHA1_BATCH_NR at a time */
+	buf = xvalloc(bsize * SHA1_BATCH_NR);
+	for (int i = 0; i < SD_BLOCK_HASH_NR; i++) {
+		unsigned char *blk = (unsigned char *)buf + nr * bsize;
+
+		if (!(dirty & (UINT64_C(1) << i)))
+			goto next;
+		if (compressed) {
+			struct siocb iocb = {
+				.buf = blk,
+				.length = bsize,
+				.offset = i * bsize,
+			};
+
+			ret = compress_read(fd, oid, path, &iocb);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		} else if (obj_pread(dfd >= 0, dfd >= 0 ? dfd : fd, blk, bsize,
+				     i * bsize) != bsize) {
+			sd_err("failed to read %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+			goto out;
+		}
+		blks[nr] = blk;
+		digests[nr++] = bh->digests[i];
+next:
+		if (nr == SHA1_BATCH_NR || (nr && i == SD_BLOCK_HASH_NR - 1)) {
+			get_buffers_sha1(blks, bsize, digests, nr);
+			nr = 0;
 		}
 	}
+	sd_debug("rehashed blocks %016"PRIx64" of %"PRIx64, dirty, oid);
 
-	length = get_store_objsize(oid);
-	buf = valloc(length);
-	if (buf == NULL)
-		return SD_RES_NO_MEM;
+	bh->id = id;
+	bh->mtime = clock_get_time() - mtime > BHASH_MTIME_MARGIN ? mtime : 0;
+	if (fsetxattr(fd, BHASH_NAME, bh, sizeof(*bh), 0) < 0)
+		sd_debug("failed to save the block hashes of %s, %m", path);
+out:
+	if (dfd >= 0)
+		close(dfd);
+	background_end(prio);
+	free(buf);
+	close(fd);
+	return ret;
+}
 
-	iocb.epoch = epoch;
-	iocb.buf = buf;
-	iocb.length = length;
+#ifdef HAVE_COMPRESS
+static int default_read_compressed(uint64_t oid, uint32_t epoch, void **buf,
+				   uint32_t *len)
+{
+	char path[PATH_MAX];
+	int fd, ret;
 
-	ret = default_read_from_path(oid, path, &iocb);
-	if (ret != SD_RES_SUCCESS) {
-		free(buf);
+	ret = get_object_path(oid, 0, epoch, path, sizeof(path));
+	if (ret != SD_RES_SUCCESS)
 		return ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return err_to_sderr(path, oid, errno);
+
+	if (!compress_is_file(oid, fd)) {
+		ret = SD_RES_NO_SUPPORT;
+		goto out;
 	}
 
-	get_buffer_sha1(buf, length, sha1);
-	free(buf);
+	*len = compress_file_size(oid);
+	*buf = xvalloc(*len);
+	ret = compress_read_file(fd, oid, path, *buf);
+	if (ret != SD_RES_SUCCESS) {
+		free(*buf);
+		*buf = NULL;
+	}
+out:
+	close(fd);
+	return ret;
+}
+#endif
+
+int default_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *digests)
+{
+	struct block_hash bh;
+	int ret;
+
+	ret = get_block_hash(oid, 0, epoch, &bh);
+	if (ret == SD_RES_SUCCESS)
+		memcpy(digests, bh.digests, sizeof(bh.digests));
+	return ret;
+}
+
+int default_get_hash(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		     uint8_t *sha1)
+{
+	struct block_hash bh;
+	int ret;
+
+	ret = get_block_hash(oid, ec_index, epoch, &bh);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 
+	get_buffer_sha1((unsigned char *)bh.digests, sizeof(bh.digests), sha1);
 	sd_debug("the message digest of %"PRIx64" at epoch %d is %s", oid,
 		 epoch, sha1_to_hex(sha1));
 
-	if (is_readonly_obj)
-		set_object_sha1(path, sha1);
-
-	return ret;
+	return SD_RES_SUCCESS;
 }
 
 int default_purge_obj(void)
 {
 	uint32_t tgt_epoch = get_latest_epoch();
 
+	journal_checkpoint();
 	return for_each_object_in_wd(move_object_to_stale_dir, true,
 				     &tgt_epoch);
 }
 
+/*
+ * Both the epoch log and the object are stamped by the local clock, and a copy
+ * which is older than the epoch log has seen no write in the epoch.
+ */
+int default_check_unchanged(uint64_t oid, uint32_t epoch, bool stale)
+{
+	char path[PATH_MAX];
+	struct timespec since;
+	struct stat st;
+	int ret;
+
+	ret = epoch_log_mtime(epoch, &since);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (stale) {
+		ret = get_store_stale_path(oid, epoch, 0, path);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	} else if (default_exist(oid, 0))
+		get_store_path(oid, 0, path);
+	else
+		return SD_RES_NO_OBJ;
+
+	if (stat(path, &st) < 0)
+		return err_to_sderr(path, oid, errno);
+
+	if (st.st_mtim.tv_sec < since.tv_sec ||
+	    (st.st_mtim.tv_sec == since.tv_sec &&
+	     st.st_mtim.tv_nsec < since.tv_nsec))
+		return SD_RES_SUCCESS;
+
+	return SD_RES_STALE_OBJ;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Asynchronous peer I/O on top of the per-node io_uring.
+ *
+ * Reads and writes are submitted only if the object fd is already cached,
+ * because the main thread must not sleep on the path lookup and open().  Cold
+ * objects go to the worker threads, which populate the fd cache.  Object
+ * creation is a chain of openat, fallocate, write and renameat, each step of
+ * which is submitted from the completion of the previous one.
+ */
+enum aio_state {
+	AIO_RW,
+	AIO_CREATE_OPEN,
+	AIO_CREATE_PREALLOC,
+	AIO_CREATE_WRITE,
+	AIO_CREATE_RENAME,
+};
+
+struct plain_aio {
+	struct uring_iocb iocb;
+	struct request *req;
+	enum aio_state state;
+	struct md_fd *mfd;
+	int fd;
+	uint32_t done;
+	uint64_t start;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+};
+
+static void aio_complete(struct plain_aio *aio, int ret)
+{
+	struct request *req = aio->req;
+
+	if (aio->mfd) {
+		md_io_account(aio->path, req->rq.opcode != SD_OP_READ_PEER,
+			      aio->start);
+		md_put_fd(aio->mfd);
+	}
+
+	if (aio->fd >= 0) {
+		if (ret != SD_RES_SUCCESS && unlink(aio->tmp_path) != 0)
+			sd_err("failed to unlink %s: %m", aio->tmp_path);
+		close(aio->fd);
+	}
+
+	if (ret == SD_RES_SUCCESS && req->rq.opcode == SD_OP_READ_PEER) {
+		req->rp.data_length = req->rq.data_length;
+		req->rp.obj.slow = md_path_slow(aio->path);
+	}
+	if (req->rq.opcode == SD_OP_WRITE_PEER) {
+		bhash_track_write(req->rq.obj.oid, req->rq.obj.offset,
+				  req->rq.data_length);
+		rcache_invalidate(req->rq.obj.oid);
+	}
+	req->rp.result = ret;
+	latency_record(req->rq.opcode, SD_LAT_STORE, aio->start);
+	free(aio);
+
+	req->work.done(&req->work);
+}
+
+static int aio_err_to_sderr(struct plain_aio *aio, int res)
+{
+	struct sd_req *hdr = &aio->req->rq;
+
+	errno = -res;
+	sd_err("failed to %s object %"PRIx64", path=%s, offset=%"PRIu32
+	       ", size=%"PRIu32", state=%d, %m",
+	       hdr->opcode == SD_OP_READ_PEER ? "read" : "write",
+	       hdr->obj.oid, aio->path, hdr->obj.offset, hdr->data_length,
+	       aio->state);
+	return err_to_sderr(aio->path, hdr->obj.oid, -res);
+}
+
+/* Submit the rest of the data transfer */
+static int aio_submit_rw(struct plain_aio *aio)
+{
+	struct sd_req *hdr = &aio->req->rq;
+	int fd = aio->mfd ? aio->mfd->fd : aio->fd;
+
+	return uring_submit_rw(&aio->iocb, hdr->opcode != SD_OP_READ_PEER, fd,
+			       (char *)aio->req->data + aio->done,
+			       hdr->data_length - aio->done,
+			       hdr->obj.offset + aio->done);
+}
+
+static void aio_done(struct uring_iocb *iocb, int res)
+{
+	struct plain_aio *aio = container_of(iocb, struct plain_aio, iocb);
+	struct sd_req *hdr = &aio->req->rq;
+	uint64_t oid = hdr->obj.oid;
+
+	switch (aio->state) {
+	case AIO_CREATE_OPEN:
+		if (res == -EEXIST) {
+			/* See the comment in default_create_and_write() */
+			sd_debug("%s exists", aio->tmp_path);
+			aio_complete(aio, SD_RES_SUCCESS);
+			return;
+		}
+		if (res < 0)
+			goto err;
+		aio->fd = res;
+		if (oid_is_sparse(oid)) {
+			/* See default_create_and_write() */
+			if (xftruncate(aio->fd, get_store_objsize(oid)) < 0) {
+				res = -errno;
+				goto err;
+			}
+			aio->state = AIO_CREATE_WRITE;
+			if (aio_submit_rw(aio) < 0)
+				goto retry;
+			return;
+		}
+		aio->state = AIO_CREATE_PREALLOC;
+		if (uring_submit_fallocate(iocb, aio->fd,
+					   get_store_objsize(oid)) < 0)
+			goto retry;
+		return;
+	case AIO_CREATE_PREALLOC:
+		if (res == -EOPNOTSUPP || res == -ENOSYS) {
+			/* Same as prealloc(), fall back to ftruncate */
+			if (xftruncate(aio->fd, get_store_objsize(oid)) < 0) {
+				res = -errno;
+				goto err;
+			}
+		} else if (res < 0)
+			goto err;
+		aio->state = AIO_CREATE_WRITE;
+		if (aio_submit_rw(aio) < 0)
+			goto retry;
+		return;
+	case AIO_RW:
+	case AIO_CREATE_WRITE:
+		if (res < 0)
+			goto err;
+		if (res == 0 && hdr->opcode == SD_OP_READ_PEER)
+			/* Hit EOF, same as xpread() */
+			break;
+		if (unlikely(res == 0)) {
+			sd_err("no progress writing object %"PRIx64, oid);
+			goto retry;
+		}
+		aio->done += res;
+		if (aio->done < hdr->data_length) {
+			if (aio_submit_rw(aio) < 0)
+				goto retry;
+			return;
+		}
+		if (aio->state == AIO_RW)
+			break;
+		aio->state = AIO_CREATE_RENAME;
+		if (uring_submit_renameat(iocb, aio->tmp_path, aio->path) < 0)
+			goto retry;
+		return;
+	case AIO_CREATE_RENAME:
+		if (res < 0)
+			goto err;
+		md_invalidate_fd(oid);
+		md_manifest_log(aio->path, oid, hdr->obj.ec_index, true);
+		objlist_cache_insert(oid);
+		break;
+	}
+
+	aio_complete(aio, SD_RES_SUCCESS);
+	return;
+err:
+	aio_complete(aio, aio_err_to_sderr(aio, res));
+	return;
+retry:
+	/* make gateway try again */
+	aio_complete(aio, SD_RES_NETWORK_ERROR);
+}
+
+static struct plain_aio *alloc_aio(struct request *req, enum aio_state state)
+{
+	struct plain_aio *aio = xzalloc(sizeof(*aio));
+
+	aio->iocb.done = aio_done;
+	aio->req = req;
+	aio->state = state;
+	aio->fd = -1;
+	aio->start = clock_get_time();
+	get_store_path(req->rq.obj.oid, req->rq.obj.ec_index, aio->path);
+
+	return aio;
+}
+
+/* The ring can't bounce the unaligned edges of O_DIRECT, see dio_pwrite() */
+static bool aio_dio_aligned(struct request *req, const struct siocb *iocb)
+{
+	return !dio_supported(req->rq.obj.oid) ||
+		dio_aligned(iocb->buf, iocb->length, iocb->offset);
+}
+
+static bool queue_rw(struct request *req, const struct siocb *iocb)
+{
+	struct sd_req *hdr = &req->rq;
+	struct plain_aio *aio;
+	struct md_fd *mfd;
+
+	if (!aio_dio_aligned(req, iocb))
+		return false;
+
+	mfd = md_lookup_fd(hdr->obj.oid, iocb->ec_index,
+			   prepare_iocb(hdr->obj.oid, iocb, false));
+	if (!mfd)
+		return false;
+	/* compress_read() and compress_write() are synchronous */
+	if (mfd->compressed) {
+		md_put_fd(mfd);
+		return false;
+	}
+
+	aio = alloc_aio(req, AIO_RW);
+	aio->mfd = mfd;
+	if (aio_submit_rw(aio) < 0) {
+		md_put_fd(mfd);
+		free(aio);
+		return false;
+	}
+
+	return true;
+}
+
+static bool queue_create(struct request *req, const struct siocb *iocb)
+{
+	struct sd_req *hdr = &req->rq;
+	struct plain_aio *aio;
+
+	if (!aio_dio_aligned(req, iocb))
+		return false;
+
+	aio = alloc_aio(req, AIO_CREATE_OPEN);
+	get_store_tmp_path(hdr->obj.oid, iocb->ec_index, aio->tmp_path);
+	if (uring_submit_openat(&aio->iocb, aio->tmp_path,
+				prepare_iocb(hdr->obj.oid, iocb, true),
+				sd_def_fmode) < 0) {
+		free(aio);
+		return false;
+	}
+
+	return true;
+}
+
+static main_fn bool default_queue_request(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = {
+		.epoch = hdr->epoch,
+		.buf = req->data,
+		.length = hdr->data_length,
+		.offset = hdr->obj.offset,
+		.ec_index = hdr->obj.ec_index,
+		.copy_policy = hdr->obj.copy_policy,
+	};
+
+	if (!sys->backend_uring || sys->gateway_only || !uring_has_room())
+		return false;
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_PEER:
+		/* peer_read_obj() encodes the sparse reply */
+		if (hdr->flags & SD_FLAG_CMD_SPARSE)
+			return false;
+		/* default_read() keeps them out of the page cache */
+		if (hdr->flags & (SD_FLAG_CMD_BACKGROUND | SD_FLAG_CMD_RECOVERY))
+			return false;
+		if (rcache_lookup(hdr->obj.oid, &iocb)) {
+			req->rp.data_length = hdr->data_length;
+			req->rp.result = SD_RES_SUCCESS;
+			req->work.done(&req->work);
+			return true;
+		}
+		/* default_read() caches the blocks of the miss */
+		if (sys->rcache_size)
+			return false;
+		return queue_rw(req, &iocb);
+	case SD_OP_WRITE_PEER:
+		/* default_write() journals or group syncs it */
+		if (sys->journal || sys->md_group_sync ||
+		    dedup_covers_block(hdr->obj.oid, iocb.offset, iocb.length))
+			return false;
+		if (iocb.epoch < sys_epoch())
+			/* let default_write() reply SD_RES_OLD_NODE_VER */
+			return false;
+		return queue_rw(req, &iocb);
+	case SD_OP_CREATE_AND_WRITE_PEER:
+		if (!uring_fs_ops_enabled() ||
+		    (hdr->flags & SD_FLAG_CMD_COMPRESS) ||
+		    /* the pool takes fewer fs ops than the ring */
+		    pool_serves(hdr->obj.oid) ||
+		    dedup_covers_block(hdr->obj.oid, iocb.offset, iocb.length))
+			return false;
+		return queue_create(req, &iocb);
+	default:
+		return false;
+	}
+}
+#endif
+
 static struct store_driver plain_store = {
 	.id = PLAIN_STORE,
 	.name = "plain",
@@ -545,7 +1693,17 @@ static struct store_driver plain_store = {
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.get_hash = default_get_hash,
+	.get_block_hash = default_get_block_hash,
 	.purge_obj = default_purge_obj,
+	.check_unchanged = default_check_unchanged,
+	.discard = default_discard,
+	.copy = default_copy,
+#ifdef HAVE_COMPRESS
+	.read_compressed = default_read_compressed,
+#endif
+#ifdef HAVE_IO_URING
+	.queue_request = default_queue_request,
+#endif
 };
 
 add_store_driver(plain_store);
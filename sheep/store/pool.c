@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Pool of the preallocated object files
+ *
+ * The creation of an object opens a tmp file, allocates it, writes it and
+ * renames it, so a guest filling fresh space sequentially waits for the
+ * metadata of a new file every 4 MB.  With '-m pool=N', a background worker
+ * keeps empty files of the size of a data object, created and preallocated,
+ * in the .pool directory of each disk, and the creation claims one: the write
+ * lands in allocated space and a rename makes it the object.
+ *
+ * The data objects are sparse to keep the vdis thin provisioned, so the pool
+ * serves the sequential fills only, i.e. the creation of the data object next
+ * to the last one created of the same vdi, which will be written to the end
+ * anyway.  A pool holds POOL_MIN_FILES files at first, and doubles up to N
+ * whenever a claim finds it empty, so the space held back follows the rate
+ * of the fills.
+ */
+
+#include "sheep_priv.h"
+
+#define POOL_DIR ".pool"
+#define POOL_MIN_FILES 4
+#define POOL_NR_VIDS 256
+
+struct pool_file {
+	int fd;
+	uint64_t seq; /* name of the file in the pool directory */
+};
+
+struct object_pool {
+	struct list_node list;
+	char dir[PATH_MAX]; /* of the disk */
+	struct sd_mutex lock;
+	struct pool_file *files;
+	int nr, target;
+	bool refilling;
+	struct work work;
+};
+
+static LIST_HEAD(pool_list);
+static struct sd_mutex pool_list_lock = SD_MUTEX_INITIALIZER;
+static uint64_t pool_seq;
+/* vid << 32 | idx of the last data object created, by vid */
+static uint64_t last_create[POOL_NR_VIDS];
+
+/* An empty path, which no syscall finds, if the disk path is too long */
+static inline void get_pool_path(const struct object_pool *pool, uint64_t seq,
+				 char *path)
+{
+	if (unlikely(snprintf(path, PATH_MAX, "%s/"POOL_DIR"/%016"PRIx64,
+			      pool->dir, seq) >= PATH_MAX))
+		path[0] = '\0';
+}
+
+static void pool_drain(struct object_pool *pool)
+{
+	char path[PATH_MAX];
+
+	for (int i = 0; i < pool->nr; i++) {
+		get_pool_path(pool, pool->files[i].seq, path);
+		if (unlink(path) < 0)
+			sd_debug("failed to unlink %s, %m", path);
+		close(pool->files[i].fd);
+	}
+	pool->nr = 0;
+}
+
+static int pool_create_file(struct object_pool *pool, struct pool_file *pf)
+{
+	char path[PATH_MAX];
+	int flags = O_RDWR | O_CREAT | O_EXCL, fd;
+
+	/* O_DSYNC can't be set afterwards */
+	if (!sys->nosync)
+		flags |= O_DSYNC;
+
+	pf->seq = uatomic_add_return(&pool_seq, 1);
+	get_pool_path(pool, pf->seq, path);
+	fd = open(path, flags, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
+	if (prealloc(fd, SD_DATA_OBJ_SIZE) < 0) {
+		sd_err("failed to preallocate %s, %m", path);
+		unlink(path);
+		close(fd);
+		return -1;
+	}
+
+	pf->fd = fd;
+	return 0;
+}
+
+static void pool_refill_work(struct work *work)
+{
+	struct object_pool *pool = container_of(work, struct object_pool,
+						work);
+	char dir[PATH_MAX + 8];
+	struct pool_file pf;
+
+	/* the disk might be plugged after the start */
+	snprintf(dir, sizeof(dir), "%s/"POOL_DIR, pool->dir);
+	if (xmkdir(dir, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", dir);
+		return;
+	}
+
+	for (;;) {
+		sd_mutex_lock(&pool->lock);
+		if (!md_has_disk(pool->dir)) {
+			/* the disk is unplugged, give the space back */
+			pool_drain(pool);
+			sd_mutex_unlock(&pool->lock);
+			return;
+		}
+		if (pool->nr >= pool->target) {
+			sd_mutex_unlock(&pool->lock);
+			return;
+		}
+		sd_mutex_unlock(&pool->lock);
+
+		if (pool_create_file(pool, &pf) < 0)
+			return;
+
+		sd_mutex_lock(&pool->lock);
+		pool->files[pool->nr++] = pf;
+		sd_mutex_unlock(&pool->lock);
+	}
+}
+
+static void pool_refill_done(struct work *work)
+{
+	struct object_pool *pool = container_of(work, struct object_pool,
+						work);
+
+	sd_mutex_lock(&pool->lock);
+	pool->refilling = false;
+	sd_mutex_unlock(&pool->lock);
+}
+
+/* Called with pool->lock held */
+static void pool_kick_refill(struct object_pool *pool)
+{
+	if (pool->refilling || pool->nr > pool->target / 2)
+		return;
+
+	pool->refilling = true;
+	pool->work.fn = pool_refill_work;
+	pool->work.done = pool_refill_done;
+	queue_work(sys->pool_wqueue, &pool->work);
+}
+
+static struct object_pool *pool_lookup(const char *dir, size_t len)
+{
+	struct object_pool *pool;
+
+	sd_mutex_lock(&pool_list_lock);
+	list_for_each_entry(pool, &pool_list, list) {
+		if (strlen(pool->dir) == len && !strncmp(pool->dir, dir, len))
+			goto out;
+	}
+
+	pool = xzalloc(sizeof(*pool));
+	pstrcpy(pool->dir, min(len + 1, sizeof(pool->dir)), dir);
+	sd_init_mutex(&pool->lock);
+	pool->files = xcalloc(sys->md_pool, sizeof(*pool->files));
+	pool->target = min(POOL_MIN_FILES, sys->md_pool);
+	list_add_tail(&pool->list, &pool_list);
+out:
+	sd_mutex_unlock(&pool_list_lock);
+	return pool;
+}
+
+/* Whether the creation of the data object continues a sequential fill */
+static bool pool_sequential(uint64_t oid)
+{
+	uint32_t vid = oid_to_vid(oid);
+	uint64_t idx = data_oid_to_idx(oid);
+	uint64_t prev;
+
+	prev = uatomic_xchg(&last_create[vid % POOL_NR_VIDS],
+			    (uint64_t)vid << 32 | (uint32_t)idx);
+	return idx > 0 && prev == ((uint64_t)vid << 32 | (uint32_t)(idx - 1));
+}
+
+/* Whether the creation of the object might claim a file of the pool */
+bool pool_serves(uint64_t oid)
+{
+	return sys->md_pool && is_data_obj(oid) && !is_erasure_oid(oid) &&
+		get_store_objsize(oid) == SD_DATA_OBJ_SIZE;
+}
+
+/*
+ * Claim a preallocated file to create the object at path, whose path in the
+ * pool is returned in pool_path.  Return the fd, or -1 if the creation should
+ * take the usual way.
+ */
+int pool_claim(uint64_t oid, const char *path, char *pool_path)
+{
+	const char *slash = strrchr(path, '/');
+	struct object_pool *pool;
+	struct pool_file pf;
+
+	if (!pool_serves(oid) || !slash || !pool_sequential(oid))
+		return -1;
+
+	pool = pool_lookup(path, slash - path);
+	sd_mutex_lock(&pool->lock);
+	if (pool->nr == 0) {
+		/* the fills outrun the pool */
+		if (pool->target < sys->md_pool)
+			pool->target = min(pool->target * 2, sys->md_pool);
+		pool_kick_refill(pool);
+		sd_mutex_unlock(&pool->lock);
+		uatomic_inc(&sys->stat.pool.missed);
+		return -1;
+	}
+	pf = pool->files[--pool->nr];
+	pool_kick_refill(pool);
+	sd_mutex_unlock(&pool->lock);
+
+	uatomic_inc(&sys->stat.pool.claimed);
+	get_pool_path(pool, pf.seq, pool_path);
+	return pf.fd;
+}
+
+/* The files left by the last run might be partly written, drop them */
+static int pool_init_dir(const char *path)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s/"POOL_DIR, path);
+	if (rmdir_r(dir) < 0 && errno != ENOENT) {
+		sd_err("failed to remove %s, %m", dir);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+int pool_init(void)
+{
+	if (for_each_obj_path(pool_init_dir) != SD_RES_SUCCESS)
+		return -1;
+
+	sd_info("pool of up to %d preallocated object files per disk",
+		sys->md_pool);
+	return 0;
+}
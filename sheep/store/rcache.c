@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory cache of the objects read from the local disks
+ *
+ * With '-R cache=SIZE', the blocks of RCACHE_BLOCK_SIZE read by default_read()
+ * are kept in memory, so the objects read by many guests at once, like the
+ * golden images, the inodes and the btree nodes, are served without a disk
+ * I/O.  A read missing the cache reads the whole blocks around its range and
+ * caches them, except the long reads of the data objects, such as the ones of
+ * the recovery, which would only flush the blocks the guests read.  The reads
+ * of the stale objects aren't cached.
+ *
+ * The cache is split by the oid into RCACHE_NR_SHARDS shards, each with its
+ * lock, its LRU list of the blocks and an equal share of the size.  A change
+ * of an object file -- a write, a discard, and the creation, the removal or
+ * the rename which md_invalidate_fd() is told of -- drops the blocks of the
+ * object once it is done and bumps the generation of the shard, so a read
+ * missing the cache over the change doesn't cache what it read before it.
+ */
+
+#include "sheep_priv.h"
+
+#define RCACHE_BLOCK_SHIFT	16
+#define RCACHE_BLOCK_SIZE	(1U << RCACHE_BLOCK_SHIFT)
+#define RCACHE_NR_SHARDS	64
+#define RCACHE_HASH_BITS	8
+#define RCACHE_HASH_SIZE	(1 << RCACHE_HASH_BITS)
+#define RCACHE_MAX_FILL		(1024 * 1024) /* longest data read cached */
+#define RCACHE_MIN_SIZE		((uint64_t)RCACHE_NR_SHARDS * 16 * \
+				 RCACHE_BLOCK_SIZE)
+
+struct rcache_object {
+	uint64_t oid;
+	uint8_t ec_index;
+	struct hlist_node hash;
+	struct rb_root blocks;
+};
+
+struct rcache_block {
+	struct rcache_object *obj;
+	uint32_t idx; /* offset in the object >> RCACHE_BLOCK_SHIFT */
+	uint32_t len; /* short at the end of the object */
+	struct rb_node node;
+	struct list_node lru;
+	char data[];
+};
+
+struct rcache_shard {
+	struct sd_mutex lock;
+	struct hlist_head hash[RCACHE_HASH_SIZE];
+	struct list_head lru;
+	uint64_t size; /* bytes taken by the blocks */
+	/* bumped on every invalidation to catch the racy cache miss */
+	uint64_t gen;
+};
+
+static struct rcache_shard *rcache_shards;
+static uint64_t rcache_shard_size;
+
+static int block_cmp(const struct rcache_block *a,
+		     const struct rcache_block *b)
+{
+	return intcmp(a->idx, b->idx);
+}
+
+static inline struct rcache_shard *rcache_shard(uint64_t oid)
+{
+	return rcache_shards + sd_hash_oid(oid) % RCACHE_NR_SHARDS;
+}
+
+static inline struct hlist_head *rcache_hash_head(struct rcache_shard *shard,
+						  uint64_t oid)
+{
+	return shard->hash + hash_64(oid, RCACHE_HASH_BITS);
+}
+
+static inline size_t block_size(const struct rcache_block *b)
+{
+	return sizeof(*b) + b->len;
+}
+
+static struct rcache_object *find_object(struct rcache_shard *shard,
+					 uint64_t oid, uint8_t ec_index)
+{
+	struct rcache_object *obj;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(obj, node, rcache_hash_head(shard, oid), hash) {
+		if (obj->oid == oid && obj->ec_index == ec_index)
+			return obj;
+	}
+	return NULL;
+}
+
+static struct rcache_block *find_block(struct rcache_object *obj,
+				       uint32_t idx)
+{
+	struct rcache_block key = { .idx = idx };
+
+	return rb_search(&obj->blocks, &key, node, block_cmp);
+}
+
+/* Must be called with shard->lock held */
+static void drop_block(struct rcache_shard *shard, struct rcache_block *b)
+{
+	struct rcache_object *obj = b->obj;
+
+	rb_erase(&b->node, &obj->blocks);
+	list_del(&b->lru);
+	shard->size -= block_size(b);
+	uatomic_sub(&sys->stat.rc.cached, block_size(b));
+	free(b);
+
+	if (RB_EMPTY_ROOT(&obj->blocks)) {
+		hlist_del(&obj->hash);
+		free(obj);
+	}
+}
+
+/* Copy the range out of the cache, false unless all its blocks are cached */
+static bool rcache_copy(struct rcache_shard *shard, uint64_t oid,
+			const struct siocb *iocb)
+{
+	uint64_t start = iocb->offset, end = start + iocb->length;
+	uint64_t pos, off, len;
+	struct rcache_object *obj;
+	struct rcache_block *b;
+
+	obj = find_object(shard, oid, iocb->ec_index);
+	if (!obj || !iocb->length)
+		return false;
+
+	for (pos = start; pos < end; pos = round_down(pos, RCACHE_BLOCK_SIZE) +
+	     RCACHE_BLOCK_SIZE) {
+		b = find_block(obj, pos >> RCACHE_BLOCK_SHIFT);
+		if (!b || pos % RCACHE_BLOCK_SIZE >= b->len ||
+		    (b->len < RCACHE_BLOCK_SIZE &&
+		     end > round_down(pos, RCACHE_BLOCK_SIZE) + b->len))
+			return false;
+	}
+
+	for (pos = start; pos < end; pos += len) {
+		b = find_block(obj, pos >> RCACHE_BLOCK_SHIFT);
+		off = pos % RCACHE_BLOCK_SIZE;
+		len = min(end - pos, b->len - off);
+		memcpy((char *)iocb->buf + (pos - start), b->data + off, len);
+		list_move(&b->lru, &shard->lru);
+	}
+	return true;
+}
+
+/* Cache the blocks read, iocb being aligned to the blocks */
+static void rcache_fill(struct rcache_shard *shard, uint64_t oid,
+			const struct siocb *iocb, uint64_t gen)
+{
+	struct rcache_object *obj;
+	struct rcache_block *b;
+
+	sd_mutex_lock(&shard->lock);
+	/* the object has changed since it was read */
+	if (gen != shard->gen)
+		goto out;
+
+	obj = find_object(shard, oid, iocb->ec_index);
+	if (!obj) {
+		obj = xzalloc(sizeof(*obj));
+		obj->oid = oid;
+		obj->ec_index = iocb->ec_index;
+		INIT_RB_ROOT(&obj->blocks);
+		hlist_add_head(&obj->hash, rcache_hash_head(shard, oid));
+	}
+
+	for (uint32_t pos = 0; pos < iocb->length; pos += RCACHE_BLOCK_SIZE) {
+		uint32_t len = min(iocb->length - pos, RCACHE_BLOCK_SIZE);
+
+		b = xmalloc(sizeof(*b) + len);
+		b->obj = obj;
+		b->idx = (iocb->offset + pos) >> RCACHE_BLOCK_SHIFT;
+		b->len = len;
+		if (rb_insert(&obj->blocks, b, node, block_cmp)) {
+			/* cached by another read */
+			free(b);
+			continue;
+		}
+		memcpy(b->data, (char *)iocb->buf + pos, len);
+		list_add(&b->lru, &shard->lru);
+		shard->size += block_size(b);
+		uatomic_add(&sys->stat.rc.cached, block_size(b));
+	}
+
+	while (shard->size > rcache_shard_size) {
+		b = list_entry(shard->lru.n.prev, struct rcache_block, lru);
+		drop_block(shard, b);
+		uatomic_inc(&sys->stat.rc.evict);
+	}
+out:
+	sd_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Serve the read from the cache, for the callers which must not sleep.  Return
+ * false on a cache miss.
+ */
+bool rcache_lookup(uint64_t oid, const struct siocb *iocb)
+{
+	struct rcache_shard *shard;
+	bool hit;
+
+	if (!rcache_shards)
+		return false;
+
+	shard = rcache_shard(oid);
+	sd_mutex_lock(&shard->lock);
+	hit = rcache_copy(shard, oid, iocb);
+	sd_mutex_unlock(&shard->lock);
+	if (hit)
+		uatomic_inc(&sys->stat.rc.hit);
+	return hit;
+}
+
+/* Read the object through the cache, read_fn() reading it from the disk */
+int rcache_read(uint64_t oid, const struct siocb *iocb,
+		int (*read_fn)(uint64_t oid, const struct siocb *iocb))
+{
+	uint64_t end = (uint64_t)iocb->offset + iocb->length, size, gen;
+	struct rcache_shard *shard;
+	struct siocb around;
+	int ret;
+
+	if (!rcache_shards)
+		return read_fn(oid, iocb);
+
+	shard = rcache_shard(oid);
+	sd_mutex_lock(&shard->lock);
+	if (rcache_copy(shard, oid, iocb)) {
+		sd_mutex_unlock(&shard->lock);
+		uatomic_inc(&sys->stat.rc.hit);
+		return SD_RES_SUCCESS;
+	}
+	gen = shard->gen;
+	sd_mutex_unlock(&shard->lock);
+	uatomic_inc(&sys->stat.rc.miss);
+
+	size = get_store_objsize(oid);
+	if ((is_data_obj(oid) && iocb->length > RCACHE_MAX_FILL) ||
+	    !iocb->length || end > size)
+		return read_fn(oid, iocb);
+
+	around = *iocb;
+	around.offset = round_down(iocb->offset, RCACHE_BLOCK_SIZE);
+	around.length = min(round_up(end, RCACHE_BLOCK_SIZE), size) -
+		around.offset;
+	around.buf = xvalloc(around.length);
+	ret = read_fn(oid, &around);
+	if (ret == SD_RES_SUCCESS) {
+		memcpy(iocb->buf, (char *)around.buf +
+		       (iocb->offset - around.offset), iocb->length);
+		rcache_fill(shard, oid, &around, gen);
+	}
+	free(around.buf);
+	return ret;
+}
+
+/* Drop the blocks of the object once it has changed, of all the ec indexes */
+void rcache_invalidate(uint64_t oid)
+{
+	struct rcache_shard *shard;
+	struct rcache_object *obj;
+	struct rcache_block *b;
+	struct hlist_node *node;
+
+	if (!rcache_shards)
+		return;
+
+	shard = rcache_shard(oid);
+	sd_mutex_lock(&shard->lock);
+	shard->gen++;
+	hlist_for_each_entry(obj, node, rcache_hash_head(shard, oid), hash) {
+		if (obj->oid != oid)
+			continue;
+		/* the last block frees the object */
+		rb_for_each_entry(b, &obj->blocks, node) {
+			drop_block(shard, b);
+		}
+	}
+	sd_mutex_unlock(&shard->lock);
+}
+
+void rcache_purge(void)
+{
+	struct rcache_block *b;
+
+	if (!rcache_shards)
+		return;
+
+	for (int i = 0; i < RCACHE_NR_SHARDS; i++) {
+		struct rcache_shard *shard = rcache_shards + i;
+
+		sd_mutex_lock(&shard->lock);
+		shard->gen++;
+		list_for_each_entry(b, &shard->lru, lru) {
+			drop_block(shard, b);
+		}
+		sd_mutex_unlock(&shard->lock);
+	}
+}
+
+int rcache_init(void)
+{
+	struct rcache_shard *shards;
+
+	if (sys->rcache_size < RCACHE_MIN_SIZE) {
+		sd_err("the read cache needs %"PRIu64" MB at least",
+		       RCACHE_MIN_SIZE / 1024 / 1024);
+		return -1;
+	}
+
+	shards = xzalloc(sizeof(*shards) * RCACHE_NR_SHARDS);
+	for (int i = 0; i < RCACHE_NR_SHARDS; i++) {
+		sd_init_mutex(&shards[i].lock);
+		INIT_LIST_HEAD(&shards[i].lru);
+	}
+	rcache_shard_size = sys->rcache_size / RCACHE_NR_SHARDS;
+	rcache_shards = shards;
+
+	sd_info("caching %"PRIu64" MB of the local reads in memory",
+		sys->rcache_size / 1024 / 1024);
+	return 0;
+}
@@ -0,0 +1,987 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tree store: an object-aggregating backend store.
+ *
+ * Instead of one file per object, every disk of md holds one large pack file
+ * which is divided into chunks of TREE_CHUNK_SIZE, and an object occupies a
+ * contiguous run of chunks (an extent).  The oid -> extent mapping is kept in
+ * an index file that has one fixed-size record per chunk; the record of an
+ * extent lives at the slot of its first chunk.  So,
+ *
+ *  - starting up loads the index with sequential reads instead of scanning
+ *    directories with millions of files,
+ *  - writes to existing objects never touch filesystem metadata, and
+ *  - the record write is the commit point of object creation, removal and
+ *    stale moves.
+ *
+ * Records carry a sequence number and the newest one wins if a crash leaves
+ * two records for the same object.  Stale objects of the older epochs stay in
+ * the pack with a non-zero epoch in their records, which replace the .stale
+ * directory of the plain store.
+ *
+ * Layout on each disk:
+ *   $disk/.tree/pack   object data
+ *   $disk/.tree/index  array of struct tree_record
+ */
+
+#include <linux/falloc.h>
+
+#include "sheep_priv.h"
+
+#define TREE_DIR		".tree"
+#define TREE_CHUNK_SHIFT	20
+#define TREE_CHUNK_SIZE		(UINT64_C(1) << TREE_CHUNK_SHIFT) /* 1 MB */
+#define TREE_GROW_CHUNKS	1024 /* grow the pack 1 GB at a time */
+
+struct tree_record {
+	uint64_t oid;
+	uint64_t seq; /* 0 means a free slot */
+	uint32_t epoch; /* 0 for live objects, otherwise the stale epoch */
+	uint32_t size;
+	uint16_t nr_chunks;
+	uint8_t ec_index;
+	uint8_t reserved[5];
+};
+
+struct tree_disk;
+
+struct tree_obj {
+	struct rb_node rb;
+	struct tree_disk *disk;
+	uint64_t oid;
+	uint32_t epoch;
+	uint8_t ec_index;
+	uint64_t chunk;
+	uint16_t nr_chunks;
+	uint32_t size;
+	uint64_t seq;
+	refcnt_t refcnt;
+};
+
+struct tree_disk {
+	struct list_node list;
+	char path[PATH_MAX];
+	int pack_fd;
+	int index_fd;
+	struct sd_mutex lock; /* protects root */
+	struct rb_root root;
+	struct sd_mutex alloc_lock; /* protects the fields below */
+	unsigned long *bitmap; /* allocated chunks */
+	uint64_t nr_chunks; /* size of the pack in chunks */
+	uint64_t hint; /* where the next allocation starts */
+};
+
+static LIST_HEAD(tree_disks);
+static struct sd_mutex tree_disks_lock = SD_MUTEX_INITIALIZER;
+static uint64_t tree_seq;
+
+/* Replicated objects are indexed with SD_MAX_COPIES, same as md.c does */
+static inline uint8_t tree_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : SD_MAX_COPIES;
+}
+
+static int tree_obj_cmp(const struct tree_obj *a, const struct tree_obj *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret)
+		return ret;
+	ret = intcmp(a->ec_index, b->ec_index);
+	if (ret)
+		return ret;
+	return intcmp(a->epoch, b->epoch);
+}
+
+static int tree_err(const struct tree_disk *td, uint64_t oid, int err)
+{
+	char path[PATH_MAX + 32];
+
+	/* a path whose dirname is the disk, to let err_to_sderr() find it */
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, td->path, oid);
+	return err_to_sderr(path, oid, err);
+}
+
+static inline off_t chunk_offset(uint64_t chunk)
+{
+	return (off_t)chunk << TREE_CHUNK_SHIFT;
+}
+
+static int write_record(struct tree_disk *td, uint64_t chunk,
+			const struct tree_record *rec)
+{
+	ssize_t ret;
+
+	ret = xpwrite(td->index_fd, rec, sizeof(*rec), chunk * sizeof(*rec));
+	if (unlikely(ret != sizeof(*rec))) {
+		sd_err("failed to write the index of %s, %m", td->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int commit_obj(struct tree_obj *obj)
+{
+	struct tree_record rec = {
+		.oid = obj->oid,
+		.seq = obj->seq,
+		.epoch = obj->epoch,
+		.size = obj->size,
+		.nr_chunks = obj->nr_chunks,
+		.ec_index = obj->ec_index,
+	};
+
+	return write_record(obj->disk, obj->chunk, &rec);
+}
+
+static int clear_record(struct tree_disk *td, uint64_t chunk)
+{
+	struct tree_record rec = {};
+
+	return write_record(td, chunk, &rec);
+}
+
+static inline void mark_chunks(struct tree_disk *td, uint64_t chunk,
+			       uint16_t nr, bool used)
+{
+	for (uint64_t i = chunk; i < chunk + nr; i++) {
+		if (used)
+			set_bit(i, td->bitmap);
+		else
+			clear_bit(i, td->bitmap);
+	}
+}
+
+static void put_obj(struct tree_obj *obj)
+{
+	struct tree_disk *td = obj->disk;
+
+	if (refcount_dec(&obj->refcnt) > 0)
+		return;
+
+	/* The last user of an unlinked object frees its extent */
+	sd_mutex_lock(&td->alloc_lock);
+	mark_chunks(td, obj->chunk, obj->nr_chunks, false);
+	if (obj->chunk < td->hint)
+		td->hint = obj->chunk;
+	sd_mutex_unlock(&td->alloc_lock);
+	free(obj);
+}
+
+/* Must be called with td->lock held */
+static void unlink_obj(struct tree_obj *obj)
+{
+	rb_erase(&obj->rb, &obj->disk->root);
+	put_obj(obj);
+}
+
+static int grow_pack(struct tree_disk *td, uint64_t nr)
+{
+	uint64_t new_nr = td->nr_chunks + roundup(nr, TREE_GROW_CHUNKS);
+	struct tree_record *rec;
+
+	if (prealloc(td->pack_fd, chunk_offset(new_nr)) < 0) {
+		sd_err("failed to grow the pack of %s, %m", td->path);
+		return -1;
+	}
+	if (xftruncate(td->index_fd, new_nr * sizeof(*rec)) < 0) {
+		sd_err("failed to grow the index of %s, %m", td->path);
+		return -1;
+	}
+
+	td->bitmap = alloc_bitmap(td->bitmap, td->nr_chunks, new_nr);
+	td->nr_chunks = new_nr;
+	return 0;
+}
+
+/* Find nr free contiguous chunks, must be called with td->alloc_lock held */
+static int64_t alloc_chunks(struct tree_disk *td, uint16_t nr)
+{
+	uint64_t start = td->hint, next;
+
+	while (true) {
+		start = find_next_zero_bit(td->bitmap, td->nr_chunks, start);
+		if (start + nr > td->nr_chunks)
+			break;
+		next = find_next_bit(td->bitmap, start + nr, start);
+		if (next >= start + nr) {
+			mark_chunks(td, start, nr, true);
+			td->hint = start + nr;
+			return start;
+		}
+		start = next;
+	}
+
+	/* The end of the pack might be free, grow it from the first hole */
+	start = td->nr_chunks;
+	while (start > 0 && !test_bit(start - 1, td->bitmap))
+		start--;
+	if (grow_pack(td, start + nr - td->nr_chunks) < 0)
+		return -1;
+
+	mark_chunks(td, start, nr, true);
+	td->hint = start + nr;
+	return start;
+}
+
+static int load_index(struct tree_disk *td)
+{
+	struct tree_record *recs;
+	struct stat st;
+	uint64_t nr;
+	int ret = -1;
+
+	if (fstat(td->index_fd, &st) < 0) {
+		sd_err("failed to stat the index of %s, %m", td->path);
+		return -1;
+	}
+
+	nr = st.st_size / sizeof(*recs);
+	td->bitmap = alloc_bitmap(NULL, 0, nr);
+	td->nr_chunks = nr;
+	if (!nr)
+		return 0;
+
+	recs = xvalloc(nr * sizeof(*recs));
+	if (xpread(td->index_fd, recs, nr * sizeof(*recs), 0) !=
+	    nr * sizeof(*recs)) {
+		sd_err("failed to read the index of %s, %m", td->path);
+		goto out;
+	}
+
+	for (uint64_t i = 0; i < nr; i++) {
+		struct tree_record *rec = recs + i;
+		struct tree_obj *obj, *old;
+
+		if (!rec->seq)
+			continue;
+		if (unlikely(i + rec->nr_chunks > nr)) {
+			sd_err("broken record of %"PRIx64" at %"PRIu64" in %s",
+			       rec->oid, i, td->path);
+			continue;
+		}
+
+		obj = xzalloc(sizeof(*obj));
+		obj->disk = td;
+		obj->oid = rec->oid;
+		obj->epoch = rec->epoch;
+		obj->ec_index = rec->ec_index;
+		obj->chunk = i;
+		obj->nr_chunks = rec->nr_chunks;
+		obj->size = rec->size;
+		obj->seq = rec->seq;
+		refcount_set(&obj->refcnt, 1);
+		tree_seq = max(tree_seq, rec->seq);
+
+		old = rb_insert(&td->root, obj, rb, tree_obj_cmp);
+		if (old) {
+			/* We crashed in the middle of replacing the object */
+			struct tree_obj *victim = old->seq < obj->seq ?
+				old : obj;
+
+			sd_info("drop the old copy of %"PRIx64" in %s",
+				obj->oid, td->path);
+			clear_record(td, victim->chunk);
+			if (victim == old) {
+				rb_erase(&old->rb, &td->root);
+				mark_chunks(td, old->chunk, old->nr_chunks,
+					    false);
+				free(old);
+				rb_insert(&td->root, obj, rb, tree_obj_cmp);
+			} else {
+				free(obj);
+				continue;
+			}
+		}
+		mark_chunks(td, obj->chunk, obj->nr_chunks, true);
+	}
+	ret = 0;
+out:
+	free(recs);
+	return ret;
+}
+
+static void free_disk(struct tree_disk *td)
+{
+	rb_destroy(&td->root, struct tree_obj, rb);
+	if (td->pack_fd >= 0)
+		close(td->pack_fd);
+	if (td->index_fd >= 0)
+		close(td->index_fd);
+	free(td->bitmap);
+	free(td);
+}
+
+static struct tree_disk *open_disk(const char *path)
+{
+	struct tree_disk *td = xzalloc(sizeof(*td));
+	char p[PATH_MAX];
+	int flags = O_RDWR | O_CREAT;
+
+	pstrcpy(td->path, sizeof(td->path), path);
+	sd_init_mutex(&td->lock);
+	sd_init_mutex(&td->alloc_lock);
+	INIT_RB_ROOT(&td->root);
+	td->pack_fd = td->index_fd = -1;
+
+	snprintf(p, sizeof(p), "%s/" TREE_DIR, path);
+	if (xmkdir(p, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", p);
+		goto err;
+	}
+
+	snprintf(p, sizeof(p), "%s/" TREE_DIR "/pack", path);
+	td->pack_fd = open(p, flags | (sys->nosync ? 0 : O_DSYNC),
+			   sd_def_fmode);
+	if (td->pack_fd < 0) {
+		sd_err("failed to open %s, %m", p);
+		goto err;
+	}
+
+	snprintf(p, sizeof(p), "%s/" TREE_DIR "/index", path);
+	td->index_fd = open(p, flags | (sys->nosync ? 0 : O_DSYNC),
+			    sd_def_fmode);
+	if (td->index_fd < 0) {
+		sd_err("failed to open %s, %m", p);
+		goto err;
+	}
+
+	if (load_index(td) < 0)
+		goto err;
+
+	sd_info("%s, %zu objects, %"PRIu64" chunks", path, td->root.nr,
+		td->nr_chunks);
+	return td;
+err:
+	free_disk(td);
+	return NULL;
+}
+
+/* Get the tree of the disk at 'path', open it if this is the first access */
+static struct tree_disk *get_disk(const char *path)
+{
+	struct tree_disk *td;
+
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		if (!strcmp(td->path, path))
+			goto out;
+	}
+
+	td = open_disk(path);
+	if (td)
+		list_add_tail(&td->list, &tree_disks);
+out:
+	sd_mutex_unlock(&tree_disks_lock);
+	return td;
+}
+
+static struct tree_obj *disk_lookup(struct tree_disk *td, uint64_t oid,
+				    uint8_t ec_index, uint32_t epoch)
+{
+	struct tree_obj key = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.epoch = epoch,
+	}, *obj;
+
+	sd_mutex_lock(&td->lock);
+	obj = rb_search(&td->root, &key, rb, tree_obj_cmp);
+	if (obj)
+		refcount_inc(&obj->refcnt);
+	sd_mutex_unlock(&td->lock);
+
+	return obj;
+}
+
+/*
+ * Look up the object, the disk which md assigns to the oid first and then the
+ * others, because objects might be misplaced after the change of the disks.
+ * The returned object must be released by put_obj().
+ */
+static struct tree_obj *lookup_obj(uint64_t oid, uint8_t ec_index,
+				   uint32_t epoch)
+{
+	struct tree_disk *td, *home;
+	struct tree_obj *obj;
+
+	ec_index = tree_ec_index(oid, ec_index);
+	home = get_disk(md_get_object_dir(oid));
+	if (home) {
+		obj = disk_lookup(home, oid, ec_index, epoch);
+		if (obj)
+			return obj;
+	}
+
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		if (td == home || !md_has_disk(td->path))
+			continue;
+		obj = disk_lookup(td, oid, ec_index, epoch);
+		if (obj)
+			goto out;
+	}
+	obj = NULL;
+out:
+	sd_mutex_unlock(&tree_disks_lock);
+	return obj;
+}
+
+static int obj_io(struct tree_obj *obj, bool write, void *buf, uint32_t len,
+		  uint32_t offset)
+{
+	ssize_t size;
+	off_t off = chunk_offset(obj->chunk) + offset;
+
+	if (unlikely(offset + len > obj->size)) {
+		sd_err("out of range I/O to %"PRIx64", offset %"PRIu32
+		       ", length %"PRIu32, obj->oid, offset, len);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (write)
+		size = xpwrite(obj->disk->pack_fd, buf, len, off);
+	else
+		size = xpread(obj->disk->pack_fd, buf, len, off);
+	if (unlikely(size != len)) {
+		sd_err("failed to %s object %"PRIx64", offset %"PRIu32
+		       ", length %"PRIu32", %m", write ? "write" : "read",
+		       obj->oid, offset, len);
+		return tree_err(obj->disk, obj->oid, errno);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Zero the extent so that a reused one doesn't expose the old data.  Zeroing
+ * the range keeps the blocks allocated, so the following writes don't need
+ * to allocate them again.
+ */
+static int zero_extent(struct tree_obj *obj)
+{
+	int fd = obj->disk->pack_fd;
+	off_t off = chunk_offset(obj->chunk), len = chunk_offset(obj->nr_chunks);
+	void *zero;
+	int ret;
+
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off,
+		      len) == 0)
+		return 0;
+
+	zero = xvalloc(len);
+	memset(zero, 0, len);
+	ret = xpwrite(fd, zero, len, off) == len ? 0 : -1;
+	free(zero);
+
+	return ret;
+}
+
+/*
+ * Link the new object into the tree and drop the older object of the same key
+ * in any disk.
+ */
+static int link_obj(struct tree_obj *obj)
+{
+	struct tree_disk *td;
+	struct tree_obj *old;
+
+	if (commit_obj(obj) < 0)
+		return tree_err(obj->disk, obj->oid, errno);
+
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		sd_mutex_lock(&td->lock);
+		old = rb_search(&td->root, obj, rb, tree_obj_cmp);
+		if (old) {
+			clear_record(td, old->chunk);
+			unlink_obj(old);
+		}
+		if (td == obj->disk)
+			rb_insert(&td->root, obj, rb, tree_obj_cmp);
+		sd_mutex_unlock(&td->lock);
+	}
+	sd_mutex_unlock(&tree_disks_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+static struct tree_obj *alloc_obj(uint64_t oid, uint8_t ec_index,
+				  uint32_t epoch, int *ret)
+{
+	const char *path = md_get_object_dir(oid);
+	size_t size = get_store_objsize(oid);
+	struct tree_disk *td;
+	struct tree_obj *obj;
+	int64_t chunk;
+
+	td = get_disk(path);
+	if (!td) {
+		/* let md know that the disk is broken */
+		char p[PATH_MAX];
+
+		snprintf(p, sizeof(p), "%s/%016"PRIx64, path, oid);
+		*ret = err_to_sderr(p, oid, EIO);
+		return NULL;
+	}
+
+	obj = xzalloc(sizeof(*obj));
+	obj->disk = td;
+	obj->oid = oid;
+	obj->ec_index = tree_ec_index(oid, ec_index);
+	obj->epoch = epoch;
+	obj->size = size;
+	obj->nr_chunks = DIV_ROUND_UP(size, TREE_CHUNK_SIZE);
+	obj->seq = uatomic_add_return(&tree_seq, 1);
+	/* the reference of the tree and the one of the caller */
+	refcount_set(&obj->refcnt, 2);
+
+	sd_mutex_lock(&td->alloc_lock);
+	chunk = alloc_chunks(td, obj->nr_chunks);
+	sd_mutex_unlock(&td->alloc_lock);
+	if (chunk < 0) {
+		free(obj);
+		*ret = SD_RES_NO_SPACE;
+		return NULL;
+	}
+	obj->chunk = chunk;
+
+	if (zero_extent(obj) < 0) {
+		*ret = tree_err(td, oid, errno);
+		goto err;
+	}
+
+	return obj;
+err:
+	sd_mutex_lock(&td->alloc_lock);
+	mark_chunks(td, obj->chunk, obj->nr_chunks, false);
+	sd_mutex_unlock(&td->alloc_lock);
+	free(obj);
+	return NULL;
+}
+
+/* Free the extent of an object which has never been linked */
+static void discard_obj(struct tree_obj *obj)
+{
+	refcount_dec(&obj->refcnt);
+	put_obj(obj);
+}
+
+static int create_obj(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		      void *buf, uint32_t len, uint32_t offset)
+{
+	struct tree_obj *obj;
+	int ret;
+
+	obj = alloc_obj(oid, ec_index, epoch, &ret);
+	if (!obj)
+		return ret;
+
+	ret = obj_io(obj, true, buf, len, offset);
+	if (ret != SD_RES_SUCCESS) {
+		discard_obj(obj);
+		return ret;
+	}
+
+	ret = link_obj(obj);
+	if (ret != SD_RES_SUCCESS) {
+		discard_obj(obj);
+		return ret;
+	}
+	put_obj(obj);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Change the epoch of the live object, i.e. move it to or from the stale */
+static int restamp_obj(struct tree_obj *obj, uint32_t epoch)
+{
+	struct tree_disk *td = obj->disk;
+	struct tree_obj key = *obj, *old;
+	int ret = SD_RES_SUCCESS;
+
+	key.epoch = epoch;
+	key.seq = uatomic_add_return(&tree_seq, 1);
+
+	sd_mutex_lock(&td->lock);
+	/* someone might have replaced or removed it */
+	if (rb_search(&td->root, obj, rb, tree_obj_cmp) != obj)
+		goto out;
+
+	if (commit_obj(&key) < 0) {
+		ret = tree_err(td, obj->oid, errno);
+		goto out;
+	}
+
+	/* Drop the stale object of the same epoch if any */
+	old = rb_search(&td->root, &key, rb, tree_obj_cmp);
+	if (old) {
+		clear_record(td, old->chunk);
+		unlink_obj(old);
+	}
+
+	rb_erase(&obj->rb, &td->root);
+	obj->epoch = epoch;
+	obj->seq = key.seq;
+	rb_insert(&td->root, obj, rb, tree_obj_cmp);
+out:
+	sd_mutex_unlock(&td->lock);
+	return ret;
+}
+
+static int tree_open_disk(const char *path)
+{
+	return get_disk(path) ? SD_RES_SUCCESS : SD_RES_EIO;
+}
+
+int tree_init(void)
+{
+	struct tree_disk *td;
+	struct tree_obj *obj;
+	int ret;
+
+	sd_debug("use tree store driver");
+	ret = for_each_obj_path(tree_open_disk);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	list_for_each_entry(td, &tree_disks, list) {
+		rb_for_each_entry(obj, &td->root, rb) {
+			objlist_cache_insert(obj->oid);
+			if (is_vdi_obj(obj->oid))
+				atomic_set_bit(oid_to_vid(obj->oid),
+					       sys->vdi_inuse);
+		}
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+bool tree_exist(uint64_t oid, uint8_t ec_index)
+{
+	struct tree_obj *obj = lookup_obj(oid, ec_index, 0);
+
+	if (!obj)
+		return false;
+
+	put_obj(obj);
+	return true;
+}
+
+int tree_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	int ret;
+
+	sd_debug("%"PRIx64, oid);
+	ret = create_obj(oid, iocb->ec_index, 0, iocb->buf, iocb->length,
+			 iocb->offset);
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+
+	return ret;
+}
+
+int tree_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct tree_obj *obj;
+	int ret;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	obj = lookup_obj(oid, iocb->ec_index, 0);
+	if (!obj)
+		return SD_RES_NO_OBJ;
+
+	ret = obj_io(obj, true, iocb->buf, iocb->length, iocb->offset);
+	put_obj(obj);
+
+	return ret;
+}
+
+int tree_read(uint64_t oid, const struct siocb *iocb)
+{
+	struct tree_obj *obj;
+	int ret;
+
+	obj = lookup_obj(oid, iocb->ec_index, 0);
+
+	/*
+	 * If the request is against the older epoch, try to read from
+	 * the stale objects
+	 */
+	if (!obj && iocb->epoch > 0 && iocb->epoch <= sys_epoch())
+		obj = lookup_obj(oid, iocb->ec_index, iocb->epoch);
+	if (!obj)
+		return SD_RES_NO_OBJ;
+
+	ret = obj_io(obj, false, iocb->buf, iocb->length, iocb->offset);
+	put_obj(obj);
+
+	return ret;
+}
+
+static int copy_obj(struct tree_obj *src, uint32_t epoch)
+{
+	void *buf = xvalloc(src->size);
+	int ret;
+
+	ret = obj_io(src, false, buf, src->size, 0);
+	if (ret == SD_RES_SUCCESS)
+		ret = create_obj(src->oid, src->ec_index, epoch, buf,
+				 src->size, 0);
+	free(buf);
+
+	return ret;
+}
+
+int tree_link(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch)
+{
+	struct tree_obj *stale;
+	int ret;
+
+	sd_debug("try link %"PRIx64" from snapshot with epoch %d", oid,
+		 tgt_epoch);
+
+	/*
+	 * Recovery thread and main thread might try to recover the same
+	 * object, so it is fine if the object already exists.
+	 */
+	if (tree_exist(oid, ec_index))
+		return SD_RES_SUCCESS;
+
+	stale = lookup_obj(oid, ec_index, tgt_epoch);
+	if (!stale)
+		return SD_RES_NO_OBJ;
+
+	ret = copy_obj(stale, 0);
+	put_obj(stale);
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+
+	return ret;
+}
+
+/*
+ * For replicated object, if any of the replica belongs to this node, we
+ * consider it not stale.  Erasure coded objects are stale if this node
+ * doesn't hold the strip of the same index any more.
+ */
+static bool tree_obj_stale(const struct tree_obj *obj,
+			   struct vnode_info *vinfo)
+{
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	int nr_copies = get_obj_copy_number(obj->oid, vinfo->nr_zones);
+
+	vinfo_oid_to_vnodes(vinfo, obj->oid, nr_copies, obj_vnodes);
+	for (int i = 0; i < nr_copies; i++) {
+		if (!vnode_is_local(obj_vnodes[i]))
+			continue;
+		if (obj->ec_index < SD_MAX_COPIES)
+			return i != obj->ec_index;
+		return false;
+	}
+
+	return true;
+}
+
+/* Move the live objects which satisfy 'stale' to the stale ones of epoch */
+static int move_to_stale(uint32_t epoch,
+			 bool (*stale)(const struct tree_obj *,
+				       struct vnode_info *))
+{
+	struct vnode_info *vinfo = get_vnode_info();
+	struct tree_disk *td;
+	struct tree_obj *obj, **objs;
+	size_t nr, i;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		if (!md_has_disk(td->path))
+			continue;
+
+		/* Restamping reorders the tree, so pick the victims first */
+		sd_mutex_lock(&td->lock);
+		objs = xmalloc(sizeof(*objs) * (td->root.nr + 1));
+		nr = 0;
+		rb_for_each_entry(obj, &td->root, rb) {
+			if (obj->epoch || (stale && !stale(obj, vinfo)))
+				continue;
+			refcount_inc(&obj->refcnt);
+			objs[nr++] = obj;
+		}
+		sd_mutex_unlock(&td->lock);
+
+		for (i = 0; i < nr; i++) {
+			obj = objs[i];
+			if (ret == SD_RES_SUCCESS) {
+				ret = restamp_obj(obj, epoch);
+				if (ret == SD_RES_SUCCESS) {
+					objlist_migrate_cache_insert(obj->oid);
+					sd_debug("moved object %"PRIx64,
+						 obj->oid);
+				}
+			}
+			put_obj(obj);
+		}
+		free(objs);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	sd_mutex_unlock(&tree_disks_lock);
+	put_vnode_info(vinfo);
+	return ret;
+}
+
+int tree_update_epoch(uint32_t epoch)
+{
+	sd_assert(epoch);
+	return move_to_stale(epoch, tree_obj_stale);
+}
+
+int tree_purge_obj(void)
+{
+	return move_to_stale(get_latest_epoch(), NULL);
+}
+
+int tree_cleanup(void)
+{
+	struct tree_disk *td;
+	struct tree_obj *obj;
+	int ret = SD_RES_SUCCESS;
+
+	objlist_migrate_cache_retire();
+
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		sd_mutex_lock(&td->lock);
+		rb_for_each_entry(obj, &td->root, rb) {
+			if (!obj->epoch)
+				continue;
+			if (clear_record(td, obj->chunk) < 0) {
+				ret = tree_err(td, obj->oid, errno);
+				break;
+			}
+			unlink_obj(obj);
+		}
+		sd_mutex_unlock(&td->lock);
+	}
+	sd_mutex_unlock(&tree_disks_lock);
+
+	return ret;
+}
+
+static int tree_purge_disk(const char *path)
+{
+	if (purge_directory(path) < 0)
+		return SD_RES_EIO;
+
+	return SD_RES_SUCCESS;
+}
+
+int tree_format(void)
+{
+	struct tree_disk *td;
+
+	sd_debug("try get a clean store");
+	sd_mutex_lock(&tree_disks_lock);
+	list_for_each_entry(td, &tree_disks, list) {
+		list_del(&td->list);
+		free_disk(td);
+	}
+	sd_mutex_unlock(&tree_disks_lock);
+
+	uatomic_set(&tree_seq, 0);
+
+	if (for_each_obj_path(tree_purge_disk) != SD_RES_SUCCESS)
+		return SD_RES_EIO;
+
+	if (sys->enable_object_cache)
+		object_cache_format();
+
+	return for_each_obj_path(tree_open_disk);
+}
+
+int tree_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	struct tree_obj *obj = lookup_obj(oid, ec_index, 0);
+	struct tree_disk *td;
+	int ret = SD_RES_SUCCESS;
+
+	if (!obj)
+		return SD_RES_NO_OBJ;
+
+	td = obj->disk;
+	sd_mutex_lock(&td->lock);
+	/* someone might have replaced or removed it */
+	if (rb_search(&td->root, obj, rb, tree_obj_cmp) != obj)
+		goto out;
+	if (clear_record(td, obj->chunk) < 0) {
+		ret = tree_err(td, oid, errno);
+		goto out;
+	}
+	unlink_obj(obj);
+out:
+	sd_mutex_unlock(&td->lock);
+	put_obj(obj);
+	return ret;
+}
+
+int tree_get_hash(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		  uint8_t *sha1)
+{
+	struct tree_obj *obj;
+	void *buf;
+	int ret;
+
+	obj = lookup_obj(oid, ec_index, 0);
+	if (!obj && epoch)
+		obj = lookup_obj(oid, ec_index, epoch);
+	if (!obj)
+		return SD_RES_NO_OBJ;
+
+	buf = xvalloc(obj->size);
+	ret = obj_io(obj, false, buf, obj->size, 0);
+	if (ret == SD_RES_SUCCESS) {
+		get_buffer_sha1(buf, obj->size, sha1);
+		sd_debug("the message digest of %"PRIx64" at epoch %d is %s",
+			 oid, epoch, sha1_to_hex(sha1));
+	}
+	free(buf);
+	put_obj(obj);
+
+	return ret;
+}
+
+static struct store_driver tree_store = {
+	.id = TREE_STORE,
+	.name = "tree",
+	.init = tree_init,
+	.exist = tree_exist,
+	.create_and_write = tree_create_and_write,
+	.write = tree_write,
+	.read = tree_read,
+	.link = tree_link,
+	.update_epoch = tree_update_epoch,
+	.cleanup = tree_cleanup,
+	.format = tree_format,
+	.remove_object = tree_remove_object,
+	.get_hash = tree_get_hash,
+	.purge_obj = tree_purge_obj,
+};
+
+add_store_driver(tree_store);
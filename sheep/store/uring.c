@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-node io_uring for the backend store.
+ *
+ * The ring is owned by the main thread: SQEs are only queued from the main
+ * thread and completions are reaped by the event loop through an eventfd
+ * registered with the ring, so no locking is needed here.  Every completion
+ * invokes the callback of its uring_iocb in the main thread.
+ */
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+/* linux/fs.h has its own definition */
+#undef BLOCK_SIZE
+
+#include "sheep_priv.h"
+
+#define URING_ENTRIES 1024
+
+static struct uring {
+	int fd;
+	int efd;
+
+	/* submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+
+	unsigned nr_inflight;
+	unsigned max_inflight;
+	bool fs_ops; /* openat, fallocate and renameat are supported */
+} ring = {
+	.fd = -1,
+	.efd = -1,
+};
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit,
+				 unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned opcode, void *arg,
+				    unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline bool uring_enabled(void)
+{
+	return ring.fd >= 0;
+}
+
+bool uring_fs_ops_enabled(void)
+{
+	return uring_enabled() && ring.fs_ops;
+}
+
+/* Return true if the ring can take a new request without overflowing CQ */
+bool uring_has_room(void)
+{
+	return uring_enabled() && ring.nr_inflight < ring.max_inflight;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+	unsigned head = uatomic_read(ring.sq_head), tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (unlikely(tail - head > *ring.sq_mask))
+		return NULL;
+
+	sqe = ring.sqes + (tail & *ring.sq_mask);
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	return sqe;
+}
+
+static int submit_sqe(struct io_uring_sqe *sqe, struct uring_iocb *iocb)
+{
+	int ret;
+
+	sqe->user_data = (uintptr_t)iocb;
+
+	/* make the sqe visible before the tail update */
+	cmm_smp_wmb();
+	uatomic_set(ring.sq_tail, *ring.sq_tail + 1);
+
+	do {
+		ret = io_uring_enter(ring.fd, 1, 0, 0);
+	} while (unlikely(ret < 0 && (errno == EINTR || errno == EAGAIN)));
+
+	if (unlikely(ret < 0)) {
+		sd_err("io_uring_enter failed, %m");
+		return -1;
+	}
+
+	ring.nr_inflight++;
+	return 0;
+}
+
+/*
+ * Helpers to submit one operation.  They return -1 if the operation can't be
+ * queued, in which case the callback of iocb will never be called.
+ */
+int uring_submit_rw(struct uring_iocb *iocb, bool write, int fd, void *buf,
+		    uint32_t len, uint64_t offset)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (unlikely(!sqe))
+		return -1;
+
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+
+	return submit_sqe(sqe, iocb);
+}
+
+int uring_submit_openat(struct uring_iocb *iocb, const char *path, int flags,
+			mode_t mode)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (unlikely(!sqe))
+		return -1;
+
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+
+	return submit_sqe(sqe, iocb);
+}
+
+int uring_submit_fallocate(struct uring_iocb *iocb, int fd, uint64_t len)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (unlikely(!sqe))
+		return -1;
+
+	sqe->opcode = IORING_OP_FALLOCATE;
+	sqe->fd = fd;
+	sqe->off = 0;
+	sqe->addr = len;
+	sqe->len = 0; /* mode */
+
+	return submit_sqe(sqe, iocb);
+}
+
+int uring_submit_renameat(struct uring_iocb *iocb, const char *old,
+			  const char *new)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	if (unlikely(!sqe))
+		return -1;
+
+	sqe->opcode = IORING_OP_RENAMEAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t)old;
+	sqe->len = AT_FDCWD;
+	sqe->addr2 = (uintptr_t)new;
+	sqe->rename_flags = 0;
+
+	return submit_sqe(sqe, iocb);
+}
+
+static void uring_handler(int fd, int events, void *data)
+{
+	struct io_uring_cqe *cqe;
+	struct uring_iocb *iocb;
+	unsigned head;
+
+	eventfd_xread(ring.efd);
+
+	head = *ring.cq_head;
+	while (head != uatomic_read(ring.cq_tail)) {
+		/* read the cqe after loading the tail */
+		cmm_smp_rmb();
+		cqe = ring.cqes + (head & *ring.cq_mask);
+		iocb = (struct uring_iocb *)(uintptr_t)cqe->user_data;
+		head++;
+		uatomic_set(ring.cq_head, head);
+		ring.nr_inflight--;
+
+		/* The callback may queue the next operation of the request */
+		iocb->done(iocb, cqe->res);
+		head = *ring.cq_head;
+	}
+}
+
+static bool probe_fs_ops(void)
+{
+	static const uint8_t ops[] = {
+		IORING_OP_OPENAT, IORING_OP_FALLOCATE, IORING_OP_RENAMEAT,
+	};
+	size_t len = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = xzalloc(len);
+	bool ret = false;
+
+	if (io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe,
+			      IORING_OP_LAST) < 0)
+		goto out;
+
+	for (int i = 0; i < ARRAY_SIZE(ops); i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			goto out;
+	}
+	ret = true;
+out:
+	free(probe);
+	return ret;
+}
+
+int uring_init(void)
+{
+	struct io_uring_params p = {};
+	void *sqes;
+
+	ring.fd = io_uring_setup(URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		sd_err("failed to setup io_uring, %m");
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		sd_err("io_uring of this kernel is too old");
+		goto err;
+	}
+
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sq_len = ring.cq_len = max(ring.sq_len, ring.cq_len);
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring.fd,
+			   IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		sd_err("failed to map io_uring, %m");
+		goto err;
+	}
+	ring.cq_ptr = ring.sq_ptr;
+
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sd_err("failed to map io_uring sqes, %m");
+		munmap(ring.sq_ptr, ring.sq_len);
+		goto err;
+	}
+	ring.sqes = sqes;
+
+	ring.sq_head = (void *)((char *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (void *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (void *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (void *)((char *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (void *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (void *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (void *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (void *)((char *)ring.cq_ptr + p.cq_off.cqes);
+	ring.max_inflight = p.cq_entries;
+
+	ring.efd = eventfd(0, EFD_NONBLOCK);
+	if (ring.efd < 0) {
+		sd_err("failed to create an eventfd, %m");
+		goto err_unmap;
+	}
+
+	if (io_uring_register(ring.fd, IORING_REGISTER_EVENTFD, &ring.efd,
+			      1) < 0) {
+		sd_err("failed to register eventfd to io_uring, %m");
+		goto err_efd;
+	}
+
+	if (register_event(ring.efd, uring_handler, NULL) < 0) {
+		sd_err("failed to register io_uring event handler");
+		goto err_efd;
+	}
+
+	ring.fs_ops = probe_fs_ops();
+	sd_info("io_uring backend enabled, %u entries%s", p.sq_entries,
+		ring.fs_ops ? "" : ", object creation uses worker threads");
+	return 0;
+err_efd:
+	close(ring.efd);
+	ring.efd = -1;
+err_unmap:
+	munmap(ring.sqes, ring.sqes_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+err:
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
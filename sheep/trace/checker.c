@@ -9,30 +9,41 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/resource.h>
+
 #include "sheep_priv.h"
 #include "trace/trace.h"
 
 #define MAX_EVENT_DURATION 1000 /* us */
-static int event_handler_depth = -1;
-static uint64_t start_time;
+#define MAX_BLOCK_DURATION 1000 /* us off the cpu */
 
-static void event_handler_enter(const struct caller *this_fn, int depth)
-{
-	if (!is_main_thread())
-		return;
+/* The main thread and each reactor run their own event loop */
+static __thread int event_handler_depth = -1;
+static __thread uint64_t start_time;
 
+/* Whether this_fn is called by the event loop, i.e. is a handler */
+static bool is_event_handler(const struct caller *this_fn, int depth)
+{
 	if (event_handler_depth < 0) {
 		if (strcmp(this_fn->name, "do_event_loop") == 0)
 			event_handler_depth = depth + 1;
 	}
 
-	if (depth == event_handler_depth)
+	return depth == event_handler_depth;
+}
+
+static void event_handler_enter(const struct caller *this_fn, int depth)
+{
+	if (is_worker_thread())
+		return;
+
+	if (is_event_handler(this_fn, depth))
 		start_time = clock_get_time();
 }
 
 static void event_handler_exit(const struct caller *this_fn, int depth)
 {
-	if (!is_main_thread())
+	if (is_worker_thread())
 		return;
 
 	if (depth == event_handler_depth) {
@@ -54,6 +65,61 @@ static struct tracer loop_checker = {
 
 tracer_register(loop_checker);
 
+/*
+ * The handlers of the main loop which sleep in the kernel, i.e. make blocking
+ * syscalls, as the voluntary context switches and the time off the cpu tell
+ */
+static uint64_t block_start, block_cpu;
+static long block_nvcsw;
+
+static uint64_t thread_cpu_time(long *nvcsw)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	*nvcsw = ru.ru_nvcsw;
+	return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+		1000000000 + ((uint64_t)ru.ru_utime.tv_usec +
+			      ru.ru_stime.tv_usec) * 1000;
+}
+
+static void block_check_enter(const struct caller *this_fn, int depth)
+{
+	if (!is_main_thread() || !is_event_handler(this_fn, depth))
+		return;
+
+	block_cpu = thread_cpu_time(&block_nvcsw);
+	block_start = clock_get_time();
+}
+
+static void block_check_exit(const struct caller *this_fn, int depth)
+{
+	uint64_t wall, cpu;
+	long nvcsw;
+
+	if (!is_main_thread() || depth != event_handler_depth ||
+	    !block_start)
+		return;
+
+	wall = clock_get_time() - block_start;
+	cpu = thread_cpu_time(&nvcsw) - block_cpu;
+	block_start = 0;
+	if (nvcsw > block_nvcsw && wall > cpu &&
+	    (wall - cpu) / 1000 > MAX_BLOCK_DURATION)
+		sd_warn("%s blocked the main thread for %"PRIu64" us, %ld "
+			"voluntary switches", this_fn->name,
+			(wall - cpu) / 1000, nvcsw - block_nvcsw);
+}
+
+static struct tracer block_checker = {
+	.name = "block_checker",
+
+	.enter = block_check_enter,
+	.exit = block_check_exit,
+};
+
+tracer_register(block_checker);
+
 static void thread_check_enter(const struct caller *this_fn, int depth)
 {
 	if (strcmp(this_fn->section, MAIN_FN_SECTION) == 0) {
@@ -64,6 +130,12 @@ static void thread_check_enter(const struct caller *this_fn, int depth)
 		if (!is_worker_thread())
 			panic("%s must be called in worker thread",
 			      this_fn->name);
+	} else if (strcmp(this_fn->section, REACTOR_FN_SECTION) == 0) {
+		/* client connections are owned by reactors if there are any */
+		if (sys->nr_reactors ? !is_reactor_thread() :
+		    !is_main_thread())
+			panic("%s must be called in %s thread", this_fn->name,
+			      sys->nr_reactors ? "reactor" : "main");
 	}
 }
 
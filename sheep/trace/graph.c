@@ -53,3 +53,46 @@ static struct tracer graph_tracer = {
 };
 
 tracer_register(graph_tracer);
+
+/* The graph of one of sys->trace_sample requests, to be left enabled */
+static void sample_tracer_exit(const struct caller *this_fn, int depth)
+{
+	struct trace_graph_item trace = {
+		.depth = depth,
+		.type = TRACE_GRAPH_RETURN,
+		.entry_time = entry_time[depth],
+		.return_time = clock_get_time(),
+	};
+
+	pstrcpy(trace.fname, sizeof(trace.fname), this_fn->name);
+	get_thread_name(trace.tname);
+
+	trace_sample_push(&trace);
+}
+
+static void sample_tracer_enter(const struct caller *this_fn, int depth)
+{
+	struct trace_graph_item trace = {
+		.type = TRACE_GRAPH_ENTRY,
+		.depth = depth,
+		/* for the time window of the sample buffers */
+		.entry_time = clock_get_time(),
+	};
+
+	pstrcpy(trace.fname, sizeof(trace.fname), this_fn->name);
+	get_thread_name(trace.tname);
+
+	entry_time[depth] = trace.entry_time;
+
+	trace_sample_push(&trace);
+}
+
+static struct tracer sample_tracer = {
+	.name = "sample",
+
+	.enter = sample_tracer_enter,
+	.exit = sample_tracer_exit,
+	.sampled = true,
+};
+
+tracer_register(sample_tracer);
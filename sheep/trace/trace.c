@@ -29,12 +29,46 @@ static __thread struct {
 static struct caller *callers;
 static size_t nr_callers;
 
+/*
+ * The items of the unsampled tracers are buffered a cpu until they are read,
+ * at most TRACE_BUFFER_MAX bytes for each, so that a tracer left enabled can
+ * be streamed with 'dog trace dump -w'.  The items over the bound are dropped
+ * and counted in the status.
+ */
+#define TRACE_BUFFER_MAX (16 * 1024 * 1024)
+
 static struct strbuf *buffer;
 static struct sd_mutex *buffer_lock;
 static int nr_cpu;
+static uint64_t nr_dropped;
 
 static __thread bool in_trace;
 
+/*
+ * The sampled tracers, as the sample one, only trace one of sample_rate
+ * requests, so they can be left enabled.  While only they are enabled, a call
+ * out of a sampled request returns from trace_function_enter() before the
+ * lookup of the caller and the hook of the return.  The items of the sampled
+ * requests go to a ring a cpu which keeps the last TRACE_SAMPLE_RING ones,
+ * and the ones older than TRACE_SAMPLE_WINDOW are dropped when read.
+ */
+#define TRACE_SAMPLE_RATE 1000 /* by default */
+#define TRACE_SAMPLE_RING 4096
+#define TRACE_SAMPLE_WINDOW (600 * 1000000000ULL) /* ns */
+
+struct sample_ring {
+	struct sd_mutex lock;
+	uint32_t head; /* the oldest item */
+	uint32_t nr;
+	struct trace_graph_item items[TRACE_SAMPLE_RING];
+};
+
+static struct sample_ring *sample_rings;
+static int sample_rate;
+static uint64_t nr_sample_requests;
+static int nr_sampled_tracers, nr_unsampled_tracers;
+static __thread bool trace_sampled;
+
 union instruction {
 	unsigned char start[INSN_SIZE];
 	struct {
@@ -106,6 +140,10 @@ void trace_function_enter(unsigned long ip, unsigned long *ret_addr)
 	struct tracer *tracer;
 	const struct caller *caller;
 
+	if (!trace_sampled && !uatomic_read(&nr_unsampled_tracers))
+		/* out of a sampled request */
+		return;
+
 	if (in_trace)
 		/* don't trace while tracing */
 		return;
@@ -116,7 +154,8 @@ void trace_function_enter(unsigned long ip, unsigned long *ret_addr)
 	caller = trace_lookup_ip(ip);
 
 	list_for_each_entry(tracer, &tracers, list) {
-		if (tracer->enter && uatomic_is_true(&tracer->enabled)) {
+		if (tracer->enter && uatomic_is_true(&tracer->enabled) &&
+		    (trace_sampled || !tracer->sampled)) {
 			tracer->stack_depth++;
 			tracer->enter(caller, ret_stack_index);
 		}
@@ -142,7 +181,8 @@ unsigned long trace_function_exit(void)
 	ret_stack_index--;
 
 	list_for_each_entry(tracer, &tracers, list) {
-		if (tracer->exit && uatomic_is_true(&tracer->enabled)) {
+		if (tracer->exit && uatomic_is_true(&tracer->enabled) &&
+		    (trace_sampled || !tracer->sampled)) {
 			if (tracer->stack_depth == 0)
 				/*
 				 * The paird trace_function_enter() was not
@@ -198,6 +238,8 @@ int trace_enable(const char *name)
 	}
 
 	uatomic_set_true(&tracer->enabled);
+	uatomic_inc(tracer->sampled ? &nr_sampled_tracers :
+		    &nr_unsampled_tracers);
 
 	if (count_enabled_tracers() == 1) {
 		suspend_worker_threads();
@@ -222,6 +264,8 @@ int trace_disable(const char *name)
 	}
 
 	uatomic_set_false(&tracer->enabled);
+	uatomic_dec(tracer->sampled ? &nr_sampled_tracers :
+		    &nr_unsampled_tracers);
 	if (count_enabled_tracers() == 0) {
 		suspend_worker_threads();
 		nop_all_sites();
@@ -256,17 +300,45 @@ size_t trace_status(char *buf)
 		*p++ = '\n';
 	}
 
+	p += sprintf(p, "dropped\t%"PRIu64"\n", uatomic_read(&nr_dropped));
 	*p++ = '\0';
 
 	return p - buf;
 }
 
+/* Move the items of the ring not older than TRACE_SAMPLE_WINDOW to buf */
+static int sample_ring_pop(struct sample_ring *ring, char *buf, uint32_t len)
+{
+	uint64_t now = clock_get_time();
+	int count = 0;
+
+	sd_mutex_lock(&ring->lock);
+	while (ring->nr && len - count >= sizeof(ring->items[0])) {
+		const struct trace_graph_item *item = ring->items + ring->head;
+		uint64_t time = item->return_time ?: item->entry_time;
+
+		if (now - time < TRACE_SAMPLE_WINDOW) {
+			memcpy(buf + count, item, sizeof(*item));
+			count += sizeof(*item);
+		}
+		ring->head = (ring->head + 1) % TRACE_SAMPLE_RING;
+		ring->nr--;
+	}
+	sd_mutex_unlock(&ring->lock);
+
+	return count;
+}
+
 int trace_buffer_pop(void *buf, uint32_t len)
 {
-	int readin, count = 0, requested = len;
+	int readin, count = 0, requested;
 	char *buff = (char *)buf;
 	int i;
 
+	/* don't split an item */
+	len -= len % sizeof(struct trace_graph_item);
+	requested = len;
+
 	for (i = 0; i < nr_cpu; i++) {
 		sd_mutex_lock(&buffer_lock[i]);
 		readin = strbuf_stripout(&buffer[i], buff, len);
@@ -281,16 +353,57 @@ int trace_buffer_pop(void *buf, uint32_t len)
 		buff += readin;
 	}
 
+	for (i = 0; i < nr_cpu; i++) {
+		readin = sample_ring_pop(&sample_rings[i], buff, len);
+		count += readin;
+		len -= readin;
+		buff += readin;
+	}
+
 	return count;
 }
 
 void trace_buffer_push(int cpuid, struct trace_graph_item *item)
 {
 	sd_mutex_lock(&buffer_lock[cpuid]);
-	strbuf_add(&buffer[cpuid], item, sizeof(*item));
+	if (buffer[cpuid].len + sizeof(*item) <= TRACE_BUFFER_MAX)
+		strbuf_add(&buffer[cpuid], item, sizeof(*item));
+	else
+		uatomic_inc(&nr_dropped);
 	sd_mutex_unlock(&buffer_lock[cpuid]);
 }
 
+/* Trace the request processed by the thread if it is one to sample */
+__attribute__((no_instrument_function))
+void trace_sample_begin(void)
+{
+	if (!uatomic_read(&nr_sampled_tracers))
+		return;
+
+	if (uatomic_add_return(&nr_sample_requests, 1) % sample_rate == 0)
+		trace_sampled = true;
+}
+
+__attribute__((no_instrument_function))
+void trace_sample_end(void)
+{
+	trace_sampled = false;
+}
+
+void trace_sample_push(const struct trace_graph_item *item)
+{
+	struct sample_ring *ring = &sample_rings[sched_getcpu()];
+
+	sd_mutex_lock(&ring->lock);
+	ring->items[(ring->head + ring->nr) % TRACE_SAMPLE_RING] = *item;
+	if (ring->nr < TRACE_SAMPLE_RING)
+		ring->nr++;
+	else
+		/* overwrite the oldest one */
+		ring->head = (ring->head + 1) % TRACE_SAMPLE_RING;
+	sd_mutex_unlock(&ring->lock);
+}
+
 /* __fentry__ call should always be the first instruction */
 static unsigned long find_fentry_call(unsigned long entry_addr)
 {
@@ -416,6 +529,13 @@ int trace_init(void)
 		sd_init_mutex(&buffer_lock[i]);
 	}
 
+	sample_rings = xzalloc(sizeof(*sample_rings) * nr_cpu);
+	for (i = 0; i < nr_cpu; i++)
+		sd_init_mutex(&sample_rings[i].lock);
+	sample_rate = sys->trace_sample ?: TRACE_SAMPLE_RATE;
+	if (sys->trace_sample)
+		trace_enable("sample");
+
 	sd_info("trace support enabled. cpu count %d.", nr_cpu);
 	return 0;
 }
@@ -19,6 +19,7 @@ struct tracer {
 
 	void (*enter)(const struct caller *this_fn, int depth);
 	void (*exit)(const struct caller *this_fn, int depth);
+	bool sampled; /* only called in the sampled requests */
 
 	/* internal use only */
 	uatomic_bool enabled;
@@ -46,6 +47,9 @@ unsigned long trace_function_exit(void);
   size_t trace_status(char *buf);
   int trace_buffer_pop(void *buf, uint32_t len);
   void trace_buffer_push(int cpuid, struct trace_graph_item *item);
+  void trace_sample_begin(void);
+  void trace_sample_end(void);
+  void trace_sample_push(const struct trace_graph_item *item);
 
 #else
   static inline int trace_init(void) { return 0; }
@@ -55,6 +59,8 @@ unsigned long trace_function_exit(void);
   static inline int trace_buffer_pop(void *buf, uint32_t len) { return 0; }
   static inline void trace_buffer_push(
 	  int cpuid, struct trace_graph_item *item) { return; }
+  static inline void trace_sample_begin(void) {}
+  static inline void trace_sample_end(void) {}
 
 #endif /* HAVE_TRACE */
 
@@ -11,14 +11,41 @@
 
 #include "sheep_priv.h"
 
+/* objects unref'ed in parallel by a deletion, by default */
+#define DELETE_WINDOW 32
+
 struct vdi_state_entry {
 	uint32_t vid;
 	bool snapshot;
+	bool inode_read; /* the fields below are valid */
+	uint8_t compress;
+	uint8_t hybrid;
+	uint8_t obj_shift; /* block_size_shift of the inode, 0 if unknown */
+	uint8_t stripe_shift;
+	uint8_t set_copies; /* 0 unless the copy number was changed, copy.c */
+	uint8_t old_copies; /* not 0 while the objects are converted */
+	bool header_read; /* the fields below are valid */
+	uint32_t snap_id;
+	uint64_t create_time;
+	uint64_t snap_ctime;
+	char name[SD_MAX_VDI_LEN];
+	char tag[SD_MAX_VDI_TAG_LEN];
+	bool objs_read; /* of a snapshot, the fields below are valid */
+	uint32_t parent_vdi_id;
+	uint64_t vdi_size;
+	uint64_t my_objs;
+	uint64_t cow_objs;
+	uint8_t nr_copies;
+	uint8_t copy_policy;
+	uint8_t store_policy;
+	uint8_t block_size_shift;
 	struct rb_node node;
 };
 
 static struct rb_root vdi_state_root = RB_ROOT;
 static struct sd_rw_lock vdi_state_lock = SD_RW_LOCK_INITIALIZER;
+/* bumped when a cached header turns stale, under vdi_state_lock */
+static uint64_t vdi_header_gen;
 
 /*
  * ec_max_data_strip represent max number of data strips in the cluster. When
@@ -95,8 +122,55 @@ bool oid_is_readonly(uint64_t oid)
 	return vid_is_snapshot(oid_to_vid(oid));
 }
 
+/*
+ * The copy number of vid and the one it is converted from, if it was changed
+ * by SD_OP_SET_VDI_COPY
+ */
+bool get_vdi_copies(uint32_t vid, int *nr_copies, int *old_nr_copies)
+{
+	struct vdi_state_entry *entry;
+	bool found;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	found = entry && entry->set_copies;
+	if (found) {
+		*nr_copies = entry->set_copies;
+		*old_nr_copies = entry->old_copies;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	return found;
+}
+
+void vdi_set_copies(uint32_t vid, uint8_t nr_copies, uint8_t old_nr_copies)
+{
+	struct vdi_state_entry *entry, *old;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+
+	sd_write_lock(&vdi_state_lock);
+	old = vdi_state_insert(&vdi_state_root, entry);
+	if (old) {
+		free(entry);
+		entry = old;
+	}
+	entry->set_copies = nr_copies;
+	entry->old_copies = old_nr_copies;
+	/* the cached header has the copy number of the inode */
+	entry->objs_read = false;
+	vdi_header_gen++;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
 int get_vdi_copy_number(uint32_t vid)
 {
+	int nr_copies, old_nr_copies;
+
+	/* the copies under both numbers are kept while they are converted */
+	if (get_vdi_copies(vid, &nr_copies, &old_nr_copies))
+		return max(nr_copies, old_nr_copies);
 	return sys->cinfo.nr_copies;
 }
 
@@ -105,14 +179,175 @@ int get_vdi_copy_policy(uint32_t vid)
 	return sys->cinfo.copy_policy;
 }
 
+/* the span of the inode from block_size_shift to stripe_shift */
+#define VDI_FLAGS_OFFSET offsetof(struct sd_inode, block_size_shift)
+#define VDI_FLAGS_SIZE (offsetof(struct sd_inode, stripe_shift) + 1 - \
+			VDI_FLAGS_OFFSET)
+
+/*
+ * Look up the compression, the hybrid flag, the data object size and the
+ * erasure stripe size of the vdi in its inode, once.  They never change for
+ * a vdi.
+ */
+static void get_vdi_flags(uint32_t vid, uint8_t *compress, uint8_t *hybrid,
+			  uint8_t *shift, uint8_t *stripe_shift)
+{
+	struct vdi_state_entry *entry, *old;
+	uint8_t flags[VDI_FLAGS_SIZE];
+	bool found;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	found = entry && entry->inode_read;
+	if (found) {
+		*compress = entry->compress;
+		*hybrid = entry->hybrid;
+		*shift = entry->obj_shift;
+		*stripe_shift = entry->stripe_shift;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+	if (found)
+		return;
+
+	*compress = SD_COMPRESS_NONE;
+	*hybrid = 0;
+	*shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	*stripe_shift = 0;
+	if (sd_read_object(vid_to_vdi_oid(vid), (char *)flags, sizeof(flags),
+			   VDI_FLAGS_OFFSET) != SD_RES_SUCCESS) {
+		sd_debug("failed to read the inode of %" PRIx32, vid);
+		return;
+	}
+#define VDI_FLAG(field) \
+	flags[offsetof(struct sd_inode, field) - VDI_FLAGS_OFFSET]
+	*compress = VDI_FLAG(compress);
+	*hybrid = VDI_FLAG(hybrid);
+	*shift = VDI_FLAG(block_size_shift);
+	*stripe_shift = VDI_FLAG(stripe_shift);
+#undef VDI_FLAG
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+	entry->inode_read = true;
+	entry->compress = *compress;
+	entry->hybrid = *hybrid;
+	entry->obj_shift = *shift;
+	entry->stripe_shift = *stripe_shift;
+
+	sd_write_lock(&vdi_state_lock);
+	old = vdi_state_insert(&vdi_state_root, entry);
+	if (old) {
+		free(entry);
+		old->inode_read = true;
+		old->compress = *compress;
+		old->hybrid = *hybrid;
+		old->obj_shift = *shift;
+		old->stripe_shift = *stripe_shift;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+bool vdi_is_compressed(uint32_t vid)
+{
+	uint8_t compress, hybrid, shift, stripe_shift;
+
+	get_vdi_flags(vid, &compress, &hybrid, &shift, &stripe_shift);
+	return compress != SD_COMPRESS_NONE;
+}
+
+bool vdi_is_hybrid(uint32_t vid)
+{
+	uint8_t compress, hybrid, shift, stripe_shift;
+
+	get_vdi_flags(vid, &compress, &hybrid, &shift, &stripe_shift);
+	return hybrid;
+}
+
+/* The shift of the size of the data objects of vid, see alloc_inode() */
+uint8_t get_vdi_block_size_shift(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+	uint8_t compress, hybrid, shift = 0, stripe_shift;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		shift = entry->obj_shift;
+	sd_rw_unlock(&vdi_state_lock);
+	if (shift)
+		return shift;
+
+	get_vdi_flags(vid, &compress, &hybrid, &shift, &stripe_shift);
+	return shift;
+}
+
+/* The size of the erasure stripes of the data objects of vid */
+uint32_t get_vdi_stripe_size(uint32_t vid)
+{
+	uint8_t compress, hybrid, shift, stripe_shift;
+
+	get_vdi_flags(vid, &compress, &hybrid, &shift, &stripe_shift);
+	return stripe_shift ? UINT32_C(1) << stripe_shift :
+		SD_EC_DATA_STRIPE_SIZE;
+}
+
+/*
+ * Tell the shift of vid known without reading the inode, for the callers in
+ * the main thread like the object cache loading its objects
+ */
+void vdi_set_block_size_shift(uint32_t vid, uint8_t shift)
+{
+	struct vdi_state_entry *entry, *old;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+
+	sd_write_lock(&vdi_state_lock);
+	old = vdi_state_insert(&vdi_state_root, entry);
+	if (old) {
+		free(entry);
+		entry = old;
+	}
+	entry->obj_shift = shift;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+/* The number of copies to ack a write after, 0 means all the copies */
+int get_vdi_write_quorum(uint32_t vid)
+{
+	return sys->write_quorum;
+}
+
 int get_obj_copy_number(uint64_t oid, int nr_zones)
 {
-	return min(get_vdi_copy_number(oid_to_vid(oid)), nr_zones);
+	int nr_copies = get_vdi_copy_number(oid_to_vid(oid)), nr_parity;
+
+	/* the hot form survives as many failures as the erasure code */
+	if (is_hot_obj(oid)) {
+		ec_policy_to_dp(get_vdi_copy_policy(oid_to_vid(oid)), NULL,
+				&nr_parity);
+		nr_copies = nr_parity + 1;
+	}
+	return min(nr_copies, nr_zones);
 }
 
 int get_req_copy_number(struct request *req)
 {
-	int nr_copies;
+	uint64_t oid = req->rq.obj.oid;
+	int nr_copies, old_nr_copies;
+
+	/*
+	 * The copy number of a converted vdi overrides the one of the client,
+	 * which may have read the inode before.  While the objects are
+	 * converted, the reads go to the copies under both numbers and the
+	 * others to the new ones, see copy.c.
+	 */
+	if (!is_hot_obj(oid) && !is_erasure_oid(oid) &&
+	    get_vdi_copies(oid_to_vid(oid), &nr_copies, &old_nr_copies)) {
+		if (old_nr_copies && req->rq.opcode == SD_OP_READ_OBJ)
+			nr_copies = min(nr_copies, old_nr_copies);
+		return min(nr_copies, req->vinfo->nr_zones);
+	}
 
 	nr_copies = min((int)req->rq.obj.copies, req->vinfo->nr_zones);
 	if (!nr_copies)
@@ -148,13 +383,110 @@ void vdi_delete_state(uint32_t vid)
 	struct vdi_state_entry *entry;
 
 	sd_debug("%"PRIx32, vid);
-	sd_read_lock(&vdi_state_lock);
+	sd_write_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
-	if (entry)
+	if (entry) {
 		rb_erase(&entry->node, &vdi_state_root);
+		free(entry);
+	}
+	vdi_header_gen++;
 	sd_rw_unlock(&vdi_state_lock);
 }
 
+/*
+ * The header of the inode of vid is written by a cluster operation, e.g. a
+ * new vdi takes the vid or a snapshot of the vdi is taken
+ */
+void vdi_invalidate_header(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+
+	sd_write_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry) {
+		entry->header_read = false;
+		entry->objs_read = false;
+	}
+	vdi_header_gen++;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+static void copy_header_from_state(struct sd_inode *inode,
+				   const struct vdi_state_entry *entry)
+{
+	memcpy(inode->name, entry->name, sizeof(inode->name));
+	memcpy(inode->tag, entry->tag, sizeof(inode->tag));
+	inode->vdi_id = entry->vid;
+	inode->snap_id = entry->snap_id;
+	inode->create_time = entry->create_time;
+	inode->snap_ctime = entry->snap_ctime;
+}
+
+static void copy_header_to_state(struct vdi_state_entry *entry,
+				 const struct sd_inode *inode)
+{
+	memcpy(entry->name, inode->name, sizeof(entry->name));
+	memcpy(entry->tag, inode->tag, sizeof(entry->tag));
+	entry->snap_id = inode->snap_id;
+	entry->create_time = inode->create_time;
+	entry->snap_ctime = inode->snap_ctime;
+	entry->header_read = true;
+}
+
+/*
+ * Read the fields of the inode header of vid which the lookups by name use,
+ * from the vdi state if use_cache and they are cached there, which cached
+ * tells.  The cluster operations which write the header invalidate it on all
+ * the nodes, so the lookups of a boot storm don't read the inodes over and
+ * over.
+ */
+static int read_vdi_header(uint32_t vid, struct sd_inode *inode,
+			   bool use_cache, bool *cached)
+{
+	struct vdi_state_entry *entry, *old;
+	uint64_t gen;
+	int ret;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (use_cache && entry && entry->header_read) {
+		copy_header_from_state(inode, entry);
+		sd_rw_unlock(&vdi_state_lock);
+		*cached = true;
+		return SD_RES_SUCCESS;
+	}
+	gen = vdi_header_gen;
+	sd_rw_unlock(&vdi_state_lock);
+
+	if (cached)
+		*cached = false;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+	copy_header_to_state(entry, inode);
+
+	sd_write_lock(&vdi_state_lock);
+	/* not if the header was invalidated while we read it */
+	if (gen != vdi_header_gen) {
+		sd_rw_unlock(&vdi_state_lock);
+		free(entry);
+		return SD_RES_SUCCESS;
+	}
+	old = vdi_state_insert(&vdi_state_root, entry);
+	if (old) {
+		free(entry);
+		copy_header_to_state(old, inode);
+	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	return SD_RES_SUCCESS;
+}
+
 static inline bool vdi_is_deleted(struct sd_inode *inode)
 {
 	return *inode->name == '\0';
@@ -184,12 +516,14 @@ out:
 	return ret;
 }
 
+/* base is the inode to share the data objects with, if any */
 static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 				    uint32_t new_snapid, uint32_t new_vid,
-				    uint32_t *data_vdi_id,
-				    struct generation_reference *gref)
+				    struct sd_inode *base)
 {
-	struct sd_inode *new = xzalloc(sizeof(*new));
+	uint32_t *data_vdi_id = base ? base->data_vdi_id : NULL;
+	struct generation_reference *gref = base ? base->gref : NULL;
+	struct sd_inode *new = xzalloc_tag(sizeof(*new), SD_MEM_INODE);
 
 	pstrcpy(new->name, sizeof(new->name), iocb->name);
 	new->vdi_id = new_vid;
@@ -198,9 +532,17 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	new->copy_policy = iocb->copy_policy;
 	new->store_policy = iocb->store_policy;
 	new->nr_copies = iocb->nr_copies;
-	new->block_size_shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	/* the shared objects are in the size of the base */
+	new->block_size_shift = base ? base->block_size_shift :
+		iocb->block_size_shift;
 	new->snap_id = new_snapid;
 	new->parent_vdi_id = iocb->base_vid;
+	/* the shared objects are in the format of the base */
+	new->compress = base ? base->compress : iocb->compress;
+	/* the snapshots and the clones of a hybrid vdi are hybrid */
+	new->hybrid = iocb->hybrid || (base && base->hybrid);
+	/* the shared objects are striped like in the base */
+	new->stripe_shift = base ? base->stripe_shift : iocb->stripe_shift;
 	if (data_vdi_id)
 		sd_inode_copy_vdis(sheep_bnode_writer, sheep_bnode_reader,
 				   data_vdi_id, iocb->store_policy,
@@ -222,12 +564,87 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	return new;
 }
 
+/* The entries of the index in use, within the size of the vdi */
+static size_t nr_index_used(const struct sd_inode *inode)
+{
+	return min(count_data_objs(inode), (size_t)SD_INODE_DATA_INDEX);
+}
+
+/*
+ * Read the inode of vid into the zeroed inode but the index beyond the size of
+ * the vdi, which is never set, so that a snapshot of a small vdi doesn't read
+ * 12 MB.  The B-tree of a hypervolume is read as a whole.
+ */
+static int read_base_inode(uint32_t vid, struct sd_inode *inode)
+{
+	uint64_t oid = vid_to_vdi_oid(vid);
+	size_t nr;
+	int ret;
+
+	ret = sd_read_object(oid, (char *)inode, SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS || inode->store_policy != 0)
+		return ret == SD_RES_SUCCESS ?
+			sd_read_object(oid, (char *)inode, sizeof(*inode), 0) :
+			ret;
+
+	nr = nr_index_used(inode);
+	if (!nr)
+		return SD_RES_SUCCESS;
+	ret = sd_read_object(oid, (char *)inode->data_vdi_id,
+			     nr * sizeof(inode->data_vdi_id[0]),
+			     offsetof(struct sd_inode, data_vdi_id));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	return sd_read_object(oid, (char *)inode->gref,
+			      nr * sizeof(inode->gref[0]),
+			      offsetof(struct sd_inode, gref));
+}
+
+/* Write the generation references of the index in use of the base out */
+static int write_base_gref(const struct sd_inode *base)
+{
+	size_t nr = base->store_policy == 0 ?
+		nr_index_used(base) : SD_INODE_DATA_INDEX;
+
+	return sd_write_object(vid_to_vdi_oid(base->vdi_id),
+			       (char *)base->gref, nr * sizeof(base->gref[0]),
+			       offsetof(struct sd_inode, gref), false);
+}
+
+/*
+ * Create the inode of a new vdi.  A vid never used before has no object, so
+ * the index beyond the size of the vdi is left to the zeroes of the creation,
+ * while the inode of a deleted vdi is overwritten as a whole.
+ */
+static int do_write_new_inode(struct sd_inode *new, bool recycled)
+{
+	uint64_t oid = vid_to_vdi_oid(new->vdi_id);
+	size_t nr = nr_index_used(new);
+	int ret;
+
+	if (new->store_policy != 0 || recycled)
+		return sd_write_object(oid, (char *)new, sizeof(*new), 0,
+				       true);
+
+	ret = sd_write_object(oid, (char *)new, SD_INODE_HEADER_SIZE +
+			      nr * sizeof(new->data_vdi_id[0]), 0, true);
+	if (ret != SD_RES_SUCCESS || !nr)
+		return ret;
+	return sd_write_object(oid, (char *)new->gref,
+			       nr * sizeof(new->gref[0]),
+			       offsetof(struct sd_inode, gref), false);
+}
+
+static int write_new_inode(struct sd_inode *new)
+{
+	return do_write_new_inode(new, test_bit(new->vdi_id, sys->vdi_inuse));
+}
+
 /* Create a fresh vdi */
 static int create_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		      uint32_t new_vid)
 {
-	struct sd_inode *new = alloc_inode(iocb, new_snapid, new_vid, NULL,
-					   NULL);
+	struct sd_inode *new = alloc_inode(iocb, new_snapid, new_vid, NULL);
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", new_vid %" PRIx32 ", copies %d, "
@@ -235,12 +652,11 @@ static int create_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		 iocb->name, iocb->size, new_vid, iocb->nr_copies, new_snapid,
 		 new->copy_policy, new->store_policy);
 
-	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
-			      sizeof(*new), 0, true);
+	ret = write_new_inode(new);
 	if (ret != SD_RES_SUCCESS)
 		ret = SD_RES_VDI_WRITE;
 
-	free(new);
+	free_tag(new, SD_MEM_INODE);
 	return ret;
 }
 
@@ -264,15 +680,15 @@ static int create_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 static int clone_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		     uint32_t new_vid, uint32_t base_vid)
 {
-	struct sd_inode *new = NULL, *base = xzalloc(sizeof(*base));
+	struct sd_inode *new = NULL,
+		*base = xzalloc_tag(sizeof(*base), SD_MEM_INODE);
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", vid %" PRIx32 ", base %" PRIx32 ", "
 		 "copies %d, snapid %" PRIu32, iocb->name, iocb->size, new_vid,
 		 base_vid, iocb->nr_copies, new_snapid);
 
-	ret = sd_read_object(vid_to_vdi_oid(base_vid), (char *)base,
-			     sizeof(*base), 0);
+	ret = read_base_inode(base_vid, base);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_BASE_VDI_READ;
 		goto out;
@@ -285,25 +701,21 @@ static int clone_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 			base->gref[i].count++;
 	}
 
-	ret = sd_write_object(vid_to_vdi_oid(base_vid), (char *)base->gref,
-			      sizeof(base->gref),
-			      offsetof(struct sd_inode, gref), false);
+	ret = write_base_gref(base);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_BASE_VDI_WRITE;
 		goto out;
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
-	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
-			      sizeof(*new), 0, true);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
+	ret = write_new_inode(new);
 	if (ret != SD_RES_SUCCESS)
 		ret = SD_RES_VDI_WRITE;
 
 out:
-	free(new);
-	free(base);
+	free_tag(new, SD_MEM_INODE);
+	free_tag(base, SD_MEM_INODE);
 	return ret;
 }
 
@@ -326,15 +738,15 @@ out:
 static int snapshot_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 			uint32_t new_vid, uint32_t base_vid)
 {
-	struct sd_inode *new = NULL, *base = xzalloc(sizeof(*base));
+	struct sd_inode *new = NULL,
+		*base = xzalloc_tag(sizeof(*base), SD_MEM_INODE);
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", vid %" PRIx32 ", base %" PRIx32 ", "
 		 "copies %d, snapid %" PRIu32, iocb->name, iocb->size, new_vid,
 		 base_vid, iocb->nr_copies, new_snapid);
 
-	ret = sd_read_object(vid_to_vdi_oid(base_vid), (char *)base,
-			     sizeof(*base), 0);
+	ret = read_base_inode(base_vid, base);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_BASE_VDI_READ;
 		goto out;
@@ -350,8 +762,12 @@ static int snapshot_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 			base->gref[i].count++;
 	}
 
-	ret = sd_write_object(vid_to_vdi_oid(base_vid), (char *)base,
-			      sizeof(*base), 0, false);
+	ret = sd_write_object(vid_to_vdi_oid(base_vid),
+			      (char *)&base->snap_ctime,
+			      sizeof(base->snap_ctime),
+			      offsetof(struct sd_inode, snap_ctime), false);
+	if (ret == SD_RES_SUCCESS)
+		ret = write_base_gref(base);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("updating gref of VDI %" PRIx32 "failed", base_vid);
 		ret = SD_RES_BASE_VDI_WRITE;
@@ -359,16 +775,14 @@ static int snapshot_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
-	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
-			      sizeof(*new), 0, true);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
+	ret = write_new_inode(new);
 	if (ret != SD_RES_SUCCESS)
 		ret = SD_RES_VDI_WRITE;
 
 out:
-	free(new);
-	free(base);
+	free_tag(new, SD_MEM_INODE);
+	free_tag(base, SD_MEM_INODE);
 	return ret;
 }
 
@@ -395,7 +809,8 @@ out:
 static int rebase_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		      uint32_t new_vid, uint32_t base_vid, uint32_t cur_vid)
 {
-	struct sd_inode *new = NULL, *base = xzalloc(sizeof(*base));
+	struct sd_inode *new = NULL,
+		*base = xzalloc_tag(sizeof(*base), SD_MEM_INODE);
 	int ret;
 
 	sd_debug("%s: size %" PRIu64 ", vid %" PRIx32 ", base %" PRIx32 ", "
@@ -403,8 +818,7 @@ static int rebase_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 		 iocb->size, new_vid, base_vid, cur_vid, iocb->nr_copies,
 		 new_snapid);
 
-	ret = sd_read_object(vid_to_vdi_oid(base_vid), (char *)base,
-			     sizeof(*base), 0);
+	ret = read_base_inode(base_vid, base);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_BASE_VDI_READ;
 		goto out;
@@ -425,25 +839,21 @@ static int rebase_vdi(const struct vdi_iocb *iocb, uint32_t new_snapid,
 			base->gref[i].count++;
 	}
 	/* update current working vdi */
-	ret = sd_write_object(vid_to_vdi_oid(base_vid), (char *)base->gref,
-			      sizeof(base->gref),
-			      offsetof(struct sd_inode, gref), false);
+	ret = write_base_gref(base);
 	if (ret != SD_RES_SUCCESS) {
 		ret = SD_RES_VDI_WRITE;
 		goto out;
 	}
 
 	/* create a new vdi */
-	new = alloc_inode(iocb, new_snapid, new_vid, base->data_vdi_id,
-			  base->gref);
-	ret = sd_write_object(vid_to_vdi_oid(new_vid), (char *)new,
-			      sizeof(*new), 0, true);
+	new = alloc_inode(iocb, new_snapid, new_vid, base);
+	ret = write_new_inode(new);
 	if (ret != SD_RES_SUCCESS)
 		ret = SD_RES_VDI_WRITE;
 
 out:
-	free(new);
-	free(base);
+	free_tag(new, SD_MEM_INODE);
+	free_tag(base, SD_MEM_INODE);
 	return ret;
 }
 
@@ -457,21 +867,21 @@ out:
  * Otherwise:
  * Return NO_VDI (bit not set) or FULL_VDI (bitmap fully set)
  */
-static int get_vdi_bitmap_range(const char *name, unsigned long *left,
-				unsigned long *right)
+static int get_vdi_bitmap_range(const char *name, const unsigned long *inuse,
+				unsigned long *left, unsigned long *right)
 {
 	*left = sd_hash_vdi(name);
 
 	if (unlikely(!*left))
 		*left = 1;	/* 0x000000 should be skipeed */
 
-	*right = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, *left);
+	*right = find_next_zero_bit(inuse, SD_NR_VDIS, *left);
 	if (*left == *right)
 		return SD_RES_NO_VDI;
 
 	if (*right == SD_NR_VDIS) {
 		/* Wrap around */
-		*right = find_next_zero_bit(sys->vdi_inuse, SD_NR_VDIS, 1);
+		*right = find_next_zero_bit(inuse, SD_NR_VDIS, 1);
 		if (*right == SD_NR_VDIS)
 			return SD_RES_FULL_VDI;
 	}
@@ -514,11 +924,23 @@ static int fill_vdi_info_range(uint32_t left, uint32_t right,
 		goto out;
 	}
 	for (i = right - 1; i >= left && i; i--) {
-		ret = sd_read_object(vid_to_vdi_oid(i), (char *)inode,
-				     SD_INODE_HEADER_SIZE, 0);
+		bool cached;
+
+		ret = read_vdi_header(i, inode, true, &cached);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
 
+		/*
+		 * The node which deletes the vdi zeroes its name behind the
+		 * back of the others, so the vdi found is read again
+		 */
+		if (cached && !strncmp(inode->name, name,
+				       sizeof(inode->name))) {
+			ret = read_vdi_header(i, inode, false, NULL);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
+
 		if (vdi_is_deleted(inode)) {
 			/* Recycle the deleted inode for fresh vdi create */
 			if (!iocb->create_snapshot)
@@ -589,13 +1011,13 @@ static int fill_vdi_info(unsigned long left, unsigned long right,
 	return ret;
 }
 
-/* Return SUCCESS if we find targeted VDI specified by iocb and fill info */
-int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
+static int do_vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info,
+			 const unsigned long *inuse)
 {
 	unsigned long left, right;
 	int ret;
 
-	ret = get_vdi_bitmap_range(iocb->name, &left, &right);
+	ret = get_vdi_bitmap_range(iocb->name, inuse, &left, &right);
 	info->free_bit = right;
 	sd_debug("%s left %lx right %lx, %x", iocb->name, left, right, ret);
 	switch (ret) {
@@ -608,6 +1030,12 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 	return fill_vdi_info(left, right, iocb, info);
 }
 
+/* Return SUCCESS if we find targeted VDI specified by iocb and fill info */
+int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
+{
+	return do_vdi_lookup(iocb, info, sys->vdi_inuse);
+}
+
 static void vdi_flush(uint32_t vid)
 {
 	struct sd_req hdr;
@@ -700,6 +1128,250 @@ int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid)
 				  info.vid);
 }
 
+/*
+ * Creation of the vdis in a batch
+ *
+ * SD_OP_NEW_VDIS creates many vdis in one cluster operation instead of one
+ * SD_OP_NEW_VDI each, which makes the provisioning of hundreds of vdis from a
+ * template wait for hundreds of rounds of the cluster.  The vids are looked up
+ * one after another in a copy of the bitmap where the vids of the batch are
+ * set, and the inodes are written NEW_VDIS_PARALLEL at a time, when the batch
+ * ends or a lookup would read one not written yet.  A base is read and its
+ * gref updated once for all of its clones.  The bitmaps of the nodes are set
+ * after all by the cluster message.
+ */
+#define NEW_VDIS_PARALLEL 16 /* each copies the 4 MB index of its base */
+
+struct new_vdi_job {
+	struct sd_new_vdi *nv;
+	struct vdi_iocb iocb;
+	uint32_t snapid;
+	bool recycled; /* the vid of a deleted vdi */
+	struct sd_inode *base;
+	struct request_iocb *wait;
+	struct work work;
+};
+
+static void new_vdi_write_work(struct work *work)
+{
+	struct new_vdi_job *job = container_of(work, struct new_vdi_job, work);
+	struct sd_inode *new;
+
+	new = alloc_inode(&job->iocb, job->snapid, job->nv->vid, job->base);
+	if (do_write_new_inode(new, job->recycled) != SD_RES_SUCCESS)
+		job->nv->result = SD_RES_VDI_WRITE;
+	free_tag(new, SD_MEM_INODE);
+}
+
+static void new_vdi_write_done(struct work *work)
+{
+	struct new_vdi_job *job = container_of(work, struct new_vdi_job, work);
+
+	eventfd_xwrite(job->wait->efd, 1);
+}
+
+/* Update the base of the jobs, which all have the base of jobs[0] */
+static int new_vdis_update_base(struct new_vdi_job *jobs, int nr,
+				struct sd_inode *base)
+{
+	uint32_t base_vid = jobs[0].nv->base_vid;
+	bool snapshot = false;
+	int ret;
+
+	ret = read_base_inode(base_vid, base);
+	if (ret != SD_RES_SUCCESS)
+		return SD_RES_BASE_VDI_READ;
+
+	for (int i = 0; i < nr; i++) {
+		if (!jobs[i].nv->snapshot)
+			continue;
+		base->snap_ctime = jobs[i].iocb.time;
+		snapshot = true;
+	}
+	for (int i = 0; i < ARRAY_SIZE(base->gref); i++)
+		if (base->data_vdi_id[i])
+			base->gref[i].count += nr;
+
+	if (snapshot) {
+		ret = sd_write_object(vid_to_vdi_oid(base_vid),
+				      (char *)&base->snap_ctime,
+				      sizeof(base->snap_ctime),
+				      offsetof(struct sd_inode, snap_ctime),
+				      false);
+		if (ret != SD_RES_SUCCESS)
+			return SD_RES_BASE_VDI_WRITE;
+	}
+	if (write_base_gref(base) != SD_RES_SUCCESS)
+		return SD_RES_BASE_VDI_WRITE;
+	return SD_RES_SUCCESS;
+}
+
+/* Write the inodes of the jobs of the same base, base_vid 0 for none */
+static void new_vdis_write(struct new_vdi_job *jobs, int nr)
+{
+	struct sd_inode *base = NULL;
+	int ret;
+
+	if (jobs[0].nv->base_vid) {
+		base = xzalloc_tag(sizeof(*base), SD_MEM_INODE);
+		ret = new_vdis_update_base(jobs, nr, base);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to update the base %" PRIx32 ", %s",
+			       jobs[0].nv->base_vid, sd_strerror(ret));
+			for (int i = 0; i < nr; i++)
+				jobs[i].nv->result = ret;
+			goto out;
+		}
+	}
+
+	for (int i = 0; i < nr; i += NEW_VDIS_PARALLEL) {
+		struct request_iocb *wait = local_req_init();
+
+		if (!wait) {
+			for (int j = i; j < nr; j++)
+				jobs[j].nv->result = SD_RES_NO_MEM;
+			break;
+		}
+		for (int j = i; j < min(nr, i + NEW_VDIS_PARALLEL); j++) {
+			jobs[j].base = base;
+			jobs[j].wait = wait;
+			jobs[j].work.fn = new_vdi_write_work;
+			jobs[j].work.done = new_vdi_write_done;
+			queue_work(sys->areq_wqueue, &jobs[j].work);
+			wait->count++;
+		}
+		local_req_wait(wait);
+	}
+out:
+	for (int i = 0; i < nr; i++)
+		vdi_invalidate_header(jobs[i].nv->vid);
+	if (base)
+		vdi_invalidate_header(base->vdi_id);
+	free_tag(base, SD_MEM_INODE);
+}
+
+static int new_vdi_job_cmp(const struct new_vdi_job *a,
+			   const struct new_vdi_job *b)
+{
+	return intcmp(a->nv->base_vid, b->nv->base_vid);
+}
+
+/* Write the pending jobs, grouped by the base */
+static void new_vdis_flush(struct new_vdi_job *jobs, int nr,
+			   unsigned long *inuse)
+{
+	int i, j;
+
+	xqsort(jobs, nr, new_vdi_job_cmp);
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr; j++)
+			if (jobs[j].nv->base_vid != jobs[i].nv->base_vid)
+				break;
+		new_vdis_write(jobs + i, j - i);
+	}
+
+	/* the vids of the failed ones are free again for the batch */
+	for (i = 0; i < nr; i++)
+		if (jobs[i].nv->result != SD_RES_SUCCESS && !jobs[i].recycled)
+			clear_bit(jobs[i].nv->vid, inuse);
+}
+
+/* Whether the lookup of the name reads one of the vids of the jobs */
+static bool new_vdi_conflicts(const char *name, const unsigned long *inuse,
+			      const struct new_vdi_job *jobs, int nr)
+{
+	unsigned long left, right;
+
+	if (get_vdi_bitmap_range(name, inuse, &left, &right) !=
+	    SD_RES_SUCCESS)
+		return false;
+
+	for (int i = 0; i < nr; i++) {
+		uint32_t vid = jobs[i].nv->vid;
+
+		if (left < right ? vid >= left && vid < right :
+		    vid >= left || vid < right)
+			return true;
+	}
+	return false;
+}
+
+/* Look up the vid and the snap id of the job as vdi_(create|snapshot) do */
+static int new_vdi_lookup(struct new_vdi_job *job,
+			  const unsigned long *inuse)
+{
+	const struct vdi_iocb *iocb = &job->iocb;
+	struct vdi_info info = {};
+	int ret;
+
+	ret = do_vdi_lookup(iocb, &info, inuse);
+	if (!iocb->create_snapshot) {
+		if (ret == SD_RES_SUCCESS)
+			return SD_RES_VDI_EXIST;
+		if (ret != SD_RES_NO_VDI)
+			return ret;
+		job->snapid = info.snapid ?: 1;
+	} else {
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		/* a rollback goes by SD_OP_NEW_VDI */
+		if (iocb->base_vid != info.vid)
+			return SD_RES_INVALID_PARMS;
+		if (sys->enable_object_cache)
+			vdi_flush(iocb->base_vid);
+		job->snapid = info.snapid;
+	}
+	job->nv->vid = info.free_bit;
+	job->recycled = test_bit(info.free_bit, inuse);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Create the vdis of nv by iocb, filling the vid and the result of each.  The
+ * copy of the bitmap makes a batch 2 MB larger, which is little for hundreds
+ * of vdis.
+ */
+void vdi_create_many(const struct vdi_iocb *iocb, struct sd_new_vdi *nv,
+		     int nr)
+{
+	unsigned long *inuse = xmalloc(sizeof(sys->vdi_inuse));
+	struct new_vdi_job *jobs = xzalloc(sizeof(*jobs) * nr);
+	int nr_pending = 0;
+
+	memcpy(inuse, sys->vdi_inuse, sizeof(sys->vdi_inuse));
+	for (int i = 0; i < nr; i++) {
+		struct new_vdi_job *job = jobs + nr_pending;
+
+		if (new_vdi_conflicts(nv[i].name, inuse, jobs, nr_pending)) {
+			new_vdis_flush(jobs, nr_pending, inuse);
+			nr_pending = 0;
+			job = jobs;
+		}
+
+		memset(job, 0, sizeof(*job));
+		job->nv = nv + i;
+		job->iocb = *iocb;
+		job->iocb.name = nv[i].name;
+		job->iocb.size = nv[i].vdi_size;
+		job->iocb.base_vid = nv[i].base_vid;
+		job->iocb.create_snapshot = !!nv[i].snapshot;
+		nv[i].copies = iocb->nr_copies;
+		nv[i].vid = 0;
+		nv[i].result = new_vdi_lookup(job, inuse);
+		if (nv[i].result != SD_RES_SUCCESS) {
+			sd_debug("%s, %s", nv[i].name,
+				 sd_strerror(nv[i].result));
+			continue;
+		}
+		set_bit(nv[i].vid, inuse);
+		nr_pending++;
+	}
+	new_vdis_flush(jobs, nr_pending, inuse);
+
+	free(jobs);
+	free(inuse);
+}
+
 int read_vdis(char *data, int len, unsigned int *rsp_len)
 {
 	if (len != sizeof(sys->vdi_inuse))
@@ -711,26 +1383,309 @@ int read_vdis(char *data, int len, unsigned int *rsp_len)
 	return SD_RES_SUCCESS;
 }
 
+static bool get_cached_vdi_header(uint32_t vid, struct sd_vdi_header *h)
+{
+	struct vdi_state_entry *entry;
+	bool found;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	found = entry && entry->header_read && entry->objs_read;
+	if (found) {
+		memcpy(h->name, entry->name, sizeof(h->name));
+		memcpy(h->tag, entry->tag, sizeof(h->tag));
+		h->create_time = entry->create_time;
+		h->snap_ctime = entry->snap_ctime;
+		h->vdi_size = entry->vdi_size;
+		h->my_objs = entry->my_objs;
+		h->cow_objs = entry->cow_objs;
+		h->vdi_id = vid;
+		h->parent_vdi_id = entry->parent_vdi_id;
+		h->snap_id = entry->snap_id;
+		h->nr_copies = entry->nr_copies;
+		h->copy_policy = entry->copy_policy;
+		h->store_policy = entry->store_policy;
+		h->block_size_shift = entry->block_size_shift;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	return found;
+}
+
+/* Not if the header was invalidated since gen, while we read it */
+static void cache_vdi_header(uint32_t vid, const struct sd_inode *inode,
+			     const struct sd_vdi_header *h, uint64_t gen)
+{
+	struct vdi_state_entry *entry, *old;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+
+	sd_write_lock(&vdi_state_lock);
+	if (gen != vdi_header_gen) {
+		sd_rw_unlock(&vdi_state_lock);
+		free(entry);
+		return;
+	}
+	old = vdi_state_insert(&vdi_state_root, entry);
+	if (old) {
+		free(entry);
+		entry = old;
+	}
+	copy_header_to_state(entry, inode);
+	entry->parent_vdi_id = h->parent_vdi_id;
+	entry->vdi_size = h->vdi_size;
+	entry->my_objs = h->my_objs;
+	entry->cow_objs = h->cow_objs;
+	entry->nr_copies = h->nr_copies;
+	entry->copy_policy = h->copy_policy;
+	entry->store_policy = h->store_policy;
+	entry->block_size_shift = h->block_size_shift;
+	entry->objs_read = true;
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+/*
+ * Read the header of vid and the index in use into inode, the B-tree of a
+ * hypervolume but its root as parse_vdi() of dog does
+ */
+static int read_vdi_index(uint32_t vid, struct sd_inode *inode)
+{
+	uint64_t oid = vid_to_vdi_oid(vid);
+	uint32_t len;
+	int ret;
+
+	ret = sd_read_object(oid, (char *)inode, SD_INODE_HEADER_SIZE +
+			     sizeof(struct sd_index_header), 0);
+	if (ret != SD_RES_SUCCESS || vdi_is_deleted(inode))
+		return ret;
+
+	/* sd_inode_get_meta_size() panics on a broken root */
+	if (inode->store_policy) {
+		const struct sd_index_header *root =
+			(struct sd_index_header *)inode->data_vdi_id;
+
+		if (root->depth != 1 && root->depth != 2)
+			return SD_RES_EIO;
+	}
+	len = sd_inode_get_meta_size(inode, sizeof(*inode));
+	return sd_read_object(oid, (char *)inode->data_vdi_id, len,
+			      SD_INODE_HEADER_SIZE);
+}
+
+/*
+ * Fill the data with the headers of the vdis in use from vid start on, for
+ * SD_OP_LIST_VDI_HEADERS, so that dog lists the vdis a page at a time instead
+ * of reading the inodes one by one.  The headers and the counts of the
+ * snapshots, which change only by the cluster operations invalidating them,
+ * are kept in the vdi state, and the index of a working vdi is counted each
+ * time.
+ */
+int list_vdi_headers(uint64_t start, void *data, uint32_t len,
+		     uint32_t *rsp_len)
+{
+	struct sd_vdi_header *h = data;
+	uint32_t max = len / sizeof(*h), nr = 0;
+	struct sd_inode *inode = NULL;
+	unsigned long vid;
+	uint64_t gen;
+	int ret;
+
+	if (!max)
+		return SD_RES_INVALID_PARMS;
+
+	for (vid = find_next_bit(sys->vdi_inuse, SD_NR_VDIS, min(start,
+				 (uint64_t)SD_NR_VDIS));
+	     vid < SD_NR_VDIS && nr < max;
+	     vid = find_next_bit(sys->vdi_inuse, SD_NR_VDIS, vid + 1)) {
+		struct sd_vdi_header *e = h + nr;
+
+		if (get_cached_vdi_header(vid, e)) {
+			nr++;
+			continue;
+		}
+
+		if (!inode)
+			inode = xvalloc_tag(sizeof(*inode), SD_MEM_INODE);
+		sd_read_lock(&vdi_state_lock);
+		gen = vdi_header_gen;
+		sd_rw_unlock(&vdi_state_lock);
+
+		ret = read_vdi_index(vid, inode);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to read the inode of %lx, %s", vid,
+			       sd_strerror(ret));
+			continue;
+		}
+		if (vdi_is_deleted(inode))
+			continue;
+
+		memset(e, 0, sizeof(*e));
+		memcpy(e->name, inode->name, sizeof(e->name));
+		memcpy(e->tag, inode->tag, sizeof(e->tag));
+		e->create_time = inode->create_time;
+		e->snap_ctime = inode->snap_ctime;
+		e->vdi_size = inode->vdi_size;
+		e->vdi_id = inode->vdi_id;
+		e->parent_vdi_id = inode->parent_vdi_id;
+		e->snap_id = inode->snap_id;
+		e->nr_copies = inode->nr_copies;
+		e->copy_policy = inode->copy_policy;
+		e->store_policy = inode->store_policy;
+		e->block_size_shift = inode->block_size_shift;
+		sd_inode_stat(inode, &e->my_objs, &e->cow_objs);
+		if (vdi_is_snapshot(inode))
+			cache_vdi_header(vid, inode, e, gen);
+		nr++;
+	}
+	free_tag(inode, SD_MEM_INODE);
+
+	*rsp_len = nr * sizeof(*h);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The vdis in use and their state for SD_OP_GET_VDI_STATE, a few bytes a vdi
+ * instead of the whole bitmap
+ */
+int fill_vdi_state_list(const struct sd_req *hdr,
+		struct sd_rsp *rsp, void *data)
+{
+	int max = hdr->data_length / sizeof(struct vdi_state), nr = 0;
+	struct vdi_state *vs = data;
+	struct vdi_state_entry *entry;
+	unsigned long vid;
+
+	sd_read_lock(&vdi_state_lock);
+	FOR_EACH_BIT(vid, sys->vdi_inuse, SD_NR_VDIS) {
+		if (nr == max) {
+			sd_rw_unlock(&vdi_state_lock);
+			return SD_RES_BUFFER_SMALL;
+		}
+		entry = vdi_state_search(&vdi_state_root, vid);
+		memset(vs + nr, 0, sizeof(*vs));
+		vs[nr].vid = vid;
+		vs[nr].snapshot = entry && entry->snapshot;
+		nr++;
+	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	rsp->data_length = nr * sizeof(*vs);
+	return SD_RES_SUCCESS;
+}
+
+/* Merge the vdis of the reply of SD_OP_GET_VDI_STATE from another node */
+void merge_vdi_state_list(const struct vdi_state *vs, int nr)
+{
+	struct vdi_state_entry *entry, *old;
+
+	sd_write_lock(&vdi_state_lock);
+	for (int i = 0; i < nr; i++) {
+		atomic_set_bit(vs[i].vid, sys->vdi_inuse);
+		if (!vs[i].snapshot)
+			continue;
+
+		entry = xzalloc(sizeof(*entry));
+		entry->vid = vs[i].vid;
+		entry->snapshot = true;
+		old = vdi_state_insert(&vdi_state_root, entry);
+		if (old) {
+			free(entry);
+			old->snapshot = true;
+		}
+	}
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+/* the objects unref'ed in parallel by a deletion */
+struct delete_batch {
+	const struct sd_inode *inode;
+	uint64_t *oids;
+	struct generation_reference *grefs; /* NULL for hypervolume */
+	int nr;
+};
+
+static void init_delete_batch(struct delete_batch *b,
+			      const struct sd_inode *inode, int window)
+{
+	b->inode = inode;
+	b->oids = xcalloc(window, sizeof(*b->oids));
+	b->grefs = inode->store_policy == 0 ?
+		xcalloc(window, sizeof(*b->grefs)) : NULL;
+	b->nr = 0;
+}
+
+static void free_delete_batch(struct delete_batch *b)
+{
+	free(b->oids);
+	free(b->grefs);
+}
+
+/*
+ * Unref the objects of the batch in parallel.  If any of them fails, remove
+ * the objects without ledger one by one, which tells the objects already gone
+ * from the errors.  The decrement messages aren't sent again, as a ledger
+ * might have taken them, so a failed one leaves its object unreclaimed rather
+ * than reclaimed early.
+ */
+static int delete_batch_flush(struct delete_batch *b)
+{
+	int ret = SD_RES_SUCCESS;
+
+	if (b->nr && sd_unref_objects(b->oids, b->grefs, b->nr) !=
+	    SD_RES_SUCCESS) {
+		for (int i = 0; i < b->nr; i++) {
+			if (b->grefs && (b->grefs[i].generation ||
+					 b->grefs[i].count))
+				continue;
+			ret = sd_remove_object(b->oids[i]);
+			if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ) {
+				sd_err("unref %" PRIx64 " fail, %d",
+				       b->oids[i], ret);
+				break;
+			}
+			ret = SD_RES_SUCCESS;
+		}
+	}
+
+	b->nr = 0;
+	return ret;
+}
+
 static void delete_cb(struct sd_index *idx, void *arg, int ignore)
 {
-	struct sd_inode *inode = arg;
+	struct delete_batch *b = arg;
 	uint64_t oid;
-	int ret;
 
 	if (idx->vdi_id) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
-		if (idx->vdi_id != inode->vdi_id)
+		if (idx->vdi_id != b->inode->vdi_id)
 			sd_debug("object %" PRIx64 " is base's data, would"
 				 " not be deleted.", oid);
 		else {
-			ret = sd_remove_object(oid);
-			if (ret != SD_RES_SUCCESS)
-				sd_err("remove object %" PRIx64 " fail, %d",
-				       oid, ret);
+			b->oids[b->nr++] = oid;
+			if (b->nr == (sys->delete_window ?: DELETE_WINDOW))
+				delete_batch_flush(b);
 		}
 	}
 }
 
+/*
+ * Clear the indexes [start, end) of the inode, whose objects are deleted, so
+ * that a deletion resent takes up from there
+ */
+static int clear_vdi_index(struct sd_inode *inode, uint32_t start,
+			   uint32_t end)
+{
+	uint32_t len = (end - start) * sizeof(inode->data_vdi_id[0]);
+
+	memset(inode->data_vdi_id + start, 0, len);
+	return sd_write_object(vid_to_vdi_oid(inode->vdi_id),
+			       (char *)(inode->data_vdi_id + start), len,
+			       SD_INODE_HEADER_SIZE + start *
+			       sizeof(inode->data_vdi_id[0]), false);
+}
+
 
 struct delete_work {
 	int ret;
@@ -741,6 +1696,8 @@ struct delete_work {
 static int vdi_delete_horse(int32_t vid)
 {
 	struct sd_inode *inode = xvalloc(sizeof(*inode));
+	int window = sys->delete_window ?: DELETE_WINDOW;
+	struct delete_batch b = {};
 	int ret;
 
 	ret = read_backend_object(vid_to_vdi_oid(vid),
@@ -754,28 +1711,41 @@ static int vdi_delete_horse(int32_t vid)
 	if (inode->vdi_size == 0 && vdi_is_deleted(inode))
 		goto out;
 
+	init_delete_batch(&b, inode, window);
 	if (inode->store_policy == 0) {
-		size_t nr_objs, i;
+		size_t nr_objs, i, end;
 
 		nr_objs = count_data_objs(inode);
-		for (i = 0; i < nr_objs; i++) {
-			uint32_t vdi_id = sd_inode_get_vid(inode, i);
-			uint64_t oid;
+		for (i = 0; i < nr_objs; i = end) {
+			end = min(i + window, nr_objs);
+			for (size_t j = i; j < end; j++) {
+				uint32_t vdi_id = sd_inode_get_vid(inode, j);
 
-			if (!vdi_id)
+				if (!vdi_id)
+					continue;
+
+				b.oids[b.nr] = vid_to_data_oid(vdi_id, j);
+				b.grefs[b.nr] = inode->gref[j];
+				b.nr++;
+			}
+			if (!b.nr)
 				continue;
 
-			oid = vid_to_data_oid(vdi_id, i);
-			ret = sd_unref_object(oid, inode->gref[i].generation,
-					      inode->gref[i].count);
 			/*
 			 * Return error if we fail to remove any object.
 			 *
-			 * We don't update inode to boost delete performance,
-			 * users can continue deletion until success.
+			 * The indexes of the deleted objects are cleared batch
+			 * by batch, so users can continue deletion until
+			 * success, from where it stopped, and the used space
+			 * of the vdi shows the progress meanwhile.
 			 */
-			if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ) {
-				sd_err("unref %" PRIx64 " fail, %d", oid, ret);
+			ret = delete_batch_flush(&b);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+			ret = clear_vdi_index(inode, i, end);
+			if (ret != SD_RES_SUCCESS) {
+				sd_err("failed to clear the index of %"PRIx32,
+				       vid);
 				goto out;
 			}
 		}
@@ -784,7 +1754,8 @@ static int vdi_delete_horse(int32_t vid)
 		 * todo: generational reference counting is not supported by
 		 * hypervolume yet
 		 */
-		sd_inode_index_walk(inode, delete_cb, inode);
+		sd_inode_index_walk(inode, delete_cb, &b);
+		delete_batch_flush(&b);
 	}
 
 	/* We can't delete inode due to vdi allocation logic, just zero name. */
@@ -793,6 +1764,7 @@ static int vdi_delete_horse(int32_t vid)
 	ret = sd_write_object(vid_to_vdi_oid(vid), (void *)inode,
 			      SD_INODE_HEADER_SIZE, 0, false);
 out:
+	free_delete_batch(&b);
 	free(inode);
 	return ret;
 }
@@ -854,6 +1826,16 @@ static uint32_t hash_vdi_attr(const struct sheepdog_vdi_attr *attr)
 	return (uint32_t)(hval & ((UINT64_C(1) << VDI_SPACE_SHIFT) - 1));
 }
 
+/* The header of an attribute object, enough to compare the keys */
+#define VDI_ATTR_HEADER_SIZE offsetof(struct sheepdog_vdi_attr, value)
+
+static bool vdi_attr_key_eq(const struct sheepdog_vdi_attr *a,
+			    const struct sheepdog_vdi_attr *b)
+{
+	return strcmp(a->name, b->name) == 0 && strcmp(a->tag, b->tag) == 0 &&
+		a->snap_id == b->snap_id && strcmp(a->key, b->key) == 0;
+}
+
 int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 		 uint32_t vid, uint32_t *attrid, uint64_t create_time,
 		 bool wr, bool excl, bool delete)
@@ -872,7 +1854,7 @@ int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 		oid = vid_to_attr_oid(vid, *attrid);
 		if (excl || !wr)
 			ret = sd_read_object(oid, (char *)&tmp_attr,
-					sizeof(tmp_attr), 0);
+					     VDI_ATTR_HEADER_SIZE, 0);
 
 		if (ret == SD_RES_NO_OBJ && wr) {
 			ret = sd_write_object(oid, (char *)vattr, data_len, 0,
@@ -888,10 +1870,7 @@ int get_vdi_attr(struct sheepdog_vdi_attr *vattr, int data_len,
 			goto out;
 
 		/* compare attribute header */
-		if (strcmp(tmp_attr.name, vattr->name) == 0 &&
-		    strcmp(tmp_attr.tag, vattr->tag) == 0 &&
-		    tmp_attr.snap_id == vattr->snap_id &&
-		    strcmp(tmp_attr.key, vattr->key) == 0) {
+		if (vdi_attr_key_eq(&tmp_attr, vattr)) {
 			if (excl)
 				ret = SD_RES_VDI_EXIST;
 			else if (delete) {
@@ -925,11 +1904,97 @@ out:
 	return ret;
 }
 
+/*
+ * Cache of the attribute ids
+ *
+ * A lookup of an attribute costs the lookup of its vdi, which reads the
+ * inodes of the vdis of the same name, and a probe of the attribute objects
+ * from the hash of the key.  The ids found are cached by the key and the
+ * snapshot id of the request, and a hit only reads the header of the
+ * attribute object to check that it's still there, since the other nodes may
+ * have deleted it.  The deletion of a vdi clears the cache of every node.
+ */
+#define VDI_ATTR_CACHE_BITS	10
+
+static struct vdi_attr_cache {
+	uint64_t hval; /* 0 if the slot is free */
+	uint32_t attrid;
+} vdi_attr_cache[1 << VDI_ATTR_CACHE_BITS];
+static struct sd_mutex vdi_attr_cache_lock = SD_MUTEX_INITIALIZER;
+
+static uint64_t vdi_attr_cache_hash(const struct sheepdog_vdi_attr *vattr,
+				    uint32_t snapid)
+{
+	uint64_t hval;
+
+	hval = fnv_64a_buf(vattr->name, strlen(vattr->name), FNV1A_64_INIT);
+	hval = fnv_64a_buf(vattr->tag, strlen(vattr->tag) + 1, hval);
+	hval = fnv_64a_buf(&vattr->snap_id, sizeof(vattr->snap_id), hval);
+	hval = fnv_64a_buf(&snapid, sizeof(snapid), hval);
+	hval = fnv_64a_buf(vattr->key, strlen(vattr->key), hval);
+
+	return hval ?: 1;
+}
+
+static struct vdi_attr_cache *vdi_attr_cache_slot(uint64_t hval)
+{
+	return vdi_attr_cache + hash_64(hval, VDI_ATTR_CACHE_BITS);
+}
+
+/* Look the attribute of the vdi vid up in the cache and check it */
+bool vdi_attr_cached(const struct sheepdog_vdi_attr *vattr, uint32_t snapid,
+		     uint32_t vid, uint32_t *attrid)
+{
+	uint64_t hval = vdi_attr_cache_hash(vattr, snapid);
+	struct vdi_attr_cache *c = vdi_attr_cache_slot(hval);
+	struct sheepdog_vdi_attr tmp_attr;
+	bool hit;
+
+	sd_mutex_lock(&vdi_attr_cache_lock);
+	hit = c->hval == hval;
+	*attrid = c->attrid;
+	sd_mutex_unlock(&vdi_attr_cache_lock);
+	if (!hit)
+		return false;
+
+	if (sd_read_object(vid_to_attr_oid(vid, *attrid), (char *)&tmp_attr,
+			   VDI_ATTR_HEADER_SIZE, 0) != SD_RES_SUCCESS ||
+	    !vdi_attr_key_eq(&tmp_attr, vattr)) {
+		vdi_attr_cache_update(vattr, snapid, *attrid, true);
+		return false;
+	}
+	return true;
+}
+
+/* Cache the attribute found at attrid, or drop it if it's deleted */
+void vdi_attr_cache_update(const struct sheepdog_vdi_attr *vattr,
+			   uint32_t snapid, uint32_t attrid, bool deleted)
+{
+	uint64_t hval = vdi_attr_cache_hash(vattr, snapid);
+	struct vdi_attr_cache *c = vdi_attr_cache_slot(hval);
+
+	sd_mutex_lock(&vdi_attr_cache_lock);
+	if (!deleted) {
+		c->hval = hval;
+		c->attrid = attrid;
+	} else if (c->hval == hval)
+		c->hval = 0;
+	sd_mutex_unlock(&vdi_attr_cache_lock);
+}
+
+void vdi_attr_cache_clear(void)
+{
+	sd_mutex_lock(&vdi_attr_cache_lock);
+	memset(vdi_attr_cache, 0, sizeof(vdi_attr_cache));
+	sd_mutex_unlock(&vdi_attr_cache_lock);
+}
+
 void clean_vdi_state(void)
 {
 	sd_write_lock(&vdi_state_lock);
 	rb_destroy(&vdi_state_root, struct vdi_state_entry, node);
 	INIT_RB_ROOT(&vdi_state_root);
+	vdi_header_gen++;
 	sd_rw_unlock(&vdi_state_lock);
 }
 
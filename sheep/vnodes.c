@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sheep_priv.h"
+
+/*
+ * Vnode ring
+ *
+ * The vnodes of a node are a chain of hashes from its id, or from each of its
+ * disks in the disk mode, so the vnodes of a node are the same in every epoch
+ * but the ones added or removed at the end of its chains.  The vnodes of a
+ * vnode_info are kept in an array sorted by hash, which backs vroot and
+ * varray, and a membership change merges the vnodes of the last epoch with the
+ * ones added, instead of hashing and inserting all of them again.
+ */
+
+/* Nodes of the last epoch to the ones of the new epoch */
+struct node_map {
+	const struct sd_node *old, *new;
+};
+
+struct vnode_builder {
+	struct sd_vnode *vnodes; /* added */
+	size_t nr, alloc;
+	uint64_t *drops; /* hashes of the vnodes removed */
+	size_t nr_drops, alloc_drops;
+};
+
+static int vnode_hash_cmp(const void *a, const void *b)
+{
+	const struct sd_vnode *v1 = a, *v2 = b;
+
+	return intcmp(v1->hash, v2->hash);
+}
+
+static int hash_cmp(const void *a, const void *b)
+{
+	return intcmp(*(const uint64_t *)a, *(const uint64_t *)b);
+}
+
+static int node_map_cmp(const void *a, const void *b)
+{
+	const struct node_map *m1 = a, *m2 = b;
+
+	return intcmp((uintptr_t)m1->old, (uintptr_t)m2->old);
+}
+
+static void builder_add(struct vnode_builder *b, uint64_t hash,
+			const struct sd_node *n)
+{
+	if (b->nr == b->alloc) {
+		b->alloc = max(b->alloc * 2, (size_t)SD_DEFAULT_VNODES);
+		b->vnodes = xrealloc_tag(b->vnodes,
+					 sizeof(*b->vnodes) * b->alloc,
+					 SD_MEM_VNODE);
+	}
+	b->vnodes[b->nr].hash = hash;
+	b->vnodes[b->nr].node = n;
+	b->nr++;
+}
+
+static void builder_drop(struct vnode_builder *b, uint64_t hash)
+{
+	if (b->nr_drops == b->alloc_drops) {
+		b->alloc_drops = max(b->alloc_drops * 2,
+				     (size_t)SD_DEFAULT_VNODES);
+		b->drops = xrealloc(b->drops,
+				    sizeof(*b->drops) * b->alloc_drops);
+	}
+	b->drops[b->nr_drops++] = hash;
+}
+
+static inline uint64_t node_vnode_seed(const struct sd_node *n)
+{
+	return sd_hash(&n->nid, offsetof(typeof(n->nid), io_addr));
+}
+
+/*
+ * Add the vnodes [from, to) of the chain of the node to b, or drop them if
+ * drop is true
+ */
+static void node_chain(struct vnode_builder *b, const struct sd_node *n,
+		       int from, int to, bool drop)
+{
+	uint64_t hval = node_vnode_seed(n);
+
+	for (int i = 0; i < to; i++) {
+		hval = sd_place_next(hval);
+		if (i < from)
+			continue;
+		if (drop)
+			builder_drop(b, hval);
+		else
+			builder_add(b, hval, n);
+	}
+}
+
+/* Same as node_disk_to_vnodes(), into b */
+static uint64_t disk_chains(struct vnode_builder *b, const struct sd_node *n,
+			    bool drop)
+{
+	uint64_t node_hval = node_vnode_seed(n), hval, disk_vnodes, total = 0;
+
+	for (int j = 0; j < DISK_MAX; j++) {
+		if (!n->disks[j].disk_id)
+			continue;
+		hval = fnv_64a_64(node_hval, n->disks[j].disk_id);
+		disk_vnodes = DIV_ROUND_UP(n->disks[j].disk_space, WEIGHT_MIN);
+		total += disk_vnodes;
+		for (int k = 0; k < disk_vnodes; k++) {
+			hval = sd_place_next(hval);
+			if (drop)
+				builder_drop(b, hval);
+			else
+				builder_add(b, hval, n);
+		}
+	}
+	return total;
+}
+
+/* Link the sorted vnodes into vroot, appending each one to the right */
+static void link_vnodes(struct vnode_info *vinfo, size_t nr)
+{
+	struct rb_root *root = &vinfo->vroot;
+	struct rb_node *last = NULL;
+
+	INIT_RB_ROOT(root);
+	for (size_t i = 0; i < nr; i++) {
+		struct sd_vnode *v = vinfo->vnodes + i;
+
+		if (unlikely(i && v[-1].hash == v->hash))
+			panic("vdisk hash collison");
+		rb_link_node(&v->rb, last, last ? &last->rb_right :
+			     &root->rb_node);
+		rb_insert_color(&v->rb, root);
+		last = &v->rb;
+	}
+	root->nr = nr;
+}
+
+/* Build the vnodes of the nodes of vinfo from scratch */
+void build_vnodes(struct vnode_info *vinfo)
+{
+	struct vnode_builder b = {};
+	struct sd_node *n;
+
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		if (vinfo->diskmode)
+			n->nr_vnodes = disk_chains(&b, n, false);
+		else
+			node_chain(&b, n, 0, n->nr_vnodes, false);
+	}
+	qsort(b.vnodes, b.nr, sizeof(*b.vnodes), vnode_hash_cmp);
+
+	vinfo->vnodes = b.vnodes;
+	link_vnodes(vinfo, b.nr);
+}
+
+/*
+ * Build the vnodes of vinfo from the ones of old.  Return false if most of the
+ * vnodes change, which is faster to build from scratch.
+ */
+bool merge_vnodes(struct vnode_info *vinfo, const struct vnode_info *old)
+{
+	const struct vnode_array *va = &old->varray;
+	struct node_map *map = xcalloc(old->nr_nodes, sizeof(*map));
+	struct vnode_builder b = {};
+	struct sd_vnode *vnodes;
+	struct sd_node *n;
+	size_t nr_map = 0, nr = 0, di = 0, ai = 0;
+
+	/* the vnodes of the nodes which left */
+	rb_for_each_entry(n, &old->nroot, rb) {
+		if (rb_search(&vinfo->nroot, n, rb, node_cmp))
+			continue;
+		if (vinfo->diskmode)
+			disk_chains(&b, n, true);
+		else
+			node_chain(&b, n, 0, n->nr_vnodes, true);
+	}
+
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		const struct sd_node *o = rb_search(&old->nroot, n, rb,
+						    node_cmp);
+
+		if (!o) {
+			if (vinfo->diskmode)
+				n->nr_vnodes = disk_chains(&b, n, false);
+			else
+				node_chain(&b, n, 0, n->nr_vnodes, false);
+			continue;
+		}
+
+		map[nr_map].old = o;
+		map[nr_map].new = n;
+		nr_map++;
+		if (vinfo->diskmode) {
+			if (!memcmp(n->disks, o->disks, sizeof(n->disks))) {
+				n->nr_vnodes = o->nr_vnodes;
+				continue;
+			}
+			disk_chains(&b, o, true);
+			n->nr_vnodes = disk_chains(&b, n, false);
+		} else if (n->nr_vnodes > o->nr_vnodes)
+			node_chain(&b, n, o->nr_vnodes, n->nr_vnodes, false);
+		else if (n->nr_vnodes < o->nr_vnodes)
+			node_chain(&b, o, n->nr_vnodes, o->nr_vnodes, true);
+	}
+
+	if (b.nr + b.nr_drops > va->nr / 2) {
+		free(map);
+		free_tag(b.vnodes, SD_MEM_VNODE);
+		free(b.drops);
+		return false;
+	}
+
+	qsort(map, nr_map, sizeof(*map), node_map_cmp);
+	qsort(b.vnodes, b.nr, sizeof(*b.vnodes), vnode_hash_cmp);
+	qsort(b.drops, b.nr_drops, sizeof(*b.drops), hash_cmp);
+
+	/* both the vnodes of old and the added ones are sorted by hash */
+	vnodes = xmalloc_tag(sizeof(*vnodes) * (va->nr - b.nr_drops + b.nr),
+			     SD_MEM_VNODE);
+	for (uint32_t i = 0; i < va->nr; i++) {
+		const struct sd_vnode *v = va->vnodes[i];
+		struct node_map key = { .old = v->node }, *m;
+
+		while (di < b.nr_drops && b.drops[di] < v->hash)
+			di++;
+		if (di < b.nr_drops && b.drops[di] == v->hash) {
+			di++;
+			continue;
+		}
+		while (ai < b.nr && b.vnodes[ai].hash < v->hash)
+			vnodes[nr++] = b.vnodes[ai++];
+
+		m = bsearch(&key, map, nr_map, sizeof(*map), node_map_cmp);
+		sd_assert(m);
+		vnodes[nr].hash = v->hash;
+		vnodes[nr].node = m->new;
+		nr++;
+	}
+	while (ai < b.nr)
+		vnodes[nr++] = b.vnodes[ai++];
+
+	free(map);
+	free_tag(b.vnodes, SD_MEM_VNODE);
+	free(b.drops);
+
+	vinfo->vnodes = vnodes;
+	link_vnodes(vinfo, nr);
+	return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The watchdog of the main loop
+ *
+ * With '-S MS', a thread samples every WATCHDOG_TICK how long the main loop
+ * has run its current callback, the lag the events wait for, into
+ * sys->stat.loop.  Once a callback runs for longer than MS, the stall is
+ * logged with the callback, and the main thread is sent WATCHDOG_SIGNAL to
+ * take its stack, which the watchdog logs as sd_backtrace() does.  A stall
+ * is reported once.
+ */
+
+#include <execinfo.h>
+#include <signal.h>
+
+#include "sheep_priv.h"
+
+#define WATCHDOG_TICK 10 /* ms */
+#define WATCHDOG_WAIT 100 /* ms for the stack of the main thread */
+#define WATCHDOG_SIGNAL SIGRTMIN
+#define WATCHDOG_MAX_DEPTH 64
+
+static void *stall_addrs[WATCHDOG_MAX_DEPTH];
+static int nr_stall_addrs;
+
+/* Runs on the main thread, only async-signal-safe calls */
+static void stall_handler(int signo, siginfo_t *info, void *context)
+{
+	uatomic_set(&nr_stall_addrs, backtrace(stall_addrs,
+					       ARRAY_SIZE(stall_addrs)));
+}
+
+static void watchdog_sample(uint64_t lag)
+{
+	uint64_t ms = lag / 1000000;
+	int b = 0;
+
+	while (b < SD_LOOP_NR_BUCKETS - 1 && ms >= (UINT64_C(1) << (2 * b)))
+		b++;
+	uatomic_inc(&sys->stat.loop.lag[b]);
+	if (lag > uatomic_read(&sys->stat.loop.max_lag))
+		uatomic_set(&sys->stat.loop.max_lag, lag);
+}
+
+static void watchdog_report(uint64_t lag, void *fn)
+{
+	int n = 0;
+
+	uatomic_inc(&sys->stat.loop.stalls);
+	sd_warn("the main loop has run a callback for %"PRIu64" ms:",
+		lag / 1000000);
+	sd_print_addrs(&fn, 1);
+
+	uatomic_set(&nr_stall_addrs, 0);
+	if (tkill(getpid(), WATCHDOG_SIGNAL) < 0) {
+		sd_err("failed to signal the main thread, %m");
+		return;
+	}
+	for (int i = 0; i < WATCHDOG_WAIT / WATCHDOG_TICK; i++) {
+		n = uatomic_read(&nr_stall_addrs);
+		if (n)
+			break;
+		usleep(WATCHDOG_TICK * 1000);
+	}
+	if (n < 3) {
+		sd_warn("the main thread didn't take its stack");
+		return;
+	}
+
+	/* skip the handler and the signal frame, see sd_backtrace() */
+	for (int i = 2; i < n; i++)
+		stall_addrs[i] = (char *)stall_addrs[i] - 1;
+	sd_warn("the stack of the main thread:");
+	sd_print_addrs(stall_addrs + 2, n - 2);
+}
+
+static void *watchdog_routine(void *arg)
+{
+	uint64_t stall = (uint64_t)sys->stall_ms * 1000000, reported = 0;
+
+	for (;;) {
+		uint64_t since, now, lag = 0;
+		void *fn;
+
+		usleep(WATCHDOG_TICK * 1000);
+		since = event_main_busy(&fn);
+		now = clock_get_time();
+		if (since && now > since)
+			lag = now - since;
+		watchdog_sample(lag);
+
+		if (lag > stall && since != reported) {
+			reported = since;
+			watchdog_report(lag, fn);
+		}
+	}
+	return NULL;
+}
+
+int watchdog_init(void)
+{
+	struct sigaction sa = {};
+	sd_thread_t thread;
+	void *dummy;
+
+	/* load libgcc now, backtrace() may not malloc in the handler */
+	backtrace(&dummy, 1);
+
+	sa.sa_sigaction = stall_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(WATCHDOG_SIGNAL, &sa, NULL) < 0) {
+		sd_err("failed to install the stall handler, %m");
+		return -1;
+	}
+
+	event_watch_main();
+	if (sd_thread_create("watchdog", &thread, watchdog_routine, NULL)) {
+		sd_err("failed to create the watchdog thread, %m");
+		return -1;
+	}
+
+	sd_info("watching the main loop for the callbacks over %"PRIu32" ms",
+		sys->stall_ms);
+	return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compression of the peer payloads on the wire
+ *
+ * With '-Y pair=A:B', the payloads between the nodes of the zones A and B,
+ * the sites of a stretched cluster for example, are deflated: the writes of
+ * the replicas forwarded by the gateway, and the objects read by the recovery.
+ * A deflated payload is the length of the data and its zlib stream, flagged by
+ * SD_FLAG_CMD_DEFLATE.  A write carries the flag when its payload is deflated,
+ * and a read carries it to ask for the reply deflated, which the peer does if
+ * it shrinks.  So the node sending a payload decides, and every node takes
+ * either form.  The writes are inflated by the workers of the peer.
+ */
+
+#include <zlib.h>
+
+#include "sheep_priv.h"
+
+#define WIRE_MIN_SIZE 4096 /* shorter payloads go as they are */
+
+struct wire_header {
+	uint32_t length; /* of the data inflated */
+};
+
+bool wire_deflate_to(const struct sd_node *n)
+{
+	uint32_t zone = sys->this_node.zone;
+
+	if (node_is_local(n))
+		return false;
+
+	for (int i = 0; i < sys->nr_wire_pairs; i++) {
+		const uint32_t *p = sys->wire_pairs[i];
+
+		if ((p[0] == zone && p[1] == n->zone) ||
+		    (p[1] == zone && p[0] == n->zone))
+			return true;
+	}
+	return false;
+}
+
+/* Deflate the data, NULL if it doesn't shrink */
+void *wire_deflate(const void *buf, uint32_t len, uint32_t *out_len)
+{
+	uLongf clen = compressBound(len);
+	uint64_t start = clock_get_time();
+	struct wire_header *wh;
+
+	if (len < WIRE_MIN_SIZE)
+		return NULL;
+
+	wh = xmalloc(sizeof(*wh) + clen);
+	wh->length = len;
+	/* the replication to a remote cluster deflates without --wire */
+	if (compress2((Bytef *)(wh + 1), &clen, buf, len,
+		      sys->wire_level ?: Z_BEST_SPEED) != Z_OK ||
+	    sizeof(*wh) + clen >= len) {
+		free(wh);
+		uatomic_add(&sys->stat.wire.ns, clock_get_time() - start);
+		return NULL;
+	}
+
+	*out_len = sizeof(*wh) + clen;
+	uatomic_add(&sys->stat.wire.raw, len);
+	uatomic_add(&sys->stat.wire.deflated, *out_len);
+	uatomic_add(&sys->stat.wire.ns, clock_get_time() - start);
+	return wh;
+}
+
+/* The length of the data of the deflated payload, 0 if it's malformed */
+static uint32_t wire_length(const void *in, uint32_t in_len)
+{
+	const struct wire_header *wh = in;
+
+	return in_len < sizeof(*wh) ? 0 : wh->length;
+}
+
+/* Inflate the payload into out, which has room for wire_length() bytes */
+static int wire_inflate(const void *in, uint32_t in_len, void *out)
+{
+	const struct wire_header *wh = in;
+	uint64_t start = clock_get_time();
+	uLongf len = wh->length;
+	int ret;
+
+	ret = uncompress(out, &len, (const Bytef *)(wh + 1),
+			 in_len - sizeof(*wh));
+	uatomic_add(&sys->stat.wire.ns, clock_get_time() - start);
+	if (ret != Z_OK || len != wh->length) {
+		sd_err("corrupted deflated payload, %d", ret);
+		return SD_RES_EIO;
+	}
+
+	uatomic_add(&sys->stat.wire.inflated, len);
+	return SD_RES_SUCCESS;
+}
+
+/* Inflate the payload of the peer write, in the worker */
+int wire_inflate_request(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint32_t len = wire_length(req->data, hdr->data_length);
+	void *buf;
+	int ret;
+
+	if (req->local || req->shm || !len ||
+	    len > get_vdi_objsize(hdr->obj.oid))
+		return SD_RES_INVALID_PARMS;
+
+	buf = xbuffer_alloc(len);
+	ret = wire_inflate(req->data, hdr->data_length, buf);
+	if (ret != SD_RES_SUCCESS) {
+		buffer_free(buf, len);
+		return ret;
+	}
+
+	buffer_free(req->data, req->data_length);
+	req->data = buf;
+	req->data_length = len;
+	hdr->data_length = len;
+	hdr->flags &= ~SD_FLAG_CMD_DEFLATE;
+	return SD_RES_SUCCESS;
+}
+
+/* Deflate the reply of the peer read in place, if it shrinks */
+void wire_deflate_reply(struct request *req)
+{
+	struct sd_rsp *rsp = &req->rp;
+	uint32_t len;
+	void *buf;
+
+	buf = wire_deflate(req->data, rsp->data_length, &len);
+	if (!buf)
+		return;
+
+	memcpy(req->data, buf, len);
+	free(buf);
+	rsp->data_length = len;
+	rsp->flags |= SD_FLAG_CMD_DEFLATE;
+}
+
+/* Inflate the reply read into buf of size bytes, if it is deflated */
+int wire_inflate_reply(struct sd_rsp *rsp, void *buf, uint32_t size)
+{
+	uint32_t len;
+	void *data;
+	int ret;
+
+	if (!(rsp->flags & SD_FLAG_CMD_DEFLATE))
+		return SD_RES_SUCCESS;
+
+	len = wire_length(buf, rsp->data_length);
+	if (!len || len > size)
+		return SD_RES_EIO;
+
+	data = xmalloc(len);
+	ret = wire_inflate(buf, rsp->data_length, data);
+	if (ret == SD_RES_SUCCESS)
+		memcpy(buf, data, len);
+	free(data);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rsp->data_length = len;
+	rsp->flags &= ~SD_FLAG_CMD_DEFLATE;
+	return SD_RES_SUCCESS;
+}
+
+int wire_init(void)
+{
+	for (int i = 0; i < sys->nr_wire_pairs; i++)
+		sd_info("deflating the payloads between the zones %"PRIu32
+			" and %"PRIu32", level %d", sys->wire_pairs[i][0],
+			sys->wire_pairs[i][1], sys->wire_level);
+	return 0;
+}
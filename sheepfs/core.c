@@ -31,17 +31,22 @@
 #define SH_OP_NAME   "user.sheepfs.opcode"
 #define SH_OP_SIZE   sizeof(uint32_t)
 
+/* The largest read and write of a fuse request */
+#define SHEEPFS_MAX_IO "131072"
+
 char sheepfs_shadow[PATH_MAX];
 
 static int sheepfs_debug;
 static int sheepfs_fg;
 int sheepfs_page_cache;
 int sheepfs_object_cache;
+int sheepfs_volume_cache;
 char sdhost[32] = "127.0.0.1";
 int sdport = SD_LISTEN_PORT;
 
 static struct option const long_options[] = {
 	{"address", required_argument, NULL, 'a'},
+	{"cache", no_argument, NULL, 'c'},
 	{"debug", no_argument, NULL, 'd'},
 	{"help", no_argument, NULL, 'h'},
 	{"foreground", no_argument, NULL, 'f'},
@@ -51,7 +56,7 @@ static struct option const long_options[] = {
 	{NULL, 0, NULL, 0},
 };
 
-static const char *short_options = "a:dfhknp:";
+static const char *short_options = "a:cdfhknp:";
 
 static struct sheepfs_file_operation {
 	int (*read)(const char *path, char *buf, size_t size, off_t,
@@ -63,6 +68,9 @@ static struct sheepfs_file_operation {
 	int (*unlink)(const char *path);
 	int (*rmdir)(const char *path);
 	int (*release)(const char *path, struct fuse_file_info *);
+#ifdef FUSE_SUPPORT_BUF
+	int (*write_buf)(const char *path, struct fuse_bufvec *, off_t);
+#endif
 } sheepfs_file_ops[] = {
 	[OP_NULL]           = { NULL, NULL, NULL },
 	[OP_CLUSTER_INFO]   = { cluster_info_read, NULL,
@@ -80,7 +88,12 @@ static struct sheepfs_file_operation {
 				config_sheep_info_write,
 				config_sheep_info_get_size },
 	[OP_VOLUME]         = { volume_read, volume_write, volume_get_size,
-				volume_sync, volume_open },
+				volume_sync, volume_open, NULL, NULL,
+				volume_release,
+#ifdef FUSE_SUPPORT_BUF
+				volume_write_buf,
+#endif
+			      },
 #ifdef HAVE_HTTP
 	[OP_HTTP_ADDRESS]   = { http_address_read, http_address_write,
 				http_address_get_size },
@@ -239,6 +252,29 @@ static int sheepfs_write(const char *path, const char *buf, size_t size,
 	return ret;
 }
 
+#ifdef FUSE_SUPPORT_BUF
+static int sheepfs_write_buf(const char *path, struct fuse_bufvec *bufv,
+			     off_t offset, struct fuse_file_info *fi)
+{
+	size_t size = fuse_buf_size(bufv);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	unsigned op = sheepfs_get_op(path);
+	ssize_t ret;
+
+	if (sheepfs_file_ops[op].write_buf)
+		return sheepfs_file_ops[op].write_buf(path, bufv, offset);
+
+	/* the others write the data in memory */
+	dst.buf[0].mem = xmalloc(size);
+	ret = fuse_buf_copy(&dst, bufv, 0);
+	if (ret >= 0)
+		ret = sheepfs_write(path, dst.buf[0].mem, ret, offset, fi);
+	free(dst.buf[0].mem);
+
+	return ret;
+}
+#endif
+
 static int sheepfs_truncate(const char *path, off_t size)
 {
 	struct strbuf p = STRBUF_INIT;
@@ -297,6 +333,9 @@ static struct fuse_operations sheepfs_ops =  {
 	.truncate = sheepfs_truncate,
 	.read     = sheepfs_read,
 	.write    = sheepfs_write,
+#ifdef FUSE_SUPPORT_BUF
+	.write_buf = sheepfs_write_buf,
+#endif
 	.fsync    = sheepfs_fsync,
 	.open     = sheepfs_open,
 	.release  = sheepfs_release,
@@ -312,6 +351,13 @@ static int sheepfs_main_loop(char *mountpoint)
 	#ifdef FUSE_SUPPORT_BIGWRITES
 	fuse_opt_add_arg(&args, "-obig_writes");
 	#endif
+	fuse_opt_add_arg(&args, "-omax_write=" SHEEPFS_MAX_IO);
+	fuse_opt_add_arg(&args, "-omax_read=" SHEEPFS_MAX_IO);
+	fuse_opt_add_arg(&args, "-omax_readahead=" SHEEPFS_MAX_IO);
+	/* the writes of the volumes splice the pipe of fuse to the sheep */
+	#ifdef FUSE_SUPPORT_BUF
+	fuse_opt_add_arg(&args, "-osplice_read");
+	#endif
 	fuse_opt_add_arg(&args, "-okernel_cache");
 	fuse_opt_add_arg(&args, "-ofsname=sheepfs");
 	fuse_opt_add_arg(&args, mountpoint);
@@ -353,6 +399,7 @@ static void usage(int inval)
 Usage: sheepfs [OPTION]... MOUNTPOINT\n\
 Options:\n\
   -a, --address           specify the sheep address (default: 127.0.0.1)\n\
+  -c, --cache             cache the objects of the volumes in sheepfs\n\
   -d, --debug             enable debug output (implies -f)\n\
   -f, --foreground        sheepfs run in the foreground\n\
   -k, --pagecache         use local kernel's page cache to access volume\n\
@@ -375,6 +422,9 @@ int main(int argc, char **argv)
 		case 'a':
 			memcpy(sdhost, optarg, strlen(optarg));
 			break;
+		case 'c':
+			sheepfs_volume_cache = true;
+			break;
 		case 'd':
 			sheepfs_debug = true;
 			break;
@@ -26,6 +26,7 @@ enum sheepfs_opcode {
 extern char sheepfs_shadow[];
 extern int sheepfs_page_cache;
 extern int sheepfs_object_cache;
+extern int sheepfs_volume_cache;
 extern char sdhost[];
 extern int sdport;
 
@@ -61,11 +62,16 @@ int create_volume_layout(void);
 int volume_read(const char *path, char *buf, size_t size, off_t offset,
 		struct fuse_file_info *fi);
 int volume_write(const char *, const char *buf, size_t size, off_t);
+#ifdef FUSE_SUPPORT_BUF
+int volume_write_buf(const char *path, struct fuse_bufvec *bufv,
+		     off_t offset);
+#endif
 size_t volume_get_size(const char *);
 int volume_create_entry(const char *entry);
 int volume_remove_entry(const char *entry);
 int volume_sync(const char *path);
 int volume_open(const char *path, struct fuse_file_info *);
+int volume_release(const char *path, struct fuse_file_info *);
 int reset_socket_pool(void);
 int sheepfs_bnode_writer(uint64_t oid, void *mem, unsigned int len,
 			 uint64_t offset, uint32_t flags, int copies,
@@ -41,10 +41,20 @@
 
 /* #define DEBUG */
 
+/* An object of a volume in the cache */
+struct volume_cache {
+	bool in_use;
+	bool uptodate; /* the whole object is read */
+	unsigned long idx;
+	char *buf;
+	uint32_t dirty_start, dirty_end; /* the range to write back */
+	uint64_t used; /* for the LRU */
+};
+
 struct vdi_inode {
 	struct rb_node rb;
 	uint32_t vid;
-	struct sd_inode *inode;
+	struct sd_cinode *inode;
 /*
  * FIXME
  * 1) Consider various VM request queue depth.
@@ -59,15 +69,21 @@ struct vdi_inode {
 	int socket_pool[SOCKET_POOL_SIZE];
 	uatomic_bool socket_in_use[SOCKET_POOL_SIZE];
 	unsigned socket_poll_adder;
+#define VOLUME_CACHE_NR 8
+	struct sd_mutex cache_lock;
+	struct volume_cache cache[VOLUME_CACHE_NR];
+	uint64_t cache_clock;
+	off_t ra_next; /* where the last read stopped */
 };
 
 static struct rb_root vdi_inode_tree = RB_ROOT;
 static struct sd_rw_lock vdi_inode_tree_lock = SD_RW_LOCK_INITIALIZER;
 
-static inline bool is_data_obj_writeable(const struct sd_inode *inode,
+static inline bool is_data_obj_writeable(struct sd_cinode *inode,
 					 uint32_t idx)
 {
-	return inode->vdi_id == sd_inode_get_vid(inode, idx);
+	return sd_cinode_header(inode)->vdi_id ==
+		sd_cinode_get_vid(inode, idx);
 }
 
 static int vdi_inode_cmp(const struct vdi_inode *a, const struct vdi_inode *b)
@@ -103,7 +119,7 @@ retry:
 	sock_idx = uatomic_add_return(&vdi->socket_poll_adder, 1) %
 		   SOCKET_POOL_SIZE;
 	/* if socket_in_use[sock_idx] is false, set it to true, otherwise, retry */
-	if (uatomic_set_true(&vdi->socket_in_use[sock_idx]))
+	if (!uatomic_set_true(&vdi->socket_in_use[sock_idx]))
 		goto retry;
 	fd = vdi->socket_pool[sock_idx];
 	*idx = sock_idx;
@@ -116,91 +132,392 @@ static inline void put_socket_fd(struct vdi_inode *vdi, int idx)
 	uatomic_set_false(&vdi->socket_in_use[idx]);
 }
 
-static int volume_rw_object(char *buf, uint64_t oid, size_t size,
-			    off_t off, int rw)
+/* Return a free socket of the pool, or -1 if all are in use */
+static inline int try_get_socket_fd(struct vdi_inode *vdi, int *idx)
 {
-	struct sd_req hdr = { 0 };
-	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, fd, sock_idx;
-	bool create = false;
-	uint32_t vid = oid_to_vid(oid), vdi_id;
+	for (int i = 0; i < SOCKET_POOL_SIZE; i++) {
+		int sock_idx = uatomic_add_return(&vdi->socket_poll_adder, 1) %
+			       SOCKET_POOL_SIZE;
+
+		if (!uatomic_set_true(&vdi->socket_in_use[sock_idx]))
+			continue;
+		*idx = sock_idx;
+		return vdi->socket_pool[sock_idx];
+	}
+	return -1;
+}
+
+/* The I/O of a request on an object, sent before its reply is read */
+struct volume_io {
+	struct sd_req hdr;
 	struct vdi_inode *vdi;
-	unsigned long idx = 0;
+	char *buf;
+	struct fuse_bufvec *bufv; /* the data of a write, if buf is NULL */
+	uint64_t oid;
+	unsigned long idx;
+	bool create;
+	bool failed;
+	int fd, sock_idx;
+};
+
+/* Return false if the object is not there to read, which reads zero */
+static bool volume_io_prep(struct volume_io *io, char *buf, uint64_t oid,
+			   size_t size, off_t off, int rw)
+{
+	struct sd_req *hdr = &io->hdr;
+	uint32_t vid = oid_to_vid(oid), vdi_id;
 	uint64_t cow_oid = 0;
 
+	memset(io, 0, sizeof(*io));
+	io->buf = buf;
 	sd_read_lock(&vdi_inode_tree_lock);
-	vdi = vdi_inode_tree_search(vid);
+	io->vdi = vdi_inode_tree_search(vid);
 	sd_rw_unlock(&vdi_inode_tree_lock);
 
 	if (is_data_obj(oid)) {
-		idx = data_oid_to_idx(oid);
-		assert(vdi);
-		vdi_id = sd_inode_get_vid(vdi->inode, idx);
+		io->idx = data_oid_to_idx(oid);
+		assert(io->vdi);
+		vdi_id = sd_cinode_get_vid(io->vdi->inode, io->idx);
 		if (!vdi_id) {
 			/* if object doesn't exist, we're done */
 			if (rw == VOLUME_READ) {
 				memset(buf, 0, size);
-				goto done;
+				return false;
 			}
-			create = true;
+			io->create = true;
 		} else {
 			if (rw == VOLUME_READ) {
-				oid = vid_to_data_oid(vdi_id, idx);
+				oid = vid_to_data_oid(vdi_id, io->idx);
 			/* in case we are writing a COW object */
-			} else if (!is_data_obj_writeable(vdi->inode, idx)) {
-				cow_oid = vid_to_data_oid(vdi_id, idx);
-				hdr.flags |= SD_FLAG_CMD_COW;
-				create = true;
+			} else if (!is_data_obj_writeable(io->vdi->inode,
+							  io->idx)) {
+				cow_oid = vid_to_data_oid(vdi_id, io->idx);
+				hdr->flags |= SD_FLAG_CMD_COW;
+				io->create = true;
 			}
 		}
 	}
 
 	if (rw == VOLUME_READ)
-		hdr.opcode = SD_OP_READ_OBJ;
+		hdr->opcode = SD_OP_READ_OBJ;
 	else {
-		hdr.opcode = (create || is_vdi_btree_obj(oid)) ?
+		hdr->opcode = (io->create || is_vdi_btree_obj(oid)) ?
 			SD_OP_CREATE_AND_WRITE_OBJ : SD_OP_WRITE_OBJ;
-		hdr.flags |= SD_FLAG_CMD_WRITE;
+		hdr->flags |= SD_FLAG_CMD_WRITE;
 	}
 
-	hdr.obj.oid = oid;
-	hdr.obj.offset = off;
-	hdr.obj.cow_oid = cow_oid;
-	hdr.data_length = size;
+	hdr->obj.oid = oid;
+	hdr->obj.offset = off;
+	hdr->obj.cow_oid = cow_oid;
+	hdr->data_length = size;
 	if (sheepfs_object_cache)
-		hdr.flags |= SD_FLAG_CMD_CACHE;
+		hdr->flags |= SD_FLAG_CMD_CACHE;
+	io->oid = oid;
+	io->fd = -1;
+	return true;
+}
+
+/* Send the request on the socket fd of the pool */
+static int volume_io_send(struct volume_io *io, int fd, int sock_idx)
+{
+	struct sd_req *hdr = &io->hdr;
+	unsigned int wlen = 0;
+	int ret = -1;
+
+	io->fd = fd;
+	io->sock_idx = sock_idx;
+	if (hdr->flags & SD_FLAG_CMD_WRITE)
+		wlen = hdr->data_length;
+	if (io->buf || !wlen) {
+		ret = send_req(fd, hdr, io->buf, wlen, NULL, 0,
+			       MAX_RETRY_COUNT);
+		goto out;
+	}
 
-	fd = get_socket_fd(vdi, &sock_idx);
-	ret = exec_req(fd, &hdr, buf, NULL, 0, MAX_RETRY_COUNT);
-	put_socket_fd(vdi, sock_idx);
+#ifdef FUSE_SUPPORT_BUF
+	/* splice the data from the pipe of fuse to the socket */
+	ret = send_req(fd, hdr, NULL, 0, NULL, 0, MAX_RETRY_COUNT);
+	if (!ret) {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(wlen);
+
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_RETRY;
+		dst.buf[0].fd = fd;
+		if (fuse_buf_copy(&dst, io->bufv, 0) != wlen)
+			ret = -1;
+	}
+#endif
+out:
+	io->failed = !!ret;
+	return ret;
+}
+
+/* Read the reply of the request and give the socket back to the pool */
+static int volume_io_recv(struct volume_io *io)
+{
+	struct sd_req *hdr = &io->hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	struct vdi_inode *vdi = io->vdi;
+	bool write = hdr->flags & SD_FLAG_CMD_WRITE;
+	unsigned int rlen = write ? 0 : hdr->data_length;
+	int ret = 1;
+
+	if (io->failed)
+		goto out;
+	ret = do_read(io->fd, rsp, sizeof(*rsp), NULL, 0, MAX_RETRY_COUNT);
+	if (!ret && rlen) {
+		if (rlen > rsp->data_length)
+			rlen = rsp->data_length;
+		ret = do_read(io->fd, io->buf, rlen, NULL, 0, MAX_RETRY_COUNT);
+	}
+out:
+	put_socket_fd(vdi, io->sock_idx);
 
 	if (ret || rsp->result != SD_RES_SUCCESS) {
 		sheepfs_pr("failed to %s object %" PRIx64 " ret %d, res %s\n",
-			   rw == VOLUME_READ ? "read" : "write",
-			   oid, ret, sd_strerror(rsp->result));
+			   write ? "write" : "read",
+			   io->oid, ret, sd_strerror(rsp->result));
+		io->failed = true;
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Update the inode for a created object, which writes an object too, so it is
+ * done once the request holds no socket
+ */
+static int volume_io_done(struct volume_io *io)
+{
+	struct vdi_inode *vdi = io->vdi;
+	uint32_t vid = oid_to_vid(io->oid);
 
-	if (create) {
-		sd_inode_set_vid(vdi->inode, idx, vid);
+	if (io->failed)
+		return -1;
+	if (io->create) {
+		if (sd_cinode_set_vid(vdi->inode, io->idx, vid) !=
+		    SD_RES_SUCCESS)
+			return -1;
 		/* writeback inode update */
-		if (sd_inode_write_vid(vdi->inode, idx, vid, vid, 0, false,
-				       false) < 0)
+		if (sd_cinode_write_vid(vdi->inode, io->idx, vid, vid, 0, false,
+					false) < 0)
 			return -1;
 	}
-done:
+	return 0;
+}
+
+static int volume_rw_object(char *buf, uint64_t oid, size_t size,
+			    off_t off, int rw)
+{
+	struct volume_io io;
+	int fd, sock_idx;
+
+	if (!volume_io_prep(&io, buf, oid, size, off, rw))
+		return size;
+
+	fd = get_socket_fd(io.vdi, &sock_idx);
+	volume_io_send(&io, fd, sock_idx);
+	volume_io_recv(&io);
+	if (volume_io_done(&io) < 0)
+		return -1;
 	return size;
 }
 
-/* Do sync read/write */
-static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
+/*
+ * The cache of the objects of the volumes
+ *
+ * With --cache, a volume keeps the last VOLUME_CACHE_NR objects it used in
+ * memory.  A read which goes on from where the last one stopped, or touches a
+ * cached object, reads the whole objects it touches into the cache, so cp or
+ * tar make a request per object instead of one per fuse read, and the random
+ * reads go to the sheep as before.  The writes go to the cache, merged into a
+ * range to write back per object, which is written when the object leaves the
+ * cache, when a write doesn't touch the range of an object not read, or on
+ * fsync and release.
+ */
+static int volume_cache_writeback(struct vdi_inode *vdi,
+				  struct volume_cache *c)
+{
+	uint32_t start = c->dirty_start, len = c->dirty_end - c->dirty_start;
+
+	if (!len)
+		return 0;
+	if (volume_rw_object(c->buf + start, vid_to_data_oid(vdi->vid, c->idx),
+			     len, start, VOLUME_WRITE) < 0)
+		return -1;
+	c->dirty_start = c->dirty_end = 0;
+	return 0;
+}
+
+static bool volume_cache_has(struct vdi_inode *vdi, off_t offset, size_t size)
+{
+	unsigned long first = offset / SD_DATA_OBJ_SIZE,
+		      last = (offset + size - 1) / SD_DATA_OBJ_SIZE;
+
+	for (int i = 0; i < VOLUME_CACHE_NR; i++)
+		if (vdi->cache[i].in_use && vdi->cache[i].idx >= first &&
+		    vdi->cache[i].idx <= last)
+			return true;
+	return false;
+}
+
+/* Return the entry of the object, writing back the one it replaces */
+static struct volume_cache *volume_cache_get(struct vdi_inode *vdi,
+					     unsigned long idx)
+{
+	struct volume_cache *c = NULL;
+
+	for (int i = 0; i < VOLUME_CACHE_NR; i++) {
+		struct volume_cache *e = vdi->cache + i;
+
+		if (e->in_use && e->idx == idx) {
+			c = e;
+			goto out;
+		}
+		if (!c || (c->in_use && (!e->in_use || e->used < c->used)))
+			c = e;
+	}
+
+	if (c->in_use && volume_cache_writeback(vdi, c) < 0)
+		return NULL;
+	if (!c->buf)
+		c->buf = xmalloc(SD_DATA_OBJ_SIZE);
+	c->in_use = true;
+	c->uptodate = false;
+	c->idx = idx;
+out:
+	c->used = ++vdi->cache_clock;
+	return c;
+}
+
+static int volume_cache_read(struct vdi_inode *vdi, char *buf,
+			     unsigned long idx, uint32_t start, size_t len,
+			     size_t vdi_size)
+{
+	struct volume_cache *c = volume_cache_get(vdi, idx);
+	uint64_t off = (uint64_t)idx * SD_DATA_OBJ_SIZE;
+
+	if (!c)
+		return -1;
+	if (!c->uptodate &&
+	    (start < c->dirty_start || start + len > c->dirty_end)) {
+		if (volume_cache_writeback(vdi, c) < 0 ||
+		    volume_rw_object(c->buf, vid_to_data_oid(vdi->vid, idx),
+				     min(vdi_size - off,
+					 (uint64_t)SD_DATA_OBJ_SIZE),
+				     0, VOLUME_READ) < 0)
+			return -1;
+		c->uptodate = true;
+	}
+	memcpy(buf, c->buf + start, len);
+	return 0;
+}
+
+static int volume_cache_write(struct vdi_inode *vdi, char *buf,
+			      struct fuse_bufvec *bufv, unsigned long idx,
+			      uint32_t start, size_t len)
+{
+	struct volume_cache *c = volume_cache_get(vdi, idx);
+	uint32_t end = start + len;
+
+	if (!c)
+		return -1;
+	/* the range between the writes is known only if the object is read */
+	if (!c->uptodate && (start > c->dirty_end || end < c->dirty_start) &&
+	    volume_cache_writeback(vdi, c) < 0)
+		return -1;
+
+	if (buf)
+		memcpy(c->buf + start, buf, len);
+#ifdef FUSE_SUPPORT_BUF
+	else {
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+
+		dst.buf[0].mem = c->buf + start;
+		if (fuse_buf_copy(&dst, bufv, 0) != len)
+			return -1;
+	}
+#endif
+
+	if (c->dirty_start == c->dirty_end) {
+		c->dirty_start = start;
+		c->dirty_end = end;
+	} else {
+		c->dirty_start = min(c->dirty_start, start);
+		c->dirty_end = max(c->dirty_end, end);
+	}
+	return 0;
+}
+
+/* Return false if the read is left to the sheep */
+static bool volume_cache_rw(struct vdi_inode *vdi, char *buf,
+			    struct fuse_bufvec *bufv, size_t size,
+			    off_t offset, int rw, size_t vdi_size,
+			    ssize_t *done)
+{
+	size_t left = size, len;
+	uint32_t start = offset % SD_DATA_OBJ_SIZE;
+	unsigned long idx = offset / SD_DATA_OBJ_SIZE;
+	int ret = 0;
+
+	sd_mutex_lock(&vdi->cache_lock);
+	if (rw == VOLUME_READ && offset != vdi->ra_next &&
+	    !volume_cache_has(vdi, offset, size)) {
+		vdi->ra_next = offset + size;
+		sd_mutex_unlock(&vdi->cache_lock);
+		return false;
+	}
+
+	while (left > 0 && ret == 0) {
+		len = min(left, (size_t)(SD_DATA_OBJ_SIZE - start));
+		if (rw == VOLUME_READ)
+			ret = volume_cache_read(vdi, buf, idx, start, len,
+						vdi_size);
+		else
+			ret = volume_cache_write(vdi, buf, bufv, idx, start,
+						 len);
+		left -= len;
+		start = 0;
+		idx++;
+		if (buf)
+			buf += len;
+	}
+	if (rw == VOLUME_READ)
+		vdi->ra_next = offset + size;
+	sd_mutex_unlock(&vdi->cache_lock);
+
+	*done = ret < 0 ? -1 : (ssize_t)size;
+	return true;
+}
+
+static int volume_cache_flush(struct vdi_inode *vdi)
+{
+	int ret = 0;
+
+	sd_mutex_lock(&vdi->cache_lock);
+	for (int i = 0; i < VOLUME_CACHE_NR; i++)
+		if (vdi->cache[i].in_use &&
+		    volume_cache_writeback(vdi, vdi->cache + i) < 0)
+			ret = -1;
+	sd_mutex_unlock(&vdi->cache_lock);
+	return ret;
+}
+
+/*
+ * Do the read/write, the requests on the objects in parallel over the sockets
+ * of the pool.  A request waits for a socket only when none of the others is
+ * in flight, so the requests never hold the sockets each other waits for.
+ */
+static ssize_t volume_do_rw(const char *path, char *buf,
+			    struct fuse_bufvec *bufv, size_t size,
 			    off_t offset, int rw)
 {
+	struct volume_io *ios;
 	uint32_t vid;
 	uint64_t oid;
 	unsigned long idx;
 	off_t start;
-	size_t len, ret, vdi_size, sz;
+	size_t len, vdi_size, sz;
+	int nr = 0, first = 0, ret = 0;
 
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -1;
@@ -215,6 +532,18 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 	if (offset + size > vdi_size)
 		size = vdi_size - offset;
 
+	if (sheepfs_volume_cache) {
+		struct vdi_inode *vdi;
+		ssize_t done;
+
+		sd_read_lock(&vdi_inode_tree_lock);
+		vdi = vdi_inode_tree_search(vid);
+		sd_rw_unlock(&vdi_inode_tree_lock);
+		if (volume_cache_rw(vdi, buf, bufv, size, offset, rw, vdi_size,
+				    &done))
+			return done;
+	}
+
 	sz = size;
 	idx = offset / SD_DATA_OBJ_SIZE;
 	oid = vid_to_data_oid(vid, idx);
@@ -224,26 +553,45 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 	if (size < len)
 		len = size;
 
+	ios = xcalloc((start + size) / SD_DATA_OBJ_SIZE + 1, sizeof(*ios));
 	do {
+		struct volume_io *io = ios + nr;
+		int fd, sock_idx;
+
 #ifdef DEBUG
 		sheepfs_pr("%s oid %"PRIx64", off %ju, len %zu,"
 			   " size %zu\n",
 			   rw == VOLUME_READ ? "read" : "write",
 			   oid, start, len, size);
 #endif
-		ret = volume_rw_object(buf, oid, len, start, rw);
-
-		if (ret != len)
-			return -1;
-
+		if (!volume_io_prep(io, buf, oid, len, start, rw))
+			goto next;
+		io->bufv = bufv;
+
+		while ((fd = try_get_socket_fd(io->vdi, &sock_idx)) < 0 &&
+		       first < nr)
+			volume_io_recv(ios + first++);
+		if (fd < 0)
+			fd = get_socket_fd(io->vdi, &sock_idx);
+		volume_io_send(io, fd, sock_idx);
+		nr++;
+next:
 		oid++;
 		size -= len;
 		start = (start + len) % SD_DATA_OBJ_SIZE;
-		buf += len;
+		if (buf)
+			buf += len;
 		len = size > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : size;
 	} while (size > 0);
 
-	return sz - size;
+	while (first < nr)
+		volume_io_recv(ios + first++);
+	for (int i = 0; i < nr; i++)
+		if (volume_io_done(ios + i) < 0)
+			ret = -1;
+	free(ios);
+
+	return ret < 0 ? ret : (ssize_t)(sz - size);
 }
 
 int sheepfs_bnode_writer(uint64_t oid, void *mem, unsigned int len,
@@ -272,7 +620,7 @@ int volume_read(const char *path, char *buf, size_t size, off_t offset,
 {
 	ssize_t done;
 
-	done = volume_do_rw(path, buf, size, offset, VOLUME_READ);
+	done = volume_do_rw(path, buf, NULL, size, offset, VOLUME_READ);
 	if (done < 0)
 		return -EIO;
 
@@ -283,13 +631,30 @@ int volume_write(const char *path, const char *buf, size_t size, off_t offset)
 {
 	ssize_t done;
 
-	done = volume_do_rw(path, (char *)buf, size, offset, VOLUME_WRITE);
+	done = volume_do_rw(path, (char *)buf, NULL, size, offset,
+			    VOLUME_WRITE);
 	if (done < 0)
 		return -EIO;
 
 	return done;
 }
 
+#ifdef FUSE_SUPPORT_BUF
+/* The write of the data in the pipe of fuse, which is spliced to the sheep */
+int volume_write_buf(const char *path, struct fuse_bufvec *bufv,
+		     off_t offset)
+{
+	ssize_t done;
+
+	done = volume_do_rw(path, NULL, bufv, fuse_buf_size(bufv), offset,
+			    VOLUME_WRITE);
+	if (done < 0)
+		return -EIO;
+
+	return done;
+}
+#endif
+
 size_t volume_get_size(const char *path)
 {
 	size_t size = 0;
@@ -330,6 +695,22 @@ out:
 	return 0;
 }
 
+static int volume_flush(uint32_t vid)
+{
+	struct vdi_inode *vdi;
+
+	sd_read_lock(&vdi_inode_tree_lock);
+	vdi = vdi_inode_tree_search(vid);
+	sd_rw_unlock(&vdi_inode_tree_lock);
+
+	if (volume_cache_flush(vdi) < 0) {
+		sheepfs_pr("failed to write back the cache of vdi %"PRIx32"\n",
+			   vid);
+		return -1;
+	}
+	return 0;
+}
+
 int volume_sync(const char *path)
 {
 	uint32_t vid;
@@ -337,12 +718,28 @@ int volume_sync(const char *path)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -EIO;
 
+	if (volume_flush(vid) < 0)
+		return -EIO;
+
 	if (sheepfs_object_cache && volume_do_sync(vid) < 0)
 		return -EIO;
 
 	return 0;
 }
 
+int volume_release(const char *path, struct fuse_file_info *fi)
+{
+	uint32_t vid;
+
+	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
+		return -EIO;
+
+	if (volume_flush(vid) < 0)
+		return -EIO;
+
+	return 0;
+}
+
 int volume_open(const char *path, struct fuse_file_info *fi)
 {
 	if (!sheepfs_page_cache)
@@ -397,7 +794,6 @@ out:
 static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 {
 	struct strbuf *buf;
-	void *inode_buf = NULL;
 	struct vdi_inode *inode = NULL, *dummy;
 	char command[COMMAND_LEN];
 	uint32_t snapid;
@@ -419,14 +815,9 @@ static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 		data++; /* eat the "\n" */
 	} while (snapid != 0);
 
-	inode_buf = malloc(SD_INODE_SIZE);
-	if (!inode_buf) {
-		sheepfs_pr("%m\n");
-		goto err;
-	}
-
 	inode = xzalloc(sizeof(*inode));
 	inode->vid = *vid;
+	sd_init_mutex(&inode->cache_lock);
 	if (setup_socket_pool(inode->socket_pool, SOCKET_POOL_SIZE) < 0) {
 		sheepfs_pr("failed to setup socket pool\n");
 		goto err;
@@ -437,18 +828,16 @@ static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 	sd_rw_unlock(&vdi_inode_tree_lock);
 	if (dummy)
 		goto err;
-	if (volume_rw_object(inode_buf, vid_to_vdi_oid(*vid), SD_INODE_SIZE,
-			     0, VOLUME_READ) < 0) {
+	/* the pages of the index are read as they are looked up */
+	if (sd_cinode_read(*vid, &inode->inode) != SD_RES_SUCCESS) {
 		rb_erase(&inode->rb, &vdi_inode_tree);
 		sheepfs_pr("failed to read inode for %"PRIx32"\n", *vid);
 		goto err;
 	}
-	inode->inode = inode_buf;
 	strbuf_release(buf);
 	free(buf);
 	return 0;
 err:
-	free(inode_buf);
 	free(inode);
 	strbuf_release(buf);
 	free(buf);
@@ -532,6 +921,9 @@ int volume_remove_entry(const char *entry)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -1;
 
+	if (volume_flush(vid) < 0)
+		return -1;
+
 	if (sheepfs_object_cache && volume_sync_and_delete(vid) < 0)
 		return -1;
 
@@ -539,12 +931,15 @@ int volume_remove_entry(const char *entry)
 	vdi = vdi_inode_tree_search(vid);
 	sd_rw_unlock(&vdi_inode_tree_lock);
 	destroy_socket_pool(vdi->socket_pool, SOCKET_POOL_SIZE);
+	for (int i = 0; i < VOLUME_CACHE_NR; i++)
+		free(vdi->cache[i].buf);
+	sd_destroy_mutex(&vdi->cache_lock);
 
 	sd_write_lock(&vdi_inode_tree_lock);
 	rb_erase(&vdi->rb, &vdi_inode_tree);
 	sd_rw_unlock(&vdi_inode_tree_lock);
 
-	free(vdi->inode);
+	sd_cinode_free(vdi->inode);
 	free(vdi);
 	shadow_file_delete(path);
 
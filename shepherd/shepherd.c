@@ -59,9 +59,32 @@ struct sheep {
 
 	struct list_node sheep_list;
 	struct list_node join_wait_list;
+
+	/* in sheep_tree by node.nid, once the node is known */
+	struct rb_node nid_node;
+	bool indexed;
+
+	/*
+	 * The messages to the joined sheep, sent together by flush_msgs() once
+	 * the events of a round of the event loop are handled
+	 */
+	char *obuf;
+	size_t olen, osize;
+	int nr_msgs;
+	struct list_node flush_list;
+
+	/* the join request kept while another sheep is joining */
+	struct sph_msg_join *wait_join;
+	uint32_t wait_join_len;
 };
 
 static LIST_HEAD(sheep_list_head);
+static struct rb_root sheep_tree = RB_ROOT;
+static LIST_HEAD(flush_list_head);
+
+/* the joined nodes, built again only after the membership changes */
+static struct sd_node joined_nodes[SD_MAX_NODES];
+static int nr_joined = -1;
 
 static bool running;
 static const char *progname;
@@ -72,32 +95,92 @@ static bool is_sd_node_zero(struct sd_node *node)
 	return !memcmp(node, &zero_node, sizeof(*node));
 }
 
+static void nodes_changed(void)
+{
+	nr_joined = -1;
+}
+
 static int build_node_array(struct sd_node *nodes)
 {
-	int i;
 	struct sheep *s;
 
-	i = 0;
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
+	if (nr_joined < 0) {
+		nr_joined = 0;
+		list_for_each_entry(s, &sheep_list_head, sheep_list) {
+			if (s->state != SHEEP_STATE_JOINED)
+				continue;
 
-		nodes[i++] = s->node;
+			joined_nodes[nr_joined++] = s->node;
+		}
 	}
 
-	return i;
+	memcpy(nodes, joined_nodes, nr_joined * sizeof(*nodes));
+	return nr_joined;
+}
+
+static int sheep_cmp(const struct sheep *a, const struct sheep *b)
+{
+	return node_id_cmp(&a->node.nid, &b->node.nid);
 }
 
 static struct sheep *find_sheep_by_nid(struct node_id *id)
+{
+	struct sheep key = { .node.nid = *id };
+
+	return rb_search(&sheep_tree, &key, nid_node, sheep_cmp);
+}
+
+/* Index the sheep by its node, the latest connection of a node wins */
+static void index_sheep(struct sheep *sheep)
+{
+	struct sheep *old;
+
+	old = rb_insert(&sheep_tree, sheep, nid_node, sheep_cmp);
+	if (old) {
+		rb_erase(&old->nid_node, &sheep_tree);
+		old->indexed = false;
+		rb_insert(&sheep_tree, sheep, nid_node, sheep_cmp);
+	}
+	sheep->indexed = true;
+}
+
+static struct timer flush_timer;
+
+/* Queue a message to the joined sheep */
+static void queue_msg(struct sheep *s, uint32_t type, const void *body,
+		      uint32_t body_len)
+{
+	struct sph_msg msg = { .type = type, .body_len = body_len };
+	size_t len = sizeof(msg) + body_len;
+
+	if (s->olen + len > s->osize) {
+		s->osize = max(s->osize * 2, s->olen + len);
+		s->obuf = xrealloc(s->obuf, s->osize);
+	}
+	memcpy(s->obuf + s->olen, &msg, sizeof(msg));
+	memcpy(s->obuf + s->olen + sizeof(msg), body, body_len);
+	s->olen += len;
+	s->nr_msgs++;
+
+	if (!list_linked(&s->flush_list))
+		list_add_tail(&s->flush_list, &flush_list_head);
+	/* run right after the events of this round */
+	if (!timer_pending(&flush_timer))
+		add_timer(&flush_timer, 0);
+}
+
+/* Queue a message to all the joined sheep but skip */
+static void broadcast_msg(uint32_t type, const void *body, uint32_t body_len,
+			  const struct sheep *skip)
 {
 	struct sheep *s;
 
 	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (!node_id_cmp(&s->node.nid, id))
-			return s;
-	}
+		if (s->state != SHEEP_STATE_JOINED || s == skip)
+			continue;
 
-	return NULL;
+		queue_msg(s, type, body, body_len);
+	}
 }
 
 static int remove_efd;
@@ -107,43 +190,62 @@ static inline void remove_sheep(struct sheep *sheep)
 	sd_debug("remove_sheep() called, removing %s",
 		 node_to_str(&sheep->node));
 
+	if (sheep->state == SHEEP_STATE_JOINED)
+		nodes_changed();
 	sheep->state = SHEEP_STATE_LEAVING;
 	eventfd_xwrite(remove_efd, 1);
 
 	event_force_refresh();
 }
 
-static int notify_remove_sheep(struct sheep *leaving)
+/*
+ * Send the messages queued to each sheep in one write, wrapped in
+ * SPH_SRV_MSG_BATCH if there are more than one
+ */
+static void flush_msgs(void *data)
 {
-	int ret, failed = 0;
+	struct sph_msg batch = { .type = SPH_SRV_MSG_BATCH };
 	struct sheep *s;
-	struct sph_msg snd;
+	ssize_t wbytes, len;
 
-	snd.type = SPH_SRV_MSG_REMOVE;
-	snd.body_len = sizeof(struct sd_node);
-
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
+	list_for_each_entry(s, &flush_list_head, flush_list) {
+		list_del(&s->flush_list);
 		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		ret = writev2(s->fd, &snd,
-			&leaving->node, sizeof(struct sd_node));
-
-		if (sizeof(snd) + sizeof(struct sd_node) != ret) {
-			sd_err("writev2() failed: %m");
-
+			goto next;
+
+		if (s->nr_msgs == 1) {
+			len = s->olen;
+			wbytes = xwrite(s->fd, s->obuf, s->olen);
+		} else {
+			batch.body_len = s->olen;
+			len = sizeof(batch) + s->olen;
+			wbytes = writev2(s->fd, &batch, s->obuf, s->olen);
+		}
+		if (wbytes != len) {
+			sd_err("failed to send %d messages to %s: %m",
+			       s->nr_msgs, node_to_str(&s->node));
 			remove_sheep(s);
-			failed++;
 		}
+next:
+		s->olen = 0;
+		s->nr_msgs = 0;
 	}
+}
+
+static struct timer flush_timer = {
+	.callback = flush_msgs,
+};
 
-	return failed;
+static void notify_remove_sheep(struct sheep *leaving)
+{
+	broadcast_msg(SPH_SRV_MSG_REMOVE, &leaving->node,
+		      sizeof(struct sd_node), NULL);
 }
 
 static void remove_handler(int fd, int events, void *data)
 {
 	struct sheep *s;
-	int nr_removed, failed = 0;
+	int nr_removed;
 
 	nr_removed = eventfd_xread(remove_efd);
 
@@ -172,7 +274,7 @@ remove:
 		goto del;
 	}
 
-	goto end;
+	return;
 
 del:
 	sd_info("removed node: %s", node_to_str(&s->node));
@@ -181,46 +283,81 @@ del:
 	close(s->fd);
 
 	list_del(&s->sheep_list);
-	list_del(&s->join_wait_list);
+	if (list_linked(&s->join_wait_list))
+		list_del(&s->join_wait_list);
+	if (list_linked(&s->flush_list))
+		list_del(&s->flush_list);
+	if (s->indexed)
+		rb_erase(&s->nid_node, &sheep_tree);
+	free(s->obuf);
+	free(s->wait_join);
 	free(s);
 
 	if (--nr_removed)
 		goto remove;
-
-end:
-	sd_debug("nodes which failed during remove_handler(): %d", failed);
 }
 
 static LIST_HEAD(join_wait_queue);
 
-static int release_joining_sheep(void)
+/*
+ * Elect one of the joined nodes to accept the join of the sheep, the sheep
+ * itself if none.  Return false if the sheep failed.
+ */
+static bool start_join(struct sheep *sheep, struct sph_msg_join *join,
+		       uint32_t join_len)
 {
-	ssize_t wbytes;
-	struct sheep *waiting;
 	struct sph_msg snd;
-	int nr_failed = 0;
+	ssize_t wbytes;
 
-retry:
-	if (list_empty(&join_wait_queue))
-		return nr_failed;
+	sheep->node = join->new_node;
+	index_sheep(sheep);
+	join->nr_nodes = build_node_array(join->nodes);
 
-	waiting = list_first_entry(&join_wait_queue,
-				struct sheep, join_wait_list);
-	list_del(&waiting->join_wait_list);
+	/* elect one node from the already joined nodes */
+	if (join->nr_nodes > 0) {
+		struct sd_node *n = join->nodes + rand() % join->nr_nodes;
 
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_JOIN_RETRY;
+		queue_msg(find_sheep_by_nid(&n->nid), SPH_SRV_MSG_NEW_NODE,
+			  join, join_len);
+	} else {
+		snd.type = SPH_SRV_MSG_NEW_NODE;
+		snd.body_len = join_len;
+		wbytes = writev2(sheep->fd, &snd, join, join_len);
+		if (sizeof(snd) + join_len != wbytes) {
+			sd_err("writev2() failed: %m");
+			remove_sheep(sheep);
+			return false;
+		}
+	}
+
+	state = SPH_STATE_JOINING;
+	return true;
+}
+
+/*
+ * Start the join of the next waiting sheep with its kept request, which
+ * saves the round trip of SPH_SRV_MSG_JOIN_RETRY per sheep in a join storm
+ */
+static int release_joining_sheep(void)
+{
+	struct sheep *waiting;
+	int nr_failed = 0;
 
-	wbytes = xwrite(waiting->fd, &snd, sizeof(snd));
-	if (sizeof(snd) != wbytes) {
-		sd_err("xwrite() failed: %m");
-		remove_sheep(waiting);
+	while (!list_empty(&join_wait_queue)) {
+		waiting = list_first_entry(&join_wait_queue,
+					   struct sheep, join_wait_list);
+		list_del(&waiting->join_wait_list);
+
+		if (start_join(waiting, waiting->wait_join,
+			       waiting->wait_join_len)) {
+			free(waiting->wait_join);
+			waiting->wait_join = NULL;
+			break;
+		}
 
 		sd_info("node %s is failed to join",
 			node_to_str(&waiting->node));
 		nr_failed++;
-
-		goto retry;
 	}
 
 	return nr_failed;
@@ -229,77 +366,48 @@ retry:
 static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 {
 	int fd = sheep->fd;
-	ssize_t rbytes, wbytes;
-
-	struct sph_msg snd;
+	ssize_t rbytes;
 	struct sph_msg_join *join;
 
-	if (state == SPH_STATE_JOINING) {
-		/* we have to trash opaque from the sheep */
-		char *buf;
-		buf = xzalloc(msg->body_len);
-		rbytes = xread(fd, buf, msg->body_len);
-		if (rbytes != msg->body_len) {
-			sd_err("xread() failed: %m");
-			goto purge_current_sheep;
-		}
-		free(buf);
-
-		list_add(&sheep->join_wait_list, &join_wait_queue);
-
-		sd_debug("there is already a joining sheep");
-		return;
-	}
-
 	join = xzalloc(msg->body_len);
 	rbytes = xread(fd, join, msg->body_len);
 	if (msg->body_len != rbytes) {
 		sd_err("xread() failed: %m");
 		free(join);
-		goto purge_current_sheep;
+		remove_sheep(sheep);
+		return;
 	}
 
-	sheep->node = join->new_node;
-	join->nr_nodes = build_node_array(join->nodes);
-
-	snd.type = SPH_SRV_MSG_NEW_NODE;
-	snd.body_len = msg->body_len;
+	if (state == SPH_STATE_JOINING) {
+		free(sheep->wait_join);
+		sheep->wait_join = join;
+		sheep->wait_join_len = msg->body_len;
+		if (!list_linked(&sheep->join_wait_list))
+			list_add_tail(&sheep->join_wait_list,
+				      &join_wait_queue);
 
-	/* elect one node from the already joined nodes */
-	if (join->nr_nodes > 0) {
-		struct sd_node *n = join->nodes + rand() % join->nr_nodes;
-		fd = find_sheep_by_nid(&n->nid)->fd;
+		sd_debug("there is already a joining sheep");
+		return;
 	}
 
-	wbytes = writev2(fd, &snd, join, msg->body_len);
+	start_join(sheep, join, msg->body_len);
 	free(join);
-
-	if (sizeof(snd) + msg->body_len != wbytes) {
-		sd_err("writev2() failed: %m");
-
-		goto purge_current_sheep;
-	}
-
-	state = SPH_STATE_JOINING;
-	return;
-
-purge_current_sheep:
-	remove_sheep(sheep);
 }
 
 static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 {
-	int fd = sheep->fd, removed = 0;
+	int fd = sheep->fd;
 	ssize_t rbytes, wbytes;
 
 	char *opaque;
 	int opaque_len;
 
 	struct sph_msg_join *join;
-	struct sheep *s, *joining_sheep;
+	struct sheep *joining_sheep;
 	struct sph_msg snd;
 	struct sph_msg_join_reply *join_reply_body;
 	struct sph_msg_join_node_finish *join_node_finish;
+	size_t finish_len;
 
 	sd_debug("new node reply from %s", node_to_str(&sheep->node));
 
@@ -337,6 +445,7 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 		joining_sheep->node;
 	memcpy(join_reply_body->opaque, opaque, opaque_len);
 
+	/* directly, the joining sheep reads it before it gets a batch */
 	wbytes = writev2(joining_sheep->fd, &snd,
 			join_reply_body, snd.body_len);
 	free(join_reply_body);
@@ -344,44 +453,31 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 
 	if (sizeof(snd) + snd.body_len != wbytes) {
 		sd_err("writev2() to master failed: %m");
+		free(opaque);
 
 		goto purge_current_sheep;
 	}
 
-	snd.type = SPH_SRV_MSG_NEW_NODE_FINISH;
-	snd.body_len = sizeof(*join_node_finish) + opaque_len;
-
-	join_node_finish = xzalloc(snd.body_len);
+	finish_len = sizeof(*join_node_finish) + opaque_len;
+	join_node_finish = xzalloc(finish_len);
 	join_node_finish->new_node = joining_sheep->node;
 	memcpy(join_node_finish->opaque, opaque, opaque_len);
 	join_node_finish->nr_nodes = build_node_array(join_node_finish->nodes);
 	join_node_finish->nodes[join_node_finish->nr_nodes++] =
 		joining_sheep->node;
 
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		if (s == joining_sheep)
-			continue;
-
-		wbytes = writev2(s->fd, &snd, join_node_finish, snd.body_len);
-
-		if (sizeof(snd) + snd.body_len != wbytes) {
-			sd_err("writev2() failed: %m");
-			remove_sheep(s);
-			removed++;
-		}
-	}
+	broadcast_msg(SPH_SRV_MSG_NEW_NODE_FINISH, join_node_finish,
+		      finish_len, joining_sheep);
 
 	free(join_node_finish);
 	free(opaque);
 
 	joining_sheep->state = SHEEP_STATE_JOINED;
+	nodes_changed();
 
 	state = SPH_STATE_DEFAULT;
 
-	removed += release_joining_sheep();
+	release_joining_sheep();
 	return;
 
 purge_current_sheep:
@@ -392,19 +488,19 @@ purge_current_sheep:
 
 static void sph_handle_notify(struct sph_msg *msg, struct sheep *sheep)
 {
-	ssize_t rbytes, wbytes;
-	int fd = sheep->fd, removed = 0;
+	ssize_t rbytes;
+	int fd = sheep->fd;
 
-	struct sph_msg snd;
 	struct sph_msg_notify *notify;
 	int notify_msg_len;
 	struct sph_msg_notify_forward *notify_forward;
-	struct sheep *s;
+	size_t forward_len;
 
 	notify = xzalloc(msg->body_len);
 	rbytes = xread(fd, notify, msg->body_len);
 	if (rbytes != msg->body_len) {
 		sd_err("xread() failed: %m");
+		free(notify);
 		goto purge_current_sheep;
 	}
 
@@ -415,28 +511,11 @@ static void sph_handle_notify(struct sph_msg *msg, struct sheep *sheep)
 	notify_forward->unblock = notify->unblock;
 	free(notify);
 
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_NOTIFY_FORWARD;
-	snd.body_len = notify_msg_len + sizeof(*notify_forward);
-
+	forward_len = notify_msg_len + sizeof(*notify_forward);
 	notify_forward->from_node = sheep->node;
 
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd, notify_forward, snd.body_len);
-		if (sizeof(snd) + snd.body_len != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto notify_failed;
-		}
-
-		continue;
-
-notify_failed:
-		remove_sheep(s);
-		removed++;
-	}
+	broadcast_msg(SPH_SRV_MSG_NOTIFY_FORWARD, notify_forward, forward_len,
+		      NULL);
 
 	free(notify_forward);
 	return;
@@ -447,66 +526,16 @@ purge_current_sheep:
 
 static void sph_handle_block(struct sph_msg *msg, struct sheep *sheep)
 {
-	int removed = 0;
-	struct sheep *s;
-	struct sph_msg snd;
-
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_BLOCK_FORWARD;
-	snd.body_len = sizeof(struct sd_node);
-
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		ssize_t wbytes;
-
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd,
-				&sheep->node, sizeof(struct sd_node));
-		if (sizeof(snd) + sizeof(struct sd_node) != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto block_failed;
-		}
-
-		continue;
-
-block_failed:	/* FIXME: is this correct behaviour? */
-		remove_sheep(s);
-		removed++;
-	}
-
-	return;
+	broadcast_msg(SPH_SRV_MSG_BLOCK_FORWARD, &sheep->node,
+		      sizeof(struct sd_node), NULL);
 }
 
 static void sph_handle_leave(struct sph_msg *msg, struct sheep *sheep)
 {
-	struct sheep *s;
-	struct sph_msg snd;
-
 	sd_info("%s is leaving", node_to_str(&sheep->node));
 
-	memset(&snd, 0, sizeof(snd));
-	snd.type = SPH_SRV_MSG_LEAVE_FORWARD;
-	snd.body_len = sizeof(struct sd_node);
-
-	list_for_each_entry(s, &sheep_list_head, sheep_list) {
-		ssize_t wbytes;
-
-		if (s->state != SHEEP_STATE_JOINED)
-			continue;
-
-		wbytes = writev2(s->fd, &snd,
-				&sheep->node, sizeof(struct sd_node));
-		if (sizeof(snd) + sizeof(struct sd_node) != wbytes) {
-			sd_err("writev2() failed: %m");
-			goto fwd_leave_failed;
-		}
-
-		continue;
-
-fwd_leave_failed:
-		remove_sheep(s);
-	}
+	broadcast_msg(SPH_SRV_MSG_LEAVE_FORWARD, &sheep->node,
+		      sizeof(struct sd_node), NULL);
 }
 
 static void (*msg_handlers[])(struct sph_msg*, struct sheep *) = {
@@ -585,6 +614,8 @@ static void sheep_accept_handler(int fd, int events, void *data)
 		goto clean;
 	}
 
+	INIT_LIST_NODE(&new_sheep->join_wait_list);
+	INIT_LIST_NODE(&new_sheep->flush_list);
 	list_add_tail(&new_sheep->sheep_list, &sheep_list_head);
 	new_sheep->state = SHEEP_STATE_CONNECTED;
 
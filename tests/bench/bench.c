@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the hot paths of the sheep
+ *
+ * 'make bench' runs them and writes the results as a JSON object to the
+ * standard output, so the numbers of two builds can be compared by a script.
+ * The inputs come from a fixed seed, so two runs do the same operations.
+ *
+ * Usage: sheep_bench [-r rounds] [-f filter]
+ *   -r  the rounds of each case, 5 by default
+ *   -f  only run the cases whose name contain the filter
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sheepdog_proto.h"
+#include "util.h"
+#include "bench.h"
+
+int bench_rounds = 5;
+static const char *bench_filter;
+static bool first_case = true;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, the seed is fixed to repeat the same inputs */
+uint64_t bench_random(void)
+{
+	static uint64_t x = 0x2545f4914f6cdd1dULL;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int ns_cmp(const double *a, const double *b)
+{
+	return intcmp(*a, *b);
+}
+
+void bench_run(const struct bench_case *c)
+{
+	double ns[bench_rounds];
+
+	if (bench_filter && !strstr(c->name, bench_filter))
+		return;
+
+	for (int i = 0; i < bench_rounds; i++) {
+		uint64_t start;
+
+		if (c->setup)
+			c->setup(c->arg);
+		start = bench_now();
+		c->run(c->arg, c->nr_ops);
+		ns[i] = (double)(bench_now() - start) / c->nr_ops;
+	}
+	xqsort(ns, bench_rounds, ns_cmp);
+
+	printf("%s\n    {\"name\": \"%s\", \"param\": \"%s\", "
+	       "\"ops\": %zu, \"rounds\": %d,\n", first_case ? "" : ",",
+	       c->name, c->param ? c->param : "", c->nr_ops, bench_rounds);
+	printf("     \"ns_per_op\": {\"min\": %.1f, \"median\": %.1f, "
+	       "\"max\": %.1f}", ns[0], ns[bench_rounds / 2],
+	       ns[bench_rounds - 1]);
+	if (c->bytes_per_op)
+		printf(",\n     \"mb_per_sec\": %.1f",
+		       c->bytes_per_op / ns[bench_rounds / 2] * 1000.0);
+	printf("}");
+	fflush(stdout);
+	first_case = false;
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:f:")) != -1) {
+		switch (ch) {
+		case 'r':
+			bench_rounds = atoi(optarg);
+			if (bench_rounds < 1) {
+				fprintf(stderr, "invalid rounds %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'f':
+			bench_filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r rounds] [-f filter]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("{\n  \"version\": \"%s\",\n  \"benchmarks\": [",
+	       PACKAGE_VERSION);
+	bench_lib();
+	bench_cache();
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
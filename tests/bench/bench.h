@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A case runs nr_ops operations a round, for bench_rounds rounds, and reports
+ * the nanoseconds an operation of the fastest, the median and the slowest
+ * round.  setup is called before each round out of the timing, e.g. to empty
+ * the structure a round fills.
+ */
+struct bench_case {
+	const char *name;
+	const char *param; /* e.g. the size, or NULL */
+	size_t nr_ops;
+	size_t bytes_per_op; /* 0 if the throughput means nothing */
+	void (*setup)(void *arg);
+	void (*run)(void *arg, size_t nr_ops);
+	void *arg;
+};
+
+extern int bench_rounds;
+
+void bench_run(const struct bench_case *c);
+uint64_t bench_random(void);
+
+void bench_lib(void);
+void bench_cache(void);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The benchmarks of the object cache and the object list cache */
+
+#include "object_cache.c"
+#include "bench.h"
+
+#define NR_CACHE_OBJECTS 65536
+
+static struct object_cache *insert_oc;
+static uint32_t insert_vid;
+
+static void free_object_cache(struct object_cache *oc)
+{
+	struct rb_node *n;
+
+	write_lock_cache(oc);
+	while ((n = rb_first(&oc->lru_tree)))
+		free_cache_entry(rb_entry(n, struct object_cache_entry, node));
+	unlock_cache(oc);
+}
+
+/* Each round fills the cache of a new vdi */
+static void setup_cache_insert(void *arg)
+{
+	if (insert_oc)
+		free_object_cache(insert_oc);
+	insert_oc = find_object_cache(++insert_vid, true);
+}
+
+static void run_cache_insert(void *arg, size_t nr)
+{
+	for (size_t i = 0; i < nr; i++)
+		add_to_lru_cache(insert_oc, i, false, NULL);
+}
+
+static void run_cache_lookup(void *arg, size_t nr)
+{
+	struct object_cache *oc = arg;
+
+	for (size_t i = 0; i < nr; i++) {
+		struct object_cache_entry *entry;
+
+		entry = get_cache_entry_from(oc, bench_random() %
+					     NR_CACHE_OBJECTS);
+		if (!entry)
+			panic("the cached object is not found");
+		put_cache_entry(entry);
+	}
+}
+
+static void bench_object_cache(void)
+{
+	char dir[] = "/tmp/sheep_bench.XXXXXX";
+	struct bench_case c = { .nr_ops = NR_CACHE_OBJECTS };
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "failed to create %s, %m\n", dir);
+		return;
+	}
+	pstrcpy(object_cache_dir, sizeof(object_cache_dir), dir);
+	sys->object_cache_size = (uint64_t)NR_CACHE_OBJECTS * 2 *
+		CACHE_OBJECT_SIZE;
+
+	c.name = "object_cache_insert";
+	c.setup = setup_cache_insert;
+	c.run = run_cache_insert;
+	bench_run(&c);
+
+	/* looked up in the cache the last round filled */
+	if (!insert_oc) {
+		setup_cache_insert(NULL);
+		run_cache_insert(NULL, c.nr_ops);
+	}
+	c.name = "object_cache_lookup";
+	c.nr_ops = 1000000;
+	c.setup = NULL;
+	c.run = run_cache_lookup;
+	c.arg = insert_oc;
+	bench_run(&c);
+
+	free_object_cache(insert_oc);
+	rmdir_r(dir);
+}
+
+static void setup_objlist_insert(void *arg)
+{
+	objlist_cache_format();
+}
+
+static void run_objlist_insert(void *arg, size_t nr)
+{
+	for (size_t i = 0; i < nr; i++)
+		objlist_cache_insert(vid_to_data_oid(bench_random() & 0xffffff,
+						     i));
+}
+
+void bench_cache(void)
+{
+	bench_object_cache();
+
+	/* without the objlist queue the log is never merged */
+	bench_run(&(struct bench_case) {
+		.name = "objlist_cache_insert",
+		.nr_ops = 1000000,
+		.setup = setup_objlist_insert,
+		.run = run_objlist_insert,
+	});
+	objlist_cache_format();
+}
@@ -0,0 +1,418 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The benchmarks of the placement, the erasure code, the inodes and lib */
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "sheep.h"
+#include "fec.h"
+#include "event.h"
+#include "work.h"
+#include "net.h"
+#include "sockfd_cache.h"
+#include "bench.h"
+
+#define NR_OIDS 4096 /* a power of 2 */
+
+static uint64_t oids[NR_OIDS];
+static volatile uint64_t sink; /* keeps the results from being optimized out */
+
+static void gen_oids(void)
+{
+	for (int i = 0; i < NR_OIDS; i++)
+		oids[i] = vid_to_data_oid(bench_random() & 0xffffff,
+					  bench_random() & 0xfffff);
+}
+
+static void run_hash_oid(void *arg, size_t nr)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < nr; i++)
+		sum ^= sd_hash_oid(oids[i & (NR_OIDS - 1)]);
+	sink = sum;
+}
+
+struct placement {
+	struct rb_root vroot;
+	struct vnode_array va;
+	int nr_copies;
+};
+
+static void run_oid_to_vnodes(void *arg, size_t nr)
+{
+	struct placement *pl = arg;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < nr; i++) {
+		oid_to_vnodes(oids[i & (NR_OIDS - 1)], &pl->vroot,
+			      pl->nr_copies, vnodes);
+		sum += vnodes[pl->nr_copies - 1]->hash;
+	}
+	sink = sum;
+}
+
+static void run_vnode_array_to_vnodes(void *arg, size_t nr)
+{
+	struct placement *pl = arg;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < nr; i++) {
+		vnode_array_to_vnodes(&pl->va, oids[i & (NR_OIDS - 1)],
+				      pl->nr_copies, vnodes);
+		sum += vnodes[pl->nr_copies - 1]->hash;
+	}
+	sink = sum;
+}
+
+static void bench_placement(int nr_nodes, int nr_copies)
+{
+	struct sd_node *nodes = xcalloc(nr_nodes, sizeof(*nodes));
+	struct placement pl = { .vroot = RB_ROOT, .nr_copies = nr_copies };
+	char param[64];
+	struct bench_case c = {
+		.name = "oid_to_vnodes",
+		.param = param,
+		.nr_ops = 1000000,
+		.run = run_oid_to_vnodes,
+		.arg = &pl,
+	};
+
+	for (int i = 0; i < nr_nodes; i++) {
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i >> 8;
+		nodes[i].nid.addr[15] = i & 0xff;
+		nodes[i].nid.port = SD_LISTEN_PORT;
+		nodes[i].nr_vnodes = SD_DEFAULT_VNODES;
+		nodes[i].zone = i;
+		node_to_vnodes(nodes + i, &pl.vroot);
+	}
+
+	vnode_array_build(&pl.va, &pl.vroot);
+
+	snprintf(param, sizeof(param), "nodes=%d,copies=%d", nr_nodes,
+		 nr_copies);
+	bench_run(&c);
+
+	/* the flat array of the same vnodes */
+	c.name = "vnode_array_to_vnodes";
+	c.run = run_vnode_array_to_vnodes;
+	bench_run(&c);
+
+	vnode_array_free(&pl.va);
+	rb_destroy(&pl.vroot, struct sd_vnode, rb);
+	free(nodes);
+}
+
+struct fec_bench {
+	struct fec *code;
+	int d, p;
+	uint8_t *data[SD_EC_MAX_STRIP], *parity[SD_EC_MAX_STRIP];
+	uint8_t *out[SD_EC_MAX_STRIP];
+};
+
+static void run_fec_encode(void *arg, size_t nr)
+{
+	struct fec_bench *fb = arg;
+	int block_nums[SD_EC_MAX_STRIP];
+
+	for (int i = 0; i < fb->p; i++)
+		block_nums[i] = fb->d + i;
+	for (size_t i = 0; i < nr; i++)
+		fec_encode(fb->code, (const uint8_t * const *)fb->data,
+			   fb->parity, block_nums, fb->p,
+			   SD_EC_DATA_STRIPE_SIZE);
+}
+
+/* Rebuild the first p data strips from the parity strips */
+static void run_fec_decode(void *arg, size_t nr)
+{
+	struct fec_bench *fb = arg;
+	const uint8_t *in[SD_EC_MAX_STRIP];
+	int idx[SD_EC_MAX_STRIP];
+
+	for (int i = 0; i < fb->d; i++) {
+		in[i] = i < fb->p ? fb->parity[i] : fb->data[i];
+		idx[i] = i < fb->p ? fb->d + i : i;
+	}
+	for (size_t i = 0; i < nr; i++)
+		fec_decode(fb->code, in, fb->out, idx, SD_EC_DATA_STRIPE_SIZE);
+}
+
+static void bench_fec(int d, int p)
+{
+	struct fec_bench fb = { .d = d, .p = p };
+	char param[64];
+	struct bench_case c = {
+		.param = param,
+		.nr_ops = 20000,
+		.bytes_per_op = d * SD_EC_DATA_STRIPE_SIZE,
+		.arg = &fb,
+	};
+
+	fb.code = fec_new(d, d + p);
+	for (int i = 0; i < d; i++) {
+		fb.data[i] = xmalloc(SD_EC_DATA_STRIPE_SIZE);
+		fb.out[i] = xmalloc(SD_EC_DATA_STRIPE_SIZE);
+		for (int j = 0; j < SD_EC_DATA_STRIPE_SIZE; j++)
+			fb.data[i][j] = bench_random();
+	}
+	for (int i = 0; i < p; i++)
+		fb.parity[i] = xmalloc(SD_EC_DATA_STRIPE_SIZE);
+
+	snprintf(param, sizeof(param), "strips=%d,parity=%d", d, p);
+	c.name = "fec_encode";
+	c.run = run_fec_encode;
+	bench_run(&c);
+	c.name = "fec_decode";
+	c.run = run_fec_decode;
+	bench_run(&c);
+
+	for (int i = 0; i < d; i++) {
+		free(fb.data[i]);
+		free(fb.out[i]);
+	}
+	for (int i = 0; i < p; i++)
+		free(fb.parity[i]);
+	fec_free(fb.code);
+}
+
+/* The in-memory store of the btree nodes of the inode benchmark */
+struct bnode_obj {
+	struct rb_node rb;
+	uint64_t oid;
+	char *mem;
+};
+
+static struct rb_root bnode_objs = RB_ROOT;
+
+static int bnode_obj_cmp(const struct bnode_obj *a, const struct bnode_obj *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static int bench_bnode_writer(uint64_t id, void *mem, unsigned int len,
+			      uint64_t offset, uint32_t flags, int copies,
+			      int copy_policy, bool create, bool direct)
+{
+	struct bnode_obj key = { .oid = id }, *obj;
+
+	/* the inode object itself is kept by the benchmark */
+	if (!is_vdi_btree_obj(id))
+		return SD_RES_SUCCESS;
+
+	obj = rb_search(&bnode_objs, &key, rb, bnode_obj_cmp);
+	if (!obj) {
+		obj = xzalloc(sizeof(*obj));
+		obj->oid = id;
+		obj->mem = xzalloc(SD_INODE_DATA_INDEX_SIZE);
+		rb_insert(&bnode_objs, obj, rb, bnode_obj_cmp);
+	}
+	memcpy(obj->mem + offset, mem, len);
+	return SD_RES_SUCCESS;
+}
+
+static int bench_bnode_reader(uint64_t id, void **mem, unsigned int len,
+			      uint64_t offset)
+{
+	struct bnode_obj key = { .oid = id }, *obj;
+
+	obj = rb_search(&bnode_objs, &key, rb, bnode_obj_cmp);
+	if (!obj)
+		return SD_RES_NO_OBJ;
+	memcpy(*mem, obj->mem + offset, len);
+	return SD_RES_SUCCESS;
+}
+
+static void run_inode_get_vid(void *arg, size_t nr)
+{
+	const struct sd_inode *inode = arg;
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < nr; i++)
+		sum += sd_inode_get_vid(inode, bench_random() %
+					SD_INODE_DATA_INDEX);
+	sink = sum;
+}
+
+static void bench_inode(void)
+{
+	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	struct bench_case c = {
+		.name = "sd_inode_get_vid",
+		.arg = inode,
+		.run = run_inode_get_vid,
+	};
+	struct bnode_obj *obj;
+
+	sd_inode_actor_init(bench_bnode_writer, bench_bnode_reader);
+	inode->vdi_id = 0x1234;
+	inode->store_policy = 1;
+	sd_inode_init(inode->data_vdi_id, 1);
+	/* a full inode has the depth of 2 */
+	sd_inode_set_vid_range(inode, 0, SD_INODE_DATA_INDEX - 1,
+			       inode->vdi_id);
+
+	c.param = "btree,uncached";
+	c.nr_ops = 1000;
+	bench_run(&c);
+	sd_inode_cache_init(64);
+	c.param = "btree,cached";
+	c.nr_ops = 1000000;
+	bench_run(&c);
+	sd_inode_cache_init(0);
+
+	rb_for_each_entry(obj, &bnode_objs, rb)
+		free(obj->mem);
+	rb_destroy(&bnode_objs, struct bnode_obj, rb);
+	INIT_RB_ROOT(&bnode_objs);
+	free(inode);
+}
+
+static struct work_queue *bench_wq;
+static size_t nr_done;
+
+static void bench_work_fn(struct work *work)
+{
+}
+
+static void bench_work_done(struct work *work)
+{
+	nr_done++;
+}
+
+/* Queue a work and wait for its done in the main thread, one at a time */
+static void run_queue_work(void *arg, size_t nr)
+{
+	struct work work = { .fn = bench_work_fn, .done = bench_work_done };
+
+	nr_done = 0;
+	for (size_t i = 0; i < nr; i++) {
+		queue_work(bench_wq, &work);
+		while (nr_done <= i)
+			event_loop(-1);
+	}
+}
+
+/* Queue all the works at once, as a burst of requests does */
+static void run_queue_work_batch(void *arg, size_t nr)
+{
+	struct work *works = arg;
+
+	nr_done = 0;
+	for (size_t i = 0; i < nr; i++)
+		queue_work(bench_wq, works + i);
+	while (nr_done < nr)
+		event_loop(-1);
+}
+
+static void bench_work(void)
+{
+	struct bench_case c = { .name = "queue_work", .nr_ops = 20000 };
+	struct work *works = xcalloc(c.nr_ops, sizeof(*works));
+
+	for (size_t i = 0; i < c.nr_ops; i++) {
+		works[i].fn = bench_work_fn;
+		works[i].done = bench_work_done;
+	}
+
+	bench_wq = create_work_queue("bench", WQ_UNLIMITED);
+	c.param = "round_trip";
+	c.run = run_queue_work;
+	bench_run(&c);
+	c.param = "batch";
+	c.run = run_queue_work_batch;
+	c.arg = works;
+	bench_run(&c);
+
+	free(works);
+}
+
+static void run_sockfd_cache(void *arg, size_t nr)
+{
+	const struct node_id *nid = arg;
+
+	for (size_t i = 0; i < nr; i++) {
+		struct sockfd *sfd = sockfd_cache_get(nid);
+
+		if (!sfd)
+			panic("failed to get a sockfd");
+		sockfd_cache_put(nid, sfd);
+	}
+}
+
+/* The cached connections go to a listener of ours which never accepts */
+static void bench_sockfd_cache(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+	struct node_id nid = {};
+	struct bench_case c = {
+		.name = "sockfd_cache_get_put",
+		.nr_ops = 1000000,
+		.run = run_sockfd_cache,
+		.arg = &nid,
+	};
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+		fprintf(stderr, "failed to listen, %m\n");
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	str_to_addr("127.0.0.1", nid.addr);
+	nid.port = ntohs(addr.sin_port);
+	sockfd_cache_add(&nid);
+	bench_run(&c);
+	sockfd_cache_del_node(&nid);
+	close(fd);
+}
+
+void bench_lib(void)
+{
+	if (init_event(4096) < 0 || init_work_queue(NULL) < 0 ||
+	    sockfd_init() < 0) {
+		fprintf(stderr, "failed to initialize the event loop\n");
+		exit(1);
+	}
+	init_fec();
+	gen_oids();
+
+	bench_run(&(struct bench_case) {
+		.name = "sd_hash_oid",
+		.nr_ops = 10000000,
+		.run = run_hash_oid,
+	});
+	bench_placement(16, 3);
+	bench_placement(256, 3);
+	bench_placement(1024, 3);
+
+	bench_fec(2, 1);
+	bench_fec(4, 2);
+	bench_fec(8, 4);
+	bench_fec(12, 4);
+
+	bench_inode();
+	bench_work();
+	bench_sockfd_cache();
+}
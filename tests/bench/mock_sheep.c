@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The sheep functions the benchmarked code calls out of the code under the
+ * benchmarks, which mustn't be called on the measured paths
+ */
+
+#include "sheep_priv.h"
+
+static struct system_info sys_info;
+struct system_info *sys = &sys_info;
+struct store_driver *sd_store;
+
+bool oid_is_readonly(uint64_t oid)
+{
+	return false;
+}
+
+struct vnode_info *get_vnode_info(void)
+{
+	return NULL;
+}
+
+void put_vnode_info(struct vnode_info *vinfo)
+{
+}
+
+bool is_erasure_oid(uint64_t oid)
+{
+	return false;
+}
+
+uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid)
+{
+	return SD_MAX_COPIES;
+}
+
+ssize_t dio_pread(int fd, void *buf, size_t len, off_t offset)
+{
+	return xpread(fd, buf, len, offset);
+}
+
+ssize_t dio_pwrite(uint64_t oid, int fd, const void *buf, size_t len,
+		   off_t offset)
+{
+	return xpwrite(fd, buf, len, offset);
+}
+
+int read_backend_object(uint64_t oid, char *data, unsigned int datalen,
+			uint64_t offset)
+{
+	panic("the benchmarks don't read the backend");
+}
+
+int exec_local_req(struct sd_req *rq, void *data)
+{
+	panic("the benchmarks don't send the requests");
+}
@@ -1,6 +1,10 @@
 #! /bin/bash
 
 # fault injection for testing journaling with object store
+#
+# sheep dies after appending a write to the journal and before writing the
+# object, so the write has to be replayed from the journal by the restarted
+# sheep
 
 sudo killall -KILL sheep
 sudo killall -KILL shepherd
@@ -11,11 +15,19 @@ sudo mkdir -p /tmp/sheepdog/dynamorio/0
 sudo shepherd
 
 sudo ~/dynamorio/build/bin64/drrun -c libjournaling.so 1 -- \
-    sheep -d -c shepherd:127.0.0.1 -p 7000 -j size=64 /tmp/sheepdog/dynamorio/0
+    sheep -c shepherd:127.0.0.1 -p 7000 -j size=64M /tmp/sheepdog/dynamorio/0
 
 sleep 3
 
 dog cluster format -c 1
-dog vdi create test 100M
+dog vdi create -P test 16M
+echo -n journaled | dog vdi write test 0 9
 
-sudo sheep -d -c shepherd:127.0.0.1 -p 7000 -j size=64 /tmp/sheepdog/dynamorio/0
+sudo sheep -c shepherd:127.0.0.1 -p 7000 -j size=64M /tmp/sheepdog/dynamorio/0
+
+sleep 3
+
+if [ "$(dog vdi read test 0 9)" != "journaled" ]; then
+	echo "the journaled write is lost"
+	exit 1
+fi
@@ -0,0 +1,32 @@
+#! /bin/bash
+
+# fault injection for testing journaling with object store
+#
+# sheep dies in the middle of appending a write to the journal, so the torn
+# entry must not be replayed by the restarted sheep
+
+sudo killall -KILL sheep
+sudo killall -KILL shepherd
+
+sudo rm -rf /tmp/sheepdog/dynamorio/*
+sudo mkdir -p /tmp/sheepdog/dynamorio/0
+
+sudo shepherd
+
+sudo ~/dynamorio/build/bin64/drrun -c libjournaling.so 2 -- \
+    sheep -c shepherd:127.0.0.1 -p 7000 -j size=64M /tmp/sheepdog/dynamorio/0
+
+sleep 3
+
+dog cluster format -c 1
+dog vdi create -P test 16M
+echo -n journaled | dog vdi write test 0 9
+
+sudo sheep -c shepherd:127.0.0.1 -p 7000 -j size=64M /tmp/sheepdog/dynamorio/0
+
+sleep 3
+
+if [ -n "$(dog vdi read test 0 9 | tr -d '\0')" ]; then
+	echo "the torn journal entry is replayed"
+	exit 1
+fi
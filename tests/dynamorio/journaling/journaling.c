@@ -32,7 +32,7 @@
 struct journal_descriptor {
 	uint32_t magic;
 	uint16_t flag;
-	uint16_t reserved;
+	uint16_t ec_index;
 	union {
 		uint32_t epoch;
 		uint64_t oid;
@@ -40,7 +40,12 @@ struct journal_descriptor {
 	uint64_t offset;
 	uint64_t size;
 	uint8_t create;
-	uint8_t pad[475];
+	uint8_t reserved[7];
+	uint64_t gen;
+	uint64_t ino;
+	uint64_t csum;
+	uint64_t hole;
+	uint8_t pad[436];
 } __packed;
 
 /* JOURNAL_DESC + JOURNAL_MARKER must be 512 algined for DIO */
@@ -53,6 +58,7 @@ struct journal_descriptor {
 
 #define JF_STORE 0
 #define JF_REMOVE_OBJ 2
+#define JF_DISCARD 3
 
 #include <string.h>
 #include <syscall.h>
@@ -64,6 +70,7 @@ enum scenario_id {
 
 	SID_DO_NOTHING = 0,
 	SID_DEATH_AFTER_STORE,
+	SID_DEATH_DURING_STORE,
 };
 
 enum scenario_id sid = SID_UNDEF;
@@ -109,7 +116,7 @@ static void thread_exit_event(void *drcontext)
 	xfree(jstate);
 }
 
-static void pre_open(void *drcontext)
+static void pre_open(void *drcontext, int path_param)
 {
 	const char *path;
 	struct per_thread_journal_state *jstate;
@@ -117,7 +124,7 @@ static void pre_open(void *drcontext)
 	jstate = (struct per_thread_journal_state *)
 		drmgr_get_tls_field(drcontext, tls_idx);
 
-	path = (const char *)dr_syscall_get_param(drcontext, 0);
+	path = (const char *)dr_syscall_get_param(drcontext, path_param);
 
 	if (strstr(path, "journal_file0")) {
 		fi_printf("journal_file0 is opened\n");
@@ -155,25 +162,40 @@ static void pre_pwrite(void *drcontext)
 	jstate = (struct per_thread_journal_state *)
 		drmgr_get_tls_field(drcontext, tls_idx);
 
+	jd = (struct journal_descriptor *)dr_syscall_get_param(drcontext, 1);
+	if (jd->magic != JOURNAL_DESC_MAGIC)
+		/* invalidation of the journal file */
+		return;
+
 	fi_printf("writing journal\n");
 	jstate->using_fd = fd;
 	jstate->state = THREAD_STATE_WRITING_JFILE;
-
-	jd = (struct journal_descriptor *)dr_syscall_get_param(drcontext, 1);
-	DR_ASSERT(jd->magic == JOURNAL_DESC_MAGIC);
 	if (jd->flag == JF_STORE)
 		jstate->pwrite_state = PWRITE_WRITING_STORE;
-	else if (jd->flag == JF_REMOVE_OBJ)
-		fi_printf("FIXME: testing object removal is not supported yet");
+	else if (jd->flag == JF_REMOVE_OBJ || jd->flag == JF_DISCARD)
+		fi_printf("FIXME: testing object removal and discard is not "
+			  "supported yet");
 	else
 		die("unknown journal flag: %d\n", jd->flag);
+
+	if (sid == SID_DEATH_DURING_STORE && jd->flag == JF_STORE) {
+		/* tear the entry, only the descriptor and half the data */
+		size_t len = (size_t)dr_syscall_get_param(drcontext, 2);
+
+		fi_printf("tearing the journal entry of %zu bytes\n", len);
+		dr_syscall_set_param(drcontext, 2,
+				     JOURNAL_DESC_SIZE + jd->size / 2);
+	}
 }
 
 static bool pre_syscall(void *drcontext, int sysnum)
 {
 	switch (sysnum) {
 	case SYS_open:
-		pre_open(drcontext);
+		pre_open(drcontext, 0);
+		break;
+	case SYS_openat:
+		pre_open(drcontext, 1);
 		break;
 	case SYS_close:
 		pre_close(drcontext);
@@ -253,6 +275,14 @@ static void post_pwrite64(void *drcontext)
 			" exiting\n");
 		exit(1);
 		break;
+	case SID_DEATH_DURING_STORE:
+		if (jstate->pwrite_state != PWRITE_WRITING_STORE)
+			return;
+
+		fi_printf("scenario is death in the middle of writing normal"
+			" store, exiting\n");
+		exit(1);
+		break;
 	default:
 		die("invalid SID: %d\n", sid);
 		break;
@@ -263,6 +293,7 @@ static void post_syscall(void *drcontext, int sysnum)
 {
 	switch (sysnum) {
 	case SYS_open:
+	case SYS_openat:
 		post_open(drcontext);
 		break;
 	case SYS_close:
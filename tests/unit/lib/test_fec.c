@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <check.h>
+
+#include "fec.h"
+
+/* The kernels of fec_new() must compute the same strips as the generic path */
+static void check_kernels(int d, int p)
+{
+	size_t len = SD_DATA_OBJ_SIZE / d;
+	struct fec *fast = fec_new(d, d + p), *slow = fec_new(d, d + p);
+	uint8_t *strips[SD_EC_MAX_STRIP], *parity[SD_EC_MAX_STRIP];
+	uint8_t *input[SD_EC_MAX_STRIP], *buf = xmalloc(len);
+	int pidx[SD_EC_MAX_STRIP], in_idx[SD_EC_MAX_STRIP];
+
+	ck_assert(fast->encode && fast->dot);
+	slow->encode = NULL;
+	slow->dot = NULL;
+
+	for (int i = 0; i < d + p; i++)
+		strips[i] = xmalloc(len);
+	for (int i = 0; i < d; i++)
+		for (size_t x = 0; x < len; x++)
+			strips[i][x] = random();
+	for (int i = 0; i < p; i++) {
+		parity[i] = xmalloc(len);
+		pidx[i] = d + i;
+	}
+
+	fec_encode(fast, (const uint8_t **)strips, strips + d, pidx, p, len);
+	fec_encode(slow, (const uint8_t **)strips, parity, pidx, p, len);
+	for (int i = 0; i < p; i++)
+		ck_assert(!memcmp(strips[d + i], parity[i], len));
+
+	/* only the last parity strip, which the kernel doesn't compute */
+	fec_encode(fast, (const uint8_t **)strips, parity, pidx + p - 1, 1,
+		   len);
+	ck_assert(!memcmp(strips[d + p - 1], parity[0], len));
+
+	/* rebuild each strip from the first d of the others */
+	for (int lost = 0; lost < d + p; lost++) {
+		for (int i = 0, n = 0; n < d; i++) {
+			if (i == lost)
+				continue;
+			input[n] = strips[i];
+			in_idx[n++] = i;
+		}
+
+		fec_decode_buffer(fast, input, in_idx, (char *)buf, lost);
+		ck_assert(!memcmp(buf, strips[lost], len));
+		memset(buf, 0, len);
+		fec_decode_buffer(slow, input, in_idx, (char *)buf, lost);
+		ck_assert(!memcmp(buf, strips[lost], len));
+	}
+
+	for (int i = 0; i < d + p; i++)
+		free(strips[i]);
+	for (int i = 0; i < p; i++)
+		free(parity[i]);
+	free(buf);
+	fec_free(fast);
+	fec_free(slow);
+}
+
+START_TEST(test_ec_kernels)
+{
+	srandom(1);
+	check_kernels(2, 1);
+	check_kernels(4, 2);
+	check_kernels(8, 3);
+}
+END_TEST
+
+static Suite *test_suite(void)
+{
+	Suite *s = suite_create("test fec");
+
+	TCase *tc_kernels = tcase_create("ec kernels");
+	tcase_add_test(tc_kernels, test_ec_kernels);
+
+	suite_add_tcase(s, tc_kernels);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s = test_suite();
+	SRunner *sr = srunner_create(s);
+
+	init_fec();
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -337,6 +337,193 @@ START_TEST(test_nodes_dispersion)
 }
 END_TEST
 
+#define NR_RING_NODES 60
+#define NR_RING_VNODES 128
+#define NR_LOOKUPS (64 * 1024)
+
+/* the flat array must pick the same vnodes as the rbtree */
+START_TEST(test_vnode_array)
+{
+	struct sd_node nodes[NR_RING_NODES];
+	const struct sd_vnode *v1[SD_MAX_COPIES], *v2[SD_MAX_COPIES];
+	struct vnode_array va;
+	struct rb_root vroot;
+
+	memset(nodes, 0, sizeof(nodes));
+	INIT_RB_ROOT(&vroot);
+	for (int i = 0; i < NR_RING_NODES; i++) {
+		/* IPv4 10.0.0.x */
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[15] = i;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = NR_RING_VNODES;
+		nodes[i].zone = i / 4;
+		node_to_vnodes(nodes + i, &vroot);
+	}
+	vnode_array_build(&va, &vroot);
+	ck_assert_int_eq(va.nr, NR_RING_NODES * NR_RING_VNODES);
+
+	for (int i = 0; i < NR_LOOKUPS; i++) {
+		uint64_t oid = vid_to_data_oid(i % 1024, i);
+
+		oid_to_vnodes(oid, &vroot, 3, v1);
+		vnode_array_to_vnodes(&va, oid, 3, v2);
+		for (int j = 0; j < 3; j++)
+			ck_assert(v1[j] == v2[j]);
+	}
+
+
+	vnode_array_free(&va);
+	rb_destroy(&vroot, struct sd_vnode, rb);
+}
+END_TEST
+
+#define NR_MERGE_NODES 40
+
+/* Allocate a vnode_info of the nodes without vnodes, as rebuild_vnode_info() */
+static struct vnode_info *merge_vinfo(const struct sd_node *nodes, int nr,
+				      bool diskmode)
+{
+	struct vnode_info *vinfo = xzalloc(sizeof(*vinfo));
+
+	INIT_RB_ROOT(&vinfo->vroot);
+	INIT_RB_ROOT(&vinfo->nroot);
+	for (int i = 0; i < nr; i++) {
+		struct sd_node *n = xmalloc(sizeof(*n));
+
+		*n = nodes[i];
+		ck_assert(!rb_insert(&vinfo->nroot, n, rb, node_cmp));
+		vinfo->nr_nodes++;
+	}
+	vinfo->diskmode = diskmode;
+	vinfo->mixhash = sd_mix_placement;
+	return vinfo;
+}
+
+static void merge_vinfo_free(struct vnode_info *vinfo)
+{
+	vnode_array_free(&vinfo->varray);
+	free_tag(vinfo->vnodes, SD_MEM_VNODE);
+	rb_destroy(&vinfo->nroot, struct sd_node, rb);
+	free(vinfo);
+}
+
+/*
+ * Merge the vnodes of old into the ones of the nodes and check them against a
+ * fresh build.  Return the merged vnode_info, the old one of the next check.
+ */
+static struct vnode_info *check_merge(struct vnode_info *old,
+				      const struct sd_node *nodes, int nr)
+{
+	struct vnode_info *merged = merge_vinfo(nodes, nr, old->diskmode);
+	struct vnode_info *built = merge_vinfo(nodes, nr, old->diskmode);
+	struct sd_node *n1, *n2;
+
+	ck_assert(merge_vnodes(merged, old));
+	build_vnodes(built);
+
+	ck_assert_int_eq(merged->vroot.nr, built->vroot.nr);
+	for (size_t i = 0; i < built->vroot.nr; i++) {
+		const struct sd_vnode *v1 = merged->vnodes + i;
+		const struct sd_vnode *v2 = built->vnodes + i;
+		struct sd_node key = *v1->node;
+
+		ck_assert(v1->hash == v2->hash);
+		ck_assert(!node_cmp(v1->node, v2->node));
+		/* not a node of old */
+		ck_assert(rb_search(&merged->nroot, &key, rb, node_cmp) ==
+			  v1->node);
+	}
+	n2 = rb_entry(rb_first(&built->nroot), struct sd_node, rb);
+	rb_for_each_entry(n1, &merged->nroot, rb) {
+		ck_assert_int_eq(n1->nr_vnodes, n2->nr_vnodes);
+		n2 = rb_entry(rb_next(&n2->rb), struct sd_node, rb);
+	}
+
+	vnode_array_build(&merged->varray, &merged->vroot);
+	merge_vinfo_free(built);
+	merge_vinfo_free(old);
+	return merged;
+}
+
+static void merge_node_init(struct sd_node *n, int idx)
+{
+	memset(n, 0, sizeof(*n));
+	/* IPv4 10.0.1.x */
+	n->nid.addr[12] = 10;
+	n->nid.addr[14] = 1;
+	n->nid.addr[15] = idx;
+	n->nid.port = 7000;
+	n->nr_vnodes = SD_DEFAULT_VNODES;
+	n->zone = idx;
+#ifdef HAVE_DISKVNODES
+	for (int j = 0; j < 4; j++) {
+		n->disks[j].disk_id = idx * DISK_MAX + j + 1;
+		n->disks[j].disk_space = WEIGHT_MIN * (j + 1);
+	}
+#endif
+}
+
+static void test_merge(bool diskmode)
+{
+	struct sd_node nodes[NR_MERGE_NODES + 2];
+	struct vnode_info *vinfo;
+	int nr = NR_MERGE_NODES;
+
+	for (int i = 0; i < nr; i++)
+		merge_node_init(nodes + i, i);
+	vinfo = merge_vinfo(nodes, nr, diskmode);
+	build_vnodes(vinfo);
+	vnode_array_build(&vinfo->varray, &vinfo->vroot);
+
+	/* a node leaves */
+	nodes[5] = nodes[--nr];
+	vinfo = check_merge(vinfo, nodes, nr);
+
+	/* two nodes join */
+	merge_node_init(nodes + nr++, 5);
+	merge_node_init(nodes + nr++, NR_MERGE_NODES);
+	vinfo = check_merge(vinfo, nodes, nr);
+
+	/* the weights change */
+	nodes[3].nr_vnodes += 16;
+	nodes[7].nr_vnodes -= 16;
+	nodes[9].nr_vnodes = 1;
+#ifdef HAVE_DISKVNODES
+	nodes[3].disks[4].disk_id = 3 * DISK_MAX + 5;
+	nodes[3].disks[4].disk_space = WEIGHT_MIN;
+	nodes[7].disks[1].disk_id = 0;
+	nodes[9].disks[2].disk_space = WEIGHT_MIN * 8;
+	nodes[11].disks[0].disk_space = WEIGHT_MIN / 2;
+#endif
+	vinfo = check_merge(vinfo, nodes, nr);
+
+	/* all at once */
+	nodes[0] = nodes[--nr];
+	merge_node_init(nodes + nr++, NR_MERGE_NODES + 1);
+	nodes[12].nr_vnodes += 8;
+#ifdef HAVE_DISKVNODES
+	nodes[12].disks[3].disk_id = 0;
+#endif
+	vinfo = check_merge(vinfo, nodes, nr);
+
+	merge_vinfo_free(vinfo);
+}
+
+/* the merged vnodes must be the same as the ones built from scratch */
+START_TEST(test_vnode_merge)
+{
+	test_merge(false);
+#ifdef HAVE_DISKVNODES
+	test_merge(true);
+#endif
+
+	sd_mix_placement = true;
+	test_merge(false);
+	sd_mix_placement = false;
+}
+END_TEST
+
 static size_t (*gen_disks)(struct disk *disks, int idx);
 
 /* generate one disk who has many virtual disks */
@@ -557,6 +744,8 @@ static Suite *test_suite(void)
 	TCase *tc_disks3 = tcase_create("many disks with some vdisks");
 	TCase *tc_objects1 = tcase_create("many data objects");
 	TCase *tc_objects2 = tcase_create("many vdi objects");
+	TCase *tc_varray = tcase_create("flat vnode array");
+	TCase *tc_vmerge = tcase_create("merged vnodes");
 
 	tcase_add_checked_fixture(tc_basic1, basic1_setup, NULL);
 	tcase_add_checked_fixture(tc_basic2, basic2_setup, NULL);
@@ -589,6 +778,8 @@ static Suite *test_suite(void)
 	tcase_add_test(tc_disks3, test_disks_dispersion);
 	tcase_add_test(tc_objects1, test_objects_dispersion);
 	tcase_add_test(tc_objects2, test_objects_dispersion);
+	tcase_add_test(tc_varray, test_vnode_array);
+	tcase_add_test(tc_vmerge, test_vnode_merge);
 
 	suite_add_tcase(s, tc_basic1);
 	suite_add_tcase(s, tc_basic2);
@@ -599,6 +790,8 @@ static Suite *test_suite(void)
 	suite_add_tcase(s, tc_disks2);
 	suite_add_tcase(s, tc_objects1);
 	suite_add_tcase(s, tc_objects2);
+	suite_add_tcase(s, tc_varray);
+	suite_add_tcase(s, tc_vmerge);
 
 	return s;
 }
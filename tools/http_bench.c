@@ -0,0 +1,1032 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator of the http gateway
+ *
+ * http_bench drives a mix of PUT, GET, HEAD, DELETE and LIST requests at a
+ * container of swift or a bucket of s3 served by 'sheep -r', with a thread and
+ * a keep-alive connection for each client, and reports the throughput and the
+ * percentiles of the latency of each operation.  The keys are picked from a
+ * key space of the given size, uniformly, by a zipf distribution or one after
+ * another, and the objects are of a fixed size or of a size uniform in a
+ * range.  LIST is a GET of the container or the bucket itself.
+ *
+ * With -M, the /metrics of a sheep are scraped before and after the run to
+ * print the time the requests spent in the stages of the gateway, see
+ * metrics_http() of sheep/http/metrics.c.
+ *
+ *   $ http_bench -c 64 -t 60 -m put=20,get=70,head=5,delete=5 -s 4k-1m \
+ *       -k 100000 -d zipf -C -M 127.0.0.1:8000 http://127.0.0.1:8000/v1/a/c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BUF_SIZE	(64 * 1024)
+#define MAX_HEADER	8192
+
+/* Latencies in microseconds, log-linear with 2^HIST_SUB_BITS per power of 2 */
+#define HIST_SUB_BITS	5
+#define HIST_NR_BUCKETS	((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum bench_op {
+	OP_PUT,
+	OP_GET,
+	OP_HEAD,
+	OP_DELETE,
+	OP_LIST,
+	OP_NR,
+};
+
+static const char * const op_names[OP_NR] = {
+	"put", "get", "head", "delete", "list",
+};
+
+enum key_dist {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_SEQ,
+};
+
+struct op_stat {
+	uint64_t nr;
+	uint64_t errors; /* I/O errors and the statuses above 400 */
+	uint64_t missing; /* 404 of the keys not put yet */
+	uint64_t bytes; /* of the bodies sent and received */
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t hist[HIST_NR_BUCKETS];
+};
+
+struct conn {
+	int fd;
+	char buf[BUF_SIZE];
+	size_t start, end;
+};
+
+struct client {
+	pthread_t thread;
+	struct conn conn;
+	uint64_t rand;
+	struct op_stat stat[OP_NR];
+};
+
+static struct {
+	char host[256];
+	char port[16];
+	char path[1024]; /* of the container or the bucket */
+	bool s3;
+	int nr_clients;
+	int seconds;
+	uint64_t nr_requests; /* 0 for running until the time is up */
+	unsigned weight[OP_NR];
+	unsigned total_weight;
+	uint64_t min_size, max_size;
+	uint64_t nr_keys;
+	enum key_dist dist;
+	double theta;
+	bool prefill;
+	bool create;
+	char metrics[256]; /* host:port, or empty */
+} opt = {
+	.port = "80",
+	.nr_clients = 16,
+	.seconds = 30,
+	.min_size = 4096,
+	.max_size = 4096,
+	.nr_keys = 1000,
+	.theta = 0.99,
+};
+
+static volatile bool stopped;
+static uint64_t nr_issued;
+static uint64_t next_seq;
+static double *zipf_cdf;
+static char *body;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64* */
+static uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * UINT64_C(2685821657736338717);
+}
+
+static double rand_double(uint64_t *state)
+{
+	return (next_rand(state) >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+static int hist_bucket(uint64_t us)
+{
+	int msb, idx;
+
+	if (us < (1 << HIST_SUB_BITS))
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((us >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+
+	return idx < HIST_NR_BUCKETS ? idx : HIST_NR_BUCKETS - 1;
+}
+
+/* The smallest value of the bucket */
+static uint64_t hist_bucket_min(int idx)
+{
+	int group = idx >> HIST_SUB_BITS, sub = idx & ((1 << HIST_SUB_BITS) - 1);
+
+	if (group == 0)
+		return idx;
+
+	return (uint64_t)((1 << HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+static uint64_t hist_percentile(const struct op_stat *s, double pct)
+{
+	uint64_t want = ceil(s->nr * pct / 100), sum = 0;
+
+	for (int i = 0; i < HIST_NR_BUCKETS; i++) {
+		sum += s->hist[i];
+		if (sum >= want && sum)
+			return hist_bucket_min(i + 1) < s->max_us ?
+				hist_bucket_min(i + 1) : s->max_us;
+	}
+	return s->max_us;
+}
+
+static int conn_open(struct conn *c, const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	}, *res, *ai;
+	int ret, on = 1;
+
+	c->fd = -1;
+	c->start = c->end = 0;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "failed to resolve %s, %s\n", host,
+			gai_strerror(ret));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (c->fd < 0)
+			continue;
+		if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(c->fd);
+		c->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (c->fd < 0) {
+		fprintf(stderr, "failed to connect to %s:%s, %m\n", host, port);
+		return -1;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->start = c->end = 0;
+}
+
+/* Read more into the buffer, after moving the unread bytes to its start */
+static int conn_fill(struct conn *c)
+{
+	ssize_t n;
+
+	if (c->start) {
+		memmove(c->buf, c->buf + c->start, c->end - c->start);
+		c->end -= c->start;
+		c->start = 0;
+	}
+	if (c->end == sizeof(c->buf))
+		return -1;
+	do {
+		n = read(c->fd, c->buf + c->end, sizeof(c->buf) - c->end);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return -1;
+	c->end += n;
+	return 0;
+}
+
+/* Return the next line without its CRLF, NULL on error */
+static char *conn_line(struct conn *c)
+{
+	char *p, *line;
+
+	while (!(p = memmem(c->buf + c->start, c->end - c->start, "\r\n", 2)))
+		if (conn_fill(c) < 0)
+			return NULL;
+	*p = '\0';
+	line = c->buf + c->start;
+	c->start = p + 2 - c->buf;
+	return line;
+}
+
+/* Read and drop len bytes of the body, or save them to out if not NULL */
+static int conn_skip(struct conn *c, uint64_t len, char *out)
+{
+	while (len) {
+		size_t n;
+
+		if (c->start == c->end && conn_fill(c) < 0)
+			return -1;
+		n = c->end - c->start < len ? c->end - c->start : len;
+		if (out) {
+			memcpy(out, c->buf + c->start, n);
+			out += n;
+		}
+		c->start += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt) {
+		ssize_t n = writev(fd, iov, cnt);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Run a request on the connection, which is opened first if it isn't.  Return
+ * the status of the response, or -1 on error after closing the connection.
+ * The body of the response is saved to out if it is not NULL, up to out_len
+ * bytes.  The bytes of the bodies are added to bytes.
+ */
+static int http_request(struct conn *c, const char *method, const char *path,
+			const char *data, uint64_t len, char *out,
+			uint64_t out_len, uint64_t *bytes)
+{
+	char hdr[MAX_HEADER], *line, *p;
+	struct iovec iov[2];
+	uint64_t length = 0;
+	bool chunked = false, keep_alive = true, head;
+	int status, n;
+
+	if (c->fd < 0 && conn_open(c, opt.host, opt.port) < 0)
+		return -1;
+
+	n = snprintf(hdr, sizeof(hdr), "%s %s HTTP/1.1\r\nHost: %s\r\n"
+		     "Content-Length: %"PRIu64"\r\n\r\n", method, path,
+		     opt.host, len);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = n;
+	iov[1].iov_base = (char *)data;
+	iov[1].iov_len = len;
+	if (send_all(c->fd, iov, len ? 2 : 1) < 0)
+		goto err;
+	*bytes += len;
+
+	line = conn_line(c);
+	if (!line || sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+		goto err;
+	while ((line = conn_line(c)) && *line) {
+		p = strchr(line, ':');
+		if (!p)
+			continue;
+		*p++ = '\0';
+		p += strspn(p, " \t");
+		if (!strcasecmp(line, "Content-Length"))
+			length = strtoull(p, NULL, 10);
+		else if (!strcasecmp(line, "Transfer-Encoding"))
+			chunked = strcasestr(p, "chunked") != NULL;
+		else if (!strcasecmp(line, "Connection"))
+			keep_alive = !strcasestr(p, "close");
+	}
+	if (!line)
+		goto err;
+
+	head = !strcmp(method, "HEAD");
+	if (head || status == 204 || status == 304)
+		;
+	else if (chunked) {
+		for (;;) {
+			uint64_t size;
+
+			line = conn_line(c);
+			if (!line)
+				goto err;
+			size = strtoull(line, NULL, 16);
+			if (!size)
+				break;
+			if (conn_skip(c, size, NULL) < 0 || !conn_line(c))
+				goto err;
+			*bytes += size;
+		}
+		/* the trailer */
+		while ((line = conn_line(c)) && *line)
+			;
+		if (!line)
+			goto err;
+	} else {
+		if (out && length < out_len) {
+			if (conn_skip(c, length, out) < 0)
+				goto err;
+			out[length] = '\0';
+		} else if (conn_skip(c, length, NULL) < 0)
+			goto err;
+		*bytes += length;
+	}
+
+	if (!keep_alive)
+		conn_close(c);
+	return status;
+err:
+	conn_close(c);
+	return -1;
+}
+
+static uint64_t pick_key(struct client *cl)
+{
+	uint64_t lo = 0, hi = opt.nr_keys - 1;
+	double r;
+
+	switch (opt.dist) {
+	case DIST_SEQ:
+		return __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED) %
+			opt.nr_keys;
+	case DIST_ZIPF:
+		r = rand_double(&cl->rand);
+		while (lo < hi) {
+			uint64_t mid = (lo + hi) / 2;
+
+			if (zipf_cdf[mid] < r)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		/* scatter the hot ranks over the key space */
+		return (lo * UINT64_C(0x9e3779b97f4a7c15)) % opt.nr_keys;
+	default:
+		return next_rand(&cl->rand) % opt.nr_keys;
+	}
+}
+
+static enum bench_op pick_op(struct client *cl)
+{
+	unsigned r = next_rand(&cl->rand) % opt.total_weight;
+	int op;
+
+	for (op = 0; op < OP_NR - 1; op++) {
+		if (r < opt.weight[op])
+			break;
+		r -= opt.weight[op];
+	}
+	return op;
+}
+
+static uint64_t pick_size(struct client *cl)
+{
+	if (opt.min_size == opt.max_size)
+		return opt.min_size;
+	return opt.min_size +
+		next_rand(&cl->rand) % (opt.max_size - opt.min_size + 1);
+}
+
+static void key_path(char *path, size_t len, uint64_t key)
+{
+	snprintf(path, len, "%s/bench-%010"PRIu64, opt.path, key);
+}
+
+static void run_op(struct client *cl, enum bench_op op, uint64_t key)
+{
+	static const char * const methods[OP_NR] = {
+		"PUT", "GET", "HEAD", "DELETE", "GET",
+	};
+	struct op_stat *s = cl->stat + op;
+	char path[sizeof(opt.path) + 32];
+	uint64_t start, us, len = 0;
+	int status;
+
+	if (op == OP_LIST)
+		snprintf(path, sizeof(path), "%s", opt.path);
+	else
+		key_path(path, sizeof(path), key);
+	if (op == OP_PUT)
+		len = pick_size(cl);
+
+	start = now_us();
+	status = http_request(&cl->conn, methods[op], path, body, len, NULL, 0,
+			      &s->bytes);
+	us = now_us() - start;
+
+	s->nr++;
+	s->total_us += us;
+	if (us > s->max_us)
+		s->max_us = us;
+	s->hist[hist_bucket(us)]++;
+	if (status == 404 && op != OP_LIST && op != OP_PUT)
+		s->missing++;
+	else if (status < 0 || status >= 400)
+		s->errors++;
+}
+
+static bool take_request(void)
+{
+	if (stopped)
+		return false;
+	if (!opt.nr_requests)
+		return true;
+	return __atomic_fetch_add(&nr_issued, 1, __ATOMIC_RELAXED) <
+		opt.nr_requests;
+}
+
+static void *client_main(void *arg)
+{
+	struct client *cl = arg;
+
+	while (take_request())
+		run_op(cl, pick_op(cl), pick_key(cl));
+
+	conn_close(&cl->conn);
+	return NULL;
+}
+
+/* PUT each key once, the clients splitting the key space */
+static void *prefill_main(void *arg)
+{
+	struct client *cl = arg;
+	uint64_t key;
+
+	while ((key = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED)) <
+	       opt.nr_keys)
+		run_op(cl, OP_PUT, key);
+
+	conn_close(&cl->conn);
+	return NULL;
+}
+
+static void run_clients(struct client *clients, void *(*fn)(void *))
+{
+	for (int i = 0; i < opt.nr_clients; i++) {
+		int ret = pthread_create(&clients[i].thread, NULL, fn,
+					 clients + i);
+
+		if (ret) {
+			fprintf(stderr, "failed to create a thread, %s\n",
+				strerror(ret));
+			exit(1);
+		}
+	}
+}
+
+/* Clear the stats and seed the generators of the clients */
+static void reset_clients(struct client *clients, uint64_t seed)
+{
+	memset(clients, 0, sizeof(*clients) * opt.nr_clients);
+	for (int i = 0; i < opt.nr_clients; i++) {
+		clients[i].conn.fd = -1;
+		clients[i].rand = (seed + i * UINT64_C(0x9e3779b97f4a7c15)) | 1;
+	}
+}
+
+static void join_clients(struct client *clients)
+{
+	for (int i = 0; i < opt.nr_clients; i++)
+		pthread_join(clients[i].thread, NULL);
+}
+
+static void merge_stat(struct op_stat *to, const struct op_stat *from)
+{
+	to->nr += from->nr;
+	to->errors += from->errors;
+	to->missing += from->missing;
+	to->bytes += from->bytes;
+	to->total_us += from->total_us;
+	if (from->max_us > to->max_us)
+		to->max_us = from->max_us;
+	for (int i = 0; i < HIST_NR_BUCKETS; i++)
+		to->hist[i] += from->hist[i];
+}
+
+static void print_report(const struct client *clients, double seconds)
+{
+	struct op_stat *sum = calloc(OP_NR + 1, sizeof(*sum));
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+
+	for (int i = 0; i < opt.nr_clients; i++)
+		for (int op = 0; op < OP_NR; op++) {
+			merge_stat(sum + op, clients[i].stat + op);
+			merge_stat(sum + OP_NR, clients[i].stat + op);
+		}
+
+	printf("%-7s %10s %8s %8s %10s %9s %9s %9s %9s %9s %9s %9s\n", "op",
+	       "requests", "errors", "missing", "req/s", "MB/s", "avg ms",
+	       "p50", "p90", "p99", "p99.9", "max");
+	for (int op = 0; op <= OP_NR; op++) {
+		const struct op_stat *s = sum + op;
+
+		if (!s->nr)
+			continue;
+		printf("%-7s %10"PRIu64" %8"PRIu64" %8"PRIu64" %10.1f %9.2f "
+		       "%9.3f", op < OP_NR ? op_names[op] : "total", s->nr,
+		       s->errors, s->missing, s->nr / seconds,
+		       s->bytes / seconds / 1048576,
+		       (double)s->total_us / s->nr / 1000);
+		for (int i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+			printf(" %9.3f", hist_percentile(s, pcts[i]) / 1000.0);
+		printf(" %9.3f\n", s->max_us / 1000.0);
+	}
+	free(sum);
+}
+
+/* The counters of the stages of sheep_http_*, see metrics_http() */
+#define NR_STAGES 4
+static const char * const stage_names[NR_STAGES] = {
+	"queue", "io", "alloc", "handle",
+};
+static const char * const method_names[] = {
+	"GET", "PUT", "POST", "DELETE", "HEAD",
+};
+#define NR_METHODS (sizeof(method_names) / sizeof(method_names[0]))
+
+struct sheep_stages {
+	double nr[NR_METHODS];
+	double seconds[NR_METHODS][NR_STAGES];
+};
+
+static int name_index(const char * const *names, int nr, const char *s,
+		      size_t len)
+{
+	for (int i = 0; i < nr; i++)
+		if (strlen(names[i]) == len && !strncmp(names[i], s, len))
+			return i;
+	return -1;
+}
+
+/* Return the index of the value of the label in names, or -1 */
+static int label_index(const char *line, const char *label,
+		       const char * const *names, int nr)
+{
+	char key[64];
+	const char *p;
+
+	snprintf(key, sizeof(key), "%s=\"", label);
+	p = strstr(line, key);
+	if (!p)
+		return -1;
+	p += strlen(key);
+	return name_index(names, nr, p, strcspn(p, "\""));
+}
+
+static int scrape_metrics(struct sheep_stages *st)
+{
+	char host[256], *port, *text, *line, *save;
+	uint64_t bytes = 0, len = 4 * 1024 * 1024;
+	struct conn *c = calloc(1, sizeof(*c));
+	int status, m, s;
+
+	memset(st, 0, sizeof(*st));
+	snprintf(host, sizeof(host), "%s", opt.metrics);
+	port = strrchr(host, ':');
+	if (!port) {
+		fprintf(stderr, "the metrics address is host:port\n");
+		free(c);
+		return -1;
+	}
+	*port++ = '\0';
+	text = malloc(len);
+	if (conn_open(c, host, port) < 0) {
+		free(text);
+		free(c);
+		return -1;
+	}
+	status = http_request(c, "GET", "/metrics", NULL, 0, text, len,
+			      &bytes);
+	conn_close(c);
+	free(c);
+	if (status != 200) {
+		fprintf(stderr, "failed to get the metrics, %d\n", status);
+		free(text);
+		return -1;
+	}
+
+	for (line = strtok_r(text, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		const char *value = strrchr(line, ' ');
+
+		if (!value)
+			continue;
+		m = label_index(line, "method", method_names, NR_METHODS);
+		if (m < 0)
+			continue;
+		if (!strncmp(line, "sheep_http_requests_total{", 26))
+			st->nr[m] = atof(value);
+		else if (!strncmp(line, "sheep_http_seconds_total{", 25)) {
+			s = label_index(line, "stage", stage_names, NR_STAGES);
+			if (s >= 0)
+				st->seconds[m][s] = atof(value);
+		}
+	}
+	free(text);
+	return 0;
+}
+
+static void print_stages(const struct sheep_stages *before,
+			 const struct sheep_stages *after)
+{
+	printf("\nsheep %s, mean ms of the stages\n", opt.metrics);
+	printf("%-7s %10s", "method", "requests");
+	for (int s = 0; s < NR_STAGES; s++)
+		printf(" %9s", stage_names[s]);
+	printf("\n");
+	for (int m = 0; m < NR_METHODS; m++) {
+		double nr = after->nr[m] - before->nr[m];
+
+		if (nr <= 0)
+			continue;
+		printf("%-7s %10.0f", method_names[m], nr);
+		for (int s = 0; s < NR_STAGES; s++)
+			printf(" %9.3f", (after->seconds[m][s] -
+					  before->seconds[m][s]) / nr * 1000);
+		printf("\n");
+	}
+}
+
+/* Create the account and the container of swift, or the bucket of s3 */
+static int create_container(void)
+{
+	struct conn c = { .fd = -1 };
+	char path[sizeof(opt.path)];
+	uint64_t bytes = 0;
+	char *p = path + 1;
+	int status = 0;
+
+	snprintf(path, sizeof(path), "%s", opt.path);
+	/* swift wants /v1/account first */
+	if (!opt.s3 && !strncmp(path, "/v1/", 4))
+		p = strchr(path + 4, '/');
+	while (p) {
+		char saved;
+
+		p = strchr(p + 1, '/');
+		if (!p)
+			p = path + strlen(path);
+		saved = *p;
+		*p = '\0';
+		status = http_request(&c, "PUT", path, NULL, 0, NULL, 0,
+				      &bytes);
+		*p = saved;
+		if (status < 0 || (status >= 400 && status != 409)) {
+			fprintf(stderr, "failed to create %.*s, %d\n",
+				(int)(p - path), path, status);
+			conn_close(&c);
+			return -1;
+		}
+		if (!saved)
+			break;
+	}
+	conn_close(&c);
+	return 0;
+}
+
+static int parse_size(const char *s, uint64_t *size)
+{
+	char *end;
+
+	*size = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'g': case 'G':
+		*size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		*size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		*size <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	return *end && *end != '-' ? -1 : 0;
+}
+
+static int parse_sizes(const char *s)
+{
+	const char *dash = strchr(s, '-');
+
+	if (parse_size(s, &opt.min_size) < 0)
+		return -1;
+	opt.max_size = opt.min_size;
+	if (dash && parse_size(dash + 1, &opt.max_size) < 0)
+		return -1;
+	return opt.min_size <= opt.max_size ? 0 : -1;
+}
+
+/* e.g. put=20,get=70,head=5,delete=5,list=0 */
+static int parse_mix(const char *s)
+{
+	char *str = strdup(s), *tok, *save, *eq;
+	int op, ret = 0;
+
+	memset(opt.weight, 0, sizeof(opt.weight));
+	opt.total_weight = 0;
+	for (tok = strtok_r(str, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (!eq) {
+			ret = -1;
+			break;
+		}
+		op = name_index(op_names, OP_NR, tok, eq - tok);
+		if (op < 0) {
+			ret = -1;
+			break;
+		}
+		opt.weight[op] = atoi(eq + 1);
+		opt.total_weight += opt.weight[op];
+	}
+	free(str);
+	return ret < 0 || !opt.total_weight ? -1 : 0;
+}
+
+static int parse_dist(const char *s)
+{
+	if (!strcmp(s, "uniform"))
+		opt.dist = DIST_UNIFORM;
+	else if (!strcmp(s, "seq"))
+		opt.dist = DIST_SEQ;
+	else if (!strncmp(s, "zipf", 4)) {
+		opt.dist = DIST_ZIPF;
+		if (s[4] == ':')
+			opt.theta = atof(s + 5);
+		else if (s[4])
+			return -1;
+	} else
+		return -1;
+	return 0;
+}
+
+/* http://host[:port]/path */
+static int parse_url(const char *url)
+{
+	const char *p, *slash, *colon;
+
+	if (strncmp(url, "http://", 7))
+		return -1;
+	p = url + 7;
+	slash = strchr(p, '/');
+	if (!slash || !slash[1])
+		return -1;
+	colon = memchr(p, ':', slash - p);
+	if (colon) {
+		snprintf(opt.host, sizeof(opt.host), "%.*s", (int)(colon - p),
+			 p);
+		snprintf(opt.port, sizeof(opt.port), "%.*s",
+			 (int)(slash - colon - 1), colon + 1);
+	} else
+		snprintf(opt.host, sizeof(opt.host), "%.*s", (int)(slash - p),
+			 p);
+	snprintf(opt.path, sizeof(opt.path), "%s", slash);
+	/* no trailing slash */
+	for (size_t len = strlen(opt.path); len > 1 && opt.path[len - 1] == '/';
+	     len--)
+		opt.path[len - 1] = '\0';
+	return 0;
+}
+
+static void init_zipf(void)
+{
+	double sum = 0;
+
+	zipf_cdf = malloc(sizeof(*zipf_cdf) * opt.nr_keys);
+	if (!zipf_cdf) {
+		fprintf(stderr, "out of memory for %"PRIu64" keys\n",
+			opt.nr_keys);
+		exit(1);
+	}
+	for (uint64_t i = 0; i < opt.nr_keys; i++) {
+		sum += 1.0 / pow(i + 1, opt.theta);
+		zipf_cdf[i] = sum;
+	}
+	for (uint64_t i = 0; i < opt.nr_keys; i++)
+		zipf_cdf[i] /= sum;
+}
+
+static void usage(int status)
+{
+	fprintf(status ? stderr : stdout,
+		"Usage: http_bench [OPTION]... URL\n"
+		"Drive requests at the container or the bucket of URL, "
+		"http://host[:port]/path\n\n"
+		"  -c, --clients N      concurrent clients (default 16)\n"
+		"  -t, --time SECONDS   run for SECONDS (default 30)\n"
+		"  -n, --requests N     stop after N requests instead\n"
+		"  -m, --mix MIX        weights of the operations, e.g.\n"
+		"                       put=20,get=70,head=5,delete=5,list=0\n"
+		"                       (default put=50,get=50)\n"
+		"  -s, --size SIZE      object size, e.g. 4k, or a range 4k-1m\n"
+		"  -k, --keys N         keys in the key space (default 1000)\n"
+		"  -d, --dist DIST      uniform, zipf[:theta] or seq\n"
+		"  -p, --prefill        PUT every key before the run\n"
+		"  -C, --create         create the container or the bucket\n"
+		"  -P, --proto PROTO    swift (default) or s3\n"
+		"  -M, --metrics ADDR   print the stages of the sheep at "
+		"host:port\n"
+		"  -h, --help           display this help and exit\n");
+	exit(status);
+}
+
+static const struct option long_options[] = {
+	{"clients", required_argument, NULL, 'c'},
+	{"time", required_argument, NULL, 't'},
+	{"requests", required_argument, NULL, 'n'},
+	{"mix", required_argument, NULL, 'm'},
+	{"size", required_argument, NULL, 's'},
+	{"keys", required_argument, NULL, 'k'},
+	{"dist", required_argument, NULL, 'd'},
+	{"prefill", no_argument, NULL, 'p'},
+	{"create", no_argument, NULL, 'C'},
+	{"proto", required_argument, NULL, 'P'},
+	{"metrics", required_argument, NULL, 'M'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+int main(int argc, char **argv)
+{
+	struct sheep_stages before, after;
+	struct client *clients;
+	uint64_t start, seed;
+	double seconds;
+	int ch;
+
+	parse_mix("put=50,get=50");
+	while ((ch = getopt_long(argc, argv, "c:t:n:m:s:k:d:pCP:M:h",
+				 long_options, NULL)) >= 0) {
+		switch (ch) {
+		case 'c':
+			opt.nr_clients = atoi(optarg);
+			if (opt.nr_clients <= 0)
+				usage(1);
+			break;
+		case 't':
+			opt.seconds = atoi(optarg);
+			if (opt.seconds <= 0)
+				usage(1);
+			break;
+		case 'n':
+			opt.nr_requests = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (parse_mix(optarg) < 0) {
+				fprintf(stderr, "invalid mix %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 's':
+			if (parse_sizes(optarg) < 0) {
+				fprintf(stderr, "invalid size %s\n", optarg);
+				usage(1);
+			}
+			break;
+		case 'k':
+			opt.nr_keys = strtoull(optarg, NULL, 10);
+			if (!opt.nr_keys)
+				usage(1);
+			break;
+		case 'd':
+			if (parse_dist(optarg) < 0) {
+				fprintf(stderr, "invalid distribution %s\n",
+					optarg);
+				usage(1);
+			}
+			break;
+		case 'p':
+			opt.prefill = true;
+			break;
+		case 'C':
+			opt.create = true;
+			break;
+		case 'P':
+			if (!strcmp(optarg, "s3"))
+				opt.s3 = true;
+			else if (strcmp(optarg, "swift"))
+				usage(1);
+			break;
+		case 'M':
+			snprintf(opt.metrics, sizeof(opt.metrics), "%s",
+				 optarg);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (optind != argc - 1 || parse_url(argv[optind]) < 0)
+		usage(1);
+
+	body = malloc(opt.max_size ?: 1);
+	clients = calloc(opt.nr_clients, sizeof(*clients));
+	if (!body || !clients) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	seed = now_us();
+	for (uint64_t i = 0; i < opt.max_size; i++)
+		body[i] = next_rand(&seed);
+	reset_clients(clients, seed);
+	if (opt.dist == DIST_ZIPF)
+		init_zipf();
+
+	if (opt.create && create_container() < 0)
+		return 1;
+	if (opt.prefill) {
+		printf("putting %"PRIu64" keys\n", opt.nr_keys);
+		run_clients(clients, prefill_main);
+		join_clients(clients);
+		reset_clients(clients, seed);
+		next_seq = 0;
+	}
+
+	if (opt.metrics[0] && scrape_metrics(&before) < 0)
+		return 1;
+
+	start = now_us();
+	run_clients(clients, client_main);
+	if (!opt.nr_requests) {
+		sleep(opt.seconds);
+		stopped = true;
+	}
+	join_clients(clients);
+	seconds = (now_us() - start) / 1e6;
+
+	printf("%d clients, %.1f seconds, %"PRIu64" keys, %"PRIu64"-%"PRIu64
+	       " bytes\n\n", opt.nr_clients, seconds, opt.nr_keys,
+	       opt.min_size, opt.max_size);
+	print_report(clients, seconds);
+
+	if (opt.metrics[0] && scrape_metrics(&after) == 0)
+		print_stages(&before, &after);
+
+	free(clients);
+	free(body);
+	free(zipf_cdf);
+	return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The virtio-blk device on the virtqueues
+ *
+ * A request is a chain of descriptors in the memory of the guest: the
+ * virtio_blk_outhdr, the data and the status byte.  The data segments are
+ * handed to sd_vdi_submit() as they are, so the objects are read into and
+ * written from the memory of the guest without a copy.  The used entries of
+ * the requests done are published and the guest is notified once for each
+ * batch.
+ */
+
+#include "vhost.h"
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_POLL_BATCH 64
+
+uint64_t vhost_blk_features(struct vhost_dev *dev)
+{
+	uint64_t features = (1ULL << VIRTIO_F_VERSION_1) |
+		(1ULL << VIRTIO_BLK_F_SEG_MAX) |
+		(1ULL << VIRTIO_BLK_F_BLK_SIZE);
+
+	/* a write is on the disks when it is done, so no FLUSH */
+	if (dev->readonly)
+		features |= 1ULL << VIRTIO_BLK_F_RO;
+	if (dev->nr_queues > 1)
+		features |= 1ULL << VIRTIO_BLK_F_MQ;
+	return features;
+}
+
+size_t vhost_blk_config(struct vhost_dev *dev, void *buf)
+{
+	struct virtio_blk_config config = {};
+
+	config.capacity = dev->capacity / BLK_SECTOR_SIZE;
+	config.seg_max = VHOST_MAX_SEGS - 2;
+	config.blk_size = BLK_SECTOR_SIZE;
+	config.num_queues = dev->nr_queues;
+	memcpy(buf, &config, sizeof(config));
+	return sizeof(config);
+}
+
+int vhost_vq_start(struct vhost_vq *vq)
+{
+	if (!vq->num || !vq->desc || !vq->avail || !vq->used) {
+		fprintf(stderr, "queue %d is not set up\n", vq->index);
+		return -1;
+	}
+
+	if (!vq->reqs)
+		vq->reqs = xcalloc(vq->num, sizeof(*vq->reqs));
+	vq->started = true;
+	return 0;
+}
+
+/* Called before the memory of the guest goes away */
+void vhost_vq_stop(struct vhost_vq *vq)
+{
+	while (vq->nr_inflight)
+		vhost_blk_complete(vq->dev, true);
+
+	vq->started = false;
+	free(vq->reqs);
+	vq->reqs = NULL;
+}
+
+static void vq_push(struct vhost_vq *vq, uint16_t head, uint32_t len)
+{
+	struct vring_used_elem *elem = vq->used->ring + vq->used_idx % vq->num;
+
+	elem->id = head;
+	elem->len = len;
+	vq->used_idx++;
+	vq->used_dirty = true;
+}
+
+static void vq_flush(struct vhost_vq *vq)
+{
+	if (!vq->used_dirty)
+		return;
+
+	/* the used entries before the index */
+	cmm_smp_wmb();
+	uatomic_set(&vq->used->idx, vq->used_idx);
+	vq->used_dirty = false;
+
+	/* the index before the flags of the guest */
+	cmm_smp_mb();
+	if (vq->call_fd >= 0 &&
+	    !(uatomic_read(&vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT))
+		eventfd_xwrite(vq->call_fd, 1);
+}
+
+static void blk_done(struct vhost_blk_req *req, uint8_t status)
+{
+	*req->status = status;
+	vq_push(req->vq, req->head, req->len);
+}
+
+/* Map the chain of head into req->iov, return the number of the segments */
+static int vq_map_chain(struct vhost_vq *vq, uint16_t head,
+			struct iovec *iov)
+{
+	uint32_t i = head;
+	int cnt = 0;
+
+	for (uint32_t n = 0; n < vq->num; n++) {
+		struct vring_desc desc = vq->desc[i];
+
+		if (cnt == VHOST_MAX_SEGS ||
+		    desc.flags & VRING_DESC_F_INDIRECT)
+			return -1;
+		iov[cnt].iov_base = vhost_gpa_to_va(vq->dev, desc.addr,
+						    desc.len);
+		if (!iov[cnt].iov_base)
+			return -1;
+		iov[cnt++].iov_len = desc.len;
+
+		if (!(desc.flags & VRING_DESC_F_NEXT))
+			return cnt;
+		i = desc.next;
+		if (i >= vq->num)
+			return -1;
+	}
+	/* a loop */
+	return -1;
+}
+
+/* Take len bytes off the front of the segments */
+static int iov_pull(struct iovec **iov, int *cnt, void *buf, size_t len)
+{
+	while (len) {
+		size_t n;
+
+		if (!*cnt)
+			return -1;
+		n = min(len, (*iov)->iov_len);
+		memcpy(buf, (*iov)->iov_base, n);
+		buf = (char *)buf + n;
+		len -= n;
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+		if (!(*iov)->iov_len) {
+			(*iov)++;
+			(*cnt)--;
+		}
+	}
+	return 0;
+}
+
+static size_t iov_size(const struct iovec *iov, int cnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < cnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static size_t iov_fill(const struct iovec *iov, int cnt, const void *buf,
+		       size_t len)
+{
+	size_t done = 0;
+
+	for (int i = 0; i < cnt && done < len; i++) {
+		size_t n = min(len - done, iov[i].iov_len);
+
+		memcpy(iov[i].iov_base, (const char *)buf + done, n);
+		done += n;
+	}
+	return done;
+}
+
+static void blk_handle(struct vhost_vq *vq, uint16_t head)
+{
+	struct vhost_dev *dev = vq->dev;
+	struct vhost_blk_req *req;
+	struct virtio_blk_outhdr hdr;
+	char id[VIRTIO_BLK_ID_BYTES] = {};
+	struct iovec *iov;
+	uint64_t offset;
+	size_t len;
+	int cnt;
+
+	if (head >= vq->num) {
+		fprintf(stderr, "bad head %u of queue %d\n", head, vq->index);
+		return;
+	}
+	req = vq->reqs + head;
+	if (req->busy) {
+		fprintf(stderr, "busy head %u of queue %d\n", head, vq->index);
+		return;
+	}
+	req->vq = vq;
+	req->head = head;
+	req->len = 1;
+
+	iov = req->iov;
+	cnt = vq_map_chain(vq, head, iov);
+	/* the status is the last byte of the chain */
+	if (cnt <= 0 || !iov[cnt - 1].iov_len) {
+		fprintf(stderr, "bad chain %u of queue %d\n", head, vq->index);
+		return;
+	}
+	req->status = (uint8_t *)iov[cnt - 1].iov_base +
+		--iov[cnt - 1].iov_len;
+	if (!iov[cnt - 1].iov_len)
+		cnt--;
+
+	if (iov_pull(&iov, &cnt, &hdr, sizeof(hdr)) < 0)
+		return blk_done(req, VIRTIO_BLK_S_IOERR);
+	len = iov_size(iov, cnt);
+
+	switch (hdr.type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		offset = hdr.sector * BLK_SECTOR_SIZE;
+		if (len % BLK_SECTOR_SIZE || offset > dev->capacity ||
+		    len > dev->capacity - offset ||
+		    (hdr.type == VIRTIO_BLK_T_OUT && dev->readonly))
+			return blk_done(req, VIRTIO_BLK_S_IOERR);
+		if (hdr.type == VIRTIO_BLK_T_IN)
+			req->len += len;
+		if (!len)
+			return blk_done(req, VIRTIO_BLK_S_OK);
+
+		req->io.vdi = dev->vdi;
+		req->io.write = hdr.type == VIRTIO_BLK_T_OUT;
+		req->io.iov = iov;
+		req->io.iovcnt = cnt;
+		req->io.offset = offset;
+		if (sd_vdi_submit(&req->io, 1) != SD_RES_SUCCESS)
+			return blk_done(req, VIRTIO_BLK_S_IOERR);
+		req->busy = true;
+		vq->nr_inflight++;
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		pstrcpy(id, sizeof(id), dev->vdi->name);
+		req->len += iov_fill(iov, cnt, id, sizeof(id));
+		blk_done(req, VIRTIO_BLK_S_OK);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		blk_done(req, VIRTIO_BLK_S_OK);
+		break;
+	default:
+		blk_done(req, VIRTIO_BLK_S_UNSUPP);
+		break;
+	}
+}
+
+/* Submit the requests the guest has made available, true if any */
+bool vhost_vq_kick(struct vhost_vq *vq)
+{
+	uint16_t avail_idx;
+
+	if (!vq->started || !vq->enabled)
+		return false;
+
+	avail_idx = uatomic_read(&vq->avail->idx);
+	if (avail_idx == vq->last_avail)
+		return false;
+	if ((uint16_t)(avail_idx - vq->last_avail) > vq->num) {
+		fprintf(stderr, "bad avail index %u of queue %d\n", avail_idx,
+			vq->index);
+		return false;
+	}
+	/* the ring entries after the index */
+	cmm_smp_rmb();
+
+	while (vq->last_avail != avail_idx) {
+		uint16_t head = vq->avail->ring[vq->last_avail % vq->num];
+
+		vq->last_avail++;
+		blk_handle(vq, head);
+	}
+	vq_flush(vq);
+	return true;
+}
+
+/* Complete the I/Os done, or wait for one, true if any */
+bool vhost_blk_complete(struct vhost_dev *dev, bool wait)
+{
+	struct sd_io *ios[BLK_POLL_BATCH];
+	int n;
+
+	n = sd_vdi_poll(dev->cluster, ios, ARRAY_SIZE(ios), wait);
+	for (int i = 0; i < n; i++) {
+		struct vhost_blk_req *req = container_of(ios[i],
+							 struct vhost_blk_req,
+							 io);
+
+		req->busy = false;
+		req->vq->nr_inflight--;
+		blk_done(req, req->io.ret == SD_RES_SUCCESS ?
+			 VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+	}
+	if (!n)
+		return false;
+
+	for (int i = 0; i < dev->nr_queues; i++)
+		vq_flush(dev->vqs + i);
+	return true;
+}
@@ -0,0 +1,714 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sheep-vhost: a vhost-user-blk back end for a vdi
+ *
+ * QEMU connects to the unix socket as the front end of the vhost-user
+ * protocol, shares the memory of the guest and hands over the virtqueues of
+ * a virtio-blk device, whose requests are served by libsheepdog, see blk.c.
+ * The guest I/O skips the block layer of QEMU and the copies to and from the
+ * buffers of a block driver.  One front end is served at a time.
+ *
+ * With -P, the queues and the completions are polled for a while after the
+ * last work before sleeping, and the guest is asked not to kick the queues
+ * while they are polled.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "vhost.h"
+
+#define VHOST_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+				 (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+				 (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+/* the tags of the epoll events, the kicks of the queues follow */
+enum {
+	EV_LISTEN,
+	EV_CONN,
+	EV_COMPLETE,
+	EV_KICK,
+};
+
+static struct vhost_dev vdev;
+static uint64_t poll_ns;
+static volatile sig_atomic_t stopping;
+
+static uint64_t vhost_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void *vhost_gpa_to_va(struct vhost_dev *dev, uint64_t gpa, uint64_t len)
+{
+	for (uint32_t i = 0; i < dev->nr_regions; i++) {
+		struct vhost_mem_region *r = dev->regions + i;
+
+		if (gpa >= r->guest_addr && gpa - r->guest_addr < r->size &&
+		    len <= r->size - (gpa - r->guest_addr))
+			return (char *)r->mmap_addr + r->mmap_offset +
+				(gpa - r->guest_addr);
+	}
+	return NULL;
+}
+
+/* The rings are given in the addresses of the front end */
+static void *uva_to_va(struct vhost_dev *dev, uint64_t uva, uint64_t len)
+{
+	for (uint32_t i = 0; i < dev->nr_regions; i++) {
+		struct vhost_mem_region *r = dev->regions + i;
+
+		if (uva >= r->user_addr && uva - r->user_addr < r->size &&
+		    len <= r->size - (uva - r->user_addr))
+			return (char *)r->mmap_addr + r->mmap_offset +
+				(uva - r->user_addr);
+	}
+	return NULL;
+}
+
+static int vq_map_rings(struct vhost_vq *vq)
+{
+	struct vhost_dev *dev = vq->dev;
+
+	vq->desc = uva_to_va(dev, vq->desc_addr,
+			     vq->num * sizeof(struct vring_desc));
+	vq->avail = uva_to_va(dev, vq->avail_addr,
+			      sizeof(struct vring_avail) +
+			      vq->num * sizeof(uint16_t));
+	vq->used = uva_to_va(dev, vq->used_addr,
+			     sizeof(struct vring_used) +
+			     vq->num * sizeof(struct vring_used_elem));
+	if (!vq->desc || !vq->avail || !vq->used) {
+		fprintf(stderr, "failed to map the rings of queue %d\n",
+			vq->index);
+		return -1;
+	}
+	return 0;
+}
+
+static void epoll_add(struct vhost_dev *dev, int fd, uint32_t tag)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = tag,
+	};
+
+	if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		panic("failed to add %d to epoll, %m", fd);
+}
+
+static void close_fd(struct vhost_dev *dev, int *fd, bool polled)
+{
+	if (*fd < 0)
+		return;
+	if (polled)
+		epoll_ctl(dev->epoll_fd, EPOLL_CTL_DEL, *fd, NULL);
+	close(*fd);
+	*fd = -1;
+}
+
+static void unmap_regions(struct vhost_dev *dev)
+{
+	/* no I/O may be left on the memory of the guest */
+	for (int i = 0; i < dev->nr_queues; i++)
+		while (dev->vqs[i].nr_inflight)
+			vhost_blk_complete(dev, true);
+
+	for (uint32_t i = 0; i < dev->nr_regions; i++)
+		munmap(dev->regions[i].mmap_addr, dev->regions[i].mmap_size);
+	dev->nr_regions = 0;
+}
+
+static void vhost_reset(struct vhost_dev *dev)
+{
+	for (int i = 0; i < dev->nr_queues; i++) {
+		struct vhost_vq *vq = dev->vqs + i;
+
+		if (vq->started)
+			vhost_vq_stop(vq);
+		close_fd(dev, &vq->kick_fd, true);
+		close_fd(dev, &vq->call_fd, false);
+		memset(vq, 0, sizeof(*vq));
+		vq->dev = dev;
+		vq->index = i;
+		vq->kick_fd = -1;
+		vq->call_fd = -1;
+	}
+	unmap_regions(dev);
+	dev->features = 0;
+	dev->protocol_features = 0;
+}
+
+static int set_mem_table(struct vhost_dev *dev, struct vhost_user_msg *msg,
+			 int *fds, int nr_fds)
+{
+	uint32_t nr = msg->payload.memory.nr_regions;
+
+	if (nr > VHOST_MAX_REGIONS || nr != nr_fds) {
+		fprintf(stderr, "bad memory table of %"PRIu32" regions\n", nr);
+		return -1;
+	}
+
+	unmap_regions(dev);
+	for (uint32_t i = 0; i < nr; i++) {
+		struct vhost_user_region *m = msg->payload.memory.regions + i;
+		struct vhost_mem_region *r = dev->regions + i;
+
+		r->guest_addr = m->guest_addr;
+		r->size = m->size;
+		r->user_addr = m->user_addr;
+		r->mmap_offset = m->mmap_offset;
+		r->mmap_size = m->mmap_offset + m->size;
+		r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fds[i], 0);
+		close(fds[i]);
+		fds[i] = -1;
+		if (r->mmap_addr == MAP_FAILED) {
+			fprintf(stderr, "failed to map region %"PRIu32", %m\n",
+				i);
+			return -1;
+		}
+		dev->nr_regions++;
+	}
+
+	/* the rings of the running queues have moved */
+	for (int i = 0; i < dev->nr_queues; i++)
+		if (dev->vqs[i].started && vq_map_rings(dev->vqs + i) < 0)
+			return -1;
+	return 0;
+}
+
+static struct vhost_vq *get_vq(struct vhost_dev *dev, uint32_t index)
+{
+	if (index >= (uint32_t)dev->nr_queues) {
+		fprintf(stderr, "bad queue %"PRIu32"\n", index);
+		return NULL;
+	}
+	return dev->vqs + index;
+}
+
+/* Take the fd of a kick, call or error message, -1 if none is passed */
+static int take_vring_fd(struct vhost_user_msg *msg, int *fds, int nr_fds)
+{
+	int fd;
+
+	if (msg->payload.u64 & VHOST_USER_VRING_NOFD || nr_fds != 1)
+		return -1;
+	fd = fds[0];
+	fds[0] = -1;
+	return fd;
+}
+
+static int set_vring_kick(struct vhost_dev *dev, struct vhost_vq *vq,
+			  int fd)
+{
+	/* we sleep on the kicks, the polling is up to us */
+	if (fd < 0) {
+		fprintf(stderr, "no kick fd of queue %d\n", vq->index);
+		return -1;
+	}
+
+	close_fd(dev, &vq->kick_fd, true);
+	vq->kick_fd = fd;
+	epoll_add(dev, fd, EV_KICK + vq->index);
+
+	/* the queues are enabled by the kick without protocol features */
+	if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+		vq->enabled = true;
+	if (vq_map_rings(vq) < 0 || vhost_vq_start(vq) < 0)
+		return -1;
+	vhost_vq_kick(vq);
+	return 0;
+}
+
+/* Return 1 if msg is filled in as the reply, 0 if none, or -1 on error */
+static int handle_msg(struct vhost_dev *dev, struct vhost_user_msg *msg,
+		      int *fds, int nr_fds)
+{
+	struct vhost_vq *vq;
+	uint8_t config[VHOST_CONFIG_MAX_SIZE] = {};
+	size_t len;
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = vhost_blk_features(dev) |
+			(1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_FEATURES:
+		dev->features = msg->payload.u64;
+		return 0;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = VHOST_PROTOCOL_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		dev->protocol_features = msg->payload.u64 &
+			VHOST_PROTOCOL_FEATURES;
+		return 0;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = dev->nr_queues;
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_OWNER:
+		return 0;
+	case VHOST_USER_RESET_OWNER:
+		vhost_reset(dev);
+		return 0;
+	case VHOST_USER_SET_MEM_TABLE:
+		return set_mem_table(dev, msg, fds, nr_fds);
+	case VHOST_USER_SET_VRING_NUM:
+		vq = get_vq(dev, msg->payload.state.index);
+		if (!vq || vq->started || !msg->payload.state.num ||
+		    msg->payload.state.num > VHOST_MAX_QUEUE_SIZE ||
+		    (msg->payload.state.num & (msg->payload.state.num - 1)))
+			return -1;
+		vq->num = msg->payload.state.num;
+		return 0;
+	case VHOST_USER_SET_VRING_ADDR:
+		vq = get_vq(dev, msg->payload.addr.index);
+		if (!vq || vq->started)
+			return -1;
+		vq->desc_addr = msg->payload.addr.desc_addr;
+		vq->avail_addr = msg->payload.addr.avail_addr;
+		vq->used_addr = msg->payload.addr.used_addr;
+		if (vq_map_rings(vq) < 0)
+			return -1;
+		/* the requests in the avail ring and not in the used ring */
+		vq->used_idx = uatomic_read(&vq->used->idx);
+		return 0;
+	case VHOST_USER_SET_VRING_BASE:
+		vq = get_vq(dev, msg->payload.state.index);
+		if (!vq || vq->started)
+			return -1;
+		vq->last_avail = msg->payload.state.num;
+		return 0;
+	case VHOST_USER_GET_VRING_BASE:
+		vq = get_vq(dev, msg->payload.state.index);
+		if (!vq)
+			return -1;
+		if (vq->started)
+			vhost_vq_stop(vq);
+		close_fd(dev, &vq->kick_fd, true);
+		msg->payload.state.num = vq->last_avail;
+		msg->size = sizeof(msg->payload.state);
+		return 1;
+	case VHOST_USER_SET_VRING_KICK:
+		vq = get_vq(dev, msg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+		if (!vq)
+			return -1;
+		return set_vring_kick(dev, vq,
+				      take_vring_fd(msg, fds, nr_fds));
+	case VHOST_USER_SET_VRING_CALL:
+		vq = get_vq(dev, msg->payload.u64 & VHOST_USER_VRING_IDX_MASK);
+		if (!vq)
+			return -1;
+		close_fd(dev, &vq->call_fd, false);
+		vq->call_fd = take_vring_fd(msg, fds, nr_fds);
+		return 0;
+	case VHOST_USER_SET_VRING_ERR:
+		/* we never report an error of a queue, fds[] are closed */
+		return get_vq(dev, msg->payload.u64 &
+			      VHOST_USER_VRING_IDX_MASK) ? 0 : -1;
+	case VHOST_USER_SET_VRING_ENABLE:
+		vq = get_vq(dev, msg->payload.state.index);
+		if (!vq)
+			return -1;
+		vq->enabled = msg->payload.state.num;
+		vhost_vq_kick(vq);
+		return 0;
+	case VHOST_USER_GET_CONFIG:
+		if (msg->size < offsetof(typeof(msg->payload.config), region) ||
+		    msg->payload.config.size > VHOST_CONFIG_MAX_SIZE ||
+		    msg->payload.config.offset > VHOST_CONFIG_MAX_SIZE -
+		    msg->payload.config.size)
+			return -1;
+		len = vhost_blk_config(dev, config);
+		memset(msg->payload.config.region, 0,
+		       msg->payload.config.size);
+		if (msg->payload.config.offset < len)
+			memcpy(msg->payload.config.region,
+			       config + msg->payload.config.offset,
+			       min((size_t)msg->payload.config.size,
+				   len - msg->payload.config.offset));
+		msg->size = offsetof(typeof(msg->payload.config), region) +
+			msg->payload.config.size;
+		return 1;
+	case VHOST_USER_SET_CONFIG:
+		/* nothing in the config is writable */
+		return 0;
+	default:
+		fprintf(stderr, "unsupported request %"PRIu32"\n",
+			msg->request);
+		return -1;
+	}
+}
+
+static int recv_msg(int fd, struct vhost_user_msg *msg, int *fds,
+		    int *nr_fds)
+{
+	char control[CMSG_SPACE(VHOST_MAX_REGIONS * sizeof(int))];
+	struct iovec iov = {
+		.iov_base = msg,
+		.iov_len = VHOST_USER_HDR_SIZE,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	*nr_fds = 0;
+reread:
+	ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	if (ret < 0 && errno == EINTR)
+		goto reread;
+	if (ret != VHOST_USER_HDR_SIZE)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			*nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nr_fds * sizeof(int));
+			break;
+		}
+
+	if (mh.msg_flags & MSG_CTRUNC || msg->size > sizeof(msg->payload) ||
+	    (msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION)
+		return -1;
+	if (msg->size && xread(fd, &msg->payload, msg->size) != msg->size)
+		return -1;
+	return 0;
+}
+
+static int send_reply(int fd, struct vhost_user_msg *msg)
+{
+	size_t len = VHOST_USER_HDR_SIZE + msg->size;
+
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+	return xwrite(fd, msg, len) == len ? 0 : -1;
+}
+
+static int conn_handler(struct vhost_dev *dev)
+{
+	struct vhost_user_msg msg;
+	int fds[VHOST_MAX_REGIONS], nr_fds, ret;
+	bool need_reply;
+
+	ret = recv_msg(dev->fd, &msg, fds, &nr_fds);
+	if (ret == 0) {
+		need_reply = msg.flags & VHOST_USER_NEED_REPLY &&
+			dev->protocol_features &
+			(1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK);
+		ret = handle_msg(dev, &msg, fds, nr_fds);
+		if (ret > 0)
+			ret = send_reply(dev->fd, &msg);
+		else if (need_reply) {
+			msg.payload.u64 = ret < 0;
+			msg.size = sizeof(msg.payload.u64);
+			if (send_reply(dev->fd, &msg) < 0)
+				ret = -1;
+		}
+	}
+
+	/* the fds the message has not taken */
+	for (int i = 0; i < nr_fds; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	return ret;
+}
+
+static void accept_handler(struct vhost_dev *dev, int listen_fd)
+{
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		fprintf(stderr, "failed to accept a front end, %m\n");
+		return;
+	}
+	if (dev->fd >= 0) {
+		fprintf(stderr, "a front end is already connected\n");
+		close(fd);
+		return;
+	}
+	dev->fd = fd;
+	epoll_add(dev, fd, EV_CONN);
+	fprintf(stderr, "front end connected\n");
+}
+
+static void disconnect(struct vhost_dev *dev)
+{
+	vhost_reset(dev);
+	close_fd(dev, &dev->fd, true);
+	fprintf(stderr, "front end disconnected\n");
+}
+
+/* Whether the guest kicks the queues, not while they are polled */
+static void set_notify(struct vhost_dev *dev, bool notify)
+{
+	for (int i = 0; i < dev->nr_queues; i++) {
+		struct vhost_vq *vq = dev->vqs + i;
+
+		if (!vq->started)
+			continue;
+		if (notify)
+			uatomic_and(&vq->used->flags, ~VRING_USED_F_NO_NOTIFY);
+		else
+			uatomic_or(&vq->used->flags, VRING_USED_F_NO_NOTIFY);
+	}
+}
+
+static void vhost_run(struct vhost_dev *dev, int listen_fd)
+{
+	struct epoll_event events[16];
+	uint64_t busy_since = 0;
+	bool polling = false;
+
+	while (!stopping) {
+		int nr = epoll_wait(dev->epoll_fd, events, ARRAY_SIZE(events),
+				    polling ? 0 : -1);
+
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("epoll_wait failed, %m");
+		}
+
+		for (int i = 0; i < nr; i++) {
+			uint32_t tag = events[i].data.u32;
+
+			switch (tag) {
+			case EV_LISTEN:
+				accept_handler(dev, listen_fd);
+				break;
+			case EV_CONN:
+				if (conn_handler(dev) < 0)
+					disconnect(dev);
+				break;
+			case EV_COMPLETE:
+				eventfd_xread(dev->cluster->complete_fd);
+				while (vhost_blk_complete(dev, false))
+					;
+				break;
+			default:
+				if (tag - EV_KICK >= (uint32_t)dev->nr_queues ||
+				    dev->vqs[tag - EV_KICK].kick_fd < 0)
+					break;
+				eventfd_xread(dev->vqs[tag - EV_KICK].kick_fd);
+				vhost_vq_kick(dev->vqs + tag - EV_KICK);
+				break;
+			}
+		}
+
+		if (!poll_ns || dev->fd < 0) {
+			polling = false;
+			continue;
+		}
+
+		/* poll until nothing has come for poll_ns */
+		for (int i = 0; i < dev->nr_queues; i++)
+			if (vhost_vq_kick(dev->vqs + i))
+				nr++;
+		if (vhost_blk_complete(dev, false))
+			nr++;
+		if (nr) {
+			if (!polling)
+				set_notify(dev, false);
+			polling = true;
+			busy_since = vhost_now();
+		} else if (polling && vhost_now() - busy_since > poll_ns) {
+			set_notify(dev, true);
+			/* the flags before the last look at the avail rings */
+			cmm_smp_mb();
+			polling = false;
+			for (int i = 0; i < dev->nr_queues; i++)
+				if (vhost_vq_kick(dev->vqs + i))
+					polling = true;
+			if (polling)
+				set_notify(dev, false);
+			busy_since = vhost_now();
+		}
+	}
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "too long socket path %s\n", path);
+		return -1;
+	}
+	pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "failed to create a socket, %m\n");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1) < 0) {
+		fprintf(stderr, "failed to listen on %s, %m\n", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void stop_handler(int signo)
+{
+	stopping = 1;
+}
+
+static const struct option long_options[] = {
+	{"address", required_argument, NULL, 'a'},
+	{"port", required_argument, NULL, 'p'},
+	{"snapshot", required_argument, NULL, 's'},
+	{"queues", required_argument, NULL, 'q'},
+	{"poll", required_argument, NULL, 'P'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(const char *progname)
+{
+	printf("Usage: %s [options] <vdi> <socket>\n"
+	       "Serve the vdi as a vhost-user-blk device on the unix socket\n"
+	       "  -a, --address   the address of the sheep, 127.0.0.1 "
+	       "by default\n"
+	       "  -p, --port      the port of the sheep, %d by default\n"
+	       "  -s, --snapshot  serve the snapshot of the tag, read only\n"
+	       "  -q, --queues    the number of the virtqueues, 1 by default\n"
+	       "  -P, --poll      poll the queues for the microseconds after "
+	       "the last request\n"
+	       "  -h, --help      show this help\n", progname, SD_LISTEN_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	struct vhost_dev *dev = &vdev;
+	const char *addr = "127.0.0.1";
+	char host[256], *tag = NULL, *name, *p;
+	int port = SD_LISTEN_PORT, listen_fd, ch;
+	struct sigaction sa = {
+		.sa_handler = stop_handler,
+	};
+
+	dev->nr_queues = 1;
+	while ((ch = getopt_long(argc, argv, "a:p:s:q:P:h", long_options,
+				 NULL)) >= 0) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = strtol(optarg, &p, 10);
+			if (p == optarg || *p || port < 1 ||
+			    port > UINT16_MAX) {
+				fprintf(stderr, "invalid port %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			tag = optarg;
+			break;
+		case 'q':
+			dev->nr_queues = strtol(optarg, &p, 10);
+			if (p == optarg || *p || dev->nr_queues < 1 ||
+			    dev->nr_queues > VHOST_MAX_QUEUES) {
+				fprintf(stderr, "invalid number of queues %s, "
+					"from 1 to %d\n", optarg,
+					VHOST_MAX_QUEUES);
+				exit(1);
+			}
+			break;
+		case 'P':
+			poll_ns = strtoull(optarg, &p, 10) * 1000;
+			if (p == optarg || *p) {
+				fprintf(stderr, "invalid poll time %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		exit(1);
+	}
+	name = argv[optind];
+
+	snprintf(host, sizeof(host), "%s:%d", addr, port);
+	dev->cluster = sd_connect(host);
+	if (!dev->cluster) {
+		fprintf(stderr, "failed to connect to %s\n", host);
+		exit(1);
+	}
+	dev->vdi = sd_vdi_open(dev->cluster, name, tag);
+	if (!dev->vdi) {
+		fprintf(stderr, "failed to open %s\n", name);
+		exit(1);
+	}
+	dev->capacity = sd_vdi_getsize(dev->vdi);
+	dev->readonly = vdi_is_snapshot(dev->vdi->inode);
+
+	listen_fd = listen_unix(argv[optind + 1]);
+	if (listen_fd < 0)
+		exit(1);
+
+	dev->fd = -1;
+	dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (dev->epoll_fd < 0)
+		panic("failed to create epoll, %m");
+	epoll_add(dev, listen_fd, EV_LISTEN);
+	epoll_add(dev, dev->cluster->complete_fd, EV_COMPLETE);
+	vhost_reset(dev);
+
+	/* release the lock of the vdi on the way out */
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fprintf(stderr, "serving %s on %s\n", name, argv[optind + 1]);
+	vhost_run(dev, listen_fd);
+
+	if (dev->fd >= 0)
+		disconnect(dev);
+	close(listen_fd);
+	unlink(argv[optind + 1]);
+	sd_vdi_close(dev->vdi);
+	sd_disconnect(dev->cluster);
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2016 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __VHOST_H__
+#define __VHOST_H__
+
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+
+#include "sheepdog.h"
+
+/* the messages of the vhost-user protocol we handle */
+enum vhost_user_request {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_VERSION_MASK		0x3
+#define VHOST_USER_REPLY		0x4
+#define VHOST_USER_NEED_REPLY		0x8
+
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+
+#define VHOST_USER_PROTOCOL_F_MQ	0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+#define VHOST_USER_PROTOCOL_F_CONFIG	9
+
+#define VHOST_USER_VRING_IDX_MASK	0xff
+#define VHOST_USER_VRING_NOFD		(1 << 8)
+
+#define VHOST_MAX_REGIONS	8
+#define VHOST_CONFIG_MAX_SIZE		256
+
+struct vhost_user_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	uint64_t mmap_offset;
+};
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size; /* of the payload */
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc_addr;
+			uint64_t used_addr;
+			uint64_t avail_addr;
+			uint64_t log_addr;
+		} addr;
+		struct {
+			uint32_t nr_regions;
+			uint32_t padding;
+			struct vhost_user_region regions[VHOST_MAX_REGIONS];
+		} memory;
+		struct {
+			uint32_t offset;
+			uint32_t size;
+			uint32_t flags;
+			uint8_t region[VHOST_CONFIG_MAX_SIZE];
+		} config;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE offsetof(struct vhost_user_msg, payload)
+
+/* The most segments of a request, the header and the status included */
+#define VHOST_MAX_SEGS		128
+#define VHOST_MAX_QUEUE_SIZE	1024
+#define VHOST_MAX_QUEUES	16
+
+struct vhost_mem_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	void *mmap_addr;
+	uint64_t mmap_size;
+	uint64_t mmap_offset;
+};
+
+struct vhost_dev;
+
+struct vhost_blk_req {
+	struct sd_io io;
+	struct iovec iov[VHOST_MAX_SEGS];
+	struct vhost_vq *vq;
+	uint16_t head;
+	uint8_t *status;
+	uint32_t len; /* written to the guest, the status included */
+	bool busy; /* submitted and not done */
+};
+
+/* A split virtqueue in the memory of the guest */
+struct vhost_vq {
+	struct vhost_dev *dev;
+	int index;
+	uint32_t num;
+	uint64_t desc_addr, avail_addr, used_addr; /* of the front end */
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t last_avail; /* the next avail entry to take */
+	uint16_t used_idx; /* the next used entry to fill */
+	bool used_dirty; /* used_idx is not published yet */
+	int kick_fd;
+	int call_fd;
+	bool enabled;
+	bool started;
+	uint32_t nr_inflight;
+	struct vhost_blk_req *reqs; /* indexed by the head of the chain */
+};
+
+struct vhost_dev {
+	int fd; /* the connection of the front end, -1 if none */
+	int epoll_fd;
+	uint64_t features;
+	uint64_t protocol_features;
+	struct vhost_mem_region regions[VHOST_MAX_REGIONS];
+	uint32_t nr_regions;
+	int nr_queues;
+	struct vhost_vq vqs[VHOST_MAX_QUEUES];
+
+	struct sd_cluster *cluster;
+	struct sd_vdi *vdi;
+	uint64_t capacity; /* in bytes */
+	bool readonly;
+};
+
+/* vhost.c */
+void *vhost_gpa_to_va(struct vhost_dev *dev, uint64_t gpa, uint64_t len);
+
+/* blk.c */
+uint64_t vhost_blk_features(struct vhost_dev *dev);
+size_t vhost_blk_config(struct vhost_dev *dev, void *buf);
+int vhost_vq_start(struct vhost_vq *vq);
+void vhost_vq_stop(struct vhost_vq *vq);
+bool vhost_vq_kick(struct vhost_vq *vq);
+bool vhost_blk_complete(struct vhost_dev *dev, bool wait);
+
+#endif